@@ -85,8 +85,17 @@ onion_connection_status cairo_img(void *v, onion_request *req, onion_response *r
 	}
 	cairo_stroke(cr);
 	
+	cairo_surface_flush(surface);
 	unsigned char *image=cairo_image_surface_get_data(surface);
-	int ok=onion_png_response(image, -4, width, height, res);
+	int stride=cairo_image_surface_get_stride(surface);
+	int ok=OCS_INTERNAL_ERROR;
+	onion_png *png=onion_png_begin(res, -4, width, height);
+	if (png){
+		int y;
+		for (y=0;y<height;y++) // Rows may be padded, so one by one.
+			onion_png_write_rows(png, image+y*stride, 1);
+		ok=onion_png_end(png);
+	}
 	
 	cairo_surface_destroy(surface);
 
@@ -18,12 +18,43 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <math.h>
 #include <png.h>
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
 #include <onion/log.h>
 #include <onion/onion.h>
 #include <onion/extras/png.h>
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define MANDEL_X86
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MANDEL_NEON
+#endif
+
+/// Side of the square tiles, in pixels. Tiles are rendered in parallel, and cached.
+#define TILE 64
+/// Tiles kept at the cache, 4KB each
+#define CACHE_TILES 4096
+/// Bands of tiles rendered ahead of the one being written to the PNG
+#define LOOKAHEAD 4
+/// Iterations, and the escape ^2 length
+#define STEPS 100
+/// Biggest image side
+#define MAX_SIDE 8192
+
 /// Basic complex class, to ease the fractal calculation
 class Complex{
 public:
@@ -40,51 +71,358 @@ private:
 	double i;
 };
 
+/// The pixel of n iterations.
+static unsigned char mandel_pixel(int n){
+	if (n >= STEPS) return 255;
+	return (n*256)/STEPS;
+}
+
+/**
+ * @short Renders n pixels of a row, from the complex point (x0 + j*stepX, y).
+ *
+ * The kernels do as the scalar one, with the same operations in the same order, so they give the same image.
+ */
+typedef void (*mandel_row_kernel)(unsigned char *row, int n, double x0, double stepX, double y);
+
+static void mandel_row_scalar(unsigned char *row, int n, double x0, double stepX, double y){
+	int j;
+	for (j=0;j<n;j++){
+		Complex z;
+		Complex c(x0 + stepX*j, y);
+		int k;
+		for (k=0;k<STEPS;k++){
+			z=z*z + c;
+			if (z.lenlen() > STEPS)
+				break;
+		}
+		row[j]=mandel_pixel(k);
+	}
+}
+
+#ifdef MANDEL_X86
+/// 4 pixels at a time. The lanes that escaped stop counting, and all stop when all escaped.
+__attribute__((target("avx2")))
+static void mandel_row_avx2(unsigned char *row, int n, double x0, double stepX, double y){
+	const __m256d limit=_mm256_set1_pd(STEPS);
+	const __m256d ci=_mm256_set1_pd(y);
+	int j;
+	for (j=0;j+4<=n;j+=4){
+		__m256d cr=_mm256_add_pd(_mm256_set1_pd(x0), _mm256_mul_pd(_mm256_set1_pd(stepX), _mm256_setr_pd(j, j+1, j+2, j+3)));
+		__m256d zr=_mm256_setzero_pd(), zi=_mm256_setzero_pd();
+		__m256d active=_mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+		__m256i count=_mm256_setzero_si256();
+		int k;
+		for (k=0;k<STEPS;k++){
+			__m256d r=_mm256_sub_pd(_mm256_mul_pd(zr, zr), _mm256_mul_pd(zi, zi));
+			__m256d i=_mm256_add_pd(_mm256_mul_pd(zr, zi), _mm256_mul_pd(zi, zr));
+			zr=_mm256_add_pd(r, cr);
+			zi=_mm256_add_pd(i, ci);
+			__m256d len=_mm256_add_pd(_mm256_mul_pd(zr, zr), _mm256_mul_pd(zi, zi));
+			active=_mm256_andnot_pd(_mm256_cmp_pd(len, limit, _CMP_GT_OQ), active);
+			if (_mm256_testz_pd(active, active))
+				break;
+			count=_mm256_sub_epi64(count, _mm256_castpd_si256(active)); // -1 at the active ones
+		}
+		int64_t c[4];
+		_mm256_storeu_si256((__m256i*)c, count);
+		int l;
+		for (l=0;l<4;l++)
+			row[j+l]=mandel_pixel(c[l]);
+	}
+	mandel_row_scalar(row+j, n-j, x0+stepX*j, stepX, y);
+}
+#endif
+
+#ifdef MANDEL_NEON
+/// 2 pixels at a time, as the AVX2 one.
+static void mandel_row_neon(unsigned char *row, int n, double x0, double stepX, double y){
+	const float64x2_t limit=vdupq_n_f64(STEPS);
+	const float64x2_t ci=vdupq_n_f64(y);
+	int j;
+	for (j=0;j+2<=n;j+=2){
+		const double offsets[2]={ (double)j, (double)(j+1) };
+		float64x2_t cr=vaddq_f64(vdupq_n_f64(x0), vmulq_f64(vdupq_n_f64(stepX), vld1q_f64(offsets)));
+		float64x2_t zr=vdupq_n_f64(0), zi=vdupq_n_f64(0);
+		uint64x2_t active=vdupq_n_u64(~0ull);
+		uint64x2_t count=vdupq_n_u64(0);
+		int k;
+		for (k=0;k<STEPS;k++){
+			float64x2_t r=vsubq_f64(vmulq_f64(zr, zr), vmulq_f64(zi, zi));
+			float64x2_t i=vaddq_f64(vmulq_f64(zr, zi), vmulq_f64(zi, zr));
+			zr=vaddq_f64(r, cr);
+			zi=vaddq_f64(i, ci);
+			float64x2_t len=vaddq_f64(vmulq_f64(zr, zr), vmulq_f64(zi, zi));
+			active=vbicq_u64(active, vcgtq_f64(len, limit));
+			if ((vgetq_lane_u64(active, 0) | vgetq_lane_u64(active, 1))==0)
+				break;
+			count=vsubq_u64(count, active);
+		}
+		row[j]=mandel_pixel(vgetq_lane_u64(count, 0));
+		row[j+1]=mandel_pixel(vgetq_lane_u64(count, 1));
+	}
+	mandel_row_scalar(row+j, n-j, x0+stepX*j, stepX, y);
+}
+#endif
+
+/// Picks the kernel for this CPU.
+static mandel_row_kernel mandel_row_dispatch(){
+#if defined(MANDEL_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return mandel_row_avx2;
+#elif defined(MANDEL_NEON)
+	return mandel_row_neon;
+#endif
+	return mandel_row_scalar;
+}
+
+static mandel_row_kernel mandel_row=mandel_row_dispatch();
+
+/**
+ * @short A tile of the image, at a pixel grid of the complex plane.
+ *
+ * The pixel (px, py) of a grid of steps (stepX, stepY) is at (px*stepX, py*stepY), so the images of the same
+ * steps, this is, of the same zoom and size, share the tiles whatever the pan.
+ */
+struct TileKey{
+	double stepX, stepY;
+	int64_t tx, ty;
+	bool operator==(const TileKey &o) const{
+		return stepX==o.stepX && stepY==o.stepY && tx==o.tx && ty==o.ty;
+	}
+};
+
+struct TileKeyHash{
+	size_t operator()(const TileKey &k) const{
+		uint64_t a, b;
+		memcpy(&a, &k.stepX, sizeof(a));
+		memcpy(&b, &k.stepY, sizeof(b));
+		uint64_t h=a*0x9E3779B97F4A7C15ull ^ (b+0x632BE59BD9B4E019ull+(a<<6)+(a>>2));
+		h^=(uint64_t)k.tx*0xC2B2AE3D27D4EB4Full + ((uint64_t)k.ty<<32) + (uint64_t)k.ty;
+		return h;
+	}
+};
+
+typedef std::vector<unsigned char> Tile;
+
+/// The last rendered tiles, least recently used out first.
+class TileCache{
+public:
+	std::shared_ptr<const Tile> get(const TileKey &key){
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it=index.find(key);
+		if (it==index.end())
+			return nullptr;
+		lru.splice(lru.begin(), lru, it->second);
+		return it->second->second;
+	}
+	void put(const TileKey &key, std::shared_ptr<const Tile> tile){
+		std::lock_guard<std::mutex> lock(mutex);
+		if (index.find(key)!=index.end()) // Some other request rendered it at the same time
+			return;
+		lru.emplace_front(key, tile);
+		index[key]=lru.begin();
+		if (index.size()>CACHE_TILES){
+			index.erase(lru.back().first);
+			lru.pop_back();
+		}
+	}
+private:
+	std::mutex mutex;
+	std::list<std::pair<TileKey, std::shared_ptr<const Tile>>> lru;
+	std::unordered_map<TileKey, decltype(lru)::iterator, TileKeyHash> index;
+};
+
+static TileCache tile_cache;
+
+/// Threads that render the tiles of all the requests.
+class TilePool{
+public:
+	TilePool(int nthreads){
+		int i;
+		for (i=0;i<nthreads;i++)
+			threads.emplace_back([this]{ run(); });
+	}
+	~TilePool(){
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping=true;
+		}
+		ready.notify_all();
+		for (auto &t: threads)
+			t.join();
+	}
+	void push(std::function<void()> job){
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			jobs.push_back(std::move(job));
+		}
+		ready.notify_one();
+	}
+private:
+	void run(){
+		for (;;){
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				ready.wait(lock, [this]{ return stopping || !jobs.empty(); });
+				if (jobs.empty())
+					return;
+				job=std::move(jobs.front());
+				jobs.pop_front();
+			}
+			job();
+		}
+	}
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::deque<std::function<void()>> jobs;
+	std::vector<std::thread> threads;
+	bool stopping=false;
+};
+
+static TilePool *tile_pool=NULL;
+
+/// Returns the tile from the cache, or renders it and keeps it there.
+static std::shared_ptr<const Tile> mandel_tile(const TileKey &key){
+	std::shared_ptr<const Tile> tile=tile_cache.get(key);
+	if (tile)
+		return tile;
+	auto rendered=std::make_shared<Tile>(TILE*TILE);
+	int i;
+	for (i=0;i<TILE;i++)
+		mandel_row(&(*rendered)[i*TILE], TILE, key.stepX*(key.tx*TILE), key.stepX, key.stepY*(key.ty*TILE+i));
+	tile_cache.put(key, rendered);
+	return rendered;
+}
+
+/// Floor of a/TILE, also for negative a.
+static int64_t tile_of(int64_t a){
+	return a>=0 ? a/TILE : -((-a+TILE-1)/TILE);
+}
+
+/**
+ * @short The tiles of a request, rendered by bands of a tile height, written to the PNG in order.
+ *
+ * Each band is a TILE rows buffer of the image width, that its tiles fill as they are ready. The request
+ * thread writes the rows of the first band as soon as all its tiles are done, while the next bands render.
+ */
+class MandelRender{
+public:
+	MandelRender(int _width, int _height, int64_t _px0, int64_t _py0, double _stepX, double _stepY) :
+		width(_width), height(_height), px0(_px0), py0(_py0), stepX(_stepX), stepY(_stepY){
+		tx0=tile_of(px0);
+		tx1=tile_of(px0+width-1);
+		ty0=tile_of(py0);
+		ty1=tile_of(py0+height-1);
+		int i;
+		for (i=0;i<LOOKAHEAD;i++){
+			bands[i].rows.resize((size_t)width*TILE);
+			bands[i].pending=0;
+		}
+	}
+	int nbands() const{ return ty1-ty0+1; }
+	/// Queues the tiles of the band
+	void start(int band){
+		Band &b=bands[band%LOOKAHEAD];
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			b.pending=tx1-tx0+1;
+		}
+		int64_t tx;
+		for (tx=tx0;tx<=tx1;tx++)
+			tile_pool->push([this, band, tx]{ render(band, tx); });
+	}
+	/// Waits for the band, and returns its first row and how many rows of the image it has.
+	const unsigned char *wait(int band, int *nrows){
+		Band &b=bands[band%LOOKAHEAD];
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&b]{ return b.pending==0; });
+		int64_t first=(ty0+band)*TILE, last=first+TILE; // Rows of the band at the grid
+		int64_t from=first<py0 ? py0 : first, to=last>py0+height ? py0+height : last;
+		*nrows=to-from;
+		return &b.rows[(size_t)(from-first)*width];
+	}
+	/// Waits for the bands that are still rendering, as they write here.
+	void wait_all(int from, int to){
+		int band, nrows;
+		for (band=from;band<to;band++)
+			wait(band, &nrows);
+	}
+private:
+	struct Band{
+		std::vector<unsigned char> rows;
+		int pending;
+	};
+	void render(int band, int64_t tx){
+		TileKey key={ stepX, stepY, tx, ty0+band };
+		std::shared_ptr<const Tile> tile=mandel_tile(key);
+		Band &b=bands[band%LOOKAHEAD];
+		int64_t left=tx*TILE, from=left<px0 ? px0 : left, to=left+TILE>px0+width ? px0+width : left+TILE;
+		int i;
+		for (i=0;i<TILE;i++)
+			memcpy(&b.rows[(size_t)i*width+(from-px0)], &(*tile)[i*TILE+(from-left)], to-from);
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--b.pending==0)
+			done.notify_all();
+	}
+	int width, height;
+	int64_t px0, py0;
+	double stepX, stepY;
+	int64_t tx0, tx1, ty0, ty1;
+	Band bands[LOOKAHEAD];
+	std::mutex mutex;
+	std::condition_variable done;
+};
+
 /**
  * @short Calculates the given mandelbrot, and returns the PNG image
- * 
+ *
  * It can receive several query parameters, but all are optional:
- * 
+ *
  * * X, Y -- Top left complex area position
  * * W, H -- Width and Height of the complex area to show
  * * width, height -- Image size
+ *
+ * The image is at the pixel grid of its steps, so X and Y are rounded to the nearest pixel, and its tiles
+ * are rendered in parallel, or reused from earlier pans. Each band of rows goes to the PNG as it is ready.
  */
 int mandelbrot(void *p, onion_request *req, onion_response *res){
 	int width=atoi(onion_request_get_queryd(req,"width","256"));
 	int height=atoi(onion_request_get_queryd(req,"height","256"));
-	
-	unsigned char *image=new unsigned char[width*height];
-  int    i,j,n;
+	if (width<=0 || height<=0 || width>MAX_SIDE || height>MAX_SIDE)
+		return OCS_INTERNAL_ERROR;
 
 	double left=atof(onion_request_get_queryd(req,"X","-2"));
 	double top=atof(onion_request_get_queryd(req,"Y","-2"));
-	double right=left + atof(onion_request_get_queryd(req,"W","4"));
-	double bottom=top + atof(onion_request_get_queryd(req,"H","4"));
-	
-  double stepX = (right-left)/width;
-  double stepY = (bottom-top)/height;
-	int steps=100;
-	unsigned char *imagep=image;
-	
-  for (i = 0; i < height; i++) {
-    for (j = 0; j < width; j++) {
-			Complex z;
-			Complex c(stepX*j + left, stepY*i + top);
-      for (n=0;n<steps;n++){
-				z=z*z + c;
-				if (z.lenlen() > steps)
-					break;
-			}
-			char P;
-			if (n >= steps) P=255;
-			else P=(n*256)/steps;
-			*imagep++=P;
-    }
-  }
-	
-	onion_png_response(image, 1, width, height, res);
-	delete image;
-	return OCS_PROCESSED;
+	double stepX=atof(onion_request_get_queryd(req,"W","4"))/width;
+	double stepY=atof(onion_request_get_queryd(req,"H","4"))/height;
+	if (!(stepX>0) || !(stepY>0) || !isfinite(left/stepX) || !isfinite(top/stepY) ||
+			fabs(left/stepX)>1e15 || fabs(top/stepY)>1e15)
+		return OCS_INTERNAL_ERROR;
+
+	onion_png *png=onion_png_begin(res, 1, width, height);
+	if (!png)
+		return OCS_INTERNAL_ERROR;
+	onion_png_set_compression(png, 1, ONION_PNG_FILTER_DEFAULT); // Generated on each request, speed matters more than size
+	onion_png_set_threads(png, 2); // Deflates a band while the next rows are written
+
+	MandelRender render(width, height, llround(left/stepX), llround(top/stepY), stepX, stepY);
+	int nbands=render.nbands();
+	int band, started=0;
+	for (;started<nbands && started<LOOKAHEAD;started++)
+		render.start(started);
+	for (band=0;band<nbands;band++){
+		int nrows;
+		const unsigned char *rows=render.wait(band, &nrows);
+		if (onion_png_write_rows(png, rows, nrows)<0) // Each band is sent as it is ready
+			break;
+		if (started<nbands) // Its buffer is free now
+			render.start(started++);
+	}
+	render.wait_all(band, started);
+
+	return onion_png_end(png);
 }
 
 // This has to be extern, as we are compiling C++
@@ -93,16 +431,23 @@ int mandel_html_template(void *, onion_request *req, onion_response *res);
 }
 
 int main(int argc, char **argv){
-	onion *o=onion_new(O_THREADED);
-	
+	int ncpus=std::thread::hardware_concurrency();
+	if (ncpus<1)
+		ncpus=1;
+	tile_pool=new TilePool(ncpus);
+
+	onion *o=onion_new(O_POOL);
+	onion_set_workers(o, 4, 64); // The handlers wait for the tiles out of the poller threads
+
 	onion_url *url=onion_root_url(o);
-	
+
 	onion_set_hostname(o, "0.0.0.0"); // Force ipv4.
-	
+
 	onion_url_add(url, "mandel.png", (void*)mandelbrot);
 	onion_url_add(url, "", (void*)mandel_html_template);
-	
+
 	onion_listen(o);
 	onion_free(o);
+	delete tile_pool;
 	return 0;
 }
@@ -24,9 +24,9 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <assert.h>
 #include <pty.h>
-#include <poll.h>
 #include <pthread.h>
 
 #include <onion/request.h>
@@ -46,22 +46,30 @@
 #include "oterm_handler.h"
 #include <onion/onion.h>
 #include <onion/poller.h>
-
-/// Time to wait for output, or just return.
-#define TIMEOUT 60000
+#include <onion/sse.h>
 
 /// Max data to store. This is, more or less a window of 230*70, which is not so extrange
 #define BUFFER_SIZE 4096*4 
 
+/// Output events kept to replay to viewers that reconnect
+#define HISTORY 256
+
+/// Output events queued to a slow viewer before it is disconnected, to reconnect and replay them
+#define VIEWER_QUEUE 1024
+
+/// Max input waiting for the process to read it
+#define INPUT_SIZE 64*1024
+
 /**
  * @short Information about a process
  * 
  * The process has a circular buffer. The pos is mod with BUFFER_SIZE. 
  * 
- * First time clients just ask data, and as a custom control command we send the latest position.
+ * The pty is read at the onion poller as it has data, which is stored at the buffer and published to the
+ * viewers, the event streams of /out. No thread waits for it. New viewers get all the buffer first, and
+ * those that reconnect get the events they missed from the history of the group, by their id.
  * 
- * Then on next request the client sets that want from that position onwards. If data avaliable,
- * it is sent, if not, then the first blocks on the fd, and the followings on a pthread_condition.
+ * Input is written to the pty without waiting; what it does not take yet is kept and written as it reads.
  */
 typedef struct process_t{
 	int fd;										///< fd that serves as communication channel with the pty.
@@ -69,7 +77,11 @@ typedef struct process_t{
 	char *title;							///< Title of the process, normally from path, but is set using xterm commands
 	char *buffer;							///< Circular buffer, keeps las BUFFER_SIZE characters emmited
 	int16_t buffer_pos;				///< Position on the circular buffer, 0-BUFFER_SIZE
-	pthread_cond_t dataReady; ///< All but one will wait on the condition
+	uint64_t last_id;         ///< Id of the last output event
+	char finished;            ///< The pty was closed, the process is gone
+	onion_sse_group *viewers; ///< Event streams that get the output
+	char *input;              ///< Input that the pty did not take yet
+	size_t input_length;
 	pthread_mutex_t mutex; 		///< Mutex for this process, as several threads can access it.
 	char uuid[37];            ///< UUID for this process. May be used to access it.
 	struct process_t *next;
@@ -250,8 +262,13 @@ process *oterm_new(oterm_data *data, oterm_session *session, const char *usernam
   
 	oterm->buffer=calloc(1, BUFFER_SIZE);
 	oterm->buffer_pos=0;
+	oterm->last_id=0;
+	oterm->finished=0;
+	oterm->viewers=onion_sse_group_new(OSSE_GROUP_DISCONNECT, VIEWER_QUEUE);
+	onion_sse_group_set_history(oterm->viewers, HISTORY);
+	oterm->input=NULL;
+	oterm->input_length=0;
 	pthread_mutex_init(&oterm->mutex, NULL);
-	pthread_cond_init(&oterm->dataReady, NULL);
 	
 	ONION_DEBUG("Creating new terminal, exec %s (%s)", data->exec_command, command_name);
 	
@@ -302,6 +319,7 @@ process *oterm_new(oterm_data *data, oterm_session *session, const char *usernam
 		perror("");
 		exit(1);
 	}
+	fcntl(oterm->fd, F_SETFL, fcntl(oterm->fd, F_GETFL) | O_NONBLOCK); // Never wait for the process
 	oterm->title=strdup(data->exec_command);
 	ONION_DEBUG("Default title is %s", oterm->title);
 	oterm->next=NULL;
@@ -362,19 +380,46 @@ int oterm_status(oterm_session *session, onion_request *req, onion_response *res
 	return onion_shortcut_response_json(status, req, res);
 }
 
-/// Input data to the process
+/// Writes the pending input, as much as the pty takes now. With the process locked.
+static int oterm_input_flush(process *p){
+	while (p->input_length){
+		ssize_t w=write(p->fd, p->input, p->input_length);
+		if (w<0 && errno==EINTR)
+			continue;
+		if (w<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+			return 0;
+		if (w<=0)
+			return -1;
+		memmove(p->input, p->input+w, p->input_length-w);
+		p->input_length-=w;
+	}
+	return 0;
+}
+
+/// Input data to the process. If it does not read it yet, it waits at the process, not at the thread.
 int oterm_in(process *p, onion_request *req, onion_response *res){
 	oterm_check_running(p);
 
 	const char *data;
 	data=onion_request_get_post(req,"type");
-	ssize_t w;
 	if (data){
-		//fprintf(stderr,"%s:%d write %ld bytes\n",__FILE__,__LINE__,strlen(data));
 		size_t r=strlen(data);
-		w=write(p->fd, data, r);
-		if (w!=r){
-			ONION_WARNING("Error writing data to process. Not all data written. (%d).",w);
+		pthread_mutex_lock(&p->mutex);
+		if (p->input_length+r>INPUT_SIZE){
+			pthread_mutex_unlock(&p->mutex);
+			ONION_WARNING("Process does not read its input, %d bytes waiting.", (int)p->input_length);
+			return onion_shortcut_response("Busy", HTTP_SERVICE_UNAVALIABLE, req, res);
+		}
+		char *input=realloc(p->input, p->input_length+r);
+		if (input){
+			p->input=input;
+			memcpy(&p->input[p->input_length], data, r);
+			p->input_length+=r;
+		}
+		int error=!input || oterm_input_flush(p)<0;
+		pthread_mutex_unlock(&p->mutex);
+		if (error){
+			ONION_WARNING("Error writing data to process.");
 			return onion_shortcut_response("Error", HTTP_INTERNAL_ERROR, req, res);
 		}
 	}
@@ -417,49 +462,98 @@ int oterm_title(process *p, onion_request* req, onion_response *res){
 	return onion_shortcut_response("OK", HTTP_OK, req, res);
 }
 
-/// Gets the output data
+/**
+ * @short Encodes the output for an event, so its line ends arrive as they are, and not as data fields.
+ * 
+ * \r, \n, \0 and % are written as %0D, %0A, %00 and %25.
+ */
+static char *oterm_encode(const char *data, size_t length, size_t *encoded_length){
+	char *ret=malloc(length*3+1);
+	size_t i, j=0;
+	for (i=0;i<length;i++){
+		char c=data[i];
+		if (c=='\r' || c=='\n' || c=='\0' || c=='%'){
+			sprintf(&ret[j], "%%%02X", (unsigned char)c);
+			j+=3;
+		}
+		else
+			ret[j++]=c;
+	}
+	ret[j]=0;
+	*encoded_length=j;
+	return ret;
+}
+
+/// Sends the output to a stream, or to all the viewers if sse is NULL. With the process locked.
+static void oterm_send(process *o, onion_sse *sse, const char *event, const char *data, size_t length){
+	char id[24];
+	snprintf(id, sizeof(id), "%llu", (unsigned long long)o->last_id);
+	size_t encoded_length;
+	char *encoded=oterm_encode(data, length, &encoded_length);
+	if (sse)
+		onion_sse_send(sse, id, event, encoded, encoded_length);
+	else
+		onion_sse_group_publish(o->viewers, id, event, encoded, encoded_length);
+	free(encoded);
+}
+
+/**
+ * @short Streams the output, as Server-Sent Events.
+ * 
+ * A new viewer gets all the buffer first, and one that reconnects the events it missed, if at the history.
+ * Then it gets the output as it comes, with all the other viewers of the process.
+ */
 int oterm_out(process *o, onion_request *req, onion_response *res){
+	onion_sse *sse=onion_sse_new(req, res);
+	if (!sse)
+		return OCS_INTERNAL_ERROR;
+	
 	pthread_mutex_lock(&o->mutex);
-	if (onion_request_get_query(req, "initial")){
+	const char *last_event_id=onion_sse_get_last_event_id(sse);
+	uint64_t last_id=last_event_id ? strtoull(last_event_id, NULL, 10) : 0;
+	if (!last_event_id || last_id>o->last_id || o->last_id-last_id>HISTORY){
+		char *initial=malloc(BUFFER_SIZE+128);
+		size_t length=0;
 		if (o->buffer[BUFFER_SIZE-1]!=0){ // If 0 then never wrote on it. So if not, write from pos to end too, first.
-			onion_response_write(res, &o->buffer[o->buffer_pos], BUFFER_SIZE-o->buffer_pos);
+			memcpy(initial, &o->buffer[o->buffer_pos], BUFFER_SIZE-o->buffer_pos);
+			length=BUFFER_SIZE-o->buffer_pos;
 		}
-		onion_response_write(res, o->buffer, o->buffer_pos);
-		onion_response_printf(res, "\033]oterm;%d;", o->buffer_pos);
-    onion_response_printf(res, "\033]url;https://localhost:8080/uuid/%s/;", o->uuid);
-		pthread_mutex_unlock(&o->mutex);
-		return OCS_PROCESSED;
+		memcpy(&initial[length], o->buffer, o->buffer_pos);
+		length+=o->buffer_pos;
+		length+=snprintf(&initial[length], 128, "\033]url;https://localhost:8080/uuid/%s/;", o->uuid);
+		oterm_send(o, sse, "initial", initial, length);
+		free(initial);
 	}
-	
-	int16_t p=atoi(onion_request_get_queryd(req, "pos", "0")); //o->buffer_pos;
-	ONION_DEBUG("Wait for data at %d", p);
-	while(p==o->buffer_pos) // We need it to be diferent, if not does not make sense to wake up
-		pthread_cond_wait(&o->dataReady, &o->mutex);
-	ONION_DEBUG("Data ready at %d (waiting from %d)", o->buffer_pos, p);
-	if (o->buffer_pos<p){
-		onion_response_write(res, &o->buffer[p], BUFFER_SIZE-p);
-		p=0;
+	int replayed=onion_sse_group_subscribe(o->viewers, sse);
+	if (o->finished){ // The history ends with the exit, if it was replayed
+		if (replayed<=0)
+			oterm_send(o, sse, "exit", "", 0);
+		onion_sse_close(sse);
 	}
-	onion_response_write(res, &o->buffer[p], o->buffer_pos-p);
-	onion_response_printf(res, "\033]oterm;%d;", o->buffer_pos);
 	pthread_mutex_unlock(&o->mutex);
-	return OCS_PROCESSED;
+	return OCS_SUSPENDED;
 }
 
 /**
  * @short The onion main poller has some data ready.
  * 
+ * It is stored at the buffer and published to the viewers. When the process is gone, they get an exit
+ * event, and the pty is not polled anymore.
  */
 static int oterm_data_ready(process *o){
-	// read data, if any. Else return inmediately empty.
 	char buffer[4096];
-	int n=0; // -O2 complains of maybe used uninitialized
-	
-	n=read(o->fd, buffer, sizeof(buffer));
-	if (n<0)
-		return n;
+	ssize_t n=read(o->fd, buffer, sizeof(buffer));
+	if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR))
+		return 0;
 	
 	pthread_mutex_lock(&o->mutex);
+	if (n<=0){ // EIO as the process exits
+		o->finished=1;
+		o->last_id++;
+		oterm_send(o, NULL, "exit", "", 0);
+		pthread_mutex_unlock(&o->mutex);
+		return -1;
+	}
 	// Store on buffer
 	const char *data=buffer;
 	int sd=n;
@@ -477,8 +571,10 @@ static int oterm_data_ready(process *o){
 	memcpy(&o->buffer[o->buffer_pos], data, sd);
 	o->buffer_pos+=sd;
 	
+	o->last_id++;
+	oterm_send(o, NULL, NULL, buffer, n);
+	oterm_input_flush(o); // It reads, so it may take the rest of the input
 	pthread_mutex_unlock(&o->mutex);
-	pthread_cond_broadcast(&o->dataReady);
 	
 	return 0;
 }
@@ -490,7 +586,9 @@ void oterm_session_free(oterm_session *o){
 	while (p){
 		kill(p->pid, SIGTERM);
 		close(p->fd);
+		onion_sse_group_free(p->viewers);
 		free(p->buffer);
+		free(p->input);
 		t=p;
 		p=p->next;
 		free(t);
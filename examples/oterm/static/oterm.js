@@ -218,39 +218,49 @@ addText = function(text, length){
 
 cacheSendKeys=''
 onpetitionIn=false // no two petitions at the same time.
-onpetitionOut=false // no two petitions at the same time.
 readDataPos=0
+output=null
 
 /**
- * @short Request new data, and do the timeout for next petition
+ * @short Sends the keys
  *
- * Data send is serialized: only one for each direction (in/out) petition can be on the air. If a new petition is done, then 
- * it must wait until the reponse of latest arrives, and then make a new one. This helps a lot the interactivity, and solves
- * serialization problems.
+ * Data send is serialized: only one petition can be on the air. If a new petition is done, then it must wait until the 
+ * reponse of latest arrives, and then make a new one. This helps a lot the interactivity, and solves serialization problems.
+ * If the server is busy as the program does not read, they are sent again later.
  */
 requestNewData = function(keyvalue){
 	if (keyvalue)
 		cacheSendKeys+=keyvalue
 	if (!onpetitionIn && cacheSendKeys){
+		var keys=cacheSendKeys
 		onpetitionIn=true
-		$.post('in',{type:cacheSendKeys}, function(){ onpetitionIn=false; requestNewData(); })
 		cacheSendKeys=''
-	}
-	if (!onpetitionOut){
-		onpetitionOut=true
-		$.get('out',{pos:readDataPos},updateRequestData,'plain')
+		$.ajax({type:'POST', url:'in', data:{type:keys}, 
+			success:function(){ onpetitionIn=false; requestNewData(); },
+			error:function(xhr){
+				if (xhr.status!=503)
+					return
+				cacheSendKeys=keys+cacheSendKeys
+				setTimeout(function(){ onpetitionIn=false; requestNewData(); }, 500)
+			}
+		})
 	}
 }
 
-/// Sets the result of data load, and set a new petition for later.
-updateRequestData = function(text){
-	updateData(text)
-	
-	onpetitionOut=false
-	if (text!="")
-		requestNewData()
-	else
-		showMsg("Program exited.");
+/// Decodes the output of an event: the line ends and % come as %0D, %0A, %00 and %25.
+decodeOutput = function(text){
+	return text.replace(/%(0D|0A|00|25)/g, function(m, code){ return String.fromCharCode(parseInt(code, 16)) })
+}
+
+/// Receives the output as it comes, as server sent events. On reconnect the server sends what was missed.
+startOutput = function(){
+	output=new EventSource('out')
+	output.onmessage=function(ev){ updateData(decodeOutput(ev.data)) }
+	output.addEventListener('initial', function(ev){ updateData(decodeOutput(ev.data)) })
+	output.addEventListener('exit', function(){
+		output.close()
+		showMsg("Program exited.")
+	})
 }
 
 
@@ -298,9 +308,8 @@ $(document).ready(function(){
 	$('#term').html('')
 	newLine()
 	
-	// Ask for stored buffer data
-	onpetitionOut=true
-	$.get('out?initial',updateRequestData, 'plain')
+	// Stored buffer data first, and then the output as it comes
+	startOutput()
 	
 	$('#msg').fadeOut().html('')
 	showMsg('Ready')
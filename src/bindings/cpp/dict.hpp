@@ -31,9 +31,37 @@
 #include <onion/dict.h>
 #include <onion/log.h>
 #include <onion/block.h>
+#include "response.hpp"
 #include <map>
+#include <string.h>
+#if __cplusplus >= 201703L
+#include <string_view>
+#include <optional>
+#endif
 
 namespace Onion{
+#if __cplusplus >= 201703L
+	/// Calls f with k as a C string, copied at the stack if short, so there is no allocation.
+	template<typename F>
+	auto with_c_str(std::string_view k, F &&f){
+		char tmp[256];
+		if (k.size()<sizeof(tmp)){
+			memcpy(tmp, k.data(), k.size());
+			tmp[k.size()]='\0';
+			return f((const char*)tmp);
+		}
+		std::string s(k);
+		return f(s.c_str());
+	}
+	
+	/// The C string as an optional view: empty if NULL.
+	inline std::optional<std::string_view> optional_view(const char *s){
+		if (!s)
+			return std::nullopt;
+		return std::string_view(s);
+	}
+#endif
+
 	class Dict{
 		onion_dict *ptr;
 	public:
@@ -66,17 +94,27 @@ namespace Onion{
 			onion_dict_dup(ptr);
 // 			ONION_DEBUG0("Dict %p:%p", this, ptr);
 		}
+#if __cplusplus >= 201103L
+		/// Takes the reference of d, with no refcount change. d can only be assigned or destroyed after.
+		Dict(Dict &&d) noexcept : ptr(d.ptr){
+			d.ptr=NULL;
+		}
+#endif
 		
     ~Dict(){
 // 			ONION_DEBUG0("~Dict %p:%p", this, ptr);
-			onion_dict_free(ptr);
+			if (ptr)
+				onion_dict_free(ptr);
 		}
     
 		std::string operator[](const std::string &k) const{
-			const char *ret=onion_dict_get(ptr, k.c_str());
+			return (*this)[k.c_str()];
+		}
+		std::string operator[](const char *k) const{
+			const char *ret=onion_dict_get(ptr, k);
 			if (!ret)
 				throw(key_not_found(k));
-			return onion_dict_get(ptr, k.c_str());
+			return ret;
 		}
 		
 		Dict &operator=(const Dict &o){
@@ -88,6 +126,16 @@ namespace Onion{
 			return *this;
 		}
 
+#if __cplusplus >= 201103L
+		/// Swaps with o, so the old one is freed when o is.
+		Dict &operator=(Dict &&o) noexcept{
+			onion_dict *ptr2=ptr;
+			ptr=o.ptr;
+			o.ptr=ptr2;
+			return *this;
+		}
+#endif
+
 		Dict &operator=(const onion_dict *o){
 // 			ONION_DEBUG0("%p = %p (~%p)", this, o, ptr);
 			onion_dict *ptr2=ptr;
@@ -103,6 +151,9 @@ namespace Onion{
 		bool has(const std::string &k) const{
 			return onion_dict_get(ptr, k.c_str())!=NULL;
 		}
+		bool has(const char *k) const{
+			return onion_dict_get(ptr, k)!=NULL;
+		}
 		
 		Dict getDict(const std::string &k) const{
 			return Dict(onion_dict_get_dict(ptr, k.c_str()));
@@ -115,6 +166,23 @@ namespace Onion{
 			return r;
 		}
 		
+		/// The C string value, owned by the dict, or NULL. No copies.
+		const char *get_c_str(const char *k) const{
+			return onion_dict_get(ptr, k);
+		}
+		
+#if __cplusplus >= 201703L
+		/// The value, a view of the string at the dict, with one lookup and no allocation. Empty if not there.
+		std::optional<std::string_view> find(std::string_view k) const{
+			return with_c_str(k, [this](const char *key){ return optional_view(onion_dict_get(ptr, key)); });
+		}
+		
+		/// The value as a view, or def if not there. Valid while the value is at the dict.
+		std::string_view view(std::string_view k, std::string_view def=std::string_view()) const{
+			return find(k).value_or(def);
+		}
+#endif
+		
 		void add(const char *k, const char *v){
 			onion_dict_add(ptr, k, v, 0);
 		}
@@ -160,9 +228,68 @@ namespace Onion{
 			return str;
 		}
 		
+		/// Writes the json straight to the response, without building it in memory. Returns the bytes written, or -1.
+		ssize_t writeJSON(Response &res) const{
+			return onion_dict_write_json(ptr, res.c_handler());
+		}
+		
+		size_t JSONLength() const{
+			return onion_dict_json_length(ptr);
+		}
+		
 		onion_dict *c_handler(){
 			return ptr;
 		}
+		
+		/**
+		 * @short Iterates the elements, as onion_dict_iter, without callbacks: for (auto &e: dict) use(e.key(), e.value());
+		 * 
+		 * Only comparisons with end() are meaningful.
+		 */
+		class const_iterator{
+			onion_dict_iter it;
+			bool valid;
+		public:
+			const_iterator() : valid(false){}
+			explicit const_iterator(const onion_dict *d){
+				valid=onion_dict_iter_begin(d, &it);
+			}
+			
+			const_iterator &operator++(){
+				valid=onion_dict_iter_next(&it);
+				return *this;
+			}
+			bool operator==(const const_iterator &o) const{
+				return valid==o.valid;
+			}
+			bool operator!=(const const_iterator &o) const{
+				return valid!=o.valid;
+			}
+			const const_iterator &operator*() const{
+				return *this;
+			}
+			
+			const char *key() const{
+				return it.key;
+			}
+			/// The string value, or NULL if it is a dict
+			const char *value() const{
+				return (it.flags&OD_DICT) ? NULL : (const char*)it.value;
+			}
+			bool isDict() const{
+				return (it.flags&OD_DICT)!=0;
+			}
+			Dict dict() const{
+				return Dict((const onion_dict*)it.value);
+			}
+		};
+		
+		const_iterator begin() const{
+			return const_iterator(ptr);
+		}
+		const_iterator end() const{
+			return const_iterator();
+		}
 	};
 }
 
@@ -0,0 +1,147 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_PARAMS_HPP
+#define ONION_PARAMS_HPP
+
+#include <charconv>
+#include <cstdlib>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+namespace Onion{
+  /**
+   * @short Parses the whole string as a value of that type, with no allocation nor exceptions. false if malformed.
+   *
+   * Integers and floating point numbers use std::from_chars, bool takes 1/true/on/yes and 0/false/off/no,
+   * std::string_view is the string itself, and std::optional<T> gets a T.
+   */
+  template<class T>
+  bool parse_value(std::string_view s, T &v){
+    if constexpr (std::is_same<T, bool>::value){
+      if (s=="1" || s=="true" || s=="on" || s=="yes")
+        v=true;
+      else if (s=="0" || s=="false" || s=="off" || s=="no")
+        v=false;
+      else
+        return false;
+      return true;
+    }
+    else if constexpr (std::is_integral<T>::value){
+      auto r=std::from_chars(s.data(), s.data()+s.size(), v);
+      return r.ec==std::errc() && r.ptr==s.data()+s.size();
+    }
+    else if constexpr (std::is_floating_point<T>::value){
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+      auto r=std::from_chars(s.data(), s.data()+s.size(), v);
+      return r.ec==std::errc() && r.ptr==s.data()+s.size();
+#else
+      char tmp[64];
+      if (s.empty() || s.size()>=sizeof(tmp))
+        return false;
+      s.copy(tmp, s.size());
+      tmp[s.size()]='\0';
+      char *end;
+      v=strtod(tmp, &end);
+      return end==tmp+s.size();
+#endif
+    }
+    else if constexpr (std::is_same<T, std::string_view>::value){
+      v=s;
+      return true;
+    }
+    else if constexpr (std::is_same<T, std::string>::value){
+      v.assign(s.data(), s.size());
+      return true;
+    }
+    else{
+      typename T::value_type r;
+      if (!parse_value(s, r))
+        return false;
+      v=std::move(r);
+      return true;
+    }
+  }
+
+  /// A field of a parameter schema: the parameter name and where it goes at the struct.
+  template<class S, class T>
+  struct Param{
+    const char *name;
+    T S::*member;
+  };
+
+  /// A field of a parameter schema, as Onion::param("limit", &Page::limit)
+  template<class S, class T>
+  constexpr Param<S, T> param(const char *name, T S::*member){
+    return Param<S, T>{name, member};
+  }
+
+  /**
+   * @short A parameter schema, to parse all the parameters of a request into a struct
+   *
+   * @code
+   *   struct Page{ int64_t limit=20; int64_t offset=0; std::optional<std::string_view> q; };
+   *   static constexpr auto page_params=Onion::params(Onion::param("limit", &Page::limit),
+   *                                                   Onion::param("offset", &Page::offset),
+   *                                                   Onion::param("q", &Page::q));
+   *   Page page;
+   *   if (const char *bad=req.parseQuery(page_params, page))
+   *     ... bad is the name of the malformed parameter
+   * @endcode
+   *
+   * Each field is one lookup with its name as is, and the missing ones keep their value. Views point to the
+   * request, and are valid while it is.
+   */
+  template<class... P>
+  struct Params{
+    std::tuple<P...> fields;
+
+    /// Parses each field with get(name), that returns the value as a const char * or NULL. Returns the name of the first malformed one, or NULL.
+    template<class S, class G>
+    const char *parse(S &s, G &&get) const{
+      return std::apply([&s, &get](const auto &... field){
+        const char *bad=nullptr;
+        (void)((parse_field(field, s, get) ? true : (bad=field.name, false)) && ...);
+        return bad;
+      }, fields);
+    }
+  private:
+    template<class S, class T, class G>
+    static bool parse_field(const Param<S, T> &field, S &s, G &get){
+      const char *v=get(field.name);
+      return !v || parse_value(std::string_view(v), s.*field.member);
+    }
+  };
+
+  template<class... P>
+  constexpr Params<P...> params(P... fields){
+    return Params<P...>{std::tuple<P...>(fields...)};
+  }
+}
+
+#endif
@@ -30,6 +30,9 @@
 
 #include <string>
 #include <onion/request.h>
+#if __cplusplus >= 201703L
+#include "params.hpp"
+#endif
 
 namespace Onion{
   
@@ -39,8 +42,57 @@ namespace Onion{
     Request(onion_request *_ptr) : ptr(_ptr){}
     
     std::string operator[](const std::string &h){
-      return headers()[h];
+      const char *r=onion_request_get_header(ptr, h.c_str());
+      if (!r)
+        throw(Dict::key_not_found(h));
+      return r;
+    }
+#if __cplusplus >= 201703L
+    /// @{ @name Views of the strings at the request, with one lookup and no allocation. Empty if not there.
+    std::optional<std::string_view> header(std::string_view k) const{
+      return with_c_str(k, [this](const char *key){ return optional_view(onion_request_get_header(ptr, key)); });
+    }
+    std::optional<std::string_view> query(std::string_view k) const{
+      return with_c_str(k, [this](const char *key){ return optional_view(onion_request_get_query(ptr, key)); });
+    }
+    std::optional<std::string_view> post(std::string_view k) const{
+      return with_c_str(k, [this](const char *key){ return optional_view(onion_request_get_post(ptr, key)); });
+    }
+    std::optional<std::string_view> cookie(std::string_view k) const{
+      return with_c_str(k, [this](const char *key){ return optional_view(onion_request_get_cookie(ptr, key)); });
+    }
+    /// @}
+
+    /// @{ @name Typed parameters, parsed from the views with Onion::parse_value: req.query<int64_t>("limit", 20). Empty, or the default, if missing or malformed.
+    template<class T>
+    std::optional<T> query(std::string_view k) const{
+      return parsed<T>(query(k));
+    }
+    template<class T>
+    T query(std::string_view k, T def) const{
+      return parsed<T>(query(k)).value_or(def);
     }
+    template<class T>
+    std::optional<T> post(std::string_view k) const{
+      return parsed<T>(post(k));
+    }
+    template<class T>
+    T post(std::string_view k, T def) const{
+      return parsed<T>(post(k)).value_or(def);
+    }
+    /// @}
+
+    /// @{ @name Parses the parameters of a Onion::Params schema into s. Returns the name of the first malformed one, or NULL.
+    template<class S, class... P>
+    const char *parseQuery(const Params<P...> &schema, S &s) const{
+      return schema.parse(s, [this](const char *key){ return onion_request_get_query(ptr, key); });
+    }
+    template<class S, class... P>
+    const char *parsePost(const Params<P...> &schema, S &s) const{
+      return schema.parse(s, [this](const char *key){ return onion_request_get_post(ptr, key); });
+    }
+    /// @}
+#endif
     
     const Dict headers() const{
       return Dict(onion_request_get_header_dict(ptr));
@@ -78,6 +130,16 @@ namespace Onion{
 		onion_request *c_handler(){
 			return ptr;
 		}
+#if __cplusplus >= 201703L
+  private:
+    template<class T>
+    static std::optional<T> parsed(std::optional<std::string_view> v){
+      T r;
+      if (v && parse_value(*v, r))
+        return r;
+      return std::nullopt;
+    }
+#endif
   };
 }
 
@@ -29,32 +29,139 @@
 #include <onion/log.h>
 #include <onion/response.h>
 #include <ostream>
+#include <iterator>
+#include <string>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#if __cplusplus >= 202002L
+#include <version>
+#ifdef __cpp_lib_format
+#include <format>
+#include <utility>
+#endif
+#endif
 
 namespace Onion{
   class Response : public std::ostream {
+    /**
+     * @short Keeps the stream output, and writes it to the onion_response in bulk.
+     *
+     * Characters and short writes are a copy to the put area; it goes to onion_response_write when
+     * full, on sync (std::flush), before any direct write or access to the onion_response, and at
+     * destruction. Writes bigger than the put area go straight to the response.
+     */
     class ResponseBuf : public std::streambuf{
-      Response *res;
     public:
-      ResponseBuf(Response *_res) : res(_res){
+      static const size_t buffer_size=1024;
+    private:
+      onion_response *ptr;
+      char buffer[buffer_size];
+
+      bool write(const char *data, size_t len){
+        return onion_response_write(ptr, data, len)>=0;
+      }
+    public:
+      ResponseBuf(onion_response *_ptr) : ptr(_ptr){
+        setp(buffer, buffer+buffer_size);
+      }
+      /// Writes the kept output to the response.
+      virtual int sync(){
+        size_t n=pptr()-pbase();
+        if (!n)
+          return 0;
+        setp(buffer, buffer+buffer_size);
+        return write(buffer, n) ? 0 : -1;
       }
-      virtual int overflow(int  c = traits_type::eof()){
-        char C=c;
-        res->write(&C,1);
+      virtual int overflow(int c = traits_type::eof()){
+        if (sync()<0)
+          return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof())){
+          *pptr()=traits_type::to_char_type(c);
+          pbump(1);
+        }
         return traits_type::not_eof(c);
       }
-      std::streamsize xsputn(const char *data, std::streamsize s){
-        return res->write(data,s);
+      virtual std::streamsize xsputn(const char *data, std::streamsize s){
+        if (s<=epptr()-pptr()){
+          memcpy(pptr(), data, s);
+          pbump(s);
+          return s;
+        }
+        if (sync()<0)
+          return 0;
+        if ((size_t)s<buffer_size/2){
+          memcpy(pptr(), data, s);
+          pbump(s);
+          return s;
+        }
+        return write(data, s) ? s : 0;
+      }
+      /// printf straight into the put area, if it fits.
+      int vprintf(const char *fmt, va_list ap){
+        va_list ap2;
+        va_copy(ap2, ap);
+        size_t avail=epptr()-pptr();
+        int n=vsnprintf(pptr(), avail, fmt, ap);
+        if (n>=0 && (size_t)n<avail)
+          pbump(n);
+        else if (n>=0 && sync()==0){
+          if ((size_t)n<buffer_size){
+            vsnprintf(pptr(), buffer_size, fmt, ap2);
+            pbump(n);
+          }
+          else{
+            std::string str(n+1, '\0');
+            vsnprintf(&str[0], n+1, fmt, ap2);
+            if (!write(str.data(), n))
+              n=-1;
+          }
+        }
+        else
+          n=-1;
+        va_end(ap2);
+        return n;
       }
     };
-    
+
     onion_response *ptr;
     ResponseBuf resbuf;
   public:
-    Response(onion_response *_ptr) : ptr(_ptr), resbuf(this) { init( &resbuf ); }
-    
+    Response(onion_response *_ptr) : ptr(_ptr), resbuf(_ptr) { init( &resbuf ); }
+    ~Response(){
+      resbuf.pubsync();
+    }
+
     int write(const char *data, int len){
+      resbuf.pubsync();
       return onion_response_write(ptr, data, len);
     }
+#if __cplusplus >= 201703L
+    /// Writes the view, with no copy to a std::string.
+    int write(std::string_view data){
+      resbuf.pubsync();
+      return onion_response_write(ptr, data.data(), data.size());
+    }
+#endif
+
+    /// Formats straight into the stream buffer, as printf. Returns the bytes written, or -1.
+    int printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))){
+      va_list ap;
+      va_start(ap, fmt);
+      int n=resbuf.vprintf(fmt, ap);
+      va_end(ap);
+      return n;
+    }
+#ifdef __cpp_lib_format
+    /// Formats straight into the stream buffer, as std::format.
+    template<class... Args>
+    void format(std::format_string<Args...> fmt, Args&&... args){
+      std::format_to(std::ostreambuf_iterator<char>(&resbuf), fmt, std::forward<Args>(args)...);
+    }
+#endif
     
     void setHeader(const std::string &k, const std::string &v){
       onion_response_set_header(ptr, k.c_str(), v.c_str());
@@ -72,7 +179,9 @@ namespace Onion{
 			onion_response_write_headers(ptr);
 		}
     
+    /// The onion_response, with the stream output written to it, so they keep the order.
     onion_response *c_handler(){
+			resbuf.pubsync();
 			return ptr;
 		}
   };
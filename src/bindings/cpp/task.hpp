@@ -0,0 +1,278 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_TASK_HPP
+#define ONION_TASK_HPP
+
+#include "handler.hpp"
+#include "request.hpp"
+#include "response.hpp"
+#include <onion/request.h>
+#include <onion/poller.h>
+#include <onion/shortcuts.h>
+#include <onion/log.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <thread>
+#include <utility>
+
+namespace Onion{
+  /**
+   * @short Result of a coroutine handler, as Onion::Task handler(Onion::Request &req, Onion::Response &res)
+   *
+   * The handler runs at the connection thread until a co_await has to wait. Then the request is suspended
+   * (OCS_SUSPENDED) and the thread goes back to the poller. When the awaited thing is ready, from any thread,
+   * the coroutine is resumed at the connection poller, and when it co_returns the request is resumed
+   * (onion_request_resume) and the response finished there.
+   *
+   * Request and response live at the request arena until the coroutine ends. Exceptions are answered as
+   * at Onion::HandlerCallable. Out of a poller (O_THREADED, O_ONE...) the handler thread waits for the
+   * coroutine instead, and awaitables resume it at the thread that completes them.
+   */
+  class Task{
+  public:
+    class promise_type;
+    typedef std::coroutine_handle<promise_type> handle;
+
+    /// State of a running task, at the request arena.
+    struct Context{
+      Request req;
+      Response res;
+      onion_poller *poller;
+      std::mutex mutex;
+      std::condition_variable cond;
+      bool finished;
+      bool detached; ///< The handler returned OCS_SUSPENDED, so the coroutine finishes the request.
+
+      Context(onion_request *_req, onion_response *_res) : req(_req), res(_res), poller(onion_request_get_poller(_req)), finished(false), detached(false){}
+    };
+
+    /// Ends the task: gives the status to the handler, or if it already returned, resumes the request.
+    struct FinalAwaiter{
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(handle h) noexcept{
+        Context *ctx=h.promise().ctx;
+        onion_connection_status status=h.promise().status;
+        {
+          std::lock_guard<std::mutex> l(ctx->mutex);
+          ctx->finished=true;
+          if (!ctx->detached){ // Handler still there, it destroys all.
+            if (!ctx->poller)
+              ctx->cond.notify_all();
+            return;
+          }
+        }
+        h.destroy();
+        onion_request *req=ctx->req.c_handler();
+        if (status==OCS_INTERNAL_ERROR || status==OCS_NOT_PROCESSED || status==OCS_NOT_IMPLEMENTED)
+          onion_shortcut_response("Internal error", HTTP_INTERNAL_ERROR, req, ctx->res.c_handler());
+        ctx->~Context();
+        onion_request_resume(req);
+      }
+      void await_resume() const noexcept {}
+    };
+
+    class promise_type{
+    public:
+      Context *ctx=nullptr;
+      onion_connection_status status=OCS_PROCESSED;
+
+      Task get_return_object(){ return Task(handle::from_promise(*this)); }
+      std::suspend_always initial_suspend() noexcept { return {}; }
+      FinalAwaiter final_suspend() noexcept { return {}; }
+      void return_value(onion_connection_status st){ status=st; }
+      void unhandled_exception(){
+        try{
+          throw;
+        }
+        catch(const HttpInternalError &e){
+          status=onion_shortcut_response(e.what(), HTTP_INTERNAL_ERROR, ctx->req.c_handler(), ctx->res.c_handler());
+        }
+        catch(const std::exception &e){
+          ONION_ERROR("Catched exception: %s", e.what());
+          status=OCS_INTERNAL_ERROR;
+        }
+        catch(...){
+          ONION_ERROR("Catched unknown exception");
+          status=OCS_INTERNAL_ERROR;
+        }
+      }
+    };
+
+    Task(Task &&o) noexcept : h(std::exchange(o.h, {})){}
+    Task(const Task &)=delete;
+    Task &operator=(const Task &)=delete;
+    ~Task(){
+      if (h)
+        h.destroy();
+    }
+
+    /// Runs f(req, res) as a task, and returns its status, or OCS_SUSPENDED if it still waits.
+    template<class F>
+    static onion_connection_status run(F &f, onion_request *_req, onion_response *_res){
+      void *mem=onion_request_alloc(_req, sizeof(Context));
+      if (!mem)
+        return OCS_INTERNAL_ERROR;
+      Context *ctx=::new (mem) Context(_req, _res);
+      try{
+        return f(ctx->req, ctx->res).start(ctx);
+      }
+      catch(...){ // Only if the coroutine frame could not be created
+        ctx->~Context();
+        throw;
+      }
+    }
+
+    /// Resumes the coroutine at the poller of its request, or right now if none.
+    static void resume(handle h){
+      onion_poller *poller=h.promise().ctx->poller;
+      if (poller)
+        onion_poller_call(poller, resume_now, h.address());
+      else
+        h.resume();
+    }
+    /// Callback for onion_poller_call and onion_poller_add_timer, with the coroutine address.
+    static void resume_now(void *address){
+      handle::from_address(address).resume();
+    }
+  private:
+    handle h;
+
+    explicit Task(handle _h) : h(_h){}
+
+    onion_connection_status start(Context *ctx){
+      handle co=std::exchange(h, {});
+      co.promise().ctx=ctx;
+      co.resume();
+      {
+        std::unique_lock<std::mutex> l(ctx->mutex);
+        if (!ctx->poller)
+          ctx->cond.wait(l, [ctx]{ return ctx->finished; });
+        if (!ctx->finished){
+          ctx->detached=true;
+          return OCS_SUSPENDED;
+        }
+      }
+      onion_connection_status status=co.promise().status;
+      co.destroy();
+      ctx->~Context();
+      return status;
+    }
+  };
+
+  /**
+   * @short Waits that time, as co_await Onion::Sleep(std::chrono::milliseconds(10));
+   *
+   * It is a timer at the connection poller; out of a poller it sleeps the thread.
+   */
+  class Sleep{
+    std::chrono::milliseconds ms;
+  public:
+    explicit Sleep(std::chrono::milliseconds _ms) : ms(_ms){}
+
+    bool await_ready() const noexcept { return ms.count()<=0; }
+    bool await_suspend(Task::handle h){
+      onion_poller *poller=h.promise().ctx->poller;
+      if (poller && onion_poller_add_timer(poller, ms.count(), Task::resume_now, h.address())==0)
+        return true;
+      std::this_thread::sleep_for(ms);
+      return false;
+    }
+    void await_resume() const noexcept {}
+  };
+
+  /**
+   * @short Something that is completed later, from any thread, and awaited at a task
+   *
+   * It is the bridge for callback based APIs, as database or HTTP clients:
+   *
+   * @code
+   *   Onion::Completion<std::string> rows;
+   *   db.query("select ...", [&rows](std::string r){ rows.complete(std::move(r)); });
+   *   std::string r=co_await rows;
+   * @endcode
+   *
+   * Completing does not resume the coroutine there, but schedules it at its connection poller. Only one task
+   * may await it, once.
+   */
+  class CompletionBase{
+    static const uintptr_t done=1;
+    std::atomic<uintptr_t> state{0}; ///< 0, done, or the address of the waiting coroutine.
+  public:
+    CompletionBase()=default;
+    CompletionBase(const CompletionBase &)=delete;
+    CompletionBase &operator=(const CompletionBase &)=delete;
+
+    bool ready() const{ return state.load(std::memory_order_acquire)==done; }
+
+    bool await_ready() const noexcept { return ready(); }
+    bool await_suspend(Task::handle h) noexcept{
+      uintptr_t expected=0;
+      return state.compare_exchange_strong(expected, reinterpret_cast<uintptr_t>(h.address()), std::memory_order_acq_rel);
+    }
+  protected:
+    /// Marks it done, and resumes the waiting task, if any. After this, this may not exist anymore.
+    void set_done(){
+      uintptr_t waiting=state.exchange(done, std::memory_order_acq_rel);
+      if (waiting>done)
+        Task::resume(Task::handle::from_address(reinterpret_cast<void*>(waiting)));
+    }
+  };
+
+  template<class T=void>
+  class Completion : public CompletionBase{
+    std::optional<T> value;
+  public:
+    void complete(T v){
+      value.emplace(std::move(v));
+      set_done();
+    }
+    T await_resume(){ return std::move(*value); }
+  };
+
+  template<>
+  class Completion<void> : public CompletionBase{
+  public:
+    void complete(){ set_done(); }
+    void await_resume() const noexcept {}
+  };
+
+  /// Adapts a callable that returns a Task to a normal handler callable, for Onion::HandlerCallable.
+  template<class F>
+  struct HandlerTask{
+    F f;
+    onion_connection_status operator()(Request &req, Response &res){
+      return Task::run(f, req.c_handler(), res.c_handler());
+    }
+  };
+}
+
+#endif
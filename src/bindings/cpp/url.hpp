@@ -28,10 +28,77 @@
 
 #include "onion.hpp"
 #include "handler.hpp"
+#include "request.hpp"
+#include "response.hpp"
 #include <onion/url.h>
 #include <onion/onion.h>
+#include <onion/shortcuts.h>
+#include <onion/log.h>
+#include <cstddef>
+#include <cstring>
+#if __cplusplus >= 201103L
+#include <new>
+#include <type_traits>
+#include <utility>
+#endif
+#if __cpp_impl_coroutine >= 201902L
+#include "task.hpp"
+#endif
 
 namespace Onion{
+#if __cplusplus >= 201103L
+  /**
+   * @short Any callable as an onion_handler, without a Handler object nor virtual calls.
+   *
+   * Callables that fit a pointer and are trivially copyable, as functions and captureless lambdas, are
+   * stored at the handler private data itself; others are moved once, at registration, to the heap.
+   * Dispatch is the onion_handler indirect call, and the callable is inlined at its trampoline.
+   */
+  template<class F>
+  class HandlerCallable{
+  public:
+    typedef typename std::decay<F>::type T;
+    static const bool inlined=sizeof(T)<=sizeof(void*) && alignof(T)<=alignof(void*) && std::is_trivially_copyable<T>::value;
+
+    static onion_handler *create(F &&f){
+      return create(std::forward<F>(f), std::integral_constant<bool, inlined>());
+    }
+  private:
+    static onion_handler *create(F &&f, std::true_type){
+      void *data=NULL;
+      ::new (static_cast<void*>(&data)) T(std::forward<F>(f));
+      return onion_handler_new(call, data, NULL);
+    }
+    static onion_handler *create(F &&f, std::false_type){
+      return onion_handler_new(call, new T(std::forward<F>(f)), destroy);
+    }
+    static onion_connection_status call(void *data, onion_request *_req, onion_response *_res){
+      T *f=inlined ? reinterpret_cast<T*>(&data) : static_cast<T*>(data);
+      try{
+        Request req(_req);
+        Response res(_res);
+        return (*f)(req, res);
+      }
+      catch(const HttpInternalError &e){
+        return onion_shortcut_response(e.what(), HTTP_INTERNAL_ERROR, _req, _res);
+      }
+      catch(const std::exception &e){
+        ONION_ERROR("Catched exception: %s", e.what());
+        return OCS_INTERNAL_ERROR;
+      }
+    }
+    static void destroy(void *data){
+      delete static_cast<T*>(data);
+    }
+  };
+#endif
+
+  /// A route of a table, as static constexpr Onion::Route routes[]={ {"path", function}, ... };
+  struct Route{
+    const char *path;
+    HandlerFunction::fn_t fn;
+  };
+
   class Url{
     onion_url *ptr;
   public:
@@ -52,7 +119,37 @@ namespace Onion{
       return onion_url_add_handler(ptr,url.c_str(), h);
     }
     bool add(const std::string &url, HandlerFunction::fn_t fn){
+#if __cplusplus >= 201103L
+      return onion_url_add_handler(ptr,url.c_str(),HandlerCallable<HandlerFunction::fn_t>::create(std::move(fn)));
+#else
       return add(url,new HandlerFunction(fn));
+#endif
+    }
+#if __cplusplus >= 201103L
+    /// Adds any callable as f(Request &, Response &), as lambdas: url.add("path", [&](Onion::Request &req, Onion::Response &res){ ... });
+    template<class F>
+    typename std::enable_if<std::is_convertible<decltype(std::declval<typename std::decay<F>::type&>()(std::declval<Request&>(), std::declval<Response&>())), onion_connection_status>::value, bool>::type
+    add(const std::string &url, F &&f){
+      return onion_url_add_handler(ptr,url.c_str(),HandlerCallable<F>::create(std::forward<F>(f)));
+    }
+#endif
+#if __cpp_impl_coroutine >= 201902L
+    /// Adds a coroutine handler, as Onion::Task f(Request &, Response &), that may co_await. @see Onion::Task
+    template<class F>
+    typename std::enable_if<std::is_same<decltype(std::declval<typename std::decay<F>::type&>()(std::declval<Request&>(), std::declval<Response&>())), Task>::value, bool>::type
+    add(const std::string &url, F &&f){
+      typedef HandlerTask<typename std::decay<F>::type> T;
+      return onion_url_add_handler(ptr,url.c_str(),HandlerCallable<T>::create(T{std::forward<F>(f)}));
+    }
+#endif
+    /// Adds all the routes of a table, in order. As onion_url_add_handler, true (non zero) at the first error.
+    template<size_t N>
+    bool add(const Route (&routes)[N]){
+      for (size_t i=0;i<N;i++){
+        if (add(routes[i].path,routes[i].fn))
+          return true;
+      }
+      return false;
     }
     template<class T>
     bool add(const std::string &url, T *o, onion_connection_status (T::*fn)(Request &,Response &)){
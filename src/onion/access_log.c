@@ -0,0 +1,559 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "access_log.h"
+#include "types_internal.h"
+#include "request.h"
+#include "stats.h"
+#include "log.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/// Default bytes of the buffer of each thread.
+#define ONION_ACCESS_LOG_BUFFER_SIZE (64*1024)
+/// Most chunks written at one writev.
+#define ONION_ACCESS_LOG_IOV 64
+/// ms the writer waits for more lines, unless a buffer gets half full first.
+#define ONION_ACCESS_LOG_INTERVAL 100
+
+/// A piece of the format: literal text, or a field.
+typedef struct onion_access_log_part_t{
+	char field;        ///< The letter after the %, or 0 for literal text.
+	const char *text;  ///< The literal text, or the header name of %{Name}i, at the copy of the format.
+	int length;
+	int phase;         ///< The onion_stats_phase of %{phase}P.
+}onion_access_log_part;
+
+/// Lines of a thread, written by it and read by the writer thread, without locks.
+typedef struct onion_access_log_ring_t{
+	char *data;
+	size_t size;      ///< Power of 2
+	size_t head;      ///< Bytes ever written by its thread. Only it changes it.
+	size_t tail;      ///< Bytes ever written to the log. Only the writer changes it.
+	long logged;      ///< Only its thread changes them.
+	long dropped;
+#ifdef HAVE_PTHREADS
+	pthread_t thread;
+#endif
+	struct onion_access_log_ring_t *next;
+}onion_access_log_ring;
+
+struct onion_access_log_t{
+	int fd;                         ///< File to append to, or -1 for syslog.
+	char *format;                   ///< Copy of the format, the parts point into it.
+	onion_access_log_part *parts;
+	int nparts;
+	size_t buffer_size;             ///< Of the new rings
+#ifdef HAVE_PTHREADS
+	unsigned int id;                ///< Unique, so the threads know their ring is of this log.
+	onion_access_log_ring *rings;   ///< Newest first. They are only added while logging, and freed at the end.
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;            ///< Wakes the writer, when a ring is half full, and to stop.
+	pthread_t writer;
+	int stop;
+#else
+	long logged;
+#endif
+};
+
+static int onion_access_log_parse(onion_access_log *log, const char *format);
+static size_t onion_access_log_format(onion_access_log *log, onion_response *res, char *line, size_t size);
+static char *onion_access_log_append(char *p, char *end, const char *text);
+static const char *onion_access_log_date();
+static void onion_access_log_output(onion_access_log *log, struct iovec *iov, int n);
+static void onion_access_log_release(onion_access_log *log);
+#ifdef HAVE_PTHREADS
+static onion_access_log_ring *onion_access_log_ring_get(onion_access_log *log);
+static void onion_access_log_flush(onion_access_log *log);
+static void *onion_access_log_writer(void *_log);
+
+static unsigned int onion_access_log_ids=0;
+static __thread unsigned int onion_access_log_self_id=0;
+static __thread onion_access_log_ring *onion_access_log_self=NULL;
+#endif
+
+static __thread time_t onion_access_log_time=0;
+static __thread char onion_access_log_time_text[32];
+
+/**
+ * @short Creates an access log.
+ * @memberof onion_access_log_t
+ * 
+ * Each thread formats its lines and keeps them at a buffer of its own, with no locks, and a thread 
+ * of the log writes them, all the pending ones at one writev, as a buffer is half full or every 100 ms.
+ * If a buffer is full the line is dropped, and counted, instead of waiting.
+ * 
+ * The format is text with these fields, as at Apache:
+ * 
+ * - %h -- The client, as onion_request_get_client_description.
+ * - %t -- Date and time, as [10/Oct/2000:13:55:36 -0700].
+ * - %m -- Method
+ * - %U -- Path, without the query.
+ * - %H -- Protocol, as HTTP/1.1.
+ * - %s -- Status code
+ * - %b -- Bytes of the body sent.
+ * - %D -- Microseconds since the first byte of the request was read, or - if not known.
+ * - %{Name}i -- The Name header of the request, or -.
+ * - %{phase}P -- Microseconds of that phase, as named at onion_stats_phase_names: tls, headers, body, 
+ *   handler, flush or total; or - if not known. Needs onion_set_request_timings.
+ * - %% -- A %
+ * 
+ * The texts from the request are escaped, as \\xHH, so each request is always one line.
+ * 
+ * @param path File to append the lines to, or NULL to write them to syslog.
+ * @param format Format of the lines, or NULL for ONION_ACCESS_LOG_DEFAULT_FORMAT.
+ * @returns The log, or NULL if the file could not be opened, or the format is not valid.
+ */
+onion_access_log *onion_access_log_new(const char *path, const char *format){
+	onion_access_log *log=calloc(1, sizeof(onion_access_log));
+	log->fd=-1;
+	log->buffer_size=ONION_ACCESS_LOG_BUFFER_SIZE;
+	if (onion_access_log_parse(log, format ? format : ONION_ACCESS_LOG_DEFAULT_FORMAT)<0){
+		ONION_ERROR("Invalid access log format: %s", format);
+		onion_access_log_release(log);
+		return NULL;
+	}
+	if (path){
+		log->fd=open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+		if (log->fd<0){
+			ONION_ERROR("Could not open the access log %s: %s", path, strerror(errno));
+			onion_access_log_release(log);
+			return NULL;
+		}
+	}
+#ifdef HAVE_PTHREADS
+	log->id=__sync_add_and_fetch(&onion_access_log_ids, 1);
+	pthread_mutex_init(&log->mutex, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&log->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&log->writer, NULL, onion_access_log_writer, log)!=0){
+		ONION_ERROR("Could not create the access log thread");
+		pthread_mutex_destroy(&log->mutex);
+		pthread_cond_destroy(&log->cond);
+		onion_access_log_release(log);
+		return NULL;
+	}
+#endif
+	return log;
+}
+
+/**
+ * @short Writes the pending lines, and frees the log.
+ * @memberof onion_access_log_t
+ * 
+ * No thread may be logging to it, so the server must not be listening.
+ */
+void onion_access_log_free(onion_access_log *log){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&log->mutex);
+	log->stop=1;
+	pthread_cond_signal(&log->cond);
+	pthread_mutex_unlock(&log->mutex);
+	pthread_join(log->writer, NULL); // It writes what is left before ending
+	while (log->rings){
+		onion_access_log_ring *next=log->rings->next;
+		free(log->rings->data);
+		free(log->rings);
+		log->rings=next;
+	}
+	pthread_mutex_destroy(&log->mutex);
+	pthread_cond_destroy(&log->cond);
+#endif
+	onion_access_log_release(log);
+}
+
+/// Frees the format and closes the file.
+static void onion_access_log_release(onion_access_log *log){
+	if (log->fd>=0)
+		close(log->fd);
+	free(log->parts);
+	free(log->format);
+	free(log);
+}
+
+/**
+ * @short Sets the bytes of the buffer of each thread.
+ * @memberof onion_access_log_t
+ * 
+ * It is rounded up to a power of 2, of at least two lines. Only the threads that log for the first
+ * time after it use it, so it should be set before listening. Default is 64 KB.
+ */
+void onion_access_log_set_buffer_size(onion_access_log *log, size_t size){
+	size_t s=2*ONION_ACCESS_LOG_LINE;
+	while (s<size)
+		s<<=1;
+	log->buffer_size=s;
+}
+
+/**
+ * @short Gets the counters of lines logged and dropped, of all the threads.
+ * @memberof onion_access_log_t
+ */
+void onion_access_log_get_stats(onion_access_log *log, onion_access_log_stats *stats){
+	memset(stats, 0, sizeof(onion_access_log_stats));
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&log->mutex);
+	onion_access_log_ring *ring;
+	for (ring=log->rings;ring;ring=ring->next){
+		stats->logged+=__atomic_load_n(&ring->logged, __ATOMIC_RELAXED);
+		stats->dropped+=__atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&log->mutex);
+#else
+	stats->logged=log->logged;
+#endif
+}
+
+/**
+ * @short Logs the response of a request.
+ * @memberof onion_access_log_t
+ * 
+ * It is called by onion_response_free when the server has an access log. The line is formatted at 
+ * this thread, and copied to its buffer, if there is room.
+ */
+void onion_access_log_write(onion_access_log *log, onion_response *res){
+	char line[ONION_ACCESS_LOG_LINE];
+	size_t len=onion_access_log_format(log, res, line, sizeof(line));
+#ifdef HAVE_PTHREADS
+	onion_access_log_ring *ring=onion_access_log_ring_get(log);
+	size_t head=ring->head;
+	size_t used=head-__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (ring->size-used<len){ // Full, the writer is late.
+		__atomic_store_n(&ring->dropped, ring->dropped+1, __ATOMIC_RELAXED);
+		pthread_cond_signal(&log->cond);
+		return;
+	}
+	size_t pos=head&(ring->size-1);
+	size_t first=(len<ring->size-pos) ? len : ring->size-pos;
+	memcpy(ring->data+pos, line, first);
+	memcpy(ring->data, line+first, len-first);
+	__atomic_store_n(&ring->head, head+len, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->logged, ring->logged+1, __ATOMIC_RELAXED);
+	if (used<ring->size/2 && used+len>=ring->size/2) // Just got half full, written now.
+		pthread_cond_signal(&log->cond);
+#else
+	struct iovec iov={ line, len };
+	onion_access_log_output(log, &iov, 1);
+	log->logged++;
+#endif
+}
+
+/// Parses the format into parts. The texts point into a copy of the format.
+static int onion_access_log_parse(onion_access_log *log, const char *format){
+	log->format=strdup(format);
+	log->parts=malloc(sizeof(onion_access_log_part)*(strlen(format)+1)); // At most one per char
+	char *p=log->format;
+	int n=0;
+	while (*p){
+		onion_access_log_part *part=&log->parts[n++];
+		part->field=0;
+		part->text=p;
+		if (*p!='%'){
+			while (*p && *p!='%')
+				p++;
+			part->length=p-part->text;
+			continue;
+		}
+		p++;
+		part->text=NULL;
+		part->length=0;
+		if (*p=='{'){
+			char *end=strchr(p, '}');
+			if (!end || (end[1]!='i' && end[1]!='P'))
+				return -1;
+			part->text=p+1;
+			part->length=end-part->text;
+			*end='\0';
+			p=end+1;
+			if (*p=='P'){
+				for (part->phase=0;part->phase<ONION_STATS_PHASES;part->phase++){
+					if (strcmp(part->text, onion_stats_phase_names[part->phase])==0)
+						break;
+				}
+				if (part->phase==ONION_STATS_PHASES)
+					return -1;
+			}
+		}
+		if (!*p || !strchr("htmUHsbDiP%", *p) || ((*p=='i' || *p=='P')!=(part->text!=NULL)))
+			return -1;
+		part->field=*p++;
+		if (part->field=='%'){
+			part->field=0;
+			part->text="%";
+			part->length=1;
+		}
+	}
+	log->nparts=n;
+	return 0;
+}
+
+/// Formats the line of the response, ended with \\n, truncated if too long. Returns its length.
+static size_t onion_access_log_format(onion_access_log *log, onion_response *res, char *line, size_t size){
+	onion_request *req=res->request;
+	char *p=line, *end=line+size-1; // Room for the \n
+	char tmp[24];
+	int i;
+	for (i=0;i<log->nparts && p<end;i++){
+		onion_access_log_part *part=&log->parts[i];
+		switch(part->field){
+			case 0:{
+				size_t l=(part->length<end-p) ? part->length : end-p;
+				memcpy(p, part->text, l);
+				p+=l;
+				break;
+			}
+			case 'h':
+				p=onion_access_log_append(p, end, onion_request_get_client_description(req));
+				break;
+			case 't':
+				p=onion_access_log_append(p, end, onion_access_log_date());
+				break;
+			case 'm':
+				p=onion_access_log_append(p, end, onion_request_methods[req->flags&OR_METHODS]);
+				break;
+			case 'U':
+				p=onion_access_log_append(p, end, req->fullpath);
+				break;
+			case 'H':
+				p=onion_access_log_append(p, end, (req->flags&OR_HTTP2) ? "HTTP/2.0" : (req->flags&OR_HTTP11) ? "HTTP/1.1" : "HTTP/1.0");
+				break;
+			case 's':
+				snprintf(tmp, sizeof(tmp), "%d", res->code);
+				p=onion_access_log_append(p, end, tmp);
+				break;
+			case 'b':
+				snprintf(tmp, sizeof(tmp), "%u", res->sent_bytes);
+				p=onion_access_log_append(p, end, tmp);
+				break;
+			case 'D':
+				if (req->timings[OR_PHASE_START]){
+					int64_t to=req->timings[OR_PHASE_END];
+					if (!to){
+						struct timespec ts;
+						clock_gettime(CLOCK_MONOTONIC, &ts);
+						to=((int64_t)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+					}
+					snprintf(tmp, sizeof(tmp), "%ld", (long)(to - req->timings[OR_PHASE_START]));
+					p=onion_access_log_append(p, end, tmp);
+				}
+				else
+					p=onion_access_log_append(p, end, NULL);
+				break;
+			case 'i':
+				p=onion_access_log_append(p, end, onion_request_get_header(req, part->text));
+				break;
+			case 'P':{
+				int64_t us=onion_stats_phase_duration(req->timings, part->phase);
+				if (us>=0){
+					snprintf(tmp, sizeof(tmp), "%ld", (long)us);
+					p=onion_access_log_append(p, end, tmp);
+				}
+				else
+					p=onion_access_log_append(p, end, NULL);
+				break;
+			}
+		}
+	}
+	*p++='\n';
+	return p-line;
+}
+
+/// Appends the text, or - if NULL, escaping quotes, backslashes and control characters as \\xHH.
+static char *onion_access_log_append(char *p, char *end, const char *text){
+	static const char hex[]="0123456789abcdef";
+	if (!text)
+		text="-";
+	for (;*text && p<end;text++){
+		unsigned char c=*text;
+		if (c<0x20 || c==0x7F || c=='"' || c=='\\'){
+			if (end-p<4)
+				return end;
+			*p++='\\';
+			*p++='x';
+			*p++=hex[c>>4];
+			*p++=hex[c&0x0F];
+		}
+		else
+			*p++=c;
+	}
+	return p;
+}
+
+/// The date for %t, formatted once a second at each thread.
+static const char *onion_access_log_date(){
+	time_t t=time(NULL);
+	if (t!=onion_access_log_time){
+		struct tm tm;
+		localtime_r(&t, &tm);
+		strftime(onion_access_log_time_text, sizeof(onion_access_log_time_text), "[%d/%b/%Y:%H:%M:%S %z]", &tm);
+		onion_access_log_time=t;
+	}
+	return onion_access_log_time_text;
+}
+
+/// Writes the lines to the file, all that writev allows, or one by one to syslog.
+static void onion_access_log_output(onion_access_log *log, struct iovec *iov, int n){
+	if (log->fd<0){
+		char line[ONION_ACCESS_LOG_LINE];
+		size_t l=0;
+		int i;
+		for (i=0;i<n;i++){
+			const char *data=iov[i].iov_base;
+			size_t j;
+			for (j=0;j<iov[i].iov_len;j++){
+				if (data[j]=='\n'){
+					syslog(LOG_INFO, "%.*s", (int)l, line);
+					l=0;
+				}
+				else if (l<sizeof(line))
+					line[l++]=data[j];
+			}
+		}
+		return;
+	}
+	while (n>0){
+		ssize_t w=writev(log->fd, iov, n);
+		if (w<0){
+			if (errno==EINTR)
+				continue;
+			ONION_ERROR("Error writing the access log: %s", strerror(errno));
+			return;
+		}
+		while (n>0 && (size_t)w>=iov->iov_len){
+			w-=iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n>0){
+			iov->iov_base=(char*)iov->iov_base+w;
+			iov->iov_len-=w;
+		}
+	}
+}
+
+#ifdef HAVE_PTHREADS
+/// The ring of this thread for the log, created the first time.
+static onion_access_log_ring *onion_access_log_ring_get(onion_access_log *log){
+	if (onion_access_log_self_id==log->id)
+		return onion_access_log_self;
+	pthread_t self=pthread_self();
+	pthread_mutex_lock(&log->mutex);
+	onion_access_log_ring *ring;
+	for (ring=log->rings;ring;ring=ring->next) // This thread may have logged to other logs meanwhile
+		if (pthread_equal(ring->thread, self))
+			break;
+	if (!ring){
+		ring=calloc(1, sizeof(onion_access_log_ring));
+		ring->data=malloc(log->buffer_size);
+		ring->size=log->buffer_size;
+		ring->thread=self;
+		ring->next=log->rings;
+		log->rings=ring;
+	}
+	pthread_mutex_unlock(&log->mutex);
+	onion_access_log_self_id=log->id;
+	onion_access_log_self=ring;
+	return ring;
+}
+
+/// Writes the pending lines of all the rings, in as few writev as possible.
+static void onion_access_log_flush(onion_access_log *log){
+	struct iovec iov[ONION_ACCESS_LOG_IOV];
+	struct{
+		onion_access_log_ring *ring;
+		size_t head;
+	}done[ONION_ACCESS_LOG_IOV];
+	int n=0, ndone=0, i;
+	pthread_mutex_lock(&log->mutex);
+	onion_access_log_ring *ring=log->rings; // The next ones do not change
+	pthread_mutex_unlock(&log->mutex);
+	while (ring){
+		size_t head=__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head!=ring->tail){
+			size_t pos=ring->tail&(ring->size-1), len=head-ring->tail;
+			size_t first=(len<ring->size-pos) ? len : ring->size-pos;
+			iov[n].iov_base=ring->data+pos;
+			iov[n++].iov_len=first;
+			if (len>first){ // Wraps around
+				iov[n].iov_base=ring->data;
+				iov[n++].iov_len=len-first;
+			}
+			done[ndone].ring=ring;
+			done[ndone++].head=head;
+		}
+		ring=ring->next;
+		if (n && (!ring || n>ONION_ACCESS_LOG_IOV-2)){
+			onion_access_log_output(log, iov, n);
+			for (i=0;i<ndone;i++)
+				__atomic_store_n(&done[i].ring->tail, done[i].head, __ATOMIC_RELEASE);
+			n=ndone=0;
+		}
+	}
+}
+
+/// The thread that writes the lines, until the log is freed.
+static void *onion_access_log_writer(void *_log){
+	onion_access_log *log=_log;
+	pthread_mutex_lock(&log->mutex);
+	while (!log->stop){
+		pthread_mutex_unlock(&log->mutex);
+		onion_access_log_flush(log);
+		pthread_mutex_lock(&log->mutex);
+		if (log->stop)
+			break;
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec+=ONION_ACCESS_LOG_INTERVAL*1000000L;
+		if (ts.tv_nsec>=1000000000L){
+			ts.tv_sec++;
+			ts.tv_nsec-=1000000000L;
+		}
+		pthread_cond_timedwait(&log->cond, &log->mutex, &ts);
+	}
+	pthread_mutex_unlock(&log->mutex);
+	onion_access_log_flush(log);
+	return NULL;
+}
+#endif
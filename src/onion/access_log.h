@@ -0,0 +1,66 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_ACCESS_LOG_H
+#define ONION_ACCESS_LOG_H
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/// Default format: the common log format, and the microseconds it took.
+#define ONION_ACCESS_LOG_DEFAULT_FORMAT "%h - - %t \"%m %U %H\" %s %b %D"
+
+/// Longest line; longer ones are truncated.
+#define ONION_ACCESS_LOG_LINE 1024
+
+/// Counters of an access log. @see onion_access_log_get_stats
+typedef struct onion_access_log_stats_t{
+	long logged;   ///< Lines at the buffers, written or to be written.
+	long dropped;  ///< Lines not logged as the buffer of the thread was full.
+}onion_access_log_stats;
+
+/// Creates an access log to that file, or to syslog if NULL, with that format, or the default if NULL. NULL on error.
+onion_access_log *onion_access_log_new(const char *path, const char *format);
+
+/// Writes what is pending and frees the log. No thread may be logging to it.
+void onion_access_log_free(onion_access_log *log);
+
+/// Sets the bytes of the buffer of each thread, rounded up to a power of 2, for the threads that log after it.
+void onion_access_log_set_buffer_size(onion_access_log *log, size_t size);
+
+/// Logs the response, just before it is freed.
+void onion_access_log_write(onion_access_log *log, onion_response *res);
+
+/// Gets the logged and dropped counters.
+void onion_access_log_get_stats(onion_access_log *log, onion_access_log_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
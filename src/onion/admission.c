@@ -0,0 +1,305 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "admission.h"
+#include "types_internal.h"
+#include "request.h"
+#include "response.h"
+#include "shortcuts.h"
+#include "sessions.h"
+#include "file_cache.h"
+#include "fragment_cache.h"
+#include "pool.h"
+#include "memory.h"
+#include "log.h"
+
+/// Buckets of the per client counters. Clients whose addresses hash the same share their limit.
+#define ONION_ADMISSION_CLIENT_BUCKETS 4096
+/// Least time between two sheddings of memory, so a server over its budget does not evict at each accept.
+#define ONION_ADMISSION_MEMORY_SHED_US 100000
+
+struct onion_admission_t{
+	int max_connections;   ///< 0 for no limit
+	int max_per_client;    ///< 0 for no limit
+	int max_requests;      ///< In flight, 0 for no limit
+	int retry_after;       ///< Seconds at the Retry-After of the 503s
+	int64_t target_us;     ///< Wait before the handler over which a request is late, 0 to not shed.
+	int64_t interval_us;   ///< Time the requests must be late before shedding
+	int64_t late_since;    ///< Monotonic us since the requests are late, or 0.
+	size_t memory_budget;  ///< Bytes of onion_memory_total, 0 for no limit
+	unsigned int connections;
+	unsigned int requests;
+	unsigned long connections_rejected;
+	unsigned long requests_rejected;
+	unsigned long requests_shed;
+	unsigned long memory_sheds;
+	unsigned int clients[ONION_ADMISSION_CLIENT_BUCKETS];
+};
+
+static int64_t onion_admission_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+/**
+ * @short Gets the admission data of the server, creating it if it has none yet.
+ * 
+ * It is at shared memory, as the stats, so the limits are for all the prefork processes together.
+ */
+onion_admission *onion_admission_get(onion *server){
+	if (server->admission)
+		return server->admission;
+	onion_admission *adm=mmap(NULL, sizeof(onion_admission), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (adm==MAP_FAILED){
+		ONION_ERROR("Could not allocate the admission limits");
+		return NULL;
+	}
+	adm->retry_after=1;
+	server->admission=adm;
+	return adm;
+}
+
+void onion_admission_free(onion_admission *adm){
+	if (adm)
+		munmap(adm, sizeof(onion_admission));
+}
+
+void onion_admission_set_connections(onion_admission *adm, int max_connections, int max_per_client){
+	adm->max_connections=max_connections>0 ? max_connections : 0;
+	adm->max_per_client=max_per_client>0 ? max_per_client : 0;
+}
+
+void onion_admission_set_inflight(onion_admission *adm, int max_requests, int retry_after){
+	adm->max_requests=max_requests>0 ? max_requests : 0;
+	adm->retry_after=retry_after>0 ? retry_after : 1;
+}
+
+void onion_admission_set_shedding(onion_admission *adm, int target_ms, int interval_ms){
+	adm->target_us=target_ms>0 ? ((int64_t)target_ms)*1000 : 0;
+	adm->interval_us=interval_ms>0 ? ((int64_t)interval_ms)*1000 : 0;
+	adm->late_since=0;
+}
+
+void onion_admission_set_memory_budget(onion_admission *adm, size_t bytes){
+	adm->memory_budget=bytes;
+}
+
+/**
+ * @short Frees what can be freed quickly when over the memory budget.
+ * 
+ * A quarter of the sessions, the least recently used ones, all the files in memory of the file cache,
+ * the fragment cache, and the objects kept at the pools of this thread.
+ */
+static void onion_admission_memory_shed(onion *server){
+	if (server->sessions){
+		int count=onion_sessions_count(server->sessions);
+		if (count)
+			onion_sessions_evict(server->sessions, count/(4*ONION_SESSIONS_SHARDS)+1);
+	}
+	if (server->file_cache)
+		onion_file_cache_evict(server->file_cache);
+	onion_fragment_cache_clear();
+	onion_pool_clear();
+}
+
+/**
+ * @short Checks the memory of the process against the budget, shedding if over it.
+ * 
+ * The memory is the one accounted by the library, of this process. The shedding is at most each
+ * ONION_ADMISSION_MEMORY_SHED_US, as freeing takes a while to show as the connections end.
+ * 
+ * @returns 1 if under the budget, maybe after shedding, 0 if still over it.
+ */
+static int onion_admission_memory_ok(onion_admission *adm, onion *server){
+	static int64_t shed_at=0; // The accounting is of the process, so the shedding too.
+	size_t total=onion_memory_total();
+	if (total<=adm->memory_budget)
+		return 1;
+	int64_t now=onion_admission_now();
+	int64_t last=__atomic_load_n(&shed_at, __ATOMIC_RELAXED);
+	if (now-last<ONION_ADMISSION_MEMORY_SHED_US || 
+	    !__atomic_compare_exchange_n(&shed_at, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return 0;
+	ONION_WARNING_RATELIMITED("Over the memory budget, %ld of %ld bytes. Evicting sessions and caches.", 
+	                          (long)total, (long)adm->memory_budget);
+	__atomic_fetch_add(&adm->memory_sheds, 1, __ATOMIC_RELAXED);
+	onion_admission_memory_shed(server);
+	return onion_memory_total()<=adm->memory_budget;
+}
+
+/// Bucket of the client address, by a FNV-1a hash of the IP. -1 if not an IP connection.
+static int onion_admission_client_bucket(onion_request *req){
+	size_t len;
+	const unsigned char *addr=onion_request_get_client_ip(req, &len);
+	if (!addr)
+		return -1;
+	uint32_t h=2166136261u;
+	size_t i;
+	for (i=0;i<len;i++)
+		h=(h^addr[i])*16777619u;
+	return h%ONION_ADMISSION_CLIENT_BUCKETS;
+}
+
+/// Takes one of the counter, unless it is already at max. 0 for no limit.
+static int onion_admission_take(unsigned int *counter, int max){
+	unsigned int n=__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+	if (max && n>(unsigned int)max){
+		__atomic_sub_fetch(counter, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
+
+/// Answers a 503 straight to the connection, without any request parsed. Not on a TLS connection still at its handshake.
+static void onion_admission_reject(onion_request *req, int retry_after){
+	onion_listen_point *lp=req->connection.listen_point;
+	if (req->connection.handshake || !lp->write)
+		return;
+	char response[160];
+	int len=snprintf(response, sizeof(response), "HTTP/1.1 503 Service Unavailable\r\nRetry-After: %d\r\n"
+									 "Content-Length: 0\r\nConnection: close\r\n\r\n", retry_after);
+	lp->write(req, response, len);
+}
+
+/**
+ * @short Counts the new connection, or rejects it if the server or its client have too many.
+ * 
+ * The rejected ones are answered a 503 if possible, and must be closed.
+ */
+int onion_admission_connection_open(onion_request *req){
+	onion *server=req->connection.listen_point->server;
+	onion_admission *adm=server->admission;
+	if (adm->memory_budget && !onion_admission_memory_ok(adm, server)){
+		__atomic_fetch_add(&adm->connections_rejected, 1, __ATOMIC_RELAXED);
+		onion_admission_reject(req, adm->retry_after);
+		return 0;
+	}
+	if (!adm->max_connections && !adm->max_per_client)
+		return 1;
+	if (!onion_admission_take(&adm->connections, adm->max_connections)){
+		__atomic_fetch_add(&adm->connections_rejected, 1, __ATOMIC_RELAXED);
+		onion_admission_reject(req, adm->retry_after);
+		return 0;
+	}
+	int bucket=adm->max_per_client ? onion_admission_client_bucket(req) : -1;
+	if (bucket>=0 && !onion_admission_take(&adm->clients[bucket], adm->max_per_client)){
+		__atomic_sub_fetch(&adm->connections, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&adm->connections_rejected, 1, __ATOMIC_RELAXED);
+		onion_admission_reject(req, adm->retry_after);
+		return 0;
+	}
+	req->admission.connection=1;
+	req->admission.client=bucket;
+	return 1;
+}
+
+void onion_admission_connection_close(onion_request *req){
+	if (!req->admission.connection)
+		return;
+	onion_admission *adm=req->connection.listen_point->server->admission;
+	req->admission.connection=0;
+	__atomic_sub_fetch(&adm->connections, 1, __ATOMIC_RELAXED);
+	if (req->admission.client>=0)
+		__atomic_sub_fetch(&adm->clients[req->admission.client], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @short Counts a new request, at its first byte, before parsing anything.
+ * 
+ * Over the in flight limit it is answered a 503 with Retry-After, and the connection must be closed.
+ */
+int onion_admission_request_start(onion_request *req){
+	onion_admission *adm=req->connection.listen_point->server->admission;
+	if (adm->target_us)
+		req->admission.start=onion_admission_now();
+	if (!adm->max_requests)
+		return 1;
+	if (!onion_admission_take(&adm->requests, adm->max_requests)){
+		__atomic_fetch_add(&adm->requests_rejected, 1, __ATOMIC_RELAXED);
+		onion_admission_reject(req, adm->retry_after);
+		return 0;
+	}
+	req->admission.request=1;
+	return 1;
+}
+
+void onion_admission_request_end(onion_request *req){
+	if (!req->admission.request)
+		return;
+	req->admission.request=0;
+	__atomic_sub_fetch(&req->connection.listen_point->server->admission->requests, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @short Sheds the request if the requests wait too long before their handler, as CoDel does at queues.
+ * 
+ * The wait is from the first byte of the request to the handler, so it has the parsing, the body, and 
+ * the wait for a worker. A request that waited over the target is late. When they are late for a whole 
+ * interval, and not just a burst, they are answered a 503 with Retry-After, until one is on time again.
+ * 
+ * @returns 1 if it may go on to its handler, 0 if it was answered.
+ */
+int onion_admission_request_handle(onion_request *req, onion_response *res){
+	onion_admission *adm=req->connection.listen_point->server->admission;
+	if (!adm->target_us || !req->admission.start)
+		return 1;
+	int64_t now=onion_admission_now();
+	if (now-req->admission.start<adm->target_us){
+		__atomic_store_n(&adm->late_since, 0, __ATOMIC_RELAXED);
+		return 1;
+	}
+	int64_t since=__atomic_load_n(&adm->late_since, __ATOMIC_RELAXED);
+	if (!since){
+		__atomic_store_n(&adm->late_since, now, __ATOMIC_RELAXED);
+		return 1;
+	}
+	if (now-since<adm->interval_us)
+		return 1;
+	__atomic_fetch_add(&adm->requests_shed, 1, __ATOMIC_RELAXED);
+	char retry_after[16];
+	snprintf(retry_after, sizeof(retry_after), "%d", adm->retry_after);
+	onion_response_set_header(res, "Retry-After", retry_after);
+	onion_request_set_no_keep_alive(req);
+	onion_shortcut_response("Service unavailable", HTTP_SERVICE_UNAVALIABLE, req, res);
+	return 0;
+}
+
+void onion_admission_get_stats(onion_admission *adm, unsigned long *connections_rejected, unsigned long *requests_rejected, unsigned long *requests_shed){
+	*connections_rejected+=__atomic_load_n(&adm->connections_rejected, __ATOMIC_RELAXED);
+	*requests_rejected+=__atomic_load_n(&adm->requests_rejected, __ATOMIC_RELAXED);
+	*requests_shed+=__atomic_load_n(&adm->requests_shed, __ATOMIC_RELAXED);
+}
+
+void onion_admission_get_memory_stats(onion_admission *adm, size_t *budget, unsigned long *sheds){
+	*budget=adm->memory_budget;
+	*sheds=__atomic_load_n(&adm->memory_sheds, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,77 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_ADMISSION_H
+#define ONION_ADMISSION_H
+
+#include <stddef.h>
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/**
+ * @struct onion_admission_t
+ * @short Limits of connections and requests of a server, and their counters.
+ *
+ * Internal. Only allocated when some limit is set, so a server without limits only checks a NULL pointer.
+ * @see onion_set_connection_limits onion_set_max_inflight onion_set_load_shedding
+ */
+struct onion_admission_t;
+typedef struct onion_admission_t onion_admission;
+
+/// Gets the admission data of the server, creating it if it has none yet.
+onion_admission *onion_admission_get(onion *server);
+/// Frees it. Used by onion_free.
+void onion_admission_free(onion_admission *adm);
+
+void onion_admission_set_connections(onion_admission *adm, int max_connections, int max_per_client);
+void onion_admission_set_inflight(onion_admission *adm, int max_requests, int retry_after);
+void onion_admission_set_shedding(onion_admission *adm, int target_ms, int interval_ms);
+void onion_admission_set_memory_budget(onion_admission *adm, size_t bytes);
+
+/// Counts the new connection. Returns 0 if over a limit; then it is not counted, and was answered a 503 if possible.
+int onion_admission_connection_open(onion_request *req);
+/// Uncounts the connection, if it was counted.
+void onion_admission_connection_close(onion_request *req);
+/// Counts a new request, at its first byte. Returns 0 if over the limit; then it was answered a 503.
+int onion_admission_request_start(onion_request *req);
+/// Uncounts the request, if it was counted.
+void onion_admission_request_end(onion_request *req);
+/// At the handler, if it waited for too long, answers a 503 and returns 0.
+int onion_admission_request_handle(onion_request *req, onion_response *res);
+
+/// Adds the rejected counters to the stats.
+void onion_admission_get_stats(onion_admission *adm, unsigned long *connections_rejected, unsigned long *requests_rejected, unsigned long *requests_shed);
+/// Gets the memory budget, and the times it was over it and shed.
+void onion_admission_get_memory_stats(onion_admission *adm, size_t *budget, unsigned long *sheds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -31,7 +31,6 @@
 #include <string.h>
 
 #define ONION_BLOCK_GROW_MIN_BLOCK 16
-#define ONION_BLOCK_GROW_EXPONENTIAL_LIMIT 1024
 
 /**
  * @short Creates a new block
@@ -120,11 +119,8 @@ void onion_block_rewind(onion_block *b, off_t n){
  * @memberof onion_block_t
  */
 int onion_block_add_char(onion_block *bl, char c){
-	if (bl->size>=bl->maxsize){ // Grows ^2, until 1024, and then on 1024 chunks.
-		int grow=bl->maxsize;
-		if (grow>ONION_BLOCK_GROW_EXPONENTIAL_LIMIT)
-			grow=ONION_BLOCK_GROW_EXPONENTIAL_LIMIT;
-		bl->maxsize+=grow;
+	if (bl->size>=bl->maxsize){ // Grows ^2, so appending char by char is linear.
+		bl->maxsize*=2;
 		bl->data=realloc(bl->data, bl->maxsize);
 	}
 	bl->data[bl->size++]=c;
@@ -149,8 +145,10 @@ int onion_block_add_str(onion_block *b, const char *str){
 int onion_block_add_data(onion_block *bl, const char *data, size_t l){
 	// I have to perform manual realloc as if I append same block, realloc may free the data, so I do it manually.
 	char *manualrealloc=NULL;
-	if (bl->size+l>bl->maxsize){
+	if (bl->size+l>bl->maxsize){ // At least doubles, not to copy all on each small append
 		int grow=l;
+		if (grow<bl->maxsize)
+			grow=bl->maxsize;
 		if (grow<ONION_BLOCK_GROW_MIN_BLOCK)
 			grow=ONION_BLOCK_GROW_MIN_BLOCK;
 		bl->maxsize=bl->size+grow;
@@ -174,3 +172,254 @@ int onion_block_add_block(onion_block *b, onion_block *toadd){
 	return onion_block_add_data(b, toadd->data, toadd->size);
 }
 
+
+/// @{ @name Ropes, blocks as a list of segments
+
+/**
+ * @short Creates a new rope, empty. Segments are allocated as data is added.
+ * @memberof onion_rope_t
+ */
+onion_rope *onion_rope_new(){
+	onion_rope *ret=calloc(1, sizeof(onion_rope));
+	return ret;
+}
+
+/**
+ * @short Frees the rope and all its segments
+ * @memberof onion_rope_t
+ */
+void onion_rope_free(onion_rope *r){
+	int i;
+	for (i=0;i<r->allocated;i++)
+		free(r->segments[i].iov_base);
+	free(r->segments);
+	free(r);
+}
+
+/**
+ * @short Discards all the data. The segments are kept, to be reused.
+ * @memberof onion_rope_t
+ */
+void onion_rope_clear(onion_rope *r){
+	int i;
+	for (i=0;i<r->count;i++)
+		r->segments[i].iov_len=0;
+	r->count=0;
+	r->size=0;
+}
+
+/**
+ * @short Returns the size of all the data
+ * @memberof onion_rope_t
+ */
+off_t onion_rope_size(const onion_rope *r){
+	return r->size;
+}
+
+/**
+ * @short Returns the data as iovecs, to write it with writev as is. Sets count to the number of them.
+ * @memberof onion_rope_t
+ * 
+ * It is valid until the rope is modified.
+ */
+const struct iovec *onion_rope_iovec(const onion_rope *r, int *count){
+	*count=r->count;
+	return r->segments;
+}
+
+/**
+ * @short Copies up to size bytes of the data to dest, contiguous.
+ * @memberof onion_rope_t
+ * 
+ * It is not \0 ended.
+ * 
+ * @returns The copied bytes.
+ */
+size_t onion_rope_copy(const onion_rope *r, char *dest, size_t size){
+	size_t w=0;
+	int i;
+	for (i=0;i<r->count && w<size;i++){
+		size_t l=r->segments[i].iov_len;
+		if (l>size-w)
+			l=size-w;
+		memcpy(dest+w, r->segments[i].iov_base, l);
+		w+=l;
+	}
+	return w;
+}
+
+/// Makes the next segment current, allocating it if needed. Returns 0 on allocation failure.
+static int onion_rope_next_segment(onion_rope *r){
+	if (r->count<r->allocated){ // Kept from before a clear
+		r->count++;
+		return 1;
+	}
+	if (r->allocated%16==0){ // The segment list itself grows in steps; it is small, only pointers.
+		struct iovec *segments=realloc(r->segments, sizeof(struct iovec)*(r->allocated+16));
+		if (!segments)
+			return 0;
+		r->segments=segments;
+	}
+	char *data=malloc(ONION_ROPE_SEGMENT_SIZE);
+	if (!data){
+		ONION_ERROR("Could not allocate a new rope segment");
+		return 0;
+	}
+	r->segments[r->allocated].iov_base=data;
+	r->segments[r->allocated].iov_len=0;
+	r->allocated++;
+	r->count++;
+	return 1;
+}
+
+/**
+ * @short Adds raw data to the rope, filling the last segment, and then new ones.
+ * @memberof onion_rope_t
+ * 
+ * The data already there is not moved.
+ * 
+ * @returns The added bytes, less than length only if out of memory.
+ */
+int onion_rope_add_data(onion_rope *r, const char *data, size_t length){
+	size_t w=0;
+	while (w<length){
+		struct iovec *last=r->count ? &r->segments[r->count-1] : NULL;
+		if (!last || last->iov_len==ONION_ROPE_SEGMENT_SIZE){
+			if (!onion_rope_next_segment(r))
+				break;
+			continue;
+		}
+		size_t l=ONION_ROPE_SEGMENT_SIZE-last->iov_len;
+		if (l>length-w)
+			l=length-w;
+		memcpy((char*)last->iov_base+last->iov_len, data+w, l);
+		last->iov_len+=l;
+		w+=l;
+	}
+	r->size+=w;
+	return w;
+}
+
+/**
+ * @short Adds a character to the rope
+ * @memberof onion_rope_t
+ */
+int onion_rope_add_char(onion_rope *r, char c){
+	if (r->count && r->segments[r->count-1].iov_len<ONION_ROPE_SEGMENT_SIZE){
+		struct iovec *last=&r->segments[r->count-1];
+		((char*)last->iov_base)[last->iov_len++]=c;
+		r->size++;
+		return 1;
+	}
+	return onion_rope_add_data(r, &c, 1);
+}
+
+/**
+ * @short Adds a string to the rope, without the ending \0.
+ * @memberof onion_rope_t
+ */
+int onion_rope_add_str(onion_rope *r, const char *str){
+	return onion_rope_add_data(r, str, strlen(str));
+}
+
+/**
+ * @short Adds the data of a block to the rope
+ * @memberof onion_rope_t
+ */
+int onion_rope_add_block(onion_rope *r, const onion_block *toadd){
+	return onion_rope_add_data(r, toadd->data, toadd->size);
+}
+
+/// @}
+
+/// @{ @name Shared buffers
+
+/**
+ * @short Wraps data owned elsewhere, without copying it, with one reference.
+ * @memberof onion_shared_buffer_t
+ * 
+ * As the last reference is dropped, free_cb is called with the data, as free, or nothing if NULL, for data
+ * that lives as long as the program. The data must not change meanwhile.
+ */
+onion_shared_buffer *onion_shared_buffer_new(const char *data, size_t size, void (*free_cb)(void *data)){
+	onion_shared_buffer *ret=malloc(sizeof(onion_shared_buffer));
+	ret->data=data;
+	ret->size=size;
+	ret->free_cb=free_cb;
+	ret->free_data=(void*)data;
+	ret->refcount=1;
+	return ret;
+}
+
+/// Frees the block of a shared buffer.
+static void onion_shared_buffer_block_free(void *block){
+	onion_block_free(block);
+}
+
+/**
+ * @short Wraps the data of the block, and takes the block, that is freed as the last reference is dropped.
+ * @memberof onion_shared_buffer_t
+ */
+onion_shared_buffer *onion_shared_buffer_new_block(onion_block *block){
+	onion_shared_buffer *ret=onion_shared_buffer_new(block->data, block->size, NULL);
+	ret->free_cb=onion_shared_buffer_block_free;
+	ret->free_data=block;
+	return ret;
+}
+
+/**
+ * @short Copies the data to a new shared buffer, at the same allocation.
+ * @memberof onion_shared_buffer_t
+ */
+onion_shared_buffer *onion_shared_buffer_copy(const char *data, size_t size){
+	onion_shared_buffer *ret=malloc(sizeof(onion_shared_buffer)+size);
+	char *copy=(char*)(ret+1);
+	memcpy(copy, data, size);
+	ret->data=copy;
+	ret->size=size;
+	ret->free_cb=NULL;
+	ret->free_data=NULL;
+	ret->refcount=1;
+	return ret;
+}
+
+/**
+ * @short Adds a reference, from any thread.
+ * @memberof onion_shared_buffer_t
+ * 
+ * @returns The same buffer
+ */
+onion_shared_buffer *onion_shared_buffer_ref(onion_shared_buffer *b){
+	__atomic_add_fetch(&b->refcount, 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+/**
+ * @short Drops a reference, from any thread, and frees the buffer and releases its data at the last one.
+ * @memberof onion_shared_buffer_t
+ */
+void onion_shared_buffer_unref(onion_shared_buffer *b){
+	if (__atomic_sub_fetch(&b->refcount, 1, __ATOMIC_ACQ_REL)>0)
+		return;
+	if (b->free_cb)
+		b->free_cb(b->free_data);
+	free(b);
+}
+
+/**
+ * @short Returns the data
+ * @memberof onion_shared_buffer_t
+ */
+const char *onion_shared_buffer_data(const onion_shared_buffer *b){
+	return b->data;
+}
+
+/**
+ * @short Returns the size of the data
+ * @memberof onion_shared_buffer_t
+ */
+size_t onion_shared_buffer_size(const onion_shared_buffer *b){
+	return b->size;
+}
+
+/// @}
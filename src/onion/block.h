@@ -33,6 +33,7 @@ extern "C"{
 #include "types.h"
 #include <stddef.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 onion_block *onion_block_new();
 void onion_block_free(onion_block *b);
@@ -49,6 +50,31 @@ int onion_block_add_str(onion_block *b, const char *str);
 int onion_block_add_data(onion_block *b, const char *data, size_t length);
 int onion_block_add_block(onion_block *b, onion_block *toadd);
 
+/// Size of each onion_rope segment
+#define ONION_ROPE_SEGMENT_SIZE 4096
+
+onion_rope *onion_rope_new();
+void onion_rope_free(onion_rope *r);
+void onion_rope_clear(onion_rope *r);
+
+off_t onion_rope_size(const onion_rope *r);
+const struct iovec *onion_rope_iovec(const onion_rope *r, int *count);
+size_t onion_rope_copy(const onion_rope *r, char *dest, size_t size);
+
+int onion_rope_add_char(onion_rope *r, char c);
+int onion_rope_add_str(onion_rope *r, const char *str);
+int onion_rope_add_data(onion_rope *r, const char *data, size_t length);
+int onion_rope_add_block(onion_rope *r, const onion_block *toadd);
+
+onion_shared_buffer *onion_shared_buffer_new(const char *data, size_t size, void (*free_cb)(void *data));
+onion_shared_buffer *onion_shared_buffer_new_block(onion_block *block);
+onion_shared_buffer *onion_shared_buffer_copy(const char *data, size_t size);
+onion_shared_buffer *onion_shared_buffer_ref(onion_shared_buffer *b);
+void onion_shared_buffer_unref(onion_shared_buffer *b);
+
+const char *onion_shared_buffer_data(const onion_shared_buffer *b);
+size_t onion_shared_buffer_size(const onion_shared_buffer *b);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,1094 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* memmem */
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef HAVE_GNUTLS
+#include <gnutls/gnutls.h>
+#endif
+
+#include "client.h"
+#include "poller.h"
+#include "block.h"
+#include "dict.h"
+#include "log.h"
+
+/// Bytes read at a time. Also the maximum size of the response headers.
+#define ONION_CLIENT_BUFFER_SIZE 16384
+
+/// A kept alive connection, waiting for the next call to its host.
+typedef struct onion_client_idle_t{
+	int fd;
+#ifdef HAVE_GNUTLS
+	gnutls_session_t tls;
+#endif
+	int64_t since;
+}onion_client_idle;
+
+/// A host the client called, with its address, resolved once, and its idle connections, the last one at the end.
+typedef struct onion_client_host_t{
+	struct onion_client_host_t *next;
+	char *host;
+	char *port;
+	int tls;
+	struct addrinfo *addr;
+	onion_client_idle *idle;
+	int nidle;
+}onion_client_host;
+
+struct onion_client_t{
+	pthread_mutex_t mutex;     ///< For the hosts and their idle connections
+	onion_client_host *hosts;
+	int max_idle;
+	int idle_timeout_ms;
+	int timeout_ms;
+#ifdef HAVE_GNUTLS
+	gnutls_certificate_credentials_t cred;
+#endif
+};
+
+/// Where the call is at. On a kept alive connection it starts at ONION_CLIENT_SENDING.
+enum onion_client_state_e{
+	ONION_CLIENT_CONNECTING=0,
+	ONION_CLIENT_HANDSHAKE=1,
+	ONION_CLIENT_SENDING=2,
+	ONION_CLIENT_HEADERS=3,
+	ONION_CLIENT_BODY=4,
+};
+
+/// How the end of the response body is known.
+enum onion_client_body_e{
+	ONION_CLIENT_BODY_NONE=0,
+	ONION_CLIENT_BODY_LENGTH=1,
+	ONION_CLIENT_BODY_CHUNKED=2,
+	ONION_CLIENT_BODY_CLOSE=3,
+};
+
+/// Where the chunked decoder is at.
+enum onion_client_chunk_e{
+	ONION_CLIENT_CHUNK_SIZE=0,
+	ONION_CLIENT_CHUNK_DATA=1,
+	ONION_CLIENT_CHUNK_DATA_END=2,
+	ONION_CLIENT_CHUNK_TRAILER=3,
+	ONION_CLIENT_CHUNK_DONE=4,
+};
+
+/// How it ended. Timeout is 0, as it is what it is when the poller ends it.
+enum onion_client_result_e{
+	ONION_CLIENT_TIMEOUT=0,
+	ONION_CLIENT_DONE=1,
+	ONION_CLIENT_FAILED=2,
+	ONION_CLIENT_RETRY=3,
+};
+
+/// Returned by the steps when the call is over, with the result set.
+#define ONION_CLIENT_STEP_END 0
+
+struct onion_client_call_t{
+	onion_client *client;
+	onion_client_host *host;
+	char *method;
+	char *host_name;    ///< As for getaddrinfo, without the [] of IPv6 addresses
+	char *authority;    ///< As at the URL, for the Host header
+	char *port;
+	char *path;         ///< With the query
+	int tls;
+	onion_block *headers;
+	int has_host;
+	char *body;
+	size_t body_size;
+
+	onion_client_callback callback;
+	void *data;
+	onion_poller *poller;
+	onion_poller_slot *slot;
+
+	int fd;
+#ifdef HAVE_GNUTLS
+	gnutls_session_t session;
+#endif
+	int want;           ///< O_POLL_READ or O_POLL_WRITE, at the last EAGAIN
+	int state;
+	int result;
+	int reused;         ///< The connection was kept alive, so the host may have closed it already.
+	int fresh;          ///< Do not take a kept alive connection
+	int keep;           ///< The connection can take another request after this one
+	onion_block *out;
+	size_t out_pos;
+	size_t received;
+
+	int code;
+	onion_dict *response_headers;
+	onion_block *response_body;
+	int body_type;
+	int64_t left;       ///< Of the body, or of the chunk
+	int chunk;
+	char chunk_line[64];
+	int chunk_line_length;
+
+	char buffer[ONION_CLIENT_BUFFER_SIZE];
+	size_t buffer_pos;
+	size_t buffer_length;
+	char error[128];
+};
+
+static int onion_client_call_connect(onion_client_call *call);
+static void onion_client_call_finish(onion_client_call *call);
+
+static int64_t onion_client_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+/// Whether the header value, of that length, has the token, as "close" at the Connection header.
+static int onion_client_has_token(const char *value, size_t length, const char *token){
+	size_t l=strlen(token);
+	size_t i;
+	for (i=0;i+l<=length;i++){
+		if (strncasecmp(&value[i], token, l)==0)
+			return 1;
+	}
+	return 0;
+}
+
+/// @{ @name Hosts, and their idle connections
+
+/// Closes a connection, saying bye first on TLS, if it can without waiting.
+static void onion_client_close(int fd, void *tls){
+#ifdef HAVE_GNUTLS
+	if (tls){
+		gnutls_bye((gnutls_session_t)tls, GNUTLS_SHUT_WR);
+		gnutls_deinit((gnutls_session_t)tls);
+	}
+#endif
+	close(fd);
+}
+
+static onion_client_host *onion_client_host_find(onion_client *client, const char *host, const char *port, int tls){
+	onion_client_host *h;
+	for (h=client->hosts;h;h=h->next){
+		if (h->tls==tls && strcasecmp(h->host, host)==0 && strcmp(h->port, port)==0)
+			return h;
+	}
+	return NULL;
+}
+
+/// The host of the call, resolving it the first time. NULL, with the error set, if it can not be resolved.
+static onion_client_host *onion_client_host_get(onion_client_call *call){
+	onion_client *client=call->client;
+	pthread_mutex_lock(&client->mutex);
+	onion_client_host *h=onion_client_host_find(client, call->host_name, call->port, call->tls);
+	pthread_mutex_unlock(&client->mutex);
+	if (h)
+		return h;
+
+	struct addrinfo hints;
+	struct addrinfo *addr;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	int r=getaddrinfo(call->host_name, call->port, &hints, &addr);
+	if (r!=0){
+		snprintf(call->error, sizeof(call->error), "Could not resolve %s: %s", call->host_name, gai_strerror(r));
+		return NULL;
+	}
+
+	pthread_mutex_lock(&client->mutex);
+	h=onion_client_host_find(client, call->host_name, call->port, call->tls);
+	if (!h){
+		h=calloc(1, sizeof(onion_client_host));
+		h->host=strdup(call->host_name);
+		h->port=strdup(call->port);
+		h->tls=call->tls;
+		h->addr=addr;
+		h->idle=malloc(sizeof(onion_client_idle)*(client->max_idle ? client->max_idle : 1));
+		h->next=client->hosts;
+		client->hosts=h;
+		addr=NULL;
+	}
+	pthread_mutex_unlock(&client->mutex);
+	if (addr) // Resolved at the same time by another call
+		freeaddrinfo(addr);
+	return h;
+}
+
+/// Takes the most recently used idle connection that is still open, if any, for the call.
+static void onion_client_pool_get(onion_client_call *call){
+	onion_client *client=call->client;
+	onion_client_host *h=call->host;
+	int64_t now=onion_client_now();
+	pthread_mutex_lock(&client->mutex);
+	while (h->nidle && call->fd<0){
+		onion_client_idle *idle=&h->idle[--h->nidle];
+		void *tls=NULL;
+#ifdef HAVE_GNUTLS
+		tls=idle->tls;
+#endif
+		char c;
+		if (now-idle->since>=client->idle_timeout_ms || recv(idle->fd, &c, 1, MSG_PEEK|MSG_DONTWAIT)>=0 ||
+				(errno!=EAGAIN && errno!=EWOULDBLOCK)){ // Expired, closed by the host, or with unexpected data
+			onion_client_close(idle->fd, tls);
+			continue;
+		}
+		call->fd=idle->fd;
+#ifdef HAVE_GNUTLS
+		call->session=idle->tls;
+#endif
+	}
+	pthread_mutex_unlock(&client->mutex);
+}
+
+/// Keeps the connection of the call for later calls, or closes it if there are enough.
+static void onion_client_pool_put(onion_client_call *call){
+	onion_client *client=call->client;
+	onion_client_host *h=call->host;
+	void *tls=NULL;
+#ifdef HAVE_GNUTLS
+	tls=call->session;
+	call->session=NULL;
+#endif
+	int fd=call->fd;
+	call->fd=-1;
+	pthread_mutex_lock(&client->mutex);
+	if (h->nidle<client->max_idle){
+		onion_client_idle *idle=&h->idle[h->nidle++];
+		idle->fd=fd;
+#ifdef HAVE_GNUTLS
+		idle->tls=tls;
+#endif
+		idle->since=onion_client_now();
+		fd=-1;
+	}
+	pthread_mutex_unlock(&client->mutex);
+	if (fd>=0)
+		onion_client_close(fd, tls);
+}
+
+/// @}
+
+/// @{ @name Connection I/O, plain or TLS
+
+/// Sends what it can. On EAGAIN, want says what to wait for.
+static ssize_t onion_client_call_io_send(onion_client_call *call, const char *data, size_t length){
+#ifdef HAVE_GNUTLS
+	if (call->session){
+		ssize_t r=gnutls_record_send(call->session, data, length);
+		if (r==GNUTLS_E_AGAIN || r==GNUTLS_E_INTERRUPTED){
+			call->want=gnutls_record_get_direction(call->session) ? O_POLL_WRITE : O_POLL_READ;
+			errno=EAGAIN;
+			return -1;
+		}
+		if (r<0){
+			snprintf(call->error, sizeof(call->error), "%s", gnutls_strerror(r));
+			errno=EPROTO;
+			return -1;
+		}
+		return r;
+	}
+#endif
+	call->want=O_POLL_WRITE;
+	return send(call->fd, data, length, MSG_NOSIGNAL);
+}
+
+/// Receives what there is, 0 at the end. On EAGAIN, want says what to wait for.
+static ssize_t onion_client_call_io_recv(onion_client_call *call, char *data, size_t length){
+#ifdef HAVE_GNUTLS
+	if (call->session){
+		ssize_t r=gnutls_record_recv(call->session, data, length);
+		if (r==GNUTLS_E_AGAIN || r==GNUTLS_E_INTERRUPTED){
+			call->want=gnutls_record_get_direction(call->session) ? O_POLL_WRITE : O_POLL_READ;
+			errno=EAGAIN;
+			return -1;
+		}
+		if (r==GNUTLS_E_PREMATURE_TERMINATION) // Closed without bye, as many servers do
+			return 0;
+		if (r<0){
+			snprintf(call->error, sizeof(call->error), "%s", gnutls_strerror(r));
+			errno=EPROTO;
+			return -1;
+		}
+		return r;
+	}
+#endif
+	call->want=O_POLL_READ;
+	return recv(call->fd, data, length, 0);
+}
+
+/// @}
+
+/// @{ @name The exchange
+
+/**
+ * @short The connection failed: sets the error, and if nothing came back on a kept alive connection, sends it again.
+ *
+ * The host may have closed it while idle; then, unless it is a POST or PATCH, which may have been processed,
+ * it goes again on a new one.
+ */
+static int onion_client_call_failed(onion_client_call *call, int error){
+	if (call->received==0 && call->reused && call->state<ONION_CLIENT_BODY &&
+			strcmp(call->method, "POST")!=0 && strcmp(call->method, "PATCH")!=0){
+		call->result=ONION_CLIENT_RETRY;
+		return ONION_CLIENT_STEP_END;
+	}
+	call->result=ONION_CLIENT_FAILED;
+	if (!call->error[0]){
+		if (error)
+			snprintf(call->error, sizeof(call->error), "%s", strerror(error));
+		else
+			snprintf(call->error, sizeof(call->error), "Connection closed");
+	}
+	return ONION_CLIENT_STEP_END;
+}
+
+/// Fails the call with that error.
+static int onion_client_call_error(onion_client_call *call, const char *error){
+	snprintf(call->error, sizeof(call->error), "%s", error);
+	call->result=ONION_CLIENT_FAILED;
+	return ONION_CLIENT_STEP_END;
+}
+
+/// Sends the request. 0 when done, or what to wait for.
+static int onion_client_call_send(onion_client_call *call){
+	const char *data=onion_block_data(call->out);
+	size_t size=onion_block_size(call->out);
+	while (call->out_pos<size){
+		ssize_t w=onion_client_call_io_send(call, &data[call->out_pos], size-call->out_pos);
+		if (w<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+			return call->want;
+		if (w<0)
+			return onion_client_call_failed(call, errno);
+		call->out_pos+=w;
+	}
+	return 0;
+}
+
+/**
+ * @short Parses the response head at the buffer: code, headers, and how the body ends.
+ *
+ * @returns 0 if done, 1 if it was an interim 1xx response, and the real one follows, or -1 if invalid.
+ */
+static int onion_client_call_parse_head(onion_client_call *call, char *end){
+	char *p=call->buffer;
+	if (end-p<12 || strncmp(p, "HTTP/1.", 7)!=0)
+		return -1;
+	int http11=(p[7]=='1');
+	int code=atoi(&p[9]);
+	if (code<100 || code>999)
+		return -1;
+	call->buffer_pos=end+4-call->buffer;
+	if (code<200){
+		memmove(call->buffer, &call->buffer[call->buffer_pos], call->buffer_length-call->buffer_pos);
+		call->buffer_length-=call->buffer_pos;
+		call->buffer_pos=0;
+		return 1;
+	}
+
+	int keep=http11, chunked=0;
+	int64_t length=-1;
+	p=(char*)memchr(p, '\n', end+2-p)+1;
+	while (p<end+2){ // The head is consumed, so keys and values are 0 terminated in place.
+		char *eol=memchr(p, '\n', end+2-p);
+		char *line_end=(eol>p && eol[-1]=='\r') ? eol-1 : eol;
+		char *colon=memchr(p, ':', line_end-p);
+		if (colon){
+			char *value=colon+1;
+			while (value<line_end && (*value==' ' || *value=='\t'))
+				value++;
+			size_t value_length=line_end-value;
+			*colon='\0';
+			*line_end='\0';
+			if (strcasecmp(p, "Content-Length")==0)
+				length=strtoll(value, NULL, 10);
+			else if (strcasecmp(p, "Transfer-Encoding")==0)
+				chunked=onion_client_has_token(value, value_length, "chunked");
+			else if (strcasecmp(p, "Connection")==0){
+				if (onion_client_has_token(value, value_length, "close"))
+					keep=0;
+				else if (onion_client_has_token(value, value_length, "keep-alive"))
+					keep=1;
+			}
+			onion_dict_add(call->response_headers, p, value, OD_DUP_ALL);
+		}
+		p=eol+1;
+	}
+
+	call->code=code;
+	if (strcmp(call->method, "HEAD")==0 || code==204 || code==304)
+		call->body_type=ONION_CLIENT_BODY_NONE;
+	else if (chunked){
+		call->body_type=ONION_CLIENT_BODY_CHUNKED;
+		call->chunk=ONION_CLIENT_CHUNK_SIZE;
+		call->chunk_line_length=0;
+	}
+	else if (length>=0){
+		call->body_type=ONION_CLIENT_BODY_LENGTH;
+		call->left=length;
+		if (length<INT32_MAX)
+			onion_block_min_maxsize(call->response_body, length+1);
+	}
+	else{
+		call->body_type=ONION_CLIENT_BODY_CLOSE;
+		keep=0;
+	}
+	call->keep=keep;
+	return 0;
+}
+
+/// Reads the response head. 0 when done, or what to wait for.
+static int onion_client_call_headers(onion_client_call *call){
+	for(;;){
+		char *end=memmem(call->buffer, call->buffer_length, "\r\n\r\n", 4);
+		if (end){
+			int r=onion_client_call_parse_head(call, end);
+			if (r==0)
+				return 0;
+			if (r>0)
+				continue;
+			return onion_client_call_error(call, "Invalid response");
+		}
+		if (call->buffer_length==sizeof(call->buffer))
+			return onion_client_call_error(call, "Response headers too long");
+		ssize_t r=onion_client_call_io_recv(call, &call->buffer[call->buffer_length], sizeof(call->buffer)-call->buffer_length);
+		if (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+			return call->want;
+		if (r<=0)
+			return onion_client_call_failed(call, r<0 ? errno : 0);
+		call->received+=r;
+		call->buffer_length+=r;
+	}
+}
+
+/// Decodes the chunked body into the response body. Returns the bytes used, or -1 on error.
+static ssize_t onion_client_call_chunked(onion_client_call *call, const char *data, size_t length){
+	size_t pos=0;
+	while (pos<length && call->chunk!=ONION_CLIENT_CHUNK_DONE){
+		if (call->chunk==ONION_CLIENT_CHUNK_DATA){
+			size_t n=length-pos;
+			if ((int64_t)n>call->left)
+				n=call->left;
+			onion_block_add_data(call->response_body, &data[pos], n);
+			pos+=n;
+			call->left-=n;
+			if (!call->left)
+				call->chunk=ONION_CLIENT_CHUNK_DATA_END;
+			continue;
+		}
+		char c=data[pos++]; // The rest are lines
+		if (c=='\r')
+			continue;
+		if (c!='\n'){
+			if (call->chunk_line_length<(int)sizeof(call->chunk_line)-1) // The rest of long ones are extensions, or trailers
+				call->chunk_line[call->chunk_line_length++]=c;
+			continue;
+		}
+		call->chunk_line[call->chunk_line_length]='\0';
+		if (call->chunk==ONION_CLIENT_CHUNK_SIZE){
+			char *end;
+			call->left=strtoll(call->chunk_line, &end, 16);
+			if (end==call->chunk_line || call->left<0)
+				return -1;
+			call->chunk=call->left ? ONION_CLIENT_CHUNK_DATA : ONION_CLIENT_CHUNK_TRAILER;
+		}
+		else if (call->chunk==ONION_CLIENT_CHUNK_DATA_END)
+			call->chunk=ONION_CLIENT_CHUNK_SIZE;
+		else if (call->chunk_line_length==0) // Empty line after the trailers
+			call->chunk=ONION_CLIENT_CHUNK_DONE;
+		call->chunk_line_length=0;
+	}
+	return pos;
+}
+
+/// Adds the body data to the response body, up to its end. Returns the bytes used, or -1 on error.
+static ssize_t onion_client_call_add_body(onion_client_call *call, const char *data, size_t length){
+	switch(call->body_type){
+		case ONION_CLIENT_BODY_LENGTH:
+			if ((int64_t)length>call->left)
+				length=call->left;
+			call->left-=length;
+			break;
+		case ONION_CLIENT_BODY_CHUNKED:
+			return onion_client_call_chunked(call, data, length);
+		case ONION_CLIENT_BODY_CLOSE:
+			break;
+		default:
+			return 0;
+	}
+	onion_block_add_data(call->response_body, data, length);
+	return length;
+}
+
+/// Reads the response body. What to wait for, or ONION_CLIENT_STEP_END when done.
+static int onion_client_call_body(onion_client_call *call){
+	for(;;){
+		if (call->buffer_pos<call->buffer_length){ // Already read
+			ssize_t used=onion_client_call_add_body(call, &call->buffer[call->buffer_pos], call->buffer_length-call->buffer_pos);
+			if (used<0)
+				return onion_client_call_error(call, "Invalid chunked body");
+			call->buffer_pos+=used;
+			if (call->buffer_pos<call->buffer_length){ // After the body; the connection is not clean.
+				call->keep=0;
+				call->buffer_pos=call->buffer_length;
+			}
+			continue;
+		}
+		if (call->body_type==ONION_CLIENT_BODY_NONE || (call->body_type==ONION_CLIENT_BODY_LENGTH && call->left==0) ||
+				(call->body_type==ONION_CLIENT_BODY_CHUNKED && call->chunk==ONION_CLIENT_CHUNK_DONE)){
+			call->result=ONION_CLIENT_DONE;
+			return ONION_CLIENT_STEP_END;
+		}
+		call->buffer_pos=call->buffer_length=0;
+		size_t l=sizeof(call->buffer);
+		if (call->body_type==ONION_CLIENT_BODY_LENGTH && call->left<(int64_t)l)
+			l=call->left;
+		ssize_t n=onion_client_call_io_recv(call, call->buffer, l);
+		if (n>0){
+			call->buffer_length=n;
+			call->received+=n;
+			continue;
+		}
+		if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+			return call->want;
+		if (n==0 && call->body_type==ONION_CLIENT_BODY_CLOSE){
+			call->result=ONION_CLIENT_DONE;
+			return ONION_CLIENT_STEP_END;
+		}
+		return onion_client_call_failed(call, n<0 ? errno : 0);
+	}
+}
+
+/// Goes on as far as possible without waiting. Returns what to wait for, or ONION_CLIENT_STEP_END with the result set.
+static int onion_client_call_step(onion_client_call *call){
+	int r;
+	switch(call->state){
+		case ONION_CLIENT_CONNECTING:{
+			int error=0;
+			socklen_t l=sizeof(error);
+			if (getsockopt(call->fd, SOL_SOCKET, SO_ERROR, &error, &l)<0)
+				error=errno;
+			if (error)
+				return onion_client_call_failed(call, error);
+			call->state=ONION_CLIENT_HANDSHAKE;
+		}
+		// fallthrough
+		case ONION_CLIENT_HANDSHAKE:
+#ifdef HAVE_GNUTLS
+			if (call->session){
+				r=gnutls_handshake(call->session);
+				if (r<0 && !gnutls_error_is_fatal(r))
+					return gnutls_record_get_direction(call->session) ? O_POLL_WRITE : O_POLL_READ;
+				if (r<0)
+					return onion_client_call_error(call, gnutls_strerror(r));
+			}
+#endif
+			call->state=ONION_CLIENT_SENDING;
+		// fallthrough
+		case ONION_CLIENT_SENDING:
+			if ( (r=onion_client_call_send(call)) || call->result!=ONION_CLIENT_TIMEOUT)
+				return r;
+			call->state=ONION_CLIENT_HEADERS;
+		// fallthrough
+		case ONION_CLIENT_HEADERS:
+			if ( (r=onion_client_call_headers(call)) || call->result!=ONION_CLIENT_TIMEOUT)
+				return r;
+			call->state=ONION_CLIENT_BODY;
+		// fallthrough
+		default:
+			return onion_client_call_body(call);
+	}
+}
+
+/**
+ * @short The connection is done with: kept alive if clean, or closed.
+ *
+ * @returns 1 if the request was sent again, on a new connection.
+ */
+static int onion_client_call_end(onion_client_call *call){
+	if (call->fd>=0){
+		if (call->result==ONION_CLIENT_DONE && call->keep)
+			onion_client_pool_put(call);
+		else{
+			void *tls=NULL;
+#ifdef HAVE_GNUTLS
+			tls=call->session;
+			call->session=NULL;
+#endif
+			onion_client_close(call->fd, tls);
+			call->fd=-1;
+		}
+	}
+	call->slot=NULL;
+	if (call->result==ONION_CLIENT_RETRY){
+		call->fresh=1;
+		if (onion_client_call_connect(call)==0)
+			return 1;
+		call->result=ONION_CLIENT_FAILED;
+	}
+	return 0;
+}
+
+/// @}
+
+/// @{ @name At the poller
+
+/// The connection is ready.
+static int onion_client_call_ready(onion_client_call *call){
+	int r=onion_client_call_step(call);
+	if (r==ONION_CLIENT_STEP_END)
+		return -1; // Ends at the shutdown
+	onion_poller_slot_set_type(call->slot, r|O_POLL_OTHER);
+	return 0;
+}
+
+/// The slot is removed: done, failed, or timed out if the result was not set.
+static void onion_client_call_shutdown(onion_client_call *call){
+	if (onion_client_call_end(call))
+		return;
+	onion_client_call_finish(call);
+}
+
+/// @}
+
+/**
+ * @short Connects to the host, or takes a kept alive connection, and starts sending.
+ *
+ * At a poller the connection gets a slot, and all goes on there.
+ *
+ * @returns 0 if on its way, -1 with the error set if the connection could not be started.
+ */
+static int onion_client_call_connect(onion_client_call *call){
+	onion_client_host *h=call->host;
+	call->fd=-1;
+	call->reused=0;
+	if (!call->fresh)
+		onion_client_pool_get(call);
+	if (call->fd>=0){
+		call->reused=1;
+		call->state=ONION_CLIENT_SENDING;
+	}
+	else{
+		struct addrinfo *a=h->addr;
+		call->fd=socket(a->ai_family, a->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC, a->ai_protocol);
+		if (call->fd<0){
+			onion_client_call_failed(call, errno);
+			return -1;
+		}
+		int one=1;
+		setsockopt(call->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (connect(call->fd, a->ai_addr, a->ai_addrlen)<0 && errno!=EINPROGRESS){
+			onion_client_call_failed(call, errno);
+			close(call->fd);
+			call->fd=-1;
+			return -1;
+		}
+#ifdef HAVE_GNUTLS
+		if (call->tls){
+			gnutls_init(&call->session, GNUTLS_CLIENT|GNUTLS_NONBLOCK);
+			gnutls_set_default_priority(call->session);
+			gnutls_credentials_set(call->session, GNUTLS_CRD_CERTIFICATE, call->client->cred);
+			gnutls_server_name_set(call->session, GNUTLS_NAME_DNS, call->host_name, strlen(call->host_name));
+			gnutls_session_set_verify_cert(call->session, call->host_name, 0);
+			gnutls_transport_set_int(call->session, call->fd);
+		}
+#endif
+		call->state=ONION_CLIENT_CONNECTING;
+	}
+	call->result=ONION_CLIENT_TIMEOUT;
+	call->keep=0;
+	call->out_pos=0;
+	call->received=0;
+	call->buffer_pos=call->buffer_length=0;
+	call->error[0]='\0';
+	if (call->poller){
+		call->slot=onion_poller_slot_new(call->fd, (void*)onion_client_call_ready, call);
+		onion_poller_slot_set_shutdown(call->slot, (void*)onion_client_call_shutdown, call);
+		onion_poller_slot_set_timeout(call->slot, call->client->timeout_ms);
+		onion_poller_slot_set_type(call->slot, O_POLL_WRITE|O_POLL_OTHER);
+		onion_poller_add(call->poller, call->slot); // From now on, it may be at other thread.
+	}
+	return 0;
+}
+
+/// Steps at this thread, waiting for the connection with poll.
+static void onion_client_call_wait(onion_client_call *call){
+	do{
+		int r;
+		while ( (r=onion_client_call_step(call))!=ONION_CLIENT_STEP_END ){
+			struct pollfd pfd;
+			pfd.fd=call->fd;
+			pfd.events=(r==O_POLL_READ) ? POLLIN : POLLOUT;
+			int p=poll(&pfd, 1, call->client->timeout_ms);
+			if (p==0)
+				break; // Timed out
+			if (p<0 && errno!=EINTR){
+				onion_client_call_failed(call, errno);
+				break;
+			}
+		}
+	}while (onion_client_call_end(call));
+	onion_client_call_finish(call);
+}
+
+static void onion_client_call_free(onion_client_call *call){
+	free(call->method);
+	free(call->host_name);
+	free(call->authority);
+	free(call->port);
+	free(call->path);
+	free(call->body);
+	onion_block_free(call->headers);
+	onion_block_free(call->out);
+	onion_block_free(call->response_body);
+	onion_dict_free(call->response_headers);
+	free(call);
+}
+
+/// Gives the response, or the error, to the callback, and frees the call.
+static void onion_client_call_finish(onion_client_call *call){
+	if (call->result==ONION_CLIENT_TIMEOUT)
+		snprintf(call->error, sizeof(call->error), "Timed out");
+	else if (call->result!=ONION_CLIENT_DONE && !call->error[0])
+		snprintf(call->error, sizeof(call->error), "Failed");
+	if (call->callback)
+		call->callback(call->data, call);
+	onion_client_call_free(call);
+}
+
+/**
+ * @short Parses the URL into the call: scheme, host, port, and path with the query.
+ *
+ * @returns 0 if valid.
+ */
+static int onion_client_call_parse_url(onion_client_call *call, const char *url){
+	const char *p;
+	if (strncasecmp(url, "http://", 7)==0)
+		p=url+7;
+	else if (strncasecmp(url, "https://", 8)==0){
+		p=url+8;
+		call->tls=1;
+	}
+	else
+		return -1;
+	size_t n=strcspn(p, "/?#");
+	if (n==0)
+		return -1;
+	call->authority=strndup(p, n);
+	const char *port=NULL;
+	if (call->authority[0]=='['){ // IPv6
+		char *close=strchr(call->authority, ']');
+		if (!close)
+			return -1;
+		call->host_name=strndup(call->authority+1, close-call->authority-1);
+		if (close[1]==':')
+			port=close+2;
+	}
+	else{
+		char *colon=strchr(call->authority, ':');
+		call->host_name=colon ? strndup(call->authority, colon-call->authority) : strdup(call->authority);
+		if (colon)
+			port=colon+1;
+	}
+	call->port=strdup(port && *port ? port : (call->tls ? "443" : "80"));
+
+	p+=n;
+	n=strcspn(p, "#");
+	if (*p=='/')
+		call->path=strndup(p, n);
+	else{ // Only a query, or nothing
+		call->path=malloc(n+2);
+		call->path[0]='/';
+		memcpy(call->path+1, p, n);
+		call->path[n+1]='\0';
+	}
+	return 0;
+}
+
+/// Writes the request: request line, headers and body.
+static void onion_client_call_write_request(onion_client_call *call){
+	onion_block *out=call->out;
+	onion_block_add_str(out, call->method);
+	onion_block_add_char(out, ' ');
+	onion_block_add_str(out, call->path);
+	onion_block_add_str(out, " HTTP/1.1\r\n");
+	if (!call->has_host){
+		onion_block_add_str(out, "Host: ");
+		onion_block_add_str(out, call->authority);
+		onion_block_add_str(out, "\r\n");
+	}
+	onion_block_add_block(out, call->headers);
+	if (call->body || strcmp(call->method, "POST")==0 || strcmp(call->method, "PUT")==0 || strcmp(call->method, "PATCH")==0){
+		char length[48];
+		snprintf(length, sizeof(length), "Content-Length: %zu\r\n", call->body_size);
+		onion_block_add_str(out, length);
+	}
+	onion_block_add_str(out, "\r\n");
+	if (call->body_size)
+		onion_block_add_data(out, call->body, call->body_size);
+}
+
+/**
+ * @short Creates a client
+ * @memberof onion_client_t
+ *
+ * Calls to the same host, port and scheme share their connections: when a response is over, the connection
+ * is kept for the next call, which saves the connect and the TLS handshake. Names are resolved the first
+ * time, blocking, and the address is kept.
+ */
+onion_client *onion_client_new(){
+	onion_client *client=calloc(1, sizeof(onion_client));
+	pthread_mutex_init(&client->mutex, NULL);
+	client->max_idle=16;
+	client->idle_timeout_ms=4000;
+	client->timeout_ms=30000;
+#ifdef HAVE_GNUTLS
+	gnutls_certificate_allocate_credentials(&client->cred);
+	gnutls_certificate_set_x509_system_trust(client->cred);
+#endif
+	return client;
+}
+
+/**
+ * @short Frees the client, and closes the idle connections
+ * @memberof onion_client_t
+ */
+void onion_client_free(onion_client *client){
+	while (client->hosts){
+		onion_client_host *h=client->hosts;
+		client->hosts=h->next;
+		while (h->nidle){
+			onion_client_idle *idle=&h->idle[--h->nidle];
+			void *tls=NULL;
+#ifdef HAVE_GNUTLS
+			tls=idle->tls;
+#endif
+			onion_client_close(idle->fd, tls);
+		}
+		free(h->idle);
+		freeaddrinfo(h->addr);
+		free(h->host);
+		free(h->port);
+		free(h);
+	}
+#ifdef HAVE_GNUTLS
+	gnutls_certificate_free_credentials(client->cred);
+#endif
+	pthread_mutex_destroy(&client->mutex);
+	free(client);
+}
+
+/**
+ * @short Sets how many idle connections are kept per host, and for how long
+ * @memberof onion_client_t
+ *
+ * Hosts close their idle connections after a while (5 s at onion), so the timeout should be shorter.
+ */
+void onion_client_set_pool(onion_client *client, int max_idle, int idle_timeout_ms){
+	if (max_idle<0)
+		max_idle=0;
+	pthread_mutex_lock(&client->mutex);
+	onion_client_host *h;
+	for (h=client->hosts;h;h=h->next){
+		while (h->nidle>max_idle){
+			onion_client_idle *idle=&h->idle[--h->nidle];
+			void *tls=NULL;
+#ifdef HAVE_GNUTLS
+			tls=idle->tls;
+#endif
+			onion_client_close(idle->fd, tls);
+		}
+		h->idle=realloc(h->idle, sizeof(onion_client_idle)*(max_idle ? max_idle : 1));
+	}
+	client->max_idle=max_idle;
+	client->idle_timeout_ms=idle_timeout_ms;
+	pthread_mutex_unlock(&client->mutex);
+}
+
+/**
+ * @short Sets the time without progress after which a call fails
+ * @memberof onion_client_t
+ */
+void onion_client_set_timeout(onion_client *client, int timeout_ms){
+	client->timeout_ms=timeout_ms;
+}
+
+/**
+ * @short Trusts also the certificates at that PEM file, as a private CA or a self signed one
+ * @memberof onion_client_t
+ *
+ * @returns 0 if loaded, -1 if not, or if there is no TLS support.
+ */
+int onion_client_set_ca_file(onion_client *client, const char *filename){
+#ifdef HAVE_GNUTLS
+	int r=gnutls_certificate_set_x509_trust_file(client->cred, filename, GNUTLS_X509_FMT_PEM);
+	if (r<=0){
+		ONION_ERROR("Could not load the certificates at %s: %s", filename, r<0 ? gnutls_strerror(r) : "none found");
+		return -1;
+	}
+	return 0;
+#else
+	ONION_ERROR("No TLS support, can not load %s", filename);
+	return -1;
+#endif
+}
+
+/**
+ * @short Prepares a call, to add headers and body to it before onion_client_call_start
+ * @memberof onion_client_call_t
+ *
+ * @returns The call, or NULL if the URL is not a http:// or https:// one, or there is no TLS support for it.
+ */
+onion_client_call *onion_client_call_new(onion_client *client, const char *method, const char *url){
+	onion_client_call *call=calloc(1, sizeof(onion_client_call));
+	call->client=client;
+	call->method=strdup(method);
+	call->fd=-1;
+	call->headers=onion_block_new();
+	call->out=onion_block_new();
+	call->response_body=onion_block_new();
+	call->response_headers=onion_dict_new();
+	onion_dict_set_flags(call->response_headers, OD_ICASE|OD_FLAT);
+	if (onion_client_call_parse_url(call, url)<0){
+		ONION_ERROR("Invalid URL for the client: %s", url);
+		onion_client_call_free(call);
+		return NULL;
+	}
+#ifndef HAVE_GNUTLS
+	if (call->tls){
+		ONION_ERROR("No TLS support for %s", url);
+		onion_client_call_free(call);
+		return NULL;
+	}
+#endif
+	return call;
+}
+
+/**
+ * @short Adds a header to the request
+ * @memberof onion_client_call_t
+ */
+void onion_client_call_set_header(onion_client_call *call, const char *key, const char *value){
+	if (strcasecmp(key, "Host")==0)
+		call->has_host=1;
+	onion_block_add_str(call->headers, key);
+	onion_block_add_str(call->headers, ": ");
+	onion_block_add_str(call->headers, value);
+	onion_block_add_str(call->headers, "\r\n");
+}
+
+/**
+ * @short Sets the request body, with its Content-Length
+ * @memberof onion_client_call_t
+ */
+void onion_client_call_set_body(onion_client_call *call, const char *data, size_t length){
+	free(call->body);
+	call->body=malloc(length ? length : 1);
+	memcpy(call->body, data, length);
+	call->body_size=length;
+}
+
+/**
+ * @short Does the call, and calls the callback with the response, or the error
+ * @memberof onion_client_call_t
+ *
+ * At a poller, as the one of a request (onion_request_get_poller), it does not wait: all goes on at the poller
+ * threads, and the callback is called at one of them. A handler can start several calls and return
+ * OCS_SUSPENDED, and the last callback answer and onion_request_resume the request.
+ *
+ * Without poller, it waits for the response at this thread, and calls the callback before returning.
+ *
+ * If the host closed a kept alive connection before answering, the request is sent again on a new one,
+ * unless it is a POST or PATCH.
+ */
+void onion_client_call_start(onion_client_call *call, onion_poller *poller, onion_client_callback callback, void *data){
+	call->callback=callback;
+	call->data=data;
+	call->poller=poller;
+	onion_client_call_write_request(call);
+	call->host=onion_client_host_get(call);
+	if (!call->host || onion_client_call_connect(call)<0){
+		call->result=ONION_CLIENT_FAILED;
+		onion_client_call_finish(call);
+		return;
+	}
+	if (!poller) // Else, call may be gone already
+		onion_client_call_wait(call);
+}
+
+/**
+ * @short The response code, or 0 if the call failed
+ * @memberof onion_client_call_t
+ */
+int onion_client_call_get_code(const onion_client_call *call){
+	return call->result==ONION_CLIENT_DONE ? call->code : 0;
+}
+
+/**
+ * @short Why the call failed, as "Timed out" or "Connection refused", or NULL if it did not
+ * @memberof onion_client_call_t
+ */
+const char *onion_client_call_get_error(const onion_client_call *call){
+	return call->result==ONION_CLIENT_DONE ? NULL : call->error;
+}
+
+/**
+ * @short A header of the response, case insensitive, or NULL
+ * @memberof onion_client_call_t
+ */
+const char *onion_client_call_get_header(const onion_client_call *call, const char *key){
+	return onion_dict_get(call->response_headers, key);
+}
+
+/**
+ * @short The response body, 0 terminated
+ * @memberof onion_client_call_t
+ */
+const char *onion_client_call_get_body(const onion_client_call *call){
+	return onion_block_data(call->response_body);
+}
+
+/**
+ * @short The size of the response body
+ * @memberof onion_client_call_t
+ */
+size_t onion_client_call_get_body_size(const onion_client_call *call){
+	return onion_block_size(call->response_body);
+}
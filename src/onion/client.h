@@ -0,0 +1,77 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_CLIENT_H
+#define ONION_CLIENT_H
+
+#include <stddef.h>
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/**
+ * @short Called once when the call is over, with its response or its error. The call is freed after it returns.
+ * @memberof onion_client_call_t
+ */
+typedef void (*onion_client_callback)(void *data, onion_client_call *call);
+
+/// Creates a client, that keeps idle connections to each host for later calls. Thread safe.
+onion_client *onion_client_new();
+/// Frees the client and closes its idle connections. No call may be running.
+void onion_client_free(onion_client *client);
+/// Idle connections kept per host, and for how long. By default 16 and 4000 ms. 0 connections disables keep alive.
+void onion_client_set_pool(onion_client *client, int max_idle, int idle_timeout_ms);
+/// Time without progress before a call fails as timed out. By default 30000 ms.
+void onion_client_set_timeout(onion_client *client, int timeout_ms);
+/// Also trusts the certificates at that PEM file for https. By default, the system ones. 0 if loaded.
+int onion_client_set_ca_file(onion_client *client, const char *filename);
+
+/// Prepares a call to that http:// or https:// URL. NULL if the URL is not valid.
+onion_client_call *onion_client_call_new(onion_client *client, const char *method, const char *url);
+/// Adds a header to the request. Host and Content-Length are set by the client, if not given.
+void onion_client_call_set_header(onion_client_call *call, const char *key, const char *value);
+/// Sets the body of the request. It is copied.
+void onion_client_call_set_body(onion_client_call *call, const char *data, size_t length);
+/// Does the call at the poller, or at this thread if NULL. The callback is always called, maybe before this returns.
+void onion_client_call_start(onion_client_call *call, onion_poller *poller, onion_client_callback callback, void *data);
+
+/// The response code, or 0 if there is no response. @see onion_client_call_get_error
+int onion_client_call_get_code(const onion_client_call *call);
+/// Why there is no response, or NULL if there is one.
+const char *onion_client_call_get_error(const onion_client_call *call);
+/// A response header, or NULL.
+const char *onion_client_call_get_header(const onion_client_call *call, const char *key);
+/// The response body, always 0 terminated.
+const char *onion_client_call_get_body(const onion_client_call *call);
+/// Size of the response body.
+size_t onion_client_call_get_body_size(const onion_client_call *call);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
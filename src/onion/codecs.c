@@ -27,13 +27,11 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdio.h>
-#ifdef HAVE_GNUTLS
-#include <gnutls/gnutls.h>
-#include <gnutls/crypto.h>
-#endif
+#include <stdint.h>
 
 #include "log.h"
 #include "codecs.h"
+#include "hash.h"
 
 /// Decode table. Its the inverse of the code table. (cb64).
 static const char db64[]={ // 16 bytes each line, 8 lines. Only 128 registers
@@ -59,258 +57,671 @@ void printf_bin(const char c, int n){
 	fprintf(stderr, " ");
 }
 
+/// @{ @name Base64, with SIMD kernels for the bulk and the scalar code for the rest.
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define ONION_BASE64_X86
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define ONION_BASE64_NEON
+#endif
+
+/// Encodes the largest prefix it can of n bytes, a multiple of 3, and returns its length.
+typedef size_t (*onion_base64_encode_kernel)(const unsigned char *in, size_t n, char *out);
+/// Decodes the prefix of n chars that has only base64 chars, in blocks. Returns the chars used; 3/4 of them are written.
+typedef size_t (*onion_base64_decode_kernel)(const unsigned char *in, size_t n, unsigned char *out);
+
+#ifdef ONION_BASE64_X86
+// Algorithms from W. Muła and D. Lemire, "Faster Base64 Encoding and Decoding Using AVX2 Instructions".
+
+/// Moves each 6 bits of 3 bytes to its own byte. Input shuffled so each 32 bits have the 3 bytes as b1,b0,b2,b1.
+__attribute__((target("ssse3")))
+static inline __m128i onion_base64_split_ssse3(__m128i v){
+	__m128i t0=_mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+	__m128i t1=_mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(t0, t1);
+}
+
+/// Index 0-63 to its char: an offset by range, looked up with a shuffle.
+__attribute__((target("ssse3")))
+static inline __m128i onion_base64_chars_ssse3(__m128i idx){
+	__m128i r=_mm_subs_epu8(idx, _mm_set1_epi8(51));
+	r=_mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+	const __m128i offsets=_mm_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, 
+	                                    '0'-52, '0'-52, '0'-52, '+'-62, '/'-63, 'A', 0, 0);
+	return _mm_add_epi8(_mm_shuffle_epi8(offsets, r), idx);
+}
+
+__attribute__((target("ssse3")))
+static size_t onion_base64_encode_ssse3(const unsigned char *in, size_t n, char *out){
+	const __m128i shuffle=_mm_set_epi8(10,11,9,10, 7,8,6,7, 4,5,3,4, 1,2,0,1);
+	size_t i;
+	for (i=0;i+16<=n;i+=12, out+=16){ // Reads 16, uses 12
+		__m128i v=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&in[i]), shuffle);
+		_mm_storeu_si128((__m128i*)out, onion_base64_chars_ssse3(onion_base64_split_ssse3(v)));
+	}
+	return i;
+}
+
+/// Chars to their 6 bit values. Sets *valid to a mask with a bit set per valid char.
+__attribute__((target("ssse3")))
+static inline __m128i onion_base64_values_ssse3(__m128i v, int *valid){
+	__m128i AZ=_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A'-1)), _mm_cmplt_epi8(v, _mm_set1_epi8('Z'+1)));
+	__m128i az=_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a'-1)), _mm_cmplt_epi8(v, _mm_set1_epi8('z'+1)));
+	__m128i d09=_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0'-1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9'+1)));
+	__m128i plus=_mm_cmpeq_epi8(v, _mm_set1_epi8('+'));
+	__m128i slash=_mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+	*valid=_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(AZ, az), _mm_or_si128(d09, _mm_or_si128(plus, slash))));
+	__m128i shift=_mm_or_si128(_mm_or_si128(_mm_and_si128(AZ, _mm_set1_epi8(-'A')), _mm_and_si128(az, _mm_set1_epi8(26-'a'))),
+	                           _mm_or_si128(_mm_and_si128(d09, _mm_set1_epi8(52-'0')), 
+	                           _mm_or_si128(_mm_and_si128(plus, _mm_set1_epi8(62-'+')), _mm_and_si128(slash, _mm_set1_epi8(63-'/')))));
+	return _mm_add_epi8(v, shift);
+}
+
+/// Packs each 4 values of 6 bits into 3 bytes, at the first 12 bytes.
+__attribute__((target("ssse3")))
+static inline __m128i onion_base64_pack_ssse3(__m128i values){
+	__m128i m=_mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+	m=_mm_madd_epi16(m, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(m, _mm_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1));
+}
+
+/// Stores exactly 12 bytes, so the destination needs no slack.
+__attribute__((target("ssse3")))
+static inline void onion_base64_store12_ssse3(unsigned char *out, __m128i v){
+	_mm_storel_epi64((__m128i*)out, v);
+	uint32_t last=_mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+	memcpy(&out[8], &last, 4);
+}
+
+__attribute__((target("ssse3")))
+static size_t onion_base64_decode_ssse3(const unsigned char *in, size_t n, unsigned char *out){
+	size_t i;
+	for (i=0;i+16<=n;i+=16, out+=12){
+		int valid;
+		__m128i values=onion_base64_values_ssse3(_mm_loadu_si128((const __m128i*)&in[i]), &valid);
+		if (valid!=0xFFFF)
+			break;
+		onion_base64_store12_ssse3(out, onion_base64_pack_ssse3(values));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t onion_base64_encode_avx2(const unsigned char *in, size_t n, char *out){
+	const __m256i shuffle=_mm256_set_epi8(10,11,9,10, 7,8,6,7, 4,5,3,4, 1,2,0,1, 10,11,9,10, 7,8,6,7, 4,5,3,4, 1,2,0,1);
+	const __m256i offsets=_mm256_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, 
+	                                       '0'-52, '0'-52, '0'-52, '+'-62, '/'-63, 'A', 0, 0,
+	                                       'a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, 
+	                                       '0'-52, '0'-52, '0'-52, '+'-62, '/'-63, 'A', 0, 0);
+	size_t i;
+	for (i=0;i+28<=n;i+=24, out+=32){ // 12 bytes at each lane, from two loads
+		__m256i v=_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)&in[i])), 
+		                                  _mm_loadu_si128((const __m128i*)&in[i+12]), 1);
+		v=_mm256_shuffle_epi8(v, shuffle);
+		__m256i t0=_mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+		__m256i t1=_mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+		__m256i idx=_mm256_or_si256(t0, t1);
+		__m256i r=_mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+		r=_mm256_or_si256(r, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx), _mm256_set1_epi8(13)));
+		_mm256_storeu_si256((__m256i*)out, _mm256_add_epi8(_mm256_shuffle_epi8(offsets, r), idx));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t onion_base64_decode_avx2(const unsigned char *in, size_t n, unsigned char *out){
+	size_t i;
+	for (i=0;i+32<=n;i+=32, out+=24){
+		__m256i v=_mm256_loadu_si256((const __m256i*)&in[i]);
+		__m256i AZ=_mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A'-1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z'+1), v));
+		__m256i az=_mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('a'-1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z'+1), v));
+		__m256i d09=_mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0'-1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9'+1), v));
+		__m256i plus=_mm256_cmpeq_epi8(v, _mm256_set1_epi8('+'));
+		__m256i slash=_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'));
+		__m256i valid=_mm256_or_si256(_mm256_or_si256(AZ, az), _mm256_or_si256(d09, _mm256_or_si256(plus, slash)));
+		if ((unsigned int)_mm256_movemask_epi8(valid)!=0xFFFFFFFFu)
+			break;
+		__m256i shift=_mm256_or_si256(_mm256_or_si256(_mm256_and_si256(AZ, _mm256_set1_epi8(-'A')), _mm256_and_si256(az, _mm256_set1_epi8(26-'a'))),
+		                              _mm256_or_si256(_mm256_and_si256(d09, _mm256_set1_epi8(52-'0')), 
+		                              _mm256_or_si256(_mm256_and_si256(plus, _mm256_set1_epi8(62-'+')), _mm256_and_si256(slash, _mm256_set1_epi8(63-'/')))));
+		__m256i m=_mm256_maddubs_epi16(_mm256_add_epi8(v, shift), _mm256_set1_epi32(0x01400140));
+		m=_mm256_madd_epi16(m, _mm256_set1_epi32(0x00011000));
+		m=_mm256_shuffle_epi8(m, _mm256_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1, 2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1));
+		onion_base64_store12_ssse3(out, _mm256_castsi256_si128(m));
+		onion_base64_store12_ssse3(&out[12], _mm256_extracti128_si256(m, 1));
+	}
+	return i;
+}
+#endif
+
+#ifdef ONION_BASE64_NEON
+/// 48 bytes to 64 chars each step: the 3 byte streams apart, and the chars by table lookup.
+static size_t onion_base64_encode_neon(const unsigned char *in, size_t n, char *out){
+	uint8x16x4_t table={{ vld1q_u8((const uint8_t*)cb64), vld1q_u8((const uint8_t*)cb64+16), 
+	                      vld1q_u8((const uint8_t*)cb64+32), vld1q_u8((const uint8_t*)cb64+48) }};
+	const uint8x16_t mask=vdupq_n_u8(0x3F);
+	size_t i;
+	for (i=0;i+48<=n;i+=48, out+=64){
+		uint8x16x3_t v=vld3q_u8(&in[i]);
+		uint8x16x4_t r;
+		r.val[0]=vshrq_n_u8(v.val[0], 2);
+		r.val[1]=vandq_u8(vorrq_u8(vshlq_n_u8(v.val[0], 4), vshrq_n_u8(v.val[1], 4)), mask);
+		r.val[2]=vandq_u8(vorrq_u8(vshlq_n_u8(v.val[1], 2), vshrq_n_u8(v.val[2], 6)), mask);
+		r.val[3]=vandq_u8(v.val[2], mask);
+		r.val[0]=vqtbl4q_u8(table, r.val[0]);
+		r.val[1]=vqtbl4q_u8(table, r.val[1]);
+		r.val[2]=vqtbl4q_u8(table, r.val[2]);
+		r.val[3]=vqtbl4q_u8(table, r.val[3]);
+		vst4q_u8((uint8_t*)out, r);
+	}
+	return i;
+}
+
+/// Chars to their 6 bit values, and or's at bad 0xFF for each invalid char.
+static inline uint8x16_t onion_base64_values_neon(uint8x16_t c, uint8x16_t *bad){
+	uint8x16_t AZ=vandq_u8(vcgeq_u8(c, vdupq_n_u8('A')), vcleq_u8(c, vdupq_n_u8('Z')));
+	uint8x16_t az=vandq_u8(vcgeq_u8(c, vdupq_n_u8('a')), vcleq_u8(c, vdupq_n_u8('z')));
+	uint8x16_t d09=vandq_u8(vcgeq_u8(c, vdupq_n_u8('0')), vcleq_u8(c, vdupq_n_u8('9')));
+	uint8x16_t plus=vceqq_u8(c, vdupq_n_u8('+'));
+	uint8x16_t slash=vceqq_u8(c, vdupq_n_u8('/'));
+	*bad=vorrq_u8(*bad, vmvnq_u8(vorrq_u8(vorrq_u8(AZ, az), vorrq_u8(d09, vorrq_u8(plus, slash)))));
+	uint8x16_t shift=vorrq_u8(vorrq_u8(vandq_u8(AZ, vdupq_n_u8((uint8_t)-'A')), vandq_u8(az, vdupq_n_u8((uint8_t)(26-'a')))),
+	                          vorrq_u8(vandq_u8(d09, vdupq_n_u8((uint8_t)(52-'0'))), 
+	                          vorrq_u8(vandq_u8(plus, vdupq_n_u8(62-'+')), vandq_u8(slash, vdupq_n_u8(63-'/')))));
+	return vaddq_u8(c, shift);
+}
+
+/// 64 chars to 48 bytes each step.
+static size_t onion_base64_decode_neon(const unsigned char *in, size_t n, unsigned char *out){
+	size_t i;
+	for (i=0;i+64<=n;i+=64, out+=48){
+		uint8x16x4_t v=vld4q_u8(&in[i]);
+		uint8x16_t bad=vdupq_n_u8(0);
+		uint8x16_t a=onion_base64_values_neon(v.val[0], &bad);
+		uint8x16_t b=onion_base64_values_neon(v.val[1], &bad);
+		uint8x16_t c=onion_base64_values_neon(v.val[2], &bad);
+		uint8x16_t d=onion_base64_values_neon(v.val[3], &bad);
+		if (vmaxvq_u8(bad))
+			break;
+		uint8x16x3_t r;
+		r.val[0]=vorrq_u8(vshlq_n_u8(a, 2), vshrq_n_u8(b, 4));
+		r.val[1]=vorrq_u8(vshlq_n_u8(b, 4), vshrq_n_u8(c, 2));
+		r.val[2]=vorrq_u8(vshlq_n_u8(c, 6), d);
+		vst3q_u8(out, r);
+	}
+	return i;
+}
+#endif
+
+static onion_base64_encode_kernel onion_base64_encode_simd=NULL;
+static onion_base64_decode_kernel onion_base64_decode_simd=NULL;
+static int onion_base64_dispatched=0;
+
+/// Picks the kernels for this CPU, once.
+static void onion_base64_dispatch(){
+	if (__atomic_load_n(&onion_base64_dispatched, __ATOMIC_ACQUIRE))
+		return;
+#if defined(ONION_BASE64_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")){
+		onion_base64_encode_simd=onion_base64_encode_avx2;
+		onion_base64_decode_simd=onion_base64_decode_avx2;
+	}
+	else if (__builtin_cpu_supports("ssse3")){
+		onion_base64_encode_simd=onion_base64_encode_ssse3;
+		onion_base64_decode_simd=onion_base64_decode_ssse3;
+	}
+#elif defined(ONION_BASE64_NEON)
+	onion_base64_encode_simd=onion_base64_encode_neon;
+	onion_base64_decode_simd=onion_base64_decode_neon;
+#endif
+	__atomic_store_n(&onion_base64_dispatched, 1, __ATOMIC_RELEASE);
+}
+
 /**
- * @short Decodes a base64 into a new char* (must be freed later).
+ * @short Whether base64 uses the SIMD kernels, when the CPU has them. They are used by default.
+ *
+ * For tests and benchmarks, to compare with the scalar code.
+ */
+void onion_base64_use_simd(int use){
+	onion_base64_dispatch();
+	if (!use){
+		onion_base64_encode_simd=NULL;
+		onion_base64_decode_simd=NULL;
+	}
+	else{
+		__atomic_store_n(&onion_base64_dispatched, 0, __ATOMIC_RELEASE);
+		onion_base64_dispatch();
+	}
+}
+
+/// Encodes n bytes, a multiple of 3, with no padding nor new lines.
+static char *onion_base64_encode_block(const unsigned char *in, size_t n, char *out){
+	size_t i=0;
+	if (onion_base64_encode_simd && n>=16){
+		i=onion_base64_encode_simd(in, n, out);
+		out+=i/3*4;
+	}
+	for (;i<n;i+=3, out+=4){
+		unsigned int v=(in[i]<<16) | (in[i+1]<<8) | in[i+2];
+		out[0]=cb64[v>>18];
+		out[1]=cb64[(v>>12)&0x3F];
+		out[2]=cb64[(v>>6)&0x3F];
+		out[3]=cb64[v&0x3F];
+	}
+	return out;
+}
+
+/**
+ * @short Bytes needed to encode length bytes with onion_base64_encode_to, with the final \0.
+ */
+size_t onion_base64_encode_length(size_t length){
+	if (length==0)
+		return 1;
+	return (length+2)/3*4 + (length+56)/57 + 1;
+}
+
+/**
+ * @short Encodes a byte array to base64 at dest, that must have onion_base64_encode_length(length) bytes.
  *
- * At length, if not NULL we set the final length of the decoded base.
+ * As onion_base64_encode, lines of 76 chars, all ended by a new line. No memory is allocated.
  *
- * The buffer might be sligthly bigger (up to 3 bytes), but length is always right.
+ * @returns The length of the encoded string, without the final \0.
  */
-char *onion_base64_decode(const char *orig, int *length){
-	if (orig==NULL)
-		return NULL;
-	int ol=strlen(orig)-1;
-	while ((ol>=3) && (orig[ol]=='\n' || orig[ol]=='\r' || orig[ol]=='\0')) ol--; // go to real end, and set to next. Order of the && is important.
-	ol++;
-	
-	//fprintf(stderr,"ol %d\n",ol);
-	int l=ol*3/4;
-	char *ret=malloc(l+1);
-	
-	if (ol<4){ // Not even a block
-		if (length)
-			*length=0;
-		ret[0]=0;
-		return ret;
+size_t onion_base64_encode_to(const char *orig, size_t length, char *dest){
+	const unsigned char *in=(const unsigned char*)orig;
+	char *r=dest;
+	if (length==0){
+		*r='\0';
+		return 0;
+	}
+	onion_base64_dispatch();
+	size_t I=0;
+	for (;I+57<length;I+=57){ // 57 bytes are 76 chars, and then the new line.
+		r=onion_base64_encode_block(&in[I], 57, r);
+		*r++='\n';
 	}
+	size_t rest=length-I; // 1 to 57
+	r=onion_base64_encode_block(&in[I], rest/3*3, r);
+	I+=rest/3*3;
+	if (rest%3){
+		unsigned int v=in[I]<<16;
+		if (rest%3==2)
+			v|=in[I+1]<<8;
+		r[0]=cb64[v>>18];
+		r[1]=cb64[(v>>12)&0x3F];
+		r[2]=(rest%3==2) ? cb64[(v>>6)&0x3F] : '=';
+		r[3]='=';
+		r+=4;
+	}
+	*r++='\n';
+	*r='\0';
+	return r-dest;
+}
 
-	
-	int i,j;
-	char c=0; // Always used properly, but gcc -O2 -Wall thinks it may get used not initialized.
-	for (i=0,j=0;i<ol;i+=4,j+=3){
-		unsigned char o[4];
-		int k;
-		for (k=0;k<4;k++){
-			while ( (i+k)<ol && ((c=db64[(int)orig[i+k]]) & 192) ) i++;
-			//fprintf(stderr,"%c ",orig[i+k]);
-			o[k]=c;
+/**
+ * @short Decodes length chars of base64 at orig to dest, that may be orig itself to decode in place.
+ *
+ * dest must have room for length*3/4 bytes. Chars out of the base64 alphabet, as new lines, are skipped,
+ * and so is the padding. No memory is allocated, and no \0 is added.
+ *
+ * @returns The decoded length.
+ */
+size_t onion_base64_decode_to(const char *orig, size_t length, char *dest){
+	const unsigned char *in=(const unsigned char*)orig;
+	unsigned char *out=(unsigned char*)dest;
+	onion_base64_dispatch();
+	size_t i=0, j=0;
+	unsigned int acc=0;
+	int n=0;
+	while (i<length){
+		if (n==0 && onion_base64_decode_simd && length-i>=16){ // At a block boundary, the kernel takes as many as it can
+			size_t used=onion_base64_decode_simd(&in[i], length-i, &out[j]);
+			i+=used;
+			j+=used/4*3;
 		}
-		
-		ret[j]  =((o[0]&0x3F)<<2)+((o[1]&0x30)>>4);
-		ret[j+1]=((o[1]&0x0F)<<4)+((o[2]&0x3C)>>2);
-		ret[j+2]=((o[2]&0x03)<<6)+(o[3]);
-		/*
-		printf_bin(o[0], 6);
-		printf_bin(o[1], 6);
-		printf_bin(o[2], 6);
-		printf_bin(o[3], 6);
-		fprintf(stderr," -> ");
-		printf_bin(ret[j], 8);
-		printf_bin(ret[j+1], 8);
-		printf_bin(ret[j+2], 8);
-		fprintf(stderr,"\n");
-		*/
-	}
-	if (length){ // Set the right size.. only if i need it.
-		*length=j;
-		//fprintf(stderr, "ol-2 %d, length %d\n",ol-2,j);
-		if (orig[ol-2]=='=')
-			*length=j-2;
-		else if (orig[ol-1]=='=')
-			*length=j-1;
-	}
-	if (orig[ol-1]=='=')
-		ret[j-1]=0;
-	/*
-	else if (orig[ol]=='=')
-		ret[j]=0;*/
-	else
-		ret[j]=0;
-	
-	return ret;
+		// Then the slow way, past the char that stopped it, as a new line, and up to a block boundary.
+		int skipped=0;
+		for (;i<length;i++){
+			unsigned char c=in[i];
+			unsigned char v=(c<128) ? (unsigned char)db64[c] : 255;
+			if (v&0xC0){
+				skipped=1;
+				continue;
+			}
+			if (n==0 && skipped)
+				break;
+			acc=(acc<<6) | v;
+			if (++n==4){
+				out[j]=acc>>16;
+				out[j+1]=acc>>8;
+				out[j+2]=acc;
+				j+=3;
+				n=0;
+			}
+		}
+	}
+	if (n==2)
+		out[j++]=acc>>4;
+	else if (n==3){
+		out[j]=acc>>10;
+		out[j+1]=acc>>2;
+		j+=2;
+	}
+	return j;
 }
 
+/**
+ * @short Decodes a base64 into a new char* (must be freed later).
+ *
+ * At length, if not NULL we set the final length of the decoded base. It is also \0 terminated.
+ * 
+ * @see onion_base64_decode_to, to decode with no allocation, or in place.
+ */
+char *onion_base64_decode(const char *orig, int *length){
+	if (orig==NULL)
+		return NULL;
+	size_t ol=strlen(orig);
+	char *ret=malloc(ol*3/4+1);
+	size_t l=onion_base64_decode_to(orig, ol, ret);
+	ret[l]='\0';
+	if (length)
+		*length=l;
+	return ret;
+}
 
 /**
  * @short Encodes a byte array to a base64 into a new char* (must be freed later).
+ * 
+ * @see onion_base64_encode_to, to encode with no allocation.
  */
 char *onion_base64_encode(const char *orig, int length){
 	if (orig==NULL)
 		return NULL;
-	/// that chars + \n one per every 57 + \n\0 at end, and maybe two '='
-	char *ret=malloc(((length*4)/3) + (length/57) + 2 + 3 );
-	if (length==0){ // easy case.. here.
-		ret[0]='\0';
-		return ret;
+	char *ret=malloc(onion_base64_encode_length(length));
+	onion_base64_encode_to(orig, length, ret);
+	return ret;
+}
+
+/// @}
+
+
+/// @{ @name URL and C quoting. Clean runs are found 16 bytes at a time where SIMD is available, and copied at once.
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define ONION_URL_SSE2
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__BYTE_ORDER__) && __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define ONION_URL_NEON
+
+/// Position of the first set byte in the comparison mask, or 16 if none.
+static inline int onion_url_neon_first(uint8x16_t m){
+	uint64_t lo=vgetq_lane_u64(vreinterpretq_u64_u8(m), 0);
+	if (lo)
+		return __builtin_ctzll(lo)/8;
+	uint64_t hi=vgetq_lane_u64(vreinterpretq_u64_u8(m), 1);
+	if (hi)
+		return 8+__builtin_ctzll(hi)/8;
+	return 16;
+}
+#endif
+
+/// Returns the position of the first a, b, c or d at str, or length if none.
+static size_t onion_url_scan(const char *str, size_t length, char a, char b, char c, char d){
+	size_t i=0;
+#if defined(ONION_URL_SSE2)
+	__m128i va=_mm_set1_epi8(a), vb=_mm_set1_epi8(b), vc=_mm_set1_epi8(c), vd=_mm_set1_epi8(d);
+	for (;i+16<=length;i+=16){
+		__m128i v=_mm_loadu_si128((const __m128i*)&str[i]);
+		__m128i m=_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,va), _mm_cmpeq_epi8(v,vb)), 
+		                       _mm_or_si128(_mm_cmpeq_epi8(v,vc), _mm_cmpeq_epi8(v,vd)));
+		int mask=_mm_movemask_epi8(m);
+		if (mask)
+			return i+__builtin_ctz(mask);
 	}
-	
-	int i,j, I,J;
-	// First many lines,  I hope the compiler unloops properly...
-	for (I=0,J=0;I<length-57;I+=57,J+=77){ // 57 chars are 76 chars in base64. Just a place to set the new line.
-		const char *o=&orig[I];
-		char *r=&ret[J];
-		for (i=0,j=0;i<57;i+=3,j+=4){
-			char a=o[i];
-			char b=o[i+1];
-			char c=o[i+2];
-			
-			r[j]=(a>>2)&0x3F;
-			r[j+1]=((a<<4)&0x30) + ((b>>4)&0x0F);
-			r[j+2]=((b<<2)&0x3C) + ((c>>6)&0x03);
-			r[j+3]=(c&0x3F);
-		}
-		for(i=0;i<76;i++){
-				r[i]=cb64[(int)r[i]];
-		}
-		r[j]='\n';
-		r[j+1]='\0';
-	}
-	// Now the same, with last lines
-	{
-		const char *o=&orig[I];
-		char *r=&ret[J];
-		int maxel=length-I; // max at end loop
-		for (i=0,j=0;i<maxel-3;i+=3,j+=4){
-			char a=o[i];
-			char b=o[i+1];
-			char c=o[i+2];
-			
-			r[j]=(a>>2)&0x3F;
-			r[j+1]=((a<<4)&0x30) + ((b>>4)&0x0F);
-			r[j+2]=((b<<2)&0x3C) + ((c>>6)&0x03);
-			r[j+3]=(c&0x3F);
-		}
-		//fprintf(stderr,"i %d maxel %d\n",i,maxel);
-		{ // last 3 chars
-			char a=(i<maxel) ? o[i] : 0;
-			char b=((i+1)<maxel) ? o[i+1] : 0;
-			char c=((i+2)<maxel) ? o[i+2] : 0;
-			
-			r[j]=(a>>2)&0x3F;
-			r[j+1]=((a<<4)&0x30) + ((b>>4)&0x0F);
-			r[j+2]=((b<<2)&0x3C) + ((c>>6)&0x03);
-			r[j+3]=(c&0x3F);
-/*
-			printf_bin(a,8);
-			printf_bin(b,8);
-			printf_bin(c,8);
-			fprintf(stderr," -> ");
-			printf_bin(r[j],6);
-			printf_bin(r[j+1],6);
-			printf_bin(r[j+2],6);
-			printf_bin(r[j+3],6);
-			fprintf(stderr,"\n");
-			*/
+#elif defined(ONION_URL_NEON)
+	uint8x16_t va=vdupq_n_u8(a), vb=vdupq_n_u8(b), vc=vdupq_n_u8(c), vd=vdupq_n_u8(d);
+	for (;i+16<=length;i+=16){
+		uint8x16_t v=vld1q_u8((const uint8_t*)&str[i]);
+		uint8x16_t m=vorrq_u8(vorrq_u8(vceqq_u8(v,va), vceqq_u8(v,vb)), vorrq_u8(vceqq_u8(v,vc), vceqq_u8(v,vd)));
+		int f=onion_url_neon_first(m);
+		if (f<16)
+			return i+f;
+	}
+#endif
+	for (;i<length;i++){
+		char x=str[i];
+		if (x==a || x==b || x==c || x==d)
+			return i;
+	}
+	return length;
+}
+
+/// Whether c is kept as is by URL quoting: ASCII letters and digits.
+#define ONION_URL_PLAIN(c) (((c)>='0' && (c)<='9') || ((c)>='A' && (c)<='Z') || ((c)>='a' && (c)<='z'))
+
+/// Returns the position of the first char that URL quoting must encode, or length if none.
+static size_t onion_url_scan_quote(const char *str, size_t length){
+	size_t i=0;
+#if defined(ONION_URL_SSE2)
+	for (;i+16<=length;i+=16){
+		__m128i v=_mm_loadu_si128((const __m128i*)&str[i]);
+		__m128i d09=_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0'-1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9'+1)));
+		__m128i AZ=_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A'-1)), _mm_cmplt_epi8(v, _mm_set1_epi8('Z'+1)));
+		__m128i az=_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a'-1)), _mm_cmplt_epi8(v, _mm_set1_epi8('z'+1)));
+		int mask=(~_mm_movemask_epi8(_mm_or_si128(d09, _mm_or_si128(AZ, az))))&0xFFFF;
+		if (mask)
+			return i+__builtin_ctz(mask);
+	}
+#elif defined(ONION_URL_NEON)
+	for (;i+16<=length;i+=16){
+		uint8x16_t v=vld1q_u8((const uint8_t*)&str[i]);
+		uint8x16_t d09=vandq_u8(vcgeq_u8(v, vdupq_n_u8('0')), vcleq_u8(v, vdupq_n_u8('9')));
+		uint8x16_t AZ=vandq_u8(vcgeq_u8(v, vdupq_n_u8('A')), vcleq_u8(v, vdupq_n_u8('Z')));
+		uint8x16_t az=vandq_u8(vcgeq_u8(v, vdupq_n_u8('a')), vcleq_u8(v, vdupq_n_u8('z')));
+		int f=onion_url_neon_first(vmvnq_u8(vorrq_u8(d09, vorrq_u8(AZ, az))));
+		if (f<16)
+			return i+f;
+	}
+#endif
+	for (;i<length;i++){
+		if (!ONION_URL_PLAIN(str[i]))
+			return i;
+	}
+	return length;
+}
+
+/// Returns the position of the first char that C quoting changes, or length if none.
+static size_t onion_c_scan(const char *str, size_t length){
+	size_t i=0;
+#if defined(ONION_URL_SSE2)
+	for (;i+16<=length;i+=16){
+		__m128i v=_mm_loadu_si128((const __m128i*)&str[i]);
+		__m128i m=_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))),
+		                       _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')), 
+		                       _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')))));
+		int mask=_mm_movemask_epi8(m) | _mm_movemask_epi8(v); // And the ones >127
+		if (mask)
+			return i+__builtin_ctz(mask);
+	}
+#endif
+	for (;i<length;i++){
+		unsigned char c=str[i];
+		if (c=='\n' || c=='\r' || c=='\t' || c=='"' || c=='\\' || c>127)
+			return i;
+	}
+	return length;
+}
+
+static int onion_url_hex(char c){
+	if (c>='0' && c<='9')
+		return c-'0';
+	if (c>='a' && c<='f')
+		return c-'a'+10;
+	if (c>='A' && c<='F')
+		return c-'A'+10;
+	return -1;
+}
+
+/**
+ * @short Performs URL unquoting of length bytes at str into dest, that may be str itself.
+ *
+ * %XX are decoded, and + are spaces. A % not followed by two hex digits is kept as is.
+ * dest must have room for length bytes, and it is not ended with \0.
+ *
+ * @returns The unquoted length.
+ */
+size_t onion_unquote_to(const char *str, size_t length, char *dest){
+	size_t i=0, j=0;
+	while (i<length){
+		size_t n=onion_url_scan(&str[i], length-i, '%', '+', '%', '+');
+		if (n){
+			if (&dest[j]!=&str[i])
+				memmove(&dest[j], &str[i], n);
+			i+=n;
+			j+=n;
+			if (i==length)
+				break;
 		}
-		for(i=0;i<j+4;i++){
-				r[i]=cb64[(int)r[i]];
+		if (str[i]=='+'){
+			dest[j++]=' ';
+			i++;
+			continue;
 		}
-		j+=4;
-		if ((length%3)==1){
-			r[j-1]='=';
-			r[j-2]='=';
+		int hi=(i+2<length) ? onion_url_hex(str[i+1]) : -1;
+		int lo=(hi>=0) ? onion_url_hex(str[i+2]) : -1;
+		if (lo>=0){
+			dest[j++]=(hi<<4)|lo;
+			i+=3;
 		}
-		if ((length%3)==2){
-			r[j-1]='=';
+		else{
+			dest[j++]='%';
+			i++;
 		}
-		r[j++]='\n';
-		r[j]='\0';
 	}
-	return ret;
+	return j;
 }
 
-
 /**
  * @short Performs unquote inplace.
  *
  * It can be inplace as char position is always at least in the same on the destination than in the origin
  */
 void onion_unquote_inplace(char *str){
-	char *r=str;
-	char *w=str;
-	char tmp[3]={0,0,0};
-	while (*r){
-		if (*r == '%'){
-			r++;
-			tmp[0]=*r++;
-			tmp[1]=*r;
-			*w=strtol(tmp, (char **)NULL, 16);
-		}
-		else if (*r=='+'){
-			*w=' ';
+	str[onion_unquote_to(str, strlen(str), str)]='\0';
+}
+
+/// Length of the URL quoting of length bytes at str, without the final \0.
+size_t onion_quote_length(const char *str, size_t length){
+	size_t i=0, nl=0;
+	while (i<length){
+		size_t n=onion_url_scan_quote(&str[i], length-i);
+		nl+=n;
+		i+=n;
+		if (i<length){
+			nl+=3;
+			i++;
 		}
-		else{
-			*w=*r;
+	}
+	return nl;
+}
+
+/**
+ * @short Performs URL quoting of length bytes at str into dest.
+ *
+ * All but ASCII letters and digits are encoded as %XX. dest must have room for 
+ * onion_quote_length(str, length)+1 bytes, as it is ended with \0.
+ *
+ * @returns The quoted length.
+ */
+size_t onion_quote_to(const char *str, size_t length, char *dest){
+	static const char hex[]="0123456789ABCDEF";
+	size_t i=0, nl=0;
+	while (i<length){
+		size_t n=onion_url_scan_quote(&str[i], length-i);
+		memcpy(&dest[nl], &str[i], n);
+		nl+=n;
+		i+=n;
+		if (i<length){
+			unsigned char c=str[i++];
+			dest[nl++]='%';
+			dest[nl++]=hex[c>>4];
+			dest[nl++]=hex[c&0x0F];
 		}
-		r++;
-		w++;
 	}
-	*w='\0';
+	dest[nl]='\0';
+	return nl;
 }
 
 /**
  * @short Performs URL quoting, memory is allocated and has to be freed.
  *
- * As size necesary is dificult to measure, it first check how many should be encoded, and on a second round it encodes it.
+ * @see onion_quote_to, to quote to a caller buffer.
  */
 char *onion_quote_new(const char *str){
-	int i;
-	int l=strlen(str);
-	int nl=1;
-	for (i=0;i<l;i++){
-		if (!isalnum(str[i]))
-			nl+=3;
-		else
-			nl++;
-	}
-	// Now do the quotation part
-	char *ret=malloc(nl);
-	onion_quote(str, ret, nl);
+	size_t l=strlen(str);
+	char *ret=malloc(onion_quote_length(str, l)+1);
+	onion_quote_to(str, l, ret);
 	return ret;
 }
 
 
 /// Performs URL quoting, uses auxiliary res, with maxlength size. If more, do up to where I can, and cut it with \0.
 int onion_quote(const char *str, char *res, int maxlength){
-	static char hex[]="0123456789ABCDEF";
+	static const char hex[]="0123456789ABCDEF";
 	int nl=0;
+	const char *p=str;
 	int l=strlen(str);
-	int i;
-	for (i=0;i<l;i++){
-		if (i>=maxlength)
+	maxlength--; // The \0
+	while (*p && nl<maxlength){
+		size_t n=onion_url_scan_quote(p, l-(p-str));
+		if (n>(size_t)(maxlength-nl))
+			n=maxlength-nl;
+		memcpy(&res[nl], p, n);
+		nl+=n;
+		p+=n;
+		if (!*p || nl+3>maxlength)
 			break;
-		char c=str[i];
-		if (isalnum(c))
-			res[nl++]=c;
-		else{
-			if (i+2>=maxlength)
-				break;
-
-			res[nl++]='%';
-			res[nl++]=hex[(c>>4)&0x0F];
-			res[nl++]=hex[c&0x0F];
-		}
+		unsigned char c=*p++;
+		res[nl++]='%';
+		res[nl++]=hex[c>>4];
+		res[nl++]=hex[c&0x0F];
 	}
-	res[nl]=0;
+	if (maxlength>=0)
+		res[nl]=0;
 	return nl;
 }
 
+/// Bytes onion_c_quote needs to quote all of str, with the quotes and the final \0.
+size_t onion_c_quote_length(const char *str){
+	size_t length=strlen(str), i=0;
+	size_t l=3; // The quotes + \0
+	while (i<length){
+		size_t n=onion_c_scan(&str[i], length-i);
+		l+=n;
+		i+=n;
+		if (i==length)
+			break;
+		unsigned char c=str[i++];
+		if (c=='\n' || c>127)
+			l+=5; // \n"[real newline]"; \ooo gets as much, as it always had
+		else
+			l+=2;
+	}
+	return l;
+}
 
-/// Performs C quotation: changes " for \". Usefull when sending data to be interpreted as JSON. Returned data must be freed.
+/**
+ * @short Performs C quotation: changes " for \". Usefull when sending data to be interpreted as JSON. Returned data must be freed.
+ *
+ * @see onion_c_quote, with onion_c_quote_length, to quote to a caller buffer.
+ */
 char *onion_c_quote_new(const char *str){
-	char *ret;
-	int l=3; // The quotes + \0
-	const unsigned char *p=(const unsigned char *)str;
-	while( *p != '\0'){ 
-		if (*p=='\r' || *p=='"' || *p=='\\' || *p=='\t')
-			l++;
-		else if (*p=='\n')
-			l+=4; // \n"[real newline]"
-		else if(*p>127)
-			l+=4;
-		l++; p++;
-	}
-	ret=malloc(l);
+	size_t l=onion_c_quote_length(str);
+	char *ret=malloc(l);
 	onion_c_quote(str, ret, l);
 	return ret;
 }
@@ -318,10 +729,26 @@ char *onion_c_quote_new(const char *str){
 /// Performs the C quotation on the ret str. Max length is l.
 char *onion_c_quote(const char *str, char *ret, int l){
 	const unsigned char *p=(const unsigned char *)str;
+	const unsigned char *end=p+strlen(str);
 	char *r=ret;
 	*r++='"';
 	l-=3; // both " at start and end, and \0
-	while( *p != '\0'){ 
+	while( p<end ){ 
+		size_t n=onion_c_scan((const char*)p, end-p);
+		if (n){ // A clean run, counted as the chars one by one
+			if ((ssize_t)n>l)
+				n=l>0 ? l : 0;
+			memcpy(r, p, n);
+			r+=n;
+			p+=n;
+			l-=n;
+			if (l<=0){
+				*r='\0';
+				break;
+			}
+			if (p==end)
+				break;
+		}
 		if (*p=='\n'){ 
 			*r='\\'; 
 			r++; 
@@ -353,7 +780,7 @@ char *onion_c_quote(const char *str, char *ret, int l){
 			r++; 
 			*r='t'; 
 		}
-		else if (*p>127){
+		else{ // >127
 			int c=*p;
 			if (l<4){ // does not fit!
 				*r='\0';
@@ -367,9 +794,6 @@ char *onion_c_quote(const char *str, char *ret, int l){
 			r++;
 			*r='0'+(c&0x07);
 		}
-		else{
-			*r=*p;
-		}
 		r++; p++; 
 		l--;
 		if (l<=0){
@@ -383,16 +807,125 @@ char *onion_c_quote(const char *str, char *ret, int l){
 	return ret;
 }
 
+/**
+ * @short Gets the next key and value of a query string, as views into it, still quoted.
+ *
+ * Walks the query in one pass with no allocation: key and value point into the query, with their
+ * lengths, and can be unquoted with onion_unquote_to if needed. value is NULL if there is no '='.
+ * Empty pieces, as in "a=1&&b=2", are skipped.
+ *
+ * @param query Position at the query, advanced past the returned pair.
+ * @returns 1 if there was a pair, 0 at the end.
+ */
+int onion_query_next(const char **query, onion_query_token *token){
+	const char *p=*query;
+	if (!p)
+		return 0;
+	while (*p=='&')
+		p++;
+	if (!*p){
+		*query=p;
+		return 0;
+	}
+	size_t l=strlen(p);
+	size_t end=onion_url_scan(p, l, '&', '&', '&', '&');
+	const char *eq=memchr(p, '=', end);
+	token->key=p;
+	if (eq){
+		token->key_length=eq-p;
+		token->value=eq+1;
+		token->value_length=end-(eq+1-p);
+	}
+	else{
+		token->key_length=end;
+		token->value=NULL;
+		token->value_length=0;
+	}
+	*query=p+end;
+	return 1;
+}
+
+/**
+ * @short Splits the next key and value of a query string in place, unquoted and ended with \0.
+ *
+ * One pass over the query: each char is looked at once, the clean runs 16 at a time, and unquoted as
+ * it goes. value is "" if there is no '='. Empty pieces are skipped.
+ *
+ * @param query Position at the query, advanced past the returned pair.
+ * @returns 1 if there was a pair, 0 at the end.
+ */
+int onion_query_split_inplace(char **query, char **key, char **value){
+	char *p=*query;
+	if (!p)
+		return 0;
+	while (*p=='&')
+		p++;
+	if (!*p){
+		*query=p;
+		return 0;
+	}
+	size_t length=strlen(p);
+	size_t i=0, j=0;
+	*key=p;
+	*value=NULL;
+	char *out=p;
+	while (i<length){
+		size_t n=*value ? onion_url_scan(&p[i], length-i, '&', '%', '+', '&') : onion_url_scan(&p[i], length-i, '&', '%', '+', '=');
+		if (n){
+			if (&out[j]!=&p[i])
+				memmove(&out[j], &p[i], n);
+			i+=n;
+			j+=n;
+			if (i==length)
+				break;
+		}
+		char c=p[i];
+		if (c=='&'){
+			i++;
+			break;
+		}
+		else if (c=='='){ // The key ends, the value is written from here on.
+			out[j]='\0';
+			i++;
+			out=*value=&p[i];
+			j=0;
+		}
+		else if (c=='+'){
+			out[j++]=' ';
+			i++;
+		}
+		else{
+			int hi=(i+2<length) ? onion_url_hex(p[i+1]) : -1;
+			int lo=(hi>=0) ? onion_url_hex(p[i+2]) : -1;
+			if (lo>=0){
+				out[j++]=(hi<<4)|lo;
+				i+=3;
+			}
+			else{
+				out[j++]='%';
+				i++;
+			}
+		}
+	}
+	out[j]='\0';
+	if (!*value)
+		*value=&out[j]; // The \0 at the end of the key
+	*query=&p[i];
+	return 1;
+}
+
+/// @}
+
 /**
  * @short Calculates the SHA1 checksum of a given data
+ * 
+ * Built in, so it does not need gnutls. @see onion_sha1_init, to hash data by parts.
  */
 void onion_sha1(const char *data, int length, char *result){
-#ifndef HAVE_GNUTLS
-	ONION_ERROR("Cant calculate SHA1 if gnutls is not compiled in! Aborting now");
-	exit(1);
-#else
-	gnutls_hash_fast(GNUTLS_DIG_SHA1, data, length, result); 
-#endif
+	onion_sha1_state state;
+	onion_sha1_init(&state);
+	onion_sha1_update(&state, data, length);
+	onion_sha1_final(&state, result);
 }
 
 /// At p inserts the proper encoding of c, and returns the new string cursor (end of inserted symbols).
@@ -425,6 +958,13 @@ char *onion_html_add_enc(char c, char *p){
 			*p++='9';
 			*p++=';';
 			break;
+		case '&':
+			*p++='&';
+			*p++='a';
+			*p++='m';
+			*p++='p';
+			*p++=';';
+			break;
 		default:
 			*p++=c;
 	}
@@ -442,6 +982,8 @@ int onion_html_encoding_size(char c){
 			return 6;
 		case '\'':
 			return 5;
+		case '&':
+			return 5;
 	}
 	return 1;
 }
@@ -472,3 +1014,65 @@ char *onion_html_quote(const char *str){
 	return ret;
 }
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define ONION_HTML_SSE2
+#endif
+
+/// Whether c needs HTML encoding.
+#define ONION_HTML_UNSAFE(c) ((c)=='<' || (c)=='>' || (c)=='&' || (c)=='"' || (c)=='\'')
+
+/**
+ * @short Returns the position of the first char that needs HTML encoding, or length if none.
+ * 
+ * Scans 16 bytes at a time with SSE2, as most of the text needs no encoding.
+ */
+size_t onion_html_scan(const char *str, size_t length){
+	size_t i=0;
+#ifdef ONION_HTML_SSE2
+	const __m128i lt=_mm_set1_epi8('<'), gt=_mm_set1_epi8('>'), amp=_mm_set1_epi8('&'), quot=_mm_set1_epi8('"'), apos=_mm_set1_epi8('\'');
+	for (;i+16<=length;i+=16){
+		__m128i v=_mm_loadu_si128((const __m128i*)&str[i]);
+		__m128i m=_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,lt), _mm_cmpeq_epi8(v,gt)), 
+		                       _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,amp), _mm_cmpeq_epi8(v,quot)), _mm_cmpeq_epi8(v,apos)));
+		int mask=_mm_movemask_epi8(m);
+		if (mask)
+			return i+__builtin_ctz(mask);
+	}
+#endif
+	for (;i<length;i++){
+		if (ONION_HTML_UNSAFE(str[i]))
+			return i;
+	}
+	return length;
+}
+
+/**
+ * @short Streams the HTML encoding of str to write.
+ * 
+ * The runs that need no encoding are written as they are, and each entity on its own write, so there is
+ * no intermediate string. onion_response_write_html_safe uses it, with the response buffer as the destination.
+ */
+ssize_t onion_html_quote_stream(const char *str, size_t length, onion_html_writer write, void *data){
+	ssize_t total=0;
+	size_t i=0;
+	while (i<length){
+		size_t n=onion_html_scan(&str[i], length-i);
+		if (n){
+			if (write(data, &str[i], n)<0)
+				return -1;
+			total+=n;
+			i+=n;
+			if (i==length)
+				break;
+		}
+		char enc[8];
+		int l=onion_html_add_enc(str[i], enc)-enc;
+		if (write(data, enc, l)<0)
+			return -1;
+		total+=l;
+		i++;
+	}
+	return total;
+}
+
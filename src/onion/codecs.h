@@ -26,6 +26,7 @@
 #ifndef ONION_CODECS_H
 #define ONION_CODECS_H
 
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C"{
@@ -37,27 +38,72 @@ char *onion_base64_decode(const char *orig, int *length);
 /// Encodes a byte array to a base64 into a new char* (must be freed later).
 char *onion_base64_encode(const char *orig, int length);
 
+/// Decodes base64 to dest, with room for length*3/4 bytes. dest may be orig. Returns the decoded length.
+size_t onion_base64_decode_to(const char *orig, size_t length, char *dest);
+
+/// Bytes onion_base64_encode_to needs, with the final \0.
+size_t onion_base64_encode_length(size_t length);
+
+/// Encodes to dest, with onion_base64_encode_length(length) bytes. Returns the encoded length.
+size_t onion_base64_encode_to(const char *orig, size_t length, char *dest);
+
+/// Whether base64 uses the SIMD kernels the CPU has. On by default.
+void onion_base64_use_simd(int use);
+
 /// Performs URL unquoting
 void onion_unquote_inplace(char *str);
 
+/// URL unquotes length bytes to dest, that may be str. No \0 is added. Returns the unquoted length.
+size_t onion_unquote_to(const char *str, size_t length, char *dest);
+
 /// Performs URL quoting, memory is allocated and has to be freed.
 char *onion_quote_new(const char *str);
 
 /// Performs URL quoting, uses auxiliary res, with maxlength size. If more, do up to where I can, and cut it with \0.
 int onion_quote(const char *str, char *res, int maxlength);
 
+/// Length of the URL quoting of length bytes at str, without the \0.
+size_t onion_quote_length(const char *str, size_t length);
+
+/// URL quotes to dest, with onion_quote_length(str, length)+1 bytes. Returns the quoted length.
+size_t onion_quote_to(const char *str, size_t length, char *dest);
+
 /// Performs C quotation: changes " for \". Usefull when sending data to be interpreted as JSON.
 char *onion_c_quote_new(const char *str);
 
 /// Performs the C quotation on the ret str. Max length is l.
 char *onion_c_quote(const char *str, char *ret, int l);
 
+/// Bytes onion_c_quote needs for all of str, with the quotes and the \0.
+size_t onion_c_quote_length(const char *str);
+
+/// A key and value of a query string, as views into it, still quoted. value is NULL if there is no '='.
+typedef struct onion_query_token_t{
+	const char *key;
+	size_t key_length;
+	const char *value;
+	size_t value_length;
+}onion_query_token;
+
+/// Gets the next pair of the query, and advances it. No allocations. Returns 0 at the end.
+int onion_query_next(const char **query, onion_query_token *token);
+
+/// Splits the next pair of the query in place, unquoted and \0 ended, and advances it. Returns 0 at the end.
+int onion_query_split_inplace(char **query, char **key, char **value);
+
 /// Calculates the sha1 checksum
 void onion_sha1(const char *data, int length, char *result);
 
 /// Calculates the HTML encoding of a string. Returned value must be freed. If no encoding needed, returns NULL.
 char *onion_html_quote(const char *str);
 
+/// Returns the position of the first char at str that needs HTML encoding, or length if none.
+size_t onion_html_scan(const char *str, size_t length);
+/// Writes a piece of the encoded html, for onion_html_quote_stream. Returns the bytes written, or <0 on error.
+typedef ssize_t (*onion_html_writer)(void *data, const char *str, size_t length);
+/// Streams the HTML encoding of str to write, with no allocations. Returns the bytes written, or -1.
+ssize_t onion_html_quote_stream(const char *str, size_t length, onion_html_writer write, void *data);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,335 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "types_internal.h"
+#include "response.h"
+#include "request.h"
+#include "dict.h"
+#include "log.h"
+
+ssize_t onion_response_write_raw(onion_response *res, const char *data, size_t length); // At response.c
+
+/// Size of the compressor output blocks, that are written to the response buffer.
+#define ONION_COMPRESS_BLOCK_SIZE 4096
+
+enum onion_compress_encoding_e{
+	OC_NONE=0,
+	OC_GZIP=1,
+	OC_DEFLATE=2,
+	OC_BROTLI=3,
+};
+
+/// Operations of the compressor, as the brotli and zlib ones.
+enum onion_compress_op_e{
+	OC_PROCESS=0,
+	OC_FLUSH=1,
+	OC_FINISH=2,
+};
+
+/// Compressor state of a response, while compressing.
+struct onion_compress_t{
+	int encoding;
+#ifdef HAVE_ZLIB
+	z_stream z;
+#endif
+#ifdef HAVE_BROTLI
+	BrotliEncoderState *br;
+#endif
+};
+typedef struct onion_compress_t onion_compress;
+
+/// Content types that are already compressed, as prefixes. Not worth to compress them again.
+static const char *onion_compress_skip_types[]={
+	"image/", "audio/", "video/", "font/woff", "application/zip", "application/gzip", "application/x-gzip",
+	"application/x-bzip2", "application/x-xz", "application/x-7z-compressed", "application/x-rar-compressed",
+	"application/octet-stream", "application/pdf", "application/wasm", NULL
+};
+
+/**
+ * @short Sets this response to be compressed, with gzip, deflate or brotli as the client accepts.
+ * @memberof onion_response_t
+ * 
+ * It is decided when the headers are written. It is not compressed if the client does not send a proper
+ * Accept-Encoding, if the Content-Type is already compressed (images, video, archives...), if there is already a 
+ * Content-Encoding, on HEAD requests and on codes without body or partial content, or if the length is known 
+ * (set, or the whole response at the buffer) and smaller than min_size.
+ * 
+ * Compressed responses lose the Content-Length set by the handler. If the whole compressed response fits at 
+ * the response buffer it gets the compressed length, otherwise it is chunked, so keep alive is kept. 
+ * onion_response_flush flushes the compressor too, so streamed data reaches the client at once.
+ * 
+ * Normally it is set for a route with onion_handler_compress.
+ * 
+ * @param res The response
+ * @param level Compression level, 1 (fast) to 9 (best) for gzip and deflate; brotli uses it as quality, up to 11.
+ *  0 to not compress.
+ * @param min_size Responses known to be smaller are not compressed.
+ */
+void onion_response_set_compression(onion_response *res, int level, size_t min_size){
+	if (res->flags&OR_HEADER_SENT){
+		ONION_WARNING("Compression set after the headers were sent. Ignored.");
+		return;
+	}
+	res->compress_level=level;
+	res->compress_min_size=min_size;
+}
+
+/// Returns the q of the encoding at the Accept-Encoding, 0 if not there, or -1 if explicitly not accepted.
+float onion_compress_accepts(const char *accept, const char *encoding){
+	size_t l=strlen(encoding);
+	float star=0;
+	while (*accept){
+		while (*accept==' ' || *accept==',')
+			accept++;
+		const char *name=accept;
+		while (*accept && *accept!=',' && *accept!=';' && *accept!=' ')
+			accept++;
+		size_t nl=accept-name;
+		float q=1;
+		while (*accept && *accept!=','){
+			if (*accept=='q' && accept[1]=='=')
+				q=atof(accept+2);
+			accept++;
+		}
+		if (nl==l && strncasecmp(name, encoding, l)==0)
+			return q>0 ? q : -1;
+		if (nl==1 && *name=='*')
+			star=q;
+	}
+	return star;
+}
+
+/// Chooses the encoding for the response, or OC_NONE.
+static int onion_compress_encoding(onion_response *res){
+	const char *accept=onion_request_get_header_id(res->request, ONION_H_ACCEPT_ENCODING);
+	if (!accept)
+		return OC_NONE;
+	int best=OC_NONE;
+	float bestq=0, q;
+#ifdef HAVE_BROTLI
+	q=onion_compress_accepts(accept, "br");
+	if (q>bestq){
+		best=OC_BROTLI;
+		bestq=q;
+	}
+#endif
+#ifdef HAVE_ZLIB
+	q=onion_compress_accepts(accept, "gzip");
+	if (q>bestq){
+		best=OC_GZIP;
+		bestq=q;
+	}
+	q=onion_compress_accepts(accept, "deflate");
+	if (q>bestq){
+		best=OC_DEFLATE;
+		bestq=q;
+	}
+#endif
+	return best;
+}
+
+/// Whether the comma separated list has the token, case insensitive.
+static int onion_compress_has_token(const char *list, const char *token){
+	size_t l=strlen(token);
+	while (*list){
+		while (*list==' ' || *list==',')
+			list++;
+		if (strncasecmp(list, token, l)==0 && (list[l]=='\0' || list[l]==',' || list[l]==' '))
+			return 1;
+		while (*list && *list!=',')
+			list++;
+	}
+	return 0;
+}
+
+/// Adds Accept-Encoding to the Vary header, as the response depends on it.
+static void onion_compress_vary(onion_response *res){
+	const char *vary=onion_dict_get(res->headers, "Vary");
+	if (!vary)
+		onion_dict_add(res->headers, "Vary", "Accept-Encoding", 0);
+	else if (!onion_compress_has_token(vary, "Accept-Encoding")){
+		char tmp[256];
+		snprintf(tmp, sizeof(tmp), "%s, Accept-Encoding", vary);
+		onion_response_set_header(res, "Vary", tmp);
+	}
+}
+
+/**
+ * @short Decides if the response is compressed, and if so sets the headers and returns the compressor.
+ * 
+ * Called once, before the headers are written. size is the body length if known, or -1.
+ */
+onion_compress *onion_compress_start(onion_response *res, ssize_t size){
+	int level=res->compress_level;
+	res->compress_level=0; // Decided.
+	if (level<=0 || !res->request)
+		return NULL;
+	if ((res->request->flags&OR_METHODS)==OR_HEAD || (res->flags&OR_CONNECTION_UPGRADE))
+		return NULL;
+	if (res->code<200 || res->code==204 /* No content */ || res->code==HTTP_PARTIAL_CONTENT || res->code==HTTP_NOT_MODIFIED)
+		return NULL;
+	if (size>=0 && size<res->compress_min_size)
+		return NULL;
+	if (onion_dict_get(res->headers, "Content-Encoding"))
+		return NULL;
+	const char *type=onion_dict_get(res->headers, "Content-Type");
+	if (type){
+		int i;
+		for (i=0;onion_compress_skip_types[i];i++){
+			if (strncasecmp(type, onion_compress_skip_types[i], strlen(onion_compress_skip_types[i]))==0 &&
+			    strncasecmp(type, "image/svg", 9)!=0)
+				return NULL;
+		}
+	}
+	onion_compress_vary(res);
+	
+	int encoding=onion_compress_encoding(res);
+	if (encoding==OC_NONE)
+		return NULL;
+	
+	onion_compress *c=calloc(1, sizeof(onion_compress));
+	if (!c)
+		return NULL;
+	c->encoding=encoding;
+	const char *name=NULL;
+#ifdef HAVE_BROTLI
+	if (encoding==OC_BROTLI){
+		c->br=BrotliEncoderCreateInstance(NULL, NULL, NULL);
+		if (!c->br){
+			free(c);
+			return NULL;
+		}
+		BrotliEncoderSetParameter(c->br, BROTLI_PARAM_QUALITY, level>BROTLI_MAX_QUALITY ? BROTLI_MAX_QUALITY : level);
+		BrotliEncoderSetParameter(c->br, BROTLI_PARAM_LGWIN, 18); // 256KB window, not the default 4MB, per response
+		BrotliEncoderSetParameter(c->br, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+		if (size>=0)
+			BrotliEncoderSetParameter(c->br, BROTLI_PARAM_SIZE_HINT, size);
+		name="br";
+	}
+#endif
+#ifdef HAVE_ZLIB
+	if (encoding==OC_GZIP || encoding==OC_DEFLATE){
+		if (deflateInit2(&c->z, level>9 ? 9 : level, Z_DEFLATED, (encoding==OC_GZIP) ? 15+16 : 15, 8, Z_DEFAULT_STRATEGY)!=Z_OK){
+			ONION_ERROR("Could not start zlib compressor: %s", c->z.msg ? c->z.msg : "?");
+			free(c);
+			return NULL;
+		}
+		name=(encoding==OC_GZIP) ? "gzip" : "deflate";
+	}
+#endif
+	ONION_DEBUG0("Compressing response with %s", name);
+	onion_dict_add(res->headers, "Content-Encoding", name, 0);
+	if (res->flags&OR_LENGTH_SET){
+		onion_dict_remove(res->headers, "Content-Length");
+		res->flags&=~OR_LENGTH_SET;
+		res->length=0;
+	}
+	return c;
+}
+
+/// Runs the compressor with the given input and operation, and writes out all the output it produces.
+static int onion_compress_run(onion_response *res, const char *data, size_t length, int op){
+	onion_compress *c=res->compress;
+#ifdef HAVE_BROTLI
+	if (c->encoding==OC_BROTLI){
+		static const BrotliEncoderOperation ops[]={ BROTLI_OPERATION_PROCESS, BROTLI_OPERATION_FLUSH, BROTLI_OPERATION_FINISH };
+		uint8_t out[ONION_COMPRESS_BLOCK_SIZE];
+		const uint8_t *next_in=(const uint8_t*)data;
+		size_t avail_in=length;
+		do{
+			uint8_t *next_out=out;
+			size_t avail_out=sizeof(out);
+			if (!BrotliEncoderCompressStream(c->br, ops[op], &avail_in, &next_in, &avail_out, &next_out, NULL)){
+				ONION_ERROR("Error compressing with brotli");
+				return -1;
+			}
+			if (avail_out!=sizeof(out) && onion_response_write_raw(res, (char*)out, sizeof(out)-avail_out)<0)
+				return -1;
+		}while (avail_in || BrotliEncoderHasMoreOutput(c->br));
+		return 0;
+	}
+#endif
+#ifdef HAVE_ZLIB
+	if (c->encoding==OC_GZIP || c->encoding==OC_DEFLATE){
+		static const int ops[]={ Z_NO_FLUSH, Z_SYNC_FLUSH, Z_FINISH };
+		char out[ONION_COMPRESS_BLOCK_SIZE];
+		c->z.next_in=(Bytef*)data;
+		c->z.avail_in=length;
+		int r;
+		do{
+			c->z.next_out=(Bytef*)out;
+			c->z.avail_out=sizeof(out);
+			r=deflate(&c->z, ops[op]);
+			if (r==Z_STREAM_ERROR){
+				ONION_ERROR("Error compressing with zlib");
+				return -1;
+			}
+			if (c->z.avail_out!=sizeof(out) && onion_response_write_raw(res, out, sizeof(out)-c->z.avail_out)<0)
+				return -1;
+		}while (c->z.avail_out==0 || (op==OC_FINISH && r!=Z_STREAM_END));
+	}
+#endif
+	return 0;
+}
+
+/// Compresses and writes the data. Returns length, or <0 on error.
+ssize_t onion_compress_write(onion_response *res, const char *data, size_t length){
+	if (onion_compress_run(res, data, length, OC_PROCESS)<0)
+		return OCS_CLOSE_CONNECTION;
+	return length;
+}
+
+/// Writes all the data given until now to the response buffer.
+void onion_compress_flush(onion_response *res){
+	onion_compress_run(res, NULL, 0, OC_FLUSH);
+}
+
+/// Writes the end of the compressed data to the response buffer, and frees the compressor.
+void onion_compress_end(onion_response *res){
+	onion_compress *c=res->compress;
+	onion_compress_run(res, NULL, 0, OC_FINISH);
+	res->compress=NULL;
+#ifdef HAVE_BROTLI
+	if (c->br)
+		BrotliEncoderDestroyInstance(c->br);
+#endif
+#ifdef HAVE_ZLIB
+	if (c->encoding==OC_GZIP || c->encoding==OC_DEFLATE)
+		deflateEnd(&c->z);
+#endif
+	free(c);
+}
@@ -28,12 +28,29 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
 
 #include "log.h"
 #include "dict.h"
 #include "types_internal.h"
 #include "codecs.h"
 #include "block.h"
+#include "pool.h"
+#include "memory.h"
+
+/// Maximum free nodes kept at each dict to be reused.
+#define ONION_DICT_MAX_FREE_NODES 64
+/// Initial slots of a hash dict. Grows to the double when 3/4 full.
+#define ONION_DICT_MIN_SLOTS 16
+/// Elements of a flat dict. One more and it becomes a tree, or a hash table with OD_HASH.
+#define ONION_DICT_FLAT_MAX 32
+/// Dupped keys shorter than this are kept inside the flat element.
+#define ONION_DICT_FLAT_KEY 24
+/// Dupped string values shorter than this are kept inside the flat element.
+#define ONION_DICT_FLAT_VALUE 48
 
 /// @private
 typedef struct onion_dict_node_data_t{
@@ -55,35 +72,146 @@ typedef struct onion_dict_node_t{
 	struct onion_dict_node_t *right;
 }onion_dict_node;
 
+/**
+ * @short Slot of the hash table, on OD_HASH dicts.
+ * @memberof onion_dict_t
+ * 
+ * Open addressing with linear probing. Empty slots have a NULL key.
+ */
+typedef struct onion_dict_slot_t{
+	onion_dict_node_data data;
+	unsigned int hash;
+}onion_dict_slot;
+
+/**
+ * @short Hash table of OD_HASH dicts.
+ * @memberof onion_dict_t
+ * 
+ * On OD_RCU dicts it is not changed once visible: changes are done on a copy, that replaces it.
+ */
+typedef struct onion_dict_table_t{
+	int nslots;               ///< A power of 2.
+	int count;
+	onion_dict_slot slots[];
+}onion_dict_table;
+
+/**
+ * @short Element of a flat dict, on OD_FLAT dicts.
+ * @memberof onion_dict_t
+ * 
+ * All are at one array, sorted by key. Short dupped keys and values are copied inside, not malloc'd.
+ */
+typedef struct onion_dict_flat_t{
+	onion_dict_node_data data;
+	char inlined;        ///< 1 if the key is at key, 2 if the value at value.
+	char key[ONION_DICT_FLAT_KEY];
+	char value[ONION_DICT_FLAT_VALUE];
+}onion_dict_flat;
+
 static void onion_dict_node_data_free(onion_dict_node_data *dict);
 static void onion_dict_set_node_data(onion_dict_node_data *data, const char *key, const void *value, int flags);
-static onion_dict_node *onion_dict_node_new(const char *key, const void *value, int flags);
+static onion_dict_node *onion_dict_node_new(onion_dict *d, const char *key, const void *value, int flags);
+static void onion_dict_node_preorder(const onion_dict_node *node, void *func, void *data);
+static void onion_dict_node_forget(onion_dict *d, onion_dict_node *node);
+static void onion_dict_hash_rehash(onion_dict *dict, int nslots, int rehash);
+static void onion_dict_hash_add(onion_dict *dict, const char *key, const void *value, int flags);
+static void onion_dict_flat_add(onion_dict *dict, const char *key, const void *value, int flags);
+static void onion_dict_flat_sort(onion_dict *dict);
+static void onion_dict_flat_grow(onion_dict *dict);
+static void onion_dict_frozen_free(onion_dict *dict);
+static void onion_dict_table_free(onion_dict_table *table);
+#ifdef HAVE_PTHREADS
+static void onion_dict_rcu_clear(onion_dict *dict);
+static void onion_dict_rcu_reclaim(onion_dict *dict, int all);
+#endif
 
 /**
  * @memberof onion_dict_t
  * Initializes the basic tree with all the structure in place, but empty.
+ * 
+ * Dicts are reused from the thread pool when possible, with their nodes, and the locks already initialized.
  */
 onion_dict *onion_dict_new(){
-	onion_dict *dict=calloc(1, sizeof(onion_dict));
+	onion_dict *dict=onion_pool_get(ONION_POOL_DICT);
+	if (dict)
+		dict->root=NULL; // Was the pool link
+	else{
+		dict=calloc(1, sizeof(onion_dict));
+		onion_memory_count(ONION_MEMORY_DICT, sizeof(onion_dict));
 #ifdef HAVE_PTHREADS
-	pthread_rwlock_init(&dict->lock, NULL);
-	pthread_mutex_init(&dict->refmutex, NULL);
+		pthread_rwlock_init(&dict->lock, NULL);
 #endif
+	}
 	dict->refcount=1;
   dict->cmp=strcmp;
 	ONION_DEBUG0("New %p, refcount %d",dict, dict->refcount);
 	return dict;
 }
 
+/// Moves a tree node data to the hash table, as is, with its flags.
+static void onion_dict_hash_move(onion_dict *dict, const char *key, const void *value, int flags){
+	onion_dict_hash_add(dict, key, value, (flags&~OD_DUP_ALL)|(flags&OD_FREE_ALL));
+}
+
 /**
  * @memberof onion_dict_t
  * 
  * Sets the dict flags.
+ * 
+ * OD_HASH keeps the elements at an open addressing hash table instead of the ordered tree, so lookups 
+ * are a hash and mostly one compare, for dicts of thousands of elements. Then onion_dict_preorder goes 
+ * in no given order, unless OD_SORTED is set too, and then it sorts the keys at each call. Set it just 
+ * after onion_dict_new; elements already there are moved.
+ * 
+ * OD_FLAT keeps up to ONION_DICT_FLAT_MAX elements at one sorted array, with the short keys and values 
+ * inside, for small dicts as the headers. With one more it becomes a tree, or with OD_HASH a hash table. 
+ * It must be set while the dict is empty, else it is ignored.
+ * 
+ * OD_RCU, with threads, is for dicts read by many threads and rarely changed, as the mime
+ * types: onion_dict_get and onion_dict_lock_read take no lock, and each change writes a copy of the table 
+ * and waits for the readers that may see the old one before freeing it. Values got must be used inside
+ * onion_dict_lock_read / onion_dict_unlock, as they may be freed after. It implies OD_HASH.
  */
 void onion_dict_set_flags(onion_dict *dict, int flags){
+  if (dict->flags&OD_FROZEN) // As it is, in order
+    return;
   if (flags&OD_ICASE){
     dict->cmp=strcasecmp;
+    if (dict->table) // Same keys, other hashes
+      onion_dict_hash_rehash(dict, dict->table->nslots, 1);
+    if (dict->flags&OD_FLAT) // Other order
+      onion_dict_flat_sort(dict);
+  }
+  dict->flags|=flags&OD_SORTED;
+  if ((flags&OD_FLAT) && !dict->root && !dict->table && !(dict->flags&OD_FLAT)){
+    if (!dict->flat){ // Kept while the dict is at the pool
+      dict->flat=malloc(sizeof(onion_dict_flat)*ONION_DICT_FLAT_MAX);
+      onion_memory_count(ONION_MEMORY_DICT, sizeof(onion_dict_flat)*ONION_DICT_FLAT_MAX);
+    }
+    dict->nflat=0;
+    dict->flags|=OD_FLAT;
   }
+  if ((flags&OD_HASH) && !(dict->flags&OD_HASH)){
+    dict->flags|=OD_HASH;
+    if (dict->flags&OD_FLAT) // Later, if it grows
+      return;
+    onion_dict_hash_rehash(dict, ONION_DICT_MIN_SLOTS, 0);
+    if (dict->root){
+      onion_dict_node *root=dict->root;
+      dict->root=NULL;
+      onion_dict_node_preorder(root, onion_dict_hash_move, dict);
+      onion_dict_node_forget(dict, root);
+    }
+  }
+#ifdef HAVE_PTHREADS
+  if ((flags&OD_RCU) && !(dict->flags&OD_RCU)){
+    if (!(dict->flags&OD_HASH))
+      onion_dict_set_flags(dict, OD_HASH);
+    if (dict->flags&OD_FLAT) // Only hash tables are copied on write
+      onion_dict_flat_grow(dict);
+    dict->flags|=OD_RCU;
+  }
+#endif
 }
 
 
@@ -99,14 +227,9 @@ void onion_dict_set_flags(onion_dict *dict, int flags){
  * environment so that multiple threads cna have the same dict and free it when not in use anymore.
  */
 onion_dict *onion_dict_dup(onion_dict *dict){
-#ifdef HAVE_PTHREADS
-	pthread_mutex_lock(&dict->refmutex);
-#endif
-	dict->refcount++;
-	ONION_DEBUG0("Dup %p, refcount %d",dict, dict->refcount);
-#ifdef HAVE_PTHREADS
-	pthread_mutex_unlock(&dict->refmutex);
-#endif
+	int refcount=__sync_add_and_fetch(&dict->refcount, 1);
+	ONION_DEBUG0("Dup %p, refcount %d",dict, refcount);
+	(void)refcount;
 	return dict;
 }
 
@@ -134,40 +257,119 @@ onion_dict *onion_dict_hard_dup(onion_dict *dict){
 }
 
 
+/// Keeps the node to be reused, or frees it if already many.
+static void onion_dict_node_release(onion_dict *d, onion_dict_node *node){
+	if (d->nfree_nodes>=ONION_DICT_MAX_FREE_NODES){
+		onion_memory_count(ONION_MEMORY_DICT, -(long)sizeof(onion_dict_node));
+		onion_slab_free(node, sizeof(onion_dict_node));
+		return;
+	}
+	node->right=d->free_nodes;
+	d->free_nodes=node;
+	d->nfree_nodes++;
+}
+
 /// Removes a node and its data
-static void onion_dict_node_free(onion_dict_node *node){
+static void onion_dict_node_free(onion_dict *d, onion_dict_node *node){
 	if (node->left)
-		onion_dict_node_free(node->left);
+		onion_dict_node_free(d, node->left);
 	if (node->right)
-		onion_dict_node_free(node->right);
+		onion_dict_node_free(d, node->right);
 
 	onion_dict_node_data_free(&node->data);
-	free(node);
+	onion_dict_node_release(d, node);
+}
+
+/// Releases the nodes, but not their data, that is somewhere else now.
+static void onion_dict_node_forget(onion_dict *d, onion_dict_node *node){
+	if (node->left)
+		onion_dict_node_forget(d, node->left);
+	if (node->right)
+		onion_dict_node_forget(d, node->right);
+	onion_dict_node_release(d, node);
 }
 
 /**
- * @short Removes the full dict struct from mem.
+ * @short Removes all the elements, keeping the dict and its nodes for reuse.
  * @memberof onion_dict_t
+ * 
+ * It affects all the soft duplicates (onion_dict_dup) of this dict.
  */
-void onion_dict_free(onion_dict *dict){
-	ONION_DEBUG0("Free %p", dict);
+void onion_dict_clear(onion_dict *dict){
+	dict->generation++;
+	if (dict->flags&OD_FROZEN){
+		onion_dict_frozen_free(dict);
+		return;
+	}
+	if (dict->flags&OD_FLAT){
+		int i;
+		for (i=0;i<dict->nflat;i++)
+			onion_dict_node_data_free(&dict->flat[i].data);
+		dict->nflat=0;
+	}
 #ifdef HAVE_PTHREADS
-	pthread_mutex_lock(&dict->refmutex);
+	if (dict->flags&OD_RCU){
+		onion_dict_rcu_clear(dict);
+		return;
+	}
 #endif
-	dict->refcount--;
-	ONION_DEBUG0("Free %p refcount %d", dict, dict->refcount);
-	int remove=(dict->refcount==0);
+	if (dict->table){
+		int i;
+		for (i=0;i<dict->table->nslots;i++){
+			if (dict->table->slots[i].data.key){
+				onion_dict_node_data_free(&dict->table->slots[i].data);
+				dict->table->slots[i].data.key=NULL;
+			}
+		}
+		dict->table->count=0;
+	}
+	if (dict->root)
+		onion_dict_node_free(dict, dict->root);
+	dict->root=NULL;
+}
+
+/// Really frees a dict, at the end of a thread pool.
+static void onion_dict_pool_free(void *_dict){
+	onion_dict *dict=_dict;
 #ifdef HAVE_PTHREADS
-	pthread_mutex_unlock(&dict->refmutex);
+	pthread_rwlock_destroy(&dict->lock);
 #endif
-	if(remove){
+	while (dict->free_nodes){
+		onion_dict_node *n=dict->free_nodes;
+		dict->free_nodes=n->right;
+		onion_memory_count(ONION_MEMORY_DICT, -(long)sizeof(onion_dict_node));
+		onion_slab_free(n, sizeof(onion_dict_node));
+	}
+	onion_dict_table_free(dict->table);
+	if (dict->flat)
+		onion_memory_count(ONION_MEMORY_DICT, -(long)(sizeof(onion_dict_flat)*ONION_DICT_FLAT_MAX));
+	free(dict->flat);
+	onion_memory_count(ONION_MEMORY_DICT, -(long)sizeof(onion_dict));
+	free(dict);
+}
+
+/**
+ * @short Removes the full dict struct from mem.
+ * @memberof onion_dict_t
+ */
+void onion_dict_free(onion_dict *dict){
+	ONION_DEBUG0("Free %p", dict);
+	int refcount=__sync_sub_and_fetch(&dict->refcount, 1);
+	ONION_DEBUG0("Free %p refcount %d", dict, refcount);
+	if(refcount==0){
 #ifdef HAVE_PTHREADS
-		pthread_rwlock_destroy(&dict->lock);
-		pthread_mutex_destroy(&dict->refmutex);
+		if (dict->flags&OD_RCU){ // Nobody else has it, so no readers to wait for
+			onion_dict_rcu_reclaim(dict, 1);
+			dict->flags&=~OD_RCU;
+		}
 #endif
-		if (dict->root)
-			onion_dict_node_free(dict->root);
-		free(dict);
+		onion_dict_clear(dict);
+		dict->cmp=strcmp;
+		dict->flags=0;
+		onion_dict_table_free(dict->table); // Back to a tree, as onion_dict_new
+		dict->table=NULL;
+		if (onion_pool_put(ONION_POOL_DICT, dict, onion_dict_pool_free)<0)
+			onion_dict_pool_free(dict);
 	}
 }
 	
@@ -194,9 +396,17 @@ static const onion_dict_node *onion_dict_find_node(const onion_dict *d, const on
 }
 
 
-/// Allocates a new node data, and sets the data itself.
-static onion_dict_node *onion_dict_node_new(const char *key, const void *value, int flags){
-	onion_dict_node *node=malloc(sizeof(onion_dict_node));
+/// Allocates a new node data, or reuses a free one, and sets the data itself.
+static onion_dict_node *onion_dict_node_new(onion_dict *d, const char *key, const void *value, int flags){
+	onion_dict_node *node=d->free_nodes;
+	if (node){
+		d->free_nodes=node->right;
+		d->nfree_nodes--;
+	}
+	else{
+		node=onion_slab_alloc(sizeof(onion_dict_node));
+		onion_memory_count(ONION_MEMORY_DICT, sizeof(onion_dict_node));
+	}
 
 	onion_dict_set_node_data(&node->data, key, value, flags);
 	
@@ -283,7 +493,7 @@ static onion_dict_node  *onion_dict_node_add(onion_dict *d, onion_dict_node *nod
 		//ONION_DEBUG("Replace %s with %s", node->data.key, nnode->data.key);
 		onion_dict_node_data_free(&node->data);
 		memcpy(&node->data, &nnode->data, sizeof(onion_dict_node_data));
-		free(nnode);
+		onion_dict_node_release(d, nnode);
 		return node;
 	}
 	else if (cmp<0){
@@ -315,7 +525,20 @@ void onion_dict_add(onion_dict *dict, const char *key, const void *value, int fl
 		ONION_ERROR("Error, trying to add an empty key to a dictionary. There is a underliying bug here! Not adding anything.");
 		return;
 	}
-	dict->root=onion_dict_node_add(dict, dict->root, onion_dict_node_new(key, value, flags));
+	if (dict->flags&OD_FROZEN){
+		ONION_ERROR("Trying to add %s to a frozen dict. Not adding it.", key);
+		return;
+	}
+	dict->generation++;
+	if (dict->flags&OD_FLAT){
+		onion_dict_flat_add(dict, key, value, flags);
+		return;
+	}
+	if (dict->table){
+		onion_dict_hash_add(dict, key, value, flags);
+		return;
+	}
+	dict->root=onion_dict_node_add(dict, dict->root, onion_dict_node_new(dict, key, value, flags));
 }
 
 /// Frees the memory, if necesary of key and value
@@ -333,7 +556,7 @@ static void onion_dict_node_data_free(onion_dict_node_data *data){
 }
 
 /// AA tree remove the node
-static onion_dict_node *onion_dict_node_remove(const onion_dict *d, onion_dict_node *node, const char *key){
+static onion_dict_node *onion_dict_node_remove(onion_dict *d, onion_dict_node *node, const char *key){
 	if (!node)
 		return NULL;
 	int cmp=d->cmp(key, node->data.key);
@@ -349,7 +572,7 @@ static onion_dict_node *onion_dict_node_remove(const onion_dict *d, onion_dict_n
 		//ONION_DEBUG("Remove here %p", node);
 		onion_dict_node_data_free(&node->data);
 		if (node->left==NULL && node->right==NULL){
-			free(node);
+			onion_dict_node_release(d, node);
 			return NULL;
 		}
 		if (node->left==NULL){
@@ -385,6 +608,689 @@ static onion_dict_node *onion_dict_node_remove(const onion_dict *d, onion_dict_n
 }
 
 
+/// FNV-1a of the key, case insensitive if the dict compares so.
+static unsigned int onion_dict_hash(const onion_dict *dict, const char *key){
+	unsigned int h=2166136261u;
+	if (dict->cmp==strcasecmp){
+		for (;*key;key++)
+			h=(h^(unsigned char)tolower((unsigned char)*key))*16777619u;
+	}
+	else{
+		for (;*key;key++)
+			h=(h^(unsigned char)*key)*16777619u;
+	}
+	return h;
+}
+
+/// Slot with that key at the table, or -1.
+static int onion_dict_table_find(const onion_dict *dict, const onion_dict_table *table, const char *key){
+	unsigned int hash=onion_dict_hash(dict, key);
+	unsigned int mask=table->nslots-1;
+	unsigned int i=hash&mask;
+	const onion_dict_slot *slot;
+	while ( (slot=&table->slots[i])->data.key ){
+		if (slot->hash==hash && dict->cmp(key, slot->data.key)==0)
+			return i;
+		i=(i+1)&mask;
+	}
+	return -1;
+}
+
+/// New table of nslots, with all the elements of old, if any, at the place of their stored hash. The data is shared with old.
+static onion_dict_table *onion_dict_table_copy(const onion_dict *dict, const onion_dict_table *old, int nslots){
+	onion_dict_table *table=calloc(1, sizeof(onion_dict_table)+nslots*sizeof(onion_dict_slot));
+	onion_memory_count(ONION_MEMORY_DICT, sizeof(onion_dict_table)+nslots*sizeof(onion_dict_slot));
+	table->nslots=nslots;
+	if (!old)
+		return table;
+	unsigned int mask=nslots-1;
+	int i;
+	for (i=0;i<old->nslots;i++){
+		if (!old->slots[i].data.key)
+			continue;
+		unsigned int hash=old->slots[i].hash;
+		unsigned int j=hash&mask;
+		while (table->slots[j].data.key)
+			j=(j+1)&mask;
+		table->slots[j].data=old->slots[i].data;
+		table->slots[j].hash=hash;
+	}
+	table->count=old->count;
+	return table;
+}
+
+/**
+ * @short Adds to the table, that must have space. As the tree, without OD_REPLACE the same key can be several times.
+ * 
+ * @returns 1 if it replaced other element, whose data is copied to replaced, to be freed.
+ */
+static int onion_dict_table_add(onion_dict *dict, onion_dict_table *table, const char *key, const void *value, int flags, onion_dict_node_data *replaced){
+	unsigned int hash=onion_dict_hash(dict, key);
+	unsigned int mask=table->nslots-1;
+	unsigned int i=hash&mask;
+	onion_dict_slot *slot;
+	while ( (slot=&table->slots[i])->data.key ){
+		if ((flags&OD_REPLACE) && slot->hash==hash && dict->cmp(key, slot->data.key)==0){
+			*replaced=slot->data;
+			onion_dict_set_node_data(&slot->data, key, value, flags);
+			return 1;
+		}
+		i=(i+1)&mask;
+	}
+	onion_dict_set_node_data(&slot->data, key, value, flags);
+	slot->hash=hash;
+	table->count++;
+	return 0;
+}
+
+/**
+ * @short Removes from the table, moving back the next ones of the probe sequence, so there are no tombstones.
+ * 
+ * @returns 1 if removed, and its data is copied to removed, to be freed.
+ */
+static int onion_dict_table_remove(onion_dict *dict, onion_dict_table *table, const char *key, onion_dict_node_data *removed){
+	int i=onion_dict_table_find(dict, table, key);
+	if (i<0)
+		return 0;
+	*removed=table->slots[i].data;
+	unsigned int mask=table->nslots-1;
+	unsigned int j=i;
+	while (1){
+		j=(j+1)&mask;
+		if (!table->slots[j].data.key)
+			break;
+		unsigned int k=table->slots[j].hash&mask; // Where it wanted to be
+		if ( (i<=j) ? (k<=i || k>j) : (k<=i && k>j) ){
+			table->slots[i]=table->slots[j];
+			i=j;
+		}
+	}
+	table->slots[i].data.key=NULL;
+	table->count--;
+	return 1;
+}
+
+/// Makes a new table of nslots, and moves all the elements there. With rehash, their hashes are calculated again, as when OD_ICASE changes.
+static void onion_dict_hash_rehash(onion_dict *dict, int nslots, int rehash){
+	onion_dict_table *old=dict->table;
+	int i;
+	for (i=0;rehash && old && i<old->nslots;i++){
+		if (old->slots[i].data.key)
+			old->slots[i].hash=onion_dict_hash(dict, old->slots[i].data.key);
+	}
+	dict->table=onion_dict_table_copy(dict, old, nslots);
+	onion_dict_table_free(old);
+}
+
+/// Frees the table, that may be NULL.
+static void onion_dict_table_free(onion_dict_table *table){
+	if (!table)
+		return;
+	onion_memory_count(ONION_MEMORY_DICT, -(long)(sizeof(onion_dict_table)+table->nslots*sizeof(onion_dict_slot)));
+	free(table);
+}
+
+#ifdef HAVE_PTHREADS
+/// @{ @name Read mostly dicts, OD_RCU. Readers only mark the epoch they entered at, at their own thread record.
+
+/// Read side of a thread. Reused by other thread when its thread ends.
+typedef struct onion_dict_reader_t{
+	unsigned long epoch;   ///< Global epoch when it entered to read, or 0 when not reading.
+	int nesting;           ///< Read sections open; only the outer one marks the epoch.
+	int used;              ///< Some thread has it.
+	struct onion_dict_reader_t *next;
+}onion_dict_reader;
+
+static onion_dict_reader *onion_dict_readers=NULL;
+static unsigned long onion_dict_epoch=1;
+static __thread onion_dict_reader *onion_dict_reader_self=NULL;
+static pthread_key_t onion_dict_reader_key;
+static pthread_once_t onion_dict_reader_once=PTHREAD_ONCE_INIT;
+
+/// When a thread ends, its record can be used by other.
+static void onion_dict_reader_release(void *_reader){
+	onion_dict_reader *reader=_reader;
+	__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&reader->used, 0, __ATOMIC_RELEASE);
+}
+
+static void onion_dict_reader_key_init(){
+	pthread_key_create(&onion_dict_reader_key, onion_dict_reader_release);
+}
+
+/// The record of this thread, a free one or a new one at the list.
+static onion_dict_reader *onion_dict_reader_get(){
+	onion_dict_reader *reader=onion_dict_reader_self;
+	if (reader)
+		return reader;
+	pthread_once(&onion_dict_reader_once, onion_dict_reader_key_init);
+	for (reader=__atomic_load_n(&onion_dict_readers, __ATOMIC_ACQUIRE);reader;reader=reader->next){
+		if (!__atomic_load_n(&reader->used, __ATOMIC_RELAXED) && __sync_bool_compare_and_swap(&reader->used, 0, 1))
+			break;
+	}
+	if (!reader){
+		reader=calloc(1, sizeof(onion_dict_reader));
+		reader->used=1;
+		do{
+			reader->next=__atomic_load_n(&onion_dict_readers, __ATOMIC_RELAXED);
+		}while (!__sync_bool_compare_and_swap(&onion_dict_readers, reader->next, reader));
+	}
+	pthread_setspecific(onion_dict_reader_key, reader);
+	onion_dict_reader_self=reader;
+	return reader;
+}
+
+/// Enters a read section: tables seen until onion_dict_rcu_read_end are not freed.
+static void onion_dict_rcu_read_begin(){
+	onion_dict_reader *reader=onion_dict_reader_get();
+	if (reader->nesting++==0){
+		__atomic_store_n(&reader->epoch, __atomic_load_n(&onion_dict_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST); // The epoch is seen before the table is read
+	}
+}
+
+static void onion_dict_rcu_read_end(){
+	onion_dict_reader *reader=onion_dict_reader_self;
+	if (--reader->nesting==0)
+		__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @short Old table, or element data, waiting for any reader that could see it.
+ * @memberof onion_dict_t
+ */
+typedef struct onion_dict_retired_t{
+	unsigned long epoch;          ///< Global epoch after it was unpublished. Readers from this epoch on can not see it.
+	onion_dict_table *table;      ///< Table to free, or NULL.
+	char free_table_data;         ///< Frees the data at the table too, as it was cleared.
+	char free_data;               ///< Frees data, an element replaced or removed.
+	onion_dict_node_data data;
+	struct onion_dict_retired_t *next;
+}onion_dict_retired;
+
+/// Oldest epoch a reader entered at and still reads, or ULONG_MAX. This thread does not count, as is writing.
+static unsigned long onion_dict_rcu_oldest_reader(){
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	unsigned long oldest=ULONG_MAX;
+	onion_dict_reader *reader;
+	for (reader=__atomic_load_n(&onion_dict_readers, __ATOMIC_ACQUIRE);reader;reader=reader->next){
+		unsigned long e=__atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE);
+		if (e && e<oldest && reader!=onion_dict_reader_self)
+			oldest=e;
+	}
+	return oldest;
+}
+
+/// Frees what was retired and no reader can see. Called with the write lock, or when nobody else has the dict (all).
+static void onion_dict_rcu_reclaim(onion_dict *dict, int all){
+	unsigned long oldest=all ? ULONG_MAX : onion_dict_rcu_oldest_reader();
+	onion_dict_retired **prev=&dict->retired;
+	while (*prev){
+		onion_dict_retired *r=*prev;
+		if (r->epoch>oldest){
+			prev=&r->next;
+			continue;
+		}
+		*prev=r->next;
+		if (r->free_table_data){
+			int i;
+			for (i=0;i<r->table->nslots;i++){
+				if (r->table->slots[i].data.key)
+					onion_dict_node_data_free(&r->table->slots[i].data);
+			}
+		}
+		onion_dict_table_free(r->table);
+		if (r->free_data)
+			onion_dict_node_data_free(&r->data);
+		free(r);
+	}
+}
+
+/// Publishes the new table, and retires the old one, and the gone data if any, until no reader sees them.
+static void onion_dict_rcu_publish(onion_dict *dict, onion_dict_table *table, int free_table_data, const onion_dict_node_data *gone){
+	onion_dict_retired *r=calloc(1, sizeof(onion_dict_retired));
+	r->table=dict->table;
+	r->free_table_data=free_table_data;
+	if (gone){
+		r->free_data=1;
+		r->data=*gone;
+	}
+	__atomic_store_n(&dict->table, table, __ATOMIC_SEQ_CST);
+	r->epoch=__atomic_add_fetch(&onion_dict_epoch, 1, __ATOMIC_SEQ_CST);
+	r->next=dict->retired;
+	dict->retired=r;
+	onion_dict_rcu_reclaim(dict, 0);
+}
+
+/// Takes the write lock, unless this thread has it already, from onion_dict_lock_write. Returns if it took it.
+static int onion_dict_rcu_write_begin(onion_dict *dict){
+	if (dict->writing && pthread_equal(dict->writer, pthread_self()))
+		return 0;
+	pthread_rwlock_wrlock(&dict->lock);
+	dict->writer=pthread_self();
+	dict->writing=1;
+	return 1;
+}
+
+static void onion_dict_rcu_write_end(onion_dict *dict){
+	dict->writing=0;
+	pthread_rwlock_unlock(&dict->lock);
+}
+
+/**
+ * @short Writes a change on OD_RCU dicts: on a copy of the table, visible to the readers at once.
+ * 
+ * The old table, and the data of the element replaced or removed, are freed at later changes, when no 
+ * reader can see them. Writers never wait for the readers.
+ * 
+ * @returns 1 if it added, replaced or removed something.
+ */
+static int onion_dict_rcu_change(onion_dict *dict, const char *key, const void *value, int flags, int remove){
+	int own=onion_dict_rcu_write_begin(dict);
+	onion_dict_table *old=dict->table;
+	int nslots=old->nslots;
+	if (!remove && (old->count+1)*4>nslots*3)
+		nslots*=2;
+	onion_dict_table *table;
+	if (nslots==old->nslots){ // Same places
+		size_t size=sizeof(onion_dict_table)+nslots*sizeof(onion_dict_slot);
+		table=malloc(size);
+		onion_memory_count(ONION_MEMORY_DICT, size);
+		memcpy(table, old, size);
+	}
+	else
+		table=onion_dict_table_copy(dict, old, nslots);
+	onion_dict_node_data gone;
+	int changed=1, freed;
+	if (remove){
+		freed=changed=onion_dict_table_remove(dict, table, key, &gone);
+		if (!changed) // Nothing to change
+			onion_dict_table_free(table);
+	}
+	else
+		freed=onion_dict_table_add(dict, table, key, value, flags, &gone);
+	if (changed)
+		onion_dict_rcu_publish(dict, table, 0, freed ? &gone : NULL);
+	if (own)
+		onion_dict_rcu_write_end(dict);
+	return changed;
+}
+
+/// Empties an OD_RCU dict, freeing the elements when no reader can see them.
+static void onion_dict_rcu_clear(onion_dict *dict){
+	int own=onion_dict_rcu_write_begin(dict);
+	onion_dict_rcu_publish(dict, onion_dict_table_copy(dict, NULL, ONION_DICT_MIN_SLOTS), 1, NULL);
+	if (own)
+		onion_dict_rcu_write_end(dict);
+}
+
+/// @}
+#endif
+
+/// Enters the read section of OD_RCU dicts. Returns if it did, for onion_dict_read_end.
+static int onion_dict_read_begin(const onion_dict *dict){
+#ifdef HAVE_PTHREADS
+	if (dict->flags&OD_RCU){
+		onion_dict_rcu_read_begin();
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+static void onion_dict_read_end(int rcu){
+#ifdef HAVE_PTHREADS
+	if (rcu)
+		onion_dict_rcu_read_end();
+#endif
+}
+
+/// Adds to the hash table, growing it if needed.
+static void onion_dict_hash_add(onion_dict *dict, const char *key, const void *value, int flags){
+#ifdef HAVE_PTHREADS
+	if (dict->flags&OD_RCU){
+		onion_dict_rcu_change(dict, key, value, flags, 0);
+		return;
+	}
+#endif
+	if ((dict->table->count+1)*4>dict->table->nslots*3)
+		onion_dict_hash_rehash(dict, dict->table->nslots*2, 0);
+	onion_dict_node_data replaced;
+	if (onion_dict_table_add(dict, dict->table, key, value, flags, &replaced))
+		onion_dict_node_data_free(&replaced);
+}
+
+/// Removes from the hash table.
+static int onion_dict_hash_remove(onion_dict *dict, const char *key){
+#ifdef HAVE_PTHREADS
+	if (dict->flags&OD_RCU)
+		return onion_dict_rcu_change(dict, key, NULL, 0, 1);
+#endif
+	onion_dict_node_data removed;
+	if (!onion_dict_table_remove(dict, dict->table, key, &removed))
+		return 0;
+	onion_dict_node_data_free(&removed);
+	return 1;
+}
+
+/// Compares the keys of two slots, for OD_SORTED preorders.
+static int onion_dict_slot_cmp(const void *a, const void *b){
+	return strcmp((*(const onion_dict_slot**)a)->data.key, (*(const onion_dict_slot**)b)->data.key);
+}
+
+/// Compares the keys of two slots, case insensitive.
+static int onion_dict_slot_casecmp(const void *a, const void *b){
+	return strcasecmp((*(const onion_dict_slot**)a)->data.key, (*(const onion_dict_slot**)b)->data.key);
+}
+
+/// Calls func on each element of the hash table, in order by key if OD_SORTED.
+static void onion_dict_hash_preorder(const onion_dict *dict, const onion_dict_table *table, void *func, void *data){
+	void (*f)(void *data, const char *key, const void *value, int flags);
+	f=func;
+	int i;
+	if (!(dict->flags&OD_SORTED)){
+		for (i=0;i<table->nslots;i++){
+			const onion_dict_slot *slot=&table->slots[i];
+			if (slot->data.key)
+				f(data, slot->data.key, slot->data.value, slot->data.flags);
+		}
+		return;
+	}
+	const onion_dict_slot **sorted=malloc(sizeof(onion_dict_slot*)*(table->count+1));
+	int n=0;
+	for (i=0;i<table->nslots;i++){
+		if (table->slots[i].data.key)
+			sorted[n++]=&table->slots[i];
+	}
+	qsort(sorted, n, sizeof(onion_dict_slot*), dict->cmp==strcasecmp ? onion_dict_slot_casecmp : onion_dict_slot_cmp);
+	for (i=0;i<n;i++)
+		f(data, sorted[i]->data.key, sorted[i]->data.value, sorted[i]->data.flags);
+	free(sorted);
+}
+
+/// Fixes the pointers to the inlined strings, after the element moved.
+static void onion_dict_flat_fix(onion_dict_flat *e){
+	if (e->inlined&1)
+		e->data.key=e->key;
+	if (e->inlined&2)
+		e->data.value=e->value;
+}
+
+/// First position with a key not less than key, and if found sets *found.
+static int onion_dict_flat_lower(const onion_dict *dict, const char *key, int *found){
+	int lo=0, hi=dict->nflat;
+	while (lo<hi){
+		int mid=(lo+hi)/2;
+		if (dict->cmp(dict->flat[mid].data.key, key)<0)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	*found=(lo<dict->nflat && dict->cmp(dict->flat[lo].data.key, key)==0);
+	return lo;
+}
+
+/// Sorts again the elements, with a new cmp. Insertion sort, they are few.
+static void onion_dict_flat_sort(onion_dict *dict){
+	onion_dict_flat tmp;
+	int i, j;
+	for (i=1;i<dict->nflat;i++){
+		memcpy(&tmp, &dict->flat[i], sizeof(tmp));
+		onion_dict_flat_fix(&tmp);
+		for (j=i;j>0 && dict->cmp(dict->flat[j-1].data.key, tmp.data.key)>0;j--){
+			memcpy(&dict->flat[j], &dict->flat[j-1], sizeof(tmp));
+			onion_dict_flat_fix(&dict->flat[j]);
+		}
+		memcpy(&dict->flat[j], &tmp, sizeof(tmp));
+		onion_dict_flat_fix(&dict->flat[j]);
+	}
+}
+
+/// Sets the element data, as onion_dict_set_node_data, but the short dupped strings are copied inside.
+static void onion_dict_flat_set(onion_dict_flat *e, const char *key, const void *value, int flags){
+	e->inlined=0;
+	size_t l;
+	if ((flags&OD_DUP_KEY)==OD_DUP_KEY && (l=strlen(key))<ONION_DICT_FLAT_KEY){
+		memcpy(e->key, key, l+1);
+		e->inlined|=1;
+		flags&=~OD_DUP_KEY;
+	}
+	if ((flags&OD_DUP_VALUE)==OD_DUP_VALUE && !(flags&OD_DICT) && value && (l=strlen(value))<ONION_DICT_FLAT_VALUE){
+		memcpy(e->value, value, l+1);
+		e->inlined|=2;
+		flags&=~OD_DUP_VALUE;
+	}
+	onion_dict_set_node_data(&e->data, key, value, flags);
+	onion_dict_flat_fix(e);
+}
+
+/// Moves all the elements to a tree, or to a hash table with OD_HASH. The inlined strings are dupped now.
+static void onion_dict_flat_grow(onion_dict *dict){
+	dict->flags&=~OD_FLAT;
+	if (dict->flags&OD_HASH)
+		onion_dict_hash_rehash(dict, ONION_DICT_MIN_SLOTS*4, 0);
+	int i;
+	for (i=0;i<dict->nflat;i++){
+		onion_dict_flat *e=&dict->flat[i];
+		int flags=(e->data.flags&~OD_DUP_ALL)|(e->data.flags&OD_FREE_ALL);
+		if (e->inlined&1)
+			flags|=OD_DUP_KEY;
+		if (e->inlined&2)
+			flags|=OD_DUP_VALUE;
+		onion_dict_add(dict, e->data.key, e->data.value, flags);
+	}
+	dict->nflat=0;
+}
+
+/// Frees the flat array of an empty OD_FLAT dict, that is flat again if set so. For the idle requests.
+void onion_dict_flat_free(onion_dict *dict){
+	if (!dict->flat || dict->nflat)
+		return;
+	onion_memory_count(ONION_MEMORY_DICT, -(long)(sizeof(onion_dict_flat)*ONION_DICT_FLAT_MAX));
+	free(dict->flat);
+	dict->flat=NULL;
+	dict->flags&=~OD_FLAT;
+}
+
+/// Adds to the flat array, in order, after the same keys. When full it grows to a tree or hash table.
+static void onion_dict_flat_add(onion_dict *dict, const char *key, const void *value, int flags){
+	int found;
+	int i=onion_dict_flat_lower(dict, key, &found);
+	if (found && (flags&OD_REPLACE)){
+		onion_dict_node_data_free(&dict->flat[i].data);
+		onion_dict_flat_set(&dict->flat[i], key, value, flags);
+		return;
+	}
+	if (dict->nflat==ONION_DICT_FLAT_MAX){
+		onion_dict_flat_grow(dict);
+		onion_dict_add(dict, key, value, flags);
+		return;
+	}
+	while (i<dict->nflat && dict->cmp(dict->flat[i].data.key, key)==0) // The tree adds them after the same keys too
+		i++;
+	int j;
+	for (j=dict->nflat;j>i;j--){
+		memcpy(&dict->flat[j], &dict->flat[j-1], sizeof(onion_dict_flat));
+		onion_dict_flat_fix(&dict->flat[j]);
+	}
+	onion_dict_flat_set(&dict->flat[i], key, value, flags);
+	dict->nflat++;
+}
+
+/// Removes from the flat array.
+static int onion_dict_flat_remove(onion_dict *dict, const char *key){
+	int found;
+	int i=onion_dict_flat_lower(dict, key, &found);
+	if (!found)
+		return 0;
+	onion_dict_node_data_free(&dict->flat[i].data);
+	dict->nflat--;
+	for (;i<dict->nflat;i++){
+		memcpy(&dict->flat[i], &dict->flat[i+1], sizeof(onion_dict_flat));
+		onion_dict_flat_fix(&dict->flat[i]);
+	}
+	return 1;
+}
+
+/// @{ @name Frozen dicts, onion_dict_freeze
+
+/**
+ * @short All the elements of a frozen dict, at one block: the sorted elements, and then the strings.
+ * @memberof onion_dict_t
+ */
+typedef struct onion_dict_frozen_t{
+	int count;
+	onion_dict_node_data elements[];
+}onion_dict_frozen;
+
+/// Element while freezing, with its order, to keep the same keys in order.
+typedef struct{
+	onion_dict_node_data data;
+	int index;
+}onion_dict_freeze_element;
+
+/// Collects the elements at the array, when freezing.
+typedef struct{
+	onion_dict_freeze_element *elements;
+	int count;
+	size_t strings;      ///< Bytes of the keys and string values.
+}onion_dict_freeze_state;
+
+static void onion_dict_freeze_collect(onion_dict_freeze_state *st, const char *key, const void *value, int flags){
+	onion_dict_freeze_element *fe=&st->elements[st->count];
+	fe->index=st->count++;
+	onion_dict_node_data *e=&fe->data;
+	e->key=key;
+	e->value=value;
+	e->flags=flags;
+	st->strings+=strlen(key)+1;
+	if (!(flags&OD_DICT))
+		st->strings+=strlen(value)+1;
+	else if (flags&OD_FREE_VALUE){ // Kept, so not freed with the old elements
+		onion_dict_freeze((onion_dict*)value);
+		onion_dict_dup((onion_dict*)value);
+	}
+}
+
+static const onion_dict *onion_dict_frozen_sort_dict; ///< As qsort has no data pointer. With the freeze lock.
+
+static int onion_dict_frozen_cmp(const void *_a, const void *_b){
+	const onion_dict_freeze_element *a=_a, *b=_b;
+	int c=onion_dict_frozen_sort_dict->cmp(a->data.key, b->data.key);
+	return c ? c : a->index-b->index;
+}
+
+#ifdef HAVE_PTHREADS
+static pthread_mutex_t onion_dict_freeze_mutex=PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * @short Makes the dict read only, with all its elements at one sorted block.
+ * @memberof onion_dict_t
+ * 
+ * For dicts built once and then read by all the threads, as configuration or template contexts: the keys and
+ * string values are copied together after the sorted elements, so lookups are a binary search at one block,
+ * and there are no node, table or rwlock costs. onion_dict_lock_read and the others do nothing on them.
+ * 
+ * Sub dicts owned by it, added with OD_FREE_VALUE, are frozen too. Adding or removing fails after it, but the
+ * dict can still be cleared, and it is a normal empty dict after that. Freeze before sharing it with
+ * other threads.
+ */
+void onion_dict_freeze(onion_dict *dict){
+	if (dict->flags&OD_FROZEN)
+		return;
+	int n=onion_dict_count(dict);
+	onion_dict_freeze_state st={ malloc(sizeof(onion_dict_freeze_element)*(n ? n : 1)), 0, 0 };
+	onion_dict_preorder(dict, (void*)onion_dict_freeze_collect, &st);
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&onion_dict_freeze_mutex);
+#endif
+	onion_dict_frozen_sort_dict=dict;
+	qsort(st.elements, st.count, sizeof(onion_dict_freeze_element), onion_dict_frozen_cmp);
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&onion_dict_freeze_mutex);
+#endif
+	
+	onion_dict_frozen *frozen=malloc(sizeof(onion_dict_frozen)+sizeof(onion_dict_node_data)*st.count+st.strings);
+	frozen->count=st.count;
+	char *strings=(char*)&frozen->elements[st.count];
+	int i;
+	for (i=0;i<st.count;i++){
+		onion_dict_node_data *e=&frozen->elements[i];
+		const onion_dict_node_data *from=&st.elements[i].data;
+		size_t l=strlen(from->key)+1;
+		e->key=memcpy(strings, from->key, l);
+		strings+=l;
+		if (from->flags&OD_DICT){
+			e->value=from->value;
+			e->flags=from->flags&(OD_DICT|OD_FREE_VALUE);
+		}
+		else{
+			l=strlen(from->value)+1;
+			e->value=memcpy(strings, from->value, l);
+			strings+=l;
+			e->flags=0;
+		}
+	}
+	free(st.elements);
+	
+	int keep=dict->flags&(OD_SORTED);
+	dict->flags&=~OD_RCU; // Not shared yet, so no readers to wait for
+	onion_dict_clear(dict);
+	onion_dict_table_free(dict->table);
+	dict->table=NULL;
+	dict->frozen=frozen;
+	dict->flags=keep|OD_FROZEN;
+}
+
+/// Finds the first element with that key at the frozen block.
+static const onion_dict_node_data *onion_dict_frozen_find(const onion_dict *dict, const char *key){
+	const onion_dict_frozen *frozen=dict->frozen;
+	int lo=0, hi=frozen->count;
+	while (lo<hi){
+		int mid=(lo+hi)/2;
+		if (dict->cmp(frozen->elements[mid].key, key)<0)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	if (lo<frozen->count && dict->cmp(frozen->elements[lo].key, key)==0)
+		return &frozen->elements[lo];
+	return NULL;
+}
+
+/// Frees the block, and the owned sub dicts. The dict is normal and empty after it.
+static void onion_dict_frozen_free(onion_dict *dict){
+	int i;
+	for (i=0;i<dict->frozen->count;i++){
+		if (dict->frozen->elements[i].flags&OD_FREE_VALUE)
+			onion_dict_free((onion_dict*)dict->frozen->elements[i].value);
+	}
+	free(dict->frozen);
+	dict->frozen=NULL;
+	dict->flags&=~OD_FROZEN;
+}
+
+/// @}
+
+/// Finds the element data, at the flat array, the tree, the hash table or the frozen block.
+static const onion_dict_node_data *onion_dict_find(const onion_dict *dict, const char *key){
+	if (dict->flags&OD_FROZEN)
+		return onion_dict_frozen_find(dict, key);
+	if (dict->flags&OD_FLAT){
+		int found;
+		int i=onion_dict_flat_lower(dict, key, &found);
+		return found ? &dict->flat[i].data : NULL;
+	}
+	const onion_dict_table *table=__atomic_load_n(&dict->table, __ATOMIC_ACQUIRE); // As published, on OD_RCU
+	if (table){
+		int i=onion_dict_table_find(dict, table, key);
+		return i<0 ? NULL : &table->slots[i].data;
+	}
+	const onion_dict_node *r=onion_dict_find_node(dict, dict->root, key, NULL);
+	return r ? &r->data : NULL;
+}
+
 /**
  * @memberof onion_dict_t
  * Removes the given key. 
@@ -392,20 +1298,40 @@ static onion_dict_node *onion_dict_node_remove(const onion_dict *d, onion_dict_n
  * Returns if it removed any node.
  */ 
 int onion_dict_remove(onion_dict *dict, const char *key){
+	if (dict->flags&OD_FROZEN){
+		ONION_ERROR("Trying to remove %s from a frozen dict", key);
+		return 0;
+	}
+	dict->generation++;
+	if (dict->flags&OD_FLAT)
+		return onion_dict_flat_remove(dict, key);
+	if (dict->table)
+		return onion_dict_hash_remove(dict, key);
 	dict->root=onion_dict_node_remove(dict, dict->root, key);
 	return 1;
 }
 
+/**
+ * @short Returns a number that changes at each add, remove or clear of the dict.
+ * @memberof onion_dict_t
+ * 
+ * Comparing it to a previous value tells if the dict was modified since, as onion_request does
+ * to save only changed sessions. Changes inside the dicts it contains are not seen.
+ */
+unsigned int onion_dict_generation(const onion_dict *dict){
+	return dict->generation;
+}
+
 /**
  * @short Gets a value. For dicts returns NULL; use onion_dict_get_dict.
  * @memberof onion_dict_t
  */
 const char *onion_dict_get(const onion_dict *dict, const char *key){
-	const onion_dict_node *r;
-	r=onion_dict_find_node(dict, dict->root, key, NULL);
-	if (r && !(r->data.flags&OD_DICT))
-		return r->data.value;
-	return NULL;
+	int rcu=onion_dict_read_begin(dict);
+	const onion_dict_node_data *r=onion_dict_find(dict, key);
+	const char *ret=(r && !(r->flags&OD_DICT)) ? r->value : NULL;
+	onion_dict_read_end(rcu);
+	return ret;
 }
 
 /**
@@ -413,13 +1339,11 @@ const char *onion_dict_get(const onion_dict *dict, const char *key){
  * @memberof onion_dict_t
  */
 onion_dict *onion_dict_get_dict(const onion_dict *dict, const char *key){
-	const onion_dict_node *r;
-	r=onion_dict_find_node(dict, dict->root, key, NULL);
-	if (r){
-		if (r->data.flags&OD_DICT)
-			return (onion_dict*)r->data.value;
-	}
-	return NULL;
+	int rcu=onion_dict_read_begin(dict);
+	const onion_dict_node_data *r=onion_dict_find(dict, key);
+	onion_dict *ret=(r && (r->flags&OD_DICT)) ? (onion_dict*)r->value : NULL;
+	onion_dict_read_end(rcu);
+	return ret;
 }
 
 
@@ -445,6 +1369,13 @@ static void onion_dict_node_print_dot(const onion_dict_node *node){
  * User of this function has to write the 'digraph G{' and '}'
  */
 void onion_dict_print_dot(const onion_dict *dict){
+	int i;
+	for (i=0;i<dict->nflat && (dict->flags&OD_FLAT);i++)
+		fprintf(stderr,"\"%s\";\n",dict->flat[i].data.key);
+	for (i=0;dict->table && i<dict->table->nslots;i++){ // No graph, just the nodes
+		if (dict->table->slots[i].data.key)
+			fprintf(stderr,"\"%s\";\n",dict->table->slots[i].data.key);
+	}
 	if (dict->root)
 		onion_dict_node_print_dot(dict->root);
 }
@@ -468,11 +1399,119 @@ static void onion_dict_node_preorder(const onion_dict_node *node, void *func, vo
  * The function is of prototype void func(void *data, const char *key, const void *value, int flags);
  */
 void onion_dict_preorder(const onion_dict *dict, void *func, void *data){
+	if (dict && (dict->flags&OD_FROZEN)){
+		void (*f)(void *data, const char *key, const void *value, int flags)=func;
+		int i;
+		for (i=0;i<dict->frozen->count;i++)
+			f(data, dict->frozen->elements[i].key, dict->frozen->elements[i].value, dict->frozen->elements[i].flags);
+		return;
+	}
+	if (dict && (dict->flags&OD_FLAT)){
+		void (*f)(void *data, const char *key, const void *value, int flags)=func;
+		int i;
+		for (i=0;i<dict->nflat;i++)
+			f(data, dict->flat[i].data.key, dict->flat[i].data.value, dict->flat[i].data.flags);
+		return;
+	}
+	if (dict && dict->table){
+		int rcu=onion_dict_read_begin(dict);
+		onion_dict_hash_preorder(dict, __atomic_load_n(&dict->table, __ATOMIC_ACQUIRE), func, data);
+		onion_dict_read_end(rcu);
+		return;
+	}
 	if (!dict || !dict->root)
 		return;
 	onion_dict_node_preorder(dict->root, func, data);
 }
 
+/// Sets the current element of the iterator. Returns 1, as there is one.
+static int onion_dict_iter_set(onion_dict_iter *it, const onion_dict_node_data *data){
+	it->key=data->key;
+	it->value=data->value;
+	it->flags=data->flags;
+	return 1;
+}
+
+/// Pushes node and all its left children: the next one is the leftmost.
+static void onion_dict_iter_push_left(onion_dict_iter *it, const onion_dict_node *node){
+	for (;node;node=node->left){
+		if (it->depth==ONION_DICT_ITER_DEPTH){ // Can not be, AA trees are balanced
+			ONION_ERROR("Dict too deep to iterate");
+			return;
+		}
+		it->stack[it->depth++]=node;
+	}
+}
+
+/**
+ * @short Starts an iteration on the elements of the dict, without callbacks, recursion nor allocations.
+ * @memberof onion_dict_t
+ * 
+ * Use as:
+ * 
+ * @code
+ *   onion_dict_iter it;
+ *   if (onion_dict_iter_begin(dict, &it)) do{
+ *     use(it.key, it.value, it.flags);
+ *   }while(onion_dict_iter_next(&it));
+ * @endcode
+ * 
+ * The order is the same as onion_dict_preorder, but on OD_HASH dicts it is always the table order, even
+ * with OD_SORTED. The dict must not change while iterating; on OD_RCU dicts iterate between
+ * onion_dict_lock_read and onion_dict_unlock.
+ * 
+ * @returns 1 if at the first element, 0 if the dict is empty.
+ */
+int onion_dict_iter_begin(const onion_dict *dict, onion_dict_iter *it){
+	it->dict=dict;
+	it->pos=-1;
+	it->depth=0;
+	it->table=NULL;
+	if (!dict)
+		return 0;
+	if (!(dict->flags&(OD_FROZEN|OD_FLAT))){
+		it->table=__atomic_load_n(&dict->table, __ATOMIC_ACQUIRE);
+		if (!it->table)
+			onion_dict_iter_push_left(it, dict->root);
+	}
+	return onion_dict_iter_next(it);
+}
+
+/**
+ * @short Goes to the next element.
+ * @memberof onion_dict_t
+ * 
+ * @returns 1 if at an element, 0 at the end.
+ */
+int onion_dict_iter_next(onion_dict_iter *it){
+	const onion_dict *dict=it->dict;
+	if (!dict)
+		return 0;
+	if (dict->flags&OD_FROZEN){
+		if (++it->pos<dict->frozen->count)
+			return onion_dict_iter_set(it, &dict->frozen->elements[it->pos]);
+		return 0;
+	}
+	if (dict->flags&OD_FLAT){
+		if (++it->pos<dict->nflat)
+			return onion_dict_iter_set(it, &dict->flat[it->pos].data);
+		return 0;
+	}
+	if (it->table){
+		const onion_dict_table *table=it->table;
+		while (++it->pos<table->nslots){
+			if (table->slots[it->pos].data.key)
+				return onion_dict_iter_set(it, &table->slots[it->pos].data);
+		}
+		return 0;
+	}
+	if (!it->depth)
+		return 0;
+	const onion_dict_node *node=it->stack[--it->depth];
+	onion_dict_iter_push_left(it, node->right);
+	return onion_dict_iter_set(it, &node->data);
+}
+
 static int onion_dict_node_count(const onion_dict_node *node){
 	int c=1;
 	if (node->left)
@@ -487,6 +1526,16 @@ static int onion_dict_node_count(const onion_dict_node *node){
  * @memberof onion_dict_t
  */
 int onion_dict_count(const onion_dict *dict){
+	if (dict && (dict->flags&OD_FROZEN))
+		return dict->frozen->count;
+	if (dict && (dict->flags&OD_FLAT))
+		return dict->nflat;
+	if (dict && dict->table){
+		int rcu=onion_dict_read_begin(dict);
+		int count=__atomic_load_n(&dict->table, __ATOMIC_ACQUIRE)->count;
+		onion_dict_read_end(rcu);
+		return count;
+	}
 	if (dict && dict->root)
 		return onion_dict_node_count(dict->root);
 	return 0;
@@ -495,9 +1544,17 @@ int onion_dict_count(const onion_dict *dict){
 /**
  * Do a read lock. Several can lock for reading, but only can be writing.
  * @memberof onion_dict_t
+ * 
+ * On OD_RCU dicts it takes no lock, writers do not wait for it, but the values got are not freed until the unlock.
  */
 void onion_dict_lock_read(const onion_dict *dict){
 #ifdef HAVE_PTHREADS
+	if (dict->flags&OD_FROZEN) // Read only
+		return;
+	if (dict->flags&OD_RCU){
+		onion_dict_rcu_read_begin();
+		return;
+	}
 	pthread_rwlock_rdlock((pthread_rwlock_t*)&dict->lock);
 #endif
 }
@@ -508,6 +1565,12 @@ void onion_dict_lock_read(const onion_dict *dict){
  */
 void onion_dict_lock_write(onion_dict *dict){
 #ifdef HAVE_PTHREADS
+	if (dict->flags&OD_FROZEN) // Nothing to write
+		return;
+	if (dict->flags&OD_RCU){
+		onion_dict_rcu_write_begin(dict);
+		return;
+	}
 	pthread_rwlock_wrlock(&dict->lock);
 #endif
 }
@@ -518,24 +1581,45 @@ void onion_dict_lock_write(onion_dict *dict){
  */
 void onion_dict_unlock(onion_dict *dict){
 #ifdef HAVE_PTHREADS
+	if (dict->flags&OD_FROZEN)
+		return;
+	if (dict->flags&OD_RCU){
+		if (dict->writing && pthread_equal(dict->writer, pthread_self()))
+			onion_dict_rcu_write_end(dict);
+		else
+			onion_dict_rcu_read_end();
+		return;
+	}
 	pthread_rwlock_unlock(&dict->lock);
 #endif
 }
 
+/**
+ * @short Adds the C quoted str to block; short ones through a stack buffer, with no malloc.
+ */
+static int onion_dict_json_add_quoted(onion_block *block, const char *str){
+	char buffer[256];
+	size_t l=onion_c_quote_length(str);
+	char *s=(l<=sizeof(buffer)) ? buffer : malloc(l);
+	if (s==NULL)
+		return 0;
+	onion_c_quote(str, s, l);
+	onion_block_add_str(block, s);
+	if (s!=buffer)
+		free(s);
+	return 1;
+}
+
 /**
  * @short Helps to prepare each pair.
  */
 static void onion_dict_json_preorder(onion_block *block, const char *key, const void *value, int flags){
 	if (!onion_block_size(block)) // Error somewhere.
 		return;
-	char *s;
-	s=onion_c_quote_new(key);
-	if (s==NULL){
+	if (!onion_dict_json_add_quoted(block, key)){
 		onion_block_clear(block);
 		return;
 	}
-	onion_block_add_str(block, s);
-	free(s);
 	onion_block_add_char(block, ':');
 	if (flags&OD_DICT){
 		onion_block *tmp;
@@ -548,17 +1632,116 @@ static void onion_dict_json_preorder(onion_block *block, const char *key, const
 		onion_block_free(tmp);
 	}
 	else{
-		s=onion_c_quote_new(value);
-		if (s==NULL){
+		if (!onion_dict_json_add_quoted(block, value)){
 			onion_block_clear(block);
 			return;
 		}
-		onion_block_add_str(block, s);
-		free(s);
 	}
 	onion_block_add_data(block, ", ",2);
 }
 
+/// State of a json streaming, while at onion_dict_preorder.
+typedef struct{
+	onion_dict_json_writer write;
+	void *data;
+	ssize_t total;           ///< Written bytes, or -1 on error.
+	int first;               ///< No pair written yet at this level.
+}onion_dict_json_state;
+
+/// Characters that must be escaped at json strings: the escape letter, 'u' for \u00XX, or 0 if written as is.
+static const char onion_dict_json_escapes[256]={
+	'u','u','u','u','u','u','u','u','b','t','n','u','f','r','u','u',
+	'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u',
+	0,0,'"',0,0,0,0,0,0,0,0,0,0,0,0,0,
+	[0x5C]='\\',
+};
+
+static void onion_dict_json_write(onion_dict_json_state *st, const char *str, size_t length){
+	if (st->total<0 || !length)
+		return;
+	ssize_t w=st->write(st->data, str, length);
+	if (w<0)
+		st->total=-1;
+	else
+		st->total+=w;
+}
+
+/// Writes the string quoted and escaped. Runs of plain characters, most of them, go at one write.
+static void onion_dict_json_write_string(onion_dict_json_state *st, const char *str){
+	const unsigned char *p=(const unsigned char*)str;
+	onion_dict_json_write(st, "\"", 1);
+	while (*p){
+		const unsigned char *run=p;
+		while (*p && !onion_dict_json_escapes[*p])
+			p++;
+		onion_dict_json_write(st, (const char*)run, p-run);
+		if (!*p)
+			break;
+		char esc[8]={'\\', onion_dict_json_escapes[*p]};
+		if (esc[1]=='u'){
+			snprintf(esc+1, sizeof(esc)-1, "u%04x", *p);
+			onion_dict_json_write(st, esc, 6);
+		}
+		else
+			onion_dict_json_write(st, esc, 2);
+		p++;
+	}
+	onion_dict_json_write(st, "\"", 1);
+}
+
+static void onion_dict_json_write_dict(onion_dict_json_state *st, const onion_dict *dict);
+
+/// Writes each pair, from onion_dict_preorder.
+static void onion_dict_json_write_pair(onion_dict_json_state *st, const char *key, const void *value, int flags){
+	if (!st->first)
+		onion_dict_json_write(st, ", ", 2);
+	st->first=0;
+	onion_dict_json_write_string(st, key);
+	onion_dict_json_write(st, ":", 1);
+	if (flags&OD_DICT)
+		onion_dict_json_write_dict(st, (const onion_dict*)value);
+	else
+		onion_dict_json_write_string(st, value);
+}
+
+static void onion_dict_json_write_dict(onion_dict_json_state *st, const onion_dict *dict){
+	onion_dict_json_write(st, "{", 1);
+	int first=st->first;
+	st->first=1;
+	onion_dict_preorder(dict, (void*)onion_dict_json_write_pair, st);
+	st->first=first;
+	onion_dict_json_write(st, "}", 1);
+}
+
+static ssize_t onion_dict_json_count(void *_, const char *str, size_t length){
+	return length;
+}
+
+/**
+ * @short Streams the dict as json, piece by piece to write, without building it in memory first.
+ * @memberof onion_dict_t
+ * 
+ * Strings are escaped as json requires; the output is as onion_dict_to_json for plain strings. Most 
+ * pieces are small, so write should buffer, as onion_response_write does. @see onion_dict_write_json
+ * 
+ * @returns The bytes written, or -1 if any write failed.
+ */
+ssize_t onion_dict_json_stream(const onion_dict *dict, onion_dict_json_writer write, void *data){
+	onion_dict_json_state st={ write, data, 0, 1 };
+	onion_dict_json_write_dict(&st, dict);
+	return st.total;
+}
+
+/**
+ * @short Length of the json onion_dict_write_json would write, without writing it.
+ * @memberof onion_dict_t
+ */
+size_t onion_dict_json_length(const onion_dict *dict){
+	onion_dict_json_state st={ onion_dict_json_count, NULL, 0, 1 };
+	onion_dict_json_write_dict(&st, dict);
+	return st.total;
+}
+
 /**
  * @short Converts a dict to a json string
  * @memberof onion_dict_t
@@ -571,8 +1754,7 @@ onion_block *onion_dict_to_json(onion_dict *dict){
 	onion_block *block=onion_block_new();
 	
 	onion_block_add_char(block, '{');
-	if (dict && dict->root)
-		onion_dict_node_preorder(dict->root, (void*)onion_dict_json_preorder, block);
+	onion_dict_preorder(dict, (void*)onion_dict_json_preorder, block);
 
 
 	int s=onion_block_size(block);
@@ -589,6 +1771,336 @@ onion_block *onion_dict_to_json(onion_dict *dict){
 	return block;
 }
 
+/// @{ @name Json parsing, onion_dict_from_json
+
+/// Deepest objects and arrays nesting allowed, as the parser recurses.
+#define ONION_DICT_JSON_MAX_DEPTH 64
+
+/// State while parsing json.
+typedef struct{
+	char *p;             ///< Next character to parse.
+	char *end;
+	int inplace;         ///< Strings are decoded at the data itself, and borrowed by the dict.
+	int depth;
+}onion_dict_json_parser;
+
+static int onion_dict_json_parse_value(onion_dict_json_parser *pa, onion_dict *dict, const char *key, int keyflags);
+
+/// Skips the whitespace, and returns the next character, or 0 at the end.
+static char onion_dict_json_ws(onion_dict_json_parser *pa){
+	while (pa->p<pa->end && (*pa->p==' ' || *pa->p=='\n' || *pa->p=='\r' || *pa->p=='\t'))
+		pa->p++;
+	return pa->p<pa->end ? *pa->p : 0;
+}
+
+/// Ones at each of the 8 bytes of a word.
+#define ONION_DICT_JSON_ONES 0x0101010101010101ULL
+
+/**
+ * @short Finds the next quote, backslash or control character of a string.
+ * 
+ * Eight bytes at a time, with the has-zero-byte trick on plain words, so long strings need no per byte branches.
+ */
+static char *onion_dict_json_scan(char *p, const char *end){
+	while (end-p>=8){
+		uint64_t w;
+		memcpy(&w, p, 8);
+		uint64_t quote=w^(ONION_DICT_JSON_ONES*'"');
+		uint64_t backslash=w^(ONION_DICT_JSON_ONES*'\\');
+		uint64_t found=((quote-ONION_DICT_JSON_ONES)&~quote) | ((backslash-ONION_DICT_JSON_ONES)&~backslash) | ((w-ONION_DICT_JSON_ONES*0x20)&~w);
+		if (found&(ONION_DICT_JSON_ONES*0x80))
+			break;
+		p+=8;
+	}
+	while (p<end && *p!='"' && *p!='\\' && (unsigned char)*p>=0x20)
+		p++;
+	return p;
+}
+
+/// Value of 4 hex digits, or -1.
+static int onion_dict_json_hex4(const char *p){
+	int i, v=0;
+	for (i=0;i<4;i++){
+		char c=p[i];
+		v<<=4;
+		if (c>='0' && c<='9')
+			v|=c-'0';
+		else if (c>='a' && c<='f')
+			v|=c-'a'+10;
+		else if (c>='A' && c<='F')
+			v|=c-'A'+10;
+		else
+			return -1;
+	}
+	return v;
+}
+
+/// Decodes the escapes at [s,e) to dst, that may be s itself, as it never grows. Returns the end at dst, or NULL if bad.
+static char *onion_dict_json_unescape(const char *s, const char *e, char *dst){
+	while (s<e){
+		if (*s!='\\'){
+			*dst++=*s++;
+			continue;
+		}
+		s++;
+		switch(*s++){
+			case '"': *dst++='"'; break;
+			case '\\': *dst++='\\'; break;
+			case '/': *dst++='/'; break;
+			case 'b': *dst++='\b'; break;
+			case 'f': *dst++='\f'; break;
+			case 'n': *dst++='\n'; break;
+			case 'r': *dst++='\r'; break;
+			case 't': *dst++='\t'; break;
+			case 'u':{
+				if (e-s<4)
+					return NULL;
+				long c=onion_dict_json_hex4(s);
+				s+=4;
+				if (c>=0xD800 && c<=0xDBFF){ // Surrogate pair, 12 chars to 4 bytes
+					int low=(e-s>=6 && s[0]=='\\' && s[1]=='u') ? onion_dict_json_hex4(s+2) : -1;
+					if (low<0xDC00 || low>0xDFFF)
+						return NULL;
+					c=0x10000+((c-0xD800)<<10)+(low-0xDC00);
+					s+=6;
+				}
+				else if (c<0 || (c>=0xDC00 && c<=0xDFFF))
+					return NULL;
+				if (c<0x80)
+					*dst++=c;
+				else if (c<0x800){
+					*dst++=0xC0|(c>>6);
+					*dst++=0x80|(c&0x3F);
+				}
+				else if (c<0x10000){
+					*dst++=0xE0|(c>>12);
+					*dst++=0x80|((c>>6)&0x3F);
+					*dst++=0x80|(c&0x3F);
+				}
+				else{
+					*dst++=0xF0|(c>>18);
+					*dst++=0x80|((c>>12)&0x3F);
+					*dst++=0x80|((c>>6)&0x3F);
+					*dst++=0x80|(c&0x3F);
+				}
+			}
+			break;
+			default:
+				return NULL;
+		}
+	}
+	return dst;
+}
+
+/**
+ * @short Parses a string, just after its opening quote.
+ * 
+ * In place it is decoded at the data, ended with a \0 where the closing quote was, and borrowed; if not,
+ * it is a new copy, and freeflag is set at flags.
+ * 
+ * @returns The string, or NULL if bad.
+ */
+static char *onion_dict_json_parse_string(onion_dict_json_parser *pa, int freeflag, int *flags){
+	char *start=pa->p, *q=start;
+	int escaped=0;
+	while (1){
+		q=onion_dict_json_scan(q, pa->end);
+		if (q>=pa->end || (unsigned char)*q<0x20)
+			return NULL;
+		if (*q=='"')
+			break;
+		escaped=1;
+		q+=2; // The escaped character; \u digits are checked at unescape
+	}
+	pa->p=q+1;
+	char *ret=start;
+	*flags=0;
+	if (!pa->inplace){
+		ret=malloc(q-start+1);
+		*flags=freeflag;
+	}
+	char *retend;
+	if (escaped)
+		retend=onion_dict_json_unescape(start, q, ret);
+	else if (pa->inplace)
+		retend=q;
+	else{
+		memcpy(ret, start, q-start);
+		retend=ret+(q-start);
+	}
+	if (!retend){
+		if (!pa->inplace)
+			free(ret);
+		return NULL;
+	}
+	*retend='\0';
+	return ret;
+}
+
+/// Parses the members of an object, or the elements of an array with keys "0", "1"..., just after the { or [.
+static int onion_dict_json_parse_container(onion_dict_json_parser *pa, onion_dict *dict, char close){
+	if (++pa->depth>ONION_DICT_JSON_MAX_DEPTH)
+		return 0;
+	int n=0;
+	if (onion_dict_json_ws(pa)==close){
+		pa->p++;
+		pa->depth--;
+		return 1;
+	}
+	while (1){
+		if (close=='}'){
+			if (onion_dict_json_ws(pa)!='"')
+				return 0;
+			pa->p++;
+			int keyflags;
+			char *key=onion_dict_json_parse_string(pa, OD_FREE_KEY, &keyflags);
+			if (!key)
+				return 0;
+			if (onion_dict_json_ws(pa)!=':' || (pa->p++, !onion_dict_json_parse_value(pa, dict, key, keyflags))){
+				if (keyflags)
+					free(key);
+				return 0;
+			}
+		}
+		else{
+			char key[16];
+			snprintf(key, sizeof(key), "%d", n);
+			if (!onion_dict_json_parse_value(pa, dict, key, OD_DUP_KEY))
+				return 0;
+		}
+		n++;
+		char c=onion_dict_json_ws(pa);
+		pa->p++;
+		if (c==close)
+			break;
+		if (c!=',')
+			return 0;
+	}
+	pa->depth--;
+	return 1;
+}
+
+/// Whether it is a json number: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+static int onion_dict_json_is_number(const char *p){
+	if (*p=='-')
+		p++;
+	if (*p=='0')
+		p++;
+	else if (isdigit((unsigned char)*p)){
+		while (isdigit((unsigned char)*p))
+			p++;
+	}
+	else
+		return 0;
+	if (*p=='.'){
+		p++;
+		if (!isdigit((unsigned char)*p))
+			return 0;
+		while (isdigit((unsigned char)*p))
+			p++;
+	}
+	if (*p=='e' || *p=='E'){
+		p++;
+		if (*p=='+' || *p=='-')
+			p++;
+		if (!isdigit((unsigned char)*p))
+			return 0;
+		while (isdigit((unsigned char)*p))
+			p++;
+	}
+	return *p=='\0';
+}
+
+/// Parses a value, and adds it at key. Numbers, true, false and null are kept as their text.
+static int onion_dict_json_parse_value(onion_dict_json_parser *pa, onion_dict *dict, const char *key, int keyflags){
+	char c=onion_dict_json_ws(pa);
+	if (c=='"'){
+		pa->p++;
+		int flags;
+		char *value=onion_dict_json_parse_string(pa, OD_FREE_VALUE, &flags);
+		if (!value)
+			return 0;
+		onion_dict_add(dict, key, value, keyflags|flags|OD_REPLACE);
+		return 1;
+	}
+	if (c=='{' || c=='['){
+		pa->p++;
+		onion_dict *sub=onion_dict_new();
+		if (!onion_dict_json_parse_container(pa, sub, c=='{' ? '}' : ']')){
+			onion_dict_free(sub);
+			return 0;
+		}
+		onion_dict_add(dict, key, sub, keyflags|OD_DICT|OD_FREE_VALUE|OD_REPLACE);
+		return 1;
+	}
+	char *start=pa->p;
+	while (pa->p<pa->end && (isalnum((unsigned char)*pa->p) || *pa->p=='-' || *pa->p=='+' || *pa->p=='.'))
+		pa->p++;
+	size_t l=pa->p-start;
+	char literal[64];
+	if (l==0 || l>=sizeof(literal))
+		return 0;
+	memcpy(literal, start, l);
+	literal[l]='\0';
+	if (strcmp(literal, "true")!=0 && strcmp(literal, "false")!=0 && strcmp(literal, "null")!=0 && !onion_dict_json_is_number(literal))
+		return 0;
+	onion_dict_add(dict, key, literal, keyflags|OD_DUP_VALUE|OD_REPLACE);
+	return 1;
+}
+
+/// Parses the json, an object or an array, that must be all the data but trailing whitespace.
+static onion_dict *onion_dict_json_parse(char *data, size_t length, int inplace){
+	onion_dict_json_parser pa={ data, data+length, inplace, 0 };
+	char c=onion_dict_json_ws(&pa);
+	if (c!='{' && c!='['){
+		ONION_DEBUG("Json is not an object nor an array");
+		return NULL;
+	}
+	pa.p++;
+	onion_dict *dict=onion_dict_new();
+	if (!onion_dict_json_parse_container(&pa, dict, c=='{' ? '}' : ']')){
+		ONION_DEBUG("Invalid json at position %d", (int)(pa.p-data));
+		onion_dict_free(dict);
+		return NULL;
+	}
+	while (onion_dict_json_ws(&pa)=='\0' && pa.p<pa.end) // As a \0 ended body
+		pa.p++;
+	if (pa.p!=pa.end){
+		ONION_DEBUG("Extra data after the json at position %d", (int)(pa.p-data));
+		onion_dict_free(dict);
+		return NULL;
+	}
+	return dict;
+}
+
+/**
+ * @short Parses a json object, or array, into a new dict.
+ * @memberof onion_dict_t
+ * 
+ * Objects and arrays become dicts, arrays with the keys "0", "1"...; numbers, true, false and null are
+ * kept as their text, as strings. All the strings are copies. Repeated keys keep the last value.
+ * 
+ * @returns The new dict, or NULL if the json is not valid.
+ */
+onion_dict *onion_dict_from_json(const char *data){
+	return onion_dict_json_parse((char*)data, strlen(data), 0); // Not written, as not in place
+}
+
+/**
+ * @short Parses a json as onion_dict_from_json, but the strings are decoded at the data, and borrowed.
+ * @memberof onion_dict_t
+ * 
+ * The data is modified, as strings get their \0 there, and the dict must be freed before the data. There are
+ * no copies other than for the array keys and the numbers and literals; this is the fast path for bodies.
+ * 
+ * @returns The new dict, or NULL if the json is not valid. Even then the data may be already modified.
+ */
+onion_dict *onion_dict_from_json_inplace(char *data, size_t length){
+	return onion_dict_json_parse(data, length, 1);
+}
+
+/// @}
+
 /**
  * @short Gets a dictionary string value, recursively
  * @memberof onion_dict_t
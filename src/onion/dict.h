@@ -28,6 +28,7 @@
 
 #include "types.h"
 #include <stddef.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C"{
@@ -54,6 +55,11 @@ enum onion_dict_flags_e{
   
   // Flags for onion_dict_set_flags
   OD_ICASE=0x01,     ///< Do case insensitive cmps.
+  OD_HASH=0x08,      ///< Keep the elements at a hash table, faster for big dicts. Not in order.
+  OD_SORTED=0x80,    ///< With OD_HASH, onion_dict_preorder and onion_dict_to_json still go in order by key.
+  OD_FLAT=0x04,      ///< Keep the elements at a flat array while they are few, as headers. Set when empty.
+  OD_RCU=0x02,       ///< Read mostly hash dict shared by threads: lookups take no lock, writes copy the table. Implies OD_HASH.
+  OD_FROZEN=0x10,    ///< Read only, at one sorted block. Set by onion_dict_freeze, not by onion_dict_set_flags.
 };
 
 /// Initializes a dict.
@@ -67,6 +73,12 @@ void onion_dict_add(onion_dict *dict, const char *key, const void *value, int fl
 /// Removes a value
 int onion_dict_remove(onion_dict *dict, const char *key);
 
+/// Removes all the elements, keeping the dict for reuse.
+void onion_dict_clear(onion_dict *dict);
+
+/// Makes the dict read only, compacted at one sorted block, without locks.
+void onion_dict_freeze(onion_dict *dict);
+
 /// Removes the full dict struct form mem.
 void onion_dict_free(onion_dict *dict);
 
@@ -94,8 +106,33 @@ void onion_dict_print_dot(const onion_dict *dict);
 /// Visits the full graph in preorder, calling that function on each node. void func(void *data, const char *key, const void *value, int flags).
 void onion_dict_preorder(const onion_dict *dict, void *func, void *data);
 
+/// Depth of the trees that iterators can walk. As trees are balanced, its for all the elements that fit in memory.
+#define ONION_DICT_ITER_DEPTH 64
+
+/**
+ * @short Iterator on the elements of a dict, usually at the stack. @see onion_dict_iter_begin
+ */
+typedef struct onion_dict_iter_t{
+	const char *key;      ///< Current element
+	const void *value;
+	int flags;
+	// Private
+	const onion_dict *dict;
+	const void *table;
+	int pos;
+	int depth;
+	const void *stack[ONION_DICT_ITER_DEPTH];
+}onion_dict_iter;
+
+/// Starts iterating the dict. Returns 1 if at the first element, 0 if empty.
+int onion_dict_iter_begin(const onion_dict *dict, onion_dict_iter *it);
+/// Goes to the next element. Returns 1 if at it, 0 at the end.
+int onion_dict_iter_next(onion_dict_iter *it);
+
 /// Counts elements
 int onion_dict_count(const onion_dict *dict);
+/// Returns a number that changes at each modification of the dict
+unsigned int onion_dict_generation(const onion_dict *dict);
 
 /// @{ @name lock management
 /// Locks for reading. Several can read, one can write.
@@ -107,6 +144,18 @@ void onion_dict_unlock(onion_dict *dict);
 /// @}
 
 onion_block *onion_dict_to_json(onion_dict *dict);
+/// Writes a piece of json, for onion_dict_json_stream. Returns the bytes written, or <0 on error.
+typedef ssize_t (*onion_dict_json_writer)(void *data, const char *str, size_t length);
+/// Streams the dict as json to write. Returns the bytes written, or -1.
+ssize_t onion_dict_json_stream(const onion_dict *dict, onion_dict_json_writer write, void *data);
+/// Writes the dict as json straight to the response. Returns the bytes written, or -1. At response.c.
+ssize_t onion_dict_write_json(const onion_dict *dict, onion_response *res);
+/// Length onion_dict_write_json would write.
+size_t onion_dict_json_length(const onion_dict *dict);
+/// Parses a json object or array into a new dict, with copies of the strings. NULL if not valid.
+onion_dict *onion_dict_from_json(const char *data);
+/// Parses a json as onion_dict_from_json, but decoding the strings at the data, that the dict borrows.
+onion_dict *onion_dict_from_json_inplace(char *data, size_t length);
 
 #ifdef __cplusplus
 }
@@ -23,27 +23,67 @@
 	library; if not see <http://www.gnu.org/licenses/>.
 	*/
 
+
 #include <png.h>
+#include <stdlib.h>
+#include <string.h>
 #include <onion/response.h>
 #include <onion/log.h>
+#include <onion/extras/png.h>
+
+#if defined(HAVE_ZLIB) && defined(HAVE_PTHREADS)
+#define ONION_PNG_PARALLEL
+#include <stdint.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <onion/workers.h>
+
+/// Raw bytes per band when deflating in parallel. Smaller images use libpng.
+#define ONION_PNG_BAND_SIZE (256*1024)
+
+struct onion_png_band_t;
+typedef struct onion_png_band_t onion_png_band;
+#endif
 
-struct onion_png_data_t{
+struct onion_png_t{
 	onion_response *res;
-	int sent;
-};
+	int Bpp; ///< Always positive; bgr tells the order
+	int bgr;
+	int width;
+	int height;
+	size_t rowbytes;
+	int rows; ///< Rows written so far
+	int started; ///< Set at the first row, options can not change after that
+	int skip; ///< HEAD, nothing is written
+	int error;
+	int level;
+	onion_png_filter filter;
+	int nthreads;
+
+	png_structp png;
+	png_infop info;
 
-typedef struct onion_png_data_t onion_png_data;
+#ifdef ONION_PNG_PARALLEL
+	onion_workers *workers;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int band_rows;
+	int max_bands; ///< Bands in flight before waiting for the first
+	int nbands;
+	onion_png_band *bands; ///< In image order, the first is the next to write
+	onion_png_band *last_band;
+	onion_png_band *current; ///< Being filled
+	unsigned char *last_row; ///< Last row of the previous band, as the filters need it
+	uLong adler;
+#endif
+};
 
-// If not sent yet, writes the error. also always write it to the log.
+// Logs the error and goes back to the setjmp at the caller.
 static void error(png_struct *p, const char *msg){
-	onion_png_data *d=(onion_png_data*)png_get_io_ptr(p);
-	if (!d->sent){
-		onion_response_set_code(d->res, HTTP_INTERNAL_ERROR);
-		onion_response_printf(d->res, "Libpng error: %s", msg);
-		d->sent=1;
-	}
-	
-	ONION_ERROR("%s", msg);
+	onion_png *png=(onion_png*)png_get_error_ptr(p);
+	png->error=1;
+	ONION_ERROR("Libpng error: %s", msg);
+	png_longjmp(p, 1);
 }
 
 // Shows a warning on the logs
@@ -53,120 +93,474 @@ static void warning(png_struct *p, const char *msg){
 
 // Writes the data to the response
 static void onion_png_write(png_struct *p, png_bytep data, size_t l){
-	onion_png_data *d=(onion_png_data*)png_get_io_ptr(p);
-	onion_response_write(d->res, (const char *)data, l);
-	//ONION_DEBUG("Write");
+	onion_png *png=(onion_png*)png_get_io_ptr(p);
+	onion_response_write(png->res, (const char *)data, l);
 }
 
 // do nothing.
 static void onion_png_flush(png_struct *p){
-	//ONION_DEBUG("Flush");
 }
 
 /**
- * @short Writes an image as png to the response object
- * 
- * @param image flat buffer with all pixels
+ * @short Starts a png image on the response, to be written row by row
+ * @memberof onion_png_t
+ *
+ * It sets the Content-Type and writes the headers. Then the rows are written with onion_png_write_rows,
+ * as they are produced, and onion_png_end finishes the image.
+ *
+ * On HEAD requests it returns a valid object that ignores the rows, so callers need no special case.
+ *
+ * @param res where to write the image
  * @param Bpp Bytes per pixel: 1 grayscale, 2 grayscale with alpha, 3 RGB, 4 RGB with alpha. Negative if in BGR format (cairo)
  * @param width The width of the image
  * @param height The height of the image
- * @param res where to write the image, it sets the necessary structs
+ * @returns The encoder, or NULL on invalid parameters; then nothing was written.
  */
-int onion_png_response(unsigned char *image, int Bpp, int width, int height, onion_response *res){
-	// Many copied from example.c from libpng source code.
-	png_structp png_ptr;
-	png_infop info_ptr;
-
-	/* Create and initialize the png_struct with the desired error handler
-	* functions.  If you want to use the default stderr and longjump method,
-	* you can supply NULL for the last three parameters.  We also check that
-	* the library version is compatible with the one used at compile time,
-	* in case we are using dynamically linked libraries.  REQUIRED.
-	*/
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, error, warning);
+onion_png *onion_png_begin(onion_response *res, int Bpp, int width, int height){
+	int bgr=0;
+	if (Bpp<0){
+		bgr=1;
+		Bpp=-Bpp;
+	}
+	if (Bpp<1 || Bpp>4){
+		ONION_ERROR("Wrong bytes per pixel: %d", Bpp);
+		return NULL;
+	}
+	if (width<=0 || height<=0){
+		ONION_ERROR("Wrong image size: %dx%d", width, height);
+		return NULL;
+	}
+	onion_png *png=calloc(1, sizeof(onion_png));
+	png->res=res;
+	png->Bpp=Bpp;
+	png->bgr=bgr;
+	png->width=width;
+	png->height=height;
+	png->rowbytes=(size_t)width*Bpp;
+	png->level=-1;
+	png->filter=ONION_PNG_FILTER_DEFAULT;
+	png->nthreads=1;
 
-	if (png_ptr == NULL)
-	{
-		return OCS_INTERNAL_ERROR;
+	onion_response_set_header(res, "Content-Type", "image/png");
+	if (onion_response_write_headers(res)==OR_SKIP_CONTENT) // Maybe it was HEAD.
+		png->skip=1;
+	return png;
+}
+
+/**
+ * @short Sets the zlib compression level and the row filter
+ * @memberof onion_png_t
+ *
+ * Must be called before the first row. Low levels save a lot of CPU on big images
+ * that are generated on the fly; ONION_PNG_FILTER_NONE also helps on synthetic images.
+ *
+ * @param level 0 (no compression) to 9 (best), or -1 for the zlib default.
+ * @param filter Row filter to use, ONION_PNG_FILTER_DEFAULT lets the encoder choose per row.
+ */
+void onion_png_set_compression(onion_png *png, int level, onion_png_filter filter){
+	if (png->started){
+		ONION_WARNING("PNG compression can only be set before the first row");
+		return;
 	}
+	if (level<-1 || level>9){
+		ONION_WARNING("Invalid PNG compression level %d, using the default", level);
+		level=-1;
+	}
+	png->level=level;
+	png->filter=filter;
+}
 
-	/* Allocate/initialize the image information data.  REQUIRED */
-	info_ptr = png_create_info_struct(png_ptr);
-	if (info_ptr == NULL)
-	{
-		png_destroy_write_struct(&png_ptr,  NULL);
-		return OCS_INTERNAL_ERROR;
+/**
+ * @short Sets how many threads deflate the image
+ * @memberof onion_png_t
+ *
+ * With more than one thread, big images are split in bands of rows that are filtered and deflated
+ * in parallel, and written in order as they are ready, while the producer keeps writing rows.
+ * Small images, or builds without zlib or pthreads, use a single thread.
+ *
+ * Must be called before the first row.
+ */
+void onion_png_set_threads(onion_png *png, int nthreads){
+	if (png->started){
+		ONION_WARNING("PNG threads can only be set before the first row");
+		return;
 	}
+	png->nthreads=nthreads>1 ? nthreads : 1;
+}
 
-	onion_png_data opd;
-	opd.res=res;
-	opd.sent=0;
-	png_set_write_fn(png_ptr, (void *)&opd, onion_png_write, onion_png_flush);
-	/* where user_io_ptr is a structure you want available to the callbacks */
+// Sets up libpng, writing the signature and the IHDR.
+static int onion_png_start_libpng(onion_png *png){
+	png->png=png_create_write_struct(PNG_LIBPNG_VER_STRING, png, error, warning);
+	if (png->png)
+		png->info=png_create_info_struct(png->png);
+	if (!png->info){
+		png->error=1;
+		return -1;
+	}
+	if (setjmp(png_jmpbuf(png->png)))
+		return -1;
+	png_set_write_fn(png->png, png, onion_png_write, onion_png_flush);
+	if (png->bgr)
+		png_set_bgr(png->png);
 
-	onion_response_set_header(res, "Content-Type", "image/png");
-	if (onion_response_write_headers(res)==OR_SKIP_CONTENT) // Maybe it was HEAD.
-		return OCS_PROCESSED;
-	 
-	/* Set the image information here.  Width and height are up to 2^31,
-	* bit_depth is one of 1, 2, 4, 8, or 16, but valid values also depend on
-	* the color_type selected. color_type is one of PNG_COLOR_TYPE_GRAY,
-	* PNG_COLOR_TYPE_GRAY_ALPHA, PNG_COLOR_TYPE_PALETTE, PNG_COLOR_TYPE_RGB,
-	* or PNG_COLOR_TYPE_RGB_ALPHA.  interlace is either PNG_INTERLACE_NONE or
-	* PNG_INTERLACE_ADAM7, and the compression_type and filter_type MUST
-	* currently be PNG_COMPRESSION_TYPE_BASE and PNG_FILTER_TYPE_BASE. REQUIRED
-	*/
-	if (Bpp<0){
-		png_set_bgr(png_ptr);
-		Bpp=-Bpp;
+	static const int color_types[]={PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA, PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGB_ALPHA};
+	png_set_IHDR(png->png, png->info, png->width, png->height, 8, color_types[png->Bpp-1],
+			PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	png_set_compression_level(png->png, png->level);
+	static const int filters[]={0, PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH, PNG_ALL_FILTERS};
+	if (png->filter!=ONION_PNG_FILTER_DEFAULT)
+		png_set_filter(png->png, PNG_FILTER_TYPE_BASE, filters[png->filter]);
+	png_write_info(png->png, png->info);
+	return 0;
+}
+
+#ifdef ONION_PNG_PARALLEL
+
+struct onion_png_band_t{
+	onion_png *png;
+	unsigned char *raw; ///< The row before the band, then its rows
+	int nrows;
+	int first;
+	int last;
+	unsigned char *out; ///< Deflated, with the zlib header at the first band
+	size_t outlen;
+	size_t inlen; ///< Filtered bytes
+	uLong adler; ///< Of the filtered bytes
+	int done;
+	int error;
+	onion_png_band *next;
+};
+
+static void onion_png_put32(unsigned char *p, uint32_t v){
+	p[0]=v>>24;
+	p[1]=v>>16;
+	p[2]=v>>8;
+	p[3]=v;
+}
+
+// Writes a whole chunk, with its length and crc.
+static void onion_png_chunk(onion_png *png, const char *type, const unsigned char *data, size_t len){
+	unsigned char head[8], crc[4];
+	onion_png_put32(head, len);
+	memcpy(head+4, type, 4);
+	uLong c=crc32(crc32(0, NULL, 0), head+4, 4);
+	c=crc32(c, data, len);
+	onion_png_put32(crc, c);
+	onion_response_write(png->res, (const char*)head, 8);
+	onion_response_write(png->res, (const char*)data, len);
+	onion_response_write(png->res, (const char*)crc, 4);
+}
+
+static int onion_png_paeth(int a, int b, int c){
+	int p=a+b-c;
+	int pa=abs(p-a), pb=abs(p-b), pc=abs(p-c);
+	if (pa<=pb && pa<=pc)
+		return a;
+	if (pb<=pc)
+		return b;
+	return c;
+}
+
+// Filters the row with the given type (1 to 5, as in the PNG spec, minus one) into out, and returns the sum of abs values.
+static unsigned long onion_png_filter_row(int type, unsigned char *out, const unsigned char *row, const unsigned char *prev, size_t n, int bpp){
+	unsigned long sum=0;
+	size_t i;
+	out[0]=type;
+	out++;
+	for (i=0;i<n;i++){
+		int a=i>=bpp ? row[i-bpp] : 0;
+		int c=i>=bpp ? prev[i-bpp] : 0;
+		unsigned char v;
+		switch(type){
+			case 0: v=row[i]; break;
+			case 1: v=row[i]-a; break;
+			case 2: v=row[i]-prev[i]; break;
+			case 3: v=row[i]-((a+prev[i])>>1); break;
+			default: v=row[i]-onion_png_paeth(a, prev[i], c); break;
+		}
+		out[i]=v;
+		sum+=v<128 ? v : 256-v;
 	}
+	return sum;
+}
 
-	switch(Bpp){
-		case 1:
-			png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_GRAY,
-					PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-		break;
-		case 2:
-			png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_GRAY_ALPHA,
-					PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-		break;
-		case 3:
-			png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB,
-					PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-		break;
-		case 4:
-			png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA,
-					PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-		break;
-		default:
-			png_error(png_ptr, "Wrong bytes per pixel");
-			break;
+// Filters the row into out, choosing the filter per row as libpng does (minimum sum of absolute differences).
+static void onion_png_filter_best(onion_png *png, unsigned char *out, const unsigned char *row, const unsigned char *prev, unsigned char *scratch){
+	size_t n=png->rowbytes;
+	if (png->filter!=ONION_PNG_FILTER_DEFAULT && png->filter!=ONION_PNG_FILTER_ADAPTIVE){
+		onion_png_filter_row(png->filter-ONION_PNG_FILTER_NONE, out, row, prev, n, png->Bpp);
+		return;
 	}
-	
-	png_uint_32 k;
-	png_bytep row_pointers[height];
+	unsigned long best=onion_png_filter_row(0, out, row, prev, n, png->Bpp);
+	int type;
+	for (type=1;type<5;type++){
+		unsigned long sum=onion_png_filter_row(type, scratch, row, prev, n, png->Bpp);
+		if (sum<best){
+			best=sum;
+			memcpy(out, scratch, n+1);
+		}
+	}
+}
 
-	if (height > PNG_UINT_32_MAX/sizeof(png_bytep))
-		png_error (png_ptr, "Image is too tall to process in memory");
+// Worker job: filters and deflates one band. The stream is flushed to a byte boundary so bands can be concatenated.
+static void onion_png_band_run(void *data){
+	onion_png_band *b=data;
+	onion_png *png=b->png;
+	size_t n=png->rowbytes;
+	int r;
+	if (png->bgr && png->Bpp>=3){
+		size_t i;
+		for (i=0;i<(b->nrows+1)*n;i+=png->Bpp){
+			unsigned char t=b->raw[i];
+			b->raw[i]=b->raw[i+2];
+			b->raw[i+2]=t;
+		}
+	}
+	b->inlen=b->nrows*(n+1);
+	unsigned char *in=malloc(b->inlen+n+1);
+	for (r=0;r<b->nrows;r++)
+		onion_png_filter_best(png, in+r*(n+1), b->raw+(r+1)*n, b->raw+r*n, in+b->inlen);
+	free(b->raw);
+	b->raw=NULL;
+	b->adler=adler32(adler32(0, NULL, 0), in, b->inlen);
 
-	for (k = 0; k < height; k++)
-		row_pointers[k] = (png_byte *) (image + k*width*Bpp);
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, png->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)!=Z_OK){
+		b->error=1;
+	}
+	else{
+		size_t size=deflateBound(&z, b->inlen)+64; // Room for the flush, header and trailer.
+		size_t off=0;
+		b->out=malloc(size);
+		if (b->first){ // zlib header, with the level hint
+			b->out[0]=0x78;
+			b->out[1]=png->level==0 || png->level==1 ? 0x01 : png->level>=2 && png->level<=5 ? 0x5e : png->level>=7 ? 0xda : 0x9c;
+			off=2;
+		}
+		z.next_in=in;
+		z.avail_in=b->inlen;
+		z.next_out=b->out+off;
+		z.avail_out=size-off-4;
+		int ret=deflate(&z, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+		if ((b->last ? ret!=Z_STREAM_END : ret!=Z_OK) || z.avail_in || !z.avail_out)
+			b->error=1;
+		b->outlen=size-4-z.avail_out;
+		deflateEnd(&z);
+	}
+	free(in);
 
-	// Sets the rows to save at the image
-	png_set_rows(png_ptr, info_ptr, row_pointers);
-	 
-	// If header already sent, then there was an error.
-	if (opd.sent){
-		return OCS_PROCESSED;
+	pthread_mutex_lock(&png->mutex);
+	b->done=1;
+	pthread_cond_broadcast(&png->cond);
+	pthread_mutex_unlock(&png->mutex);
+}
+
+// Writes the bands that are ready, in order. Waits while there are too many in flight, or for all if wait_all.
+static void onion_png_write_bands(onion_png *png, int wait_all){
+	pthread_mutex_lock(&png->mutex);
+	while (png->bands){
+		onion_png_band *b=png->bands;
+		if (!b->done){
+			if (!wait_all && png->nbands<png->max_bands)
+				break;
+			pthread_cond_wait(&png->cond, &png->mutex);
+			continue;
+		}
+		png->bands=b->next;
+		if (!png->bands)
+			png->last_band=NULL;
+		png->nbands--;
+		pthread_mutex_unlock(&png->mutex);
+
+		if (b->error)
+			png->error=1;
+		if (!png->error){
+			png->adler=adler32_combine(png->adler, b->adler, b->inlen);
+			if (b->last){ // There is room for the trailer.
+				onion_png_put32(b->out+b->outlen, png->adler);
+				b->outlen+=4;
+			}
+			onion_png_chunk(png, "IDAT", b->out, b->outlen);
+		}
+		free(b->out);
+		free(b);
+
+		pthread_mutex_lock(&png->mutex);
 	}
-	opd.sent=1;
-	// Finally WRITE the image. Uses the onion_response_write via onion_png_write helper.
-	png_write_png(png_ptr, info_ptr, 0, NULL);
-	
-	/* Clean up after the write, and free any memory allocated */
-	png_destroy_write_struct(&png_ptr, &info_ptr);
+	pthread_mutex_unlock(&png->mutex);
+}
 
-	/* That's it */
-	return OCS_PROCESSED;
+// Queues the current band at the workers, and writes the ones already done.
+static void onion_png_submit(onion_png *png){
+	onion_png_band *b=png->current;
+	png->current=NULL;
+	b->last=(png->rows==png->height);
+
+	pthread_mutex_lock(&png->mutex);
+	if (png->last_band)
+		png->last_band->next=b;
+	else
+		png->bands=b;
+	png->last_band=b;
+	png->nbands++;
+	pthread_mutex_unlock(&png->mutex);
+
+	if (onion_workers_push(png->workers, onion_png_band_run, b)<0)
+		onion_png_band_run(b);
+	onion_png_write_bands(png, b->last);
+}
+
+// Writes the signature and IHDR, and starts the workers.
+static void onion_png_start_parallel(onion_png *png){
+	static const unsigned char signature[8]={0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+	static const unsigned char color_types[]={0, 4, 2, 6};
+	unsigned char ihdr[13];
+	onion_png_put32(ihdr, png->width);
+	onion_png_put32(ihdr+4, png->height);
+	ihdr[8]=8; // Bit depth
+	ihdr[9]=color_types[png->Bpp-1];
+	ihdr[10]=ihdr[11]=ihdr[12]=0; // Deflate, adaptive filtering, no interlace
+	onion_response_write(png->res, (const char*)signature, sizeof(signature));
+	onion_png_chunk(png, "IHDR", ihdr, sizeof(ihdr));
+
+	pthread_mutex_init(&png->mutex, NULL);
+	pthread_cond_init(&png->cond, NULL);
+	png->band_rows=ONION_PNG_BAND_SIZE/png->rowbytes;
+	if (png->band_rows<1)
+		png->band_rows=1;
+	png->max_bands=png->nthreads*2;
+	png->adler=adler32(0, NULL, 0);
+	png->workers=onion_workers_new(png->nthreads, png->max_bands, NULL, 0);
+}
+
+// Copies rows to the current band, queuing it when full.
+static void onion_png_write_rows_parallel(onion_png *png, const unsigned char *rows, int nrows){
+	size_t n=png->rowbytes;
+	while (nrows>0){
+		onion_png_band *b=png->current;
+		if (!b){
+			b=calloc(1, sizeof(onion_png_band));
+			b->png=png;
+			b->first=(png->rows==0);
+			int left=png->height-png->rows;
+			b->raw=malloc(((left<png->band_rows ? left : png->band_rows)+1)*n);
+			if (b->first)
+				memset(b->raw, 0, n);
+			else // The last row of the previous band, still as given
+				memcpy(b->raw, png->last_row, n);
+			png->current=b;
+		}
+		memcpy(b->raw+(b->nrows+1)*n, rows, n);
+		b->nrows++;
+		png->rows++;
+		rows+=n;
+		nrows--;
+		if (b->nrows==png->band_rows || png->rows==png->height){
+			memcpy(png->last_row, b->raw+b->nrows*n, n);
+			onion_png_submit(png);
+		}
+	}
 }
 
+#endif
+
+/**
+ * @short Writes some rows of the image
+ * @memberof onion_png_t
+ *
+ * Rows must be in order, and contiguous at rows, of width*Bpp bytes each. The data is not
+ * needed after the call returns.
+ *
+ * @returns 0 if ok, <0 on error; then the image is broken and the connection should be closed.
+ */
+int onion_png_write_rows(onion_png *png, const unsigned char *rows, int nrows){
+	if (png->skip)
+		return 0;
+	if (png->error)
+		return -1;
+	if (nrows>png->height-png->rows){
+		ONION_ERROR("Too many rows for the PNG image, %d high", png->height);
+		png->error=1;
+		return -1;
+	}
+	if (!png->started){
+		png->started=1;
+#ifdef ONION_PNG_PARALLEL
+		if (png->nthreads>1 && png->rowbytes*png->height>=2*ONION_PNG_BAND_SIZE){
+			png->last_row=malloc(png->rowbytes);
+			onion_png_start_parallel(png);
+		}
+		else
+#endif
+		if (onion_png_start_libpng(png)<0)
+			return -1;
+	}
+#ifdef ONION_PNG_PARALLEL
+	if (png->workers){
+		onion_png_write_rows_parallel(png, rows, nrows);
+		return png->error ? -1 : 0;
+	}
+#endif
+	if (setjmp(png_jmpbuf(png->png)))
+		return -1;
+	while (nrows-- > 0){
+		png_write_row(png->png, (png_bytep)rows);
+		rows+=png->rowbytes;
+		png->rows++;
+	}
+	return 0;
+}
+
+/**
+ * @short Finishes the image and frees the encoder
+ * @memberof onion_png_t
+ *
+ * @returns OCS_PROCESSED, or OCS_INTERNAL_ERROR if the image could not be completely written.
+ */
+int onion_png_end(onion_png *png){
+	if (!png->skip && !png->error && png->rows!=png->height){
+		ONION_ERROR("PNG image ended at row %d of %d", png->rows, png->height);
+		png->error=1;
+	}
+#ifdef ONION_PNG_PARALLEL
+	if (png->workers){
+		onion_png_write_bands(png, 1);
+		if (png->current){ // Only if the image was not finished
+			free(png->current->raw);
+			free(png->current);
+		}
+		if (!png->error)
+			onion_png_chunk(png, "IEND", NULL, 0);
+		onion_workers_free(png->workers);
+		pthread_mutex_destroy(&png->mutex);
+		pthread_cond_destroy(&png->cond);
+		free(png->last_row);
+	}
+#endif
+	if (png->png){
+		if (!png->error && !setjmp(png_jmpbuf(png->png)))
+			png_write_end(png->png, png->info);
+		png_destroy_write_struct(&png->png, &png->info);
+	}
+	int ret=png->error ? OCS_INTERNAL_ERROR : OCS_PROCESSED;
+	free(png);
+	return ret;
+}
+
+/**
+ * @short Writes an image as png to the response object
+ * 
+ * @param image flat buffer with all pixels
+ * @param Bpp Bytes per pixel: 1 grayscale, 2 grayscale with alpha, 3 RGB, 4 RGB with alpha. Negative if in BGR format (cairo)
+ * @param width The width of the image
+ * @param height The height of the image
+ * @param res where to write the image, it sets the necessary structs
+ */
+int onion_png_response(unsigned char *image, int Bpp, int width, int height, onion_response *res){
+	onion_png *png=onion_png_begin(res, Bpp, width, height);
+	if (!png)
+		return OCS_INTERNAL_ERROR;
+	onion_png_write_rows(png, image, height);
+	return onion_png_end(png);
+}
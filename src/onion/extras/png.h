@@ -32,9 +32,35 @@ extern "C"{
 
 #include <onion/types.h>
 
+struct onion_png_t;
+typedef struct onion_png_t onion_png;
+
+/// Row filters, as in the PNG spec. Default lets the encoder choose, per row.
+enum onion_png_filter_e{
+	ONION_PNG_FILTER_DEFAULT=0,
+	ONION_PNG_FILTER_NONE=1,
+	ONION_PNG_FILTER_SUB=2,
+	ONION_PNG_FILTER_UP=3,
+	ONION_PNG_FILTER_AVG=4,
+	ONION_PNG_FILTER_PAETH=5,
+	ONION_PNG_FILTER_ADAPTIVE=6, ///< Tries all the filters on each row
+};
+typedef enum onion_png_filter_e onion_png_filter;
+
 /// Writes an image data to a response object
 int onion_png_response(unsigned char *image, int Bpp, int width, int height, onion_response *res);
 
+/// Starts a png image at the response, to be written row by row
+onion_png *onion_png_begin(onion_response *res, int Bpp, int width, int height);
+/// Sets the zlib level (-1 to 9) and row filter. Before the first row.
+void onion_png_set_compression(onion_png *png, int level, onion_png_filter filter);
+/// Deflates bands of rows of big images in parallel. Before the first row.
+void onion_png_set_threads(onion_png *png, int nthreads);
+/// Writes nrows contiguous rows
+int onion_png_write_rows(onion_png *png, const unsigned char *rows, int nrows);
+/// Finishes the image, frees the encoder, and returns the handler return code
+int onion_png_end(onion_png *png);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,420 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "file_cache.h"
+#include "shortcuts.h"
+#include "mime.h"
+#include "memory.h"
+#include "log.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+struct onion_file_cache_entry_t{
+	char *path;        ///< Path as asked, the key.
+	char *realpath;    ///< Resolved path, or NULL.
+	int exists;        ///< If 0, a cached "does not exist", so it does not stat again until expired.
+	int fd;            ///< Open fd, only for regular files; else -1.
+	struct stat st;
+	char etag[32];
+	char *mime;        ///< A copy, as the MIME types may be changed or freed meanwhile.
+	long created;      ///< Monotonic ms when created, to expire.
+	int refcount;      ///< The cache holds one while it is at the table.
+	unsigned int slot; ///< Its slot at the table.
+	char *data;        ///< Contents of small files, if in memory, or NULL.
+	char *headers[2];  ///< Prerendered headers to answer it whole, and as precompressed sibling of other file. @see onion_file_cache_entry_set_headers
+	onion_file_cache_entry *lru_prev; ///< At the list of the ones in memory, the most recently used first.
+	onion_file_cache_entry *lru_next;
+};
+
+struct onion_file_cache_t{
+	onion_file_cache_entry **entries; ///< Direct mapped table by path hash. A new path at a used slot replaces the old one.
+	int max_entries;
+	int ttl_ms;
+	size_t max_file_size;  ///< Files up to this size are kept in memory. 0 for none.
+	size_t max_memory;     ///< Bytes in memory for all. Over it the least recently used ones are removed.
+	onion_file_cache_entry *lru_first;
+	onion_file_cache_entry *lru_last;
+	onion_file_cache_stats stats;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+};
+
+/// Monotonic time in ms. The coarse clock is enough, and does not need a syscall.
+static long onion_file_cache_now(){
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/// FNV-1a of the path
+static unsigned int onion_file_cache_hash(const char *path){
+	uint32_t h=2166136261u;
+	while (*path){
+		h^=(unsigned char)*path++;
+		h*=16777619u;
+	}
+	return h;
+}
+
+static void onion_file_cache_lock(onion_file_cache *cache){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&cache->mutex);
+#endif
+}
+
+static void onion_file_cache_unlock(onion_file_cache *cache){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&cache->mutex);
+#endif
+}
+
+static void onion_file_cache_entry_free(onion_file_cache_entry *entry){
+	if (entry->fd>=0)
+		close(entry->fd);
+	free(entry->path);
+	free(entry->realpath);
+	free(entry->mime);
+	if (entry->data)
+		onion_memory_count(ONION_MEMORY_CACHE, -(long)entry->st.st_size);
+	free(entry->data);
+	free(entry->headers[0]);
+	free(entry->headers[1]);
+	free(entry);
+}
+
+/// Reads all the file to memory. Copied, not mmap, so a file truncated meanwhile can not crash the server.
+static char *onion_file_cache_read(int fd, size_t size){
+	char *data=malloc(size ? size : 1);
+	size_t pos=0;
+	while (pos<size){
+		ssize_t r=pread(fd, data+pos, size-pos, pos);
+		if (r<=0){
+			free(data);
+			return NULL;
+		}
+		pos+=r;
+	}
+	return data;
+}
+
+/// Stats and opens the path, and fills a new entry. Small files are read to memory.
+static onion_file_cache_entry *onion_file_cache_entry_new(onion_file_cache *cache, const char *path){
+	onion_file_cache_entry *entry=calloc(1, sizeof(onion_file_cache_entry));
+	entry->path=strdup(path);
+	entry->fd=-1;
+	entry->refcount=1;
+	entry->created=onion_file_cache_now();
+	if (stat(path, &entry->st)!=0)
+		return entry;
+	if (S_ISREG(entry->st.st_mode)){
+		entry->fd=open(path, O_RDONLY|O_CLOEXEC);
+		if (entry->fd<0 || fstat(entry->fd, &entry->st)!=0) // The one opened, if it changed meanwhile
+			return entry;
+		onion_shortcut_etag(&entry->st, entry->etag);
+		entry->mime=strdup(onion_mime_get(path));
+		if ((size_t)entry->st.st_size<=cache->max_file_size){
+			entry->data=onion_file_cache_read(entry->fd, entry->st.st_size);
+			if (entry->data)
+				onion_memory_count(ONION_MEMORY_CACHE, entry->st.st_size);
+		}
+	}
+	char realp[PATH_MAX];
+	if (realpath(path, realp))
+		entry->realpath=strdup(realp);
+	entry->exists=1;
+	return entry;
+}
+
+/// Removes the entry from the list of the ones in memory. With the lock.
+static void onion_file_cache_lru_remove(onion_file_cache *cache, onion_file_cache_entry *entry){
+	if (!entry->data)
+		return;
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next=entry->lru_next;
+	else
+		cache->lru_first=entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev=entry->lru_prev;
+	else
+		cache->lru_last=entry->lru_prev;
+	entry->lru_prev=entry->lru_next=NULL;
+	cache->stats.memory-=entry->st.st_size;
+	cache->stats.in_memory--;
+}
+
+/// Adds the entry as the most recently used. With the lock.
+static void onion_file_cache_lru_add(onion_file_cache *cache, onion_file_cache_entry *entry){
+	if (!entry->data)
+		return;
+	entry->lru_prev=NULL;
+	entry->lru_next=cache->lru_first;
+	if (cache->lru_first)
+		cache->lru_first->lru_prev=entry;
+	else
+		cache->lru_last=entry;
+	cache->lru_first=entry;
+	cache->stats.memory+=entry->st.st_size;
+	cache->stats.in_memory++;
+}
+
+/// Removes the least recently used entries in memory until under the limit, but the given one. With the lock.
+static void onion_file_cache_lru_evict(onion_file_cache *cache, onion_file_cache_entry *keep){
+	while (cache->stats.memory>cache->max_memory && cache->lru_last && cache->lru_last!=keep){
+		onion_file_cache_entry *entry=cache->lru_last;
+		onion_file_cache_lru_remove(cache, entry);
+		cache->entries[entry->slot]=NULL;
+		cache->stats.evictions++;
+		onion_file_cache_release(entry); // Freed now, or when the last request using it ends.
+	}
+}
+
+/**
+ * @short Creates a cache of open files and their metadata.
+ * @memberof onion_file_cache_t
+ * 
+ * Each path keeps its fd open, its stat, the resolved path, ETag and MIME type, so a hot static file 
+ * does not need any syscall before the sendfile. Paths that do not exist are cached too.
+ * 
+ * Files that change are seen when their entry expires, after ttl_ms; there is no watch on the files.
+ * The table is direct mapped: a path whose slot is used replaces the old entry, so there are never more 
+ * than max_entries files open.
+ */
+onion_file_cache *onion_file_cache_new(int max_entries, int ttl_ms){
+	if (max_entries<1){
+		ONION_ERROR("File cache needs at least one entry");
+		return NULL;
+	}
+	onion_file_cache *cache=calloc(1, sizeof(onion_file_cache));
+	cache->entries=calloc(max_entries, sizeof(onion_file_cache_entry*));
+	cache->max_entries=max_entries;
+	cache->ttl_ms=ttl_ms;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_init(&cache->mutex, NULL);
+#endif
+	return cache;
+}
+
+/**
+ * @short Keeps the contents of small files in memory too.
+ * @memberof onion_file_cache_t
+ * 
+ * Files up to max_file_size bytes are read when first asked for, and answered from memory, with the 
+ * headers prerendered. It helps most where sendfile can not be used, as on HTTPS. When all of them 
+ * use more than max_memory bytes, the least recently used are removed.
+ * 
+ * It applies to the paths read from now on. max_file_size 0 keeps no file in memory.
+ */
+void onion_file_cache_set_memory(onion_file_cache *cache, size_t max_file_size, size_t max_memory){
+	if (max_file_size>max_memory){
+		ONION_WARNING("Files in memory can not be bigger than all the memory, set to %d bytes", (int)max_memory);
+		max_file_size=max_memory;
+	}
+	onion_file_cache_lock(cache);
+	cache->max_file_size=max_file_size;
+	cache->max_memory=max_memory;
+	onion_file_cache_lru_evict(cache, NULL);
+	onion_file_cache_unlock(cache);
+}
+
+/**
+ * @short Removes all the files in memory, as when memory is short.
+ * @memberof onion_file_cache_t
+ * 
+ * They are freed now, or as the requests using them end, and are read again when asked for.
+ * 
+ * @returns The bytes they used.
+ */
+size_t onion_file_cache_evict(onion_file_cache *cache){
+	onion_file_cache_lock(cache);
+	size_t memory=cache->stats.memory, max_memory=cache->max_memory;
+	cache->max_memory=0;
+	onion_file_cache_lru_evict(cache, NULL);
+	cache->max_memory=max_memory;
+	onion_file_cache_unlock(cache);
+	return memory;
+}
+
+/**
+ * @short Gets the counters of the cache.
+ * @memberof onion_file_cache_t
+ */
+void onion_file_cache_get_stats(onion_file_cache *cache, onion_file_cache_stats *stats){
+	onion_file_cache_lock(cache);
+	*stats=cache->stats;
+	onion_file_cache_unlock(cache);
+}
+
+/**
+ * @short Frees the cache.
+ * @memberof onion_file_cache_t
+ * 
+ * The entries still in use are freed as they are released.
+ */
+void onion_file_cache_free(onion_file_cache *cache){
+	int i;
+	for (i=0;i<cache->max_entries;i++){
+		if (cache->entries[i])
+			onion_file_cache_release(cache->entries[i]);
+	}
+#ifdef HAVE_PTHREADS
+	pthread_mutex_destroy(&cache->mutex);
+#endif
+	free(cache->entries);
+	free(cache);
+}
+
+/**
+ * @short Gets the entry of a path, from the cache if not expired, or stats and opens it now.
+ * @memberof onion_file_cache_t
+ * 
+ * The entry must be released with onion_file_cache_release when done.
+ * 
+ * @returns The entry, or NULL if the path does not exist.
+ */
+onion_file_cache_entry *onion_file_cache_get(onion_file_cache *cache, const char *path){
+	unsigned int slot=onion_file_cache_hash(path)%cache->max_entries;
+	long now=onion_file_cache_now();
+	onion_file_cache_entry *entry;
+	
+	onion_file_cache_lock(cache);
+	entry=cache->entries[slot];
+	if (entry && now-entry->created<=cache->ttl_ms && strcmp(entry->path, path)==0){
+		cache->stats.hits++;
+		if (!entry->exists){
+			onion_file_cache_unlock(cache);
+			return NULL;
+		}
+		__sync_fetch_and_add(&entry->refcount, 1);
+		if (entry->data && entry!=cache->lru_first){
+			onion_file_cache_lru_remove(cache, entry);
+			onion_file_cache_lru_add(cache, entry);
+		}
+		onion_file_cache_unlock(cache);
+		return entry;
+	}
+	cache->stats.misses++;
+	onion_file_cache_unlock(cache);
+	
+	entry=onion_file_cache_entry_new(cache, path); // Without the lock, it does some syscalls.
+	entry->slot=slot;
+	ONION_DEBUG0("File cache miss for %s", path);
+	
+	onion_file_cache_lock(cache);
+	onion_file_cache_entry *old=cache->entries[slot];
+	if (old)
+		onion_file_cache_lru_remove(cache, old);
+	cache->entries[slot]=entry;
+	if (entry->exists)
+		__sync_fetch_and_add(&entry->refcount, 1); // One for the cache, one for the caller
+	onion_file_cache_lru_add(cache, entry);
+	onion_file_cache_lru_evict(cache, entry);
+	onion_file_cache_unlock(cache);
+	if (old)
+		onion_file_cache_release(old);
+	
+	return entry->exists ? entry : NULL;
+}
+
+/**
+ * @short Releases an entry got with onion_file_cache_get.
+ * @memberof onion_file_cache_entry_t
+ * 
+ * If it is not at the cache anymore and nobody else uses it, it is freed, and its fd closed.
+ */
+void onion_file_cache_release(onion_file_cache_entry *entry){
+	if (__sync_sub_and_fetch(&entry->refcount, 1)==0)
+		onion_file_cache_entry_free(entry);
+}
+
+/// @memberof onion_file_cache_entry_t
+int onion_file_cache_entry_fd(onion_file_cache_entry *entry){
+	return entry->fd;
+}
+
+/// @memberof onion_file_cache_entry_t
+const struct stat *onion_file_cache_entry_stat(onion_file_cache_entry *entry){
+	return &entry->st;
+}
+
+/// @memberof onion_file_cache_entry_t
+const char *onion_file_cache_entry_realpath(onion_file_cache_entry *entry){
+	return entry->realpath;
+}
+
+/// @memberof onion_file_cache_entry_t
+const char *onion_file_cache_entry_etag(onion_file_cache_entry *entry){
+	return entry->etag;
+}
+
+/// @memberof onion_file_cache_entry_t
+const char *onion_file_cache_entry_mime(onion_file_cache_entry *entry){
+	return entry->mime;
+}
+
+/// @memberof onion_file_cache_entry_t
+const char *onion_file_cache_entry_data(onion_file_cache_entry *entry){
+	return entry->data;
+}
+
+/// @memberof onion_file_cache_entry_t
+const char *onion_file_cache_entry_headers(onion_file_cache_entry *entry, int encoded){
+	return entry->headers[encoded ? 1 : 0];
+}
+
+/**
+ * @short Keeps the prerendered headers to answer this file, if it has none yet.
+ * @memberof onion_file_cache_entry_t
+ * 
+ * There are two sets: to answer the file as itself, and, if encoded, as the precompressed sibling of 
+ * another, with that one Content-Type. The entry takes ownership of headers. If other thread set them 
+ * first, these are freed.
+ * 
+ * @returns The headers kept at the entry.
+ */
+const char *onion_file_cache_entry_set_headers(onion_file_cache_entry *entry, int encoded, char *headers){
+	if (!__sync_bool_compare_and_swap(&entry->headers[encoded ? 1 : 0], NULL, headers))
+		free(headers);
+	return entry->headers[encoded ? 1 : 0];
+}
@@ -0,0 +1,95 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_FILE_CACHE_H
+#define ONION_FILE_CACHE_H
+
+#include <sys/stat.h>
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/// Counters of a file cache. @see onion_file_cache_get_stats
+typedef struct onion_file_cache_stats_t{
+	long hits;          ///< Paths found at the cache.
+	long misses;        ///< Paths not at the cache, or expired, that were stat, opened and maybe read.
+	long evictions;     ///< Files in memory removed to keep under the memory limit.
+	size_t memory;      ///< Bytes of the files in memory now.
+	int in_memory;      ///< Files in memory now.
+}onion_file_cache_stats;
+
+/// Creates a file cache of up to max_entries paths, each valid for ttl_ms milliseconds.
+onion_file_cache *onion_file_cache_new(int max_entries, int ttl_ms);
+
+/// Frees the cache. Entries still in use are freed when released.
+void onion_file_cache_free(onion_file_cache *cache);
+
+/// Keeps too the contents of files up to max_file_size, up to max_memory bytes for all, least recently used out first.
+void onion_file_cache_set_memory(onion_file_cache *cache, size_t max_file_size, size_t max_memory);
+
+/// Removes all the files in memory. Returns the bytes they used.
+size_t onion_file_cache_evict(onion_file_cache *cache);
+
+/// Gets the hits, misses and memory use counters.
+void onion_file_cache_get_stats(onion_file_cache *cache, onion_file_cache_stats *stats);
+
+/// Gets the entry of that path, from the cache or new. Must be released. NULL if the path does not exist.
+onion_file_cache_entry *onion_file_cache_get(onion_file_cache *cache, const char *path);
+
+/// Releases an entry got with onion_file_cache_get.
+void onion_file_cache_release(onion_file_cache_entry *entry);
+
+/// Open fd of the file, or -1 if it is not a regular file. Owned by the entry, do not close.
+int onion_file_cache_entry_fd(onion_file_cache_entry *entry);
+
+/// The stat of the file.
+const struct stat *onion_file_cache_entry_stat(onion_file_cache_entry *entry);
+
+/// The resolved path, as realpath, or NULL if could not be resolved.
+const char *onion_file_cache_entry_realpath(onion_file_cache_entry *entry);
+
+/// The ETag, as onion_shortcut_etag. Only for regular files.
+const char *onion_file_cache_entry_etag(onion_file_cache_entry *entry);
+
+/// The MIME type, as onion_mime_get. Only for regular files.
+const char *onion_file_cache_entry_mime(onion_file_cache_entry *entry);
+
+/// The contents of the file, if in memory, or NULL. The size is at its stat.
+const char *onion_file_cache_entry_data(onion_file_cache_entry *entry);
+
+/// The headers to answer the whole file, or if encoded as precompressed sibling, as set by onion_file_cache_entry_set_headers, or NULL.
+const char *onion_file_cache_entry_headers(onion_file_cache_entry *entry, int encoded);
+
+/// Keeps the prerendered headers, and takes ownership, unless some were set already. Returns the kept ones.
+const char *onion_file_cache_entry_set_headers(onion_file_cache_entry *entry, int encoded, char *headers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
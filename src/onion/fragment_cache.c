@@ -0,0 +1,241 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "fragment_cache.h"
+#include "response.h"
+#include "block.h"
+#include "dict.h"
+#include "memory.h"
+#include "log.h"
+
+/// A rendered fragment.
+typedef struct onion_fragment_cache_entry_t{
+	char *key;          ///< name, \0, key
+	onion_block *data;
+	long expires;       ///< Monotonic ms
+	int refcount;       ///< The table holds one, and each replay another.
+	struct onion_fragment_cache_entry_t *lru_prev; ///< Most recently used first
+	struct onion_fragment_cache_entry_t *lru_next;
+}onion_fragment_cache_entry;
+
+/// The cache is shared by all the templates and threads of the process.
+static struct{
+	onion_dict *entries;   ///< By key
+	onion_fragment_cache_entry *lru_first;
+	onion_fragment_cache_entry *lru_last;
+	size_t size;
+	size_t max_size;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+}onion_fragment_cache={
+	NULL, NULL, NULL, 0, 16*1024*1024,
+#ifdef HAVE_PTHREADS
+	PTHREAD_MUTEX_INITIALIZER
+#endif
+};
+
+static void onion_fragment_cache_lock();
+static void onion_fragment_cache_unlock();
+static void onion_fragment_cache_remove(onion_fragment_cache_entry *entry);
+
+/// Monotonic time in ms
+static long onion_fragment_cache_now(){
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static void onion_fragment_cache_lock(){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&onion_fragment_cache.mutex);
+#endif
+}
+
+static void onion_fragment_cache_unlock(){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&onion_fragment_cache.mutex);
+#endif
+}
+
+/// Composes the key of the table, as name:key, at buffer if it fits, if not a new one to free.
+static char *onion_fragment_cache_key(const char *name, const char *key, char *buffer, size_t size){
+	if (!key)
+		key="";
+	size_t lname=strlen(name), lkey=strlen(key);
+	char *ret=(lname+lkey+2<=size) ? buffer : malloc(lname+lkey+2);
+	memcpy(ret, name, lname);
+	ret[lname]=':';
+	memcpy(ret+lname+1, key, lkey+1);
+	return ret;
+}
+
+/// Drops a reference, freeing the entry at the last one. With the lock.
+static void onion_fragment_cache_unref(onion_fragment_cache_entry *entry){
+	if (--entry->refcount)
+		return;
+	onion_memory_count(ONION_MEMORY_CACHE, -(long)onion_block_size(entry->data));
+	onion_block_free(entry->data);
+	free(entry->key);
+	free(entry);
+}
+
+/// Removes the entry from the table. Those replaying it keep it until done. With the lock.
+static void onion_fragment_cache_remove(onion_fragment_cache_entry *entry){
+	onion_dict_remove(onion_fragment_cache.entries, entry->key);
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next=entry->lru_next;
+	else
+		onion_fragment_cache.lru_first=entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev=entry->lru_prev;
+	else
+		onion_fragment_cache.lru_last=entry->lru_prev;
+	onion_fragment_cache.size-=onion_block_size(entry->data);
+	onion_fragment_cache_unref(entry);
+}
+
+/// Puts the entry the first at the LRU list. It is not there. With the lock.
+static void onion_fragment_cache_lru_push(onion_fragment_cache_entry *entry){
+	entry->lru_prev=NULL;
+	entry->lru_next=onion_fragment_cache.lru_first;
+	if (onion_fragment_cache.lru_first)
+		onion_fragment_cache.lru_first->lru_prev=entry;
+	else
+		onion_fragment_cache.lru_last=entry;
+	onion_fragment_cache.lru_first=entry;
+}
+
+/**
+ * @short Writes to res the fragment kept for name and key, if not expired.
+ * 
+ * The fragment is written out of the lock, so others can use it meanwhile.
+ * 
+ * @returns 1 if written, 0 if not there and it has to be rendered, and then stored with onion_fragment_cache_store.
+ */
+int onion_fragment_cache_write(const char *name, const char *key, onion_response *res){
+	char buffer[256];
+	char *k=onion_fragment_cache_key(name, key, buffer, sizeof(buffer));
+	onion_fragment_cache_entry *entry=NULL;
+	
+	onion_fragment_cache_lock();
+	if (onion_fragment_cache.entries)
+		entry=(onion_fragment_cache_entry*)onion_dict_get(onion_fragment_cache.entries, k);
+	if (entry && entry->expires<=onion_fragment_cache_now()){
+		onion_fragment_cache_remove(entry);
+		entry=NULL;
+	}
+	if (entry){
+		if (entry!=onion_fragment_cache.lru_first){
+			entry->lru_prev->lru_next=entry->lru_next;
+			if (entry->lru_next)
+				entry->lru_next->lru_prev=entry->lru_prev;
+			else
+				onion_fragment_cache.lru_last=entry->lru_prev;
+			onion_fragment_cache_lru_push(entry);
+		}
+		entry->refcount++;
+	}
+	onion_fragment_cache_unlock();
+	if (k!=buffer)
+		free(k);
+	
+	if (!entry)
+		return 0;
+	onion_response_write(res, onion_block_data(entry->data), onion_block_size(entry->data));
+	
+	onion_fragment_cache_lock();
+	onion_fragment_cache_unref(entry);
+	onion_fragment_cache_unlock();
+	return 1;
+}
+
+/**
+ * @short Keeps the rendered fragment for name and key for ttl seconds.
+ * 
+ * If another was stored meanwhile for the same key, it is replaced. Fragments bigger than the max size are not kept.
+ */
+void onion_fragment_cache_store(const char *name, const char *key, int ttl, onion_block *fragment){
+	if (!fragment)
+		return;
+	if (ttl<=0 || (size_t)onion_block_size(fragment)>onion_fragment_cache.max_size){
+		onion_block_free(fragment);
+		return;
+	}
+	onion_fragment_cache_entry *entry=malloc(sizeof(onion_fragment_cache_entry));
+	entry->key=onion_fragment_cache_key(name, key, NULL, 0);
+	entry->data=fragment;
+	entry->expires=onion_fragment_cache_now()+ttl*1000L;
+	entry->refcount=1;
+	onion_memory_count(ONION_MEMORY_CACHE, onion_block_size(fragment));
+	
+	onion_fragment_cache_lock();
+	if (!onion_fragment_cache.entries){
+		onion_fragment_cache.entries=onion_dict_new();
+		onion_dict_set_flags(onion_fragment_cache.entries, OD_HASH);
+	}
+	onion_fragment_cache_entry *old=(onion_fragment_cache_entry*)onion_dict_get(onion_fragment_cache.entries, entry->key);
+	if (old)
+		onion_fragment_cache_remove(old);
+	onion_fragment_cache.size+=onion_block_size(fragment);
+	while (onion_fragment_cache.size>onion_fragment_cache.max_size)
+		onion_fragment_cache_remove(onion_fragment_cache.lru_last);
+	onion_dict_add(onion_fragment_cache.entries, entry->key, entry, 0);
+	onion_fragment_cache_lru_push(entry);
+	onion_fragment_cache_unlock();
+}
+
+/// Sets the most memory of all the fragments. Over it the least recently used are removed.
+void onion_fragment_cache_set_max_size(size_t max_size){
+	onion_fragment_cache_lock();
+	onion_fragment_cache.max_size=max_size;
+	while (onion_fragment_cache.size>onion_fragment_cache.max_size)
+		onion_fragment_cache_remove(onion_fragment_cache.lru_last);
+	onion_fragment_cache_unlock();
+}
+
+/// Removes all the fragments. The ones being written are freed when done.
+void onion_fragment_cache_clear(){
+	onion_fragment_cache_lock();
+	while (onion_fragment_cache.lru_first)
+		onion_fragment_cache_remove(onion_fragment_cache.lru_first);
+	if (onion_fragment_cache.entries){
+		onion_dict_free(onion_fragment_cache.entries);
+		onion_fragment_cache.entries=NULL;
+	}
+	onion_fragment_cache_unlock();
+}
@@ -0,0 +1,53 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_FRAGMENT_CACHE_H
+#define ONION_FRAGMENT_CACHE_H
+
+#include <stddef.h>
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/// Writes to res the fragment kept for name and key, if not expired. Returns 1 if written, 0 if it has to be rendered.
+int onion_fragment_cache_write(const char *name, const char *key, onion_response *res);
+
+/// Keeps the fragment for name and key for ttl seconds. Takes the block, that may be NULL if it could not be captured.
+void onion_fragment_cache_store(const char *name, const char *key, int ttl, onion_block *fragment);
+
+/// Sets the most memory of all the fragments. Over it the least recently used are removed. Default 16MB.
+void onion_fragment_cache_set_max_size(size_t max_size);
+
+/// Removes all the fragments.
+void onion_fragment_cache_clear();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -37,6 +37,32 @@
 #include "response.h"
 #include "types_internal.h"
 #include "websocket.h"
+#include "pool.h"
+#include "poller.h"
+
+void onion_response_set_length_buffered(onion_response *res); // At response.c
+int onion_response_is_last(onion_response *res); // At response.c
+
+/// Finishes the response of a handler that did not return OCS_NOT_PROCESSED.
+static onion_connection_status onion_handler_processed(onion_connection_status res, onion_request *request, onion_response *response){
+	if (res==OCS_SUSPENDED) // Response will be written later, do not touch it.
+		return res;
+	// write pending data.
+	onion_response_set_length_buffered(response);
+	int linger=(res!=OCS_WEBSOCKET && onion_response_is_last(response)); // May go with the close
+	request->output.linger=linger;
+	onion_response_flush(response);
+	request->output.linger=0;
+	if (res==OCS_WEBSOCKET){
+		if (request->websocket)
+			return onion_websocket_call(request->websocket);
+		else{
+			ONION_ERROR("Handler did set the OCS_WEBSOCKET, but did not initialize the websocket on this request.");
+			return OCS_INTERNAL_ERROR;
+		}
+	}
+	return res;
+}
 
 /**
  * @short Tryes to handle the petition with that handler.
@@ -44,12 +70,25 @@
  *
  * It needs the handler to handle, the request and the response.
  *
- * It checks this parser, and siblings.
+ * It checks this parser, and siblings. If the level was frozen, they are called from the table, where
+ * they follow each other, instead of following the next pointers. @see onion_handler_freeze
  * 
  * @returns If can not, returns OCS_NOT_PROCESSED (0), else the onion_connection_status. (normally OCS_PROCESSED)
  */
 onion_connection_status onion_handler_handle(onion_handler *handler, onion_request *request, onion_response *response){
 	onion_connection_status res;
+	if (handler && handler->frozen){
+		const onion_handler_entry *entry=handler->frozen;
+		for(;;){
+			onion_poller_note_handler((void*)entry->handler, request);
+			res=entry->handler(entry->priv_data, request, response);
+			if (res)
+				return onion_handler_processed(res, request, response);
+			if (entry->last)
+				return OCS_NOT_PROCESSED;
+			entry++;
+		}
+	}
 	while (handler){
 		if (handler->handler){
 #ifdef __DEBUG0__
@@ -57,23 +96,11 @@ onion_connection_status onion_handler_handle(onion_handler *handler, onion_reque
 			ONION_DEBUG0("Calling handler: %s",bs[0]);
 			free(bs);
 #endif
+			onion_poller_note_handler((void*)handler->handler, request);
 			res=handler->handler(handler->priv_data, request, response);
 			ONION_DEBUG0("Result: %d",res);
-			if (res){
-				// write pending data.
-				if (!(response->flags&OR_HEADER_SENT) && response->buffer_pos<sizeof(response->buffer))
-					onion_response_set_length(response, response->buffer_pos);
-				onion_response_flush(response);
-				if (res==OCS_WEBSOCKET){
-					if (request->websocket)
-						return onion_websocket_call(request->websocket);
-					else{
-						ONION_ERROR("Handler did set the OCS_WEBSOCKET, but did not initialize the websocket on this request.");
-						return OCS_INTERNAL_ERROR;
-					}
-				}
-				return res;
-			}
+			if (res)
+				return onion_handler_processed(res, request, response);
 		}
 		handler=handler->next;
 	}
@@ -87,7 +114,7 @@ onion_connection_status onion_handler_handle(onion_handler *handler, onion_reque
  *
  */
 onion_handler *onion_handler_new(onion_handler_handler handler, void *priv_data, onion_handler_private_data_free priv_data_free){
-	onion_handler *phandler=calloc(1, sizeof(onion_handler));
+	onion_handler *phandler=onion_slab_calloc(sizeof(onion_handler));
 	phandler->handler=handler;
 	phandler->priv_data=priv_data;
 	phandler->priv_data_free=priv_data_free;
@@ -114,7 +141,7 @@ int onion_handler_free(onion_handler *handler){
 			handler->priv_data_free(handler->priv_data);
 		}
 		next=handler->next;
-		free(handler);
+		onion_slab_free(handler, sizeof(onion_handler));
 		n++;
 	}
 	return n;
@@ -126,8 +153,12 @@ int onion_handler_free(onion_handler *handler){
  *
  * Adds a handler at the end of the list of handlers of this level. Each handler is called in order,
  * until one of them succeds. So each handler is in charge of cheching if its itself who is being called.
+ *
+ * If the level was frozen, base must be its first handler, so it walks the list again, until the
+ * next onion_handler_freeze.
  */
 void onion_handler_add(onion_handler *base, onion_handler *new_handler){
+	base->frozen=NULL;
 	while(base->next)
 		base=base->next;
 	base->next=new_handler;
@@ -143,3 +174,159 @@ void onion_handler_add(onion_handler *base, onion_handler *new_handler){
 void *onion_handler_get_private_data(onion_handler *handler){
 	return handler->priv_data;
 }
+
+/**
+ * @short Sets how to find the handlers this one calls, so they are frozen with it.
+ * @memberof onion_handler_t
+ *
+ * Handlers that call other levels with onion_handler_handle, as onion_url or onion_handler_path,
+ * set it so onion_handler_freeze reaches those levels. Without it the levels inside are not frozen,
+ * and still walk their lists.
+ */
+void onion_handler_set_children(onion_handler *handler, onion_handler_children_f children){
+	handler->children=children;
+}
+
+/// Whether any handler has a prerendered response, as only then the routes are looked up before the handlers.
+int onion_handler_prerendered_used=0;
+
+/**
+ * @short Sets the response the handler always writes, whatever the request.
+ * @memberof onion_handler_t
+ *
+ * When the route of a request at an onion_url, or the root handler, is this handler, the response is written
+ * as it is, with one write, without calling the handler nor creating an onion_response; even before passing
+ * the request to the workers. The handler is still called when it can not be, as on HTTP/2, with admission
+ * control, route stats, an access log or a traffic record, so it must write the same response.
+ *
+ * The response is not owned by the handler: it must be valid while the handler is, and is normally freed
+ * with its private data. onion_url_add_static and onion_handler_static set it.
+ */
+void onion_handler_set_prerendered(onion_handler *handler, const onion_response_prerendered *prerendered){
+	handler->prerendered=prerendered;
+	if (prerendered)
+		onion_handler_prerendered_used=1;
+}
+
+/**
+ * @short Creates an empty table of frozen handlers.
+ * @memberof onion_handler_table_t
+ */
+onion_handler_table *onion_handler_table_new(){
+	return calloc(1, sizeof(onion_handler_table));
+}
+
+/**
+ * @short Frees the table, and the ones it replaced.
+ * @memberof onion_handler_table_t
+ *
+ * The handlers frozen at it must not be used anymore, as they dispatch from it.
+ */
+void onion_handler_table_free(onion_handler_table *table){
+	while (table){
+		onion_handler_table *previous=table->previous;
+		free(table->entries);
+		free(table->heads);
+		free(table);
+		table=previous;
+	}
+}
+
+typedef struct{
+	onion_handler_table *table;
+	int depth;
+}onion_handler_freeze_data;
+
+static void onion_handler_freeze_level(onion_handler_table *table, onion_handler *head, int depth, const char *route);
+
+static void onion_handler_freeze_child(void *data, onion_handler *child, const char *route){
+	onion_handler_freeze_data *fd=data;
+	onion_handler_freeze_level(fd->table, child, fd->depth, route);
+}
+
+/// Copies the level to consecutive entries, and then the levels its handlers call.
+static void onion_handler_freeze_level(onion_handler_table *table, onion_handler *head, int depth, const char *route){
+	if (!head)
+		return;
+	int i;
+	for (i=0;i<table->nheads;i++)
+		if (table->heads[i].head==head) // Shared, or a loop
+			return;
+	int n=0;
+	onion_handler *h;
+	for (h=head;h;h=h->next)
+		if (h->handler)
+			n++;
+	if (table->nheads==table->aheads){
+		table->aheads=table->aheads ? table->aheads*2 : 16;
+		table->heads=realloc(table->heads, table->aheads*sizeof(onion_handler_table_head));
+	}
+	table->heads[table->nheads].head=head;
+	table->heads[table->nheads].start=table->count;
+	table->heads[table->nheads].count=n;
+	table->nheads++;
+	if (table->count+n>table->allocated){
+		while (table->count+n>table->allocated)
+			table->allocated=table->allocated ? table->allocated*2 : 64;
+		table->entries=realloc(table->entries, table->allocated*sizeof(onion_handler_entry));
+	}
+	onion_handler_entry *entry=&table->entries[table->count];
+	table->count+=n;
+	for (h=head;h;h=h->next){
+		if (!h->handler)
+			continue;
+		entry->handler=h->handler;
+		entry->priv_data=h->priv_data;
+		entry->origin=h;
+		entry->route=route;
+		entry->depth=depth;
+		entry->last=(--n==0);
+		entry++;
+	}
+	onion_handler_freeze_data fd={ table, depth+1 };
+	for (h=head;h;h=h->next)
+		if (h->children)
+			h->children(h->priv_data, onion_handler_freeze_child, &fd);
+}
+
+/**
+ * @short Copies the handlers of that tree to the table, and makes them dispatch from there.
+ * @memberof onion_handler_table_t
+ *
+ * Each level is copied to consecutive entries, so onion_handler_handle calls them in order without
+ * following the next pointers. The levels the handlers call are found with onion_handler_set_children,
+ * and are frozen too. onion_listen freezes the root handler, the internal error handler and the vhosts.
+ *
+ * A level changed with onion_handler_add at its first handler walks its list again. Handlers
+ * added after the freeze to other handlers of the level are not called.
+ *
+ * @returns The number of handlers copied.
+ */
+int onion_handler_freeze(onion_handler_table *table, onion_handler *handler){
+	int count=table->count;
+	onion_handler_freeze_level(table, handler, 0, NULL);
+	int i;
+	for (i=0;i<table->nheads;i++) // The entries may have moved
+		table->heads[i].head->frozen=table->heads[i].count ? &table->entries[table->heads[i].start] : NULL;
+	return table->count-count;
+}
+
+/**
+ * @short Number of handlers at the table.
+ * @memberof onion_handler_table_t
+ */
+int onion_handler_table_count(const onion_handler_table *table){
+	return table ? table->count : 0;
+}
+
+/**
+ * @short Returns the nth handler of the table, or NULL.
+ * @memberof onion_handler_table_t
+ *
+ * They are as they were frozen: each level, and then the levels its handlers call, with their depth and route.
+ */
+const onion_handler_entry *onion_handler_table_get(const onion_handler_table *table, int n){
+	if (!table || n<0 || n>=table->count)
+		return NULL;
+	return &table->entries[n];
+}
@@ -48,6 +48,27 @@ void onion_handler_add(onion_handler *base, onion_handler *new_handler);
 /// Returns the private data part of the handler. Useful at handlers, to customize the private data externally.
 void *onion_handler_get_private_data(onion_handler *handler);
 
+/// Sets how to find the handlers this one calls, so they are frozen with it.
+void onion_handler_set_children(onion_handler *handler, onion_handler_children_f children);
+
+/// Sets the response the handler always writes, so the requests to it are answered with it, without calling it.
+void onion_handler_set_prerendered(onion_handler *handler, const onion_response_prerendered *prerendered);
+
+/// Creates an empty table of frozen handlers.
+onion_handler_table *onion_handler_table_new();
+
+/// Frees the table, and the ones it replaced.
+void onion_handler_table_free(onion_handler_table *table);
+
+/// Copies the handlers of that tree to the table, and makes them dispatch from there.
+int onion_handler_freeze(onion_handler_table *table, onion_handler *handler);
+
+/// Number of handlers at the table.
+int onion_handler_table_count(const onion_handler_table *table);
+
+/// Returns the nth handler of the table, in the order they are tried, or NULL.
+const onion_handler_entry *onion_handler_table_get(const onion_handler_table *table, int n);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,239 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <onion/handler.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/shortcuts.h>
+#include <onion/log.h>
+
+#include "archive.h"
+
+/// A mapped archive, refcounted so the requests being served keep it after a reload.
+typedef struct onion_archive_t{
+	int refcount;          ///< Atomic. One while it is the current one, and one per request that uses it.
+	int fd;
+	const char *map;
+	size_t size;
+	const onion_archive_header *header;
+	const onion_archive_entry *entries;
+	const uint32_t *buckets;
+}onion_archive;
+
+typedef struct{
+	pthread_mutex_t mutex; ///< To replace the current archive, and take a reference.
+	onion_archive *current;
+}onion_handler_archive_data;
+
+static void onion_archive_release(onion_archive *archive){
+	if (__sync_sub_and_fetch(&archive->refcount, 1)!=0)
+		return;
+	munmap((void*)archive->map, archive->size);
+	close(archive->fd);
+	free(archive);
+}
+
+/// Whether there is a NUL ended string at offset.
+static int onion_archive_string_valid(const onion_archive *archive, uint32_t offset){
+	return offset>0 && offset<archive->size && memchr(archive->map+offset, 0, archive->size-offset)!=NULL;
+}
+
+/// Checks all the offsets, so the lookups can trust them.
+static int onion_archive_valid(const onion_archive *archive){
+	const onion_archive_header *h=archive->header;
+	if (archive->size<sizeof(onion_archive_header) || memcmp(h->magic, ONION_ARCHIVE_MAGIC, sizeof(h->magic))!=0 || h->size!=archive->size)
+		return 0;
+	if (h->nbuckets==0 || (h->nbuckets&(h->nbuckets-1)) || h->nentries>=h->nbuckets)
+		return 0;
+	if (h->entries>archive->size || (archive->size-h->entries)/sizeof(onion_archive_entry)<h->nentries || h->entries%sizeof(uint64_t))
+		return 0;
+	if (h->buckets>archive->size || (archive->size-h->buckets)/sizeof(uint32_t)<h->nbuckets || h->buckets%sizeof(uint32_t))
+		return 0;
+	uint32_t i, j;
+	for (i=0;i<h->nbuckets;i++){
+		if (archive->buckets[i]>h->nentries)
+			return 0;
+	}
+	for (i=0;i<h->nentries;i++){
+		const onion_archive_entry *e=&archive->entries[i];
+		if (!onion_archive_string_valid(archive, e->path) || !onion_archive_string_valid(archive, e->content_type) || 
+				!onion_archive_string_valid(archive, e->etag) || e->nvariants<1 || e->nvariants>ONION_ARCHIVE_VARIANTS)
+			return 0;
+		for (j=0;j<e->nvariants;j++){
+			const onion_archive_variant *v=&e->variants[j];
+			if (v->offset>archive->size || archive->size-v->offset<v->length || v->length>0xFFFFFFFFu)
+				return 0;
+			if ((v->encoding!=0) != (j<e->nvariants-1) || (v->encoding && !onion_archive_string_valid(archive, v->encoding)))
+				return 0;
+			if (!onion_archive_string_valid(archive, v->headers) || strlen(archive->map+v->headers)!=v->headers_length)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/// Maps the archive at filename, or NULL if it can not be read or is not valid.
+static onion_archive *onion_archive_open(const char *filename){
+	int fd=open(filename, O_RDONLY|O_CLOEXEC);
+	if (fd<0){
+		ONION_ERROR("Could not open the archive %s: %s", filename, strerror(errno));
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st)<0 || st.st_size<sizeof(onion_archive_header)){
+		ONION_ERROR("The archive %s is not valid", filename);
+		close(fd);
+		return NULL;
+	}
+	void *map=mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map==MAP_FAILED){
+		ONION_ERROR("Could not map the archive %s: %s", filename, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	onion_archive *archive=calloc(1, sizeof(onion_archive));
+	archive->refcount=1;
+	archive->fd=fd;
+	archive->map=map;
+	archive->size=st.st_size;
+	archive->header=map;
+	archive->entries=(const onion_archive_entry*)(archive->map+archive->header->entries);
+	archive->buckets=(const uint32_t*)(archive->map+archive->header->buckets);
+	if (!onion_archive_valid(archive)){
+		ONION_ERROR("The archive %s is not valid", filename);
+		onion_archive_release(archive);
+		return NULL;
+	}
+	ONION_DEBUG("Archive %s mapped, %d entries", filename, archive->header->nentries);
+	return archive;
+}
+
+/// The entry of that path, or NULL.
+static const onion_archive_entry *onion_archive_find(const onion_archive *archive, const char *path){
+	uint32_t hash=onion_archive_hash(path);
+	uint32_t mask=archive->header->nbuckets-1;
+	uint32_t i=hash&mask;
+	for (;archive->buckets[i];i=(i+1)&mask){ // There is always an empty one
+		const onion_archive_entry *e=&archive->entries[archive->buckets[i]-1];
+		if (e->hash==hash && strcmp(archive->map+e->path, path)==0)
+			return e;
+	}
+	return NULL;
+}
+
+static onion_connection_status onion_handler_archive_handler(onion_handler_archive_data *d, onion_request *req, onion_response *res){
+	pthread_mutex_lock(&d->mutex);
+	onion_archive *archive=d->current;
+	__sync_fetch_and_add(&archive->refcount, 1);
+	pthread_mutex_unlock(&d->mutex);
+	
+	onion_connection_status ret=OCS_NOT_PROCESSED;
+	const onion_archive_entry *e=onion_archive_find(archive, onion_request_get_path(req));
+	if (e){
+		onion_shortcut_embedded variants[ONION_ARCHIVE_VARIANTS+1];
+		uint32_t i;
+		for (i=0;i<e->nvariants;i++){
+			const onion_archive_variant *v=&e->variants[i];
+			variants[i].encoding=v->encoding ? archive->map+v->encoding : NULL;
+			variants[i].data=archive->map+v->offset;
+			variants[i].length=v->length;
+			variants[i].headers=archive->map+v->headers;
+			variants[i].headers_length=v->headers_length;
+		}
+		ret=onion_shortcut_response_mapped(variants, archive->map+e->content_type, archive->map+e->etag, NULL, 
+																			 archive->fd, archive->map, req, res);
+	}
+	onion_archive_release(archive);
+	return ret;
+}
+
+static void onion_handler_archive_free(onion_handler_archive_data *d){
+	onion_archive_release(d->current);
+	pthread_mutex_destroy(&d->mutex);
+	free(d);
+}
+
+/**
+ * @short Creates a handler that serves the files of an asset archive, as opack -r writes them.
+ * 
+ * Unlike the C code of opack, the assets are not compiled in: the archive is a single file, mapped now, 
+ * so it can change without building again, or be replaced while running with onion_handler_archive_reload.
+ * 
+ * Each request path is looked up at the hash table of the archive, and answered as the opack handlers do, 
+ * with the brotli or gzip variant the client accepts, compressed when the archive was written, the ETag of 
+ * the contents, 304 if the client has it, and the prerendered headers. The data is sent by sendfile from the 
+ * archive, and big files are sent in slices from the poller.
+ * 
+ * If the path is not there, the next handler is tried.
+ * 
+ * @param filename The archive
+ * @returns The handler, or NULL if the archive could not be read or is not valid.
+ */
+onion_handler *onion_handler_archive(const char *filename){
+	onion_archive *archive=onion_archive_open(filename);
+	if (!archive)
+		return NULL;
+	onion_handler_archive_data *priv_data=calloc(1, sizeof(onion_handler_archive_data));
+	if (!priv_data){
+		onion_archive_release(archive);
+		return NULL;
+	}
+	pthread_mutex_init(&priv_data->mutex, NULL);
+	priv_data->current=archive;
+	
+	return onion_handler_new((onion_handler_handler)onion_handler_archive_handler, priv_data, 
+													 (onion_handler_private_data_free)onion_handler_archive_free);
+}
+
+/**
+ * @short Replaces the archive, as when the assets are deployed again.
+ * 
+ * The new archive is mapped and checked before, and if it is not valid the current one stays. The 
+ * requests being served keep the old one until they are done, and the next get the new one. As the old 
+ * one is still mapped, the new should be written to another file and renamed over, not written in place.
+ * 
+ * @returns 0 if replaced, -1 if the new one could not be read or is not valid.
+ */
+int onion_handler_archive_reload(onion_handler *archive, const char *filename){
+	onion_handler_archive_data *d=onion_handler_get_private_data(archive);
+	onion_archive *next=onion_archive_open(filename);
+	if (!next)
+		return -1;
+	pthread_mutex_lock(&d->mutex);
+	onion_archive *old=d->current;
+	d->current=next;
+	pthread_mutex_unlock(&d->mutex);
+	onion_archive_release(old);
+	return 0;
+}
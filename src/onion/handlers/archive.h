@@ -0,0 +1,101 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef __ONION_HANDLER_ARCHIVE__
+#define __ONION_HANDLER_ARCHIVE__
+
+#include <stdint.h>
+#include <onion/types.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/// Start of the asset archives, as opack -r writes them.
+#define ONION_ARCHIVE_MAGIC "ONIONAR1"
+/// Representations of an entry, at most: brotli, gzip and the identity one.
+#define ONION_ARCHIVE_VARIANTS 3
+/// The data of the variants of this size or more starts at a multiple of it.
+#define ONION_ARCHIVE_ALIGN 4096
+
+/**
+ * @short A representation of an entry of the archive.
+ * 
+ * The offsets are from the start of the archive, and the strings there end with a NUL. The numbers are in 
+ * the byte order of the host that wrote it.
+ */
+typedef struct onion_archive_variant_t{
+	uint64_t offset;          ///< Of the data
+	uint64_t length;
+	uint32_t encoding;        ///< The Content-Encoding, or 0 at the identity one
+	uint32_t headers;         ///< The prerendered Etag, Content-Type, Content-Encoding, Vary and Cache-Control lines
+	uint32_t headers_length;
+	uint32_t reserved;
+}onion_archive_variant;
+
+/// A file of the archive, by its path without the leading /.
+typedef struct onion_archive_entry_t{
+	uint32_t path;
+	uint32_t hash;            ///< onion_archive_hash of the path
+	uint32_t content_type;
+	uint32_t etag;            ///< Of the identity one; the others add -encoding.
+	uint32_t nvariants;       ///< The identity one is the last, as at onion_shortcut_response_embedded.
+	uint32_t reserved;
+	onion_archive_variant variants[ONION_ARCHIVE_VARIANTS];
+}onion_archive_entry;
+
+/**
+ * @short The header, at the start of the archive.
+ * 
+ * After it come the entries, the hash table, the strings and the data. The table has nbuckets, a power of 
+ * two, with the index+1 of an entry, or 0 if empty; collisions go to the next bucket.
+ */
+typedef struct onion_archive_header_t{
+	char magic[8];
+	uint32_t nentries;
+	uint32_t nbuckets;
+	uint64_t size;            ///< Of the whole archive, so a truncated one is not used
+	uint64_t entries;         ///< Offset of the entries
+	uint64_t buckets;         ///< Offset of the hash table
+}onion_archive_header;
+
+/// FNV-1a of the path, to find it at the hash table.
+static inline uint32_t onion_archive_hash(const char *path){
+	uint32_t h=2166136261u;
+	while (*path)
+		h=(h^(unsigned char)*path++)*16777619u;
+	return h;
+}
+
+/// Creates a handler that serves the files of the asset archive at filename, mapped now. NULL if it is not valid.
+onion_handler *onion_handler_archive(const char *filename);
+/// Replaces the archive by the one at filename, atomically. The requests being served keep the old one. -1 if it is not valid.
+int onion_handler_archive_reload(onion_handler *archive, const char *filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
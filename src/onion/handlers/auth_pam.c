@@ -25,74 +25,258 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <time.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #include <security/pam_appl.h>
 #include <security/pam_misc.h>
 
 #include <onion/handler.h>
+#include <onion/request.h>
 #include <onion/response.h>
 #include <onion/codecs.h>
 #include <onion/log.h>
 #include <onion/dict.h>
+#include <onion/random.h>
+#include <onion/shortcuts.h>
+#include <onion/workers.h>
+
+#include "auth_pam.h"
 
 int authorize(const char *pamname, const char *username, const char *password);
 
 #define RESPONSE_UNAUTHORIZED "<h1>Unauthorized access</h1>"
 
+/// Jobs waiting for a PAM worker, per worker. More run at the thread of the request.
+#define ONION_HANDLER_AUTH_PAM_QUEUE 16
+
+/// A verification of some credentials, valid until expires.
+typedef struct onion_handler_auth_pam_entry_t{
+	char key[33];            ///< Hex of the keyed hash of the Authorization header
+	char *username;          ///< If it was ok, else NULL.
+	long expires;            ///< Monotonic ms
+	struct onion_handler_auth_pam_entry_t *lru_prev; ///< Most recently used first
+	struct onion_handler_auth_pam_entry_t *lru_next;
+}onion_handler_auth_pam_entry;
+
 struct onion_handler_auth_pam_data_t{
 	char *realm;
 	char *pamname;
 	onion_handler *inside;
+	
+	int max_entries;         ///< Verifications kept, or 0 for no cache.
+	int ttl_ms;
+	int negative_ttl_ms;     ///< For the failed ones
+	int nentries;
+	uint64_t hash_key[4];    ///< Random, so the hashes can not be known, nor collisions searched, from out.
+	onion_dict *entries;     ///< By key
+	onion_handler_auth_pam_entry *lru_first;
+	onion_handler_auth_pam_entry *lru_last;
+	onion_workers *workers;  ///< Threads for the PAM calls, or NULL to call it at the request thread.
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;
+#endif
 };
 
 typedef struct onion_handler_auth_pam_data_t onion_handler_auth_pam_data;
 
-int onion_handler_auth_pam_handler(onion_handler_auth_pam_data *d, onion_request *request, onion_response *res){
-	/// Use session to know if already logged in, so do not mess with PAM so often.
-	if (onion_request_get_session(request, "pam_logged_in"))
-		return onion_handler_handle(d->inside, request, res);
-	
-	const char *o=onion_request_get_header(request, "Authorization");
-	char *auth=NULL;
-	char *username=NULL;
-	char *passwd=NULL;
-	if (o && strncmp(o,"Basic",5)==0){
-		//fprintf(stderr,"auth: '%s'\n",&o[6]);
-		auth=onion_base64_decode(&o[6], NULL);
-		username=auth;
-		int i=0;
-		while (auth[i]!='\0' && auth[i]!=':') i++;
-		if (auth[i]==':'){
-			auth[i]='\0'; // so i have user ready
-			passwd=&auth[i+1];
+/// A PAM call at a worker, for a suspended request.
+typedef struct onion_handler_auth_pam_job_t{
+	onion_handler_auth_pam_data *d;
+	onion_request *req;
+	onion_response *res;
+	char key[33];
+	char *auth;              ///< The Authorization header value
+}onion_handler_auth_pam_job;
+
+static long onion_handler_auth_pam_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static void onion_handler_auth_pam_lock(onion_handler_auth_pam_data *d){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&d->mutex);
+#endif
+}
+
+static void onion_handler_auth_pam_unlock(onion_handler_auth_pam_data *d){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&d->mutex);
+#endif
+}
+
+#define ONION_SIPHASH_ROTL(x,b) (uint64_t)(((x)<<(b)) | ((x)>>(64-(b))))
+#define ONION_SIPHASH_ROUND do{ \
+		v0+=v1; v1=ONION_SIPHASH_ROTL(v1,13); v1^=v0; v0=ONION_SIPHASH_ROTL(v0,32); \
+		v2+=v3; v3=ONION_SIPHASH_ROTL(v3,16); v3^=v2; \
+		v0+=v3; v3=ONION_SIPHASH_ROTL(v3,21); v3^=v0; \
+		v2+=v1; v1=ONION_SIPHASH_ROTL(v1,17); v1^=v2; v2=ONION_SIPHASH_ROTL(v2,32); \
+	}while(0)
+
+/// SipHash-2-4 of the data, with that 128 bit key.
+static uint64_t onion_handler_auth_pam_siphash(const uint64_t key[2], const unsigned char *data, size_t length){
+	uint64_t v0=0x736f6d6570736575ull^key[0];
+	uint64_t v1=0x646f72616e646f6dull^key[1];
+	uint64_t v2=0x6c7967656e657261ull^key[0];
+	uint64_t v3=0x7465646279746573ull^key[1];
+	const unsigned char *end=data+length-(length%8);
+	int i;
+	for (;data!=end;data+=8){
+		uint64_t m=0;
+		for (i=7;i>=0;i--)
+			m=(m<<8)|data[i];
+		v3^=m;
+		ONION_SIPHASH_ROUND;
+		ONION_SIPHASH_ROUND;
+		v0^=m;
+	}
+	uint64_t b=((uint64_t)length)<<56;
+	for (i=(length&7)-1;i>=0;i--)
+		b|=((uint64_t)data[i])<<(8*i);
+	v3^=b;
+	ONION_SIPHASH_ROUND;
+	ONION_SIPHASH_ROUND;
+	v0^=b;
+	v2^=0xff;
+	ONION_SIPHASH_ROUND;
+	ONION_SIPHASH_ROUND;
+	ONION_SIPHASH_ROUND;
+	ONION_SIPHASH_ROUND;
+	return v0^v1^v2^v3;
+}
+
+/// The key of the credentials at the cache: 128 bits of keyed hash, as hex. The credentials themselves are not kept.
+static void onion_handler_auth_pam_key(onion_handler_auth_pam_data *d, const char *auth, char key[33]){
+	size_t l=strlen(auth);
+	uint64_t h0=onion_handler_auth_pam_siphash(&d->hash_key[0], (const unsigned char*)auth, l);
+	uint64_t h1=onion_handler_auth_pam_siphash(&d->hash_key[2], (const unsigned char*)auth, l);
+	snprintf(key, 33, "%016llx%016llx", (unsigned long long)h0, (unsigned long long)h1);
+}
+
+static void onion_handler_auth_pam_lru_remove(onion_handler_auth_pam_data *d, onion_handler_auth_pam_entry *e){
+	if (e->lru_prev)
+		e->lru_prev->lru_next=e->lru_next;
+	else
+		d->lru_first=e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev=e->lru_prev;
+	else
+		d->lru_last=e->lru_prev;
+	e->lru_prev=e->lru_next=NULL;
+}
+
+static void onion_handler_auth_pam_lru_push(onion_handler_auth_pam_data *d, onion_handler_auth_pam_entry *e){
+	e->lru_prev=NULL;
+	e->lru_next=d->lru_first;
+	if (d->lru_first)
+		d->lru_first->lru_prev=e;
+	else
+		d->lru_last=e;
+	d->lru_first=e;
+}
+
+/// Must have the lock.
+static void onion_handler_auth_pam_remove(onion_handler_auth_pam_data *d, onion_handler_auth_pam_entry *e){
+	onion_dict_remove(d->entries, e->key);
+	onion_handler_auth_pam_lru_remove(d, e);
+	d->nentries--;
+	free(e->username);
+	free(e);
+}
+
+/**
+ * @short Looks for a verification of the credentials at the cache.
+ * 
+ * @returns 1 if ok, and then username gets a copy of the user name, 0 if not ok, -1 if not at the cache.
+ */
+static int onion_handler_auth_pam_cache_get(onion_handler_auth_pam_data *d, const char *key, char **username){
+	int ret=-1;
+	onion_handler_auth_pam_lock(d);
+	onion_handler_auth_pam_entry *e=(onion_handler_auth_pam_entry*)onion_dict_get(d->entries, key);
+	if (e && e->expires<=onion_handler_auth_pam_now()){
+		onion_handler_auth_pam_remove(d, e);
+		e=NULL;
+	}
+	if (e){
+		onion_handler_auth_pam_lru_remove(d, e);
+		onion_handler_auth_pam_lru_push(d, e);
+		if (e->username){
+			*username=strdup(e->username);
+			ret=1;
 		}
 		else
-			passwd=NULL;
+			ret=0;
 	}
-	
-	// I have my data, try to authorize
-	if (username && passwd){
-		int ok=authorize(d->pamname, username, passwd);
-		
-		if (ok){ // I save the username at the session, so it can be accessed later.
-			onion_dict *session=onion_request_get_session_dict(request);
-			onion_dict_lock_write(session);
-			onion_dict_add(session, "username", username, OD_REPLACE|OD_DUP_VALUE);
-			onion_dict_add(session, "pam_logged_in", username, OD_REPLACE|OD_DUP_VALUE);
-			onion_dict_unlock(session);
-			
-			free(auth);
-			return onion_handler_handle(d->inside, request, res);
-		}
+	onion_handler_auth_pam_unlock(d);
+	return ret;
+}
+
+/// Keeps the result of the verification, the username if ok, or NULL if not.
+static void onion_handler_auth_pam_cache_add(onion_handler_auth_pam_data *d, const char *key, const char *username){
+	int ttl=username ? d->ttl_ms : d->negative_ttl_ms;
+	if (ttl<=0)
+		return;
+	onion_handler_auth_pam_lock(d);
+	onion_handler_auth_pam_entry *e=(onion_handler_auth_pam_entry*)onion_dict_get(d->entries, key);
+	if (e) // Another request got here first
+		onion_handler_auth_pam_remove(d, e);
+	e=calloc(1, sizeof(onion_handler_auth_pam_entry));
+	strcpy(e->key, key);
+	e->username=username ? strdup(username) : NULL;
+	e->expires=onion_handler_auth_pam_now()+ttl;
+	onion_dict_add(d->entries, e->key, e, 0);
+	onion_handler_auth_pam_lru_push(d, e);
+	d->nentries++;
+	while (d->nentries>d->max_entries)
+		onion_handler_auth_pam_remove(d, d->lru_last);
+	onion_handler_auth_pam_unlock(d);
+}
+
+/**
+ * @short Checks the Basic credentials with PAM, and keeps the result at the cache, if any.
+ * 
+ * @returns The user name if ok, to be freed, or NULL.
+ */
+static char *onion_handler_auth_pam_verify(onion_handler_auth_pam_data *d, const char *auth, const char *key){
+	size_t length=strlen(auth);
+	char *decoded=malloc(length*3/4+1);
+	decoded[onion_base64_decode_to(auth, length, decoded)]='\0';
+	char *username=NULL;
+	char *passwd=strchr(decoded, ':');
+	if (passwd){
+		*passwd++='\0';
+		if (authorize(d->pamname, decoded, passwd))
+			username=strdup(decoded);
 	}
-	if (auth)
-		free(auth);
+	free(decoded);
+	if (d->max_entries>0)
+		onion_handler_auth_pam_cache_add(d, key, username);
+	return username;
+}
 
-	
-	// Not authorized. Ask for it.
+/// The user is in. Saves the username at the session, so it can be accessed later, and goes inside.
+static onion_connection_status onion_handler_auth_pam_pass(onion_handler_auth_pam_data *d, const char *username, 
+																													 onion_request *request, onion_response *res){
+	onion_dict *session=onion_request_get_session_dict(request);
+	onion_dict_lock_write(session);
+	onion_dict_add(session, "username", username, OD_REPLACE|OD_DUP_VALUE);
+	onion_dict_add(session, "pam_logged_in", username, OD_REPLACE|OD_DUP_VALUE);
+	onion_dict_unlock(session);
+	return onion_handler_handle(d->inside, request, res);
+}
+
+/// Not authorized. Ask for it.
+static onion_connection_status onion_handler_auth_pam_unauthorized(onion_handler_auth_pam_data *d, onion_response *res){
 	char temp[256];
-	sprintf(temp, "Basic realm=\"%s\"",d->realm);
+	snprintf(temp, sizeof(temp), "Basic realm=\"%s\"",d->realm);
 	onion_response_set_header(res, "WWW-Authenticate",temp);
 	onion_response_set_code(res, HTTP_UNAUTHORIZED);
 	onion_response_set_length(res,sizeof(RESPONSE_UNAUTHORIZED));
@@ -101,33 +285,170 @@ int onion_handler_auth_pam_handler(onion_handler_auth_pam_data *d, onion_request
 	return OCS_PROCESSED;
 }
 
+/// Verifies at a worker, and answers the suspended request.
+static void onion_handler_auth_pam_job_run(onion_handler_auth_pam_job *job){
+	onion_handler_auth_pam_data *d=job->d;
+	onion_request *req=job->req;
+	onion_response *res=job->res;
+	char *username=onion_handler_auth_pam_verify(d, job->auth, job->key);
+	free(job->auth);
+	free(job);
+	
+	onion_connection_status r;
+	if (username){
+		r=onion_handler_auth_pam_pass(d, username, req, res);
+		free(username);
+	}
+	else
+		r=onion_handler_auth_pam_unauthorized(d, res);
+	if (r==OCS_SUSPENDED) // The inside handler resumes it
+		return;
+	if (r==OCS_NOT_PROCESSED)
+		onion_shortcut_response("Not found", HTTP_NOT_FOUND, req, res);
+	else if (r<0)
+		onion_shortcut_response("Internal error", HTTP_INTERNAL_ERROR, req, res);
+	onion_request_resume(req);
+}
+
+int onion_handler_auth_pam_handler(onion_handler_auth_pam_data *d, onion_request *request, onion_response *res){
+	/// Use session to know if already logged in, so do not mess with PAM so often.
+	if (onion_request_get_session(request, "pam_logged_in"))
+		return onion_handler_handle(d->inside, request, res);
+	
+	const char *o=onion_request_get_header_id(request, ONION_H_AUTHORIZATION);
+	if (!o || strncmp(o,"Basic ",6)!=0)
+		return onion_handler_auth_pam_unauthorized(d, res);
+	const char *auth=&o[6];
+	
+	char key[33]="";
+	if (d->max_entries>0){
+		onion_handler_auth_pam_key(d, auth, key);
+		char *username=NULL;
+		int ok=onion_handler_auth_pam_cache_get(d, key, &username);
+		if (ok==1){
+			onion_connection_status r=onion_handler_auth_pam_pass(d, username, request, res);
+			free(username);
+			return r;
+		}
+		if (ok==0)
+			return onion_handler_auth_pam_unauthorized(d, res);
+	}
+	
+	if (d->workers && onion_request_get_poller(request)){ // Not at the poller thread
+		onion_handler_auth_pam_job *job=malloc(sizeof(onion_handler_auth_pam_job));
+		job->d=d;
+		job->req=request;
+		job->res=res;
+		strcpy(job->key, key);
+		job->auth=strdup(auth);
+		if (onion_workers_push(d->workers, (void*)onion_handler_auth_pam_job_run, job)==0)
+			return OCS_SUSPENDED;
+		free(job->auth); // Queue full, here then
+		free(job);
+	}
+	
+	char *username=onion_handler_auth_pam_verify(d, auth, key);
+	if (username){
+		onion_connection_status r=onion_handler_auth_pam_pass(d, username, request, res);
+		free(username);
+		return r;
+	}
+	return onion_handler_auth_pam_unauthorized(d, res);
+}
+
 
 void onion_handler_auth_pam_delete(onion_handler_auth_pam_data *d){
+	if (d->workers)
+		onion_workers_free(d->workers);
+	while (d->lru_first)
+		onion_handler_auth_pam_remove(d, d->lru_first);
+	onion_dict_free(d->entries);
+#ifdef HAVE_PTHREADS
+	pthread_mutex_destroy(&d->mutex);
+#endif
 	free(d->pamname);
 	free(d->realm);
 	onion_handler_free(d->inside);
 	free(d);
 }
 
+static void onion_handler_auth_pam_children(onion_handler_auth_pam_data *d, onion_handler_child_f f, void *data){
+	f(data, d->inside, NULL);
+}
+
 /**
  * @short Creates an path handler. If the path matches the regex, it reomves that from the regexp and goes to the inside_level.
  *
  * If on the inside level nobody answers, it just returns NULL, so ->next can answer.
  */
 onion_handler *onion_handler_auth_pam(const char *realm, const char *pamname, onion_handler *inside_level){
-	onion_handler_auth_pam_data *priv_data=malloc(sizeof(onion_handler_auth_pam_data));
+	onion_handler_auth_pam_data *priv_data=calloc(1, sizeof(onion_handler_auth_pam_data));
 	if (!priv_data)
 		return NULL;
 
 	priv_data->inside=inside_level;
 	priv_data->pamname=strdup(pamname);
 	priv_data->realm=strdup(realm);
+	priv_data->entries=onion_dict_new();
+	onion_random_generate(priv_data->hash_key, sizeof(priv_data->hash_key));
+#ifdef HAVE_PTHREADS
+	pthread_mutex_init(&priv_data->mutex, NULL);
+#endif
 	
 	onion_handler *ret=onion_handler_new((onion_handler_handler)onion_handler_auth_pam_handler,
 																			 priv_data, (onion_handler_private_data_free) onion_handler_auth_pam_delete);
+	onion_handler_set_children(ret, (onion_handler_children_f)onion_handler_auth_pam_children);
 	return ret;
 }
 
+/**
+ * @short Keeps the result of the PAM verifications, so clients that send the credentials on each request do not go through PAM each time.
+ * 
+ * Credentials are known by a keyed hash of the Authorization header, with a random key, and are not kept.
+ * Good ones are trusted for ttl_ms, so a changed password or a locked account are only noticed after that,
+ * and wrong ones are rejected without asking PAM for negative_ttl_ms, that also slows down guessing.
+ * Over max_entries the least recently used are out.
+ * 
+ * Must be set before the handler is in use.
+ * 
+ * @param auth The handler, as returned by onion_handler_auth_pam
+ * @param max_entries Most verifications kept, or 0 to not keep any.
+ * @param ttl_ms For how long a verification is good
+ * @param negative_ttl_ms For how long a failed one is, or 0 to always ask PAM again
+ */
+void onion_handler_auth_pam_set_cache(onion_handler *auth, int max_entries, int ttl_ms, int negative_ttl_ms){
+	onion_handler_auth_pam_data *d=onion_handler_get_private_data(auth);
+	d->max_entries=max_entries;
+	d->ttl_ms=ttl_ms;
+	d->negative_ttl_ms=negative_ttl_ms;
+	onion_handler_auth_pam_lock(d);
+	while (d->nentries>(max_entries>0 ? max_entries : 0))
+		onion_handler_auth_pam_remove(d, d->lru_last);
+	onion_handler_auth_pam_unlock(d);
+}
+
+/**
+ * @short Calls PAM at nthreads threads of its own, so slow PAM modules do not keep the poller threads busy.
+ * 
+ * Only at O_POLL/O_POOL, where the request is suspended meanwhile; on other modes, or if the threads
+ * have too many calls waiting, PAM is called at the request thread. Verifications at the cache are
+ * answered at once, with no thread change.
+ * 
+ * Must be set before the handler is in use.
+ * 
+ * @param auth The handler, as returned by onion_handler_auth_pam
+ * @param nthreads Threads for the PAM calls, or 0 to call it at the request thread.
+ */
+void onion_handler_auth_pam_set_workers(onion_handler *auth, int nthreads){
+	onion_handler_auth_pam_data *d=onion_handler_get_private_data(auth);
+	if (d->workers){
+		onion_workers_free(d->workers);
+		d->workers=NULL;
+	}
+	if (nthreads>0)
+		d->workers=onion_workers_new(nthreads, nthreads*ONION_HANDLER_AUTH_PAM_QUEUE, NULL, 0);
+}
+
 /// simple answer to the password question, needed by pam
 static int authPAM_passwd(int num_msg, const struct pam_message **msg,
                 struct pam_response **resp, void *appdata_ptr){
@@ -34,6 +34,10 @@ extern "C"{
 
 /// Creates an auth handler that do not allow to pass unless user is authenticated using a pam name.
 onion_handler *onion_handler_auth_pam(const char *realm, const char *pamname, onion_handler *inside_level);
+/// Keeps up to max_entries verifications, good ones for ttl_ms and failed ones for negative_ttl_ms, so PAM is not asked on each request.
+void onion_handler_auth_pam_set_cache(onion_handler *auth, int max_entries, int ttl_ms, int negative_ttl_ms);
+/// Calls PAM at nthreads threads of its own, while the request waits suspended, instead of at the poller threads.
+void onion_handler_auth_pam_set_workers(onion_handler *auth, int nthreads);
 
 #ifdef __cplusplus
 }
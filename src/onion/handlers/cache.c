@@ -0,0 +1,469 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include <onion/handler.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/dict.h>
+#include <onion/block.h>
+#include <onion/log.h>
+#include <onion/types_internal.h>
+
+#include "cache.h"
+
+/// Most vary headers of a cache
+#define ONION_HANDLER_CACHE_MAX_VARY 8
+/// Longest a request waits for another to fill the same key, before running the handler by itself.
+#define ONION_HANDLER_CACHE_WAIT_MS 10000
+
+/// A cached response, or the place of one being made.
+typedef struct onion_handler_cache_entry_t{
+	char *key;
+	int code;
+	char *headers;          ///< "Key: value\r\n" lines, for onion_response_set_header_block
+	size_t headers_length;
+	char has_content_type;  ///< The headers have the Content-Type, so the default is removed.
+	char *body;
+	size_t length;
+	long fresh_until;       ///< Monotonic ms
+	long stale_until;
+	int refcount;           ///< The table holds one, and each replay another.
+	char filling;           ///< A request is running the handler to fill it. The others wait.
+	char refreshing;        ///< Stale, and a request is running the handler to replace it. The others get this one.
+	struct onion_handler_cache_entry_t *lru_prev; ///< Most recently used first
+	struct onion_handler_cache_entry_t *lru_next;
+}onion_handler_cache_entry;
+
+struct onion_handler_cache_data_t{
+	onion_handler *inside;
+	int ttl_ms;
+	int stale_ms;
+	size_t max_size;        ///< Of all the entries. Over it the least recently used are removed.
+	size_t max_entry_size;  ///< Bigger bodies are not kept.
+	size_t size;
+	char *vary[ONION_HANDLER_CACHE_MAX_VARY];
+	int nvary;
+	onion_dict *entries;    ///< By key
+	onion_handler_cache_entry *lru_first;
+	onion_handler_cache_entry *lru_last;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;
+	pthread_cond_t filled;  ///< Broadcast when an entry stops filling
+#endif
+};
+
+typedef struct onion_handler_cache_data_t onion_handler_cache_data;
+
+static int onion_handler_cache_handler(onion_handler_cache_data *d, onion_request *request, onion_response *response);
+static void onion_handler_cache_delete(void *data);
+
+/// Monotonic time in ms
+static long onion_handler_cache_now(){
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static void onion_handler_cache_lock(onion_handler_cache_data *d){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&d->mutex);
+#endif
+}
+
+static void onion_handler_cache_unlock(onion_handler_cache_data *d){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&d->mutex);
+#endif
+}
+
+/// Drops a reference, freeing the entry at the last one. With the lock.
+static void onion_handler_cache_entry_unref(onion_handler_cache_entry *e){
+	if (--e->refcount>0)
+		return;
+	free(e->key);
+	free(e->headers);
+	free(e->body);
+	free(e);
+}
+
+static void onion_handler_cache_lru_remove(onion_handler_cache_data *d, onion_handler_cache_entry *e){
+	if (e->lru_prev)
+		e->lru_prev->lru_next=e->lru_next;
+	else
+		d->lru_first=e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev=e->lru_prev;
+	else
+		d->lru_last=e->lru_prev;
+	e->lru_prev=e->lru_next=NULL;
+}
+
+static void onion_handler_cache_lru_push(onion_handler_cache_data *d, onion_handler_cache_entry *e){
+	e->lru_prev=NULL;
+	e->lru_next=d->lru_first;
+	if (d->lru_first)
+		d->lru_first->lru_prev=e;
+	else
+		d->lru_last=e;
+	d->lru_first=e;
+}
+
+/// Removes the entry from the table. Those replaying it keep it until done. With the lock.
+static void onion_handler_cache_remove(onion_handler_cache_data *d, onion_handler_cache_entry *e){
+	onion_dict_remove(d->entries, e->key);
+	if (!e->filling){
+		onion_handler_cache_lru_remove(d, e);
+		d->size-=strlen(e->key)+e->headers_length+e->length;
+	}
+	onion_handler_cache_entry_unref(e);
+}
+
+/// Adds to the table a new entry for that key, filling or filled. With the lock.
+static onion_handler_cache_entry *onion_handler_cache_add(onion_handler_cache_data *d, const char *key){
+	onion_handler_cache_entry *e=calloc(1, sizeof(onion_handler_cache_entry));
+	e->key=strdup(key);
+	e->refcount=1;
+	onion_dict_add(d->entries, e->key, e, 0);
+	return e;
+}
+
+/**
+ * @short Key of the request: the full path, the query and the vary headers, at the request arena.
+ * 
+ * The query is the raw one, or if already parsed, its key=value pairs in order.
+ */
+static char *onion_handler_cache_key(onion_handler_cache_data *d, onion_request *req){
+	onion_block *key=onion_block_new();
+	onion_block_add_str(key, onion_request_get_fullpath(req));
+	if (req->query){
+		onion_block_add_char(key, '?');
+		onion_block_add_str(key, req->query);
+	}
+	else if (req->GET){
+		onion_dict_iter it;
+		char sep='?';
+		if (onion_dict_iter_begin(req->GET, &it)) do{
+			onion_block_add_char(key, sep);
+			onion_block_add_str(key, it.key);
+			onion_block_add_char(key, '=');
+			onion_block_add_str(key, it.value);
+			sep='&';
+		}while(onion_dict_iter_next(&it));
+	}
+	int i;
+	for (i=0;i<d->nvary;i++){
+		const char *value=onion_request_get_header(req, d->vary[i]);
+		onion_block_add_char(key, '\n');
+		if (value)
+			onion_block_add_str(key, value);
+	}
+	char *ret=onion_request_strdup(req, onion_block_data(key));
+	onion_block_free(key);
+	return ret;
+}
+
+/// Whether the response may be kept for all the clients
+static int onion_handler_cache_cacheable(onion_request *req, onion_response *res){
+	int code=res->code;
+	if (code!=200 && code!=203 && code!=204 && code!=300 && code!=301 && code!=404 && code!=410)
+		return 0;
+	if (req->session) // May be of this user, and would set its cookie
+		return 0;
+	onion_dict *headers=onion_response_get_headers(res);
+	if (onion_dict_get(headers, "Set-Cookie"))
+		return 0;
+	const char *cache_control=onion_dict_get(headers, "Cache-Control");
+	if (cache_control && (strstr(cache_control, "no-store") || strstr(cache_control, "private") || strstr(cache_control, "no-cache")))
+		return 0;
+	return 1;
+}
+
+/// Headers that are not replayed, as they are of each response or connection, or of the compressed body.
+static int onion_handler_cache_skip_header(const char *key){
+	static const char *skip[]={ "Content-Length", "Date", "Server", "Connection", "Transfer-Encoding", "Content-Encoding", NULL };
+	int i;
+	for (i=0;skip[i];i++){
+		if (strcasecmp(key, skip[i])==0)
+			return 1;
+	}
+	return 0;
+}
+
+/// Fills the entry from the response, with its body copy. With the lock.
+static void onion_handler_cache_fill(onion_handler_cache_data *d, onion_handler_cache_entry *e, onion_response *res, const onion_block *body, long now){
+	onion_block *headers=onion_block_new();
+	onion_dict_iter it;
+	if (onion_dict_iter_begin(onion_response_get_headers(res), &it)) do{
+		if (onion_handler_cache_skip_header(it.key))
+			continue;
+		if (strcasecmp(it.key, "Content-Type")==0)
+			e->has_content_type=1;
+		onion_block_add_str(headers, it.key);
+		onion_block_add_data(headers, ": ", 2);
+		onion_block_add_str(headers, it.value);
+		onion_block_add_data(headers, "\r\n", 2);
+	}while(onion_dict_iter_next(&it));
+	if (res->header_block)
+		onion_block_add_data(headers, res->header_block, res->header_block_length);
+	e->headers_length=onion_block_size(headers);
+	e->headers=malloc(e->headers_length+1);
+	memcpy(e->headers, onion_block_data(headers), e->headers_length+1);
+	onion_block_free(headers);
+
+	e->code=res->code;
+	e->length=onion_block_size(body);
+	e->body=malloc(e->length+1);
+	memcpy(e->body, onion_block_data(body), e->length);
+	e->fresh_until=now+d->ttl_ms;
+	e->stale_until=e->fresh_until+d->stale_ms;
+	e->filling=0;
+
+	d->size+=strlen(e->key)+e->headers_length+e->length;
+	onion_handler_cache_lru_push(d, e);
+	while (d->size>d->max_size && d->lru_last && d->lru_last!=e)
+		onion_handler_cache_remove(d, d->lru_last);
+}
+
+/**
+ * @short Writes the cached response.
+ * 
+ * The headers are written now, as the entry may be freed after, and the body after them, so unless it
+ * is big, all goes at one write when the response ends.
+ */
+static int onion_handler_cache_replay(onion_handler_cache_entry *e, onion_response *res){
+	onion_response_set_code(res, e->code);
+	if (e->has_content_type)
+		onion_dict_remove(onion_response_get_headers(res), "Content-Type");
+	onion_response_set_header_block(res, e->headers, e->headers_length);
+	onion_response_set_length(res, e->length);
+	if (onion_response_write_headers(res)==OR_SKIP_CONTENT)
+		return OCS_PROCESSED;
+	onion_response_write(res, e->body, e->length);
+	return OCS_PROCESSED;
+}
+
+/// Waits until some entry stops filling. Returns 0 if timed out. With the lock.
+static int onion_handler_cache_wait(onion_handler_cache_data *d, long until){
+#ifdef HAVE_PTHREADS
+	long left=until-onion_handler_cache_now();
+	if (left<=0)
+		return 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec+=left/1000;
+	ts.tv_nsec+=(left%1000)*1000000;
+	if (ts.tv_nsec>=1000000000){
+		ts.tv_sec++;
+		ts.tv_nsec-=1000000000;
+	}
+	return pthread_cond_timedwait(&d->filled, &d->mutex, &ts)!=ETIMEDOUT || onion_handler_cache_now()<until;
+#else
+	return 0; // Nobody else could be filling it
+#endif
+}
+
+/**
+ * @short Answers from the cache, or runs the inside handler and keeps its response.
+ * 
+ * Only GET, and HEAD from the GET responses, without Authorization. While a key is filled, the other
+ * requests for it wait and get the same response. When stale, one request refreshes it while the
+ * others get the stale one.
+ */
+static int onion_handler_cache_handler(onion_handler_cache_data *d, onion_request *request, onion_response *response){
+	int method=onion_request_get_flags(request)&OR_METHODS;
+	if ((method!=OR_GET && method!=OR_HEAD) || onion_request_get_header(request, "Authorization"))
+		return onion_handler_handle(d->inside, request, response);
+
+	char *key=onion_handler_cache_key(d, request);
+	long now=onion_handler_cache_now();
+	long wait_until=now+ONION_HANDLER_CACHE_WAIT_MS;
+	onion_handler_cache_entry *fill=NULL; // Filling or refreshing by this request
+	onion_handler_cache_lock(d);
+	while(1){
+		onion_handler_cache_entry *e=(onion_handler_cache_entry*)onion_dict_get(d->entries, key);
+		if (e && e->filling){
+			if (onion_handler_cache_wait(d, wait_until))
+				continue;
+			break; // Too long, run it as if not cached
+		}
+		if (e && (now<e->fresh_until || (now<e->stale_until && e->refreshing))){
+			e->refcount++;
+			onion_handler_cache_lru_remove(d, e);
+			onion_handler_cache_lru_push(d, e);
+			onion_handler_cache_unlock(d);
+			int r=onion_handler_cache_replay(e, response);
+			onion_handler_cache_lock(d);
+			onion_handler_cache_entry_unref(e);
+			onion_handler_cache_unlock(d);
+			return r;
+		}
+		if (method==OR_HEAD) // Has no body to keep
+			break;
+		if (e && now<e->stale_until){
+			e->refreshing=1;
+			fill=e;
+		}
+		else{
+			if (e)
+				onion_handler_cache_remove(d, e);
+			fill=onion_handler_cache_add(d, key);
+			fill->filling=1;
+		}
+		fill->refcount++; // Kept until filled, even if removed meanwhile
+		break;
+	}
+	onion_handler_cache_unlock(d);
+	if (!fill)
+		return onion_handler_handle(d->inside, request, response);
+
+	onion_response_set_capture(response, d->max_entry_size);
+	int r=onion_handler_handle(d->inside, request, response);
+	const onion_block *body=onion_response_get_capture(response);
+
+	onion_handler_cache_lock(d);
+	int ok=(r==OCS_PROCESSED && body && onion_handler_cache_cacheable(request, response));
+	if (fill->filling){ // Only this request could remove it
+		if (ok)
+			onion_handler_cache_fill(d, fill, response, body, onion_handler_cache_now());
+		else
+			onion_handler_cache_remove(d, fill);
+	}
+	else{ // Refreshed. The stale one stays if this one can not be kept. It may have been removed meanwhile.
+		fill->refreshing=0;
+		if (ok){
+			if ((onion_handler_cache_entry*)onion_dict_get(d->entries, key)==fill)
+				onion_handler_cache_remove(d, fill);
+			if (!onion_dict_get(d->entries, key))
+				onion_handler_cache_fill(d, onion_handler_cache_add(d, key), response, body, onion_handler_cache_now());
+		}
+	}
+	onion_handler_cache_entry_unref(fill);
+#ifdef HAVE_PTHREADS
+	pthread_cond_broadcast(&d->filled);
+#endif
+	onion_handler_cache_unlock(d);
+	return r;
+}
+
+/// Frees an entry at the cache free.
+static void onion_handler_cache_entry_free(void *_, const char *key, const void *entry, int flags){
+	onion_handler_cache_entry_unref((onion_handler_cache_entry*)entry);
+}
+
+static void onion_handler_cache_delete(void *data){
+	onion_handler_cache_data *d=data;
+	onion_handler_free(d->inside);
+	onion_dict_preorder(d->entries, onion_handler_cache_entry_free, NULL);
+	onion_dict_free(d->entries);
+	int i;
+	for (i=0;i<d->nvary;i++)
+		free(d->vary[i]);
+#ifdef HAVE_PTHREADS
+	pthread_mutex_destroy(&d->mutex);
+	pthread_cond_destroy(&d->filled);
+#endif
+	free(d);
+}
+
+static void onion_handler_cache_children(onion_handler_cache_data *d, onion_handler_child_f f, void *data){
+	f(data, d->inside, NULL);
+}
+
+/**
+ * @short Creates a handler that keeps the responses of the inside level for some time, and replays them.
+ *
+ * It is for endpoints whose output changes seldom, as on an onion_url route:
+ *
+ *   onion_url_add_handler(urls, "^news/", onion_handler_cache(onion_url_to_handler(news), 5000, 30000, 16*1024*1024, 256*1024));
+ *
+ * The GET responses are kept, with their code, headers and body, by full path, query and the request headers
+ * added with onion_handler_cache_vary. A hit writes them at once, without calling the inside handler.
+ * 
+ * - Each is fresh for ttl_ms, and then, for stale_ms more, it is still answered while one request runs the handler
+ *   to replace it.
+ * - When many requests miss the same key at once, only one runs the handler, and the others wait for its response.
+ * - Over max_size bytes, the least recently used ones are removed. Bodies over max_entry_size are not kept.
+ * 
+ * Only the 200, 203, 204, 300, 301, 404 and 410 responses are kept, and not those that set a cookie, use
+ * the session, or have Cache-Control no-store, no-cache or private. Requests with Authorization are not cached.
+ * 
+ * The body is kept before compression, so put the compress handler outside this one.
+ *
+ * @param inside_level The handler whose responses are kept
+ * @param ttl_ms How long a response is fresh
+ * @param stale_ms How long after the ttl it may be given stale while refreshing
+ * @param max_size Bytes for all the responses
+ * @param max_entry_size Bytes for a response
+ */
+onion_handler *onion_handler_cache(onion_handler *inside_level, int ttl_ms, int stale_ms, size_t max_size, size_t max_entry_size){
+	onion_handler_cache_data *priv_data=calloc(1, sizeof(onion_handler_cache_data));
+	if (!priv_data)
+		return NULL;
+	
+	priv_data->inside=inside_level;
+	priv_data->ttl_ms=ttl_ms;
+	priv_data->stale_ms=stale_ms;
+	priv_data->max_size=max_size;
+	priv_data->max_entry_size=max_entry_size;
+	priv_data->entries=onion_dict_new();
+	onion_dict_set_flags(priv_data->entries, OD_HASH);
+#ifdef HAVE_PTHREADS
+	pthread_mutex_init(&priv_data->mutex, NULL);
+	pthread_cond_init(&priv_data->filled, NULL);
+#endif
+	
+	onion_handler *ret=onion_handler_new((onion_handler_handler)onion_handler_cache_handler,
+																				 priv_data, (onion_handler_private_data_free) onion_handler_cache_delete);
+	onion_handler_set_children(ret, (onion_handler_children_f)onion_handler_cache_children);
+	return ret;
+}
+
+/**
+ * @short Adds a request header to the key of the cached responses.
+ *
+ * For the headers the response depends on, as Accept-Language. Should be set before the first request.
+ */
+void onion_handler_cache_vary(onion_handler *cache, const char *header){
+	onion_handler_cache_data *d=onion_handler_get_private_data(cache);
+	if (d->nvary>=ONION_HANDLER_CACHE_MAX_VARY){
+		ONION_ERROR("Too many vary headers at the cache, %d at most", ONION_HANDLER_CACHE_MAX_VARY);
+		return;
+	}
+	d->vary[d->nvary++]=strdup(header);
+}
@@ -0,0 +1,45 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef __ONION_HANDLER_CACHE__
+#define __ONION_HANDLER_CACHE__
+
+#include <stddef.h>
+#include <onion/types.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/// Creates a handler that keeps the GET responses of the inside_level for ttl_ms, and serves them stale for stale_ms more while one request refreshes them.
+onion_handler *onion_handler_cache(onion_handler *inside_level, int ttl_ms, int stale_ms, size_t max_size, size_t max_entry_size);
+/// Adds a request header to the key of the cached responses, as Accept-Language.
+void onion_handler_cache_vary(onion_handler *cache, const char *header);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
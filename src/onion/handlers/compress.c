@@ -0,0 +1,87 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+
+#include <onion/handler.h>
+#include <onion/response.h>
+
+#include "compress.h"
+
+struct onion_handler_compress_data_t{
+	int level;
+	size_t min_size;
+	onion_handler *inside;
+};
+
+typedef struct onion_handler_compress_data_t onion_handler_compress_data;
+
+static int onion_handler_compress_handler(onion_handler_compress_data *d, onion_request *request, onion_response *response){
+	onion_response_set_compression(response, d->level, d->min_size);
+	int r=onion_handler_handle(d->inside, request, response);
+	if (r==OCS_NOT_PROCESSED) // Other handler may answer, not on this route.
+		onion_response_set_compression(response, 0, 0);
+	return r;
+}
+
+static void onion_handler_compress_delete(void *data){
+	onion_handler_compress_data *d=data;
+	onion_handler_free(d->inside);
+	free(data);
+}
+
+static void onion_handler_compress_children(onion_handler_compress_data *d, onion_handler_child_f f, void *data){
+	f(data, d->inside, NULL);
+}
+
+/**
+ * @short Creates a handler that compresses the responses of the inside level.
+ *
+ * It can be added to an onion_url route to compress only that route, each with its own level and minimum size:
+ *
+ *   onion_url_add_handler(urls, "^api/", onion_handler_compress(onion_url_to_handler(api), 6, 1024));
+ *
+ * Responses are compressed with gzip, deflate or brotli as the client accepts at Accept-Encoding, but not
+ * those already compressed by Content-Type, or those known to be smaller than min_size. It streams,
+ * so works with chunked responses. @see onion_response_set_compression
+ *
+ * @param inside_level The handler whose responses are compressed
+ * @param level Compression level, 1 (fast) to 9 (best); brotli up to 11.
+ * @param min_size Responses known to be smaller are sent as they are.
+ */
+onion_handler *onion_handler_compress(onion_handler *inside_level, int level, size_t min_size){
+	onion_handler_compress_data *priv_data=malloc(sizeof(onion_handler_compress_data));
+	if (!priv_data)
+		return NULL;
+	
+	priv_data->level=level;
+	priv_data->min_size=min_size;
+	priv_data->inside=inside_level;
+	
+	onion_handler *ret=onion_handler_new((onion_handler_handler)onion_handler_compress_handler,
+																				 priv_data, (onion_handler_private_data_free) onion_handler_compress_delete);
+	onion_handler_set_children(ret, (onion_handler_children_f)onion_handler_compress_children);
+	return ret;
+}
@@ -0,0 +1,149 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <onion/handler.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/shortcuts.h>
+#include <onion/dict.h>
+#include <onion/block.h>
+#include <onion/hash.h>
+#include <onion/log.h>
+#include <onion/types_internal.h>
+
+#include "conditional.h"
+
+int onion_response_rewind(onion_response *res); // At response.c
+
+struct onion_handler_conditional_data_t{
+	onion_handler *inside;
+	size_t max_size;        ///< Bigger bodies are sent as they are written, without ETag
+};
+
+typedef struct onion_handler_conditional_data_t onion_handler_conditional_data;
+
+/**
+ * @short Runs the inside handler with its response held, and answers it or 304.
+ * 
+ * The response buffer is as big as max_size, and held, so nothing is sent while the handler writes. Then, if it was 
+ * a 200 and all is still there, it is made again with the ETag, the one the handler set or a hash of the body,
+ * and without body if the client already has it.
+ */
+static int onion_handler_conditional_handler(onion_handler_conditional_data *d, onion_request *request, onion_response *response){
+	if ((onion_request_get_flags(request)&OR_METHODS)!=OR_GET || (request->flags&OR_HTTP2))
+		return onion_handler_handle(d->inside, request, response);
+
+	size_t buffer_size=response->buffer_size;
+	if (buffer_size<d->max_size)
+		response->buffer_size=d->max_size;
+	size_t mark=onion_response_fragment_begin(response);
+	response->hold=1;
+	int r=onion_handler_handle(d->inside, request, response);
+	response->hold=0;
+	onion_block *body=onion_response_fragment_end(response, mark);
+	response->buffer_size=buffer_size;
+	if (r!=OCS_PROCESSED || !body || response->code!=HTTP_OK || onion_response_rewind(response)<0){
+		if (body)
+			onion_block_free(body);
+		return r;
+	}
+
+	onion_dict *headers=onion_response_get_headers(response);
+	const char *etag=onion_dict_get(headers, "ETag");
+	if (!etag)
+		etag=onion_dict_get(headers, "Etag");
+	if (!etag){
+		char tmp[24];
+		snprintf(tmp, sizeof(tmp), "W/\"%016" PRIx64 "\"", onion_hash64(onion_block_data(body), onion_block_size(body), 0));
+		onion_response_set_header(response, "ETag", tmp);
+		etag=onion_dict_get(headers, "ETag");
+	}
+	const char *last_modified_header=onion_dict_get(headers, "Last-Modified");
+	time_t last_modified=last_modified_header ? onion_shortcut_date_time_t(last_modified_header) : -1;
+
+	onion_block *capture=response->capture; // It has the body already, as for an outer cache.
+	response->capture=NULL;
+	if (onion_shortcut_not_modified(request, etag, last_modified)){
+		ONION_DEBUG0("Not modified, %s", etag);
+		onion_response_set_length(response, 0);
+		onion_response_set_code(response, HTTP_NOT_MODIFIED);
+		onion_response_write_headers(response);
+	}
+	else{
+		onion_response_set_length(response, onion_block_size(body));
+		onion_response_write_headers(response);
+		onion_response_write(response, onion_block_data(body), onion_block_size(body));
+	}
+	response->capture=capture;
+	onion_block_free(body);
+	return r;
+}
+
+static void onion_handler_conditional_delete(void *data){
+	onion_handler_conditional_data *d=data;
+	onion_handler_free(d->inside);
+	free(d);
+}
+
+static void onion_handler_conditional_children(onion_handler_conditional_data *d, onion_handler_child_f f, void *data){
+	f(data, d->inside, NULL);
+}
+
+/**
+ * @short Creates a handler that answers 304 to the clients that already have the response of the inside level.
+ *
+ * It is for endpoints that are polled and seldom change, as dashboards:
+ *
+ *   onion_url_add_handler(urls, "^status/", onion_handler_conditional(onion_url_to_handler(status), 256*1024));
+ *
+ * The GET responses are held until the handler ends, up to max_size bytes of body. Then, if they are 200, they 
+ * get a weak ETag from a hash of the body, unless the handler set its own, and if the If-None-Match of the 
+ * request has it, or else the If-Modified-Since is not before the Last-Modified the handler set, they are answered
+ * 304 without body. The handler still runs each time; this saves the sending, not the making.
+ * 
+ * Bigger bodies, explicit flushes, and HTTP/2 and HEAD requests are answered as they are, without ETag. The body is
+ * hashed before compression, so put the compress handler outside this one.
+ *
+ * @param inside_level The handler whose responses are checked
+ * @param max_size Bytes of the biggest body that is held
+ */
+onion_handler *onion_handler_conditional(onion_handler *inside_level, size_t max_size){
+	onion_handler_conditional_data *priv_data=calloc(1, sizeof(onion_handler_conditional_data));
+	if (!priv_data)
+		return NULL;
+	
+	priv_data->inside=inside_level;
+	priv_data->max_size=max_size;
+	
+	onion_handler *ret=onion_handler_new((onion_handler_handler)onion_handler_conditional_handler,
+																				 priv_data, (onion_handler_private_data_free) onion_handler_conditional_delete);
+	onion_handler_set_children(ret, (onion_handler_children_f)onion_handler_conditional_children);
+	return ret;
+}
@@ -0,0 +1,126 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/handler.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/types_internal.h>
+
+#include "connections.h"
+
+/// Longest in the state first, as those are the ones to look at.
+static int onion_handler_connections_compare(const void *a, const void *b){
+	int64_t x=((const onion_connection_info*)a)->state_ms, y=((const onion_connection_info*)b)->state_ms;
+	return x<y ? 1 : x>y ? -1 : 0;
+}
+
+/// Writes the string as a JSON one, with its quotes.
+static void onion_handler_connections_json_string(onion_response *res, const char *str){
+	onion_response_write(res, "\"", 1);
+	for (;*str;str++){
+		unsigned char c=*str;
+		if (c=='"' || c=='\\')
+			onion_response_printf(res, "\\%c", c);
+		else if (c<0x20)
+			onion_response_printf(res, "\\u%04x", c);
+		else
+			onion_response_write(res, (const char*)&c, 1);
+	}
+	onion_response_write(res, "\"", 1);
+}
+
+static void onion_handler_connections_json(onion_response *res, onion_connection_info *infos, int count){
+	onion_response_set_header(res, "Content-Type", "application/json");
+	onion_response_write0(res, "[");
+	int i;
+	for (i=0;i<count;i++){
+		onion_connection_info *c=&infos[i];
+		onion_response_printf(res, "%s\n{\"fd\":%d,\"peer\":", i ? "," : "", c->fd);
+		onion_handler_connections_json_string(res, c->peer);
+		onion_response_write0(res, ",\"listen_point\":");
+		onion_handler_connections_json_string(res, c->listen_point);
+		onion_response_printf(res, ",\"state\":\"%s\",\"age_ms\":%ld,\"state_ms\":%ld,\"bytes_in\":%llu,\"bytes_out\":%llu,\"path\":",
+		                      onion_request_state_names[c->state], (long)c->age_ms, (long)c->state_ms,
+		                      (unsigned long long)c->bytes_in, (unsigned long long)c->bytes_out);
+		onion_handler_connections_json_string(res, c->path);
+		onion_response_write0(res, "}");
+	}
+	onion_response_write0(res, "\n]\n");
+}
+
+static void onion_handler_connections_text(onion_response *res, onion_connection_info *infos, int count){
+	onion_response_set_header(res, "Content-Type", "text/plain; charset=utf-8");
+	onion_response_printf(res, "%-5s %-40s %-20s %-9s %9s %9s %12s %12s %s\n", "fd", "peer", "listen", "state", "age_ms",
+	                      "state_ms", "bytes_in", "bytes_out", "path");
+	int i;
+	for (i=0;i<count;i++){
+		onion_connection_info *c=&infos[i];
+		char path[ONION_CONNECTION_PATH_SIZE];
+		int j;
+		for (j=0;c->path[j];j++) // One line each, whatever the path has
+			path[j]=((unsigned char)c->path[j]<0x20) ? '?' : c->path[j];
+		path[j]='\0';
+		onion_response_printf(res, "%-5d %-40s %-20s %-9s %9ld %9ld %12llu %12llu %s\n", c->fd, c->peer[0] ? c->peer : "-",
+		                      c->listen_point, onion_request_state_names[c->state], (long)c->age_ms, (long)c->state_ms,
+		                      (unsigned long long)c->bytes_in, (unsigned long long)c->bytes_out, path);
+	}
+}
+
+/// Writes the live connections, longest in their state first.
+static onion_connection_status onion_handler_connections_handler(void *_, onion_request *req, onion_response *res){
+	int count=0;
+	onion_connection_info *infos=onion_get_connections(req->connection.listen_point->server, &count);
+	if (count>1)
+		qsort(infos, count, sizeof(onion_connection_info), onion_handler_connections_compare);
+	onion_response_set_header(res, "Cache-Control", "no-store");
+	const char *format=onion_request_get_query(req, "format");
+	if (format && strcmp(format, "json")==0)
+		onion_handler_connections_json(res, infos, count);
+	else
+		onion_handler_connections_text(res, infos, count);
+	free(infos);
+	return OCS_PROCESSED;
+}
+
+/**
+ * @short Creates a handler that lists the live connections, and what each one does now.
+ * 
+ * Add it at some private path, as onion_url_add_handler(urls, "connections", onion_handler_connections()),
+ * to see which connections hold the threads when the latency goes up. For each connection at the pollers: 
+ * its fd, client and listen point, its state (handshake, headers, body, handler, writing or idle), its age 
+ * and time at that state, the bytes read and sent, and the method and path of the current request. 
+ * 
+ * The ones longest at their state go first. It is a plain text table, or JSON with ?format=json. It shows
+ * the paths and clients of all the connections, so do not make it public.
+ * 
+ * @see onion_get_connections
+ */
+onion_handler *onion_handler_connections(){
+	return onion_handler_new(onion_handler_connections_handler, NULL, NULL);
+}
@@ -34,21 +34,37 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <pwd.h>
+#include <errno.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #include <onion/shortcuts.h>
 #include <onion/handler.h>
 #include <onion/response.h>
 #include <onion/codecs.h>
+#include <onion/block.h>
+#include <onion/dict.h>
 #include <onion/log.h>
+#include <onion/file_cache.h>
+#include <onion/types_internal.h>
 
 #include "exportlocal.h"
 
 
+struct onion_export_local_cache_t;
+typedef struct onion_export_local_cache_t onion_export_local_cache;
+
 struct onion_handler_export_local_data_t{
 	void (*renderer_header)(onion_response *res, const char *dirname);
 	void (*renderer_footer)(onion_response *res, const char *dirname);
 	char *localpath;
 	int is_file:1;
+	onion_export_local_cache *cache; ///< Directory listings kept, or NULL. @see onion_handler_export_local_set_listing_cache
 };
 
 typedef struct onion_handler_export_local_data_t onion_handler_export_local_data;
@@ -56,6 +72,28 @@ typedef struct onion_handler_export_local_data_t onion_handler_export_local_data
 int onion_handler_export_local_directory(onion_handler_export_local_data *data, const char *realp, const char *showpath, onion_request *req, onion_response *res);
 int onion_handler_export_local_file(const char *realp, struct stat *reals, onion_request *request, onion_response *response);
 
+/// As onion_handler_export_local_handler, with the checks from the server file cache. @see onion_set_file_cache
+static int onion_handler_export_local_cached(onion_handler_export_local_data *d, onion_file_cache *cache, const char *path, onion_request *request, onion_response *response){
+	onion_file_cache_entry *entry=onion_file_cache_get(cache, path);
+	if (!entry){
+		ONION_DEBUG0("Not found %s.", path);
+		return 0;
+	}
+	const char *realp=onion_file_cache_entry_realpath(entry);
+	int ret=OCS_NOT_PROCESSED;
+	mode_t mode=onion_file_cache_entry_stat(entry)->st_mode;
+	if (!realp || strncmp(realp, d->localpath, strlen(d->localpath))!=0) // out of secured dir.
+		ONION_WARNING_RATELIMITED("Trying to escape from secured dir (secured dir %s, trying %s).", d->localpath, realp ? realp : path);
+	else if (S_ISDIR(mode))
+		ret=onion_handler_export_local_directory(d, realp, onion_request_get_path(request), request, response);
+	else if (S_ISREG(mode))
+		ret=onion_shortcut_response_file(realp, request, response);
+	else
+		ONION_DEBUG0("Dont know how to handle");
+	onion_file_cache_release(entry);
+	return ret;
+}
+
 int onion_handler_export_local_handler(onion_handler_export_local_data *d, onion_request *request, onion_response *response){
 	char tmp[PATH_MAX];
 	char realp[PATH_MAX];
@@ -67,6 +105,10 @@ int onion_handler_export_local_handler(onion_handler_export_local_data *d, onion
 
 	ONION_DEBUG0("Get %s (base %s)",tmp, d->localpath);
 
+	onion_file_cache *cache=request->connection.listen_point->server->file_cache;
+	if (cache) // The stat and realpath, and later the file itself, from the cache
+		return onion_handler_export_local_cached(d, cache, tmp, request, response);
+	
 	// First check if it exists and so on. If it does not exist, no trying to escape message
 	struct stat reals;
 	int ok=stat(tmp,&reals);
@@ -78,7 +120,7 @@ int onion_handler_export_local_handler(onion_handler_export_local_data *d, onion
 		
 	const char *ret=realpath(tmp, realp);
 	if (!ret || strncmp(realp, d->localpath, strlen(d->localpath))!=0){ // out of secured dir.
-		ONION_WARNING("Trying to escape from secured dir (secured dir %s, trying %s).", d->localpath, realp);
+		ONION_WARNING_RATELIMITED("Trying to escape from secured dir (secured dir %s, trying %s).", d->localpath, realp);
 		return 0;
 	}
 
@@ -115,15 +157,8 @@ void onion_handler_export_local_footer_default(onion_response *res, const char *
 														"Under <a href=\"http://www.gnu.org/licenses/lgpl-3.0.html\">LGPL 3.0.</a> License.</h2>\n");
 }
 
-/**
- * @short Returns the directory listing
- */
-int onion_handler_export_local_directory(onion_handler_export_local_data *data, const char *realp, const char *showpath, onion_request *req, onion_response *res){
-	DIR *dir=opendir(realp);
-	if (!dir) // Continue on next. Quite probably a custom error.
-		return 0;
-	onion_response_set_header(res, "Content-Type", "text/html; charset=utf-8");
-	
+/// Writes the html listing page, with the files array already rendered.
+static void onion_handler_export_local_page(onion_handler_export_local_data *data, onion_block *files, const char *showpath, onion_response *res){
 	onion_response_write0(res,"<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML 1.0 Transitional//EN\" \"http://www.w3.org/TR/xhtml1/DTD/xhtml1-transitional.dtd\">\n"
 														"<html>\n"
 														" <head><meta content=\"text/html; charset=UTF-8\" http-equiv=\"content-type\"/>\n");
@@ -163,23 +198,7 @@ int onion_handler_export_local_directory(onion_handler_export_local_data *data,
 "\n"
 "files=[\n");
 	
-	struct dirent *fi;
-	struct stat    st;
-	char temp[1024];
-	struct passwd  *pwd;
-	while ( (fi=readdir(dir)) != NULL ){
-		if (fi->d_name[0]=='.')
-			continue;
-		snprintf(temp,sizeof(temp),"%s/%s",realp,fi->d_name);
-		stat(temp, &st);
-		pwd=getpwuid(st.st_uid);
-		
-		if (S_ISDIR(st.st_mode))
-			onion_response_printf(res, "  ['%s/',%d,'%s','dir'],\n",fi->d_name, st.st_size, pwd ? pwd->pw_name : "???");
-		else
-			onion_response_printf(res, "  ['%s',%d,'%s','file'],\n",fi->d_name, st.st_size, pwd ? pwd->pw_name : "???");
-	}
-
+	onion_response_write(res, onion_block_data(files), onion_block_size(files));
 	onion_response_write0(res,"  [] ]\n</script>\n");
 
 	
@@ -199,15 +218,476 @@ int onion_handler_export_local_directory(onion_handler_export_local_data *data,
 		data->renderer_footer(res, showpath);
 
 	onion_response_write0(res,"</body></html>");
+}
 
-	closedir(dir);
-	
+/// Size and owner of a file at a listing.
+typedef struct onion_export_local_file_t{
+	long long size;
+	uid_t uid;
+	int is_dir;
+}onion_export_local_file;
+
+/// A rendered listing. Answers hold a reference, so it can be replaced meanwhile.
+typedef struct onion_export_local_listing_t{
+	onion_block *files; ///< The files array of the html page
+	onion_block *json;
+	char etag[48];
+	int refcount;
+}onion_export_local_listing;
+
+/// A directory listed, with its files by name.
+typedef struct onion_export_local_dir_t{
+	char *path;
+	int wd;            ///< The inotify watch, or -1 if checked by mtime
+	char key[16];      ///< The wd as string, its key at dirs_by_wd
+	struct timespec mtime;
+	onion_dict *files; ///< onion_export_local_file by name, without the hidden ones
+	onion_dict *pending; ///< Names changed since read, to stat again
+	int rescan;        ///< All must be read again
+	onion_export_local_listing *listing; ///< NULL if files changed since rendered
+	size_t memory;
+	struct onion_export_local_dir_t *lru_prev; ///< Most recently used first
+	struct onion_export_local_dir_t *lru_next;
+}onion_export_local_dir;
+
+/**
+ * @short Cache of directory listings.
+ * 
+ * Each directory keeps its files, with sizes and owners, and the rendered listing. On Linux an inotify
+ * watch tells which names changed, and only those are stat'ed again, so big directories are not read
+ * again on each change. Elsewhere the directory is read again when its mtime changes.
+ */
+struct onion_export_local_cache_t{
+	size_t max_memory;
+	size_t memory;
+	onion_dict *dirs;        ///< By path
+	onion_dict *dirs_by_wd;
+	onion_dict *owners;      ///< User names by uid, so getpwuid is not called per file
+	onion_export_local_dir *lru_first;
+	onion_export_local_dir *lru_last;
+	int inotify;
+	unsigned long generation; ///< For the ETags
+	long started;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+};
+
+/// Approximate memory of a file at the dicts.
+#define ONION_EXPORT_LOCAL_FILE_MEMORY (sizeof(onion_export_local_file)+64)
+
+static void onion_export_local_cache_lock(onion_export_local_cache *cache){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&cache->mutex);
+#endif
+}
+
+static void onion_export_local_cache_unlock(onion_export_local_cache *cache){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&cache->mutex);
+#endif
+}
+
+/// The user name of uid, from owners, or looked up and added there.
+static const char *onion_export_local_owner(onion_dict *owners, uid_t uid){
+	char key[24];
+	snprintf(key, sizeof(key), "%u", (unsigned int)uid);
+	const char *name=onion_dict_get(owners, key);
+	if (!name){
+		struct passwd pwd, *result=NULL;
+		char buffer[1024];
+		getpwuid_r(uid, &pwd, buffer, sizeof(buffer), &result);
+		onion_dict_add(owners, key, result ? result->pw_name : "???", OD_DUP_ALL);
+		name=onion_dict_get(owners, key);
+	}
+	return name;
+}
+
+/// Stats name at the directory, and sets it at files, or removes it if gone.
+static void onion_export_local_dir_stat(onion_export_local_dir *dir, const char *name){
+	char temp[PATH_MAX];
+	struct stat st;
+	snprintf(temp, sizeof(temp), "%s/%s", dir->path, name);
+	if (stat(temp, &st)<0){
+		if (onion_dict_get(dir->files, name) && onion_dict_remove(dir->files, name))
+			dir->memory-=ONION_EXPORT_LOCAL_FILE_MEMORY+strlen(name);
+		return;
+	}
+	onion_export_local_file *f=(onion_export_local_file*)onion_dict_get(dir->files, name);
+	if (!f){
+		f=malloc(sizeof(onion_export_local_file));
+		onion_dict_add(dir->files, name, f, OD_DUP_KEY|OD_FREE_VALUE);
+		dir->memory+=ONION_EXPORT_LOCAL_FILE_MEMORY+strlen(name);
+	}
+	f->size=st.st_size;
+	f->uid=st.st_uid;
+	f->is_dir=S_ISDIR(st.st_mode);
+}
+
+/// Reads all the files at the directory. Returns <0 if it can not be opened.
+static int onion_export_local_dir_scan(onion_export_local_dir *dir){
+	DIR *d=opendir(dir->path);
+	if (!d)
+		return -1;
+	if (dir->files)
+		onion_dict_free(dir->files);
+	dir->files=onion_dict_new();
+	onion_dict_set_flags(dir->files, OD_HASH|OD_SORTED);
+	dir->memory=0;
+	struct dirent *fi;
+	while ( (fi=readdir(d)) != NULL ){
+		if (fi->d_name[0]=='.')
+			continue;
+		onion_export_local_dir_stat(dir, fi->d_name);
+	}
+	closedir(d);
+	if (dir->pending)
+		onion_dict_free(dir->pending);
+	dir->pending=NULL;
+	dir->rescan=0;
+	return 0;
+}
+
+/// Writes str as a json string. < is escaped too, as it goes inside a <script>.
+static void onion_export_local_json_string(onion_block *block, const char *str){
+	const unsigned char *p=(const unsigned char*)str;
+	onion_block_add_char(block, '"');
+	for (;*p;p++){
+		if (*p=='"' || *p=='\\'){
+			onion_block_add_char(block, '\\');
+			onion_block_add_char(block, *p);
+		}
+		else if (*p<0x20 || *p=='<'){
+			char esc[8];
+			snprintf(esc, sizeof(esc), "\\u%04x", *p);
+			onion_block_add_str(block, esc);
+		}
+		else
+			onion_block_add_char(block, *p);
+	}
+	onion_block_add_char(block, '"');
+}
+
+typedef struct{
+	onion_export_local_listing *listing;
+	onion_dict *owners;
+	int first;
+}onion_export_local_render_state;
+
+static void onion_export_local_render_file(onion_export_local_render_state *st, const char *name, const onion_export_local_file *f, int flags){
+	const char *owner=onion_export_local_owner(st->owners, f->uid);
+	char num[32];
+	snprintf(num, sizeof(num), ",%lld,", f->size);
+	onion_block *b=st->listing->files;
+	onion_block_add_str(b, "  [");
+	if (f->is_dir){
+		char *dirname=malloc(strlen(name)+2);
+		sprintf(dirname, "%s/", name);
+		onion_export_local_json_string(b, dirname);
+		free(dirname);
+	}
+	else
+		onion_export_local_json_string(b, name);
+	onion_block_add_str(b, num);
+	onion_export_local_json_string(b, owner);
+	onion_block_add_str(b, f->is_dir ? ",\"dir\"],\n" : ",\"file\"],\n");
+
+	b=st->listing->json;
+	onion_block_add_str(b, st->first ? "[{\"name\":" : ",{\"name\":");
+	st->first=0;
+	onion_export_local_json_string(b, name);
+	snprintf(num, sizeof(num), ",\"size\":%lld", f->size);
+	onion_block_add_str(b, num);
+	onion_block_add_str(b, ",\"owner\":");
+	onion_export_local_json_string(b, owner);
+	onion_block_add_str(b, f->is_dir ? ",\"dir\":true}" : ",\"dir\":false}");
+}
+
+/// Renders the files as the html files array and as json.
+static onion_export_local_listing *onion_export_local_render(onion_dict *files, onion_dict *owners){
+	onion_export_local_render_state st;
+	st.listing=calloc(1, sizeof(onion_export_local_listing));
+	st.listing->files=onion_block_new();
+	st.listing->json=onion_block_new();
+	st.listing->refcount=1;
+	st.owners=owners;
+	st.first=1;
+	onion_dict_preorder(files, onion_export_local_render_file, &st);
+	onion_block_add_str(st.listing->json, st.first ? "[]" : "]");
+	return st.listing;
+}
+
+static void onion_export_local_listing_unref(onion_export_local_listing *l){
+	if (--l->refcount>0)
+		return;
+	onion_block_free(l->files);
+	onion_block_free(l->json);
+	free(l);
+}
+
+static size_t onion_export_local_dir_memory(onion_export_local_dir *dir){
+	size_t memory=dir->memory+sizeof(onion_export_local_dir)+strlen(dir->path);
+	if (dir->listing)
+		memory+=onion_block_size(dir->listing->files)+onion_block_size(dir->listing->json);
+	return memory;
+}
+
+/// The files changed, so the listing must be rendered again.
+static void onion_export_local_dir_touch(onion_export_local_cache *cache, onion_export_local_dir *dir){
+	if (dir->listing){
+		cache->memory-=onion_block_size(dir->listing->files)+onion_block_size(dir->listing->json);
+		onion_export_local_listing_unref(dir->listing);
+		dir->listing=NULL;
+	}
+}
+
+static void onion_export_local_lru_remove(onion_export_local_cache *cache, onion_export_local_dir *dir){
+	if (dir->lru_prev)
+		dir->lru_prev->lru_next=dir->lru_next;
+	else
+		cache->lru_first=dir->lru_next;
+	if (dir->lru_next)
+		dir->lru_next->lru_prev=dir->lru_prev;
+	else
+		cache->lru_last=dir->lru_prev;
+	dir->lru_prev=dir->lru_next=NULL;
+}
+
+static void onion_export_local_lru_push(onion_export_local_cache *cache, onion_export_local_dir *dir){
+	dir->lru_prev=NULL;
+	dir->lru_next=cache->lru_first;
+	if (cache->lru_first)
+		cache->lru_first->lru_prev=dir;
+	else
+		cache->lru_last=dir;
+	cache->lru_first=dir;
+}
+
+/// Forgets the directory, and its watch. ignored if the watch is already gone.
+static void onion_export_local_dir_remove(onion_export_local_cache *cache, onion_export_local_dir *dir, int ignored){
+	onion_export_local_lru_remove(cache, dir);
+	onion_dict_remove(cache->dirs, dir->path);
+	cache->memory-=onion_export_local_dir_memory(dir);
+	if (dir->wd>=0){
+		onion_dict_remove(cache->dirs_by_wd, dir->key);
+#ifdef __linux__
+		if (!ignored)
+			inotify_rm_watch(cache->inotify, dir->wd);
+#endif
+	}
+	if (dir->listing)
+		onion_export_local_listing_unref(dir->listing);
+	if (dir->files)
+		onion_dict_free(dir->files);
+	if (dir->pending)
+		onion_dict_free(dir->pending);
+	free(dir->path);
+	free(dir);
+}
+
+/// Reads the pending inotify events, and notes the changed names. Must have the lock.
+static void onion_export_local_cache_drain(onion_export_local_cache *cache){
+#ifdef __linux__
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+	while ( (n=read(cache->inotify, buffer, sizeof(buffer)))>0 ){
+		char *p=buffer;
+		while (p<buffer+n){
+			const struct inotify_event *ev=(const struct inotify_event*)p;
+			p+=sizeof(struct inotify_event)+ev->len;
+			if (ev->mask&IN_Q_OVERFLOW){ // Lost some, so all must be read again
+				ONION_WARNING("Too many changes at the exported directories to follow them, reading them again");
+				onion_export_local_dir *dir;
+				for (dir=cache->lru_first;dir;dir=dir->lru_next){
+					dir->rescan=1;
+					onion_export_local_dir_touch(cache, dir);
+				}
+				continue;
+			}
+			char key[16];
+			snprintf(key, sizeof(key), "%d", ev->wd);
+			onion_export_local_dir *dir=(onion_export_local_dir*)onion_dict_get(cache->dirs_by_wd, key);
+			if (!dir)
+				continue;
+			if (ev->mask&(IN_IGNORED|IN_DELETE_SELF|IN_MOVE_SELF)){
+				onion_export_local_dir_remove(cache, dir, ev->mask&IN_IGNORED);
+				continue;
+			}
+			onion_export_local_dir_touch(cache, dir);
+			if (!ev->len || dir->rescan || ev->name[0]=='.')
+				continue;
+			if (!dir->pending)
+				dir->pending=onion_dict_new();
+			onion_dict_add(dir->pending, ev->name, "", OD_DUP_KEY|OD_REPLACE);
+		}
+	}
+#endif
+}
+
+static void onion_export_local_dir_stat_pending(onion_export_local_dir *dir, const char *name, const void *_, int flags){
+	onion_export_local_dir_stat(dir, name);
+}
+
+/**
+ * @short Gets the listing of the directory at path, that must be released, or NULL if it can not be read.
+ * 
+ * Brings it up to date first: only the changed names if watched, all if new or its mtime changed.
+ */
+static onion_export_local_listing *onion_export_local_cache_get(onion_export_local_cache *cache, const char *path){
+	onion_export_local_cache_lock(cache);
+	onion_export_local_cache_drain(cache);
+	onion_export_local_dir *dir=(onion_export_local_dir*)onion_dict_get(cache->dirs, path);
+	struct stat st;
+	if (!dir){
+		dir=calloc(1, sizeof(onion_export_local_dir));
+		dir->path=strdup(path);
+		dir->wd=-1;
+		dir->rescan=1;
+#ifdef __linux__
+		if (cache->inotify>=0) // Before reading it, not to lose changes
+			dir->wd=inotify_add_watch(cache->inotify, path, IN_CREATE|IN_DELETE|IN_MODIFY|IN_ATTRIB|IN_MOVED_FROM|IN_MOVED_TO|
+																								IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR);
+#endif
+		if (dir->wd>=0){
+			snprintf(dir->key, sizeof(dir->key), "%d", dir->wd);
+			if (onion_dict_get(cache->dirs_by_wd, dir->key)){ // Same directory by another path, check this one by mtime.
+				dir->wd=-1;
+			}
+			else
+				onion_dict_add(cache->dirs_by_wd, dir->key, dir, 0);
+		}
+		onion_dict_add(cache->dirs, dir->path, dir, 0);
+		onion_export_local_lru_push(cache, dir);
+		cache->memory+=onion_export_local_dir_memory(dir);
+	}
+	else{
+		onion_export_local_lru_remove(cache, dir);
+		onion_export_local_lru_push(cache, dir);
+	}
+	if (dir->wd<0){
+		if (stat(path, &st)==0 && (st.st_mtim.tv_sec!=dir->mtime.tv_sec || st.st_mtim.tv_nsec!=dir->mtime.tv_nsec)){
+			dir->mtime=st.st_mtim;
+			dir->rescan=1;
+			onion_export_local_dir_touch(cache, dir);
+		}
+	}
+
+	cache->memory-=onion_export_local_dir_memory(dir);
+	if (dir->rescan){
+		if (onion_export_local_dir_scan(dir)<0){
+			cache->memory+=onion_export_local_dir_memory(dir);
+			onion_export_local_dir_remove(cache, dir, 0);
+			onion_export_local_cache_unlock(cache);
+			return NULL;
+		}
+	}
+	else if (dir->pending){
+		onion_dict_preorder(dir->pending, onion_export_local_dir_stat_pending, dir);
+		onion_dict_free(dir->pending);
+		dir->pending=NULL;
+	}
+	if (!dir->listing){
+		dir->listing=onion_export_local_render(dir->files, cache->owners);
+		snprintf(dir->listing->etag, sizeof(dir->listing->etag), "\"%lx-%lx\"", cache->started, ++cache->generation);
+	}
+	cache->memory+=onion_export_local_dir_memory(dir);
+
+	onion_export_local_listing *listing=dir->listing;
+	listing->refcount++;
+	while (cache->memory>cache->max_memory && cache->lru_last!=dir)
+		onion_export_local_dir_remove(cache, cache->lru_last, 0);
+	onion_export_local_cache_unlock(cache);
+	return listing;
+}
+
+static void onion_export_local_cache_release(onion_export_local_cache *cache, onion_export_local_listing *listing){
+	onion_export_local_cache_lock(cache);
+	onion_export_local_listing_unref(listing);
+	onion_export_local_cache_unlock(cache);
+}
+
+static void onion_export_local_cache_free(onion_export_local_cache *cache){
+	while (cache->lru_first)
+		onion_export_local_dir_remove(cache, cache->lru_first, 0);
+	onion_dict_free(cache->dirs);
+	onion_dict_free(cache->dirs_by_wd);
+	onion_dict_free(cache->owners);
+	if (cache->inotify>=0)
+		close(cache->inotify);
+#ifdef HAVE_PTHREADS
+	pthread_mutex_destroy(&cache->mutex);
+#endif
+	free(cache);
+}
+
+/// Reads and renders the directory, for a single answer.
+static onion_export_local_listing *onion_export_local_listing_new(const char *path){
+	onion_export_local_dir dir;
+	memset(&dir, 0, sizeof(dir));
+	dir.path=(char*)path;
+	if (onion_export_local_dir_scan(&dir)<0)
+		return NULL;
+	onion_dict *owners=onion_dict_new();
+	onion_export_local_listing *listing=onion_export_local_render(dir.files, owners);
+	onion_dict_free(owners);
+	onion_dict_free(dir.files);
+	return listing;
+}
+
+/**
+ * @short Returns the directory listing
+ * 
+ * It is an html page, or json if the client accepts application/json: an array of objects with
+ * name, size, owner and whether it is a dir.
+ */
+int onion_handler_export_local_directory(onion_handler_export_local_data *data, const char *realp, const char *showpath, onion_request *req, onion_response *res){
+	onion_export_local_listing *listing;
+	if (data->cache)
+		listing=onion_export_local_cache_get(data->cache, realp);
+	else
+		listing=onion_export_local_listing_new(realp);
+	if (!listing) // Continue on next. Quite probably a custom error.
+		return 0;
+
+	const char *accept=onion_request_get_header(req, "Accept");
+	int json=accept && strstr(accept, "application/json");
+	onion_response_set_header(res, "Vary", "Accept");
+	if (data->cache){
+		char etag[sizeof(listing->etag)+8];
+		snprintf(etag, sizeof(etag), "%.*s%s\"", (int)strlen(listing->etag)-1, listing->etag, json ? "-j" : "");
+		onion_response_set_header(res, "ETag", etag);
+		const char *prev_etag=onion_request_get_header_id(req, ONION_H_IF_NONE_MATCH);
+		if (prev_etag && strstr(prev_etag, etag)){
+			onion_export_local_cache_release(data->cache, listing);
+			onion_response_set_length(res, 0);
+			onion_response_set_code(res, HTTP_NOT_MODIFIED);
+			onion_response_write_headers(res);
+			return OCS_PROCESSED;
+		}
+	}
+
+	if (json){
+		onion_response_set_header(res, "Content-Type", "application/json");
+		onion_response_set_length(res, onion_block_size(listing->json));
+		onion_response_write(res, onion_block_data(listing->json), onion_block_size(listing->json));
+	}
+	else{
+		onion_response_set_header(res, "Content-Type", "text/html; charset=utf-8");
+		onion_handler_export_local_page(data, listing->files, showpath, res);
+	}
+
+	if (data->cache)
+		onion_export_local_cache_release(data->cache, listing);
+	else
+		onion_export_local_listing_unref(listing);
 	return OCS_PROCESSED;
 }
 
 /// Frees local data from the directory handler
 void onion_handler_export_local_delete(void *data){
 	onion_handler_export_local_data *d=data;
+	if (d->cache)
+		onion_export_local_cache_free(d->cache);
 	free(d->localpath);
 	free(d);
 }
@@ -224,6 +704,45 @@ void onion_handler_export_local_set_footer(onion_handler *handler, void (*render
 	d->renderer_footer=renderer;
 }
 
+/**
+ * @short Keeps the directory listings, up to max_memory bytes, and answers them with an ETag.
+ * 
+ * Each directory is read once, and then kept up to date with the changes: on Linux only the changed
+ * names are looked at again, elsewhere all the directory is read again if its mtime changed. Owner
+ * names are looked up once per uid.
+ * 
+ * The header and footer renderers are still called on each answer, and should depend only on the
+ * directory name, as the ETag does not change with them.
+ * 
+ * @param max_memory Bytes to keep; 0 disables the cache.
+ */
+void onion_handler_export_local_set_listing_cache(onion_handler *handler, size_t max_memory){
+	onion_handler_export_local_data *d=onion_handler_get_private_data(handler);
+	if (d->cache){
+		onion_export_local_cache_free(d->cache);
+		d->cache=NULL;
+	}
+	if (!max_memory)
+		return;
+	onion_export_local_cache *cache=calloc(1, sizeof(onion_export_local_cache));
+	cache->max_memory=max_memory;
+	cache->dirs=onion_dict_new();
+	cache->dirs_by_wd=onion_dict_new();
+	cache->owners=onion_dict_new();
+	cache->started=time(NULL);
+#ifdef __linux__
+	cache->inotify=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (cache->inotify<0)
+		ONION_WARNING("Could not watch the exported directories (%s), listings are checked by mtime", strerror(errno));
+#else
+	cache->inotify=-1;
+#endif
+#ifdef HAVE_PTHREADS
+	pthread_mutex_init(&cache->mutex, NULL);
+#endif
+	d->cache=cache;
+}
+
 /**
  * @short Creates an local filesystem handler.
  * 
@@ -247,6 +766,7 @@ onion_handler *onion_handler_export_local_new(const char *localpath){
 	onion_handler_export_local_data *priv_data=malloc(sizeof(onion_handler_export_local_data));
 
 	priv_data->localpath=rp;
+	priv_data->cache=NULL;
 	priv_data->renderer_header=onion_handler_export_local_header_default;
 	priv_data->renderer_footer=onion_handler_export_local_footer_default;
 	
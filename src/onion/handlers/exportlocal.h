@@ -41,6 +41,8 @@ onion_handler *onion_handler_export_local_new(const char *localpath);
 void onion_handler_export_local_set_header(onion_handler *dir, void (*renderer)(onion_response *res, const char *dirname));
 /// Calls to render a footers before end.
 void onion_handler_export_local_set_footer(onion_handler *dir, void (*renderer)(onion_response *res, const char *dirname));
+/// Keeps the directory listings, up to max_memory bytes, updated as the directories change. 0 to disable.
+void onion_handler_export_local_set_listing_cache(onion_handler *dir, size_t max_memory);
 
 #ifdef __cplusplus
 }
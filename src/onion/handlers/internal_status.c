@@ -27,6 +27,8 @@
 #include <onion/dict.h>
 #include <onion/types.h>
 #include <onion/types_internal.h>
+#include <onion/sessions.h>
+#include <onion/url.h>
 
 static void header_write(onion_response *res, const char *key, const char *value, int flags){
   onion_response_printf(res,"<li><b>%s</b> = %s</li>",key,value);
@@ -40,6 +42,12 @@ static void session_write(onion_response *res, const char *key, onion_dict *valu
   onion_response_write0(res, "</ul></li>");
 }
 
+static void route_write(onion_response *res, const onion_url_route_stats *stats){
+  onion_response_printf(res,"<tr><td>%s</td><td>%lu</td><td>%lu</td><td>%lu</td><td>%lu</td><td>%lu</td></tr>",
+                        stats->route, stats->hits, stats->errors, onion_url_stats_percentile(stats, 50),
+                        onion_url_stats_percentile(stats, 99), onion_url_stats_percentile(stats, 100));
+}
+
 static onion_connection_status onion_internal_handler(void *_, onion_request *req, onion_response *res){
   onion_request_get_session_dict(req);
   onion_response_write_headers(res);
@@ -60,9 +68,14 @@ static onion_connection_status onion_internal_handler(void *_, onion_request *re
   
   // Sessions
   onion_response_write0(res,"<h1>Sessions and data</h1><ul>");
-  onion_dict_preorder( req->connection.listen_point->server->sessions->sessions, session_write, res);
+  onion_sessions_preorder( onion_get_sessions(req->connection.listen_point->server), session_write, res);
   onion_response_write0(res, "</ul>");
   
+  // Routes, if the root is an url with stats
+  onion_response_write0(res,"<h1>Routes</h1><table><tr><th>Route</th><th>Hits</th><th>Errors</th><th>p50 us</th><th>p99 us</th><th>Max us</th></tr>");
+  onion_url_stats((onion_url*)onion_get_root_handler(req->connection.listen_point->server), (void*)route_write, res);
+  onion_response_write0(res, "</table>");
+  
   onion_response_write0(res, "</body></html>");
   return OCS_PROCESSED;
 }
@@ -0,0 +1,250 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <onion/onion.h>
+#include <onion/handler.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/url.h>
+#include <onion/stats.h>
+#include <onion/access_log.h>
+#include <onion/types_internal.h>
+#ifdef HAVE_GNUTLS
+#include <onion/https.h>
+#endif
+
+#include "metrics.h"
+
+/// State of the calls of onion_url_stats, for a metric family at each pass.
+typedef struct{
+	onion_response *res;
+	int errors;  ///< This pass writes the errors, not the latencies.
+}onion_handler_metrics_routes;
+
+static void onion_handler_metrics_write(onion_response *res, const char *name, const char *type, const char *help, unsigned long value);
+static void onion_handler_metrics_route(onion_handler_metrics_routes *routes, const onion_url_route_stats *stats);
+static void onion_handler_metrics_label(char *out, size_t size, const char *value);
+static void onion_handler_metrics_phases(onion_response *res, const onion_stats *stats);
+static unsigned long onion_handler_metrics_bucket_max(int i);
+
+/// Writes all the metrics.
+static onion_connection_status onion_handler_metrics_handler(void *_, onion_request *req, onion_response *res){
+	onion *server=req->connection.listen_point->server;
+	onion_stats stats;
+	onion_get_stats(server, &stats);
+	
+	onion_response_set_header(res, "Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+	onion_response_set_header(res, "Cache-Control", "no-store");
+	onion_handler_metrics_write(res, "onion_connections", "gauge", "Open connections.", stats.connections);
+	onion_handler_metrics_write(res, "onion_connections_total", "counter", "Connections opened.", stats.connections_total);
+	onion_handler_metrics_write(res, "onion_accepted_total", "counter", "Connections accepted at the pollers.", stats.accepted);
+	onion_handler_metrics_write(res, "onion_accept_wakeups_total", "counter", "Times the listen sockets were ready.", stats.accept_wakeups);
+	onion_handler_metrics_write(res, "onion_poller_wakeups_total", "counter", "Wakeups of the pollers.", stats.poller_wakeups);
+	onion_handler_metrics_write(res, "onion_poller_events_total", "counter", "Events handled by the pollers.", stats.poller_events);
+	if (server->poller_profiling){
+		onion_response_printf(res, "# HELP onion_poller_wait_seconds_total Time the pollers waited for events.\n"
+		                      "# TYPE onion_poller_wait_seconds_total counter\nonion_poller_wait_seconds_total %g\n", stats.poller_wait_us/1e6);
+		onion_response_printf(res, "# HELP onion_poller_callback_seconds_total Time the pollers ran the callbacks of the events.\n"
+		                      "# TYPE onion_poller_callback_seconds_total counter\nonion_poller_callback_seconds_total %g\n", stats.poller_callbacks_us/1e6);
+		onion_handler_metrics_write(res, "onion_poller_stalls_total", "counter", "Callbacks that held a poller thread over the stall threshold.", stats.poller_stalls);
+	}
+	onion_handler_metrics_write(res, "onion_http_received_bytes_total", "counter", "Request bytes read.", stats.bytes_in);
+	onion_handler_metrics_write(res, "onion_http_sent_bytes_total", "counter", "Response body bytes sent.", stats.bytes_out);
+	
+	onion_response_write0(res, "# HELP onion_http_responses_total Responses by status code.\n# TYPE onion_http_responses_total counter\n");
+	int i;
+	for (i=0;i<ONION_STATS_CODES;i++){
+		if (!stats.responses[i])
+			continue;
+		if (i)
+			onion_response_printf(res, "onion_http_responses_total{code=\"%d\"} %lu\n", i, stats.responses[i]);
+		else
+			onion_response_printf(res, "onion_http_responses_total{code=\"other\"} %lu\n", stats.responses[i]);
+	}
+	
+	onion_handler_metrics_write(res, "onion_sessions", "gauge", "Sessions at the store.", stats.sessions);
+	if (server->admission){
+		onion_handler_metrics_write(res, "onion_connections_rejected_total", "counter", "Connections rejected over the connection limits.", stats.connections_rejected);
+		onion_handler_metrics_write(res, "onion_requests_rejected_total", "counter", "Requests rejected over the in flight limit.", stats.requests_rejected);
+		onion_handler_metrics_write(res, "onion_requests_shed_total", "counter", "Requests shed as they waited too long for their handler.", stats.requests_shed);
+		if (stats.memory_budget){
+			onion_handler_metrics_write(res, "onion_memory_budget_bytes", "gauge", "Memory budget of the library.", stats.memory_budget);
+			onion_handler_metrics_write(res, "onion_memory_sheds_total", "counter", "Times it was over the memory budget, and evicted sessions and caches.", stats.memory_sheds);
+		}
+	}
+	onion_response_write0(res, "# HELP onion_memory_bytes Memory allocated by the library, by subsystem.\n# TYPE onion_memory_bytes gauge\n");
+	for (i=0;i<ONION_MEMORY_TAGS;i++)
+		onion_response_printf(res, "onion_memory_bytes{subsystem=\"%s\"} %lu\n", onion_memory_tag_names[i], (unsigned long)stats.memory[i]);
+#ifdef HAVE_PTHREADS
+	if (server->nworkers){
+		onion_handler_metrics_write(res, "onion_workers", "gauge", "Worker threads running.", stats.workers);
+		onion_handler_metrics_write(res, "onion_workers_busy", "gauge", "Worker threads running a handler.", stats.workers_busy);
+		onion_handler_metrics_write(res, "onion_workers_queued", "gauge", "Requests waiting for a worker.", stats.workers_queued);
+		onion_handler_metrics_write(res, "onion_workers_max", "gauge", "Most worker threads at a time.", server->nworkers);
+		onion_handler_metrics_write(res, "onion_workers_peak", "gauge", "Most worker threads that ran at a time.", stats.workers_peak);
+		onion_handler_metrics_write(res, "onion_workers_started_total", "counter", "Worker threads started as all were busy.", stats.workers_started);
+		onion_handler_metrics_write(res, "onion_workers_retired_total", "counter", "Worker threads retired as idle.", stats.workers_retired);
+	}
+#endif
+	if (server->request_timings)
+		onion_handler_metrics_phases(res, &stats);
+	
+	if (server->access_log){
+		onion_access_log_stats log_stats;
+		onion_access_log_get_stats(server->access_log, &log_stats);
+		onion_handler_metrics_write(res, "onion_access_log_dropped_total", "counter", "Access log lines dropped, as the buffer was full.", log_stats.dropped);
+	}
+	
+#ifdef HAVE_GNUTLS
+	onion_https_stats tls, sum;
+	int https=0;
+	memset(&sum, 0, sizeof(sum));
+	onion_listen_point **lp;
+	for (lp=server->listen_points;lp && *lp;lp++){
+		if (onion_https_get_stats(*lp, &tls)==0){
+			sum.handshakes+=tls.handshakes;
+			sum.resumed+=tls.resumed;
+			https=1;
+		}
+	}
+	if (https){
+		onion_handler_metrics_write(res, "onion_tls_handshakes_total", "counter", "TLS handshakes.", sum.handshakes);
+		onion_handler_metrics_write(res, "onion_tls_resumed_total", "counter", "TLS handshakes that resumed a session.", sum.resumed);
+	}
+#endif
+	
+	// Routes, if the root is an url with stats
+	onion_url *url=(onion_url*)onion_get_root_handler(server);
+	onion_handler_metrics_routes routes={ res, 0 };
+	onion_response_write0(res, "# HELP onion_route_latency_seconds Handler time of each route.\n# TYPE onion_route_latency_seconds histogram\n");
+	onion_url_stats(url, (void*)onion_handler_metrics_route, &routes);
+	routes.errors=1;
+	onion_response_write0(res, "# HELP onion_route_errors_total Handler errors and 5xx responses of each route.\n# TYPE onion_route_errors_total counter\n");
+	onion_url_stats(url, (void*)onion_handler_metrics_route, &routes);
+	
+	return OCS_PROCESSED;
+}
+
+/// Writes a metric with no labels.
+static void onion_handler_metrics_write(onion_response *res, const char *name, const char *type, const char *help, unsigned long value){
+	onion_response_printf(res, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type, name, value);
+}
+
+/// Writes the latency histogram, or the errors, of a route.
+static void onion_handler_metrics_route(onion_handler_metrics_routes *routes, const onion_url_route_stats *stats){
+	char route[512];
+	onion_handler_metrics_label(route, sizeof(route), stats->route);
+	if (routes->errors){
+		onion_response_printf(routes->res, "onion_route_errors_total{route=\"%s\"} %lu\n", route, stats->errors);
+		return;
+	}
+	unsigned long count=0;
+	int i=0, b;
+	for (b=0;b<ONION_STATS_PHASE_BUCKETS-1;b++){
+		while (i<ONION_URL_STATS_BUCKETS && onion_handler_metrics_bucket_max(i)<=onion_stats_phase_bounds[b])
+			count+=stats->latency[i++];
+		onion_response_printf(routes->res, "onion_route_latency_seconds_bucket{route=\"%s\",le=\"%g\"} %lu\n", route, 
+		                      onion_stats_phase_bounds[b]/1e6, count);
+	}
+	for (;i<ONION_URL_STATS_BUCKETS;i++)
+		count+=stats->latency[i];
+	onion_response_printf(routes->res, "onion_route_latency_seconds_bucket{route=\"%s\",le=\"+Inf\"} %lu\n", route, count);
+	onion_response_printf(routes->res, "onion_route_latency_seconds_count{route=\"%s\"} %lu\n", route, count);
+}
+
+/// Writes the histograms of the phases of the requests.
+static void onion_handler_metrics_phases(onion_response *res, const onion_stats *stats){
+	onion_response_write0(res, "# HELP onion_request_phase_seconds Duration of each phase of the requests.\n# TYPE onion_request_phase_seconds histogram\n");
+	int p, b;
+	for (p=0;p<ONION_STATS_PHASES;p++){
+		const char *phase=onion_stats_phase_names[p];
+		unsigned long count=0;
+		for (b=0;b<ONION_STATS_PHASE_BUCKETS-1;b++){
+			count+=stats->phases[p][b];
+			onion_response_printf(res, "onion_request_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %lu\n", phase, 
+			                      onion_stats_phase_bounds[b]/1e6, count);
+		}
+		count+=stats->phases[p][b];
+		onion_response_printf(res, "onion_request_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n", phase, count);
+		onion_response_printf(res, "onion_request_phase_seconds_sum{phase=\"%s\"} %g\n", phase, stats->phases_us[p]/1e6);
+		onion_response_printf(res, "onion_request_phase_seconds_count{phase=\"%s\"} %lu\n", phase, count);
+	}
+}
+
+/// Copies the label value, escaping backslashes, quotes and new lines.
+static void onion_handler_metrics_label(char *out, size_t size, const char *value){
+	char *end=out+size-3;
+	for (;*value && out<end;value++){
+		if (*value=='\\' || *value=='"' || *value=='\n'){
+			*out++='\\';
+			*out++=(*value=='\n') ? 'n' : *value;
+		}
+		else
+			*out++=*value;
+	}
+	*out='\0';
+}
+
+/**
+ * @short Highest latency, in microseconds, counted at that bucket of the route stats.
+ * 
+ * Exact up to 7, then 8 buckets for each power of two, as onion_url does. The last has all the higher ones.
+ */
+static unsigned long onion_handler_metrics_bucket_max(int i){
+	if (i<8)
+		return i;
+	if (i>=ONION_URL_STATS_BUCKETS-1)
+		return ULONG_MAX;
+	int e=i/8+2;
+	return ((9UL+i%8)<<(e-3))-1;
+}
+
+/**
+ * @short Creates a handler that answers the counters of the server, at the Prometheus text format.
+ * 
+ * Add it at some path, as onion_url_add_handler(urls, "metrics", onion_handler_metrics()), for the
+ * monitoring to scrape. It answers:
+ * 
+ * - onion_connections, and the totals of connections opened, accepted, and listen socket wakeups.
+ * - The wakeups and events of the pollers; events/wakeups is the mean of events per wakeup. With
+ *   onion_set_poller_profiling also the time they wait, and run callbacks, and the stalls.
+ * - The responses by status code, and the bytes read and sent.
+ * - The sessions at the store, and the access log lines dropped, if there is an access log.
+ * - The memory of the library by subsystem, and the budget and times it was shed, if set.
+ * - The histograms of the phases of the requests, as tls, headers or handler, with onion_set_request_timings.
+ * - The TLS handshakes and resumptions of the HTTPS listen points.
+ * - The latency histogram and errors of each route, if the root handler is an onion_url with
+ *   onion_url_set_stats. The buckets are the ones near the bounds that the route stats allow.
+ * 
+ * All the counters are kept per thread, or per listen point or poller, and only added at each scrape.
+ * The rates, as accepts per second, are for the monitoring to compute.
+ */
+onion_handler *onion_handler_metrics(){
+	return onion_handler_new(onion_handler_metrics_handler, NULL, NULL);
+}
@@ -64,6 +64,10 @@ void onion_handler_path_delete(void *data){
 	free(data);
 }
 
+static void onion_handler_path_children(onion_handler_path_data *d, onion_handler_child_f f, void *data){
+	f(data, d->inside, NULL);
+}
+
 /**
  * @short Creates an path handler. If the path matches the regex, it reomves that from the regexp and goes to the inside_level.
  *
@@ -92,6 +96,7 @@ onion_handler *onion_handler_path(const char *path, onion_handler *inside_level)
 
 	onion_handler *ret=onion_handler_new((onion_handler_handler)onion_handler_path_handler,
 																			 priv_data, (onion_handler_private_data_free) onion_handler_path_delete);
+	onion_handler_set_children(ret, (onion_handler_children_f)onion_handler_path_children);
 	return ret;
 }
 
@@ -0,0 +1,1260 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* splice, pipe2 */
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <onion/handler.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/shortcuts.h>
+#include <onion/poller.h>
+#include <onion/block.h>
+#include <onion/dict.h>
+#include <onion/log.h>
+#include <onion/types_internal.h>
+
+#include "proxy.h"
+
+/// Bytes read from the upstream at a time. Also the maximum size of its response headers.
+#define ONION_HANDLER_PROXY_BUFFER_SIZE 16384
+/// Bodies of known length with at least this left are spliced to the client instead of copied.
+#define ONION_HANDLER_PROXY_SPLICE_MIN 16384
+/// Bytes moved through the pipe at a time.
+#define ONION_HANDLER_PROXY_SPLICE_SIZE 65536
+/// After a connection to an upstream fails, it gets no requests for this long.
+#define ONION_HANDLER_PROXY_FAIL_MS 10000
+/// While the client does not take more data, it is checked again this often.
+#define ONION_HANDLER_PROXY_CLIENT_WAIT_MS 5
+
+/// A server the requests are sent to, with its idle connections.
+typedef struct onion_handler_proxy_upstream_t{
+	char *host;
+	char *port;
+	struct addrinfo *addr;
+	int active;            ///< Requests in flight, for least connections.
+	int healthy;           ///< By the last health check, or 1 if not checked.
+	int64_t down_until;    ///< Monotonic ms until it gets requests again, after a failed connection.
+	pthread_mutex_t mutex; ///< For the idle connections.
+	int *idle;             ///< Idle connections, the most recently used last.
+	int64_t *idle_since;
+	int nidle;
+}onion_handler_proxy_upstream;
+
+struct onion_handler_proxy_data_t{
+	onion_handler_proxy_upstream **upstreams;
+	int count;
+	unsigned int next;      ///< Where to start looking for the least loaded, so ties go round robin.
+	int max_idle;
+	int idle_timeout_ms;
+	int timeout_ms;
+	char *health_path;
+	int health_interval_ms;
+	pid_t health_pid;       ///< Process where the health check thread runs; forked workers start their own.
+	pthread_t health_thread;
+	pthread_mutex_t health_mutex;
+	pthread_cond_t health_cond;
+	int health_stop;
+};
+
+typedef struct onion_handler_proxy_data_t onion_handler_proxy_data;
+
+/// Where a proxied request is.
+enum onion_handler_proxy_state_e{
+	PROXY_CONNECTING=0,
+	PROXY_SENDING=1,
+	PROXY_HEADERS=2,
+	PROXY_BODY=3,
+};
+
+/// How the body of the upstream response ends.
+enum onion_handler_proxy_body_e{
+	PROXY_BODY_NONE=0,
+	PROXY_BODY_LENGTH=1,
+	PROXY_BODY_CHUNKED=2,
+	PROXY_BODY_CLOSE=3,  ///< When the upstream closes the connection.
+};
+
+/// States of the chunked body decoding.
+enum onion_handler_proxy_chunk_e{
+	PROXY_CHUNK_SIZE=0,
+	PROXY_CHUNK_DATA=1,
+	PROXY_CHUNK_DATA_END=2,
+	PROXY_CHUNK_TRAILER=3,
+	PROXY_CHUNK_DONE=4,
+};
+
+/// How the exchange with the upstream ended.
+enum onion_handler_proxy_result_e{
+	PROXY_TIMEOUT=0,  ///< Until something else happens
+	PROXY_DONE=1,
+	PROXY_FAILED=2,
+	PROXY_RETRY=3,    ///< Nothing came, so it is sent again on another connection.
+};
+
+/// The step is done, see the result. Else it waits for O_POLL_READ or O_POLL_WRITE of the upstream, or for the client.
+#define PROXY_STEP_END 0
+#define PROXY_STEP_WAIT_CLIENT 8
+
+/// A request being proxied.
+typedef struct onion_handler_proxy_call_t{
+	onion_handler_proxy_data *proxy;
+	onion_handler_proxy_upstream *upstream;
+	onion_request *req;
+	onion_response *res;
+	onion_poller *poller;     ///< Where it waits, or NULL if the handler thread waits.
+	onion_poller_slot *slot;
+	int fd;                   ///< Connection to the upstream
+	char reused;              ///< The connection came from the pool
+	char keep;                ///< The connection may go back to the pool
+	char state;
+	char body;
+	char chunk;
+	char result;
+	int attempts;
+	int64_t client_wait;      ///< Monotonic ms since the client does not take more data, or 0.
+	onion_block *out;         ///< The request head, and its body unless it is a file.
+	size_t out_pos;
+	int file_fd;              ///< A PUT body, sent after out.
+	off_t file_pos;
+	off_t file_size;
+	int64_t left;             ///< Bytes left of the body, or of the current chunk.
+	char chunk_line[24];
+	int chunk_line_length;
+	int pipe[2];              ///< To splice the body, once needed.
+	size_t piped;             ///< Bytes at the pipe, still not sent to the client.
+	size_t received;          ///< Bytes received from the upstream.
+	size_t buffer_pos;
+	size_t buffer_length;
+	char buffer[ONION_HANDLER_PROXY_BUFFER_SIZE];
+}onion_handler_proxy_call;
+
+/// Request headers that are of the connection, or that the proxy sets itself.
+static const char *onion_handler_proxy_request_skip[]={
+	"Connection", "Keep-Alive", "Proxy-Authorization", "Proxy-Connection", "TE", "Trailer", "Transfer-Encoding",
+	"Upgrade", "Content-Length", "Expect", "Host", "X-Forwarded-For", ONION_REQUEST_TIMEOUT_HEADER, NULL
+};
+/// Response headers that are of the connection, or that onion writes itself.
+static const char *onion_handler_proxy_response_skip[]={
+	"Connection", "Keep-Alive", "Proxy-Authenticate", "Proxy-Connection", "TE", "Trailer", "Transfer-Encoding",
+	"Upgrade", "Content-Length", "Date", "Server", NULL
+};
+
+static int onion_handler_proxy_call_start(onion_handler_proxy_call *call);
+static int onion_handler_proxy_call_step(onion_handler_proxy_call *call);
+static onion_connection_status onion_handler_proxy_call_finish(onion_handler_proxy_call *call);
+
+static int64_t onion_handler_proxy_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+/// Whether the header key, of that length, is at the list.
+static int onion_handler_proxy_is_at(const char **names, const char *key, size_t length){
+	for (;*names;names++){
+		if (strlen(*names)==length && strncasecmp(*names, key, length)==0)
+			return 1;
+	}
+	return 0;
+}
+
+/// Whether the header value, of that length, has the token, as "close" at the Connection header.
+static int onion_handler_proxy_has_token(const char *value, size_t length, const char *token){
+	size_t l=strlen(token);
+	size_t i;
+	for (i=0;i+l<=length;i++){
+		if (strncasecmp(&value[i], token, l)==0)
+			return 1;
+	}
+	return 0;
+}
+
+/// Adds the string quoted for an URL, leaving as they are the alphanumeric chars and the ones at keep.
+static void onion_handler_proxy_add_quoted(onion_block *out, const char *str, const char *keep){
+	static const char hex[]="0123456789ABCDEF";
+	for (;*str;str++){
+		unsigned char c=*str;
+		if (isalnum(c) || strchr(keep, c))
+			onion_block_add_char(out, c);
+		else{
+			onion_block_add_char(out, '%');
+			onion_block_add_char(out, hex[c>>4]);
+			onion_block_add_char(out, hex[c&0x0F]);
+		}
+	}
+}
+
+/// @{ @name Upstreams, and their idle connections
+
+/// The upstream with less requests in flight of those that are up, or NULL if none.
+static onion_handler_proxy_upstream *onion_handler_proxy_choose(onion_handler_proxy_data *d){
+	int64_t now=onion_handler_proxy_now();
+	unsigned int start=__sync_fetch_and_add(&d->next, 1);
+	onion_handler_proxy_upstream *best=NULL;
+	int best_active=0;
+	int i;
+	for (i=0;i<d->count;i++){
+		onion_handler_proxy_upstream *u=d->upstreams[(start+i)%d->count];
+		if (!__atomic_load_n(&u->healthy, __ATOMIC_RELAXED) || __atomic_load_n(&u->down_until, __ATOMIC_RELAXED)>now)
+			continue;
+		int active=__atomic_load_n(&u->active, __ATOMIC_RELAXED);
+		if (!best || active<best_active){
+			best=u;
+			best_active=active;
+		}
+	}
+	return best;
+}
+
+/// Takes the most recently used idle connection that is still open, or -1 if none.
+static int onion_handler_proxy_pool_get(onion_handler_proxy_data *d, onion_handler_proxy_upstream *u){
+	int64_t now=onion_handler_proxy_now();
+	int fd=-1;
+	pthread_mutex_lock(&u->mutex);
+	while (u->nidle && fd<0){
+		u->nidle--;
+		fd=u->idle[u->nidle];
+		char c;
+		if (now-u->idle_since[u->nidle]>=d->idle_timeout_ms || recv(fd, &c, 1, MSG_PEEK|MSG_DONTWAIT)>=0 || 
+				(errno!=EAGAIN && errno!=EWOULDBLOCK)){ // Expired, closed by the upstream, or with unexpected data
+			close(fd);
+			fd=-1;
+		}
+	}
+	pthread_mutex_unlock(&u->mutex);
+	return fd;
+}
+
+/// Keeps the connection for later requests, or closes it if there are enough.
+static void onion_handler_proxy_pool_put(onion_handler_proxy_data *d, onion_handler_proxy_upstream *u, int fd){
+	pthread_mutex_lock(&u->mutex);
+	if (u->nidle<d->max_idle){
+		u->idle[u->nidle]=fd;
+		u->idle_since[u->nidle]=onion_handler_proxy_now();
+		u->nidle++;
+		fd=-1;
+	}
+	pthread_mutex_unlock(&u->mutex);
+	if (fd>=0)
+		close(fd);
+}
+
+/// Makes room for max_idle connections, closing the ones over it.
+static void onion_handler_proxy_pool_resize(onion_handler_proxy_upstream *u, int max_idle){
+	pthread_mutex_lock(&u->mutex);
+	while (u->nidle>max_idle)
+		close(u->idle[--u->nidle]);
+	u->idle=realloc(u->idle, sizeof(int)*(max_idle ? max_idle : 1));
+	u->idle_since=realloc(u->idle_since, sizeof(int64_t)*(max_idle ? max_idle : 1));
+	pthread_mutex_unlock(&u->mutex);
+}
+
+/// Starts a non blocking connection to the upstream, or returns -1.
+static int onion_handler_proxy_connect(onion_handler_proxy_upstream *u){
+	struct addrinfo *a=u->addr;
+	int fd=socket(a->ai_family, a->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC, a->ai_protocol);
+	if (fd<0)
+		return -1;
+	int one=1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(fd, a->ai_addr, a->ai_addrlen)<0 && errno!=EINPROGRESS){
+		int e=errno;
+		close(fd);
+		errno=e;
+		return -1;
+	}
+	return fd;
+}
+
+/// No requests for a while, as its connection failed.
+static void onion_handler_proxy_upstream_failed(onion_handler_proxy_upstream *u, int error){
+	ONION_WARNING("Could not connect to upstream %s:%s (%s). Not used for %d s.", u->host, u->port, strerror(error), ONION_HANDLER_PROXY_FAIL_MS/1000);
+	__atomic_store_n(&u->down_until, onion_handler_proxy_now()+ONION_HANDLER_PROXY_FAIL_MS, __ATOMIC_RELAXED);
+}
+
+/// @}
+
+/// @{ @name Health checks
+
+/// Whether a GET of the health path gets a 2xx or 3xx in time. Blocking.
+static int onion_handler_proxy_health_check(onion_handler_proxy_data *d, onion_handler_proxy_upstream *u){
+	struct addrinfo *a=u->addr;
+	int fd=socket(a->ai_family, a->ai_socktype|SOCK_CLOEXEC, a->ai_protocol);
+	if (fd<0)
+		return 0;
+	struct timeval tv;
+	tv.tv_sec=d->timeout_ms/1000;
+	tv.tv_usec=(d->timeout_ms%1000)*1000;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	int ok=0;
+	char buffer[256];
+	if (connect(fd, a->ai_addr, a->ai_addrlen)==0){
+		int l=snprintf(buffer, sizeof(buffer), "GET %s HTTP/1.1\r\nHost: %s:%s\r\nConnection: close\r\n\r\n", d->health_path, u->host, u->port);
+		if (l>0 && l<(int)sizeof(buffer) && send(fd, buffer, l, MSG_NOSIGNAL)==l){
+			ssize_t r, got=0;
+			while (got<12 && (r=recv(fd, &buffer[got], sizeof(buffer)-1-got, 0))>0)
+				got+=r;
+			buffer[got]='\0';
+			if (got>=12 && strncmp(buffer, "HTTP/1.", 7)==0){
+				int code=atoi(&buffer[9]);
+				ok=(code>=200 && code<400);
+			}
+		}
+	}
+	close(fd);
+	return ok;
+}
+
+/// Checks all the upstreams each interval, until stopped.
+static void *onion_handler_proxy_health_thread(void *_){
+	onion_handler_proxy_data *d=(onion_handler_proxy_data*)_;
+	pthread_mutex_lock(&d->health_mutex);
+	while (!d->health_stop){
+		pthread_mutex_unlock(&d->health_mutex);
+		int i;
+		for (i=0;i<d->count;i++){
+			onion_handler_proxy_upstream *u=d->upstreams[i];
+			int healthy=onion_handler_proxy_health_check(d, u);
+			if (healthy!=__atomic_exchange_n(&u->healthy, healthy, __ATOMIC_RELAXED)){
+				if (healthy)
+					ONION_INFO("Upstream %s:%s is up again", u->host, u->port);
+				else
+					ONION_WARNING("Upstream %s:%s failed its health check", u->host, u->port);
+			}
+		}
+		pthread_mutex_lock(&d->health_mutex);
+		int64_t next=onion_handler_proxy_now()+d->health_interval_ms;
+		while (!d->health_stop && onion_handler_proxy_now()<next){
+			struct timespec ts;
+			ts.tv_sec=next/1000;
+			ts.tv_nsec=(next%1000)*1000000;
+			pthread_cond_timedwait(&d->health_cond, &d->health_mutex, &ts);
+		}
+	}
+	pthread_mutex_unlock(&d->health_mutex);
+	return NULL;
+}
+
+/// Starts the health checks at this process, if not yet.
+static void onion_handler_proxy_health_start(onion_handler_proxy_data *d){
+	pid_t pid=d->health_pid, me=getpid();
+	if (pid==me || !__sync_bool_compare_and_swap(&d->health_pid, pid, me))
+		return;
+	if (pthread_create(&d->health_thread, NULL, onion_handler_proxy_health_thread, d)!=0){
+		ONION_ERROR("Could not start the upstream health check thread");
+		d->health_pid=0;
+	}
+}
+
+static void onion_handler_proxy_health_stop(onion_handler_proxy_data *d){
+	pthread_mutex_lock(&d->health_mutex);
+	d->health_stop=1;
+	pthread_cond_signal(&d->health_cond);
+	pthread_mutex_unlock(&d->health_mutex);
+	if (d->health_pid==getpid()){
+		pthread_join(d->health_thread, NULL);
+		d->health_pid=0;
+	}
+	d->health_stop=0;
+}
+
+/// @}
+
+/// @{ @name Requests
+
+/**
+ * @short Writes the request to send upstream: its head, and the body as it was read.
+ * 
+ * The path is quoted again, and the query is the raw one, or the one at the query dict if it was parsed. 
+ * Connection headers are removed, the client address is added to X-Forwarded-For, and the time left
+ * to the request deadline is at X-Request-Timeout.
+ * 
+ * @returns 0, or the HTTP code to answer if it can not be forwarded.
+ */
+static int onion_handler_proxy_call_request(onion_handler_proxy_call *call){
+	onion_request *req=call->req;
+	onion_block *out=call->out;
+	int method=req->flags&OR_METHODS;
+	if (req->flags&OR_POST_MULTIPART){
+		ONION_ERROR("Can not forward multipart bodies to upstream servers");
+		return HTTP_NOT_IMPLEMENTED;
+	}
+	
+	onion_block_add_str(out, onion_request_methods[method]);
+	onion_block_add_char(out, ' ');
+	onion_handler_proxy_add_quoted(out, onion_request_get_fullpath(req), "/-._~!$&'()*+,;=:@");
+	if (req->query){ // Still raw
+		onion_block_add_char(out, '?');
+		onion_block_add_str(out, req->query);
+	}
+	else if (req->GET){
+		onion_dict_iter it;
+		char sep='?';
+		if (onion_dict_iter_begin(req->GET, &it)) do{
+			onion_block_add_char(out, sep);
+			onion_handler_proxy_add_quoted(out, it.key, "-._~");
+			onion_block_add_char(out, '=');
+			onion_handler_proxy_add_quoted(out, it.value, "-._~");
+			sep='&';
+		}while(onion_dict_iter_next(&it));
+	}
+	onion_block_add_str(out, " HTTP/1.1\r\nHost: ");
+	const char *host=onion_request_get_header(req, "Host");
+	if (host)
+		onion_block_add_str(out, host);
+	else{
+		onion_block_add_str(out, call->proxy->upstreams[0]->host);
+		onion_block_add_char(out, ':');
+		onion_block_add_str(out, call->proxy->upstreams[0]->port);
+	}
+	onion_block_add_str(out, "\r\n");
+	
+	onion_dict_iter it;
+	if (onion_dict_iter_begin(onion_request_get_header_dict(req), &it)) do{
+		if (onion_handler_proxy_is_at(onion_handler_proxy_request_skip, it.key, strlen(it.key)))
+			continue;
+		onion_block_add_str(out, it.key);
+		onion_block_add_str(out, ": ");
+		onion_block_add_str(out, it.value);
+		onion_block_add_str(out, "\r\n");
+	}while(onion_dict_iter_next(&it));
+	const char *client=onion_request_get_client_description(req);
+	if (client){
+		const char *forwarded=onion_request_get_header(req, "X-Forwarded-For");
+		onion_block_add_str(out, "X-Forwarded-For: ");
+		if (forwarded){
+			onion_block_add_str(out, forwarded);
+			onion_block_add_str(out, ", ");
+		}
+		onion_block_add_str(out, client);
+		onion_block_add_str(out, "\r\n");
+	}
+	int remaining=onion_request_get_remaining_ms(req);
+	if (remaining>=0){ // The upstream can give up when the client does.
+		char timeout[48];
+		snprintf(timeout, sizeof(timeout), ONION_REQUEST_TIMEOUT_HEADER ": %d\r\n", remaining);
+		onion_block_add_str(out, timeout);
+	}
+	
+	char length[48];
+	const onion_block *data=onion_request_get_data(req);
+	const char *filename=(method==OR_PUT) ? onion_request_get_file(req, "filename") : NULL;
+	if (filename){
+		struct stat st;
+		call->file_fd=open(filename, O_RDONLY|O_CLOEXEC);
+		if (call->file_fd<0 || fstat(call->file_fd, &st)<0){
+			ONION_ERROR("Could not open the PUT body at %s: %s", filename, strerror(errno));
+			return HTTP_INTERNAL_ERROR;
+		}
+		call->file_size=st.st_size;
+		snprintf(length, sizeof(length), "Content-Length: %lld\r\n\r\n", (long long)call->file_size);
+		onion_block_add_str(out, length);
+	}
+	else if (data){
+		snprintf(length, sizeof(length), "Content-Length: %ld\r\n\r\n", (long)onion_block_size(data));
+		onion_block_add_str(out, length);
+		onion_block_add_data(out, onion_block_data(data), onion_block_size(data));
+	}
+	else if (req->POST){ // Parsed from url encoded, so encoded again
+		onion_block *body=onion_block_new();
+		onion_dict_iter it;
+		if (onion_dict_iter_begin(req->POST, &it)) do{
+			if (onion_block_size(body))
+				onion_block_add_char(body, '&');
+			onion_handler_proxy_add_quoted(body, it.key, "-._~");
+			onion_block_add_char(body, '=');
+			onion_handler_proxy_add_quoted(body, it.value, "-._~");
+		}while(onion_dict_iter_next(&it));
+		if (!onion_request_get_header(req, "Content-Type"))
+			onion_block_add_str(out, "Content-Type: application/x-www-form-urlencoded\r\n");
+		snprintf(length, sizeof(length), "Content-Length: %ld\r\n\r\n", (long)onion_block_size(body));
+		onion_block_add_str(out, length);
+		onion_block_add_block(out, body);
+		onion_block_free(body);
+	}
+	else if (method==OR_POST || method==OR_PUT || method==OR_PATCH)
+		onion_block_add_str(out, "Content-Length: 0\r\n\r\n");
+	else
+		onion_block_add_str(out, "\r\n");
+	return 0;
+}
+
+/**
+ * @short The connection to the upstream failed.
+ * 
+ * If nothing came back, it is sent again: on a failed connect, to another upstream; on a pooled connection 
+ * that the upstream had closed, on a new one, unless it is a POST or PATCH, which may have been processed.
+ */
+static int onion_handler_proxy_call_failed(onion_handler_proxy_call *call, int error){
+	int method=call->req->flags&OR_METHODS;
+	call->result=PROXY_FAILED;
+	if (call->received==0 && call->state==PROXY_CONNECTING){
+		onion_handler_proxy_upstream_failed(call->upstream, error);
+		call->result=PROXY_RETRY;
+	}
+	else if (call->received==0 && call->reused && call->state<PROXY_BODY && method!=OR_POST && method!=OR_PATCH)
+		call->result=PROXY_RETRY;
+	else
+		ONION_ERROR("Error with upstream %s:%s: %s", call->upstream->host, call->upstream->port, error ? strerror(error) : "closed");
+	return PROXY_STEP_END;
+}
+
+/// Sends the request. 0 when done, or what to wait for.
+static int onion_handler_proxy_call_send(onion_handler_proxy_call *call){
+	const char *data=onion_block_data(call->out);
+	size_t size=onion_block_size(call->out);
+	while (call->out_pos<size){
+		ssize_t w=send(call->fd, &data[call->out_pos], size-call->out_pos, MSG_NOSIGNAL);
+		if (w<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+			return O_POLL_WRITE;
+		if (w<0)
+			return onion_handler_proxy_call_failed(call, errno);
+		call->out_pos+=w;
+	}
+	while (call->file_pos<call->file_size){ // Through the buffer, which is not in use until the response.
+		ssize_t r=pread(call->file_fd, call->buffer, sizeof(call->buffer), call->file_pos);
+		if (r<=0){
+			ONION_ERROR("Could not read the PUT body (%s)", r<0 ? strerror(errno) : "file is shorter");
+			call->result=PROXY_FAILED;
+			return PROXY_STEP_END;
+		}
+		ssize_t w=send(call->fd, call->buffer, r, MSG_NOSIGNAL);
+		if (w<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+			return O_POLL_WRITE;
+		if (w<0)
+			return onion_handler_proxy_call_failed(call, errno);
+		call->file_pos+=w;
+	}
+	return 0;
+}
+
+/**
+ * @short Parses the response head at the buffer, and sets the response code, headers and length.
+ * 
+ * @returns 0 if done, 1 if it was an interim 1xx response, and the real one follows, or -1 if invalid.
+ */
+static int onion_handler_proxy_call_parse_head(onion_handler_proxy_call *call, const char *end){
+	const char *p=call->buffer;
+	if (end-p<12 || strncmp(p, "HTTP/1.", 7)!=0)
+		return -1;
+	int http11=(p[7]=='1');
+	int code=atoi(&p[9]);
+	if (code<100 || code>999)
+		return -1;
+	call->buffer_pos=end+4-call->buffer;
+	if (code<200){
+		memmove(call->buffer, &call->buffer[call->buffer_pos], call->buffer_length-call->buffer_pos);
+		call->buffer_length-=call->buffer_pos;
+		call->buffer_pos=0;
+		return 1;
+	}
+	
+	onion_block *headers=onion_block_new();
+	int keep=http11, chunked=0;
+	int64_t length=-1;
+	p=(const char*)memchr(p, '\n', end+2-p)+1;
+	while (p<end+2){
+		const char *eol=memchr(p, '\n', end+2-p);
+		const char *line_end=(eol>p && eol[-1]=='\r') ? eol-1 : eol;
+		const char *colon=memchr(p, ':', line_end-p);
+		if (colon){
+			size_t key_length=colon-p;
+			const char *value=colon+1;
+			while (value<line_end && (*value==' ' || *value=='\t'))
+				value++;
+			size_t value_length=line_end-value;
+			if (key_length==14 && strncasecmp(p, "Content-Length", 14)==0)
+				length=strtoll(value, NULL, 10);
+			else if (key_length==17 && strncasecmp(p, "Transfer-Encoding", 17)==0)
+				chunked=onion_handler_proxy_has_token(value, value_length, "chunked");
+			else if (key_length==10 && strncasecmp(p, "Connection", 10)==0){
+				if (onion_handler_proxy_has_token(value, value_length, "close"))
+					keep=0;
+				else if (onion_handler_proxy_has_token(value, value_length, "keep-alive"))
+					keep=1;
+			}
+			if (!onion_handler_proxy_is_at(onion_handler_proxy_response_skip, p, key_length)){
+				onion_block_add_data(headers, p, line_end-p);
+				onion_block_add_str(headers, "\r\n");
+			}
+		}
+		p=eol+1;
+	}
+	
+	onion_response *res=call->res;
+	onion_response_set_code(res, code);
+	onion_dict_remove(onion_response_get_headers(res), "Content-Type"); // The upstream one, if any, is at the block.
+	if (onion_block_size(headers)){ // At the request arena, as they may be written after this call is over.
+		char *block=onion_request_alloc(call->req, onion_block_size(headers));
+		memcpy(block, onion_block_data(headers), onion_block_size(headers));
+		onion_response_set_header_block(res, block, onion_block_size(headers));
+	}
+	onion_block_free(headers);
+	
+	int head=((call->req->flags&OR_METHODS)==OR_HEAD);
+	if (head || code==204 || code==304)
+		call->body=PROXY_BODY_NONE;
+	else if (chunked){
+		call->body=PROXY_BODY_CHUNKED;
+		call->chunk=PROXY_CHUNK_SIZE;
+		call->chunk_line_length=0;
+	}
+	else if (length>=0){
+		call->body=PROXY_BODY_LENGTH;
+		call->left=length;
+	}
+	else{
+		call->body=PROXY_BODY_CLOSE;
+		keep=0;
+	}
+	if (length>=0 && !chunked && code!=304)
+		onion_response_set_length(res, length);
+	else if (call->body==PROXY_BODY_NONE && !head)
+		onion_response_set_length(res, 0);
+	call->keep=keep;
+	return 0;
+}
+
+/// Reads the response head. 0 when done, or what to wait for.
+static int onion_handler_proxy_call_headers(onion_handler_proxy_call *call){
+	for(;;){
+		char *end=memmem(call->buffer, call->buffer_length, "\r\n\r\n", 4);
+		if (end){
+			int r=onion_handler_proxy_call_parse_head(call, end);
+			if (r==0)
+				return 0;
+			if (r>0)
+				continue;
+			ONION_ERROR("Invalid response from upstream %s:%s", call->upstream->host, call->upstream->port);
+			call->result=PROXY_FAILED;
+			return PROXY_STEP_END;
+		}
+		if (call->buffer_length==sizeof(call->buffer)){
+			ONION_ERROR("Response headers from upstream %s:%s too long", call->upstream->host, call->upstream->port);
+			call->result=PROXY_FAILED;
+			return PROXY_STEP_END;
+		}
+		ssize_t r=recv(call->fd, &call->buffer[call->buffer_length], sizeof(call->buffer)-call->buffer_length, 0);
+		if (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+			return O_POLL_READ;
+		if (r<=0)
+			return onion_handler_proxy_call_failed(call, r<0 ? errno : 0);
+		call->received+=r;
+		call->buffer_length+=r;
+	}
+}
+
+/// Decodes the chunked body, writing it to the response. Returns the bytes used, or -1 on error.
+static ssize_t onion_handler_proxy_call_chunked(onion_handler_proxy_call *call, const char *data, size_t length){
+	size_t pos=0;
+	while (pos<length && call->chunk!=PROXY_CHUNK_DONE){
+		if (call->chunk==PROXY_CHUNK_DATA){
+			size_t n=length-pos;
+			if ((int64_t)n>call->left)
+				n=call->left;
+			if (onion_response_write(call->res, &data[pos], n)<0)
+				return -1;
+			pos+=n;
+			call->left-=n;
+			if (!call->left)
+				call->chunk=PROXY_CHUNK_DATA_END;
+			continue;
+		}
+		char c=data[pos++]; // The rest are lines
+		if (c=='\r')
+			continue;
+		if (c!='\n'){
+			if (call->chunk_line_length<(int)sizeof(call->chunk_line)-1) // The rest of long ones are extensions, or trailers
+				call->chunk_line[call->chunk_line_length++]=c;
+			continue;
+		}
+		call->chunk_line[call->chunk_line_length]='\0';
+		if (call->chunk==PROXY_CHUNK_SIZE){
+			char *end;
+			call->left=strtoll(call->chunk_line, &end, 16);
+			if (end==call->chunk_line || call->left<0)
+				return -1;
+			call->chunk=call->left ? PROXY_CHUNK_DATA : PROXY_CHUNK_TRAILER;
+		}
+		else if (call->chunk==PROXY_CHUNK_DATA_END)
+			call->chunk=PROXY_CHUNK_SIZE;
+		else if (call->chunk_line_length==0) // Empty line after the trailers
+			call->chunk=PROXY_CHUNK_DONE;
+		call->chunk_line_length=0;
+	}
+	return pos;
+}
+
+/// Writes the body data to the response, up to its end. Returns the bytes used, or -1 on error.
+static ssize_t onion_handler_proxy_call_relay(onion_handler_proxy_call *call, const char *data, size_t length){
+	switch(call->body){
+		case PROXY_BODY_LENGTH:
+			if ((int64_t)length>call->left)
+				length=call->left;
+			call->left-=length;
+			break;
+		case PROXY_BODY_CHUNKED:
+			return onion_handler_proxy_call_chunked(call, data, length);
+		case PROXY_BODY_CLOSE:
+			break;
+		default:
+			return 0;
+	}
+	if (length && onion_response_write(call->res, data, length)<0)
+		return -1;
+	return length;
+}
+
+/**
+ * @short Sends to the client what it did not take yet: the queued output, and the pipe.
+ * 
+ * @returns 0 if all was sent, 1 if the client does not take more now, or -1 on error.
+ */
+static int onion_handler_proxy_call_flush(onion_handler_proxy_call *call){
+	onion_request *req=call->req;
+	if (onion_request_output_pending(req)){
+		int r=onion_request_output_flush(req);
+		if (r)
+			return r<0 ? -1 : 1;
+	}
+	while (call->piped){
+		ssize_t w=req->connection.listen_point->splice(req, call->pipe[0], call->piped);
+		if (w<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+			return 1;
+		if (w<=0)
+			return -1;
+		call->piped-=w;
+		call->res->sent_bytes+=w;
+		call->res->sent_bytes_total+=w;
+	}
+	return 0;
+}
+
+/// Whether the rest of the body can go through a pipe: known length, and nothing changes it on its way.
+static int onion_handler_proxy_call_can_splice(onion_handler_proxy_call *call){
+	onion_response *res=call->res;
+	if (call->body!=PROXY_BODY_LENGTH || call->left<ONION_HANDLER_PROXY_SPLICE_MIN || call->pipe[0]==-2)
+		return 0;
+	if (!call->req->connection.listen_point->splice || (call->req->flags&OR_HTTP2) || res->compress || res->capture || 
+			(res->flags&(OR_HEADER_SENT|OR_CHUNKED|OR_SKIP_CONTENT))!=OR_HEADER_SENT)
+		return 0;
+	if (call->pipe[0]==-1 && pipe2(call->pipe, O_NONBLOCK|O_CLOEXEC)<0){
+		call->pipe[0]=-2; // Copied then
+		return 0;
+	}
+	return 1;
+}
+
+/// Relays the response body. What to wait for, or PROXY_STEP_END when done.
+static int onion_handler_proxy_call_body(onion_handler_proxy_call *call){
+	onion_response *res=call->res;
+	for(;;){
+		int r=onion_handler_proxy_call_flush(call);
+		if (r<0){
+			call->result=PROXY_FAILED;
+			return PROXY_STEP_END;
+		}
+		if (r>0)
+			return PROXY_STEP_WAIT_CLIENT;
+		if (call->buffer_pos<call->buffer_length){ // Already read
+			ssize_t used=onion_handler_proxy_call_relay(call, &call->buffer[call->buffer_pos], call->buffer_length-call->buffer_pos);
+			if (used<0){
+				call->result=PROXY_FAILED;
+				return PROXY_STEP_END;
+			}
+			call->buffer_pos+=used;
+			if (call->buffer_pos<call->buffer_length){ // After the body; the connection is not clean.
+				call->keep=0;
+				call->buffer_pos=call->buffer_length;
+			}
+			continue;
+		}
+		if (call->body==PROXY_BODY_NONE || (call->body==PROXY_BODY_LENGTH && call->left==0) || 
+				(call->body==PROXY_BODY_CHUNKED && call->chunk==PROXY_CHUNK_DONE)){
+			call->result=PROXY_DONE;
+			return PROXY_STEP_END;
+		}
+		call->buffer_pos=call->buffer_length=0;
+		
+		ssize_t n;
+		if (onion_handler_proxy_call_can_splice(call)){
+			if (res->buffer_pos){ // Headers first
+				if (onion_response_flush(res)<0){
+					call->result=PROXY_FAILED;
+					return PROXY_STEP_END;
+				}
+				continue;
+			}
+			size_t l=call->left<ONION_HANDLER_PROXY_SPLICE_SIZE ? call->left : ONION_HANDLER_PROXY_SPLICE_SIZE;
+			n=splice(call->fd, NULL, call->pipe[1], NULL, l, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+			if (n>0){
+				call->piped+=n;
+				call->left-=n;
+				call->received+=n;
+				continue;
+			}
+		}
+		else{
+			size_t l=sizeof(call->buffer);
+			if (call->body==PROXY_BODY_LENGTH && call->left<(int64_t)l)
+				l=call->left;
+			n=recv(call->fd, call->buffer, l, 0);
+			if (n>0){
+				call->buffer_length=n;
+				call->received+=n;
+				continue;
+			}
+		}
+		if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+			return O_POLL_READ;
+		if (n==0 && call->body==PROXY_BODY_CLOSE){
+			call->result=PROXY_DONE;
+			return PROXY_STEP_END;
+		}
+		return onion_handler_proxy_call_failed(call, n<0 ? errno : 0);
+	}
+}
+
+/// Goes on as far as possible without waiting. Returns what to wait for, or PROXY_STEP_END with the result set.
+static int onion_handler_proxy_call_step(onion_handler_proxy_call *call){
+	int r;
+	switch(call->state){
+		case PROXY_CONNECTING:{
+			int error=0;
+			socklen_t l=sizeof(error);
+			if (getsockopt(call->fd, SOL_SOCKET, SO_ERROR, &error, &l)<0)
+				error=errno;
+			if (error)
+				return onion_handler_proxy_call_failed(call, error);
+			call->state=PROXY_SENDING;
+		}
+		// fallthrough
+		case PROXY_SENDING:
+			if ( (r=onion_handler_proxy_call_send(call)) || call->result!=PROXY_TIMEOUT)
+				return r;
+			call->state=PROXY_HEADERS;
+		// fallthrough
+		case PROXY_HEADERS:
+			if ( (r=onion_handler_proxy_call_headers(call)) || call->result!=PROXY_TIMEOUT)
+				return r;
+			call->state=PROXY_BODY;
+			if (onion_response_write_headers(call->res)==OR_SKIP_CONTENT)
+				call->body=PROXY_BODY_NONE;
+		// fallthrough
+		default:
+			return onion_handler_proxy_call_body(call);
+	}
+}
+
+/**
+ * @short The connection to the upstream is done with: back to the pool if clean, or closed.
+ * 
+ * @returns 1 if the request was sent again, on another connection.
+ */
+static int onion_handler_proxy_call_end(onion_handler_proxy_call *call){
+	onion_handler_proxy_upstream *u=call->upstream;
+	__sync_fetch_and_sub(&u->active, 1);
+	if (call->result==PROXY_DONE && call->keep)
+		onion_handler_proxy_pool_put(call->proxy, u, call->fd);
+	else
+		close(call->fd);
+	call->fd=-1;
+	call->slot=NULL;
+	if (call->result==PROXY_RETRY){
+		if (onion_handler_proxy_call_start(call)==0)
+			return 1;
+		call->result=PROXY_FAILED;
+	}
+	return 0;
+}
+
+/// @{ @name At the poller
+
+/// The upstream connection is ready.
+static int onion_handler_proxy_call_ready(onion_handler_proxy_call *call);
+
+/// Waits for the client to take more data. 0 if waiting, -1 if it took too long or the timer could not be set.
+static int onion_handler_proxy_call_client_wait(onion_handler_proxy_call *call);
+
+/// Checks again if the client takes more data.
+static void onion_handler_proxy_call_client_ready(onion_handler_proxy_call *call){
+	int r=onion_handler_proxy_call_step(call);
+	if (r==PROXY_STEP_WAIT_CLIENT && onion_handler_proxy_call_client_wait(call)==0)
+		return;
+	call->client_wait=0;
+	if (r==O_POLL_READ || r==O_POLL_WRITE){
+		onion_poller_slot_set_type(call->slot, r|O_POLL_OTHER);
+		onion_poller_slot_resume(call->slot);
+		return;
+	}
+	if (r==PROXY_STEP_WAIT_CLIENT){
+		ONION_WARNING("Client of proxied request too slow, closing it");
+		call->result=PROXY_FAILED;
+	}
+	onion_poller_remove(call->poller, call->fd); // And it ends at the shutdown
+}
+
+/// The proxy timeout, or the time left to the request deadline if less.
+static int onion_handler_proxy_call_timeout(onion_handler_proxy_call *call){
+	int remaining=onion_request_get_remaining_ms(call->req);
+	return (remaining>=0 && remaining<call->proxy->timeout_ms) ? remaining : call->proxy->timeout_ms;
+}
+
+static int onion_handler_proxy_call_client_wait(onion_handler_proxy_call *call){
+	int64_t now=onion_handler_proxy_now();
+	if (!call->client_wait)
+		call->client_wait=now;
+	else if (now-call->client_wait>call->proxy->timeout_ms)
+		return -1;
+	return onion_poller_add_timer(call->poller, ONION_HANDLER_PROXY_CLIENT_WAIT_MS, (void*)onion_handler_proxy_call_client_ready, call) ? -1 : 0;
+}
+
+static int onion_handler_proxy_call_ready(onion_handler_proxy_call *call){
+	int r=onion_handler_proxy_call_step(call);
+	if (r==O_POLL_READ || r==O_POLL_WRITE){
+		onion_poller_slot_set_type(call->slot, r|O_POLL_OTHER);
+		return 0;
+	}
+	if (r==PROXY_STEP_WAIT_CLIENT){
+		if (onion_handler_proxy_call_client_wait(call)==0)
+			return OCS_YIELD; // Resumed by the timer
+		call->result=PROXY_FAILED;
+	}
+	return -1; // Ends at the shutdown
+}
+
+/// The slot is removed: done, failed, or timed out if the result was not set.
+static void onion_handler_proxy_call_shutdown(onion_handler_proxy_call *call){
+	if (onion_handler_proxy_call_end(call))
+		return;
+	onion_handler_proxy_call_finish(call);
+}
+
+/// @}
+
+/**
+ * @short Sends the request to the least loaded upstream, on an idle connection or a new one.
+ * 
+ * At a poller the connection gets a slot, and all goes on there.
+ * 
+ * @returns 0 if on its way, -1 if no upstream can take it.
+ */
+static int onion_handler_proxy_call_start(onion_handler_proxy_call *call){
+	onion_handler_proxy_data *d=call->proxy;
+	while (call->attempts++<=d->count){
+		onion_handler_proxy_upstream *u=onion_handler_proxy_choose(d);
+		if (!u)
+			break;
+		call->state=PROXY_SENDING;
+		call->fd=onion_handler_proxy_pool_get(d, u);
+		call->reused=(call->fd>=0);
+		if (call->fd<0){
+			call->state=PROXY_CONNECTING;
+			call->fd=onion_handler_proxy_connect(u);
+			if (call->fd<0){
+				onion_handler_proxy_upstream_failed(u, errno);
+				continue;
+			}
+		}
+		__sync_fetch_and_add(&u->active, 1);
+		call->upstream=u;
+		call->result=PROXY_TIMEOUT;
+		call->keep=0;
+		call->out_pos=0;
+		call->file_pos=0;
+		call->received=0;
+		call->buffer_pos=call->buffer_length=0;
+		if (call->poller){
+			call->slot=onion_poller_slot_new(call->fd, (void*)onion_handler_proxy_call_ready, call);
+			onion_poller_slot_set_shutdown(call->slot, (void*)onion_handler_proxy_call_shutdown, call);
+			onion_poller_slot_set_timeout(call->slot, onion_handler_proxy_call_timeout(call));
+			onion_poller_slot_set_type(call->slot, O_POLL_WRITE|O_POLL_OTHER);
+			onion_poller_add(call->poller, call->slot); // From now on, it may be at other thread.
+		}
+		return 0;
+	}
+	ONION_ERROR("No upstream available for %s", call->req->fullpath);
+	return -1;
+}
+
+/// Steps at this thread, waiting for the upstream or the client with poll.
+static onion_connection_status onion_handler_proxy_call_wait(onion_handler_proxy_call *call){
+	do{
+		int r;
+		while ( (r=onion_handler_proxy_call_step(call))!=PROXY_STEP_END ){
+			struct pollfd pfd;
+			pfd.fd=(r==PROXY_STEP_WAIT_CLIENT) ? call->req->connection.fd : call->fd;
+			pfd.events=(r==O_POLL_READ) ? POLLIN : POLLOUT;
+			int p=poll(&pfd, 1, onion_handler_proxy_call_timeout(call));
+			if (p==0)
+				break; // Timed out
+			if (p<0 && errno!=EINTR){
+				call->result=PROXY_FAILED;
+				break;
+			}
+		}
+	}while (onion_handler_proxy_call_end(call));
+	return onion_handler_proxy_call_finish(call);
+}
+
+static void onion_handler_proxy_call_free(onion_handler_proxy_call *call){
+	if (call->pipe[0]>=0){
+		close(call->pipe[0]);
+		close(call->pipe[1]);
+	}
+	if (call->file_fd>=0)
+		close(call->file_fd);
+	onion_block_free(call->out);
+	free(call);
+}
+
+/**
+ * @short Answers the request if the upstream did not, and gives it back.
+ * 
+ * If the response was half relayed, the client connection is shut down, so it is not taken as complete.
+ * At a poller the request is resumed; else the status is for the handler to return.
+ */
+static onion_connection_status onion_handler_proxy_call_finish(onion_handler_proxy_call *call){
+	onion_request *req=call->req;
+	onion_connection_status ret=OCS_PROCESSED;
+	if (call->result!=PROXY_DONE){
+		if (call->state<PROXY_BODY){
+			if (call->result==PROXY_TIMEOUT)
+				onion_shortcut_response("Gateway timeout", HTTP_GATEWAY_TIMEOUT, req, call->res);
+			else
+				onion_shortcut_response("Bad gateway", HTTP_BAD_GATEWAY, req, call->res);
+		}
+		else{
+			ONION_WARNING("Upstream response to %s not complete, closing the connection", req->fullpath);
+			shutdown(req->connection.fd, SHUT_RDWR);
+			ret=OCS_CLOSE_CONNECTION;
+		}
+	}
+	onion_poller *poller=call->poller;
+	onion_handler_proxy_call_free(call);
+	if (poller)
+		onion_request_resume(req);
+	return ret;
+}
+
+/// @}
+
+/**
+ * @short Forwards the request to an upstream, and relays the response.
+ * 
+ * At a poller the request is suspended, and the exchange with the upstream goes on at the poller, so no 
+ * thread waits for it. Else, as on HTTP/2 streams, this thread waits.
+ */
+static onion_connection_status onion_handler_proxy_handler(onion_handler_proxy_data *d, onion_request *req, onion_response *res){
+	if (!d->count)
+		return OCS_NOT_PROCESSED;
+	if (d->health_path)
+		onion_handler_proxy_health_start(d);
+	onion_handler_proxy_call *call=calloc(1, sizeof(onion_handler_proxy_call));
+	call->proxy=d;
+	call->req=req;
+	call->res=res;
+	call->fd=-1;
+	call->file_fd=-1;
+	call->pipe[0]=call->pipe[1]=-1;
+	call->out=onion_block_new();
+	int code=onion_handler_proxy_call_request(call);
+	if (code){
+		onion_handler_proxy_call_free(call);
+		return onion_shortcut_response(code==HTTP_NOT_IMPLEMENTED ? "Not implemented" : "Internal error", code, req, res);
+	}
+	if (!(req->flags&OR_HTTP2))
+		call->poller=onion_request_get_poller(req);
+	onion_poller *poller=call->poller;
+	if (onion_handler_proxy_call_start(call)<0){
+		onion_handler_proxy_call_free(call);
+		return onion_shortcut_response("Bad gateway", HTTP_BAD_GATEWAY, req, res);
+	}
+	if (poller) // call may be gone already
+		return OCS_SUSPENDED;
+	return onion_handler_proxy_call_wait(call);
+}
+
+static void onion_handler_proxy_free(onion_handler_proxy_data *d){
+	onion_handler_proxy_health_stop(d);
+	int i;
+	for (i=0;i<d->count;i++){
+		onion_handler_proxy_upstream *u=d->upstreams[i];
+		while (u->nidle)
+			close(u->idle[--u->nidle]);
+		free(u->idle);
+		free(u->idle_since);
+		freeaddrinfo(u->addr);
+		pthread_mutex_destroy(&u->mutex);
+		free(u->host);
+		free(u->port);
+		free(u);
+	}
+	free(d->upstreams);
+	free(d->health_path);
+	pthread_cond_destroy(&d->health_cond);
+	pthread_mutex_destroy(&d->health_mutex);
+	free(d);
+}
+
+/**
+ * @short Creates a reverse proxy handler, that forwards the requests to HTTP/1.1 servers
+ * 
+ * Requests go with their full path, headers and body, except the ones of the connection, and with the client
+ * address added to X-Forwarded-For. Multipart bodies can not be forwarded, as they are already parsed. 
+ * The responses are relayed as they come; bodies of known length go from the upstream connection to the 
+ * client with splice, without copies, when nothing has to change them (HTTP, no compression).
+ * 
+ * Connections to the upstreams are kept open for the next requests. More upstreams can be added with 
+ * onion_handler_proxy_add_upstream; each request goes to the one with less requests in flight.
+ * 
+ * At O_POLL and O_POOL modes no thread waits for the upstream: the request is suspended and all is done at 
+ * the poller.
+ * 
+ * @param host Host of the first upstream, or NULL to add them later.
+ * @param port Its port.
+ * @returns The handler, or NULL if the host could not be resolved.
+ */
+onion_handler *onion_handler_proxy(const char *host, const char *port){
+	onion_handler_proxy_data *priv_data=calloc(1, sizeof(onion_handler_proxy_data));
+	if (!priv_data)
+		return NULL;
+	priv_data->max_idle=32;
+	priv_data->idle_timeout_ms=4000;
+	priv_data->timeout_ms=60000;
+	pthread_mutex_init(&priv_data->health_mutex, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&priv_data->health_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	
+	onion_handler *ret=onion_handler_new((onion_handler_handler)onion_handler_proxy_handler,
+																			 priv_data, (onion_handler_private_data_free) onion_handler_proxy_free);
+	if (host && onion_handler_proxy_add_upstream(ret, host, port)<0){
+		onion_handler_free(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+/**
+ * @short Adds an upstream server. It is resolved now.
+ * 
+ * Should be added before the first request.
+ * 
+ * @returns 0, or -1 if it could not be resolved.
+ */
+int onion_handler_proxy_add_upstream(onion_handler *proxy, const char *host, const char *port){
+	onion_handler_proxy_data *d=onion_handler_get_private_data(proxy);
+	struct addrinfo hints;
+	struct addrinfo *addr;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_NUMERICSERV;
+	int e=getaddrinfo(host, port ? port : "80", &hints, &addr);
+	if (e!=0){
+		ONION_ERROR("Could not resolve upstream %s:%s: %s", host, port ? port : "80", gai_strerror(e));
+		return -1;
+	}
+	onion_handler_proxy_upstream *u=calloc(1, sizeof(onion_handler_proxy_upstream));
+	u->host=strdup(host);
+	u->port=strdup(port ? port : "80");
+	u->addr=addr;
+	u->healthy=1;
+	pthread_mutex_init(&u->mutex, NULL);
+	onion_handler_proxy_pool_resize(u, d->max_idle);
+	d->upstreams=realloc(d->upstreams, sizeof(onion_handler_proxy_upstream*)*(d->count+1));
+	d->upstreams[d->count++]=u;
+	return 0;
+}
+
+/**
+ * @short Sets how many idle connections are kept per upstream, and for how long.
+ * 
+ * The idle timeout should be less than the keep alive timeout of the upstreams. Connections that the 
+ * upstream closed anyway are detected before use. Defaults to 32 connections, for 4 s. 0 connections 
+ * closes them after each request.
+ */
+void onion_handler_proxy_set_pool(onion_handler *proxy, int max_idle, int idle_timeout_ms){
+	onion_handler_proxy_data *d=onion_handler_get_private_data(proxy);
+	d->max_idle=max_idle;
+	d->idle_timeout_ms=idle_timeout_ms;
+	int i;
+	for (i=0;i<d->count;i++)
+		onion_handler_proxy_pool_resize(d->upstreams[i], max_idle);
+}
+
+/**
+ * @short Sets how long to wait for each read or write of the upstream, and for health checks. Default 60 s.
+ * 
+ * When it times out before the response starts, the client gets a 504.
+ */
+void onion_handler_proxy_set_timeout(onion_handler *proxy, int timeout_ms){
+	onion_handler_proxy_data *d=onion_handler_get_private_data(proxy);
+	d->timeout_ms=timeout_ms;
+}
+
+/**
+ * @short Checks the upstreams every interval_ms, with a GET of path.
+ * 
+ * Those that do not answer with a 2xx or 3xx get no requests until they do. The checks are done by a thread
+ * of each process, started at the first request. Without health checks, an upstream that refuses a 
+ * connection gets no requests for some seconds.
+ * 
+ * @param path Path to check, or NULL to stop checking.
+ */
+void onion_handler_proxy_set_health_check(onion_handler *proxy, const char *path, int interval_ms){
+	onion_handler_proxy_data *d=onion_handler_get_private_data(proxy);
+	onion_handler_proxy_health_stop(d);
+	free(d->health_path);
+	d->health_path=path ? strdup(path) : NULL;
+	d->health_interval_ms=interval_ms;
+	int i;
+	for (i=0;i<d->count;i++)
+		d->upstreams[i]->healthy=1;
+}
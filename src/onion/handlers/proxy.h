@@ -0,0 +1,50 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef __ONION_HANDLER_PROXY__
+#define __ONION_HANDLER_PROXY__
+
+#include <onion/types.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/// Creates a handler that forwards the requests to the HTTP/1.1 server at host:port, and relays its responses.
+onion_handler *onion_handler_proxy(const char *host, const char *port);
+/// Adds another server to send requests to. Each request goes to the one with less requests in flight. -1 if it could not be resolved.
+int onion_handler_proxy_add_upstream(onion_handler *proxy, const char *host, const char *port);
+/// Keeps up to max_idle open connections per upstream, closed after idle_timeout_ms without use.
+void onion_handler_proxy_set_pool(onion_handler *proxy, int max_idle, int idle_timeout_ms);
+/// Gives up on upstreams that do not answer in timeout_ms, with a 504.
+void onion_handler_proxy_set_timeout(onion_handler *proxy, int timeout_ms);
+/// Checks every interval_ms that a GET of path to each upstream gets a 2xx or 3xx, and sends requests only to those that do.
+void onion_handler_proxy_set_health_check(onion_handler *proxy, const char *path, int interval_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
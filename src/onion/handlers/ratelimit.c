@@ -0,0 +1,237 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <onion/handler.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/shortcuts.h>
+#include <onion/log.h>
+
+#include "ratelimit.h"
+
+/// Slots of the table of each limit. Each key uses two, so keys only share their limit if both collide.
+#define ONION_HANDLER_RATELIMIT_SLOTS 16384
+
+struct onion_handler_ratelimit_data_t{
+	onion_handler *inside;
+	int limit;
+	int window_ms;
+	int64_t interval_us;  ///< A token comes back each window/limit
+	int64_t window_us;
+	char *header;         ///< Key by this header, if any
+	onion_handler_ratelimit_key key;
+	void *key_data;
+	int64_t *slots;       ///< Theoretical arrival time of the next request of each slot, in monotonic us
+};
+
+typedef struct onion_handler_ratelimit_data_t onion_handler_ratelimit_data;
+
+static int64_t onion_handler_ratelimit_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+/// FNV-1a of the bytes, added to h.
+static uint64_t onion_handler_ratelimit_hash(uint64_t h, const unsigned char *data, size_t length){
+	size_t i;
+	for (i=0;i<length;i++)
+		h=(h^data[i])*1099511628211ull;
+	return h;
+}
+
+/// Hash of the key of the request: the extracted one, or the client IP.
+static uint64_t onion_handler_ratelimit_key_hash(onion_handler_ratelimit_data *d, onion_request *req){
+	uint64_t h=14695981039346656037ull;
+	const char *key=NULL;
+	if (d->key)
+		key=d->key(d->key_data, req);
+	else if (d->header)
+		key=onion_request_get_header(req, d->header);
+	if (key)
+		return onion_handler_ratelimit_hash(h, (const unsigned char*)key, strlen(key));
+	
+	size_t length;
+	const unsigned char *ip=onion_request_get_client_ip(req, &length);
+	h=onion_handler_ratelimit_hash(h, (const unsigned char*)"\0", 1); // Never as a string key
+	if (!ip)
+		return h;
+	return onion_handler_ratelimit_hash(h, ip, length);
+}
+
+/**
+ * @short Takes a token of the key, as GCRA, the token bucket kept as a single time per slot.
+ * 
+ * The key is at two slots. The first is updated with a compare and swap, so the requests of the same key 
+ * are counted exactly, and the second gets at least the same time. So both keep the use of the key, and 
+ * a key only gets the limit of other if both slots collide.
+ * 
+ * @returns The microseconds until the key has all its tokens back if allowed, or minus the microseconds to wait if not.
+ */
+static int64_t onion_handler_ratelimit_take(onion_handler_ratelimit_data *d, uint64_t hash){
+	int64_t *first=&d->slots[hash%ONION_HANDLER_RATELIMIT_SLOTS];
+	int64_t *second=&d->slots[(hash>>32)%ONION_HANDLER_RATELIMIT_SLOTS];
+	if (first==second)
+		second=&d->slots[((hash>>32)+1)%ONION_HANDLER_RATELIMIT_SLOTS];
+	int64_t now=onion_handler_ratelimit_now();
+	int64_t current=__atomic_load_n(first, __ATOMIC_RELAXED);
+	int64_t next;
+	do{
+		int64_t tat=current;
+		int64_t other=__atomic_load_n(second, __ATOMIC_RELAXED);
+		if (other>tat)
+			tat=other;
+		if (now>tat)
+			tat=now;
+		next=tat+d->interval_us;
+		if (next-now>d->window_us)
+			return -(next-now-d->window_us);
+	}while(!__atomic_compare_exchange_n(first, &current, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	
+	int64_t other=__atomic_load_n(second, __ATOMIC_RELAXED);
+	while (other<next && !__atomic_compare_exchange_n(second, &other, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return next-now;
+}
+
+/// Seconds, rounded up.
+static long onion_handler_ratelimit_seconds(int64_t us){
+	return (us+999999)/1000000;
+}
+
+static int onion_handler_ratelimit_handler(onion_handler_ratelimit_data *d, onion_request *req, onion_response *res){
+	int64_t used=onion_handler_ratelimit_take(d, onion_handler_ratelimit_key_hash(d, req));
+	char tmp[64];
+	snprintf(tmp, sizeof(tmp), "%d", d->limit);
+	onion_response_set_header(res, "RateLimit-Limit", tmp);
+	snprintf(tmp, sizeof(tmp), "%d;w=%d", d->limit, (d->window_ms+999)/1000);
+	onion_response_set_header(res, "RateLimit-Policy", tmp);
+	if (used<0){
+		long wait=onion_handler_ratelimit_seconds(-used);
+		if (wait<1)
+			wait=1;
+		snprintf(tmp, sizeof(tmp), "%ld", wait);
+		onion_response_set_header(res, "RateLimit-Remaining", "0");
+		onion_response_set_header(res, "RateLimit-Reset", tmp);
+		onion_response_set_header(res, "Retry-After", tmp);
+		return onion_shortcut_response("Too many requests", HTTP_TOO_MANY_REQUESTS, req, res);
+	}
+	snprintf(tmp, sizeof(tmp), "%ld", (long)((d->window_us-used)/d->interval_us));
+	onion_response_set_header(res, "RateLimit-Remaining", tmp);
+	snprintf(tmp, sizeof(tmp), "%ld", onion_handler_ratelimit_seconds(used));
+	onion_response_set_header(res, "RateLimit-Reset", tmp);
+	return onion_handler_handle(d->inside, req, res);
+}
+
+static void onion_handler_ratelimit_delete(void *data){
+	onion_handler_ratelimit_data *d=data;
+	onion_handler_free(d->inside);
+	free(d->header);
+	free(d->slots);
+	free(d);
+}
+
+static void onion_handler_ratelimit_children(onion_handler_ratelimit_data *d, onion_handler_child_f f, void *data){
+	f(data, d->inside, NULL);
+}
+
+/**
+ * @short Creates a handler that limits the rate of the requests of each client to the inside level.
+ *
+ * It is a token bucket for each client: it holds limit tokens, each request takes one, and they come
+ * back at limit per window_ms. So a client may do a burst of limit requests, and then limit per window.
+ * The rest are answered 429 Too Many Requests with Retry-After, and not passed to the inside level.
+ * 
+ * It wraps a route, as other handlers, so each route may have its own limit:
+ *
+ *   onion_url_add_handler(urls, "^api/", onion_handler_ratelimit(onion_url_to_handler(api), 100, 60000));
+ *
+ * Clients are told apart by their IP, or by a header, as an API key, with onion_handler_ratelimit_by_header, 
+ * or by any string, as the user or the route and the IP, with onion_handler_ratelimit_by_key.
+ * 
+ * The buckets are kept as a single time each, at a fixed table of slots updated with atomic compare and 
+ * swap, so there are no locks nor allocations per request, and many keys take no more memory. Each key 
+ * uses two slots, and only if both are shared with other keys it may be limited by their use too.
+ * 
+ * All responses get the RateLimit-Limit, RateLimit-Remaining, RateLimit-Reset and RateLimit-Policy headers.
+ *
+ * @param inside_level The handler to protect
+ * @param limit Requests per window, and the burst size
+ * @param window_ms The window
+ */
+onion_handler *onion_handler_ratelimit(onion_handler *inside_level, int limit, int window_ms){
+	if (limit<1 || window_ms<1){
+		ONION_ERROR("The rate limit needs a limit and window of at least 1");
+		return NULL;
+	}
+	onion_handler_ratelimit_data *priv_data=calloc(1, sizeof(onion_handler_ratelimit_data));
+	if (!priv_data)
+		return NULL;
+	priv_data->slots=calloc(ONION_HANDLER_RATELIMIT_SLOTS, sizeof(int64_t));
+	if (!priv_data->slots){
+		free(priv_data);
+		return NULL;
+	}
+	priv_data->inside=inside_level;
+	priv_data->limit=limit;
+	priv_data->window_ms=window_ms;
+	priv_data->window_us=((int64_t)window_ms)*1000;
+	priv_data->interval_us=priv_data->window_us/limit;
+	if (priv_data->interval_us<1)
+		priv_data->interval_us=1;
+	
+	onion_handler *ret=onion_handler_new((onion_handler_handler)onion_handler_ratelimit_handler,
+																				 priv_data, (onion_handler_private_data_free) onion_handler_ratelimit_delete);
+	onion_handler_set_children(ret, (onion_handler_children_f)onion_handler_ratelimit_children);
+	return ret;
+}
+
+/**
+ * @short Keys the limit by the value of a request header, as X-Api-Key.
+ *
+ * Requests without it are limited by their client address. Should be set before the first request.
+ */
+void onion_handler_ratelimit_by_header(onion_handler *ratelimit, const char *header){
+	onion_handler_ratelimit_data *d=onion_handler_get_private_data(ratelimit);
+	free(d->header);
+	d->header=header ? strdup(header) : NULL;
+}
+
+/**
+ * @short Keys the limit by the string the function returns for each request.
+ *
+ * When it returns NULL, the request is limited by its client address. The string is hashed right away,
+ * so it may be at the request or at a thread local buffer. Should be set before the first request.
+ */
+void onion_handler_ratelimit_by_key(onion_handler *ratelimit, onion_handler_ratelimit_key key, void *data){
+	onion_handler_ratelimit_data *d=onion_handler_get_private_data(ratelimit);
+	d->key=key;
+	d->key_data=data;
+}
@@ -0,0 +1,49 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef __ONION_HANDLER_RATELIMIT__
+#define __ONION_HANDLER_RATELIMIT__
+
+#include <onion/types.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/// Gets the key of the request for the rate limit, as an API key, or NULL to use the client address.
+typedef const char *(*onion_handler_ratelimit_key)(void *data, onion_request *req);
+
+/// Creates a handler that lets limit requests per window_ms of each client through to the inside_level, and answers 429 to the rest.
+onion_handler *onion_handler_ratelimit(onion_handler *inside_level, int limit, int window_ms);
+/// Keys the limit by the value of this request header, as X-Api-Key, instead of the client address.
+void onion_handler_ratelimit_by_header(onion_handler *ratelimit, const char *header);
+/// Keys the limit by the string the function returns for each request.
+void onion_handler_ratelimit_by_key(onion_handler *ratelimit, onion_handler_ratelimit_key key, void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
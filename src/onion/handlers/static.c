@@ -36,6 +36,7 @@
 struct onion_handler_static_data_t{
 	int code;
 	const char *data;
+	onion_response_prerendered *prerendered;
 };
 
 typedef struct onion_handler_static_data_t onion_handler_static_data;
@@ -58,6 +59,7 @@ int onion_handler_static_handler(onion_handler_static_data *d, onion_request *re
 /// Removes internal data for this handler.
 void onion_handler_static_delete(onion_handler_static_data *d){
 	free((char*)d->data);
+	onion_response_prerendered_free(d->prerendered);
 	free(d);
 }
 
@@ -65,6 +67,8 @@ void onion_handler_static_delete(onion_handler_static_data *d){
  * @short Creates a static handler that just writes some static data.
  *
  * Path is a regex for the url, as arrived here.
+ *
+ * The response is prerendered, and written without calling the handler when possible. @see onion_handler_set_prerendered
  */
 onion_handler *onion_handler_static(const char *text, int code){
 	onion_handler_static_data *priv_data=malloc(sizeof(onion_handler_static_data));
@@ -73,9 +77,11 @@ onion_handler *onion_handler_static(const char *text, int code){
 
 	priv_data->code=code;
 	priv_data->data=strdup(text);
+	priv_data->prerendered=onion_response_prerender(code, NULL, text, strlen(text));
 
 	onion_handler *ret=onion_handler_new((onion_handler_handler)onion_handler_static_handler,
 																			 priv_data,(onion_handler_private_data_free) onion_handler_static_delete);
+	onion_handler_set_prerendered(ret, priv_data->prerendered);
 	return ret;
 }
 
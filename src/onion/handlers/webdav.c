@@ -32,6 +32,7 @@
 #include <onion/log.h>
 #include <onion/response.h>
 #include <onion/block.h>
+#include <onion/dict.h>
 #include <onion/shortcuts.h>
 
 #include "webdav.h"
@@ -39,13 +40,25 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <malloc.h>
 #include <libgen.h>
 #include <ctype.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+typedef struct onion_webdav_cache_t onion_webdav_cache;
 
 struct onion_webdav_t{
 	char *path;
 	onion_webdav_permissions_check check_permissions;
+	onion_webdav_cache *cache; ///< PROPFIND answers kept, or NULL. @see onion_handler_webdav_set_cache
 };
 
 typedef struct onion_webdav_t onion_webdav;
@@ -126,6 +139,337 @@ onion_connection_status onion_webdav_handler(onion_webdav *wd, onion_request *re
 	return OCS_PROCESSED;
 }
 
+/// Most directories a cache watches. Answers that need more are not kept.
+#define ONION_WEBDAV_CACHE_MAX_WATCHES 4096
+
+/// A PROPFIND multistatus kept in memory, for a collection, depth and props.
+typedef struct onion_webdav_cache_entry_t{
+	char *key;         ///< "depth props url"
+	char *path;        ///< The collection at the file system, normalized, to know which changes touch it.
+	onion_block *body;
+	char etag[48];
+	int refcount;      ///< The cache holds one, and each answer from it another.
+	struct onion_webdav_cache_entry_t *lru_prev; ///< Most recently used first
+	struct onion_webdav_cache_entry_t *lru_next;
+}onion_webdav_cache_entry;
+
+/// A directory watched for changes.
+typedef struct onion_webdav_watch_t{
+	int wd;
+	char key[16];      ///< The wd as string, its key at watches_by_wd.
+	char *path;
+}onion_webdav_watch;
+
+/**
+ * @short Cache of PROPFIND answers of collections.
+ * 
+ * Each answer is kept while no change touches the collection or what is under it. Changes are known
+ * from inotify watches of every directory the answer went through, read before each lookup, and
+ * from the PUT, DELETE, MOVE and MKCOL done through the handler.
+ */
+struct onion_webdav_cache_t{
+	size_t max_memory;
+	size_t memory;
+	onion_dict *entries;          ///< By key
+	onion_webdav_cache_entry *lru_first;
+	onion_webdav_cache_entry *lru_last;
+	int inotify;
+	onion_dict *watches;          ///< By path
+	onion_dict *watches_by_wd;
+	int nwatches;
+	unsigned long changes;        ///< Of anything. An answer made while something changed is not kept.
+	unsigned long generation;     ///< For the ETags
+	long started;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+};
+
+static void onion_webdav_cache_lock(onion_webdav_cache *cache){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&cache->mutex);
+#endif
+}
+
+static void onion_webdav_cache_unlock(onion_webdav_cache *cache){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&cache->mutex);
+#endif
+}
+
+/// Removes repeated / and the trailing ones, in place, so the same directory has always the same path.
+static char *onion_webdav_cache_normalize(char *path){
+	char *r=path, *w=path;
+	while (*r){
+		if (*r=='/' && r[1]=='/'){
+			r++;
+			continue;
+		}
+		*w++=*r++;
+	}
+	while (w>path+1 && w[-1]=='/')
+		w--;
+	*w='\0';
+	return path;
+}
+
+/// Whether a change at one path touches the answer of the other: one is the other, or is under it.
+static int onion_webdav_cache_related(const char *a, const char *b){
+	size_t la=strlen(a), lb=strlen(b);
+	size_t l=la<lb ? la : lb;
+	if (strncmp(a, b, l)!=0)
+		return 0;
+	if (la==lb)
+		return 1;
+	const char *longer=la>lb ? a : b;
+	return longer[l]=='/' || (l>0 && longer[l-1]=='/');
+}
+
+static void onion_webdav_cache_entry_unref(onion_webdav_cache_entry *e){
+	if (--e->refcount>0)
+		return;
+	free(e->key);
+	free(e->path);
+	onion_block_free(e->body);
+	free(e);
+}
+
+static void onion_webdav_cache_lru_remove(onion_webdav_cache *cache, onion_webdav_cache_entry *e){
+	if (e->lru_prev)
+		e->lru_prev->lru_next=e->lru_next;
+	else
+		cache->lru_first=e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev=e->lru_prev;
+	else
+		cache->lru_last=e->lru_prev;
+	e->lru_prev=e->lru_next=NULL;
+}
+
+static void onion_webdav_cache_lru_push(onion_webdav_cache *cache, onion_webdav_cache_entry *e){
+	e->lru_prev=NULL;
+	e->lru_next=cache->lru_first;
+	if (cache->lru_first)
+		cache->lru_first->lru_prev=e;
+	else
+		cache->lru_last=e;
+	cache->lru_first=e;
+}
+
+static void onion_webdav_cache_remove(onion_webdav_cache *cache, onion_webdav_cache_entry *e){
+	onion_dict_remove(cache->entries, e->key);
+	onion_webdav_cache_lru_remove(cache, e);
+	cache->memory-=onion_block_size(e->body);
+	onion_webdav_cache_entry_unref(e);
+}
+
+/// Removes the answers the change at path touches, or all if path is NULL. Must have the lock.
+static void onion_webdav_cache_invalidate(onion_webdav_cache *cache, const char *path){
+	cache->changes++;
+	onion_webdav_cache_entry *e=cache->lru_first;
+	while (e){
+		onion_webdav_cache_entry *next=e->lru_next;
+		if (!path || onion_webdav_cache_related(e->path, path)){
+			ONION_DEBUG0("Change at %s, out %s", path ? path : "(all)", e->key);
+			onion_webdav_cache_remove(cache, e);
+		}
+		e=next;
+	}
+}
+
+static void onion_webdav_watch_free(void *_, const char *key, const void *w, int flags){
+	free(((onion_webdav_watch*)w)->path);
+	free((void*)w);
+}
+
+/// Reads the pending inotify events, and removes the answers they touch. Must have the lock.
+static void onion_webdav_cache_drain(onion_webdav_cache *cache){
+#ifdef __linux__
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+	while ( (n=read(cache->inotify, buffer, sizeof(buffer)))>0 ){
+		char *p=buffer;
+		while (p<buffer+n){
+			const struct inotify_event *ev=(const struct inotify_event*)p;
+			p+=sizeof(struct inotify_event)+ev->len;
+			if (ev->mask&IN_Q_OVERFLOW){ // Lost some, so all could have changed
+				ONION_WARNING("Too many changes at the WebDAV share to follow them, cache emptied");
+				onion_webdav_cache_invalidate(cache, NULL);
+				continue;
+			}
+			char key[16];
+			snprintf(key, sizeof(key), "%d", ev->wd);
+			onion_webdav_watch *w=(onion_webdav_watch*)onion_dict_get(cache->watches_by_wd, key);
+			if (!w)
+				continue;
+			if (ev->len){
+				size_t l=strlen(w->path);
+				char *path=malloc(l+ev->len+2);
+				memcpy(path, w->path, l);
+				path[l]='/';
+				strcpy(&path[l+1], ev->name);
+				onion_webdav_cache_invalidate(cache, path);
+				free(path);
+			}
+			else
+				onion_webdav_cache_invalidate(cache, w->path);
+			if (ev->mask&IN_IGNORED){ // The directory is gone, and so its watch
+				onion_dict_remove(cache->watches, w->path);
+				onion_dict_remove(cache->watches_by_wd, w->key);
+				onion_webdav_watch_free(NULL, NULL, w, 0);
+				cache->nwatches--;
+			}
+		}
+	}
+#endif
+}
+
+/**
+ * @short Watches the directory for changes, if not yet.
+ * 
+ * Must be watched before it is read, so changes after reading it are not lost.
+ * 
+ * @returns 0 if watched, 1 if it is not a directory, -1 if it could not be watched.
+ */
+static int onion_webdav_cache_watch(onion_webdav_cache *cache, const char *path){
+	int ret=0;
+	onion_webdav_cache_lock(cache);
+	if (!onion_dict_get(cache->watches, path)){
+#ifdef __linux__
+		int wd=-1;
+		if (cache->nwatches<ONION_WEBDAV_CACHE_MAX_WATCHES)
+			wd=inotify_add_watch(cache->inotify, path, IN_CREATE|IN_DELETE|IN_MODIFY|IN_ATTRIB|IN_MOVED_FROM|IN_MOVED_TO|
+																								IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR);
+		if (wd<0)
+			ret=(errno==ENOTDIR) ? 1 : -1;
+		else{
+			onion_webdav_watch *w=malloc(sizeof(onion_webdav_watch));
+			w->wd=wd;
+			snprintf(w->key, sizeof(w->key), "%d", wd);
+			w->path=strdup(path);
+			if (onion_dict_get(cache->watches_by_wd, w->key)) // Same directory by another path, keep the first.
+				onion_webdav_watch_free(NULL, NULL, w, 0);
+			else{
+				onion_dict_add(cache->watches, w->path, w, 0);
+				onion_dict_add(cache->watches_by_wd, w->key, w, 0);
+				cache->nwatches++;
+			}
+		}
+#else
+		ret=-1;
+#endif
+	}
+	onion_webdav_cache_unlock(cache);
+	return ret;
+}
+
+/**
+ * @short Gets the answer with that key, that must be released, or NULL.
+ * 
+ * @param changes Set to the changes count, to know at onion_webdav_cache_add if the answer made meanwhile is still good.
+ */
+static onion_webdav_cache_entry *onion_webdav_cache_get(onion_webdav_cache *cache, const char *key, unsigned long *changes){
+	onion_webdav_cache_lock(cache);
+	onion_webdav_cache_drain(cache);
+	onion_webdav_cache_entry *e=(onion_webdav_cache_entry*)onion_dict_get(cache->entries, key);
+	if (e){
+		e->refcount++;
+		onion_webdav_cache_lru_remove(cache, e);
+		onion_webdav_cache_lru_push(cache, e);
+	}
+	*changes=cache->changes;
+	onion_webdav_cache_unlock(cache);
+	return e;
+}
+
+static void onion_webdav_cache_release(onion_webdav_cache *cache, onion_webdav_cache_entry *e){
+	onion_webdav_cache_lock(cache);
+	onion_webdav_cache_entry_unref(e);
+	onion_webdav_cache_unlock(cache);
+}
+
+/// A new ETag, for an answer that may be kept.
+static void onion_webdav_cache_etag(onion_webdav_cache *cache, char *etag, size_t size){
+	onion_webdav_cache_lock(cache);
+	unsigned long generation=++cache->generation;
+	onion_webdav_cache_unlock(cache);
+	snprintf(etag, size, "\"%lx-%lx\"", cache->started, generation);
+}
+
+/**
+ * @short Keeps the answer, if nothing changed since changes was got at onion_webdav_cache_get.
+ * 
+ * Takes ownership of the body.
+ */
+static void onion_webdav_cache_add(onion_webdav_cache *cache, const char *key, const char *path, onion_block *body, 
+																	 const char *etag, unsigned long changes){
+	onion_webdav_cache_lock(cache);
+	onion_webdav_cache_drain(cache);
+	if (cache->changes!=changes || onion_block_size(body)>cache->max_memory || onion_dict_get(cache->entries, key)){
+		onion_webdav_cache_unlock(cache);
+		onion_block_free(body);
+		return;
+	}
+	onion_webdav_cache_entry *e=calloc(1, sizeof(onion_webdav_cache_entry));
+	e->key=strdup(key);
+	e->path=strdup(path);
+	e->body=body;
+	snprintf(e->etag, sizeof(e->etag), "%s", etag);
+	e->refcount=1;
+	onion_dict_add(cache->entries, e->key, e, 0);
+	onion_webdav_cache_lru_push(cache, e);
+	cache->memory+=onion_block_size(body);
+	while (cache->memory>cache->max_memory && cache->lru_last!=e)
+		onion_webdav_cache_remove(cache, cache->lru_last);
+	onion_webdav_cache_unlock(cache);
+}
+
+/// The file at path was changed through the handler, so the answers about it are out.
+static void onion_webdav_changed(onion_webdav *wd, const char *path){
+	if (!wd->cache)
+		return;
+	char *p=onion_webdav_cache_normalize(strdup(path));
+	onion_webdav_cache_lock(wd->cache);
+	onion_webdav_cache_invalidate(wd->cache, p);
+	onion_webdav_cache_unlock(wd->cache);
+	free(p);
+}
+
+static void onion_webdav_cache_free(onion_webdav_cache *cache){
+	while (cache->lru_first)
+		onion_webdav_cache_remove(cache, cache->lru_first);
+	onion_dict_free(cache->entries);
+	onion_dict_preorder(cache->watches, onion_webdav_watch_free, NULL);
+	onion_dict_free(cache->watches);
+	onion_dict_free(cache->watches_by_wd);
+	if (cache->inotify>=0)
+		close(cache->inotify); // And so all the watches
+#ifdef HAVE_PTHREADS
+	pthread_mutex_destroy(&cache->mutex);
+#endif
+	free(cache);
+}
+
+/// Answers from the cache, or 304 if the client has that answer already.
+static onion_connection_status onion_webdav_cache_answer(onion_webdav_cache *cache, onion_webdav_cache_entry *e, 
+																												 onion_request *req, onion_response *res){
+	onion_response_set_header(res, "ETag", e->etag);
+	const char *prev_etag=onion_request_get_header_id(req, ONION_H_IF_NONE_MATCH);
+	if (prev_etag && strstr(prev_etag, e->etag)){
+		onion_response_set_length(res, 0);
+		onion_response_set_code(res, HTTP_NOT_MODIFIED);
+		onion_response_write_headers(res);
+	}
+	else{
+		onion_response_set_header(res, "Content-Type", "text/xml; charset=\"utf-8\"");
+		onion_response_set_code(res, HTTP_MULTI_STATUS);
+		onion_response_set_length(res, onion_block_size(e->body));
+		onion_response_write(res, onion_block_data(e->body), onion_block_size(e->body));
+	}
+	onion_webdav_cache_release(cache, e);
+	return OCS_PROCESSED;
+}
+
 /**
  * @short Simple get on webdav is just a simple get on a default path.
  */
@@ -140,6 +484,7 @@ onion_connection_status onion_webdav_get(const char *filename, onion_webdav *wd,
 onion_connection_status onion_webdav_delete(const char *filename, onion_webdav *wd, onion_request *req, onion_response *res){
 	ONION_DEBUG("Webdav delete %s", filename);
 	int error=remove(filename);
+	onion_webdav_changed(wd, filename);
 	if (error==0)
 		return onion_shortcut_response("Deleted", HTTP_OK, req, res);
 	else{
@@ -189,6 +534,8 @@ onion_connection_status onion_webdav_move(const char *filename, onion_webdav *wd
 	ONION_INFO("Move %s to %s (webdav)", fullpath, dest_orig);
 	
 	int ok=onion_shortcut_rename(orig, fdest);
+	onion_webdav_changed(wd, orig);
+	onion_webdav_changed(wd, fdest);
 
 	if (ok==0){
 		ONION_DEBUG("Created %s succesfully", fdest);
@@ -206,7 +553,9 @@ onion_connection_status onion_webdav_move(const char *filename, onion_webdav *wd
  * Spec says it must create only if the parent exists.
  */
 onion_connection_status onion_webdav_mkcol(const char *filename, onion_webdav *wd, onion_request *req, onion_response *res){
-	if (mkdir(filename,0777)!=0){
+	int error=mkdir(filename,0777);
+	onion_webdav_changed(wd, filename);
+	if (error!=0){
 		return onion_shortcut_response("403 Forbidden", HTTP_FORBIDDEN, req, res);
 	}
 	return onion_shortcut_response("201 Created", 201, req, res);
@@ -223,6 +572,7 @@ onion_connection_status onion_webdav_put(const char *filename, onion_webdav *wd,
 	const char *tmpfile=onion_block_data(onion_request_get_data(req));
 	
 	int ok=onion_shortcut_rename(tmpfile, filename);
+	onion_webdav_changed(wd, filename);
 	
 	if (ok==0){
 		ONION_DEBUG("Created %s succesfully", filename);
@@ -257,6 +607,8 @@ onion_connection_status onion_webdav_options(const char *filename, onion_webdav
  * 
  */
 static int onion_webdav_parse_propfind(const onion_block *block){
+	if (!block || onion_block_size(block)==0) // No body is allprop, RFC 4918 9.1
+		return WD_RESOURCE_TYPE|WD_CONTENT_LENGTH|WD_LAST_MODIFIED|WD_CREATION_DATE|WD_ETAG|WD_CONTENT_TYPE|WD_DISPLAY_NAME|WD_EXECUTABLE;
 	// For parsing the data
 	xmlDocPtr doc;
 	doc = xmlParseMemory((char*)onion_block_data(block), onion_block_size(block));
@@ -318,95 +670,54 @@ static int onion_webdav_parse_propfind(const onion_block *block){
 /**
  * @short Write the properties of a path.
  * 
- * Given a path, and optionally a file at that path, writes the XML of its properties.
- * 
- * If no file given, data is for that path, else it is for the path+filename.
- * 
  * @param writer XML writer to write the data to
- * @param realpath The real path on the file server, used to check permissions and read data TODO
- * @param urlpath The base URL of the element, needed in the response. Composed with filename if filename!=NULL.
- * @param filename NULL if that element itself, else the subelement (file in path).
+ * @param href The URL of the element, as it goes at the response.
+ * @param st Its stat. With only the type at st_mode if the props do not need more. @see onion_webdav_props_stat
  * @param props Bitmask of the properties the user asked for.
- * 
- * @return 0 is ok, 1 if could not stat file.
  */
-int onion_webdav_write_props(xmlTextWriterPtr writer, const char *basepath, 
-														 const char *realpath, const char *urlpath, const char *filename, 
-														 int props){
-	ONION_DEBUG("Info for path '%s', urlpath '%s', file '%s', basepath '%s'", realpath, urlpath, filename, basepath);
-	// Stat the thing itself
-	char tmp[512];
-	if (filename)
-		snprintf(tmp, sizeof(tmp), "%s/%s", realpath, filename);
-	else
-		strncpy(tmp, realpath, sizeof(tmp));
-	struct stat st;
-	if (stat(tmp, &st)<0){
-		ONION_ERROR("Error on %s: %s", tmp, strerror(errno));
-		return 1;
-	}
-	while (*urlpath=='/') // No / at the begining.
-		urlpath++;
-
-	if (filename){
-		if (urlpath[0]==0)
-			snprintf(tmp, sizeof(tmp), "%s/%s", basepath, filename);
-		else
-			snprintf(tmp, sizeof(tmp), "%s/%s/%s", basepath, urlpath, filename);
-	}
-	else{
-		if (urlpath[0]==0)
-			snprintf(tmp, sizeof(tmp), "%s/", basepath);
-		else{
-			snprintf(tmp, sizeof(tmp), "%s/%s", basepath, urlpath);
-		}
-	}
-	if (S_ISDIR(st.st_mode) && urlpath[0]!=0)
-		strncat(tmp,"/", sizeof(tmp) - 1);
-	ONION_DEBUG0("Props for %s", tmp);
+static void onion_webdav_write_props(xmlTextWriterPtr writer, const char *href, const struct stat *st, int props){
+	ONION_DEBUG0("Props for %s", href);
+	char tmp[32];
 	
 	xmlTextWriterStartElement(writer, BAD_CAST "D:response");
 	xmlTextWriterWriteAttribute(writer, BAD_CAST "xmlns:lp1" ,BAD_CAST "DAV:");
 	xmlTextWriterWriteAttribute(writer, BAD_CAST "xmlns:g0" ,BAD_CAST "DAV:");
 	xmlTextWriterWriteAttribute(writer, BAD_CAST "xmlns:a" ,BAD_CAST "http://apache.org/dav/props/");
 	
-		xmlTextWriterWriteElement(writer, BAD_CAST "D:href", BAD_CAST  tmp); 
+		xmlTextWriterWriteElement(writer, BAD_CAST "D:href", BAD_CAST href); 
 		
 		/// OK
 		xmlTextWriterStartElement(writer, BAD_CAST "D:propstat");
 			xmlTextWriterStartElement(writer, BAD_CAST "D:prop");
 				if (props&WD_RESOURCE_TYPE){
 					xmlTextWriterStartElement(writer, BAD_CAST "lp1:resourcetype");
-						if (S_ISDIR(st.st_mode)){ // no marker for other resources
+						if (S_ISDIR(st->st_mode)){ // no marker for other resources
 							xmlTextWriterStartElement(writer, BAD_CAST "D:collection");
 							xmlTextWriterEndElement(writer);
 						}
 					xmlTextWriterEndElement(writer);
 				}
 				if (props&WD_LAST_MODIFIED){
-					char time[32];
-					onion_shortcut_date_string(st.st_mtime, time);
-					xmlTextWriterWriteElement(writer, BAD_CAST "lp1:getlastmodified", BAD_CAST time); 
+					onion_shortcut_date_string(st->st_mtime, tmp);
+					xmlTextWriterWriteElement(writer, BAD_CAST "lp1:getlastmodified", BAD_CAST tmp); 
 				}
 				if (props&WD_CREATION_DATE){
-					char time[32];
-					onion_shortcut_date_string_iso(st.st_mtime, time);
-					xmlTextWriterWriteElement(writer, BAD_CAST "lp1:creationdate", BAD_CAST time );
+					onion_shortcut_date_string_iso(st->st_mtime, tmp);
+					xmlTextWriterWriteElement(writer, BAD_CAST "lp1:creationdate", BAD_CAST tmp);
 				}
-				if (props&WD_CONTENT_LENGTH && !S_ISDIR(st.st_mode)){
-					snprintf(tmp, sizeof(tmp), "%d", (int)st.st_size);
+				if (props&WD_CONTENT_LENGTH && !S_ISDIR(st->st_mode)){
+					snprintf(tmp, sizeof(tmp), "%lld", (long long)st->st_size);
 					xmlTextWriterWriteElement(writer, BAD_CAST "lp1:getcontentlength", BAD_CAST tmp);
 				}
-				if (props&WD_CONTENT_TYPE && S_ISDIR(st.st_mode)){
+				if (props&WD_CONTENT_TYPE && S_ISDIR(st->st_mode)){
 					xmlTextWriterWriteElement(writer, BAD_CAST "lp1:getcontenttype", BAD_CAST "httpd/unix-directory");
 				}
 				if (props&WD_ETAG){
-					char etag[32];
-					onion_shortcut_etag(&st, etag);
-					xmlTextWriterWriteElement(writer, BAD_CAST "lp1:getetag", BAD_CAST etag);
+					onion_shortcut_etag((struct stat*)st, tmp);
+					xmlTextWriterWriteElement(writer, BAD_CAST "lp1:getetag", BAD_CAST tmp);
 				}
-				if (props&WD_EXECUTABLE && !S_ISDIR(st.st_mode)){
-					if (st.st_mode&0111)
+				if (props&WD_EXECUTABLE && !S_ISDIR(st->st_mode)){
+					if (st->st_mode&0111)
 						xmlTextWriterWriteElement(writer, BAD_CAST "a:executable", BAD_CAST "true");
 					else
 						xmlTextWriterWriteElement(writer, BAD_CAST "a:executable", BAD_CAST "false");
@@ -419,11 +730,10 @@ int onion_webdav_write_props(xmlTextWriterPtr writer, const char *basepath,
 		/// NOT FOUND
 		xmlTextWriterStartElement(writer, BAD_CAST "D:propstat");
 			xmlTextWriterStartElement(writer, BAD_CAST "D:prop");
-				if (props&WD_CONTENT_LENGTH && S_ISDIR(st.st_mode)){
-					snprintf(tmp, sizeof(tmp), "%d", (int)st.st_size);
+				if (props&WD_CONTENT_LENGTH && S_ISDIR(st->st_mode)){
 					xmlTextWriterWriteElement(writer, BAD_CAST "g0:getcontentlength", BAD_CAST "");
 				}
-				if (props&WD_CONTENT_TYPE && !S_ISDIR(st.st_mode)){
+				if (props&WD_CONTENT_TYPE && !S_ISDIR(st->st_mode)){
 					xmlTextWriterWriteElement(writer, BAD_CAST "g0:getcontenttype", BAD_CAST "");
 				}
 				if (props&WD_DISPLAY_NAME){
@@ -434,76 +744,151 @@ int onion_webdav_write_props(xmlTextWriterPtr writer, const char *basepath,
 		xmlTextWriterEndElement(writer); // /propstat
 		
 	xmlTextWriterEndElement(writer);
-	
+}
+
+/// Props that need more than the file type, so a stat.
+#define WD_PROPS_STAT (WD_CONTENT_LENGTH|WD_LAST_MODIFIED|WD_CREATION_DATE|WD_ETAG|WD_EXECUTABLE)
+
+/**
+ * @short Stats the directory entry, relative to its directory, or if the props need only the type, takes the one at the entry.
+ * 
+ * @returns 0 if ok, -1 if it could not be stated.
+ */
+static int onion_webdav_props_stat(int dirfd, const struct dirent *de, int props, struct stat *st){
+	if (!(props&WD_PROPS_STAT) && (de->d_type==DT_DIR || de->d_type==DT_REG)){
+		memset(st, 0, sizeof(*st));
+		st->st_mode=(de->d_type==DT_DIR) ? S_IFDIR : S_IFREG;
+		return 0;
+	}
+	if (fstatat(dirfd, de->d_name, st, 0)<0){
+		ONION_ERROR("Error on %s: %s", de->d_name, strerror(errno));
+		return -1;
+	}
 	return 0;
 }
 
+/// URL of the current element of a propfind, that grows and shrinks as it goes down and up the tree.
+typedef struct onion_webdav_href_t{
+	char *data;
+	size_t length;
+	size_t size;
+}onion_webdav_href;
+
+/// Adds the name, and a / if a directory. Returns the previous length, to go back to it.
+static size_t onion_webdav_href_push(onion_webdav_href *href, const char *name, int isdir){
+	size_t prev=href->length;
+	size_t l=strlen(name);
+	if (href->length+l+2>href->size){
+		href->size=(href->length+l+2)*2;
+		href->data=realloc(href->data, href->size);
+	}
+	memcpy(&href->data[href->length], name, l);
+	href->length+=l;
+	if (isdir)
+		href->data[href->length++]='/';
+	href->data[href->length]='\0';
+	return prev;
+}
+
+static void onion_webdav_href_pop(onion_webdav_href *href, size_t length){
+	href->length=length;
+	href->data[length]='\0';
+}
+
+/// Levels a Depth: infinity propfind goes down, at most. Each one has a directory open.
+#define ONION_WEBDAV_MAX_DEPTH 32
+
+/// State of a propfind as it goes down the tree.
+typedef struct onion_webdav_walk_t{
+	xmlTextWriterPtr writer;
+	onion_webdav_href href;
+	int props;
+	onion_webdav_cache *cache; ///< If the answer may be kept, to watch the directories it goes through. Else NULL.
+	onion_webdav_href path;    ///< At the file system, to watch the directories.
+	int uncacheable;           ///< Some directory could not be watched, so the answer can not be kept.
+}onion_webdav_walk;
+
 /**
- * @short Prepares the response for propfinds
+ * @short Writes the props of the entries of the directory, and of their entries up to that depth.
  * 
- * @param realpath Shared folder
- * @param urlpath URL of the requested propfind
- * @param depth Depth of query, 0 or 1.
- * @param props Properties of the query
+ * Entries are stated relative to the directory fd, and written as they are read, so memory is one open
+ * directory per level, whatever their size. Symbolic links are listed, but not followed down.
  * 
- * @returns An onion_block with the XML data.
+ * If the answer may be kept, each directory is watched before its stat, so any later change is known.
+ * 
+ * @param fd The directory, that is closed at the end.
  */
-onion_block *onion_webdav_write_propfind(const char *basepath, const char *realpath, const char *urlpath, int depth, 
-																				 int props){
-	onion_block *data=onion_block_new();
-	xmlTextWriterPtr writer;
-	xmlBufferPtr buf;
-	buf = xmlBufferCreate();
-	if (buf == NULL) {
-		ONION_ERROR("testXmlwriterMemory: Error creating the xml buffer");
-		return data;
-	}
-	writer = xmlNewTextWriterMemory(buf, 0);
-	if (writer == NULL) {
-		ONION_ERROR("testXmlwriterMemory: Error creating the xml writer");
-		return data;
-	}
-	int error;
-	xmlTextWriterStartDocument(writer, NULL, "utf-8", NULL);
-	xmlTextWriterStartElement(writer, BAD_CAST "D:multistatus");
-		xmlTextWriterWriteAttribute(writer, BAD_CAST "xmlns:D" ,BAD_CAST "DAV:");
-			error=onion_webdav_write_props(writer, basepath, realpath, urlpath, NULL, props);
-			if (depth>0){
-				ONION_DEBUG("Get also all files");
-				DIR *dir=opendir(realpath);
-				if (!dir){
-					ONION_ERROR("Error opening dir %s to check files on it", realpath);
-				}
-				else{
-					struct dirent *de;
-					while ( (de=readdir(dir)) ){
-						if (de->d_name[0]!='.')
-							onion_webdav_write_props(writer, basepath, realpath, urlpath, de->d_name, props);
-					}
-					closedir(dir);
-				}
-			}
-		xmlTextWriterEndElement(writer);
-	xmlTextWriterEndElement(writer);
-	
-	
-	xmlTextWriterEndDocument(writer);
-	xmlFreeTextWriter(writer);
-	
-	onion_block_add_str(data, (const char*)buf->content);
-	xmlBufferFree(buf);
+static void onion_webdav_write_dir(onion_webdav_walk *walk, int fd, int depth){
+	DIR *dir=fdopendir(fd);
+	if (!dir){
+		ONION_ERROR("Error opening dir %s to check files on it", walk->href.data);
+		close(fd);
+		walk->uncacheable=1;
+		return;
+	}
+	struct dirent *de;
+	while ( (de=readdir(dir)) ){
+		if (de->d_name[0]=='.')
+			continue;
+		size_t prevpath=walk->path.length;
+		if (walk->cache){
+			onion_webdav_href_push(&walk->path, "/", 0);
+			onion_webdav_href_push(&walk->path, de->d_name, 0);
+			if ((de->d_type==DT_DIR || de->d_type==DT_UNKNOWN) && onion_webdav_cache_watch(walk->cache, walk->path.data)<0)
+				walk->uncacheable=1;
+		}
+		struct stat st;
+		if (onion_webdav_props_stat(dirfd(dir), de, walk->props, &st)<0){
+			walk->uncacheable=1;
+			if (walk->cache)
+				onion_webdav_href_pop(&walk->path, prevpath);
+			continue;
+		}
+		size_t prev=onion_webdav_href_push(&walk->href, de->d_name, S_ISDIR(st.st_mode));
+		onion_webdav_write_props(walk->writer, walk->href.data, &st, walk->props);
+		if (depth>1 && S_ISDIR(st.st_mode) && de->d_type!=DT_LNK){
+			int sub=openat(dirfd(dir), de->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+			if (sub>=0)
+				onion_webdav_write_dir(walk, sub, depth-1);
+		}
+		onion_webdav_href_pop(&walk->href, prev);
+		if (walk->cache)
+			onion_webdav_href_pop(&walk->path, prevpath);
+	}
+	closedir(dir);
+}
 
-	if (error){
-		onion_block_free(data);
-		return NULL;
+/// Where the XML goes as it is produced: to the response, and a copy to keep it, while not too big.
+typedef struct onion_webdav_output_t{
+	onion_response *res;
+	onion_block *copy;
+	size_t max_size;
+}onion_webdav_output;
+
+/// Writes the XML as it is produced to the response.
+static int onion_webdav_write_response(void *data, const char *buffer, int length){
+	onion_webdav_output *out=data;
+	if (out->copy){
+		if (onion_block_size(out->copy)+length>out->max_size){
+			onion_block_free(out->copy);
+			out->copy=NULL;
+		}
+		else
+			onion_block_add_data(out->copy, buffer, length);
 	}
-	return data;
+	if (onion_response_write(out->res, buffer, length)<0)
+		return -1;
+	return length;
 }
 
 /**
  * @short Handles a propfind
  * 
- * @param path the shared path.
+ * The multistatus is written to the response as it is produced, with chunked encoding, so big directories,
+ * and whole trees with Depth: infinity, go out without being kept in memory.
+ * 
+ * If there is a cache, answers of collections are kept, with an ETag, and the next same propfind gets the 
+ * kept one, or a 304 if it has If-None-Match with that ETag, until something changes there.
  */
 onion_connection_status onion_webdav_propfind(const char *filename, onion_webdav *wd, onion_request* req, onion_response* res){
 	// Prepare the basepath, necesary for props.
@@ -513,46 +898,120 @@ onion_connection_status onion_webdav_propfind(const char *filename, onion_webdav
 	const char *fullpath=onion_request_get_fullpath(req);
 	pathlen=(current_path-fullpath);
 	basepath=alloca(pathlen+1);
-	memcpy(basepath, fullpath, pathlen+1);
-	ONION_DEBUG0("Pathbase initial <%s> %d", basepath, pathlen); 
-	while(basepath[pathlen]=='/')
+	memcpy(basepath, fullpath, pathlen);
+	ONION_DEBUG0("Pathbase initial <%.*s> %d", pathlen, basepath, pathlen); 
+	while(pathlen>0 && basepath[pathlen-1]=='/')
 		pathlen--;
-	basepath[pathlen+1]=0;
+	basepath[pathlen]=0;
 				 
 	ONION_DEBUG0("PROPFIND; pathbase %s", basepath);
 	int depth;
 	{
 		const char *depths=onion_request_get_header(req, "Depth");
-		if (!depths){
-			ONION_ERROR("Missing Depth header on webdav request");
-			return OCS_INTERNAL_ERROR;
-		}
-		if (strcmp(depths,"infinity")==0){
-			ONION_ERROR("Infinity depth not supported yet.");
-			return OCS_INTERNAL_ERROR;
-		}
-		depth=atoi(depths);
+		if (!depths || strcmp(depths,"infinity")==0) // No header is infinity, RFC 4918 9.1
+			depth=ONION_WEBDAV_MAX_DEPTH;
+		else
+			depth=atoi(depths);
 	}
 
 	int props=onion_webdav_parse_propfind(onion_request_get_data(req));
 	ONION_DEBUG("Asking for props %08X, depth %d", props, depth);
 	
-	onion_block *block=onion_webdav_write_propfind(basepath, filename, onion_request_get_path(req), depth, props);
+	onion_webdav_walk walk;
+	memset(&walk, 0, sizeof(walk));
+	walk.props=props;
+	char *key=NULL;
+	unsigned long changes=0;
+	char etag[48];
+	if (wd->cache){
+		size_t l=strlen(fullpath)+32;
+		key=malloc(l);
+		snprintf(key, l, "%d %d %s", depth, props, fullpath);
+		onion_webdav_cache_normalize(key);
+		onion_webdav_cache_entry *e=onion_webdav_cache_get(wd->cache, key, &changes);
+		if (e){
+			free(key);
+			return onion_webdav_cache_answer(wd->cache, e, req, res);
+		}
+		onion_webdav_href_push(&walk.path, filename, 0);
+		onion_webdav_cache_normalize(walk.path.data);
+		walk.path.length=strlen(walk.path.data);
+		if (onion_webdav_cache_watch(wd->cache, walk.path.data)==0) // Only collections are kept
+			walk.cache=wd->cache;
+	}
 	
-	if (!block) // No block, resource does not exist
+	struct stat st;
+	if (stat(filename, &st)<0){ // Resource does not exist
+		free(key);
+		free(walk.path.data);
 		return onion_shortcut_response("Not found", HTTP_NOT_FOUND, req, res);
-		
-	ONION_DEBUG0("Printing block %s", onion_block_data(block));
+	}
+	
+	const char *urlpath=current_path;
+	while (*urlpath=='/') // No / at the begining.
+		urlpath++;
+	size_t urlpath_length=strlen(urlpath);
+	while (urlpath_length && urlpath[urlpath_length-1]=='/')
+		urlpath_length--;
+	onion_webdav_href_push(&walk.href, basepath, 0);
+	onion_webdav_href_push(&walk.href, "/", 0);
+	if (urlpath_length){
+		char *name=strndup(urlpath, urlpath_length);
+		onion_webdav_href_push(&walk.href, name, S_ISDIR(st.st_mode));
+		free(name);
+	}
 	
 	onion_response_set_header(res, "Content-Type", "text/xml; charset=\"utf-8\"");
-	onion_response_set_length(res, onion_block_size(block));
 	onion_response_set_code(res, HTTP_MULTI_STATUS);
-	onion_response_write_headers(res);
-	onion_response_flush(res);
 	
-	onion_response_write(res, onion_block_data(block), onion_block_size(block));
+	onion_webdav_output output={ res, NULL, 0 };
+	if (walk.cache){
+		onion_webdav_cache_etag(walk.cache, etag, sizeof(etag));
+		onion_response_set_header(res, "ETag", etag);
+		output.copy=onion_block_new();
+		output.max_size=walk.cache->max_memory;
+	}
+	xmlOutputBufferPtr out=xmlOutputBufferCreateIO(onion_webdav_write_response, NULL, &output, NULL);
+	walk.writer=out ? xmlNewTextWriter(out) : NULL;
+	if (!walk.writer){
+		ONION_ERROR("Error creating the xml writer");
+		if (out)
+			xmlOutputBufferClose(out);
+		if (output.copy)
+			onion_block_free(output.copy);
+		free(key);
+		free(walk.href.data);
+		free(walk.path.data);
+		return OCS_INTERNAL_ERROR;
+	}
+	xmlTextWriterStartDocument(walk.writer, NULL, "utf-8", NULL);
+	xmlTextWriterStartElement(walk.writer, BAD_CAST "D:multistatus");
+		xmlTextWriterWriteAttribute(walk.writer, BAD_CAST "xmlns:D" ,BAD_CAST "DAV:");
+			onion_webdav_write_props(walk.writer, walk.href.data, &st, props);
+			if (depth>0 && S_ISDIR(st.st_mode)){
+				ONION_DEBUG("Get also all files");
+				int fd=open(filename, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+				if (fd<0){
+					ONION_ERROR("Error opening dir %s to check files on it", filename);
+					walk.uncacheable=1;
+				}
+				else
+					onion_webdav_write_dir(&walk, fd, depth);
+			}
+		xmlTextWriterEndElement(walk.writer);
+	xmlTextWriterEndElement(walk.writer);
+	xmlTextWriterEndDocument(walk.writer);
+	xmlFreeTextWriter(walk.writer); // Flushes, and closes out
 	
-	onion_block_free(block);
+	if (output.copy){
+		if (walk.uncacheable)
+			onion_block_free(output.copy);
+		else
+			onion_webdav_cache_add(walk.cache, key, walk.path.data, output.copy, etag, changes);
+	}
+	free(key);
+	free(walk.href.data);
+	free(walk.path.data);
 	
 	return OCS_PROCESSED;
 }
@@ -626,6 +1085,8 @@ onion_connection_status onion_webdav_proppatch(const char *filename, onion_webda
  * @short Frees the webdav data
  */
 void onion_webdav_free(onion_webdav *wd){
+	if (wd->cache)
+		onion_webdav_cache_free(wd->cache);
 	free(wd->path);
 	free(wd);
 	
@@ -706,6 +1167,7 @@ onion_handler *onion_handler_webdav(const char *path, onion_webdav_permissions_c
 	LIBXML_TEST_VERSION
 
 	wd->path=strdup(path);
+	wd->cache=NULL;
 	
 	if (perm)
 		wd->check_permissions=perm;
@@ -715,3 +1177,47 @@ onion_handler *onion_handler_webdav(const char *path, onion_webdav_permissions_c
 	onion_handler *ret=onion_handler_new((void*)onion_webdav_handler, wd, (void*)onion_webdav_free);
 	return ret;
 }
+
+/**
+ * @short Keeps the PROPFIND answers of collections in memory, up to max_memory bytes for all.
+ * 
+ * Clients that poll the same collections get the kept answer, with no directory read nor stat, or a 304 if
+ * they send If-None-Match with its ETag. Each answer is kept until something changes at the collection or
+ * under it, as told by inotify watches of the directories it went through, or by a PUT, DELETE, MOVE or
+ * MKCOL through this handler. The least recently used answers go out first.
+ * 
+ * Must be set before the handler is in use. A max_memory of 0 removes the cache.
+ * 
+ * @returns 0 if set, -1 if there is no inotify, so changes could not be known.
+ */
+int onion_handler_webdav_set_cache(onion_handler *webdav, size_t max_memory){
+	onion_webdav *wd=onion_handler_get_private_data(webdav);
+	if (wd->cache){
+		onion_webdav_cache_free(wd->cache);
+		wd->cache=NULL;
+	}
+	if (max_memory==0)
+		return 0;
+#ifdef __linux__
+	int inotify=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (inotify<0){
+		ONION_ERROR("Could not start inotify for the WebDAV cache: %s", strerror(errno));
+		return -1;
+	}
+	onion_webdav_cache *cache=calloc(1, sizeof(onion_webdav_cache));
+	cache->max_memory=max_memory;
+	cache->entries=onion_dict_new();
+	cache->watches=onion_dict_new();
+	cache->watches_by_wd=onion_dict_new();
+	cache->inotify=inotify;
+	cache->started=time(NULL);
+#ifdef HAVE_PTHREADS
+	pthread_mutex_init(&cache->mutex, NULL);
+#endif
+	wd->cache=cache;
+	return 0;
+#else
+	ONION_ERROR("The WebDAV cache needs inotify");
+	return -1;
+#endif
+}
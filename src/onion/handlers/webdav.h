@@ -34,6 +34,9 @@ typedef int (*onion_webdav_permissions_check)(const char *exported_path, const c
 /// Exports the given path through webdav.
 onion_handler *onion_handler_webdav(const char *path, onion_webdav_permissions_check);
 
+/// Keeps the PROPFIND answers of collections, up to max_memory bytes, until something changes there. -1 if it can not know about changes.
+int onion_handler_webdav_set_cache(onion_handler *webdav, size_t max_memory);
+
 /// Default permission checker
 int onion_webdav_default_check_permissions(const char *exported_path, const char *file, onion_request *req);
 
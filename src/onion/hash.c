@@ -0,0 +1,528 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <string.h>
+
+#include "hash.h"
+
+/**
+ * @short SHA-1, SHA-256, HMAC-SHA256 and xxHash64, with no external library.
+ *
+ * The SHA compress functions use the SHA extensions of x86 or ARMv8 when the CPU has them, checked
+ * once at the first use, and else the plain C code.
+ */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define ONION_HASH_X86
+#elif defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define ONION_HASH_ARM
+#endif
+
+/// Compresses nblocks blocks of 64 bytes into the state.
+typedef void (*onion_sha1_blocks_f)(uint32_t h[5], const unsigned char *data, size_t nblocks);
+typedef void (*onion_sha256_blocks_f)(uint32_t h[8], const unsigned char *data, size_t nblocks);
+
+static const uint32_t onion_sha256_k[64]={
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ONION_ROTL32(x, n) (((x)<<(n)) | ((x)>>(32-(n))))
+#define ONION_ROTR32(x, n) (((x)>>(n)) | ((x)<<(32-(n))))
+
+static inline uint32_t onion_hash_be32(const unsigned char *p){
+	return ((uint32_t)p[0]<<24) | ((uint32_t)p[1]<<16) | ((uint32_t)p[2]<<8) | p[3];
+}
+
+static void onion_sha1_blocks_c(uint32_t h[5], const unsigned char *data, size_t nblocks){
+	for (;nblocks--;data+=64){
+		uint32_t w[80];
+		int i;
+		for (i=0;i<16;i++)
+			w[i]=onion_hash_be32(&data[i*4]);
+		for (;i<80;i++)
+			w[i]=ONION_ROTL32(w[i-3]^w[i-8]^w[i-14]^w[i-16], 1);
+		uint32_t a=h[0], b=h[1], c=h[2], d=h[3], e=h[4];
+		for (i=0;i<80;i++){
+			uint32_t f, k;
+			if (i<20){
+				f=(b&c)|(~b&d);
+				k=0x5A827999;
+			}
+			else if (i<40){
+				f=b^c^d;
+				k=0x6ED9EBA1;
+			}
+			else if (i<60){
+				f=(b&c)|(b&d)|(c&d);
+				k=0x8F1BBCDC;
+			}
+			else{
+				f=b^c^d;
+				k=0xCA62C1D6;
+			}
+			uint32_t t=ONION_ROTL32(a, 5)+f+e+k+w[i];
+			e=d;
+			d=c;
+			c=ONION_ROTL32(b, 30);
+			b=a;
+			a=t;
+		}
+		h[0]+=a;
+		h[1]+=b;
+		h[2]+=c;
+		h[3]+=d;
+		h[4]+=e;
+	}
+}
+
+static void onion_sha256_blocks_c(uint32_t h[8], const unsigned char *data, size_t nblocks){
+	for (;nblocks--;data+=64){
+		uint32_t w[64];
+		int i;
+		for (i=0;i<16;i++)
+			w[i]=onion_hash_be32(&data[i*4]);
+		for (;i<64;i++){
+			uint32_t s0=ONION_ROTR32(w[i-15], 7)^ONION_ROTR32(w[i-15], 18)^(w[i-15]>>3);
+			uint32_t s1=ONION_ROTR32(w[i-2], 17)^ONION_ROTR32(w[i-2], 19)^(w[i-2]>>10);
+			w[i]=w[i-16]+s0+w[i-7]+s1;
+		}
+		uint32_t a=h[0], b=h[1], c=h[2], d=h[3], e=h[4], f=h[5], g=h[6], hh=h[7];
+		for (i=0;i<64;i++){
+			uint32_t t1=hh+(ONION_ROTR32(e, 6)^ONION_ROTR32(e, 11)^ONION_ROTR32(e, 25))+((e&f)^(~e&g))+onion_sha256_k[i]+w[i];
+			uint32_t t2=(ONION_ROTR32(a, 2)^ONION_ROTR32(a, 13)^ONION_ROTR32(a, 22))+((a&b)^(a&c)^(b&c));
+			hh=g;
+			g=f;
+			f=e;
+			e=d+t1;
+			d=c;
+			c=b;
+			b=a;
+			a=t1+t2;
+		}
+		h[0]+=a;
+		h[1]+=b;
+		h[2]+=c;
+		h[3]+=d;
+		h[4]+=e;
+		h[5]+=f;
+		h[6]+=g;
+		h[7]+=hh;
+	}
+}
+
+#ifdef ONION_HASH_X86
+#define ONION_HASH_SHANI __attribute__((target("sha,sse4.1,ssse3")))
+
+/// 4 rounds of SHA-1 with the function f, with w as the next 4 words of the schedule.
+#define ONION_SHA1_SHANI_ROUNDS(f, w) \
+	e=_mm_sha1nexte_epu32(prev, w); \
+	prev=abcd; \
+	abcd=_mm_sha1rnds4_epu32(abcd, e, f)
+
+/// Next 4 words of the schedule, from the 4 previous groups at m, at m[i%4].
+#define ONION_SHA1_SHANI_NEXT(m, i) \
+	m[(i)&3]=_mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(m[(i)&3], m[((i)+1)&3]), m[((i)+2)&3]), m[((i)+3)&3])
+
+ONION_HASH_SHANI
+static void onion_sha1_blocks_shani(uint32_t h[5], const unsigned char *data, size_t nblocks){
+	const __m128i mask=_mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd=_mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)h), 0x1B);
+	__m128i e0=_mm_set_epi32(h[4], 0, 0, 0);
+	for (;nblocks--;data+=64){
+		__m128i abcd_save=abcd, e0_save=e0, e, prev, m[4];
+		int i;
+		for (i=0;i<4;i++)
+			m[i]=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&data[i*16]), mask);
+		e=_mm_add_epi32(e0, m[0]);
+		prev=abcd;
+		abcd=_mm_sha1rnds4_epu32(abcd, e, 0);
+		for (i=1;i<5;i++){
+			if (i>=4)
+				ONION_SHA1_SHANI_NEXT(m, i);
+			ONION_SHA1_SHANI_ROUNDS(0, m[i&3]);
+		}
+		for (;i<10;i++){
+			ONION_SHA1_SHANI_NEXT(m, i);
+			ONION_SHA1_SHANI_ROUNDS(1, m[i&3]);
+		}
+		for (;i<15;i++){
+			ONION_SHA1_SHANI_NEXT(m, i);
+			ONION_SHA1_SHANI_ROUNDS(2, m[i&3]);
+		}
+		for (;i<20;i++){
+			ONION_SHA1_SHANI_NEXT(m, i);
+			ONION_SHA1_SHANI_ROUNDS(3, m[i&3]);
+		}
+		e0=_mm_sha1nexte_epu32(prev, e0_save);
+		abcd=_mm_add_epi32(abcd, abcd_save);
+	}
+	_mm_storeu_si128((__m128i*)h, _mm_shuffle_epi32(abcd, 0x1B));
+	h[4]=_mm_extract_epi32(e0, 3);
+}
+
+ONION_HASH_SHANI
+static void onion_sha256_blocks_shani(uint32_t h[8], const unsigned char *data, size_t nblocks){
+	const __m128i mask=_mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i tmp=_mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&h[0]), 0xB1); // CDAB
+	__m128i state1=_mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&h[4]), 0x1B); // EFGH
+	__m128i state0=_mm_alignr_epi8(tmp, state1, 8); // ABEF
+	state1=_mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+	for (;nblocks--;data+=64){
+		__m128i abef_save=state0, cdgh_save=state1, m[4];
+		int i;
+		for (i=0;i<16;i++){
+			if (i<4)
+				m[i]=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&data[i*16]), mask);
+			else
+				m[i&3]=_mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m[i&3], m[(i+1)&3]),
+				                                          _mm_alignr_epi8(m[(i+3)&3], m[(i+2)&3], 4)), m[(i+3)&3]);
+			__m128i msg=_mm_add_epi32(m[i&3], _mm_loadu_si128((const __m128i*)&onion_sha256_k[i*4]));
+			state1=_mm_sha256rnds2_epu32(state1, state0, msg);
+			state0=_mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+		}
+		state0=_mm_add_epi32(state0, abef_save);
+		state1=_mm_add_epi32(state1, cdgh_save);
+	}
+	tmp=_mm_shuffle_epi32(state0, 0x1B); // FEBA
+	state1=_mm_shuffle_epi32(state1, 0xB1); // DCHG
+	_mm_storeu_si128((__m128i*)&h[0], _mm_blend_epi16(tmp, state1, 0xF0)); // DCBA
+	_mm_storeu_si128((__m128i*)&h[4], _mm_alignr_epi8(state1, tmp, 8)); // HGFE
+}
+#endif
+
+#ifdef ONION_HASH_ARM
+#define ONION_HASH_ARMCE __attribute__((target("+crypto")))
+
+ONION_HASH_ARMCE
+static void onion_sha1_blocks_arm(uint32_t h[5], const unsigned char *data, size_t nblocks){
+	static const uint32_t k[4]={ 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+	uint32x4_t abcd=vld1q_u32(h);
+	uint32_t e0=h[4];
+	for (;nblocks--;data+=64){
+		uint32x4_t abcd_save=abcd, m[4];
+		uint32_t e=e0;
+		int i;
+		for (i=0;i<4;i++)
+			m[i]=vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(&data[i*16])));
+		for (i=0;i<20;i++){
+			if (i>=4)
+				m[i&3]=vsha1su1q_u32(vsha1su0q_u32(m[i&3], m[(i+1)&3], m[(i+2)&3]), m[(i+3)&3]);
+			uint32x4_t wk=vaddq_u32(m[i&3], vdupq_n_u32(k[i/5]));
+			uint32_t next=vsha1h_u32(vgetq_lane_u32(abcd, 0));
+			if (i<5)
+				abcd=vsha1cq_u32(abcd, e, wk);
+			else if (i<10 || i>=15)
+				abcd=vsha1pq_u32(abcd, e, wk);
+			else
+				abcd=vsha1mq_u32(abcd, e, wk);
+			e=next;
+		}
+		e0+=e;
+		abcd=vaddq_u32(abcd, abcd_save);
+	}
+	vst1q_u32(h, abcd);
+	h[4]=e0;
+}
+
+ONION_HASH_ARMCE
+static void onion_sha256_blocks_arm(uint32_t h[8], const unsigned char *data, size_t nblocks){
+	uint32x4_t state0=vld1q_u32(&h[0]), state1=vld1q_u32(&h[4]);
+	for (;nblocks--;data+=64){
+		uint32x4_t state0_save=state0, state1_save=state1, m[4];
+		int i;
+		for (i=0;i<16;i++){
+			if (i<4)
+				m[i]=vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(&data[i*16])));
+			else
+				m[i&3]=vsha256su1q_u32(vsha256su0q_u32(m[i&3], m[(i+1)&3]), m[(i+2)&3], m[(i+3)&3]);
+			uint32x4_t wk=vaddq_u32(m[i&3], vld1q_u32(&onion_sha256_k[i*4]));
+			uint32x4_t abcd=state0;
+			state0=vsha256hq_u32(state0, state1, wk);
+			state1=vsha256h2q_u32(state1, abcd, wk);
+		}
+		state0=vaddq_u32(state0, state0_save);
+		state1=vaddq_u32(state1, state1_save);
+	}
+	vst1q_u32(&h[0], state0);
+	vst1q_u32(&h[4], state1);
+}
+#endif
+
+static onion_sha1_blocks_f onion_sha1_blocks=NULL;
+static onion_sha256_blocks_f onion_sha256_blocks=NULL;
+
+/// Picks the compress functions for this CPU, once.
+static void onion_hash_dispatch(){
+	onion_sha1_blocks_f sha1=onion_sha1_blocks_c;
+	onion_sha256_blocks_f sha256=onion_sha256_blocks_c;
+#if defined(ONION_HASH_X86)
+	unsigned int eax, ebx, ecx, edx;
+	if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("ssse3") &&
+	    __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx&(1<<29))){
+		sha1=onion_sha1_blocks_shani;
+		sha256=onion_sha256_blocks_shani;
+	}
+#elif defined(ONION_HASH_ARM)
+	unsigned long hwcap=getauxval(AT_HWCAP);
+	if (hwcap&HWCAP_SHA1)
+		sha1=onion_sha1_blocks_arm;
+	if (hwcap&HWCAP_SHA2)
+		sha256=onion_sha256_blocks_arm;
+#endif
+	onion_sha1_blocks=sha1;
+	onion_sha256_blocks=sha256;
+}
+
+/**
+ * @short Whether SHA uses the instructions of the CPU for it, if it has them.
+ *
+ * On by default. Off is the plain C code, to compare them.
+ */
+void onion_hash_use_hw(int use){
+	onion_hash_dispatch();
+	if (!use){
+		onion_sha1_blocks=onion_sha1_blocks_c;
+		onion_sha256_blocks=onion_sha256_blocks_c;
+	}
+}
+
+/// Adds data to a SHA-1 or SHA-256 state, by blocks of 64 bytes. Both keep the length and buffer alike.
+#define ONION_SHA_UPDATE(state, blocks, data, length) do{ \
+	const unsigned char *p=(const unsigned char*)(data); \
+	size_t l=(length), used=(state)->length&63; \
+	(state)->length+=l; \
+	if (used){ \
+		size_t n=64-used; \
+		if (n>l) \
+			n=l; \
+		memcpy(&(state)->buffer[used], p, n); \
+		p+=n; \
+		l-=n; \
+		if (used+n<64) \
+			break; \
+		blocks((state)->h, (state)->buffer, 1); \
+	} \
+	if (l>=64){ \
+		blocks((state)->h, p, l/64); \
+		p+=l&~(size_t)63; \
+		l&=63; \
+	} \
+	memcpy((state)->buffer, p, l); \
+}while(0)
+
+/// Pads the last block with the length in bits, and compresses it.
+#define ONION_SHA_PAD(state, blocks) do{ \
+	size_t used=(state)->length&63; \
+	uint64_t bits=(state)->length*8; \
+	(state)->buffer[used++]=0x80; \
+	if (used>56){ \
+		memset(&(state)->buffer[used], 0, 64-used); \
+		blocks((state)->h, (state)->buffer, 1); \
+		used=0; \
+	} \
+	memset(&(state)->buffer[used], 0, 56-used); \
+	int i; \
+	for (i=0;i<8;i++) \
+		(state)->buffer[56+i]=bits>>(56-i*8); \
+	blocks((state)->h, (state)->buffer, 1); \
+}while(0)
+
+/// Starts a SHA-1
+void onion_sha1_init(onion_sha1_state *state){
+	if (!onion_sha1_blocks)
+		onion_hash_dispatch();
+	static const uint32_t h[5]={ 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	memcpy(state->h, h, sizeof(h));
+	state->length=0;
+}
+
+/// Adds length bytes of data to the SHA-1
+void onion_sha1_update(onion_sha1_state *state, const void *data, size_t length){
+	ONION_SHA_UPDATE(state, onion_sha1_blocks, data, length);
+}
+
+/// Ends the SHA-1, and writes its ONION_SHA1_LENGTH bytes at result
+void onion_sha1_final(onion_sha1_state *state, char *result){
+	ONION_SHA_PAD(state, onion_sha1_blocks);
+	int i;
+	for (i=0;i<ONION_SHA1_LENGTH;i++)
+		result[i]=state->h[i/4]>>(24-(i%4)*8);
+}
+
+/// Starts a SHA-256
+void onion_sha256_init(onion_sha256_state *state){
+	if (!onion_sha256_blocks)
+		onion_hash_dispatch();
+	static const uint32_t h[8]={ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	memcpy(state->h, h, sizeof(h));
+	state->length=0;
+}
+
+/// Adds length bytes of data to the SHA-256
+void onion_sha256_update(onion_sha256_state *state, const void *data, size_t length){
+	ONION_SHA_UPDATE(state, onion_sha256_blocks, data, length);
+}
+
+/// Ends the SHA-256, and writes its ONION_SHA256_LENGTH bytes at result
+void onion_sha256_final(onion_sha256_state *state, char *result){
+	ONION_SHA_PAD(state, onion_sha256_blocks);
+	int i;
+	for (i=0;i<ONION_SHA256_LENGTH;i++)
+		result[i]=state->h[i/4]>>(24-(i%4)*8);
+}
+
+/// SHA-256 of length bytes of data, ONION_SHA256_LENGTH bytes at result
+void onion_sha256(const char *data, size_t length, char *result){
+	onion_sha256_state state;
+	onion_sha256_init(&state);
+	onion_sha256_update(&state, data, length);
+	onion_sha256_final(&state, result);
+}
+
+/**
+ * @short HMAC-SHA256 of data with key (RFC 2104), ONION_SHA256_LENGTH bytes at result.
+ *
+ * result may be key or data.
+ */
+void onion_hmac_sha256(const char *key, size_t key_length, const char *data, size_t length, char *result){
+	unsigned char pad[64];
+	char inner[ONION_SHA256_LENGTH];
+	memset(pad, 0, sizeof(pad));
+	if (key_length>sizeof(pad))
+		onion_sha256(key, key_length, (char*)pad);
+	else
+		memcpy(pad, key, key_length);
+	int i;
+	for (i=0;i<64;i++)
+		pad[i]^=0x36;
+	onion_sha256_state state;
+	onion_sha256_init(&state);
+	onion_sha256_update(&state, pad, sizeof(pad));
+	onion_sha256_update(&state, data, length);
+	onion_sha256_final(&state, inner);
+	for (i=0;i<64;i++)
+		pad[i]^=0x36^0x5c;
+	onion_sha256_init(&state);
+	onion_sha256_update(&state, pad, sizeof(pad));
+	onion_sha256_update(&state, inner, sizeof(inner));
+	onion_sha256_final(&state, result);
+}
+
+#define ONION_XXH_P1 11400714785074694791ULL
+#define ONION_XXH_P2 14029467366897019727ULL
+#define ONION_XXH_P3 1609587929392839161ULL
+#define ONION_XXH_P4 9650029242287828579ULL
+#define ONION_XXH_P5 2870177450012600261ULL
+#define ONION_ROTL64(x, n) (((x)<<(n)) | ((x)>>(64-(n))))
+
+static inline uint64_t onion_hash_le64(const unsigned char *p){
+	uint64_t v;
+	memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+	v=__builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline uint32_t onion_hash_le32(const unsigned char *p){
+	uint32_t v;
+	memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+	v=__builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static inline uint64_t onion_xxh64_round(uint64_t acc, uint64_t input){
+	acc+=input*ONION_XXH_P2;
+	acc=ONION_ROTL64(acc, 31);
+	return acc*ONION_XXH_P1;
+}
+
+static inline uint64_t onion_xxh64_merge(uint64_t acc, uint64_t v){
+	acc^=onion_xxh64_round(0, v);
+	return acc*ONION_XXH_P1+ONION_XXH_P4;
+}
+
+/**
+ * @short Fast, non cryptographic, 64 bit hash of data: xxHash64, same values as the reference one.
+ *
+ * Good for ETags of generated content and for hash tables, but not where someone could search for
+ * collisions on purpose, unless the seed is secret.
+ */
+uint64_t onion_hash64(const void *data, size_t length, uint64_t seed){
+	const unsigned char *p=data, *end=p+length;
+	uint64_t h;
+	if (length>=32){
+		uint64_t v1=seed+ONION_XXH_P1+ONION_XXH_P2, v2=seed+ONION_XXH_P2, v3=seed, v4=seed-ONION_XXH_P1;
+		const unsigned char *limit=end-32;
+		do{
+			v1=onion_xxh64_round(v1, onion_hash_le64(p));
+			v2=onion_xxh64_round(v2, onion_hash_le64(p+8));
+			v3=onion_xxh64_round(v3, onion_hash_le64(p+16));
+			v4=onion_xxh64_round(v4, onion_hash_le64(p+24));
+			p+=32;
+		}while (p<=limit);
+		h=ONION_ROTL64(v1, 1)+ONION_ROTL64(v2, 7)+ONION_ROTL64(v3, 12)+ONION_ROTL64(v4, 18);
+		h=onion_xxh64_merge(h, v1);
+		h=onion_xxh64_merge(h, v2);
+		h=onion_xxh64_merge(h, v3);
+		h=onion_xxh64_merge(h, v4);
+	}
+	else
+		h=seed+ONION_XXH_P5;
+	h+=length;
+	for (;p+8<=end;p+=8){
+		h^=onion_xxh64_round(0, onion_hash_le64(p));
+		h=ONION_ROTL64(h, 27)*ONION_XXH_P1+ONION_XXH_P4;
+	}
+	if (p+4<=end){
+		h^=(uint64_t)onion_hash_le32(p)*ONION_XXH_P1;
+		h=ONION_ROTL64(h, 23)*ONION_XXH_P2+ONION_XXH_P3;
+		p+=4;
+	}
+	for (;p<end;p++){
+		h^=(*p)*ONION_XXH_P5;
+		h=ONION_ROTL64(h, 11)*ONION_XXH_P1;
+	}
+	h^=h>>33;
+	h*=ONION_XXH_P2;
+	h^=h>>29;
+	h*=ONION_XXH_P3;
+	h^=h>>32;
+	return h;
+}
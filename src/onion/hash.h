@@ -0,0 +1,85 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_HASH_H
+#define ONION_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/// Length of a SHA-1 digest
+#define ONION_SHA1_LENGTH 20
+/// Length of a SHA-256 digest
+#define ONION_SHA256_LENGTH 32
+
+/// State of a SHA-1 in progress. @see onion_sha1_init
+typedef struct onion_sha1_state_t{
+	uint32_t h[5];
+	uint64_t length;          ///< Bytes so far
+	unsigned char buffer[64]; ///< Of a block not full yet
+}onion_sha1_state;
+
+/// State of a SHA-256 in progress. @see onion_sha256_init
+typedef struct onion_sha256_state_t{
+	uint32_t h[8];
+	uint64_t length;
+	unsigned char buffer[64];
+}onion_sha256_state;
+
+/// Starts a SHA-1
+void onion_sha1_init(onion_sha1_state *state);
+/// Adds length bytes of data to the SHA-1
+void onion_sha1_update(onion_sha1_state *state, const void *data, size_t length);
+/// Ends the SHA-1, and writes its ONION_SHA1_LENGTH bytes at result
+void onion_sha1_final(onion_sha1_state *state, char *result);
+
+/// Starts a SHA-256
+void onion_sha256_init(onion_sha256_state *state);
+/// Adds length bytes of data to the SHA-256
+void onion_sha256_update(onion_sha256_state *state, const void *data, size_t length);
+/// Ends the SHA-256, and writes its ONION_SHA256_LENGTH bytes at result
+void onion_sha256_final(onion_sha256_state *state, char *result);
+
+/// SHA-256 of length bytes of data, ONION_SHA256_LENGTH bytes at result
+void onion_sha256(const char *data, size_t length, char *result);
+
+/// HMAC-SHA256 of data with key, ONION_SHA256_LENGTH bytes at result
+void onion_hmac_sha256(const char *key, size_t key_length, const char *data, size_t length, char *result);
+
+/// Fast, non cryptographic, 64 bit hash (xxHash64), for ETags and hash tables.
+uint64_t onion_hash64(const void *data, size_t length, uint64_t seed);
+
+/// Whether SHA uses the CPU instructions for it, if any. On by default.
+void onion_hash_use_hw(int use);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,564 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "hpack.h"
+#include "block.h"
+#include "log.h"
+
+/// @{ @name Tables of RFC 7541
+
+struct onion_hpack_static_t{
+	const char *name;
+	const char *value;
+};
+
+/// Static table of RFC 7541 Appendix A. Index 1 is the first.
+static const struct onion_hpack_static_t hpack_static_table[61]={
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+/// Huffman codes of RFC 7541 Appendix B, by symbol. 256 is EOS.
+static const uint32_t hpack_huffman_codes[257]={
+	0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+	0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+	0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+	0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+	0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+	0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+	0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+	0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+	0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+	0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+	0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+	0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+	0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+	0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+	0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+	0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+	0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+	0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+	0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+	0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+	0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+	0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+	0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+	0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+	0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+	0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+	0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+	0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+	0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+	0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+	0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+	0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+	0x3fffffff,
+};
+
+/// Bit length of each Huffman code.
+static const uint8_t hpack_huffman_lengths[257]={
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+
+/// Huffman decoding tree, as [node][bit]. Leaves are 0x8000|symbol, else the next node.
+static const uint16_t hpack_huffman_tree[256][2]={
+	{0x42,0x1}, {0x5d,0x2}, {0x68,0x3}, {0x77,0x4}, {0x90,0x5}, {0x4b,0x6}, {0x7b,0x7}, {0x47,0x8},
+	{0x4d,0x9}, {0x49,0xa}, {0xb,0xd}, {0xc,0x66}, {0x8000,0x8024}, {0x7f,0xe}, {0x80,0xf}, {0x62,0x10},
+	{0x807b,0x11}, {0x7c,0x12}, {0x96,0x13}, {0x14,0x19}, {0xc7,0x15}, {0xd8,0x16}, {0x17,0xa2}, {0x18,0xa1},
+	{0x8001,0x8087}, {0xa7,0x1a}, {0x29,0x1b}, {0xbf,0x1c}, {0xd3,0x1d}, {0xe5,0x1e}, {0x1f,0x2d}, {0x20,0x26},
+	{0x21,0x23}, {0x80fe,0x22}, {0x8002,0x8003}, {0x24,0x25}, {0x8004,0x8005}, {0x8006,0x8007}, {0x27,0x34}, {0x28,0x33},
+	{0x8008,0x800b}, {0xd0,0x2a}, {0x2b,0xa5}, {0x80ef,0x2c}, {0x8009,0x808e}, {0x37,0x2e}, {0x3f,0x2f}, {0x93,0x30},
+	{0x80f9,0x31}, {0x32,0x3b}, {0x800a,0x800d}, {0x800c,0x800e}, {0x35,0x36}, {0x800f,0x8010}, {0x8011,0x8012}, {0x38,0x3c},
+	{0x39,0x3a}, {0x8013,0x8014}, {0x8015,0x8017}, {0x8016,0x8100}, {0x3d,0x3e}, {0x8018,0x8019}, {0x801a,0x801b}, {0x40,0x41},
+	{0x801c,0x801d}, {0x801e,0x801f}, {0x55,0x43}, {0x44,0x52}, {0x8f,0x45}, {0x46,0x51}, {0x8020,0x8025}, {0x48,0x4f},
+	{0x8021,0x8022}, {0x807c,0x4a}, {0x8023,0x803e}, {0x4c,0x50}, {0x8026,0x802a}, {0x803f,0x4e}, {0x8027,0x802b}, {0x8028,0x8029},
+	{0x802c,0x803b}, {0x802d,0x802e}, {0x53,0x5a}, {0x54,0x59}, {0x802f,0x8033}, {0x56,0x82}, {0x57,0x58}, {0x8030,0x8031},
+	{0x8032,0x8061}, {0x8034,0x8035}, {0x5b,0x5c}, {0x8036,0x8037}, {0x8038,0x8039}, {0x63,0x5e}, {0x8a,0x5f}, {0x8e,0x60},
+	{0x61,0x67}, {0x803a,0x8042}, {0x803c,0x8060}, {0x64,0x84}, {0x65,0x81}, {0x803d,0x8041}, {0x8040,0x805b}, {0x8043,0x8044},
+	{0x69,0x70}, {0x6a,0x6d}, {0x6b,0x6c}, {0x8045,0x8046}, {0x8047,0x8048}, {0x6e,0x6f}, {0x8049,0x804a}, {0x804b,0x804c},
+	{0x71,0x74}, {0x72,0x73}, {0x804d,0x804e}, {0x804f,0x8050}, {0x75,0x76}, {0x8051,0x8052}, {0x8053,0x8054}, {0x78,0x88},
+	{0x79,0x7a}, {0x8055,0x8056}, {0x8057,0x8059}, {0x8058,0x805a}, {0x7d,0x9b}, {0x7e,0x94}, {0x805c,0x80c3}, {0x805d,0x807e},
+	{0x805e,0x807d}, {0x805f,0x8062}, {0x83,0x87}, {0x8063,0x8065}, {0x85,0x86}, {0x8064,0x8066}, {0x8067,0x8068}, {0x8069,0x806f},
+	{0x89,0x8d}, {0x806a,0x806b}, {0x8b,0x8c}, {0x806c,0x806d}, {0x806e,0x8070}, {0x8071,0x8076}, {0x8072,0x8075}, {0x8073,0x8074},
+	{0x91,0x92}, {0x8077,0x8078}, {0x8079,0x807a}, {0x807f,0x80dc}, {0x80d0,0x95}, {0x8080,0x8082}, {0xc4,0x97}, {0x98,0xb2},
+	{0x99,0x9e}, {0x80e6,0x9a}, {0x8081,0x8084}, {0x9c,0xaf}, {0x9d,0xcc}, {0x8083,0x80a2}, {0x9f,0xa0}, {0x8085,0x8086},
+	{0x8088,0x8092}, {0x8089,0x808a}, {0xa3,0xa4}, {0x808b,0x808c}, {0x808d,0x808f}, {0xa6,0xab}, {0x8090,0x8091}, {0xa8,0xb9},
+	{0xa9,0xad}, {0xaa,0xac}, {0x8093,0x8095}, {0x8094,0x809f}, {0x8096,0x8097}, {0xae,0xb5}, {0x8098,0x809b}, {0xf1,0xb0},
+	{0xb1,0xbc}, {0x8099,0x80a1}, {0xb3,0xb7}, {0xb4,0xb6}, {0x809a,0x809c}, {0x809d,0x809e}, {0x80a0,0x80a3}, {0xb8,0xbe},
+	{0x80a4,0x80a9}, {0xba,0xc2}, {0xbb,0xbd}, {0x80a5,0x80a6}, {0x80a7,0x80ac}, {0x80a8,0x80ae}, {0x80aa,0x80ad}, {0xc0,0xda},
+	{0xc1,0xea}, {0x80ab,0x80ce}, {0xc3,0xcb}, {0x80af,0x80b4}, {0xc5,0xeb}, {0xc6,0xca}, {0x80b0,0x80b1}, {0xc8,0xce},
+	{0xc9,0xcd}, {0x80b2,0x80b5}, {0x80b3,0x80d1}, {0x80b6,0x80b7}, {0x80b8,0x80c2}, {0x80b9,0x80ba}, {0xcf,0xd2}, {0x80bb,0x80bd},
+	{0xd1,0xd7}, {0x80bc,0x80bf}, {0x80be,0x80c4}, {0xd4,0xe0}, {0xd5,0xde}, {0xd6,0xdd}, {0x80c0,0x80c1}, {0x80c5,0x80e7},
+	{0xd9,0xf3}, {0x80c6,0x80e4}, {0xf5,0xdb}, {0xdc,0xf4}, {0x80c7,0x80cf}, {0x80c8,0x80c9}, {0xdf,0xe4}, {0x80ca,0x80cd},
+	{0xed,0xe1}, {0xf8,0xe2}, {0x80ff,0xe3}, {0x80cb,0x80cc}, {0x80d2,0x80d5}, {0xe6,0xf9}, {0xe7,0xef}, {0xe8,0xe9},
+	{0x80d3,0x80d4}, {0x80d6,0x80dd}, {0x80d7,0x80e1}, {0xec,0xf2}, {0x80d8,0x80d9}, {0xee,0xf6}, {0x80da,0x80db}, {0xf0,0xf7},
+	{0x80de,0x80df}, {0x80e0,0x80e2}, {0x80e3,0x80e5}, {0x80e8,0x80e9}, {0x80ea,0x80eb}, {0x80ec,0x80ed}, {0x80ee,0x80f0}, {0x80f1,0x80f4},
+	{0x80f2,0x80f3}, {0xfa,0xfd}, {0xfb,0xfc}, {0x80f5,0x80f6}, {0x80f7,0x80f8}, {0xfe,0xff}, {0x80fa,0x80fb}, {0x80fc,0x80fd},
+};
+
+/// @}
+
+/// Entries at the static table
+#define HPACK_STATIC_COUNT 61
+/// Overhead of each entry at the table size, RFC 7541 4.1
+#define HPACK_ENTRY_OVERHEAD 32
+
+/// An entry of the dynamic table. At data the name and the value, 0 ended each.
+typedef struct{
+	size_t name_length;
+	size_t value_length;
+	char data[];
+}onion_hpack_entry;
+
+struct onion_hpack_t{
+	onion_hpack_entry **entries; ///< Ring of entries, the newest at first.
+	size_t capacity;             ///< Slots at entries; enough for the limit, as each entry takes at least 32.
+	size_t first;
+	size_t count;
+	size_t size;                 ///< Size of the entries, as defined at RFC 7541 4.1
+	size_t max_size;             ///< Current maximum size, as set by the last size update
+	size_t limit;                ///< Maximum size allowed by the decoder settings
+	int size_update;             ///< When encoding, a size update must be signaled at the next header.
+	char *buffer;                ///< Decoded strings of the current header, when decoding.
+	size_t buffer_size;
+};
+
+/**
+ * @short Creates a HPACK context
+ * 
+ * @param max_size Maximum size of the dynamic table. 4096 is the HTTP/2 default.
+ */
+onion_hpack *onion_hpack_new(size_t max_size){
+	onion_hpack *hpack=calloc(1, sizeof(onion_hpack));
+	hpack->capacity=max_size/HPACK_ENTRY_OVERHEAD+1;
+	hpack->entries=calloc(hpack->capacity, sizeof(onion_hpack_entry*));
+	hpack->max_size=hpack->limit=max_size;
+	return hpack;
+}
+
+/// Frees the HPACK context
+void onion_hpack_free(onion_hpack *hpack){
+	size_t i;
+	for (i=0;i<hpack->count;i++)
+		free(hpack->entries[(hpack->first+i)%hpack->capacity]);
+	free(hpack->entries);
+	free(hpack->buffer);
+	free(hpack);
+}
+
+/// Removes the oldest entries until the table size allows size more.
+static void hpack_evict(onion_hpack *hpack, size_t size){
+	while (hpack->count && hpack->size+size>hpack->max_size){
+		size_t last=(hpack->first+hpack->count-1)%hpack->capacity;
+		onion_hpack_entry *e=hpack->entries[last];
+		hpack->size-=e->name_length+e->value_length+HPACK_ENTRY_OVERHEAD;
+		free(e);
+		hpack->entries[last]=NULL;
+		hpack->count--;
+	}
+}
+
+/// Adds an entry to the dynamic table. The name may be at an entry that is evicted, so it is copied first.
+static void hpack_add(onion_hpack *hpack, const char *name, size_t name_length, const char *value, size_t value_length){
+	size_t size=name_length+value_length+HPACK_ENTRY_OVERHEAD;
+	if (size>hpack->max_size){ // Not an error, just empties the table.
+		hpack_evict(hpack, hpack->max_size+1);
+		return;
+	}
+	onion_hpack_entry *e=malloc(sizeof(onion_hpack_entry)+name_length+value_length+2);
+	e->name_length=name_length;
+	e->value_length=value_length;
+	memcpy(e->data, name, name_length);
+	e->data[name_length]='\0';
+	memcpy(e->data+name_length+1, value, value_length);
+	e->data[name_length+1+value_length]='\0';
+	hpack_evict(hpack, size);
+	hpack->first=(hpack->first+hpack->capacity-1)%hpack->capacity;
+	hpack->entries[hpack->first]=e;
+	hpack->count++;
+	hpack->size+=size;
+}
+
+/// Gets the name and value at that index, static or dynamic. Returns <0 if out of the table.
+static int hpack_get(onion_hpack *hpack, size_t index, const char **name, size_t *name_length, const char **value, size_t *value_length){
+	if (index==0)
+		return -1;
+	if (index<=HPACK_STATIC_COUNT){
+		*name=hpack_static_table[index-1].name;
+		*value=hpack_static_table[index-1].value;
+		*name_length=strlen(*name);
+		*value_length=strlen(*value);
+		return 0;
+	}
+	index-=HPACK_STATIC_COUNT+1;
+	if (index>=hpack->count)
+		return -1;
+	onion_hpack_entry *e=hpack->entries[(hpack->first+index)%hpack->capacity];
+	*name=e->data;
+	*name_length=e->name_length;
+	*value=e->data+e->name_length+1;
+	*value_length=e->value_length;
+	return 0;
+}
+
+/// @{ @name Decoding
+
+/// Decodes an integer with the given prefix bits. Returns <0 if incomplete or too big.
+static int hpack_decode_int(const unsigned char **p, const unsigned char *end, int prefix, size_t *value){
+	if (*p>=end)
+		return -1;
+	size_t max=(1<<prefix)-1;
+	size_t v=*(*p)++ & max;
+	if (v<max){
+		*value=v;
+		return 0;
+	}
+	int shift=0;
+	while (*p<end){
+		unsigned char b=*(*p)++;
+		if (shift>21) // Bigger than any sane length or index
+			return -1;
+		v+=((size_t)(b&0x7f))<<shift;
+		shift+=7;
+		if (!(b&0x80)){
+			*value=v;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/// Huffman decodes into out, that has space for length*8/5 bytes. Returns the decoded length, or <0 on error.
+static ssize_t hpack_huffman_decode(const unsigned char *data, size_t length, char *out){
+	int node=0;
+	int bits=0; // Bits since the last symbol, at most 7 of EOS padding at the end.
+	int ones=1;
+	size_t o=0;
+	size_t i;
+	for (i=0;i<length;i++){
+		int j;
+		for (j=7;j>=0;j--){
+			int b=(data[i]>>j)&1;
+			uint16_t next=hpack_huffman_tree[node][b];
+			bits++;
+			ones&=b;
+			if (next&0x8000){
+				if ((next&0x7FFF)==256) // EOS is an error inside the string
+					return -1;
+				out[o++]=next&0xFF;
+				node=0;
+				bits=0;
+				ones=1;
+			}
+			else
+				node=next;
+		}
+	}
+	if (bits>7 || !ones)
+		return -1;
+	return o;
+}
+
+/// Decodes a string to the end of the decode buffer. Its position and length are returned. <0 on error.
+static int hpack_decode_string(onion_hpack *hpack, const unsigned char **p, const unsigned char *end, size_t *used, size_t *pos, size_t *length){
+	if (*p>=end)
+		return -1;
+	int huffman=**p&0x80;
+	size_t l;
+	if (hpack_decode_int(p, end, 7, &l)<0 || l>(size_t)(end-*p))
+		return -1;
+	size_t need=*used+(huffman ? (l*8)/5+1 : l)+1;
+	if (need>hpack->buffer_size){
+		hpack->buffer_size=need*2;
+		hpack->buffer=realloc(hpack->buffer, hpack->buffer_size);
+	}
+	*pos=*used;
+	if (huffman){
+		ssize_t r=hpack_huffman_decode(*p, l, hpack->buffer+*used);
+		if (r<0)
+			return -1;
+		*length=r;
+	}
+	else{
+		memcpy(hpack->buffer+*used, *p, l);
+		*length=l;
+	}
+	hpack->buffer[*used+*length]='\0';
+	*used+=*length+1;
+	*p+=l;
+	return 0;
+}
+
+/**
+ * @short Decodes a full header block, calling header_f for each header, in order.
+ * 
+ * @returns 0 if ok, <0 on compression error; as the table may be corrupted, the connection must be closed.
+ */
+int onion_hpack_decode(onion_hpack *hpack, const unsigned char *data, size_t length, onion_hpack_header_f header_f, void *header_data){
+	const unsigned char *p=data;
+	const unsigned char *end=data+length;
+	while (p<end){
+		unsigned char b=*p;
+		const char *name, *value;
+		size_t name_length, value_length;
+		size_t index;
+		if (b&0x80){ // Indexed
+			if (hpack_decode_int(&p, end, 7, &index)<0 || hpack_get(hpack, index, &name, &name_length, &value, &value_length)<0)
+				return -1;
+			if (header_f(header_data, name, name_length, value, value_length)<0)
+				return -1;
+			continue;
+		}
+		if ((b&0xE0)==0x20){ // Size update
+			size_t size;
+			if (hpack_decode_int(&p, end, 5, &size)<0 || size>hpack->limit)
+				return -1;
+			hpack->max_size=size;
+			hpack_evict(hpack, 0);
+			continue;
+		}
+		int indexing=b&0x40;
+		if (hpack_decode_int(&p, end, indexing ? 6 : 4, &index)<0)
+			return -1;
+		size_t used=0, name_pos=0, value_pos;
+		if (index){
+			const char *ivalue;
+			size_t ivalue_length;
+			if (hpack_get(hpack, index, &name, &name_length, &ivalue, &ivalue_length)<0)
+				return -1;
+		}
+		else{
+			if (hpack_decode_string(hpack, &p, end, &used, &name_pos, &name_length)<0)
+				return -1;
+		}
+		if (hpack_decode_string(hpack, &p, end, &used, &value_pos, &value_length)<0)
+			return -1;
+		if (!index) // The buffer may have moved
+			name=hpack->buffer+name_pos;
+		value=hpack->buffer+value_pos;
+		if (header_f(header_data, name, name_length, value, value_length)<0)
+			return -1;
+		if (indexing)
+			hpack_add(hpack, name, name_length, value, value_length);
+	}
+	return 0;
+}
+
+/// @}
+
+/// @{ @name Encoding
+
+/// Encodes an integer, with the first bits of the first byte at flags.
+static void hpack_encode_int(onion_block *out, int prefix, unsigned char flags, size_t value){
+	size_t max=(1<<prefix)-1;
+	if (value<max){
+		onion_block_add_char(out, flags|value);
+		return;
+	}
+	onion_block_add_char(out, flags|max);
+	value-=max;
+	while (value>=0x80){
+		onion_block_add_char(out, (value&0x7f)|0x80);
+		value>>=7;
+	}
+	onion_block_add_char(out, value);
+}
+
+/// Encodes a string, Huffman encoded if that is shorter.
+static void hpack_encode_string(onion_block *out, const char *str){
+	size_t l=strlen(str);
+	size_t bits=0;
+	size_t i;
+	for (i=0;i<l;i++)
+		bits+=hpack_huffman_lengths[(unsigned char)str[i]];
+	size_t hl=(bits+7)/8;
+	if (hl>=l){
+		hpack_encode_int(out, 7, 0, l);
+		onion_block_add_data(out, str, l);
+		return;
+	}
+	hpack_encode_int(out, 7, 0x80, hl);
+	uint64_t acc=0;
+	int nacc=0;
+	for (i=0;i<l;i++){
+		unsigned char c=str[i];
+		acc=(acc<<hpack_huffman_lengths[c]) | hpack_huffman_codes[c];
+		nacc+=hpack_huffman_lengths[c];
+		while (nacc>=8){
+			nacc-=8;
+			onion_block_add_char(out, (acc>>nacc)&0xFF);
+		}
+	}
+	if (nacc) // Padded with the start of EOS, all ones.
+		onion_block_add_char(out, ((acc<<(8-nacc)) | (0xFF>>nacc))&0xFF);
+}
+
+/// Headers that change at each response, or are secret, so they are not added to the table.
+static int hpack_not_indexed(const char *name){
+	return strcmp(name, "content-length")==0 || strcmp(name, "set-cookie")==0 || strcmp(name, "authorization")==0;
+}
+
+/**
+ * @short Encodes a header at the end of out.
+ * 
+ * Uses the tables when they have the name, or both name and value, and adds the new headers to the
+ * dynamic table, but for some that change at each response.
+ */
+void onion_hpack_encode(onion_hpack *hpack, onion_block *out, const char *name, const char *value){
+	if (hpack->size_update){
+		hpack_encode_int(out, 5, 0x20, hpack->max_size);
+		hpack->size_update=0;
+	}
+	size_t name_index=0;
+	size_t i;
+	for (i=0;i<HPACK_STATIC_COUNT;i++){
+		if (strcmp(hpack_static_table[i].name, name)==0){
+			if (strcmp(hpack_static_table[i].value, value)==0){
+				hpack_encode_int(out, 7, 0x80, i+1);
+				return;
+			}
+			if (!name_index)
+				name_index=i+1;
+		}
+	}
+	for (i=0;i<hpack->count;i++){
+		onion_hpack_entry *e=hpack->entries[(hpack->first+i)%hpack->capacity];
+		if (strcmp(e->data, name)==0){
+			if (strcmp(e->data+e->name_length+1, value)==0){
+				hpack_encode_int(out, 7, 0x80, HPACK_STATIC_COUNT+1+i);
+				return;
+			}
+			if (!name_index)
+				name_index=HPACK_STATIC_COUNT+1+i;
+		}
+	}
+	int indexing=!hpack_not_indexed(name);
+	if (indexing)
+		hpack_encode_int(out, 6, 0x40, name_index);
+	else
+		hpack_encode_int(out, 4, 0, name_index);
+	if (!name_index)
+		hpack_encode_string(out, name);
+	hpack_encode_string(out, value);
+	if (indexing)
+		hpack_add(hpack, name, strlen(name), value, strlen(value));
+}
+
+/**
+ * @short Sets the maximum table size that the peer decoder allows, from its settings.
+ * 
+ * As the table was created with some size, it never grows over that.
+ */
+void onion_hpack_set_max_size(onion_hpack *hpack, size_t max_size){
+	if (max_size>hpack->limit)
+		max_size=hpack->limit;
+	if (max_size==hpack->max_size)
+		return;
+	hpack->max_size=max_size;
+	hpack_evict(hpack, 0);
+	hpack->size_update=1;
+}
+
+/// @}
@@ -0,0 +1,63 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_HPACK_H
+#define ONION_HPACK_H
+
+#include <stddef.h>
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/**
+ * @short HPACK (RFC 7541) header compression context, for one direction of an HTTP/2 connection.
+ *
+ * Internal. Keeps the dynamic table; one decodes the header blocks from the peer, other encodes 
+ * the ones sent to it.
+ */
+typedef struct onion_hpack_t onion_hpack;
+
+/// Called for each decoded header. Both strings are 0 ended. Returns <0 to stop decoding.
+typedef int (*onion_hpack_header_f)(void *data, const char *name, size_t name_length, const char *value, size_t value_length);
+
+/// Creates a context whose dynamic table may grow up to max_size.
+onion_hpack *onion_hpack_new(size_t max_size);
+/// Frees the context
+void onion_hpack_free(onion_hpack *hpack);
+/// Decodes a full header block. Returns <0 on compression error, and the connection can not be used anymore.
+int onion_hpack_decode(onion_hpack *hpack, const unsigned char *data, size_t length, onion_hpack_header_f header_f, void *header_data);
+/// Encodes a header at the end of out. Names must be lowercase.
+void onion_hpack_encode(onion_hpack *hpack, onion_block *out, const char *name, const char *value);
+/// Sets the maximum table size the peer decoder allows. The change is signaled at the next encode.
+void onion_hpack_set_max_size(onion_hpack *hpack, size_t max_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,18 +23,49 @@
 	library; if not see <http://www.gnu.org/licenses/>.
 	*/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* splice */
+#endif
+
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#endif
 
 #include "types.h"
 #include "http.h"
 #include "types_internal.h"
 #include "listen_point.h"
 #include "request.h"
+#include "poller.h"
+#include "traffic_record.h"
 #include "log.h"
 
 static ssize_t onion_http_read(onion_request *req, char *data, size_t len);
 ssize_t onion_http_write(onion_request *req, const char *data, size_t len);
+ssize_t onion_http_writev(onion_request *req, const struct iovec *iov, int iovcnt);
+static ssize_t onion_http_sendfile(onion_request *req, int fd, off_t *offset, size_t count);
+static ssize_t onion_http_splice(onion_request *req, int fd, size_t count);
 int onion_http_read_ready(onion_request *req);
+static int onion_http_received(onion_request *req, const char *data, size_t len);
+void onion_http2_session_new(onion_request *con); // At http2.c
+int onion_http2_session_read(onion_request *con, const char *data, size_t length); // At http2.c
+int onion_http2_read_ready(onion_request *con); // At http2.c
+size_t onion_request_body_read_space(onion_request *req, char **dest); // At request_parser.c
+onion_connection_status onion_request_body_read_done(onion_request *req, size_t length); // At request_parser.c
+
+/// Start of the HTTP/2 client preface
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+/// Size of each read
+#define ONION_HTTP_READ_SIZE (64*1024)
+/// Max bytes read from a connection at each poller wakeup
+#define ONION_HTTP_READ_BUDGET (256*1024)
 
 /**
  * @struct onion_http_t
@@ -53,12 +84,42 @@ onion_listen_point* onion_http_new()
 	
 	ret->read=onion_http_read;
 	ret->write=onion_http_write;
+	ret->writev=onion_http_writev;
+	ret->sendfile=onion_http_sendfile;
+	ret->splice=onion_http_splice;
 	ret->close=onion_listen_point_request_close_socket;
 	ret->read_ready=onion_http_read_ready;
+	ret->received=onion_http_received;
 	
 	return ret;
 }
 
+/**
+ * @short Creates an HTTP listen point at a unix socket
+ * @memberof onion_http_t
+ * 
+ * For local clients, as a sidecar or a health checker, that so skip the TCP stack and do not run out 
+ * of ports. If the path starts with '@' it is at the Linux abstract namespace, with no file; else a 
+ * stale socket file is replaced when it starts listening, and removed when it stops.
+ * 
+ * Add it with onion_add_listen_point, with NULL hostname and port.
+ */
+onion_listen_point *onion_unix_new(const char *path){
+	onion_listen_point *ret=onion_http_new();
+	ret->path=strdup(path);
+	return ret;
+}
+
+/**
+ * @short Sets the permissions of the socket file of an onion_unix_new listen point.
+ * @memberof onion_http_t
+ * 
+ * Applied when it starts listening. Does not apply at the abstract namespace.
+ */
+void onion_unix_set_mode(onion_listen_point *op, int mode){
+	op->mode=mode;
+}
+
 /**
  * @short Reads data from the http connection
  * @memberof onion_http_t
@@ -67,23 +128,104 @@ static ssize_t onion_http_read(onion_request *con, char *data, size_t len){
 	return read(con->connection.fd, data, len);
 }
 
+/// Whether this data, the first of a connection, is the prior knowledge HTTP/2 client preface.
+static int onion_http_is_preface(onion_request *con, const char *data, size_t len){
+	return con->connection.listen_point->http2 && !con->parser && len>=4 && 
+			memcmp(data, HTTP2_PREFACE, len<sizeof(HTTP2_PREFACE)-1 ? len : sizeof(HTTP2_PREFACE)-1)==0;
+}
+
 /**
  * @short HTTP client has data ready to be readen
  * @memberof onion_http_t
+ * 
+ * It reads until there is no more data, up to ONION_HTTP_READ_BUDGET bytes, so a big body does not need 
+ * a poller wakeup for each read, nor keeps the poller from the other connections. On O_NONBLOCKING it
+ * reads until EAGAIN, or a short read on plain sockets; else only while FIONREAD says there is more, as 
+ * the read would block.
+ * 
+ * A body kept in memory is read straight to its place. @see onion_request_body_read_space
  */
 int onion_http_read_ready(onion_request *con){
-	char buffer[1500];
-	ssize_t len=con->connection.listen_point->read(con, buffer, sizeof(buffer));
-	
-	if (len<=0)
+	if (con->connection.http2)
+		return onion_http2_read_ready(con);
+	char buffer[ONION_HTTP_READ_SIZE];
+	onion_listen_point *lp=con->connection.listen_point;
+	int nonblocking=(lp->server->flags&O_NONBLOCKING);
+	size_t total=0;
+	for(;;){
+		char *dest=buffer;
+		size_t size=onion_request_body_read_space(con, &dest);
+		if (!size){
+			dest=buffer;
+			size=sizeof(buffer);
+		}
+		ssize_t len=lp->read(con, dest, size);
+		
+		if (len<0 && (errno==EAGAIN || errno==EWOULDBLOCK)){ // O_NONBLOCKING, nothing yet.
+			if (con->connection.slot)
+				onion_poller_slot_set_drained(con->connection.slot);
+			return OCS_PROCESSED;
+		}
+		if (len<=0)
+			return OCS_CLOSE_CONNECTION;
+		if (nonblocking && len<size && lp->read==onion_http_read && con->connection.slot) // All there was, for edge triggered slots
+			onion_poller_slot_set_drained(con->connection.slot);
+		
+		onion_connection_status st;
+		int http2=(dest==buffer && onion_http_is_preface(con, buffer, len));
+		if (lp->server->traffic_record && !http2)
+			onion_traffic_record_data(lp->server->traffic_record, con, dest, len);
+		if (dest!=buffer)
+			st=onion_request_body_read_done(con, len);
+		else if (http2){
+			onion_http2_session_new(con);
+			return onion_http2_session_read(con, buffer, len);
+		}
+		else
+			st=onion_request_write(con, buffer, len);
+		if (st!=OCS_NEED_MORE_DATA){
+			if (st<0 || st==OCS_YIELD)
+				return st;
+			return OCS_PROCESSED;
+		}
+		
+		total+=len;
+		if (total>=ONION_HTTP_READ_BUDGET)
+			return OCS_PROCESSED;
+		if (nonblocking){
+			if (len<size && lp->read==onion_http_read) // All there was
+				return OCS_PROCESSED;
+		}
+		else{
+			int pending=0;
+			if (ioctl(con->connection.fd, FIONREAD, &pending)<0 || pending<=0)
+				return OCS_PROCESSED;
+		}
+	}
+}
+
+/**
+ * @short The poller read this data from the HTTP client
+ * @memberof onion_http_t
+ * 
+ * As onion_http_read_ready, with the data the poller already read into its buffer. The body goes through
+ * onion_request_write, as it is not read straight to its place.
+ */
+static int onion_http_received(onion_request *con, const char *data, size_t len){
+	if (!len)
 		return OCS_CLOSE_CONNECTION;
-	
-	onion_connection_status st=onion_request_write(con, buffer, len);
-	if (st!=OCS_NEED_MORE_DATA){
-		if (st<0)
-			return st;
+	if (con->connection.http2)
+		return onion_http2_session_read(con, data, len);
+	if (onion_http_is_preface(con, data, len)){
+		onion_http2_session_new(con);
+		return onion_http2_session_read(con, data, len);
 	}
-	
+	onion_listen_point *lp=con->connection.listen_point;
+	if (lp->server->traffic_record)
+		onion_traffic_record_data(lp->server->traffic_record, con, data, len);
+	onion_connection_status st=onion_request_write(con, data, len);
+	if (st<0 || st==OCS_YIELD)
+		return st;
 	return OCS_PROCESSED;
 }
 
@@ -92,6 +234,80 @@ int onion_http_read_ready(onion_request *con){
  * @memberof onion_http_t
  */
 ssize_t onion_http_write(onion_request *con, const char *data, size_t len){
+#ifdef MSG_MORE
+	if (con->output.more || con->output.bulk){ // More pipelined responses or more of this one follow, let the kernel send them together.
+		con->output.more_sent=1;
+		return send(con->connection.fd, data, len, MSG_MORE);
+	}
+	if (con->output.more_sent) // This write sends the held data too.
+		con->output.more_sent=0;
+#endif
 	return write(con->connection.fd, data, len);
 }
 
+/// Writes the buffers with the listen point write, one by one. As writev, returns what was written until some write was short.
+static ssize_t onion_http_writev_each(onion_request *con, const struct iovec *iov, int iovcnt){
+	ssize_t total=0;
+	int i;
+	for (i=0;i<iovcnt;i++){
+		ssize_t w=con->connection.listen_point->write(con, iov[i].iov_base, iov[i].iov_len);
+		if (w<0)
+			return total ? total : w;
+		total+=w;
+		if ((size_t)w<iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+/**
+ * @short Writes several buffers to the HTTP client, with one syscall.
+ * @memberof onion_http_t
+ */
+ssize_t onion_http_writev(onion_request *con, const struct iovec *iov, int iovcnt){
+	if (con->connection.listen_point->write!=onion_http_write) // Custom write, as of some tests. Keeps its behaviour.
+		return onion_http_writev_each(con, iov, iovcnt);
+#ifdef MSG_MORE
+	if (con->output.more || con->output.bulk){ // As onion_http_write
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov=(struct iovec*)iov;
+		msg.msg_iovlen=iovcnt;
+		con->output.more_sent=1;
+		return sendmsg(con->connection.fd, &msg, MSG_MORE);
+	}
+	if (con->output.more_sent)
+		con->output.more_sent=0;
+#endif
+	return writev(con->connection.fd, iov, iovcnt);
+}
+
+/**
+ * @short Sends from the file to the HTTP client, with sendfile.
+ * @memberof onion_http_t
+ */
+static ssize_t onion_http_sendfile(onion_request *con, int fd, off_t *offset, size_t count){
+#ifdef __linux__
+	if (con->connection.listen_point->write==onion_http_write){ // Not with a custom write, as with writev
+		ssize_t r=sendfile(con->connection.fd, fd, offset, count);
+		if (r>0 && !con->output.more) // Its last page sends the held headers with it.
+			con->output.more_sent=0;
+		return r;
+	}
+#endif
+	errno=ENOSYS;
+	return -1;
+}
+
+/**
+ * @short Moves data from the pipe to the HTTP client, with splice.
+ * @memberof onion_http_t
+ */
+static ssize_t onion_http_splice(onion_request *con, int fd, size_t count){
+#ifdef __linux__
+	if (con->connection.listen_point->write==onion_http_write)
+		return splice(fd, NULL, con->connection.fd, NULL, count, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+#endif
+	errno=ENOSYS;
+	return -1;
+}
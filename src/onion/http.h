@@ -29,5 +29,9 @@
 #include "types.h"
 
 onion_listen_point *onion_http_new();
+/// HTTP at a unix socket, at that path, or at the abstract namespace if it starts with '@'.
+onion_listen_point *onion_unix_new(const char *path);
+/// Sets the permissions of the unix socket file, as 0660. By default the ones of the umask.
+void onion_unix_set_mode(onion_listen_point *op, int mode);
 
 #endif
@@ -0,0 +1,1048 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "types.h"
+#include "http.h"
+#include "http2.h"
+#include "hpack.h"
+#include "types_internal.h"
+#include "listen_point.h"
+#include "request.h"
+#include "response.h"
+#include "block.h"
+#include "dict.h"
+#include "log.h"
+
+/**
+ * @short HTTP/2 (RFC 9113) connections
+ * @struct onion_http2_t
+ * @memberof onion_http2_t
+ * 
+ * Each connection has a session with the HPACK contexts, the flow control windows and the open 
+ * streams. Each stream is a normal onion_request, with its own fake listen point whose write frames
+ * the response as DATA. The request headers are decoded and passed to the request parser as an HTTP/1.1
+ * request, and the body as chunked if its length is not known, so POST, sessions, body callbacks and 
+ * handlers work as always.
+ * 
+ * Streams are processed at the connection thread as soon as they are complete, one after the other;
+ * so workers are not used, and handlers must not return OCS_SUSPENDED.
+ */
+
+int onion_http_read_ready(onion_request *req); // At http.c
+const char *onion_response_date_header(int *length); // At response.c
+char *onion_request_session_cookie(onion_request *req); // At request.c
+
+/// Client connection preface, RFC 9113 3.4
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LENGTH 24
+#define HTTP2_FRAME_HEADER_LENGTH 9
+/// Our SETTINGS_MAX_FRAME_SIZE, the default
+#define HTTP2_MAX_FRAME_SIZE 16384
+/// Our SETTINGS_MAX_CONCURRENT_STREAMS
+#define HTTP2_MAX_STREAMS 100
+/// Maximum size of a header block, all HEADERS and CONTINUATION frames
+#define HTTP2_MAX_HEADER_BLOCK (64*1024)
+#define HTTP2_DEFAULT_WINDOW 65535
+#define HTTP2_MAX_WINDOW 0x7FFFFFFF
+/// Size of the HPACK dynamic tables, the default
+#define HTTP2_HEADER_TABLE_SIZE 4096
+
+enum onion_http2_frame_type_e{
+	HTTP2_DATA=0,
+	HTTP2_HEADERS=1,
+	HTTP2_PRIORITY=2,
+	HTTP2_RST_STREAM=3,
+	HTTP2_SETTINGS=4,
+	HTTP2_PUSH_PROMISE=5,
+	HTTP2_PING=6,
+	HTTP2_GOAWAY=7,
+	HTTP2_WINDOW_UPDATE=8,
+	HTTP2_CONTINUATION=9,
+};
+
+enum onion_http2_frame_flags_e{
+	HTTP2_END_STREAM=0x01,
+	HTTP2_ACK=0x01,
+	HTTP2_END_HEADERS=0x04,
+	HTTP2_PADDED=0x08,
+	HTTP2_PRIORITY_FLAG=0x20,
+};
+
+enum onion_http2_error_e{
+	HTTP2_NO_ERROR=0,
+	HTTP2_PROTOCOL_ERROR=1,
+	HTTP2_INTERNAL_ERROR=2,
+	HTTP2_FLOW_CONTROL_ERROR=3,
+	HTTP2_STREAM_CLOSED=5,
+	HTTP2_FRAME_SIZE_ERROR=6,
+	HTTP2_REFUSED_STREAM=7,
+	HTTP2_COMPRESSION_ERROR=9,
+};
+
+enum onion_http2_settings_e{
+	HTTP2_SETTINGS_HEADER_TABLE_SIZE=1,
+	HTTP2_SETTINGS_ENABLE_PUSH=2,
+	HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS=3,
+	HTTP2_SETTINGS_INITIAL_WINDOW_SIZE=4,
+	HTTP2_SETTINGS_MAX_FRAME_SIZE=5,
+};
+
+typedef struct onion_http2_session_t onion_http2_session;
+typedef struct onion_http2_stream_t onion_http2_stream;
+
+struct onion_http2_stream_t{
+	onion_http2_session *session;
+	uint32_t id;
+	onion_request *req;       ///< While the request is read and processed. NULL after.
+	int64_t send_window;
+	int64_t recv_window;
+	onion_block *pending;     ///< Response data waiting for the flow control windows.
+	size_t pending_pos;
+	int64_t content_length;   ///< As stated by the client, or -1.
+	int64_t received;         ///< Body bytes received
+	char chunked;             ///< The body is passed to the parser chunked, as its length is not known.
+	char remote_closed;       ///< Got END_STREAM
+	char headers_sent;
+	char done;                ///< The response is complete; END_STREAM is sent after the pending data.
+	char end_sent;
+	onion_http2_stream *next;
+};
+
+/// Request headers, as they are decoded.
+typedef struct{
+	onion_block *head;        ///< The regular headers, as HTTP/1.1 lines
+	onion_block *cookie;      ///< All the cookie headers, joined.
+	onion_block *method;
+	onion_block *path;
+	onion_block *authority;
+	int seen;                 ///< Or'ed pseudo headers seen, 1 method, 2 path, 4 authority, 8 scheme, 16 any regular header.
+	int malformed;
+	int64_t content_length;
+}onion_http2_headers;
+
+struct onion_http2_session_t{
+	onion_request *con;       ///< The connection
+	onion_listen_point *streams_lp; ///< Listen point of the stream requests; its write sends DATA frames.
+	onion_hpack *decoder;
+	onion_hpack *encoder;
+	onion_block *in;          ///< Read data not processed yet, an incomplete frame.
+	onion_block *frame;       ///< Scratch for the frames to write.
+	onion_block *header_block; ///< The header block being read, from HEADERS and CONTINUATION frames.
+	onion_block *out_headers; ///< Scratch for the response header blocks.
+	onion_block *body;        ///< Scratch for the body chunks.
+	uint32_t header_stream;   ///< Stream of the header block being read, 0 if none.
+	int header_flags;
+	onion_http2_headers headers;
+	char preface;             ///< The client preface was read.
+	char settings;            ///< The client SETTINGS were read; must be the first frame.
+	char goaway;              ///< The client will not open more streams, close when all are done.
+	uint32_t last_stream_id;
+	onion_http2_stream *streams; ///< Open streams, oldest first.
+	int nstreams;
+	int64_t send_window;
+	int64_t recv_window;
+	uint32_t peer_initial_window;
+	uint32_t peer_max_frame_size;
+};
+
+static ssize_t onion_http2_stream_write(onion_request *req, const char *data, size_t len);
+static void http2_flush(onion_http2_session *s);
+
+static uint32_t http2_get32(const unsigned char *p){
+	return (((uint32_t)p[0])<<24) | (p[1]<<16) | (p[2]<<8) | p[3];
+}
+
+/**
+ * @short Creates an HTTP listen point that also accepts HTTP/2 connections
+ * @memberof onion_http2_t
+ * 
+ * The connections that start with the HTTP/2 preface are HTTP/2 (h2c by prior knowledge, RFC 9113 3.3), 
+ * the others HTTP/1. The Upgrade: h2c mechanism is not supported.
+ */
+onion_listen_point *onion_http2_new(){
+	onion_listen_point *ret=onion_http_new();
+	ret->http2=1;
+	return ret;
+}
+
+/**
+ * @short Enables or disables HTTP/2 at the given listen point
+ * @memberof onion_http2_t
+ * 
+ * At HTTPS listen points "h2" is offered at ALPN, with precedence over "http/1.1"; at HTTP ones the 
+ * connections that start with the HTTP/2 preface are HTTP/2. Must be set before listening.
+ */
+void onion_listen_point_set_http2(onion_listen_point *op, int enable){
+	op->http2=enable;
+}
+
+/// Stream requests are created by the session, there is nothing to accept.
+static int onion_http2_stream_init(onion_request *req){
+	return 0;
+}
+
+/// Writes a frame to the connection
+static void http2_frame(onion_http2_session *s, int type, int flags, uint32_t stream_id, const void *payload, size_t length){
+	unsigned char header[HTTP2_FRAME_HEADER_LENGTH]={
+		length>>16, length>>8, length, type, flags, 
+		(stream_id>>24)&0x7F, stream_id>>16, stream_id>>8, stream_id
+	};
+	onion_block_clear(s->frame);
+	onion_block_add_data(s->frame, (const char*)header, sizeof(header));
+	if (length)
+		onion_block_add_data(s->frame, payload, length);
+	onion_request_output_write(s->con, s->frame->data, s->frame->size);
+}
+
+/// Writes a frame with a 32 bit payload, as RST_STREAM or WINDOW_UPDATE
+static void http2_frame32(onion_http2_session *s, int type, uint32_t stream_id, uint32_t value){
+	unsigned char payload[4]={ value>>24, value>>16, value>>8, value };
+	http2_frame(s, type, 0, stream_id, payload, sizeof(payload));
+}
+
+/// Connection error: sends GOAWAY, and the connection must be closed.
+static int http2_goaway(onion_http2_session *s, int code){
+	ONION_DEBUG("HTTP/2 connection error %d, closing", code);
+	unsigned char payload[8]={
+		s->last_stream_id>>24, s->last_stream_id>>16, s->last_stream_id>>8, s->last_stream_id,
+		code>>24, code>>16, code>>8, code
+	};
+	http2_frame(s, HTTP2_GOAWAY, 0, 0, payload, sizeof(payload));
+	return OCS_CLOSE_CONNECTION;
+}
+
+/// Writes a header block as HEADERS and the needed CONTINUATION frames.
+static void http2_header_frames(onion_http2_session *s, uint32_t stream_id, onion_block *block, int flags){
+	size_t length=block->size;
+	size_t pos=0;
+	int type=HTTP2_HEADERS;
+	do{
+		size_t l=length-pos;
+		if (l>s->peer_max_frame_size)
+			l=s->peer_max_frame_size;
+		int f=(type==HTTP2_HEADERS ? flags : 0) | (pos+l==length ? HTTP2_END_HEADERS : 0);
+		http2_frame(s, type, f, stream_id, block->data+pos, l);
+		type=HTTP2_CONTINUATION;
+		pos+=l;
+	}while(pos<length);
+}
+
+/// @{ @name Streams
+
+static onion_http2_stream *http2_stream_find(onion_http2_session *s, uint32_t id){
+	onion_http2_stream *stream;
+	for (stream=s->streams;stream;stream=stream->next)
+		if (stream->id==id)
+			return stream;
+	return NULL;
+}
+
+static onion_http2_stream *http2_stream_new(onion_http2_session *s, uint32_t id){
+	onion_request *req=onion_request_new(s->streams_lp);
+	if (!req)
+		return NULL;
+	onion_http2_stream *stream=calloc(1, sizeof(onion_http2_stream));
+	stream->session=s;
+	stream->id=id;
+	stream->req=req;
+	stream->send_window=s->peer_initial_window;
+	stream->recv_window=HTTP2_DEFAULT_WINDOW;
+	stream->content_length=-1;
+	req->connection.user_data=stream;
+	memcpy(&req->connection.cli_addr, &s->con->connection.cli_addr, s->con->connection.cli_len);
+	req->connection.cli_len=s->con->connection.cli_len;
+	memcpy(req->connection.cli_info, s->con->connection.cli_info, sizeof(req->connection.cli_info));
+	req->flags|=OR_HTTP2;
+	
+	onion_http2_stream **p=&s->streams;
+	while (*p)
+		p=&(*p)->next;
+	*p=stream;
+	s->nstreams++;
+	return stream;
+}
+
+/// Removes the stream from the session, and frees it.
+static void http2_stream_remove(onion_http2_stream *stream){
+	onion_http2_session *s=stream->session;
+	onion_http2_stream **p=&s->streams;
+	while (*p!=stream)
+		p=&(*p)->next;
+	*p=stream->next;
+	s->nstreams--;
+	if (stream->req)
+		onion_request_free(stream->req);
+	if (stream->pending)
+		onion_block_free(stream->pending);
+	free(stream);
+}
+
+/// Stream error: sends RST_STREAM, and the stream is gone.
+static void http2_stream_reset(onion_http2_stream *stream, int code){
+	ONION_DEBUG("HTTP/2 stream %u error %d", stream->id, code);
+	http2_frame32(stream->session, HTTP2_RST_STREAM, stream->id, code);
+	http2_stream_remove(stream);
+}
+
+/**
+ * @short The request of the stream is done, with the given status.
+ * 
+ * If the headers were not sent, as on parse errors, an error status is sent. The END_STREAM is sent
+ * once all the pending data is, at http2_flush.
+ */
+static void http2_stream_done(onion_http2_stream *stream, onion_connection_status status){
+	if (!stream->headers_sent){
+		int code=400;
+		if (status==OCS_INTERNAL_ERROR)
+			code=500;
+		else if (status==OCS_NOT_IMPLEMENTED)
+			code=501;
+		char tmp[8];
+		snprintf(tmp, sizeof(tmp), "%d", code);
+		onion_http2_session *s=stream->session;
+		onion_block_clear(s->out_headers);
+		onion_hpack_encode(s->encoder, s->out_headers, ":status", tmp);
+		onion_hpack_encode(s->encoder, s->out_headers, "content-length", "0");
+		http2_header_frames(s, stream->id, s->out_headers, HTTP2_END_STREAM);
+		stream->headers_sent=stream->end_sent=1;
+	}
+	onion_request_free(stream->req);
+	stream->req=NULL;
+	stream->done=1;
+}
+
+/// Passes data to the request parser; when the request is processed, the stream is done.
+static void http2_stream_feed(onion_http2_stream *stream, const char *data, size_t length){
+	if (!stream->req)
+		return;
+	onion_connection_status r=onion_request_write(stream->req, data, length);
+	if (r!=OCS_NEED_MORE_DATA)
+		http2_stream_done(stream, r);
+}
+
+/// Sends as much data as the flow control windows allow. Returns the bytes sent.
+static size_t http2_stream_send(onion_http2_stream *stream, const char *data, size_t length){
+	onion_http2_session *s=stream->session;
+	size_t pos=0;
+	while (pos<length){
+		int64_t l=length-pos;
+		if (l>s->peer_max_frame_size)
+			l=s->peer_max_frame_size;
+		if (l>stream->send_window)
+			l=stream->send_window;
+		if (l>s->send_window)
+			l=s->send_window;
+		if (l<=0)
+			break;
+		http2_frame(s, HTTP2_DATA, 0, stream->id, data+pos, l);
+		stream->send_window-=l;
+		s->send_window-=l;
+		pos+=l;
+	}
+	return pos;
+}
+
+/**
+ * @short Writes the response data of a stream, as DATA frames.
+ * 
+ * What does not fit the flow control windows is kept at the stream, and sent as the client opens them.
+ */
+static ssize_t onion_http2_stream_write(onion_request *req, const char *data, size_t len){
+	onion_http2_stream *stream=(onion_http2_stream*)req->connection.user_data;
+	size_t w=0;
+	if (!stream->pending || stream->pending_pos==stream->pending->size)
+		w=http2_stream_send(stream, data, len);
+	if (w<len){
+		if (!stream->pending)
+			stream->pending=onion_block_new();
+		onion_block_add_data(stream->pending, data+w, len-w);
+	}
+	return len;
+}
+
+/**
+ * @short Sends the pending data of the streams, and ends the ones that are done.
+ */
+static void http2_flush(onion_http2_session *s){
+	onion_http2_stream *stream=s->streams;
+	while (stream){
+		onion_http2_stream *next=stream->next;
+		onion_block *pending=stream->pending;
+		if (pending && stream->pending_pos<pending->size){
+			stream->pending_pos+=http2_stream_send(stream, pending->data+stream->pending_pos, pending->size-stream->pending_pos);
+			if (stream->pending_pos==pending->size){
+				onion_block_clear(pending);
+				stream->pending_pos=0;
+			}
+		}
+		if (stream->done && (!pending || !pending->size)){
+			if (!stream->end_sent)
+				http2_frame(s, HTTP2_DATA, HTTP2_END_STREAM, stream->id, NULL, 0);
+			if (!stream->remote_closed) // The rest of the request is not needed anymore
+				http2_frame32(s, HTTP2_RST_STREAM, stream->id, HTTP2_NO_ERROR);
+			http2_stream_remove(stream);
+		}
+		stream=next;
+	}
+}
+
+/// The client sent all the request
+static void http2_stream_end(onion_http2_stream *stream){
+	stream->remote_closed=1;
+	if (!stream->req)
+		return;
+	if (stream->chunked)
+		http2_stream_feed(stream, "0\r\n\r\n", 5);
+	else if (stream->content_length>=0 && stream->received!=stream->content_length)
+		http2_stream_reset(stream, HTTP2_PROTOCOL_ERROR);
+}
+
+/// @}
+
+/// @{ @name Request headers
+
+/// Connection specific headers, not allowed at HTTP/2, RFC 9113 8.2.2
+static int http2_connection_header(const char *name){
+	return strcmp(name, "connection")==0 || strcmp(name, "keep-alive")==0 || strcmp(name, "proxy-connection")==0 ||
+		strcmp(name, "transfer-encoding")==0 || strcmp(name, "upgrade")==0;
+}
+
+/// Header names must be lowercase tokens.
+static int http2_valid_name(const char *name, size_t length){
+	size_t i;
+	for (i=0;i<length;i++){
+		unsigned char c=name[i];
+		if (i==0 && c==':')
+			continue;
+		if ((c>='a' && c<='z') || (c>='0' && c<='9') || strchr("!#$%&'*+-.^_`|~", c))
+			continue;
+		return 0;
+	}
+	return length>0;
+}
+
+/// Called for each decoded header. Errors are marked at malformed, to keep decoding, as the table must be kept in sync.
+static int http2_header(void *data, const char *name, size_t name_length, const char *value, size_t value_length){
+	onion_http2_headers *h=(onion_http2_headers*)data;
+	if (h->malformed)
+		return 0;
+	if (!http2_valid_name(name, name_length) || memchr(value, '\r', value_length) || memchr(value, '\n', value_length) ||
+			memchr(value, '\0', value_length)){
+		h->malformed=1;
+		return 0;
+	}
+	if (name[0]==':'){
+		onion_block *b=NULL;
+		int flag;
+		if (h->seen&16) // After regular headers
+			flag=0;
+		else if (strcmp(name, ":method")==0){
+			b=h->method;
+			flag=1;
+		}
+		else if (strcmp(name, ":path")==0){
+			b=h->path;
+			flag=2;
+		}
+		else if (strcmp(name, ":authority")==0){
+			b=h->authority;
+			flag=4;
+		}
+		else if (strcmp(name, ":scheme")==0){
+			b=NULL;
+			flag=8;
+		}
+		else
+			flag=0;
+		if (!flag || (h->seen&flag) || memchr(value, ' ', value_length)){
+			h->malformed=1;
+			return 0;
+		}
+		h->seen|=flag;
+		if (b)
+			onion_block_add_data(b, value, value_length);
+		return 0;
+	}
+	h->seen|=16;
+	if (http2_connection_header(name) || (strcmp(name, "te")==0 && strcmp(value, "trailers")!=0)){
+		h->malformed=1;
+		return 0;
+	}
+	if (strcmp(name, "cookie")==0){
+		if (h->cookie->size)
+			onion_block_add_data(h->cookie, "; ", 2);
+		onion_block_add_data(h->cookie, value, value_length);
+		return 0;
+	}
+	if (strcmp(name, "host")==0 && (h->seen&4)) // :authority takes precedence
+		return 0;
+	if (strcmp(name, "expect")==0) // No 100-continue, the body is read anyway.
+		return 0;
+	if (strcmp(name, "content-length")==0){
+		char *end;
+		long long l=strtoll(value, &end, 10);
+		if (!value_length || *end || l<0 || (h->content_length>=0 && h->content_length!=l)){
+			h->malformed=1;
+			return 0;
+		}
+		h->content_length=l;
+	}
+	onion_block_add_data(h->head, name, name_length);
+	onion_block_add_data(h->head, ": ", 2);
+	onion_block_add_data(h->head, value, value_length);
+	onion_block_add_data(h->head, "\r\n", 2);
+	return 0;
+}
+
+/// Starts a new stream with the decoded headers, passing them to the parser as an HTTP/1.1 request.
+static void http2_stream_start(onion_http2_session *s, uint32_t id, int end_stream){
+	onion_http2_headers *h=&s->headers;
+	if ((h->seen&11)!=11 || h->malformed || (end_stream && h->content_length>0) ||
+			(onion_block_data(h->path)[0]!='/' && strcmp(onion_block_data(h->path), "*")!=0)){
+		http2_frame32(s, HTTP2_RST_STREAM, id, HTTP2_PROTOCOL_ERROR);
+		return;
+	}
+	onion_http2_stream *stream=http2_stream_new(s, id);
+	if (!stream){
+		http2_frame32(s, HTTP2_RST_STREAM, id, HTTP2_INTERNAL_ERROR);
+		return;
+	}
+	stream->content_length=h->content_length;
+	stream->remote_closed=end_stream;
+	
+	onion_block *b=s->body;
+	onion_block_clear(b);
+	onion_block_add_block(b, h->method);
+	onion_block_add_char(b, ' ');
+	onion_block_add_block(b, h->path);
+	onion_block_add_str(b, " HTTP/1.1\r\n");
+	if (h->seen&4){
+		onion_block_add_str(b, "Host: ");
+		onion_block_add_block(b, h->authority);
+		onion_block_add_str(b, "\r\n");
+	}
+	onion_block_add_block(b, h->head);
+	if (h->cookie->size){
+		onion_block_add_str(b, "Cookie: ");
+		onion_block_add_block(b, h->cookie);
+		onion_block_add_str(b, "\r\n");
+	}
+	if (h->content_length<0){
+		if (!end_stream){
+			onion_block_add_str(b, "Transfer-Encoding: chunked\r\n");
+			stream->chunked=1;
+		}
+		else if (strcmp(onion_block_data(h->method), "GET")!=0 && strcmp(onion_block_data(h->method), "HEAD")!=0)
+			onion_block_add_str(b, "Content-Length: 0\r\n");
+	}
+	onion_block_add_str(b, "\r\n");
+	http2_stream_feed(stream, b->data, b->size);
+}
+
+/// A full header block was read; a new request, or the trailers of one.
+static int http2_header_block(onion_http2_session *s){
+	uint32_t id=s->header_stream;
+	int end_stream=s->header_flags&HTTP2_END_STREAM;
+	s->header_stream=0;
+	
+	onion_http2_headers *h=&s->headers;
+	onion_block_clear(h->head);
+	onion_block_clear(h->cookie);
+	onion_block_clear(h->method);
+	onion_block_clear(h->path);
+	onion_block_clear(h->authority);
+	h->seen=h->malformed=0;
+	h->content_length=-1;
+	if (onion_hpack_decode(s->decoder, (const unsigned char*)s->header_block->data, s->header_block->size, http2_header, h)<0)
+		return http2_goaway(s, HTTP2_COMPRESSION_ERROR);
+	
+	onion_http2_stream *stream=http2_stream_find(s, id);
+	if (stream){ // Trailers, ignored.
+		if (stream->remote_closed){
+			http2_stream_reset(stream, HTTP2_STREAM_CLOSED);
+			return 0;
+		}
+		if (!end_stream){
+			http2_stream_reset(stream, HTTP2_PROTOCOL_ERROR);
+			return 0;
+		}
+		http2_stream_end(stream);
+		return 0;
+	}
+	if (id<=s->last_stream_id) // Already closed
+		return 0;
+	s->last_stream_id=id;
+	if (s->nstreams>=HTTP2_MAX_STREAMS){
+		http2_frame32(s, HTTP2_RST_STREAM, id, HTTP2_REFUSED_STREAM);
+		return 0;
+	}
+	http2_stream_start(s, id, end_stream);
+	return 0;
+}
+
+/// @}
+
+/// @{ @name Frames
+
+/// Removes the padding of DATA and HEADERS frames. Returns <0 if wrong.
+static int http2_unpad(int flags, const unsigned char **payload, size_t *length){
+	if (!(flags&HTTP2_PADDED))
+		return 0;
+	if (*length<1)
+		return -1;
+	size_t pad=(*payload)[0];
+	if (pad>=*length)
+		return -1;
+	(*payload)++;
+	*length-=pad+1;
+	return 0;
+}
+
+/// Keeps the receive window open.
+static void http2_window_refill(onion_http2_session *s, uint32_t id, int64_t *window){
+	if (*window<HTTP2_DEFAULT_WINDOW/2){
+		http2_frame32(s, HTTP2_WINDOW_UPDATE, id, HTTP2_DEFAULT_WINDOW-*window);
+		*window=HTTP2_DEFAULT_WINDOW;
+	}
+}
+
+static int http2_data(onion_http2_session *s, int flags, uint32_t id, const unsigned char *payload, size_t length){
+	if (!id)
+		return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+	s->recv_window-=length;
+	if (s->recv_window<0)
+		return http2_goaway(s, HTTP2_FLOW_CONTROL_ERROR);
+	http2_window_refill(s, 0, &s->recv_window);
+	if (http2_unpad(flags, &payload, &length)<0)
+		return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+	
+	onion_http2_stream *stream=http2_stream_find(s, id);
+	if (!stream){
+		if (id>s->last_stream_id) // Idle
+			return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+		return 0;
+	}
+	if (stream->remote_closed){
+		http2_stream_reset(stream, HTTP2_STREAM_CLOSED);
+		return 0;
+	}
+	stream->recv_window-=length;
+	if (!(flags&HTTP2_END_STREAM))
+		http2_window_refill(s, id, &stream->recv_window);
+	if (stream->req && length){
+		stream->received+=length;
+		if (stream->content_length>=0 && stream->received>stream->content_length){
+			http2_stream_reset(stream, HTTP2_PROTOCOL_ERROR);
+			return 0;
+		}
+		if (stream->chunked){
+			char tmp[24];
+			snprintf(tmp, sizeof(tmp), "%X\r\n", (unsigned int)length);
+			onion_block_clear(s->body);
+			onion_block_add_str(s->body, tmp);
+			onion_block_add_data(s->body, (const char*)payload, length);
+			onion_block_add_str(s->body, "\r\n");
+			http2_stream_feed(stream, s->body->data, s->body->size);
+		}
+		else
+			http2_stream_feed(stream, (const char*)payload, length);
+	}
+	if (flags&HTTP2_END_STREAM)
+		http2_stream_end(stream);
+	return 0;
+}
+
+static int http2_headers(onion_http2_session *s, int flags, uint32_t id, const unsigned char *payload, size_t length){
+	if (!id || !(id&1))
+		return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+	if (http2_unpad(flags, &payload, &length)<0)
+		return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+	if (flags&HTTP2_PRIORITY_FLAG){
+		if (length<5)
+			return http2_goaway(s, HTTP2_FRAME_SIZE_ERROR);
+		payload+=5;
+		length-=5;
+	}
+	onion_block_clear(s->header_block);
+	onion_block_add_data(s->header_block, (const char*)payload, length);
+	s->header_stream=id;
+	s->header_flags=flags;
+	if (flags&HTTP2_END_HEADERS)
+		return http2_header_block(s);
+	return 0;
+}
+
+static int http2_continuation(onion_http2_session *s, int flags, uint32_t id, const unsigned char *payload, size_t length){
+	if (!s->header_stream || id!=s->header_stream)
+		return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+	if (s->header_block->size+length>HTTP2_MAX_HEADER_BLOCK){
+		ONION_WARNING_RATELIMITED("Too big HTTP/2 header block");
+		return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+	}
+	onion_block_add_data(s->header_block, (const char*)payload, length);
+	if (flags&HTTP2_END_HEADERS)
+		return http2_header_block(s);
+	return 0;
+}
+
+static int http2_settings(onion_http2_session *s, int flags, uint32_t id, const unsigned char *payload, size_t length){
+	if (id)
+		return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+	if (flags&HTTP2_ACK){
+		if (length)
+			return http2_goaway(s, HTTP2_FRAME_SIZE_ERROR);
+		return 0;
+	}
+	if (length%6)
+		return http2_goaway(s, HTTP2_FRAME_SIZE_ERROR);
+	size_t i;
+	for (i=0;i<length;i+=6){
+		int setting=(payload[i]<<8) | payload[i+1];
+		uint32_t value=http2_get32(payload+i+2);
+		switch(setting){
+			case HTTP2_SETTINGS_HEADER_TABLE_SIZE:
+				onion_hpack_set_max_size(s->encoder, value);
+				break;
+			case HTTP2_SETTINGS_ENABLE_PUSH:
+				if (value>1)
+					return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+				break;
+			case HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:{
+				if (value>HTTP2_MAX_WINDOW)
+					return http2_goaway(s, HTTP2_FLOW_CONTROL_ERROR);
+				int64_t delta=(int64_t)value-s->peer_initial_window;
+				onion_http2_stream *stream;
+				for (stream=s->streams;stream;stream=stream->next)
+					stream->send_window+=delta;
+				s->peer_initial_window=value;
+				break;
+			}
+			case HTTP2_SETTINGS_MAX_FRAME_SIZE:
+				if (value<16384 || value>16777215)
+					return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+				s->peer_max_frame_size=value;
+				break;
+			default: // Unknown, or just informative
+				break;
+		}
+	}
+	http2_frame(s, HTTP2_SETTINGS, HTTP2_ACK, 0, NULL, 0);
+	return 0;
+}
+
+static int http2_window_update(onion_http2_session *s, uint32_t id, const unsigned char *payload, size_t length){
+	if (length!=4)
+		return http2_goaway(s, HTTP2_FRAME_SIZE_ERROR);
+	uint32_t increment=http2_get32(payload)&0x7FFFFFFF;
+	if (!id){
+		s->send_window+=increment;
+		if (!increment || s->send_window>HTTP2_MAX_WINDOW)
+			return http2_goaway(s, !increment ? HTTP2_PROTOCOL_ERROR : HTTP2_FLOW_CONTROL_ERROR);
+		return 0;
+	}
+	onion_http2_stream *stream=http2_stream_find(s, id);
+	if (!stream)
+		return 0;
+	stream->send_window+=increment;
+	if (!increment)
+		http2_stream_reset(stream, HTTP2_PROTOCOL_ERROR);
+	else if (stream->send_window>HTTP2_MAX_WINDOW)
+		http2_stream_reset(stream, HTTP2_FLOW_CONTROL_ERROR);
+	return 0;
+}
+
+/// Processes a full frame. Returns <0 if the connection must be closed.
+static int http2_frame_process(onion_http2_session *s, int type, int flags, uint32_t id, const unsigned char *payload, size_t length){
+	ONION_DEBUG0("HTTP/2 frame type %d, flags %02X, stream %u, %d bytes", type, flags, id, (int)length);
+	if (!s->settings){
+		if (type!=HTTP2_SETTINGS || (flags&HTTP2_ACK))
+			return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+		s->settings=1;
+	}
+	if (s->header_stream && type!=HTTP2_CONTINUATION) // Header blocks are not interleaved
+		return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+	switch(type){
+		case HTTP2_DATA:
+			return http2_data(s, flags, id, payload, length);
+		case HTTP2_HEADERS:
+			return http2_headers(s, flags, id, payload, length);
+		case HTTP2_CONTINUATION:
+			return http2_continuation(s, flags, id, payload, length);
+		case HTTP2_PRIORITY:
+			if (!id)
+				return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+			return 0;
+		case HTTP2_RST_STREAM:{
+			if (length!=4)
+				return http2_goaway(s, HTTP2_FRAME_SIZE_ERROR);
+			if (!id || id>s->last_stream_id)
+				return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+			onion_http2_stream *stream=http2_stream_find(s, id);
+			if (stream)
+				http2_stream_remove(stream);
+			return 0;
+		}
+		case HTTP2_SETTINGS:
+			return http2_settings(s, flags, id, payload, length);
+		case HTTP2_PING:
+			if (length!=8)
+				return http2_goaway(s, HTTP2_FRAME_SIZE_ERROR);
+			if (id)
+				return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+			if (!(flags&HTTP2_ACK))
+				http2_frame(s, HTTP2_PING, HTTP2_ACK, 0, payload, length);
+			return 0;
+		case HTTP2_GOAWAY:
+			if (id)
+				return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+			s->goaway=1;
+			return 0;
+		case HTTP2_WINDOW_UPDATE:
+			return http2_window_update(s, id, payload, length);
+		case HTTP2_PUSH_PROMISE: // Clients do not push
+			return http2_goaway(s, HTTP2_PROTOCOL_ERROR);
+		default: // Unknown frames are ignored
+			return 0;
+	}
+}
+
+/// @}
+
+/**
+ * @short Starts an HTTP/2 session at the connection, and sends the server SETTINGS.
+ * @memberof onion_http2_t
+ * 
+ * Internal; the client preface is expected as the first data.
+ */
+void onion_http2_session_new(onion_request *con){
+	onion_http2_session *s=calloc(1, sizeof(onion_http2_session));
+	s->con=con;
+	s->decoder=onion_hpack_new(HTTP2_HEADER_TABLE_SIZE);
+	s->encoder=onion_hpack_new(HTTP2_HEADER_TABLE_SIZE);
+	s->in=onion_block_new();
+	s->frame=onion_block_new();
+	s->header_block=onion_block_new();
+	s->out_headers=onion_block_new();
+	s->body=onion_block_new();
+	s->headers.head=onion_block_new();
+	s->headers.cookie=onion_block_new();
+	s->headers.method=onion_block_new();
+	s->headers.path=onion_block_new();
+	s->headers.authority=onion_block_new();
+	s->send_window=s->recv_window=HTTP2_DEFAULT_WINDOW;
+	s->peer_initial_window=HTTP2_DEFAULT_WINDOW;
+	s->peer_max_frame_size=HTTP2_MAX_FRAME_SIZE;
+	
+	onion_listen_point *lp=onion_listen_point_new();
+	lp->server=con->connection.listen_point->server;
+	lp->listenfd=-1;
+	lp->request_init=onion_http2_stream_init;
+	lp->write=onion_http2_stream_write;
+	s->streams_lp=lp;
+	con->connection.http2=s;
+	
+	unsigned char settings[6]={ 0, HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, HTTP2_MAX_STREAMS };
+	http2_frame(s, HTTP2_SETTINGS, 0, 0, settings, sizeof(settings));
+}
+
+/**
+ * @short Frees the HTTP/2 session of the connection, and its streams.
+ * @memberof onion_http2_t
+ */
+void onion_http2_session_free(onion_request *con){
+	onion_http2_session *s=con->connection.http2;
+	while (s->streams)
+		http2_stream_remove(s->streams);
+	onion_hpack_free(s->decoder);
+	onion_hpack_free(s->encoder);
+	onion_block_free(s->in);
+	onion_block_free(s->frame);
+	onion_block_free(s->header_block);
+	onion_block_free(s->out_headers);
+	onion_block_free(s->body);
+	onion_block_free(s->headers.head);
+	onion_block_free(s->headers.cookie);
+	onion_block_free(s->headers.method);
+	onion_block_free(s->headers.path);
+	onion_block_free(s->headers.authority);
+	onion_listen_point_free(s->streams_lp);
+	free(s);
+	con->connection.http2=NULL;
+}
+
+/**
+ * @short Processes the data read from an HTTP/2 connection
+ * @memberof onion_http2_t
+ * 
+ * The full frames are processed, and the rest kept for the next read.
+ * 
+ * @returns OCS_PROCESSED, or OCS_CLOSE_CONNECTION.
+ */
+int onion_http2_session_read(onion_request *con, const char *data, size_t length){
+	onion_http2_session *s=con->connection.http2;
+	onion_block_add_data(s->in, data, length);
+	const unsigned char *p=(const unsigned char*)s->in->data;
+	size_t size=s->in->size;
+	size_t pos=0;
+	int ret=OCS_PROCESSED;
+	
+	if (!s->preface){
+		size_t l=size<HTTP2_PREFACE_LENGTH ? size : HTTP2_PREFACE_LENGTH;
+		if (memcmp(p, HTTP2_PREFACE, l)!=0){
+			ONION_DEBUG("Bad HTTP/2 preface");
+			return OCS_CLOSE_CONNECTION;
+		}
+		if (l<HTTP2_PREFACE_LENGTH)
+			return OCS_PROCESSED;
+		s->preface=1;
+		pos=HTTP2_PREFACE_LENGTH;
+	}
+	while (size-pos>=HTTP2_FRAME_HEADER_LENGTH){
+		size_t flength=(p[pos]<<16) | (p[pos+1]<<8) | p[pos+2];
+		if (flength>HTTP2_MAX_FRAME_SIZE){
+			ret=http2_goaway(s, HTTP2_FRAME_SIZE_ERROR);
+			break;
+		}
+		if (size-pos<HTTP2_FRAME_HEADER_LENGTH+flength)
+			break;
+		ret=http2_frame_process(s, p[pos+3], p[pos+4], http2_get32(p+pos+5)&0x7FFFFFFF, p+pos+HTTP2_FRAME_HEADER_LENGTH, flength);
+		pos+=HTTP2_FRAME_HEADER_LENGTH+flength;
+		if (ret<0)
+			break;
+	}
+	memmove(s->in->data, s->in->data+pos, size-pos);
+	s->in->size=size-pos;
+	if (ret<0)
+		return ret;
+	
+	http2_flush(s);
+	if (s->goaway && !s->nstreams)
+		return OCS_CLOSE_CONNECTION;
+	return OCS_PROCESSED;
+}
+
+/**
+ * @short The HTTP/2 connection has data ready to be read
+ * @memberof onion_http2_t
+ */
+int onion_http2_read_ready(onion_request *con){
+	char buffer[HTTP2_MAX_FRAME_SIZE];
+	ssize_t len=con->connection.listen_point->read(con, buffer, sizeof(buffer));
+	
+	if (len<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) // O_NONBLOCKING, nothing yet.
+		return OCS_PROCESSED;
+	if (len<=0)
+		return OCS_CLOSE_CONNECTION;
+	return onion_http2_session_read(con, buffer, len);
+}
+
+/// Adds a response header to the header block, lowercased, but those not allowed at HTTP/2.
+static void http2_write_header(onion_http2_session *s, const char *key, const char *value, int flags){
+	char name[128];
+	size_t l=strlen(key);
+	if (l>=sizeof(name)){
+		ONION_WARNING("Too long header name %s, not sent", key);
+		return;
+	}
+	size_t i;
+	for (i=0;i<=l;i++)
+		name[i]=(key[i]>='A' && key[i]<='Z') ? key[i]-'A'+'a' : key[i];
+	if (http2_connection_header(name))
+		return;
+	onion_hpack_encode(s->encoder, s->out_headers, name, value);
+}
+
+/// Adds the "Key: value\r\n" lines of onion_response_set_header_block to the header block.
+static void http2_write_header_block(onion_http2_session *s, const char *block, size_t length){
+	char *lines=strndup(block, length);
+	char *line=lines;
+	char *end;
+	while ( (end=strstr(line, "\r\n")) ){
+		*end='\0';
+		char *value=strchr(line, ':');
+		if (value){
+			*value++='\0';
+			while (*value==' ')
+				value++;
+			http2_write_header(s, line, value, 0);
+		}
+		line=end+2;
+	}
+	free(lines);
+}
+
+/**
+ * @short Writes the response headers of a stream, as HEADERS frames.
+ * @memberof onion_http2_t
+ * 
+ * As onion_response_write_headers, that calls this for HTTP/2 requests.
+ * 
+ * @returns 0, or OR_SKIP_CONTENT on HEAD requests.
+ */
+int onion_http2_write_headers(onion_response *res){
+	res->flags|=OR_HEADER_SENT;
+	res->request->flags|=OR_HEADER_SENT;
+	onion_http2_stream *stream=(onion_http2_stream*)res->request->connection.user_data;
+	onion_http2_session *s=stream->session;
+	
+	char tmp[128];
+	snprintf(tmp, sizeof(tmp), "%d", res->code);
+	onion_block_clear(s->out_headers);
+	onion_hpack_encode(s->encoder, s->out_headers, ":status", tmp);
+#ifndef DONT_USE_DATE_HEADER
+	if (!onion_dict_get(res->headers, "Date")){
+		int length;
+		const char *date=onion_response_date_header(&length);
+		snprintf(tmp, sizeof(tmp), "%.*s", length-8, date+6); // Without "Date: " and "\r\n"
+		onion_hpack_encode(s->encoder, s->out_headers, "date", tmp);
+	}
+#endif
+	onion_dict_iter it;
+	if (onion_dict_iter_begin(res->headers, &it)) do{
+		http2_write_header(s, it.key, it.value, it.flags);
+	}while(onion_dict_iter_next(&it));
+	if (res->header_block)
+		http2_write_header_block(s, res->header_block, res->header_block_length);
+	char *session_cookie=onion_request_session_cookie(res->request); // I have session with something, tell user
+	if (session_cookie){
+		onion_hpack_encode(s->encoder, s->out_headers, "set-cookie", session_cookie);
+		free(session_cookie);
+	}
+	http2_header_frames(s, stream->id, s->out_headers, 0);
+	stream->headers_sent=1;
+	res->sent_bytes=0; // Not at the buffer as on HTTP/1, nothing to discount.
+	
+	if ((res->request->flags&OR_METHODS)==OR_HEAD){
+		res->flags|=OR_SKIP_CONTENT;
+		return OR_SKIP_CONTENT;
+	}
+	return 0;
+}
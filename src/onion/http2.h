@@ -0,0 +1,44 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_HTTP2_H
+#define ONION_HTTP2_H
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/// Creates an HTTP listen point that also talks HTTP/2 to the clients that start with its preface (h2c).
+onion_listen_point *onion_http2_new();
+/// Enables HTTP/2 at an http (prior knowledge) or https (ALPN "h2") listen point.
+void onion_listen_point_set_http2(onion_listen_point *op, int enable);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,9 +25,24 @@
 
 #include <gcrypt.h>
 #include <gnutls/gnutls.h>
+#include <gnutls/socket.h>
+#include <gnutls/x509.h>
+#include <gnutls/ocsp.h>
 #include <malloc.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <poll.h>
 
 #include "https.h"
 #include "http.h"
@@ -35,12 +50,111 @@
 #include "log.h"
 #include "listen_point.h"
 #include "request.h"
+#include "dict.h"
+#include "poller.h"
+#include "block.h"
+#include "memory.h"
 
 #ifdef HAVE_PTHREADS
 #include <pthread.h>
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 #endif
 
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+/// GnuTLS can use the kernel TLS, so the data is written to the socket as is, and files use sendfile.
+#define ONION_HTTPS_KTLS 1
+#endif
+
+/// Master key size of gnutls_session_ticket_key_generate
+#define ONION_HTTPS_TICKET_KEY_SIZE 64
+/// Slots per bucket of the resumption cache
+#define ONION_HTTPS_CACHE_WAYS 4
+/// Max key of a slot: a session id, or the binder that identifies some early data. @see onion_https_set_early_data
+#define ONION_HTTPS_CACHE_ID_SIZE 64
+/// Early data accepted in the anti replay window, at most. @see onion_https_set_early_data
+#define ONION_HTTPS_REPLAY_SIZE 4096
+/// Max session data stored at a slot; bigger sessions, as with long client certificate chains, are not cached.
+#define ONION_HTTPS_CACHE_DATA_SIZE 2016
+/// Seconds to retry a failed OCSP fetch, and between refreshes when the responses say no next update.
+#define ONION_HTTPS_OCSP_RETRY 60
+#define ONION_HTTPS_OCSP_REFRESH 3600
+/// Payload of the first records of a connection, so each fits in one TCP segment and can be decrypted as it arrives.
+#define ONION_HTTPS_RECORD_SMALL 1369
+/// Records sent small before growing to the full 16 KB, and ms without writing after which they are small again, as the TCP window.
+#define ONION_HTTPS_RECORD_SMALL_COUNT 40
+#define ONION_HTTPS_RECORD_IDLE 1000
+/// Max data held corked before it is sent
+#define ONION_HTTPS_RECORD_FULL 16384
+/// Max size of an OCSP responder answer
+#define ONION_HTTPS_OCSP_MAX_SIZE (64*1024)
+/// Memory of a TLS session, for the accounting, as GnuTLS allocates it itself: the state, and the record buffers.
+#define ONION_HTTPS_SESSION_MEMORY (40*1024)
+
+/**
+ * @short The ticket key and the counters, at anonymous shared memory so the prefork workers share them.
+ * 
+ * The key is rotated by the first worker that sees it expired, and the others use the new one too.
+ */
+typedef struct{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+	int rotation;          ///< Seconds between ticket key rotations, 0 never, <0 tickets disabled.
+	int64_t next_rotation; ///< Monotonic ms
+	unsigned int key_size;
+	unsigned char key[ONION_HTTPS_TICKET_KEY_SIZE];
+	onion_https_stats stats;
+}onion_https_shared;
+
+/// A stored session, by its id
+typedef struct{
+	int64_t expires;       ///< Monotonic ms, 0 if free.
+	uint16_t id_size;
+	uint16_t data_size;
+	unsigned char id[ONION_HTTPS_CACHE_ID_SIZE];
+	unsigned char data[ONION_HTTPS_CACHE_DATA_SIZE];
+}onion_https_cache_slot;
+
+typedef struct{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+	onion_https_cache_slot slots[ONION_HTTPS_CACHE_WAYS];
+}onion_https_cache_bucket;
+
+/// The resumption cache, a single mapping, shared or not with the workers forked after.
+typedef struct{
+	size_t size;      ///< Of the mapping
+	int nbuckets;
+	int ttl;          ///< Seconds
+	onion_https_shared *shared; ///< For the counters
+	onion_https_cache_bucket buckets[];
+}onion_https_cache;
+
+/// An element of some credentials, as it was set, so they can be loaded again. @see onion_https_watch_certificates
+typedef struct onion_https_credentials_file_t{
+	onion_ssl_certificate_type type;
+	char *filename;
+	char *extra;           ///< The key file of O_SSL_CERTIFICATE_KEY, or the password of O_SSL_CERTIFICATE_PKCS12.
+	struct stat st[2];     ///< Of filename, and of the key file, when loaded.
+	struct onion_https_credentials_file_t *next;
+}onion_https_credentials_file;
+
+/**
+ * @short Certificate credentials, refcounted so the connections that use them keep them after a reload.
+ * 
+ * The session pointer of each connection is its credentials, so they are released when it is closed.
+ */
+typedef struct onion_https_credentials_t{
+	gnutls_certificate_credentials_t cred;
+	struct onion_https_t *https;
+	int refcount;          ///< Atomic. One while they are the current ones, and one per session.
+	onion_https_credentials_file *files; ///< As set, in order
+	gnutls_datum_t ocsp;   ///< The OCSP response stapled at the handshakes, or empty. Under credentials_mutex.
+	time_t ocsp_expires;   ///< Its next update; after it, it is not stapled any more.
+	int64_t ocsp_refresh;  ///< Monotonic ms of its next fetch, 0 as soon as possible.
+}onion_https_credentials;
+
 /**
  * @short Stores some data about the connection
  * @struct onion_https_t
@@ -49,21 +163,84 @@ GCRY_THREAD_OPTION_PTHREAD_IMPL;
  * It has the main data for the connection; the setup certificate and such.
  */
 struct onion_https_t{
-	gnutls_certificate_credentials_t x509_cred;
+	onion_https_credentials *credentials; ///< The current default ones. @see onion_https_reload_certificate
 	gnutls_dh_params_t dh_params;
 	gnutls_priority_t priority_cache;
+	onion_dict *hosts; ///< Credentials by SNI host name, or NULL. @see onion_https_set_host_certificate
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t credentials_mutex; ///< To change the current credentials, default or of the hosts, and take a reference.
+#endif
+	int watch;         ///< Seconds between the checks of the certificate files, or 0. @see onion_https_watch_certificates
+	int64_t watch_next; ///< Monotonic ms of the next check
+	onion_https_shared *shared; ///< Ticket key and counters
+	onion_https_cache *cache; ///< Server side resumption cache, or NULL. @see onion_https_set_session_cache
+	int ocsp;          ///< Whether the OCSP responses are fetched and stapled. @see onion_https_set_ocsp_stapling
+	size_t early_data; ///< Max TLS 1.3 early data accepted, or 0. @see onion_https_set_early_data
+	gnutls_anti_replay_t anti_replay;
+	onion_https_cache *replay; ///< The early data already seen in the anti replay window
+#ifdef HAVE_PTHREADS
+	pid_t ocsp_pid;    ///< Process where the refresh thread runs; the workers forked after start their own.
+	pthread_t ocsp_thread;
+	pthread_cond_t ocsp_cond; ///< With credentials_mutex, to wake the refresh thread, to stop or to fetch for new credentials.
+	int ocsp_wake;
+#endif
 };
 
 typedef struct onion_https_t onion_https;
 
 
 int onion_http_read_ready(onion_request *req);
+void onion_http2_session_new(onion_request *con); // At http2.c
 static int onion_https_request_init(onion_request *req);
+static int onion_https_handshake(onion_request *req);
+static int onion_https_read_ready(onion_request *req);
 static ssize_t onion_https_read(onion_request *req, char *data, size_t len);
+static ssize_t onion_https_read_early(onion_request *req, char *data, size_t len);
 ssize_t onion_https_write(onion_request *req, const char *data, size_t len);
+static ssize_t onion_https_uncork(onion_request *req, ssize_t written);
+static ssize_t onion_https_writev(onion_request *req, const struct iovec *iov, int iovcnt);
+static ssize_t onion_https_sendfile(onion_request *req, int fd, off_t *offset, size_t count);
 static void onion_https_close(onion_request *req);
 static void onion_https_listen_stop(onion_listen_point *op);
+static size_t onion_https_get_restart_state(onion_listen_point *op, void *data, size_t size);
+static void onion_https_set_restart_state(onion_listen_point *op, const void *data, size_t size);
 static void onion_https_free_user_data(onion_listen_point *op);
+static int onion_https_select_host(gnutls_session_t session);
+static void onion_https_free_host(void *_, const char *host, const void *cred, int flags);
+static onion_https_credentials *onion_https_credentials_new(onion_https *https);
+static void onion_https_credentials_release(onion_https_credentials *c);
+static onion_https_credentials *onion_https_credentials_get(onion_https *https, const char *host);
+static void onion_https_credentials_install(onion_https *https, const char *host, onion_https_credentials *c);
+static int onion_https_credentials_add(onion_https_credentials *c, onion_ssl_certificate_type type, const char *filename, const char *extra);
+static int onion_https_credentials_changed(onion_https_credentials *c);
+static int onion_https_file_changed(const char *filename, const struct stat *st);
+static void onion_https_add_host_name(void *names, const char *host, const void *_, int flags);
+static void onion_https_credentials_check(onion_https *https, const char *host);
+static void onion_https_watch(onion_https *https);
+static void onion_https_session_free(gnutls_session_t session);
+static int onion_https_ocsp_staple(gnutls_session_t session, void *ptr, gnutls_datum_t *response);
+#ifdef HAVE_PTHREADS
+static void onion_https_ocsp_start(onion_https *https);
+static void onion_https_ocsp_stop(onion_https *https);
+static void *onion_https_ocsp_thread(void *_);
+static int64_t onion_https_ocsp_refresh_all(onion_https *https);
+static int64_t onion_https_ocsp_refresh(onion_https *https, const char *host);
+static int onion_https_ocsp_fetch(onion_https_credentials *c, gnutls_datum_t *der, time_t *next_update);
+static int onion_https_ocsp_post(const char *url, const gnutls_datum_t *request, onion_block *answer);
+#endif
+const void *onion_host_lookup(const onion_dict *hosts, const char *host); // At onion.c
+static int onion_https_shared_new(onion_https *https);
+static int onion_https_ticket_key(onion_https *https, gnutls_datum_t *key);
+static int64_t onion_https_now();
+static void onion_https_cache_lock(onion_https_cache_bucket *bucket);
+static void onion_https_cache_unlock(onion_https_cache_bucket *bucket);
+static onion_https_cache_bucket *onion_https_cache_get_bucket(onion_https_cache *cache, gnutls_datum_t key);
+static onion_https_cache_slot *onion_https_cache_find(onion_https_cache_bucket *bucket, gnutls_datum_t key, int64_t now);
+static gnutls_datum_t onion_https_cache_retrieve(void *data, gnutls_datum_t key);
+static int onion_https_cache_store(void *data, gnutls_datum_t key, gnutls_datum_t value);
+static int onion_https_cache_remove(void *data, gnutls_datum_t key);
+static onion_https_cache *onion_https_cache_new(onion_https *https, int max_entries, int ttl, int shared);
+static int onion_https_replay_add(void *data, time_t expires, const gnutls_datum_t *key, const gnutls_datum_t *value);
 
 /**
  * @short Creates a new listen point with HTTPS powers.
@@ -83,10 +260,14 @@ onion_listen_point *onion_https_new(){
 	op->request_init=onion_https_request_init;
 	op->free_user_data=onion_https_free_user_data;
 	op->listen_stop=onion_https_listen_stop;
+	op->get_restart_state=onion_https_get_restart_state;
+	op->set_restart_state=onion_https_set_restart_state;
 	op->read=onion_https_read;
 	op->write=onion_https_write;
+	op->writev=onion_https_writev;
+	op->sendfile=onion_https_sendfile;
 	op->close=onion_https_close;
-	op->read_ready=onion_http_read_ready;
+	op->read_ready=onion_https_read_ready;
 	
 	op->user_data=calloc(1,sizeof(onion_https));
 	onion_https *https=(onion_https*)op->user_data;
@@ -99,7 +280,6 @@ onion_listen_point *onion_https_new(){
 	//}
 	
 	gnutls_global_init ();
-	gnutls_certificate_allocate_credentials (&https->x509_cred);
 	
 	// set cert here??
 	//onion_https_set_certificate(op,O_SSL_CERTIFICATE_KEY, "mycert.pem","mycert.pem");
@@ -108,7 +288,6 @@ onion_listen_point *onion_https_new(){
 	e=gnutls_dh_params_init (&https->dh_params);
 	if (e<0){
 		ONION_ERROR("Error initializing HTTPS: %s", gnutls_strerror(e));
-		gnutls_certificate_free_credentials (https->x509_cred);
 		op->free_user_data=NULL;
 		onion_listen_point_free(op);
 		free(https);
@@ -117,7 +296,6 @@ onion_listen_point *onion_https_new(){
 	e=gnutls_dh_params_generate2 (https->dh_params, bits);
 	if (e<0){
 		ONION_ERROR("Error initializing HTTPS: %s", gnutls_strerror(e));
-		gnutls_certificate_free_credentials (https->x509_cred);
 		op->free_user_data=NULL;
 		onion_listen_point_free(op);
 		free(https);
@@ -126,14 +304,40 @@ onion_listen_point *onion_https_new(){
 	e=gnutls_priority_init (&https->priority_cache, "PERFORMANCE:%SAFE_RENEGOTIATION:-VERS-TLS1.0", NULL);
 	if (e<0){
 		ONION_ERROR("Error initializing HTTPS: %s", gnutls_strerror(e));
-		gnutls_certificate_free_credentials (https->x509_cred);
 		gnutls_dh_params_deinit(https->dh_params);
 		op->free_user_data=NULL;
 		onion_listen_point_free(op);
 		free(https);
 		return NULL;
 	}
-	gnutls_certificate_set_dh_params (https->x509_cred, https->dh_params);
+	if (onion_https_shared_new(https)<0){
+		ONION_ERROR("Error initializing HTTPS: %s", strerror(errno));
+		gnutls_dh_params_deinit(https->dh_params);
+		gnutls_priority_deinit(https->priority_cache);
+		op->free_user_data=NULL;
+		onion_listen_point_free(op);
+		free(https);
+		return NULL;
+	}
+#ifdef HAVE_PTHREADS
+	pthread_mutex_init(&https->credentials_mutex, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&https->ocsp_cond, &attr);
+	pthread_condattr_destroy(&attr);
+#endif
+	https->credentials=onion_https_credentials_new(https);
+	if (!https->credentials){
+		gnutls_dh_params_deinit(https->dh_params);
+		gnutls_priority_deinit(https->priority_cache);
+		munmap(https->shared, sizeof(onion_https_shared));
+		op->free_user_data=NULL;
+		onion_listen_point_free(op);
+		free(https);
+		return NULL;
+	}
+	gnutls_priority_deinit (https->priority_cache);
 	gnutls_priority_init (&https->priority_cache, "NORMAL:-VERS-TLS-ALL:+VERS-TLS1.0:+VERS-SSL3.0:%COMPAT", NULL); // PERFORMANCE:%SAFE_RENEGOTIATION:-VERS-TLS1.0:%COMPAT"
 	
 	ONION_DEBUG("HTTPS connection ready");
@@ -166,9 +370,27 @@ static void onion_https_free_user_data(onion_listen_point *op){
 	ONION_DEBUG("Free HTTPS %s:%s", op->hostname, op->port);
 	onion_https *https=(onion_https*)op->user_data;
 	
-	gnutls_certificate_free_credentials (https->x509_cred);
+#ifdef HAVE_PTHREADS
+	onion_https_ocsp_stop(https);
+#endif
+	onion_https_credentials_release(https->credentials);
+	if (https->hosts){
+		onion_dict_preorder(https->hosts, onion_https_free_host, NULL);
+		onion_dict_free(https->hosts);
+	}
 	gnutls_dh_params_deinit(https->dh_params);
 	gnutls_priority_deinit (https->priority_cache);
+	if (https->cache)
+		munmap(https->cache, https->cache->size);
+	if (https->replay){
+		munmap(https->replay, https->replay->size);
+		gnutls_anti_replay_deinit(https->anti_replay);
+	}
+	munmap(https->shared, sizeof(onion_https_shared));
+#ifdef HAVE_PTHREADS
+	pthread_cond_destroy(&https->ocsp_cond);
+	pthread_mutex_destroy(&https->credentials_mutex);
+#endif
 	//if (op->server->flags&O_SSL_NO_DEINIT)
 	gnutls_global_deinit(); // This may cause problems if several characters use the gnutls on the same binary.
 	free(https);
@@ -178,44 +400,204 @@ static void onion_https_free_user_data(onion_listen_point *op){
  * @short Initializes a connection on a request
  * @memberof onion_https_t
  * 
- * Do the accept of the request, and the SSL handshake.
+ * Do the accept of the request, and starts the SSL handshake. But on O_ONE mode the socket is non blocking 
+ * while at the handshake, and if the client did not send all yet, it goes on at onion_https_read_ready as 
+ * the poller says the socket is ready, so slow clients do not stop the others.
  * 
  * @param req The request
  * @returns <0 in case of error.
  */
 static int onion_https_request_init(onion_request *req){
-	onion_listen_point_request_init_from_socket(req);
+	if (onion_listen_point_request_init_from_socket(req)<0)
+		return -1;
 	onion_https *https=(onion_https*)req->connection.listen_point->user_data;
 	
 	ONION_DEBUG("Accept new request, fd %d",req->connection.fd);
 	
 	gnutls_session_t session;
-
-  gnutls_init (&session, GNUTLS_SERVER);
+	unsigned int flags=GNUTLS_SERVER;
+#ifdef GNUTLS_NO_SIGNAL
+	flags|=GNUTLS_NO_SIGNAL; // The client may be gone at gnutls_bye, as after a HTTP/2 GOAWAY.
+#endif
+	if (https->early_data && !req->connection.listen_point->http2)
+		flags|=GNUTLS_ENABLE_EARLY_DATA|GNUTLS_ENABLE_EARLY_START;
+  gnutls_init (&session, flags);
+	onion_memory_count(ONION_MEMORY_TLS, ONION_HTTPS_SESSION_MEMORY);
   gnutls_priority_set (session, https->priority_cache);
-  gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, https->x509_cred);
+	if (flags&GNUTLS_ENABLE_EARLY_DATA){
+		gnutls_record_set_max_early_data_size(session, https->early_data);
+		gnutls_anti_replay_enable(session, https->anti_replay);
+	}
+	if (https->watch)
+		onion_https_watch(https);
+#ifdef HAVE_PTHREADS
+	if (https->ocsp && https->ocsp_pid!=getpid()) // A forked worker
+		onion_https_ocsp_start(https);
+#endif
+	onion_https_credentials *credentials=onion_https_credentials_get(https, NULL);
+  gnutls_credentials_set (session, GNUTLS_CRD_CERTIFICATE, credentials->cred);
+	gnutls_session_set_ptr(session, credentials);
+	if (https->hosts) // Other credentials, by the SNI name, after the client hello
+		gnutls_handshake_set_post_client_hello_function(session, onion_https_select_host);
+	gnutls_datum_t ticket_key;
+	unsigned char ticket_key_data[ONION_HTTPS_TICKET_KEY_SIZE];
+	ticket_key.data=ticket_key_data;
+	if (onion_https_ticket_key(https, &ticket_key)==0)
+		gnutls_session_ticket_enable_server(session, &ticket_key);
+	if (https->cache){
+		gnutls_db_set_retrieve_function(session, onion_https_cache_retrieve);
+		gnutls_db_set_store_function(session, onion_https_cache_store);
+		gnutls_db_set_remove_function(session, onion_https_cache_remove);
+		gnutls_db_set_ptr(session, https->cache);
+		gnutls_db_set_cache_expiration(session, https->cache->ttl);
+	}
   /* Set maximum compatibility mode. This is only suggested on public webservers
    * that need to trade security for compatibility
    */
   gnutls_session_enable_compatibility_mode (session);
+	if (req->connection.listen_point->http2){ // Offers HTTP/2, preferred
+		gnutls_datum_t protocols[2]={ { (unsigned char*)"h2", 2 }, { (unsigned char*)"http/1.1", 8 } };
+		gnutls_alpn_set_protocols(session, protocols, 2, GNUTLS_ALPN_SERVER_PRECEDENCE);
+	}
 
 	gnutls_transport_set_ptr (session, (gnutls_transport_ptr_t)(long) req->connection.fd);
+	req->connection.user_data=(void*)session;
+	req->connection.corked=0;
+	req->connection.small_records=0;
+	req->connection.last_write=0;
+	req->connection.early_pending=0;
+	req->connection.early_data=0;
+	if (!(req->connection.listen_point->server->flags&O_ONE)){
+		int flags=fcntl(req->connection.fd, F_GETFL);
+		if (flags==-1 || fcntl(req->connection.fd, F_SETFL, flags|O_NONBLOCK)==-1){
+			ONION_ERROR("Setting O_NONBLOCK for the handshake");
+			return -1;
+		}
+		req->connection.handshake=1;
+	}
+	return onion_https_handshake(req)<0 ? -1 : 0;
+}
+
+/**
+ * @short Goes on with the handshake as far as it can.
+ * @memberof onion_https_t
+ * 
+ * When done, the socket is blocking again unless O_NONBLOCKING, and the HTTP/2 session is started if that 
+ * was the ALPN protocol.
+ * 
+ * @returns 0 when done, 1 if it waits for the socket, at the direction set at the poller slot, -1 on error, 
+ *   and then the session is gone.
+ */
+static int onion_https_handshake(onion_request *req){
+	gnutls_session_t session=(gnutls_session_t)req->connection.user_data;
 	int ret;
 	do{
 			ret = gnutls_handshake (session);
-	}while (ret < 0 && gnutls_error_is_fatal (ret) == 0);
+	}while (ret < 0 && gnutls_error_is_fatal (ret) == 0 && ret!=GNUTLS_E_AGAIN);
+	if (ret==GNUTLS_E_AGAIN && req->connection.handshake){ // Blocking sockets only get it at the SO_RCVTIMEO, that is an error.
+		if (req->connection.slot)
+			onion_poller_slot_set_type(req->connection.slot, (gnutls_record_get_direction(session) ? O_POLL_WRITE : O_POLL_READ)|O_POLL_OTHER);
+		return 1;
+	}
 	if (ret<0){ // could not handshake. assume an error.
-	  ONION_ERROR("Handshake has failed (%s)", gnutls_strerror (ret));
-		gnutls_bye (session, GNUTLS_SHUT_WR);
-		gnutls_deinit(session);
+	  ONION_ERROR_RATELIMITED("Handshake has failed (%s)", gnutls_strerror (ret));
+		if (!req->connection.handshake)
+			gnutls_bye (session, GNUTLS_SHUT_WR);
+		onion_https_session_free(session);
+		req->connection.user_data=NULL;
 		onion_listen_point_request_close_socket(req);
 		return -1;
 	}
 	
-	req->connection.user_data=(void*)session;
+	onion_listen_point *op=req->connection.listen_point;
+	if (req->connection.handshake){
+		req->connection.handshake=0;
+		if (!(op->server->flags&O_NONBLOCKING)){
+			int flags=fcntl(req->connection.fd, F_GETFL);
+			if (flags==-1 || fcntl(req->connection.fd, F_SETFL, flags&~O_NONBLOCK)==-1)
+				ONION_ERROR("Could not set the connection blocking after the handshake");
+		}
+		if (req->connection.slot)
+			onion_poller_slot_set_type(req->connection.slot, O_POLL_READ|O_POLL_OTHER);
+	}
+	onion_request_timing(req, OR_PHASE_HANDSHAKE);
+	onion_https *https=(onion_https*)op->user_data;
+	__sync_fetch_and_add(&https->shared->stats.handshakes, 1);
+	if (gnutls_session_is_resumed(session))
+		__sync_fetch_and_add(&https->shared->stats.resumed, 1);
+	unsigned int flags=gnutls_session_get_flags(session);
+	req->connection.early_pending=(flags&(GNUTLS_SFLAGS_EARLY_START|GNUTLS_SFLAGS_EARLY_DATA)) ? 1 : 0;
+	if (flags&GNUTLS_SFLAGS_EARLY_DATA)
+		__sync_fetch_and_add(&https->shared->stats.early_data, 1);
+#ifdef ONION_HTTPS_KTLS
+	if (gnutls_transport_is_ktls_enabled(session)&GNUTLS_KTLS_SEND)
+		__sync_fetch_and_add(&https->shared->stats.ktls, 1);
+#endif
+	
+	gnutls_datum_t protocol;
+	if (op->http2 && gnutls_alpn_get_selected_protocol(session, &protocol)==0 &&
+			protocol.size==2 && memcmp(protocol.data, "h2", 2)==0)
+		onion_http2_session_new(req);
+	return 0;
+}
+
+/**
+ * @short The socket is ready: goes on with the handshake, or reads as onion_http_read_ready.
+ * @memberof onion_https_t
+ */
+static int onion_https_read_ready(onion_request *req){
+	if (req->connection.handshake){
+		int r=onion_https_handshake(req);
+		if (r<0)
+			return OCS_CLOSE_CONNECTION;
+		if (r>0 || (!req->connection.early_pending && !gnutls_record_check_pending((gnutls_session_t)req->connection.user_data)))
+			return OCS_PROCESSED;
+	}
+	return onion_http_read_ready(req);
+}
+
+/**
+ * @short Sets the credentials of the host the client asks for, by SNI, if it has its own.
+ * @memberof onion_https_t
+ */
+static int onion_https_select_host(gnutls_session_t session){
+	onion_https_credentials *current=(onion_https_credentials*)gnutls_session_get_ptr(session);
+	onion_https *https=current->https;
+	char name[256];
+	size_t length=sizeof(name);
+	unsigned int type;
+	if (gnutls_server_name_get(session, name, &length, &type, 0)!=0 || type!=GNUTLS_NAME_DNS)
+		return 0;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&https->credentials_mutex);
+#endif
+	onion_https_credentials *c=(onion_https_credentials*)onion_host_lookup(https->hosts, name);
+	if (c)
+		__sync_fetch_and_add(&c->refcount, 1);
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&https->credentials_mutex);
+#endif
+	if (c){
+		gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, c->cred);
+		gnutls_session_set_ptr(session, c);
+		onion_https_credentials_release(current);
+	}
 	return 0;
 }
 
+/// Releases the credentials of a host.
+static void onion_https_free_host(void *_, const char *host, const void *cred, int flags){
+	onion_https_credentials_release((onion_https_credentials*)cred);
+}
+
+/// Deinits the session, and releases its credentials.
+static void onion_https_session_free(gnutls_session_t session){
+	onion_https_credentials *c=(onion_https_credentials*)gnutls_session_get_ptr(session);
+	gnutls_deinit(session);
+	onion_memory_count(ONION_MEMORY_TLS, -ONION_HTTPS_SESSION_MEMORY);
+	onion_https_credentials_release(c);
+}
+
 /**
  * @short Method to read some HTTPS data.
  * @memberof onion_https_t
@@ -226,19 +608,81 @@ static int onion_https_request_init(onion_request *req){
  * @returns Actual read data. 0 means EOF.
  */
 static ssize_t onion_https_read(onion_request *req, char *data, size_t len){
+	if (req->connection.early_pending)
+		return onion_https_read_early(req, data, len);
 	gnutls_session_t session=(gnutls_session_t)req->connection.user_data;
 	ssize_t ret=gnutls_record_recv(session, data, len);
 	ONION_DEBUG("Read! (%p), %d bytes", session, ret);
+	if (ret==GNUTLS_E_AGAIN || ret==GNUTLS_E_INTERRUPTED){ // O_NONBLOCKING, nothing yet.
+		errno=EAGAIN;
+		return -1;
+	}
 	if (ret<0){
-	  ONION_ERROR("Reading data has failed (%s)", gnutls_strerror (ret));
+	  ONION_ERROR_RATELIMITED("Reading data has failed (%s)", gnutls_strerror (ret));
 	}
 	return ret;
 }
 
+/**
+ * @short Reads the TLS 1.3 early data, and the end of the handshake if it returned early.
+ * @memberof onion_https_t
+ * 
+ * The early data is kept apart by GnuTLS, and read first. Then, if the handshake returned before the client
+ * Finished (GNUTLS_ENABLE_EARLY_START, on the handshakes without early data), it only reads what is already 
+ * there until it comes, as the client may not send more until it gets an answer.
+ * 
+ * The requests read complete from the early data are marked, so the replayable ones are not processed. 
+ * @see onion_https_set_early_data
+ */
+static ssize_t onion_https_read_early(onion_request *req, char *data, size_t len){
+	gnutls_session_t session=(gnutls_session_t)req->connection.user_data;
+	for(;;){
+		ssize_t ret=gnutls_record_recv_early_data(session, data, len);
+		if (ret>0){
+			req->connection.early_data=1;
+			return ret;
+		}
+		if (gnutls_handshake_get_last_in(session)==GNUTLS_HANDSHAKE_FINISHED){
+			req->connection.early_pending=0;
+			req->connection.early_data=0;
+			return onion_https_read(req, data, len);
+		}
+		struct pollfd pfd={ req->connection.fd, POLLIN, 0 };
+		if (!gnutls_record_check_pending(session) && poll(&pfd, 1, 0)<=0){
+			errno=EAGAIN;
+			return -1;
+		}
+		ret=gnutls_record_recv(session, data, len);
+		if (ret>=0){ // After the Finished
+			req->connection.early_pending=0;
+			req->connection.early_data=0;
+			return ret;
+		}
+		if (ret!=GNUTLS_E_AGAIN && ret!=GNUTLS_E_INTERRUPTED){
+			ONION_ERROR_RATELIMITED("Reading data has failed (%s)", gnutls_strerror(ret));
+			return ret;
+		}
+	}
+}
+
 /**
  * @short Writes some data to the HTTPS client.
  * @memberof onion_https_t
  * 
+ * The records are sized as the connection goes: the first ONION_HTTPS_RECORD_SMALL_COUNT are small, of one 
+ * TCP segment, so the client can decrypt and use the first bytes of the response as they arrive, and then 
+ * they grow to the full 16 KB, with less overhead on bulk transfers. After ONION_HTTPS_RECORD_IDLE ms 
+ * without writes they are small again, as the TCP congestion window is small again too.
+ * 
+ * On the full records phase, the writes of the response buffer as it gets full are held corked, and sent 
+ * together at full records when there are ONION_HTTPS_RECORD_FULL bytes, or at the next write that is not 
+ * one of them, as at onion_response_flush or the end of the response. Not on O_NONBLOCKING, where they 
+ * could not be queued.
+ * 
+ * While more of the response follows, or the data is more than a record, the socket is corked too, so the
+ * records go at full TCP segments, and the last one is pushed as the write that is not bulk is all sent. Else 
+ * each record is a short segment, and Nagle holds the next until the client ACKs, maybe delayed.
+ * 
  * @param req to where write the data
  * @param data to write
  * @param len Ammount of data desired to write
@@ -247,7 +691,144 @@ static ssize_t onion_https_read(onion_request *req, char *data, size_t len){
 ssize_t onion_https_write(onion_request *req, const char *data, size_t len){
 	gnutls_session_t session=(gnutls_session_t)req->connection.user_data;
 	ONION_DEBUG("Write! (%p)", session);
-	return gnutls_record_send(session, data, len);
+	int64_t now=onion_https_now();
+	if (now-req->connection.last_write>ONION_HTTPS_RECORD_IDLE)
+		req->connection.small_records=0;
+	req->connection.last_write=now;
+#ifdef TCP_CORK
+	if ((req->output.bulk || len>ONION_HTTPS_RECORD_FULL) && !req->output.more_sent){
+		int one=1;
+		setsockopt(req->connection.fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+		req->output.more_sent=1;
+	}
+#endif
+	
+	ssize_t ret;
+	if (req->connection.small_records<ONION_HTTPS_RECORD_SMALL_COUNT && !req->connection.corked){
+		ret=gnutls_record_send(session, data, len<ONION_HTTPS_RECORD_SMALL ? len : ONION_HTTPS_RECORD_SMALL);
+		if (ret>0)
+			req->connection.small_records++;
+	}
+	else if (req->output.bulk && !(req->connection.listen_point->server->flags&O_NONBLOCKING)
+#ifdef ONION_HTTPS_KTLS
+					 && !(gnutls_transport_is_ktls_enabled(session)&GNUTLS_KTLS_SEND)
+#endif
+					 ){
+		if (!req->connection.corked){
+			gnutls_record_cork(session);
+			req->connection.corked=1;
+		}
+		ret=gnutls_record_send(session, data, len);
+		if (ret>0 && gnutls_record_check_corked(session)>=ONION_HTTPS_RECORD_FULL)
+			ret=onion_https_uncork(req, ret);
+	}
+	else{
+		ret=gnutls_record_send(session, data, len); // After the held data, if corked
+		if (ret>0 && req->connection.corked)
+			ret=onion_https_uncork(req, ret);
+	}
+	if (ret==GNUTLS_E_AGAIN || ret==GNUTLS_E_INTERRUPTED){ // O_NONBLOCKING, socket full. Must retry with same data.
+		errno=EAGAIN;
+		return -1;
+	}
+	if (ret==len && !req->output.bulk && !req->output.more && req->output.more_sent)
+		onion_request_output_push(req);
+	return ret;
+}
+
+/// Sends the held data, at full records. Returns written, or the error.
+static ssize_t onion_https_uncork(onion_request *req, ssize_t written){
+	req->connection.corked=0;
+	int r=gnutls_record_uncork((gnutls_session_t)req->connection.user_data, GNUTLS_RECORD_WAIT);
+	if (r<0){
+		ONION_ERROR_RATELIMITED("Writing data has failed (%s)", gnutls_strerror(r));
+		return r;
+	}
+	return written;
+}
+
+/**
+ * @short Writes several buffers to the HTTPS client, as one TLS record.
+ * @memberof onion_https_t
+ * 
+ * The buffers that fit are copied together, so they are encrypted and sent at once. With kernel TLS they 
+ * are written as they are, and the kernel makes the records. As writev, it may write less than all.
+ */
+static ssize_t onion_https_writev(onion_request *req, const struct iovec *iov, int iovcnt){
+#ifdef ONION_HTTPS_KTLS
+	if (gnutls_transport_is_ktls_enabled((gnutls_session_t)req->connection.user_data)&GNUTLS_KTLS_SEND) // The kernel makes the records
+		return writev(req->connection.fd, iov, iovcnt);
+#endif
+	char tmp[ONION_HTTPS_RECORD_FULL];
+	size_t l=0;
+	int i;
+	for (i=0;i<iovcnt && l+iov[i].iov_len<=sizeof(tmp);i++){
+		memcpy(tmp+l, iov[i].iov_base, iov[i].iov_len);
+		l+=iov[i].iov_len;
+	}
+	if (i==0) // First is too big, alone.
+		return onion_https_write(req, iov[0].iov_base, iov[0].iov_len);
+	return onion_https_write(req, tmp, l);
+}
+
+/**
+ * @short Sends from a file to the HTTPS client, without copies, when the connection uses kernel TLS.
+ * @memberof onion_https_t
+ * 
+ * GnuTLS uses the kernel TLS when it is enabled at its system config, as ktls = true at [global], the 
+ * kernel has the tls module, and the cipher suite is one the kernel knows, as the AES-GCM of TLS 1.2 and 
+ * 1.3. Else it returns -1 with ENOSYS, and the callers read and write it.
+ */
+static ssize_t onion_https_sendfile(onion_request *req, int fd, off_t *offset, size_t count){
+#ifdef ONION_HTTPS_KTLS
+	gnutls_session_t session=(gnutls_session_t)req->connection.user_data;
+	if (gnutls_transport_is_ktls_enabled(session)&GNUTLS_KTLS_SEND){
+		ssize_t ret=gnutls_record_send_file(session, fd, offset, count);
+		if (ret==GNUTLS_E_AGAIN || ret==GNUTLS_E_INTERRUPTED){
+			errno=EAGAIN;
+			return -1;
+		}
+		if (ret<0){
+			ONION_ERROR("Sending the file has failed (%s)", gnutls_strerror(ret));
+			errno=EIO;
+			return -1;
+		}
+		return ret;
+	}
+#endif
+	errno=ENOSYS;
+	return -1;
+}
+
+/**
+ * @short Sets the GnuTLS priority string, that says the protocol versions and cipher suites to use.
+ * @memberof onion_https_t
+ * 
+ * The default only allows up to TLS 1.0, so to use TLS 1.2 and 1.3, and with them the kernel TLS, 
+ * set a priority as "NORMAL" or "SECURE256".
+ * 
+ * @param ol Listen point
+ * @param priority The priority string, @see gnutls_priority_init
+ * @returns 0 if ok, -1 if the string is not valid.
+ */
+int onion_https_set_priority(onion_listen_point *ol, const char *priority){
+	if (ol->write!=onion_https_write){
+		ONION_ERROR("Trying to set the priority on a non HTTPS listen point");
+		errno=EINVAL;
+		return -1;
+	}
+	onion_https *https=(onion_https*)ol->user_data;
+	gnutls_priority_t priority_cache;
+	const char *err_pos;
+	int e=gnutls_priority_init(&priority_cache, priority, &err_pos);
+	if (e<0){
+		ONION_ERROR("Invalid HTTPS priority '%s' at '%s': %s", priority, err_pos, gnutls_strerror(e));
+		errno=EINVAL;
+		return -1;
+	}
+	gnutls_priority_deinit(https->priority_cache);
+	https->priority_cache=priority_cache;
+	return 0;
 }
 
 /**
@@ -263,8 +844,11 @@ static void onion_https_close(onion_request *req){
 	gnutls_session_t session=(gnutls_session_t)req->connection.user_data;
 	if (session){
 		ONION_DEBUG("Free session %p", session);
-		gnutls_bye (session, GNUTLS_SHUT_WR);
-		gnutls_deinit(session);
+		if (req->connection.corked)
+			onion_https_uncork(req, 0);
+		if (!req->connection.handshake)
+			gnutls_bye (session, GNUTLS_SHUT_WR);
+		onion_https_session_free(session);
 	
 	}
 	onion_listen_point_request_close_socket(req);
@@ -304,37 +888,1186 @@ int onion_https_set_certificate_argv(onion_listen_point *ol, onion_ssl_certifica
 		errno=EINVAL;
 		return -1;
 	}
+	int t=type&0x0FF;
+	const char *extra=(t==O_SSL_CERTIFICATE_KEY || t==O_SSL_CERTIFICATE_PKCS12) ? va_arg(va, const char *) : NULL;
+	return onion_https_credentials_add(https->credentials, type, filename, extra);
+}
+
+/**
+ * @short Sets certificate elements for the clients that ask for that host, by SNI
+ * @memberof onion_https_t
+ * 
+ * Each host has its own credentials, that replace the ones of onion_https_set_certificate at the handshake
+ * when the SNI name is that host. Hosts as *.example.com are for all the subdomains without their own.
+ * Several elements may be set to the same host, as with onion_https_set_certificate.
+ * 
+ * @param ol Listen point
+ * @param host The host name, as www.example.com or *.example.com
+ * @param type Type of certificate to add
+ * @param filename File where this data is.
+ * @returns If the operation was sucesful
+ */
+int onion_https_set_host_certificate(onion_listen_point *ol, const char *host, onion_ssl_certificate_type type, const char *filename, ...){
+	onion_https *https=(onion_https*)ol->user_data;
+	
+	if (ol->write!=onion_https_write){
+		ONION_ERROR("Trying to set a certificate on a non HTTPS listen point");
+		errno=EINVAL;
+		return -1;
+	}
+	onion_https_credentials *c=onion_https_credentials_get(https, host);
+	if (!c){
+		c=onion_https_credentials_new(https);
+		if (!c)
+			return -1;
+		__sync_fetch_and_add(&c->refcount, 1);
+		onion_https_credentials_install(https, host, c);
+	}
+	va_list va;
+	va_start(va, filename);
+	int t=type&0x0FF;
+	const char *extra=(t==O_SSL_CERTIFICATE_KEY || t==O_SSL_CERTIFICATE_PKCS12) ? va_arg(va, const char *) : NULL;
+	int r=onion_https_credentials_add(c, type, filename, extra);
+	va_end(va);
+	onion_https_credentials_release(c);
+
+	return r;
+}
+
+/**
+ * @short Replaces the certificate elements, atomically, at a running listen point.
+ * @memberof onion_https_t
+ * 
+ * New credentials are loaded from the given elements, as many as needed until O_SSL_NONE, as 
+ * (O_SSL_CERTIFICATE_KEY, "cert.pem", "key.pem", O_SSL_CERTIFICATE_TRUST, "chain.pem", O_SSL_NONE). The new 
+ * handshakes use them, and the connections that are already open keep the ones they had, which are freed 
+ * when the last of them is closed. If any element can not be loaded, the current ones are kept.
+ * 
+ * Each prefork worker has its own credentials, so the reload must be done at each, as with 
+ * onion_https_watch_certificates.
+ * 
+ * @param ol Listen point
+ * @param host The SNI host, as at onion_https_set_host_certificate, or NULL for the default credentials.
+ * @param type Type of the first element
+ * @param filename Its file
+ * @returns 0 if ok, -1 on error.
+ */
+int onion_https_reload_certificate(onion_listen_point *ol, const char *host, onion_ssl_certificate_type type, const char *filename, ...){
+	if (ol->write!=onion_https_write){
+		ONION_ERROR("Trying to reload a certificate on a non HTTPS listen point");
+		errno=EINVAL;
+		return -1;
+	}
+	onion_https *https=(onion_https*)ol->user_data;
+	onion_https_credentials *c=onion_https_credentials_new(https);
+	if (!c)
+		return -1;
+	va_list va;
+	va_start(va, filename);
+	int r=0;
+	while (type!=O_SSL_NONE && r>=0){
+		int t=type&0x0FF;
+		const char *extra=(t==O_SSL_CERTIFICATE_KEY || t==O_SSL_CERTIFICATE_PKCS12) ? va_arg(va, const char *) : NULL;
+		r=onion_https_credentials_add(c, type, filename, extra);
+		type=va_arg(va, onion_ssl_certificate_type);
+		if (type!=O_SSL_NONE)
+			filename=va_arg(va, const char *);
+	}
+	va_end(va);
+	if (r<0){
+		ONION_ERROR("Could not reload the certificate%s%s, keeping the current one", host ? " of " : "", host ? host : "");
+		onion_https_credentials_release(c);
+		return -1;
+	}
+	onion_https_credentials_install(https, host, c);
+	__sync_fetch_and_add(&https->shared->stats.certificate_reloads, 1);
+	return 0;
+}
+
+/**
+ * @short Reloads the certificates when their files change.
+ * @memberof onion_https_t
+ * 
+ * Every that many seconds, at the next handshake, the files of the elements of each credentials, default 
+ * and by host, are checked. If any changed, all the elements of those credentials are loaded again, as 
+ * with onion_https_reload_certificate. It is done at each prefork worker, so all get them.
+ * 
+ * If the new files can not be loaded, as when the key does not match the certificate as one is still 
+ * being written, the current ones are kept, and tried again at the next check.
+ * 
+ * @param ol Listen point
+ * @param seconds Seconds between checks, or 0 to stop checking.
+ * @returns 0 if ok, -1 if not an HTTPS listen point.
+ */
+int onion_https_watch_certificates(onion_listen_point *ol, int seconds){
+	if (ol->write!=onion_https_write){
+		ONION_ERROR("Trying to watch the certificates on a non HTTPS listen point");
+		errno=EINVAL;
+		return -1;
+	}
+	onion_https *https=(onion_https*)ol->user_data;
+	https->watch_next=onion_https_now()+((int64_t)seconds)*1000;
+	https->watch=seconds>0 ? seconds : 0;
+	return 0;
+}
+
+/// New empty credentials, with a reference for the caller.
+static onion_https_credentials *onion_https_credentials_new(onion_https *https){
+	onion_https_credentials *c=calloc(1, sizeof(onion_https_credentials));
+	int e=gnutls_certificate_allocate_credentials(&c->cred);
+	if (e<0){
+		ONION_ERROR("Error creating the HTTPS credentials: %s", gnutls_strerror(e));
+		free(c);
+		return NULL;
+	}
+	gnutls_certificate_set_dh_params(c->cred, https->dh_params);
+	gnutls_certificate_set_ocsp_status_request_function(c->cred, onion_https_ocsp_staple, c);
+	c->https=https;
+	c->refcount=1;
+	return c;
+}
+
+/// Releases a reference; the last frees them.
+static void onion_https_credentials_release(onion_https_credentials *c){
+	if (__sync_sub_and_fetch(&c->refcount, 1)!=0)
+		return;
+	gnutls_certificate_free_credentials(c->cred);
+	gnutls_free(c->ocsp.data);
+	onion_https_credentials_file *f=c->files;
+	while (f){
+		onion_https_credentials_file *next=f->next;
+		free(f->filename);
+		free(f->extra);
+		free(f);
+		f=next;
+	}
+	free(c);
+}
+
+/// Gets a reference to the current credentials of that host, or the default ones, or NULL if the host has none.
+static onion_https_credentials *onion_https_credentials_get(onion_https *https, const char *host){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&https->credentials_mutex);
+#endif
+	onion_https_credentials *c;
+	if (host)
+		c=https->hosts ? (onion_https_credentials*)onion_dict_get(https->hosts, host) : NULL;
+	else
+		c=https->credentials;
+	if (c)
+		__sync_fetch_and_add(&c->refcount, 1);
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&https->credentials_mutex);
+#endif
+	return c;
+}
+
+/// Makes them the current credentials of that host, or the default ones, and releases the previous. Takes the reference of the caller.
+static void onion_https_credentials_install(onion_https *https, const char *host, onion_https_credentials *c){
+	onion_https_credentials *old;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&https->credentials_mutex);
+#endif
+	if (host){
+		if (!https->hosts){
+			https->hosts=onion_dict_new();
+			onion_dict_set_flags(https->hosts, OD_HASH|OD_ICASE);
+		}
+		old=(onion_https_credentials*)onion_dict_get(https->hosts, host);
+		onion_dict_add(https->hosts, host, c, OD_DUP_KEY|OD_REPLACE);
+	}
+	else{
+		old=https->credentials;
+		https->credentials=c;
+	}
+#ifdef HAVE_PTHREADS
+	if (https->ocsp){ // Fetch now for the new ones
+		https->ocsp_wake=1;
+		pthread_cond_signal(&https->ocsp_cond);
+	}
+	pthread_mutex_unlock(&https->credentials_mutex);
+#endif
+	if (old)
+		onion_https_credentials_release(old);
+}
+
+/**
+ * @short Adds a certificate element to those credentials, and keeps how, to reload them.
+ * @memberof onion_https_t
+ */
+static int onion_https_credentials_add(onion_https_credentials *c, onion_ssl_certificate_type type, const char *filename, const char *extra){
+	gnutls_certificate_credentials_t cred=c->cred;
 	int r=0;
 	switch(type&0x0FF){
 		case O_SSL_CERTIFICATE_CRL:
 			ONION_DEBUG("Setting SSL Certificate CRL");
-			r=gnutls_certificate_set_x509_crl_file(https->x509_cred, filename, (type&O_SSL_DER) ? GNUTLS_X509_FMT_DER : GNUTLS_X509_FMT_PEM);
+			r=gnutls_certificate_set_x509_crl_file(cred, filename, (type&O_SSL_DER) ? GNUTLS_X509_FMT_DER : GNUTLS_X509_FMT_PEM);
 			break;
 		case O_SSL_CERTIFICATE_KEY:
-		{
-			//va_arg(va, const char *); // Ignore first.
-			const char *keyfile=va_arg(va, const char *);
-			ONION_DEBUG("Setting certificate to %p: cert %s, key %s", ol, filename, keyfile);
-			r=gnutls_certificate_set_x509_key_file(https->x509_cred, filename, keyfile, 
+			ONION_DEBUG("Setting certificate to %p: cert %s, key %s", cred, filename, extra);
+			r=gnutls_certificate_set_x509_key_file(cred, filename, extra, 
 																									(type&O_SSL_DER) ? GNUTLS_X509_FMT_DER : GNUTLS_X509_FMT_PEM);
-		}
 			break;
 		case O_SSL_CERTIFICATE_TRUST:
 			ONION_DEBUG("Setting SSL Certificate Trust");
-			r=gnutls_certificate_set_x509_trust_file(https->x509_cred, filename, (type&O_SSL_DER) ? GNUTLS_X509_FMT_DER : GNUTLS_X509_FMT_PEM);
+			r=gnutls_certificate_set_x509_trust_file(cred, filename, (type&O_SSL_DER) ? GNUTLS_X509_FMT_DER : GNUTLS_X509_FMT_PEM);
 			break;
 		case O_SSL_CERTIFICATE_PKCS12:
-		{
 			ONION_DEBUG("Setting SSL Certificate PKCS12");
-			r=gnutls_certificate_set_x509_simple_pkcs12_file(https->x509_cred, filename,
+			r=gnutls_certificate_set_x509_simple_pkcs12_file(cred, filename,
 																														(type&O_SSL_DER) ? GNUTLS_X509_FMT_DER : GNUTLS_X509_FMT_PEM,
-																														va_arg(va, const char *));
-		}
+																														extra);
 			break;
 		default:
 			r=-1;
 			ONION_ERROR("Set unknown type of certificate: %d",type);
 	}
+	if (r<0)
+		return r;
 
+	onion_https_credentials_file *f=calloc(1, sizeof(onion_https_credentials_file));
+	f->type=type;
+	f->filename=strdup(filename);
+	f->extra=extra ? strdup(extra) : NULL;
+	stat(filename, &f->st[0]);
+	if ((type&0x0FF)==O_SSL_CERTIFICATE_KEY)
+		stat(extra, &f->st[1]);
+	onion_https_credentials_file **last=&c->files;
+	while (*last)
+		last=&(*last)->next;
+	*last=f;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&c->https->credentials_mutex);
+	c->ocsp_refresh=0; // Maybe a new certificate, so a new response
+	if (c->https->ocsp){
+		c->https->ocsp_wake=1;
+		pthread_cond_signal(&c->https->ocsp_cond);
+	}
+	pthread_mutex_unlock(&c->https->credentials_mutex);
+#endif
+	return r;
+}
+
+/// Whether a file is not the same as when st was taken. If it can not be read now, as while it is replaced, it is not changed yet.
+static int onion_https_file_changed(const char *filename, const struct stat *st){
+	struct stat now;
+	if (stat(filename, &now)<0)
+		return 0;
+	return now.st_ino!=st->st_ino || now.st_size!=st->st_size || 
+		now.st_mtim.tv_sec!=st->st_mtim.tv_sec || now.st_mtim.tv_nsec!=st->st_mtim.tv_nsec;
+}
+
+/// Whether any of the files of those credentials changed since they were loaded.
+static int onion_https_credentials_changed(onion_https_credentials *c){
+	onion_https_credentials_file *f;
+	for (f=c->files;f;f=f->next){
+		if (onion_https_file_changed(f->filename, &f->st[0]))
+			return 1;
+		if ((f->type&0x0FF)==O_SSL_CERTIFICATE_KEY && onion_https_file_changed(f->extra, &f->st[1]))
+			return 1;
+	}
+	return 0;
+}
+
+/// Loads again the credentials of that host, or the default ones, if their files changed.
+static void onion_https_credentials_check(onion_https *https, const char *host){
+	onion_https_credentials *c=onion_https_credentials_get(https, host);
+	if (!c)
+		return;
+	if (c->files && onion_https_credentials_changed(c)){
+		ONION_INFO("Certificate files%s%s changed, reloading", host ? " of " : "", host ? host : "");
+		onion_https_credentials *n=onion_https_credentials_new(https);
+		onion_https_credentials_file *f;
+		int r=n ? 0 : -1;
+		for (f=c->files;f && r>=0;f=f->next)
+			r=onion_https_credentials_add(n, f->type, f->filename, f->extra);
+		if (r<0){
+			ONION_ERROR("Could not reload the certificate%s%s, keeping the current one", host ? " of " : "", host ? host : "");
+			if (n)
+				onion_https_credentials_release(n);
+		}
+		else{
+			onion_https_credentials_install(https, host, n);
+			__sync_fetch_and_add(&https->shared->stats.certificate_reloads, 1);
+		}
+	}
+	onion_https_credentials_release(c);
+}
+
+/// Adds the host name to the block, to check it after.
+static void onion_https_add_host_name(void *names, const char *host, const void *_, int flags){
+	onion_block_add_data((onion_block*)names, host, strlen(host)+1);
+}
+
+/// If it is time, checks the files of all the credentials. Only one thread does it each time.
+static void onion_https_watch(onion_https *https){
+	int64_t now=onion_https_now();
+	int64_t next=https->watch_next;
+	if (now<next || !__sync_bool_compare_and_swap(&https->watch_next, next, now+((int64_t)https->watch)*1000))
+		return;
+	onion_https_credentials_check(https, NULL);
+	if (!https->hosts)
+		return;
+	onion_block *names=onion_block_new();
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&https->credentials_mutex);
+#endif
+	onion_dict_preorder(https->hosts, onion_https_add_host_name, names);
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&https->credentials_mutex);
+#endif
+	const char *host=onion_block_data(names), *end=host+onion_block_size(names);
+	while (host<end){
+		onion_https_credentials_check(https, host);
+		host+=strlen(host)+1;
+	}
+	onion_block_free(names);
+}
+
+/// Monotonic time, in ms. It is the same for all the processes of the host.
+static int64_t onion_https_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+/**
+ * @short Creates the shared state, with a first ticket key that never rotates.
+ * @memberof onion_https_t
+ * 
+ * It is anonymous shared memory, so the workers forked after share the key and the counters.
+ */
+static int onion_https_shared_new(onion_https *https){
+	onion_https_shared *shared=mmap(NULL, sizeof(onion_https_shared), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (shared==MAP_FAILED)
+		return -1;
+	memset(shared, 0, sizeof(onion_https_shared));
+#ifdef HAVE_PTHREADS
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&shared->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+#endif
+	https->shared=shared;
+	return 0;
+}
+
+/**
+ * @short Gets the current ticket key at key->data, that has room for ONION_HTTPS_TICKET_KEY_SIZE bytes.
+ * @memberof onion_https_t
+ * 
+ * A new one is generated if there is none yet, or it has to be rotated.
+ * 
+ * @returns 0 if ok, -1 if tickets are disabled or the key could not be generated.
+ */
+static int onion_https_ticket_key(onion_https *https, gnutls_datum_t *key){
+	onion_https_shared *shared=https->shared;
+	int ret=0;
+	if (shared->rotation<0)
+		return -1;
+#ifdef HAVE_PTHREADS
+	if (pthread_mutex_lock(&shared->mutex)==EOWNERDEAD)
+		pthread_mutex_consistent(&shared->mutex);
+#endif
+	int64_t now=onion_https_now();
+	if (!shared->key_size || (shared->rotation>0 && now>=shared->next_rotation)){
+		gnutls_datum_t new_key;
+		int e=gnutls_session_ticket_key_generate(&new_key);
+		if (e<0 || new_key.size>sizeof(shared->key)){
+			ONION_ERROR("Could not generate the session ticket key: %s", e<0 ? gnutls_strerror(e) : "too long");
+			if (e>=0)
+				gnutls_free(new_key.data);
+		}
+		else{
+			if (shared->key_size)
+				ONION_DEBUG("Rotated the session ticket key");
+			memcpy(shared->key, new_key.data, new_key.size);
+			shared->key_size=new_key.size;
+			shared->next_rotation=now+((int64_t)shared->rotation)*1000;
+			gnutls_memset(new_key.data, 0, new_key.size);
+			gnutls_free(new_key.data);
+		}
+	}
+	if (shared->key_size){
+		memcpy(key->data, shared->key, shared->key_size);
+		key->size=shared->key_size;
+	}
+	else
+		ret=-1;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&shared->mutex);
+#endif
+	return ret;
+}
+
+/// The ticket key, as handed to the next process at a hot restart.
+typedef struct{
+	uint32_t key_size;
+	int64_t next_rotation; ///< The monotonic clock is the same for all the processes of the host.
+	unsigned char key[ONION_HTTPS_TICKET_KEY_SIZE];
+}onion_https_restart_state;
+
+/**
+ * @short Writes the current ticket key, so the tickets issued here are still valid at the next process.
+ * @memberof onion_https_t
+ */
+static size_t onion_https_get_restart_state(onion_listen_point *op, void *data, size_t size){
+	onion_https_shared *shared=((onion_https*)op->user_data)->shared;
+	if (size<sizeof(onion_https_restart_state))
+		return 0;
+	onion_https_restart_state state;
+	memset(&state, 0, sizeof(state));
+#ifdef HAVE_PTHREADS
+	if (pthread_mutex_lock(&shared->mutex)==EOWNERDEAD)
+		pthread_mutex_consistent(&shared->mutex);
+#endif
+	if (shared->rotation>=0 && shared->key_size){
+		state.key_size=shared->key_size;
+		state.next_rotation=shared->next_rotation;
+		memcpy(state.key, shared->key, shared->key_size);
+	}
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&shared->mutex);
+#endif
+	if (!state.key_size)
+		return 0;
+	memcpy(data, &state, sizeof(state));
+	gnutls_memset(&state, 0, sizeof(state));
+	return sizeof(state);
+}
+
+/**
+ * @short Uses the ticket key of the previous process, until its rotation.
+ * @memberof onion_https_t
+ */
+static void onion_https_set_restart_state(onion_listen_point *op, const void *data, size_t size){
+	onion_https_shared *shared=((onion_https*)op->user_data)->shared;
+	onion_https_restart_state state;
+	if (size!=sizeof(state))
+		return;
+	memcpy(&state, data, sizeof(state));
+	if (state.key_size && state.key_size<=sizeof(shared->key)){
+#ifdef HAVE_PTHREADS
+		if (pthread_mutex_lock(&shared->mutex)==EOWNERDEAD)
+			pthread_mutex_consistent(&shared->mutex);
+#endif
+		if (shared->rotation>=0){
+			memcpy(shared->key, state.key, state.key_size);
+			shared->key_size=state.key_size;
+			shared->next_rotation=state.next_rotation;
+			ONION_DEBUG("Using the session ticket key of the previous process");
+		}
+#ifdef HAVE_PTHREADS
+		pthread_mutex_unlock(&shared->mutex);
+#endif
+	}
+	gnutls_memset(&state, 0, sizeof(state));
+}
+
+/**
+ * @short Sets how often the session ticket key is replaced, or disables session tickets.
+ * @memberof onion_https_t
+ * 
+ * Session tickets are on by default, with a random key created at the first handshake that lasts as long
+ * as the listen point. The key is shared by the prefork workers, so a ticket from one is valid at all.
+ * 
+ * After a rotation the tickets made with the previous key are not valid anymore, and those clients do a
+ * full handshake. GnuTLS already rotates the keys it derives from this one for TLS 1.3, so this is to
+ * limit how long a leaked key is useful.
+ * 
+ * @param ol Listen point
+ * @param seconds Seconds between rotations, 0 for never, or <0 to disable session tickets.
+ * @returns 0 if ok, -1 on error.
+ */
+int onion_https_set_ticket_rotation(onion_listen_point *ol, int seconds){
+	if (ol->write!=onion_https_write){
+		ONION_ERROR("Trying to set the ticket rotation on a non HTTPS listen point");
+		errno=EINVAL;
+		return -1;
+	}
+	onion_https_shared *shared=((onion_https*)ol->user_data)->shared;
+#ifdef HAVE_PTHREADS
+	if (pthread_mutex_lock(&shared->mutex)==EOWNERDEAD)
+		pthread_mutex_consistent(&shared->mutex);
+#endif
+	shared->rotation=seconds;
+	if (shared->key_size && seconds>0)
+		shared->next_rotation=onion_https_now()+((int64_t)seconds)*1000;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&shared->mutex);
+#endif
+	return 0;
+}
+
+/**
+ * @short Sets up a server side session resumption cache, by session id.
+ * @memberof onion_https_t
+ * 
+ * It is for the clients that do not use session tickets, on TLS 1.2 and before; TLS 1.3 resumes only
+ * with tickets. The sessions are at buckets of ONION_HTTPS_CACHE_WAYS slots, each with its own lock,
+ * and when a bucket is full the session closest to expire is replaced.
+ * 
+ * When shared, the memory is shared with the processes forked after, as the prefork workers of
+ * onion_set_workers, so it must be set before onion_listen.
+ * 
+ * @param ol Listen point
+ * @param max_sessions Sessions to keep, rounded up to a multiple of ONION_HTTPS_CACHE_WAYS. 0 removes the cache.
+ * @param ttl Seconds a session can be resumed
+ * @param shared Whether it is shared with the forked workers.
+ * @returns 0 if ok, -1 on error.
+ */
+int onion_https_set_session_cache(onion_listen_point *ol, int max_sessions, int ttl, int shared){
+	if (ol->write!=onion_https_write){
+		ONION_ERROR("Trying to set a session cache on a non HTTPS listen point");
+		errno=EINVAL;
+		return -1;
+	}
+	onion_https *https=(onion_https*)ol->user_data;
+	if (https->cache){
+		munmap(https->cache, https->cache->size);
+		https->cache=NULL;
+	}
+	if (max_sessions<=0)
+		return 0;
+	if (ttl<=0){
+		ONION_ERROR("Invalid session cache ttl, %d", ttl);
+		errno=EINVAL;
+		return -1;
+	}
+	https->cache=onion_https_cache_new(https, max_sessions, ttl, shared);
+	return https->cache ? 0 : -1;
+}
+
+/// Maps a table of max_entries keys of ttl seconds, as the session cache, or NULL on error.
+static onion_https_cache *onion_https_cache_new(onion_https *https, int max_entries, int ttl, int shared){
+	int nbuckets=(max_entries+ONION_HTTPS_CACHE_WAYS-1)/ONION_HTTPS_CACHE_WAYS;
+	size_t size=sizeof(onion_https_cache)+nbuckets*sizeof(onion_https_cache_bucket);
+	onion_https_cache *cache=mmap(NULL, size, PROT_READ|PROT_WRITE, (shared ? MAP_SHARED : MAP_PRIVATE)|MAP_ANONYMOUS, -1, 0);
+	if (cache==MAP_FAILED){
+		ONION_ERROR("Could not map a TLS cache of %d entries: %s", max_entries, strerror(errno));
+		return NULL;
+	}
+	cache->size=size;
+	cache->nbuckets=nbuckets;
+	cache->ttl=ttl;
+	cache->shared=https->shared;
+#ifdef HAVE_PTHREADS
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	if (shared){
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	}
+	int i;
+	for (i=0;i<nbuckets;i++)
+		pthread_mutex_init(&cache->buckets[i].mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+#endif
+	return cache;
+}
+
+/**
+ * @short Accepts TLS 1.3 early data (0-RTT), so resumed clients send their first request with the handshake.
+ * @memberof onion_https_t
+ * 
+ * The clients that resume a session by a ticket of this listen point may send up to max_size bytes of 
+ * requests before the handshake is done, and they are answered right after the server handshake: the first 
+ * request costs one round trip less. It needs TLS 1.3 at the priority (onion_https_set_priority), and the 
+ * session tickets.
+ * 
+ * Early data can be replayed by whoever captures it. Each is accepted only once in the anti replay window 
+ * of GnuTLS, by a table of ONION_HTTPS_REPLAY_SIZE entries, shared if so with the processes forked after, 
+ * as the session cache; when it is full the early data is rejected, and the client sends it again after 
+ * the handshake. And the requests that arrive complete as early data, with other methods than GET, HEAD 
+ * and OPTIONS, are answered 425 Too Early, so the client sends them again too (RFC 8470).
+ * 
+ * Not on listen points with HTTP/2, as the streams do not know which data came early.
+ * 
+ * @param ol Listen point
+ * @param max_size Max bytes of early data of each connection, or 0 to not accept it.
+ * @param shared Whether the anti replay table is shared with the forked workers.
+ * @returns 0 if ok, -1 on error.
+ */
+int onion_https_set_early_data(onion_listen_point *ol, size_t max_size, int shared){
+	if (ol->write!=onion_https_write){
+		ONION_ERROR("Trying to set early data on a non HTTPS listen point");
+		errno=EINVAL;
+		return -1;
+	}
+	onion_https *https=(onion_https*)ol->user_data;
+	if (https->replay){
+		munmap(https->replay, https->replay->size);
+		gnutls_anti_replay_deinit(https->anti_replay);
+		https->replay=NULL;
+	}
+	https->early_data=0;
+	if (max_size==0)
+		return 0;
+	int r=gnutls_anti_replay_init(&https->anti_replay);
+	if (r<0){
+		ONION_ERROR("Could not set up the early data anti replay: %s", gnutls_strerror(r));
+		return -1;
+	}
+	https->replay=onion_https_cache_new(https, ONION_HTTPS_REPLAY_SIZE, 0, shared);
+	if (!https->replay){
+		gnutls_anti_replay_deinit(https->anti_replay);
+		return -1;
+	}
+	gnutls_anti_replay_set_add_function(https->anti_replay, onion_https_replay_add);
+	gnutls_anti_replay_set_ptr(https->anti_replay, https->replay);
+	https->early_data=max_size;
+	return 0;
+}
+
+/**
+ * @short Gets the handshake and resumption counters, of all the workers.
+ * @memberof onion_https_t
+ * 
+ * The resumption hit rate is resumed/handshakes; cache_hits/(cache_hits+cache_misses) is the one of the
+ * server side cache alone.
+ * 
+ * @returns 0 if ok, -1 if it is not a HTTPS listen point.
+ */
+int onion_https_get_stats(onion_listen_point *ol, onion_https_stats *stats){
+	if (ol->write!=onion_https_write){
+		errno=EINVAL;
+		return -1;
+	}
+	onion_https_stats *s=&((onion_https*)ol->user_data)->shared->stats;
+	stats->handshakes=__atomic_load_n(&s->handshakes, __ATOMIC_RELAXED);
+	stats->resumed=__atomic_load_n(&s->resumed, __ATOMIC_RELAXED);
+	stats->cache_hits=__atomic_load_n(&s->cache_hits, __ATOMIC_RELAXED);
+	stats->cache_misses=__atomic_load_n(&s->cache_misses, __ATOMIC_RELAXED);
+	stats->cache_stores=__atomic_load_n(&s->cache_stores, __ATOMIC_RELAXED);
+	stats->cache_evictions=__atomic_load_n(&s->cache_evictions, __ATOMIC_RELAXED);
+	stats->ktls=__atomic_load_n(&s->ktls, __ATOMIC_RELAXED);
+	stats->certificate_reloads=__atomic_load_n(&s->certificate_reloads, __ATOMIC_RELAXED);
+	stats->ocsp_fetches=__atomic_load_n(&s->ocsp_fetches, __ATOMIC_RELAXED);
+	stats->ocsp_errors=__atomic_load_n(&s->ocsp_errors, __ATOMIC_RELAXED);
+	stats->ocsp_stapled=__atomic_load_n(&s->ocsp_stapled, __ATOMIC_RELAXED);
+	stats->early_data=__atomic_load_n(&s->early_data, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/// Locks the bucket. If a process died with it locked, it is recovered; at worst that session is lost.
+static void onion_https_cache_lock(onion_https_cache_bucket *bucket){
+#ifdef HAVE_PTHREADS
+	if (pthread_mutex_lock(&bucket->mutex)==EOWNERDEAD)
+		pthread_mutex_consistent(&bucket->mutex);
+#endif
+}
+
+static void onion_https_cache_unlock(onion_https_cache_bucket *bucket){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&bucket->mutex);
+#endif
+}
+
+static onion_https_cache_bucket *onion_https_cache_get_bucket(onion_https_cache *cache, gnutls_datum_t key){
+	unsigned int h=2166136261u;
+	unsigned int i;
+	for (i=0;i<key.size;i++)
+		h=(h^key.data[i])*16777619u;
+	return &cache->buckets[h%cache->nbuckets];
+}
+
+/// Finds the slot of that session id at the bucket, if not expired. Must be locked.
+static onion_https_cache_slot *onion_https_cache_find(onion_https_cache_bucket *bucket, gnutls_datum_t key, int64_t now){
+	int i;
+	for (i=0;i<ONION_HTTPS_CACHE_WAYS;i++){
+		onion_https_cache_slot *slot=&bucket->slots[i];
+		if (slot->expires>now && slot->id_size==key.size && memcmp(slot->id, key.data, key.size)==0)
+			return slot;
+	}
+	return NULL;
+}
+
+/// GnuTLS asks for a session to resume. The data is a copy, that GnuTLS frees.
+static gnutls_datum_t onion_https_cache_retrieve(void *data, gnutls_datum_t key){
+	onion_https_cache *cache=data;
+	gnutls_datum_t ret={ NULL, 0 };
+	onion_https_cache_bucket *bucket=onion_https_cache_get_bucket(cache, key);
+	onion_https_cache_lock(bucket);
+	onion_https_cache_slot *slot=onion_https_cache_find(bucket, key, onion_https_now());
+	if (slot){
+		ret.data=gnutls_malloc(slot->data_size);
+		if (ret.data){
+			memcpy(ret.data, slot->data, slot->data_size);
+			ret.size=slot->data_size;
+		}
+	}
+	onion_https_cache_unlock(bucket);
+	__sync_fetch_and_add(ret.data ? &cache->shared->stats.cache_hits : &cache->shared->stats.cache_misses, 1);
+	return ret;
+}
+
+/**
+ * @short Stores the value by that key, at a free or expired slot, or replacing the closest to expire.
+ * 
+ * If exclusive, an entry still valid by that key is kept and it returns 1, and valid entries are never
+ * replaced: when the bucket is full it returns -1.
+ * 
+ * @returns 0 if stored, 1 if exclusive and already there, -1 if it does not fit.
+ */
+static int onion_https_cache_put(onion_https_cache *cache, gnutls_datum_t key, gnutls_datum_t value, int64_t expires, int exclusive){
+	if (key.size>ONION_HTTPS_CACHE_ID_SIZE || value.size>ONION_HTTPS_CACHE_DATA_SIZE)
+		return -1;
+	int64_t now=onion_https_now();
+	onion_https_cache_bucket *bucket=onion_https_cache_get_bucket(cache, key);
+	onion_https_cache_lock(bucket);
+	onion_https_cache_slot *slot=onion_https_cache_find(bucket, key, now);
+	if (slot && exclusive){
+		onion_https_cache_unlock(bucket);
+		return 1;
+	}
+	if (!slot){
+		int i;
+		slot=&bucket->slots[0];
+		for (i=1;i<ONION_HTTPS_CACHE_WAYS && slot->expires>now;i++){
+			if (bucket->slots[i].expires<slot->expires)
+				slot=&bucket->slots[i];
+		}
+		if (slot->expires>now){
+			if (exclusive){
+				onion_https_cache_unlock(bucket);
+				return -1;
+			}
+			__sync_fetch_and_add(&cache->shared->stats.cache_evictions, 1);
+		}
+		memcpy(slot->id, key.data, key.size);
+		slot->id_size=key.size;
+	}
+	if (value.size)
+		memcpy(slot->data, value.data, value.size);
+	slot->data_size=value.size;
+	slot->expires=expires;
+	onion_https_cache_unlock(bucket);
+	return 0;
+}
+
+/// Stores a new session after a full handshake.
+static int onion_https_cache_store(void *data, gnutls_datum_t key, gnutls_datum_t value){
+	onion_https_cache *cache=data;
+	if (key.size>GNUTLS_MAX_SESSION_ID_SIZE || onion_https_cache_put(cache, key, value, onion_https_now()+((int64_t)cache->ttl)*1000, 0)<0){
+		ONION_DEBUG("TLS session of %d bytes too big for the session cache", value.size);
+		return -1;
+	}
+	__sync_fetch_and_add(&cache->shared->stats.cache_stores, 1);
+	return 0;
+}
+
+static int onion_https_cache_remove(void *data, gnutls_datum_t key){
+	onion_https_cache *cache=data;
+	onion_https_cache_bucket *bucket=onion_https_cache_get_bucket(cache, key);
+	onion_https_cache_lock(bucket);
+	onion_https_cache_slot *slot=onion_https_cache_find(bucket, key, onion_https_now());
+	if (slot)
+		slot->expires=0;
+	onion_https_cache_unlock(bucket);
+	return slot ? 0 : -1;
+}
+
+/**
+ * @short GnuTLS keeps the early data it accepts until expires, and rejects it if already there, as replayed.
+ * 
+ * The key is the binder of the client hello, that is unique to it.
+ */
+static int onion_https_replay_add(void *data, time_t expires, const gnutls_datum_t *key, const gnutls_datum_t *value){
+	onion_https_cache *replay=data;
+	gnutls_datum_t empty={ NULL, 0 };
+	int64_t now=onion_https_now();
+	int64_t ttl=((int64_t)(expires-time(NULL)))*1000;
+	int r=onion_https_cache_put(replay, *key, empty, now+(ttl>1000 ? ttl : 1000), 1);
+	if (r==1)
+		return GNUTLS_E_DB_ENTRY_EXISTS;
+	return r<0 ? GNUTLS_E_DB_ERROR : 0;
+}
+
+/**
+ * @short Fetches the OCSP responses of the certificates in the background, and staples them at the handshakes.
+ * @memberof onion_https_t
+ * 
+ * A thread asks the responder at the OCSP URI of the certificate of each credentials, default and by host, 
+ * and keeps the response once verified against the issuer, that must be the next certificate of the chain, 
+ * or the certificate itself if self signed. The clients that ask for the certificate status get it at the 
+ * handshake, so they do not have to ask the CA before the first request.
+ * 
+ * Each response is fetched again at the half of its validity, and if the responder fails it is retried 
+ * every ONION_HTTPS_OCSP_RETRY seconds, while the previous one is still stapled until its next update. 
+ * Reloaded certificates get theirs as soon as they are installed. Only the first certificate of each 
+ * credentials is stapled.
+ * 
+ * The workers forked after start their own thread at their first handshake.
+ * 
+ * @param ol Listen point
+ * @param enable 1 to fetch and staple, 0 to stop fetching; the responses already fetched are stapled until they expire.
+ * @returns 0 if ok, -1 if not an HTTPS listen point, or there are no threads.
+ */
+int onion_https_set_ocsp_stapling(onion_listen_point *ol, int enable){
+	if (ol->write!=onion_https_write){
+		ONION_ERROR("Trying to set OCSP stapling on a non HTTPS listen point");
+		errno=EINVAL;
+		return -1;
+	}
+#ifdef HAVE_PTHREADS
+	onion_https *https=(onion_https*)ol->user_data;
+	if (!enable)
+		onion_https_ocsp_stop(https);
+	else if (!https->ocsp){
+		https->ocsp=1;
+		onion_https_ocsp_start(https);
+	}
+	return 0;
+#else
+	ONION_ERROR("OCSP stapling needs the refresh thread, but onion is compiled without threads");
+	errno=ENOSYS;
+	return -1;
+#endif
+}
+
+/// GnuTLS callback at the handshake: a copy of the current OCSP response of those credentials, if not expired.
+static int onion_https_ocsp_staple(gnutls_session_t session, void *ptr, gnutls_datum_t *response){
+	onion_https_credentials *c=(onion_https_credentials*)ptr;
+	int r=GNUTLS_E_NO_CERTIFICATE_STATUS;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&c->https->credentials_mutex);
+#endif
+	if (c->ocsp.size && time(NULL)<c->ocsp_expires){
+		response->data=gnutls_malloc(c->ocsp.size);
+		if (response->data){
+			memcpy(response->data, c->ocsp.data, c->ocsp.size);
+			response->size=c->ocsp.size;
+			r=0;
+		}
+	}
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&c->https->credentials_mutex);
+#endif
+	if (r==0)
+		__sync_fetch_and_add(&c->https->shared->stats.ocsp_stapled, 1);
 	return r;
 }
+
+#ifdef HAVE_PTHREADS
+/// Starts the refresh thread, if it is not running at this process yet.
+static void onion_https_ocsp_start(onion_https *https){
+	pid_t pid=https->ocsp_pid, me=getpid();
+	if (pid==me || !__sync_bool_compare_and_swap(&https->ocsp_pid, pid, me))
+		return;
+	if (pthread_create(&https->ocsp_thread, NULL, onion_https_ocsp_thread, https)!=0){
+		ONION_ERROR("Could not start the OCSP refresh thread");
+		https->ocsp_pid=0;
+	}
+}
+
+/// Stops the refresh thread. It may wait for a fetch in progress, that times out in some seconds.
+static void onion_https_ocsp_stop(onion_https *https){
+	pthread_mutex_lock(&https->credentials_mutex);
+	https->ocsp=0;
+	pthread_cond_signal(&https->ocsp_cond);
+	pthread_mutex_unlock(&https->credentials_mutex);
+	if (https->ocsp_pid==getpid()){
+		pthread_join(https->ocsp_thread, NULL);
+		https->ocsp_pid=0;
+	}
+}
+
+/// Refreshes the responses as they are due, sleeping until the next, or until new credentials are installed.
+static void *onion_https_ocsp_thread(void *_){
+	onion_https *https=(onion_https*)_;
+	pthread_mutex_lock(&https->credentials_mutex);
+	while (https->ocsp){
+		https->ocsp_wake=0;
+		pthread_mutex_unlock(&https->credentials_mutex);
+		int64_t next=onion_https_ocsp_refresh_all(https);
+		pthread_mutex_lock(&https->credentials_mutex);
+		while (https->ocsp && !https->ocsp_wake && onion_https_now()<next){
+			struct timespec ts;
+			ts.tv_sec=next/1000;
+			ts.tv_nsec=(next%1000)*1000000;
+			pthread_cond_timedwait(&https->ocsp_cond, &https->credentials_mutex, &ts);
+		}
+	}
+	pthread_mutex_unlock(&https->credentials_mutex);
+	return NULL;
+}
+
+/// Refreshes the due responses of all the credentials, and returns when the next is due, monotonic ms.
+static int64_t onion_https_ocsp_refresh_all(onion_https *https){
+	int64_t next=onion_https_ocsp_refresh(https, NULL);
+	if (!https->hosts)
+		return next;
+	onion_block *names=onion_block_new();
+	pthread_mutex_lock(&https->credentials_mutex);
+	onion_dict_preorder(https->hosts, onion_https_add_host_name, names);
+	pthread_mutex_unlock(&https->credentials_mutex);
+	const char *host=onion_block_data(names), *end=host+onion_block_size(names);
+	while (host<end && https->ocsp){
+		int64_t n=onion_https_ocsp_refresh(https, host);
+		if (n<next)
+			next=n;
+		host+=strlen(host)+1;
+	}
+	onion_block_free(names);
+	return next;
+}
+
+/// Fetches the response of the credentials of that host, or the default ones, if it is due. Returns when to look again.
+static int64_t onion_https_ocsp_refresh(onion_https *https, const char *host){
+	onion_https_credentials *c=onion_https_credentials_get(https, host);
+	if (!c)
+		return INT64_MAX;
+	int64_t now=onion_https_now();
+	pthread_mutex_lock(&https->credentials_mutex);
+	int64_t due=c->ocsp_refresh;
+	pthread_mutex_unlock(&https->credentials_mutex);
+	if (now<due){
+		onion_https_credentials_release(c);
+		return due;
+	}
+	
+	gnutls_datum_t der={ NULL, 0 };
+	time_t next_update=0;
+	int r=onion_https_ocsp_fetch(c, &der, &next_update);
+	int64_t next;
+	if (r==0){
+		int64_t half=(next_update-time(NULL))/2;
+		next=now+(half>ONION_HTTPS_OCSP_RETRY ? half : ONION_HTTPS_OCSP_RETRY)*1000;
+		__sync_fetch_and_add(&https->shared->stats.ocsp_fetches, 1);
+	}
+	else if (r>0) // Nothing to ask for, until the certificate is changed
+		next=INT64_MAX;
+	else{
+		ONION_WARNING("Could not get the OCSP response%s%s, retrying in %d seconds", host ? " of " : "", host ? host : "", ONION_HTTPS_OCSP_RETRY);
+		next=now+ONION_HTTPS_OCSP_RETRY*1000;
+		__sync_fetch_and_add(&https->shared->stats.ocsp_errors, 1);
+	}
+	
+	pthread_mutex_lock(&https->credentials_mutex);
+	if (c->ocsp_refresh==due){
+		if (r==0){
+			gnutls_free(c->ocsp.data);
+			c->ocsp=der;
+			c->ocsp_expires=next_update;
+			der.data=NULL;
+		}
+		c->ocsp_refresh=next;
+	}
+	else // A certificate was added meanwhile, so it is asked for again.
+		next=0;
+	pthread_mutex_unlock(&https->credentials_mutex);
+	gnutls_free(der.data);
+	onion_https_credentials_release(c);
+	return next;
+}
+
+/**
+ * @short Asks the responder of the certificate of those credentials for its status.
+ * @memberof onion_https_t
+ * 
+ * @param c The credentials
+ * @param der The verified response, to free with gnutls_free.
+ * @param next_update Until when it is valid.
+ * @returns 0 if ok, 1 if there is nothing to ask for, as there is no certificate or it has no OCSP URI, -1 on error.
+ */
+static int onion_https_ocsp_fetch(onion_https_credentials *c, gnutls_datum_t *der, time_t *next_update){
+	gnutls_datum_t raw, uri={ NULL, 0 }, request={ NULL, 0 };
+	char url[512];
+	gnutls_x509_crt_t crt=NULL, issuer=NULL;
+	gnutls_ocsp_req_t req=NULL;
+	gnutls_ocsp_resp_t resp=NULL;
+	onion_block *answer=NULL;
+	int ret=1, e=0, i;
+	
+	if (gnutls_certificate_get_crt_raw(c->cred, 0, 0, &raw)<0) // No certificate yet
+		return 1;
+	gnutls_x509_crt_init(&crt);
+	if (gnutls_x509_crt_import(crt, &raw, GNUTLS_X509_FMT_DER)<0)
+		goto end;
+	for (i=0;(e=gnutls_x509_crt_get_authority_info_access(crt, i, GNUTLS_IA_OCSP_URI, &uri, NULL))==GNUTLS_E_UNKNOWN_ALGORITHM;i++);
+	if (e<0){
+		ONION_DEBUG("The certificate has no OCSP responder, not stapling");
+		goto end;
+	}
+	snprintf(url, sizeof(url), "%.*s", (int)uri.size, uri.data); // Not 0 ended
+	ret=-1;
+	if (gnutls_certificate_get_crt_raw(c->cred, 0, 1, &raw)>=0){
+		gnutls_x509_crt_init(&issuer);
+		if ((e=gnutls_x509_crt_import(issuer, &raw, GNUTLS_X509_FMT_DER))<0){
+			ONION_ERROR("Invalid issuer certificate: %s", gnutls_strerror(e));
+			goto end;
+		}
+	}
+	else if (gnutls_x509_crt_check_issuer(crt, crt))
+		issuer=crt;
+	else{
+		ONION_ERROR("The issuer of the certificate is not at its chain, can not ask for its OCSP status");
+		goto end;
+	}
+	if ((e=gnutls_ocsp_req_init(&req))<0 || (e=gnutls_ocsp_req_add_cert(req, GNUTLS_DIG_SHA1, issuer, crt))<0 ||
+			(e=gnutls_ocsp_req_export(req, &request))<0){
+		ONION_ERROR("Error making the OCSP request: %s", gnutls_strerror(e));
+		goto end;
+	}
+	
+	answer=onion_block_new();
+	ONION_DEBUG("Asking for the OCSP status at %s", url);
+	if (onion_https_ocsp_post(url, &request, answer)<0)
+		goto end;
+	gnutls_datum_t data={ (unsigned char*)onion_block_data(answer), onion_block_size(answer) };
+	unsigned int verify=0, status=0;
+	time_t this_update=0, now=time(NULL);
+	if ((e=gnutls_ocsp_resp_init(&resp))<0 || (e=gnutls_ocsp_resp_import(resp, &data))<0){
+		ONION_ERROR("Invalid OCSP response from %s: %s", url, gnutls_strerror(e));
+		goto end;
+	}
+	if ((e=gnutls_ocsp_resp_get_status(resp))!=GNUTLS_OCSP_RESP_SUCCESSFUL){
+		ONION_ERROR("The OCSP responder %s answered with error %d", url, e);
+		goto end;
+	}
+	if ((e=gnutls_ocsp_resp_verify_direct(resp, issuer, &verify, 0))<0 || verify!=0 || (e=gnutls_ocsp_resp_check_crt(resp, 0, crt))<0){
+		ONION_ERROR("The OCSP response from %s is not signed by the issuer, or is not for this certificate", url);
+		goto end;
+	}
+	if ((e=gnutls_ocsp_resp_get_single(resp, 0, NULL, NULL, NULL, NULL, &status, &this_update, next_update, NULL, NULL))<0){
+		ONION_ERROR("Invalid OCSP response from %s: %s", url, gnutls_strerror(e));
+		goto end;
+	}
+	if (status!=GNUTLS_OCSP_CERT_GOOD){
+		ONION_ERROR("The OCSP responder %s says the certificate is %s, not stapling it", url, status==GNUTLS_OCSP_CERT_REVOKED ? "revoked" : "unknown");
+		goto end;
+	}
+	if (*next_update==(time_t)-1) // Newer status is always available
+		*next_update=now+ONION_HTTPS_OCSP_REFRESH;
+	if (*next_update<=now || this_update>now+ONION_HTTPS_OCSP_RETRY){
+		ONION_ERROR("The OCSP response from %s is expired, or not valid yet", url);
+		goto end;
+	}
+	der->data=gnutls_malloc(data.size);
+	if (!der->data)
+		goto end;
+	memcpy(der->data, data.data, data.size);
+	der->size=data.size;
+	ret=0;
+	
+end:
+	if (resp)
+		gnutls_ocsp_resp_deinit(resp);
+	if (answer)
+		onion_block_free(answer);
+	if (req)
+		gnutls_ocsp_req_deinit(req);
+	if (issuer && issuer!=crt)
+		gnutls_x509_crt_deinit(issuer);
+	gnutls_x509_crt_deinit(crt);
+	gnutls_free(request.data);
+	gnutls_free(uri.data);
+	return ret;
+}
+
+/**
+ * @short POSTs the OCSP request to the responder, and gets the body of the answer.
+ * @memberof onion_https_t
+ * 
+ * It is plain HTTP/1.0, as the responders use, so the answer ends when the connection is closed. It 
+ * waits for the responder at most 5 seconds each time.
+ * 
+ * @returns 0 if ok, -1 on error.
+ */
+static int onion_https_ocsp_post(const char *url, const gnutls_datum_t *request, onion_block *answer){
+	if (strncasecmp(url, "http://", 7)!=0){
+		ONION_ERROR("Can not ask the OCSP responder %s, only http is supported", url);
+		return -1;
+	}
+	const char *hostport=url+7;
+	const char *path=strchr(hostport, '/');
+	if (!path)
+		path=hostport+strlen(hostport);
+	const char *colon=memchr(hostport, ':', path-hostport);
+	char host[256], port[8]="80";
+	size_t l=(colon ? colon : path)-hostport;
+	if (l==0 || l>=sizeof(host) || (colon && (path-colon<2 || path-colon>(ssize_t)sizeof(port)))){
+		ONION_ERROR("Invalid OCSP responder %s", url);
+		return -1;
+	}
+	memcpy(host, hostport, l);
+	host[l]='\0';
+	if (colon){
+		memcpy(port, colon+1, path-colon-1);
+		port[path-colon-1]='\0';
+	}
+	
+	struct addrinfo hints, *res, *a;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	if (getaddrinfo(host, port, &hints, &res)!=0){
+		ONION_ERROR("Can not resolve the OCSP responder %s", host);
+		return -1;
+	}
+	struct timeval timeout={ 5, 0 };
+	int fd=-1;
+	for (a=res;a && fd<0;a=a->ai_next){
+		fd=socket(a->ai_family, a->ai_socktype|SOCK_CLOEXEC, a->ai_protocol);
+		if (fd<0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		if (connect(fd, a->ai_addr, a->ai_addrlen)<0){
+			close(fd);
+			fd=-1;
+		}
+	}
+	freeaddrinfo(res);
+	if (fd<0){
+		ONION_ERROR("Can not connect to the OCSP responder %s:%s", host, port);
+		return -1;
+	}
+	
+	onion_block *raw=onion_block_new();
+	char buffer[4096];
+	int n=snprintf(buffer, sizeof(buffer), "POST %s HTTP/1.0\r\nHost: %.*s\r\nContent-Type: application/ocsp-request\r\nContent-Length: %u\r\n\r\n",
+								 *path ? path : "/", (int)(path-hostport), hostport, request->size);
+	int ok=(n>0 && n<sizeof(buffer));
+	if (ok)
+		onion_block_add_data(raw, buffer, n);
+	onion_block_add_data(raw, (const char*)request->data, request->size);
+	const char *data=onion_block_data(raw);
+	ssize_t left=onion_block_size(raw), r=0;
+	while (ok && left>0){
+		r=send(fd, data, left, MSG_NOSIGNAL);
+		if (r<=0)
+			ok=0;
+		data+=r;
+		left-=r;
+	}
+	onion_block_clear(raw);
+	while (ok && (r=read(fd, buffer, sizeof(buffer)))>0){
+		onion_block_add_data(raw, buffer, r);
+		if (onion_block_size(raw)>ONION_HTTPS_OCSP_MAX_SIZE)
+			ok=0;
+	}
+	close(fd);
+	if (r<0)
+		ok=0;
+	
+	// The status, and the body after the headers
+	data=onion_block_data(raw);
+	size_t size=onion_block_size(raw), i;
+	if (ok && (size<12 || strncmp(data, "HTTP/1.", 7)!=0 || strncmp(data+8, " 200", 4)!=0)){
+		ONION_ERROR("The OCSP responder %s did not answer 200 OK", url);
+		ok=0;
+	}
+	for (i=0;ok && i+4<=size && memcmp(data+i, "\r\n\r\n", 4)!=0;i++);
+	if (ok && i+4>size)
+		ok=0;
+	if (ok)
+		onion_block_add_data(answer, data+i+4, size-i-4);
+	else
+		ONION_ERROR("Error getting the OCSP response from %s", url);
+	onion_block_free(raw);
+	return ok ? 0 : -1;
+}
+#endif
@@ -32,5 +32,39 @@
 onion_listen_point *onion_https_new();
 int onion_https_set_certificate(onion_listen_point *ol, onion_ssl_certificate_type type, const char *filename, ...);
 int onion_https_set_certificate_argv(onion_listen_point *ol, onion_ssl_certificate_type type, const char *filename, va_list va);
+/// Sets certificate elements only for the clients that ask for that host by SNI, as www.example.com or *.example.com.
+int onion_https_set_host_certificate(onion_listen_point *ol, const char *host, onion_ssl_certificate_type type, const char *filename, ...);
+/// Replaces atomically the credentials, default or of a SNI host, with the elements until O_SSL_NONE. Open connections keep the old ones.
+int onion_https_reload_certificate(onion_listen_point *ol, const char *host, onion_ssl_certificate_type type, const char *filename, ...);
+/// Checks every that many seconds the certificate files, and reloads them when they change. 0 to stop.
+int onion_https_watch_certificates(onion_listen_point *ol, int seconds);
+
+/// Handshake and resumption counters of a HTTPS listen point, added for all its workers.
+typedef struct onion_https_stats_t{
+	long handshakes;     ///< Successful handshakes
+	long resumed;        ///< Of them, resumed sessions, by ticket or by the session cache
+	long cache_hits;     ///< Sessions found at the session cache
+	long cache_misses;   ///< Sessions asked for and not found, or expired
+	long cache_stores;   ///< Sessions stored at the session cache
+	long cache_evictions;///< Still valid sessions replaced by new ones, as the bucket was full
+	long ktls;           ///< Connections that send by kernel TLS, so with sendfile.
+	long certificate_reloads; ///< Credentials replaced by onion_https_reload_certificate or by the watch
+	long ocsp_fetches;   ///< Valid OCSP responses got from the responders
+	long ocsp_errors;    ///< Failed OCSP fetches, as the responder was down or the response was not valid
+	long ocsp_stapled;   ///< Handshakes where the OCSP response was stapled
+	long early_data;     ///< Handshakes where the TLS 1.3 early data was accepted
+}onion_https_stats;
+
+/// Seconds between the session ticket key rotations, 0 never, or <0 to disable the session tickets.
+int onion_https_set_ticket_rotation(onion_listen_point *ol, int seconds);
+/// Server side session resumption cache, of ttl seconds, optionally shared with the prefork workers.
+int onion_https_set_session_cache(onion_listen_point *ol, int max_sessions, int ttl, int shared);
+int onion_https_get_stats(onion_listen_point *ol, onion_https_stats *stats);
+/// GnuTLS priority string, as "NORMAL". The default only allows up to TLS 1.0, and the kernel TLS needs 1.2 or 1.3.
+int onion_https_set_priority(onion_listen_point *ol, const char *priority);
+/// Fetches in the background the OCSP responses of the certificates, and staples them at the handshakes.
+int onion_https_set_ocsp_stapling(onion_listen_point *ol, int enable);
+/// Accepts up to max_size bytes of TLS 1.3 early data (0-RTT) from the resumed clients, each only once.
+int onion_https_set_early_data(onion_listen_point *ol, size_t max_size, int shared);
 
 #endif
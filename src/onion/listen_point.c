@@ -27,30 +27,41 @@
 #define _GNU_SOURCE             /* See feature_test_macros(7) */
 #endif
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "types_internal.h"
 #include "log.h"
+#include "trace.h"
 #include "poller.h"
 #include "request.h"
 #include "listen_point.h"
+#include "block.h"
+#include "admission.h"
+#include "sse.h"
 
 #ifndef SOCK_CLOEXEC
 #define SOCK_CLOEXEC 0
 #define accept4(a,b,c,d) accept(a,b,c);
 #endif
 
-#ifdef HAVE_SYSTEMD
-#include "sd-daemon.h"
-#endif
-
 
 static int onion_listen_point_read_ready(onion_request *req);
+static int onion_listen_point_received(onion_request *req, const char *data, size_t len);
+
+/// Connection accepted by the poller, for onion_listen_point_request_init_from_socket to take instead of accepting. -1 if none.
+static __thread int onion_listen_point_accepted_fd=-1;
 
 
 /**
@@ -83,44 +94,323 @@ void onion_listen_point_free(onion_listen_point *op){
 		free(op->hostname);
 	if (op->port)
 		free(op->port);
+	if (op->path)
+		free(op->path);
 	free(op);
 }
 
+/**
+ * @short Creates a copy of the listen point, that will add its connections to the given poller.
+ * @memberof onion_listen_point_t
+ * 
+ * It shares the protocol and the user data (certificates...) with the original, but has its own 
+ * listen socket, which is not open yet. Only the original owns the user data, so the copy must be freed
+ * before the original.
+ * 
+ * Used on O_REUSEPORT mode, so that each thread listens on its own socket.
+ * 
+ * @param op The original listen point
+ * @param poller Poller where to add the new connections
+ * @returns The new listen point
+ */
+onion_listen_point *onion_listen_point_dup(onion_listen_point *op, onion_poller *poller){
+	onion_listen_point *ret=onion_listen_point_new();
+	memcpy(ret, op, sizeof(onion_listen_point));
+	ret->hostname=op->hostname ? strdup(op->hostname) : NULL;
+	ret->port=op->port ? strdup(op->port) : NULL;
+	ret->path=op->path ? strdup(op->path) : NULL;
+	ret->free_user_data=NULL;
+	ret->listenfd=-1;
+	ret->poller=poller;
+	memset(&ret->accept_stats, 0, sizeof(ret->accept_stats));
+	return ret;
+}
+
+/// A phase timeout, or the server one if not set.
+static int onion_listen_point_timeout(onion *server, int timeout){
+	return timeout ? timeout : server->timeout;
+}
+
+/// Current monotonic time, in milliseconds.
+static int64_t onion_listen_point_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
 
 /**
- * @short Called when a new connection appears on the listenfd
+ * @short Sets the slot timeout for what the connection waits for now: the headers, the body, to write, or the next request.
+ * 
+ * The headers have a deadline from their first byte, so a client that sends them a byte at a time does not 
+ * keep the connection forever; the body must keep a minimum rate.
+ * 
+ * @returns ret, or OCS_CLOSE_CONNECTION if the headers or the body are too slow.
+ * @see onion_set_timeouts
+ */
+static int onion_listen_point_phase_timeout(onion_request *req, int ret){
+	onion *server=req->connection.listen_point->server;
+	const onion_timeouts *t=&server->timeouts;
+	if (ret<0 || req->connection.http2 || req->websocket)
+		return ret;
+	int timeout;
+	if (onion_request_output_pending(req))
+		timeout=onion_listen_point_timeout(server, t->write);
+	else if (!req->parser){
+		req->phase.state=0;
+		timeout=onion_listen_point_timeout(server, t->keep_alive);
+	}
+	else if (!req->known_headers.ready){
+		int64_t now=onion_listen_point_now();
+		if (req->phase.state!=1){
+			req->phase.state=1;
+			req->phase.start=now;
+		}
+		timeout=onion_listen_point_timeout(server, t->header);
+		if (timeout>=0){
+			timeout-=now-req->phase.start;
+			if (timeout<=0){
+				ONION_DEBUG("Headers not read in time, closing connection %d", req->connection.fd);
+				return OCS_CLOSE_CONNECTION;
+			}
+		}
+	}
+	else{
+		timeout=onion_listen_point_timeout(server, t->body);
+		int64_t now=onion_listen_point_now();
+		if (req->phase.state!=2){
+			req->phase.state=2;
+			req->phase.start=now;
+			req->phase.body_read=0;
+		}
+		int64_t elapsed=now-req->phase.start;
+		if (t->body_min_rate>0 && elapsed>=(timeout>0 ? timeout : 1000) && 
+				req->phase.body_read*1000/elapsed < t->body_min_rate){
+			ONION_DEBUG("Body too slow (%ld bytes in %ld ms), closing connection %d", 
+			            (long)req->phase.body_read, (long)elapsed, req->connection.fd);
+			return OCS_CLOSE_CONNECTION;
+		}
+	}
+	onion_poller_slot_set_timeout(req->connection.slot, timeout);
+	return ret;
+}
+
+/// The connection is idle since a while; frees the request buffers until the next request. @see onion_set_idle_compact
+static void onion_listen_point_idle(void *req){
+	onion_request_compact(req);
+}
+
+/// Adds the request of a new connection to the poller, with its slot. If it can not, frees the request.
+static void onion_listen_point_connection_add(onion_listen_point *op, onion_request *req){
+	if (op->server->admission && !onion_admission_connection_open(req)){
+		onion_request_free(req);
+		return;
+	}
+	onion_poller_slot *slot=onion_poller_slot_new(req->connection.fd, (void*)onion_listen_point_read_ready, req);
+	if (!slot){
+		onion_request_free(req);
+		return;
+	}
+	onion_poller *poller=op->poller ? op->poller : op->server->poller;
+	if (op->received){
+		onion_poller_slot_set_recv(slot, (void*)onion_listen_point_received);
+		req->connection.send_close=(op->close==onion_listen_point_request_close_socket && onion_poller_can_send_close(poller));
+	}
+	onion_poller_slot_set_timeout(slot, op->server->phase_timeouts ? 
+	                              onion_listen_point_timeout(op->server, op->server->timeouts.keep_alive) : op->server->timeout);
+	onion_poller_slot_set_shutdown(slot, (void*)onion_request_free, req);
+	if (op->server->idle_compact_ms>=0)
+		onion_poller_slot_set_idle(slot, op->server->idle_compact_ms, onion_listen_point_idle, req);
+	if (op->server->edge_connections && onion_poller_slot_set_edge_triggered(slot)<0){
+		ONION_DEBUG("Edge triggered connections not supported by this poller");
+		op->server->edge_connections=0;
+	}
+	req->connection.slot=slot;
+	if (op->server->flags&O_NONBLOCKING){
+		int flags=fcntl(req->connection.fd, F_GETFL);
+		if (flags==-1 || fcntl(req->connection.fd, F_SETFL, flags|O_NONBLOCK)==-1){
+			ONION_ERROR("Setting O_NONBLOCK to connection");
+			onion_poller_slot_free(slot);
+			onion_request_free(req);
+			return;
+		}
+	}
+	onion_poller_add(poller, slot);
+}
+
+/**
+ * @short Accepts one connection, and adds it to the poller.
+ * 
+ * @returns 1 if there was a connection, even if it could not be used, 0 if there was none, -1 if 
+ *   the listen socket was shut down.
+ */
+static int onion_listen_point_accept_one(onion_listen_point *op){
+	errno=0;
+	onion_request *req=onion_request_new(op);
+	if (op->listenfd<0 || errno==EINVAL){ // onion_listen_stop
+		if (req)
+			onion_request_free(req);
+		return -1;
+	}
+	if (!req) // Failed init, as https handshake. Maybe nothing to accept on non blocking.
+		return !(errno==EAGAIN || errno==EWOULDBLOCK);
+	if (req->connection.fd<0){
+		if (errno!=EAGAIN && errno!=EWOULDBLOCK)
+			ONION_ERROR("Error creating connection");
+		onion_request_free(req);
+		return 0;
+	}
+	onion_listen_point_connection_add(op, req);
+	return 1;
+}
+
+/**
+ * @short Called when new connections appear on the listenfd
  * @memberof onion_listen_point_t
  * 
- * When the new connection appears, creates the request and adds it to the pollers.
+ * For each new connection, creates the request and adds it to the pollers. On poll modes the listenfd
+ * is non blocking (onion_listen_point_set_nonblocking), so it accepts until there are no more 
+ * connections, or the server accept budget is used (onion_set_accept_budget).
  * 
- * It returns always 1 as any <0 would detach from the poller and close the listen point, 
+ * It returns 1 as any <0 would detach from the poller and close the listen point, 
  * and not accepting a request does not mean the connection point is corrupted. If a 
  * connection point may become corrupted should be the connection point itself who detaches 
- * from the poller.
+ * from the poller. The exception is when the listen socket was shut down by onion_listen_stop,
+ * as then it would be ready forever.
  * 
  * @param op The listen point from where the request must be built
- * @returns 1 always. 
+ * @returns 1, or OCS_CLOSE_CONNECTION if the listen socket is shut down.
  */
 int onion_listen_point_accept(onion_listen_point *op){
-	onion_request *req=onion_request_new(op);
-	if (req){
-		if (req->connection.fd>0){
-			onion_poller_slot *slot=onion_poller_slot_new(req->connection.fd, (void*)onion_listen_point_read_ready, req);
-			if (!slot)
-				return 1;
-			onion_poller_slot_set_timeout(slot, req->connection.listen_point->server->timeout);
-			onion_poller_slot_set_shutdown(slot, (void*)onion_request_free, req);
-			onion_poller_add(req->connection.listen_point->server->poller, slot);
-			return 1;
-		}
-		if (req->connection.fd<0)
-			ONION_ERROR("Error creating connection");
-		// else, no need for fd... no use case yet.
+	int budget=op->server->accept_budget;
+	int n=0, r=0;
+	while (n<budget && (r=onion_listen_point_accept_one(op))>0)
+		n++;
+	if (r<0){
+		ONION_DEBUG("Listen point stopped, removing it from the poller");
+		return OCS_CLOSE_CONNECTION;
 	}
+	
+	__sync_fetch_and_add(&op->accept_stats.wakeups, 1);
+	__sync_fetch_and_add(&op->accept_stats.accepted, n);
+	if (n==budget)
+		__sync_fetch_and_add(&op->accept_stats.full, 1);
+	ONION_DEBUG0("Accepted %d connections at this wakeup", n);
+	return 1;
+}
 
+/**
+ * @short Called with each connection that the poller accepted, if it can accept
+ * @memberof onion_listen_point_t
+ * 
+ * The listen slot is set so with onion_poller_slot_set_accept, and then this is called instead of 
+ * onion_listen_point_accept, with each new connection already accepted, at its own poller completion: so
+ * there is no accept budget, and those completed at the same poller wakeup count as one wakeup. The request
+ * is made as for onion_listen_point_accept, but onion_listen_point_request_init_from_socket takes this fd 
+ * instead of accepting.
+ * 
+ * @param op The listen point
+ * @param fd The new connection, or -errno if the accept failed
+ * @returns 1, or OCS_CLOSE_CONNECTION if the listen socket is shut down.
+ */
+int onion_listen_point_accepted(onion_listen_point *op, int fd){
+	if (op->listenfd<0 || fd==-EINVAL){ // onion_listen_stop
+		if (fd>=0)
+			close(fd);
+		ONION_DEBUG("Listen point stopped, removing it from the poller");
+		return OCS_CLOSE_CONNECTION;
+	}
+	if (fd<0){
+		if (fd!=-EAGAIN && fd!=-EWOULDBLOCK && fd!=-ECONNABORTED)
+			ONION_ERROR("Error accepting connection: %s", strerror(-fd));
+		return 1;
+	}
+	unsigned long wakeup;
+	onion_poller_get_event_stats(op->poller ? op->poller : op->server->poller, &wakeup, NULL);
+	if (__sync_lock_test_and_set(&op->accept_stats.poller_wakeup, wakeup)!=wakeup)
+		__sync_fetch_and_add(&op->accept_stats.wakeups, 1);
+	__sync_fetch_and_add(&op->accept_stats.accepted, 1);
+	onion_listen_point_accepted_fd=fd;
+	onion_request *req=onion_request_new(op);
+	if (onion_listen_point_accepted_fd>=0){ // Not taken, so the listen point does not accept from sockets
+		close(onion_listen_point_accepted_fd);
+		onion_listen_point_accepted_fd=-1;
+	}
+	if (!req) // Failed init, as https handshake.
+		return 1;
+	if (req->connection.fd<0){
+		onion_request_free(req);
+		return 1;
+	}
+	onion_listen_point_connection_add(op, req);
 	return 1;
 }
 
+/**
+ * @short Gets the accept counters of this listen point
+ * @memberof onion_listen_point_t
+ * 
+ * The accepted/wakeups ratio is the mean of connections accepted per poller wakeup. If many of 
+ * the wakeups are full, the accept budget may be too small.
+ * 
+ * On O_REUSEPORT mode the other threads have their own listen points, which are not counted here.
+ * 
+ * @param op The listen point
+ * @param wakeups Times the listen socket was ready. May be NULL.
+ * @param accepted Accepted connections. May be NULL.
+ * @param full Wakeups where all the accept budget was used. May be NULL.
+ */
+void onion_listen_point_get_accept_stats(onion_listen_point *op, unsigned long *wakeups, unsigned long *accepted, unsigned long *full){
+	if (wakeups)
+		*wakeups=op->accept_stats.wakeups;
+	if (accepted)
+		*accepted=op->accept_stats.accepted;
+	if (full)
+		*full=op->accept_stats.full;
+}
+
+/**
+ * @short Sets the listen socket non blocking, so it can accept in a loop.
+ * @memberof onion_listen_point_t
+ * 
+ * Accepted connections do not inherit it. It does nothing if this listen point is not socket based.
+ * 
+ * @returns 0 if ok, <0 on error.
+ */
+int onion_listen_point_set_nonblocking(onion_listen_point *op){
+	if (op->listen || op->listenfd<0)
+		return 0;
+	int flags=fcntl(op->listenfd, F_GETFL);
+	if (flags==-1 || fcntl(op->listenfd, F_SETFL, flags|O_NONBLOCK)==-1){
+		ONION_ERROR("Setting O_NONBLOCK to listen socket: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/// listen_stop of listen points that use the listenfd of other, which closes it.
+static void onion_listen_point_listen_stop_shared(onion_listen_point *op){
+	op->listenfd=-1;
+}
+
+/**
+ * @short Creates a copy of the listen point that uses the same listen socket
+ * @memberof onion_listen_point_t
+ * 
+ * As onion_listen_point_dup, but it does not open its own socket. It must be stopped and freed before
+ * the original, that owns the socket. The socket should be added to the pollers as O_POLL_EXCLUSIVE, 
+ * so that only one of them wakes up on each new connection.
+ * 
+ * @param op The original listen point, already listening.
+ * @param poller Poller where to add the new connections
+ * @returns The new listen point
+ */
+onion_listen_point *onion_listen_point_dup_shared(onion_listen_point *op, onion_poller *poller){
+	onion_listen_point *ret=onion_listen_point_dup(op, poller);
+	ret->listenfd=op->listenfd;
+	ret->listen_stop=onion_listen_point_listen_stop_shared;
+	return ret;
+}
+
 /**
  * @short Stops listening the listen point
  * @memberof onion_listen_point_t
@@ -137,10 +427,152 @@ void onion_listen_point_listen_stop(onion_listen_point *op){
 			shutdown(op->listenfd,SHUT_RDWR);
 			close(op->listenfd);
 			op->listenfd=-1;
+			if (op->path && op->path[0]!='@') // Handed sockets are not closed here, so the next process keeps the file.
+				unlink(op->path);
 		}
 	}
 }
 
+/**
+ * @short Sets the socket tuning options of this listen point
+ * @memberof onion_listen_point_t
+ * 
+ * They are applied when it starts listening, also to systemd passed sockets. Fields at 0 get the 
+ * server defaults, set with onion_set_socket_options.
+ * 
+ * @param op The listen point
+ * @param opts The options. They are copied.
+ */
+void onion_listen_point_set_socket_options(onion_listen_point *op, const onion_socket_options *opts){
+	op->socket_options=*opts;
+}
+
+/// Sets an int socket option, if asked to.
+static void onion_listen_point_setsockopt(int sockfd, int level, int name, const char *sname, int value){
+	if (!value)
+		return;
+	if (setsockopt(sockfd, level, name, &value, sizeof(value))<0)
+		ONION_ERROR("Could not set %s to %d: %s", sname, value, strerror(errno));
+}
+
+/**
+ * @short Applies the socket options to the listen socket, and starts listening on it.
+ * 
+ * Also for already listening sockets, as then listen just changes the backlog.
+ */
+static void onion_listen_point_listen_with_options(onion_listen_point *op, int sockfd){
+	onion_socket_options opts=op->socket_options;
+	const onion_socket_options *def=&op->server->socket_options;
+#define ONION_SOCKET_OPTION_DEFAULT(field) if (!opts.field) opts.field=def->field;
+	ONION_SOCKET_OPTION_DEFAULT(backlog);
+	ONION_SOCKET_OPTION_DEFAULT(defer_accept);
+	ONION_SOCKET_OPTION_DEFAULT(fastopen);
+	ONION_SOCKET_OPTION_DEFAULT(nodelay);
+	ONION_SOCKET_OPTION_DEFAULT(busy_poll);
+	ONION_SOCKET_OPTION_DEFAULT(sndbuf);
+	ONION_SOCKET_OPTION_DEFAULT(rcvbuf);
+#undef ONION_SOCKET_OPTION_DEFAULT
+	
+	onion_listen_point_setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", opts.sndbuf);
+	onion_listen_point_setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", opts.rcvbuf);
+	if (op->path){ // No TCP at unix sockets
+		if (listen(sockfd, opts.backlog ? opts.backlog : SOMAXCONN)<0)
+			ONION_ERROR("Could not listen: %s", strerror(errno));
+		return;
+	}
+	onion_listen_point_setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", opts.nodelay);
+#ifdef TCP_DEFER_ACCEPT
+	onion_listen_point_setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, "TCP_DEFER_ACCEPT", opts.defer_accept);
+#else
+	if (opts.defer_accept)
+		ONION_WARNING("TCP_DEFER_ACCEPT not supported on this platform.");
+#endif
+#ifdef TCP_FASTOPEN
+	onion_listen_point_setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", opts.fastopen);
+#else
+	if (opts.fastopen)
+		ONION_WARNING("TCP_FASTOPEN not supported on this platform.");
+#endif
+#ifdef SO_BUSY_POLL
+	onion_listen_point_setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", opts.busy_poll);
+#else
+	if (opts.busy_poll)
+		ONION_WARNING("SO_BUSY_POLL not supported on this platform.");
+#endif
+	
+	if (listen(sockfd, opts.backlog ? opts.backlog : SOMAXCONN)<0)
+		ONION_ERROR("Could not listen: %s", strerror(errno));
+}
+
+/**
+ * @short Fills the address of a unix socket listen point. Returns its length, or 0 if the path is too long.
+ * 
+ * A leading '@' is at the abstract namespace, where the name starts with a '\0' and is not '\0' ended.
+ */
+static socklen_t onion_listen_point_unix_address(onion_listen_point *op, struct sockaddr_un *addr){
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family=AF_UNIX;
+	size_t len=strlen(op->path);
+	if (len>=sizeof(addr->sun_path)){
+		ONION_ERROR("Unix socket path too long: %s", op->path);
+		return 0;
+	}
+	memcpy(addr->sun_path, op->path, len);
+	if (op->path[0]=='@'){
+		addr->sun_path[0]='\0';
+		return offsetof(struct sockaddr_un, sun_path)+len;
+	}
+	return offsetof(struct sockaddr_un, sun_path)+len+1;
+}
+
+/**
+ * @short Listens at the unix socket of the listen point.
+ * 
+ * A socket file left by a previous process is replaced, but only if nobody listens at it, so a second 
+ * bind, as of O_REUSEPORT, fails as at TCP, and shares the socket.
+ */
+static int onion_listen_point_listen_unix(onion_listen_point *op){
+	struct sockaddr_un addr;
+	socklen_t len=onion_listen_point_unix_address(op, &addr);
+	if (!len)
+		return ENAMETOOLONG;
+	int sockfd=socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sockfd<0){
+		ONION_ERROR("Could not create unix socket: %s", strerror(errno));
+		return errno;
+	}
+	if (SOCK_CLOEXEC == 0)
+		fcntl(sockfd, F_SETFD, fcntl(sockfd, F_GETFD) | FD_CLOEXEC);
+	int ret=bind(sockfd, (struct sockaddr*)&addr, len);
+	if (ret<0 && errno==EADDRINUSE && op->path[0]!='@'){
+		int probe=socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		struct stat st;
+		if (probe>=0 && connect(probe, (struct sockaddr*)&addr, len)<0 && errno==ECONNREFUSED &&
+		    lstat(op->path, &st)==0 && S_ISSOCK(st.st_mode)){
+			ONION_DEBUG("Replacing stale unix socket %s", op->path);
+			unlink(op->path);
+			ret=bind(sockfd, (struct sockaddr*)&addr, len);
+		}
+		else
+			errno=EADDRINUSE;
+		if (probe>=0)
+			close(probe);
+	}
+	if (ret<0){
+		int err=errno;
+		ONION_ERROR("Could not bind to unix socket %s: %s", op->path, strerror(err));
+		close(sockfd);
+		return err;
+	}
+	if (op->mode && op->path[0]!='@' && chmod(op->path, op->mode)<0)
+		ONION_ERROR("Could not set the permissions of %s: %s", op->path, strerror(errno));
+	
+	ONION_DEBUG("Listening to unix socket %s, fd %d", op->path, sockfd);
+	onion_listen_point_listen_with_options(op, sockfd);
+	op->listenfd=sockfd;
+	return 0;
+}
+
 /**
  * @short Starts the listening phase for this listen point for sockets.
  * @memberof onion_listen_point_t
@@ -155,22 +587,8 @@ int onion_listen_point_listen(onion_listen_point *op){
 			op->listen(op);
 			return 0;
 	}
-#ifdef HAVE_SYSTEMD
-	if (op->server->flags&O_SYSTEMD){
-		int n=sd_listen_fds(0);
-		ONION_DEBUG("Checking if have systemd sockets: %d",n);
-		if (n>0){ // If 0, normal startup. Else use the first LISTEN_FDS.
-			ONION_DEBUG("Using systemd sockets");
-			if (n>1){
-				ONION_WARNING("Get more than one systemd socket descriptor. Using only the first.");
-			}
-			op->listenfd=SD_LISTEN_FDS_START+0;
-			return 0;
-		}
-	}
-#endif
-
-	
+	if (op->path)
+		return onion_listen_point_listen_unix(op);
 	struct addrinfo hints;
 	struct addrinfo *result, *rp;
 	int sockfd;
@@ -208,6 +626,15 @@ int onion_listen_point_listen(onion_listen_point *op){
 		if (setsockopt(sockfd,SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval) ) < 0){
 			ONION_ERROR("Could not set socket options: %s",strerror(errno));
 		}
+		if (op->server->flags&O_REUSEPORT){
+#ifdef SO_REUSEPORT
+			if (setsockopt(sockfd,SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval) ) < 0){
+				ONION_ERROR("Could not set SO_REUSEPORT: %s",strerror(errno));
+			}
+#else
+			ONION_WARNING("SO_REUSEPORT not supported on this platform.");
+#endif
+		}
 		if (bind(sockfd, rp->ai_addr, rp->ai_addrlen) == 0)
 			break; // Success
 		else {
@@ -227,12 +654,54 @@ int onion_listen_point_listen(onion_listen_point *op){
 	ONION_DEBUG("Listening to %s:%s, fd %d",address,&address[32],sockfd);
 #endif
 	freeaddrinfo(result);
-	listen(sockfd,5); // queue of only 5.
+	onion_listen_point_listen_with_options(op, sockfd);
 	
 	op->listenfd=sockfd;
 	return 0;
 }
 
+/**
+ * @short Listens on an already open and bound socket, as the ones taken at a hot restart.
+ * @memberof onion_listen_point_t
+ * 
+ * The socket options are applied to it, and it is owned by the listen point from now on.
+ * 
+ * @param op The listen point
+ * @param fd The socket
+ */
+void onion_listen_point_listen_fd(onion_listen_point *op, int fd){
+	ONION_DEBUG("Listening to inherited fd %d at %s:%s", fd, op->hostname, op->port ? op->port : "8080");
+	op->listenfd=fd;
+	onion_listen_point_listen_with_options(op, fd);
+}
+
+/**
+ * @short After processing, if there is output pending, waits for the socket to be writable.
+ * 
+ * @param req The request
+ * @param ret The status as returned by the processing
+ * @returns The status for the poller.
+ */
+static int onion_listen_point_wait_output(onion_request *req, int ret){
+	if (req->connection.slot && onion_request_output_pending(req)){
+		ONION_DEBUG0("Output pending, waiting for fd %d to be writable", req->connection.fd);
+		req->output.status=ret<0 ? ret : OCS_PROCESSED; // If must close, close after the data is written.
+		onion_poller_slot_set_type(req->connection.slot, O_POLL_WRITE|O_POLL_OTHER);
+		return OCS_PROCESSED;
+	}
+	return ret;
+}
+
+/// After the connection data is processed, waits for the output if still pending, and sets the phase timeout.
+static int onion_listen_point_processed(onion_request *req, int ret){
+	if (ret==OCS_YIELD) // Not mine anymore.
+		return ret;
+	ret=onion_listen_point_wait_output(req, ret);
+	if (req->connection.listen_point->server->phase_timeouts)
+		ret=onion_listen_point_phase_timeout(req, ret);
+	return ret;
+}
+
 /**
  * @short This listen point has data ready to read; calls the listen_point read_ready
  * @memberof onion_listen_point_t
@@ -247,10 +716,84 @@ static int onion_listen_point_read_ready(onion_request *req){
 		return OCS_INTERNAL_ERROR;
 	}
 #endif
-		
-	return req->connection.listen_point->read_ready(req);
+	if (req->sse) // Writable, with events queued
+		return onion_sse_ready(req->sse);
+	if (onion_request_output_pending(req)){ // Called as socket is writable
+		int r=onion_request_output_flush(req);
+		if (r<0)
+			return r;
+		if (r>0)
+			return OCS_PROCESSED;
+		if (req->connection.state==OR_STATE_WRITING) // The response is done now
+			onion_request_set_state(req, OR_STATE_IDLE);
+		onion_poller_slot_set_type(req->connection.slot, O_POLL_READ|O_POLL_OTHER);
+		if (req->output.status<0)
+			return req->output.status;
+		if (!req->pipeline.data || !onion_block_size(req->pipeline.data)){
+			if (req->connection.listen_point->server->phase_timeouts)
+				return onion_listen_point_phase_timeout(req, OCS_PROCESSED);
+			return OCS_PROCESSED;
+		}
+		// Pipelined requests that waited for the output.
+		onion_block *pipelined=req->pipeline.data;
+		req->pipeline.data=NULL;
+		int ret=onion_request_write(req, onion_block_data(pipelined), onion_block_size(pipelined));
+		onion_block_free(pipelined);
+		return onion_listen_point_processed(req, ret);
+	}
+	
+	return onion_listen_point_processed(req, req->connection.listen_point->read_ready(req));
 }
 
+/**
+ * @short The poller read data for this connection, as the listen point can take it. @see onion_poller_slot_set_recv
+ * @memberof onion_listen_point_t
+ * 
+ * As onion_listen_point_read_ready, but the listen point received method gets the data, instead of read_ready
+ * reading it. The poller only reads while the slot waits to read, so there is no output pending.
+ * 
+ * @param req The request
+ * @param data The data read, only valid during this call
+ * @param len Its length, or 0 if the client closed the connection
+ * @returns <0 in case of error and request connection should be closed.
+ */
+static int onion_listen_point_received(onion_request *req, const char *data, size_t len){
+	if (req->sse) // Not for the client to send
+		return len ? onion_sse_ready(req->sse) : OCS_CLOSE_CONNECTION;
+	return onion_listen_point_processed(req, req->connection.listen_point->received(req, data, len));
+}
+
+/**
+ * @short Gives back the connection to its poller, after the request was processed at another thread.
+ * @memberof onion_listen_point_t
+ * 
+ * The processing returned OCS_YIELD to the poller, so its slot is not watched. Now the slot is watched 
+ * again, or if the connection should be closed, it is removed from the poller, which frees the request.
+ * 
+ * @param req The request
+ * @param status The status of the processing, as onion_request_process.
+ */
+void onion_listen_point_request_resume(onion_request *req, int status){
+	onion_listen_point *op=req->connection.listen_point;
+	req->output.more=0;
+	if (status>=0 && req->pipeline.data && onion_block_size(req->pipeline.data)){ // Next pipelined requests, already read.
+		onion_block *pipelined=req->pipeline.data;
+		req->pipeline.data=NULL;
+		status=onion_request_write(req, onion_block_data(pipelined), onion_block_size(pipelined));
+		onion_block_free(pipelined);
+		if (status==OCS_YIELD) // At another thread again
+			return;
+	}
+	else if (req->output.more_sent)
+		onion_request_output_push(req);
+	status=onion_listen_point_wait_output(req, status<0 ? status : OCS_PROCESSED);
+	if (op->server->phase_timeouts)
+		status=onion_listen_point_phase_timeout(req, status);
+	if (status<0)
+		onion_poller_remove(op->poller ? op->poller : op->server->poller, req->connection.fd);
+	else
+		onion_poller_slot_resume(req->connection.slot);
+}
 
 /**
  * @short Default implementation that initializes the request from a socket
@@ -274,22 +817,31 @@ int onion_listen_point_request_init_from_socket(onion_request *req){
 	req->connection.cli_len = sizeof(req->connection.cli_addr);
 
 	int set_cloexec=SOCK_CLOEXEC == 0;
-	int clientfd=accept4(listenfd, (struct sockaddr *) &req->connection.cli_addr, 
+	int clientfd;
+	if (onion_listen_point_accepted_fd>=0){ // Already accepted by the poller. @see onion_listen_point_accepted
+		clientfd=onion_listen_point_accepted_fd;
+		onion_listen_point_accepted_fd=-1;
+		if (getpeername(clientfd, (struct sockaddr *) &req->connection.cli_addr, &req->connection.cli_len)<0)
+			req->connection.cli_len=0;
+	}
+	else
+		clientfd=accept4(listenfd, (struct sockaddr *) &req->connection.cli_addr, 
 				&req->connection.cli_len, SOCK_CLOEXEC);
-	if (clientfd<0){
+	if (clientfd<0 && errno==ENOSYS){
 		ONION_DEBUG("Second try? errno %d, clientfd %d", errno, clientfd);
-		if (errno==ENOSYS){
-			clientfd=accept(listenfd, (struct sockaddr *) &req->connection.cli_addr, 
-					&req->connection.cli_len);
-		}
-		ONION_DEBUG("How was it? errno %d, clientfd %d", errno, clientfd);
-		if (clientfd<0){
-			ONION_ERROR("Error accepting connection: %s",strerror(errno),errno);
-			onion_listen_point_request_close_socket(req);
+		clientfd=accept(listenfd, (struct sockaddr *) &req->connection.cli_addr, 
+				&req->connection.cli_len);
+	}
+	if (clientfd<0){
+		if (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINVAL) // Non blocking listenfd with nothing new, or shut down. Keep errno for the caller.
 			return -1;
-		}
+		ONION_ERROR("Error accepting connection: %s",strerror(errno),errno);
+		onion_listen_point_request_close_socket(req);
+		return -1;
 	}
 	req->connection.fd=clientfd;
+	onion_request_timing(req, OR_PHASE_ACCEPT);
+	ONION_TRACE(accept, clientfd);
 	
 	/// Thanks to Andrew Victor for pointing that without this client may block HTTPS connection. It could lead to DoS if occupies all connections.
 	{
@@ -319,14 +871,98 @@ int onion_listen_point_request_init_from_socket(onion_request *req){
  * @short Default implementation that just closes the connection
  * @memberof onion_listen_point_t
  * 
+ * If the poller can, it sends the last response, kept by the request, and then shuts down and closes the 
+ * connection, all without waiting for it. @see onion_poller_send_close
+ * 
  * @param oc The request
  */
 void onion_listen_point_request_close_socket(onion_request *oc){
 	int fd=oc->connection.fd;
 	ONION_DEBUG0("Closing connection socket %d",fd);
+	onion_block *last=oc->output.last;
+	oc->output.last=NULL;
 	if (fd>=0){
-		shutdown(fd,SHUT_RDWR);
-		close(fd);
+		ONION_TRACE(close, fd);
+		onion_listen_point *op=oc->connection.listen_point;
+		onion_poller *poller=op->poller ? op->poller : op->server->poller;
+		if (!oc->connection.send_close || onion_poller_send_close(poller, fd, last ? onion_block_data(last) : NULL, 
+				last ? onion_block_size(last) : 0)<0){
+			if (last){ // As it would have been written
+				size_t pos=0;
+				ssize_t w;
+				while (pos<onion_block_size(last) && (w=write(fd, onion_block_data(last)+pos, onion_block_size(last)-pos))>0)
+					pos+=w;
+			}
+			shutdown(fd,SHUT_RDWR);
+			close(fd);
+		}
 		oc->connection.fd=-1;
 	}
+	if (last)
+		onion_block_free(last);
+}
+
+/// The connections being listed by onion_listen_point_get_connections
+typedef struct{
+	onion_connection_info *infos;
+	int count;
+	int size;
+	int64_t now;
+}onion_listen_point_connections;
+
+/// Adds the connection of the slot, if it is one. At onion_poller_foreach, so with the poller locked.
+static void onion_listen_point_connection_info(onion_listen_point_connections *list, int (*f)(void*), void *data){
+	if (f!=(void*)onion_listen_point_read_ready)
+		return;
+	if (list->count>=list->size){
+		int size=list->size ? list->size*2 : 64;
+		onion_connection_info *infos=realloc(list->infos, sizeof(onion_connection_info)*size);
+		if (!infos)
+			return;
+		list->infos=infos;
+		list->size=size;
+	}
+	onion_request *req=data;
+	onion_connection_info *info=&list->infos[list->count++];
+	memset(info, 0, sizeof(onion_connection_info));
+	info->fd=req->connection.fd;
+	char host[64], serv[16];
+	if (req->connection.cli_len && (req->connection.cli_addr.ss_family==AF_INET || req->connection.cli_addr.ss_family==AF_INET6) &&
+			getnameinfo((struct sockaddr*)&req->connection.cli_addr, req->connection.cli_len, host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST|NI_NUMERICSERV)==0)
+		snprintf(info->peer, sizeof(info->peer), strchr(host, ':') ? "[%s]:%s" : "%s:%s", host, serv);
+	onion_listen_point *op=req->connection.listen_point;
+	snprintf(info->listen_point, sizeof(info->listen_point), "%s:%s", op->hostname ? op->hostname : "*", op->port ? op->port : "");
+	info->state=req->connection.handshake ? OR_STATE_HANDSHAKE : req->connection.state;
+	info->age_ms=list->now-req->connection.accepted;
+	info->state_ms=list->now-req->connection.state_since;
+	info->bytes_in=req->connection.bytes_in;
+	info->bytes_out=req->connection.bytes_out;
+	memcpy(info->path, req->connection.path, sizeof(info->path)); // It may be written meanwhile, but it is always there
+	info->path[sizeof(info->path)-1]='\0';
+}
+
+/**
+ * @short Adds the connections at that poller to the list, growing it.
+ * 
+ * Used by onion_get_connections. The fields of each connection are read as they are, without locks, so 
+ * they are only a close picture of what it does.
+ * 
+ * @param poller The poller
+ * @param infos The list, allocated with malloc, or NULL
+ * @param count Connections at it, updated
+ * @param size Its allocated size, updated
+ */
+void onion_listen_point_get_connections(onion_poller *poller, onion_connection_info **infos, int *count, int *size){
+	onion_listen_point_connections list={ *infos, *count, *size, 0 };
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts); // Same clock as the states
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	list.now=((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+	onion_poller_foreach(poller, (void*)onion_listen_point_connection_info, &list);
+	*infos=list.infos;
+	*count=list.count;
+	*size=list.size;
 }
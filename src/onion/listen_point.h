@@ -30,10 +30,19 @@
 
 onion_listen_point *onion_listen_point_new();
 int onion_listen_point_listen(onion_listen_point *);
+void onion_listen_point_listen_fd(onion_listen_point *, int fd);
 void onion_listen_point_listen_stop(onion_listen_point *op);
 void onion_listen_point_free(onion_listen_point *);
+onion_listen_point *onion_listen_point_dup(onion_listen_point *op, onion_poller *poller);
 int onion_listen_point_accept(onion_listen_point *);
+int onion_listen_point_accepted(onion_listen_point *op, int fd);
+void onion_listen_point_get_accept_stats(onion_listen_point *op, unsigned long *wakeups, unsigned long *accepted, unsigned long *full);
+int onion_listen_point_set_nonblocking(onion_listen_point *op);
+onion_listen_point *onion_listen_point_dup_shared(onion_listen_point *op, onion_poller *poller);
+void onion_listen_point_set_socket_options(onion_listen_point *op, const onion_socket_options *opts);
 int onion_listen_point_request_init_from_socket(onion_request *op);
 void onion_listen_point_request_close_socket(onion_request *oc);
+void onion_listen_point_request_resume(onion_request *req, int status);
+void onion_listen_point_get_connections(onion_poller *poller, onion_connection_info **infos, int *count, int *size);
 
 #endif
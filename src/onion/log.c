@@ -47,6 +47,9 @@ static pthread_mutex_t onion_log_mutex=PTHREAD_MUTEX_INITIALIZER;
 #ifdef __DEBUG__
 static const char *debug0=NULL;
 #endif
+/// Messages per second, and burst, of each rate limited call site. @see onion_log_set_ratelimit
+static int onion_log_ratelimit_rate=10;
+static int onion_log_ratelimit_burst=20;
 
 void onion_log_syslog(onion_log_level level, const char *filename, int lineno, const char *fmt, ...);
 void onion_log_stderr(onion_log_level level, const char *filename, int lineno, const char *fmt, ...);
@@ -121,7 +124,7 @@ void onion_log_stderr(onion_log_level level, const char *filename, int lineno, c
 		va_start(ap, fmt);
 		vsnprintf(tmp,sizeof(tmp),fmt, ap);
 		va_end(ap);
-		onion_log(level, filename, lineno, tmp);
+		onion_log(level, filename, lineno, "%s", tmp);
 		return;
 	}
 	
@@ -176,6 +179,58 @@ void onion_log_stderr(onion_log_level level, const char *filename, int lineno, c
 }
 
 
+/**
+ * @short Sets how much each ONION_LOG_RATELIMITED call site may log.
+ * 
+ * Each call site may log up to burst messages at once, and rate per second on average, default 10 and
+ * 20; the ones over that are dropped, and counted at the next that is logged. With rate 0 they are not 
+ * limited.
+ */
+void onion_log_set_ratelimit(int rate, int burst){
+	onion_log_ratelimit_rate=rate;
+	onion_log_ratelimit_burst=burst>0 ? burst : 1;
+}
+
+/**
+ * @short Takes a token of the bucket of a call site, refilled as time passes.
+ * 
+ * It never waits: while other thread checks that same call site, the message is just dropped.
+ */
+int onion_log_ratelimit_check(onion_log_ratelimit *rl, unsigned long *dropped){
+	*dropped=0;
+	int rate=onion_log_ratelimit_rate, burst=onion_log_ratelimit_burst;
+	if (rate<=0)
+		return 1;
+	if (__sync_lock_test_and_set(&rl->lock, 1)){
+		__sync_fetch_and_add(&rl->dropped, 1);
+		return 0;
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	long now=ts.tv_sec*1000 + ts.tv_nsec/1000000;
+	long added=(now-rl->refilled_ms)*rate/1000;
+	if (added>0 || !rl->refilled_ms){
+		if (!rl->refilled_ms || rl->tokens+added>=burst){
+			rl->tokens=burst;
+			rl->refilled_ms=now;
+		}
+		else{
+			rl->tokens+=added;
+			rl->refilled_ms+=added*1000/rate; // Keeps the remainder for the next token
+		}
+	}
+	int ok=0;
+	if (rl->tokens>0){
+		rl->tokens--;
+		*dropped=__sync_lock_test_and_set(&rl->dropped, 0);
+		ok=1;
+	}
+	else
+		__sync_fetch_and_add(&rl->dropped, 1);
+	__sync_lock_release(&rl->lock);
+	return ok;
+}
+
 /**
  * @short Performs the log to the syslog
  */
@@ -26,17 +26,49 @@
 #ifndef ONION_LOG_H
 #define ONION_LOG_H
 
+/**
+ * @short Lowest level compiled in, as an onion_log_level number: with 3, the debug and info calls are not 
+ * compiled, nor their arguments evaluated. Set it with -DONION_LOG_MIN_LEVEL=n, or the CMake option of the same name.
+ */
+#ifndef ONION_LOG_MIN_LEVEL
+#define ONION_LOG_MIN_LEVEL 0
+#endif
+
+/// Logs at that level, if compiled in.
+#define ONION_LOG(level, ...) (((level)>=ONION_LOG_MIN_LEVEL) ? onion_log(level, __FILE__, __LINE__, __VA_ARGS__) : (void)0)
+
 #ifdef __DEBUG__
-#define ONION_DEBUG(...) onion_log(O_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define ONION_DEBUG0(...) onion_log(O_DEBUG0, __FILE__, __LINE__, __VA_ARGS__)
+#define ONION_DEBUG(...) ONION_LOG(O_DEBUG, __VA_ARGS__)
+#define ONION_DEBUG0(...) ONION_LOG(O_DEBUG0, __VA_ARGS__)
 #else
 #define ONION_DEBUG(...)
 #define ONION_DEBUG0(...)
 #endif
 
-#define ONION_INFO(...) onion_log(O_INFO, __FILE__, __LINE__, __VA_ARGS__)
-#define ONION_WARNING(...) onion_log(O_WARNING, __FILE__, __LINE__, __VA_ARGS__)
-#define ONION_ERROR(...) onion_log(O_ERROR, __FILE__, __LINE__, __VA_ARGS__)
+#define ONION_INFO(...) ONION_LOG(O_INFO, __VA_ARGS__)
+#define ONION_WARNING(...) ONION_LOG(O_WARNING, __VA_ARGS__)
+#define ONION_ERROR(...) ONION_LOG(O_ERROR, __VA_ARGS__)
+
+/**
+ * @short Logs at that level, if compiled in and this call site has not logged too much lately.
+ * 
+ * For the messages clients can cause at will, as bad requests or missing files, so they can not flood
+ * the log. Each call site has its own bucket of onion_log_set_ratelimit tokens; when it logs again after
+ * dropping messages it says how many.
+ */
+#define ONION_LOG_RATELIMITED(level, ...) do{ \
+		static onion_log_ratelimit onion_log_ratelimit_site; \
+		unsigned long onion_log_ratelimit_dropped; \
+		if ((level)>=ONION_LOG_MIN_LEVEL && onion_log_ratelimit_check(&onion_log_ratelimit_site, &onion_log_ratelimit_dropped)){ \
+			if (onion_log_ratelimit_dropped) \
+				onion_log(level, __FILE__, __LINE__, "%lu similar messages were dropped", onion_log_ratelimit_dropped); \
+			onion_log(level, __FILE__, __LINE__, __VA_ARGS__); \
+		} \
+	}while(0)
+
+#define ONION_INFO_RATELIMITED(...) ONION_LOG_RATELIMITED(O_INFO, __VA_ARGS__)
+#define ONION_WARNING_RATELIMITED(...) ONION_LOG_RATELIMITED(O_WARNING, __VA_ARGS__)
+#define ONION_ERROR_RATELIMITED(...) ONION_LOG_RATELIMITED(O_ERROR, __VA_ARGS__)
 
 #ifdef __cplusplus
 extern "C"{
@@ -68,6 +100,19 @@ extern void (*onion_log)(onion_log_level level, const char *filename, int lineno
 void onion_log_stderr(onion_log_level level, const char *filename, int lineno, const char *fmt, ...);
 void onion_log_syslog(onion_log_level level, const char *filename, int lineno, const char *fmt, ...);
 
+/// Token bucket of a rate limited call site. Zero initialized, as a static. @see ONION_LOG_RATELIMITED
+typedef struct onion_log_ratelimit_t{
+	int lock;
+	int tokens;
+	long refilled_ms;       ///< Monotonic ms up to which the tokens were added.
+	unsigned long dropped;  ///< Messages dropped since the last one logged.
+}onion_log_ratelimit;
+
+/// Sets the messages per second, and burst, of each rate limited call site. rate 0 does not limit them.
+void onion_log_set_ratelimit(int rate, int burst);
+/// Takes a token of that call site. Returns 1 if it may log, with the messages dropped before, or 0.
+int onion_log_ratelimit_check(onion_log_ratelimit *rl, unsigned long *dropped);
+
 #ifdef __cplusplus
 }
 #endif
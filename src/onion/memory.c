@@ -0,0 +1,138 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "memory.h"
+
+const char *onion_memory_tag_names[ONION_MEMORY_TAGS]={ "request", "parser", "response", "dict", "session", "poller", "tls", "cache" };
+
+/**
+ * @short Counters of a thread.
+ * 
+ * Only that thread writes them, with plain relaxed stores, so counting is an add at memory no other 
+ * thread writes. An object freed at other thread than the one that allocated it makes the counters of 
+ * each one drift, but not their sum. When a thread ends they are kept, still in the sum, and the next 
+ * new thread goes on with them.
+ */
+typedef struct onion_memory_counters_t{
+	long bytes[ONION_MEMORY_TAGS];
+	int used; ///< By a running thread
+	struct onion_memory_counters_t *next;
+}__attribute__((aligned(64))) onion_memory_counters;
+
+#ifdef HAVE_PTHREADS
+/// All the counters ever used. They are never freed, so they can be summed without locks.
+static onion_memory_counters *onion_memory_all=NULL;
+static __thread onion_memory_counters *onion_memory_thread=NULL;
+static pthread_key_t onion_memory_key;
+static pthread_once_t onion_memory_key_once=PTHREAD_ONCE_INIT;
+
+/// At thread end, leaves the counters for the next thread.
+static void onion_memory_thread_end(void *_counters){
+	onion_memory_counters *counters=_counters;
+	onion_memory_thread=NULL; // If something is freed later at this thread, it takes some again.
+	__atomic_store_n(&counters->used, 0, __ATOMIC_RELEASE);
+}
+
+static void onion_memory_key_init(){
+	pthread_key_create(&onion_memory_key, onion_memory_thread_end);
+}
+
+/// Takes the counters of an ended thread, or new ones, for this thread.
+static onion_memory_counters *onion_memory_thread_counters(){
+	pthread_once(&onion_memory_key_once, onion_memory_key_init);
+	onion_memory_counters *counters;
+	for (counters=__atomic_load_n(&onion_memory_all, __ATOMIC_ACQUIRE);counters;counters=counters->next){
+		int unused=0;
+		if (!__atomic_load_n(&counters->used, __ATOMIC_RELAXED) && 
+		    __atomic_compare_exchange_n(&counters->used, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if (!counters){
+		if (posix_memalign((void**)&counters, 64, sizeof(onion_memory_counters))!=0)
+			return NULL;
+		memset(counters, 0, sizeof(onion_memory_counters));
+		counters->used=1;
+		counters->next=__atomic_load_n(&onion_memory_all, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&onion_memory_all, &counters->next, counters, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+	onion_memory_thread=counters;
+	pthread_setspecific(onion_memory_key, counters);
+	return counters;
+}
+
+/**
+ * @short Counts bytes allocated for that subsystem, or freed if negative.
+ * 
+ * At the counters of this thread, without atomic operations, so it can be at the hot paths.
+ */
+void onion_memory_count(onion_memory_tag tag, long bytes){
+	onion_memory_counters *counters=onion_memory_thread;
+	if (!counters && !(counters=onion_memory_thread_counters()))
+		return;
+	__atomic_store_n(&counters->bytes[tag], counters->bytes[tag]+bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * @short Bytes allocated now for that subsystem, by all the threads.
+ * 
+ * The sum of the counters of all the threads, so it costs some loads per thread; it is exact only 
+ * when no thread is counting.
+ */
+size_t onion_memory_get(onion_memory_tag tag){
+	long sum=0;
+	onion_memory_counters *counters;
+	for (counters=__atomic_load_n(&onion_memory_all, __ATOMIC_ACQUIRE);counters;counters=counters->next)
+		sum+=__atomic_load_n(&counters->bytes[tag], __ATOMIC_RELAXED);
+	return sum>0 ? sum : 0;
+}
+#else
+static onion_memory_counters onion_memory_counters_static;
+
+void onion_memory_count(onion_memory_tag tag, long bytes){
+	onion_memory_counters_static.bytes[tag]+=bytes;
+}
+
+size_t onion_memory_get(onion_memory_tag tag){
+	long sum=onion_memory_counters_static.bytes[tag];
+	return sum>0 ? sum : 0;
+}
+#endif
+
+/// Bytes allocated now for all the subsystems.
+size_t onion_memory_total(){
+	size_t total=0;
+	int i;
+	for (i=0;i<ONION_MEMORY_TAGS;i++)
+		total+=onion_memory_get(i);
+	return total;
+}
@@ -0,0 +1,71 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_MEMORY_H
+#define ONION_MEMORY_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/**
+ * @short Subsystems whose memory is accounted.
+ * 
+ * The library counts the bytes it allocates for each, while they are allocated, also the objects kept at 
+ * the thread pools for reuse. They are the main structures, not every allocation: so the strings of the 
+ * dicts are not counted, and the TLS sessions are an estimate, as GnuTLS allocates them itself.
+ * @see onion_memory_get onion_set_memory_budget
+ */
+enum onion_memory_tag_e{
+	ONION_MEMORY_REQUEST=0, ///< Requests, and their arenas, with the headers.
+	ONION_MEMORY_PARSER,    ///< Tokens of the request parser.
+	ONION_MEMORY_RESPONSE,  ///< Responses, and their buffers.
+	ONION_MEMORY_DICT,      ///< Dicts, with their nodes and hash tables, as the headers or the session data.
+	ONION_MEMORY_SESSION,   ///< Entries of the in memory session store. Their data are dicts.
+	ONION_MEMORY_POLLER,    ///< Poller slots, one per connection or timer.
+	ONION_MEMORY_TLS,       ///< TLS sessions, estimated.
+	ONION_MEMORY_CACHE,     ///< Contents of files at the file caches, and fragments at the fragment cache.
+	ONION_MEMORY_TAGS,      ///< Number of tags, not a tag.
+};
+
+typedef enum onion_memory_tag_e onion_memory_tag;
+
+/// Names of the tags, as request or tls, for the metrics.
+extern const char *onion_memory_tag_names[ONION_MEMORY_TAGS];
+
+/// Counts bytes allocated for that subsystem, or freed if negative.
+void onion_memory_count(onion_memory_tag tag, long bytes);
+/// Bytes allocated now for that subsystem, by all the threads.
+size_t onion_memory_get(onion_memory_tag tag);
+/// Bytes allocated now for all the subsystems.
+size_t onion_memory_total();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
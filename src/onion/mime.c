@@ -26,46 +26,78 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
 
 #include "types.h"
 #include "mime.h"
 #include "dict.h"
 #include "log.h"
+#include "mime_hash.h"
+#include "mime_table.h" // Generated at build time from mime_builtin.types
 #include <ctype.h>
 
-/// Dict with all extension to mime type. This will never be freed.
+/**
+ * @short Dict with the extension to mime type set by the user, on top of all the others, or NULL.
+ * 
+ * Changed by onion_mime_update, or set with onion_mime_set.
+ */
 static onion_dict *onion_mime_dict=NULL;
+/**
+ * @short Frozen dict with the types read by onion_mime_load, on top of the built in table, or NULL.
+ * 
+ * The built in table needs nothing at startup, so the first static file does not pay for parsing 
+ * /etc/mime.types, as it did before; it is read only if asked for.
+ */
+static onion_dict *onion_mime_file=NULL;
+/// Whether the built in table is used, under the dict. Not if the user set a dict of its own.
+static int onion_mime_builtin_enabled=1;
+
+/// Looks for the extension at the built in table, in any case. Two hashes and one compare.
+static const char *onion_mime_builtin_get(const char *extension){
+	uint32_t bucket=onion_mime_hash(extension, 0)%ONION_MIME_BUILTIN_BUCKETS;
+	const onion_mime_builtin_entry *entry=
+		&onion_mime_builtin[onion_mime_hash(extension, onion_mime_builtin_seeds[bucket])%ONION_MIME_BUILTIN_SLOTS];
+	if (entry->extension && strcasecmp(entry->extension, extension)==0)
+		return entry->mimetype;
+	return NULL;
+}
 
-static void onion_mime_fill();
+/// Copies a pair to the new dict of onion_mime_load.
+static void onion_mime_copy(onion_dict *dict, const char *key, const void *value, int flags){
+	onion_dict_add(dict, key, value, OD_DUP_ALL);
+}
 
 /**
  * @short Sets a user set dict as mime dict
  * 
- * This dict maps "extension" -> "mimetype".
+ * This dict maps "extension" -> "mimetype", and it is the only one used, without the built in 
+ * types nor the loaded ones. With NULL it goes back to the built in types only.
  * 
  * At onion_server_free it is freed, as if this function is called again.
  */
 void onion_mime_set(onion_dict *d){
 	if (onion_mime_dict)
 		onion_dict_free(onion_mime_dict);
+	if (onion_mime_file){
+		onion_dict_free(onion_mime_file);
+		onion_mime_file=NULL;
+	}
 	onion_mime_dict=d;
+	onion_mime_builtin_enabled=(d==NULL);
 }
 
 
 /**
  * @short Given a filename or extensiton, it returns the proper mime type.
  * 
- * If onion_mime_set was called before, it is used, else it reads mime types /etc/mime.types.
- * 
- * Full mime catalog, from /etc/mime.types, takes about 36kb on ubuntu 10.10, may depend on
- * how many mime types are known.
+ * Looks at the types set with onion_mime_load, onion_mime_update or onion_mime_set, and then at the 
+ * built in table of the common types, generated at build time as a perfect hash. Extensions are 
+ * case insensitive. No file is read.
  * 
  * If none is found, returns text/plain.
  */
 const char *onion_mime_get(const char *filename){
-	if (!onion_mime_dict)
-		onion_mime_fill();
-	
 	const char *extension=filename;
 	int l=strlen(filename);
 	int i;
@@ -76,9 +108,13 @@ const char *onion_mime_get(const char *filename){
 		}
 	}
 	
-	//ONION_DEBUG("I know %d mime types", onion_dict_count(onion_mime_dict));
-	
-	const char *r=onion_dict_get(onion_mime_dict, extension);
+	const char *r=NULL;
+	if (onion_mime_dict)
+		r=onion_dict_get(onion_mime_dict, extension);
+	if (!r && onion_mime_file)
+		r=onion_dict_get(onion_mime_file, extension);
+	if (!r && onion_mime_builtin_enabled)
+		r=onion_mime_builtin_get(extension);
 	if (r)
 		return r;
 	//ONION_DEBUG("Mime type for extension '%s' %s",extension, r);
@@ -86,28 +122,29 @@ const char *onion_mime_get(const char *filename){
 }
 
 /**
- * @short Reads the /etc/mime.types file
+ * @short Loads the types at a mime.types file on top of the built in ones.
  * 
+ * As /etc/mime.types, for the types that are not built in, or to change them. NULL is 
+ * /etc/mime.types. They are kept at a frozen dict, with the ones of the files loaded before, so it 
+ * should be done at startup, before serving.
  * 
+ * @returns The number of extensions read, or -1 if the file could not be read.
  */
-static void onion_mime_fill(){
-	onion_mime_set(NULL);
-	onion_mime_dict=onion_dict_new();
-	//ONION_DEBUG("Filling mime types");
-	
-	FILE *fd=fopen("/etc/mime.types", "rt");
+int onion_mime_load(const char *filename){
+	if (!filename)
+		filename="/etc/mime.types";
+	FILE *fd=fopen(filename, "rt");
 	if (!fd){
-		ONION_WARNING("Could not read MIME types (etc/mime.types), returned mime types may be incorrect. Adding minimal set.");
-		onion_dict_add(onion_mime_dict, "html", "text/html",0);
-		onion_dict_add(onion_mime_dict, "htm", "text/html",0);
-		onion_dict_add(onion_mime_dict, "js", "application/javascript",0);
-		onion_dict_add(onion_mime_dict, "css", "text/css",0);
-		onion_dict_add(onion_mime_dict, "png", "image/png",0);
-		onion_dict_add(onion_mime_dict, "jpg", "image/jpeg",0);
-		return;
+		ONION_WARNING("Could not read MIME types at %s, using the built in ones.", filename);
+		return -1;
 	}
+	onion_dict *dict=onion_dict_new();
+	onion_dict_set_flags(dict, OD_ICASE);
+	if (onion_mime_file)
+		onion_dict_preorder(onion_mime_file, onion_mime_copy, dict);
+	int count=0;
 	char mimetype[128];
-	char extension[8];
+	char extension[16];
 	int mode=0; // 0 mimetype, 1 extension
 	int i=0;
 	int c;
@@ -119,8 +156,8 @@ static void onion_mime_fill(){
 		if (c=='\n'){
 			if (mode==1 && i!=0){
 				extension[i]=0;
-				onion_dict_add(onion_mime_dict, extension, mimetype, OD_DUP_ALL);
-				//ONION_DEBUG("Add mimetype '%s' (%s).", extension, mimetype);
+				onion_dict_add(dict, extension, mimetype, OD_DUP_ALL|OD_REPLACE);
+				count++;
 			}
 			mode=0;
 			i=0;
@@ -135,8 +172,8 @@ static void onion_mime_fill(){
 				else if (i!=0){
 					extension[i]='\0';
 					i=0;
-					onion_dict_add(onion_mime_dict, extension, mimetype, OD_DUP_ALL);
-					//ONION_DEBUG("Add mimetype '%s' (%s)", extension, mimetype);
+					onion_dict_add(dict, extension, mimetype, OD_DUP_ALL|OD_REPLACE);
+				count++;
 				}
 			}
 			else{
@@ -148,13 +185,10 @@ static void onion_mime_fill(){
 						mimetype[i++]=c;
 				}
 				else{
-					if (i>=sizeof(extension)-1){
+					if (i>=sizeof(extension)-1){ // Too long, no extension is so long
 						while ( (c=getc(fd)) >= 0 && c!='\n');
-						extension[i]='\0';
 						i=0;
 						mode=0;
-						onion_dict_add(onion_mime_dict, extension, mimetype,  OD_DUP_ALL);
-						//ONION_DEBUG("Add mimetype '%s' (%s)..", extension, mimetype);
 					}
 					else
 						extension[i++]=c;
@@ -164,20 +198,29 @@ static void onion_mime_fill(){
 	}
 	fclose(fd);
 	
-	ONION_DEBUG("I know %d mime types", onion_dict_count(onion_mime_dict));
+	onion_dict_freeze(dict); // Read at each static file by all the threads, with no locks
+	if (onion_mime_file)
+		onion_dict_free(onion_mime_file);
+	onion_mime_file=dict;
+	ONION_DEBUG("Read %d mime types from %s", count, filename);
+	return count;
 }
 
 /**
  * @short Allow to update mime types.
  * 
- * User can add new mime types, or remove.
+ * User can add new mime types, or remove. Removing a built in one makes it text/plain.
  */
 void onion_mime_update(const char *extension, const char *mimetype){
-	if (!onion_mime_dict)
-		onion_mime_fill();
-	
+	if (!onion_mime_dict){
+		onion_mime_dict=onion_dict_new();
+		onion_dict_set_flags(onion_mime_dict, OD_ICASE|OD_RCU); // Read at each static file, by all the threads
+	}
 	if (mimetype)
-		onion_dict_add(onion_mime_dict, extension, mimetype,  OD_DUP_ALL);
+		onion_dict_add(onion_mime_dict, extension, mimetype,  OD_DUP_ALL|OD_REPLACE);
+	else if ((onion_mime_file && onion_dict_get(onion_mime_file, extension)) || 
+	         (onion_mime_builtin_enabled && onion_mime_builtin_get(extension)))
+		onion_dict_add(onion_mime_dict, extension, "text/plain",  OD_DUP_ALL|OD_REPLACE); // Hides the other
 	else
 		onion_dict_remove(onion_mime_dict, extension);
 }
@@ -38,6 +38,8 @@ void onion_mime_set(onion_dict *);
 const char *onion_mime_get(const char *filename);
 /// Updates a mime record, for that extensions set that mimetype. If mimetype==NULL, removes it.
 void onion_mime_update(const char *extension, const char *mimetype);
+/// Loads the types of a mime.types file on top of the built in ones. NULL is /etc/mime.types.
+int onion_mime_load(const char *filename);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,182 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+/**
+ * @short Generates the built in MIME table, a perfect hash, from a mime.types file. Run at build time.
+ * 
+ * The table is hash and displace: each extension goes to a bucket by its hash with seed 0, and each
+ * bucket has the seed that sends all its extensions to free slots. So a lookup is two hashes and one
+ * compare, and there is nothing to do at startup.
+ * 
+ * Usage: mime_gen mime_builtin.types mime_table.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "mime_hash.h"
+
+#define MAX_TYPES 1024
+
+typedef struct{
+	char extension[32];
+	char mimetype[128];
+	uint32_t bucket;
+}mime_gen_type;
+
+static mime_gen_type types[MAX_TYPES];
+static int ntypes=0;
+
+/// Adds an extension, lower case, if not there yet.
+static void mime_gen_add(const char *extension, const char *mimetype){
+	char lower[32];
+	int i;
+	for (i=0;extension[i] && i<sizeof(lower)-1;i++)
+		lower[i]=tolower((unsigned char)extension[i]);
+	lower[i]='\0';
+	for (i=0;i<ntypes;i++){
+		if (strcmp(types[i].extension, lower)==0){
+			fprintf(stderr, "mime_gen: %s is already %s, not %s\n", lower, types[i].mimetype, mimetype);
+			return;
+		}
+	}
+	if (ntypes>=MAX_TYPES){
+		fprintf(stderr, "mime_gen: too many types\n");
+		exit(1);
+	}
+	strcpy(types[ntypes].extension, lower);
+	snprintf(types[ntypes].mimetype, sizeof(types[ntypes].mimetype), "%s", mimetype);
+	ntypes++;
+}
+
+/// Buckets by their number of extensions, biggest first.
+static int *mime_gen_bucket_size;
+static int mime_gen_bucket_cmp(const void *a, const void *b){
+	return mime_gen_bucket_size[*(const int*)b]-mime_gen_bucket_size[*(const int*)a];
+}
+
+int main(int argc, char **argv){
+	if (argc!=3){
+		fprintf(stderr, "Usage: %s mime_builtin.types mime_table.h\n", argv[0]);
+		return 1;
+	}
+	FILE *in=fopen(argv[1], "rt");
+	if (!in){
+		perror(argv[1]);
+		return 1;
+	}
+	char line[512];
+	while (fgets(line, sizeof(line), in)){
+		char *hash=strchr(line, '#');
+		if (hash)
+			*hash='\0';
+		char *save=NULL;
+		char *mimetype=strtok_r(line, " \t\r\n", &save);
+		if (!mimetype)
+			continue;
+		char *extension;
+		while ( (extension=strtok_r(NULL, " \t\r\n", &save)) )
+			mime_gen_add(extension, mimetype);
+	}
+	fclose(in);
+
+	int nbuckets=ntypes/2+1;
+	int nslots=ntypes+ntypes/4+1;
+	int *seeds=calloc(nbuckets, sizeof(int));
+	int *slots=malloc(nslots*sizeof(int));
+	int *order=malloc(nbuckets*sizeof(int));
+	mime_gen_bucket_size=calloc(nbuckets, sizeof(int));
+	int i, j;
+	for (i=0;i<nslots;i++)
+		slots[i]=-1;
+	for (i=0;i<ntypes;i++){
+		types[i].bucket=onion_mime_hash(types[i].extension, 0)%nbuckets;
+		mime_gen_bucket_size[types[i].bucket]++;
+	}
+	for (i=0;i<nbuckets;i++)
+		order[i]=i;
+	qsort(order, nbuckets, sizeof(int), mime_gen_bucket_cmp);
+
+	for (i=0;i<nbuckets && mime_gen_bucket_size[order[i]];i++){
+		int bucket=order[i];
+		int seed;
+		for (seed=1;seed<65536;seed++){ // Tries seeds until all the extensions of the bucket go to free, different, slots
+			int ok=1;
+			for (j=0;j<ntypes && ok;j++){
+				if (types[j].bucket!=bucket)
+					continue;
+				int slot=onion_mime_hash(types[j].extension, seed)%nslots;
+				if (slots[slot]!=-1)
+					ok=0;
+				else
+					slots[slot]=j;
+			}
+			if (ok)
+				break;
+			for (j=0;j<nslots;j++) // Undo this try
+				if (slots[j]>=0 && types[slots[j]].bucket==bucket)
+					slots[j]=-1;
+		}
+		if (seed==65536){
+			fprintf(stderr, "mime_gen: no seed found for bucket %d\n", bucket);
+			return 1;
+		}
+		seeds[bucket]=seed;
+	}
+
+	FILE *out=fopen(argv[2], "wt");
+	if (!out){
+		perror(argv[2]);
+		return 1;
+	}
+	const char *name=strrchr(argv[1], '/');
+	fprintf(out, "/* Generated by mime_gen from %s. Do not edit. */\n\n", name ? name+1 : argv[1]);
+	fprintf(out, "#define ONION_MIME_BUILTIN_COUNT %d\n", ntypes);
+	fprintf(out, "#define ONION_MIME_BUILTIN_BUCKETS %d\n", nbuckets);
+	fprintf(out, "#define ONION_MIME_BUILTIN_SLOTS %d\n\n", nslots);
+	fprintf(out, "static const uint16_t onion_mime_builtin_seeds[ONION_MIME_BUILTIN_BUCKETS]={");
+	for (i=0;i<nbuckets;i++)
+		fprintf(out, "%s%d", i==0 ? "\n\t" : (i%16) ? ", " : ",\n\t", seeds[i]);
+	fprintf(out, "\n};\n\n");
+	fprintf(out, "static const onion_mime_builtin_entry onion_mime_builtin[ONION_MIME_BUILTIN_SLOTS]={\n");
+	for (i=0;i<nslots;i++){
+		if (slots[i]<0)
+			fprintf(out, "\t{ NULL, NULL },\n");
+		else
+			fprintf(out, "\t{ \"%s\", \"%s\" },\n", types[slots[i]].extension, types[slots[i]].mimetype);
+	}
+	fprintf(out, "};\n");
+	if (fclose(out)!=0){
+		perror(argv[2]);
+		return 1;
+	}
+	free(seeds);
+	free(slots);
+	free(order);
+	free(mime_gen_bucket_size);
+	return 0;
+}
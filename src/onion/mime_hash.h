@@ -0,0 +1,56 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_MIME_HASH_H
+#define ONION_MIME_HASH_H
+
+#include <stdint.h>
+
+/**
+ * @short Internal: the hash of the built in MIME table, shared by mime.c and its generator mime_gen.c.
+ * 
+ * ASCII case insensitive, so the extensions are found in any case.
+ */
+static inline uint32_t onion_mime_hash(const char *extension, uint32_t seed){
+	uint32_t h=2166136261u^(seed*0x9E3779B9u);
+	for (;*extension;extension++){
+		unsigned char c=*extension;
+		if (c>='A' && c<='Z')
+			c+='a'-'A';
+		h=(h^c)*16777619u;
+	}
+	h^=h>>15;
+	h*=0x2c1b3c6du;
+	h^=h>>12;
+	return h;
+}
+
+/// Entry of the built in MIME table. Empty slots have NULL extension.
+typedef struct{
+	const char *extension;
+	const char *mimetype;
+}onion_mime_builtin_entry;
+
+#endif
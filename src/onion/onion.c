@@ -122,11 +122,24 @@
  * 
  */
 
+#define _GNU_SOURCE             /* sched_setaffinity */
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#include <linux/filter.h>
+#endif
 
 //#define HAVE_PTHREADS
 #ifdef HAVE_PTHREADS
@@ -141,10 +154,27 @@
 #include "listen_point.h"
 #include "sessions.h"
 #include "mime.h"
+#include "dict.h"
 #include "http.h"
 #include "https.h"
+#include "pool.h"
+#include "file_cache.h"
+#include "access_log.h"
+#include "traffic_record.h"
+#include "stats.h"
+#include "admission.h"
+#ifdef HAVE_PTHREADS
+#include "workers.h"
+#include "steal.h"
+#endif
+#ifdef HAVE_SYSTEMD
+#include "sd-daemon.h"
+#endif
 
 static int onion_default_error(void *handler, onion_request *req, onion_response *res);
+static void onion_vhost_free_handler(void *_, const char *host, const void *handler, int flags);
+static void onion_listen_spares_free(onion *o);
+static void onion_freeze_handlers(onion *o);
 // Import it here as I need it to know if we have a HTTP port.
 ssize_t onion_http_write(onion_request *req, const char *data, size_t len);
 #ifdef HAVE_GNUTLS
@@ -190,15 +220,21 @@ onion *onion_new(int flags){
 	}
 	o->flags=(flags&0x0FF)|O_SSL_AVAILABLE;
 	o->timeout=5000; // 5 seconds of timeout, default.
+	o->idle_compact_ms=1000;
+	o->accept_budget=1;
 	o->poller=onion_poller_new(15);
 	if (!o->poller){
 		free(o);
 		return NULL;
 	}
-	o->sessions=onion_sessions_new();
+	o->sessions_timer_fd=-1; // The sessions are created at their first use. @see onion_get_sessions
+	o->stats=onion_stats_shards_new();
+	o->process_index=-1;
+	o->hot_restart_fd=-1;
 	o->internal_error_handler=onion_handler_new((onion_handler_handler)onion_default_error, NULL, NULL);
 	o->max_post_size=1024*1024; // 1MB
 	o->max_file_size=1024*1024*1024; // 1GB
+	o->response_buffer_size=ONION_RESPONSE_BUFFER_SIZE;
 #ifdef HAVE_PTHREADS
 	o->flags|=O_THREADS_AVALIABLE;
 	o->nthreads=8;
@@ -217,11 +253,21 @@ void onion_free(onion *onion){
 	ONION_DEBUG("Onion free");
 	onion_listen_stop(onion);
 	
+	// The handlers before the poller, so the threads of their own, as the auth_pam workers, finish their 
+	// jobs, that resume the suspended requests at the poller, while it is still there.
+	if (onion->root_handler)
+		onion_handler_free(onion->root_handler);
+	if (onion->vhosts){
+		onion_dict_preorder(onion->vhosts, onion_vhost_free_handler, NULL);
+		onion_dict_free(onion->vhosts);
+	}
 	if (onion->poller)
 		onion_poller_free(onion->poller);
 	
 	if (onion->username)
 		free(onion->username);
+	if (onion->spool_dir)
+		free(onion->spool_dir);
 	
 	if (onion->listen_points){
 		onion_listen_point **p=onion->listen_points;
@@ -231,19 +277,879 @@ void onion_free(onion *onion){
 		}
 		free(onion->listen_points);
 	}
-	if (onion->root_handler)
-		onion_handler_free(onion->root_handler);
 	if (onion->internal_error_handler)
 		onion_handler_free(onion->internal_error_handler);
+	onion_handler_table_free(onion->handler_table);
 	onion_mime_set(NULL);
 	if (onion->sessions)
 		onion_sessions_free(onion->sessions);
+	if (onion->file_cache)
+		onion_file_cache_free(onion->file_cache);
+	if (onion->access_log)
+		onion_access_log_free(onion->access_log);
+	if (onion->traffic_record)
+		onion_traffic_record_free(onion->traffic_record);
+	onion_stats_shards_free(onion->stats);
+	onion_admission_free(onion->admission);
+	if (onion->process_pids)
+		free(onion->process_pids);
+	if (onion->processes_cpus)
+		free(onion->processes_cpus);
+	if (onion->hot_restart_path)
+		free(onion->hot_restart_path);
+	onion_listen_spares_free(onion);
 	
 #ifdef HAVE_PTHREADS
 	if (onion->threads)
 		free(onion->threads);
+	if (onion->workers_cpus)
+		free(onion->workers_cpus);
+	if (onion->threads_cpus)
+		free(onion->threads_cpus);
 #endif
 	free(onion);
+	onion_pool_clear(); // The other threads already ended, freeing theirs.
+}
+
+/// A new poller, with the settings of the server pollers.
+static onion_poller *onion_listen_poller_new(onion *o){
+	onion_poller *poller=onion_poller_new(15);
+	if (o->poller_max_events)
+		onion_poller_set_max_events(poller, o->poller_max_events, o->poller_max_events_limit);
+	if (o->poller_profiling)
+		onion_poller_set_profiling(poller, o->poller_stall_ms);
+	return poller;
+}
+
+/// The poller accepts for the listen points that accept as plain sockets, if it can. @see onion_listen_point_accepted
+static void onion_listen_slot_set_accept(onion_poller_slot *slot, onion_listen_point *lp){
+	if (!lp->request_init)
+		onion_poller_slot_set_accept(slot, (void*)onion_listen_point_accepted);
+}
+
+/**
+ * @short Takes a spare socket of that listen point, if any is left.
+ * @memberof onion_t
+ * @returns The socket, or -1.
+ */
+static int onion_spare_fd_take(onion *o, onion_listen_point *lp){
+	int i;
+	for (i=0;i<o->nspare_fds;i++){
+		if (o->spare_fds[i].lp==lp && o->spare_fds[i].fd>=0){
+			int fd=o->spare_fds[i].fd;
+			o->spare_fds[i].fd=-1;
+			return fd;
+		}
+	}
+	return -1;
+}
+
+/// Closes the spare sockets not used, and forgets them.
+static void onion_spare_fds_free(onion *o){
+	int i;
+	for (i=0;i<o->nspare_fds;i++){
+		if (o->spare_fds[i].fd>=0)
+			close(o->spare_fds[i].fd);
+	}
+	free(o->spare_fds);
+	o->spare_fds=NULL;
+	o->nspare_fds=0;
+}
+
+/**
+ * @short Listens at the spare sockets left, at the main poller, each with a copy of its listen point.
+ * @memberof onion_t
+ * 
+ * Sockets of the same address as with ReusePort= get their share of the connections from the kernel,
+ * so all must be accepted from.
+ */
+static void onion_listen_spares(onion *o){
+	int i, n=0;
+	if (!o->nspare_fds)
+		return;
+	o->spare_listen_points=calloc(o->nspare_fds+1, sizeof(onion_listen_point*));
+	for (i=0;i<o->nspare_fds;i++){
+		int fd=onion_spare_fd_take(o, o->spare_fds[i].lp);
+		if (fd<0)
+			continue;
+		onion_listen_point *dup=onion_listen_point_dup(o->spare_fds[i].lp, NULL);
+		onion_listen_point_listen_fd(dup, fd);
+		onion_listen_point_set_nonblocking(dup);
+		o->spare_listen_points[n++]=dup;
+		onion_poller_slot *slot=onion_poller_slot_new(fd, (void*)onion_listen_point_accept, dup);
+		onion_poller_slot_set_type(slot, o->process_index>=0 ? O_POLL_READ|O_POLL_EXCLUSIVE : O_POLL_ALL);
+		onion_listen_slot_set_accept(slot, dup);
+		onion_poller_add(o->poller, slot);
+	}
+	ONION_DEBUG("Listening at %d spare sockets", n);
+}
+
+/// Stops listening at the spare sockets.
+static void onion_listen_spares_remove(onion *o){
+	onion_listen_point **lp;
+	for (lp=o->spare_listen_points;lp && *lp;lp++){
+		if ((*lp)->listenfd>=0)
+			onion_poller_remove(o->poller, (*lp)->listenfd);
+	}
+}
+
+/**
+ * @short Frees the listen points of the spare sockets.
+ * 
+ * Not when onion_listen ends, as onion_listen_stop may be stopping them at another thread, but at the
+ * next listen, or at onion_free.
+ */
+static void onion_listen_spares_free(onion *o){
+	onion_listen_point **lp;
+	for (lp=o->spare_listen_points;lp && *lp;lp++)
+		onion_listen_point_free(*lp);
+	free(o->spare_listen_points);
+	o->spare_listen_points=NULL;
+	onion_spare_fds_free(o);
+}
+
+#ifdef HAVE_SYSTEMD
+/// If the systemd name of a socket, from FileDescriptorName=, is for that listen point: its port, or http or https.
+static int onion_systemd_name_is(const char *name, onion_listen_point *lp){
+	if (strcmp(name, lp->port ? lp->port : "8080")==0)
+		return 1;
+	if (strcmp(name, "http")==0)
+		return lp->write==onion_http_write;
+#ifdef HAVE_GNUTLS
+	if (strcmp(name, "https")==0)
+		return lp->write==onion_https_write;
+#endif
+	return 0;
+}
+
+/// If the socket is bound to the port of that listen point.
+static int onion_systemd_address_is(int fd, onion_listen_point *lp){
+	struct sockaddr_storage addr;
+	socklen_t len=sizeof(addr);
+	char port[NI_MAXSERV];
+	if (getsockname(fd, (struct sockaddr*)&addr, &len)<0 || 
+	    getnameinfo((struct sockaddr*)&addr, len, NULL, 0, port, sizeof(port), NI_NUMERICSERV)!=0)
+		return 0;
+	return strcmp(port, lp->port ? lp->port : "8080")==0;
+}
+
+/**
+ * @short Gives the socket to the first listen point that matches by name and or address.
+ * 
+ * If all that match already have a socket, it is a spare of the first.
+ * 
+ * @returns 1 if given, 0 if none matches.
+ */
+static int onion_systemd_give(onion *o, int *fds, int fd, const char *name, int by_address){
+	int i, first=-1;
+	for (i=0;o->listen_points[i];i++){
+		onion_listen_point *lp=o->listen_points[i];
+		if (lp->listen || (name && !onion_systemd_name_is(name, lp)) || (by_address && !onion_systemd_address_is(fd, lp)))
+			continue;
+		if (fds[i]<0){
+			fds[i]=fd;
+			return 1;
+		}
+		if (first<0)
+			first=i;
+	}
+	if (first<0)
+		return 0;
+	o->spare_fds=realloc(o->spare_fds, sizeof(struct onion_spare_fd_t)*(o->nspare_fds+1));
+	o->spare_fds[o->nspare_fds].lp=o->listen_points[first];
+	o->spare_fds[o->nspare_fds].fd=fd;
+	o->nspare_fds++;
+	return 1;
+}
+
+/**
+ * @short Takes the sockets passed by systemd socket activation for the listen points.
+ * @memberof onion_t
+ * 
+ * Each one of LISTEN_FDS goes to the listen point of its name at LISTEN_FDNAMES, as set with 
+ * FileDescriptorName=, that may be the listen point port, or http or https for its protocol; else to 
+ * the one of the port it is bound to; and else to the first socket listen point without one. So a
+ * single unit can pass both the HTTP and HTTPS sockets.
+ * 
+ * More sockets for a listen point than the first, as one per CPU with ReusePort=, are used by the
+ * threads of O_REUSEPORT, and the rest are listened at the main poller too.
+ * 
+ * @param fds Where to leave the socket of each listen point. Those already set are not changed.
+ */
+static void onion_systemd_take(onion *o, int *fds){
+	int n=sd_listen_fds(0);
+	ONION_DEBUG("Checking if have systemd sockets: %d", n);
+	if (n<=0)
+		return;
+	
+	char **names=calloc(n, sizeof(char*));
+	char *fdnames=getenv("LISTEN_FDNAMES") ? strdup(getenv("LISTEN_FDNAMES")) : NULL;
+	int i, nnames=0;
+	char *saveptr=NULL, *name;
+	for (name=fdnames ? strtok_r(fdnames, ":", &saveptr) : NULL;name && nnames<n;name=strtok_r(NULL, ":", &saveptr))
+		names[nnames++]=name;
+	if (nnames!=n){
+		if (fdnames)
+			ONION_WARNING("LISTEN_FDNAMES has %d names for %d sockets, ignoring them", nnames, n);
+		memset(names, 0, sizeof(char*)*n);
+	}
+	
+	char *given=calloc(n, 1);
+	for (i=0;i<n;i++){
+		if (sd_is_socket(SD_LISTEN_FDS_START+i, AF_UNSPEC, SOCK_STREAM, 1)<=0){
+			ONION_WARNING("Systemd passed fd %d is not a listening stream socket, not used", SD_LISTEN_FDS_START+i);
+			given[i]=1;
+		}
+	}
+	int pass;
+	for (pass=0;pass<3;pass++){ // By name and address, by name, and by address
+		for (i=0;i<n;i++){
+			if (given[i] || (pass<2 && !names[i]))
+				continue;
+			given[i]=onion_systemd_give(o, fds, SD_LISTEN_FDS_START+i, pass<2 ? names[i] : NULL, pass!=1);
+		}
+	}
+	for (i=0;i<n;i++){
+		if (given[i])
+			continue;
+		int j;
+		for (j=0;o->listen_points[j] && (o->listen_points[j]->listen || fds[j]>=0);j++);
+		if (o->listen_points[j])
+			fds[j]=SD_LISTEN_FDS_START+i;
+		else
+			ONION_WARNING("Systemd socket %d (%s) is for no listen point, not used", SD_LISTEN_FDS_START+i, names[i] ? names[i] : "no name");
+	}
+	ONION_DEBUG("Using %d systemd sockets, %d of them spare", n, o->nspare_fds);
+	free(given);
+	free(names);
+	free(fdnames);
+}
+#endif
+
+#ifdef HAVE_PTHREADS
+/// CPU of the poller thread of that index; 0 is the one that calls onion_listen.
+static int onion_thread_cpu(onion *o, int index){
+	return o->threads_cpus[index%o->nthreads_cpus];
+}
+
+/// Tells the kernel which CPU serves this listen socket, to prefer it for the connections that CPU gets.
+static void onion_listen_socket_cpu(int fd, int cpu){
+#ifdef SO_INCOMING_CPU
+	setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+#endif
+}
+
+/// Pins the poller thread of that index to its CPU, if set.
+static void onion_thread_attr_cpu(onion *o, pthread_attr_t *attr, int index){
+	if (!o->threads_cpus)
+		return;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(onion_thread_cpu(o, index), &set);
+	pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+#endif
+}
+
+/**
+ * @short Sends the new connections of this listen point to the thread pinned to the CPU that got them.
+ * @memberof onion_t
+ * 
+ * The sockets of the reuseport group are the one of the main thread and then the one of each extra 
+ * thread, so a classic BPF program returns the index of the thread of the current CPU. Connections at
+ * other CPUs are balanced as usual. SO_INCOMING_CPU tells the same to the kernels without the program.
+ */
+static void onion_listen_reuseport_steer(onion *o, onion_listen_point *op){
+#ifdef __linux__
+	onion_listen_socket_cpu(op->listenfd, onion_thread_cpu(o, 0));
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	int i, nthreads=o->nthreads;
+	struct sock_filter *code=malloc(sizeof(struct sock_filter)*(2*nthreads+2));
+	code[0]=(struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF+SKF_AD_CPU);
+	for (i=0;i<nthreads;i++){
+		code[1+2*i]=(struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, onion_thread_cpu(o, i), 0, 1);
+		code[2+2*i]=(struct sock_filter)BPF_STMT(BPF_RET|BPF_K, i);
+	}
+	code[1+2*nthreads]=(struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0xffffffff); // Out of the group, so balanced as usual
+	struct sock_fprog prog={ 2*nthreads+2, code };
+	if (setsockopt(op->listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog))<0)
+		ONION_WARNING("Could not steer the connections to the thread of their CPU: %s", strerror(errno));
+	free(code);
+#endif
+#endif
+}
+
+/// A copy of a listen point at port 0 binds to the port the kernel gave to it, so it joins its reuseport group.
+static void onion_listen_reuseport_bound_port(onion_listen_point *dup, onion_listen_point *op){
+	if (!op->port || strcmp(op->port, "0")!=0)
+		return;
+	struct sockaddr_storage addr;
+	socklen_t len=sizeof(addr);
+	if (getsockname(op->listenfd, (struct sockaddr*)&addr, &len)<0 || (addr.ss_family!=AF_INET && addr.ss_family!=AF_INET6))
+		return;
+	char port[8];
+	snprintf(port, sizeof(port), "%d", ntohs(addr.ss_family==AF_INET6 ? ((struct sockaddr_in6*)&addr)->sin6_port : 
+	                                                                   ((struct sockaddr_in*)&addr)->sin_port));
+	free(dup->port);
+	dup->port=strdup(port);
+}
+
+/**
+ * @short Creates the private poller and listen sockets of each extra thread for O_REUSEPORT mode.
+ * @memberof onion_t
+ * 
+ * Each extra thread gets a copy of every socket listen point, with its own SO_REUSEPORT socket 
+ * bound to the same address, so the kernel balances the new connections among them. It is one of the
+ * spare systemd passed sockets of that address, if there are. Sockets that can not be bound again are
+ * shared by all the pollers, as O_POLL_EXCLUSIVE so that each connection wakes only one. Custom listen
+ * points stay only at the main thread poller.
+ */
+static void onion_listen_reuseport_prepare(onion *o){
+	int nlisten_points=0;
+	onion_listen_point **lp=o->listen_points;
+	while (*lp++) nlisten_points++;
+	
+	o->thread_pollers=calloc(o->nthreads, sizeof(onion_poller*));
+	o->thread_listen_points=calloc((o->nthreads-1)*nlisten_points+1, sizeof(onion_listen_point*));
+	int nthread_listen_points=0;
+	int i;
+	char *steerable=calloc(nlisten_points, 1); // All the threads have their own socket of it, in order.
+	for (i=0;i<nlisten_points;i++)
+		steerable[i]=o->threads_steer && o->threads_cpus;
+	for (i=0;i<o->nthreads-1;i++){
+		onion_poller *poller=onion_listen_poller_new(o);
+		o->thread_pollers[i]=poller;
+		for (lp=o->listen_points;*lp;lp++){
+			if ((*lp)->listen || (*lp)->listenfd<0){ // Not from socket, or not listening.
+				steerable[lp-o->listen_points]=0;
+				continue;
+			}
+			onion_listen_point *dup=onion_listen_point_dup(*lp, poller);
+			onion_listen_reuseport_bound_port(dup, *lp);
+			int type=O_POLL_ALL;
+			int spare=onion_spare_fd_take(o, *lp);
+			if (spare>=0){
+				onion_listen_point_listen_fd(dup, spare);
+				steerable[lp-o->listen_points]=0; // At the reuseport group in some other order
+			}
+			if (spare<0 && onion_listen_point_listen(dup)!=0){
+				ONION_DEBUG("Could not create a private listen socket for %s:%s at thread %d, sharing it", (*lp)->hostname, (*lp)->port, i+1);
+				onion_listen_point_free(dup);
+				dup=onion_listen_point_dup_shared(*lp, poller);
+				type=O_POLL_READ|O_POLL_EXCLUSIVE; // Several pollers on the same socket, only one should wake.
+				steerable[lp-o->listen_points]=0;
+			}
+			else{
+				onion_listen_point_set_nonblocking(dup);
+				if (steerable[lp-o->listen_points])
+					onion_listen_socket_cpu(dup->listenfd, onion_thread_cpu(o, i+1));
+			}
+			o->thread_listen_points[nthread_listen_points++]=dup;
+			onion_poller_slot *slot=onion_poller_slot_new(dup->listenfd, (void*)onion_listen_point_accept, dup);
+			onion_poller_slot_set_type(slot, type);
+			onion_listen_slot_set_accept(slot, dup);
+			onion_poller_add(poller, slot);
+		}
+	}
+	ONION_DEBUG("Using %d private pollers, with %d listen sockets", o->nthreads-1, nthread_listen_points);
+	for (i=0;i<nlisten_points;i++)
+		if (steerable[i])
+			onion_listen_reuseport_steer(o, o->listen_points[i]);
+	free(steerable);
+}
+
+/**
+ * @short Frees the private pollers of O_REUSEPORT mode, with its pending connections and listen points.
+ * @memberof onion_t
+ */
+static void onion_listen_reuseport_free(onion *o){
+	onion_poller **poller=o->thread_pollers;
+	while (*poller)
+		onion_poller_free(*poller++);
+	free(o->thread_pollers);
+	o->thread_pollers=NULL;
+	
+	onion_listen_point **lp=o->thread_listen_points;
+	while (*lp)
+		onion_listen_point_free(*lp++);
+	free(o->thread_listen_points);
+	o->thread_listen_points=NULL;
+}
+#endif
+
+/// The server of this prefork process, to stop it at SIGTERM.
+static onion *onion_prefork_server=NULL;
+
+static void onion_prefork_sigterm(int _){
+	onion_listen_stop(onion_prefork_server);
+}
+
+/**
+ * @short Forks the process of that index. At the parent returns the pid, or -1 on error.
+ * 
+ * The new process returns 0, with its own poller and pinned to its CPU, and goes on listening at onion_listen
+ * with the inherited listen sockets.
+ */
+static pid_t onion_prefork_spawn(onion *o, int index){
+	pid_t pid=fork();
+	if (pid!=0){
+		if (pid<0)
+			ONION_ERROR("Could not fork the listen process %d: %s", index, strerror(errno));
+		return pid;
+	}
+	o->process_index=index;
+	o->flags&=~(O_DETACH_LISTEN|O_DETACHED);
+	free(o->process_pids);
+	o->process_pids=NULL;
+	// The epoll instance is shared with the parent after fork; each process needs its own.
+	onion_poller_free(o->poller);
+	o->poller=onion_listen_poller_new(o);
+	onion_stats_set_process(index);
+#ifdef __linux__
+	if (o->processes_cpus){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(o->processes_cpus[index%o->nprocesses_cpus], &set);
+		if (sched_setaffinity(0, sizeof(set), &set)<0)
+			ONION_WARNING("Could not set the CPU of the listen process %d: %s", index, strerror(errno));
+	}
+#endif
+	onion_prefork_server=o;
+	signal(SIGTERM, onion_prefork_sigterm);
+	ONION_DEBUG("Listen process %d started, pid %d", index, (int)getpid());
+	return 0;
+}
+
+/**
+ * @short Supervises the prefork processes: forks them, and respawns the ones that exit, until onion_listen_stop.
+ * 
+ * It returns at the supervisor when all the processes ended, and at each new process, to go on listening.
+ */
+static int onion_listen_prefork(onion *o){
+	int n=o->nprocesses, i;
+	if (o->process_pids)
+		free(o->process_pids);
+	o->process_pids=calloc(n, sizeof(pid_t));
+	time_t *started=calloc(n, sizeof(time_t));
+	o->processes_stopping=0;
+	int running=0;
+	for (i=0;i<n && !o->processes_stopping;i++){
+		pid_t pid=onion_prefork_spawn(o, i);
+		if (pid==0){
+			free(started);
+			return 0;
+		}
+		if (pid>0){
+			o->process_pids[i]=pid;
+			started[i]=time(NULL);
+			running++;
+		}
+	}
+	ONION_DEBUG("Supervising %d listen processes", running);
+	while (running){
+		int status;
+		pid_t pid=waitpid(-1, &status, 0);
+		if (pid<0){
+			if (errno==EINTR)
+				continue;
+			ONION_ERROR("Error waiting for the listen processes: %s", strerror(errno));
+			break;
+		}
+		for (i=0;i<n && o->process_pids[i]!=pid;i++);
+		if (i==n) // Not ours
+			continue;
+		o->process_pids[i]=0;
+		running--;
+		if (o->processes_stopping)
+			continue;
+		if (WIFSIGNALED(status))
+			ONION_WARNING("Listen process %d (pid %d) killed by signal %d, respawning", i, (int)pid, WTERMSIG(status));
+		else
+			ONION_WARNING("Listen process %d (pid %d) exited with status %d, respawning", i, (int)pid, WEXITSTATUS(status));
+		if (time(NULL)-started[i]<1) // Do not spin if it fails at start
+			sleep(1);
+		if (o->processes_stopping)
+			continue;
+		pid=onion_prefork_spawn(o, i);
+		if (pid==0){
+			free(started);
+			return 0;
+		}
+		if (pid>0){
+			o->process_pids[i]=pid;
+			started[i]=time(NULL);
+			o->process_respawns++;
+			running++;
+		}
+	}
+	free(started);
+	// process_pids, now all 0, is kept until onion_free, as onion_listen_stop and onion_get_stats may be reading it.
+	ONION_DEBUG("All listen processes ended");
+	return 0;
+}
+
+/// Sessions checked per shard at each tick of the sessions timer.
+#define ONION_SESSIONS_EXPIRE_STEP 64
+
+/// At each tick of the sessions timer, removes some expired sessions.
+static int onion_sessions_timer(onion *o){
+	uint64_t ticks;
+	if (read(o->sessions_timer_fd, &ticks, sizeof(ticks))<0 && errno!=EAGAIN)
+		ONION_ERROR("Error reading the sessions timer: %s", strerror(errno));
+	onion_sessions_expire(o->sessions, ONION_SESSIONS_EXPIRE_STEP);
+	return 0;
+}
+
+static void onion_sessions_timer_close(void *fd){
+	close((int)(intptr_t)fd);
+}
+
+/**
+ * @short If the sessions expire, adds a timer to the poller that removes them incrementally.
+ * 
+ * It ticks each second, or more often for short times to live, and removes at most 
+ * ONION_SESSIONS_EXPIRE_STEP per shard each time, so it never stalls the poller for long.
+ */
+static void onion_sessions_timer_start(onion *o){
+#ifdef __linux__
+	if (!o->sessions) // No time to live was set, so nothing expires
+		return;
+	int ttl=o->sessions->idle_ttl;
+	if (!ttl || (o->sessions->absolute_ttl && o->sessions->absolute_ttl<ttl))
+		ttl=o->sessions->absolute_ttl;
+	if (!ttl)
+		return;
+	int interval=ttl/4;
+	if (interval>1000)
+		interval=1000;
+	if (interval<10)
+		interval=10;
+	int fd=timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (fd<0){
+		ONION_ERROR("Could not create the sessions timer, they will expire only when new ones are created: %s", strerror(errno));
+		return;
+	}
+	struct itimerspec its={ { interval/1000, (interval%1000)*1000000 }, { interval/1000, (interval%1000)*1000000 } };
+	timerfd_settime(fd, 0, &its, NULL);
+	o->sessions_timer_fd=fd;
+	onion_poller_slot *slot=onion_poller_slot_new(fd, (void*)onion_sessions_timer, o);
+	onion_poller_slot_set_shutdown(slot, onion_sessions_timer_close, (void*)(intptr_t)fd);
+	onion_poller_add(o->poller, slot);
+#endif
+}
+
+/// Max listen sockets handed at a hot restart, and max size of the state of each.
+#define ONION_HOT_RESTART_MAX_FDS 16
+#define ONION_HOT_RESTART_STATE_SIZE 256
+#define ONION_HOT_RESTART_MAGIC 0x6f6e6872
+/// ms between the checks of the open connections, while draining.
+#define ONION_DRAIN_CHECK_MS 50
+
+/// A listen socket handed at a hot restart: the address of its listen point, as set, and its state.
+typedef struct{
+	char hostname[128];
+	char port[32];
+	uint32_t state_size;
+	unsigned char state[ONION_HOT_RESTART_STATE_SIZE];
+}onion_hot_restart_point;
+
+/// The message of a hot restart. The sockets go as SCM_RIGHTS, in the same order.
+typedef struct{
+	uint32_t magic;
+	uint32_t count;
+	onion_hot_restart_point points[ONION_HOT_RESTART_MAX_FDS];
+}onion_hot_restart_message;
+
+static int64_t onion_now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+/// If that point is the address of that listen point.
+static int onion_hot_restart_point_is(const onion_hot_restart_point *point, onion_listen_point *lp){
+	if (lp->path) // Unix socket path as the hostname, and no port
+		return strcmp(point->hostname, lp->path)==0 && point->port[0]=='\0';
+	return strcmp(point->hostname, lp->hostname ? lp->hostname : "")==0 && 
+	       strcmp(point->port, lp->port ? lp->port : "8080")==0;
+}
+
+/// Fills the address of the unix socket. -1 if the path is too long.
+static int onion_hot_restart_address(onion *o, struct sockaddr_un *addr){
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family=AF_UNIX;
+	if (strlen(o->hot_restart_path)>=sizeof(addr->sun_path)){
+		ONION_ERROR("Hot restart path too long: %s", o->hot_restart_path);
+		return -1;
+	}
+	strcpy(addr->sun_path, o->hot_restart_path);
+	return 0;
+}
+
+/**
+ * @short Takes the listen sockets of the previous process, if there is one at the hot restart path.
+ * @memberof onion_t
+ * 
+ * The previous process stops accepting as it sends them, so there is no moment without someone
+ * listening. The state of each listen point is set here, before listening.
+ * 
+ * @param fds Where to leave the socket of each listen point, or -1.
+ * @returns Number of sockets taken.
+ */
+static int onion_hot_restart_take(onion *o, int *fds){
+	struct sockaddr_un addr;
+	if (onion_hot_restart_address(o, &addr)<0)
+		return 0;
+	int fd=socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+	if (fd<0)
+		return 0;
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))<0){ // No previous process, a normal start.
+		ONION_DEBUG("No previous process at %s: %s", o->hot_restart_path, strerror(errno));
+		close(fd);
+		return 0;
+	}
+	
+	onion_hot_restart_message *msg=calloc(1, sizeof(onion_hot_restart_message));
+	char control[CMSG_SPACE(sizeof(int)*ONION_HOT_RESTART_MAX_FDS)];
+	struct iovec iov={ msg, sizeof(onion_hot_restart_message) };
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov=&iov;
+	mh.msg_iovlen=1;
+	mh.msg_control=control;
+	mh.msg_controllen=sizeof(control);
+	ssize_t r;
+	while ( (r=recvmsg(fd, &mh, MSG_CMSG_CLOEXEC))<0 && errno==EINTR );
+	close(fd);
+	
+	int received[ONION_HOT_RESTART_MAX_FDS];
+	int nreceived=0;
+	struct cmsghdr *cmsg;
+	for (cmsg=CMSG_FIRSTHDR(&mh);cmsg;cmsg=CMSG_NXTHDR(&mh, cmsg)){
+		if (cmsg->cmsg_level==SOL_SOCKET && cmsg->cmsg_type==SCM_RIGHTS){
+			int n=(cmsg->cmsg_len-CMSG_LEN(0))/sizeof(int);
+			if (n>ONION_HOT_RESTART_MAX_FDS-nreceived)
+				n=ONION_HOT_RESTART_MAX_FDS-nreceived;
+			memcpy(&received[nreceived], CMSG_DATA(cmsg), n*sizeof(int));
+			nreceived+=n;
+		}
+	}
+	if (r!=sizeof(onion_hot_restart_message) || msg->magic!=ONION_HOT_RESTART_MAGIC || msg->count!=(uint32_t)nreceived){
+		ONION_ERROR("Invalid hot restart message from %s", o->hot_restart_path);
+		msg->count=0;
+	}
+	
+	int i, taken=0;
+	for (i=0;i<nreceived;i++){
+		onion_hot_restart_point *point=&msg->points[i];
+		point->hostname[sizeof(point->hostname)-1]=0;
+		point->port[sizeof(point->port)-1]=0;
+		int j=-1;
+		if (i<(int)msg->count){
+			for (j=0;o->listen_points[j] && (fds[j]>=0 || !onion_hot_restart_point_is(point, o->listen_points[j]));j++);
+			if (!o->listen_points[j])
+				j=-1;
+		}
+		if (j<0){
+			ONION_WARNING("Listen socket %s:%s of the previous process is not used here, closing it", point->hostname, point->port);
+			close(received[i]);
+			continue;
+		}
+		onion_listen_point *lp=o->listen_points[j];
+		fds[j]=received[i];
+		if (lp->set_restart_state && point->state_size>0 && point->state_size<=ONION_HOT_RESTART_STATE_SIZE)
+			lp->set_restart_state(lp, point->state, point->state_size);
+		taken++;
+	}
+	free(msg);
+	ONION_INFO("Took %d listen sockets from the previous process", taken);
+	return taken;
+}
+
+/**
+ * @short Stops the O_REUSEPORT private pollers.
+ * 
+ * Only while the main poller runs, as when its poll returns onion_listen frees them.
+ */
+static void onion_listen_stop_thread_pollers(onion *o){
+#ifdef HAVE_PTHREADS
+	if (o->thread_pollers){
+		onion_poller **poller=o->thread_pollers;
+		while (*poller)
+			onion_poller_stop(*poller++);
+	}
+#endif
+}
+
+/**
+ * @short Stops the pollers, so onion_listen returns.
+ * 
+ * The main one the last, as when its poll returns onion_listen frees the others.
+ */
+static void onion_listen_stop_pollers(onion *o){
+	onion_listen_stop_thread_pollers(o);
+	if (o->poller)
+		onion_poller_stop(o->poller);
+}
+
+/**
+ * @short Checks if the connections were drained, or the deadline passed, and then stops listening.
+ * @memberof onion_t
+ * 
+ * The connections left are closed when onion_listen returns.
+ */
+static void onion_drain_check(void *_o){
+	onion *o=_o;
+	onion_stats stats;
+	onion_get_stats(o, &stats);
+	int64_t now=onion_now_ms();
+	if (stats.connections>0 && (!o->drain_deadline || now<o->drain_deadline)){
+		if (onion_poller_add_timer(o->poller, ONION_DRAIN_CHECK_MS, onion_drain_check, o)==0)
+			return;
+	}
+	onion_drain_report report;
+	report.connections=o->drain_connections;
+	report.forced=stats.connections;
+	report.drained=report.connections>report.forced ? report.connections-report.forced : 0;
+	report.ms=(int)(now-o->drain_started);
+	if (report.forced)
+		ONION_WARNING("Drain deadline passed with %lu connections still open, closing them", report.forced);
+	else
+		ONION_DEBUG("All connections drained in %d ms", report.ms);
+	if (o->drain_callback)
+		o->drain_callback(o->drain_data, o, &report);
+	onion_listen_stop_pollers(o);
+}
+
+/**
+ * @short Starts draining, at the poller: waits for the open connections until the deadline.
+ * @memberof onion_t
+ * 
+ * The listen sockets are already closed, and draining is set, so the requests in progress finish 
+ * without keep alive.
+ */
+static void onion_drain_begin(void *_o){
+	onion *o=_o;
+	onion_stats stats;
+	onion_get_stats(o, &stats);
+	o->drain_started=onion_now_ms();
+	o->drain_connections=stats.connections;
+	o->drain_deadline=o->drain_ms>0 ? o->drain_started+o->drain_ms : 0;
+	ONION_DEBUG("Draining %lu connections", stats.connections);
+	onion_drain_check(o);
+}
+
+/**
+ * @short Sends the listen sockets to the next process that connected, and starts draining.
+ * @memberof onion_t
+ * 
+ * From then on no new connections are accepted here; the sockets are closed but not shut down, as
+ * they are still open at the next process. Then it drains as at onion_listen_stop, but without 
+ * deadline if there is none set with onion_set_drain.
+ * 
+ * @returns -1, so the slot is removed: it is done only once.
+ */
+static int onion_hot_restart_handoff(onion *o){
+	int fd=accept4(o->hot_restart_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd<0)
+		return (errno==EAGAIN || errno==EINTR) ? 0 : -1;
+	
+	onion_hot_restart_message *msg=calloc(1, sizeof(onion_hot_restart_message));
+	int fds[ONION_HOT_RESTART_MAX_FDS];
+	onion_listen_point **lp;
+	msg->magic=ONION_HOT_RESTART_MAGIC;
+	for (lp=o->listen_points;*lp && msg->count<ONION_HOT_RESTART_MAX_FDS;lp++){
+		if ((*lp)->listen || (*lp)->listenfd<0) // Only the socket ones
+			continue;
+		onion_hot_restart_point *point=&msg->points[msg->count];
+		if ((*lp)->path)
+			snprintf(point->hostname, sizeof(point->hostname), "%s", (*lp)->path);
+		else{
+			snprintf(point->hostname, sizeof(point->hostname), "%s", (*lp)->hostname ? (*lp)->hostname : "");
+			snprintf(point->port, sizeof(point->port), "%s", (*lp)->port ? (*lp)->port : "8080");
+		}
+		if ((*lp)->get_restart_state)
+			point->state_size=(*lp)->get_restart_state(*lp, point->state, sizeof(point->state));
+		fds[msg->count++]=(*lp)->listenfd;
+	}
+	
+	char control[CMSG_SPACE(sizeof(int)*ONION_HOT_RESTART_MAX_FDS)];
+	memset(control, 0, sizeof(control));
+	struct iovec iov={ msg, sizeof(onion_hot_restart_message) };
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov=&iov;
+	mh.msg_iovlen=1;
+	if (msg->count){
+		mh.msg_control=control;
+		mh.msg_controllen=CMSG_SPACE(sizeof(int)*msg->count);
+		struct cmsghdr *cmsg=CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level=SOL_SOCKET;
+		cmsg->cmsg_type=SCM_RIGHTS;
+		cmsg->cmsg_len=CMSG_LEN(sizeof(int)*msg->count);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int)*msg->count);
+	}
+	int count=msg->count;
+	ssize_t w;
+	while ( (w=sendmsg(fd, &mh, MSG_NOSIGNAL))<0 && errno==EINTR );
+	memset(msg, 0, sizeof(onion_hot_restart_message)); // No keys left around
+	free(msg);
+	close(fd);
+	if (w<0){
+		ONION_ERROR("Could not hand the listen sockets to the next process: %s", strerror(errno));
+		return 0;
+	}
+	
+	ONION_INFO("Handed %d listen sockets to the next process, draining", count);
+	o->draining=1;
+	for (lp=o->listen_points;*lp;lp++){
+		if ((*lp)->listen || (*lp)->listenfd<0)
+			continue;
+		onion_poller_remove(o->poller, (*lp)->listenfd);
+		close((*lp)->listenfd);
+		(*lp)->listenfd=-1;
+	}
+	for (lp=o->spare_listen_points;lp && *lp;lp++){ // Not handed, but it stops accepting at them too.
+		if ((*lp)->listenfd<0)
+			continue;
+		onion_poller_remove(o->poller, (*lp)->listenfd);
+		close((*lp)->listenfd);
+		(*lp)->listenfd=-1;
+	}
+	o->hot_restart_fd=-1; // Closed at the slot shutdown
+	onion_drain_begin(o);
+	return -1;
+}
+
+static void onion_hot_restart_close(void *fd){
+	close((int)(intptr_t)fd);
+}
+
+/**
+ * @short Listens at the hot restart path, for the next process to take the listen sockets.
+ * @memberof onion_t
+ * 
+ * Any previous socket file is replaced; the previous process, if any, already handed its sockets.
+ */
+static void onion_hot_restart_listen(onion *o){
+	struct sockaddr_un addr;
+	if (onion_hot_restart_address(o, &addr)<0)
+		return;
+	int fd=socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+	if (fd<0){
+		ONION_ERROR("Could not create the hot restart socket: %s", strerror(errno));
+		return;
+	}
+	unlink(o->hot_restart_path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))<0 || listen(fd, 1)<0){
+		ONION_ERROR("Could not listen at the hot restart path %s: %s", o->hot_restart_path, strerror(errno));
+		close(fd);
+		return;
+	}
+	o->hot_restart_fd=fd;
+	onion_poller_slot *slot=onion_poller_slot_new(fd, (void*)onion_hot_restart_handoff, o);
+	onion_poller_slot_set_shutdown(slot, onion_hot_restart_close, (void*)(intptr_t)fd);
+	onion_poller_add(o->poller, slot);
 }
 
 /**
@@ -275,17 +1181,45 @@ int onion_listen(onion *o){
 	/// Start listening
 	size_t successful_listened_points=0;
 	onion_listen_point **lp=o->listen_points;
+	int *taken=NULL;
+	onion_listen_spares_free(o); // Of a previous listen
+	if (o->hot_restart_path || (o->flags&O_SYSTEMD)){
+		int n=0;
+		while (lp[n])
+			n++;
+		taken=malloc(sizeof(int)*n);
+		memset(taken, -1, sizeof(int)*n);
+		if (o->hot_restart_path)
+			onion_hot_restart_take(o, taken);
+#ifdef HAVE_SYSTEMD
+		if (o->flags&O_SYSTEMD)
+			onion_systemd_take(o, taken);
+#endif
+	}
+	o->draining=0;
 	while (*lp){
-		int listen_result=onion_listen_point_listen(*lp);
+		int listen_result=0;
+		if (taken && taken[lp-o->listen_points]>=0)
+			onion_listen_point_listen_fd(*lp, taken[lp-o->listen_points]);
+		else
+			listen_result=onion_listen_point_listen(*lp);
 		if (!listen_result) {
 			successful_listened_points++;
 		}
 		lp++;
 	}
+	free(taken);
 	if (!successful_listened_points){
 		ONION_ERROR("There are no available listen points");
 		return 1;
 	}
+	onion_freeze_handlers(o);
+
+	if (o->nprocesses>1 && o->process_index<0){
+		int ret=onion_listen_prefork(o);
+		if (o->process_index<0) // At the supervisor, all ended.
+			return ret;
+	}
 
 	
 	if (o->flags&O_ONE){
@@ -310,36 +1244,115 @@ int onion_listen(onion *o){
 		}while(((o->flags&O_ONE_LOOP) == O_ONE_LOOP) && op->listenfd>0);
 	}
 	else{
+#ifdef HAVE_PTHREADS
+		if (o->nworkers>0){
+			if (o->workers_min>0 && o->workers_min<o->nworkers)
+				o->workers=onion_workers_new_adaptive(o->workers_min, o->nworkers, o->workers_idle_ms, o->workers_max_queue, 
+				                                      o->workers_cpus, o->nworkers_cpus);
+			else
+				o->workers=onion_workers_new(o->nworkers, o->workers_max_queue, o->workers_cpus, o->nworkers_cpus);
+			int i;
+			for (i=0;o->workers && i<OPRIO_CLASSES;i++)
+				onion_workers_set_lane_limit(o->workers, i, o->priority_limits[i]);
+		}
+#endif
 		onion_listen_point **listen_points=o->listen_points;
 		while (*listen_points){
 			onion_listen_point *p=*listen_points;
 			ONION_DEBUG("Adding listen point fd %d to poller", p->listenfd);
+			onion_listen_point_set_nonblocking(p);
 			onion_poller_slot *slot=onion_poller_slot_new(p->listenfd, (void*)onion_listen_point_accept, p);
-			onion_poller_slot_set_type(slot, O_POLL_ALL);
+			// Prefork processes share the socket, so only one wakes for each connection.
+			onion_poller_slot_set_type(slot, o->process_index>=0 ? O_POLL_READ|O_POLL_EXCLUSIVE : O_POLL_ALL);
+			onion_listen_slot_set_accept(slot, p);
 			onion_poller_add(o->poller, slot);
 			listen_points++;
 		}
+		onion_sessions_timer_start(o);
+		if (o->hot_restart_path){
+			if (o->process_index>=0 || (o->flags&O_REUSEPORT))
+				ONION_WARNING("Hot restart only hands the listen sockets without prefork processes nor O_REUSEPORT");
+			else
+				onion_hot_restart_listen(o);
+		}
 
 #ifdef HAVE_PTHREADS
-		ONION_DEBUG("Start polling / listening %p, %p, %p", o->listen_points, *o->listen_points, *(o->listen_points+1));
+		if ((o->flags&O_THREADED) && (o->flags&O_REUSEPORT)){
+			onion_listen_reuseport_prepare(o);
+			if (o->steal_max_queue>0 && o->nthreads>1){
+				onion_poller **pollers=malloc(sizeof(onion_poller*)*o->nthreads);
+				pollers[0]=o->poller;
+				memcpy(pollers+1, o->thread_pollers, sizeof(onion_poller*)*(o->nthreads-1));
+				o->steal=onion_steal_new(pollers, o->nthreads, o->steal_max_queue);
+				free(pollers);
+			}
+		}
+#endif
+		onion_listen_spares(o);
+		o->edge_connections=0;
+		if (o->edge_triggered){
+			int shared_poller=0; // Polled by several threads
+#ifdef HAVE_PTHREADS
+			shared_poller=(o->flags&O_THREADED) && o->nthreads>1 && !o->thread_pollers;
+#endif
+			if (!(o->flags&O_NONBLOCKING) || shared_poller)
+				ONION_WARNING("Edge triggered connections need O_NONBLOCKING, and O_REUSEPORT when threaded. Using one shot ones.");
+			else
+				o->edge_connections=1;
+		}
+		o->listening=1;
+
+#ifdef HAVE_PTHREADS
+		ONION_DEBUG("Start polling / listening %p, %p, %p", o->listen_points, *o->listen_points, *(o->listen_points+1));
 		if (o->flags&O_THREADED){
 			o->threads=malloc(sizeof(pthread_t)*(o->nthreads-1));
 			int i;
 			for (i=0;i<o->nthreads-1;i++){
-				pthread_create(&o->threads[i],NULL,(void*)onion_poller_poll, o->poller);
+				onion_poller *poller=o->thread_pollers ? o->thread_pollers[i] : o->poller;
+				pthread_attr_t attr;
+				pthread_attr_init(&attr);
+				onion_thread_attr_cpu(o, &attr, i+1);
+				pthread_create(&o->threads[i],&attr,(void*)onion_poller_poll, poller);
+				pthread_attr_destroy(&attr);
 			}
 			
+#ifdef __linux__
+			cpu_set_t old_cpus;
+			int pinned=o->threads_cpus && pthread_getaffinity_np(pthread_self(), sizeof(old_cpus), &old_cpus)==0;
+			if (pinned){ // While listening; the caller gets its own back.
+				cpu_set_t set;
+				CPU_ZERO(&set);
+				CPU_SET(onion_thread_cpu(o, 0), &set);
+				pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+			}
+#endif
 			// Here is where it waits.. but eventually it will exit at onion_listen_stop
 			onion_poller_poll(o->poller);
 			ONION_DEBUG("Closing onion_listen");
+#ifdef __linux__
+			if (pinned)
+				pthread_setaffinity_np(pthread_self(), sizeof(old_cpus), &old_cpus);
+#endif
 			
 			for (i=0;i<o->nthreads-1;i++){
 				pthread_join(o->threads[i],NULL);
 			}
+			if (o->steal){ // Pollers stopped, so run the requests left at the queues here.
+				onion_steal_free(o->steal);
+				o->steal=NULL;
+			}
+			if (o->thread_pollers)
+				onion_listen_reuseport_free(o);
 		}
 		else
 #endif
 			onion_poller_poll(o->poller);
+#ifdef HAVE_PTHREADS
+		if (o->workers){ // Pollers stopped, so no more requests are queued. Finish the pending ones.
+			onion_workers_free(o->workers);
+			o->workers=NULL;
+		}
+#endif
 
 		listen_points=o->listen_points;
 		while (*listen_points){
@@ -350,135 +1363,802 @@ int onion_listen(onion *o){
 			}
 			listen_points++;
 		}
+		if (o->sessions_timer_fd>=0){ // Closed at the slot shutdown
+			onion_poller_remove(o->poller, o->sessions_timer_fd);
+			o->sessions_timer_fd=-1;
+		}
+		if (o->hot_restart_fd>=0){
+			onion_poller_remove(o->poller, o->hot_restart_fd);
+			o->hot_restart_fd=-1;
+		}
+		o->listening=0;
+		if (o->draining){ // Closes the connections left after the deadline, with a new poller for the next listen.
+			onion_poller_free(o->poller);
+			o->poller=onion_listen_poller_new(o);
+		}
 	}
+	onion_listen_spares_remove(o);
+	if (o->process_index>=0) // A prefork process, that the supervisor stopped.
+		exit(0);
 	return 0;
 }
 
 /**
- * @short Advises the listener to stop.
+ * @short Advises the listener to stop.
+ * 
+ * The listener is advised to stop listening. After this call no listening is still open, and listen could be
+ * called again, or the onion server freed.
+ * 
+ * If there is any pending connection, it can finish if onion not freed before. With a drain deadline
+ * (onion_set_drain) it stops gracefully: no new connections are accepted, the requests in progress
+ * finish and close their connections, and onion_listen returns when there are none left, or at the
+ * deadline, closing the rest. On O_DETACH_LISTEN mode this waits for it.
+ */
+void onion_listen_stop(onion* server){
+	if (server->process_pids){ // At the supervisor, stops the processes, and then it returns.
+		server->processes_stopping=1;
+		int i;
+		for (i=0;i<server->nprocesses;i++){
+			if (server->process_pids[i]>0)
+				kill(server->process_pids[i], SIGTERM);
+		}
+	}
+	// Queued before the listen points go away, so the poller does not finish as empty before it runs.
+	int drain=(server->drain_ms && server->listening && !server->draining);
+	if (drain){
+		server->draining=1;
+		onion_poller_call(server->poller, onion_drain_begin, server);
+	}
+	// The main listen points last: until then the main poller runs, so onion_listen does not join the
+	// threads, and free their pollers and listen points, while they are stopped here. Once the main
+	// poller has no slots left it stops by itself, so only it is stopped after that.
+	onion_listen_point **lp;
+#ifdef HAVE_PTHREADS
+	if (server->thread_listen_points){
+		for (lp=server->thread_listen_points;*lp;lp++)
+			onion_listen_point_listen_stop(*lp);
+	}
+#endif
+	for (lp=server->spare_listen_points;lp && *lp;lp++)
+		onion_listen_point_listen_stop(*lp);
+	if (!drain) // Also if called again while draining, to stop right now.
+		onion_listen_stop_thread_pollers(server);
+	for (lp=server->listen_points;*lp;lp++)
+		onion_listen_point_listen_stop(*lp);
+	if (drain){
+		ONION_DEBUG("Stop listening, draining");
+	}
+	else{
+		ONION_DEBUG("Stop listening");
+		if (server->poller)
+			onion_poller_stop(server->poller);
+	}
+#ifdef HAVE_PTHREADS
+	if (server->flags&O_DETACHED)
+		pthread_join(server->listen_thread, NULL);
+#endif
+}
+
+
+/**
+ * @short Sets the root handler
+ * @memberof onion_t
+ */
+void onion_set_root_handler(onion *onion, onion_handler *handler){
+	onion->root_handler=handler;
+}
+
+/**
+ * @short Returns current root handler. 
+ * @memberof onion_t
+ * 
+ * For example when changing root handler, the old one is not deleted (as oposed that when deleting the onion*
+ * object it is). So user may use onion_handler_free(onion_get_root_handler(o));
+ * 
+ * @param server The onion server
+ * @returns onion_handler currently at root.
+ */
+onion_handler *onion_get_root_handler(onion *server){
+	return server->root_handler;
+}
+
+
+/// Frees a handler of the vhosts dict.
+static void onion_vhost_free_handler(void *_, const char *host, const void *handler, int flags){
+	onion_handler_free((onion_handler*)handler);
+}
+
+static void onion_vhost_freeze_handler(onion_handler_table *table, const char *host, const void *handler, int flags){
+	onion_handler_freeze(table, (onion_handler*)handler);
+}
+
+/**
+ * @short Freezes the handlers to a new table, so each level is called from consecutive entries.
+ *
+ * The previous table is kept, as the requests being handled, or handlers not at the tree anymore,
+ * may still use it. All are freed at onion_free. @see onion_handler_freeze
+ */
+static void onion_freeze_handlers(onion *o){
+	onion_handler_table *table=onion_handler_table_new();
+	table->previous=o->handler_table;
+	if (o->root_handler)
+		onion_handler_freeze(table, o->root_handler);
+	if (o->internal_error_handler)
+		onion_handler_freeze(table, o->internal_error_handler);
+	if (o->vhosts)
+		onion_dict_preorder(o->vhosts, onion_vhost_freeze_handler, table);
+	o->handler_table=table;
+#ifdef __DEBUG0__
+	int i;
+	for (i=0;i<table->count;i++){
+		const onion_handler_entry *e=&table->entries[i];
+		ONION_DEBUG0("Handler %*s%p %s", e->depth*2, "", e->handler, e->route ? e->route : "");
+	}
+#endif
+	ONION_DEBUG("Frozen %d handlers", table->count);
+}
+
+/**
+ * @short Returns the handlers frozen at the last onion_listen, or NULL before it.
+ * @memberof onion_t
+ *
+ * They can be inspected with onion_handler_table_count and onion_handler_table_get, to list the routes.
+ */
+const onion_handler_table *onion_get_handler_table(onion *server){
+	return server->handler_table;
+}
+
+/**
+ * @short Finds the value of that host at a dict of hosts, exact or by wildcard.
+ * @memberof onion_t
+ * 
+ * The port and a final dot are ignored. a.b.example.com is looked up as is, then as *.b.example.com 
+ * and *.example.com, so the most specific wins.
+ * 
+ * @returns The value, or NULL if none.
+ */
+const void *onion_host_lookup(const onion_dict *hosts, const char *host){
+	if (!hosts || !host)
+		return NULL;
+	size_t l;
+	if (host[0]=='['){ // IPv6 address
+		const char *end=strchr(host, ']');
+		l=end ? end+1-host : strlen(host);
+	}
+	else
+		l=strcspn(host, ":");
+	if (l>0 && host[l-1]=='.')
+		l--;
+	char tmp[256];
+	if (l==0 || l>=sizeof(tmp))
+		return NULL;
+	memcpy(tmp, host, l);
+	tmp[l]='\0';
+	const void *ret=onion_dict_get(hosts, tmp);
+	size_t i;
+	for (i=1;!ret && i<l;i++){
+		if (tmp[i]=='.'){ // The label before is not needed anymore
+			tmp[i-1]='*';
+			ret=onion_dict_get(hosts, tmp+i-1);
+		}
+	}
+	return ret;
+}
+
+/**
+ * @short Sets the handler for the requests to that host
+ * @memberof onion_t
+ * 
+ * The requests are dispatched by their Host header, without the port, looked up at a hash table. A host
+ * as *.example.com is for all the subdomains without their own entry. Requests to other hosts go to the
+ * root handler.
+ * 
+ * The previous handler for that host is freed, and all of them are freed with the server. A NULL handler
+ * removes the host. Should be set before listening.
+ * 
+ * @param server The onion server
+ * @param host The host name, as www.example.com or *.example.com
+ * @param handler The handler for that host
+ */
+void onion_set_vhost_handler(onion *server, const char *host, onion_handler *handler){
+	if (!server->vhosts){
+		server->vhosts=onion_dict_new();
+		onion_dict_set_flags(server->vhosts, OD_RCU|OD_ICASE); // Read by all the threads at each request
+	}
+	onion_handler *old=(onion_handler*)onion_dict_get(server->vhosts, host);
+	if (old){
+		onion_dict_remove(server->vhosts, host);
+		onion_handler_free(old);
+	}
+	if (handler)
+		onion_dict_add(server->vhosts, host, handler, OD_DUP_KEY);
+}
+
+/**
+ * @short Returns the handler for the requests to that host
+ * @memberof onion_t
+ * 
+ * @param server The onion server
+ * @param host The Host header, may have a port, or NULL
+ * @returns The handler of that host or of its wildcard, or the root handler if none.
+ */
+onion_handler *onion_get_vhost_handler(onion *server, const char *host){
+	onion_handler *ret=(onion_handler*)onion_host_lookup(server->vhosts, host);
+	return ret ? ret : server->root_handler;
+}
+
+/**
+ * @short  Sets the internal error handler
+ * @memberof onion_t
+ */
+void onion_set_internal_error_handler(onion* server, onion_handler* handler){
+	server->internal_error_handler=handler;
+}
+
+/**
+ * @short Sets the port to listen to.
+ * @memberof onion_t
+ * 
+ * Default listen point is HTTP at localhost:8080.
+ * 
+ * @param server The onion server to act on.
+ * @param port The number of port to listen to, or service name, as string always.
+ */
+int onion_add_listen_point(onion* server, const char* hostname, const char* port, onion_listen_point* protocol){
+	if (protocol==NULL){
+		ONION_ERROR("Trying to add an invalid entry point. Ignoring.");
+		return -1;
+	}
+	
+	protocol->server=server;
+	if (hostname)
+		protocol->hostname=strdup(hostname);
+	if (port)
+		protocol->port=strdup(port);
+	
+	if (server->listen_points){
+		onion_listen_point **p=server->listen_points;
+		int protcount=0;
+		while (*p++) protcount++;
+		server->listen_points=realloc(server->listen_points, (protcount+2)*sizeof(onion_listen_point));
+		server->listen_points[protcount]=protocol;
+		server->listen_points[protcount+1]=NULL;
+	}
+	else{
+		server->listen_points=malloc(sizeof(onion_listen_point*)*2);
+		server->listen_points[0]=protocol;
+		server->listen_points[1]=NULL;
+	}
+	
+	ONION_DEBUG("add %p listen_point (%p, %p, %p)", protocol, server->listen_points, *server->listen_points, *(server->listen_points+1));
+	return 0;
+}
+
+/**
+ * @short Returns the listen point n.
+ * 
+ * 
+ * @param server The onion server
+ * @param nlisten_point Listen point index.
+ * @returns The listen point, or NULL if not that many listen points.
+ */
+onion_listen_point *onion_get_listen_point(onion *server, int nlisten_point){
+	onion_listen_point **next=server->listen_points;
+	while(next){ // I have to go one by one, as NULL is the stop marker.
+		if (nlisten_point==0)
+			return *next;
+		nlisten_point--;
+		next++;
+	}
+	return NULL;
+}
+
+/**
+ * @short Sets the timeout, in milliseconds
+ * @memberof onion_t
+ * 
+ * The default timeout is 5000 milliseconds.
+ * 
+ * @param timeout 0 dont wait for incomming data (too strict maybe), -1 forever, clients closes connection
+ */
+void onion_set_timeout(onion *onion, int timeout){
+	onion->timeout=timeout;
+}
+
+/**
+ * @short Sets the timeouts of each phase of the connections
+ * @memberof onion_t
+ * 
+ * With only onion_set_timeout, the same time is for a slow upload and for an idle keep alive connection,
+ * or a client that sends its headers a byte at a time. These set apart the time for the whole headers,
+ * the progress of the body and of the output, the idle time between requests, and the time a suspended 
+ * request may take.
+ * 
+ * @code
+ * onion_timeouts timeouts={ .header=10000, .body=30000, .body_min_rate=1024, .keep_alive=2000, .max_requests=1000 };
+ * onion_set_timeouts(o, &timeouts);
+ * @endcode
+ * 
+ * @param timeouts The timeouts. They are copied. Affects the connections accepted after this call.
+ */
+void onion_set_timeouts(onion *server, const onion_timeouts *timeouts){
+	server->timeouts=*timeouts;
+	server->phase_timeouts=(timeouts->header || timeouts->body || timeouts->body_min_rate || timeouts->handler ||
+	                        timeouts->write || timeouts->keep_alive || timeouts->max_requests);
+}
+
+/**
+ * @short Sets how many connections may be accepted at each listen point per poller wakeup
+ * @memberof onion_t
+ * 
+ * On poll modes the listen sockets are non blocking, so when the poller says there are new connections, 
+ * they are accepted in a loop until there are no more, or this budget is used. A big budget saves
+ * poller round trips on connection storms, a small one keeps the latency of the already accepted
+ * connections. Use onion_listen_point_get_accept_stats to tune it.
+ * 
+ * The default is 1, one connection per wakeup.
+ * 
+ * @param budget Maximum connections per wakeup, at least 1.
+ */
+void onion_set_accept_budget(onion *server, int budget){
+	if (budget<1){
+		ONION_ERROR("Accept budget must be at least 1, not %d", budget);
+		return;
+	}
+	server->accept_budget=budget;
+}
+
+/**
+ * @short Sets the maximum number of open connections, of all the clients and of each one
+ * @memberof onion_t
+ * 
+ * Over them new connections are answered a 503 with Retry-After (@see onion_set_max_inflight) and closed 
+ * right after the accept, before any request is read. TLS connections still at their handshake are just
+ * closed. Clients are told apart by their IP, hashed to a fixed table, so a few may share their limit.
+ * 
+ * The counters are shared by the prefork processes, so the limits are for all of them.
+ * Only for the poll modes. Can only be tweaked before listen.
+ * 
+ * @param server The onion server
+ * @param max_connections Maximum open connections, 0 for no limit.
+ * @param max_per_client Maximum open connections from the same IP, 0 for no limit.
+ */
+void onion_set_connection_limits(onion *server, int max_connections, int max_per_client){
+	onion_admission *adm=onion_admission_get(server);
+	if (adm)
+		onion_admission_set_connections(adm, max_connections, max_per_client);
+}
+
+/**
+ * @short Sets the maximum number of requests in flight, from their first byte to their response
+ * @memberof onion_t
+ * 
+ * Over it new requests are answered a 503 with Retry-After before they are parsed, and their
+ * connection is closed. It bounds the memory and latency on overload, as the server only works on
+ * the requests it can answer in time.
+ * 
+ * @param server The onion server
+ * @param max_requests Maximum requests in flight, 0 for no limit.
+ * @param retry_after Seconds at the Retry-After header of all the rejections. Default 1.
+ */
+void onion_set_max_inflight(onion *server, int max_requests, int retry_after){
+	onion_admission *adm=onion_admission_get(server);
+	if (adm)
+		onion_admission_set_inflight(adm, max_requests, retry_after);
+}
+
+/**
+ * @short Sheds the requests when they wait too long before their handler, as CoDel does at queues
+ * @memberof onion_t
+ * 
+ * The wait is from the first byte of the request to its handler, which grows when the threads or 
+ * workers can not keep up. A burst of late requests is fine, but when all of them are over the target 
+ * for a whole interval, they are answered a 503 with Retry-After instead of running their handler, 
+ * until one is on time again. So the latency stays around the target under overload.
+ * 
+ * Typical values are a target of 5 to 50 ms, and an interval of 100 ms.
+ * 
+ * @param server The onion server
+ * @param target_ms Wait over which a request is late, 0 to not shed.
+ * @param interval_ms Time the requests must be late before shedding them.
+ */
+void onion_set_load_shedding(onion *server, int target_ms, int interval_ms){
+	onion_admission *adm=onion_admission_get(server);
+	if (adm)
+		onion_admission_set_shedding(adm, target_ms, interval_ms);
+}
+
+/**
+ * @short Sets the most memory the library may use, before it sheds load instead of growing
+ * @memberof onion_t
+ * 
+ * The memory is the one the library accounts for its requests, parser, responses, dicts, sessions,
+ * poller slots, TLS sessions and caches (@see onion_memory_get), of this process; not all the 
+ * allocations, nor the ones of the handlers. So the budget must be below the real limit, as of the 
+ * container, with room for the rest.
+ * 
+ * Over it, the least recently used quarter of the sessions, the files in memory of the file cache and 
+ * the fragment cache are evicted, at most each 100 ms, and while still over it new connections are 
+ * answered a 503 with Retry-After and closed, as over onion_set_connection_limits. The open ones go on,
+ * and as they end their memory is freed. So under a flood the server answers less, instead of 
+ * growing until the OOM killer ends it.
+ * 
+ * Only for the poll modes. The prefork processes have a budget each.
+ * 
+ * @param server The onion server
+ * @param bytes Memory budget, 0 for no limit.
+ */
+void onion_set_memory_budget(onion *server, size_t bytes){
+	onion_admission *adm=onion_admission_get(server);
+	if (adm)
+		onion_admission_set_memory_budget(adm, bytes);
+}
+
+/**
+ * @short Sets the default socket tuning options for the listen points
+ * @memberof onion_t
+ * 
+ * Applied to all the listen points when they start listening, also systemd passed sockets. Each 
+ * listen point may override them with onion_listen_point_set_socket_options.
+ * 
+ * @code
+ * onion_socket_options opts={ .backlog=1024, .defer_accept=5, .nodelay=1 };
+ * onion_set_socket_options(o, &opts);
+ * @endcode
+ * 
+ * @param opts The options. They are copied.
+ */
+void onion_set_socket_options(onion *server, const onion_socket_options *opts){
+	server->socket_options=*opts;
+}
+
+/**
+ * @short Sets the events read at each poller wakeup, for all the pollers of this server
+ * @memberof onion_t
+ * 
+ * Also for the private pollers of each thread at O_REUSEPORT mode. 
+ * 
+ * @see onion_poller_set_max_events
+ */
+void onion_set_poller_max_events(onion *server, int max_events, int max_events_limit){
+	if (max_events<1){
+		ONION_ERROR("Poller max events must be at least 1, not %d", max_events);
+		return;
+	}
+	server->poller_max_events=max_events;
+	server->poller_max_events_limit=max_events_limit;
+	onion_poller_set_max_events(server->poller, max_events, max_events_limit);
+}
+
+/**
+ * @short Measures the wait and callback times of all the pollers of this server
+ * @memberof onion_t
+ * 
+ * Also of the private pollers of each thread at O_REUSEPORT mode. The times are at onion_get_stats, and
+ * the callbacks that hold a poller thread more than stall_ms are logged. It can be changed while listening.
+ * 
+ * @param stall_ms Stall threshold, in ms, or 0 to only measure, or <0 to stop measuring.
+ * @see onion_poller_set_profiling
+ */
+void onion_set_poller_profiling(onion *server, int stall_ms){
+	server->poller_profiling=(stall_ms>=0);
+	server->poller_stall_ms=stall_ms;
+	onion_poller_set_profiling(server->poller, stall_ms);
+#ifdef HAVE_PTHREADS
+	onion_poller **poller;
+	for (poller=server->thread_pollers;poller && *poller;poller++)
+		onion_poller_set_profiling(*poller, stall_ms);
+#endif
+}
+
+/**
+ * @short Watches the connections edge triggered at the poller, so they are not rearmed after each event
+ * @memberof onion_t
+ * 
+ * Each event of a connection costs an epoll_ctl to watch it again, as they are one shot so only one thread
+ * gets them. Edge triggered they stay watched, and reads go until EAGAIN; the rearm is only needed when 
+ * what is waited for changes, as when the output has to wait to be writable.
+ * 
+ * A connection must be of only one thread then, so it needs O_NONBLOCKING and pollers of one thread each: 
+ * O_POLL, or O_POOL with O_REUSEPORT. Else onion_listen warns and uses one shot connections as always. 
+ * Only the epoll poller supports it. Set before onion_listen.
+ * 
+ * @param edge_triggered 1 to use it, 0 not to, the default.
+ */
+void onion_set_edge_triggered(onion *server, int edge_triggered){
+	server->edge_triggered=edge_triggered;
+}
+
+/**
+ * @short Keeps the request headers as slices of a per connection buffer, instead of a dict.
+ * @memberof onion_t
+ * 
+ * Keys and values are copied once into a buffer that is reused on keep alive, and onion_request_get_header
+ * looks them up there, without allocations per header. The header dict is only built if asked for, at 
+ * onion_request_get_header_dict. Affects the requests created after this call.
+ */
+void onion_set_header_slices(onion *server, int enable){
+	server->header_slices=enable;
+}
+
+/**
+ * @short Frees the request buffers of the keep alive connections idle for idle_ms.
+ * @memberof onion_t
+ * 
+ * Between requests a connection keeps its parser, arena, path and header buffers, for the next request.
+ * After idle_ms without data they are freed, so many idle connections only cost the request itself, and
+ * they are created again as the next request comes. Only if shorter than the timeout.
+ * 
+ * The default is 1000 ms. Affects the connections accepted after this call.
+ * 
+ * @param idle_ms Time without data, in milliseconds, or <0 to never free them.
+ */
+void onion_set_idle_compact(onion *server, int idle_ms){
+	server->idle_compact_ms=idle_ms;
+}
+
+/**
+ * @short Keeps the time of each phase of the requests.
+ * @memberof onion_t
+ * 
+ * Each request gets the monotonic time at the accept, TLS handshake, start and end of the headers, start 
+ * and end of the handler and the end of the response, for onion_request_get_timings, the %{phase}P fields 
+ * of the access log and the phase histograms of onion_get_stats. Off by default, and then only the start 
+ * is kept, if there is an access log.
+ */
+void onion_set_request_timings(onion *server, int enable){
+	server->request_timings=enable;
+}
+
+/**
+ * @short Negotiates the permessage-deflate extension (RFC 7692) on the new websockets.
+ * @memberof onion_t
+ * 
+ * Text and binary messages are compressed if the client offers it. With context takeover the compressor 
+ * keeps its window between messages, which compresses repetitive feeds best; without it each message is 
+ * compressed on its own, and the zlib streams are freed after each message, so idle connections keep no 
+ * memory for them.
+ * 
+ * The zlib streams of each connection, as zlib documents their size, are kept under max_memory: the window 
+ * bits of both sides and the compressor memory level are lowered to fit, and if it is not possible the 
+ * extension is not negotiated. Windows of 15 bits with the default memory level take about 300 KB; the 
+ * least, 9 bits and memory level 1, about 11 KB.
+ * 
+ * Inflated messages from the client are limited as the POST data, by onion_set_max_post_size.
+ * 
+ * @param server The server
+ * @param window_bits Max window of the compressor, 9 to 15, or 0 to disable it, the default.
+ * @param context_takeover Whether the windows are kept between messages
+ * @param max_memory Of the zlib streams of each connection, or 0 for no limit.
+ */
+void onion_set_websocket_deflate(onion *server, int window_bits, int context_takeover, size_t max_memory){
+#ifdef HAVE_ZLIB
+	if (window_bits!=0 && (window_bits<9 || window_bits>15)){
+		ONION_ERROR("Websocket deflate window bits must be 9 to 15, not %d", window_bits);
+		return;
+	}
+	server->websocket_deflate.window_bits=window_bits;
+	server->websocket_deflate.no_context_takeover=!context_takeover;
+	server->websocket_deflate.max_memory=max_memory;
+#else
+	if (window_bits)
+		ONION_ERROR("Websocket deflate needs zlib, and onion was compiled without it");
+#endif
+}
+
+/**
+ * @short Sets the default keepalive of the new websockets.
+ * @memberof onion_t
+ * 
+ * Websockets that read nothing for ping_interval_ms are pinged, and if they read nothing more, as the 
+ * pong, in pong_timeout_ms, they are closed. So the connections dropped by the way, as by NAT boxes, are 
+ * freed, and the live ones are kept open through them. It can be changed for each websocket with
+ * onion_websocket_set_keepalive.
+ * 
+ * @param server The server
+ * @param ping_interval_ms Idle time before the ping, or 0 to not ping, the default.
+ * @param pong_timeout_ms Time for the answer, or 0 for the same as the interval.
+ */
+void onion_set_websocket_keepalive(onion *server, int ping_interval_ms, int pong_timeout_ms){
+	server->websocket_ping_interval=ping_interval_ms>0 ? ping_interval_ms : 0;
+	server->websocket_pong_timeout=pong_timeout_ms>0 ? pong_timeout_ms : ping_interval_ms;
+}
+
+/**
+ * @short Sets the default response buffer size, in bytes.
+ * @memberof onion_t
+ * 
+ * Responses are buffered up to this size before writing. Responses that fit get an exact Content-Length 
+ * and are written at once, so the connection can be kept alive without chunked encoding; bigger ones are 
+ * sent in chunks of this size. The buffer starts small and only grows as the response needs it.
+ * 
+ * Default is ONION_RESPONSE_BUFFER_SIZE (1500 bytes). It can be changed for a single response with
+ * onion_response_set_buffer_size.
+ */
+void onion_set_response_buffer_size(onion *server, size_t size){
+	if (size<1){
+		ONION_ERROR("Response buffer size must be at least 1");
+		return;
+	}
+	server->response_buffer_size=size;
+}
+
+/**
+ * @short Sets the function called when the headers of a request with a body are read, before the body.
+ * @memberof onion_t
+ * 
+ * Normally the body is kept in memory (POST, Content-Length) or at a temporal file (PUT) before calling
+ * the handler. The hook can check the headers and path, and call onion_request_set_body_callback to get 
+ * the body in chunks as it arrives instead, so it can be piped to its destination with constant memory.
+ * Or it can call onion_request_reject_body, to answer before the body is sent.
+ * 
+ * @param server The server
+ * @param hook The hook, or NULL to always buffer the bodies.
+ * @param data Passed as is to the hook.
+ */
+void onion_set_request_body_hook(onion *server, onion_request_body_hook hook, void *data){
+	server->body_hook=hook;
+	server->body_hook_data=data;
+}
+
+/**
+ * @short Sets the directory where the PUT bodies are kept until their handler gets them. By default /tmp.
+ * @memberof onion_t
  * 
- * The listener is advised to stop listening. After this call no listening is still open, and listen could be
- * called again, or the onion server freed.
+ * Where the kernel allows, they are unnamed O_TMPFILE files, removed by themselves if not used, and the
+ * handler moves them to their place with a link and a rename, that must be at the same filesystem to not
+ * copy them. Routes that move them elsewhere can set their own at the body hook, with onion_request_set_spool_dir.
  * 
- * If there is any pending connection, it can finish if onion not freed before.
+ * @param server The server
+ * @param dir The directory, or NULL for /tmp
  */
-void onion_listen_stop(onion* server){
-	/// Start listening
-	onion_listen_point **lp=server->listen_points;
-	while (*lp){
-		onion_listen_point_listen_stop(*lp);
-		lp++;
-	}	
-	if (server->poller){
-		ONION_DEBUG("Stop listening");
-		onion_poller_stop(server->poller);
-	}
-#ifdef HAVE_PTHREADS
-	if (server->flags&O_DETACHED)
-		pthread_join(server->listen_thread, NULL);
-#endif
+void onion_set_spool_dir(onion *server, const char *dir){
+	if (server->spool_dir)
+		free(server->spool_dir);
+	server->spool_dir=dir ? strdup(dir) : NULL;
 }
 
+/**
+ * @short Keeps the static files open, with their metadata, for onion_shortcut_response_file and export_local.
+ * @memberof onion_t
+ * 
+ * Serving a file needs a stat, an open and more before the first byte is sent. With the cache, up to 
+ * max_entries paths keep their open fd, stat, resolved path, ETag and MIME type, so a hot file costs about 
+ * only the sendfile. Paths that do not exist are remembered too.
+ * 
+ * Changes to the files are seen at most ttl_ms milliseconds later. Default is no cache.
+ * 
+ * @param server The server
+ * @param max_entries Maximum paths, and so open files, at the cache. 0 disables it.
+ * @param ttl_ms How long each entry is valid, in milliseconds.
+ */
+void onion_set_file_cache(onion *server, int max_entries, int ttl_ms){
+	if (server->file_cache)
+		onion_file_cache_free(server->file_cache);
+	server->file_cache=max_entries>0 ? onion_file_cache_new(max_entries, ttl_ms) : NULL;
+}
 
 /**
- * @short Sets the root handler
+ * @short Sets the time to live of the sessions.
  * @memberof onion_t
+ * 
+ * Sessions not used for idle_ttl ms, or created absolute_ttl ms ago, are not valid anymore. While listening
+ * a timer at the poller removes them incrementally, checking only the least recently used of each 
+ * session shard. Default is that they never expire. Set it before onion_listen.
+ * 
+ * @see onion_sessions_set_ttl
  */
-void onion_set_root_handler(onion *onion, onion_handler *handler){
-	onion->root_handler=handler;
+void onion_set_session_ttl(onion *server, int idle_ttl, int absolute_ttl){
+	onion_sessions_set_ttl(onion_get_sessions(server), idle_ttl, absolute_ttl);
 }
 
 /**
- * @short Returns current root handler. 
+ * @short Sets the maximum number of sessions, to cap their memory.
  * @memberof onion_t
  * 
- * For example when changing root handler, the old one is not deleted (as oposed that when deleting the onion*
- * object it is). So user may use onion_handler_free(onion_get_root_handler(o));
+ * Creating more evicts the least recently used. Default is no limit.
  * 
- * @param server The onion server
- * @returns onion_handler currently at root.
+ * @see onion_sessions_set_max
  */
-onion_handler *onion_get_root_handler(onion *server){
-	return server->root_handler;
+void onion_set_max_sessions(onion *server, int max_sessions){
+	onion_sessions_set_max(onion_get_sessions(server), max_sessions);
 }
 
+/**
+ * @short Stores the sessions at that backend, instead of in memory, to share them among processes or keep them.
+ * @memberof onion_t
+ * 
+ * It takes ownership of the backend. Set it before onion_listen, and before forking the workers for 
+ * an anonymous onion_sessions_backend_shm.
+ * 
+ * @see onion_sessions_set_backend
+ */
+void onion_set_session_backend(onion *server, onion_sessions_backend *backend){
+	onion_sessions_set_backend(onion_get_sessions(server), backend);
+}
 
 /**
- * @short  Sets the internal error handler
+ * @short Keeps the sessions at signed cookies at the clients, so the servers keep no session state.
  * @memberof onion_t
+ * 
+ * All the servers that share the sessions need the same key. With encrypt the clients can not read 
+ * them either, which needs gnutls.
+ * 
+ * @see onion_sessions_set_cookie_key
+ * @returns 0 if set, -1 if not possible.
  */
-void onion_set_internal_error_handler(onion* server, onion_handler* handler){
-	server->internal_error_handler=handler;
+int onion_set_session_cookie_key(onion *server, const char *key, int length, int encrypt){
+	return onion_sessions_set_cookie_key(onion_get_sessions(server), key, length, encrypt);
 }
 
 /**
- * @short Sets the port to listen to.
+ * @short Logs the requests at an access log, instead of as INFO lines.
  * @memberof onion_t
  * 
- * Default listen point is HTTP at localhost:8080.
+ * Each thread keeps its lines at a buffer of its own, without locks, and a thread of the log writes 
+ * them in batches; so logging does not serialize the threads as the INFO lines do. When there is no room
+ * lines are dropped and counted, not waited for. Set it before onion_listen.
  * 
- * @param server The onion server to act on.
- * @param port The number of port to listen to, or service name, as string always.
+ * @see onion_access_log_new for the format. onion_access_log_get_stats
+ * 
+ * @param server The server
+ * @param path File to append to, or NULL for syslog.
+ * @param format Format of the lines, or NULL for ONION_ACCESS_LOG_DEFAULT_FORMAT.
+ * @returns 0 if set, -1 if the file could not be opened or the format is not valid.
  */
-int onion_add_listen_point(onion* server, const char* hostname, const char* port, onion_listen_point* protocol){
-	if (protocol==NULL){
-		ONION_ERROR("Trying to add an invalid entry point. Ignoring.");
+int onion_set_access_log(onion *server, const char *path, const char *format){
+	onion_access_log *log=onion_access_log_new(path, format);
+	if (!log)
 		return -1;
-	}
-	
-	protocol->server=server;
-	if (hostname)
-		protocol->hostname=strdup(hostname);
-	if (port)
-		protocol->port=strdup(port);
-	
-	if (server->listen_points){
-		onion_listen_point **p=server->listen_points;
-		int protcount=0;
-		while (*p++) protcount++;
-		server->listen_points=realloc(server->listen_points, (protcount+2)*sizeof(onion_listen_point));
-		server->listen_points[protcount]=protocol;
-		server->listen_points[protcount+1]=NULL;
-	}
-	else{
-		server->listen_points=malloc(sizeof(onion_listen_point*)*2);
-		server->listen_points[0]=protocol;
-		server->listen_points[1]=NULL;
-	}
-	
-	ONION_DEBUG("add %p listen_point (%p, %p, %p)", protocol, server->listen_points, *server->listen_points, *(server->listen_points+1));
+	if (server->access_log)
+		onion_access_log_free(server->access_log);
+	server->access_log=log;
 	return 0;
 }
 
 /**
- * @short Returns the listen point n.
- * 
- * 
- * @param server The onion server
- * @param nlisten_point Listen point index.
- * @returns The listen point, or NULL if not that many listen points.
+ * @short Returns the access log, to get its counters, or NULL if none.
+ * @memberof onion_t
  */
-onion_listen_point *onion_get_listen_point(onion *server, int nlisten_point){
-	onion_listen_point **next=server->listen_points;
-	while(next){ // I have to go one by one, as NULL is the stop marker.
-		if (nlisten_point==0)
-			return *next;
-		nlisten_point--;
-		next++;
-	}
-	return NULL;
+onion_access_log *onion_get_access_log(onion *server){
+	return server->access_log;
 }
 
 /**
- * @short Sets the timeout, in milliseconds
+ * @short Records the requests read, with their timing, to replay them later against another server.
  * @memberof onion_t
  * 
- * The default timeout is 5000 milliseconds.
+ * The bytes read from each HTTP/1 connection are recorded as they come, after TLS, with the time they were 
+ * read; then when each response is sent, with its status, and when the connection is closed. So a replay
+ * can send the same bytes, at the same pace, and check the responses. The threads write to the file with 
+ * it locked, so it is meant for captures, not to be always on. HTTP/2 connections are not recorded.
  * 
- * @param timeout 0 dont wait for incomming data (too strict maybe), -1 forever, clients closes connection
+ * The bodies and the headers are recorded as they are, cookies and credentials too: keep the files as 
+ * private as the traffic. Set it before onion_listen; it is written at onion_free.
+ * 
+ * @see onion_traffic_record_read to read it. tests/10-benchmarks/10-replay to replay it.
+ * 
+ * @param server The server
+ * @param path File to write, truncated, or NULL to stop recording.
+ * @returns 0 if set, -1 if the file could not be opened.
  */
-void onion_set_timeout(onion *onion, int timeout){
-	onion->timeout=timeout;
+int onion_set_traffic_record(onion *server, const char *path){
+	onion_traffic_record *record=NULL;
+	if (path && !(record=onion_traffic_record_new(path)))
+		return -1;
+	if (server->traffic_record)
+		onion_traffic_record_free(server->traffic_record);
+	server->traffic_record=record;
+	return 0;
+}
+
+/**
+ * @short Returns the file cache, to set it up more or get its counters, or NULL if none.
+ * @memberof onion_t
+ * @see onion_file_cache_set_memory onion_file_cache_get_stats
+ */
+onion_file_cache *onion_get_file_cache(onion *server){
+	return server->file_cache;
 }
 
 /**
@@ -497,6 +2177,268 @@ void onion_set_max_threads(onion *onion, int max_threads){
 #endif
 }
 
+/**
+ * @short Sets the number of threads that run the handlers, separated from the poller threads.
+ * @memberof onion_t
+ * 
+ * On O_POLL/O_POOL modes, the poller threads read and parse the requests, and then pass the parsed
+ * request to a queue served by these worker threads. When the handler is done, the connection
+ * goes back to its poller. This way slow handlers do not delay the accept and parsing of other
+ * requests, and I/O and handler threads can be sized independently.
+ * 
+ * If the queue is full, the request is processed at the poller thread.
+ * 
+ * Only for epoll and io_uring pollers. Can only be tweaked before listen.
+ * 
+ * @param server The onion server
+ * @param nworkers Number of worker threads. 0 (default) runs the handlers at the poller threads.
+ * @param max_queue Maximum number of requests waiting for a worker.
+ */
+void onion_set_workers(onion *server, int nworkers, int max_queue){
+#ifdef HAVE_PTHREADS
+	server->nworkers=nworkers;
+	server->workers_max_queue=max_queue;
+#else
+	ONION_WARNING("No pthreads support, handlers run at the poller thread.");
+#endif
+}
+
+/**
+ * @short Makes the worker threads grow with the load and shrink when idle, instead of all running always.
+ * @memberof onion_t
+ * 
+ * The workers start with min_workers threads. When a request is queued and all of them are busy, 
+ * with more requests waiting than idle threads, one more is started, up to the nworkers of 
+ * onion_set_workers. The threads over min_workers that wait idle_ms without a request retire. So the
+ * maximum can be sized for the peaks, and only the threads that the load needs run.
+ * 
+ * The thread counts are at onion_get_stats, and at the metrics handler. Can only be tweaked before listen.
+ * 
+ * @param server The onion server
+ * @param min_workers Threads always running, at least 1. 0, the default, to always run all the nworkers.
+ * @param idle_ms Time without requests after which a thread over min_workers retires.
+ */
+void onion_set_workers_autoscale(onion *server, int min_workers, int idle_ms){
+#ifdef HAVE_PTHREADS
+	if (min_workers<0 || idle_ms<=0){
+		ONION_ERROR("Invalid worker autoscale: %d minimum workers, %d ms idle", min_workers, idle_ms);
+		return;
+	}
+	server->workers_min=min_workers;
+	server->workers_idle_ms=idle_ms;
+#else
+	ONION_WARNING("No pthreads support, handlers run at the poller thread.");
+#endif
+}
+
+/**
+ * @short Sets how many requests of a priority class may run at the worker threads at a time.
+ * @memberof onion_t
+ * 
+ * The routes get their class with onion_url_set_priority. The workers take the requests of OPRIO_HIGH 
+ * first, then OPRIO_NORMAL and then OPRIO_LOW, each class from its own queue of max_queue requests 
+ * (onion_set_workers), and up to its limit. So with a limit to OPRIO_LOW lower than the workers, bulk 
+ * requests can not take all the threads, and the others still have some. As with the default queue,
+ * if the queue of the class is full the request is processed at the poller thread.
+ * 
+ * Only with workers. Can only be tweaked before listen.
+ * 
+ * @param server The onion server
+ * @param priority The class
+ * @param max_running Requests of the class running at a time, or 0 (default) for as many as workers.
+ */
+void onion_set_priority_class(onion *server, onion_priority_class priority, int max_running){
+	if (priority<0 || priority>=OPRIO_CLASSES || max_running<0){
+		ONION_ERROR("Invalid priority class %d limit %d", priority, max_running);
+		return;
+	}
+	if (!server->nworkers)
+		ONION_WARNING("Priority classes only apply to the worker threads. Set them with onion_set_workers.");
+	server->priority_limits[priority]=max_running;
+}
+
+/**
+ * @short Balances the handlers among the poller threads of O_REUSEPORT mode.
+ * @memberof onion_t
+ * 
+ * On O_REUSEPORT mode each thread has its own poller and connections, without locks, but a few heavy 
+ * keep alive clients may keep one thread busy while the others are idle. With work stealing the poller 
+ * threads queue the parsed requests, and run them after each batch of events; a thread with nothing to 
+ * do takes the oldest requests of the others. The queues are lock free deques (Chase-Lev): the owner 
+ * pushes and takes from one end, the idle threads steal from the other. When a thread queues more than 
+ * one request, it wakes up an idle one.
+ * 
+ * The connection stays at its poller, and goes back to it after the request, as with onion_set_workers,
+ * that are used instead if set. If the queue is full, the request is processed right away.
+ * 
+ * Only for epoll and io_uring pollers. Can only be tweaked before listen.
+ * 
+ * @param server The onion server
+ * @param max_queue Maximum number of requests waiting at each thread. 0 (default) for no work stealing.
+ */
+void onion_set_work_stealing(onion *server, int max_queue){
+#ifdef HAVE_PTHREADS
+	server->steal_max_queue=max_queue;
+#else
+	ONION_WARNING("No pthreads support, no work stealing.");
+#endif
+}
+
+/**
+ * @short Pins each poller thread to a CPU.
+ * @memberof onion_t
+ * 
+ * On O_THREADED modes, the thread that calls onion_listen (while listening) and each of the other 
+ * onion_set_max_threads threads is pinned to the next CPU of the list, round robin. So the state of each
+ * connection stays at the caches of one CPU, and as memory is placed at the NUMA node of the thread that
+ * first uses it, the per thread pools, slots and request buffers are at the node of their CPU.
+ * 
+ * On O_REUSEPORT mode each thread has its own listen socket, and with steer the kernel is asked to give
+ * each new connection to the socket of the thread of the CPU that got it, with a reuseport BPF program 
+ * and SO_INCOMING_CPU. Then the connection is served where its packets, and interrupts, arrive; best with 
+ * the NIC queues interrupts at the same CPUs.
+ * 
+ * Set it before onion_listen.
+ * 
+ * @param server The onion server
+ * @param cpus List of CPU numbers. NULL to run on any CPU.
+ * @param ncpus Number of elements at cpus
+ * @param steer Steer the connections to the thread of their CPU, on O_REUSEPORT mode.
+ */
+void onion_set_threads_affinity(onion *server, const int *cpus, int ncpus, int steer){
+#ifdef HAVE_PTHREADS
+	if (server->threads_cpus)
+		free(server->threads_cpus);
+	server->threads_cpus=NULL;
+	server->nthreads_cpus=0;
+	if (cpus && ncpus>0){
+		server->threads_cpus=malloc(sizeof(int)*ncpus);
+		memcpy(server->threads_cpus, cpus, sizeof(int)*ncpus);
+		server->nthreads_cpus=ncpus;
+	}
+	server->threads_steer=steer;
+#endif
+}
+
+/**
+ * @short Sets the CPUs where the worker threads run. @see onion_set_workers
+ * @memberof onion_t
+ * 
+ * @param server The onion server
+ * @param cpus List of CPU numbers. NULL to run on any CPU.
+ * @param ncpus Number of elements at cpus
+ */
+void onion_set_workers_affinity(onion *server, const int *cpus, int ncpus){
+#ifdef HAVE_PTHREADS
+	if (server->workers_cpus)
+		free(server->workers_cpus);
+	server->workers_cpus=NULL;
+	server->nworkers_cpus=0;
+	if (cpus && ncpus>0){
+		server->workers_cpus=malloc(sizeof(int)*ncpus);
+		memcpy(server->workers_cpus, cpus, sizeof(int)*ncpus);
+		server->nworkers_cpus=ncpus;
+	}
+#endif
+}
+
+/**
+ * @short Sets the number of processes forked at onion_listen, and the CPUs where they run
+ * @memberof onion_t
+ * 
+ * The listen sockets are opened, and then onion_listen forks nprocesses, each with its own poller, 
+ * threads and sessions, that accept from the inherited sockets; only one of them wakes for each 
+ * connection. The calling process becomes their supervisor: it respawns the ones that exit or crash, 
+ * and at onion_listen_stop sends them SIGTERM, waits for them, and returns. The processes themselves 
+ * exit when they stop listening.
+ * 
+ * This way handlers that are not thread safe, or that contend on locks, scale with the processes. Use 
+ * onion_get_process_index for per process setup, and onion_sessions_backend_shm to share the sessions.
+ * The counters of onion_get_stats are at shared memory, so the supervisor sees the ones of all the 
+ * processes; the accept and poller ones are only of the calling process.
+ * 
+ * Can only be tweaked before listen.
+ * 
+ * @param server The onion server
+ * @param nprocesses Number of processes. 0 or 1 (default) listens at the calling process.
+ * @param cpus The CPU of each process, round robin, or NULL to not pin them.
+ * @param ncpus Number of cpus
+ */
+void onion_set_processes(onion *server, int nprocesses, const int *cpus, int ncpus){
+	server->nprocesses=nprocesses;
+	if (server->processes_cpus)
+		free(server->processes_cpus);
+	server->processes_cpus=NULL;
+	server->nprocesses_cpus=0;
+	if (cpus && ncpus>0){
+		server->processes_cpus=malloc(sizeof(int)*ncpus);
+		memcpy(server->processes_cpus, cpus, sizeof(int)*ncpus);
+		server->nprocesses_cpus=ncpus;
+	}
+}
+
+/**
+ * @short Index of this prefork process, from 0, or -1 at the supervisor or without prefork. @see onion_set_processes
+ * @memberof onion_t
+ */
+int onion_get_process_index(onion *server){
+	return server->process_index;
+}
+
+/**
+ * @short Zero downtime restarts: takes the listen sockets of the running process, and hands them to the next one
+ * @memberof onion_t
+ * 
+ * At onion_listen, if a previous process listens at path, its listen sockets are taken for the listen
+ * points with the same hostname and port, instead of opening new ones, and with them the state the
+ * connections need to resume, as the HTTPS session ticket keys. Then this one listens at path.
+ * 
+ * When the next process takes them, this one stops accepting and drains as at onion_listen_stop, with
+ * the deadline of onion_set_drain, or waiting for all the connections if there is none; then onion_listen 
+ * returns. The kernel keeps the sockets open all along, so no connection is refused during the restart:
+ * 
+ * @code
+ *   onion_set_hot_restart(o, "/run/myserver.sock");
+ *   onion_set_drain(o, 30000, NULL, NULL);
+ *   onion_listen(o); // Returns when a new ./myserver takes over
+ *   onion_free(o);
+ * @endcode
+ * 
+ * It does not hand the sockets with prefork processes nor O_REUSEPORT, though it can take them.
+ * 
+ * Can only be tweaked before listen.
+ * 
+ * @param server The onion server
+ * @param path Path of the unix socket, or NULL to disable it.
+ */
+void onion_set_hot_restart(onion *server, const char *path){
+	if (server->hot_restart_path)
+		free(server->hot_restart_path);
+	server->hot_restart_path=path ? strdup(path) : NULL;
+}
+
+/**
+ * @short Makes onion_listen_stop graceful: it drains the open connections, up to a deadline
+ * @memberof onion_t
+ * 
+ * At onion_listen_stop the listen sockets are closed at once, but the connections are not: their 
+ * requests in progress finish, and answer with Connection: close, so the clients, or the load balancer,
+ * go elsewhere for the next one. When there are no connections left, or at the deadline, the callback 
+ * is called with the counts, at a poller thread, and onion_listen returns, closing the connections left.
+ * 
+ * Idle keep alive connections are only closed by their client, their timeout, or the deadline.
+ * 
+ * @param server The onion server
+ * @param deadline_ms Max ms to wait for the connections, <0 to wait for all, or 0 (default) to stop at once.
+ * @param callback Called when drained, or NULL.
+ * @param data For the callback
+ */
+void onion_set_drain(onion *server, int deadline_ms, onion_drain_callback callback, void *data){
+	server->drain_ms=deadline_ms;
+	server->drain_callback=callback;
+	server->drain_data=data;
+}
+
 /**
  * @short Returns the current flags. @see onion_mode_e
  * @memberof onion_t
@@ -518,7 +2460,7 @@ void onion_set_user(onion *server, const char *username){
 	server->username=strdup(username);
 }
 
-void onion_url_free_data(onion_url_data **d);
+void onion_url_free_data(void *router);
 
 /**
  * @short If no root handler is set, creates an url handler and returns it.
@@ -539,6 +2481,27 @@ onion_url *onion_root_url(onion *server){
 	return url;
 }
 
+/**
+ * @short Returns the url handler of that host, creating it if needed.
+ * @memberof onion_t
+ * 
+ * As onion_root_url, but for the requests to that host. @see onion_set_vhost_handler
+ * 
+ * @returns The url handler, or NULL if that host has another kind of handler.
+ */
+onion_url *onion_vhost_url(onion *server, const char *host){
+	onion_handler *handler=server->vhosts ? (onion_handler*)onion_dict_get(server->vhosts, host) : NULL;
+	if (handler){
+		if (handler->priv_data_free==(void*)onion_url_free_data)
+			return (onion_url*)handler;
+		ONION_WARNING("Could not get url handler for %s, as there is another non url handler for it.", host);
+		return NULL;
+	}
+	onion_url *url=onion_url_new();
+	onion_set_vhost_handler(server, host, (onion_handler*)url);
+	return url;
+}
+
 /**
  * @short Returns the poller, if any
  */
@@ -546,6 +2509,53 @@ onion_poller *onion_get_poller(onion *server){
 	return server->poller;
 }
 
+/**
+ * @short Returns the sessions of the server, creating them at the first use.
+ * @memberof onion_t
+ *
+ * Servers that never use a session do not create their shards, nor prepare the random generator,
+ * so they start faster. It is safe to call from several threads at once.
+ */
+onion_sessions *onion_get_sessions(onion *server){
+	onion_sessions *sessions=__atomic_load_n(&server->sessions, __ATOMIC_ACQUIRE);
+	if (sessions)
+		return sessions;
+	sessions=onion_sessions_new();
+	onion_sessions *expected=NULL;
+	if (!__atomic_compare_exchange_n(&server->sessions, &expected, sessions, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+		onion_sessions_free(sessions); // Another thread was first
+		return expected;
+	}
+	return sessions;
+}
+
+/**
+ * @short Lists the connections at the pollers, with what they do now.
+ * @memberof onion_t
+ * 
+ * For each one, its client, listen point, state, age, time at the state, bytes in and out, and the current
+ * path. They are kept at each connection as plain stores at each phase, so it costs nothing until listed,
+ * and are read as they are while they go on at other threads, so the list is a close picture, not exact.
+ * 
+ * Only the connections at the pollers: not on O_ONE nor O_THREADED, nor the HTTP/2 streams one by one.
+ * 
+ * @param count Set to the number of connections
+ * @returns The list, to free with free, or NULL if none.
+ */
+onion_connection_info *onion_get_connections(onion *server, int *count){
+	onion_connection_info *infos=NULL;
+	int size=0;
+	*count=0;
+	if (server->poller)
+		onion_listen_point_get_connections(server->poller, &infos, count, &size);
+#ifdef HAVE_PTHREADS
+	onion_poller **poller;
+	for (poller=server->thread_pollers;poller && *poller;poller++)
+		onion_listen_point_get_connections(*poller, &infos, count, &size);
+#endif
+	return infos;
+}
+
 #define ERROR_500 "<h1>500 - Internal error</h1> Check server logs or contact administrator."
 #define ERROR_403 "<h1>403 - Forbidden</h1>"
 #define ERROR_404 "<h1>404 - Not found</h1>"
@@ -668,3 +2678,26 @@ int onion_set_certificate(onion *onion, onion_ssl_certificate_type type, const c
 void onion_set_max_post_size(onion *server, size_t max_size){
 	server->max_post_size=max_size;
 }
+
+/**
+ * @short Decodes the request bodies sent with Content-Encoding gzip or deflate as they are read.
+ * @memberof onion_t
+ * 
+ * The decoded body goes where a body of unknown length would: to the body callback, to the PUT file, to 
+ * the POST dicts, or to onion_request_get_data; the encoded one is never kept whole. The Content-Encoding 
+ * header is kept, and the request has the OR_INFLATED flag.
+ * 
+ * Only max_size bytes are decoded, so a small body can not expand into gigabytes; bigger ones are answered 
+ * with 413 Payload Too Large. The limits of the POST and PUT data apply too.
+ * 
+ * @param server The server
+ * @param max_size Max decoded size of each body, or 0 to keep the bodies as sent, the default.
+ */
+void onion_set_request_inflate(onion *server, size_t max_size){
+#ifdef HAVE_ZLIB
+	server->max_inflate_size=max_size;
+#else
+	if (max_size)
+		ONION_ERROR("Request inflate needs zlib, and onion was compiled without it");
+#endif
+}
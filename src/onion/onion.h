@@ -49,15 +49,27 @@ void onion_listen_stop(onion *server);
 /// Removes the allocated data
 void onion_free(onion *onion);
 
+/// Sets the allocator of the small library objects, for all servers. Before creating any.
+void onion_set_allocator(void *(*malloc_f)(size_t), void (*free_f)(void *));
+
 /// Sets the root handler
 void onion_set_root_handler(onion *server, onion_handler *handler);
 
 /// Sets the root handler
 onion_handler *onion_get_root_handler(onion *server);
 
+/// Sets the handler for the requests to that Host, as www.example.com, or *.example.com for its subdomains.
+void onion_set_vhost_handler(onion *server, const char *host, onion_handler *handler);
+
+/// Returns the handler for the requests to that Host, or the root handler if none.
+onion_handler *onion_get_vhost_handler(onion *server, const char *host);
+
 /// Sets the root handler
 void onion_set_internal_error_handler(onion *server, onion_handler *handler);
 
+/// Returns the handlers frozen at onion_listen, to inspect them.
+const onion_handler_table *onion_get_handler_table(onion *server);
+
 /// Sets the port to listen
 void onion_set_port(onion *server, const char *port);
 
@@ -79,20 +91,137 @@ int onion_flags(onion *onion);
 /// Sets the timeout, in milliseconds, 0 dont wait for incomming data (too strict maybe), -1 forever, clients closes connection
 void onion_set_timeout(onion *onion, int timeout);
 
+/// Sets the timeouts of each phase of the connections: headers, body, handler, write and keep alive.
+void onion_set_timeouts(onion *server, const onion_timeouts *timeouts);
+
+/// Sets the maximum connections accepted at each listen point per poller wakeup. Default 1.
+void onion_set_accept_budget(onion *server, int budget);
+
+/// Sets the maximum open connections, of all the clients and of each one. Over them they get a 503.
+void onion_set_connection_limits(onion *server, int max_connections, int max_per_client);
+/// Sets the maximum requests in flight. Over it they get a 503 with Retry-After, before parsing them.
+void onion_set_max_inflight(onion *server, int max_requests, int retry_after);
+/// Sheds the requests with a 503 while they wait over target_ms for their handler for a whole interval.
+void onion_set_load_shedding(onion *server, int target_ms, int interval_ms);
+/// Sets the most memory the library may use. Over it sessions and caches are evicted, and new connections get a 503.
+void onion_set_memory_budget(onion *server, size_t bytes);
+
+/// Sets the default socket tuning options (backlog, TCP_DEFER_ACCEPT...) for the listen points.
+void onion_set_socket_options(onion *server, const onion_socket_options *opts);
+
+/// Sets the events read per wakeup at all the server pollers. Grows up to max_events_limit when batches are full.
+void onion_set_poller_max_events(onion *server, int max_events, int max_events_limit);
+
+/// Measures the wait and callback times of all the pollers, and logs the callbacks over stall_ms. <0 to stop.
+void onion_set_poller_profiling(onion *server, int stall_ms);
+
+/// Watches the connections edge triggered, with no rearm syscall per event. Only with O_NONBLOCKING and one thread per poller.
+void onion_set_edge_triggered(onion *server, int edge_triggered);
+
+/// Keeps the request headers as slices of a per connection buffer; the header dict is built only if asked for.
+void onion_set_header_slices(onion *server, int enable);
+
+/// Keep alive connections idle for idle_ms free their request buffers until the next request. <0 never.
+void onion_set_idle_compact(onion *server, int idle_ms);
+
+/// Keeps the time of each phase of the requests. @see onion_request_get_timings
+void onion_set_request_timings(onion *server, int enable);
+
+/// Negotiates permessage-deflate on the websockets, with up to window_bits and max_memory per connection.
+void onion_set_websocket_deflate(onion *server, int window_bits, int context_takeover, size_t max_memory);
+
+/// Pings the websockets idle for ping_interval_ms, and closes them if they do not answer in pong_timeout_ms.
+void onion_set_websocket_keepalive(onion *server, int ping_interval_ms, int pong_timeout_ms);
+
+/// Sets the default response buffer size. Responses up to it are written at once, with Content-Length.
+void onion_set_response_buffer_size(onion *server, size_t size);
+
+/// Sets the function called when the headers of a request with body are read, that may set a body callback.
+void onion_set_request_body_hook(onion *server, onion_request_body_hook hook, void *data);
+
+/// Sets the directory where PUT bodies are kept until the handler moves them, by default /tmp.
+void onion_set_spool_dir(onion *server, const char *dir);
+
+/// Keeps up to max_entries static files open, with their metadata, for ttl_ms. 0 entries disables it.
+void onion_set_file_cache(onion *server, int max_entries, int ttl_ms);
+
+/// Sessions expire when not used for idle_ttl ms, or absolute_ttl ms after creation. 0 is never.
+void onion_set_session_ttl(onion *server, int idle_ttl, int absolute_ttl);
+
+/// Keeps at most max_sessions sessions, evicting the least recently used. 0 is no limit.
+void onion_set_max_sessions(onion *server, int max_sessions);
+
+/// Stores the sessions at that backend, as onion_sessions_backend_shm, instead of in memory.
+void onion_set_session_backend(onion *server, onion_sessions_backend *backend);
+
+/// Keeps the sessions at signed, and encrypted if so asked, cookies at the clients, instead of at the server.
+int onion_set_session_cookie_key(onion *server, const char *key, int length, int encrypt);
+
+/// Logs the requests to that file, or syslog if NULL, with that format, instead of as INFO. -1 on error.
+int onion_set_access_log(onion *server, const char *path, const char *format);
+
+/// Returns the access log, or NULL if none.
+onion_access_log *onion_get_access_log(onion *server);
+
+/// Records the requests read, with their timing, to that file, to replay them. NULL stops it. -1 on error.
+int onion_set_traffic_record(onion *server, const char *path);
+
+/// Returns the file cache, or NULL if none.
+onion_file_cache *onion_get_file_cache(onion *server);
+
 /// Sets the maximum number of threads to use for requests. default 16.
 void onion_set_max_threads(onion *onion, int max_threads);
 
+/// Sets the number of threads that run the handlers, apart from the poller threads, and their queue size.
+void onion_set_workers(onion *server, int nworkers, int max_queue);
+/// Starts min_workers, and more up to nworkers when all are busy; the ones over it retire after idle_ms without requests.
+void onion_set_workers_autoscale(onion *server, int min_workers, int idle_ms);
+/// Sets how many requests of a priority class (onion_url_set_priority) may run at the workers at a time.
+void onion_set_priority_class(onion *server, onion_priority_class priority, int max_running);
+
+/// Balances the handlers among the poller threads of O_REUSEPORT mode, as idle threads steal the requests queued at busy ones.
+void onion_set_work_stealing(onion *server, int max_queue);
+
+/// Sets the CPUs where the worker threads run.
+void onion_set_workers_affinity(onion *server, const int *cpus, int ncpus);
+
+/// Pins each poller thread to a CPU, and on O_REUSEPORT mode may steer the connections to the thread of the CPU that got them.
+void onion_set_threads_affinity(onion *server, const int *cpus, int ncpus, int steer);
+
+/// Sets the number of processes forked at onion_listen, and the CPUs where they run.
+void onion_set_processes(onion *server, int nprocesses, const int *cpus, int ncpus);
+
+/// Index of this prefork process, or -1 at the supervisor or without prefork.
+int onion_get_process_index(onion *server);
+
+/// Takes the listen sockets from the previous process at path, and hands them to the next one, draining.
+void onion_set_hot_restart(onion *server, const char *path);
+
+/// Makes onion_listen_stop wait for the open connections, up to deadline_ms, and then calls the callback.
+void onion_set_drain(onion *server, int deadline_ms, onion_drain_callback callback, void *data);
+
 /// Sets this user as soon as listen starts.
 void onion_set_user(onion *server, const char *username);
 
 /// If no root handler is set, creates an url handler and returns it.
 onion_url *onion_root_url(onion *server);
 
+/// Returns the url handler for the requests to that host, creating it if needed.
+onion_url *onion_vhost_url(onion *server, const char *host);
+
 /// If on poller mode, returns the poller, if not, returns NULL
 onion_poller *onion_get_poller(onion *server);
 
+/// Returns the sessions of the server, creating them at the first use.
+onion_sessions *onion_get_sessions(onion *server);
+
+/// Lists the connections at the pollers, with what they do now. The list is freed with free.
+onion_connection_info *onion_get_connections(onion *server, int *count);
+
 /// Set the maximum post size
 void onion_set_max_post_size(onion *server, size_t max_size);
+/// Decodes the gzip and deflate request bodies as read, up to max_size decoded bytes. 0, the default, keeps them as sent.
+void onion_set_request_inflate(onion *server, size_t max_size);
 
 #ifdef __cplusplus
 }
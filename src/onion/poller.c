@@ -29,6 +29,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <limits.h>
+#include <stdint.h>
 #include <time.h>
 #include <unistd.h>
 #ifdef __DEBUG__
@@ -39,8 +40,12 @@
 #include <assert.h>
 
 #include "log.h"
+#include "trace.h"
 #include "types.h"
 #include "poller.h"
+#include "pool.h"
+#include "memory.h"
+#include "request.h"
 #include <sys/socket.h>
 #include <sys/eventfd.h>
 #include <fcntl.h>
@@ -61,6 +66,13 @@
 #endif
 
 
+/// A call queued with onion_poller_call
+typedef struct onion_poller_deferred_t{
+	void (*f)(void *);
+	void *data;
+	struct onion_poller_deferred_t *next;
+}onion_poller_deferred;
+
 struct onion_poller_t{
 	int fd;
 	int eventfd; ///< fd to signal internal changes on poller.
@@ -71,7 +83,24 @@ struct onion_poller_t{
 	int npollers;
 #endif
 
-	onion_poller_slot *head;
+	onion_poller_slot *head;     ///< Doubly linked list of all slots. First is always the eventfd.
+	onion_poller_deferred *calls;      ///< Calls queued by onion_poller_call, to run at a poller thread. FIFO.
+	onion_poller_deferred *calls_last; ///< Last of calls, to append.
+	void (*batch)(void *);       ///< Called after each batch of events. @see onion_poller_set_batch_callback
+	void *batch_data;
+	onion_poller_slot **slots;   ///< Slots indexed by fd, for fast lookup at onion_poller_remove.
+	int slots_size;              ///< Allocated size of slots
+
+	onion_poller_slot **timeouts; ///< Binary min-heap of armed slots, ordered by timeout_limit.
+	int ntimeouts;               ///< Slots currently at the heap
+	int timeouts_size;           ///< Allocated size of the heap
+
+	int max_events;              ///< Events per epoll_wait. @see onion_poller_set_max_events
+	int max_events_limit;        ///< When batches come back full, max_events grows up to this.
+	unsigned long wakeups;       ///< epoll_wait that returned events. Atomic.
+	unsigned long events;        ///< Events returned by all those epoll_wait. Atomic.
+	int stall_ms;                ///< Callbacks longer than this are logged; 0 only measures, <0 is off. @see onion_poller_set_profiling
+	onion_poller_profile profile; ///< Atomic.
 };
 
 /// Each element of the poll
@@ -85,12 +114,38 @@ struct onion_poller_slot_t{
 	void (*shutdown)(void*);
 	void *shutdown_data;
 
-	time_t timeout;
-	time_t timeout_limit; ///< Limit in seconds for use with time function.
+	int timeout;             ///< Timeout in ms, <0 if none.
+	int64_t timeout_limit;   ///< Monotonic ms at which this slot times out, if armed.
+	int timeout_pos;         ///< Position at the poller timeouts heap, or -1 if not armed.
+	int idle_ms;             ///< Before the timeout, idle is called once after this long without events. @see onion_poller_slot_set_idle
+	void (*idle)(void*);
+	void *idle_data;
+	char idled;              ///< idle was already called since the last event.
+	char edge;               ///< Edge triggered, not rearmed after each event. @see onion_poller_slot_set_edge_triggered
+	char drained;            ///< The callback read until EAGAIN at this event. @see onion_poller_slot_set_drained
+	char busy;               ///< Edge triggered, and its callback runs or it yielded. Atomic.
+	char timer;              ///< An onion_poller_add_timer timer: only at the timeouts heap, no fd.
+	int armed;               ///< Events at the epoll now, to know if a type change needs a rearm.
+	onion_poller *poller;    ///< Poller this slot was added to, if any.
 	
 	onion_poller_slot *next;
+	onion_poller_slot *prev;
 };
 
+static void onion_poller_timeout_arm(onion_poller *p, onion_poller_slot *el);
+static void onion_poller_timeout_disarm(onion_poller *p, onion_poller_slot *el);
+static void onion_poller_timer_free(onion_poller_slot *el);
+static int64_t onion_poller_now_us();
+static int64_t onion_poller_callback_start(onion_poller *p);
+static void onion_poller_callback_end(onion_poller *p, onion_poller_slot *el, int64_t start);
+
+/// What the callback running at this thread does, for the stall log. Only noted while profiling.
+static __thread struct{
+	char profiling;
+	void *handler;
+	char path[128];
+}onion_poller_current;
+
 /**
  * @short Creates a new slot for the poller, for input data to be ready.
  * @memberof onion_poller_slot_t
@@ -106,12 +161,13 @@ onion_poller_slot *onion_poller_slot_new(int fd, int (*f)(void*), void *data){
 		ONION_ERROR("Trying to add an invalid file descriptor to the poller. Please check.");
 		return NULL;
 	}
-	onion_poller_slot *el=(onion_poller_slot*)calloc(1, sizeof(onion_poller_slot));
+	onion_poller_slot *el=onion_slab_calloc(sizeof(onion_poller_slot));
+	onion_memory_count(ONION_MEMORY_POLLER, sizeof(onion_poller_slot));
 	el->fd=fd;
 	el->f=f;
 	el->data=data;
 	el->timeout=-1;
-	el->timeout_limit=INT_MAX;
+	el->timeout_pos=-1;
 	el->type=EPOLLIN | EPOLLHUP | EPOLLONESHOT;
 	
 	return el;
@@ -124,7 +180,8 @@ onion_poller_slot *onion_poller_slot_new(int fd, int (*f)(void*), void *data){
 void onion_poller_slot_free(onion_poller_slot *el){
 	if (el->shutdown)
 		el->shutdown(el->shutdown_data);
-	free(el);
+	onion_memory_count(ONION_MEMORY_POLLER, -(long)sizeof(onion_poller_slot));
+	onion_slab_free(el, sizeof(onion_poller_slot));
 }
 
 /**
@@ -143,21 +200,60 @@ void onion_poller_slot_set_shutdown(onion_poller_slot *el, void (*sd)(void*), vo
 /**
  * @short Sets the timeout for the slot
  * 
- * The timeout is passed in ms, but due to current implementation it is rounded to seconds. The interface stays, and hopefully
- * in the future the behaviour will change.
+ * The timeout is in milliseconds, and counts from now. Each time the slot callback is called
+ * it is rearmed with the same value. A negative timeout means no timeout at all.
+ * 
+ * It can be called both before adding the slot to the poller, or from the slot callback itself.
  * @memberof onion_poller_slot_t
  * 
  * @param el Slot to modify
  * @param timeout Time in milliseconds that this file can be waiting.
  */
 void onion_poller_slot_set_timeout(onion_poller_slot *el, int timeout){
-	el->timeout=timeout/1000; // I dont have that resolution.
-	el->timeout_limit=time(NULL)+el->timeout;
-	ONION_DEBUG0("Set timeout to %d, %d s", el->timeout_limit, el->timeout);
+	el->timeout=timeout;
+	if (el->poller){
+		pthread_mutex_lock(&el->poller->mutex);
+		if (timeout>=0)
+			onion_poller_timeout_arm(el->poller, el);
+		else
+			onion_poller_timeout_disarm(el->poller, el);
+		pthread_mutex_unlock(&el->poller->mutex);
+	}
+	ONION_DEBUG0("Set timeout to %d ms", el->timeout);
+}
+
+/**
+ * @short Sets a function to call when the slot is idle for idle_ms, before its timeout.
+ * @memberof onion_poller_slot_t
+ * 
+ * It is called once each time the slot waits that long without events, from the poller thread that sees it,
+ * with the poller lock, and so while no callback of the slot runs. The slot stays, and times out as usual
+ * at its timeout. Only for slots with a timeout longer than idle_ms. It must be set before adding the slot.
+ * 
+ * @param el Slot to modify
+ * @param idle_ms Time without events, in milliseconds
+ * @param idle Function to call, or NULL to not call any
+ * @param data Parameter for the function
+ */
+void onion_poller_slot_set_idle(onion_poller_slot *el, int idle_ms, void (*idle)(void*), void *data){
+	el->idle_ms=idle_ms;
+	el->idle=idle;
+	el->idle_data=data;
 }
 
 void onion_poller_slot_set_type(onion_poller_slot *el, int type){
-	el->type=EPOLLONESHOT;
+#ifdef EPOLLEXCLUSIVE
+	if (type&O_POLL_EXCLUSIVE){ // Can not be EPOLLONESHOT nor modified later, so it is always watched.
+		el->type=EPOLLEXCLUSIVE;
+		if (type&O_POLL_READ)
+			el->type|=EPOLLIN;
+		if (type&O_POLL_WRITE)
+			el->type|=EPOLLOUT;
+		ONION_DEBUG0("Setting exclusive type to %d, %d", el->fd, el->type);
+		return;
+	}
+#endif
+	el->type=el->edge ? EPOLLET : EPOLLONESHOT;
 	if (type&O_POLL_READ)
 		el->type|=EPOLLIN;
 	if (type&O_POLL_WRITE)
@@ -167,8 +263,143 @@ void onion_poller_slot_set_type(onion_poller_slot *el, int type){
 	ONION_DEBUG0("Setting type to %d, %d", el->fd, el->type);
 }
 
-static int onion_poller_stop_helper(void *p){
-	onion_poller_stop(p);
+/**
+ * @short Makes the slot edge triggered: it is not rearmed after each event, but only when its type changes.
+ * @memberof onion_poller_slot_t
+ * 
+ * With EPOLLONESHOT each event costs an epoll_ctl to watch the fd again. Edge triggered slots stay watched,
+ * so that syscall is saved, but only a new edge wakes the poller: the callback must read until EAGAIN and tell
+ * so with onion_poller_slot_set_drained, else the slot is rearmed as before, so a non drained fd is not
+ * forgotten.
+ * 
+ * Events can come while the callback runs, so only for pollers that a single thread polls. The slot is not
+ * watched while its callback yielded (OCS_YIELD) until onion_poller_slot_resume. It must be set before adding
+ * the slot, on a non blocking fd.
+ * 
+ * @returns 0, as it is supported by this poller.
+ */
+int onion_poller_slot_set_edge_triggered(onion_poller_slot *el){
+	el->edge=1;
+	el->type=(el->type&~EPOLLONESHOT)|EPOLLET;
+	return 0;
+}
+
+/**
+ * @short From the callback of an edge triggered slot, tells that it read until EAGAIN.
+ * @memberof onion_poller_slot_t
+ * 
+ * So if its type did not change, it is not rearmed. A read shorter than asked from a stream socket is 
+ * also until EAGAIN.
+ */
+void onion_poller_slot_set_drained(onion_poller_slot *el){
+	el->drained=1;
+}
+
+/// Accepts at the poller. Not supported, the slot callback accepts as always.
+int onion_poller_slot_set_accept(onion_poller_slot *el, int (*accepted)(void *data, int fd)){
+	return -1;
+}
+
+/// Reads at the poller. Not supported, the slot callback reads as always.
+int onion_poller_slot_set_recv(onion_poller_slot *el, int (*received)(void *data, const char *buffer, size_t len)){
+	return -1;
+}
+
+/**
+ * @short Current monotonic time, in milliseconds.
+ * 
+ * Timeouts are not affected by wall clock changes.
+ */
+static int64_t onion_poller_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+/// Places el at pos in the timeouts heap, and updates the back reference.
+static inline void onion_poller_timeout_place(onion_poller *p, onion_poller_slot *el, int pos){
+	p->timeouts[pos]=el;
+	el->timeout_pos=pos;
+}
+
+/// Moves the element at pos up or down the heap until the heap property holds again.
+static void onion_poller_timeout_fix(onion_poller *p, int pos){
+	onion_poller_slot *el=p->timeouts[pos];
+	while (pos>0){ // Up
+		int parent=(pos-1)/2;
+		if (p->timeouts[parent]->timeout_limit <= el->timeout_limit)
+			break;
+		onion_poller_timeout_place(p, p->timeouts[parent], pos);
+		pos=parent;
+	}
+	for(;;){ // Down
+		int child=pos*2+1;
+		if (child>=p->ntimeouts)
+			break;
+		if (child+1<p->ntimeouts && p->timeouts[child+1]->timeout_limit < p->timeouts[child]->timeout_limit)
+			child++;
+		if (el->timeout_limit <= p->timeouts[child]->timeout_limit)
+			break;
+		onion_poller_timeout_place(p, p->timeouts[child], pos);
+		pos=child;
+	}
+	onion_poller_timeout_place(p, el, pos);
+}
+
+/**
+ * @short Arms (or rearms) the timeout of the slot to now+el->timeout.
+ * 
+ * Poller must be locked by caller.
+ */
+static void onion_poller_timeout_arm(onion_poller *p, onion_poller_slot *el){
+	el->idled=0;
+	el->timeout_limit=onion_poller_now()+((el->idle && el->idle_ms<el->timeout) ? el->idle_ms : el->timeout);
+	if (el->timeout_pos<0){
+		if (p->ntimeouts==p->timeouts_size){
+			p->timeouts_size=p->timeouts_size ? p->timeouts_size*2 : 16;
+			p->timeouts=realloc(p->timeouts, sizeof(onion_poller_slot*)*p->timeouts_size);
+		}
+		onion_poller_timeout_place(p, el, p->ntimeouts++);
+	}
+	onion_poller_timeout_fix(p, el->timeout_pos);
+}
+
+/**
+ * @short Removes the slot from the timeouts heap, if there.
+ * 
+ * Poller must be locked by caller.
+ */
+static void onion_poller_timeout_disarm(onion_poller *p, onion_poller_slot *el){
+	int pos=el->timeout_pos;
+	if (pos<0)
+		return;
+	el->timeout_pos=-1;
+	p->ntimeouts--;
+	if (pos==p->ntimeouts)
+		return;
+	onion_poller_timeout_place(p, p->timeouts[p->ntimeouts], pos);
+	onion_poller_timeout_fix(p, pos);
+}
+
+/// The eventfd was signaled: runs the onion_poller_call queued calls, and stops if asked to.
+static int onion_poller_eventfd_helper(void *_p){
+	onion_poller *p=_p;
+	uint64_t v;
+	int __attribute__((unused)) r=read(p->eventfd, &v, sizeof(v));
+	
+	pthread_mutex_lock(&p->mutex);
+	onion_poller_deferred *call=p->calls;
+	p->calls=p->calls_last=NULL;
+	pthread_mutex_unlock(&p->mutex);
+	while (call){
+		onion_poller_deferred *next=call->next;
+		call->f(call->data);
+		free(call);
+		call=next;
+	}
+	
+	if (p->stop)
+		onion_poller_stop(p);
   return 1;
 }
 
@@ -196,8 +427,20 @@ onion_poller *onion_poller_new(int n){
   fcntl(p->eventfd,F_SETFD,FD_CLOEXEC);
 #endif
 	p->head=NULL;
+	p->slots=NULL;
+	p->slots_size=0;
 	p->n=0;
   p->stop=0;
+	p->timeouts=NULL;
+	p->ntimeouts=0;
+	p->timeouts_size=0;
+	p->calls=p->calls_last=NULL;
+	p->batch=NULL;
+	p->batch_data=NULL;
+	p->max_events=p->max_events_limit=ONION_POLLER_MAX_EVENTS;
+	p->wakeups=p->events=0;
+	p->stall_ms=-1;
+	memset(&p->profile, 0, sizeof(p->profile));
 
 #ifdef HAVE_PTHREADS
   ONION_DEBUG("Init thread stuff for poll. Eventfd at %d", p->eventfd);
@@ -209,7 +452,7 @@ onion_poller *onion_poller_new(int n){
   pthread_mutexattr_destroy(&attr);
 #endif
 
-  onion_poller_slot *ev=onion_poller_slot_new(p->eventfd,onion_poller_stop_helper,p);
+  onion_poller_slot *ev=onion_poller_slot_new(p->eventfd,onion_poller_eventfd_helper,p);
   onion_poller_add(p,ev);
   
 	return p;
@@ -229,12 +472,21 @@ void onion_poller_free(onion_poller *p){
 		onion_poller_slot *next=p->head;
 		while (next){
 			onion_poller_slot *tnext=next->next;
-			if (next->shutdown)
-				next->shutdown(next->shutdown_data);
-			free(next);
+			onion_poller_slot_free(next);
 			next=tnext;
 		}
 		pthread_mutex_unlock(&p->mutex);
+		while (p->calls){ // Not run, as the poller is gone.
+			onion_poller_deferred *next=p->calls->next;
+			free(p->calls);
+			p->calls=next;
+		}
+		int i;
+		for (i=0;i<p->ntimeouts;i++) // Timers are only here
+			if (p->timeouts[i]->timer)
+				onion_poller_timer_free(p->timeouts[i]);
+		free(p->slots);
+		free(p->timeouts);
 		free(p);
 	}
 	ONION_DEBUG0("Done");
@@ -253,11 +505,26 @@ int onion_poller_add(onion_poller *poller, onion_poller_slot *el){
 	ONION_DEBUG0("Adding fd %d for polling (%d)", el->fd, poller->n);
 
 	pthread_mutex_lock(&poller->mutex);
-	// I like head to be always the same, so I do some tricks to keep it. This is beacuse at head normally I have the listen fd, which is very accessed
+	el->poller=poller;
+	if (el->timeout>=0)
+		onion_poller_timeout_arm(poller, el);
+	if (el->fd>=poller->slots_size){
+		int nsize=poller->slots_size ? poller->slots_size : 64;
+		while (nsize<=el->fd)
+			nsize*=2;
+		poller->slots=realloc(poller->slots, sizeof(onion_poller_slot*)*nsize);
+		memset(&poller->slots[poller->slots_size], 0, sizeof(onion_poller_slot*)*(nsize-poller->slots_size));
+		poller->slots_size=nsize;
+	}
+	poller->slots[el->fd]=el;
+	// I like head to be always the same, so I do some tricks to keep it. This is beacuse at head normally I have the eventfd.
 	if (!poller->head)
 		poller->head=el;
 	else{
+		el->prev=poller->head;
 		el->next=poller->head->next;
+		if (el->next)
+			el->next->prev=el;
 		poller->head->next=el;
 		poller->n++;
 	}
@@ -265,7 +532,7 @@ int onion_poller_add(onion_poller *poller, onion_poller_slot *el){
 	
 	struct epoll_event ev;
 	memset(&ev, 0, sizeof(ev));
-	ev.events=el->type;
+	ev.events=el->armed=el->type;
 	ev.data.ptr=el;
 	if (epoll_ctl(poller->fd, EPOLL_CTL_ADD, el->fd, &ev) < 0){
 		ONION_ERROR("Error add descriptor to listen to. %s", strerror(errno));
@@ -275,74 +542,237 @@ int onion_poller_add(onion_poller *poller, onion_poller_slot *el){
 }
 
 /**
- * @short Removes a file descriptor, and all related callbacks from the listening queue
- * @memberof onion_poller_t
+ * @short Unlinks the slot from the poller structures.
+ * 
+ * It does not depend on the number of slots at the poller, as the list is doubly linked.
+ * 
+ * Poller must be locked by caller.
  */
-int onion_poller_remove(onion_poller *poller, int fd){
-	if (epoll_ctl(poller->fd, EPOLL_CTL_DEL, fd, NULL) < 0){
+static void onion_poller_unlink_slot(onion_poller *poller, onion_poller_slot *el){
+	ONION_DEBUG0("Removing fd %d (%d)", el->fd, poller->n);
+	if (el->prev){
+		el->prev->next=el->next;
+		poller->n--;
+	}
+	else
+		poller->head=el->next;
+	if (el->next)
+		el->next->prev=el->prev;
+	if (poller->slots[el->fd]==el)
+		poller->slots[el->fd]=NULL;
+	onion_poller_timeout_disarm(poller, el);
+	
+	if (poller->head && poller->head->next==NULL && !poller->calls && !poller->ntimeouts){ // This means only eventfd is here, and nothing queued nor timers.
+		ONION_DEBUG0("Removed last, stopping poll");
+		onion_poller_stop(poller);
+	}
+}
+
+/**
+ * @short Removes the slot from the poller, and frees it.
+ * 
+ * Used when the slot is already known, as from the epoll event data.
+ */
+static void onion_poller_remove_slot(onion_poller *poller, onion_poller_slot *el){
+	if (epoll_ctl(poller->fd, EPOLL_CTL_DEL, el->fd, NULL) < 0){
 		ONION_ERROR("Error remove descriptor to listen to. %s", strerror(errno));
 	}
+	pthread_mutex_lock(&poller->mutex);
+	onion_poller_unlink_slot(poller, el);
+	pthread_mutex_unlock(&poller->mutex);
 	
+	onion_poller_slot_free(el);
+}
+
+/**
+ * @short Removes a file descriptor, and all related callbacks from the listening queue
+ * @memberof onion_poller_t
+ */
+int onion_poller_remove(onion_poller *poller, int fd){
 	pthread_mutex_lock(&poller->mutex);
-	ONION_DEBUG0("Trying to remove fd %d (%d)", fd, poller->n);
-	onion_poller_slot *el=poller->head;
-	if (el && el->fd==fd){
-		ONION_DEBUG0("Removed from head %p", el);
-		
-		poller->head=el->next;
-		pthread_mutex_unlock(&poller->mutex);
-    
-		onion_poller_slot_free(el);
+	onion_poller_slot *el=NULL;
+	if (fd>=0 && fd<poller->slots_size)
+		el=poller->slots[fd];
+	if (el)
+		onion_poller_unlink_slot(poller, el);
+	pthread_mutex_unlock(&poller->mutex);
+	
+	if (!el){
+		ONION_WARNING("Trying to remove unknown fd from poller %d", fd);
 		return 0;
 	}
-	while (el->next){
-		if (el->next->fd==fd){
-			ONION_DEBUG0("Removed from tail %p",el);
-			onion_poller_slot *t=el->next;
-			el->next=t->next;
-      
-      if (poller->head->next==NULL){ // This means only eventfd is here.
-        ONION_DEBUG0("Removed last, stopping poll");
-        onion_poller_stop(poller);
-      }
-      
-			pthread_mutex_unlock(&poller->mutex);
-			
-			onion_poller_slot_free(t);
-			return 0;
-		}
-		el=el->next;
+	if (epoll_ctl(poller->fd, EPOLL_CTL_DEL, fd, NULL) < 0){
+		ONION_ERROR("Error remove descriptor to listen to. %s", strerror(errno));
 	}
-	pthread_mutex_unlock(&poller->mutex);
-	ONION_WARNING("Trying to remove unknown fd from poller %d", fd);
+	onion_poller_slot_free(el);
 	return 0;
 }
 
 /**
- * @short Gets the next timeout
+ * @short Calls f for each slot at the poller, with its callback and data.
+ * @memberof onion_poller_t
+ * 
+ * The poller is locked meanwhile, so the slots are not freed under f, but f must be quick and must not use 
+ * the poller. Their data may be in use at other threads.
+ */
+void onion_poller_foreach(onion_poller *poller, void (*f)(void *data, int (*callback)(void*), void *slot_data), void *data){
+	pthread_mutex_lock(&poller->mutex);
+	onion_poller_slot *el;
+	for (el=poller->head;el;el=el->next)
+		f(data, el->f, el->data);
+	pthread_mutex_unlock(&poller->mutex);
+}
+
+/**
+ * @short Gets the time to wait until next timeout, in ms.
  * 
- * On edge cases could get a wrong timeout, but always old or new, so its ok.
+ * It is just a peek at the top of the heap. If nothing is armed, waits at most an hour.
  * 
  * List must be locked by caller.
  */
-static int onion_poller_get_next_timeout(onion_poller *p){
-	onion_poller_slot *next;
-	int timeout=INT_MAX; // Ok, minimum wakeup , once per hour.
-	next=p->head;
-	while(next){
-		//ONION_DEBUG("Check %d %d %d", timeout, next->timeout, next->delta_timeout);
-		if (next->timeout_limit<timeout)
-			timeout=next->timeout_limit;
-		
-		next=next->next;
+static int onion_poller_get_next_timeout(onion_poller *p, int64_t now){
+	if (!p->ntimeouts)
+		return 3600000;
+	int64_t timeout=p->timeouts[0]->timeout_limit - now;
+	if (timeout<0)
+		return 0;
+	if (timeout>3600000)
+		return 3600000;
+	return (int)timeout;
+}
+
+/**
+ * @short Sets how many events are read at each epoll_wait
+ * @memberof onion_poller_t
+ * 
+ * Events not read are returned at the next epoll_wait, so no problem, but each call also checks the 
+ * timeouts and takes the lock, so on busy servers bigger batches mean less overhead. Small batches 
+ * share the events better among the polling threads.
+ * 
+ * If max_events_limit is bigger than max_events, it is adaptive: each thread starts with max_events, and 
+ * doubles it up to max_events_limit when the batches come back full.
+ * 
+ * Default is ONION_POLLER_MAX_EVENTS, not adaptive. It can be changed while polling.
+ * 
+ * @param max_events Events per epoll_wait, at least 1.
+ * @param max_events_limit Limit for the adaptive mode. If smaller than max_events, not adaptive.
+ */
+void onion_poller_set_max_events(onion_poller *p, int max_events, int max_events_limit){
+	if (max_events<1){
+		ONION_ERROR("Poller max events must be at least 1, not %d", max_events);
+		return;
 	}
-	
-	//ONION_DEBUG("Next wakeup in %d ms, at least", timeout);
-	return timeout;
+	if (max_events_limit<max_events)
+		max_events_limit=max_events;
+	p->max_events=max_events;
+	p->max_events_limit=max_events_limit;
 }
 
-// Max of events per loop. If not al consumed for next, so no prob.  right number uses less memory, and makes less calls.
-#define MAX_EVENTS 10
+/**
+ * @short Gets the poller event counters
+ * @memberof onion_poller_t
+ * 
+ * events/wakeups is the mean of events per wakeup. If close to the max events, batches are full and 
+ * may be made bigger.
+ * 
+ * @param wakeups Wakeups that returned some event. May be NULL.
+ * @param events Total events. May be NULL.
+ */
+void onion_poller_get_event_stats(onion_poller *p, unsigned long *wakeups, unsigned long *events){
+	if (wakeups)
+		*wakeups=p->wakeups;
+	if (events)
+		*events=p->events;
+}
+
+/**
+ * @short Measures where the poller threads spend their time
+ * @memberof onion_poller_t
+ * 
+ * The time waiting for events, and running the callbacks, added for all the threads of this poller, 
+ * for onion_poller_get_profile. Each thread of O_REUSEPORT has a poller of its own, so there it is per
+ * thread. The events per wakeup are at onion_poller_get_event_stats.
+ * 
+ * Callbacks that hold the thread more than stall_ms are logged, rate limited, with the fd, the path of 
+ * the request and the address of the last handler called, as addr2line or gdb can resolve: these are the 
+ * handlers that block the event loop, and should be at onion_set_workers or suspend the request.
+ * 
+ * It costs two clock_gettime per event while on. It can be changed while polling.
+ * 
+ * @param stall_ms Stall threshold, in ms, or 0 to only measure, or <0 to stop measuring.
+ */
+void onion_poller_set_profiling(onion_poller *p, int stall_ms){
+	p->stall_ms=stall_ms;
+}
+
+/**
+ * @short Gets the times measured since onion_poller_set_profiling
+ * @memberof onion_poller_t
+ */
+void onion_poller_get_profile(onion_poller *p, onion_poller_profile *profile){
+	profile->wait_us=__atomic_load_n(&p->profile.wait_us, __ATOMIC_RELAXED);
+	profile->callbacks_us=__atomic_load_n(&p->profile.callbacks_us, __ATOMIC_RELAXED);
+	profile->max_callback_us=__atomic_load_n(&p->profile.max_callback_us, __ATOMIC_RELAXED);
+	profile->stalls=__atomic_load_n(&p->profile.stalls, __ATOMIC_RELAXED);
+}
+
+/**
+ * @short Notes the handler that the callback of this thread calls, and the path of its request.
+ * 
+ * Only if the poller of this thread is profiling; else it just returns.
+ */
+void onion_poller_note_handler(void *handler, onion_request *req){
+	if (!onion_poller_current.profiling)
+		return;
+	onion_poller_current.handler=handler;
+	const char *path=req ? onion_request_get_fullpath(req) : NULL;
+	snprintf(onion_poller_current.path, sizeof(onion_poller_current.path), "%s", path ? path : "");
+}
+
+/// Current monotonic time, in microseconds.
+static int64_t onion_poller_now_us(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+/// Starts measuring a callback, if profiling. Returns its start time, or 0.
+static int64_t onion_poller_callback_start(onion_poller *p){
+	if (p->stall_ms<0)
+		return 0;
+	onion_poller_current.profiling=1;
+	onion_poller_current.handler=NULL;
+	onion_poller_current.path[0]='\0';
+	return onion_poller_now_us();
+}
+
+/// Adds the time of the callback, and logs it if it stalled the thread.
+static void onion_poller_callback_end(onion_poller *p, onion_poller_slot *el, int64_t start){
+	if (!start)
+		return;
+	onion_poller_current.profiling=0;
+	unsigned long us=onion_poller_now_us()-start;
+	__atomic_fetch_add(&p->profile.callbacks_us, us, __ATOMIC_RELAXED);
+	unsigned long max=__atomic_load_n(&p->profile.max_callback_us, __ATOMIC_RELAXED);
+	while (us>max && !__atomic_compare_exchange_n(&p->profile.max_callback_us, &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	if (p->stall_ms>0 && us>=p->stall_ms*1000UL){
+		__atomic_fetch_add(&p->profile.stalls, 1, __ATOMIC_RELAXED);
+		ONION_WARNING_RATELIMITED("Poller thread stalled %ld ms at the callback of fd %d, path '%s', handler %p", 
+		                          (long)(us/1000), el->fd, onion_poller_current.path, onion_poller_current.handler);
+	}
+}
+
+/// Size of the event batch for next epoll_wait, given the current one and if it was full
+static int onion_poller_next_batch_size(onion_poller *p, int size, int full){
+	int next=size;
+	if (full)
+		next*=2;
+	if (next<p->max_events)
+		next=p->max_events;
+	if (next>p->max_events_limit)
+		next=p->max_events_limit;
+	return next;
+}
 
 /**
  * @short Do the event polling.
@@ -353,7 +783,9 @@ static int onion_poller_get_next_timeout(onion_poller *p){
  * If no fd to poll, returns.
  */
 void onion_poller_poll(onion_poller *p){
-	struct epoll_event event[MAX_EVENTS];
+	int nevents=p->max_events;
+	struct epoll_event *event=malloc(nevents*sizeof(struct epoll_event));
+	int full=0;
 	ONION_DEBUG("Start polling");
 	p->stop=0;
 #ifdef HAVE_PTHREADS
@@ -362,47 +794,64 @@ void onion_poller_poll(onion_poller *p){
 	ONION_DEBUG0("Npollers %d. %d listenings %p", p->npollers, p->n, p->head);
 	pthread_mutex_unlock(&p->mutex);
 #endif
-	pthread_mutex_lock(&p->mutex);
-	int maxtime;
-	pthread_mutex_unlock(&p->mutex);
-	time_t ctime;
 	int timeout;
 	while (!p->stop && p->head){
-		ctime=time(NULL);
 		pthread_mutex_lock(&p->mutex);
-		maxtime=onion_poller_get_next_timeout(p);
+		timeout=onion_poller_get_next_timeout(p, onion_poller_now());
 		pthread_mutex_unlock(&p->mutex);
 		
-		timeout=maxtime-ctime;
-		if (timeout>3600)
-			timeout=3600000;
-		else
-			timeout*=1000;
+		int next=onion_poller_next_batch_size(p, nevents, full);
+		if (next!=nevents){
+			ONION_DEBUG0("Event batch size now %d", next);
+			nevents=next;
+			event=realloc(event, nevents*sizeof(struct epoll_event));
+		}
+		
 		ONION_DEBUG0("Wait for %d ms", timeout);
-		int nfds = epoll_wait(p->fd, event, MAX_EVENTS, timeout);
-		int ctime_end=time(NULL);
-		ONION_DEBUG0("Current time is %d, limit is %d, timeout is %d. Waited for %d seconds", ctime, maxtime, timeout, ctime_end-ctime);
-    ctime=ctime_end;
+		int64_t wait_start=(p->stall_ms>=0) ? onion_poller_now_us() : 0;
+		int nfds = epoll_wait(p->fd, event, nevents, timeout);
+		if (wait_start)
+			__atomic_fetch_add(&p->profile.wait_us, onion_poller_now_us()-wait_start, __ATOMIC_RELAXED);
+		int64_t now=onion_poller_now();
+		full=(nfds==nevents);
+		ONION_TRACE(poller_wakeup, p->fd, nfds, timeout);
+		if (nfds>0){
+			__sync_fetch_and_add(&p->wakeups, 1);
+			__sync_fetch_and_add(&p->events, nfds);
+		}
 
 		pthread_mutex_lock(&p->mutex);
-		{ // Somebody timedout?
-			onion_poller_slot *next=p->head;
-			while (next){
-				onion_poller_slot *cur=next;
-				next=next->next;
-				if (cur->timeout_limit <= ctime){
-					ONION_DEBUG0("Timeout on %d, was %d (ctime %d)", cur->fd, cur->timeout_limit, ctime);
-          int i;
-          for (i=0;i<nfds;i++){
-            onion_poller_slot *el=(onion_poller_slot*)event[i].data.ptr;
-            if (cur==el){ // If removed just one with event, make it ignore the event later.
-              ONION_DEBUG0("Ignoring event as it timeouted: %d", cur->fd);
-              event[i].data.ptr=NULL;
-            }
-          }
-          onion_poller_remove(p, cur->fd);
+		// Somebody timedout? They are all at the top of the heap.
+		while (p->ntimeouts && p->timeouts[0]->timeout_limit <= now){
+			onion_poller_slot *cur=p->timeouts[0];
+			if (cur->idle && !cur->idled && cur->idle_ms<cur->timeout){ // Idle first, and then the rest of the timeout
+				cur->idled=1;
+				cur->timeout_limit+=cur->timeout-cur->idle_ms;
+				onion_poller_timeout_fix(p, 0);
+				cur->idle(cur->idle_data);
+				continue;
+			}
+			if (cur->timer){ // Out of the lock, as it may take long or add more timers
+				onion_poller_timeout_disarm(p, cur);
+				pthread_mutex_unlock(&p->mutex);
+				((void (*)(void *))cur->f)(cur->data);
+				onion_poller_timer_free(cur);
+				pthread_mutex_lock(&p->mutex);
+				if (p->head && p->head->next==NULL && !p->calls && !p->ntimeouts) // Only this timer kept it running
+					onion_poller_stop(p);
+				continue;
+			}
+			ONION_DEBUG0("Timeout on %d, was %ld (now %ld)", cur->fd, (long)cur->timeout_limit, (long)now);
+			ONION_TRACE(slot_timeout, cur->fd);
+			int i;
+			for (i=0;i<nfds;i++){
+				onion_poller_slot *el=(onion_poller_slot*)event[i].data.ptr;
+				if (cur==el){ // If removed just one with event, make it ignore the event later.
+					ONION_DEBUG0("Ignoring event as it timeouted: %d", cur->fd);
+					event[i].data.ptr=NULL;
 				}
 			}
+			onion_poller_remove_slot(p, cur);
 		}
 		pthread_mutex_unlock(&p->mutex);
 		
@@ -415,6 +864,7 @@ void onion_poller_poll(onion_poller *p){
 				p->npollers--;
 				pthread_mutex_unlock(&p->mutex);
 #endif
+				free(event);
 				return;
 			}
 		}
@@ -423,6 +873,12 @@ void onion_poller_poll(onion_poller *p){
 			onion_poller_slot *el=(onion_poller_slot*)event[i].data.ptr;
       if (!el)
         continue;
+			if (el->edge){
+				if (__atomic_load_n(&el->busy, __ATOMIC_ACQUIRE)) // Yielded; onion_poller_slot_resume rearms it, and so sees this again.
+					continue;
+				el->busy=1;
+				el->drained=0;
+			}
 			// Call the callback
 			//ONION_DEBUG("Calling callback for fd %d (%X %X)", el->fd, event[i].events);
 			int n=-1;
@@ -430,25 +886,38 @@ void onion_poller_poll(onion_poller *p){
 				n=-1;
 			}
 			else{ // I also take care of the timeout, no timeout when on the handler, it should handle it itself.
-				el->timeout_limit=INT_MAX;
+				pthread_mutex_lock(&p->mutex);
+				onion_poller_timeout_disarm(p, el);
+				pthread_mutex_unlock(&p->mutex);
 
 #ifdef __DEBUG0__
         char **bs=backtrace_symbols((void * const *)&el->f, 1);
         ONION_DEBUG0("Calling handler: %s (%d)",bs[0], el->fd);
         free(bs);
 #endif
+				int64_t start=onion_poller_callback_start(p);
 				n=el->f(el->data);
+				onion_poller_callback_end(p, el, start);
+				if (n==OCS_YIELD) // Somebody else owns it now, and will onion_poller_slot_resume it.
+					continue;
+				if (el->edge)
+					__atomic_store_n(&el->busy, 0, __ATOMIC_RELEASE);
 				
-				ctime=time(NULL);
-				if (el->timeout>0)
-					el->timeout_limit=ctime+el->timeout;
+				if (n>=0 && el->timeout>0){
+					pthread_mutex_lock(&p->mutex);
+					onion_poller_timeout_arm(p, el);
+					pthread_mutex_unlock(&p->mutex);
+				}
 			}
 			if (n<0){
-				onion_poller_remove(p, el->fd);
+				onion_poller_remove_slot(p, el);
+			}
+			else if (el->edge && el->drained && el->armed==el->type){
+				// Still watched, and nothing left to read until the next edge.
 			}
-			else{
+			else if (el->type&(EPOLLONESHOT|EPOLLET)){
 				ONION_DEBUG0("Re setting poller %d", el->fd);
-				event[i].events=el->type;
+				event[i].events=el->armed=el->type;
 				if (p->fd>=0){
 					int e=epoll_ctl(p->fd, EPOLL_CTL_MOD, el->fd, &event[i]);
 					if (e<0){
@@ -457,8 +926,11 @@ void onion_poller_poll(onion_poller *p){
 				}
 			}
 		}
+		if (p->batch && nfds>0)
+			p->batch(p->batch_data);
 	}
 	ONION_DEBUG("Finished polling fds");
+	free(event);
 #ifdef HAVE_PTHREADS
 	pthread_mutex_lock(&p->mutex);
 	p->npollers--;
@@ -467,6 +939,133 @@ void onion_poller_poll(onion_poller *p){
 #endif
 }
 
+/**
+ * @short Resumes polling on a slot whose callback returned OCS_YIELD
+ * @memberof onion_poller_slot_t
+ * 
+ * May be called from any thread. The slot is watched again with its current type, and its timeout 
+ * is rearmed. Edge triggered slots are rearmed too, so the events that came meanwhile are seen.
+ */
+void onion_poller_slot_resume(onion_poller_slot *el){
+	onion_poller *p=el->poller;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events=el->armed=el->type;
+	ev.data.ptr=el;
+	
+	pthread_mutex_lock(&p->mutex); // So it does not timeout and get freed meanwhile
+	if (el->timeout>0)
+		onion_poller_timeout_arm(p, el);
+	if (el->edge)
+		__atomic_store_n(&el->busy, 0, __ATOMIC_RELEASE);
+	if (p->fd>=0 && epoll_ctl(p->fd, EPOLL_CTL_MOD, el->fd, &ev)<0)
+		ONION_ERROR("Error resuming poller slot, %s", strerror(errno));
+	pthread_mutex_unlock(&p->mutex);
+}
+
+/**
+ * @short Calls f(data) soon, from a poller thread
+ * @memberof onion_poller_t
+ * 
+ * May be called from any thread. It uses the poller eventfd to wake up the poller. Calls are done in 
+ * order, one after the other.
+ */
+void onion_poller_call(onion_poller *p, void (*f)(void *), void *data){
+	onion_poller_deferred *call=malloc(sizeof(onion_poller_deferred));
+	call->f=f;
+	call->data=data;
+	call->next=NULL;
+	
+	pthread_mutex_lock(&p->mutex);
+	if (p->calls_last)
+		p->calls_last->next=call;
+	else
+		p->calls=call;
+	p->calls_last=call;
+	pthread_mutex_unlock(&p->mutex);
+	
+	uint64_t one=1;
+	if (write(p->eventfd, &one, sizeof(one))<0)
+		ONION_ERROR("Error signaling poller: %s", strerror(errno));
+}
+
+/**
+ * @short Sets a function to call after each batch of events, before waiting again
+ * @memberof onion_poller_t
+ * 
+ * It is called at the thread that got the batch, so work the callbacks left for later, as the requests
+ * queued for work stealing, is done there. Set it before polling.
+ * 
+ * @returns 0, as it is supported by this poller.
+ */
+int onion_poller_set_batch_callback(onion_poller *p, void (*f)(void *), void *data){
+	p->batch=f;
+	p->batch_data=data;
+	return 0;
+}
+
+/**
+ * @short Wakes up a thread waiting at the poller, that then calls the batch callback
+ * @memberof onion_poller_t
+ * 
+ * May be called from any thread.
+ */
+void onion_poller_wakeup(onion_poller *p){
+	uint64_t one=1;
+	if (write(p->eventfd, &one, sizeof(one))<0)
+		ONION_ERROR("Error signaling poller: %s", strerror(errno));
+}
+
+/**
+ * @short Calls f(data) once from a poller thread, after ms milliseconds
+ * @memberof onion_poller_t
+ * 
+ * May be called from any thread. The timer is just an entry at the timeouts heap, which already sets
+ * how long the poller waits, so it needs no file descriptor nor syscalls, except waking up the poller
+ * when it is the new earliest timeout.
+ * If the poller is freed before, f is not called.
+ * 
+ * @returns 0 if the timer was added, or -1 on error.
+ */
+int onion_poller_add_timer(onion_poller *p, int ms, void (*f)(void *), void *data){
+	onion_poller_slot *el=onion_slab_calloc(sizeof(onion_poller_slot));
+	if (!el){
+		ONION_ERROR("Could not create a timer");
+		return -1;
+	}
+	onion_memory_count(ONION_MEMORY_POLLER, sizeof(onion_poller_slot));
+	el->fd=-1;
+	el->timer=1;
+	el->f=(void*)f;
+	el->data=data;
+	el->timeout=(ms<0) ? 0 : ms;
+	el->timeout_pos=-1;
+	el->poller=p;
+	pthread_mutex_lock(&p->mutex);
+	onion_poller_timeout_arm(p, el);
+	int first=(el->timeout_pos==0);
+	pthread_mutex_unlock(&p->mutex);
+	if (first) // Pollers may be waiting for a later timeout
+		onion_poller_wakeup(p);
+	return 0;
+}
+
+/// Frees a timer without calling it.
+static void onion_poller_timer_free(onion_poller_slot *el){
+	onion_memory_count(ONION_MEMORY_POLLER, -(long)sizeof(onion_poller_slot));
+	onion_slab_free(el, sizeof(onion_poller_slot));
+}
+
+/// Sends and closes at the kernel. Not supported.
+int onion_poller_can_send_close(onion_poller *p){
+	return 0;
+}
+
+/// Sends and closes at the kernel. Not supported, the caller writes and closes itself.
+int onion_poller_send_close(onion_poller *p, int fd, const char *data, size_t len){
+	return -1;
+}
+
 /**
  * @short Marks the poller to stop ASAP
  * @memberof onion_poller_t
@@ -36,7 +36,8 @@ enum onion_poller_slot_type_e{
 	O_POLL_READ=1,
 	O_POLL_WRITE=2,
 	O_POLL_OTHER=4,
-	O_POLL_ALL=7
+	O_POLL_ALL=7,
+	O_POLL_EXCLUSIVE=8, ///< The fd is watched by several pollers, wake only one. Not rearmed after each event, so only for listen sockets.
 };
 
 /// Create a new slot for the poller
@@ -45,20 +46,74 @@ onion_poller_slot *onion_poller_slot_new(int fd, int (*f)(void*), void *data);
 void onion_poller_slot_free(onion_poller_slot *el);
 /// Sets the shutdown function for this poller slot
 void onion_poller_slot_set_shutdown(onion_poller_slot *el, void (*shutdown)(void*), void *data);
-/// Sets the timeout for this slot. Current implementation takes ms, but then it rounds to seconds.
+/// Sets the timeout for this slot, in milliseconds. <0 means no timeout.
 void onion_poller_slot_set_timeout(onion_poller_slot *el, int timeout_ms);
+/// Sets a function to call once when the slot waits idle_ms without events, before its timeout.
+void onion_poller_slot_set_idle(onion_poller_slot *el, int idle_ms, void (*idle)(void*), void *data);
 /// Sets the polling type: read/write/other. O_POLL_READ | O_POLL_WRITE | O_POLL_OTHER
 void onion_poller_slot_set_type(onion_poller_slot *el, int type);
+/// Makes the slot edge triggered, so not rearmed after each event. Only at pollers of one thread. 0 if supported.
+int onion_poller_slot_set_edge_triggered(onion_poller_slot *el);
+/// From the callback of an edge triggered slot, tells that it read until EAGAIN, so it needs no rearm.
+void onion_poller_slot_set_drained(onion_poller_slot *el);
+/// The slot is a listen socket, and the poller accepts: accepted(data, fd) gets each new connection, or -errno. 0 if supported.
+int onion_poller_slot_set_accept(onion_poller_slot *el, int (*accepted)(void *data, int fd));
+/// The poller reads: received(data, buffer, len) gets the data as it comes, or len 0 when closed by the peer. 0 if supported.
+int onion_poller_slot_set_recv(onion_poller_slot *el, int (*received)(void *data, const char *buffer, size_t len));
 
 /// Create a new poller
 onion_poller *onion_poller_new(int aprox_n);
 /// Frees the poller. It first stops it.
 void onion_poller_free(onion_poller *);
 
+/// Default events read per wakeup. @see onion_poller_set_max_events
+#define ONION_POLLER_MAX_EVENTS 10
+
+/// Sets the events read per wakeup. If max_events_limit>max_events, grows up to it when the batches are full.
+void onion_poller_set_max_events(onion_poller *poller, int max_events, int max_events_limit);
+/// Gets the number of wakeups with events, and of events.
+void onion_poller_get_event_stats(onion_poller *poller, unsigned long *wakeups, unsigned long *events);
+
+/// Time waiting and at the callbacks of a poller, of all its threads. @see onion_poller_set_profiling
+typedef struct onion_poller_profile_t{
+	unsigned long wait_us;          ///< Waiting for events
+	unsigned long callbacks_us;     ///< Running the callbacks of the events
+	unsigned long max_callback_us;  ///< The longest callback
+	unsigned long stalls;           ///< Callbacks longer than the stall threshold
+}onion_poller_profile;
+
+/// Measures the wait and callback times; callbacks longer than stall_ms, if >0, are logged. <0 to stop.
+void onion_poller_set_profiling(onion_poller *poller, int stall_ms);
+/// Gets those times. All 0 if never profiled.
+void onion_poller_get_profile(onion_poller *poller, onion_poller_profile *profile);
+/// Notes the handler called by the callback running at this thread, for the stall log. Used by onion_handler_handle.
+void onion_poller_note_handler(void *handler, onion_request *req);
+
 /// Adds a slot to the poller
 int onion_poller_add(onion_poller *poller, onion_poller_slot *el);
 /// Removes a fd from the poller
 int onion_poller_remove(onion_poller *poller, int fd);
+/// Calls f for each slot, with the poller locked. @see onion_poller_foreach
+void onion_poller_foreach(onion_poller *poller, void (*f)(void *data, int (*callback)(void*), void *slot_data), void *data);
+
+/// Watches again a slot whose callback returned OCS_YIELD. Thread safe.
+void onion_poller_slot_resume(onion_poller_slot *el);
+
+/// Calls f(data) soon from a poller thread. Thread safe.
+void onion_poller_call(onion_poller *poller, void (*f)(void *), void *data);
+
+/// Calls f(data) once from a poller thread, after ms milliseconds. Thread safe. 0 if added.
+int onion_poller_add_timer(onion_poller *poller, int ms, void (*f)(void *), void *data);
+
+/// Whether onion_poller_send_close is supported, so the caller may keep the data to send with the close.
+int onion_poller_can_send_close(onion_poller *poller);
+/// Sends the data, and then shuts down and closes fd, without waiting for them. Thread safe. 0 if queued, <0 if not supported.
+int onion_poller_send_close(onion_poller *poller, int fd, const char *data, size_t len);
+
+/// Calls f(data) at the polling thread after each batch of events, before waiting again. 0 if set, <0 if not supported.
+int onion_poller_set_batch_callback(onion_poller *poller, void (*f)(void *), void *data);
+/// Wakes up a thread waiting at the poller, so it calls the batch callback. Thread safe.
+void onion_poller_wakeup(onion_poller *poller);
 
 /// Do the polling. If on several threads, this is done in every thread.
 void onion_poller_poll(onion_poller *);
@@ -0,0 +1,1421 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+/**
+ * @file poller_io_uring.c
+ * @short Poller implemented over io_uring.
+ *
+ * It keeps the same semantics as the epoll poller: a slot callback is called once when its fd is ready,
+ * and then the slot is rearmed. Each arm is a IORING_OP_POLL_ADD at the submission queue, which is
+ * submitted in the same io_uring_enter call that waits for the next completions, so there is no
+ * extra syscall to rearm as the epoll_ctl(EPOLL_CTL_MOD) at the epoll poller.
+ *
+ * Where the poller can do the work itself, the submission is the work, and not only the poll for it:
+ * listen sockets have a multishot IORING_OP_ACCEPT, so one submission accepts connection after connection
+ * (onion_poller_slot_set_accept); connections waiting for data have an IORING_OP_RECV to a buffer of a
+ * provided buffer ring, so the completion brings the data (onion_poller_slot_set_recv); and the last
+ * response of a connection goes as an IORING_OP_SEND linked to its shutdown and close
+ * (onion_poller_send_close). None of them needs a syscall of its own.
+ *
+ * It uses the raw syscalls, so there is no need for liburing. Needs Linux 5.11 or newer; multishot accept
+ * and the buffer ring need Linux 5.19, and without them those slots are polled as the others.
+ */
+
+#include <malloc.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "log.h"
+#include "trace.h"
+#include "types.h"
+#include "poller.h"
+#include "pool.h"
+#include "memory.h"
+#include "request.h"
+
+#ifdef HAVE_PTHREADS
+# include <pthread.h>
+#else  // if no pthreads, ignore locks.
+# define pthread_mutex_init(...)
+# define pthread_mutex_lock(...)
+# define pthread_mutex_trylock(...) (0)
+# define pthread_mutex_unlock(...)
+#endif
+
+/// Size of the submission queue. Completion queue is twice as big.
+#define ONION_IO_URING_ENTRIES 256
+/// Buffers at the provided buffer ring, for the slots that receive at the poller. A power of 2.
+#define ONION_IO_URING_BUFFERS 64
+/// Size of each of those buffers
+#define ONION_IO_URING_BUFFER_SIZE (16*1024)
+/// Buffer group of that ring
+#define ONION_IO_URING_BGID 0
+
+#ifndef IORING_ACCEPT_MULTISHOT // Headers older than Linux 5.19, so no multishot accept nor buffer rings.
+# define ONION_IO_URING_NO_RINGS
+#endif
+#ifndef IORING_CQE_F_MORE
+# define IORING_CQE_F_MORE (1U << 1)
+#endif
+
+/// A call queued with onion_poller_call
+typedef struct onion_poller_deferred_t{
+	void (*f)(void *);
+	void *data;
+	struct onion_poller_deferred_t *next;
+}onion_poller_deferred;
+
+struct onion_poller_t{
+	int fd; ///< io_uring fd
+	int eventfd; ///< fd to signal internal changes on poller.
+	int n;
+	char stop;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;
+	int npollers;
+#endif
+
+	/// @{ @name Submission queue, as mmaped from the kernel
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	int pending; ///< SQEs at the queue, still not submitted
+	/// @}
+	/// @{ @name Completion queue, as mmaped from the kernel
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	/// @}
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	onion_poller_slot *head;     ///< Doubly linked list of all slots. First is always the eventfd.
+	onion_poller_slot *zombies;  ///< Removed slots with a poll still at the kernel. Freed when it completes.
+	onion_poller_deferred *calls;      ///< Calls queued by onion_poller_call, to run at a poller thread. FIFO.
+	onion_poller_deferred *calls_last; ///< Last of calls, to append.
+	void (*batch)(void *);       ///< Called after each batch of completions. @see onion_poller_set_batch_callback
+	void *batch_data;
+	onion_poller_slot **slots;   ///< Slots indexed by fd, for fast lookup at onion_poller_remove.
+	int slots_size;              ///< Allocated size of slots
+
+	onion_poller_slot **timeouts; ///< Binary min-heap of armed slots, ordered by timeout_limit.
+	int ntimeouts;               ///< Slots currently at the heap
+	int timeouts_size;           ///< Allocated size of the heap
+
+	struct io_uring_buf_ring *buf_ring; ///< Provided buffer ring of the receiving slots, or NULL if the kernel has none.
+	char *buffers;               ///< ONION_IO_URING_BUFFERS of ONION_IO_URING_BUFFER_SIZE, for buf_ring.
+	int closing;                 ///< onion_poller_send_close still at the kernel.
+
+	unsigned long wakeups;       ///< Waits after which there were completions. Atomic.
+	unsigned long events;        ///< Completions dispatched to a slot. Atomic.
+	int stall_ms;                ///< Callbacks longer than this are logged; 0 only measures, <0 is off. @see onion_poller_set_profiling
+	onion_poller_profile profile; ///< Atomic.
+};
+
+/// Each element of the poll
+/// @private
+struct onion_poller_slot_t{
+	int fd;
+	int (*f)(void*);
+	void *data;
+	int type;                ///< poll(2) events to wait for
+
+	void (*shutdown)(void*);
+	void *shutdown_data;
+
+	int timeout;             ///< Timeout in ms, <0 if none.
+	int64_t timeout_limit;   ///< Monotonic ms at which this slot times out, if armed.
+	int timeout_pos;         ///< Position at the poller timeouts heap, or -1 if not armed.
+	int idle_ms;             ///< Before the timeout, idle is called once after this long without events.
+	void (*idle)(void*);
+	void *idle_data;
+	char idled;              ///< idle was already called since the last event.
+	onion_poller *poller;    ///< Poller this slot was added to, if any.
+	char polling;            ///< There is a poll request at the kernel for this slot.
+	char timer;              ///< An onion_poller_add_timer timer: only at the timeouts heap, no fd.
+	int (*accepted)(void *data, int fd); ///< Accepts at the poller. @see onion_poller_slot_set_accept
+	int (*received)(void *data, const char *buffer, size_t len); ///< Receives at the poller. @see onion_poller_slot_set_recv
+	char receiving;          ///< What is at the kernel is a receive, not a poll.
+	char poll_once;          ///< The buffers were all in use, so the next arm is a poll, and the callback reads.
+	int running;             ///< Accepted callbacks running now. A multishot accept may have several at once.
+
+	onion_poller_slot *next;
+	onion_poller_slot *prev;
+};
+
+static void onion_poller_timeout_arm(onion_poller *p, onion_poller_slot *el);
+static void onion_poller_timeout_disarm(onion_poller *p, onion_poller_slot *el);
+static void onion_poller_timer_free(onion_poller_slot *el);
+static int64_t onion_poller_now_us();
+static int64_t onion_poller_callback_start(onion_poller *p);
+static void onion_poller_callback_end(onion_poller *p, onion_poller_slot *el, int64_t start);
+static void onion_poller_buffer_give_back(onion_poller *p, int bid);
+
+/// Poller whose poll loop runs at this thread, if any. Its submissions go with its next wait.
+static __thread onion_poller *onion_poller_polling;
+
+/// What the callback running at this thread does, for the stall log. Only noted while profiling.
+static __thread struct{
+	char profiling;
+	void *handler;
+	char path[128];
+}onion_poller_current;
+
+/**
+ * @short Creates a new slot for the poller, for input data to be ready.
+ * @memberof onion_poller_slot_t
+ *
+ * @param fd File descriptor to watch
+ * @param f Function to call when data is ready. If function returns <0, the slot will be removed.
+ * @param data Data to pass to the function.
+ *
+ * @returns A new poller slot, ready to be added (onion_poller_add) or modified (onion_poller_slot_set_shutdown, onion_poller_slot_set_timeout).
+ */
+onion_poller_slot *onion_poller_slot_new(int fd, int (*f)(void*), void *data){
+	if (fd<0){
+		ONION_ERROR("Trying to add an invalid file descriptor to the poller. Please check.");
+		return NULL;
+	}
+	onion_poller_slot *el=onion_slab_calloc(sizeof(onion_poller_slot));
+	onion_memory_count(ONION_MEMORY_POLLER, sizeof(onion_poller_slot));
+	el->fd=fd;
+	el->f=f;
+	el->data=data;
+	el->timeout=-1;
+	el->timeout_pos=-1;
+	el->type=POLLIN | POLLHUP;
+
+	return el;
+}
+
+/**
+ * @short Free the data for the given slot, calling shutdown if any.
+ * @memberof onion_poller_slot_t
+ */
+void onion_poller_slot_free(onion_poller_slot *el){
+	if (el->shutdown)
+		el->shutdown(el->shutdown_data);
+	onion_memory_count(ONION_MEMORY_POLLER, -(long)sizeof(onion_poller_slot));
+	onion_slab_free(el, sizeof(onion_poller_slot));
+}
+
+/**
+ * @short Sets a function to be called when the slot is removed, for example because the file is closed.
+ * @memberof onion_poller_slot_t
+ *
+ * @param el slot
+ * @param sd Function to call
+ * @param data Parameter for the function
+ */
+void onion_poller_slot_set_shutdown(onion_poller_slot *el, void (*sd)(void*), void *data){
+	el->shutdown=sd;
+	el->shutdown_data=data;
+}
+
+/**
+ * @short Sets the timeout for the slot
+ * @memberof onion_poller_slot_t
+ *
+ * Same semantics as at the epoll poller: in milliseconds, rearmed after each callback, <0 is no timeout.
+ *
+ * @param el Slot to modify
+ * @param timeout Time in milliseconds that this file can be waiting.
+ */
+void onion_poller_slot_set_timeout(onion_poller_slot *el, int timeout){
+	el->timeout=timeout;
+	if (el->poller){
+		pthread_mutex_lock(&el->poller->mutex);
+		if (timeout>=0)
+			onion_poller_timeout_arm(el->poller, el);
+		else
+			onion_poller_timeout_disarm(el->poller, el);
+		pthread_mutex_unlock(&el->poller->mutex);
+	}
+}
+
+/**
+ * @short Sets a function to call once when the slot waits idle_ms without events, before its timeout.
+ * @memberof onion_poller_slot_t
+ *
+ * Same semantics as at the epoll poller.
+ */
+void onion_poller_slot_set_idle(onion_poller_slot *el, int idle_ms, void (*idle)(void*), void *data){
+	el->idle_ms=idle_ms;
+	el->idle=idle;
+	el->idle_data=data;
+}
+
+void onion_poller_slot_set_type(onion_poller_slot *el, int type){
+	el->type=0; // O_POLL_EXCLUSIVE is ignored: polls are oneshot, and late wakers find nothing to accept on the non blocking socket.
+	if (type&O_POLL_READ)
+		el->type|=POLLIN;
+	if (type&O_POLL_WRITE)
+		el->type|=POLLOUT;
+	if (type&O_POLL_OTHER)
+		el->type|=POLLERR|POLLHUP|POLLPRI;
+	ONION_DEBUG0("Setting type to %d, %d", el->fd, el->type);
+}
+
+/// Edge triggered slots. Not supported, the slots are watched as always.
+int onion_poller_slot_set_edge_triggered(onion_poller_slot *el){
+	return -1;
+}
+
+/// Tells the slot read until EAGAIN. Not supported, does nothing.
+void onion_poller_slot_set_drained(onion_poller_slot *el){
+}
+
+/**
+ * @short The slot is a listen socket, and the poller accepts its connections.
+ * @memberof onion_poller_slot_t
+ * 
+ * It is a multishot IORING_OP_ACCEPT: one submission accepts connection after connection, each at a completion,
+ * with no poll nor accept syscalls. accepted(data, fd) is called instead of the slot callback with each new 
+ * connection, or with -errno if accept failed; if it returns <0 the slot is removed. As it is multishot, it
+ * may be called at several threads at once.
+ * 
+ * Needs Linux 5.19. On older kernels, known as they have no provided buffer rings, the slot callback is called
+ * as always, so it must still accept.
+ * 
+ * @returns 0, as it is supported by this poller.
+ */
+int onion_poller_slot_set_accept(onion_poller_slot *el, int (*accepted)(void *data, int fd)){
+	el->accepted=accepted;
+	return 0;
+}
+
+/**
+ * @short The poller reads for the slot, to a buffer of its provided buffer ring.
+ * @memberof onion_poller_slot_t
+ * 
+ * While the slot waits only to read, each arm is an IORING_OP_RECV that takes a buffer when the data comes,
+ * so the completion brings the data, with no read syscall. received(data, buffer, len) is called instead of
+ * the slot callback, with len 0 if the peer closed; the buffer is given back to the ring after the call. As a
+ * poll, it is one shot: it is not called again until it returns, or until onion_poller_slot_resume if it yielded.
+ * 
+ * When it waits to write, or all the buffers are in use, it is polled and the slot callback is called, so it
+ * must still read. Needs Linux 5.19, else it is always so.
+ * 
+ * @returns 0, as it is supported by this poller.
+ */
+int onion_poller_slot_set_recv(onion_poller_slot *el, int (*received)(void *data, const char *buffer, size_t len)){
+	el->received=received;
+	return 0;
+}
+
+/// Current monotonic time, in milliseconds.
+static int64_t onion_poller_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+/// Places el at pos in the timeouts heap, and updates the back reference.
+static inline void onion_poller_timeout_place(onion_poller *p, onion_poller_slot *el, int pos){
+	p->timeouts[pos]=el;
+	el->timeout_pos=pos;
+}
+
+/// Moves the element at pos up or down the heap until the heap property holds again.
+static void onion_poller_timeout_fix(onion_poller *p, int pos){
+	onion_poller_slot *el=p->timeouts[pos];
+	while (pos>0){ // Up
+		int parent=(pos-1)/2;
+		if (p->timeouts[parent]->timeout_limit <= el->timeout_limit)
+			break;
+		onion_poller_timeout_place(p, p->timeouts[parent], pos);
+		pos=parent;
+	}
+	for(;;){ // Down
+		int child=pos*2+1;
+		if (child>=p->ntimeouts)
+			break;
+		if (child+1<p->ntimeouts && p->timeouts[child+1]->timeout_limit < p->timeouts[child]->timeout_limit)
+			child++;
+		if (el->timeout_limit <= p->timeouts[child]->timeout_limit)
+			break;
+		onion_poller_timeout_place(p, p->timeouts[child], pos);
+		pos=child;
+	}
+	onion_poller_timeout_place(p, el, pos);
+}
+
+/// Arms (or rearms) the timeout of the slot to now+el->timeout. Poller must be locked by caller.
+static void onion_poller_timeout_arm(onion_poller *p, onion_poller_slot *el){
+	el->idled=0;
+	el->timeout_limit=onion_poller_now()+((el->idle && el->idle_ms<el->timeout) ? el->idle_ms : el->timeout);
+	if (el->timeout_pos<0){
+		if (p->ntimeouts==p->timeouts_size){
+			p->timeouts_size=p->timeouts_size ? p->timeouts_size*2 : 16;
+			p->timeouts=realloc(p->timeouts, sizeof(onion_poller_slot*)*p->timeouts_size);
+		}
+		onion_poller_timeout_place(p, el, p->ntimeouts++);
+	}
+	onion_poller_timeout_fix(p, el->timeout_pos);
+}
+
+/// Removes the slot from the timeouts heap, if there. Poller must be locked by caller.
+static void onion_poller_timeout_disarm(onion_poller *p, onion_poller_slot *el){
+	int pos=el->timeout_pos;
+	if (pos<0)
+		return;
+	el->timeout_pos=-1;
+	p->ntimeouts--;
+	if (pos==p->ntimeouts)
+		return;
+	onion_poller_timeout_place(p, p->timeouts[p->ntimeouts], pos);
+	onion_poller_timeout_fix(p, pos);
+}
+
+/// Time to wait until next timeout, in ms. Poller must be locked by caller.
+static int onion_poller_get_next_timeout(onion_poller *p, int64_t now){
+	if (!p->ntimeouts)
+		return 3600000;
+	int64_t timeout=p->timeouts[0]->timeout_limit - now;
+	if (timeout<0)
+		return 0;
+	if (timeout>3600000)
+		return 3600000;
+	return (int)timeout;
+}
+
+/**
+ * @short Sends the pending submissions to the kernel, and optionally waits for some completion.
+ *
+ * @param to_submit Number of SQEs to submit
+ * @param timeout If >=0 waits up to that ms for at least one completion. If <0 does not wait.
+ */
+static int onion_poller_enter(onion_poller *p, int to_submit, int timeout){
+	if (timeout<0)
+		return syscall(__NR_io_uring_enter, p->fd, to_submit, 0, 0, NULL, 0);
+
+	struct __kernel_timespec ts;
+	ts.tv_sec=timeout/1000;
+	ts.tv_nsec=(timeout%1000)*1000000;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts=(uint64_t)(uintptr_t)&ts;
+	return syscall(__NR_io_uring_enter, p->fd, to_submit, 1, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+/**
+ * @short Gets a free SQE. If the queue is full, submits it first.
+ *
+ * Poller must be locked by caller.
+ */
+static struct io_uring_sqe *onion_poller_get_sqe(onion_poller *p){
+	unsigned tail=*p->sq_tail;
+	if (tail - __atomic_load_n(p->sq_head, __ATOMIC_ACQUIRE) >= p->sq_entries){
+		int r=onion_poller_enter(p, p->pending, -1);
+		if (r<0){
+			ONION_ERROR("Error submitting to io_uring: %s", strerror(errno));
+			return NULL;
+		}
+		p->pending-=r;
+		if (tail - __atomic_load_n(p->sq_head, __ATOMIC_ACQUIRE) >= p->sq_entries){
+			ONION_ERROR("io_uring submission queue full");
+			return NULL;
+		}
+	}
+	unsigned idx=tail & *p->sq_mask;
+	struct io_uring_sqe *sqe=&p->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	p->sq_array[idx]=idx;
+	return sqe;
+}
+
+/// Makes the last SQE from onion_poller_get_sqe visible to the kernel. Poller must be locked by caller.
+static void onion_poller_push_sqe(onion_poller *p){
+	__atomic_store_n(p->sq_tail, *p->sq_tail+1, __ATOMIC_RELEASE);
+	p->pending++;
+}
+
+/**
+ * @short Queues a poll for the slot. Poller must be locked by caller.
+ * 
+ * Or the work it waits for, if the poller does it: the multishot accept of onion_poller_slot_set_accept, or
+ * the receive of onion_poller_slot_set_recv, if it only waits to read.
+ */
+static void onion_poller_queue_poll(onion_poller *p, onion_poller_slot *el){
+	struct io_uring_sqe *sqe=onion_poller_get_sqe(p);
+	if (!sqe)
+		return;
+	sqe->fd=el->fd;
+	sqe->user_data=(uint64_t)(uintptr_t)el;
+	el->receiving=0;
+#ifndef ONION_IO_URING_NO_RINGS
+	if (el->accepted){
+		sqe->opcode=IORING_OP_ACCEPT;
+		sqe->ioprio=IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags=SOCK_CLOEXEC;
+	}
+	else if (el->received && !el->poll_once && !(el->type&POLLOUT)){
+		sqe->opcode=IORING_OP_RECV;
+		sqe->flags=IOSQE_BUFFER_SELECT;
+		sqe->buf_group=ONION_IO_URING_BGID;
+		el->receiving=1;
+	}
+	else
+#endif
+	{
+		sqe->opcode=IORING_OP_POLL_ADD;
+		sqe->poll32_events=el->type;
+	}
+	el->poll_once=0;
+	onion_poller_push_sqe(p);
+	el->polling=1;
+}
+
+/// Queues the cancel of what the slot waits for at the kernel. Its completion has no slot. Poller must be locked by caller.
+static void onion_poller_queue_cancel(onion_poller *p, onion_poller_slot *el){
+	struct io_uring_sqe *sqe=onion_poller_get_sqe(p);
+	if (!sqe)
+		return;
+	sqe->opcode=IORING_OP_ASYNC_CANCEL;
+	sqe->fd=-1;
+	sqe->addr=(uint64_t)(uintptr_t)el;
+	sqe->user_data=0;
+	onion_poller_push_sqe(p);
+}
+
+/// Submits now all pending SQEs. Needed when changes come from outside the poll loop. Poller must be locked.
+static void onion_poller_submit(onion_poller *p){
+	if (!p->pending)
+		return;
+	int r=onion_poller_enter(p, p->pending, -1);
+	if (r<0)
+		ONION_ERROR("Error submitting to io_uring: %s", strerror(errno));
+	else
+		p->pending-=r;
+}
+
+/// The eventfd was signaled: runs the onion_poller_call queued calls, and stops if asked to.
+static int onion_poller_eventfd_helper(void *_p){
+	onion_poller *p=_p;
+	uint64_t v;
+	int __attribute__((unused)) r=read(p->eventfd, &v, sizeof(v));
+	
+	pthread_mutex_lock(&p->mutex);
+	onion_poller_deferred *call=p->calls;
+	p->calls=p->calls_last=NULL;
+	pthread_mutex_unlock(&p->mutex);
+	while (call){
+		onion_poller_deferred *next=call->next;
+		call->f(call->data);
+		free(call);
+		call=next;
+	}
+	
+	if (p->stop)
+		onion_poller_stop(p);
+  return 1;
+}
+
+/**
+ * @short Registers the provided buffer ring, for onion_poller_slot_set_recv
+ * 
+ * If the kernel has none, before Linux 5.19, p->buf_ring is left NULL, and the slots are polled as always.
+ */
+static void onion_poller_buffers_new(onion_poller *p){
+#ifndef ONION_IO_URING_NO_RINGS
+	size_t ring_size=ONION_IO_URING_BUFFERS*sizeof(struct io_uring_buf);
+	struct io_uring_buf_ring *ring=mmap(NULL, ring_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (ring==MAP_FAILED)
+		return;
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr=(uint64_t)(uintptr_t)ring;
+	reg.ring_entries=ONION_IO_URING_BUFFERS;
+	reg.bgid=ONION_IO_URING_BGID;
+	if (syscall(__NR_io_uring_register, p->fd, IORING_REGISTER_PBUF_RING, &reg, 1)<0){
+		ONION_DEBUG("No io_uring buffer rings, so no multishot accept nor receives at the poller. Needs Linux 5.19. %s", strerror(errno));
+		munmap(ring, ring_size);
+		return;
+	}
+	p->buffers=malloc(ONION_IO_URING_BUFFERS*ONION_IO_URING_BUFFER_SIZE);
+	onion_memory_count(ONION_MEMORY_POLLER, ONION_IO_URING_BUFFERS*ONION_IO_URING_BUFFER_SIZE);
+	p->buf_ring=ring;
+	int i;
+	for (i=0;i<ONION_IO_URING_BUFFERS;i++)
+		onion_poller_buffer_give_back(p, i);
+#endif
+}
+
+/// Frees the provided buffer ring, once the io_uring is closed.
+static void onion_poller_buffers_free(onion_poller *p){
+#ifndef ONION_IO_URING_NO_RINGS
+	if (!p->buf_ring)
+		return;
+	munmap(p->buf_ring, ONION_IO_URING_BUFFERS*sizeof(struct io_uring_buf));
+	onion_memory_count(ONION_MEMORY_POLLER, -(long)(ONION_IO_URING_BUFFERS*ONION_IO_URING_BUFFER_SIZE));
+	free(p->buffers);
+#endif
+}
+
+/// Data of the buffer bid of the provided buffer ring.
+static inline char *onion_poller_buffer(onion_poller *p, int bid){
+	return p->buffers+(size_t)bid*ONION_IO_URING_BUFFER_SIZE;
+}
+
+/// Gives the buffer bid back to the provided buffer ring, for the next receives. Poller must be locked by caller.
+static void onion_poller_buffer_give_back(onion_poller *p, int bid){
+#ifndef ONION_IO_URING_NO_RINGS
+	unsigned short tail=p->buf_ring->tail;
+	struct io_uring_buf *buf=&p->buf_ring->bufs[tail&(ONION_IO_URING_BUFFERS-1)];
+	buf->addr=(uint64_t)(uintptr_t)onion_poller_buffer(p, bid);
+	buf->len=ONION_IO_URING_BUFFER_SIZE;
+	buf->bid=bid;
+	__atomic_store_n(&p->buf_ring->tail, tail+1, __ATOMIC_RELEASE);
+#endif
+}
+
+/**
+ * @short Returns a poller object that helps polling on sockets and files
+ * @memberof onion_poller_t
+ *
+ * This poller is implemented through io_uring.
+ */
+onion_poller *onion_poller_new(int n){
+	onion_poller *p=calloc(1, sizeof(onion_poller));
+	p->stall_ms=-1;
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	p->fd=syscall(__NR_io_uring_setup, ONION_IO_URING_ENTRIES, &params);
+	if (p->fd < 0){
+		ONION_ERROR("Error creating the poller. %s", strerror(errno));
+		free(p);
+		return NULL;
+	}
+	if (!(params.features&IORING_FEAT_EXT_ARG)){
+		ONION_ERROR("This kernel io_uring does not support IORING_FEAT_EXT_ARG. Needs Linux 5.11 or newer.");
+		close(p->fd);
+		free(p);
+		return NULL;
+	}
+	fcntl(p->fd, F_SETFD, FD_CLOEXEC);
+
+	p->sq_ring_size=params.sq_off.array + params.sq_entries*sizeof(unsigned);
+	p->cq_ring_size=params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+	if (params.features&IORING_FEAT_SINGLE_MMAP){
+		if (p->cq_ring_size>p->sq_ring_size)
+			p->sq_ring_size=p->cq_ring_size;
+		p->cq_ring_size=p->sq_ring_size;
+	}
+	p->sq_ring=mmap(NULL, p->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, p->fd, IORING_OFF_SQ_RING);
+	if (params.features&IORING_FEAT_SINGLE_MMAP)
+		p->cq_ring=p->sq_ring;
+	else
+		p->cq_ring=mmap(NULL, p->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, p->fd, IORING_OFF_CQ_RING);
+	p->sqes_size=params.sq_entries*sizeof(struct io_uring_sqe);
+	p->sqes=mmap(NULL, p->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, p->fd, IORING_OFF_SQES);
+	if (p->sq_ring==MAP_FAILED || p->cq_ring==MAP_FAILED || p->sqes==MAP_FAILED){
+		ONION_ERROR("Error mapping the io_uring queues. %s", strerror(errno));
+		close(p->fd);
+		free(p);
+		return NULL;
+	}
+
+	p->sq_head=p->sq_ring+params.sq_off.head;
+	p->sq_tail=p->sq_ring+params.sq_off.tail;
+	p->sq_mask=p->sq_ring+params.sq_off.ring_mask;
+	p->sq_array=p->sq_ring+params.sq_off.array;
+	p->sq_entries=params.sq_entries;
+	p->cq_head=p->cq_ring+params.cq_off.head;
+	p->cq_tail=p->cq_ring+params.cq_off.tail;
+	p->cq_mask=p->cq_ring+params.cq_off.ring_mask;
+	p->cqes=p->cq_ring+params.cq_off.cqes;
+	onion_poller_buffers_new(p);
+
+	p->eventfd=eventfd(0,EFD_CLOEXEC | EFD_NONBLOCK);
+
+#ifdef HAVE_PTHREADS
+  ONION_DEBUG("Init thread stuff for poll. Eventfd at %d", p->eventfd);
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&p->mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+#endif
+
+  onion_poller_slot *ev=onion_poller_slot_new(p->eventfd,onion_poller_eventfd_helper,p);
+  onion_poller_add(p,ev);
+
+	return p;
+}
+
+/// Frees a list of slots, calling the shutdown functions.
+static void onion_poller_free_slots(onion_poller_slot *next){
+	while (next){
+		onion_poller_slot *tnext=next->next;
+		onion_poller_slot_free(next);
+		next=tnext;
+	}
+}
+
+/**
+ * @short Waits a little for the onion_poller_send_close still at the kernel. Poller must be locked.
+ * 
+ * Else closing the io_uring would cancel them, and their fds would be left open. The other completions are
+ * dropped, as their slots are freed now, but connections accepted meanwhile are closed.
+ */
+static void onion_poller_wait_closes(onion_poller *p){
+	onion_poller_submit(p);
+	int tries=10;
+	while (p->closing && tries--){
+		onion_poller_enter(p, 0, 100);
+		unsigned head=*p->cq_head;
+		while (head != __atomic_load_n(p->cq_tail, __ATOMIC_ACQUIRE)){
+			struct io_uring_cqe *cqe=&p->cqes[head & *p->cq_mask];
+			uintptr_t user_data=(uintptr_t)cqe->user_data;
+			if (user_data&1){
+				free((void*)(user_data&~(uintptr_t)1));
+				p->closing--;
+			}
+			else if (user_data && ((onion_poller_slot*)user_data)->accepted && cqe->res>=0)
+				close(cqe->res);
+			head++;
+		}
+		__atomic_store_n(p->cq_head, head, __ATOMIC_RELEASE);
+	}
+	if (p->closing)
+		ONION_WARNING("%d connections could not send their last data and close in time", p->closing);
+}
+
+/// @memberof onion_poller_t
+void onion_poller_free(onion_poller *p){
+	ONION_DEBUG("Free onion poller: %d waiting", p->n);
+	p->stop=1;
+
+	if (pthread_mutex_trylock(&p->mutex)>0){
+		ONION_WARNING("When cleaning the poller object, some poller is still active; not freeing memory");
+		return;
+	}
+	onion_poller_wait_closes(p);
+	close(p->fd); // Cancels all pending polls.
+	p->fd=-1;
+	onion_poller_buffers_free(p);
+	munmap(p->sqes, p->sqes_size);
+	if (p->cq_ring!=p->sq_ring)
+		munmap(p->cq_ring, p->cq_ring_size);
+	munmap(p->sq_ring, p->sq_ring_size);
+
+	onion_poller_free_slots(p->head);
+	onion_poller_free_slots(p->zombies);
+	pthread_mutex_unlock(&p->mutex);
+	close(p->eventfd);
+	while (p->calls){ // Not run, as the poller is gone.
+		onion_poller_deferred *next=p->calls->next;
+		free(p->calls);
+		p->calls=next;
+	}
+	int i;
+	for (i=0;i<p->ntimeouts;i++) // Timers are only here
+		if (p->timeouts[i]->timer)
+			onion_poller_timer_free(p->timeouts[i]);
+	free(p->slots);
+	free(p->timeouts);
+	free(p);
+	ONION_DEBUG0("Done");
+}
+
+/**
+ * @short Adds a file descriptor to poll.
+ * @memberof onion_poller_t
+ *
+ * When new data is available (read/write/event) the given function
+ * is called with that data.
+ */
+int onion_poller_add(onion_poller *poller, onion_poller_slot *el){
+	ONION_DEBUG0("Adding fd %d for polling (%d)", el->fd, poller->n);
+
+	pthread_mutex_lock(&poller->mutex);
+	el->poller=poller;
+	if (!poller->buf_ring){ // Before Linux 5.19, polled as the others
+		el->accepted=NULL;
+		el->received=NULL;
+	}
+	if (el->timeout>=0)
+		onion_poller_timeout_arm(poller, el);
+	if (el->fd>=poller->slots_size){
+		int nsize=poller->slots_size ? poller->slots_size : 64;
+		while (nsize<=el->fd)
+			nsize*=2;
+		poller->slots=realloc(poller->slots, sizeof(onion_poller_slot*)*nsize);
+		memset(&poller->slots[poller->slots_size], 0, sizeof(onion_poller_slot*)*(nsize-poller->slots_size));
+		poller->slots_size=nsize;
+	}
+	poller->slots[el->fd]=el;
+	if (!poller->head)
+		poller->head=el;
+	else{
+		el->prev=poller->head;
+		el->next=poller->head->next;
+		if (el->next)
+			el->next->prev=el;
+		poller->head->next=el;
+		poller->n++;
+	}
+	onion_poller_queue_poll(poller, el);
+	onion_poller_submit(poller);
+	pthread_mutex_unlock(&poller->mutex);
+	return 1;
+}
+
+/**
+ * @short Unlinks the slot from the poller structures.
+ *
+ * If there is still a poll at the kernel, it is cancelled and the slot is moved to the zombies
+ * until its completion arrives, so the completion never points to freed memory. Also while accepted
+ * callbacks run at other threads.
+ *
+ * Poller must be locked by caller.
+ *
+ * @returns 1 if the slot can be freed now, 0 if it is a zombie.
+ */
+static int onion_poller_unlink_slot(onion_poller *poller, onion_poller_slot *el){
+	if (el->prev){
+		el->prev->next=el->next;
+		poller->n--;
+	}
+	else
+		poller->head=el->next;
+	if (el->next)
+		el->next->prev=el->prev;
+	el->prev=el->next=NULL;
+	if (poller->slots[el->fd]==el)
+		poller->slots[el->fd]=NULL;
+	onion_poller_timeout_disarm(poller, el);
+
+	if (poller->head && poller->head->next==NULL && !poller->ntimeouts){ // This means only eventfd is here, and no timers.
+		ONION_DEBUG0("Removed last, stopping poll");
+		onion_poller_stop(poller);
+	}
+
+	if (!el->polling && !el->running)
+		return 1;
+	if (el->polling)
+		onion_poller_queue_cancel(poller, el);
+	el->next=poller->zombies;
+	if (el->next)
+		el->next->prev=el;
+	poller->zombies=el;
+	return 0;
+}
+
+/// A zombie has no more completions to come nor callbacks running: takes it from the zombies. Poller must be locked. 1 if it can be freed.
+static int onion_poller_zombie_done(onion_poller *poller, onion_poller_slot *el){
+	if (el->polling || el->running)
+		return 0;
+	if (el->prev)
+		el->prev->next=el->next;
+	else
+		poller->zombies=el->next;
+	if (el->next)
+		el->next->prev=el->prev;
+	return 1;
+}
+
+/// Calls the shutdown of an unlinked slot, and frees it if there is no poll at the kernel.
+static void onion_poller_release_slot(onion_poller_slot *el, int can_free){
+	if (can_free)
+		onion_poller_slot_free(el);
+	else if (el->shutdown){ // Shutdown now, memory later.
+		el->shutdown(el->shutdown_data);
+		el->shutdown=NULL;
+	}
+}
+
+/// Removes the slot, calls its shutdown, and frees it as soon as possible. Poll loop only.
+static void onion_poller_remove_slot(onion_poller *poller, onion_poller_slot *el){
+	pthread_mutex_lock(&poller->mutex);
+	int can_free=onion_poller_unlink_slot(poller, el);
+	pthread_mutex_unlock(&poller->mutex);
+
+	onion_poller_release_slot(el, can_free);
+}
+
+/**
+ * @short Removes a file descriptor, and all related callbacks from the listening queue
+ * @memberof onion_poller_t
+ */
+int onion_poller_remove(onion_poller *poller, int fd){
+	pthread_mutex_lock(&poller->mutex);
+	onion_poller_slot *el=NULL;
+	int can_free=0;
+	if (fd>=0 && fd<poller->slots_size)
+		el=poller->slots[fd];
+	if (el){
+		can_free=onion_poller_unlink_slot(poller, el);
+		onion_poller_submit(poller);
+	}
+	pthread_mutex_unlock(&poller->mutex);
+
+	if (!el){
+		ONION_WARNING("Trying to remove unknown fd from poller %d", fd);
+		return 0;
+	}
+	onion_poller_release_slot(el, can_free);
+	return 0;
+}
+
+/**
+ * @short Calls f for each slot at the poller, with its callback and data.
+ * @memberof onion_poller_t
+ * 
+ * The poller is locked meanwhile, so the slots are not freed under f, but f must be quick and must not use 
+ * the poller. Their data may be in use at other threads.
+ */
+void onion_poller_foreach(onion_poller *poller, void (*f)(void *data, int (*callback)(void*), void *slot_data), void *data){
+	pthread_mutex_lock(&poller->mutex);
+	onion_poller_slot *el;
+	for (el=poller->head;el;el=el->next)
+		f(data, el->f, el->data);
+	pthread_mutex_unlock(&poller->mutex);
+}
+
+/**
+ * @short Sets the events per wakeup
+ * @memberof onion_poller_t
+ * 
+ * Ignored at this poller: all the ready completions are always dispatched before waiting again, 
+ * up to the size of the completion ring.
+ */
+void onion_poller_set_max_events(onion_poller *p, int max_events, int max_events_limit){
+	ONION_DEBUG("io_uring poller dispatches all ready completions, ignoring max events %d", max_events);
+}
+
+/**
+ * @short Gets the poller event counters
+ * @memberof onion_poller_t
+ * 
+ * events/wakeups is the mean of completions handled after each wait.
+ * 
+ * @param wakeups Waits after which there were completions. May be NULL.
+ * @param events Total completions. May be NULL.
+ */
+void onion_poller_get_event_stats(onion_poller *p, unsigned long *wakeups, unsigned long *events){
+	if (wakeups)
+		*wakeups=p->wakeups;
+	if (events)
+		*events=p->events;
+}
+
+/**
+ * @short Measures where the poller threads spend their time
+ * @memberof onion_poller_t
+ * 
+ * The time waiting for events, and running the callbacks, added for all the threads of this poller, 
+ * for onion_poller_get_profile. Each thread of O_REUSEPORT has a poller of its own, so there it is per
+ * thread. The events per wakeup are at onion_poller_get_event_stats.
+ * 
+ * Callbacks that hold the thread more than stall_ms are logged, rate limited, with the fd, the path of 
+ * the request and the address of the last handler called, as addr2line or gdb can resolve: these are the 
+ * handlers that block the event loop, and should be at onion_set_workers or suspend the request.
+ * 
+ * It costs two clock_gettime per event while on. It can be changed while polling.
+ * 
+ * @param stall_ms Stall threshold, in ms, or 0 to only measure, or <0 to stop measuring.
+ */
+void onion_poller_set_profiling(onion_poller *p, int stall_ms){
+	p->stall_ms=stall_ms;
+}
+
+/**
+ * @short Gets the times measured since onion_poller_set_profiling
+ * @memberof onion_poller_t
+ */
+void onion_poller_get_profile(onion_poller *p, onion_poller_profile *profile){
+	profile->wait_us=__atomic_load_n(&p->profile.wait_us, __ATOMIC_RELAXED);
+	profile->callbacks_us=__atomic_load_n(&p->profile.callbacks_us, __ATOMIC_RELAXED);
+	profile->max_callback_us=__atomic_load_n(&p->profile.max_callback_us, __ATOMIC_RELAXED);
+	profile->stalls=__atomic_load_n(&p->profile.stalls, __ATOMIC_RELAXED);
+}
+
+/**
+ * @short Notes the handler that the callback of this thread calls, and the path of its request.
+ * 
+ * Only if the poller of this thread is profiling; else it just returns.
+ */
+void onion_poller_note_handler(void *handler, onion_request *req){
+	if (!onion_poller_current.profiling)
+		return;
+	onion_poller_current.handler=handler;
+	const char *path=req ? onion_request_get_fullpath(req) : NULL;
+	snprintf(onion_poller_current.path, sizeof(onion_poller_current.path), "%s", path ? path : "");
+}
+
+/// Current monotonic time, in microseconds.
+static int64_t onion_poller_now_us(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+/// Starts measuring a callback, if profiling. Returns its start time, or 0.
+static int64_t onion_poller_callback_start(onion_poller *p){
+	if (p->stall_ms<0)
+		return 0;
+	onion_poller_current.profiling=1;
+	onion_poller_current.handler=NULL;
+	onion_poller_current.path[0]='\0';
+	return onion_poller_now_us();
+}
+
+/// Adds the time of the callback, and logs it if it stalled the thread.
+static void onion_poller_callback_end(onion_poller *p, onion_poller_slot *el, int64_t start){
+	if (!start)
+		return;
+	onion_poller_current.profiling=0;
+	unsigned long us=onion_poller_now_us()-start;
+	__atomic_fetch_add(&p->profile.callbacks_us, us, __ATOMIC_RELAXED);
+	unsigned long max=__atomic_load_n(&p->profile.max_callback_us, __ATOMIC_RELAXED);
+	while (us>max && !__atomic_compare_exchange_n(&p->profile.max_callback_us, &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	if (p->stall_ms>0 && us>=p->stall_ms*1000UL){
+		__atomic_fetch_add(&p->profile.stalls, 1, __ATOMIC_RELAXED);
+		ONION_WARNING_RATELIMITED("Poller thread stalled %ld ms at the callback of fd %d, path '%s', handler %p", 
+		                          (long)(us/1000), el->fd, onion_poller_current.path, onion_poller_current.handler);
+	}
+}
+
+/**
+ * @short Calls the accepted callback for a completion of a multishot accept. Called locked, returns unlocked.
+ * 
+ * Completions of the same accept may be at several threads at once, so the slot counts its callbacks running,
+ * and if it was removed meanwhile, the last one frees it. If the kernel ended the multishot, as when the
+ * completion queue overflowed, it is queued again.
+ */
+static void onion_poller_dispatch_accept(onion_poller *p, onion_poller_slot *el, int res, int more){
+	el->running++;
+	pthread_mutex_unlock(&p->mutex);
+	__sync_fetch_and_add(&p->events, 1);
+	int64_t start=onion_poller_callback_start(p);
+	int n=el->accepted(el->data, res);
+	onion_poller_callback_end(p, el, start);
+
+	pthread_mutex_lock(&p->mutex);
+	el->running--;
+	int can_free=0;
+	if (p->slots[el->fd]!=el){ // Removed meanwhile, so a zombie, and its shutdown was already called
+		if (onion_poller_zombie_done(p, el)){
+			pthread_mutex_unlock(&p->mutex);
+			onion_poller_slot_free(el);
+			return;
+		}
+	}
+	else if (n<0){
+		can_free=onion_poller_unlink_slot(p, el);
+		pthread_mutex_unlock(&p->mutex);
+		onion_poller_release_slot(el, can_free);
+		return;
+	}
+	else if (!more)
+		onion_poller_queue_poll(p, el);
+	pthread_mutex_unlock(&p->mutex);
+}
+
+/**
+ * @short Do the event polling.
+ * @memberof onion_poller_t
+ *
+ * It loops over polling. To exit polling call onion_poller_stop().
+ *
+ * Several threads can poll at the same time; each completion is dispatched to only one of them.
+ */
+void onion_poller_poll(onion_poller *p){
+	ONION_DEBUG("Start polling");
+	p->stop=0;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&p->mutex);
+	p->npollers++;
+	pthread_mutex_unlock(&p->mutex);
+#endif
+	int waited=1; // Completions may be ready before the first wait.
+	int dispatched=0; // Completions since the batch callback
+	onion_poller *prev_polling=onion_poller_polling;
+	onion_poller_polling=p;
+	while (!p->stop && p->head){
+		pthread_mutex_lock(&p->mutex);
+		int64_t now=onion_poller_now();
+		while (p->ntimeouts && p->timeouts[0]->timeout_limit <= now){
+			onion_poller_slot *cur=p->timeouts[0];
+			if (cur->idle && !cur->idled && cur->idle_ms<cur->timeout){ // Idle first, and then the rest of the timeout
+				cur->idled=1;
+				cur->timeout_limit+=cur->timeout-cur->idle_ms;
+				onion_poller_timeout_fix(p, 0);
+				cur->idle(cur->idle_data);
+				continue;
+			}
+			if (cur->timer){ // Out of the lock, as it may take long or add more timers
+				onion_poller_timeout_disarm(p, cur);
+				pthread_mutex_unlock(&p->mutex);
+				((void (*)(void *))cur->f)(cur->data);
+				onion_poller_timer_free(cur);
+				pthread_mutex_lock(&p->mutex);
+				if (p->head && p->head->next==NULL && !p->ntimeouts) // Only this timer kept it running
+					onion_poller_stop(p);
+				continue;
+			}
+			ONION_DEBUG0("Timeout on %d", cur->fd);
+			ONION_TRACE(slot_timeout, cur->fd);
+			onion_poller_remove_slot(p, cur);
+		}
+
+		unsigned head=*p->cq_head;
+		if (head == __atomic_load_n(p->cq_tail, __ATOMIC_ACQUIRE)){ // Nothing ready, submit and wait.
+			if (p->batch && dispatched){ // Before waiting, and then check again, as it may add more.
+				pthread_mutex_unlock(&p->mutex);
+				dispatched=0;
+				p->batch(p->batch_data);
+				continue;
+			}
+			int to_submit=p->pending;
+			p->pending=0;
+			int timeout=onion_poller_get_next_timeout(p, now);
+			pthread_mutex_unlock(&p->mutex);
+
+			int64_t wait_start=(p->stall_ms>=0) ? onion_poller_now_us() : 0;
+			int r=onion_poller_enter(p, to_submit, timeout);
+			if (wait_start)
+				__atomic_fetch_add(&p->profile.wait_us, onion_poller_now_us()-wait_start, __ATOMIC_RELAXED);
+			ONION_TRACE(poller_wakeup, p->fd, r, timeout);
+			waited=1;
+			if (r<0 && errno!=ETIME && errno!=EINTR && errno!=EBUSY){
+				ONION_ERROR("Error waiting at io_uring: %s", strerror(errno));
+			}
+			if (r<to_submit){ // Not all submitted, keep them as pending
+				pthread_mutex_lock(&p->mutex);
+				p->pending+=to_submit-(r>0 ? r : 0);
+				pthread_mutex_unlock(&p->mutex);
+			}
+			continue;
+		}
+		if (waited){
+			__sync_fetch_and_add(&p->wakeups, 1);
+			waited=0;
+		}
+		struct io_uring_cqe *cqe=&p->cqes[head & *p->cq_mask];
+		onion_poller_slot *el=(onion_poller_slot*)(uintptr_t)cqe->user_data;
+		int res=cqe->res;
+		unsigned flags=cqe->flags;
+		__atomic_store_n(p->cq_head, head+1, __ATOMIC_RELEASE);
+
+		if (!el){ // Completion of a cancel, or of the send or shutdown of onion_poller_send_close
+			pthread_mutex_unlock(&p->mutex);
+			continue;
+		}
+		if ((uintptr_t)el&1){ // The close of onion_poller_send_close, so its data is not needed anymore
+			p->closing--;
+			pthread_mutex_unlock(&p->mutex);
+			free((void*)((uintptr_t)el&~(uintptr_t)1));
+			continue;
+		}
+		int more=(flags&IORING_CQE_F_MORE);
+		if (!more)
+			el->polling=0;
+		int received=el->receiving;
+		int bid=(flags&IORING_CQE_F_BUFFER) ? (int)(flags>>IORING_CQE_BUFFER_SHIFT) : -1;
+		dispatched=1;
+		if (!el->poller || (p->slots[el->fd]!=el)){ // A zombie, removed while polling
+			if (el->accepted && res>=0) // Nobody takes this connection
+				close(res);
+			if (bid>=0)
+				onion_poller_buffer_give_back(p, bid);
+			int can_free=onion_poller_zombie_done(p, el);
+			pthread_mutex_unlock(&p->mutex);
+			if (can_free)
+				onion_poller_slot_free(el); // Its shutdown was already called
+			continue;
+		}
+		if (el->accepted){
+			onion_poller_dispatch_accept(p, el, res, more);
+			continue;
+		}
+		// I also take care of the timeout, no timeout when on the handler, it should handle it itself.
+		onion_poller_timeout_disarm(p, el);
+		pthread_mutex_unlock(&p->mutex);
+		__sync_fetch_and_add(&p->events, 1);
+
+		int n=-1;
+		if (received && res==-ENOBUFS){ // All the buffers in use: this time it is polled, and the callback reads.
+			el->poll_once=1;
+			n=OCS_PROCESSED;
+		}
+		else if (res>=0){
+			int64_t start=onion_poller_callback_start(p);
+			if (received)
+				n=el->received(el->data, bid>=0 ? onion_poller_buffer(p, bid) : NULL, res);
+			else
+				n=el->f(el->data);
+			onion_poller_callback_end(p, el, start);
+		}
+		else
+			ONION_DEBUG("Poll error on fd %d: %s", el->fd, strerror(-res));
+		if (bid>=0){
+			pthread_mutex_lock(&p->mutex);
+			onion_poller_buffer_give_back(p, bid);
+			pthread_mutex_unlock(&p->mutex);
+		}
+		if (n==OCS_YIELD) // Somebody else owns it now, and will onion_poller_slot_resume it.
+			continue;
+
+		if (n<0){
+			onion_poller_remove_slot(p, el);
+		}
+		else{
+			pthread_mutex_lock(&p->mutex);
+			if (el->timeout>0)
+				onion_poller_timeout_arm(p, el);
+			onion_poller_queue_poll(p, el); // Submitted at next wait, no syscall just for this.
+			pthread_mutex_unlock(&p->mutex);
+		}
+	}
+	ONION_DEBUG("Finished polling fds");
+	onion_poller_polling=prev_polling;
+	pthread_mutex_lock(&p->mutex);
+	onion_poller_submit(p); // What waited for the next wait, as the closes of onion_poller_send_close
+#ifdef HAVE_PTHREADS
+	p->npollers--;
+#endif
+	pthread_mutex_unlock(&p->mutex);
+}
+
+/**
+ * @short Resumes polling on a slot whose callback returned OCS_YIELD
+ * @memberof onion_poller_slot_t
+ * 
+ * May be called from any thread. The poll is submitted right away.
+ */
+void onion_poller_slot_resume(onion_poller_slot *el){
+	onion_poller *p=el->poller;
+	pthread_mutex_lock(&p->mutex);
+	if (el->timeout>0)
+		onion_poller_timeout_arm(p, el);
+	onion_poller_queue_poll(p, el);
+	onion_poller_submit(p);
+	pthread_mutex_unlock(&p->mutex);
+}
+
+/**
+ * @short Calls f(data) soon, from a poller thread
+ * @memberof onion_poller_t
+ * 
+ * May be called from any thread. It uses the poller eventfd to wake up the poller. Calls are done in 
+ * order, one after the other.
+ */
+void onion_poller_call(onion_poller *p, void (*f)(void *), void *data){
+	onion_poller_deferred *call=malloc(sizeof(onion_poller_deferred));
+	call->f=f;
+	call->data=data;
+	call->next=NULL;
+	
+	pthread_mutex_lock(&p->mutex);
+	if (p->calls_last)
+		p->calls_last->next=call;
+	else
+		p->calls=call;
+	p->calls_last=call;
+	pthread_mutex_unlock(&p->mutex);
+	
+	uint64_t one=1;
+	if (write(p->eventfd, &one, sizeof(one))<0)
+		ONION_ERROR("Error signaling poller: %s", strerror(errno));
+}
+
+/**
+ * @short Sets a function to call after each batch of completions, before waiting again
+ * @memberof onion_poller_t
+ * 
+ * It is called at the thread that got the batch, so work the callbacks left for later, as the requests
+ * queued for work stealing, is done there. Set it before polling.
+ * 
+ * @returns 0, as it is supported by this poller.
+ */
+int onion_poller_set_batch_callback(onion_poller *p, void (*f)(void *), void *data){
+	p->batch=f;
+	p->batch_data=data;
+	return 0;
+}
+
+/**
+ * @short Wakes up a thread waiting at the poller, that then calls the batch callback
+ * @memberof onion_poller_t
+ * 
+ * May be called from any thread.
+ */
+void onion_poller_wakeup(onion_poller *p){
+	uint64_t one=1;
+	if (write(p->eventfd, &one, sizeof(one))<0)
+		ONION_ERROR("Error signaling poller: %s", strerror(errno));
+}
+
+/**
+ * @short Calls f(data) once from a poller thread, after ms milliseconds
+ * @memberof onion_poller_t
+ * 
+ * May be called from any thread. The timer is just an entry at the timeouts heap, which already sets
+ * how long the poller waits, so it needs no file descriptor nor syscalls, except waking up the poller
+ * when it is the new earliest timeout.
+ * If the poller is freed before, f is not called.
+ * 
+ * @returns 0 if the timer was added, or -1 on error.
+ */
+int onion_poller_add_timer(onion_poller *p, int ms, void (*f)(void *), void *data){
+	onion_poller_slot *el=onion_slab_calloc(sizeof(onion_poller_slot));
+	if (!el){
+		ONION_ERROR("Could not create a timer");
+		return -1;
+	}
+	onion_memory_count(ONION_MEMORY_POLLER, sizeof(onion_poller_slot));
+	el->fd=-1;
+	el->timer=1;
+	el->f=(void*)f;
+	el->data=data;
+	el->timeout=(ms<0) ? 0 : ms;
+	el->timeout_pos=-1;
+	el->poller=p;
+	pthread_mutex_lock(&p->mutex);
+	onion_poller_timeout_arm(p, el);
+	int first=(el->timeout_pos==0);
+	pthread_mutex_unlock(&p->mutex);
+	if (first) // Pollers may be waiting for a later timeout
+		onion_poller_wakeup(p);
+	return 0;
+}
+
+/// Frees a timer without calling it.
+static void onion_poller_timer_free(onion_poller_slot *el){
+	onion_memory_count(ONION_MEMORY_POLLER, -(long)sizeof(onion_poller_slot));
+	onion_slab_free(el, sizeof(onion_poller_slot));
+}
+
+/**
+ * @short Whether onion_poller_send_close sends and closes at the kernel
+ * @memberof onion_poller_t
+ * 
+ * Only at Linux 5.19 or later, as for the buffer ring, so the connections that would send with the close
+ * do not need one check for each operation.
+ */
+int onion_poller_can_send_close(onion_poller *p){
+	return p->buf_ring!=NULL;
+}
+
+/**
+ * @short Sends the data, and then shuts down and closes the fd, without waiting for them
+ * @memberof onion_poller_t
+ * 
+ * For the last response of a connection that closes: an IORING_OP_SEND, IORING_OP_SHUTDOWN and IORING_OP_CLOSE,
+ * hard linked at the submission queue, so the kernel does them in order, and closes even if the send fails.
+ * From the poll loop of this poller they go with its next wait, with no syscall of their own; from other threads
+ * they are submitted now, one syscall for the three. The data is copied; if there is none, it only shuts down
+ * and closes. The fd must not be at the poller, nor be used after.
+ * 
+ * May be called from any thread.
+ * 
+ * @returns 0 if queued, or -1 if not, as the poller is being freed, and then nothing was done.
+ */
+int onion_poller_send_close(onion_poller *p, int fd, const char *data, size_t len){
+	char *copy=malloc(len ? len : 1);
+	if (!copy)
+		return -1;
+	if (len)
+		memcpy(copy, data, len);
+	pthread_mutex_lock(&p->mutex);
+	if (p->fd>=0 && *p->sq_tail - __atomic_load_n(p->sq_head, __ATOMIC_ACQUIRE) > p->sq_entries-3) // The three must go at the same submission
+		onion_poller_submit(p);
+	if (p->fd<0 || *p->sq_tail - __atomic_load_n(p->sq_head, __ATOMIC_ACQUIRE) > p->sq_entries-3){
+		pthread_mutex_unlock(&p->mutex);
+		free(copy);
+		return -1;
+	}
+	struct io_uring_sqe *sqe;
+	if (len){
+		sqe=onion_poller_get_sqe(p);
+		sqe->opcode=IORING_OP_SEND;
+		sqe->fd=fd;
+		sqe->addr=(uint64_t)(uintptr_t)copy;
+		sqe->len=len;
+		sqe->msg_flags=MSG_NOSIGNAL|MSG_WAITALL;
+		sqe->flags=IOSQE_IO_HARDLINK;
+		onion_poller_push_sqe(p);
+	}
+	sqe=onion_poller_get_sqe(p);
+	sqe->opcode=IORING_OP_SHUTDOWN;
+	sqe->fd=fd;
+	sqe->len=SHUT_RDWR;
+	sqe->flags=IOSQE_IO_HARDLINK;
+	onion_poller_push_sqe(p);
+	sqe=onion_poller_get_sqe(p);
+	sqe->opcode=IORING_OP_CLOSE;
+	sqe->fd=fd;
+	sqe->user_data=(uint64_t)(uintptr_t)copy|1;
+	onion_poller_push_sqe(p);
+	p->closing++;
+	if (onion_poller_polling!=p)
+		onion_poller_submit(p);
+	pthread_mutex_unlock(&p->mutex);
+	return 0;
+}
+
+/**
+ * @short Marks the poller to stop ASAP
+ * @memberof onion_poller_t
+ */
+void onion_poller_stop(onion_poller *p){
+  ONION_DEBUG("Stopping poller");
+  p->stop=1;
+  char data[8]={0,0,0,0, 0,0,0,1};
+  int __attribute__((unused)) r=read(p->eventfd, data, 8); // Flush eventfd data, discard data
+
+	pthread_mutex_lock(&p->mutex);
+  int n=p->npollers;
+	pthread_mutex_unlock(&p->mutex);
+
+  if (n>0){
+		int w=write(p->eventfd,data,8); // Tell another thread to exit
+		if (w<0){
+			ONION_ERROR("Error signaling poller to stop!");
+		}
+	}
+	else
+		ONION_DEBUG("Poller stopped");
+}
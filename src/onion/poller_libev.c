@@ -24,15 +24,61 @@
 	*/
 
 #include <ev.h>
+#include <pthread.h>
 #include <stdlib.h>
-#include <semaphore.h>
+#include <string.h>
 
 #include "poller.h"
+#include "memory.h"
 #include "log.h"
 
-struct onion_poller_t{
+/**
+ * @short The event loop of one of the threads that poll. Each thread has its own, and the slots are spread among them.
+ * 
+ * libev loops are not thread safe, so each has a mutex, held by its thread but while it waits for events
+ * and at the slot callbacks. The other threads take it to change its watchers, and then wake it up.
+ */
+typedef struct onion_poller_loop_t{
 	struct ev_loop *loop;
-	sem_t sem;
+	pthread_mutex_t mutex;
+	ev_async wake;        ///< Sent from any thread to wake it up: runs the queued calls, and the batch callback.
+	onion_poller *poller;
+	char polling;         ///< A thread runs this loop now
+}onion_poller_loop;
+
+/// A call queued with onion_poller_call
+typedef struct onion_poller_deferred_t{
+	void (*f)(void *);
+	void *data;
+	struct onion_poller_deferred_t *next;
+}onion_poller_deferred;
+
+/// A one shot timer, added with onion_poller_add_timer
+typedef struct onion_poller_timer_t{
+	ev_timer timer;
+	void (*f)(void *);
+	void *data;
+	onion_poller_loop *loop;
+	struct onion_poller_timer_t *prev;
+	struct onion_poller_timer_t *next;
+}onion_poller_timer;
+
+/// The poller mutex is always taken before the one of a loop, never while holding it.
+struct onion_poller_t{
+	pthread_mutex_t mutex;
+	onion_poller_loop **loops;   ///< The first is created with the poller, the rest as more threads poll.
+	int nloops;
+	int next_loop;               ///< Where the next slot goes, round robin
+	onion_poller_slot *head;     ///< Doubly linked list of all slots
+	onion_poller_slot **slots;   ///< Slots indexed by fd, for onion_poller_remove.
+	int slots_size;
+	onion_poller_timer *timers;
+	onion_poller_deferred *calls;      ///< Calls queued by onion_poller_call. FIFO.
+	onion_poller_deferred *calls_last;
+	void (*batch)(void *);       ///< Called after each batch of events. @see onion_poller_set_batch_callback
+	void *batch_data;
+	unsigned long wakeups;       ///< Loop iterations with events. Atomic.
+	unsigned long events;        ///< Events dispatched to a slot. Atomic.
 	volatile int stop;
 };
 
@@ -40,41 +86,63 @@ struct onion_poller_slot_t{
 	int fd;
 	int timeout;
 	int type;
-	ev_io ev;
+	int idle_ms;
+	void (*idle)(void*);
+	void *idle_data;
+	char idled;     ///< The idle function was called since the last event
+	char linked;    ///< At the poller list. With the poller locked.
+	char running;   ///< At its callback, so a remove leaves the free to it. With the loop locked.
+	char removed;   ///< With the loop locked.
+	ev_io io;
+	ev_timer timer;
 	void *data;
 	int (*f)(void*);
 	void *shutdown_data;
 	void (*shutdown)(void*);
 	onion_poller *poller;
+	onion_poller_loop *loop;
+	onion_poller_slot *prev;
+	onion_poller_slot *next;
 };
 
+/// The loop of this thread, if it polls, so changes to it do not need a wake up.
+static __thread onion_poller_loop *onion_poller_current_loop=NULL;
+
 /// Create a new slot for the poller
 onion_poller_slot *onion_poller_slot_new(int fd, int (*f)(void*), void *data){
 	onion_poller_slot *ret=calloc(1, sizeof(onion_poller_slot));
+	onion_memory_count(ONION_MEMORY_POLLER, sizeof(onion_poller_slot));
 	ret->fd=fd;
 	ret->f=f;
 	ret->data=data;
-	ret->type=EV_READ | EV_WRITE;
+	ret->timeout=-1;
+	ret->type=EV_READ;
 	
 	return ret;
 }
 
-/// Cleans a poller slot. Do not call if already on the poller (onion_poller_add). Use onion_poller_remove instead.
+/// Cleans a poller slot, calling shutdown if any. Do not call if already on the poller (onion_poller_add). Use onion_poller_remove instead.
 void onion_poller_slot_free(onion_poller_slot *el){
-	if (el->poller)
-		ev_io_stop(el->poller->loop, &el->ev);
 	if (el->shutdown)
 		el->shutdown(el->shutdown_data);
+	onion_memory_count(ONION_MEMORY_POLLER, -(long)sizeof(onion_poller_slot));
+	free(el);
 }
 /// Sets the shutdown function for this poller slot
 void onion_poller_slot_set_shutdown(onion_poller_slot *el, void (*shutdown)(void*), void *data){
 	el->shutdown=shutdown;
 	el->shutdown_data=data;
 }
-/// Sets the timeout for this slot. Current implementation takes ms, but then it rounds to seconds.
+/// Sets the timeout for this slot, in milliseconds, rearmed at each event. <0 means no timeout.
 void onion_poller_slot_set_timeout(onion_poller_slot *el, int timeout_ms){
 	el->timeout=timeout_ms;
 }
+/// Sets a function to call once when the slot waits idle_ms without events, before its timeout.
+void onion_poller_slot_set_idle(onion_poller_slot *el, int idle_ms, void (*idle)(void*), void *data){
+	el->idle_ms=idle_ms;
+	el->idle=idle;
+	el->idle_data=data;
+}
 /// Sets the polling type: read/write/other. O_POLL_READ | O_POLL_WRITE | O_POLL_OTHER
 void onion_poller_slot_set_type(onion_poller_slot *el, int type){
 	el->type=0;
@@ -84,81 +152,516 @@ void onion_poller_slot_set_type(onion_poller_slot *el, int type){
 		el->type|=EV_WRITE;
 }
 
+/// Edge triggered slots. Not supported, the slots are watched as always.
+int onion_poller_slot_set_edge_triggered(onion_poller_slot *el){
+	return -1;
+}
+
+/// Tells the slot read until EAGAIN. Not supported, does nothing.
+void onion_poller_slot_set_drained(onion_poller_slot *el){
+}
+
+/// Accepts at the poller. Not supported, the slot callback accepts as always.
+int onion_poller_slot_set_accept(onion_poller_slot *el, int (*accepted)(void *data, int fd)){
+	return -1;
+}
+
+/// Reads at the poller. Not supported, the slot callback reads as always.
+int onion_poller_slot_set_recv(onion_poller_slot *el, int (*received)(void *data, const char *buffer, size_t len)){
+	return -1;
+}
+
+/**
+ * @short ev_init, without its type punning.
+ * 
+ * The ev_init macro gives a "dereferencing type-punned pointer will break strict-aliasing rules" 
+ * error on some gcc versions, so this is what it expands to, more or less.
+ */
+static void onion_poller_watcher_init(ev_watcher *w, void *cb, void *data){
+	w->active=0;
+	w->pending=0;
+	w->priority=0;
+	w->cb=cb;
+	w->data=data;
+}
+
+/// ev_timer_set, one shot in ms, also without the type punning.
+static void onion_poller_timer_set(ev_timer *w, int ms){
+	w->at=ms/1000.0;
+	w->repeat=0.;
+}
+
+/// Wakes up the loop, if not at its own thread, so it sees the changes to its watchers.
+static void onion_poller_loop_changed(onion_poller_loop *loop){
+	if (loop!=onion_poller_current_loop)
+		ev_async_send(loop->loop, &loop->wake);
+}
+
+/// Wakes up all the loops, so they check the stop flag and call the batch callback. With the poller locked.
+static void onion_poller_wake_all(onion_poller *p){
+	int i;
+	for (i=0;i<p->nloops;i++)
+		ev_async_send(p->loops[i]->loop, &p->loops[i]->wake);
+}
+
+/// Stops when nothing is left to poll, as the epoll poller. With the poller locked.
+static void onion_poller_check_empty(onion_poller *p){
+	if (!p->head && !p->timers && !p->calls){
+		ONION_DEBUG0("Removed last, stopping poll");
+		p->stop=1;
+		onion_poller_wake_all(p);
+	}
+}
+
+/// Unlinks the slot from the poller, that must be locked. Does nothing if already unlinked.
+static void onion_poller_unlink_slot(onion_poller *p, onion_poller_slot *el){
+	if (!el->linked)
+		return;
+	el->linked=0;
+	if (el->prev)
+		el->prev->next=el->next;
+	else
+		p->head=el->next;
+	if (el->next)
+		el->next->prev=el->prev;
+	if (p->slots[el->fd]==el)
+		p->slots[el->fd]=NULL;
+	onion_poller_check_empty(p);
+}
+
+/**
+ * @short Watches the slot until its next event, or for ms. With the loop locked.
+ * 
+ * Events are one shot, as at the epoll poller: the slot is not watched while at its callback, and
+ * then with its type at that moment.
+ */
+static void onion_poller_slot_arm(onion_poller_slot *el, int ms){
+	struct ev_loop *l=el->loop->loop;
+	ev_io_set(&el->io, el->fd, el->type);
+	ev_io_start(l, &el->io);
+	if (ms>0){
+		ev_now_update(l); // May be stale, if not at the loop thread.
+		onion_poller_timer_set(&el->timer, ms);
+		ev_timer_start(l, &el->timer);
+	}
+}
+
+/// Arms the slot after an event: its timeout, or before it the idle time.
+static void onion_poller_slot_rearm(onion_poller_slot *el){
+	el->idled=0;
+	int ms=el->timeout;
+	if (ms>0 && el->idle && el->idle_ms<ms)
+		ms=el->idle_ms;
+	onion_poller_slot_arm(el, ms);
+}
+
+/**
+ * @short An event, or the timeout, of a slot. At the thread of its loop, with it locked.
+ */
+static void onion_poller_slot_event(onion_poller_slot *el, int timeout){
+	onion_poller_loop *loop=el->loop;
+	onion_poller *p=el->poller;
+	ev_io_stop(loop->loop, &el->io);
+	ev_timer_stop(loop->loop, &el->timer);
+	
+	int idle=0, n=-1;
+	if (timeout && el->idle && !el->idled && el->idle_ms<el->timeout){ // Idle first, and then the rest of the timeout
+		idle=1;
+		el->idled=1;
+	}
+	if (!timeout || idle){
+		el->running=1;
+		pthread_mutex_unlock(&loop->mutex);
+		__sync_fetch_and_add(&p->events, 1);
+		if (idle)
+			el->idle(el->idle_data);
+		else
+			n=el->f(el->data);
+		pthread_mutex_lock(&loop->mutex);
+		el->running=0;
+	}
+	else
+		ONION_DEBUG0("Timeout on %d", el->fd);
+	
+	if (el->removed || (n<0 && !idle)){ // Now, or removed while at the callback
+		el->removed=1;
+		pthread_mutex_unlock(&loop->mutex);
+		pthread_mutex_lock(&p->mutex);
+		onion_poller_unlink_slot(p, el);
+		pthread_mutex_unlock(&p->mutex);
+		onion_poller_slot_free(el);
+		pthread_mutex_lock(&loop->mutex);
+		return;
+	}
+	if (idle)
+		onion_poller_slot_arm(el, el->timeout-el->idle_ms);
+	else if (n!=OCS_YIELD) // Else somebody else owns it now, and will onion_poller_slot_resume it.
+		onion_poller_slot_rearm(el);
+}
+
+static void onion_poller_io(struct ev_loop *l, ev_io *w, int revents){
+	onion_poller_slot_event(w->data, 0);
+}
+
+static void onion_poller_timeout(struct ev_loop *l, ev_timer *w, int revents){
+	onion_poller_slot_event(w->data, 1);
+}
+
+/// The loop was woken up: runs the queued calls. The batch callback is called after.
+static void onion_poller_wake(struct ev_loop *l, ev_async *w, int revents){
+	onion_poller_loop *loop=w->data;
+	onion_poller *p=loop->poller;
+	pthread_mutex_unlock(&loop->mutex);
+	pthread_mutex_lock(&p->mutex);
+	onion_poller_deferred *call=p->calls;
+	p->calls=p->calls_last=NULL;
+	pthread_mutex_unlock(&p->mutex);
+	while (call){
+		onion_poller_deferred *next=call->next;
+		call->f(call->data);
+		free(call);
+		call=next;
+	}
+	pthread_mutex_lock(&loop->mutex);
+}
+
+/// The loop is about to wait for events: lets the other threads change it.
+static void onion_poller_loop_release(struct ev_loop *l){
+	pthread_mutex_unlock(&((onion_poller_loop*)ev_userdata(l))->mutex);
+}
+
+/// The loop got events.
+static void onion_poller_loop_acquire(struct ev_loop *l){
+	pthread_mutex_lock(&((onion_poller_loop*)ev_userdata(l))->mutex);
+}
+
+/// Creates a loop for one more thread. With the poller locked.
+static onion_poller_loop *onion_poller_loop_new(onion_poller *p){
+	onion_poller_loop *loop=calloc(1, sizeof(onion_poller_loop));
+	loop->loop=ev_loop_new(EVFLAG_AUTO);
+	loop->poller=p;
+	pthread_mutex_init(&loop->mutex, NULL);
+	ev_set_userdata(loop->loop, loop);
+	ev_set_loop_release_cb(loop->loop, onion_poller_loop_release, onion_poller_loop_acquire);
+	onion_poller_watcher_init((ev_watcher*)&loop->wake, onion_poller_wake, loop);
+	ev_async_start(loop->loop, &loop->wake);
+	p->loops=realloc(p->loops, sizeof(onion_poller_loop*)*(p->nloops+1));
+	p->loops[p->nloops++]=loop;
+	return loop;
+}
+
+/**
+ * @short The loop for the next slot. With the poller locked.
+ * 
+ * The first loop keeps what was added before the other threads polled, as the listen sockets, and the 
+ * rest goes round robin to the other loops. So a blocking handler never holds the accepts, as 
+ * at the epoll poller where any free thread takes the next event.
+ */
+static onion_poller_loop *onion_poller_next_loop(onion_poller *p){
+	if (p->nloops==1)
+		return p->loops[0];
+	return p->loops[1 + (p->next_loop++ % (p->nloops-1))];
+}
+
 /// Create a new poller
 onion_poller *onion_poller_new(int aprox_n){
 	onion_poller *ret=calloc(1,sizeof(onion_poller));
-	ret->loop=ev_default_loop(0);
-	sem_init(&ret->sem, 0, 1);
+	pthread_mutex_init(&ret->mutex, NULL);
+	onion_poller_loop_new(ret);
 	return ret;
 }
 
-/// Frees the poller. It first stops it.
+/// Frees the poller, with its slots and timers. It first stops it.
 void onion_poller_free(onion_poller *p){
-	free(p);
-}
-
-static void event_callback(struct ev_loop *loop, ev_io *w, int revents){
-	onion_poller_slot *s=w->data;
-	int res=s->f(s->data);
-	if (res<0){
-		onion_poller_slot_free(s);
+	onion_poller_stop(p);
+	while (p->head){
+		onion_poller_slot *next=p->head->next;
+		ev_io_stop(p->head->loop->loop, &p->head->io);
+		ev_timer_stop(p->head->loop->loop, &p->head->timer);
+		onion_poller_slot_free(p->head);
+		p->head=next;
+	}
+	while (p->timers){ // Not called, as the poller is gone.
+		onion_poller_timer *next=p->timers->next;
+		ev_timer_stop(p->timers->loop->loop, &p->timers->timer);
+		free(p->timers);
+		p->timers=next;
 	}
+	while (p->calls){
+		onion_poller_deferred *next=p->calls->next;
+		free(p->calls);
+		p->calls=next;
+	}
+	int i;
+	for (i=0;i<p->nloops;i++){
+		ev_async_stop(p->loops[i]->loop, &p->loops[i]->wake);
+		ev_loop_destroy(p->loops[i]->loop);
+		pthread_mutex_destroy(&p->loops[i]->mutex);
+		free(p->loops[i]);
+	}
+	free(p->loops);
+	free(p->slots);
+	pthread_mutex_destroy(&p->mutex);
+	free(p);
 }
 
-/// Adds a slot to the poller
+/**
+ * @short Adds a slot to the poller
+ * 
+ * Each slot goes to the loop of one of the threads that poll. @see onion_poller_next_loop
+ */
 int onion_poller_add(onion_poller *poller, onion_poller_slot *el){
+	pthread_mutex_lock(&poller->mutex);
+	if (el->fd>=poller->slots_size){
+		int size=poller->slots_size ? poller->slots_size : 64;
+		while (size<=el->fd)
+			size*=2;
+		poller->slots=realloc(poller->slots, sizeof(onion_poller_slot*)*size);
+		memset(poller->slots+poller->slots_size, 0, sizeof(onion_poller_slot*)*(size-poller->slots_size));
+		poller->slots_size=size;
+	}
 	el->poller=poller;
-
-	// normally would use ev_io_init bellow, but gcc on F18+ give a 
-	// "dereferencing type-punned pointer will break strict-aliasing rules" error
-	// So the macro must be expanded and this is what we get. In the future this may
-	// give bugs on libevent if this changes.
+	el->loop=onion_poller_next_loop(poller);
+	el->prev=NULL;
+	el->next=poller->head;
+	if (el->next)
+		el->next->prev=el;
+	poller->head=el;
+	poller->slots[el->fd]=el;
+	el->linked=1;
+	onion_poller_watcher_init((ev_watcher*)&el->io, onion_poller_io, el);
+	onion_poller_watcher_init((ev_watcher*)&el->timer, onion_poller_timeout, el);
 	
-	//ev_io_init(&el->ev, event_callback, el->fd, el->type);
-	// expands to ev_init + ev_io_set. ev_init expand more or less as bellow
+	pthread_mutex_lock(&el->loop->mutex);
+	onion_poller_slot_rearm(el);
+	onion_poller_loop_changed(el->loop);
+	pthread_mutex_unlock(&el->loop->mutex);
+	pthread_mutex_unlock(&poller->mutex);
+	return 1;
+}
 
-	//ev_init(&el->ev, event_callback);
-	{
-		ev_watcher *ew=(void *)(&el->ev); // ew must exit to prevent the before mentioned error.
-		ew->active  = 0;
-		ew->pending = 0;	
-		ew->priority = 0;
-		el->ev.cb = event_callback;
+/**
+ * @short Removes a fd from the poller, and frees its slot
+ * 
+ * If its callback is running, the slot is freed when it returns.
+ */
+int onion_poller_remove(onion_poller *poller, int fd){
+	pthread_mutex_lock(&poller->mutex);
+	onion_poller_slot *el=NULL;
+	int free_now=0;
+	if (fd>=0 && fd<poller->slots_size)
+		el=poller->slots[fd];
+	if (el){
+		onion_poller_unlink_slot(poller, el);
+		pthread_mutex_lock(&el->loop->mutex);
+		if (!el->removed){ // Else its callback frees it
+			el->removed=1;
+			if (!el->running){
+				ev_io_stop(el->loop->loop, &el->io);
+				ev_timer_stop(el->loop->loop, &el->timer);
+				onion_poller_loop_changed(el->loop);
+				free_now=1;
+			}
+		}
+		pthread_mutex_unlock(&el->loop->mutex);
 	}
+	pthread_mutex_unlock(&poller->mutex);
 	
-	ev_io_set(&el->ev, el->fd, el->type);
+	if (!el){
+		ONION_WARNING("Trying to remove unknown fd from poller %d", fd);
+		return 0;
+	}
+	if (free_now)
+		onion_poller_slot_free(el);
+	return 0;
+}
+
+/**
+ * @short Calls f for each slot at the poller, with its callback and data.
+ * @memberof onion_poller_t
+ * 
+ * The poller is locked meanwhile, so the slots are not freed under f, but f must be quick and must not use 
+ * the poller. Their data may be in use at other threads.
+ */
+void onion_poller_foreach(onion_poller *poller, void (*f)(void *data, int (*callback)(void*), void *slot_data), void *data){
+	pthread_mutex_lock(&poller->mutex);
+	onion_poller_slot *el;
+	for (el=poller->head;el;el=el->next)
+		f(data, el->f, el->data);
+	pthread_mutex_unlock(&poller->mutex);
+}
+
+/// Watches again a slot whose callback returned OCS_YIELD. From any thread.
+void onion_poller_slot_resume(onion_poller_slot *el){
+	onion_poller_loop *loop=el->loop;
+	pthread_mutex_lock(&loop->mutex);
+	if (!el->removed){
+		onion_poller_slot_rearm(el);
+		onion_poller_loop_changed(loop);
+	}
+	pthread_mutex_unlock(&loop->mutex);
+}
+
+/// Calls f(data) soon, from a poller thread. From any thread. Calls are done in order.
+void onion_poller_call(onion_poller *p, void (*f)(void *), void *data){
+	onion_poller_deferred *call=malloc(sizeof(onion_poller_deferred));
+	call->f=f;
+	call->data=data;
+	call->next=NULL;
 	
-	el->ev.data=el;
-// 	if (el->timeout>0){
-// 		event_add(el->ev, &tv);
-// 	}
-// 	else{
-// 		event_add(el->ev, NULL);
-// 	}
-	ev_io_start(poller->loop, &el->ev);
-	return 1;
+	pthread_mutex_lock(&p->mutex);
+	if (p->calls_last)
+		p->calls_last->next=call;
+	else
+		p->calls=call;
+	p->calls_last=call;
+	onion_poller_wake_all(p); // The first free thread runs it.
+	pthread_mutex_unlock(&p->mutex);
 }
 
-/// Removes a fd from the poller
-int onion_poller_remove(onion_poller *poller, int fd){
-	ONION_ERROR("FIXME!! not removing fd %d", fd);
-	return -1;
+/// The timer expired: calls it, and frees it. With the loop locked.
+static void onion_poller_timer_expired(struct ev_loop *l, ev_timer *w, int revents){
+	onion_poller_timer *t=w->data;
+	onion_poller_loop *loop=t->loop;
+	onion_poller *p=loop->poller;
+	pthread_mutex_unlock(&loop->mutex);
+	pthread_mutex_lock(&p->mutex);
+	if (t->prev)
+		t->prev->next=t->next;
+	else
+		p->timers=t->next;
+	if (t->next)
+		t->next->prev=t->prev;
+	pthread_mutex_unlock(&p->mutex);
+	t->f(t->data);
+	free(t);
+	pthread_mutex_lock(&p->mutex);
+	onion_poller_check_empty(p);
+	pthread_mutex_unlock(&p->mutex);
+	pthread_mutex_lock(&loop->mutex);
+}
+
+/// Calls f(data) once from a poller thread, after ms milliseconds. From any thread. If the poller is freed before, it is not called.
+int onion_poller_add_timer(onion_poller *p, int ms, void (*f)(void *), void *data){
+	onion_poller_timer *t=calloc(1, sizeof(onion_poller_timer));
+	t->f=f;
+	t->data=data;
+	if (ms<0)
+		ms=0;
+	onion_poller_watcher_init((ev_watcher*)&t->timer, onion_poller_timer_expired, t);
+	pthread_mutex_lock(&p->mutex);
+	t->loop=onion_poller_next_loop(p);
+	t->next=p->timers;
+	if (t->next)
+		t->next->prev=t;
+	p->timers=t;
+	pthread_mutex_lock(&t->loop->mutex);
+	ev_now_update(t->loop->loop);
+	onion_poller_timer_set(&t->timer, ms);
+	ev_timer_start(t->loop->loop, &t->timer);
+	onion_poller_loop_changed(t->loop);
+	pthread_mutex_unlock(&t->loop->mutex);
+	pthread_mutex_unlock(&p->mutex);
+	return 0;
+}
+
+/// Sets a function to call at each polling thread after each batch of events, before waiting again.
+int onion_poller_set_batch_callback(onion_poller *p, void (*f)(void *), void *data){
+	p->batch=f;
+	p->batch_data=data;
+	return 0;
 }
 
-/// Do the polling. If on several threads, this is done in every thread.
-void onion_poller_poll(onion_poller *poller){
-	ev_default_fork();
-	ev_loop_fork(poller->loop);
+/// Wakes up the threads waiting at the poller, so they call the batch callback. From any thread.
+void onion_poller_wakeup(onion_poller *p){
+	pthread_mutex_lock(&p->mutex);
+	onion_poller_wake_all(p);
+	pthread_mutex_unlock(&p->mutex);
+}
+
+/// Sets the events per wakeup. Not supported, the library decides.
+void onion_poller_set_max_events(onion_poller *p, int max_events, int max_events_limit){
+	ONION_DEBUG("onion_poller_set_max_events not supported on this poller");
+}
+
+/// Gets the number of loop iterations with events, and of events.
+void onion_poller_get_event_stats(onion_poller *p, unsigned long *wakeups, unsigned long *events){
+	if (wakeups)
+		*wakeups=__sync_fetch_and_add(&p->wakeups, 0);
+	if (events)
+		*events=__sync_fetch_and_add(&p->events, 0);
+}
+
+/// Measures the wait and callback times. Not supported on this poller.
+void onion_poller_set_profiling(onion_poller *p, int stall_ms){
+	ONION_DEBUG("onion_poller_set_profiling not supported on this poller");
+}
 
-	poller->stop=0;
-	while(!poller->stop){
-		sem_wait(&poller->sem);
-		ev_run(poller->loop,EVLOOP_ONESHOT);
-		sem_post(&poller->sem);
+/// Gets the wait and callback times. Not supported, always 0.
+void onion_poller_get_profile(onion_poller *p, onion_poller_profile *profile){
+	memset(profile, 0, sizeof(onion_poller_profile));
+}
+
+/// Notes the handler for the stall log. Not supported, does nothing.
+void onion_poller_note_handler(void *handler, onion_request *req){
+}
+
+/**
+ * @short Do the polling. If on several threads, this is done in every thread.
+ * 
+ * Each thread runs its own loop: the first one that created with the poller, and a new one for each 
+ * other thread. So they do not contend for a single loop.
+ */
+void onion_poller_poll(onion_poller *p){
+	p->stop=0;
+	pthread_mutex_lock(&p->mutex);
+	onion_poller_loop *loop=NULL;
+	int i;
+	for (i=0;i<p->nloops && !loop;i++){
+		if (!p->loops[i]->polling)
+			loop=p->loops[i];
 	}
+	if (!loop)
+		loop=onion_poller_loop_new(p);
+	loop->polling=1;
+	pthread_mutex_unlock(&p->mutex);
+	
+	onion_poller_loop *prev_loop=onion_poller_current_loop;
+	onion_poller_current_loop=loop;
+	pthread_mutex_lock(&loop->mutex);
+	while(!p->stop){
+		unsigned long events=p->events;
+		ev_run(loop->loop, EVRUN_ONCE);
+		if (p->events!=events)
+			__sync_fetch_and_add(&p->wakeups, 1);
+		if (p->batch){
+			pthread_mutex_unlock(&loop->mutex);
+			p->batch(p->batch_data);
+			pthread_mutex_lock(&loop->mutex);
+		}
+	}
+	pthread_mutex_unlock(&loop->mutex);
+	onion_poller_current_loop=prev_loop;
+	
+	pthread_mutex_lock(&p->mutex);
+	loop->polling=0;
+	pthread_mutex_unlock(&p->mutex);
 }
-/// Stops the polling. This only marks the flag, and should be cancelled with pthread_cancel.
-void onion_poller_stop(onion_poller *poller){
-	poller->stop=1;
-	ev_break(poller->loop, EVBREAK_ALL);
+
+/// Sends and closes at the kernel. Not supported.
+int onion_poller_can_send_close(onion_poller *p){
+	return 0;
+}
+
+/// Sends and closes at the kernel. Not supported, the caller writes and closes itself.
+int onion_poller_send_close(onion_poller *p, int fd, const char *data, size_t len){
+	return -1;
+}
+
+/// Stops the polling, waking up all the threads.
+void onion_poller_stop(onion_poller *p){
+	p->stop=1;
+	pthread_mutex_lock(&p->mutex);
+	onion_poller_wake_all(p);
+	pthread_mutex_unlock(&p->mutex);
 }
@@ -25,15 +25,54 @@
 
 #include <event2/event.h>
 #include <event2/thread.h>
-#include <malloc.h>
-#include <semaphore.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "poller.h"
+#include "memory.h"
 #include "log.h"
 
-struct onion_poller_t{
+/// The event loop of one of the threads that poll. Each thread has its own, and the slots are spread among them.
+typedef struct onion_poller_loop_t{
 	struct event_base *base;
-	sem_t sem;
+	struct event *wake;   ///< Activated from any thread to wake it up: runs the queued calls, and the batch callback.
+	onion_poller *poller;
+	char polling;         ///< A thread runs this loop now
+}onion_poller_loop;
+
+/// A call queued with onion_poller_call
+typedef struct onion_poller_deferred_t{
+	void (*f)(void *);
+	void *data;
+	struct onion_poller_deferred_t *next;
+}onion_poller_deferred;
+
+/// A one shot timer, added with onion_poller_add_timer
+typedef struct onion_poller_timer_t{
+	struct event *ev;
+	void (*f)(void *);
+	void *data;
+	onion_poller *poller;
+	struct onion_poller_timer_t *prev;
+	struct onion_poller_timer_t *next;
+}onion_poller_timer;
+
+struct onion_poller_t{
+	pthread_mutex_t mutex;
+	onion_poller_loop **loops;   ///< The first is created with the poller, the rest as more threads poll.
+	int nloops;
+	int next_loop;               ///< Where the next slot goes, round robin
+	onion_poller_slot *head;     ///< Doubly linked list of all slots
+	onion_poller_slot **slots;   ///< Slots indexed by fd, for onion_poller_remove.
+	int slots_size;
+	onion_poller_timer *timers;
+	onion_poller_deferred *calls;      ///< Calls queued by onion_poller_call. FIFO.
+	onion_poller_deferred *calls_last;
+	void (*batch)(void *);       ///< Called after each batch of events. @see onion_poller_set_batch_callback
+	void *batch_data;
+	unsigned long wakeups;       ///< Loop iterations with events. Atomic.
+	unsigned long events;        ///< Events dispatched to a slot. Atomic.
 	volatile int stop;
 };
 
@@ -41,107 +80,499 @@ struct onion_poller_slot_t{
 	int fd;
 	int timeout;
 	int type;
+	int idle_ms;
+	void (*idle)(void*);
+	void *idle_data;
+	char idled;     ///< The idle function was called since the last event
+	char running;   ///< At its callback, so a remove leaves the free to it.
+	char removed;
 	struct event *ev;
 	void *data;
 	int (*f)(void*);
 	void *shutdown_data;
 	void (*shutdown)(void*);
+	onion_poller *poller;
+	onion_poller_loop *loop;
+	onion_poller_slot *prev;
+	onion_poller_slot *next;
 };
 
-typedef struct onion_poller_slot_t onion_poller_slot;
-
 /// Create a new slot for the poller
 onion_poller_slot *onion_poller_slot_new(int fd, int (*f)(void*), void *data){
 	onion_poller_slot *ret=calloc(1, sizeof(onion_poller_slot));
+	onion_memory_count(ONION_MEMORY_POLLER, sizeof(onion_poller_slot));
 	ret->fd=fd;
 	ret->f=f;
 	ret->data=data;
-	ret->type=EV_READ | EV_WRITE | EV_PERSIST;
+	ret->timeout=-1;
+	ret->type=EV_READ;
 	
 	return ret;
 }
 
-/// Cleans a poller slot. Do not call if already on the poller (onion_poller_add). Use onion_poller_remove instead.
+/// Cleans a poller slot, calling shutdown if any. Do not call if already on the poller (onion_poller_add). Use onion_poller_remove instead.
 void onion_poller_slot_free(onion_poller_slot *el){
 	if (el->ev)
-		event_del(el->ev);
+		event_free(el->ev);
 	if (el->shutdown)
 		el->shutdown(el->shutdown_data);
+	onion_memory_count(ONION_MEMORY_POLLER, -(long)sizeof(onion_poller_slot));
+	free(el);
 }
 /// Sets the shutdown function for this poller slot
 void onion_poller_slot_set_shutdown(onion_poller_slot *el, void (*shutdown)(void*), void *data){
 	el->shutdown=shutdown;
 	el->shutdown_data=data;
 }
-/// Sets the timeout for this slot. Current implementation takes ms, but then it rounds to seconds.
+/// Sets the timeout for this slot, in milliseconds, rearmed at each event. <0 means no timeout.
 void onion_poller_slot_set_timeout(onion_poller_slot *el, int timeout_ms){
 	el->timeout=timeout_ms;
 }
+/// Sets a function to call once when the slot waits idle_ms without events, before its timeout.
+void onion_poller_slot_set_idle(onion_poller_slot *el, int idle_ms, void (*idle)(void*), void *data){
+	el->idle_ms=idle_ms;
+	el->idle=idle;
+	el->idle_data=data;
+}
 /// Sets the polling type: read/write/other. O_POLL_READ | O_POLL_WRITE | O_POLL_OTHER
 void onion_poller_slot_set_type(onion_poller_slot *el, int type){
-	el->type=EV_PERSIST;
+	el->type=0;
 	if (type&O_POLL_READ)
 		el->type|=EV_READ;
 	if (type&O_POLL_WRITE)
 		el->type|=EV_WRITE;
 }
 
+/// Edge triggered slots. Not supported, the slots are watched as always.
+int onion_poller_slot_set_edge_triggered(onion_poller_slot *el){
+	return -1;
+}
+
+/// Tells the slot read until EAGAIN. Not supported, does nothing.
+void onion_poller_slot_set_drained(onion_poller_slot *el){
+}
+
+/// Accepts at the poller. Not supported, the slot callback accepts as always.
+int onion_poller_slot_set_accept(onion_poller_slot *el, int (*accepted)(void *data, int fd)){
+	return -1;
+}
+
+/// Reads at the poller. Not supported, the slot callback reads as always.
+int onion_poller_slot_set_recv(onion_poller_slot *el, int (*received)(void *data, const char *buffer, size_t len)){
+	return -1;
+}
+
+static void onion_poller_event(evutil_socket_t fd, short what, void *_el);
+
+/// Wakes up all the loops, so they check the stop flag and call the batch callback. With the poller locked.
+static void onion_poller_wake_all(onion_poller *p){
+	int i;
+	for (i=0;i<p->nloops;i++)
+		event_active(p->loops[i]->wake, EV_READ, 0);
+}
+
+/// Stops when nothing is left to poll, as the epoll poller. With the poller locked.
+static void onion_poller_check_empty(onion_poller *p){
+	if (!p->head && !p->timers && !p->calls){
+		ONION_DEBUG0("Removed last, stopping poll");
+		p->stop=1;
+		onion_poller_wake_all(p);
+	}
+}
+
+/**
+ * @short Watches the slot until its next event or timeout. With the poller locked.
+ * 
+ * Events are one shot, as at the epoll poller: the slot is not watched while at its callback, and
+ * then with its type at that moment.
+ */
+static void onion_poller_slot_arm(onion_poller_slot *el, int ms){
+	event_assign(el->ev, el->loop->base, el->fd, el->type, onion_poller_event, el);
+	if (ms>0){
+		struct timeval tv={ ms/1000, 1000*(ms%1000) };
+		event_add(el->ev, &tv);
+	}
+	else
+		event_add(el->ev, NULL);
+}
+
+/// Arms the slot after an event: its timeout, or before it the idle time.
+static void onion_poller_slot_rearm(onion_poller_slot *el){
+	el->idled=0;
+	int ms=el->timeout;
+	if (ms>0 && el->idle && el->idle_ms<ms)
+		ms=el->idle_ms;
+	onion_poller_slot_arm(el, ms);
+}
+
+/// Unlinks the slot from the poller, that must be locked.
+static void onion_poller_unlink_slot(onion_poller *p, onion_poller_slot *el){
+	if (el->prev)
+		el->prev->next=el->next;
+	else
+		p->head=el->next;
+	if (el->next)
+		el->next->prev=el->prev;
+	if (p->slots[el->fd]==el)
+		p->slots[el->fd]=NULL;
+	el->removed=1;
+	onion_poller_check_empty(p);
+}
+
+/**
+ * @short An event, or the timeout, of a slot. At the thread of its loop.
+ */
+static void onion_poller_event(evutil_socket_t fd, short what, void *_el){
+	onion_poller_slot *el=_el;
+	onion_poller *p=el->poller;
+	pthread_mutex_lock(&p->mutex);
+	if (el->removed){ // Freed at onion_poller_remove, after this returns.
+		pthread_mutex_unlock(&p->mutex);
+		return;
+	}
+	int idle=0;
+	if (what&EV_TIMEOUT){
+		if (!el->idle || el->idled || el->idle_ms>=el->timeout){
+			ONION_DEBUG0("Timeout on %d", el->fd);
+			onion_poller_unlink_slot(p, el);
+			pthread_mutex_unlock(&p->mutex);
+			onion_poller_slot_free(el);
+			return;
+		}
+		idle=1; // Idle first, and then the rest of the timeout
+		el->idled=1;
+	}
+	el->running=1;
+	pthread_mutex_unlock(&p->mutex);
+	__sync_fetch_and_add(&p->events, 1);
+	
+	int n=0;
+	if (idle)
+		el->idle(el->idle_data);
+	else
+		n=el->f(el->data);
+	
+	pthread_mutex_lock(&p->mutex);
+	el->running=0;
+	if (!el->removed && n<0)
+		onion_poller_unlink_slot(p, el);
+	if (el->removed){ // Now or while at the callback
+		pthread_mutex_unlock(&p->mutex);
+		onion_poller_slot_free(el);
+		return;
+	}
+	if (idle)
+		onion_poller_slot_arm(el, el->timeout-el->idle_ms);
+	else if (n!=OCS_YIELD) // Else somebody else owns it now, and will onion_poller_slot_resume it.
+		onion_poller_slot_rearm(el);
+	pthread_mutex_unlock(&p->mutex);
+}
+
+/// The loop was woken up: runs the queued calls. The batch callback is called after.
+static void onion_poller_wake(evutil_socket_t fd, short what, void *_loop){
+	onion_poller *p=((onion_poller_loop*)_loop)->poller;
+	pthread_mutex_lock(&p->mutex);
+	onion_poller_deferred *call=p->calls;
+	p->calls=p->calls_last=NULL;
+	pthread_mutex_unlock(&p->mutex);
+	while (call){
+		onion_poller_deferred *next=call->next;
+		call->f(call->data);
+		free(call);
+		call=next;
+	}
+}
+
+/// Creates a loop for one more thread. With the poller locked.
+static onion_poller_loop *onion_poller_loop_new(onion_poller *p){
+	onion_poller_loop *loop=calloc(1, sizeof(onion_poller_loop));
+	loop->base=event_base_new();
+	loop->poller=p;
+	loop->wake=event_new(loop->base, -1, 0, onion_poller_wake, loop);
+	p->loops=realloc(p->loops, sizeof(onion_poller_loop*)*(p->nloops+1));
+	p->loops[p->nloops++]=loop;
+	return loop;
+}
+
+/**
+ * @short The loop for the next slot. With the poller locked.
+ * 
+ * The first loop keeps what was added before the other threads polled, as the listen sockets, and the 
+ * rest goes round robin to the other loops. So a blocking handler never holds the accepts, as 
+ * at the epoll poller where any free thread takes the next event.
+ */
+static onion_poller_loop *onion_poller_next_loop(onion_poller *p){
+	if (p->nloops==1)
+		return p->loops[0];
+	return p->loops[1 + (p->next_loop++ % (p->nloops-1))];
+}
+
 /// Create a new poller
 onion_poller *onion_poller_new(int aprox_n){
 	evthread_use_pthreads();
 	
 	onion_poller *ret=calloc(1,sizeof(onion_poller));
-	ret->base=event_base_new();
-	sem_init(&ret->sem, 0, 1);
+	pthread_mutex_init(&ret->mutex, NULL);
+	onion_poller_loop_new(ret);
 	return ret;
 }
 
-/// Frees the poller. It first stops it.
+/// Frees the poller, with its slots and timers. It first stops it.
 void onion_poller_free(onion_poller *p){
-	event_base_free(p->base);
+	onion_poller_stop(p);
+	while (p->head){
+		onion_poller_slot *next=p->head->next;
+		onion_poller_slot_free(p->head);
+		p->head=next;
+	}
+	while (p->timers){ // Not called, as the poller is gone.
+		onion_poller_timer *next=p->timers->next;
+		event_free(p->timers->ev);
+		free(p->timers);
+		p->timers=next;
+	}
+	while (p->calls){
+		onion_poller_deferred *next=p->calls->next;
+		free(p->calls);
+		p->calls=next;
+	}
+	int i;
+	for (i=0;i<p->nloops;i++){
+		event_free(p->loops[i]->wake);
+		event_base_free(p->loops[i]->base);
+		free(p->loops[i]);
+	}
+	free(p->loops);
+	free(p->slots);
+	pthread_mutex_destroy(&p->mutex);
 	free(p);
 }
 
-static void event_callback(evutil_socket_t fd, short evtype, void *e){
-	onion_poller_slot *s=e;
-	int res=s->f(s->data);
-	if (res<0){
-		onion_poller_slot_free(s);
+/**
+ * @short Adds a slot to the poller
+ * 
+ * Each slot goes to the loop of one of the threads that poll. @see onion_poller_next_loop
+ */
+int onion_poller_add(onion_poller *poller, onion_poller_slot *el){
+	pthread_mutex_lock(&poller->mutex);
+	if (el->fd>=poller->slots_size){
+		int size=poller->slots_size ? poller->slots_size : 64;
+		while (size<=el->fd)
+			size*=2;
+		poller->slots=realloc(poller->slots, sizeof(onion_poller_slot*)*size);
+		memset(poller->slots+poller->slots_size, 0, sizeof(onion_poller_slot*)*(size-poller->slots_size));
+		poller->slots_size=size;
 	}
+	el->poller=poller;
+	el->loop=onion_poller_next_loop(poller);
+	el->prev=NULL;
+	el->next=poller->head;
+	if (el->next)
+		el->next->prev=el;
+	poller->head=el;
+	poller->slots[el->fd]=el;
+	el->ev=event_new(el->loop->base, el->fd, el->type, onion_poller_event, el);
+	onion_poller_slot_rearm(el);
+	pthread_mutex_unlock(&poller->mutex);
+	return 1;
 }
 
-/// Adds a slot to the poller
-int onion_poller_add(onion_poller *poller, onion_poller_slot *el){
-	el->ev=event_new(poller->base, el->fd, el->type, event_callback, el); 
-	if (el->timeout>0){
-		struct timeval tv;
-		tv.tv_sec=el->timeout/1000;
-		tv.tv_usec=1000*(el->timeout%1000);
-		event_add(el->ev, &tv);
+/**
+ * @short Removes a fd from the poller, and frees its slot
+ * 
+ * If its callback is running at another thread, the slot is freed when it returns.
+ */
+int onion_poller_remove(onion_poller *poller, int fd){
+	pthread_mutex_lock(&poller->mutex);
+	onion_poller_slot *el=NULL;
+	if (fd>=0 && fd<poller->slots_size)
+		el=poller->slots[fd];
+	if (el)
+		onion_poller_unlink_slot(poller, el);
+	int running=el && el->running;
+	pthread_mutex_unlock(&poller->mutex);
+	
+	if (!el){
+		ONION_WARNING("Trying to remove unknown fd from poller %d", fd);
+		return 0;
 	}
-	else{
-		event_add(el->ev, NULL);
+	if (!running){
+		event_del(el->ev); // Waits for its callback, if just started at another thread.
+		onion_poller_slot_free(el);
 	}
-	return 1;
+	return 0;
 }
 
-/// Removes a fd from the poller
-int onion_poller_remove(onion_poller *poller, int fd){
-	ONION_ERROR("FIXME!! not removing fd %d", fd);
-	return -1;
+/**
+ * @short Calls f for each slot at the poller, with its callback and data.
+ * @memberof onion_poller_t
+ * 
+ * The poller is locked meanwhile, so the slots are not freed under f, but f must be quick and must not use 
+ * the poller. Their data may be in use at other threads.
+ */
+void onion_poller_foreach(onion_poller *poller, void (*f)(void *data, int (*callback)(void*), void *slot_data), void *data){
+	pthread_mutex_lock(&poller->mutex);
+	onion_poller_slot *el;
+	for (el=poller->head;el;el=el->next)
+		f(data, el->f, el->data);
+	pthread_mutex_unlock(&poller->mutex);
+}
+
+/// Watches again a slot whose callback returned OCS_YIELD. From any thread.
+void onion_poller_slot_resume(onion_poller_slot *el){
+	onion_poller *p=el->poller;
+	pthread_mutex_lock(&p->mutex);
+	if (!el->removed)
+		onion_poller_slot_rearm(el);
+	pthread_mutex_unlock(&p->mutex);
+}
+
+/// Calls f(data) soon, from a poller thread. From any thread. Calls are done in order.
+void onion_poller_call(onion_poller *p, void (*f)(void *), void *data){
+	onion_poller_deferred *call=malloc(sizeof(onion_poller_deferred));
+	call->f=f;
+	call->data=data;
+	call->next=NULL;
+	
+	pthread_mutex_lock(&p->mutex);
+	if (p->calls_last)
+		p->calls_last->next=call;
+	else
+		p->calls=call;
+	p->calls_last=call;
+	onion_poller_wake_all(p); // The first free thread runs it.
+	pthread_mutex_unlock(&p->mutex);
+}
+
+/// The timer expired: calls it, and frees it.
+static void onion_poller_timer_expired(evutil_socket_t fd, short what, void *_t){
+	onion_poller_timer *t=_t;
+	onion_poller *p=t->poller;
+	pthread_mutex_lock(&p->mutex);
+	if (t->prev)
+		t->prev->next=t->next;
+	else
+		p->timers=t->next;
+	if (t->next)
+		t->next->prev=t->prev;
+	pthread_mutex_unlock(&p->mutex);
+	t->f(t->data);
+	event_free(t->ev);
+	free(t);
+	pthread_mutex_lock(&p->mutex);
+	onion_poller_check_empty(p);
+	pthread_mutex_unlock(&p->mutex);
+}
+
+/// Calls f(data) once from a poller thread, after ms milliseconds. From any thread. If the poller is freed before, it is not called.
+int onion_poller_add_timer(onion_poller *p, int ms, void (*f)(void *), void *data){
+	onion_poller_timer *t=calloc(1, sizeof(onion_poller_timer));
+	t->f=f;
+	t->data=data;
+	t->poller=p;
+	if (ms<0)
+		ms=0;
+	struct timeval tv={ ms/1000, 1000*(ms%1000) };
+	pthread_mutex_lock(&p->mutex);
+	t->ev=evtimer_new(onion_poller_next_loop(p)->base, onion_poller_timer_expired, t);
+	t->next=p->timers;
+	if (t->next)
+		t->next->prev=t;
+	p->timers=t;
+	evtimer_add(t->ev, &tv);
+	pthread_mutex_unlock(&p->mutex);
+	return 0;
+}
+
+/// Sets a function to call at each polling thread after each batch of events, before waiting again.
+int onion_poller_set_batch_callback(onion_poller *p, void (*f)(void *), void *data){
+	p->batch=f;
+	p->batch_data=data;
+	return 0;
+}
+
+/// Wakes up the threads waiting at the poller, so they call the batch callback. From any thread.
+void onion_poller_wakeup(onion_poller *p){
+	pthread_mutex_lock(&p->mutex);
+	onion_poller_wake_all(p);
+	pthread_mutex_unlock(&p->mutex);
+}
+
+/// Sets the events per wakeup. Not supported, the library decides.
+void onion_poller_set_max_events(onion_poller *p, int max_events, int max_events_limit){
+	ONION_DEBUG("onion_poller_set_max_events not supported on this poller");
+}
+
+/// Gets the number of loop iterations with events, and of events.
+void onion_poller_get_event_stats(onion_poller *p, unsigned long *wakeups, unsigned long *events){
+	if (wakeups)
+		*wakeups=__sync_fetch_and_add(&p->wakeups, 0);
+	if (events)
+		*events=__sync_fetch_and_add(&p->events, 0);
+}
+
+/// Measures the wait and callback times. Not supported on this poller.
+void onion_poller_set_profiling(onion_poller *p, int stall_ms){
+	ONION_DEBUG("onion_poller_set_profiling not supported on this poller");
+}
+
+/// Gets the wait and callback times. Not supported, always 0.
+void onion_poller_get_profile(onion_poller *p, onion_poller_profile *profile){
+	memset(profile, 0, sizeof(onion_poller_profile));
+}
+
+/// Notes the handler for the stall log. Not supported, does nothing.
+void onion_poller_note_handler(void *handler, onion_request *req){
 }
 
-/// Do the polling. If on several threads, this is done in every thread.
-void onion_poller_poll(onion_poller *poller){
-	poller->stop=0;
-	while(!poller->stop){
-		sem_wait(&poller->sem);
-		event_base_loop(poller->base,EVLOOP_ONCE);
-		sem_post(&poller->sem);
+/**
+ * @short Do the polling. If on several threads, this is done in every thread.
+ * 
+ * Each thread runs its own loop: the first one that created with the poller, and a new one for each 
+ * other thread. So they do not contend for a single event base.
+ */
+void onion_poller_poll(onion_poller *p){
+	p->stop=0;
+	pthread_mutex_lock(&p->mutex);
+	onion_poller_loop *loop=NULL;
+	int i;
+	for (i=0;i<p->nloops && !loop;i++){
+		if (!p->loops[i]->polling)
+			loop=p->loops[i];
 	}
+	if (!loop)
+		loop=onion_poller_loop_new(p);
+	loop->polling=1;
+	pthread_mutex_unlock(&p->mutex);
+	
+	while(!p->stop){
+		unsigned long events=p->events;
+		event_base_loop(loop->base, EVLOOP_ONCE|EVLOOP_NO_EXIT_ON_EMPTY);
+		if (p->events!=events)
+			__sync_fetch_and_add(&p->wakeups, 1);
+		if (p->batch)
+			p->batch(p->batch_data);
+	}
+	
+	pthread_mutex_lock(&p->mutex);
+	loop->polling=0;
+	pthread_mutex_unlock(&p->mutex);
 }
-/// Stops the polling. This only marks the flag, and should be cancelled with pthread_cancel.
-void onion_poller_stop(onion_poller *poller){
-	poller->stop=1;
-	event_base_loopbreak(poller->base);
+
+/// Sends and closes at the kernel. Not supported.
+int onion_poller_can_send_close(onion_poller *p){
+	return 0;
+}
+
+/// Sends and closes at the kernel. Not supported, the caller writes and closes itself.
+int onion_poller_send_close(onion_poller *p, int fd, const char *data, size_t len){
+	return -1;
+}
+
+/// Stops the polling, waking up all the threads.
+void onion_poller_stop(onion_poller *p){
+	p->stop=1;
+	pthread_mutex_lock(&p->mutex);
+	onion_poller_wake_all(p);
+	pthread_mutex_unlock(&p->mutex);
 }
@@ -0,0 +1,325 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "pool.h"
+
+#define ONION_POOL_KINDS 3
+
+/// Maximum objects of each kind kept per thread.
+static const int onion_pool_max[ONION_POOL_KINDS]={ 64, 64, 256 };
+
+/// Really free the pooled objects, at thread end. Set at the first put of each kind.
+static void (*onion_pool_free_f[ONION_POOL_KINDS])(void *);
+
+/// A pooled object. Its first bytes are overwritten with the link to the next one.
+typedef struct onion_pool_item_t{
+	struct onion_pool_item_t *next;
+}onion_pool_item;
+
+/// Size classes of onion_slab_alloc, each ONION_SLAB_CLASS_SIZE bigger than the previous.
+#define ONION_SLAB_CLASSES 16
+#define ONION_SLAB_CLASS_SIZE 16
+/// Free small objects kept at each thread, per class. Over this, a batch goes to the shared depot.
+#define ONION_SLAB_CACHE_MAX 128
+/// Objects moved at once between a thread cache and the depot, so the depot lock is rarely taken.
+#define ONION_SLAB_BATCH 32
+/// Batches kept at the depot, per class. Over this, they are really freed, so the memory of a spike is returned.
+#define ONION_SLAB_DEPOT_MAX 32
+
+/// A free small object. As the classes are at least 16 bytes, it has room for both links.
+typedef struct onion_slab_item_t{
+	struct onion_slab_item_t *next;
+	struct onion_slab_item_t *next_batch; ///< At the depot, at the first of each batch.
+}onion_slab_item;
+
+/// The pools of a thread
+typedef struct{
+	onion_pool_item *first[ONION_POOL_KINDS];
+	int count[ONION_POOL_KINDS];
+	onion_slab_item *slab_first[ONION_SLAB_CLASSES];
+	int slab_count[ONION_SLAB_CLASSES];
+}onion_pool_lists;
+
+static void onion_slab_lists_clear(onion_pool_lists *lists);
+
+/// Really frees the pooled objects of these lists.
+static void onion_pool_lists_clear(onion_pool_lists *lists){
+	int i;
+	for (i=0;i<ONION_POOL_KINDS;i++){
+		while (lists->first[i]){
+			onion_pool_item *it=lists->first[i];
+			lists->first[i]=it->next;
+			onion_pool_free_f[i](it);
+		}
+		lists->count[i]=0;
+	}
+	onion_slab_lists_clear(lists);
+}
+
+#ifdef HAVE_PTHREADS
+static __thread onion_pool_lists *onion_pool_thread_lists;
+static pthread_key_t onion_pool_key;
+static pthread_once_t onion_pool_key_once=PTHREAD_ONCE_INIT;
+
+/// At thread end frees the pooled objects.
+static void onion_pool_lists_free(void *_lists){
+	onion_pool_lists *lists=_lists;
+	onion_pool_thread_lists=NULL; // If something is freed later at this thread, it gets new lists.
+	onion_pool_lists_clear(lists);
+	free(lists);
+}
+
+static void onion_pool_key_init(){
+	pthread_key_create(&onion_pool_key, onion_pool_lists_free);
+}
+
+/// The lists of this thread, created at the first put.
+static onion_pool_lists *onion_pool_get_lists(){
+	if (!onion_pool_thread_lists){
+		pthread_once(&onion_pool_key_once, onion_pool_key_init);
+		onion_pool_thread_lists=calloc(1, sizeof(onion_pool_lists));
+		pthread_setspecific(onion_pool_key, onion_pool_thread_lists);
+	}
+	return onion_pool_thread_lists;
+}
+#else
+static onion_pool_lists onion_pool_static_lists;
+
+static onion_pool_lists *onion_pool_get_lists(){
+	return &onion_pool_static_lists;
+}
+#endif
+
+/**
+ * @short Gets a pooled object of that kind, or NULL if none.
+ *
+ * It has the contents it had when put; the caller resets it.
+ */
+void *onion_pool_get(onion_pool_kind kind){
+	onion_pool_lists *lists=onion_pool_get_lists();
+	onion_pool_item *it=lists->first[kind];
+	if (!it)
+		return NULL;
+	lists->first[kind]=it->next;
+	lists->count[kind]--;
+	return it;
+}
+
+/**
+ * @short Keeps the object at this thread pool.
+ *
+ * @param free_f Really frees this kind of objects, when the thread ends.
+ * @returns 0 if kept, <0 if the pool is full, and the caller must free it.
+ */
+int onion_pool_put(onion_pool_kind kind, void *obj, void (*free_f)(void *)){
+	onion_pool_lists *lists=onion_pool_get_lists();
+	if (!lists || lists->count[kind]>=onion_pool_max[kind])
+		return -1;
+	onion_pool_free_f[kind]=free_f;
+	onion_pool_item *it=obj;
+	it->next=lists->first[kind];
+	lists->first[kind]=it;
+	lists->count[kind]++;
+	return 0;
+}
+
+/**
+ * @short Really frees the pooled objects of this thread.
+ *
+ * The other threads free theirs when they end.
+ */
+void onion_pool_clear(){
+#ifdef HAVE_PTHREADS
+	if (!onion_pool_thread_lists)
+		return;
+#endif
+	onion_pool_lists_clear(onion_pool_get_lists());
+}
+
+/// @{ @name Small objects allocator, by size classes
+///
+/// The small fixed size objects of the library (poller slots, dict nodes, handlers, url entries, 
+/// websockets) are kept when freed at a cache of the thread that frees them, by size class, and reused 
+/// by the next allocation of that size at that thread, without locks. When a thread cache is full a 
+/// batch goes to a shared depot, from where other threads take them; if the depot is full too they 
+/// are really freed, so after connection spikes the memory goes back to the allocator.
+
+static void *(*onion_slab_malloc_f)(size_t)=malloc;
+static void (*onion_slab_free_f)(void *)=free;
+
+/// Batches of free objects shared by all threads, per class.
+static struct{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+	onion_slab_item *first_batch;
+	int nbatches;
+}onion_slab_depot[ONION_SLAB_CLASSES]={
+#ifdef HAVE_PTHREADS
+	[0 ... ONION_SLAB_CLASSES-1]={ PTHREAD_MUTEX_INITIALIZER, NULL, 0 }
+#endif
+};
+
+/**
+ * @short Sets the allocator of the library small objects.
+ * 
+ * By default malloc and free. It must be set before any onion object is created, as the objects 
+ * are freed with the free_f of the allocator that allocated them. On top of it the freed objects 
+ * are cached by size, so it is called less often.
+ */
+void onion_set_allocator(void *(*malloc_f)(size_t), void (*free_f)(void *)){
+	onion_slab_malloc_f=malloc_f ? malloc_f : malloc;
+	onion_slab_free_f=free_f ? free_f : free;
+}
+
+/// Returns the size class for that size, or -1 if too big.
+static inline int onion_slab_class(size_t size){
+	if (size>ONION_SLAB_CLASSES*ONION_SLAB_CLASS_SIZE)
+		return -1;
+	return size ? (size-1)/ONION_SLAB_CLASS_SIZE : 0;
+}
+
+/// Moves a batch of objects of that class from the depot to the thread cache. Returns 0 if the depot had none.
+static int onion_slab_depot_get(onion_pool_lists *lists, int c){
+	onion_slab_item *batch;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&onion_slab_depot[c].mutex);
+#endif
+	batch=onion_slab_depot[c].first_batch;
+	if (batch){
+		onion_slab_depot[c].first_batch=batch->next_batch;
+		onion_slab_depot[c].nbatches--;
+	}
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&onion_slab_depot[c].mutex);
+#endif
+	if (!batch)
+		return 0;
+	lists->slab_first[c]=batch;
+	lists->slab_count[c]=ONION_SLAB_BATCH;
+	return 1;
+}
+
+/// Moves a batch from the thread cache to the depot, or frees it if the depot is full.
+static void onion_slab_depot_put(onion_pool_lists *lists, int c){
+	onion_slab_item *batch=lists->slab_first[c], *last=batch;
+	int i;
+	for (i=1;i<ONION_SLAB_BATCH;i++)
+		last=last->next;
+	lists->slab_first[c]=last->next;
+	lists->slab_count[c]-=ONION_SLAB_BATCH;
+	last->next=NULL;
+	
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&onion_slab_depot[c].mutex);
+#endif
+	int kept=onion_slab_depot[c].nbatches<ONION_SLAB_DEPOT_MAX;
+	if (kept){
+		batch->next_batch=onion_slab_depot[c].first_batch;
+		onion_slab_depot[c].first_batch=batch;
+		onion_slab_depot[c].nbatches++;
+	}
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&onion_slab_depot[c].mutex);
+#endif
+	while (!kept && batch){
+		onion_slab_item *next=batch->next;
+		onion_slab_free_f(batch);
+		batch=next;
+	}
+}
+
+/// Gives the cached objects to the depot in batches, and frees the rest. At thread end and onion_pool_clear.
+static void onion_slab_lists_clear(onion_pool_lists *lists){
+	int c;
+	for (c=0;c<ONION_SLAB_CLASSES;c++){
+		while (lists->slab_count[c]>=ONION_SLAB_BATCH)
+			onion_slab_depot_put(lists, c);
+		while (lists->slab_first[c]){
+			onion_slab_item *it=lists->slab_first[c];
+			lists->slab_first[c]=it->next;
+			onion_slab_free_f(it);
+		}
+		lists->slab_count[c]=0;
+	}
+}
+
+/**
+ * @short Allocates a small object, from the thread cache of its size if possible.
+ * 
+ * It must be freed with onion_slab_free, with the same size. Bigger than the biggest class,
+ * it is just the allocator malloc.
+ */
+void *onion_slab_alloc(size_t size){
+	int c=onion_slab_class(size);
+	if (c<0)
+		return onion_slab_malloc_f(size);
+	onion_pool_lists *lists=onion_pool_get_lists();
+	if (lists && (lists->slab_first[c] || onion_slab_depot_get(lists, c))){
+		onion_slab_item *it=lists->slab_first[c];
+		lists->slab_first[c]=it->next;
+		lists->slab_count[c]--;
+		return it;
+	}
+	return onion_slab_malloc_f((c+1)*ONION_SLAB_CLASS_SIZE);
+}
+
+/// As onion_slab_alloc, zeroed.
+void *onion_slab_calloc(size_t size){
+	void *ret=onion_slab_alloc(size);
+	if (ret)
+		memset(ret, 0, size);
+	return ret;
+}
+
+/**
+ * @short Frees an object of onion_slab_alloc, keeping it at this thread cache.
+ * 
+ * The size must be the same as given to onion_slab_alloc.
+ */
+void onion_slab_free(void *ptr, size_t size){
+	if (!ptr)
+		return;
+	int c=onion_slab_class(size);
+	onion_pool_lists *lists=(c<0) ? NULL : onion_pool_get_lists();
+	if (!lists){
+		onion_slab_free_f(ptr);
+		return;
+	}
+	onion_slab_item *it=ptr;
+	it->next=lists->slab_first[c];
+	lists->slab_first[c]=it;
+	if (++lists->slab_count[c]>=ONION_SLAB_CACHE_MAX)
+		onion_slab_depot_put(lists, c);
+}
+
+/// @}
@@ -0,0 +1,65 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_POOL_H
+#define ONION_POOL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/**
+ * @short Kinds of objects kept at the per thread pools.
+ *
+ * Internal. Freed objects are kept at the pool of the thread that frees them, and reused by the
+ * next new at that thread, so the keep alive path does not malloc.
+ */
+typedef enum{
+	ONION_POOL_REQUEST=0,
+	ONION_POOL_RESPONSE=1,
+	ONION_POOL_DICT=2,
+}onion_pool_kind;
+
+/// Gets a pooled object of that kind, or NULL if none.
+void *onion_pool_get(onion_pool_kind kind);
+/// Keeps the object at the pool. Returns <0 if the pool is full, and the caller must free it.
+int onion_pool_put(onion_pool_kind kind, void *obj, void (*free_f)(void *));
+/// Frees the pooled objects of this thread.
+void onion_pool_clear();
+
+/// Allocates a small object, from the per thread cache of its size class.
+void *onion_slab_alloc(size_t size);
+/// As onion_slab_alloc, zeroed.
+void *onion_slab_calloc(size_t size);
+/// Frees an object of onion_slab_alloc. The size must be the same.
+void onion_slab_free(void *ptr, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,284 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#ifdef __linux__
+#include <sys/random.h>
+#endif
+
+#include "random.h"
+#include "types_internal.h"
+#include "log.h"
+
+/**
+ * @short Random data from a ChaCha20 stream per thread, keyed from the kernel.
+ * 
+ * Each thread has its own generator, so there is no lock, and it is filled ONION_RANDOM_BLOCKS blocks
+ * at a time, so most calls are just a copy. The first 32 bytes of each fill are the key of the next, 
+ * and the given bytes are erased from the buffer, so a later leak of the state does not show the 
+ * previous output. Every ONION_RANDOM_RESEED bytes the key is mixed with new kernel randomness, and
+ * after a fork the child gets a new key, so it never repeats the parent output.
+ */
+
+/// ChaCha20 blocks generated at each fill, 64 bytes each.
+#define ONION_RANDOM_BLOCKS 16
+/// Bytes generated before mixing new randomness from the kernel into the key.
+#define ONION_RANDOM_RESEED (1024*1024)
+
+typedef struct{
+	uint32_t key[8];
+	uint64_t counter;
+	unsigned char buffer[ONION_RANDOM_BLOCKS*64];
+	size_t pos;              ///< Given bytes of the buffer. At the size, it has to be filled.
+	size_t since_reseed;
+	unsigned int forks;      ///< onion_random_forks when keyed; if different, this is a forked child.
+	char keyed;
+}onion_random_state;
+
+static int onion_random_kernel(void *data, size_t size);
+static void onion_random_chacha20(const uint32_t key[8], uint64_t counter, unsigned char *out);
+static void onion_random_fill(onion_random_state *st);
+
+static __thread onion_random_state onion_random_thread_state;
+/// Increased at each fork, at the child.
+static volatile unsigned int onion_random_forks=0;
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+static pthread_mutex_t onion_random_refcount_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define onion_random_refcount_mutex_lock() pthread_mutex_lock(&onion_random_refcount_mutex);
+#define onion_random_refcount_mutex_unlock() pthread_mutex_unlock(&onion_random_refcount_mutex);
+static pthread_once_t onion_random_atfork_once=PTHREAD_ONCE_INIT;
+
+static void onion_random_atfork_child(){
+	onion_random_forks++;
+}
+
+static void onion_random_atfork_init(){
+	pthread_atfork(NULL, NULL, onion_random_atfork_child);
+}
+#else
+#define onion_random_refcount_mutex_lock() ;
+#define onion_random_refcount_mutex_unlock() ;
+#endif
+
+static size_t onion_random_refcount=0;
+
+/**
+ * @short Reads size bytes from the kernel generator, without blocking.
+ *
+ * Early at boot the kernel pool may not be initialized yet, and getrandom would block until it is,
+ * maybe for seconds, before the first session. Then it reads /dev/urandom, that does not block, and
+ * returns 0, so the key is mixed with new randomness at the next fill.
+ *
+ * @returns 1 if the pool was initialized, 0 if not.
+ */
+static int onion_random_kernel(void *data, size_t size){
+	unsigned char *p=data;
+	int ready=1;
+#ifdef __linux__
+	while (size>0){
+		ssize_t r=getrandom(p, size, GRND_NONBLOCK);
+		if (r<0){
+			if (errno==EINTR)
+				continue;
+			if (errno==EAGAIN){
+				static int warned=0;
+				if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED))
+					ONION_WARNING("The kernel random pool is not initialized yet. Using /dev/urandom until it is.");
+				ready=0;
+			}
+			break; // Or no getrandom, as an old kernel
+		}
+		p+=r;
+		size-=r;
+	}
+	if (size==0)
+		return ready;
+#endif
+	int fd=open("/dev/urandom", O_RDONLY|O_CLOEXEC);
+	while (fd>=0 && size>0){
+		ssize_t r=read(fd, p, size);
+		if (r<=0 && errno!=EINTR)
+			break;
+		if (r>0){
+			p+=r;
+			size-=r;
+		}
+	}
+	if (fd>=0)
+		close(fd);
+	if (size>0){
+		ONION_ERROR("Could not read the kernel random generator. Aborting, as random data would not be safe.");
+		abort();
+	}
+	return ready;
+}
+
+#define ONION_RANDOM_ROTL(v, n) (((v)<<(n)) | ((v)>>(32-(n))))
+#define ONION_RANDOM_QR(a, b, c, d) \
+	a+=b; d^=a; d=ONION_RANDOM_ROTL(d,16); \
+	c+=d; b^=c; b=ONION_RANDOM_ROTL(b,12); \
+	a+=b; d^=a; d=ONION_RANDOM_ROTL(d, 8); \
+	c+=d; b^=c; b=ONION_RANDOM_ROTL(b, 7);
+
+/// One ChaCha20 block (RFC 7539, with a 64 bit counter and zero nonce) at out, as little endian.
+static void onion_random_chacha20(const uint32_t key[8], uint64_t counter, unsigned char *out){
+	uint32_t in[16]={ 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+		key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+		(uint32_t)counter, (uint32_t)(counter>>32), 0, 0 };
+	uint32_t x[16];
+	int i;
+	memcpy(x, in, sizeof(x));
+	for (i=0;i<10;i++){
+		ONION_RANDOM_QR(x[0], x[4], x[ 8], x[12]);
+		ONION_RANDOM_QR(x[1], x[5], x[ 9], x[13]);
+		ONION_RANDOM_QR(x[2], x[6], x[10], x[14]);
+		ONION_RANDOM_QR(x[3], x[7], x[11], x[15]);
+		ONION_RANDOM_QR(x[0], x[5], x[10], x[15]);
+		ONION_RANDOM_QR(x[1], x[6], x[11], x[12]);
+		ONION_RANDOM_QR(x[2], x[7], x[ 8], x[13]);
+		ONION_RANDOM_QR(x[3], x[4], x[ 9], x[14]);
+	}
+	for (i=0;i<16;i++){
+		uint32_t v=x[i]+in[i];
+		out[i*4]=v;
+		out[i*4+1]=v>>8;
+		out[i*4+2]=v>>16;
+		out[i*4+3]=v>>24;
+	}
+}
+
+/// Fills the buffer of the thread generator, keying or reseeding it first if needed.
+static void onion_random_fill(onion_random_state *st){
+	if (!st->keyed || st->forks!=onion_random_forks){
+		int ready=onion_random_kernel(st->key, sizeof(st->key));
+		st->counter=0;
+		st->since_reseed=ready ? 0 : ONION_RANDOM_RESEED; // If not, reseeds at the next fill
+		st->forks=onion_random_forks;
+		st->keyed=1;
+	}
+	else if (st->since_reseed>=ONION_RANDOM_RESEED){
+		uint32_t fresh[8];
+		int i;
+		int ready=onion_random_kernel(fresh, sizeof(fresh));
+		for (i=0;i<8;i++)
+			st->key[i]^=fresh[i];
+		memset(fresh, 0, sizeof(fresh));
+		st->since_reseed=ready ? 0 : ONION_RANDOM_RESEED;
+	}
+	int i;
+	for (i=0;i<ONION_RANDOM_BLOCKS;i++)
+		onion_random_chacha20(st->key, st->counter++, &st->buffer[i*64]);
+	memcpy(st->key, st->buffer, sizeof(st->key)); // Fast key erasure: the old key can not be known from the new one
+	memset(st->buffer, 0, sizeof(st->key));
+	st->pos=sizeof(st->key);
+	st->since_reseed+=sizeof(st->buffer);
+}
+
+/**
+ * @short Initializes the global random number generator
+ * 
+ * The generators are per thread and keyed at their first use, from the kernel. This only prepares 
+ * their rekeying after a fork.
+ *
+ * It is safe to call onion_random_init() more than once, but union_random_free() must be called the same amount of times.
+ */ 
+void onion_random_init() {
+	onion_random_refcount_mutex_lock();
+#ifdef HAVE_PTHREADS
+	pthread_once(&onion_random_atfork_once, onion_random_atfork_init);
+#endif
+	onion_random_refcount++;
+	onion_random_refcount_mutex_unlock();
+}
+
+/**
+ * @short Free up memory used by global random number generator
+ *
+ * onion_random_free() must not be called more times than onion_random_init()
+ */
+void onion_random_free() {
+	onion_random_refcount_mutex_lock();
+	assert( onion_random_refcount > 0 );
+	onion_random_refcount--;
+	onion_random_refcount_mutex_unlock();
+}
+
+/**
+ * @short Generates random data
+ *
+ * Generate size bytes of random data and put on data. Safe for keys and session ids, and 
+ * without locks, as each thread has its own generator.
+ */
+void onion_random_generate(void* data, size_t size) {
+	onion_random_state *st=&onion_random_thread_state;
+	unsigned char *out=data;
+	while (size>0){
+		if (st->pos>=sizeof(st->buffer) || !st->keyed || st->forks!=onion_random_forks) // The rest of the buffer of the parent is not for the child either
+			onion_random_fill(st);
+		size_t n=sizeof(st->buffer)-st->pos;
+		if (n>size)
+			n=size;
+		memcpy(out, &st->buffer[st->pos], n);
+		memset(&st->buffer[st->pos], 0, n);
+		st->pos+=n;
+		out+=n;
+		size-=n;
+	}
+}
+
+/**
+ * @short Generates length random characters of the alphabet, and a final \0, at data.
+ *
+ * Each character is equally likely: random bytes that would favour the first characters of 
+ * the alphabet are skipped, instead of taking the modulo. The alphabet has at most 256 characters.
+ */
+void onion_random_alphabet(char *data, size_t length, const char *alphabet){
+	size_t nchars=strlen(alphabet);
+	unsigned int mask=1;
+	while (mask<nchars)
+		mask<<=1;
+	mask--;
+	unsigned char bytes[64];
+	size_t i=0, j=sizeof(bytes);
+	while (i<length){
+		if (j==sizeof(bytes)){
+			onion_random_generate(bytes, sizeof(bytes));
+			j=0;
+		}
+		unsigned int c=bytes[j++]&mask;
+		if (c<nchars)
+			data[i++]=alphabet[c];
+	}
+	data[i]='\0';
+	memset(bytes, 0, sizeof(bytes));
+}
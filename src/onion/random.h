@@ -41,6 +41,9 @@ void onion_random_free();
 /// Generate size bytes of random data and put on data
 void onion_random_generate(void* data, size_t size);
 
+/// Generates length random, unbiased, characters of the alphabet at data, and a final \0.
+void onion_random_alphabet(char *data, size_t length, const char *alphabet);
+
 #ifdef __cplusplus
 }
 #endif
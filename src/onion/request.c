@@ -23,24 +23,78 @@
 	library; if not see <http://www.gnu.org/licenses/>.
 	*/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* POLLRDHUP */
+#endif
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <poll.h>
 #include <netdb.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+#endif
 
+#include "onion.h"
 #include "dict.h"
 #include "request.h"
 #include "response.h"
 #include "handler.h"
 #include "types_internal.h"
 #include "log.h"
+#include "trace.h"
 #include "sessions.h"
 #include "block.h"
 #include "listen_point.h"
 #include "websocket.h"
+#include "sse.h"
+#include "shortcuts.h"
+#include "poller.h"
+#include "url.h"
+#include "pool.h"
+#include "memory.h"
+#include "stats.h"
+#include "admission.h"
+#include "traffic_record.h"
+#ifdef HAVE_PTHREADS
+#include "workers.h"
+#include "steal.h"
+# include <pthread.h>
+#else  // if no pthreads, ignore locks.
+# define pthread_mutex_init(...)
+# define pthread_mutex_destroy(...)
+# define pthread_mutex_lock(...)
+# define pthread_mutex_unlock(...)
+#endif
 
 void onion_request_parser_data_free(void *token); // At request_parser.c
+void onion_request_parser_data_clean(void *token); // At request_parser.c
+void onion_request_body_inflate_free(onion_request *req); // At request_parser.c
+onion_dict *onion_request_query_dict(onion_request *req); // At request_parser.c
+const char *onion_request_query_find(onion_request *req, const char *key); // At request_parser.c
+void onion_http2_session_free(onion_request *con); // At http2.c
+void onion_dict_flat_free(onion_dict *dict); // At dict.c
+onion_handler *onion_get_vhost_handler(onion *server, const char *host); // At onion.c
+static void onion_request_session_release(onion_request *req);
+static void onion_request_stats_open(onion_request *req);
+static void onion_request_watchdog_stop(onion_request *req);
+static void onion_request_deadline_start(onion_request *req);
+static void onion_request_canceller_stop(onion_request *req);
+static char *onion_request_session_cookie_value(const char *value);
+static const char *onion_request_url_param_value(onion_request *req, struct onion_request_url_param_t *param);
+static void onion_request_output_shared_free(onion_request *req);
+onion_connection_status onion_response_write_prerendered(onion_request *req, const onion_response_prerendered *p); // At response.c
 
 /**
  * @memberof onion_request_t
@@ -56,6 +110,155 @@ const char *onion_request_methods[16]={
 	"MKCOL", "PROPPATCH", "PATCH", NULL, 
 	NULL, NULL, NULL, NULL };
 
+const char *onion_request_header_names[ONION_H_COUNT]={
+	"Host", "Connection", "Content-Length", "Content-Type", 
+	"Transfer-Encoding", "Cookie", "Range", "If-Range", 
+	"If-None-Match", "Accept-Encoding", "Accept-Language", "Upgrade", 
+	"Authorization", "Expect", "If-Modified-Since", "Content-Encoding" };
+
+/// Returns the onion_header_id of that header name, case insensitive, or -1 if it is not a well known one.
+int onion_request_header_id_find(const char *name, size_t length){
+	int c=tolower((unsigned char)name[0]);
+	int i;
+	for (i=0;i<ONION_H_COUNT;i++){
+		const char *h=onion_request_header_names[i];
+		if (tolower((unsigned char)h[0])==c && strncasecmp(name, h, length)==0 && h[length]=='\0')
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * @short Frees all the arena blocks but the oldest, that is emptied for the next request.
+ * 
+ * An oldest block bigger than ONION_REQUEST_ARENA_BLOCK_SIZE, from a big first allocation, is freed too.
+ */
+static void onion_request_arena_reset(onion_request *req){
+	struct onion_request_arena_block_t *b=req->arena;
+	if (!b)
+		return;
+	while (b->next){
+		struct onion_request_arena_block_t *next=b->next;
+		onion_memory_count(ONION_MEMORY_REQUEST, -(long)(sizeof(struct onion_request_arena_block_t)+b->size));
+		free(b);
+		b=next;
+	}
+	if (b->size>ONION_REQUEST_ARENA_BLOCK_SIZE){
+		onion_memory_count(ONION_MEMORY_REQUEST, -(long)(sizeof(struct onion_request_arena_block_t)+b->size));
+		free(b);
+		b=NULL;
+	}
+	else
+		b->used=0;
+	req->arena=b;
+}
+
+/// Frees all the arena blocks.
+static void onion_request_arena_free(onion_request *req){
+	onion_request_arena_reset(req);
+	if (req->arena)
+		onion_memory_count(ONION_MEMORY_REQUEST, -(long)(sizeof(struct onion_request_arena_block_t)+req->arena->size));
+	free(req->arena);
+	req->arena=NULL;
+}
+
+/**
+ * @short Allocates at the arena, aligned to align (a power of 2).
+ * 
+ * A new block is added when the newest has no space left; the space left at the previous one is not used anymore.
+ */
+static void *onion_request_arena_get(onion_request *req, size_t size, size_t align){
+	struct onion_request_arena_block_t *b=req->arena;
+	if (b){
+		size_t start=b->used + ((-(uintptr_t)(b->data+b->used)) & (align-1));
+		if (start<=b->size && size<=b->size-start){
+			b->used=start+size;
+			return b->data+start;
+		}
+	}
+	if (size>SIZE_MAX/2)
+		return NULL;
+	size_t bsize=(size>ONION_REQUEST_ARENA_BLOCK_SIZE-align) ? size+align : ONION_REQUEST_ARENA_BLOCK_SIZE;
+	b=malloc(sizeof(struct onion_request_arena_block_t)+bsize);
+	if (!b)
+		return NULL;
+	onion_memory_count(ONION_MEMORY_REQUEST, sizeof(struct onion_request_arena_block_t)+bsize);
+	b->next=req->arena;
+	b->size=bsize;
+	size_t start=(-(uintptr_t)b->data) & (align-1);
+	b->used=start+size;
+	req->arena=b;
+	return b->data+start;
+}
+
+/**
+ * @short Allocates memory that lives as long as the request, for handler scratch data.
+ * @memberof onion_request_t
+ * 
+ * It is not freed one by one, but all together when the request is cleaned for the next one on keep
+ * alive, or freed. Its much faster than malloc, as normally its just moving a pointer. The request 
+ * headers, the url regexp groups and the cookies are there too.
+ * 
+ * Memory is aligned to 16 bytes.
+ * 
+ * @returns The memory, or NULL if size could not be allocated.
+ */
+void *onion_request_alloc(onion_request *req, size_t size){
+	return onion_request_arena_get(req, size, 16);
+}
+
+/**
+ * @short Copies the string into the request arena, so it lives as long as the request.
+ * @memberof onion_request_t
+ * 
+ * @see onion_request_alloc
+ */
+char *onion_request_strdup(onion_request *req, const char *str){
+	size_t l=strlen(str)+1;
+	char *ret=onion_request_arena_get(req, l, 1);
+	if (ret)
+		memcpy(ret, str, l);
+	return ret;
+}
+
+/**
+ * @short Zeroes a pooled request, but for the buffers that are reused.
+ * 
+ * The parser token, the path buffer, the header slices and the arena are kept as on keep alive.
+ */
+static void onion_request_pool_reset(onion_request *req){
+	void *parser_data=req->parser_data;
+	struct onion_request_arena_block_t *arena=req->arena;
+	char *path_data=req->path_buffer.data;
+	size_t path_size=req->path_buffer.size;
+	onion_block *slices_data=req->header_slices.data;
+	struct onion_request_header_slice_t *slices=req->header_slices.slices;
+	int slices_size=req->header_slices.size;
+	memset(req, 0, sizeof(onion_request));
+	req->parser_data=parser_data;
+	req->path_buffer.data=path_data;
+	req->path_buffer.size=path_size;
+	req->header_slices.data=slices_data;
+	req->header_slices.slices=slices;
+	req->header_slices.size=slices_size;
+	req->arena=arena;
+}
+
+/// Really frees a request, at the end of a thread pool.
+static void onion_request_pool_free(void *_req){
+	onion_request *req=_req;
+	if (req->parser_data)
+		onion_request_parser_data_free(req->parser_data);
+	free(req->path_buffer.data);
+	if (req->header_slices.data){
+		onion_block_free(req->header_slices.data);
+		free(req->header_slices.slices);
+	}
+	onion_request_arena_free(req);
+	onion_memory_count(ONION_MEMORY_REQUEST, -(long)sizeof(onion_request));
+	free(req);
+}
+
 /**
  *  @short Creates a request object
  * @memberof onion_request_t
@@ -63,37 +266,68 @@ const char *onion_request_methods[16]={
  * @param op Listen point this request is listening to, to be able to read and write data
  */
 onion_request *onion_request_new(onion_listen_point *op){
-	onion_request *req;
-	req=calloc(1, sizeof(onion_request));
+	onion_request *req=onion_pool_get(ONION_POOL_REQUEST);
+	if (req)
+		onion_request_pool_reset(req);
+	else{
+		req=calloc(1, sizeof(onion_request));
+		onion_memory_count(ONION_MEMORY_REQUEST, sizeof(onion_request));
+	}
 	
 	req->connection.listen_point=op;
 	req->connection.fd=-1;
+	req->output.file_fd=-1;
+	req->spool.fd=-1;
 	
 	//req->connection=con;
 	req->headers=onion_dict_new();
-	onion_dict_set_flags(req->headers, OD_ICASE);
+	onion_dict_set_flags(req->headers, OD_ICASE|OD_FLAT);
 	ONION_DEBUG0("Create request %p", req);
 	
+	if (op && op->server && op->server->header_slices){
+		if (!req->header_slices.data)
+			req->header_slices.data=onion_block_new();
+	}
+	else if (req->header_slices.data){ // From a pooled request
+		onion_block_free(req->header_slices.data);
+		free(req->header_slices.slices);
+		req->header_slices.data=NULL;
+		req->header_slices.slices=NULL;
+		req->header_slices.size=0;
+	}
 	if (op){
 		if (op->request_init){
 			if (op->request_init(req)<0){
+				int err=errno; // Callers check for EAGAIN, non blocking accept with nothing new.
 				ONION_DEBUG("Invalid request, closing");
 				onion_request_free(req);
+				errno=err;
 				return NULL;
 			}
 		}
 		else
 			onion_listen_point_request_init_from_socket(req);
+		onion_request_stats_open(req);
 	}
 	return req;
 }
 
+/// Counts the connection as open at the server stats, once it has a socket.
+static void onion_request_stats_open(onion_request *req){
+	if (req->connection.fd>=0 && !req->connection.stats_open){
+		req->connection.stats_open=1;
+		onion_stats_connection(req->connection.listen_point->server, 1);
+	}
+}
+
 /// Creates a request, with socket info.
 onion_request *onion_request_new_from_socket(onion_listen_point *con, int fd, struct sockaddr_storage *cli_addr, socklen_t cli_len){
 	onion_request *req=onion_request_new(con);
 	req->connection.fd=fd;
 	memcpy(&req->connection.cli_addr,cli_addr,cli_len);
 	req->connection.cli_len=cli_len;
+	if (con)
+		onion_request_stats_open(req);
 	return req;
 }
 
@@ -102,6 +336,8 @@ onion_request *onion_request_new_from_socket(onion_listen_point *con, int fd, st
  * @memberof onion_request_t
  */
 static void unlink_files(void *p, const char *key, const char *value, int flags){
+	if (strncmp(value, ONION_SPOOL_UNNAMED, sizeof(ONION_SPOOL_UNNAMED)-1)==0) // Gone when its fd is closed
+		return;
 	ONION_DEBUG0("Unlinking temporal file %s",value);
 	unlink(value);
 }
@@ -112,11 +348,24 @@ static void unlink_files(void *p, const char *key, const char *value, int flags)
  */
 void onion_request_free(onion_request *req){
   ONION_DEBUG0("Free request %p", req);
+	char streaming=(req->sse!=NULL);
+	if (req->sse) // Before the connection is closed, as its groups may still shut it down.
+		onion_sse_detach(req->sse);
 	onion_dict_free(req->headers);
 	
+	if (req->connection.http2)
+		onion_http2_session_free(req);
 	if (req->connection.listen_point!=NULL && req->connection.listen_point->close)
 		req->connection.listen_point->close(req);
-	if (req->fullpath)
+	if (req->connection.stats_open)
+		onion_stats_connection(req->connection.listen_point->server, 0);
+	if (req->connection.record_id && req->connection.listen_point->server->traffic_record)
+		onion_traffic_record_close(req->connection.listen_point->server->traffic_record, req);
+	if (req->admission.connection || req->admission.request){
+		onion_admission_request_end(req);
+		onion_admission_connection_close(req);
+	}
+	if (req->fullpath && req->fullpath!=req->path_buffer.data)
 		free(req->fullpath);
 	if (req->GET)
 		onion_dict_free(req->GET);
@@ -126,28 +375,49 @@ void onion_request_free(onion_request *req){
 		onion_dict_preorder(req->FILES, unlink_files, NULL);
 		onion_dict_free(req->FILES);
 	}
-	if (req->session){
-    if (onion_dict_count(req->session)==0)
-      onion_request_session_free(req);
-    else{
-      onion_dict_free(req->session); // Not really remove, just dereference
-      free(req->session_id);
-    }
-  }
+	if (req->session_id)
+		onion_request_session_release(req);
+	if (req->json.dict) // Before the data, where its strings are
+		onion_dict_free(req->json.dict);
 	if (req->data)
 		onion_block_free(req->data);
-	if (req->connection.cli_info)
-		free(req->connection.cli_info);
 	
 	if (req->websocket)
 		onion_websocket_free(req->websocket);
 	
-	if (req->parser_data){
-		free(req->parser_data);
-	}
+	if (req->parser_data) // Kept for the pool
+		onion_request_parser_data_clean(req->parser_data);
 	if (req->cookies)
 		onion_dict_free(req->cookies);
-	free(req);
+	onion_request_watchdog_stop(req);
+	onion_request_canceller_stop(req);
+	if (req->response){ // Suspended, and never resumed; normal on event streams, as the client goes away.
+		if (streaming) // Its end can not be written anymore
+			req->response->flags|=OR_SKIP_CONTENT;
+		else
+			ONION_WARNING("Freeing a suspended request");
+		onion_response_free(req->response);
+	}
+	if (req->output.data)
+		onion_block_free(req->output.data);
+	if (req->output.last) // Not taken by the close
+		onion_block_free(req->output.last);
+	onion_request_output_shared_free(req);
+	if (req->output.file_fd>=0)
+		close(req->output.file_fd);
+	free(req->output.file_block);
+	if (req->header_slices.data)
+		onion_block_clear(req->header_slices.data);
+	if (req->pipeline.data)
+		onion_block_free(req->pipeline.data);
+	if (req->body.free_data)
+		req->body.free_data(req->body.data);
+	onion_request_body_inflate_free(req);
+	if (req->spool.fd>=0)
+		close(req->spool.fd);
+	onion_request_arena_reset(req);
+	if (onion_pool_put(ONION_POOL_REQUEST, req, onion_request_pool_free)<0)
+		onion_request_pool_free(req);
 }
 
 /**
@@ -156,22 +426,41 @@ void onion_request_free(onion_request *req){
  */
 void onion_request_clean(onion_request* req){
   ONION_DEBUG0("Clean request %p", req);
-  onion_dict_free(req->headers);
-  req->headers=onion_dict_new();
-  onion_dict_set_flags(req->headers, OD_ICASE);
-  req->flags&=OR_NO_KEEP_ALIVE; // I keep keep alive.
-  if (req->parser_data){
-    onion_request_parser_data_free(req->parser_data);
-    req->parser_data=NULL;
+  req->url_params.count=0;
+  if (req->headers->refcount==1) // Reset in place, unless some handler kept it.
+    onion_dict_clear(req->headers);
+  else{
+    onion_dict_free(req->headers);
+    req->headers=onion_dict_new();
+    onion_dict_set_flags(req->headers, OD_ICASE|OD_FLAT);
+  }
+  if (req->header_slices.data){ // Keeps the buffer for next request
+    onion_block_clear(req->header_slices.data);
+    req->header_slices.count=0;
+    req->header_slices.start=0;
+    req->header_slices.at_dict=0;
   }
+  memset(&req->known_headers, 0, sizeof(req->known_headers));
+  req->flags&=OR_NO_KEEP_ALIVE; // I keep keep alive.
+  if (req->admission.request)
+    onion_admission_request_end(req);
+  req->admission.start=0;
+  req->phase.deadline=0;
+  req->phase.cancelled=0;
+  memset(req->timings, 0, sizeof(req->timings));
+  if (req->parser_data) // Kept for the next request
+    onion_request_parser_data_clean(req->parser_data);
+  req->parser=NULL;
   if (req->fullpath){
-    free(req->fullpath);
+    if (req->fullpath!=req->path_buffer.data)
+      free(req->fullpath);
     req->path=req->fullpath=NULL;
   }
   if (req->GET){
     onion_dict_free(req->GET);
     req->GET=NULL;
   }
+  req->query=NULL; // At the arena
   if (req->POST){
     onion_dict_free(req->POST);
     req->POST=NULL;
@@ -181,31 +470,93 @@ void onion_request_clean(onion_request* req){
     onion_dict_free(req->FILES);
     req->FILES=NULL;
   }
-  if (req->session_id){
-    if (onion_dict_count(req->session)==0){
-      onion_request_session_free(req);
-    }
-    else{
-      onion_dict_free(req->session); // Not really remove, just dereference
-      req->session=NULL;
-      free(req->session_id);
-      req->session_id=NULL;
-    }
-  }
+  if (req->session_id)
+    onion_request_session_release(req);
+  if (req->json.dict)
+    onion_dict_free(req->json.dict);
+  req->json.dict=NULL;
+  req->json.parsed=0;
   if (req->data){
     onion_block_free(req->data);
     req->data=NULL;
   }
-	if (req->connection.cli_info){
-		free(req->connection.cli_info);
-		req->connection.cli_info=NULL;
-	}
 	if (req->cookies){
 		onion_dict_free(req->cookies);
 		req->cookies=NULL;
 	}
+	if (req->body.free_data)
+		req->body.free_data(req->body.data);
+	onion_request_body_inflate_free(req);
+	memset(&req->body, 0, sizeof(req->body));
+	if (req->spool.fd>=0)
+		close(req->spool.fd);
+	req->spool.fd=-1;
+	req->spool.dir=NULL; // At the arena
+	onion_request_arena_reset(req); // Last, the dicts may point into it.
+}
+
+
+/**
+ * @short Frees the buffers kept on keep alive, for a connection that is idle between requests.
+ * @memberof onion_request_t
+ * 
+ * The parser token, the arena, the path buffer, the header slices, the output buffer and the flat array of
+ * the headers dict are freed. They are created again as the next request comes.
+ * 
+ * It does nothing if a request is being read or answered, or there is pending output or pipelined data.
+ * 
+ * @returns 1 if compacted, 0 if not.
+ */
+int onion_request_compact(onion_request *req){
+	if (req->parser || req->response || req->websocket || req->suspended || req->body.paused ||
+			(req->flags&OR_HTTP2) || req->connection.http2 || req->pipeline.data || onion_request_output_pending(req))
+		return 0;
+	ONION_DEBUG0("Compact idle request %p", req);
+	if (req->parser_data){
+		onion_request_parser_data_free(req->parser_data);
+		req->parser_data=NULL;
+	}
+	onion_request_arena_free(req);
+	free(req->path_buffer.data);
+	req->path_buffer.data=NULL;
+	req->path_buffer.size=0;
+	if (req->header_slices.data){
+		onion_block_free(req->header_slices.data);
+		free(req->header_slices.slices);
+		req->header_slices.data=NULL;
+		req->header_slices.slices=NULL;
+		req->header_slices.size=0;
+	}
+	if (req->output.data){
+		onion_block_free(req->output.data);
+		req->output.data=NULL;
+		req->output.data_pos=0;
+	}
+	onion_dict *headers=req->headers;
+	if (headers->refcount==1 && (headers->flags&OD_FLAT)) // Flat again at the next request
+		onion_dict_flat_free(headers);
+	return 1;
 }
 
+/**
+ * @short Sets the fullpath to a copy of path, at the path buffer that is kept on keep alive.
+ * 
+ * Internal. The previous fullpath is not freed, and the path must be set by the caller as needed.
+ */
+void onion_request_set_fullpath(onion_request *req, const char *path){
+	size_t l=strlen(path)+1;
+	char *data=req->path_buffer.data;
+	if (l>req->path_buffer.size){
+		req->path_buffer.size=(l<64) ? 64 : l;
+		data=malloc(req->path_buffer.size);
+	}
+	memmove(data, path, l); // path may be at the current fullpath
+	if (data!=req->path_buffer.data){
+		free(req->path_buffer.data);
+		req->path_buffer.data=data;
+	}
+	req->fullpath=data;
+}
 
 /**
  * @short Returns a pointer to the string with the current path. Its a const and should not be trusted for long time.
@@ -239,22 +590,122 @@ void onion_request_advance_path(onion_request *req, int addtopos){
 	req->path=&req->path[addtopos];
 }
 
+/// Returns the value of the capture, copying it to the arena the first time.
+static const char *onion_request_url_param_value(onion_request *req, struct onion_request_url_param_t *param){
+	if (!param->value){
+		char *value=onion_request_alloc(req, param->length+1);
+		memcpy(value, param->start, param->length);
+		value[param->length]='\0';
+		param->value=value;
+	}
+	return param->value;
+}
+
+/**
+ * @short Gets the value of a :name segment of the url patterns that matched, as "id" for "users/:id".
+ * @memberof onion_request_t
+ * 
+ * The urls keep just where at the path it is; the string is made at the request arena when first asked, 
+ * and is valid until the request is cleaned. If several levels of urls have the same name, the innermost 
+ * is returned.
+ */
+const char *onion_request_get_url_param(onion_request *req, const char *name){
+	int i;
+	for (i=req->url_params.count-1;i>=0;i--){
+		struct onion_request_url_param_t *param=&req->url_params.params[i];
+		if (param->name && strcmp(param->name, name)==0)
+			return onion_request_url_param_value(req, param);
+	}
+	return NULL;
+}
+
+/**
+ * @short Gets the group n, from 1, of the innermost url regexp that matched with such group.
+ * @memberof onion_request_t
+ * 
+ * As onion_request_get_url_param, made when first asked. onion_request_get_query also returns them, 
+ * as "1", "2"..., if there is no such key at the query.
+ */
+const char *onion_request_get_url_group(onion_request *req, int n){
+	int i;
+	for (i=req->url_params.count-1;i>=0;i--){
+		struct onion_request_url_param_t *param=&req->url_params.params[i];
+		if (param->group==n)
+			return onion_request_url_param_value(req, param);
+	}
+	return NULL;
+}
+
+/**
+ * @short Keeps a capture of the url that matched: a :name segment, or a group of a regexp if name is NULL.
+ * @memberof onion_request_t
+ * 
+ * Only where it is at the path is kept, so it does not allocate. The name must be kept until the 
+ * request is cleaned, as the urls do.
+ */
+void onion_request_add_url_param(onion_request *req, const char *name, int group, const char *start, int length){
+	if (req->url_params.count==ONION_REQUEST_MAX_URL_PARAMS){
+		ONION_DEBUG("Too many url captures, %s %d is not kept", name ? name : "group", group);
+		return;
+	}
+	struct onion_request_url_param_t *param=&req->url_params.params[req->url_params.count++];
+	param->name=name;
+	param->group=group;
+	param->start=start;
+	param->length=length;
+	param->value=NULL;
+}
+
 /**
  * @short Gets a header data
  * @memberof onion_request_t
+ * 
+ * On onion_set_header_slices mode it is looked up at the header slices, case insensitive, and returns
+ * a pointer into the per connection buffer, valid until the request is cleaned.
  */
 const char *onion_request_get_header(onion_request *req, const char *header){
+	if (req->header_slices.count){
+		const char *data=req->header_slices.data->data;
+		int l=strlen(header);
+		int i;
+		for (i=0;i<req->header_slices.count;i++){
+			const struct onion_request_header_slice_t *sl=&req->header_slices.slices[i];
+			if (sl->key_length==l && strcasecmp(&data[sl->key], header)==0)
+				return &data[sl->value];
+		}
+	}
 	return onion_dict_get(req->headers, header);
 }
 
+/**
+ * @short Gets a well known header, resolved when parsed.
+ * @memberof onion_request_t
+ * 
+ * Same as onion_request_get_header with onion_request_header_names[id], but just an array access. For 
+ * requests not parsed, as the ones built by hand, it is looked up by name.
+ */
+const char *onion_request_get_header_id(onion_request *req, onion_header_id id){
+	if (req->known_headers.ready)
+		return req->known_headers.values[id];
+	return onion_request_get_header(req, onion_request_header_names[id]);
+}
+
 /**
  * @short Gets a query data
  * @memberof onion_request_t
+ * 
+ * Until the query dict is asked for, the raw query is scanned for this key, so handlers that only
+ * need a couple of values from long queries do not pay for parsing it all.
  */
 const char *onion_request_get_query(onion_request *req, const char *query){
+	const char *ret=NULL;
 	if (req->GET)
-		return onion_dict_get(req->GET, query);
-	return NULL;
+		ret=onion_dict_get(req->GET, query);
+	else if (req->query)
+		ret=onion_request_query_find(req, query);
+	if (!ret && req->url_params.count && isdigit(query[0])) // The url regexp groups, as they were added here
+		ret=onion_request_get_url_group(req, atoi(query));
+	return ret;
 }
 
 /**
@@ -269,6 +720,16 @@ const char *onion_request_get_queryd(onion_request *req, const char *key, const
 	return def;
 }
 
+/**
+ * @short Gets the raw query string, the part after the '?', still quoted.
+ * @memberof onion_request_t
+ * 
+ * Handlers can walk it with onion_query_next, with no allocations, instead of building the GET dict.
+ */
+const char *onion_request_get_query_string(onion_request *req){
+	return req->query;
+}
+
 /**
  * @short Gets a post data
  * @memberof onion_request_t
@@ -294,8 +755,8 @@ const char *onion_request_get_file(onion_request *req, const char *query){
  * @memberof onion_request_t
  */
 const char *onion_request_get_session(onion_request *req, const char *key){
-	onion_dict *d=onion_request_get_session_dict(req);
-	return onion_dict_get(d, key);
+	const onion_dict *d=onion_request_get_session_snapshot(req);
+	return d ? onion_dict_get(d, key) : NULL;
 }
 
 /**
@@ -303,15 +764,26 @@ const char *onion_request_get_session(onion_request *req, const char *key){
  * @memberof onion_request_t
  */
 const onion_dict *onion_request_get_header_dict(onion_request *req){
+	if (req->header_slices.count && !req->header_slices.at_dict){ // Built now, the strings are still at the buffer.
+		const char *data=req->header_slices.data->data;
+		int i;
+		for (i=0;i<req->header_slices.count;i++){
+			const struct onion_request_header_slice_t *sl=&req->header_slices.slices[i];
+			onion_dict_add(req->headers, &data[sl->key], &data[sl->value], 0);
+		}
+		req->header_slices.at_dict=1;
+	}
 	return req->headers;
 }
 
 /**
  * @short Gets request query dict
  * @memberof onion_request_t
+ * 
+ * It is built at the first call, from the raw query.
  */
 const onion_dict *onion_request_get_query_dict(onion_request *req){
-	return req->GET;
+	return onion_request_query_dict(req);
 }
 
 /**
@@ -337,7 +809,7 @@ const onion_dict *onion_request_get_file_dict(onion_request *req){
 void onion_request_guess_session_id(onion_request *req){
 	if (req->session_id) // already known.
 		return;
-	const char *ov=onion_dict_get(req->headers, "Cookie");
+	const char *ov=onion_request_get_header_id(req, ONION_H_COOKIE);
   const char *v=ov;
 	ONION_DEBUG("Session ID, maybe from %s",v);
 	char *r=NULL;
@@ -364,7 +836,7 @@ void onion_request_guess_session_id(onion_request *req){
       while (*p!='\0' && *p!=';') p++;
       *p='\0';
       ONION_DEBUG0("Checking if %s exists in sessions", r);
-      session=onion_sessions_get(req->connection.listen_point->server->sessions, r);
+      session=onion_sessions_get(onion_get_sessions(req->connection.listen_point->server), r);
     }
 	}while(!session);
 	
@@ -386,7 +858,11 @@ void onion_request_guess_session_id(onion_request *req){
  * 
  * Session is not automatically retrieved as it is a slow operation and not used normally, only on "active" handlers.
  * 
- * Returned dictionary can be freely managed (added new keys...) and this is the session data.
+ * Returned dictionary can be freely managed (added new keys...) and this is the session data. It is
+ * a copy for this request, so it needs no lock; when the request ends, it replaces the stored one if
+ * it was changed. If several requests change the same session at once, the last one to end wins.
+ * Handlers that only read should use onion_request_get_session_snapshot or onion_request_get_session,
+ * that do not copy nor save it.
  * 
  * @return session dictionary for current request.
  */
@@ -397,13 +873,111 @@ onion_dict *onion_request_get_session_dict(onion_request *req){
     }
 		onion_request_guess_session_id(req);
 		if (!req->session){ // Maybe old session is not to be used anymore
-			req->session_id=onion_sessions_create(req->connection.listen_point->server->sessions);
-			req->session=onion_sessions_get(req->connection.listen_point->server->sessions, req->session_id);
+			req->session_id=onion_sessions_create(onion_get_sessions(req->connection.listen_point->server));
+			req->session=onion_sessions_get(onion_get_sessions(req->connection.listen_point->server), req->session_id);
+			if (!req->session) // At cookies it is not stored until the response
+				req->session=onion_dict_new();
+		}
+	}
+	if (!req->session_writable){
+		if (req->session->refcount>1){ // Shared with the storage or other requests, so a copy to write at.
+			onion_dict *copy=onion_dict_hard_dup(req->session);
+			onion_dict_free(req->session);
+			req->session=copy;
 		}
+		req->session_writable=1;
+		req->session_generation=onion_dict_generation(req->session);
 	}
 	return req->session;
 }
 
+/**
+ * @short Returns the session dict to read, or NULL if there is no session.
+ * @memberof onion_request_t
+ * 
+ * It is the stored session as it was when first asked, shared with the other requests that read it 
+ * and never modified while shared, so it needs no lock. It does not create a session, and the session
+ * is not saved at the end of the request, nor is any lock taken, unless onion_request_get_session_dict
+ * is also used.
+ * 
+ * Sessions as onion_request_get_session_dict, before sending any header.
+ */
+const onion_dict *onion_request_get_session_snapshot(onion_request *req){
+	if (!req->session)
+		onion_request_guess_session_id(req);
+	return req->session;
+}
+
+/**
+ * @short Marks the session as changed, so it is saved at the end of the request.
+ * @memberof onion_request_t
+ * 
+ * Only needed when changing dicts inside the session dict, as adding or removing at it is already seen.
+ */
+void onion_request_session_changed(onion_request *req){
+	onion_request_get_session_dict(req);
+	req->session_generation=onion_dict_generation(req->session)-1;
+}
+
+/// The Set-Cookie value for the sessionid cookie with that value.
+static char *onion_request_session_cookie_value(const char *value){
+	size_t length=strlen(value)+sizeof("sessionid=; httponly");
+	char *ret=malloc(length);
+	snprintf(ret, length, "sessionid=%s; httponly", value);
+	return ret;
+}
+
+/**
+ * @short Returns the Set-Cookie value for the session, to be freed, or NULL if none is needed.
+ * 
+ * With the sessions in memory or at a backend, it is the session id, while the session has something. 
+ * With the sessions at cookies, it is the encoded session, only if it changed, or to remove the cookie 
+ * if it is empty now; then the session counts as saved.
+ */
+char *onion_request_session_cookie(onion_request *req){
+	if (!req->session_id || !req->session)
+		return NULL;
+	onion_sessions *sessions=onion_get_sessions(req->connection.listen_point->server);
+	if (!sessions->cookie.enabled)
+		return onion_dict_count(req->session)>0 ? onion_request_session_cookie_value(req->session_id) : NULL;
+	if (!req->session_writable || onion_dict_generation(req->session)==req->session_generation)
+		return NULL; // The client keeps the one it sent.
+	req->session_generation=onion_dict_generation(req->session);
+	if (onion_dict_count(req->session)==0)
+		return strdup("sessionid=; Max-Age=0; httponly");
+	char *cookie=onion_sessions_cookie_encode(sessions, req->session);
+	if (!cookie)
+		return NULL;
+	char *ret=onion_request_session_cookie_value(cookie);
+	free(cookie);
+	return ret;
+}
+
+/**
+ * @short Ends the use of the session by the request.
+ * 
+ * Only the sessions changed at the copy of onion_request_get_session_dict are saved, replacing the 
+ * stored one, so requests that only read do not write to the storage. Empty sessions are removed.
+ */
+static void onion_request_session_release(onion_request *req){
+	if (req->session && onion_dict_count(req->session)==0){
+		onion_request_session_free(req);
+		return;
+	}
+	if (req->session_writable && onion_dict_generation(req->session)!=req->session_generation){
+		onion_sessions *sessions=onion_get_sessions(req->connection.listen_point->server);
+		if (sessions->cookie.enabled)
+			ONION_WARNING("Session changed after sending the headers, so it is not at the cookie. Changes lost.");
+		onion_sessions_save(sessions, req->session_id, req->session);
+	}
+	if (req->session)
+		onion_dict_free(req->session); // Not really remove, just dereference
+	req->session=NULL;
+	req->session_writable=0;
+	free(req->session_id);
+	req->session_id=NULL;
+}
+
 
 /**
  * @short Forces the request to process only one request, not doing the keep alive.
@@ -426,13 +1000,15 @@ void onion_request_set_no_keep_alive(onion_request *req){
 int onion_request_keep_alive(onion_request *req){
 	if (req->flags&OR_NO_KEEP_ALIVE)
 		return 0;
+	if (req->connection.listen_point && req->connection.listen_point->server->draining) // Handed to the next process
+		return 0;
 	if (req->flags&OR_HTTP11){
-		const char *connection=onion_request_get_header(req,"Connection");
+		const char *connection=onion_request_get_header_id(req, ONION_H_CONNECTION);
 		if (!connection || strcasecmp(connection,"Close")!=0) // Other side wants keep alive
 			return 1;
 	}
 	else{ // HTTP/1.0
-		const char *connection=onion_request_get_header(req,"Connection");
+		const char *connection=onion_request_get_header_id(req, ONION_H_CONNECTION);
 		if (connection && strcasecmp(connection,"Keep-Alive")==0) // Other side wants keep alive
 			return 1;
 	}
@@ -454,9 +1030,10 @@ void onion_request_session_free(onion_request *req){
 		onion_request_guess_session_id(req);
 	if (req->session_id){
     ONION_DEBUG("Removing from session storage session id: %s",req->session_id);
-		onion_sessions_remove(req->connection.listen_point->server->sessions, req->session_id);
+		onion_sessions_remove(onion_get_sessions(req->connection.listen_point->server), req->session_id);
 		onion_dict_free(req->session);
 		req->session=NULL;
+		req->session_writable=0;
 		free(req->session_id);
 		req->session_id=NULL;
 	}
@@ -474,7 +1051,7 @@ void onion_request_session_free(onion_request *req){
  * @returns The language code for this request or C. Data must be freed.
  */
 const char *onion_request_get_language_code(onion_request *req){
-	const char *lang=onion_dict_get(req->headers, "Accept-Language");
+	const char *lang=onion_request_get_header_id(req, ONION_H_ACCEPT_LANGUAGE);
 	if (lang){
 		char *l=strdup(lang);
 		char *p=l;
@@ -500,36 +1077,30 @@ const onion_block *onion_request_get_data(onion_request *req){
 }
 
 /**
- * @short Launches one handler for the given request
+ * @short Parses the body as json, as onion_dict_from_json_inplace, so the strings are not copied.
+ * @memberof onion_request_t
  * 
- * Once the request is ready, launch it.
+ * It is parsed at the first call, and kept until the request is cleaned. After it, the data of 
+ * onion_request_get_data has the strings decoded and ended by \0, so it is not the original body anymore.
  * 
- * @returns The connection status: if it should be closed, error codes...
+ * @returns The json body as a dict, or NULL if there is no body or it is not valid json.
  */
-onion_connection_status onion_request_process(onion_request *req){
-	onion_response *res=onion_response_new(req);
-	if (!req->path){ 
-    onion_request_polish(req);
-  }  
-	// Call the main handler.
-	onion_connection_status hs=onion_handler_handle(req->connection.listen_point->server->root_handler, req, res);
-
-	if (hs==OCS_INTERNAL_ERROR || 
-		hs==OCS_NOT_IMPLEMENTED || 
-		hs==OCS_NOT_PROCESSED){
-		if (hs==OCS_INTERNAL_ERROR)
-			req->flags|=OR_INTERNAL_ERROR;
-		if (hs==OCS_NOT_IMPLEMENTED)
-			req->flags|=OR_NOT_IMPLEMENTED;
-		if (hs==OCS_NOT_PROCESSED)
-			req->flags|=OR_NOT_FOUND;
-    if (hs==OCS_FORBIDDEN)
-      req->flags|=OR_FORBIDDEN;
-		
-		hs=onion_handler_handle(req->connection.listen_point->server->internal_error_handler, req, res);
-	}
+const onion_dict *onion_request_get_json(onion_request *req){
+	if (req->json.parsed || !req->data)
+		return req->json.dict;
+	req->json.parsed=1;
+	req->json.dict=onion_dict_from_json_inplace((char*)onion_block_data(req->data), onion_block_size(req->data));
+	return req->json.dict;
+}
 
-	
+/**
+ * @short Frees the response, and prepares the request for the next petition on keep alive.
+ * 
+ * @returns The connection status, as onion_request_process.
+ */
+static onion_connection_status onion_request_complete(onion_request *req, onion_response *res, onion_connection_status hs){
+	onion_request_canceller_stop(req);
+	onion_request_timing(req, OR_PHASE_HANDLED);
 	int rs=onion_response_free(res);
 	if (hs>=0 && rs==OCS_KEEP_ALIVE) // if keep alive, reset struct to get the new petition.
 		onion_request_clean(req);
@@ -538,81 +1109,747 @@ onion_connection_status onion_request_process(onion_request *req){
 }
 
 /**
- * @short Performs the final touches do the request is ready to be handled.
- * @memberof onion_request_t
- * 
- * After parsing the request, some final touches are needed to set the current path.
+ * @short Keeps a copy of the pipelined data after this request, as the request will finish at another thread.
  * 
- * @param req The request.
+ * It is fed to the parser when the request is given back to the poller. @see onion_listen_point_request_resume
  */
-void onion_request_polish(onion_request *req){
-  if (*req->fullpath)
-    req->path=req->fullpath+1;
-  else
-    req->path=req->fullpath;
+static void onion_request_pipeline_keep(onion_request *req){
+	if (!req->pipeline.rest_length)
+		return;
+	if (!req->pipeline.data)
+		req->pipeline.data=onion_block_new();
+	onion_block_add_data(req->pipeline.data, req->pipeline.rest, req->pipeline.rest_length);
+	req->pipeline.rest=NULL;
+	req->pipeline.rest_length=0;
 }
 
 /**
- * @short Returns a string with the client's description.
+ * @short Returns the handler for this request: the one of its Host, or the root handler.
  * @memberof onion_request_t
+ */
+onion_handler *onion_request_root_handler(onion_request *req){
+	onion *server=req->connection.listen_point->server;
+	if (!server->vhosts)
+		return server->root_handler;
+	return onion_get_vhost_handler(server, onion_request_get_header(req, "Host"));
+}
+
+/**
+ * @short Timer of the handler timeout of a suspended request
  * 
- * @return A const char * with the client description
+ * Apart from the request, as the request may be resumed and freed before it expires.
  */
-const char *onion_request_get_client_description(onion_request *req){
-	if (!req->connection.cli_info && req->connection.cli_len){
-		char tmp[256];
-		if (getnameinfo((struct sockaddr *)&req->connection.cli_addr, req->connection.cli_len, tmp, sizeof(tmp)-1,
-					NULL, 0, NI_NUMERICHOST) == 0){
-			tmp[sizeof(tmp)-1]='\0';
-			req->connection.cli_info=strdup(tmp);
-		}
-		else
-			req->connection.cli_info=NULL;
+struct onion_request_watchdog_t{
+	int fd;       ///< Of the connection
+	char stopped; ///< Expired, or the request is done with the connection.
+	int refs;     ///< The request and the timer. Atomic.
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex; ///< Held while shutting down the connection, so it is not closed, and maybe reused, meanwhile.
+#endif
+};
+
+/// Drops a reference to the watchdog, freeing it at the last one.
+static void onion_request_watchdog_unref(struct onion_request_watchdog_t *w){
+	if (__sync_sub_and_fetch(&w->refs, 1)==0){
+		pthread_mutex_destroy(&w->mutex);
+		free(w);
 	}
-	return req->connection.cli_info;
+}
+
+/// The suspended request was not resumed in time; the client gets the connection closed.
+static void onion_request_watchdog_expired(struct onion_request_watchdog_t *w){
+	pthread_mutex_lock(&w->mutex);
+	if (!w->stopped){
+		ONION_WARNING("Suspended request not resumed in time, shutting down its connection %d", w->fd);
+		shutdown(w->fd, SHUT_RDWR); // The writes of the handler fail, and it is closed as it resumes.
+		w->stopped=1;
+	}
+	pthread_mutex_unlock(&w->mutex);
+	onion_request_watchdog_unref(w);
+}
+
+/// Starts the handler timeout of a request that is being suspended, if any.
+static void onion_request_watchdog_start(onion_request *req){
+	int ms=req->connection.listen_point->server->timeouts.handler;
+	if (ms<=0)
+		return;
+	struct onion_request_watchdog_t *w=malloc(sizeof(struct onion_request_watchdog_t));
+	w->fd=req->connection.fd;
+	w->stopped=0;
+	w->refs=2;
+	pthread_mutex_init(&w->mutex, NULL);
+	if (onion_poller_add_timer(onion_request_get_poller(req), ms, (void*)onion_request_watchdog_expired, w)<0){
+		pthread_mutex_destroy(&w->mutex);
+		free(w);
+		return;
+	}
+	req->phase.watchdog=w;
+}
+
+/// Stops the handler timeout, before the connection may be closed. Waits for it if expiring now.
+static void onion_request_watchdog_stop(onion_request *req){
+	struct onion_request_watchdog_t *w=req->phase.watchdog;
+	if (!w)
+		return;
+	req->phase.watchdog=NULL;
+	pthread_mutex_lock(&w->mutex);
+	w->stopped=1;
+	pthread_mutex_unlock(&w->mutex);
+	onion_request_watchdog_unref(w);
+}
+
+/// Monotonic milliseconds, as the deadlines.
+static int64_t onion_request_now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
 }
 
 /**
- * @short Returns the sockaddr_storage pointer to the data client data as stored here.
- * @memberof onion_request_t
+ * @short Sets the deadline of the request, as it goes to the handler.
  * 
- * @param req Request to get data from
- * @param client_len The lenght of the returned sockaddr_storage
- * @returns Pointer to the stored sockaddr_storage.
+ * It is the handler timeout (onion_set_timeouts), or the one the client asks at the X-Request-Timeout 
+ * header if shorter. The time waiting for a worker counts.
  */
-struct sockaddr_storage *onion_request_get_sockadd_storage(onion_request *req, socklen_t *client_len){
-  if (client_len)
-    *client_len=req->connection.cli_len;
-	if (req->connection.cli_len==0)
-		return NULL;
-  return &req->connection.cli_addr;
+static void onion_request_deadline_start(onion_request *req){
+	int ms=req->connection.listen_point ? req->connection.listen_point->server->timeouts.handler : 0;
+	const char *timeout=onion_request_get_header(req, ONION_REQUEST_TIMEOUT_HEADER);
+	if (timeout){
+		int client=atoi(timeout);
+		if (client>0 && (ms<=0 || client<ms))
+			ms=client;
+	}
+	req->phase.deadline=(ms>0) ? onion_request_now_ms()+ms : 0;
 }
 
 /**
- * @short Gets the dict with the cookies
+ * @short Milliseconds left until the request deadline.
  * @memberof onion_request_t
  * 
- * @param req Request to get the cookies from
- * 
- * @returns A dict with all the cookies. It might be empty.
+ * For the handlers that call other services, so they wait no more than that, and pass it on, as 
+ * onion_handler_proxy does with the X-Request-Timeout header.
  * 
- * First call it generates the dict.
+ * @returns The milliseconds, 0 if it passed, or -1 if the request has no deadline.
  */
-onion_dict* onion_request_get_cookies_dict(onion_request* req){
-	if (req->cookies)
+int onion_request_get_remaining_ms(onion_request *req){
+	if (!req->phase.deadline)
+		return -1;
+	int64_t left=req->phase.deadline-onion_request_now_ms();
+	return left>0 ? (int)left : 0;
+}
+
+/**
+ * @short Whether the handler can give up the request, as nobody waits for the answer.
+ * @memberof onion_request_t
+ * 
+ * That is when the deadline passed, or the client closed the connection, or at least its side of it, 
+ * as seen by a poll without wait. Handlers doing long work call it from time to time; once cancelled 
+ * it stays so. The answer is not sent when the client is gone, and may be a 503 or some partial 
+ * result if only the deadline passed.
+ */
+int onion_request_is_cancelled(onion_request *req){
+	if (__atomic_load_n(&req->phase.cancelled, __ATOMIC_RELAXED))
+		return 1;
+	int cancelled=0;
+	if (req->phase.deadline && onion_request_now_ms()>=req->phase.deadline)
+		cancelled=1;
+	else if (req->connection.fd>=0){
+		struct pollfd pfd={ req->connection.fd, POLLRDHUP, 0 };
+		if (poll(&pfd, 1, 0)>0 && (pfd.revents&(POLLRDHUP|POLLHUP|POLLERR)))
+			cancelled=1;
+	}
+	if (cancelled)
+		__atomic_store_n(&req->phase.cancelled, 1, __ATOMIC_RELAXED);
+	return cancelled;
+}
+
+/**
+ * @short Checks the request from the poller, while at the handler, to call the cancel callback.
+ * 
+ * Apart from the request, as the timer may expire after the request is done.
+ */
+struct onion_request_canceller_t{
+	onion_request *req;
+	onion_poller *poller;
+	void (*f)(void *data);
+	void *data;
+	char stopped; ///< Called, or the request is done. req is not valid then.
+	int refs;     ///< The request and the timer. Atomic.
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex; ///< Held while checking, so the request is alive meanwhile.
+#endif
+};
+
+static void onion_request_canceller_check(struct onion_request_canceller_t *c);
+
+/// Drops a reference to the canceller, freeing it at the last one.
+static void onion_request_canceller_unref(struct onion_request_canceller_t *c){
+	if (__sync_sub_and_fetch(&c->refs, 1)==0){
+		pthread_mutex_destroy(&c->mutex);
+		free(c);
+	}
+}
+
+/// Next check, at the deadline or ONION_REQUEST_CANCEL_CHECK_MS, what comes first.
+static int onion_request_canceller_arm(struct onion_request_canceller_t *c, int remaining){
+	int ms=(remaining>=0 && remaining<ONION_REQUEST_CANCEL_CHECK_MS) ? remaining : ONION_REQUEST_CANCEL_CHECK_MS;
+	return onion_poller_add_timer(c->poller, ms, (void*)onion_request_canceller_check, c);
+}
+
+/**
+ * @short The timer: calls the callback if cancelled, or checks again later.
+ * 
+ * The next timer is added out of the lock, as stopping may be called with the poller locked.
+ */
+static void onion_request_canceller_check(struct onion_request_canceller_t *c){
+	int remaining=-2; // Not checking again
+	pthread_mutex_lock(&c->mutex);
+	if (!c->stopped){
+		if (onion_request_is_cancelled(c->req)){
+			ONION_DEBUG("Request cancelled at the handler");
+			c->f(c->data);
+			c->stopped=1;
+		}
+		else
+			remaining=onion_request_get_remaining_ms(c->req);
+	}
+	pthread_mutex_unlock(&c->mutex);
+	if (remaining>=-1 && onion_request_canceller_arm(c, remaining)>=0)
+		return; // Keeps the reference for the new timer
+	onion_request_canceller_unref(c);
+}
+
+/**
+ * @short Calls f if the request is cancelled while at the handler.
+ * @memberof onion_request_t
+ * 
+ * The poller checks the request from time to time, and calls f once, from a poller thread, if the 
+ * client goes away or the deadline passes (onion_request_is_cancelled) before the response is 
+ * complete. So a handler waiting for something else, or working at another thread, can stop. It 
+ * should be short, as setting a flag or waking the work up, as the request waits for it to end. It is 
+ * not called once the request is complete. Only on O_POLL/O_POOL modes, one callback per request.
+ * 
+ * @param req The request
+ * @param f Function to call, from the poller thread
+ * @param data Passed as is to f
+ */
+void onion_request_set_cancel_callback(onion_request *req, void (*f)(void *data), void *data){
+	onion_poller *poller=onion_request_get_poller(req);
+	if (!poller || req->phase.canceller){
+		ONION_ERROR("Cancel callbacks only on O_POLL/O_POOL modes, once per request");
+		return;
+	}
+	struct onion_request_canceller_t *c=malloc(sizeof(struct onion_request_canceller_t));
+	c->req=req;
+	c->poller=poller;
+	c->f=f;
+	c->data=data;
+	c->stopped=0;
+	c->refs=2;
+	pthread_mutex_init(&c->mutex, NULL);
+	if (onion_request_canceller_arm(c, onion_request_get_remaining_ms(req))<0){
+		pthread_mutex_destroy(&c->mutex);
+		free(c);
+		return;
+	}
+	req->phase.canceller=c;
+}
+
+/// Stops calling the cancel callback, waiting for it if being called, as the request is done.
+static void onion_request_canceller_stop(onion_request *req){
+	struct onion_request_canceller_t *c=req->phase.canceller;
+	if (!c)
+		return;
+	req->phase.canceller=NULL;
+	pthread_mutex_lock(&c->mutex);
+	c->stopped=1;
+	pthread_mutex_unlock(&c->mutex);
+	onion_request_canceller_unref(c);
+}
+
+/**
+ * @short Runs the handler for the given request, at this thread.
+ * 
+ * @returns The connection status, or OCS_YIELD if the handler suspended the request.
+ */
+static onion_connection_status onion_request_process_now(onion_request *req){
+	onion_response *res=onion_response_new(req);
+	if (!req->path){ 
+    onion_request_polish(req);
+  }  
+	int method=req->flags&OR_METHODS;
+	if (req->connection.early_data && method!=OR_GET && method!=OR_HEAD && method!=OR_OPTIONS){ // TLS 1.3 early data could be replayed; the client sends it again after the handshake. RFC 8470.
+		onion_shortcut_response("Too early", HTTP_TOO_EARLY, req, res);
+		return onion_request_complete(req, res, OCS_PROCESSED);
+	}
+	if (req->admission.start && !onion_admission_request_handle(req, res))
+		return onion_request_complete(req, res, OCS_PROCESSED);
+	if (req->phase.cancelled || (req->phase.deadline && onion_request_is_cancelled(req))){ // Waited too long at the workers, or the client is gone.
+		ONION_DEBUG("Request cancelled before its handler");
+		onion_shortcut_response("Service unavailable", HTTP_SERVICE_UNAVALIABLE, req, res);
+		onion_request_complete(req, res, OCS_PROCESSED);
+		return OCS_CLOSE_CONNECTION;
+	}
+	// Call the main handler.
+	ONION_TRACE(handler_enter, req->connection.fd, req->fullpath);
+	onion_connection_status hs=onion_handler_handle(onion_request_root_handler(req), req, res);
+	ONION_TRACE(handler_exit, req->connection.fd, req->fullpath, hs);
+
+	if (hs==OCS_SUSPENDED){
+		if (!req->connection.slot){
+			ONION_ERROR("Handler returned OCS_SUSPENDED, but this request does not come from a poller. Closing it.");
+			onion_request_complete(req, res, OCS_PROCESSED);
+			return OCS_CLOSE_CONNECTION;
+		}
+		onion_request_pipeline_keep(req);
+		req->response=res;
+		if (!req->sse) // Event streams last as long as the client wants.
+			onion_request_watchdog_start(req); // Before, as once suspended it may be resumed and freed at any time.
+		if (!(__sync_fetch_and_or(&req->suspended, 1)&2)){ // Not resumed yet, whoever resumes, completes.
+			if (req->sse)
+				onion_sse_suspended(req->sse);
+			return OCS_YIELD;
+		}
+		ONION_DEBUG0("Request resumed before handler returned, complete now");
+		onion_request_watchdog_stop(req);
+		req->response=NULL;
+		req->suspended=0;
+		onion_response_flush(res); // Headers, as onion_handler_handle does for the other statuses.
+		hs=OCS_PROCESSED;
+	}
+
+	if (req->sse) // Not suspended, so the stream ends with the request.
+		onion_sse_detach(req->sse);
+
+	if (hs==OCS_INTERNAL_ERROR || 
+		hs==OCS_NOT_IMPLEMENTED || 
+		hs==OCS_NOT_PROCESSED){
+		if (hs==OCS_INTERNAL_ERROR)
+			req->flags|=OR_INTERNAL_ERROR;
+		if (hs==OCS_NOT_IMPLEMENTED)
+			req->flags|=OR_NOT_IMPLEMENTED;
+		if (hs==OCS_NOT_PROCESSED)
+			req->flags|=OR_NOT_FOUND;
+    if (hs==OCS_FORBIDDEN)
+      req->flags|=OR_FORBIDDEN;
+		
+		hs=onion_handler_handle(req->connection.listen_point->server->internal_error_handler, req, res);
+	}
+
+	return onion_request_complete(req, res, hs);
+}
+
+#ifdef HAVE_PTHREADS
+/**
+ * @short Runs the request at a worker thread, and then gives back the connection to its poller.
+ */
+static void onion_request_process_worker(onion_request *req){
+	onion_request_is_cancelled(req); // Maybe the client went away meanwhile; then it is not handled.
+	onion_connection_status st=onion_request_process_now(req);
+	if (st==OCS_YIELD) // Suspended
+		return;
+	onion_listen_point_request_resume(req, st);
+}
+#endif
+
+/**
+ * @short Completes a suspended request. At the poller thread.
+ */
+static void onion_request_resume_now(onion_request *req){
+	onion_response *res=req->response;
+	req->response=NULL;
+	req->suspended=0;
+	onion_response_flush(res); // Headers, as onion_handler_handle does for the other statuses.
+	onion_connection_status st=onion_request_complete(req, res, OCS_PROCESSED);
+	onion_listen_point_request_resume(req, st);
+}
+
+/**
+ * @short Resumes a request that was suspended by its handler returning OCS_SUSPENDED
+ * @memberof onion_request_t
+ * 
+ * When a handler must wait for something (long polling, some upstream data...), instead of blocking the
+ * thread it may keep the request and response pointers and return OCS_SUSPENDED. Later, from any 
+ * thread, it writes the response and calls this function. The response is then finished at the 
+ * connection poller, and the connection is ready for the next request, or closed.
+ * 
+ * After this call, request and response must not be used anymore.
+ * 
+ * Only for O_POLL/O_POOL modes. While suspended the connection has no timeout, but the handler one, that 
+ * shuts down the connection if not resumed in time. @see onion_timeouts_t
+ * 
+ * @param req The suspended request
+ */
+void onion_request_resume(onion_request *req){
+	if (!(__sync_fetch_and_or(&req->suspended, 2)&1)) // Handler did not return yet, it will complete.
+		return;
+	onion_request_watchdog_stop(req);
+	onion_listen_point *op=req->connection.listen_point;
+	onion_poller_call(op->poller ? op->poller : op->server->poller, (void*)onion_request_resume_now, req);
+}
+
+/**
+ * @short Returns the poller of the connection of this request, or NULL if it does not come from a poller
+ * @memberof onion_request_t
+ * 
+ * It is where onion_request_resume completes the request, so handlers that suspend it can also 
+ * schedule their own work there, with onion_poller_call or onion_poller_add_timer.
+ */
+onion_poller *onion_request_get_poller(onion_request *req){
+	if (!req->connection.slot)
+		return NULL;
+	onion_listen_point *op=req->connection.listen_point;
+	return op->poller ? op->poller : op->server->poller;
+}
+
+/**
+ * @short Sets the callback that gets the request body as it is read, instead of keeping it.
+ * @memberof onion_request_t
+ * 
+ * Only from the body hook (onion_set_request_body_hook), before the body is read. The callback gets each
+ * chunk as read, and then the handler is called as usual, but with no POST, FILES nor data. If the 
+ * callback can not take more data for a while, it returns OCS_SUSPENDED, and no more data is read from 
+ * the connection until onion_request_body_resume.
+ * 
+ * @param req The request
+ * @param callback Gets the body chunks. @see onion_request_body_callback
+ * @param data Passed as is to the callback
+ * @param free_data Called with data when the request is done, if not NULL.
+ */
+void onion_request_set_body_callback(onion_request *req, onion_request_body_callback callback, void *data, onion_handler_private_data_free free_data){
+	if (req->body.free_data)
+		req->body.free_data(req->body.data);
+	req->body.callback=callback;
+	req->body.data=data;
+	req->body.free_data=free_data;
+}
+
+/**
+ * @short Answers code right away, without reading the body, nor calling the handler.
+ * @memberof onion_request_t
+ * 
+ * Only from the body hook (onion_set_request_body_hook), before the body is read. As a client that sent 
+ * "Expect: 100-continue" waits for the answer before sending the body, a big upload without the right 
+ * credentials, for example, is not sent at all. The connection is closed after the answer.
+ * 
+ * @param req The request
+ * @param code The HTTP code, as HTTP_UNAUTHORIZED or HTTP_PAYLOAD_TOO_LARGE.
+ */
+void onion_request_reject_body(onion_request *req, int code){
+	req->body.reject=code;
+}
+
+/**
+ * @short Sets the directory where the body of this PUT is kept until the handler gets it.
+ * 
+ * Only from the body hook (onion_set_request_body_hook), before the body is read. The handler that will
+ * move the file somewhere, as onion_handler_webdav, can so have it at that same filesystem, where the move 
+ * is just a rename, and the body is written only once.
+ * 
+ * @see onion_set_spool_dir
+ */
+void onion_request_set_spool_dir(onion_request *req, const char *dir){
+	req->spool.dir=onion_request_strdup(req, dir);
+}
+
+/**
+ * @short Launches one handler for the given request
+ * 
+ * Once the request is ready, launch it.
+ * 
+ * If the server has workers (onion_set_workers) and the request comes from a poller, the request is 
+ * passed to a worker, and this returns OCS_YIELD; the worker gives back the connection to the poller 
+ * when done, at the queue of the priority class of its route (onion_url_set_priority). If the queue is 
+ * full, runs at this thread.
+ * 
+ * With work stealing (onion_set_work_stealing) it is queued at the poller thread instead, and runs after
+ * the current batch of events, there or at an idle thread that steals it.
+ * 
+ * @returns The connection status: if it should be closed, error codes...
+ */
+/**
+ * @short Writes the prerendered response of the route of the request, if it has one, without a response object.
+ * 
+ * Before the workers, as it is just a write. Not when something else needs the response: HTTP/2, admission
+ * control, TLS early data, the access log or the traffic record.
+ * 
+ * @returns The connection status, or OCS_NOT_PROCESSED to handle the request as always.
+ */
+static onion_connection_status onion_request_process_prerendered(onion_request *req){
+	onion *server=req->connection.listen_point->server;
+	if ((req->flags&OR_HTTP2) || req->admission.start || req->connection.early_data || server->access_log || server->traffic_record)
+		return OCS_NOT_PROCESSED;
+	if (!req->path)
+		onion_request_polish(req);
+	const onion_response_prerendered *prerendered=onion_url_get_prerendered((onion_url*)onion_request_root_handler(req), req);
+	if (!prerendered)
+		return OCS_NOT_PROCESSED;
+	onion_request_timing(req, OR_PHASE_HANDLED);
+	onion_connection_status r=onion_response_write_prerendered(req, prerendered);
+	if (r==OCS_KEEP_ALIVE)
+		onion_request_clean(req);
+	return r;
+}
+
+onion_connection_status onion_request_process(onion_request *req){
+	onion_request_timing(req, OR_PHASE_HANDLER);
+	onion_request_deadline_start(req);
+	onion_connection_status prerendered=onion_request_process_prerendered(req);
+	if (prerendered!=OCS_NOT_PROCESSED)
+		return prerendered;
+#ifdef HAVE_PTHREADS
+	onion *server=req->connection.listen_point->server;
+	if (server->workers && req->connection.slot){
+		onion_request_pipeline_keep(req); // Before the push, as the worker might be done very soon.
+		if (!req->path)
+			onion_request_polish(req);
+		onion_priority_class priority=onion_url_get_priority((onion_url*)onion_request_root_handler(req), req);
+		if (onion_workers_push_lane(server->workers, priority, (void*)onion_request_process_worker, req)==0)
+			return OCS_YIELD;
+		ONION_DEBUG("Workers queue full, processing request at poller thread");
+	}
+	else if (server->steal && req->connection.slot){
+		onion_listen_point *op=req->connection.listen_point;
+		onion_request_pipeline_keep(req);
+		if (onion_steal_push(server->steal, op->poller ? op->poller : server->poller, (void*)onion_request_process_worker, req)==0)
+			return OCS_YIELD;
+	}
+#endif
+	return onion_request_process_now(req);
+}
+
+/**
+ * @short Performs the final touches do the request is ready to be handled.
+ * @memberof onion_request_t
+ * 
+ * After parsing the request, some final touches are needed to set the current path.
+ * 
+ * @param req The request.
+ */
+void onion_request_polish(onion_request *req){
+  if (*req->fullpath)
+    req->path=req->fullpath+1;
+  else
+    req->path=req->fullpath;
+}
+
+/**
+ * @short Gets the time of each phase of the request.
+ * @memberof onion_request_t
+ * 
+ * The times are monotonic microseconds, indexed by onion_request_phase, and 0 for the phases not reached 
+ * yet, as the handler and end while at the handler, or the accept and handshake after the first request 
+ * of a keep alive connection. Durations are the differences, as timings[OR_PHASE_HEADERS]-timings[OR_PHASE_START].
+ * 
+ * @returns The timings, valid until the request is cleaned, or NULL if the server does not keep them. 
+ * @see onion_set_request_timings
+ */
+const int64_t *onion_request_get_timings(onion_request *req){
+	if (!req->connection.listen_point || !req->connection.listen_point->server->request_timings)
+		return NULL;
+	return req->timings;
+}
+
+/**
+ * @short Records the current monotonic time as the one of that phase.
+ * @memberof onion_request_t
+ * 
+ * Does nothing unless the server keeps the timings, but the start, also kept for an access log. The 
+ * connection state is always set, as the phase leads to it.
+ */
+void onion_request_timing(onion_request *req, onion_request_phase phase){
+	switch(phase){
+		case OR_PHASE_ACCEPT:
+			onion_request_set_state(req, OR_STATE_IDLE);
+			req->connection.accepted=req->connection.state_since;
+			break;
+		case OR_PHASE_HANDSHAKE:
+			onion_request_set_state(req, OR_STATE_IDLE);
+			break;
+		case OR_PHASE_START:
+			onion_request_set_state(req, OR_STATE_HEADERS);
+			break;
+		case OR_PHASE_HEADERS:
+			snprintf(req->connection.path, sizeof(req->connection.path), "%s %s", onion_request_methods[req->flags&OR_METHODS] ? onion_request_methods[req->flags&OR_METHODS] : "?", req->fullpath ? req->fullpath : "");
+			onion_request_set_state(req, OR_STATE_BODY);
+			break;
+		case OR_PHASE_HANDLER:
+			onion_request_set_state(req, OR_STATE_HANDLER);
+			break;
+		case OR_PHASE_HANDLED:
+			onion_request_set_state(req, OR_STATE_WRITING);
+			break;
+		case OR_PHASE_END:
+			onion_request_set_state(req, onion_request_output_pending(req) ? OR_STATE_WRITING : OR_STATE_IDLE);
+			break;
+		default:
+			break;
+	}
+	onion *server=req->connection.listen_point ? req->connection.listen_point->server : NULL;
+	if (!server || !(server->request_timings || (phase==OR_PHASE_START && server->access_log)))
+		return;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	req->timings[phase]=((int64_t)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+/// Coarse monotonic ms, for the connection states.
+static int64_t onion_request_coarse_ms(){
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return ((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+/**
+ * @short Sets what the connection is doing now, and since when.
+ * @memberof onion_request_t
+ * 
+ * Some plain stores, so it can be done at each phase. onion_get_connections reads them from other threads.
+ */
+void onion_request_set_state(onion_request *req, onion_request_state state){
+	req->connection.state=state;
+	req->connection.state_since=onion_request_coarse_ms();
+}
+
+/// Names of the onion_request_state
+const char *onion_request_state_names[OR_STATES]={ "idle", "handshake", "headers", "body", "handler", "writing" };
+
+/// Writes the IPv4 as a.b.c.d, '\0' ended, and returns its end.
+static char *onion_request_format_ipv4(char *p, const unsigned char *ip){
+	int i;
+	for (i=0;i<4;i++){
+		unsigned int n=ip[i];
+		if (n>=100)
+			*p++='0'+n/100;
+		if (n>=10)
+			*p++='0'+n/10%10;
+		*p++='0'+n%10;
+		*p++=(i<3) ? '.' : '\0';
+	}
+	return p-1;
+}
+
+/**
+ * @short Returns a string with the client's description.
+ * @memberof onion_request_t
+ * 
+ * The numeric IP, or for unix sockets "unix:" and the path of the client socket, if it has one, as
+ * most clients do not bind theirs.
+ * 
+ * It is formatted only once for the connection, without getnameinfo, and kept for the next requests.
+ * 
+ * @return A const char * with the client description, or NULL if there is no client address.
+ */
+const char *onion_request_get_client_description(onion_request *req){
+	char *info=req->connection.cli_info;
+	if (info[0])
+		return info;
+	if (!req->connection.cli_len)
+		return NULL;
+	struct sockaddr_storage *addr=&req->connection.cli_addr;
+	if (addr->ss_family==AF_INET)
+		onion_request_format_ipv4(info, (const unsigned char*)&((struct sockaddr_in*)addr)->sin_addr);
+	else if (addr->ss_family==AF_INET6){
+		const unsigned char *ip=(const unsigned char*)&((struct sockaddr_in6*)addr)->sin6_addr;
+		if (IN6_IS_ADDR_V4MAPPED((struct in6_addr*)ip)){ // As inet_ntop and getnameinfo
+			strcpy(info, "::ffff:");
+			onion_request_format_ipv4(info+7, ip+12);
+		}
+		else if (!inet_ntop(AF_INET6, ip, info, ONION_CLIENT_DESCRIPTION_SIZE))
+			info[0]='\0';
+	}
+	else if (addr->ss_family==AF_UNIX){
+		struct sockaddr_un *un=(struct sockaddr_un*)addr;
+		size_t len=req->connection.cli_len>offsetof(struct sockaddr_un, sun_path) ? 
+		           req->connection.cli_len-offsetof(struct sockaddr_un, sun_path) : 0;
+		if (len>sizeof(un->sun_path))
+			len=sizeof(un->sun_path);
+		if (len && un->sun_path[0]) // Else unnamed, or abstract
+			snprintf(info, ONION_CLIENT_DESCRIPTION_SIZE, "unix:%.*s", (int)len, un->sun_path);
+		else
+			strcpy(info, "unix");
+	}
+	else if (getnameinfo((struct sockaddr *)addr, req->connection.cli_len, info, ONION_CLIENT_DESCRIPTION_SIZE,
+	                     NULL, 0, NI_NUMERICHOST)!=0)
+		info[0]='\0';
+	return info[0] ? info : NULL;
+}
+
+/**
+ * @short Returns the IP of the client, in binary, to use as a key without formatting it.
+ * @memberof onion_request_t
+ * 
+ * IPv4 mapped IPv6 addresses, as the clients of IPv4 at a dual stack socket, are given as IPv4, so the
+ * same client always has the same key.
+ * 
+ * @param req The request
+ * @param length Where to set the length of the IP: 4 or 16.
+ * @returns The address in network order, or NULL if the client is not at an IP connection.
+ */
+const unsigned char *onion_request_get_client_ip(onion_request *req, size_t *length){
+	struct sockaddr_storage *addr=&req->connection.cli_addr;
+	if (!req->connection.cli_len)
+		return NULL;
+	if (addr->ss_family==AF_INET){
+		*length=4;
+		return (const unsigned char*)&((struct sockaddr_in*)addr)->sin_addr;
+	}
+	if (addr->ss_family==AF_INET6){
+		const unsigned char *ip=(const unsigned char*)&((struct sockaddr_in6*)addr)->sin6_addr;
+		if (IN6_IS_ADDR_V4MAPPED((struct in6_addr*)ip)){
+			*length=4;
+			return ip+12;
+		}
+		*length=16;
+		return ip;
+	}
+	return NULL;
+}
+
+/**
+ * @short Returns the sockaddr_storage pointer to the data client data as stored here.
+ * @memberof onion_request_t
+ * 
+ * @param req Request to get data from
+ * @param client_len The lenght of the returned sockaddr_storage
+ * @returns Pointer to the stored sockaddr_storage.
+ */
+struct sockaddr_storage *onion_request_get_sockadd_storage(onion_request *req, socklen_t *client_len){
+  if (client_len)
+    *client_len=req->connection.cli_len;
+	if (req->connection.cli_len==0)
+		return NULL;
+  return &req->connection.cli_addr;
+}
+
+/**
+ * @short Gets the dict with the cookies
+ * @memberof onion_request_t
+ * 
+ * @param req Request to get the cookies from
+ * 
+ * @returns A dict with all the cookies. It might be empty.
+ * 
+ * First call it generates the dict.
+ */
+onion_dict* onion_request_get_cookies_dict(onion_request* req){
+	if (req->cookies)
 		return req->cookies;
 	
 	req->cookies=onion_dict_new();
 	
-	const char *ccookies=onion_request_get_header(req, "Cookie");
+	const char *ccookies=onion_request_get_header_id(req, ONION_H_COOKIE);
 	if (!ccookies)
 		return req->cookies;
-	char *cookies=strdup(ccookies); // I prepare a temporal string, will modify it.
+	char *cookies=onion_request_strdup(req, ccookies); // A copy at the arena, as it is modified.
 	char *val=NULL;
 	char *key=NULL;
 	char *p=cookies;
 	
-	int dflags=OD_FREE_KEY;
 	while(*p){
 		if (*p!=' ' && !key && !val){
 			key=p;
@@ -623,17 +1860,16 @@ onion_dict* onion_request_get_cookies_dict(onion_request* req){
 		}
 		else if (*p==';' && key && val){
 			*p=0;
-			onion_dict_add(req->cookies, key, val, dflags); // I duplicate all as will free cookies string later. 
-			ONION_DEBUG0("Add cookie <%s>=<%s> %X", key, val, dflags);
-			dflags=0; // On the first element, remove all data as is in key.
+			onion_dict_add(req->cookies, key, val, 0);
+			ONION_DEBUG0("Add cookie <%s>=<%s>", key, val);
 			val=NULL;
 			key=NULL;
 		}
 		p++;
 	}
 	if (key && val && val<p){ // A final element, with value.
-		onion_dict_add(req->cookies, key, val, dflags);
-		ONION_DEBUG0("Add cookie <%s>=<%s> %X", key, val, dflags);
+		onion_dict_add(req->cookies, key, val, 0);
+		ONION_DEBUG0("Add cookie <%s>=<%s>", key, val);
 	}
 	
 	return req->cookies;
@@ -653,3 +1889,428 @@ const char* onion_request_get_cookie(onion_request* req, const char* cookiename)
 	const onion_dict *cookies=onion_request_get_cookies_dict(req);
 	return onion_dict_get(cookies, cookiename);
 }
+
+/**
+ * @short Whether this request writes to a non blocking socket, and may queue output.
+ * @memberof onion_request_t
+ */
+static int onion_request_output_can_queue(onion_request *req){
+	return req->connection.slot && (req->connection.listen_point->server->flags&O_NONBLOCKING);
+}
+
+/**
+ * @short Queues the data to be written when the connection is writable again.
+ * 
+ * Data of a shared buffer is not copied; the buffer is referenced until written. Other data is copied
+ * to the output block, or, if shared data is already queued, to a shared buffer after it, to keep the order.
+ * 
+ * @returns 0 if ok, <0 if it can not be queued.
+ */
+static int onion_request_output_queue(onion_request *req, const char *data, size_t len, onion_shared_buffer *owner){
+	if (!len)
+		return 0;
+	if (req->output.file_fd>=0){
+		ONION_ERROR("Can not queue more data after a file. Closing connection.");
+		return OCS_CLOSE_CONNECTION;
+	}
+	if (owner || req->output.shared){
+		onion_request_output_shared *q=malloc(sizeof(onion_request_output_shared));
+		if (owner)
+			q->buffer=onion_shared_buffer_ref(owner);
+		else{
+			q->buffer=onion_shared_buffer_copy(data, len);
+			data=onion_shared_buffer_data(q->buffer);
+		}
+		q->data=data;
+		q->length=len;
+		q->next=NULL;
+		if (req->output.shared_last)
+			req->output.shared_last->next=q;
+		else
+			req->output.shared=q;
+		req->output.shared_last=q;
+		return 0;
+	}
+	if (!req->output.data)
+		req->output.data=onion_block_new();
+	ONION_DEBUG0("Queue %d bytes for later write", (int)len);
+	if (req->output.data->size+len > req->output.data->maxsize) // Grow exponentially, as it may get big.
+		onion_block_min_maxsize(req->output.data, (req->output.data->size+len)*2);
+	onion_block_add_data(req->output.data, data, len);
+	return 0;
+}
+
+/**
+ * @short Whether there is output waiting for the connection to be writable
+ * @memberof onion_request_t
+ */
+int onion_request_output_pending(onion_request *req){
+	return (req->output.data && onion_block_size(req->output.data)>req->output.data_pos) || req->output.shared || 
+		req->output.file_fd>=0;
+}
+
+/// Drops the shared buffers still queued, as the connection closes.
+static void onion_request_output_shared_free(onion_request *req){
+	while (req->output.shared){
+		onion_request_output_shared *q=req->output.shared;
+		req->output.shared=q->next;
+		onion_shared_buffer_unref(q->buffer);
+		free(q);
+	}
+	req->output.shared_last=NULL;
+}
+
+/**
+ * @short Keeps the last response of a connection that closes, to send it with the close.
+ * 
+ * onion_listen_point_request_close_socket gives it to onion_poller_send_close, so its send, and the shutdown
+ * and close, need no syscalls of their own. Up to ONION_REQUEST_OUTPUT_LAST_MAX bytes; bigger, it is written 
+ * as always.
+ * 
+ * @returns The length of the data, or -1 if it was not kept.
+ */
+static ssize_t onion_request_output_linger(onion_request *req, const struct iovec *iov, int iovcnt){
+	size_t total=0;
+	int i;
+	for (i=0;i<iovcnt;i++)
+		total+=iov[i].iov_len;
+	if ((req->output.last ? onion_block_size(req->output.last) : 0)+total > ONION_REQUEST_OUTPUT_LAST_MAX)
+		return -1;
+	if (!req->output.last)
+		req->output.last=onion_block_new();
+	for (i=0;i<iovcnt;i++)
+		onion_block_add_data(req->output.last, iov[i].iov_base, iov[i].iov_len);
+	return total;
+}
+
+/// Writes now the response kept by onion_request_output_linger, as more output follows. <0 on error.
+static int onion_request_output_unlinger(onion_request *req){
+	onion_block *last=req->output.last;
+	req->output.last=NULL;
+	ssize_t w=onion_request_output_write(req, onion_block_data(last), onion_block_size(last));
+	onion_block_free(last);
+	return w<0 ? w : 0;
+}
+
+/**
+ * @short Writes data to the connection, queueing it if the socket would block.
+ * @memberof onion_request_t
+ * 
+ * On O_NONBLOCKING mode, if there is already pending output or the socket can not accept all the data
+ * now, the rest is queued, and written by onion_request_output_flush when the socket is writable again.
+ * 
+ * On other modes it just writes all data.
+ * 
+ * @returns The length of the data (written or queued), or <0 on error.
+ */
+ssize_t onion_request_output_write(onion_request *req, const char *data, size_t len){
+	return onion_request_output_write_shared(req, data, len, NULL);
+}
+
+/**
+ * @short Writes data of a shared buffer to the connection, and if it would block, queues a reference, not a copy.
+ * @memberof onion_request_t
+ * 
+ * As onion_request_output_write. The data is at owner, or owner is NULL, and it is copied if queued.
+ */
+ssize_t onion_request_output_write_shared(onion_request *req, const char *data, size_t len, onion_shared_buffer *owner){
+	ssize_t (*write)(onion_request *, const char *data, size_t len);
+	write=req->connection.listen_point->write;
+	
+	if (req->output.last && onion_request_output_unlinger(req)<0)
+		return OCS_CLOSE_CONNECTION;
+	if (!onion_request_output_can_queue(req)){
+		size_t pos=0;
+		while (pos<len){
+			ssize_t w=write(req, &data[pos], len-pos);
+			if (w<=0)
+				return OCS_CLOSE_CONNECTION;
+			pos+=w;
+		}
+		return len;
+	}
+
+	size_t pos=0;
+	if (!onion_request_output_pending(req)){
+		while (pos<len){
+			ssize_t w=write(req, &data[pos], len-pos);
+			if (w<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+				break;
+			if (w<=0)
+				return OCS_CLOSE_CONNECTION;
+			pos+=w;
+		}
+		if (pos==len)
+			return len;
+	}
+	if (onion_request_output_queue(req, &data[pos], len-pos, owner)<0)
+		return OCS_CLOSE_CONNECTION;
+	return len;
+}
+
+/**
+ * @short Writes several buffers to the connection, queueing what can not be written now, as onion_request_output_write.
+ * @memberof onion_request_t
+ * 
+ * If the listen point has a writev method, all are written with one call when possible, which on small 
+ * responses saves several syscalls (chunk size, data, chunk end...). If not, they are written one by one.
+ * 
+ * @returns The length of all the data (written or queued), or <0 on error.
+ */
+ssize_t onion_request_output_writev(onion_request *req, const struct iovec *iov, int iovcnt){
+	return onion_request_output_writev_shared(req, iov, NULL, iovcnt);
+}
+
+/**
+ * @short Writes several buffers, some of them of shared buffers, queueing references to those if it would block.
+ * @memberof onion_request_t
+ * 
+ * As onion_request_output_writev. owners has the shared buffer of each iov, or NULL if it has to be copied 
+ * to be queued; or owners is NULL and all are copied.
+ */
+ssize_t onion_request_output_writev_shared(onion_request *req, const struct iovec *iov, onion_shared_buffer * const *owners, int iovcnt){
+	ssize_t (*writev)(onion_request *, const struct iovec *iov, int iovcnt);
+	writev=req->connection.listen_point->writev;
+	int i;
+	size_t total=0;
+	
+	if (req->output.linger && !onion_request_output_pending(req)){
+		ssize_t kept=onion_request_output_linger(req, iov, iovcnt);
+		if (kept>=0)
+			return kept;
+	}
+	if (req->output.last && onion_request_output_unlinger(req)<0)
+		return OCS_CLOSE_CONNECTION;
+	if (!writev || iovcnt>ONION_REQUEST_OUTPUT_IOV_MAX || onion_request_output_pending(req)){
+		for (i=0;i<iovcnt;i++){
+			if (onion_request_output_write_shared(req, iov[i].iov_base, iov[i].iov_len, owners ? owners[i] : NULL)<0)
+				return OCS_CLOSE_CONNECTION;
+			total+=iov[i].iov_len;
+		}
+		return total;
+	}
+	
+	struct iovec left[ONION_REQUEST_OUTPUT_IOV_MAX]; // Advanced on partial writes
+	for (i=0;i<iovcnt;i++){
+		left[i]=iov[i];
+		total+=iov[i].iov_len;
+	}
+	int can_queue=onion_request_output_can_queue(req);
+	i=0;
+	while (i<iovcnt){
+		if (!left[i].iov_len){
+			i++;
+			continue;
+		}
+		ssize_t w=writev(req, &left[i], iovcnt-i);
+		if (w<0 && can_queue && (errno==EAGAIN || errno==EWOULDBLOCK))
+			break;
+		if (w<=0)
+			return OCS_CLOSE_CONNECTION;
+		while (i<iovcnt && (size_t)w>=left[i].iov_len){
+			w-=left[i].iov_len;
+			i++;
+		}
+		if (w){
+			left[i].iov_base=(char*)left[i].iov_base+w;
+			left[i].iov_len-=w;
+		}
+	}
+	for (;i<iovcnt;i++){
+		if (onion_request_output_queue(req, left[i].iov_base, left[i].iov_len, owners ? owners[i] : NULL)<0)
+			return OCS_CLOSE_CONNECTION;
+	}
+	return total;
+}
+
+/**
+ * @short Sends now the output that the listen point held as more pipelined responses would follow.
+ * @memberof onion_request_t
+ * 
+ * When the pipelined requests are processed in a row, their responses are written with MSG_MORE, so the kernel
+ * sends them together. This pushes them if the last written response was not the last one, for example as the 
+ * next request is not complete yet.
+ */
+void onion_request_output_push(onion_request *req){
+#ifdef TCP_CORK
+	int zero=0; // Clearing TCP_CORK sends what is pending, also the MSG_MORE data.
+	setsockopt(req->connection.fd, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero));
+#endif
+	req->output.more_sent=0;
+}
+
+/**
+ * @short Whether a file can be queued with onion_request_output_queue_file.
+ * @memberof onion_request_t
+ */
+int onion_request_output_can_queue_file(onion_request *req){
+	return req->connection.slot && req->output.file_fd<0;
+}
+
+/**
+ * @short Queues the given file to be sent after the pending output.
+ * @memberof onion_request_t
+ * 
+ * The file descriptor is owned by the request from now on, and is closed when done.
+ * 
+ * Only for connections at a poller, and only one file at a time. If the server is not O_NONBLOCKING the 
+ * socket is set non blocking meanwhile, so the file is sent in slices as the socket is writable, and the 
+ * poller thread serves other connections between them.
+ * 
+ * @returns 0 if ok, <0 if could not be queued; the fd is closed anyway.
+ */
+int onion_request_output_queue_file(onion_request *req, int fd, off_t pos, size_t len){
+	if (!onion_request_output_can_queue_file(req)){
+		ONION_ERROR("Can not queue file for output");
+		close(fd);
+		return OCS_INTERNAL_ERROR;
+	}
+	if (!len){
+		close(fd);
+		return 0;
+	}
+	if (!(req->connection.listen_point->server->flags&O_NONBLOCKING)){
+		int flags=fcntl(req->connection.fd, F_GETFL);
+		if (flags==-1 || fcntl(req->connection.fd, F_SETFL, flags|O_NONBLOCK)==-1){
+			ONION_ERROR("Setting O_NONBLOCK to connection to send the file");
+			close(fd);
+			return OCS_INTERNAL_ERROR;
+		}
+		req->output.file_nonblock=1;
+	}
+	req->output.file_fd=fd;
+	req->output.file_pos=pos;
+	req->output.file_left=len;
+	return 0;
+}
+
+/**
+ * @short Reads the next block of the queued file, to write it when it can not go by sendfile.
+ * 
+ * The reads are of ONION_REQUEST_OUTPUT_FILE_BLOCK, aligned to it, and the kernel is told the file is read
+ * sequentially so it reads ahead. The block is kept until written, so a short write does not read again.
+ * 
+ * @returns 0 if ok, <0 on error.
+ */
+static int onion_request_output_file_read(onion_request *req){
+	if (!req->output.file_block){
+		req->output.file_block=malloc(req->output.file_left<ONION_REQUEST_OUTPUT_FILE_BLOCK ? req->output.file_left : ONION_REQUEST_OUTPUT_FILE_BLOCK);
+		if (!req->output.file_block){
+			ONION_ERROR("Could not allocate the file block");
+			return -1;
+		}
+#ifdef POSIX_FADV_SEQUENTIAL
+		posix_fadvise(req->output.file_fd, req->output.file_pos, req->output.file_left, POSIX_FADV_SEQUENTIAL);
+#endif
+	}
+	size_t l=ONION_REQUEST_OUTPUT_FILE_BLOCK-(req->output.file_pos%ONION_REQUEST_OUTPUT_FILE_BLOCK);
+	if (l>req->output.file_left) // Never more than allocated, as file_left only decreases
+		l=req->output.file_left;
+	ssize_t r=pread(req->output.file_fd, req->output.file_block, l, req->output.file_pos);
+	if (r<=0){
+		ONION_ERROR("Could not read file to send (%s)", r<0 ? strerror(errno) : "file is shorter");
+		return -1;
+	}
+	req->output.file_pos+=r;
+	req->output.file_left-=r;
+	req->output.file_block_pos=0;
+	req->output.file_block_len=r;
+	return 0;
+}
+
+/**
+ * @short Writes as much pending output as the socket accepts now.
+ * @memberof onion_request_t
+ * 
+ * Of a queued file at most ONION_REQUEST_OUTPUT_FILE_SLICE bytes are sent on each call, so a fast client 
+ * downloading a big file does not keep the poller thread from the other connections.
+ * 
+ * @returns 0 if all written, 1 if there is still pending output, <0 on error.
+ */
+int onion_request_output_flush(onion_request *req){
+	ssize_t (*write)(onion_request *, const char *data, size_t len);
+	write=req->connection.listen_point->write;
+	ssize_t w;
+	
+	if (req->output.data){
+		const char *data=onion_block_data(req->output.data);
+		size_t size=onion_block_size(req->output.data);
+		while (req->output.data_pos<size){
+			w=write(req, &data[req->output.data_pos], size-req->output.data_pos);
+			if (w<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+				return 1;
+			if (w<=0)
+				return OCS_CLOSE_CONNECTION;
+			req->output.data_pos+=w;
+		}
+		onion_block_clear(req->output.data);
+		req->output.data_pos=0;
+	}
+	while (req->output.shared){
+		onion_request_output_shared *q=req->output.shared;
+		while (q->length){
+			w=write(req, q->data, q->length);
+			if (w<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+				return 1;
+			if (w<=0)
+				return OCS_CLOSE_CONNECTION;
+			q->data+=w;
+			q->length-=w;
+		}
+		req->output.shared=q->next;
+		if (!req->output.shared)
+			req->output.shared_last=NULL;
+		onion_shared_buffer_unref(q->buffer);
+		free(q);
+	}
+	
+	size_t slice=ONION_REQUEST_OUTPUT_FILE_SLICE;
+	while (req->output.file_fd>=0 && (req->output.file_left>0 || req->output.file_block_pos<req->output.file_block_len)){
+		if (!slice) // Some more at the next writable event.
+			return 1;
+		if (req->connection.listen_point->sendfile && !req->output.file_block){ // Once it failed, the rest is read
+			w=req->connection.listen_point->sendfile(req, req->output.file_fd, &req->output.file_pos, req->output.file_left<slice ? req->output.file_left : slice);
+			if (w<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+				return 1;
+			if (w>0){
+				req->output.file_left-=w;
+				slice-=w;
+				continue;
+			}
+			if (w==0 || errno!=ENOSYS){
+				ONION_ERROR("Could not send all file (%s)", w<0 ? strerror(errno) : "file is shorter");
+				return OCS_CLOSE_CONNECTION;
+			}
+		}
+		if (req->output.file_block_pos==req->output.file_block_len && onion_request_output_file_read(req)<0)
+			return OCS_CLOSE_CONNECTION;
+		size_t l=req->output.file_block_len-req->output.file_block_pos;
+		if (l>slice)
+			l=slice;
+		req->output.bulk=(req->output.file_left || req->output.file_block_pos+l<req->output.file_block_len); // Only the last write pushes
+		w=write(req, &req->output.file_block[req->output.file_block_pos], l);
+		req->output.bulk=0;
+		if (w<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+			return 1;
+		if (w<=0)
+			return OCS_CLOSE_CONNECTION;
+		req->output.file_block_pos+=w;
+		slice-=w;
+	}
+	free(req->output.file_block);
+	req->output.file_block=NULL;
+	req->output.file_block_pos=req->output.file_block_len=0;
+	if (req->output.file_fd>=0){
+		close(req->output.file_fd);
+		req->output.file_fd=-1;
+	}
+	if (req->output.file_nonblock){
+		int flags=fcntl(req->connection.fd, F_GETFL);
+		if (flags==-1 || fcntl(req->connection.fd, F_SETFL, flags&~O_NONBLOCK)==-1){
+			ONION_ERROR("Setting the connection back to blocking");
+			return OCS_CLOSE_CONNECTION;
+		}
+		req->output.file_nonblock=0;
+	}
+	return 0;
+}
@@ -28,6 +28,8 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdint.h>
 
 #include "types.h"
 
@@ -57,10 +59,12 @@ enum onion_request_flags_e{
 	OR_HTTP11=0x10,
 	OR_POST_MULTIPART=0x20,
 	OR_POST_URLENCODED=0x40,
+	OR_HTTP2=0x80,           ///< Stream of an HTTP/2 connection. @see onion_http2_new
 	
 	/// Server flags are at 0x0F00.
 	OR_NO_KEEP_ALIVE=0x0100,
   OR_HEADER_SENT_=0x0200,  ///< Dup name from onion_response_flags, same meaning.
+	OR_INFLATED=0x0800,      ///< The body came with Content-Encoding, and was decoded as read. @see onion_set_request_inflate
 	
 	/// Errors at 0x0F000.
 	OR_INTERNAL_ERROR=0x01000,
@@ -71,9 +75,91 @@ enum onion_request_flags_e{
 
 typedef enum onion_request_flags_e onion_request_flags;
 
+/**
+ * @short Well known headers, resolved once as parsed, to get them without looking them up by name.
+ * @see onion_request_get_header_id
+ */
+enum onion_header_id_e{
+	ONION_H_HOST=0,
+	ONION_H_CONNECTION,
+	ONION_H_CONTENT_LENGTH,
+	ONION_H_CONTENT_TYPE,
+	ONION_H_TRANSFER_ENCODING,
+	ONION_H_COOKIE,
+	ONION_H_RANGE,
+	ONION_H_IF_RANGE,
+	ONION_H_IF_NONE_MATCH,
+	ONION_H_ACCEPT_ENCODING,
+	ONION_H_ACCEPT_LANGUAGE,
+	ONION_H_UPGRADE,
+	ONION_H_AUTHORIZATION,
+	ONION_H_EXPECT,
+	ONION_H_IF_MODIFIED_SINCE,
+	ONION_H_CONTENT_ENCODING,
+	ONION_H_COUNT,        ///< Number of well known headers, not a header.
+};
+
+typedef enum onion_header_id_e onion_header_id;
+
+/**
+ * @short Moments of a request, as kept with onion_set_request_timings.
+ * @see onion_request_get_timings
+ */
+enum onion_request_phase_e{
+	OR_PHASE_ACCEPT=0,    ///< The connection was accepted. Only at its first request.
+	OR_PHASE_HANDSHAKE,   ///< The TLS handshake was done. Only at the first request of HTTPS connections.
+	OR_PHASE_START,       ///< The first byte of the request was parsed.
+	OR_PHASE_HEADERS,     ///< The headers were parsed.
+	OR_PHASE_HANDLER,     ///< The body was read, and the request is given to the handler.
+	OR_PHASE_HANDLED,     ///< The handler is done, or the suspended request was resumed.
+	OR_PHASE_END,         ///< The response is done.
+	OR_PHASES,            ///< Number of phases, not a phase.
+};
+
+typedef enum onion_request_phase_e onion_request_phase;
+
+/**
+ * @short What a connection is doing now, as listed by onion_get_connections.
+ * 
+ * It follows the phases of its requests, also if the server does not keep their timings.
+ */
+enum onion_request_state_e{
+	OR_STATE_IDLE=0,      ///< Waiting for a request, the first one or the next of a keep alive connection.
+	OR_STATE_HANDSHAKE,   ///< At the TLS handshake.
+	OR_STATE_HEADERS,     ///< Reading the headers.
+	OR_STATE_BODY,        ///< Reading the body.
+	OR_STATE_HANDLER,     ///< At the handler, or waiting for a worker thread.
+	OR_STATE_WRITING,     ///< Writing the rest of the response, after the handler.
+	OR_STATES,            ///< Number of states, not a state.
+};
+
+typedef enum onion_request_state_e onion_request_state;
+
+/// Names of the states, as handler or writing.
+extern const char *onion_request_state_names[OR_STATES];
+
+/// Bytes of the method and path kept for onion_get_connections. Longer paths are cut.
+#define ONION_CONNECTION_PATH_SIZE 96
+
+/// A connection at the pollers, as listed by onion_get_connections.
+struct onion_connection_info_t{
+	int fd;
+	char peer[64];             ///< Address and port of the client, numeric, or empty if not an IP connection.
+	char listen_point[64];     ///< Host and port it was accepted at.
+	onion_request_state state;
+	int64_t age_ms;            ///< Since the accept
+	int64_t state_ms;          ///< Since it entered the state
+	uint64_t bytes_in;         ///< Request bytes read, of all its requests
+	uint64_t bytes_out;        ///< Response body bytes sent, of all its finished responses, as counted by onion_get_stats
+	char path[ONION_CONNECTION_PATH_SIZE]; ///< Method and path of the current request, or the last one if idle.
+};
+
 /// List of known methods. NULL empty space, position is the method as listed at the flags. @see onion_request_flags
 extern const char *onion_request_methods[16];
 
+/// Names of the well known headers, position is the onion_header_id.
+extern const char *onion_request_header_names[ONION_H_COUNT];
+
 /// Creates a request from a listen point. Socket info and so on must be filled by user.
 onion_request *onion_request_new(onion_listen_point *con);
 
@@ -101,17 +187,32 @@ onion_request_flags onion_request_get_flags(onion_request *req);
 /// Moves the path pointer to later in the fullpath
 void onion_request_advance_path(onion_request *req, int addtopos);
 
+/// Gets the value of a :name segment of the url patterns that matched
+const char *onion_request_get_url_param(onion_request *req, const char *name);
+
+/// Gets the group n of the url regexp that matched
+const char *onion_request_get_url_group(onion_request *req, int n);
+
+/// Keeps where a :name segment, or a regexp group, is at the path
+void onion_request_add_url_param(onion_request *req, const char *name, int group, const char *start, int length);
+
 /// @{ @name Get header, query, post, file data and session
 
 /// Gets a header data
 const char *onion_request_get_header(onion_request *req, const char *header);
 
+/// Gets a well known header, as onion_request_get_header with its name, but without the lookup.
+const char *onion_request_get_header_id(onion_request *req, onion_header_id id);
+
 /// Gets query data
 const char *onion_request_get_query(onion_request *req, const char *query);
 
 /// Gets query data, but returns a default value if key not found.
 const char *onion_request_get_queryd(onion_request *req, const char *key, const char *def);
 
+/// Gets the raw query string, still quoted, to walk with onion_query_next. NULL if none.
+const char *onion_request_get_query_string(onion_request *req);
+
 /// Gets post data
 const char *onion_request_get_post(onion_request *req, const char *query);
 
@@ -133,9 +234,15 @@ const onion_dict *onion_request_get_post_dict(onion_request *req);
 /// Gets post data dict
 const onion_dict *onion_request_get_file_dict(onion_request *req);
 
-/// Gets session data dict
+/// Gets session data dict, to modify it. A copy for this request, saved at its end if changed.
 onion_dict *onion_request_get_session_dict(onion_request *req);
 
+/// Gets session data dict to read, shared, or NULL if no session
+const onion_dict *onion_request_get_session_snapshot(onion_request *req);
+
+/// Marks the session as changed, as when changing dicts inside it
+void onion_request_session_changed(onion_request *req);
+
 /// Gets the cookies dict
 onion_dict *onion_request_get_cookies_dict(onion_request *req);
 
@@ -150,6 +257,9 @@ void onion_request_session_free(onion_request *req);
 /// Cleans the request object, to reuse it
 void onion_request_clean(onion_request *req);
 
+/// Frees the buffers kept on keep alive, while the connection is idle between requests.
+int onion_request_compact(onion_request *req);
+
 /// Reqeust to close connection after one request is done, forces no keep alive.
 void onion_request_set_no_keep_alive(onion_request *req);
 
@@ -162,18 +272,100 @@ const char *onion_request_get_language_code(onion_request *req);
 /// Returns extra request data, such as POST with non-form data, or PROPFIND. Needs the Content-Length request header.
 const onion_block *onion_request_get_data(onion_request *req);
 
+/// Parses the body as json, once, in place. NULL if none or not valid.
+const onion_dict *onion_request_get_json(onion_request *req);
+
 /// Performs final touches to the request to its ready to be processed.
 void onion_request_polish(onion_request *req);
 
 /// Executes the handler required for this request
 onion_connection_status onion_request_process(onion_request *req);
 
+/// @{ @name Connection output. On O_NONBLOCKING mode, data that can not be written now is queued; files also on other poller modes.
+
+/// Writes data to the connection, or queues it if the socket would block.
+ssize_t onion_request_output_write(onion_request *req, const char *data, size_t len);
+
+/// Writes several buffers to the connection, in one call if the listen point has writev, queueing the rest if it would block.
+ssize_t onion_request_output_writev(onion_request *req, const struct iovec *iov, int iovcnt);
+
+/// Writes data of that shared buffer, and if it would block, queues a reference instead of a copy.
+ssize_t onion_request_output_write_shared(onion_request *req, const char *data, size_t len, onion_shared_buffer *owner);
+
+/// As onion_request_output_writev, with the shared buffer of each iov, or NULL.
+ssize_t onion_request_output_writev_shared(onion_request *req, const struct iovec *iov, onion_shared_buffer * const *owners, int iovcnt);
+
+/// Whether a file can be queued now: the connection is at a poller, and has no other file queued.
+int onion_request_output_can_queue_file(onion_request *req);
+
+/// Queues a file to be sent after the pending output. Takes ownership of the fd.
+int onion_request_output_queue_file(onion_request *req, int fd, off_t pos, size_t len);
+
+/// Whether there is queued output still not written
+int onion_request_output_pending(onion_request *req);
+
+/// Writes as much queued output as possible. 0 done, 1 still pending, <0 error.
+int onion_request_output_flush(onion_request *req);
+
+/// Sends now the output held to be sent together with the next pipelined responses.
+void onion_request_output_push(onion_request *req);
+
+/// @}
+
+/// Resumes a request suspended with OCS_SUSPENDED. From any thread.
+void onion_request_resume(onion_request *req);
+
+/// Poller of the connection, where a suspended request is resumed, or NULL if not at a poller.
+onion_poller *onion_request_get_poller(onion_request *req);
+
+/// Header with the milliseconds the client waits for the answer, that may shorten the request deadline.
+#define ONION_REQUEST_TIMEOUT_HEADER "X-Request-Timeout"
+/// How often the client connection is checked for the cancel callback, in ms.
+#define ONION_REQUEST_CANCEL_CHECK_MS 100
+
+/// Milliseconds left until the request deadline, 0 if passed, or -1 if it has none.
+int onion_request_get_remaining_ms(onion_request *req);
+/// Whether the client went away or the deadline passed, so the handler can give up.
+int onion_request_is_cancelled(onion_request *req);
+/// Calls f once, from the poller, if the request is cancelled while at the handler.
+void onion_request_set_cancel_callback(onion_request *req, void (*f)(void *data), void *data);
+
+/// Sets the callback that gets the body as it is read, instead of keeping it. From the body hook.
+void onion_request_set_body_callback(onion_request *req, onion_request_body_callback callback, void *data, onion_handler_private_data_free free_data);
+
+/// Answers code (as HTTP_UNAUTHORIZED) without reading the body, and closes the connection. From the body hook.
+void onion_request_reject_body(onion_request *req, int code);
+
+/// Sets the directory where the body of this PUT is kept, as at the filesystem it is moved to at the end. From the body hook.
+void onion_request_set_spool_dir(onion_request *req, const char *dir);
+
+/// Reads again the body after its callback returned OCS_SUSPENDED. From any thread.
+void onion_request_body_resume(onion_request *req);
+
+/// Allocates memory that is freed when the request is cleaned or freed.
+void *onion_request_alloc(onion_request *req, size_t size);
+
+/// Copies the string to memory that is freed when the request is cleaned or freed.
+char *onion_request_strdup(onion_request *req, const char *str);
+
 /// Get a string with a client description
 const char *onion_request_get_client_description(onion_request *req);
 
+/// The client IP in binary, 4 or 16 bytes as set at length, or NULL if not an IP connection.
+const unsigned char *onion_request_get_client_ip(onion_request *req, size_t *length);
+
 /// Get the sockaddr_storage from the client, if any.
 struct sockaddr_storage *onion_request_get_sockadd_storage(onion_request *req, socklen_t *client_len);
 
+/// Gets the monotonic microseconds of each onion_request_phase, 0 if not reached, or NULL if not kept.
+const int64_t *onion_request_get_timings(onion_request *req);
+
+/// Records the time of that phase, if the server keeps them, and the state it leads to. Used by the parser and listen points.
+void onion_request_timing(onion_request *req, onion_request_phase phase);
+
+/// Sets what the connection is doing now. Used by the listen points, as the phases do not tell all.
+void onion_request_set_state(onion_request *req, onion_request_state state);
+
 #ifdef __cplusplus
 }
 #endif
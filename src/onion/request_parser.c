@@ -23,19 +23,37 @@
 	library; if not see <http://www.gnu.org/licenses/>.
 	*/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* O_TMPFILE, fallocate */
+#endif
+
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <libgen.h>
+#include <alloca.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "dict.h"
 #include "request.h"
+#include "response.h"
 #include "types_internal.h"
 #include "codecs.h"
 #include "log.h"
+#include "trace.h"
 #include "block.h"
+#include "listen_point.h"
+#include "poller.h"
+#include "stats.h"
+#include "admission.h"
+#include "memory.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 /**
  * @short Known token types. This is merged with onion_connection_status as return value at token readers.
@@ -53,13 +71,21 @@ typedef enum{
 	STRING_NEW_LINE=1009,
 }onion_token_token;
 
+/// Maximum size of a token, as a header line or the path.
+#define ONION_TOKEN_MAX_SIZE (256*4*8)
+/// Tokens start at this size, and grow as needed up to ONION_TOKEN_MAX_SIZE.
+#define ONION_TOKEN_INITIAL_SIZE 256
+
 /// @private
 typedef struct onion_token_s{
-	char str[256*4*8];
+	char *str;  // Points to small, or to a malloc'ed area when the token grows.
+	size_t size; // Current size of str
 	off_t pos;
 	
-	char *extra; // Only used when need some previous data, like at header value, i need the key
+	char *extra; // Only used when need some previous data, like the POST body
 	size_t extra_size;
+	char *key; // Header key while reading its value, at the request arena
+	char small[ONION_TOKEN_INITIAL_SIZE];
 }onion_token;
 
 /// @private
@@ -70,61 +96,229 @@ typedef struct onion_buffer_s{
 }onion_buffer;
 
 /**
- * @short This struct is mapped at token->extra. The token, _start and data are maped to token->extra area too.
+ * @short This struct is mapped at token->extra, with the boundary after it.
  * @private
  * 
- * This is a bit juggling with pointers, but needed to keep the deallocation simple, and the token object minimal in most cases.
- * 
- * token->pos is the pointer to the free area and token->extra_size is the real size.
+ * The field names and values are at the request arena, as they come, so a post that is mostly a file
+ * takes no memory for fields. token->pos is the length of the field being read.
  */
 typedef struct onion_multipart_buffer_s{
 	char *boundary; /// Pointer to where the boundary is stored
 	size_t size; 		/// Size of the boundary
 	off_t pos;			/// Pos at the boundarycheck
 	off_t startpos; /// Where did the boundary started (\n\r vs \n)
-	char *data;			/// When need a new buffered data (always from stream), get it from here. This advances as used.
+	char *field;		/// Value of the field being read, at the request arena
+	size_t field_size; /// Allocated size of field
 	char *name; 		/// point to a in data position
 	char *filename; /// point to a in data position
 	size_t file_total_size;	/// Total size of all file read data
-	size_t post_total_size;	/// Total size of post, to check limits
+	size_t post_total_size;	/// Bytes left for the fields, to check limits
 	int fd; 				/// If file, the file descriptor.
+	unsigned char skip[256]; /// Horspool skips to search the boundary at file parts
 }onion_multipart_buffer;
 
+/// Size of the decoded pieces of an encoded body, as passed on. At the stack.
+#define ONION_INFLATE_CHUNK_SIZE (16*1024)
+
+/**
+ * @short Decoder of a body with Content-Encoding, at req->body.inflate.
+ * @private
+ * 
+ * The raw body is framed as always, by Content-Length or chunks; its decoded data goes where a chunked body goes.
+ */
+struct onion_request_inflate_t{
+#ifdef HAVE_ZLIB
+	z_stream z;
+#endif
+	size_t size;       /// Decoded bytes, to check max_inflate_size
+	onion_connection_status (*multipart)(onion_request *req, onion_buffer *data); /// Multipart parser state on the decoded data, or NULL
+	char pending;      /// The consumer paused, and zlib may keep more decoded data
+	char end;          /// The encoded stream ended
+	char multipart_end; /// The multipart parser read the last boundary; the rest is ignored
+};
+
 static void onion_request_parse_query_to_dict(onion_dict *dict, char *p);
 static int onion_request_parse_query(onion_request *req);
 static onion_connection_status prepare_POST(onion_request *req);
+static onion_connection_status prepare_POST_multipart(onion_request *req, const char *content_type, size_t cl);
 static onion_connection_status prepare_CONTENT_LENGTH(onion_request *req);
-static onion_connection_status prepare_PUT(onion_request *req);
+static onion_connection_status prepare_PUT(onion_request *req, onion_buffer *data);
+static onion_connection_status process_request(onion_request *req, onion_buffer *data);
+static onion_connection_status prepare_body_callback(onion_request *req, size_t length);
+static onion_connection_status prepare_CHUNKED(onion_request *req, const char *transfer_encoding);
+static onion_connection_status prepare_INFLATE(onion_request *req, size_t length);
+static onion_connection_status prepare_inflate(onion_request *req);
+static int body_encoded(onion_request *req);
+static onion_connection_status body_reject(onion_request *req, int code);
+void onion_request_body_inflate_free(onion_request *req);
+void onion_request_set_fullpath(onion_request *req, const char *path); // At request.c
+int onion_request_header_id_find(const char *name, size_t length); // At request.c
+const char *onion_response_code_description(int code); // At response.c
+
+/// Maximum size of all the headers of a request, on header slices mode.
+#define ONION_HEADER_SLICES_MAX_SIZE (64*1024)
+
+/// Creates the token. Its not zeroed, as its always written before read.
+static onion_token *token_new(){
+	onion_token *token=malloc(sizeof(onion_token));
+	onion_memory_count(ONION_MEMORY_PARSER, sizeof(onion_token));
+	token->str=token->small;
+	token->size=sizeof(token->small);
+	token->pos=0;
+	token->extra=NULL;
+	token->extra_size=0;
+	token->key=NULL;
+	return token;
+}
+
+/// Doubles the token size, up to ONION_TOKEN_MAX_SIZE. Returns -1 if already at max size.
+static int token_grow(onion_token *token){
+	if (token->size>=ONION_TOKEN_MAX_SIZE)
+		return -1;
+	size_t size=token->size*2;
+	if (token->str==token->small){
+		token->str=malloc(size);
+		memcpy(token->str, token->small, token->pos);
+		onion_memory_count(ONION_MEMORY_PARSER, size);
+	}
+	else{
+		token->str=realloc(token->str, size);
+		onion_memory_count(ONION_MEMORY_PARSER, size-token->size);
+	}
+	token->size=size;
+	return 0;
+}
+
+/// @{ @name Delimiter scanning, 16 bytes at a time where SIMD is available.
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define ONION_SCAN_SSE2
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__BYTE_ORDER__) && __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define ONION_SCAN_NEON
+
+/// Position of the first set byte in the comparison mask, or 16 if none.
+static inline int scan_neon_first(uint8x16_t m){
+	uint64_t lo=vgetq_lane_u64(vreinterpretq_u64_u8(m), 0);
+	if (lo)
+		return __builtin_ctzll(lo)/8;
+	uint64_t hi=vgetq_lane_u64(vreinterpretq_u64_u8(m), 1);
+	if (hi)
+		return 8+__builtin_ctzll(hi)/8;
+	return 16;
+}
+#endif
+
+/// Returns the position of the first a, b or c at p, or l if none.
+static size_t scan_until3(const char *p, size_t l, char a, char b, char c){
+	size_t i=0;
+#if defined(ONION_SCAN_SSE2)
+	__m128i va=_mm_set1_epi8(a), vb=_mm_set1_epi8(b), vc=_mm_set1_epi8(c);
+	for (;i+16<=l;i+=16){
+		__m128i v=_mm_loadu_si128((const __m128i*)&p[i]);
+		__m128i m=_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,va), _mm_cmpeq_epi8(v,vb)), _mm_cmpeq_epi8(v,vc));
+		int mask=_mm_movemask_epi8(m);
+		if (mask)
+			return i+__builtin_ctz(mask);
+	}
+#elif defined(ONION_SCAN_NEON)
+	uint8x16_t va=vdupq_n_u8(a), vb=vdupq_n_u8(b), vc=vdupq_n_u8(c);
+	for (;i+16<=l;i+=16){
+		uint8x16_t v=vld1q_u8((const uint8_t*)&p[i]);
+		uint8x16_t m=vorrq_u8(vorrq_u8(vceqq_u8(v,va), vceqq_u8(v,vb)), vceqq_u8(v,vc));
+		int f=scan_neon_first(m);
+		if (f<16)
+			return i+f;
+	}
+#endif
+	for (;i<l;i++){
+		char x=p[i];
+		if (x==a || x==b || x==c)
+			return i;
+	}
+	return l;
+}
+
+/// Returns the position of the first control char or space (<=0x20) at p, or l if none.
+static size_t scan_until_control(const char *p, size_t l){
+	size_t i=0;
+#if defined(ONION_SCAN_SSE2)
+	__m128i vs=_mm_set1_epi8(0x20);
+	for (;i+16<=l;i+=16){
+		__m128i v=_mm_loadu_si128((const __m128i*)&p[i]);
+		int mask=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v,vs), v));
+		if (mask)
+			return i+__builtin_ctz(mask);
+	}
+#elif defined(ONION_SCAN_NEON)
+	uint8x16_t vs=vdupq_n_u8(0x20);
+	for (;i+16<=l;i+=16){
+		int f=scan_neon_first(vcleq_u8(vld1q_u8((const uint8_t*)&p[i]), vs));
+		if (f<16)
+			return i+f;
+	}
+#endif
+	for (;i<l;i++){
+		if ((unsigned char)p[i]<=0x20)
+			return i;
+	}
+	return l;
+}
+
+/// Returns the position of the first isspace() char at p, or l if none. All of them are <=0x20.
+static size_t scan_until_space(const char *p, size_t l){
+	size_t i=0;
+	while ( (i+=scan_until_control(&p[i], l-i)) < l ){
+		if (isspace(p[i]))
+			return i;
+		i++;
+	}
+	return l;
+}
+
+/// @}
+
+/// Appends l bytes to the token, growing it if needed. Keeps space for the final \0. Returns -1 if too long.
+static int token_append(onion_token *token, const char *data, size_t l){
+	while (token->pos+l+1>=token->size){
+		if (token_grow(token)<0)
+			return -1;
+	}
+	memcpy(&token->str[token->pos], data, l);
+	token->pos+=l;
+	return 0;
+}
 
 /// Reads a string until a non-string char. Returns an onion_token
 int token_read_STRING(onion_token *token, onion_buffer *data){
-	if (data->pos>=data->size)
-		return OCS_NEED_MORE_DATA;
-	
-	char c=data->data[data->pos++];
-	while (!isspace(c)){
-		token->str[token->pos++]=c;
-		if (data->pos>=data->size)
-			return OCS_NEED_MORE_DATA;
-		if (token->pos>=(sizeof(token->str)-1)){
+	while (data->pos<data->size){
+		const char *p=&data->data[data->pos];
+		size_t n=scan_until_space(p, data->size-data->pos);
+		if (token_append(token, p, n)<0){
 			char tmp[16];
 			strncpy(tmp, token->str, 16);
 			tmp[15]='\0';
-			ONION_ERROR("Token too long to parse it. Part read start as %s (%d bytes)",tmp,token->pos);
+			ONION_ERROR_RATELIMITED("Token too long to parse it. Part read start as %s (%d bytes)",tmp,token->pos);
 			return OCS_INTERNAL_ERROR;
 		}
-		c=data->data[data->pos++];
+		data->pos+=n;
+		if (data->pos>=data->size)
+			return OCS_NEED_MORE_DATA;
+		
+		char c=data->data[data->pos++];
+		int ret;
+		if (c=='\n')
+			ret=STRING_NEW_LINE;
+		else
+			ret=STRING;
+		
+		token->str[token->pos]='\0';
+		token->pos=0;
+		//ONION_DEBUG0("Found STRING token %s",token->str);
+		return ret;
 	}
-	int ret;
-	if (c=='\n')
-		ret=STRING_NEW_LINE;
-	else
-		ret=STRING;
-	
-	token->str[token->pos]='\0';
-	token->pos=0;
-	//ONION_DEBUG0("Found STRING token %s",token->str);
-	return ret;
+	return OCS_NEED_MORE_DATA;
 }
 
 /**
@@ -136,38 +330,40 @@ int token_read_STRING(onion_token *token, onion_buffer *data){
  */
 ///
 int token_read_until(onion_token *token, onion_buffer *data, char delimiter){
-	if (data->pos>=data->size)
-		return OCS_NEED_MORE_DATA;
-	
 	//ONION_DEBUG0("Read data %d bytes, at token pos %d",data->size-data->pos, token->pos);
 	
-	char c=data->data[data->pos++];
-	while (c!=delimiter && c!='\n'){
-		if (c!='\r') // Just ignore it here
-			token->str[token->pos++]=c;
-		if (data->pos>=data->size){
-			return OCS_NEED_MORE_DATA;
-		}
-		if (token->pos>=(sizeof(token->str)-1)){
-			ONION_ERROR("Token too long to parse it. Part read is %s (%d bytes)",token->str,token->pos);
+	while (data->pos<data->size){
+		const char *p=&data->data[data->pos];
+		size_t n=scan_until3(p, data->size-data->pos, delimiter, '\n', '\r');
+		if (token_append(token, p, n)<0){
+			token->str[token->pos]='\0';
+			ONION_ERROR_RATELIMITED("Token too long to parse it. Part read is %s (%d bytes)",token->str,token->pos);
 			return OCS_INTERNAL_ERROR;
 		}
-		c=data->data[data->pos++];
-	}
-	int ret=STRING;
-	token->str[token->pos]='\0';
-	if (c!=delimiter){
-		if ( token->pos==0 && c=='\n' ){
-			ret=NEW_LINE;
-		}
-		else{ // only option left.
-			ret=STRING_NEW_LINE;
+		data->pos+=n;
+		if (data->pos>=data->size)
+			return OCS_NEED_MORE_DATA;
+		
+		char c=data->data[data->pos++];
+		if (c=='\r') // Just ignore it here
+			continue;
+		
+		int ret=STRING;
+		token->str[token->pos]='\0';
+		if (c!=delimiter){
+			if ( token->pos==0 && c=='\n' ){
+				ret=NEW_LINE;
+			}
+			else{ // only option left.
+				ret=STRING_NEW_LINE;
+			}
 		}
+		token->pos=0;
+		
+		//ONION_DEBUG0("Found KEY token %s",token->str);
+		return ret;
 	}
-	token->pos=0;
-	
-	//ONION_DEBUG0("Found KEY token %s",token->str);
-	return ret;
+	return OCS_NEED_MORE_DATA;
 }
 
 /// Reads a key, that is a string ended with ':'.
@@ -176,7 +372,7 @@ int token_read_KEY(onion_token *token, onion_buffer *data){
 	if (res==STRING)
 		return KEY;
 	if (res==STRING_NEW_LINE){
-		ONION_ERROR("When parsing header, found a non valid delimited string token: '%s'",token->str);
+		ONION_ERROR_RATELIMITED("When parsing header, found a non valid delimited string token: '%s'",token->str);
 		return OCS_INTERNAL_ERROR;
 	}
 	return res;
@@ -187,27 +383,27 @@ int token_read_LINE(onion_token *token, onion_buffer *data){
 	if (data->pos>=data->size)
 		return OCS_NEED_MORE_DATA;
 	
-	char c=data->data[data->pos++];
-	int ignore_to_end=0;
-	while (c!='\n'){
-		if (!ignore_to_end && (token->pos>=(sizeof(token->str)-1))){
-			ONION_WARNING("Token too long to parse it. Ignoring remaining. "); 
+	const char *p=&data->data[data->pos];
+	const char *nl=memchr(p, '\n', data->size-data->pos);
+	size_t n=nl ? nl-p : data->size-data->pos;
+	if (token_append(token, p, n)<0){ // Keeps what fits
+		size_t room=token->size-1-token->pos;
+		ONION_WARNING_RATELIMITED("Token too long to parse it. Ignoring remaining. "); 
 #ifdef __DEBUG__
-				char tmp[16];
-				strncpy(tmp, token->str, 16);
-				tmp[15]='\0';
-				ONION_DEBUG("Long token starts with: %s...",tmp);
+		char tmp[16];
+		strncpy(tmp, token->str, 16);
+		tmp[15]='\0';
+		ONION_DEBUG("Long token starts with: %s...",tmp);
 #endif
-			ignore_to_end=1;
-		}
-		if (!ignore_to_end)
-			token->str[token->pos++]=c;
-		if (data->pos>=data->size)
-			return OCS_NEED_MORE_DATA;
-		
-		c=data->data[data->pos++];
+		memcpy(&token->str[token->pos], p, room);
+		token->pos+=room;
 	}
-	if (token->str[token->pos-1]=='\r')
+	data->pos+=n;
+	if (!nl)
+		return OCS_NEED_MORE_DATA;
+	data->pos++; // \n
+	
+	if (token->pos>0 && token->str[token->pos-1]=='\r')
 		token->str[token->pos-1]='\0';
 	else
 		token->str[token->pos]='\0';
@@ -245,7 +441,7 @@ int token_read_MULTIPART_BOUNDARY(onion_token *token, onion_buffer *data){
 			return OCS_NEED_MORE_DATA;
 	}
 	if (multipart->boundary[multipart->pos]){
-		ONION_ERROR("Expecting multipart boundary, but not here (pos %d) (%c!=%c)", multipart->pos, data->data[data->pos], multipart->boundary[multipart->pos]);
+		ONION_ERROR_RATELIMITED("Expecting multipart boundary, but not here (pos %d) (%c!=%c)", multipart->pos, data->data[data->pos], multipart->boundary[multipart->pos]);
 		return OCS_INTERNAL_ERROR;
 	}
 	return MULTIPART_BOUNDARY;
@@ -320,9 +516,10 @@ static onion_connection_status parse_CONTENT_LENGTH(onion_request *req, onion_bu
 	
 	onion_block_add_data(req->data, &data->data[data->pos], length);
 	data->pos+=length;
+	token->pos+=length;
 	
 	if (exit)
-		return onion_request_process(req);
+		return process_request(req, data);
 	
 	return OCS_NEED_MORE_DATA;
 }
@@ -359,125 +556,606 @@ static onion_connection_status parse_PUT(onion_request *req, onion_buffer *data)
 #endif
 	
 	if (exit){
-		close (*fd);
+		if (*fd!=req->spool.fd) // Unnamed, so kept open for the handler
+			close (*fd);
+		free(fd);
+		token->extra=NULL;
+		return process_request(req, data);
+	}
+	
+	return OCS_NEED_MORE_DATA;
+}
+
+
+/**
+ * @short The body was passed to the body callback, tells it and processes the request.
+ */
+static onion_connection_status parse_body_end(onion_request *req, onion_buffer *data){
+	onion_connection_status r=req->body.callback(req->body.data, req, NULL, 0);
+	if (r<0)
+		return r;
+	return process_request(req, data);
+}
+
+static onion_connection_status parse_body_callback(onion_request *req, onion_buffer *data);
+static onion_connection_status parse_body_inflate(onion_request *req, onion_buffer *data);
+static onion_connection_status parse_inflate_end(onion_request *req, onion_buffer *data);
+static onion_connection_status body_inflate(onion_request *req, const char *data, size_t length, size_t *used);
+
+/// Whether a paused body was already all read, and only the end is left.
+static int body_read_all(onion_request *req){
+	return (req->parser==parse_body_callback || req->parser==parse_body_inflate) && !req->body.left;
+}
+
+static onion_connection_status parse_body_pause(onion_request *req, onion_buffer *data);
+
+/**
+ * @short Goes on after a pause of the body callback: with what zlib kept decoded, and with the end if all was read.
+ */
+static onion_connection_status body_resume_next(onion_request *req, onion_buffer *data){
+	if (req->body.inflate && req->body.inflate->pending){
+		size_t used;
+		onion_connection_status r=body_inflate(req, "", 0, &used);
+		if (r==OCS_SUSPENDED)
+			return parse_body_pause(req, data);
+		if (r!=OCS_NEED_MORE_DATA)
+			return r<0 ? r : OCS_INTERNAL_ERROR;
+	}
+	if (body_read_all(req))
+		return req->body.inflate ? parse_inflate_end(req, data) : parse_body_end(req, data);
+	return OCS_NEED_MORE_DATA;
+}
+
+/**
+ * @short The body callback returned OCS_SUSPENDED, stops reading until onion_request_body_resume.
+ * 
+ * The rest of the read data is kept as the pipelined requests are, and parsed on resume.
+ */
+static onion_connection_status parse_body_pause(onion_request *req, onion_buffer *data){
+	if (!req->connection.slot){
+		ONION_ERROR("Body callback returned OCS_SUSPENDED, but this request does not come from a poller. Closing it.");
+		return OCS_CLOSE_CONNECTION;
+	}
+	off_t pos=data->pos;
+	if (data->pos<data->size){
+		req->pipeline.data=onion_block_new();
+		onion_block_add_data(req->pipeline.data, &data->data[data->pos], data->size-data->pos);
+		data->pos=data->size;
+	}
+	if (!(__sync_fetch_and_or(&req->body.paused, 1)&2)) // Not resumed yet, whoever resumes, goes on.
+		return OCS_YIELD;
+	ONION_DEBUG0("Body resumed before the callback returned, go on now");
+	req->body.paused=0;
+	if (req->pipeline.data){
+		onion_block_free(req->pipeline.data);
+		req->pipeline.data=NULL;
+		data->pos=pos;
+	}
+	return body_resume_next(req, data);
+}
+
+/**
+ * @short Passes the body, as read, to the body callback.
+ */
+static onion_connection_status parse_body_callback(onion_request *req, onion_buffer *data){
+	size_t length=data->size-data->pos;
+	if (length>req->body.left)
+		length=req->body.left;
+	
+	onion_connection_status r=req->body.callback(req->body.data, req, &data->data[data->pos], length);
+	data->pos+=length;
+	req->body.left-=length;
+	
+	if (r==OCS_SUSPENDED)
+		return parse_body_pause(req, data);
+	if (r!=OCS_NEED_MORE_DATA)
+		return r<0 ? r : OCS_INTERNAL_ERROR;
+	if (!req->body.left)
+		return parse_body_end(req, data);
+	return OCS_NEED_MORE_DATA;
+}
+
+/**
+ * @short Goes on with a paused body. At the poller thread.
+ */
+static void onion_request_body_resume_now(onion_request *req){
+	onion_connection_status st=OCS_PROCESSED;
+	req->body.paused=0;
+	if (body_read_all(req) || (req->body.inflate && req->body.inflate->pending)){ // Paused at the last chunk, or with decoded data left
+		onion_buffer empty={ "", 0, 0 };
+		st=body_resume_next(req, &empty);
+		if (st==OCS_YIELD)
+			return;
+	}
+	onion_listen_point_request_resume(req, st); // Parses the rest of the body, if already read, or reads more.
+}
+
+/**
+ * @short Reads again the body of a request whose body callback returned OCS_SUSPENDED.
+ * @memberof onion_request_t
+ * 
+ * This is the backpressure of the body callbacks: when the destination of the body can not take more data 
+ * for a while, the callback returns OCS_SUSPENDED, and nothing more is read from the connection until this is 
+ * called, from any thread. The data already read is passed to the callback then.
+ * 
+ * Only for O_POLL/O_POOL modes.
+ * 
+ * @param req The request with the paused body
+ */
+void onion_request_body_resume(onion_request *req){
+	if (!(__sync_fetch_and_or(&req->body.paused, 2)&1)) // Callback did not return yet, it will go on.
+		return;
+	onion_listen_point *op=req->connection.listen_point;
+	onion_poller_call(op->poller ? op->poller : op->server->poller, (void*)onion_request_body_resume_now, req);
+}
+
+/**
+ * @short Keeps the decoded chunked body, when there is no body callback.
+ * 
+ * PUT goes to the temporal file, as with Content-Length, the rest to req->data. Over the limits, it is a 413,
+ * as with Content-Length, but once the body is being read.
+ */
+static onion_connection_status chunked_keep(onion_request *req, const char *data, size_t length){
+	onion *server=req->connection.listen_point->server;
+	req->body.read+=length;
+	if ((req->flags&OR_METHODS)==OR_PUT){
+		if (req->body.read>server->max_file_size){
+			ONION_ERROR_RATELIMITED("Trying to PUT a file bigger than allowed size");
+			return body_reject(req, HTTP_PAYLOAD_TOO_LARGE);
+		}
+		int *fd=(int*)((onion_token*)req->parser_data)->extra;
+		if (write(*fd, data, length)!=(ssize_t)length){
+			ONION_ERROR("Could not write all data to temporal file.");
+			return OCS_INTERNAL_ERROR;
+		}
+		return OCS_NEED_MORE_DATA;
+	}
+	if (req->body.read>server->max_post_size){
+		ONION_ERROR_RATELIMITED("Trying to set more data at server than allowed %d", server->max_post_size);
+		return body_reject(req, HTTP_PAYLOAD_TOO_LARGE);
+	}
+	onion_block_add_data(req->data, data, length);
+	return OCS_NEED_MORE_DATA;
+}
+
+/// Whether the POST body is urlencoded, as it is when no Content-Type is set.
+static int body_urlencoded(onion_request *req){
+	const char *content_type=onion_request_get_header_id(req, ONION_H_CONTENT_TYPE);
+	return !content_type || strstr(content_type, "application/x-www-form-urlencoded");
+}
+
+/**
+ * @short The chunked body is complete, processes the request.
+ */
+static onion_connection_status parse_chunked_end(onion_request *req, onion_buffer *data){
+	if (req->body.callback)
+		return parse_body_end(req, data);
+	onion_token *token=req->parser_data;
+	if ((req->flags&OR_METHODS)==OR_PUT){
+		int *fd=(int*)token->extra;
+		if (*fd!=req->spool.fd)
+			close(*fd);
 		free(fd);
 		token->extra=NULL;
-		return onion_request_process(req);
+	}
+	else if ((req->flags&OR_METHODS)==OR_POST && body_urlencoded(req)){ // parsed as with Content-Length
+		token->extra=strdup(onion_block_data(req->data));
+		onion_block_free(req->data);
+		req->data=NULL;
+		req->POST=onion_dict_new();
+		onion_request_parse_query_to_dict(req->POST, token->extra);
+	}
+	return process_request(req, data);
+}
+
+/**
+ * @short Passes the decoded multipart body to the multipart parser, whose state is kept apart from the raw body one.
+ * 
+ * Its end waits for the end of the encoded body, and what follows the last boundary is ignored.
+ */
+static onion_connection_status inflate_multipart(onion_request *req, const char *data, size_t length){
+	struct onion_request_inflate_t *inf=req->body.inflate;
+	if (inf->multipart_end)
+		return OCS_NEED_MORE_DATA;
+	onion_buffer decoded={ data, length, 0 };
+	void *parser=req->parser;
+	onion_connection_status r=OCS_NEED_MORE_DATA;
+	req->parser=inf->multipart;
+	while (r==OCS_NEED_MORE_DATA && decoded.pos<decoded.size && !inf->multipart_end){
+		onion_connection_status (*parse)(onion_request *req, onion_buffer *data)=req->parser;
+		r=parse(req, &decoded);
+	}
+	inf->multipart=req->parser;
+	req->parser=parser;
+	return r;
+}
+
+/**
+ * @short The body, decoded if needed, to the body callback or kept.
+ */
+static onion_connection_status body_decoded(onion_request *req, const char *data, size_t length){
+	if (req->body.callback)
+		return req->body.callback(req->body.data, req, data, length);
+	if (req->body.inflate && req->body.inflate->multipart)
+		return inflate_multipart(req, data, length);
+	return chunked_keep(req, data, length);
+}
+
+/**
+ * @short Decodes length bytes of the encoded body, and passes them on, in pieces of ONION_INFLATE_CHUNK_SIZE.
+ * 
+ * If the consumer pauses, *used tells how much zlib took, and the rest has to be passed again; as zlib may keep 
+ * decoded data, that is passed on resume. Only max_inflate_size decoded bytes are allowed, so a small body can not
+ * take gigabytes.
+ */
+static onion_connection_status body_inflate(onion_request *req, const char *data, size_t length, size_t *used){
+	struct onion_request_inflate_t *inf=req->body.inflate;
+	onion_connection_status r=OCS_NEED_MORE_DATA;
+#ifdef HAVE_ZLIB
+	size_t max_size=req->connection.listen_point->server->max_inflate_size;
+	char out[ONION_INFLATE_CHUNK_SIZE];
+	inf->z.next_in=(Bytef*)data;
+	inf->z.avail_in=length;
+	inf->pending=0;
+	while (!inf->end){
+		inf->z.next_out=(Bytef*)out;
+		inf->z.avail_out=sizeof(out);
+		int zr=inflate(&inf->z, Z_NO_FLUSH);
+		if (zr!=Z_OK && zr!=Z_STREAM_END && zr!=Z_BUF_ERROR){
+			ONION_ERROR_RATELIMITED("Invalid encoded request body: %s", inf->z.msg ? inf->z.msg : "unknown error");
+			return OCS_INTERNAL_ERROR;
+		}
+		if (zr==Z_STREAM_END)
+			inf->end=1;
+		size_t n=sizeof(out)-inf->z.avail_out;
+		if (!n) // All the input decoded
+			break;
+		inf->size+=n;
+		if (inf->size>max_size){
+			ONION_ERROR_RATELIMITED("Decoded request body bigger than allowed %d", (int)max_size);
+			return body_reject(req, HTTP_PAYLOAD_TOO_LARGE);
+		}
+		r=body_decoded(req, out, n);
+		if (r!=OCS_NEED_MORE_DATA){
+			inf->pending=(r==OCS_SUSPENDED && !inf->end);
+			break;
+		}
+	}
+	*used=inf->end ? length : length-inf->z.avail_in; // What follows the stream is ignored
+#else
+	*used=length;
+	r=OCS_INTERNAL_ERROR;
+#endif
+	return r;
+}
+
+/**
+ * @short Passes length bytes of the body, as sent, to where they go, decoding them first if encoded.
+ * 
+ * *used is less than length only when the consumer paused before taking all of them.
+ */
+static onion_connection_status body_data(onion_request *req, const char *data, size_t length, size_t *used){
+	if (req->body.inflate)
+		return body_inflate(req, data, length, used);
+	*used=length;
+	return body_decoded(req, data, length);
+}
+
+/**
+ * @short All the encoded body was read: it must be complete. Then it ends as a chunked body.
+ */
+static onion_connection_status parse_inflate_end(onion_request *req, onion_buffer *data){
+	struct onion_request_inflate_t *inf=req->body.inflate;
+	if (!inf->end || (inf->multipart && !inf->multipart_end)){
+		ONION_ERROR_RATELIMITED("Encoded request body ends before its data");
+		return OCS_INTERNAL_ERROR;
+	}
+	int multipart=(inf->multipart!=NULL);
+	onion_request_body_inflate_free(req);
+	if (multipart)
+		return process_request(req, data);
+	return parse_chunked_end(req, data);
+}
+
+/**
+ * @short Decodes the encoded body of a request with Content-Length, as read.
+ */
+static onion_connection_status parse_body_inflate(onion_request *req, onion_buffer *data){
+	size_t length=data->size-data->pos;
+	if (length>req->body.left)
+		length=req->body.left;
+	
+	size_t used;
+	onion_connection_status r=body_inflate(req, &data->data[data->pos], length, &used);
+	data->pos+=used;
+	req->body.left-=used;
+	
+	if (r==OCS_SUSPENDED)
+		return parse_body_pause(req, data);
+	if (r!=OCS_NEED_MORE_DATA)
+		return r<0 ? r : OCS_INTERNAL_ERROR;
+	if (!req->body.left)
+		return parse_inflate_end(req, data);
+	return OCS_NEED_MORE_DATA;
+}
+
+static onion_connection_status parse_chunked_size(onion_request *req, onion_buffer *data);
+
+/// Trailer headers after the last chunk are ignored, until the empty line.
+static onion_connection_status parse_chunked_trailer(onion_request *req, onion_buffer *data){
+	onion_token *token=req->parser_data;
+	int res=token_read_LINE(token, data);
+	
+	if (res<=1000)
+		return res;
+	token->pos=0;
+	
+	if (token->str[0]=='\0')
+		return req->body.inflate ? parse_inflate_end(req, data) : parse_chunked_end(req, data);
+	return OCS_NEED_MORE_DATA;
+}
+
+/// The \r\n after the chunk data.
+static onion_connection_status parse_chunked_data_end(onion_request *req, onion_buffer *data){
+	onion_token *token=req->parser_data;
+	int res=token_read_NEW_LINE(token, data);
+	
+	if (res<=1000){
+		if (res==OCS_INTERNAL_ERROR)
+			ONION_ERROR_RATELIMITED("Chunk data does not end with a new line");
+		return res;
+	}
+	
+	req->parser=parse_chunked_size;
+	return OCS_NEED_MORE_DATA;
+}
+
+/**
+ * @short The data of a chunk, to the body callback or kept.
+ */
+static onion_connection_status parse_chunked_data(onion_request *req, onion_buffer *data){
+	size_t length=data->size-data->pos;
+	if (length>req->body.left)
+		length=req->body.left;
+	
+	size_t used;
+	onion_connection_status r=body_data(req, &data->data[data->pos], length, &used);
+	data->pos+=used;
+	req->body.left-=used;
+	if (!req->body.left) // Before a pause, so it goes on there.
+		req->parser=parse_chunked_data_end;
+	
+	if (r==OCS_SUSPENDED)
+		return parse_body_pause(req, data);
+	if (r!=OCS_NEED_MORE_DATA)
+		return r<0 ? r : OCS_INTERNAL_ERROR;
+	return OCS_NEED_MORE_DATA;
+}
+
+/**
+ * @short The chunk size line: the size in hexadecimal, and maybe some ignored ;extensions.
+ */
+static onion_connection_status parse_chunked_size(onion_request *req, onion_buffer *data){
+	onion_token *token=req->parser_data;
+	int res=token_read_LINE(token, data);
+	
+	if (res<=1000)
+		return res;
+	token->pos=0;
+	
+	size_t size=0;
+	int ndigits=0;
+	const char *p=token->str;
+	while (isxdigit(*p)){
+		if (++ndigits>15){
+			ONION_ERROR_RATELIMITED("Chunk size too big: %s", token->str);
+			return OCS_INTERNAL_ERROR;
+		}
+		size=size*16 + (isdigit(*p) ? *p-'0' : (tolower(*p)-'a'+10));
+		p++;
+	}
+	if (!ndigits || (*p!='\0' && *p!=';' && *p!=' ' && *p!='\t')){
+		ONION_ERROR_RATELIMITED("Invalid chunk size line: %s", token->str);
+		return OCS_INTERNAL_ERROR;
 	}
 	
+	if (size==0){
+		req->parser=parse_chunked_trailer;
+		return OCS_NEED_MORE_DATA;
+	}
+	req->body.left=size;
+	req->parser=parse_chunked_data;
 	return OCS_NEED_MORE_DATA;
 }
 
+/**
+ * @short Writes length bytes of a file part to its temporal file, all of them.
+ *
+ * Checks the max file size too. On error closes the file and returns -1.
+ */
+static int parse_POST_multipart_file_write(onion_request *req, onion_multipart_buffer *multipart, const char *p, size_t length){
+	multipart->file_total_size+=length;
+	if (multipart->file_total_size>req->connection.listen_point->server->max_file_size){
+		ONION_ERROR("Files on this post too big. Aborting.");
+		close(multipart->fd);
+		return -1;
+	}
+	while (length){
+		ssize_t w=write(multipart->fd, p, length);
+		if (w<0 && errno==EINTR)
+			continue;
+		if (w<=0){
+			ONION_ERROR("Error writing multipart data to file. Check permissions on temp directory, and availabe disk.");
+			close(multipart->fd);
+			return -1;
+		}
+		p+=w;
+		length-=w;
+	}
+	return 0;
+}
+
+/**
+ * @short Finds the pattern (the boundary from its \n) at s, skipping as Horspool does.
+ *
+ * Each try looks at the last char of the window, and if it is not the boundary's, skips as much as
+ * the skip table says, which at binary data is most times the full boundary.
+ */
+static const char *parse_POST_multipart_find(const char *s, size_t length, const char *pattern, size_t m, const unsigned char *skip){
+	if (length<m)
+		return NULL;
+	const char *last=s+length-m;
+	unsigned char lastc=pattern[m-1];
+	while (s<=last){
+		unsigned char c=s[m-1];
+		if (c==lastc && memcmp(s, pattern, m-1)==0)
+			return s;
+		s+=skip[c];
+	}
+	return NULL;
+}
 
 /**
  * Hard parser as I must set into the file as I read, until i found the boundary token (or start), try to parse, and if fail, 
  * write to the file.
  * 
- * The boundary may be in two or N parts.
+ * The boundary may be in two or N parts: a boundary started at the end of the last data is kept at
+ * multipart->pos, and checked char by char here. Else the data is scanned for the full boundary, and all
+ * the data before it, or before a possible start of it at the end, is written at once, from the read buffer.
  */
 static onion_connection_status parse_POST_multipart_file(onion_request *req, onion_buffer *data){
-	char tmp[1024]; /// Read 1024 bytes fo the read on this call, and write. If read less write as read. 
-	int tmppos=0;
 	onion_token *token=req->parser_data;
 	onion_multipart_buffer *multipart=(onion_multipart_buffer*)token->extra;
 	const char *p=data->data+data->pos;
-	for (;data->pos<data->size;data->pos++){
-		//ONION_DEBUG("*p %d boundary %d (%s)",*p,multipart->boundary[multipart->pos],multipart->boundary);
-		if (multipart->pos==0){
-			if (*p=='\n') // \r is optional.
-				multipart->startpos=multipart->pos=1;
-			else
-				multipart->startpos=0;
-		}
+	const char *end=data->data+data->size;
+	
+	while (multipart->pos && p<end){
 		if (*p==multipart->boundary[multipart->pos]){
+			p++;
 			multipart->pos++;
 			if (multipart->pos==multipart->size){
 				multipart->startpos=multipart->pos=0;
-				data->pos++; // Not sure why this is needed. FIXME.
-
-				int w=write(multipart->fd,tmp,tmppos); 
-				if (w!=tmppos){
-					ONION_ERROR("Error writing multipart data to file. Check permissions on temp directory, and availabe disk.");
-					close(multipart->fd);
-					return OCS_INTERNAL_ERROR;
-				}
-
+				data->pos=p-data->data;
 				close(multipart->fd);
 				req->parser=parse_POST_multipart_next;
 				return OCS_NEED_MORE_DATA;
 			}
 		}
-		else{
-			if (multipart->file_total_size>req->connection.listen_point->server->max_file_size){
-				ONION_ERROR("Files on this post too big. Aborting.");
+		else{ // Was data, and the current char may be the start of a boundary.
+			if (parse_POST_multipart_file_write(req, multipart, multipart->boundary+multipart->startpos, multipart->pos-multipart->startpos)<0)
 				return OCS_INTERNAL_ERROR;
+			multipart->startpos=multipart->pos=0;
+		}
+	}
+	data->pos=data->size;
+	if (p==end)
+		return OCS_NEED_MORE_DATA;
+	
+	// The boundary from the \n, as \r is optional.
+	const char *pattern=multipart->boundary+1;
+	size_t m=multipart->size-1;
+	const char *found=parse_POST_multipart_find(p, end-p, pattern, m, multipart->skip);
+	if (found){
+		const char *data_end=(found>p && found[-1]=='\r') ? found-1 : found;
+		if (parse_POST_multipart_file_write(req, multipart, p, data_end-p)<0)
+			return OCS_INTERNAL_ERROR;
+		data->pos=(found+m)-data->data;
+		close(multipart->fd);
+		req->parser=parse_POST_multipart_next;
+		return OCS_NEED_MORE_DATA;
+	}
+	
+	// Keeps a possible start of the boundary for the next data. It can only start at the last \r or \n.
+	const char *keep=end;
+	if (end[-1]=='\r'){
+		keep=end-1;
+		multipart->startpos=0;
+		multipart->pos=1;
+	}
+	else{
+		const char *from=(size_t)(end-p)>m-1 ? end-(m-1) : p;
+		const char *nl=memrchr(from, '\n', end-from);
+		if (nl && memcmp(nl, pattern, end-nl)==0){
+			if (nl>p && nl[-1]=='\r'){
+				keep=nl-1;
+				multipart->startpos=0;
 			}
-			if (multipart->pos!=0){
-				multipart->file_total_size+=multipart->pos;
-				int r=multipart->pos-multipart->startpos;
-				//ONION_DEBUG0("Write %d bytes",r);
-				int w=write(multipart->fd,tmp,tmppos); 
-				if (w!=tmppos){
-					ONION_ERROR("Error writing multipart data to file. Check permissions on temp directory, and availabe disk.");
-					close(multipart->fd);
-					return OCS_INTERNAL_ERROR;
-				}
-				tmppos=0;
-				
-				w=write(multipart->fd, multipart->boundary+multipart->startpos, r);
-				if (w!=r){
-					ONION_ERROR("Error writing multipart data to file. Check permissions on temp directory, and availabe disk.");
-					close(multipart->fd);
-					return OCS_INTERNAL_ERROR;
-				}
-				multipart->startpos=multipart->pos=0;
-				data->pos--; // Ignore read charater, try again. May be start of boundary.
-				continue;
-			}
-			//ONION_DEBUG0("Write 1 byte");
-			tmp[tmppos++]=*p;
-			if (tmppos==sizeof(tmp)){
-				int w=write(multipart->fd,tmp,tmppos); 
-				if (w!=tmppos){
-					ONION_ERROR("Error writing multipart data to file. Check permissions on temp directory, and availabe disk.");
-					close(multipart->fd);
-					return OCS_INTERNAL_ERROR;
-				}
-				tmppos=0;
+			else{
+				keep=nl;
+				multipart->startpos=1;
 			}
+			multipart->pos=1+(end-nl);
 		}
-		multipart->file_total_size++;
-		p++;
 	}
-	int w=write(multipart->fd,tmp,tmppos); 
-	if (w!=tmppos){
-		ONION_ERROR("Error writing multipart data to file. Check permissions on temp directory, and availabe disk.");
-		close(multipart->fd);
+	if (parse_POST_multipart_file_write(req, multipart, p, keep-p)<0)
 		return OCS_INTERNAL_ERROR;
-	}
 	return OCS_NEED_MORE_DATA;
 }
 
 /**
- * Hard parser as I must set into the file as I read, until i found the boundary token (or start), try to parse, and if fail, 
- * write to the file.
+ * @short Appends length bytes to the field being read.
+ *
+ * The field is at the request arena, and doubles as needed, so only the fields that actually come
+ * take memory, always up to the post size limit. Returns -1 if over the limit.
+ */
+static int parse_POST_multipart_field_append(onion_request *req, onion_multipart_buffer *multipart, onion_token *token, const char *p, size_t length){
+	if (length>multipart->post_total_size){
+		ONION_ERROR("No space left for this post.");
+		return -1;
+	}
+	multipart->post_total_size-=length;
+	size_t need=token->pos+length+1; // And the \0
+	if (need>multipart->field_size){
+		size_t size=multipart->field_size ? multipart->field_size*2 : 64;
+		while (size<need)
+			size*=2;
+		if (size>need+multipart->post_total_size) // No need to go over the limit
+			size=need+multipart->post_total_size;
+		char *field=onion_request_alloc(req, size);
+		if (!field)
+			return -1;
+		if (token->pos)
+			memcpy(field, multipart->field, token->pos);
+		multipart->field=field;
+		multipart->field_size=size;
+	}
+	memcpy(multipart->field+token->pos, p, length);
+	token->pos+=length;
+	return 0;
+}
+
+/**
+ * Hard parser as I must set into the field as I read, until i found the boundary token (or start), try to parse, and if fail, 
+ * add to the field.
  * 
- * The boundary may be in two or N parts.
+ * The boundary may be in two or N parts; the data before a possible boundary is added at once.
  */
 static onion_connection_status parse_POST_multipart_data(onion_request *req, onion_buffer *data){
 	onion_token *token=req->parser_data;
 	onion_multipart_buffer *multipart=(onion_multipart_buffer*)token->extra;
 	const char *p=data->data+data->pos;
-	char *d=&multipart->data[token->pos];
+	const char *end=data->data+data->size;
+	const char *start=p; // Not added yet to the field
 
-	for (;data->pos<data->size;data->pos++){
-		if (multipart->pos==0 && *p=='\n') // \r is optional.
-			multipart->pos=1;
+	while (p<end){
+		if (multipart->pos==0){
+			if (*p!='\r' && *p!='\n'){
+				p++;
+				continue;
+			}
+			if (parse_POST_multipart_field_append(req, multipart, token, start, p-start)<0)
+				return OCS_INTERNAL_ERROR;
+			multipart->startpos=multipart->pos=(*p=='\n'); // \r is optional.
+		}
 		if (*p==multipart->boundary[multipart->pos]){ // Check boundary
+			p++;
 			multipart->pos++;
 			if (multipart->pos==multipart->size){
-				multipart->pos=0;
-				data->pos++; // Not sure why this is needed. FIXME.
+				multipart->startpos=multipart->pos=0;
+				data->pos=p-data->data;
+				if (parse_POST_multipart_field_append(req, multipart, token, p, 0)<0)
+					return OCS_INTERNAL_ERROR;
+				char *d=multipart->field+token->pos;
 				if (token->pos>0 && *(d-1)=='\n'){
 					token->pos--;
 					d--;
@@ -487,37 +1165,24 @@ static onion_connection_status parse_POST_multipart_data(onion_request *req, oni
 				
 				*d='\0';
 				ONION_DEBUG0("Adding POST data '%s'",multipart->name);
-				onion_dict_add(req->POST, multipart->name, multipart->data, 0);
-				multipart->data=multipart->data+token->pos+1;
+				onion_dict_add(req->POST, multipart->name, multipart->field, 0);
+				multipart->field=NULL;
+				multipart->field_size=0;
 				token->pos=0;
 				req->parser=parse_POST_multipart_next;
 				return OCS_NEED_MORE_DATA;
 			}
 		}
-		else{ // No boundary
-			if (multipart->pos!=0){// Maybe i was checking before... so I need to copy as much as I wrongly thought I got.
-				if (multipart->post_total_size<=multipart->pos){
-					ONION_ERROR("No space left for this post.");
-					return OCS_INTERNAL_ERROR;
-				}
-				multipart->post_total_size-=multipart->pos;
-				memcpy(d,p,multipart->pos);
-				d+=multipart->pos;
-				token->pos+=multipart->pos;
-				multipart->pos=0;
-			}
-			if (multipart->post_total_size<=0){
-				ONION_ERROR("No space left for this post.");
+		else{ // Was data, and the current char may be the start of a boundary.
+			if (parse_POST_multipart_field_append(req, multipart, token, multipart->boundary+multipart->startpos, multipart->pos-multipart->startpos)<0)
 				return OCS_INTERNAL_ERROR;
-			}
-			multipart->post_total_size--;
-			//ONION_DEBUG0("%d %d",multipart->post_total_size,token->extra_size - (int) (d-token->extra));
-			*d=*p;
-			d++;
-			token->pos++;
+			multipart->startpos=multipart->pos=0;
+			start=p;
 		}
-		p++;
 	}
+	if (multipart->pos==0 && parse_POST_multipart_field_append(req, multipart, token, start, p-start)<0)
+		return OCS_INTERNAL_ERROR;
+	data->pos=data->size;
 	return OCS_NEED_MORE_DATA;
 }
 
@@ -538,13 +1203,15 @@ static onion_connection_status parse_POST_multipart_content_type(onion_request *
 	if (name){
 		int l=strlen(token->str)-9;
 		if (l>multipart->post_total_size){
-			ONION_ERROR("Post buffer exhausted. content-Length wrong passed.");
+			ONION_ERROR_RATELIMITED("Post buffer exhausted. content-Length wrong passed.");
 			return OCS_INTERNAL_ERROR;
 		}
-		multipart->filename=multipart->data;
+		multipart->post_total_size-=l;
+		multipart->filename=onion_request_alloc(req, l+1);
+		if (!multipart->filename)
+			return OCS_INTERNAL_ERROR;
 		memcpy(multipart->filename, name+9, l);
 		multipart->filename[l]=0;
-		multipart->data=multipart->data+l+1;
 		if (*multipart->filename=='"' && multipart->filename[l-2]=='"'){
 			multipart->filename[l-2]='\0';
 			multipart->filename++;
@@ -556,10 +1223,13 @@ static onion_connection_status parse_POST_multipart_content_type(onion_request *
 		if (name){
 			int l=strlen(token->str)-5;
 			if (l>multipart->post_total_size){
-				ONION_ERROR("Post buffer exhausted. Content-Length had wrong size.");
+				ONION_ERROR_RATELIMITED("Post buffer exhausted. Content-Length had wrong size.");
 				return OCS_INTERNAL_ERROR;
 			}
-			multipart->name=multipart->data;
+			multipart->post_total_size-=l;
+			multipart->name=onion_request_alloc(req, l+1);
+			if (!multipart->name)
+				return OCS_INTERNAL_ERROR;
 			memcpy(multipart->name, name+5, l);
 			multipart->name[l]=0;
 			if (*multipart->name=='"' && multipart->name[l-2]=='"'){
@@ -567,7 +1237,6 @@ static onion_connection_status parse_POST_multipart_content_type(onion_request *
 				multipart->name[l]='\0';
 				multipart->name++;
 			}
-			multipart->data=multipart->name+l+1;
 			ONION_DEBUG0("Set field name '%s'",multipart->name);
 		}
 	}
@@ -604,7 +1273,10 @@ static onion_connection_status parse_POST_multipart_headers_key(onion_request *r
 			req->POST=onion_dict_new();
 		ONION_DEBUG("New line");
 		onion_multipart_buffer *multipart=(onion_multipart_buffer*)token->extra;
-		multipart->pos=0;
+		multipart->startpos=multipart->pos=0;
+		multipart->field=NULL;
+		multipart->field_size=0;
+		token->pos=0;
 
 		if (multipart->filename){
 			char filename[]="/tmp/onion-XXXXXX";
@@ -646,8 +1318,13 @@ static onion_connection_status parse_POST_multipart_next(onion_request *req, oni
 	
 	//ONION_DEBUG("Found next token: %d",res);
 	
-	if (res==MULTIPART_END)
-		return onion_request_process(req);
+	if (res==MULTIPART_END){
+		if (req->body.inflate){ // Processed at the end of the encoded body
+			req->body.inflate->multipart_end=1;
+			return OCS_NEED_MORE_DATA;
+		}
+		return process_request(req, data);
+	}
 	
 	onion_multipart_buffer *multipart=(onion_multipart_buffer*)token->extra;
 	multipart->filename=NULL;
@@ -678,7 +1355,7 @@ static onion_connection_status parse_POST_urlencode(onion_request *req, onion_bu
 	req->POST=onion_dict_new();
 	onion_request_parse_query_to_dict(req->POST, token->extra);
 
-	return onion_request_process(req);
+	return process_request(req, data);
 }
 
 static onion_connection_status parse_headers_KEY(onion_request *req, onion_buffer *data);
@@ -691,6 +1368,10 @@ static onion_connection_status parse_headers_VALUE_skip_leading_whitespace(onion
 			onion_token *token=req->parser_data;
 			if (peek=='\n')
 				return OCS_NEED_MORE_DATA;
+			if (token->pos+2>=token->size && token_grow(token)<0){
+				ONION_ERROR_RATELIMITED("Token too long to parse it (%d bytes)",token->pos);
+				return OCS_INTERNAL_ERROR;
+			}
 			token->str[token->pos++]=' ';
 			token->str[token->pos++]=peek;
 			req->parser=parse_headers_VALUE;
@@ -717,9 +1398,13 @@ static onion_connection_status parse_headers_VALUE_multiline_if_space(onion_requ
 	char *p=token->str; // skips leading spaces
 	while (isspace(*p)) p++;
 
-	ONION_DEBUG0("Adding header %s : %s",token->extra,p);
-	onion_dict_add(req->headers,token->extra,p, OD_DUP_VALUE|OD_FREE_KEY);
-	token->extra=NULL;
+	ONION_DEBUG0("Adding header %s : %s",token->key,p);
+	char *value=onion_request_strdup(req, p);
+	onion_dict_add(req->headers,token->key,value, 0); // Both at the arena, freed with the request
+	int id=onion_request_header_id_find(token->key, strlen(token->key));
+	if (id>=0 && !req->known_headers.values[id])
+		req->known_headers.values[id]=value;
+	token->key=NULL;
 	
 	req->parser=parse_headers_KEY;
 	return OCS_NEED_MORE_DATA; // Get back recursion if any, to prevent too long callstack (on long headers) and stack overflow.
@@ -736,7 +1421,208 @@ static onion_connection_status parse_headers_VALUE(onion_request *req, onion_buf
 }
 
 
+/**
+ * @short Answers code right away, with no body read, and the connection is closed.
+ * 
+ * As the limits are checked with the headers, a client that waits for the 100 Continue does not send the body.
+ * Returns OCS_INTERNAL_ERROR, as these errors always did, so the connection is closed. On HTTP/2
+ * streams there is no answer.
+ */
+static onion_connection_status body_reject(onion_request *req, int code){
+	if (req->flags&OR_HTTP2)
+		return OCS_INTERNAL_ERROR;
+	char response[128];
+	int len=snprintf(response, sizeof(response), "HTTP/1.%d %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", 
+									 (req->flags&OR_HTTP11) ? 1 : 0, code, onion_response_code_description(code));
+	onion_request_output_write(req, response, len);
+	return OCS_INTERNAL_ERROR;
+}
+
+static onion_connection_status parse_headers_body(onion_request *req, onion_buffer *data);
+
+/**
+ * @short All headers read, prepares to read the body, if any, or processes the request.
+ * 
+ * If the client asked for it with "Expect: 100-continue", and the body is going to be read, as it is 
+ * within limits and the body hook did not reject it, it is told to send it. Not if some body is already here.
+ */
+static onion_connection_status parse_headers_end(onion_request *req, onion_buffer *data){
+	onion_connection_status r=parse_headers_body(req, data);
+	if (r==OCS_NEED_MORE_DATA && data->pos==data->size && (req->flags&OR_HTTP11) && !(req->flags&OR_HTTP2)){
+		const char *expect=onion_request_get_header_id(req, ONION_H_EXPECT);
+		if (expect && strcasecmp(expect, "100-continue")==0)
+			onion_request_output_write(req, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+	}
+	return r;
+}
+
+/// Chooses how to read the body, if any, checking its limits, or processes the request.
+static onion_connection_status parse_headers_body(onion_request *req, onion_buffer *data){
+	onion *server=req->connection.listen_point->server;
+	onion_request_timing(req, OR_PHASE_HEADERS);
+	ONION_TRACE(request_parsed, req->connection.fd, req->fullpath, req->flags&OR_METHODS);
+	int i;
+	for (i=req->header_slices.count-1;i>=0;i--){ // Now the slices data does not move anymore. Backwards, so the first one stays.
+		const struct onion_request_header_slice_t *sl=&req->header_slices.slices[i];
+		if (sl->id>=0)
+			req->known_headers.values[sl->id]=&req->header_slices.data->data[sl->value];
+	}
+	req->known_headers.ready=1;
+	const char *transfer_encoding=onion_request_get_header_id(req, ONION_H_TRANSFER_ENCODING);
+	if (transfer_encoding){ // Before Content-Length, which is ignored.
+		if (server->body_hook)
+			server->body_hook(server->body_hook_data, req);
+		if (req->body.reject)
+			return body_reject(req, req->body.reject);
+		return prepare_CHUNKED(req, transfer_encoding);
+	}
+	const char *content_size=onion_request_get_header_id(req, ONION_H_CONTENT_LENGTH);
+	long cl=content_size ? atol(content_size) : 0;
+	if (server->body_hook && cl>0){
+		server->body_hook(server->body_hook_data, req);
+		if (req->body.reject)
+			return body_reject(req, req->body.reject);
+		if (req->body.callback && !body_encoded(req))
+			return prepare_body_callback(req, cl);
+	}
+	if (cl>0 && body_encoded(req))
+		return prepare_INFLATE(req, cl);
+	if ((req->flags&OR_METHODS)==OR_POST){
+		const char *content_type=onion_request_get_header_id(req, ONION_H_CONTENT_TYPE);
+		if (!content_type || (strstr(content_type,"application/x-www-form-urlencoded") || strstr(content_type, "boundary")))
+			return prepare_POST(req);
+	}
+	if ((req->flags&OR_METHODS)==OR_PUT)
+		return prepare_PUT(req, data);
+	const char *content_length=onion_request_get_header_id(req, ONION_H_CONTENT_LENGTH);
+	if (content_length){ // Soem length, not POST, get data.
+		int n=atoi(content_length);
+		if (n>0)
+			return prepare_CONTENT_LENGTH(req);
+	}
+	
+	return process_request(req, data);
+}
+
+/// @{ @name Header slices mode. Keys and values are copied straight to req->header_slices.data. @see onion_set_header_slices
+
+static onion_connection_status parse_headers_KEY_slices(onion_request *req, onion_buffer *data);
+static onion_connection_status parse_headers_VALUE_slices(onion_request *req, onion_buffer *data);
+
+/// Copies header bytes to the slices buffer, if still within limits.
+static int header_slices_add(onion_request *req, const char *data, size_t l){
+	onion_block *b=req->header_slices.data;
+	if (b->size+l>ONION_HEADER_SLICES_MAX_SIZE){
+		ONION_ERROR_RATELIMITED("Headers too long to parse them (more than %d bytes)", ONION_HEADER_SLICES_MAX_SIZE);
+		return -1;
+	}
+	onion_block_add_data(b, data, l);
+	return 0;
+}
+
+static onion_connection_status parse_headers_VALUE_multiline_slices(onion_request *req, onion_buffer *data);
+
+/// On multiline values, whitespace at the start of the new line is just one space. Empty lines are skipped too.
+static onion_connection_status parse_headers_VALUE_skip_whitespace_slices(onion_request *req, onion_buffer *data){
+	while (data->pos<data->size){
+		char c=data->data[data->pos];
+		if (c!=' ' && c!='\t' && c!='\r' && c!='\n'){
+			req->parser=parse_headers_VALUE_slices;
+			return parse_headers_VALUE_slices(req, data);
+		}
+		data->pos++;
+	}
+	return OCS_NEED_MORE_DATA;
+}
+
+static onion_connection_status parse_headers_VALUE_multiline_slices(onion_request *req, onion_buffer *data){
+	char peek=token_peek_next_char(data);
+	if (peek==0)
+		return OCS_NEED_MORE_DATA;
+	onion_block *b=req->header_slices.data;
+	if (peek==' ' || peek=='\t'){
+		if (b->size>req->header_slices.start && header_slices_add(req, " ", 1)<0)
+			return OCS_INTERNAL_ERROR;
+		req->parser=parse_headers_VALUE_skip_whitespace_slices;
+		return parse_headers_VALUE_skip_whitespace_slices(req, data);
+	}
+	struct onion_request_header_slice_t *sl=&req->header_slices.slices[req->header_slices.count];
+	sl->value=req->header_slices.start;
+	sl->value_length=b->size-req->header_slices.start;
+	sl->id=onion_request_header_id_find(&b->data[sl->key], sl->key_length);
+	onion_block_add_char(b, '\0');
+	req->header_slices.start=b->size;
+	req->header_slices.count++;
+	ONION_DEBUG0("Adding header %s : %s", &b->data[sl->key], &b->data[sl->value]);
+	
+	req->parser=parse_headers_KEY_slices;
+	return OCS_NEED_MORE_DATA; // Get back recursion if any, as at parse_headers_VALUE_multiline_if_space
+}
+
+static onion_connection_status parse_headers_VALUE_slices(onion_request *req, onion_buffer *data){
+	onion_block *b=req->header_slices.data;
+	if (b->size==req->header_slices.start){ // skips leading spaces
+		while (data->pos<data->size && (data->data[data->pos]==' ' || data->data[data->pos]=='\t'))
+			data->pos++;
+	}
+	const char *nl=memchr(&data->data[data->pos], '\n', data->size-data->pos);
+	size_t n=nl ? nl-&data->data[data->pos] : data->size-data->pos;
+	if (n && header_slices_add(req, &data->data[data->pos], n)<0)
+		return OCS_INTERNAL_ERROR;
+	data->pos+=n;
+	if (data->pos>=data->size)
+		return OCS_NEED_MORE_DATA;
+	data->pos++; // \n
+	if (b->size>req->header_slices.start && b->data[b->size-1]=='\r')
+		b->size--;
+	
+	req->parser=parse_headers_VALUE_multiline_slices;
+	return parse_headers_VALUE_multiline_slices(req, data);
+}
+
+static onion_connection_status parse_headers_KEY_slices(onion_request *req, onion_buffer *data){
+	onion_block *b=req->header_slices.data;
+	while (data->pos<data->size){
+		size_t n=scan_until3(&data->data[data->pos], data->size-data->pos, ':', '\r', '\n');
+		if (n && header_slices_add(req, &data->data[data->pos], n)<0)
+			return OCS_INTERNAL_ERROR;
+		data->pos+=n;
+		if (data->pos>=data->size)
+			return OCS_NEED_MORE_DATA;
+		char c=data->data[data->pos++];
+		if (c=='\r') // Just ignore it here
+			continue;
+		int key_length=b->size-req->header_slices.start;
+		if (c=='\n'){
+			if (key_length==0)
+				return parse_headers_end(req, data);
+			onion_block_add_char(b, '\0');
+			ONION_ERROR_RATELIMITED("When parsing header, found a non valid delimited string token: '%s'",&b->data[req->header_slices.start]);
+			return OCS_INTERNAL_ERROR;
+		}
+		if (req->header_slices.count==req->header_slices.size){
+			req->header_slices.size=req->header_slices.size ? req->header_slices.size*2 : 16;
+			req->header_slices.slices=realloc(req->header_slices.slices, req->header_slices.size*sizeof(struct onion_request_header_slice_t));
+		}
+		struct onion_request_header_slice_t *sl=&req->header_slices.slices[req->header_slices.count];
+		sl->key=req->header_slices.start;
+		sl->key_length=key_length;
+		onion_block_add_char(b, '\0');
+		req->header_slices.start=b->size;
+		
+		req->parser=parse_headers_VALUE_slices;
+		return parse_headers_VALUE_slices(req, data);
+	}
+	return OCS_NEED_MORE_DATA;
+}
+
+/// @}
+
 static onion_connection_status parse_headers_KEY(onion_request *req, onion_buffer *data){
+	if (req->header_slices.data){
+		req->parser=parse_headers_KEY_slices;
+		return parse_headers_KEY_slices(req, data);
+	}
 	onion_token *token=req->parser_data;
 	
 	int res=token_read_KEY(token, data);
@@ -746,24 +1632,10 @@ static onion_connection_status parse_headers_KEY(onion_request *req, onion_buffe
 
   ONION_DEBUG0("Got %d at KEY",res);
   
-	if ( res == NEW_LINE ){
-		if ((req->flags&OR_METHODS)==OR_POST){
-			const char *content_type=onion_request_get_header(req, "Content-Type");
-			if (!content_type || (strstr(content_type,"application/x-www-form-urlencoded") || strstr(content_type, "boundary")))
-				return prepare_POST(req);
-		}
-		if ((req->flags&OR_METHODS)==OR_PUT)
-			return prepare_PUT(req);
-		if (onion_request_get_header(req, "Content-Length")){ // Soem length, not POST, get data.
-			int n=atoi(onion_request_get_header(req, "Content-Length"));
-			if (n>0)
-				return prepare_CONTENT_LENGTH(req);
-		}
-		
-		return onion_request_process(req);
-	}
+	if ( res == NEW_LINE )
+		return parse_headers_end(req, data);
 	
-	token->extra=strdup(token->str);
+	token->key=onion_request_strdup(req, token->str);
 	
 	req->parser=parse_headers_VALUE;
 	return parse_headers_VALUE(req, data);
@@ -791,9 +1663,6 @@ static onion_connection_status parse_headers_VERSION(onion_request *req, onion_b
 	if (strcmp(token->str,"HTTP/1.1")==0)
 		req->flags|=OR_HTTP11;
 
-	if (!req->GET)
-		req->GET=onion_dict_new();
-
 	if (res==STRING){
 		req->parser=parse_headers_KEY_skip_NL;
 		return parse_headers_KEY_skip_NL(req, data);
@@ -812,7 +1681,7 @@ static onion_connection_status parse_headers_URL(onion_request *req, onion_buffe
 	if (res<=1000)
 		return res;
 
-	req->fullpath=strdup(token->str);
+	onion_request_set_fullpath(req, token->str);
 	onion_request_parse_query(req);
 	ONION_DEBUG0("URL path is %s", req->fullpath);
 	
@@ -828,6 +1697,12 @@ static onion_connection_status parse_headers_URL(onion_request *req, onion_buffe
 
 static onion_connection_status parse_headers_GET(onion_request *req, onion_buffer *data){
 	onion_token *token=req->parser_data;
+	if (token->pos==0){ // Empty lines before the request line are ignored, as the \r\n some clients send after a multipart body.
+		while (data->pos<data->size && (data->data[data->pos]=='\r' || data->data[data->pos]=='\n'))
+			data->pos++;
+		if (data->pos==data->size)
+			return OCS_NEED_MORE_DATA;
+	}
 	int res=token_read_STRING(token, data);
 	
 	if (res<=1000)
@@ -836,7 +1711,7 @@ static onion_connection_status parse_headers_GET(onion_request *req, onion_buffe
 	int i;
 	for (i=0;i<16;i++){
 		if (!onion_request_methods[i]){
-			ONION_ERROR("Unknown method '%s' (%d known methods)",token->str, i);
+			ONION_ERROR_RATELIMITED("Unknown method '%s' (%d known methods)",token->str, i);
 			return OCS_NOT_IMPLEMENTED;
 		}
 		if (strcmp(onion_request_methods[i], token->str)==0){
@@ -852,6 +1727,25 @@ static onion_connection_status parse_headers_GET(onion_request *req, onion_buffe
 
 
 
+/**
+ * @short Processes the parsed request. What is left at data is the start of the next pipelined request.
+ * 
+ * The handler can see it at req->pipeline, to keep it if the request goes to another thread, and 
+ * the response knows if more responses will follow, to send them together.
+ */
+static onion_connection_status process_request(onion_request *req, onion_buffer *data){
+	req->pipeline.rest=&data->data[data->pos];
+	req->pipeline.rest_length=data->size-data->pos;
+	req->output.more=(req->pipeline.rest_length>0);
+	onion_connection_status r=onion_request_process(req);
+	if (r!=OCS_YIELD){ // If yield, its not mine anymore
+		req->pipeline.rest=NULL;
+		req->pipeline.rest_length=0;
+		req->output.more=0;
+	}
+	return r;
+}
+
 /**
  * @short Write some data into the request, and passes it line by line to onion_request_fill
  *
@@ -863,36 +1757,106 @@ static onion_connection_status parse_headers_GET(onion_request *req, onion_buffe
  * @see onion_connection_status
  */
 onion_connection_status onion_request_write(onion_request *req, const char *data, size_t size){
-	if (!req->parser_data){
-		req->parser_data=calloc(1, sizeof(onion_token));
-		req->parser=parse_headers_GET;
-	}
-	
-	onion_connection_status (*parse)(onion_request *req, onion_buffer *data);
-	parse=req->parser;
-	
-	if (parse){
-		onion_buffer odata={ data, size, 0};
-		while (odata.size>odata.pos){
-			int r=parse(req, &odata);
-			if (r!=OCS_NEED_MORE_DATA){
-				return r;
-			}
-			parse=req->parser;
+	onion_connection_status r=OCS_NEED_MORE_DATA;
+	onion_buffer odata={ data, size, 0};
+	req->connection.bytes_in+=size;
+	if (req->connection.listen_point)
+		onion_stats_bytes_in(req->connection.listen_point->server, size);
+	if (req->phase.state==2) // For the minimum body rate
+		req->phase.body_read+=size;
+	do{
+		if (!req->parser_data)
+			req->parser_data=token_new();
+		if (!req->parser){ // New request, or cleaned for the next on keep alive
+			// Rejected before parsing anything. HTTP/2 streams are counted at their connection.
+			onion *server=req->connection.listen_point ? req->connection.listen_point->server : NULL;
+			if (server && server->admission && !(req->flags&OR_HTTP2) && !onion_admission_request_start(req))
+				return OCS_CLOSE_CONNECTION;
+			if (server && server->timeouts.max_requests>0 && !(req->flags&OR_HTTP2) && 
+					++req->phase.requests>=(unsigned int)server->timeouts.max_requests)
+				req->flags|=OR_NO_KEEP_ALIVE;
+			if (!(req->headers->flags&OD_FLAT)) // Compacted while idle
+				onion_dict_set_flags(req->headers, OD_ICASE|OD_FLAT);
+			if (server && server->header_slices && !req->header_slices.data)
+				req->header_slices.data=onion_block_new();
+			req->parser=parse_headers_GET;
+			onion_request_timing(req, OR_PHASE_START);
 		}
-		return OCS_NEED_MORE_DATA;
+		if (odata.size==odata.pos)
+			break;
+		if (req->connection.slot && onion_request_output_pending(req)){
+			// A pipelined request, whose response would go before the queued output. It waits until that is written.
+			if (!req->pipeline.data)
+				req->pipeline.data=onion_block_new();
+			onion_block_add_data(req->pipeline.data, &odata.data[odata.pos], odata.size-odata.pos);
+			break;
+		}
+		
+		onion_connection_status (*parse)(onion_request *req, onion_buffer *data);
+		parse=req->parser;
+		r=parse(req, &odata);
+		// On keep alive, the rest of data is the next pipelined request.
+	}while( r==OCS_NEED_MORE_DATA || (r==OCS_KEEP_ALIVE && odata.pos<odata.size) );
+	
+	if (r!=OCS_YIELD && req->output.more_sent) // Some pipelined response is waiting for more.
+		onion_request_output_push(req);
+	return r;
+}
+
+/**
+ * @short Where the next body bytes can be read to straight from the connection, and how many.
+ * 
+ * Only when the body is kept in memory with a known length, as a Content-Length or an urlencoded POST,
+ * so the listen point reads it there without a copy. The size is just what is left of this body, so
+ * a pipelined request never goes there. Returns 0 if not at such a body; then onion_request_write.
+ * 
+ * After the read, onion_request_body_read_done says how many bytes were read.
+ */
+size_t onion_request_body_read_space(onion_request *req, char **dest){
+	onion_token *token=req->parser_data;
+	if (!token || (req->connection.slot && onion_request_output_pending(req)))
+		return 0;
+	if (req->parser==parse_CONTENT_LENGTH){
+		onion_block *b=req->data;
+		*dest=b->data+b->size;
+		return token->extra_size-token->pos;
 	}
-	
-	return OCS_INTERNAL_ERROR;
+	if (req->parser==parse_POST_urlencode){
+		*dest=token->extra+token->pos;
+		return token->extra_size-token->pos;
+	}
+	return 0;
+}
+
+/// length bytes were read at the place onion_request_body_read_space said. Goes on as onion_request_write.
+onion_connection_status onion_request_body_read_done(onion_request *req, size_t length){
+	onion_token *token=req->parser_data;
+	onion_buffer empty={ NULL, 0, 0 };
+	req->connection.bytes_in+=length;
+	if (req->connection.listen_point)
+		onion_stats_bytes_in(req->connection.listen_point->server, length);
+	token->pos+=length;
+	if (req->parser==parse_CONTENT_LENGTH)
+		req->data->size+=length;
+	if (token->pos<token->extra_size)
+		return OCS_NEED_MORE_DATA;
+	if (req->parser==parse_CONTENT_LENGTH)
+		return process_request(req, &empty);
+	token->extra[token->pos]='\0';
+	req->POST=onion_dict_new();
+	onion_request_parse_query_to_dict(req->POST, token->extra);
+	return process_request(req, &empty);
 }
 
 /**
- * @short Parses the query to unquote the path and get the query.
+ * @short Unquotes the path, and keeps the query at the arena, to parse it when asked.
+ * 
+ * The GET dict is only built at onion_request_get_query_dict; before, onion_request_get_query looks at the raw query.
  */
 static int onion_request_parse_query(onion_request *req){
 	if (!req->fullpath)
 		return 0;
-	if (req->GET) // already done
+	if (req->GET || req->query) // already done
 		return 1;
 
 	char *p=req->fullpath;
@@ -906,63 +1870,78 @@ static int onion_request_parse_query(onion_request *req){
 	}
 	*p='\0';
 	onion_unquote_inplace(req->fullpath);
-	if (have_query){ // There are querys.
-		p++;
+	if (have_query) // There are querys. Copied, as internal redirects reuse the fullpath buffer.
+		req->query=onion_request_strdup(req, p+1);
+	return 1;
+}
+
+/**
+ * @short Returns the GET dict, parsing the query now if not done yet.
+ * 
+ * Internal; the url handler adds the regexp groups to it. NULL if there is no path yet.
+ */
+onion_dict *onion_request_query_dict(onion_request *req){
+	if (!req->GET && req->fullpath){
 		req->GET=onion_dict_new();
-		onion_request_parse_query_to_dict(req->GET, p);
+		if (req->query){ // Parsed on a copy, so the raw query is still there for the cache and proxy keys.
+			char *query=onion_request_strdup(req, req->query);
+			if (query)
+				onion_request_parse_query_to_dict(req->GET, query);
+		}
 	}
-	return 1;
+	return req->GET;
 }
 
 /**
- * @short Parses the query part to a given dictionary.
+ * @short Looks for key at the raw query, without building the GET dict.
  * 
- * The data is overwriten as necessary. It is NOT dupped, so if you free this char *p, please free the tree too.
+ * Internal. Returns the first value for that key, unquoted into the request arena, "" if it has no
+ * value, or NULL if not found.
  */
-static void onion_request_parse_query_to_dict(onion_dict *dict, char *p){
-	ONION_DEBUG0("Query to dict %s",p);
-	char *key=NULL, *value=NULL;
-	int state=0;  // 0 key, 1 value
-	key=p;
-	while(*p){
-		if (state==0){
-			if (*p=='='){
-				*p='\0';
-				value=p+1;
-				state=1;
-			}
-			else if (*p=='&'){
-				*p='\0';
-				onion_unquote_inplace(key);
-				ONION_DEBUG0("Adding key %s",key);
-				onion_dict_add(dict, key, "", 0);
-				key=p+1;
-				state=0;
-			}
+const char *onion_request_query_find(onion_request *req, const char *key){
+	const char *p=req->query;
+	size_t keyl=strlen(key);
+	char *tmp=NULL;
+	size_t tmpl=0;
+	onion_query_token token;
+	while (onion_query_next(&p, &token)){
+		if (token.key_length<keyl)
+			continue;
+		if (!memchr(token.key, '%', token.key_length) && !memchr(token.key, '+', token.key_length)){
+			if (token.key_length!=keyl || memcmp(token.key, key, keyl)!=0)
+				continue;
 		}
-		else{
-			if (*p=='&'){
-				*p='\0';
-				onion_unquote_inplace(key);
-				onion_unquote_inplace(value);
-				ONION_DEBUG0("Adding key %s=%-16s",key,value);
-				onion_dict_add(dict, key, value, 0);
-				key=p+1;
-				state=0;
+		else{ // Quoted key; unquoted to a scratch buffer at the arena, reused for the next ones.
+			if (tmpl<token.key_length){
+				tmp=onion_request_alloc(req, token.key_length);
+				if (!tmp)
+					return NULL;
+				tmpl=token.key_length;
 			}
+			if (onion_unquote_to(token.key, token.key_length, tmp)!=keyl || memcmp(tmp, key, keyl)!=0)
+				continue;
 		}
-		p++;
-	}
-	if (state==0){
-		if (key[0]!='\0'){
-			onion_unquote_inplace(key);
-			ONION_DEBUG0("Adding key %s",key);
-			onion_dict_add(dict, key, "", 0);
-		}
+		if (!token.value)
+			return "";
+		char *value=onion_request_alloc(req, token.value_length+1);
+		if (!value)
+			return NULL;
+		value[onion_unquote_to(token.value, token.value_length, value)]='\0';
+		return value;
 	}
-	else{
-		onion_unquote_inplace(key);
-		onion_unquote_inplace(value);
+	return NULL;
+}
+
+/**
+ * @short Parses the query part to a given dictionary.
+ * 
+ * The data is overwriten as necessary. It is NOT dupped, so if you free this char *p, please free the tree too.
+ * Split and unquoted in a single pass; empty pieces, as in "a=1&&b=2", are skipped.
+ */
+static void onion_request_parse_query_to_dict(onion_dict *dict, char *p){
+	ONION_DEBUG0("Query to dict %s",p);
+	char *key, *value;
+	while (onion_query_split_inplace(&p, &key, &value)){
 		ONION_DEBUG0("Adding key %s=%-16s",key,value);
 		onion_dict_add(dict, key, value, 0);
 	}
@@ -974,19 +1953,19 @@ static void onion_request_parse_query_to_dict(onion_dict *dict, char *p){
 static onion_connection_status prepare_POST(onion_request *req){
 	// ok post
 	onion_token *token=req->parser_data;
-	const char *content_type=onion_dict_get(req->headers, "Content-Type");
-	const char *content_size=onion_dict_get(req->headers, "Content-Length");
+	const char *content_type=onion_request_get_header_id(req, ONION_H_CONTENT_TYPE);
+	const char *content_size=onion_request_get_header_id(req, ONION_H_CONTENT_LENGTH);
 	
 	if (!content_size){
-		ONION_ERROR("I need the content size header to support POST data");
+		ONION_ERROR_RATELIMITED("I need the content size header to support POST data");
 		return OCS_INTERNAL_ERROR;
 	}
 	size_t cl=atol(content_size);
 	//ONION_DEBUG("Content type %s",content_type);
 	if (!content_type || (strstr(content_type, "application/x-www-form-urlencoded"))){
 		if (cl>req->connection.listen_point->server->max_post_size){
-			ONION_ERROR("Asked to send much POST data. Limit %d. Failing.",req->connection.listen_point->server->max_post_size);
-			return OCS_INTERNAL_ERROR;
+			ONION_ERROR_RATELIMITED("Asked to send much POST data. Limit %d. Failing.",req->connection.listen_point->server->max_post_size);
+			return body_reject(req, HTTP_PAYLOAD_TOO_LARGE);
 		}
 		token->extra=malloc(cl+1); // Cl + \0
 		token->extra_size=cl;
@@ -995,23 +1974,34 @@ static onion_connection_status prepare_POST(onion_request *req){
 		return OCS_NEED_MORE_DATA;
 	}
 	
-	// multipart.
-	
+	return prepare_POST_multipart(req, content_type, cl);
+}
+
+/**
+ * @short Prepares the multipart POST, of cl bytes as told by the client.
+ */
+static onion_connection_status prepare_POST_multipart(onion_request *req, const char *content_type, size_t cl){
+	onion_token *token=req->parser_data;
 	const char *mp_token=strstr(content_type, "boundary=");
 	if (!mp_token){
-		ONION_ERROR("No boundary set at content-type");
+		ONION_ERROR_RATELIMITED("No boundary set at content-type");
 		return OCS_INTERNAL_ERROR;
 	}
 	mp_token+=9;
-	if (cl>req->connection.listen_point->server->max_post_size) // I hope the missing part is files, else error later.
-		cl=req->connection.listen_point->server->max_post_size;
+	onion *server=req->connection.listen_point->server;
+	if (cl>server->max_post_size+server->max_file_size){ // Can not fit even if all is files
+		ONION_ERROR_RATELIMITED("Asked to send much multipart POST data. Limit %d. Failing.", (int)(server->max_post_size+server->max_file_size));
+		return body_reject(req, HTTP_PAYLOAD_TOO_LARGE);
+	}
+	if (cl>server->max_post_size) // I hope the missing part is files, else error later.
+		cl=server->max_post_size;
 	
 	int mp_token_size=strlen(mp_token);
-	token->extra_size=cl; // Max size of the multipart->data
-	onion_multipart_buffer *multipart=malloc(token->extra_size+sizeof(onion_multipart_buffer)+mp_token_size+2);
+	token->extra_size=sizeof(onion_multipart_buffer)+mp_token_size+5; // Fields go to the arena as they come
+	onion_multipart_buffer *multipart=malloc(token->extra_size);
 	token->extra=(char*)multipart;
 	
-	multipart->boundary=(char*)multipart+sizeof(onion_multipart_buffer)+1;
+	multipart->boundary=(char*)multipart+sizeof(onion_multipart_buffer);
 	multipart->size=mp_token_size+4;
 	multipart->pos=2; // First boundary already have [\r]\n readen
 	multipart->post_total_size=cl;
@@ -1021,7 +2011,15 @@ static onion_connection_status prepare_POST(onion_request *req){
 	multipart->boundary[2]='-';
 	multipart->boundary[3]='-';
 	strcpy(&multipart->boundary[4],mp_token);
-	multipart->data=(char*)multipart+sizeof(onion_multipart_buffer)+multipart->size+1;
+	multipart->field=NULL;
+	multipart->field_size=0;
+	multipart->filename=NULL;
+	multipart->name=NULL;
+	// Skips for the boundary from its \n; capped, a shorter skip is always safe.
+	size_t m=multipart->size-1, i;
+	memset(multipart->skip, m<255 ? m : 255, sizeof(multipart->skip));
+	for (i=0;i<m-1;i++)
+		multipart->skip[(unsigned char)multipart->boundary[1+i]]=(m-1-i)<255 ? m-1-i : 255;
 	
 	//ONION_DEBUG("Multipart POST boundary '%s'",multipart->boundary);
 	
@@ -1035,19 +2033,20 @@ static onion_connection_status prepare_POST(onion_request *req){
  */
 static onion_connection_status prepare_CONTENT_LENGTH(onion_request *req){
 	onion_token *token=req->parser_data;
-	const char *content_size=onion_dict_get(req->headers, "Content-Length");
+	const char *content_size=onion_request_get_header_id(req, ONION_H_CONTENT_LENGTH);
 	if (!content_size){
-		ONION_ERROR("I need the Content-Length header to get data");
+		ONION_ERROR_RATELIMITED("I need the Content-Length header to get data");
 		return OCS_INTERNAL_ERROR;
 	}
 	size_t cl=atol(content_size);
 	
 	if (cl>req->connection.listen_point->server->max_post_size){
-		ONION_ERROR("Trying to set more data at server than allowed %d", req->connection.listen_point->server->max_post_size);
-		return OCS_INTERNAL_ERROR;
+		ONION_ERROR_RATELIMITED("Trying to set more data at server than allowed %d", req->connection.listen_point->server->max_post_size);
+		return body_reject(req, HTTP_PAYLOAD_TOO_LARGE);
 	}
 
 	req->data=onion_block_new();
+	onion_block_min_maxsize(req->data, cl+1); // All at once, and it may be read straight there
 	
 	token->extra=NULL;
 	token->extra_size=cl;
@@ -1058,33 +2057,52 @@ static onion_connection_status prepare_CONTENT_LENGTH(onion_request *req){
 }
 
 /**
- * @short Prepares the PUT
+ * @short Prepares to pass the body to the body callback, instead of keeping it.
  * 
- * It saves the data to a temporal file, which name is stored at data.
+ * No size limits apply, as nothing is kept.
  */
-static onion_connection_status prepare_PUT(onion_request *req){
-	onion_token *token=req->parser_data;
-	const char *content_size=onion_dict_get(req->headers, "Content-Length");
-	if (!content_size){
-		ONION_ERROR("I need the Content-Length header to get data");
-		return OCS_INTERNAL_ERROR;
-	}
-	size_t cl=atol(content_size);
+static onion_connection_status prepare_body_callback(onion_request *req, size_t length){
+	req->body.left=length;
+	req->parser=parse_body_callback;
+	return OCS_NEED_MORE_DATA;
+}
 
-	if (cl>req->connection.listen_point->server->max_file_size){
-		ONION_ERROR("Trying to PUT a file bigger than allowed size");
-		return OCS_INTERNAL_ERROR;
-	}
-	
+/**
+ * @short Creates the temporal file for the PUT data. Its name is stored at data, and at FILES as filename.
+ * 
+ * It is at the spool dir of the request, or of the server. If possible it is an unnamed O_TMPFILE file, 
+ * open while the request lasts, and its name is its /proc/self/fd one, that onion_shortcut_rename links.
+ * 
+ * @param length The size it will have, if known, to allocate it at once, or 0.
+ */
+static int prepare_PUT_file(onion_request *req, size_t length){
+	onion *server=req->connection.listen_point->server;
+	const char *dir=req->spool.dir ? req->spool.dir : server->spool_dir ? server->spool_dir : "/tmp";
 	req->data=onion_block_new();
 	
-	char filename[]="/tmp/onion-XXXXXX";
-	int fd=mkstemp(filename);
-	if (fd<0)
-		ONION_ERROR("Could not create temporal file at %s.", filename);
+	size_t l=strlen(dir)+32;
+	char *filename=alloca(l);
+	int fd=-1;
+#ifdef O_TMPFILE
+	fd=open(dir, O_TMPFILE|O_WRONLY|O_CLOEXEC, 0600);
+	if (fd>=0){
+		req->spool.fd=fd;
+		snprintf(filename, l, ONION_SPOOL_UNNAMED "%d", fd);
+	}
+#endif
+	if (fd<0){ // Not at this kernel or filesystem
+		snprintf(filename, l, "%s/onion-XXXXXX", dir);
+		fd=mkstemp(filename);
+		if (fd<0)
+			ONION_ERROR("Could not create temporal file at %s.", filename);
+	}
+#ifdef __linux__
+	if (fd>=0 && length>0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, length)<0) // Just a hint, for less fragmentation
+		ONION_DEBUG0("Could not allocate %ld bytes for the PUT at %s: %s", (long)length, filename, strerror(errno));
+#endif
 	
 	onion_block_add_str(req->data, filename);
-	ONION_DEBUG0("Creating PUT file %s (%d bytes long)", filename, token->extra_size);
+	ONION_DEBUG0("Creating PUT file %s", filename);
 	
 	if (!req->FILES){
 		req->FILES=onion_dict_new();
@@ -1093,12 +2111,144 @@ static onion_connection_status prepare_PUT(onion_request *req){
 	const char *filename=onion_block_data(req->data);
 	onion_dict_add(req->FILES,"filename", filename, 0);
 	}
+	return fd;
+}
+
+/**
+ * @short Prepares to keep a body of unknown length, as it comes, when there is no body callback.
+ * 
+ * PUT goes to the temporal file, as with Content-Length, the rest to req->data. Multipart POST is not 
+ * supported here.
+ */
+static onion_connection_status prepare_body_keep(onion_request *req){
+	req->body.read=0;
+	if ((req->flags&OR_METHODS)==OR_PUT){
+		onion_token *token=req->parser_data;
+		int *pfd=malloc(sizeof(int));
+		*pfd=prepare_PUT_file(req, 0);
+		token->extra=(char*)pfd;
+		return OCS_NEED_MORE_DATA;
+	}
+	if ((req->flags&OR_METHODS)==OR_POST){
+		const char *content_type=onion_request_get_header_id(req, ONION_H_CONTENT_TYPE);
+		if (content_type && strstr(content_type, "boundary")){
+			ONION_ERROR_RATELIMITED("Chunked POST of %s is only supported with a body callback", content_type);
+			return OCS_INTERNAL_ERROR;
+		}
+	}
+	req->data=onion_block_new();
+	return OCS_NEED_MORE_DATA;
+}
+
+/**
+ * @short Prepares to read a Transfer-Encoding: chunked body.
+ * 
+ * The chunks go to the body callback if set, if not, they are kept as a body with Content-Length would be,
+ * but for multipart POST, that needs the body callback. They are decoded first if encoded.
+ */
+static onion_connection_status prepare_CHUNKED(onion_request *req, const char *transfer_encoding){
+	if (strcasecmp(transfer_encoding, "chunked")!=0){ // No other codings as gzip, chunked.
+		ONION_ERROR_RATELIMITED("Transfer-Encoding %s not supported", transfer_encoding);
+		return OCS_INTERNAL_ERROR;
+	}
+	req->body.left=0;
+	req->body.read=0;
+	req->parser=parse_chunked_size;
+	if (body_encoded(req) && prepare_inflate(req)<0)
+		return OCS_INTERNAL_ERROR;
+	if (req->body.callback)
+		return OCS_NEED_MORE_DATA;
+	return prepare_body_keep(req);
+}
+
+/// Whether the body has a Content-Encoding that is decoded at this server. Others are kept as sent.
+static int body_encoded(onion_request *req){
+	if (!req->connection.listen_point->server->max_inflate_size)
+		return 0;
+	const char *encoding=onion_request_get_header_id(req, ONION_H_CONTENT_ENCODING);
+	return encoding && (strcasecmp(encoding, "gzip")==0 || strcasecmp(encoding, "x-gzip")==0 || strcasecmp(encoding, "deflate")==0);
+}
+
+/// Starts the decoder of the body, gzip or zlib as its header tells.
+static onion_connection_status prepare_inflate(onion_request *req){
+	struct onion_request_inflate_t *inf=calloc(1, sizeof(struct onion_request_inflate_t));
+#ifdef HAVE_ZLIB
+	if (inflateInit2(&inf->z, 15+32)!=Z_OK){
+		ONION_ERROR("Could not start the decoder of the request body");
+		free(inf);
+		return OCS_INTERNAL_ERROR;
+	}
+#endif
+	req->body.inflate=inf;
+	req->flags|=OR_INFLATED;
+	return OCS_NEED_MORE_DATA;
+}
+
+/**
+ * @short Prepares to decode a body with Content-Encoding and Content-Length, as it is read.
+ * 
+ * The decoded body goes to the body callback, or is kept as a chunked one is, but for multipart POST, that 
+ * goes to the multipart parser, with the POST and file limits.
+ */
+static onion_connection_status prepare_INFLATE(onion_request *req, size_t length){
+	if (prepare_inflate(req)<0)
+		return OCS_INTERNAL_ERROR;
+	onion_connection_status r=OCS_NEED_MORE_DATA;
+	if (!req->body.callback){
+		const char *content_type=onion_request_get_header_id(req, ONION_H_CONTENT_TYPE);
+		if ((req->flags&OR_METHODS)==OR_POST && content_type && strstr(content_type, "boundary")){
+			onion *server=req->connection.listen_point->server;
+			r=prepare_POST_multipart(req, content_type, server->max_post_size);
+			req->body.inflate->multipart=req->parser;
+		}
+		else
+			r=prepare_body_keep(req);
+	}
+	if (r<0)
+		return r;
+	req->body.left=length;
+	req->parser=parse_body_inflate;
+	return OCS_NEED_MORE_DATA;
+}
+
+/// Frees the decoder of the body, if any. At the end of the body, or when the request is cleaned.
+void onion_request_body_inflate_free(onion_request *req){
+	struct onion_request_inflate_t *inf=req->body.inflate;
+	if (!inf)
+		return;
+#ifdef HAVE_ZLIB
+	inflateEnd(&inf->z);
+#endif
+	free(inf);
+	req->body.inflate=NULL;
+}
+
+/**
+ * @short Prepares the PUT
+ * 
+ * It saves the data to a temporal file, which name is stored at data.
+ */
+static onion_connection_status prepare_PUT(onion_request *req, onion_buffer *data){
+	onion_token *token=req->parser_data;
+	const char *content_size=onion_request_get_header_id(req, ONION_H_CONTENT_LENGTH);
+	if (!content_size){
+		ONION_ERROR_RATELIMITED("I need the Content-Length header to get data");
+		return OCS_INTERNAL_ERROR;
+	}
+	size_t cl=atol(content_size);
 
+	if (cl>req->connection.listen_point->server->max_file_size){
+		ONION_ERROR_RATELIMITED("Trying to PUT a file bigger than allowed size");
+		return body_reject(req, HTTP_PAYLOAD_TOO_LARGE);
+	}
+	
+	int fd=prepare_PUT_file(req, cl);
 	
 	if (cl==0){
 		ONION_DEBUG0("Created 0 length file");
-		close(fd);
-		return onion_request_process(req);
+		if (fd!=req->spool.fd)
+			close(fd);
+		return process_request(req, data);
 	}
 	
 	int *pfd=malloc(sizeof(fd));
@@ -1112,15 +2262,37 @@ static onion_connection_status prepare_PUT(onion_request *req){
 	return OCS_NEED_MORE_DATA;
 }
 
+void onion_request_parser_data_clean(void *t);
+
 /**
  * @short Frees the parser data.
  */
 void onion_request_parser_data_free(void *t){
 	ONION_DEBUG0("Free parser data");
+	onion_token *token=t;
+	onion_request_parser_data_clean(token);
+	onion_memory_count(ONION_MEMORY_PARSER, -(long)sizeof(onion_token));
+	free(token);
+}
+
+/**
+ * @short Leaves the parser data ready for the next request, on keep alive.
+ * 
+ * Long tokens go back to the small initial size, to keep the memory of idle connections low.
+ */
+void onion_request_parser_data_clean(void *t){
 	onion_token *token=t;
 	if (token->extra){
 		free(token->extra);
 		token->extra=NULL;
 	}
-	free(token);
+	token->extra_size=0;
+	token->key=NULL;
+	if (token->str!=token->small){
+		onion_memory_count(ONION_MEMORY_PARSER, -(long)token->size);
+		free(token->str);
+		token->str=token->small;
+		token->size=sizeof(token->small);
+	}
+	token->pos=0;
 }
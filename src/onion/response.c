@@ -30,6 +30,8 @@
 #include <time.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <stdint.h>
+#include <errno.h>
 
 #ifdef HAVE_PTHREAD
 # include <pthread.h>
@@ -40,18 +42,60 @@
 #include "response.h"
 #include "types_internal.h"
 #include "log.h"
+#include "trace.h"
 #include "codecs.h"
+#include "block.h"
+#include "pool.h"
+#include "memory.h"
+#include "access_log.h"
+#include "traffic_record.h"
+#include "stats.h"
 
 const char *onion_response_code_description(int code);
+int onion_http2_write_headers(onion_response *res); // At http2.c
+char *onion_request_session_cookie(onion_request *req); // At request.c
+static int onion_response_flush_end(onion_response *res, int end);
+static ssize_t onion_response_stream_write(void *res, const char *data, size_t length);
+ssize_t onion_response_write_raw(onion_response *res, const char *data, size_t length);
+struct onion_compress_t *onion_compress_start(onion_response *res, ssize_t size); // At compress.c
+ssize_t onion_compress_write(onion_response *res, const char *data, size_t length);
+void onion_compress_flush(onion_response *res);
+void onion_compress_end(onion_response *res);
+
+/// Default headers, added by pointer. When the value is this same pointer, the prerendered line is written.
+#define SERVER_NAME "libonion v0.5 - coralbits.com"
+#define DEFAULT_CONTENT_TYPE "text/html"
+static const char onion_response_server_name[]=SERVER_NAME;
+static const char onion_response_default_content_type[]=DEFAULT_CONTENT_TYPE;
 
 // DONT_USE_DATE_HEADER is not defined anywhere, but here just in case needed in the future.
 
 #ifndef DONT_USE_DATE_HEADER
-static volatile time_t onion_response_last_time=0;
-static char *onion_response_last_date_header=NULL;
-#ifdef HAVE_PTHREAD
-pthread_rwlock_t onion_response_date_lock=PTHREAD_RWLOCK_INITIALIZER;
-#endif
+/// Date header of this thread, refreshed once per second, and when it was. No locks nor allocations.
+static __thread time_t onion_response_date_time=0;
+static __thread char onion_response_date_line[48];
+static __thread int onion_response_date_line_length;
+
+/**
+ * @short Returns the "Date: ...\r\n" header line for now, as RFC 7231 IMF-fixdate (always GMT).
+ * 
+ * Not strftime, as the day and month names must not depend on the locale.
+ */
+const char *onion_response_date_header(int *length){
+	static const char *days[]={ "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+	static const char *months[]={ "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+	time_t t=time(NULL);
+	if (t!=onion_response_date_time){
+		struct tm tm;
+		gmtime_r(&t, &tm);
+		onion_response_date_line_length=snprintf(onion_response_date_line, sizeof(onion_response_date_line), 
+							"Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n", days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon], 
+							tm.tm_year+1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+		onion_response_date_time=t;
+	}
+	*length=onion_response_date_line_length;
+	return onion_response_date_line;
+}
 #endif
 
 
@@ -74,71 +118,156 @@ pthread_rwlock_t onion_response_date_lock=PTHREAD_RWLOCK_INITIALIZER;
  * onion_response objects are passed by onion internally to process the request, and should not be
  * created by user normally. Nontheless the option exist.
  * 
+ * They are reused from the thread pool when possible.
+ * 
  * @returns An onion_response object for that request.
  */
 onion_response *onion_response_new(onion_request *req){
-	onion_response *res=malloc(sizeof(onion_response));
+	onion_response *res=onion_pool_get(ONION_POOL_RESPONSE);
+	if (!res){
+		res=malloc(sizeof(onion_response));
+		onion_memory_count(ONION_MEMORY_RESPONSE, sizeof(onion_response));
+	}
 	
 	res->request=req;
 	res->headers=onion_dict_new();
+	onion_dict_set_flags(res->headers, OD_FLAT); // Few, and short
 	res->code=200; // The most normal code, so no need to overwrite it in other codes.
 	res->flags=0;
 	res->sent_bytes_total=res->length=res->sent_bytes=0;
 	res->buffer_pos=0;
+	res->chunk_start=0;
+	res->header_block=NULL;
+	res->header_block_length=0;
+	res->compress_level=0;
+	res->compress_min_size=0;
+	res->compress=NULL;
+	res->capture=NULL;
+	res->capture_max=0;
+	res->capture_fragments=0;
+	res->capture_fragments_own=0;
+	res->capture_fragments_max=0;
+	res->hold=0;
+	res->buffer=res->small_buffer;
+	res->buffer_allocated=sizeof(res->small_buffer);
+	if (req && req->connection.listen_point && req->connection.listen_point->server)
+		res->buffer_size=req->connection.listen_point->server->response_buffer_size;
+	else
+		res->buffer_size=ONION_RESPONSE_BUFFER_SIZE;
 	
-#ifndef DONT_USE_DATE_HEADER
-	{
-		time_t t;
-		struct tm *tmp;
+	// Sorry for the advertisment.
+	onion_dict_add(res->headers, "Server", onion_response_server_name, 0);
+	onion_dict_add(res->headers, "Content-Type", onion_response_default_content_type, 0); // Maybe not the best guess, but really useful.
+	
+	return res;
+}
 
-		t = time(NULL);
-		
-		// onion_response_last_date_header is set to t later. It should be more or less atomic. 
-		// If not no big deal, as we will just use slightly more CPU on those "ephemeral" moments.
-		
-		if (t!=onion_response_last_time){
-			ONION_DEBUG("Recalculating date header");
-			char current_datetime[200];
-			
-			tmp = localtime(&t);
-			if (tmp == NULL) {
-					perror("localtime");
-					exit(EXIT_FAILURE);
-			}
+/// The connection of a sink response: a listen point that writes to the sink. @see onion_response_new_sink
+typedef struct onion_response_sink_data_t{
+	onion_listen_point lp;
+	onion_response_sink write;
+	void *data;
+}onion_response_sink_data;
+
+/// Sink requests need no socket.
+static int onion_response_sink_request_init(onion_request *req){
+	return 0;
+}
+
+/// Writes to the sink of the listen point of the request.
+static ssize_t onion_response_sink_write(onion_request *req, const char *data, size_t length){
+	onion_response_sink_data *sink=(onion_response_sink_data*)req->connection.listen_point;
+	return sink->write(sink->data, data, length);
+}
 
-			if (strftime(current_datetime, sizeof(current_datetime), "%a, %d %b %Y %H:%M:%S %Z", tmp) == 0) {
-					fprintf(stderr, "strftime returned 0");
-					exit(EXIT_FAILURE);
+/**
+ * @short Creates a response with no connection, whose body goes to write.
+ * @memberof onion_response_t
+ * 
+ * No headers are written, only the body, through the same buffer as any response, so it is written in 
+ * big pieces. Its for rendering once, as a template to a file or a block at deploy time, or for several 
+ * websocket subscribers. onion_response_free flushes it and frees all.
+ * 
+ * There is no request data: the handlers called with it must not need it.
+ * 
+ * @see onion_response_sink_block onion_response_sink_fd
+ */
+onion_response *onion_response_new_sink(onion_response_sink write, void *data){
+	onion_response_sink_data *sink=calloc(1, sizeof(onion_response_sink_data));
+	sink->lp.listenfd=-1;
+	sink->lp.request_init=onion_response_sink_request_init;
+	sink->lp.write=onion_response_sink_write;
+	sink->write=write;
+	sink->data=data;
+	
+	onion_request *req=onion_request_new(&sink->lp);
+	req->flags|=OR_HEADER_SENT;
+	onion_response *res=onion_response_new(req);
+	res->flags|=OR_HEADER_SENT|OR_SINK;
+	return res;
+}
+
+/// Sink that appends to the onion_block at block.
+ssize_t onion_response_sink_block(void *block, const char *str, size_t length){
+	onion_block_add_data(block, str, length);
+	return length;
+}
+
+/// Sink that writes to the file descriptor at fd, as (void*)(intptr_t)fd.
+ssize_t onion_response_sink_fd(void *fd, const char *str, size_t length){
+	ssize_t w;
+	do{
+		w=write((int)(intptr_t)fd, str, length);
+	}while(w<0 && errno==EINTR);
+	return w;
+}
+
+/// Really frees a response, at the end of a thread pool.
+static void onion_response_pool_free(void *res){
+	onion_memory_count(ONION_MEMORY_RESPONSE, -(long)sizeof(onion_response));
+	free(res);
+}
+
+/**
+ * @short If the whole response is at the buffer, and the headers not sent, sets its length.
+ * @memberof onion_response_t
+ * 
+ * If it is compressed, it is compressed now, in one go, and the compressed length is set.
+ */
+void onion_response_set_length_buffered(onion_response *res){
+	if ((res->flags&OR_HEADER_SENT) || res->buffer_pos>=res->buffer_size)
+		return;
+	if (res->compress_level){
+		struct onion_compress_t *compress=onion_compress_start(res, res->buffer_pos);
+		if (compress){
+			char tmpb[sizeof(res->small_buffer)];
+			char *data=tmpb;
+			size_t length=res->buffer_pos;
+			if (res->buffer==res->small_buffer)
+				memcpy(tmpb, res->buffer, length);
+			else{
+				data=res->buffer;
+				onion_memory_count(ONION_MEMORY_RESPONSE, -(long)res->buffer_allocated);
+				res->buffer=res->small_buffer;
+				res->buffer_allocated=sizeof(res->small_buffer);
 			}
-			// Risky, not using mutex...
-#ifdef HAVE_PTHREAD
-			pthread_rwlock_wrlock(&onion_response_date_lock);
-#endif
-			onion_response_last_time=t; 
-			if (onion_response_last_date_header)
-				free(onion_response_last_date_header);
-			onion_response_last_date_header=strdup(current_datetime);
-#ifdef HAVE_PTHREAD
-			pthread_rwlock_unlock(&onion_response_date_lock);
-#endif
+			res->buffer_pos=0;
+			res->compress=compress;
+			onion_compress_write(res, data, length);
+			onion_compress_end(res);
+			if (data!=tmpb)
+				free(data);
+			if (res->flags&OR_HEADER_SENT) // Did not fit
+				return;
 		}
 	}
-#ifdef HAVE_PTHREAD
-	pthread_rwlock_rdlock(&onion_response_date_lock);
-#endif
-	assert(onion_response_last_date_header);
-	onion_dict_add(res->headers, "Date", onion_response_last_date_header, OD_DUP_VALUE);
-#ifdef HAVE_PTHREAD
-	pthread_rwlock_unlock(&onion_response_date_lock);
-#endif
-#endif // USE_DATE_HEADER
-	// Sorry for the advertisment.
-	onion_dict_add(res->headers, "Server", "libonion v0.5 - coralbits.com", 0);
-	onion_dict_add(res->headers, "Content-Type", "text/html", 0); // Maybe not the best guess, but really useful.
-	//time_t t=time(NULL);
-	//onion_dict_add(res->headers, "Date", asctime(localtime(&t)), OD_DUP_VALUE);
-	
-	return res;
+	onion_response_set_length(res, res->buffer_pos);
+}
+
+/// The connection closes after this response, and its poller can send it with the close. @see onion_poller_send_close
+int onion_response_is_last(onion_response *res){
+	return res->request->connection.send_close && !onion_request_keep_alive(res->request) && 
+		!(res->flags&OR_CONNECTION_UPGRADE);
 }
 
 /**
@@ -152,18 +281,32 @@ onion_response *onion_response_new(onion_request *req){
  */
 onion_connection_status onion_response_free(onion_response *res){
 	// write pending data.
-	if (!(res->flags&OR_HEADER_SENT) && res->buffer_pos<sizeof(res->buffer))
-		onion_response_set_length(res, res->buffer_pos);
-	
-	onion_response_flush(res);
-	onion_request *req=res->request;
+	onion_response_set_length_buffered(res);
 	
-	if (res->flags&OR_CHUNKED){ // Set the chunked data end.
-		req->connection.listen_point->write(req, "0\r\n\r\n",5);
+	int linger=res->request && onion_response_is_last(res);
+	if (linger)
+		res->request->output.linger=1;
+	onion_response_flush_end(res, 1); // With the chunked data end, if chunked, and the compressed data end.
+	if (linger)
+		res->request->output.linger=0;
+	if (res->request && res->request->output.more_sent && !res->request->output.more) // Nothing else follows, do not leave it held.
+		onion_request_output_push(res->request);
+	if (res->buffer!=res->small_buffer){
+		onion_memory_count(ONION_MEMORY_RESPONSE, -(long)res->buffer_allocated);
+		free(res->buffer);
 	}
+	if (res->capture)
+		onion_block_free(res->capture);
+	onion_request *req=res->request;
 	
 	int r=OCS_CLOSE_CONNECTION;
 	
+	if (res->flags&OR_SINK){ // Its own request and listen point
+		onion_listen_point *lp=req->connection.listen_point;
+		onion_request_free(req);
+		free(lp);
+		req=NULL;
+	}
 	// it is a rare ocassion that there is no request, but although unlikely, it may happend
 	if (req){
 		// keep alive only on HTTP/1.1.
@@ -175,8 +318,17 @@ onion_connection_status onion_response_free(onion_response *res){
 			 )
 			r=OCS_KEEP_ALIVE;
 		
-		if ((onion_log_flags & OF_NOINFO)!=OF_NOINFO)
-			// FIXME! This is no proper logging at all. Maybe use a handler.
+		onion *server=req->connection.listen_point ? req->connection.listen_point->server : NULL;
+		onion_stats_response(server, res->code, res->sent_bytes);
+		req->connection.bytes_out+=res->sent_bytes;
+		onion_request_timing(req, OR_PHASE_END);
+		if (server && server->request_timings)
+			onion_stats_timings(server, req->timings);
+		if (server && server->traffic_record)
+			onion_traffic_record_response(server->traffic_record, res);
+		if (server && server->access_log)
+			onion_access_log_write(server->access_log, res);
+		else if ((onion_log_flags & OF_NOINFO)!=OF_NOINFO)
 			ONION_INFO("[%s] \"%s %s\" %d %d (%s)", onion_request_get_client_description(res->request),
 								onion_request_methods[res->request->flags&OR_METHODS],
 							res->request->fullpath, res->code, res->sent_bytes,
@@ -184,11 +336,13 @@ onion_connection_status onion_response_free(onion_response *res){
 	}
 	
 	onion_dict_free(res->headers);
-	free(res);
+	if (onion_pool_put(ONION_POOL_RESPONSE, res, onion_response_pool_free)<0)
+		onion_response_pool_free(res);
 	
 	return r;
 }
 
+
 /**
  * @short Adds a header to the response object
  * @memberof onion_response_t
@@ -207,9 +361,8 @@ void onion_response_set_length(onion_response *res, size_t len){
 		ONION_WARNING("Trying to set length after headers sent. Undefined onion behaviour.");
 		return;
 	}
-	char tmp[16];
-	sprintf(tmp,"%lu",(unsigned long)len);
-	onion_response_set_header(res, "Content-Length", tmp);
+	snprintf(res->length_header, sizeof(res->length_header), "%lu", (unsigned long)len);
+	onion_dict_add(res->headers, "Content-Length", res->length_header, OD_REPLACE);
 	res->length=len;
 	res->flags|=OR_LENGTH_SET;
 }
@@ -222,17 +375,160 @@ void onion_response_set_code(onion_response *res, int  code){
 	res->code=code;
 }
 
+/**
+ * @short Sets preformatted headers, written as they are after the other headers.
+ * @memberof onion_response_t
+ * 
+ * The headers are "Key: value\r\n" lines, normally prepared once by the handler, for example
+ * a static string with the Cache-Control and security headers of all its responses. They are copied
+ * with a single memcpy when the headers are written, instead of one dict entry each. They are not copied 
+ * here, so they must be valid until then. Setting them again replaces the previous ones.
+ * 
+ * They are not checked: they must not repeat headers at the dict, and must end in "\r\n".
+ */
+void onion_response_set_header_block(onion_response *res, const char *headers, size_t length){
+	res->header_block=headers;
+	res->header_block_length=length;
+}
+
+/**
+ * @short Keeps a copy of the body written from now on, up to max_size bytes.
+ * @memberof onion_response_t
+ * 
+ * It is the body as written by the handler, before compression, so a cache can replay it. Data sent 
+ * without the response, as by sendfile, is read and written through it instead. If the body grows over 
+ * max_size the copy is dropped.
+ * 
+ * @see onion_response_get_capture
+ */
+void onion_response_set_capture(onion_response *res, size_t max_size){
+	if (!res->capture)
+		res->capture=onion_block_new();
+	else
+		onion_block_clear(res->capture);
+	res->capture_max=max_size;
+}
+
+/**
+ * @short Returns the body written since onion_response_set_capture.
+ * @memberof onion_response_t
+ * 
+ * @returns The copy, owned by the response, or NULL if not capturing or it did not fit.
+ */
+const onion_block *onion_response_get_capture(onion_response *res){
+	return res->capture;
+}
+
+/**
+ * @short Starts keeping a copy of the body from here, as for a template fragment.
+ * @memberof onion_response_t
+ * 
+ * It shares the capture of onion_response_set_capture, so the fragments can nest, and be inside a handler cache.
+ * While any fragment is open the capture is not limited. Each begin must have its onion_response_fragment_end.
+ * 
+ * @returns The mark of the start of the fragment.
+ */
+size_t onion_response_fragment_begin(onion_response *res){
+	if (res->capture_fragments==0){
+		res->capture_fragments_own=(res->capture==NULL);
+		if (res->capture_fragments_own)
+			res->capture=onion_block_new();
+		else
+			res->capture_fragments_max=res->capture_max;
+		res->capture_max=(size_t)-1;
+	}
+	res->capture_fragments++;
+	return onion_block_size(res->capture);
+}
+
+/**
+ * @short Returns a copy of the body written since the mark of onion_response_fragment_begin.
+ * @memberof onion_response_t
+ * 
+ * After the last fragment the capture goes back as it was, and is dropped if it does not fit the max size.
+ * 
+ * @returns A new block to be freed, or NULL if the body was not written, as on HEAD.
+ */
+onion_block *onion_response_fragment_end(onion_response *res, size_t mark){
+	onion_block *ret=NULL;
+	if (!(res->flags&OR_SKIP_CONTENT) && res->capture && onion_block_size(res->capture)>=mark){
+		ret=onion_block_new();
+		onion_block_add_data(ret, onion_block_data(res->capture)+mark, onion_block_size(res->capture)-mark);
+	}
+	if (--res->capture_fragments==0){
+		if (res->capture_fragments_own){
+			onion_block_free(res->capture);
+			res->capture=NULL;
+			res->capture_max=0;
+		}
+		else{
+			res->capture_max=res->capture_fragments_max;
+			if (onion_block_size(res->capture)>res->capture_max){
+				onion_block_free(res->capture);
+				res->capture=NULL;
+			}
+		}
+	}
+	return ret;
+}
+
+/// Adds the data to the capture, or drops it if too big.
+static void onion_response_capture(onion_response *res, const char *data, size_t length){
+	if (onion_block_size(res->capture)+length>res->capture_max){
+		onion_block_free(res->capture);
+		res->capture=NULL;
+		return;
+	}
+	onion_block_add_data(res->capture, data, length);
+}
+
+/**
+ * @short Writes several parts to the buffer. When they fit, in one go, without flushing checks.
+ * @memberof onion_response_t
+ */
+static void onion_response_write_parts(onion_response *res, const struct iovec *parts, int nparts){
+	size_t l=0;
+	int i;
+	for (i=0;i<nparts;i++)
+		l+=parts[i].iov_len;
+	if (res->buffer_pos+l<=res->buffer_allocated && res->buffer_pos+l<=res->buffer_size+res->chunk_start){
+		char *p=&res->buffer[res->buffer_pos];
+		for (i=0;i<nparts;i++){
+			memcpy(p, parts[i].iov_base, parts[i].iov_len);
+			p+=parts[i].iov_len;
+		}
+		res->buffer_pos+=l;
+		return;
+	}
+	for (i=0;i<nparts;i++)
+		onion_response_write(res, parts[i].iov_base, parts[i].iov_len);
+}
+
+#define SERVER_LINE "Server: " SERVER_NAME "\r\n"
+#define DEFAULT_CONTENT_TYPE_LINE "Content-Type: " DEFAULT_CONTENT_TYPE "\r\n"
+
 /**
  * @short Helper that is called on each header, and writes the header
  * @memberof onion_response_t
+ * 
+ * The defaults are written prerendered, the rest key and value at once.
  */
 static void write_header(onion_response *res, const char *key, const char *value, int flags){
 	//ONION_DEBUG0("Response header: %s: %s",key, value);
 
-	onion_response_write0(res, key);
-	onion_response_write(res, ": ",2);
-	onion_response_write0(res, value);
-	onion_response_write(res, "\r\n",2);
+	if (value==onion_response_server_name)
+		onion_response_write(res, SERVER_LINE, sizeof(SERVER_LINE)-1);
+	else if (value==onion_response_default_content_type)
+		onion_response_write(res, DEFAULT_CONTENT_TYPE_LINE, sizeof(DEFAULT_CONTENT_TYPE_LINE)-1);
+	else{
+		struct iovec parts[4]={
+			{ (void*)key, strlen(key) },
+			{ ": ", 2 },
+			{ (void*)value, strlen(value) },
+			{ "\r\n", 2 }
+		};
+		onion_response_write_parts(res, parts, 4);
+	}
 }
 
 #define CONNECTION_CLOSE "Connection: Close\r\n"
@@ -240,6 +536,58 @@ static void write_header(onion_response *res, const char *key, const char *value
 #define CONNECTION_CHUNK_ENCODING "Transfer-Encoding: chunked\r\n"
 #define CONNECTION_UPGRADE "Connection: Upgrade\r\n"
 
+/// Status line without the "HTTP/1.x" prefix, prerendered for a code. It must match onion_response_code_description.
+#define STATUS_LINE(code, description) { code, " " #code " " description "\r\n", sizeof(" " #code " " description "\r\n")-1 }
+
+/// Status lines of the known codes, the most common first.
+static const struct{
+	int code;
+	const char *line;
+	int length;
+}onion_response_status_lines[]={
+	STATUS_LINE(200, "OK"),
+	STATUS_LINE(304, "NOT MODIFIED"),
+	STATUS_LINE(404, "NOT FOUND"),
+	STATUS_LINE(302, "REDIRECT"),
+	STATUS_LINE(301, "MOVED"),
+	STATUS_LINE(101, "SWITCHING PROTOCOLS"),
+	STATUS_LINE(201, "CREATED"),
+	STATUS_LINE(206, "PARTIAL CONTENT"),
+	STATUS_LINE(207, "MULTI STATUS"),
+	STATUS_LINE(303, "SEE OTHER"),
+	STATUS_LINE(307, "TEMPORARY REDIRECT"),
+	STATUS_LINE(400, "BAD REQUEST"),
+	STATUS_LINE(401, "UNAUTHORIZED"),
+	STATUS_LINE(403, "FORBIDDEN"),
+	STATUS_LINE(405, "METHOD NOT ALLOWED"),
+	STATUS_LINE(413, "PAYLOAD TOO LARGE"),
+	STATUS_LINE(416, "RANGE NOT SATISFIABLE"),
+	STATUS_LINE(429, "TOO MANY REQUESTS"),
+	STATUS_LINE(500, "INTERNAL ERROR"),
+	STATUS_LINE(501, "NOT IMPLEMENTED"),
+	STATUS_LINE(502, "BAD GATEWAY"),
+	STATUS_LINE(503, "SERVICE UNAVALIABLE"),
+	STATUS_LINE(504, "GATEWAY TIMEOUT"),
+	{ 0, NULL, 0 }
+};
+
+/// Writes the status line, from the prerendered ones if known.
+static void onion_response_write_status_line(onion_response *res){
+	const char *version=(res->request->flags&OR_HTTP11) ? "HTTP/1.1" : "HTTP/1.0";
+	int i;
+	for (i=0;onion_response_status_lines[i].line;i++){
+		if (onion_response_status_lines[i].code==res->code){
+			struct iovec parts[2]={
+				{ (void*)version, 8 },
+				{ (void*)onion_response_status_lines[i].line, onion_response_status_lines[i].length }
+			};
+			onion_response_write_parts(res, parts, 2);
+			return;
+		}
+	}
+	onion_response_printf(res, "%s %d %s\r\n", version, res->code, onion_response_code_description(res->code));
+}
+
 /**
  * @short Writes all the header to the given response
  * @memberof onion_response_t
@@ -255,54 +603,287 @@ static void write_header(onion_response *res, const char *key, const char *value
  * @returns 0 if should procced to normal data write, or OR_SKIP_CONTENT if should not write content.
  */
 int onion_response_write_headers(onion_response *res){
+	struct onion_compress_t *compress=NULL;
+	if (res->compress_level) // Decided now, with the length if known
+		compress=onion_compress_start(res, (res->flags&OR_LENGTH_SET) ? (ssize_t)res->length : -1);
+	if (res->request->flags&OR_HTTP2){
+		int r=onion_http2_write_headers(res);
+		res->compress=compress;
+		return r;
+	}
 	res->flags|=OR_HEADER_SENT; // I Set at the begining so I can do normal writing.
 	res->request->flags|=OR_HEADER_SENT;
+	onion_block *capture=res->capture; // Only the body is captured
+	res->capture=NULL;
 	char chunked=0;
+	size_t buffer_size=res->buffer_size; // Headers are not split on small buffers
+	if (buffer_size<sizeof(res->small_buffer))
+		res->buffer_size=sizeof(res->small_buffer);
 	
+	onion_response_write_status_line(res);
 	if (res->request->flags&OR_HTTP11){
-		onion_response_printf(res, "HTTP/1.1 %d %s\r\n",res->code, onion_response_code_description(res->code));
-		//ONION_DEBUG("Response header: HTTP/1.1 %d %s\n",res->code, onion_response_code_description(res->code));
-		if (!(res->flags&OR_LENGTH_SET)  && onion_request_keep_alive(res->request)){
+		if (!(res->flags&(OR_LENGTH_SET|OR_CONNECTION_UPGRADE)) && onion_request_keep_alive(res->request)){ // Upgraded ones are not HTTP anymore
 			onion_response_write(res, CONNECTION_CHUNK_ENCODING, sizeof(CONNECTION_CHUNK_ENCODING)-1);
 			chunked=1;
 		}
 	}
 	else{
-		onion_response_printf(res, "HTTP/1.0 %d %s\r\n",res->code, onion_response_code_description(res->code));
-		//ONION_DEBUG("Response header: HTTP/1.0 %d %s\n",res->code, onion_response_code_description(res->code));
 		if (res->flags&OR_LENGTH_SET) // On HTTP/1.0, i need to state it. On 1.1 it is default.
 			onion_response_write(res, CONNECTION_KEEP_ALIVE, sizeof(CONNECTION_KEEP_ALIVE)-1);
 	}
 	
-	if (!(res->flags&OR_LENGTH_SET) && !chunked && !(res->flags&OR_CONNECTION_UPGRADE))
+	if (!chunked && !(res->flags&OR_CONNECTION_UPGRADE) && 
+	    (!(res->flags&OR_LENGTH_SET) || ((res->request->flags&OR_HTTP11) && !onion_request_keep_alive(res->request)))) // On HTTP/1.1 keep alive is the default, so tell it will close.
 		onion_response_write(res, CONNECTION_CLOSE, sizeof(CONNECTION_CLOSE)-1);
 	
 	if (res->flags&OR_CONNECTION_UPGRADE)
 		onion_response_write(res, CONNECTION_UPGRADE, sizeof(CONNECTION_UPGRADE)-1);
 	
-	onion_dict_preorder(res->headers, write_header, res);
+#ifndef DONT_USE_DATE_HEADER
+	if (!onion_dict_get(res->headers, "Date")){ // Not set by the handler
+		int length;
+		const char *date=onion_response_date_header(&length);
+		onion_response_write(res, date, length);
+	}
+#endif
+	onion_dict_iter it;
+	if (onion_dict_iter_begin(res->headers, &it)) do{ // Inlined, no callback per header
+		write_header(res, it.key, it.value, it.flags);
+	}while(onion_dict_iter_next(&it));
+	if (res->header_block)
+		onion_response_write(res, res->header_block, res->header_block_length);
 	
-	if (res->request->session_id && (onion_dict_count(res->request->session)>0)) // I have session with something, tell user
-		onion_response_printf(res, "Set-Cookie: sessionid=%s; httponly\n", res->request->session_id);
+	char *session_cookie=onion_request_session_cookie(res->request); // I have session with something, tell user
+	if (session_cookie){
+		onion_response_printf(res, "Set-Cookie: %s\r\n", session_cookie);
+		free(session_cookie);
+	}
   
 	onion_response_write(res,"\r\n",2);
 	
 	ONION_DEBUG0("Headers written");
 	res->sent_bytes=-res->buffer_pos; // the header size is not counted here. It will add again so start negative.
+	res->buffer_size=buffer_size;
+	res->capture=capture;
 	
 	if ((res->request->flags&OR_METHODS)==OR_HEAD){
 		onion_response_flush(res);
 		res->flags|=OR_SKIP_CONTENT;
 		return OR_SKIP_CONTENT;
 	}
-	if (chunked){
-		onion_response_flush(res);
+	if (chunked){ // The headers are sent with the first chunk.
+		res->chunk_start=res->buffer_pos;
 		res->flags|=OR_CHUNKED;
 	}
+	res->compress=compress; // Now, as the headers were written with onion_response_write
 	
 	return 0;
 }
 
+/**
+ * @short Drops the headers and body written until now, if nothing was sent yet, so the response can be made again.
+ * @memberof onion_response_t
+ * 
+ * The code and headers stay as set, to be changed before writing again. Not once something was sent, nor 
+ * on HTTP/2, HEAD or compressed responses, as their headers are already out or changed. While the hold 
+ * field is set, onion_response_flush does not send, so only a full buffer does.
+ * 
+ * @returns 0 if done, or -1 if it can not be.
+ */
+int onion_response_rewind(onion_response *res){
+	if (res->sent_bytes_total || res->compress || (res->flags&OR_SKIP_CONTENT) || (res->request->flags&OR_HTTP2))
+		return -1;
+	res->buffer_pos=0;
+	res->chunk_start=0;
+	res->sent_bytes=0;
+	res->flags&=~(OR_HEADER_SENT|OR_CHUNKED);
+	res->request->flags&=~OR_HEADER_SENT;
+	return 0;
+}
+
+/**
+ * @short A whole response, rendered once: status line, headers and body. Only the Date changes.
+ * @private
+ */
+struct onion_response_prerendered_t{
+	int code;
+	size_t status_length;  ///< " 200 OK\r\n", without the version, as it is the one of the request
+	size_t headers_length; ///< From the Content-Length header to the empty line
+	size_t body_length;
+	char data[];           ///< The status line, the headers and the body, one after the other
+};
+
+/**
+ * @short Renders a response that is always the same, as of a health check or a static route.
+ * @memberof onion_response_t
+ * 
+ * The status line, the Content-Length, Content-Type and Server headers and the body are rendered now, so 
+ * the requests to a handler with it (onion_handler_set_prerendered) are answered with a single write, 
+ * with the Date and Connection headers they need, without a response object. It has no session cookie, 
+ * nor compression.
+ * 
+ * @param code The HTTP code
+ * @param content_type The Content-Type, or NULL for the default, text/html
+ * @param body The body, copied
+ * @param length Its length
+ * 
+ * @returns The response, to be freed with onion_response_prerendered_free once no handler uses it.
+ */
+onion_response_prerendered *onion_response_prerender(int code, const char *content_type, const char *body, size_t length){
+	char status[128];
+	int status_length=0, i;
+	for (i=0;onion_response_status_lines[i].line;i++){
+		if (onion_response_status_lines[i].code==code){
+			status_length=snprintf(status, sizeof(status), "%s", onion_response_status_lines[i].line);
+			break;
+		}
+	}
+	if (!status_length)
+		status_length=snprintf(status, sizeof(status), " %d %s\r\n", code, onion_response_code_description(code));
+	char headers[512];
+	int headers_length;
+	if (content_type) // In the order of the header dict
+		headers_length=snprintf(headers, sizeof(headers), "Content-Length: %lu\r\nContent-Type: %s\r\n" SERVER_LINE "\r\n", 
+		                        (unsigned long)length, content_type);
+	else
+		headers_length=snprintf(headers, sizeof(headers), "Content-Length: %lu\r\n" DEFAULT_CONTENT_TYPE_LINE SERVER_LINE "\r\n", 
+		                        (unsigned long)length);
+	if (status_length>=sizeof(status) || headers_length>=sizeof(headers)){
+		ONION_ERROR("Content type too long to prerender a response");
+		return NULL;
+	}
+	size_t size=sizeof(onion_response_prerendered)+status_length+headers_length+length;
+	onion_response_prerendered *p=malloc(size);
+	if (!p)
+		return NULL;
+	onion_memory_count(ONION_MEMORY_RESPONSE, size);
+	p->code=code;
+	p->status_length=status_length;
+	p->headers_length=headers_length;
+	p->body_length=length;
+	memcpy(p->data, status, status_length);
+	memcpy(p->data+status_length, headers, headers_length);
+	memcpy(p->data+status_length+headers_length, body, length);
+	return p;
+}
+
+/**
+ * @short Frees a prerendered response.
+ * @memberof onion_response_t
+ */
+void onion_response_prerendered_free(onion_response_prerendered *p){
+	if (!p)
+		return;
+	onion_memory_count(ONION_MEMORY_RESPONSE, -(long)(sizeof(onion_response_prerendered)+p->status_length+p->headers_length+p->body_length));
+	free(p);
+}
+
+/**
+ * @short Writes the prerendered response to the request, and ends it as onion_response_free would.
+ * 
+ * One writev of the version, the status line, the Connection and Date headers and the rest, as the headers 
+ * of onion_response_write_headers for a response with its length set. Only for HTTP/1.x, and without an 
+ * access log nor a traffic record, as they need the response. The stats are kept as always.
+ * 
+ * @returns OCS_KEEP_ALIVE or OCS_CLOSE_CONNECTION.
+ */
+onion_connection_status onion_response_write_prerendered(onion_request *req, const onion_response_prerendered *p){
+	int head=((req->flags&OR_METHODS)==OR_HEAD);
+	int keep_alive=onion_request_keep_alive(req);
+	struct iovec iov[5];
+	int n=0;
+	iov[n].iov_base=(req->flags&OR_HTTP11) ? "HTTP/1.1" : "HTTP/1.0";
+	iov[n++].iov_len=8;
+	iov[n].iov_base=(void*)p->data;
+	iov[n++].iov_len=p->status_length;
+	if (!(req->flags&OR_HTTP11)){
+		iov[n].iov_base=CONNECTION_KEEP_ALIVE;
+		iov[n++].iov_len=sizeof(CONNECTION_KEEP_ALIVE)-1;
+	}
+	else if (!keep_alive){
+		iov[n].iov_base=CONNECTION_CLOSE;
+		iov[n++].iov_len=sizeof(CONNECTION_CLOSE)-1;
+	}
+#ifndef DONT_USE_DATE_HEADER
+	int date_length;
+	iov[n].iov_base=(void*)onion_response_date_header(&date_length);
+	iov[n++].iov_len=date_length;
+#endif
+	iov[n].iov_base=(void*)(p->data+p->status_length);
+	iov[n++].iov_len=p->headers_length+(head ? 0 : p->body_length);
+	req->flags|=OR_HEADER_SENT;
+	
+	size_t sent=head ? 0 : p->body_length;
+	int r=OCS_CLOSE_CONNECTION;
+	ONION_TRACE(response_flush, req->connection.fd, p->code, iov[n-1].iov_len, 1);
+	req->output.linger=(req->connection.send_close && !keep_alive); // The last, so it may go with the close
+	ssize_t w=onion_request_output_writev(req, iov, n);
+	req->output.linger=0;
+	if (w<0){
+		ONION_ERROR("Error writing the prerendered response. Maybe closed connection.");
+		sent=0;
+	}
+	else if (keep_alive)
+		r=OCS_KEEP_ALIVE;
+	if (req->output.more_sent && !req->output.more)
+		onion_request_output_push(req);
+	
+	onion *server=req->connection.listen_point->server;
+	onion_stats_response(server, p->code, sent);
+	req->connection.bytes_out+=sent;
+	onion_request_timing(req, OR_PHASE_END);
+	if (server->request_timings)
+		onion_stats_timings(server, req->timings);
+	if ((onion_log_flags & OF_NOINFO)!=OF_NOINFO)
+		ONION_INFO("[%s] \"%s %s\" %d %d (%s)", onion_request_get_client_description(req),
+		           onion_request_methods[req->flags&OR_METHODS], req->fullpath, p->code, (int)sent,
+		           (r==OCS_KEEP_ALIVE) ? "Keep-Alive" : "Close connection");
+	return r;
+}
+
+/**
+ * @short Sets the buffer size of this response, in bytes.
+ * @memberof onion_response_t
+ * 
+ * Overrides the server default of onion_set_response_buffer_size, for example to get an exact Content-Length
+ * on a known medium sized response, or to stream a slow response in small chunks. Data already buffered
+ * over the new size is flushed now.
+ */
+void onion_response_set_buffer_size(onion_response *res, size_t size){
+	if (size<1){
+		ONION_ERROR("Response buffer size must be at least 1");
+		return;
+	}
+	res->buffer_size=size;
+	if (res->buffer_pos>=size)
+		onion_response_flush(res);
+}
+
+/// Grows the buffer to at least the given size, doubling, up to buffer_size. Returns <0 if no memory, and the buffer is kept.
+static int onion_response_buffer_grow(onion_response *res, size_t size){
+	size_t allocated=res->buffer_allocated;
+	while (allocated<size)
+		allocated*=2;
+	if (allocated>res->buffer_size+res->chunk_start)
+		allocated=res->buffer_size+res->chunk_start;
+	char *buffer;
+	if (res->buffer==res->small_buffer){
+		buffer=malloc(allocated);
+		if (buffer)
+			memcpy(buffer, res->buffer, res->buffer_pos);
+	}
+	else
+		buffer=realloc(res->buffer, allocated);
+	if (!buffer){
+		ONION_ERROR("Could not grow the response buffer to %ld bytes", (long)allocated);
+		return -1;
+	}
+	onion_memory_count(ONION_MEMORY_RESPONSE, (res->buffer==res->small_buffer) ? allocated : allocated-res->buffer_allocated);
+	res->buffer=buffer;
+	res->buffer_allocated=allocated;
+	return 0;
+}
+
 /**
  * @short Write some response data.
  * @memberof onion_response_t
@@ -315,6 +896,8 @@ int onion_response_write_headers(onion_response *res){
  * These chunks are when the response is finished, or when the internal buffer is full. This
  * helps performance, and eases the programming on the user side.
  * 
+ * If the response is compressed, the data goes through the compressor before the buffer.
+ * 
  * If length is 0, forces the write of pending data.
  * 
  * @returns The bytes written, normally just length. On error returns OCS_CLOSE_CONNECTION.
@@ -331,27 +914,70 @@ ssize_t onion_response_write(onion_response *res, const char *data, size_t lengt
 		onion_response_flush(res);
 		return 0;
 	}
+	if (res->capture)
+		onion_response_capture(res, data, length);
+	if (res->compress_level && !(res->flags&OR_HEADER_SENT) && res->buffer_pos+length>res->buffer_size){
+		// Does not fit, compression is decided now, and the buffered data goes through it.
+		if (res->buffer_pos)
+			onion_response_flush_end(res, 0);
+		else
+			onion_response_write_headers(res);
+	}
+	if (res->compress)
+		return onion_compress_write(res, data, length);
+	return onion_response_write_raw(res, data, length);
+}
+
+/**
+ * @short Writes the data to the buffer, as is, flushing it when full.
+ * @memberof onion_response_t
+ * 
+ * The compressor writes its output here.
+ */
+ssize_t onion_response_write_raw(onion_response *res, const char *data, size_t length){
 	//ONION_DEBUG0("Write %d bytes [%d total] (%p)", length, res->sent_bytes, res);
 
-	int l=length;
-	int w=0;
-	while (res->buffer_pos+l>sizeof(res->buffer)){
-		int wb=sizeof(res->buffer)-res->buffer_pos;
+	if (length>=res->buffer_size && (res->flags&(OR_HEADER_SENT|OR_CHUNKED|OR_SKIP_CONTENT))==OR_HEADER_SENT){
+		// Bigger than the buffer: what is buffered, and the data as is, without copies, at one writev.
+		struct iovec iov[2]={ { res->buffer, res->buffer_pos }, { (void*)data, length } };
+		int n=res->buffer_pos ? 2 : 1;
+		if (onion_request_output_writev(res->request, &iov[2-n], n)<0){
+			ONION_ERROR("Error writing %d bytes. Maybe closed connection.", (int)(res->buffer_pos+length));
+			res->buffer_pos=0;
+			return -1;
+		}
+		res->sent_bytes+=res->buffer_pos+length;
+		res->sent_bytes_total+=res->buffer_pos+length;
+		res->buffer_pos=0;
+		return length;
+	}
+
+	size_t l=length;
+	size_t w=0;
+	while (l){
+		size_t limit=res->buffer_size+res->chunk_start; // The headers waiting for the first chunk do not count
+		if (limit>res->buffer_allocated && res->buffer_size<=sizeof(res->small_buffer)) // But do not grow for them
+			limit=res->buffer_allocated;
+		size_t wb=(res->buffer_pos<limit) ? limit-res->buffer_pos : 0;
+		if (wb>l)
+			wb=l;
+		if (res->buffer_pos+wb>res->buffer_allocated && onion_response_buffer_grow(res, res->buffer_pos+wb)<0)
+			wb=res->buffer_allocated-res->buffer_pos;
 		memcpy(&res->buffer[res->buffer_pos], data, wb);
-		
-		res->buffer_pos=sizeof(res->buffer);
-		if (onion_response_flush(res)<0)
-			return w;
-		
+		res->buffer_pos+=wb;
 		l-=wb;
 		data+=wb;
 		w+=wb;
+		
+		if (l){ // Full, and still more
+			res->request->output.bulk=1;
+			int r=onion_response_flush_end(res, 0);
+			res->request->output.bulk=0;
+			if (r<0)
+				return w;
+		}
 	}
 	
-	memcpy(&res->buffer[res->buffer_pos], data, l);
-	res->buffer_pos+=l;
-	w+=l;
-	
 	return w;
 }
 
@@ -364,19 +990,50 @@ ssize_t onion_response_write(onion_response *res, const char *data, size_t lengt
  * on more cases.
  */
 int onion_response_flush(onion_response *res){
+	if (res->hold) // Until the buffer is full
+		return 0;
+	if (res->compress) // All the data written until now, out of the compressor
+		onion_compress_flush(res);
+	return onion_response_flush_end(res, 0);
+}
+
+/**
+ * @short Writes the buffered output, and if end and chunked, the end of the chunked data.
+ * 
+ * All, the headers still at the buffer, the chunk size, the data and the chunk end, are written at
+ * once with onion_request_output_writev.
+ */
+static int onion_response_flush_end(onion_response *res, int end){
+	if (end && res->compress) // The end of the compressed data, to the buffer
+		onion_compress_end(res);
 	res->sent_bytes+=res->buffer_pos;
 	res->sent_bytes_total+=res->buffer_pos;
-	if(res->buffer_pos==0) // Not used.
+	if(res->buffer_pos==0 && !(end && res->flags&OR_CHUNKED)) // Not used.
 		return 0;
 	if (!(res->flags&OR_HEADER_SENT)){ // Automatic header write
 		ONION_DEBUG0("Doing fast header hack: store current buffer, send current headers. Resend buffer.");
-		char tmpb[sizeof(res->buffer)];
+		char tmpb[sizeof(res->small_buffer)];
+		char *data=tmpb;
 		int tmpp=res->buffer_pos;
-		memcpy(tmpb, res->buffer, res->buffer_pos);
+		if (res->buffer==res->small_buffer)
+			memcpy(tmpb, res->buffer, res->buffer_pos);
+		else{ // Grown, the headers go to the small buffer, and it grows again as the data is written.
+			data=res->buffer;
+			onion_memory_count(ONION_MEMORY_RESPONSE, -(long)res->buffer_allocated);
+			res->buffer=res->small_buffer;
+			res->buffer_allocated=sizeof(res->small_buffer);
+		}
 		res->buffer_pos=0;
 		
 		onion_response_write_headers(res);
-		onion_response_write( res, tmpb, tmpp );
+		onion_block *capture=res->capture; // Already captured
+		res->capture=NULL;
+		onion_response_write( res, data, tmpp );
+		res->capture=capture;
+		if (data!=tmpb)
+			free(data);
+		if (end) // The last flush, all must be written now.
+			return onion_response_flush_end(res, end);
  		return 0;
 	}
 	if (res->flags&OR_SKIP_CONTENT) // HEAD request
@@ -384,34 +1041,41 @@ int onion_response_flush(onion_response *res){
 	ONION_DEBUG0("Flush %d bytes", res->buffer_pos);
 
 	onion_request *req=res->request;
-	ssize_t (*write)(onion_request *, const char *data, size_t len);
-	write=req->connection.listen_point->write;
+	struct iovec iov[5];
+	int n=0;
+	char tmp[16];
 	
-	ssize_t w;
-	off_t pos=0;
 	//ONION_DEBUG0("Write %d bytes",res->buffer_pos);
 	if (res->flags&OR_CHUNKED){
-		char tmp[16];
-		snprintf(tmp,sizeof(tmp),"%X\r\n",(unsigned int)res->buffer_pos);
-		if ( (w=write(req, tmp, strlen(tmp)))<=0){
-			ONION_WARNING("Error writing chunk encoding length. Aborting write.");
-			return OCS_CLOSE_CONNECTION;
+		int start=res->chunk_start;
+		if (start){ // Headers
+			iov[n].iov_base=res->buffer;
+			iov[n++].iov_len=start;
+			res->chunk_start=0;
 		}
-		ONION_DEBUG0("Write %d-%d bytes",res->buffer_pos,w);
-	}
-	while ( (w=write(req, &res->buffer[pos], res->buffer_pos)) != res->buffer_pos){
-		if (w<=0 || res->buffer_pos<0){
-			ONION_ERROR("Error writing %d bytes. Maybe closed connection. Code %d. ",res->buffer_pos, w);
-			perror("");
-			res->buffer_pos=0;
-			return OCS_CLOSE_CONNECTION;
+		if (res->buffer_pos>start){ // An empty chunk would be the end
+			snprintf(tmp,sizeof(tmp),"%X\r\n",(unsigned int)(res->buffer_pos-start));
+			iov[n].iov_base=tmp;
+			iov[n++].iov_len=strlen(tmp);
+			iov[n].iov_base=&res->buffer[start];
+			iov[n++].iov_len=res->buffer_pos-start;
+			iov[n].iov_base="\r\n";
+			iov[n++].iov_len=2;
+		}
+		if (end){
+			iov[n].iov_base="0\r\n\r\n";
+			iov[n++].iov_len=5;
 		}
-		pos+=w;
-		ONION_DEBUG0("Write %d-%d bytes",res->buffer_pos,w);
-		res->buffer_pos-=w;
 	}
-	if (res->flags&OR_CHUNKED){
-		write(req,"\r\n",2);
+	else{
+		iov[n].iov_base=res->buffer;
+		iov[n++].iov_len=res->buffer_pos;
+	}
+	ONION_TRACE(response_flush, req->connection.fd, res->code, res->buffer_pos, end);
+	if (onion_request_output_writev(req, iov, n)<0){
+		ONION_ERROR("Error writing %d bytes. Maybe closed connection.",res->buffer_pos);
+		res->buffer_pos=0;
+		return OCS_CLOSE_CONNECTION;
 	}
 	res->buffer_pos=0;
 	return 0;
@@ -422,22 +1086,179 @@ ssize_t onion_response_write0(onion_response *res, const char *data){
 	return onion_response_write(res, data, strlen(data));
 }
 
+/**
+ * @short Writes all the data of the rope to the response.
+ * @memberof onion_response_t
+ * 
+ * When it is bigger than the buffer, and the response is not chunked nor compressed, the segments are
+ * not copied: they go as they are, after what is buffered, at writev calls of up to ONION_REQUEST_OUTPUT_IOV_MAX 
+ * buffers. Else each segment is written as with onion_response_write.
+ * 
+ * The headers are written first, so set the length before, or it will be chunked.
+ */
+ssize_t onion_response_write_rope(onion_response *res, const onion_rope *rope){
+	int count, i;
+	const struct iovec *segments=onion_rope_iovec(rope, &count);
+	size_t size=onion_rope_size(rope);
+	
+	if (size>=res->buffer_size && !res->compress_level && !(res->flags&OR_HEADER_SENT)){
+		if (res->buffer_pos) // The headers go before what is buffered
+			onion_response_flush_end(res, 0);
+		else
+			onion_response_write_headers(res);
+	}
+	if (size<res->buffer_size || res->compress || res->capture || (res->flags&(OR_HEADER_SENT|OR_CHUNKED|OR_SKIP_CONTENT))!=OR_HEADER_SENT){
+		ssize_t w=0;
+		for (i=0;i<count;i++){
+			ssize_t r=onion_response_write(res, segments[i].iov_base, segments[i].iov_len);
+			if (r<0)
+				return r;
+			w+=r;
+		}
+		return w;
+	}
+	
+	struct iovec iov[ONION_REQUEST_OUTPUT_IOV_MAX];
+	int n=0;
+	if (res->buffer_pos){
+		iov[n].iov_base=res->buffer;
+		iov[n++].iov_len=res->buffer_pos;
+	}
+	size_t sent=res->buffer_pos;
+	for (i=0;i<count;){
+		while (i<count && n<ONION_REQUEST_OUTPUT_IOV_MAX){
+			sent+=segments[i].iov_len;
+			iov[n++]=segments[i++];
+		}
+		if (onion_request_output_writev(res->request, iov, n)<0){
+			ONION_ERROR("Error writing %d bytes. Maybe closed connection.", (int)size);
+			res->buffer_pos=0;
+			return -1;
+		}
+		n=0;
+	}
+	res->sent_bytes+=sent;
+	res->sent_bytes_total+=sent;
+	res->buffer_pos=0;
+	return size;
+}
+
+/**
+ * @short Writes the data of the shared buffer to the response, without copying it when possible.
+ * @memberof onion_response_t
+ * 
+ * When it is bigger than the buffer, and the response is not compressed, captured nor held, the data goes
+ * as it is, after what is buffered, at one writev, also as a chunk of chunked responses. If the socket would 
+ * block, a reference is queued instead of a copy, and dropped as it is written, so the same buffer can be 
+ * written to many responses at once. Else it is written as with onion_response_write.
+ * 
+ * The caller keeps its reference. The headers are written first, so set the length before, or it will be chunked.
+ * 
+ * @returns The bytes written, or <0 on error.
+ */
+ssize_t onion_response_write_shared(onion_response *res, onion_shared_buffer *buffer){
+	const char *data=onion_shared_buffer_data(buffer);
+	size_t length=onion_shared_buffer_size(buffer);
+	
+	if (length>=res->buffer_size && !res->compress_level && !res->hold && !(res->flags&OR_HEADER_SENT)){
+		if (res->buffer_pos) // The headers go before what is buffered
+			onion_response_flush_end(res, 0);
+		else
+			onion_response_write_headers(res);
+	}
+	if (length<res->buffer_size || res->compress || res->capture || res->hold || 
+			(res->flags&(OR_HEADER_SENT|OR_SKIP_CONTENT))!=OR_HEADER_SENT)
+		return onion_response_write(res, data, length);
+	
+	struct iovec iov[3];
+	onion_shared_buffer *owners[3]={ NULL, NULL, NULL };
+	int n=0;
+	char tmp[24];
+	size_t sent;
+	if (res->flags&OR_CHUNKED){
+		if (onion_response_flush_end(res, 0)<0) // The headers and what is buffered, as their own chunk
+			return -1;
+		sent=0;
+		snprintf(tmp, sizeof(tmp), "%lX\r\n", (unsigned long)length);
+		iov[n].iov_base=tmp;
+		iov[n++].iov_len=strlen(tmp);
+	}
+	else{
+		sent=res->buffer_pos;
+		if (res->buffer_pos){
+			iov[n].iov_base=res->buffer;
+			iov[n++].iov_len=res->buffer_pos;
+		}
+	}
+	owners[n]=buffer;
+	iov[n].iov_base=(void*)data;
+	iov[n++].iov_len=length;
+	if (res->flags&OR_CHUNKED){
+		iov[n].iov_base="\r\n";
+		iov[n++].iov_len=2;
+	}
+	sent+=length;
+	if (onion_request_output_writev_shared(res->request, iov, owners, n)<0){
+		ONION_ERROR("Error writing %d bytes. Maybe closed connection.", (int)sent);
+		res->buffer_pos=0;
+		return -1;
+	}
+	res->sent_bytes+=sent;
+	res->sent_bytes_total+=sent;
+	res->buffer_pos=0;
+	return length;
+}
+
+/**
+ * @short Writes data owned by the caller to the response, and frees it with free_cb when it is not needed anymore.
+ * @memberof onion_response_t
+ * 
+ * As onion_response_write_shared, so big data is not copied, and it may be freed after this returns, as
+ * the socket is writable again; or at once, if it was copied or written. With free_cb NULL the data is not
+ * freed, and must live as long as the program.
+ * 
+ * free_cb is called exactly once, also on error.
+ * 
+ * @returns The bytes written, or <0 on error.
+ */
+ssize_t onion_response_write_external(onion_response *res, const char *data, size_t length, void (*free_cb)(void *data)){
+	if (length<res->buffer_size){ // Copied anyway
+		ssize_t w=onion_response_write(res, data, length);
+		if (free_cb)
+			free_cb((void*)data);
+		return w;
+	}
+	onion_shared_buffer *buffer=onion_shared_buffer_new(data, length, free_cb);
+	ssize_t w=onion_response_write_shared(res, buffer);
+	onion_shared_buffer_unref(buffer);
+	return w;
+}
+
 /**
  * @short Writes the given string to the res, but encodes the data using html entities
  * 
  * The encoding mens that <code><html> whould become &lt;html&gt;</code>
  */
 ssize_t onion_response_write_html_safe(onion_response *res, const char *data){
-	char *tmp=onion_html_quote(data);
-	if (tmp){
-		int r=onion_response_write0(res, tmp);
-		free(tmp);
-		return r;
-	}
-	else
-		return onion_response_write0(res, data);
+	return onion_html_quote_stream(data, strlen(data), onion_response_stream_write, res);
 }
 
+/// Writer of onion_dict_json_stream and onion_html_quote_stream to the response.
+static ssize_t onion_response_stream_write(void *res, const char *data, size_t length){
+	return onion_response_write(res, data, length);
+}
+
+/**
+ * @short Writes the dict as json straight to the response buffer, without the full json at memory.
+ * @memberof onion_dict_t
+ * 
+ * Set the length before with onion_dict_json_length, or the response goes chunked.
+ * 
+ * @returns The bytes written, or -1 on error.
+ */
+ssize_t onion_dict_write_json(const onion_dict *dict, onion_response *res){
+	return onion_dict_json_stream(dict, onion_response_stream_write, res);
+}
 
 /**
  * @short Writes some data to the response. Using sprintf format strings. Max final string size: 1024
@@ -470,6 +1291,8 @@ const char *onion_response_code_description(int code){
 		case HTTP_MULTI_STATUS:
 			return "MULTI STATUS";
 			
+		case HTTP_CONTINUE:
+			return "CONTINUE";
 		case HTTP_SWITCH_PROTOCOL:
 			return "SWITCHING PROTOCOLS";
 			
@@ -494,6 +1317,14 @@ const char *onion_response_code_description(int code){
 			return "NOT FOUND";
 		case HTTP_METHOD_NOT_ALLOWED:
 			return "METHOD NOT ALLOWED";
+		case HTTP_PAYLOAD_TOO_LARGE:
+			return "PAYLOAD TOO LARGE";
+		case HTTP_RANGE_NOT_SATISFIABLE:
+			return "RANGE NOT SATISFIABLE";
+		case HTTP_TOO_EARLY:
+			return "TOO EARLY";
+		case HTTP_TOO_MANY_REQUESTS:
+			return "TOO MANY REQUESTS";
 
 		case HTTP_INTERNAL_ERROR:
 			return "INTERNAL ERROR";
@@ -503,6 +1334,8 @@ const char *onion_response_code_description(int code){
 			return "BAD GATEWAY";
 		case HTTP_SERVICE_UNAVALIABLE:
 			return "SERVICE UNAVALIABLE";
+		case HTTP_GATEWAY_TIMEOUT:
+			return "GATEWAY TIMEOUT";
 	}
 	return "CODE UNKNOWN";
 }
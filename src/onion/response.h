@@ -41,6 +41,7 @@ extern "C"{
  */
 enum onion_response_codes_e{
 	//
+	HTTP_CONTINUE=100,
 	HTTP_SWITCH_PROTOCOL=101,
 	
 	// OK codes
@@ -62,12 +63,17 @@ enum onion_response_codes_e{
 	HTTP_FORBIDDEN=403,
 	HTTP_NOT_FOUND=404,
 	HTTP_METHOD_NOT_ALLOWED=405,
+	HTTP_PAYLOAD_TOO_LARGE=413,
+	HTTP_RANGE_NOT_SATISFIABLE=416,
+	HTTP_TOO_EARLY=425,
+	HTTP_TOO_MANY_REQUESTS=429,
 	
 	// Error codes
 	HTTP_INTERNAL_ERROR=500,
 	HTTP_NOT_IMPLEMENTED=501,
 	HTTP_BAD_GATEWAY=502,
 	HTTP_SERVICE_UNAVALIABLE=503,
+	HTTP_GATEWAY_TIMEOUT=504,
 };
 
 
@@ -87,6 +93,7 @@ enum onion_response_flags_e{
 	OR_CHUNKED=32,					///< The data is to be sent using chunk encoding. Its on if no lenght is set.
 	OR_CONNECTION_UPGRADE=64, ///< The connection is upgraded (websockets).
   OR_HEADER_SENT=0x0200,  ///< The header has already been written. Its done automatically on first user write. Same id as OR_HEADER_SENT from onion_response_flags.
+	OR_SINK=0x0400,         ///< Not for a connection, the body goes to a sink. @see onion_response_new_sink
 };
 
 enum onion_response_cookie_flags_e{
@@ -99,6 +106,14 @@ typedef enum onion_response_flags_e onion_response_flags;
 onion_response *onion_response_new(onion_request *req);
 /// Frees the memory consumed by this object. Returns keep_alive status.
 int onion_response_free(onion_response *res);
+/// Writes a piece of the body of a sink response. Returns the bytes written, or <0 on error.
+typedef ssize_t (*onion_response_sink)(void *data, const char *str, size_t length);
+/// Creates a response with no connection nor headers, whose body goes to write, as for rendering a template once.
+onion_response *onion_response_new_sink(onion_response_sink write, void *data);
+/// Sink that appends to the onion_block at data.
+ssize_t onion_response_sink_block(void *block, const char *str, size_t length);
+/// Sink that writes to the file descriptor at data, as (void*)(intptr_t)fd.
+ssize_t onion_response_sink_fd(void *fd, const char *str, size_t length);
 /// Adds a header to the response object
 void onion_response_set_header(onion_response *res, const char *key, const char *value);
 /// Sets the header length. Normally it should be through set_header, but as its very common and needs some procesing here is a shortcut
@@ -107,6 +122,24 @@ void onion_response_set_length(onion_response *res, size_t length);
 void onion_response_set_code(onion_response *res, int code);
 /// Gets the headers dictionary
 onion_dict *onion_response_get_headers(onion_response *res);
+/// Sets the buffer size of this response. Up to it, it is written at once with Content-Length.
+void onion_response_set_buffer_size(onion_response *res, size_t size);
+/// Sets preformatted "Key: value\r\n" headers, written at once. Not copied, must be valid until written.
+void onion_response_set_header_block(onion_response *res, const char *headers, size_t length);
+/// Compresses the response (gzip, deflate or brotli) as the client accepts, if not known to be smaller than min_size. Level 0 does not.
+void onion_response_set_compression(onion_response *res, int level, size_t min_size);
+/// Keeps a copy of the body written from now on, before compression, up to max_size bytes.
+void onion_response_set_capture(onion_response *res, size_t max_size);
+/// Returns the body written since onion_response_set_capture, or NULL if it did not fit.
+const onion_block *onion_response_get_capture(onion_response *res);
+/// Starts keeping a copy of the body from here, as for a template fragment. Returns the mark for onion_response_fragment_end.
+size_t onion_response_fragment_begin(onion_response *res);
+/// Returns a new block with the body written since the mark, or NULL if there is no body, as on HEAD.
+onion_block *onion_response_fragment_end(onion_response *res, size_t mark);
+/// Renders once a response that is always the same, to be written by the handlers with onion_handler_set_prerendered. NULL content_type is text/html.
+onion_response_prerendered *onion_response_prerender(int code, const char *content_type, const char *body, size_t length);
+/// Frees a prerendered response.
+void onion_response_prerendered_free(onion_response_prerendered *p);
 /// Sets a new cookie
 void onion_response_add_cookie(onion_response *req, const char *cookiename, const char *cookievalue, time_t validity_t, const char *path, const char *domain, int flags);
 
@@ -118,6 +151,12 @@ int onion_response_write_headers(onion_response *res);
 ssize_t onion_response_write(onion_response *res, const char *data, size_t length);
 /// Writes some data to the response. \0 ended string
 ssize_t onion_response_write0(onion_response *res, const char *data);
+/// Writes all the data of the rope to the response, its segments as they are when possible.
+ssize_t onion_response_write_rope(onion_response *res, const onion_rope *rope);
+/// Writes the data of the shared buffer, referencing it instead of copying it when possible.
+ssize_t onion_response_write_shared(onion_response *res, onion_shared_buffer *buffer);
+/// Writes data that free_cb frees as it is not needed anymore, without copying it when possible.
+ssize_t onion_response_write_external(onion_response *res, const char *data, size_t length, void (*free_cb)(void *data));
 /// Writes some data to the response. \0 ended string, and encodes it if necesary into html entities to make it safe
 ssize_t onion_response_write_html_safe(onion_response *res, const char *data);
 /// Writes some data to the response. Using sprintf format strings.
@@ -24,12 +24,106 @@
 	*/
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "sessions.h"
 #include "types_internal.h"
 #include "dict.h"
 #include "log.h"
 #include "random.h"
+#include "memory.h"
+
+/// Maximum sessions checked per shard at each onion_sessions_create, so expiry also happens without a poller.
+#define ONION_SESSIONS_CREATE_EXPIRE 2
+
+/// Monotonic time, in ms
+static int64_t onion_sessions_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+/// The shard of that session id, by FNV-1a hash.
+static onion_sessions_shard *onion_sessions_get_shard(onion_sessions *sessions, const char *sessionId){
+	unsigned int h=2166136261u;
+	while (*sessionId)
+		h=(h^(unsigned char)*sessionId++)*16777619u;
+	return &sessions->shards[h&(ONION_SESSIONS_SHARDS-1)];
+}
+
+static inline void onion_sessions_shard_lock(onion_sessions_shard *shard){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&shard->mutex);
+#endif
+}
+
+static inline void onion_sessions_shard_unlock(onion_sessions_shard *shard){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&shard->mutex);
+#endif
+}
+
+/// Takes the entry out of the shard LRU list
+static void onion_sessions_lru_unlink(onion_sessions_shard *shard, onion_sessions_entry *entry){
+	if (entry->prev)
+		entry->prev->next=entry->next;
+	else
+		shard->first=entry->next;
+	if (entry->next)
+		entry->next->prev=entry->prev;
+	else
+		shard->last=entry->prev;
+	entry->prev=entry->next=NULL;
+}
+
+/// Puts the entry as the most recently used
+static void onion_sessions_lru_push(onion_sessions_shard *shard, onion_sessions_entry *entry){
+	entry->prev=NULL;
+	entry->next=shard->first;
+	if (shard->first)
+		shard->first->prev=entry;
+	else
+		shard->last=entry;
+	shard->first=entry;
+}
+
+/**
+ * @short Removes the entry from the shard, and its reference to the session dict. Shard must be locked.
+ * 
+ * Requests still using the session keep it until they free their reference.
+ */
+static void onion_sessions_entry_remove(onion_sessions_shard *shard, onion_sessions_entry *entry){
+	onion_sessions_lru_unlink(shard, entry);
+	onion_dict_remove(shard->entries, entry->id);
+	shard->count--;
+	onion_memory_count(ONION_MEMORY_SESSION, -(long)(sizeof(onion_sessions_entry)+strlen(entry->id)+1));
+	onion_dict_free(entry->data);
+	free(entry->id);
+	free(entry);
+}
+
+/// If the entry is past its idle or absolute time to live
+static inline int onion_sessions_expired(const onion_sessions *sessions, const onion_sessions_entry *entry, int64_t now){
+	return (sessions->idle_ttl && now-entry->last_access >= sessions->idle_ttl) || 
+	       (sessions->absolute_ttl && now-entry->created >= sessions->absolute_ttl);
+}
+
+/**
+ * @short Removes the expired sessions at the end of the shard LRU list, up to max. Shard must be locked.
+ * 
+ * The least recently used are the first to pass the idle time, and as creation is before the last 
+ * access, also the absolute one. Others past the absolute time are removed when used.
+ */
+static int onion_sessions_shard_expire(onion_sessions *sessions, onion_sessions_shard *shard, int64_t now, int max){
+	int n=0;
+	while (shard->last && n<max && onion_sessions_expired(sessions, shard->last, now)){
+		ONION_DEBUG0("Session '%s' expired", shard->last->id);
+		onion_sessions_entry_remove(shard, shard->last);
+		n++;
+	}
+	return n;
+}
 
 /**
  * @short Generates a unique id.
@@ -37,20 +131,14 @@
  * 
  * This unique id is also dificult to guess, so that blind guessing will not work.
  * 
- * Just now random 32 bytes string with alphanum chars. Not really safe as using simple C rand.
+ * It is a random 32 bytes string with alphanum chars, from the per thread generator of random.c, so 
+ * about 190 bits and no lock.
  * 
  * The memory is malloc'ed and will be freed somewhere.
  */
 char *onion_sessions_generate_id(){
-	char allowed_chars[]="abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
-	
 	char *ret=malloc(33);
-	onion_random_generate(ret,32);
-	int i;
-	for (i=0;i<32;i++){
-		ret[i]=allowed_chars[ ret[i]%(sizeof(allowed_chars)-1) ];
-	}
-	ret[i]='\0';
+	onion_random_alphabet(ret, 32, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789");
 	return ret;
 }
 
@@ -58,33 +146,210 @@ char *onion_sessions_generate_id(){
  * @short Creates a sessions data object, which keeps all sessions in memory.
  * @memberof onion_sessions_t
  * 
- * TODO: Make it also to allow persistent storage: for example if sqlite is available.
+ * The sessions are at ONION_SESSIONS_SHARDS independent shards by hash of the id, each with its own 
+ * lock, so requests of different sessions rarely wait for each other. By default they never expire;
+ * see onion_sessions_set_ttl and onion_sessions_set_max.
+ * 
+ * For shared or persistent storage, see onion_sessions_set_backend, and to keep them at the clients,
+ * onion_sessions_set_cookie_key.
  */
 onion_sessions *onion_sessions_new(){
 	onion_random_init();
 	
-	onion_sessions *ret=malloc(sizeof(onion_sessions));
-	ret->sessions=onion_dict_new();
+	onion_sessions *ret=calloc(1, sizeof(onion_sessions));
+	int i;
+	for (i=0;i<ONION_SESSIONS_SHARDS;i++){
+		onion_sessions_shard *shard=&ret->shards[i];
+#ifdef HAVE_PTHREADS
+		pthread_mutex_init(&shard->mutex, NULL);
+#endif
+		shard->entries=onion_dict_new();
+		onion_dict_set_flags(shard->entries, OD_HASH); // Found by id only, at every request
+	}
 	return ret;
 }
 
-/// Helper to remove all dicts inside session. Called with onion_dict_preorder
-static void onion_sessions_free_helper(void *data, const char *key, onion_dict *value, int flags){
-	onion_dict_free(value);
-}
-
 /**
  * @short Frees the memory used by sessions
  * @memberof onion_sessions_t
  */
 void onion_sessions_free(onion_sessions* sessions){
-	onion_dict_preorder(sessions->sessions, (void*)onion_sessions_free_helper, NULL);
-	onion_dict_free(sessions->sessions);
+	onion_sessions_set_backend(sessions, NULL);
+	int i;
+	for (i=0;i<ONION_SESSIONS_SHARDS;i++){
+		onion_sessions_shard *shard=&sessions->shards[i];
+		while (shard->first)
+			onion_sessions_entry_remove(shard, shard->first);
+		onion_dict_free(shard->entries);
+#ifdef HAVE_PTHREADS
+		pthread_mutex_destroy(&shard->mutex);
+#endif
+	}
 	free(sessions);
 
 	onion_random_free();
 }
 
+/**
+ * @short Stores the sessions at that backend, as a shared or persistent store, instead of in memory.
+ * @memberof onion_sessions_t
+ * 
+ * The sessions are then not kept here: each onion_sessions_get loads them from the backend and each 
+ * request that changed a session saves it at its end, with onion_sessions_save. The time to live and 
+ * maximum are then those of the backend, as the count and preorder are of the in memory ones.
+ * 
+ * It takes ownership of the backend, and frees the previous one. NULL is back to memory. Set it 
+ * before any session is used.
+ * 
+ * @see onion_sessions_backend_shm
+ */
+void onion_sessions_set_backend(onion_sessions *sessions, onion_sessions_backend *backend){
+	if (sessions->backend){
+		if (sessions->backend->free)
+			sessions->backend->free(sessions->backend->data);
+		free(sessions->backend);
+	}
+	sessions->backend=backend;
+}
+
+/**
+ * @short Stores the session data, as at the end of a request that changed it.
+ * @memberof onion_sessions_t
+ * 
+ * In memory the dict replaces the stored one, if the session still exists, as a whole, so those 
+ * reading the previous one keep it unchanged until they free it.
+ */
+void onion_sessions_save(onion_sessions *sessions, const char *sessionId, onion_dict *session){
+	if (sessions->cookie.enabled) // Already at the response cookie
+		return;
+	if (sessions->backend){
+		sessions->backend->put(sessions->backend->data, sessionId, session);
+		return;
+	}
+	onion_dict *old=NULL;
+	onion_sessions_shard *shard=onion_sessions_get_shard(sessions, sessionId);
+	onion_sessions_shard_lock(shard);
+	onion_sessions_entry *entry=(onion_sessions_entry*)onion_dict_get(shard->entries, sessionId);
+	if (entry && entry->data!=session){
+		old=entry->data;
+		entry->data=onion_dict_dup(session);
+	}
+	onion_sessions_shard_unlock(shard);
+	if (old)
+		onion_dict_free(old);
+	else if (!entry)
+		ONION_DEBUG("Session '%s' was removed while used, not saved", sessionId);
+}
+
+/**
+ * @short Marks the session as used now, for its idle time, without loading nor changing it.
+ * @memberof onion_sessions_t
+ */
+void onion_sessions_touch(onion_sessions *sessions, const char *sessionId){
+	if (sessions->cookie.enabled)
+		return;
+	if (sessions->backend){
+		if (sessions->backend->touch)
+			sessions->backend->touch(sessions->backend->data, sessionId);
+		return;
+	}
+	onion_sessions_shard *shard=onion_sessions_get_shard(sessions, sessionId);
+	onion_sessions_shard_lock(shard);
+	onion_sessions_entry *entry=(onion_sessions_entry*)onion_dict_get(shard->entries, sessionId);
+	if (entry){
+		entry->last_access=onion_sessions_now();
+		onion_sessions_lru_unlink(shard, entry);
+		onion_sessions_lru_push(shard, entry);
+	}
+	onion_sessions_shard_unlock(shard);
+}
+
+/**
+ * @short Sets the time to live of the sessions, in ms.
+ * @memberof onion_sessions_t
+ * 
+ * Sessions not used for idle_ttl ms, or created more than absolute_ttl ms ago, are removed. 0 is no limit.
+ * 
+ * Expired sessions are not returned by onion_sessions_get, and are removed incrementally, a few at each
+ * onion_sessions_create and at onion_sessions_expire, which the server calls from its poller timer.
+ */
+void onion_sessions_set_ttl(onion_sessions *sessions, int idle_ttl, int absolute_ttl){
+	sessions->idle_ttl=idle_ttl>0 ? idle_ttl : 0;
+	sessions->absolute_ttl=absolute_ttl>0 ? absolute_ttl : 0;
+}
+
+/**
+ * @short Sets the maximum number of sessions, to cap their memory. 0 is no limit.
+ * @memberof onion_sessions_t
+ * 
+ * When creating one more, the least recently used of its shard is evicted, so each shard keeps at 
+ * most its part of the maximum, and the eviction is LRU inside each shard.
+ */
+void onion_sessions_set_max(onion_sessions *sessions, int max_sessions){
+	sessions->max_sessions=max_sessions>0 ? max_sessions : 0;
+}
+
+/**
+ * @short Returns how many sessions are stored, including expired ones not removed yet.
+ * @memberof onion_sessions_t
+ */
+int onion_sessions_count(onion_sessions *sessions){
+	int i, n=0;
+	for (i=0;i<ONION_SESSIONS_SHARDS;i++){
+		onion_sessions_shard_lock(&sessions->shards[i]);
+		n+=sessions->shards[i].count;
+		onion_sessions_shard_unlock(&sessions->shards[i]);
+	}
+	return n;
+}
+
+/**
+ * @short Removes expired sessions, up to max per shard.
+ * @memberof onion_sessions_t
+ * 
+ * Only the least recently used of each shard are checked, so the cost is for the expired ones, 
+ * not a scan of all.
+ * 
+ * @returns Number of removed sessions.
+ */
+int onion_sessions_expire(onion_sessions *sessions, int max){
+	if (!sessions->idle_ttl && !sessions->absolute_ttl)
+		return 0;
+	int64_t now=onion_sessions_now();
+	int i, n=0;
+	for (i=0;i<ONION_SESSIONS_SHARDS;i++){
+		onion_sessions_shard *shard=&sessions->shards[i];
+		onion_sessions_shard_lock(shard);
+		n+=onion_sessions_shard_expire(sessions, shard, now, max);
+		onion_sessions_shard_unlock(shard);
+	}
+	return n;
+}
+
+/**
+ * @short Removes the least recently used sessions, expired or not, up to max per shard.
+ * @memberof onion_sessions_t
+ * 
+ * To free memory when it is short, as over the memory budget. Their users must log in again.
+ * Only for the in memory store.
+ * 
+ * @returns Number of removed sessions.
+ */
+int onion_sessions_evict(onion_sessions *sessions, int max){
+	int i, n=0;
+	for (i=0;i<ONION_SESSIONS_SHARDS;i++){
+		onion_sessions_shard *shard=&sessions->shards[i];
+		onion_sessions_shard_lock(shard);
+		int j;
+		for (j=0;j<max && shard->last;j++){
+			ONION_DEBUG("Session '%s' evicted, to free memory", shard->last->id);
+			onion_sessions_entry_remove(shard, shard->last);
+			n++;
+		}
+		onion_sessions_shard_unlock(shard);
+	}
+	return n;
+}
 
 /**
  * @short Creates a new session and returns the sessionId.
@@ -94,8 +359,36 @@ void onion_sessions_free(onion_sessions* sessions){
  */
 char *onion_sessions_create(onion_sessions *sessions){
 	char *sessionId=onion_sessions_generate_id();
-	onion_dict *data=onion_dict_new();
-	onion_dict_add(sessions->sessions, sessionId, data, OD_DUP_KEY|OD_DICT);
+	if (sessions->cookie.enabled) // Not stored, its data will be the cookie
+		return sessionId;
+	if (sessions->backend){
+		onion_dict *data=onion_dict_new();
+		sessions->backend->put(sessions->backend->data, sessionId, data);
+		onion_dict_free(data);
+		ONION_DEBUG("Created the session '%s' at the backend",sessionId);
+		return sessionId;
+	}
+	onion_sessions_entry *entry=malloc(sizeof(onion_sessions_entry));
+	entry->id=strdup(sessionId);
+	entry->data=onion_dict_new();
+	entry->created=entry->last_access=onion_sessions_now();
+	onion_memory_count(ONION_MEMORY_SESSION, sizeof(onion_sessions_entry)+strlen(entry->id)+1);
+	
+	onion_sessions_shard *shard=onion_sessions_get_shard(sessions, sessionId);
+	onion_sessions_shard_lock(shard);
+	if (sessions->idle_ttl || sessions->absolute_ttl)
+		onion_sessions_shard_expire(sessions, shard, entry->created, ONION_SESSIONS_CREATE_EXPIRE);
+	if (sessions->max_sessions){
+		int max=(sessions->max_sessions+ONION_SESSIONS_SHARDS-1)/ONION_SESSIONS_SHARDS;
+		while (shard->count>=max){
+			ONION_DEBUG("Session '%s' evicted, at the sessions limit", shard->last->id);
+			onion_sessions_entry_remove(shard, shard->last);
+		}
+	}
+	onion_dict_add(shard->entries, entry->id, entry, 0);
+	onion_sessions_lru_push(shard, entry);
+	shard->count++;
+	onion_sessions_shard_unlock(shard);
 	ONION_DEBUG("Created the session '%s'",sessionId);
 	return sessionId;
 }
@@ -115,16 +408,59 @@ char *onion_sessions_create(onion_sessions *sessions){
  * onion_sessions_create has to be used. It used to reuse the sessionId if it doe snot exist, but that 
  * looks like an insecure pattern.
  * 
- * @returns The session for that id, or NULL if none.
+ * It also marks the session as used now, for its idle time and the LRU eviction.
+ * 
+ * @returns The session for that id, or NULL if none or expired.
  */
 onion_dict *onion_sessions_get(onion_sessions *sessions, const char *sessionId){
 	ONION_DEBUG0("Accessing session '%s'",sessionId);
-	onion_dict *sess=onion_dict_get_dict(sessions->sessions, sessionId);
+	if (sessions->cookie.enabled)
+		return onion_sessions_cookie_decode(sessions, sessionId);
+	if (sessions->backend)
+		return sessions->backend->get(sessions->backend->data, sessionId);
+	onion_sessions_shard *shard=onion_sessions_get_shard(sessions, sessionId);
+	onion_dict *sess=NULL;
+	onion_sessions_shard_lock(shard);
+	onion_sessions_entry *entry=(onion_sessions_entry*)onion_dict_get(shard->entries, sessionId);
+	if (entry){
+		int64_t now=onion_sessions_now();
+		if (onion_sessions_expired(sessions, entry, now)){
+			ONION_DEBUG0("Session '%s' expired", sessionId);
+			onion_sessions_entry_remove(shard, entry);
+		}
+		else{
+			entry->last_access=now;
+			onion_sessions_lru_unlink(shard, entry);
+			onion_sessions_lru_push(shard, entry);
+			sess=onion_dict_dup(entry->data); // Not removed until dupped
+		}
+	}
+	onion_sessions_shard_unlock(shard);
 	if (!sess){
 		ONION_DEBUG0("Unknown session '%s'.", sessionId);
 		return NULL;
 	}
-	return onion_dict_dup(sess);
+	return sess;
+}
+
+/**
+ * @short Calls func(data, sessionId, session dict, OD_DICT) for each session, as onion_dict_preorder.
+ * @memberof onion_sessions_t
+ * 
+ * By shard, and inside from the most recently used. Each shard is locked while its sessions are 
+ * visited, so func must not use the sessions.
+ */
+void onion_sessions_preorder(onion_sessions *sessions, void *func, void *data){
+	void (*f)(void *data, const char *key, const void *value, int flags)=func;
+	int i;
+	for (i=0;i<ONION_SESSIONS_SHARDS;i++){
+		onion_sessions_shard *shard=&sessions->shards[i];
+		onion_sessions_shard_lock(shard);
+		onion_sessions_entry *entry;
+		for (entry=shard->first;entry;entry=entry->next)
+			f(data, entry->id, entry->data, OD_DICT);
+		onion_sessions_shard_unlock(shard);
+	}
 }
 
 /**
@@ -132,9 +468,16 @@ onion_dict *onion_sessions_get(onion_sessions *sessions, const char *sessionId){
  * @memberof onion_sessions_t
  */
 void onion_sessions_remove(onion_sessions *sessions, const char *sessionId){
-	onion_dict *data=onion_dict_get_dict(sessions->sessions, sessionId);
-	if (data){
-		onion_dict_free(data);
-		onion_dict_remove(sessions->sessions, sessionId);
+	if (sessions->cookie.enabled)
+		return;
+	if (sessions->backend){
+		sessions->backend->remove(sessions->backend->data, sessionId);
+		return;
 	}
+	onion_sessions_shard *shard=onion_sessions_get_shard(sessions, sessionId);
+	onion_sessions_shard_lock(shard);
+	onion_sessions_entry *entry=(onion_sessions_entry*)onion_dict_get(shard->entries, sessionId);
+	if (entry)
+		onion_sessions_entry_remove(shard, entry);
+	onion_sessions_shard_unlock(shard);
 }
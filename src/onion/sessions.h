@@ -32,6 +32,26 @@
 extern "C"{
 #endif
 
+/**
+ * @short Storage of the sessions, instead of the default in memory one.
+ * 
+ * All are called with the data, and may be called from several threads at once. get returns a new dict
+ * (refcount 1) with the session data, or NULL if unknown or expired; it is the only one that must wait 
+ * for the storage. put stores the session, at creation and when each request that changed it ends; remove 
+ * and touch forget it or mark it as used. These may return before the storage is done, as queueing 
+ * or pipelining the writes to a remote store, so other processes may see them a bit later.
+ * 
+ * touch may be NULL. free is called with data when the sessions are freed.
+ */
+struct onion_sessions_backend_t{
+	onion_dict *(*get)(void *data, const char *sessionId);
+	int (*put)(void *data, const char *sessionId, onion_dict *session);
+	void (*remove)(void *data, const char *sessionId);
+	void (*touch)(void *data, const char *sessionId);
+	void (*free)(void *data);
+	void *data;
+};
+
 /// Initializes the sessions object
 onion_sessions *onion_sessions_new();
 
@@ -47,6 +67,45 @@ onion_dict *onion_sessions_get(onion_sessions *sessions, const char *sessionId);
 /// Removes a session from the storage.
 void onion_sessions_remove(onion_sessions *sessions, const char *sessionId);
 
+/// Sets the idle and absolute time to live of the sessions, in ms. 0 is no limit.
+void onion_sessions_set_ttl(onion_sessions *sessions, int idle_ttl, int absolute_ttl);
+
+/// Sets the maximum number of sessions, evicting the least recently used. 0 is no limit.
+void onion_sessions_set_max(onion_sessions *sessions, int max_sessions);
+
+/// Calls func(data, sessionId, session dict, flags) for each session.
+void onion_sessions_preorder(onion_sessions *sessions, void *func, void *data);
+
+/// Returns the number of stored sessions.
+int onion_sessions_count(onion_sessions *sessions);
+
+/// Removes expired sessions, up to max per shard. Returns how many.
+int onion_sessions_expire(onion_sessions *sessions, int max);
+
+/// Removes the least recently used sessions, expired or not, up to max per shard. Returns how many.
+int onion_sessions_evict(onion_sessions *sessions, int max);
+
+/// Stores the sessions at that backend, instead of in memory. Takes ownership of it.
+void onion_sessions_set_backend(onion_sessions *sessions, onion_sessions_backend *backend);
+
+/// Stores the session data, after a request changed it, replacing the stored one.
+void onion_sessions_save(onion_sessions *sessions, const char *sessionId, onion_dict *session);
+
+/// Marks the session as used now, without changing it.
+void onion_sessions_touch(onion_sessions *sessions, const char *sessionId);
+
+/// Keeps the sessions at signed, and maybe encrypted, cookies at the client. At sessions_cookie.c
+int onion_sessions_set_cookie_key(onion_sessions *sessions, const char *key, int length, int encrypt);
+
+/// Encodes the session as a cookie value. Must be freed.
+char *onion_sessions_cookie_encode(onion_sessions *sessions, onion_dict *session);
+
+/// Decodes a session cookie value, or NULL if not valid.
+onion_dict *onion_sessions_cookie_decode(onion_sessions *sessions, const char *cookie);
+
+/// Backend at shared memory, anonymous for forked workers or at path for any process of the host. At sessions_shm.c
+onion_sessions_backend *onion_sessions_backend_shm(const char *path, int max_sessions, int slot_size, int idle_ttl);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,258 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#ifdef HAVE_GNUTLS
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#endif
+
+#include "sessions.h"
+#include "types_internal.h"
+#include "dict.h"
+#include "block.h"
+#include "codecs.h"
+#include "log.h"
+#include "random.h"
+#include "hash.h"
+
+/**
+ * @short Sessions kept at the clients, as the cookie itself, instead of at the server.
+ * 
+ * The cookie is "payload.issued.signature": the payload is the session as json, or encrypted with 
+ * AES-256-GCM, in base64; issued is the creation time, in seconds since the epoch and in hex, to 
+ * check the absolute time to live; and the signature is the HMAC-SHA256 of both. The keys for the
+ * signature and the encryption are derived from the given one.
+ * 
+ * Nothing is stored at the server, so any server with the key can read the sessions. But a copy of 
+ * a cookie is valid until its absolute time to live, as the server can not forget it.
+ */
+
+/// Cookies are kept by browsers up to 4096 bytes, with the name and attributes.
+#define ONION_SESSIONS_COOKIE_MAX 4000
+/// Of the AES-GCM nonce
+#define ONION_SESSIONS_COOKIE_NONCE 12
+/// Of the AES-GCM tag
+#define ONION_SESSIONS_COOKIE_TAG 16
+
+static char *onion_sessions_cookie_base64(const char *data, int length);
+#ifdef HAVE_GNUTLS
+static int onion_sessions_cookie_cipher(onion_sessions *sessions, int encrypt, const char *nonce, const char *issued, 
+                                        const char *in, size_t in_length, char *out, size_t *out_length);
+#endif
+
+/// Base64 in one line, as the cookie value.
+static char *onion_sessions_cookie_base64(const char *data, int length){
+	char *ret=onion_base64_encode(data, length);
+	char *r=ret, *w=ret;
+	for (;*r;r++)
+		if (*r!='\n')
+			*w++=*r;
+	*w='\0';
+	return ret;
+}
+
+#ifdef HAVE_GNUTLS
+/// Encrypts or decrypts with the key of the sessions, authenticating also the issued time. Returns 0 if ok.
+static int onion_sessions_cookie_cipher(onion_sessions *sessions, int encrypt, const char *nonce, const char *issued, 
+                                        const char *in, size_t in_length, char *out, size_t *out_length){
+	gnutls_datum_t key={ sessions->cookie.encrypt_key, sizeof(sessions->cookie.encrypt_key) };
+	gnutls_aead_cipher_hd_t cipher;
+	if (gnutls_aead_cipher_init(&cipher, GNUTLS_CIPHER_AES_256_GCM, &key)<0)
+		return -1;
+	int r;
+	if (encrypt)
+		r=gnutls_aead_cipher_encrypt(cipher, nonce, ONION_SESSIONS_COOKIE_NONCE, issued, strlen(issued), 
+		                             ONION_SESSIONS_COOKIE_TAG, in, in_length, out, out_length);
+	else
+		r=gnutls_aead_cipher_decrypt(cipher, nonce, ONION_SESSIONS_COOKIE_NONCE, issued, strlen(issued), 
+		                             ONION_SESSIONS_COOKIE_TAG, in, in_length, out, out_length);
+	gnutls_aead_cipher_deinit(cipher);
+	return r<0 ? -1 : 0;
+}
+#endif
+
+/**
+ * @short Keeps the sessions at a signed cookie at the client, instead of at the server.
+ * @memberof onion_sessions_t
+ * 
+ * The session is decoded from the sessionid cookie at onion_request_get_session_dict, and written 
+ * back at the headers of the response only when it changed, so changes after the headers are sent 
+ * are lost. With encrypt the client can not read it either. Sessions must be small, as the cookie is 
+ * at most ONION_SESSIONS_COOKIE_MAX bytes.
+ * 
+ * All the servers that share the sessions must use the same key, that should be at least 32 random 
+ * bytes. Signing is built in; encrypting needs gnutls.
+ * 
+ * @returns 0 if set, or -1 if asked to encrypt without gnutls.
+ */
+int onion_sessions_set_cookie_key(onion_sessions *sessions, const char *key, int length, int encrypt){
+#ifndef HAVE_GNUTLS
+	if (encrypt){
+		ONION_ERROR("Encrypted cookie sessions need gnutls, which is not compiled in");
+		return -1;
+	}
+#endif
+	if (length<16)
+		ONION_WARNING("The sessions cookie key has only %d bytes, it should have at least 32", length);
+	onion_hmac_sha256(key, length, "onion session signature", 23, (char*)sessions->cookie.mac_key);
+	onion_hmac_sha256(key, length, "onion session encryption", 24, (char*)sessions->cookie.encrypt_key);
+	sessions->cookie.encrypt=encrypt ? 1 : 0;
+	sessions->cookie.enabled=1;
+	return 0;
+}
+
+/// Writer of onion_dict_json_stream to a block.
+static ssize_t onion_sessions_cookie_json_write(void *block, const char *str, size_t length){
+	onion_block_add_data(block, str, length);
+	return length;
+}
+
+/**
+ * @short Encodes the session as the value of its cookie.
+ * @memberof onion_sessions_t
+ * 
+ * The session goes as json, as onion_dict_from_json decodes it, with onion_dict_json_stream; not with 
+ * onion_dict_to_json, whose C quoting onion_dict_from_json does not read back.
+ * 
+ * @returns The cookie value, to be freed, or NULL if too big or not possible.
+ */
+char *onion_sessions_cookie_encode(onion_sessions *sessions, onion_dict *session){
+	onion_block *json=onion_block_new();
+	if (onion_dict_json_stream(session, onion_sessions_cookie_json_write, json)<0){
+		onion_block_free(json);
+		return NULL;
+	}
+	char issued[24];
+	snprintf(issued, sizeof(issued), "%llx", (unsigned long long)time(NULL));
+	char *payload;
+#ifdef HAVE_GNUTLS
+	if (sessions->cookie.encrypt){
+		size_t length=onion_block_size(json)+ONION_SESSIONS_COOKIE_TAG;
+		char *data=malloc(ONION_SESSIONS_COOKIE_NONCE+length);
+		onion_random_generate(data, ONION_SESSIONS_COOKIE_NONCE);
+		if (onion_sessions_cookie_cipher(sessions, 1, data, issued, onion_block_data(json), onion_block_size(json), 
+		                                 data+ONION_SESSIONS_COOKIE_NONCE, &length)<0){
+			ONION_ERROR("Could not encrypt the session cookie");
+			free(data);
+			onion_block_free(json);
+			return NULL;
+		}
+		payload=onion_sessions_cookie_base64(data, ONION_SESSIONS_COOKIE_NONCE+length);
+		free(data);
+	}
+	else
+#endif
+		payload=onion_sessions_cookie_base64(onion_block_data(json), onion_block_size(json));
+	onion_block_free(json);
+
+	onion_block *cookie=onion_block_new();
+	onion_block_add_str(cookie, payload);
+	onion_block_add_char(cookie, '.');
+	onion_block_add_str(cookie, issued);
+	free(payload);
+	char mac[32];
+	onion_hmac_sha256((const char*)sessions->cookie.mac_key, sizeof(sessions->cookie.mac_key), 
+	                  onion_block_data(cookie), onion_block_size(cookie), mac);
+	char *signature=onion_sessions_cookie_base64(mac, sizeof(mac));
+	onion_block_add_char(cookie, '.');
+	onion_block_add_str(cookie, signature);
+	free(signature);
+
+	char *ret=NULL;
+	if (onion_block_size(cookie)>ONION_SESSIONS_COOKIE_MAX)
+		ONION_ERROR("Session too big for a cookie, %d bytes. Not saved.", onion_block_size(cookie));
+	else
+		ret=strdup(onion_block_data(cookie));
+	onion_block_free(cookie);
+	return ret;
+}
+
+/**
+ * @short Decodes the session from the value of its cookie.
+ * @memberof onion_sessions_t
+ * 
+ * @returns A new dict with the session, or NULL if the signature is not valid, or it expired.
+ */
+onion_dict *onion_sessions_cookie_decode(onion_sessions *sessions, const char *cookie){
+	const char *sig=strrchr(cookie, '.');
+	if (!sig || sig==cookie)
+		return NULL;
+	const char *issued=sig-1;
+	while (issued>cookie && *issued!='.')
+		issued--;
+	if (issued==cookie || sig-issued<2 || sig-issued>17)
+		return NULL;
+	char mac[32];
+	onion_hmac_sha256((const char*)sessions->cookie.mac_key, sizeof(sessions->cookie.mac_key), 
+	                  cookie, sig-cookie, mac);
+	char given[sizeof(mac)+3];
+	size_t sig_length=strlen(sig+1);
+	size_t length=0;
+	if (sig_length<=sizeof(given)*4/3)
+		length=onion_base64_decode_to(sig+1, sig_length, given);
+	int diff=(length!=sizeof(mac));
+	int i;
+	for (i=0;i<sizeof(mac) && i<length;i++) // Same time for all the wrong ones
+		diff|=mac[i]^given[i];
+	if (diff){
+		ONION_DEBUG("Session cookie with a wrong signature");
+		return NULL;
+	}
+
+	char issued_str[24];
+	memcpy(issued_str, issued+1, sig-issued-1);
+	issued_str[sig-issued-1]='\0';
+	long long age=(long long)time(NULL) - strtoll(issued_str, NULL, 16);
+	if (sessions->absolute_ttl && age*1000 >= sessions->absolute_ttl){
+		ONION_DEBUG("Session cookie expired");
+		return NULL;
+	}
+
+	char *data=malloc((issued-cookie)*3/4+1);
+	length=onion_base64_decode_to(cookie, issued-cookie, data);
+	data[length]='\0';
+	onion_dict *ret=NULL;
+#ifdef HAVE_GNUTLS
+	if (sessions->cookie.encrypt){
+		size_t json_length=length;
+		char *json=malloc(length+1);
+		if (length>ONION_SESSIONS_COOKIE_NONCE+ONION_SESSIONS_COOKIE_TAG &&
+		    onion_sessions_cookie_cipher(sessions, 0, data, issued_str, data+ONION_SESSIONS_COOKIE_NONCE, 
+		                                 length-ONION_SESSIONS_COOKIE_NONCE, json, &json_length)==0){
+			json[json_length]='\0';
+			ret=onion_dict_from_json(json);
+		}
+		free(json);
+	}
+	else
+#endif
+		ret=onion_dict_from_json(data);
+	free(data);
+	return ret;
+}
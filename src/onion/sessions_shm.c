@@ -0,0 +1,332 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "sessions.h"
+#include "dict.h"
+#include "log.h"
+
+/**
+ * @short Session storage at a shared memory mapping, for several processes of the same host.
+ * 
+ * The sessions are stored as json at fixed size slots. A session id hashes to a bucket of 
+ * ONION_SESSIONS_SHM_WAYS slots, with its own process shared lock, so there is no probing outside it, 
+ * and when all its slots are used the least recently used is replaced. So the memory is fixed at 
+ * creation, and expired or evicted sessions do not need any sweep.
+ */
+
+/// Slots per bucket
+#define ONION_SESSIONS_SHM_WAYS 8
+/// Marks an initialized mapping
+#define ONION_SESSIONS_SHM_MAGIC 0x6f6e7331
+
+/// A stored session. The json follows, up to the slot size.
+typedef struct{
+	char id[40];
+	int64_t last_access; ///< Monotonic ms, 0 if free.
+	uint32_t length;     ///< Of the json, without the ending \0
+}onion_sessions_shm_slot;
+
+typedef struct{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+	int64_t pad; ///< So the slots after are aligned
+}onion_sessions_shm_bucket;
+
+/// At the start of the mapping
+typedef struct{
+	volatile uint32_t magic;
+	int nbuckets;
+	int slot_size;
+	int idle_ttl;
+}onion_sessions_shm_header;
+
+typedef struct{
+	onion_sessions_shm_header *header;
+	size_t size;
+	size_t bucket_size;
+}onion_sessions_shm;
+
+/// Monotonic time, in ms. It is the same for all the processes of the host.
+static int64_t onion_sessions_shm_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+static onion_sessions_shm_bucket *onion_sessions_shm_get_bucket(onion_sessions_shm *shm, const char *id){
+	unsigned int h=2166136261u;
+	while (*id)
+		h=(h^(unsigned char)*id++)*16777619u;
+	return (onion_sessions_shm_bucket*)((char*)(shm->header+1) + (h%shm->header->nbuckets)*shm->bucket_size);
+}
+
+static inline onion_sessions_shm_slot *onion_sessions_shm_get_slot(onion_sessions_shm *shm, onion_sessions_shm_bucket *bucket, int i){
+	return (onion_sessions_shm_slot*)((char*)(bucket+1) + i*shm->header->slot_size);
+}
+
+/// Locks the bucket. If a process died with it locked, it is recovered; its slots are consistent anyway but for that session.
+static void onion_sessions_shm_lock(onion_sessions_shm_bucket *bucket){
+#ifdef HAVE_PTHREADS
+	if (pthread_mutex_lock(&bucket->mutex)==EOWNERDEAD)
+		pthread_mutex_consistent(&bucket->mutex);
+#endif
+}
+
+static void onion_sessions_shm_unlock(onion_sessions_shm_bucket *bucket){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&bucket->mutex);
+#endif
+}
+
+/// The slot of that session, if there and not expired. Bucket must be locked.
+static onion_sessions_shm_slot *onion_sessions_shm_find(onion_sessions_shm *shm, onion_sessions_shm_bucket *bucket, const char *id, int64_t now){
+	int i;
+	for (i=0;i<ONION_SESSIONS_SHM_WAYS;i++){
+		onion_sessions_shm_slot *slot=onion_sessions_shm_get_slot(shm, bucket, i);
+		if (slot->last_access && strcmp(slot->id, id)==0){
+			if (shm->header->idle_ttl && now-slot->last_access >= shm->header->idle_ttl){
+				slot->last_access=0;
+				return NULL;
+			}
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+static onion_dict *onion_sessions_shm_get(void *data, const char *id){
+	onion_sessions_shm *shm=data;
+	onion_sessions_shm_bucket *bucket=onion_sessions_shm_get_bucket(shm, id);
+	onion_dict *ret=NULL;
+	int64_t now=onion_sessions_shm_now();
+	onion_sessions_shm_lock(bucket);
+	onion_sessions_shm_slot *slot=onion_sessions_shm_find(shm, bucket, id, now);
+	if (slot){
+		slot->last_access=now;
+		ret=onion_dict_from_json((const char*)(slot+1));
+	}
+	onion_sessions_shm_unlock(bucket);
+	return ret;
+}
+
+/// Writes the json at the slot
+typedef struct{
+	char *p;
+	size_t left;
+}onion_sessions_shm_writer;
+
+static ssize_t onion_sessions_shm_write(void *_w, const char *data, size_t length){
+	onion_sessions_shm_writer *w=_w;
+	if (length>w->left)
+		return -1;
+	memcpy(w->p, data, length);
+	w->p+=length;
+	w->left-=length;
+	return length;
+}
+
+static int onion_sessions_shm_put(void *data, const char *id, onion_dict *session){
+	onion_sessions_shm *shm=data;
+	size_t length=onion_dict_json_length(session);
+	size_t room=shm->header->slot_size-sizeof(onion_sessions_shm_slot)-1;
+	if (length>room || strlen(id)>=sizeof(((onion_sessions_shm_slot*)0)->id)){
+		ONION_ERROR("Session %s too big for the shared memory slots, %d bytes, and there is room for %d", id, (int)length, (int)room);
+		return -1;
+	}
+	onion_sessions_shm_bucket *bucket=onion_sessions_shm_get_bucket(shm, id);
+	int64_t now=onion_sessions_shm_now();
+	onion_sessions_shm_lock(bucket);
+	onion_sessions_shm_slot *slot=onion_sessions_shm_find(shm, bucket, id, now);
+	if (!slot){ // A free one, or the least recently used
+		int i;
+		slot=onion_sessions_shm_get_slot(shm, bucket, 0);
+		for (i=1;i<ONION_SESSIONS_SHM_WAYS && slot->last_access;i++){
+			onion_sessions_shm_slot *s=onion_sessions_shm_get_slot(shm, bucket, i);
+			if (s->last_access<slot->last_access)
+				slot=s;
+		}
+		if (slot->last_access)
+			ONION_DEBUG("Session '%s' evicted from the shared memory store", slot->id);
+		strcpy(slot->id, id);
+	}
+	onion_sessions_shm_writer w={ (char*)(slot+1), room };
+	onion_dict_json_stream(session, onion_sessions_shm_write, &w);
+	*w.p=0;
+	slot->length=length;
+	slot->last_access=now;
+	onion_sessions_shm_unlock(bucket);
+	return 0;
+}
+
+static void onion_sessions_shm_remove(void *data, const char *id){
+	onion_sessions_shm *shm=data;
+	onion_sessions_shm_bucket *bucket=onion_sessions_shm_get_bucket(shm, id);
+	onion_sessions_shm_lock(bucket);
+	onion_sessions_shm_slot *slot=onion_sessions_shm_find(shm, bucket, id, onion_sessions_shm_now());
+	if (slot)
+		slot->last_access=0;
+	onion_sessions_shm_unlock(bucket);
+}
+
+static void onion_sessions_shm_touch(void *data, const char *id){
+	onion_sessions_shm *shm=data;
+	onion_sessions_shm_bucket *bucket=onion_sessions_shm_get_bucket(shm, id);
+	int64_t now=onion_sessions_shm_now();
+	onion_sessions_shm_lock(bucket);
+	onion_sessions_shm_slot *slot=onion_sessions_shm_find(shm, bucket, id, now);
+	if (slot)
+		slot->last_access=now;
+	onion_sessions_shm_unlock(bucket);
+}
+
+/// Unmaps it. The named store stays at its file, for the next processes.
+static void onion_sessions_shm_free(void *data){
+	onion_sessions_shm *shm=data;
+	munmap(shm->header, shm->size);
+	free(shm);
+}
+
+/// Sets up a new mapping: the header and the process shared locks. The magic is set the last.
+static void onion_sessions_shm_init(onion_sessions_shm *shm, int nbuckets, int slot_size, int idle_ttl){
+	onion_sessions_shm_header *header=shm->header;
+	header->nbuckets=nbuckets;
+	header->slot_size=slot_size;
+	header->idle_ttl=idle_ttl;
+#ifdef HAVE_PTHREADS
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	int i;
+	for (i=0;i<nbuckets;i++){
+		onion_sessions_shm_bucket *bucket=(onion_sessions_shm_bucket*)((char*)(header+1) + i*shm->bucket_size);
+		pthread_mutex_init(&bucket->mutex, &attr);
+	}
+	pthread_mutexattr_destroy(&attr);
+#endif
+	__sync_synchronize();
+	header->magic=ONION_SESSIONS_SHM_MAGIC;
+}
+
+/**
+ * @short Creates a session backend at shared memory, for several processes at the same host.
+ * @memberof onion_sessions_t
+ * 
+ * Without path the memory is anonymous, and shared with the processes forked after, as prefork 
+ * workers. With a path, normally at /dev/shm, the store is at that file: other processes that open 
+ * the same path share it, and it survives restarts. If it already exists its sizes are used.
+ * 
+ * Each session is stored as json, and must fit at slot_size bytes, minus a small header. When all 
+ * the slots of its bucket are used, storing a new one replaces the least recently used.
+ * 
+ * @param path File to map, or NULL for anonymous memory.
+ * @param max_sessions Number of slots, rounded up to a multiple of ONION_SESSIONS_SHM_WAYS.
+ * @param slot_size Bytes per session.
+ * @param idle_ttl Sessions not used for this ms are not valid anymore. 0 for never.
+ * 
+ * @returns The backend for onion_sessions_set_backend, or NULL on error.
+ */
+onion_sessions_backend *onion_sessions_backend_shm(const char *path, int max_sessions, int slot_size, int idle_ttl){
+	int nbuckets=(max_sessions+ONION_SESSIONS_SHM_WAYS-1)/ONION_SESSIONS_SHM_WAYS;
+	slot_size=(slot_size+7)&~7;
+	if (nbuckets<1 || slot_size<=(int)sizeof(onion_sessions_shm_slot)){
+		ONION_ERROR("Invalid shared memory sessions size, %d sessions of %d bytes", max_sessions, slot_size);
+		return NULL;
+	}
+	onion_sessions_shm *shm=calloc(1, sizeof(onion_sessions_shm));
+	shm->bucket_size=sizeof(onion_sessions_shm_bucket)+ONION_SESSIONS_SHM_WAYS*slot_size;
+	shm->size=sizeof(onion_sessions_shm_header)+nbuckets*shm->bucket_size;
+	
+	if (!path){
+		shm->header=mmap(NULL, shm->size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (shm->header==MAP_FAILED)
+			goto error;
+		onion_sessions_shm_init(shm, nbuckets, slot_size, idle_ttl);
+	}
+	else{
+		int created=1;
+		int fd=open(path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+		if (fd<0 && errno==EEXIST){
+			created=0;
+			fd=open(path, O_RDWR|O_CLOEXEC);
+		}
+		if (fd<0)
+			goto error;
+		if (created && ftruncate(fd, shm->size)<0){
+			close(fd);
+			goto error;
+		}
+		if (!created){ // The sizes of the existing one
+			onion_sessions_shm_header header;
+			int i;
+			for (i=0;i<100;i++){ // It may be being created now
+				if (pread(fd, &header, sizeof(header), 0)==sizeof(header) && header.magic==ONION_SESSIONS_SHM_MAGIC)
+					break;
+				usleep(10000);
+			}
+			if (i==100){
+				ONION_ERROR("Shared memory sessions at %s are not valid", path);
+				close(fd);
+				errno=EINVAL;
+				goto error;
+			}
+			shm->bucket_size=sizeof(onion_sessions_shm_bucket)+ONION_SESSIONS_SHM_WAYS*header.slot_size;
+			shm->size=sizeof(onion_sessions_shm_header)+header.nbuckets*shm->bucket_size;
+		}
+		shm->header=mmap(NULL, shm->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (shm->header==MAP_FAILED)
+			goto error;
+		if (created)
+			onion_sessions_shm_init(shm, nbuckets, slot_size, idle_ttl);
+	}
+	
+	onion_sessions_backend *backend=calloc(1, sizeof(onion_sessions_backend));
+	backend->get=onion_sessions_shm_get;
+	backend->put=onion_sessions_shm_put;
+	backend->remove=onion_sessions_shm_remove;
+	backend->touch=onion_sessions_shm_touch;
+	backend->free=onion_sessions_shm_free;
+	backend->data=shm;
+	return backend;
+error:
+	ONION_ERROR("Could not create the shared memory sessions%s%s: %s", path ? " at " : "", path ? path : "", strerror(errno));
+	free(shm);
+	return NULL;
+}
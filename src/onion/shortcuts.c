@@ -25,6 +25,9 @@
 #ifdef __linux__
 #define USE_SENDFILE
 #endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* O_TMPFILE */
+#endif
 
 #include <string.h>
 #include <stdarg.h>
@@ -35,9 +38,6 @@
 #include <stdio.h>
 #include <time.h>
 #include <errno.h>
-#ifdef USE_SENDFILE
-#include <sys/sendfile.h>
-#endif
 
 #include "onion.h"
 #include "log.h"
@@ -46,6 +46,10 @@
 #include "block.h"
 #include "mime.h"
 #include "types_internal.h"
+#include "file_cache.h"
+
+/// Max ranges at a Range header. With more, it is ignored and all the file is sent.
+#define ONION_SHORTCUT_MAX_RANGES 16
 
 #ifndef O_CLOEXEC
 #define O_CLOEXEC 0
@@ -53,8 +57,213 @@
 
 int onion_use_sendfile=-1;
 
-// Import it here as I need it to know if can use sendfile.
-ssize_t onion_http_write(onion_request *req, const char *data, size_t len);
+float onion_compress_accepts(const char *accept, const char *encoding); // At compress.c
+static onion_connection_status onion_shortcut_response_variants(const onion_shortcut_embedded *variants, const char *content_type, 
+											const char *etag, const char *cache_control, int fd, const char *base, onion_request *req, onion_response *res);
+
+/**
+ * @short Queues the rest of the file to be sent when the client socket is writable again
+ * 
+ * On O_NONBLOCKING mode, when the client does not accept more data, the thread would block; instead the
+ * file is sent as the socket becomes writable. Big files are queued from the start on any poller mode, 
+ * so they are sent in slices and the thread serves other connections between them. The first slice 
+ * is sent now. The request gets its own copy of the file descriptor.
+ */
+static onion_connection_status onion_shortcut_queue_file(onion_request *req, onion_response *res, int fd, off_t pos, size_t left){
+	onion_response_write(res,NULL,0);
+	ONION_DEBUG0("Queue %d bytes from file at %d", (int)left, (int)pos);
+	fd=dup(fd); // The caller keeps its own, it may be cached
+	if (fd<0){
+		ONION_ERROR("Could not dup file to queue it (%s)", strerror(errno));
+		return OCS_INTERNAL_ERROR;
+	}
+	if (onion_request_output_queue_file(req, fd, pos, left)<0)
+		return OCS_INTERNAL_ERROR;
+	res->sent_bytes+=left;
+	res->sent_bytes_total+=left;
+	if (onion_request_output_flush(req)<0)
+		return OCS_CLOSE_CONNECTION;
+	return OCS_PROCESSED;
+}
+
+/// Whether the file is sent in slices from the poller, instead of all now.
+static int onion_shortcut_file_in_slices(onion_request *req, size_t length){
+	return length>ONION_REQUEST_OUTPUT_FILE_SLICE && onion_request_output_can_queue_file(req);
+}
+
+/**
+ * @short Sends length bytes of the file from pos, after what is already written to the response.
+ * 
+ * It uses sendfile at that offset if suitable, or reads and writes through the response, at big aligned
+ * blocks, that go to the listen point without copies to the response buffer. If it is the last data of the
+ * response, the file may be queued to be sent from the poller. If the data is in memory, it is written from there.
+ * 
+ * @returns 0 if all sent or queued, or <0 on error.
+ */
+static int onion_shortcut_send_file(onion_request *request, onion_response *res, int fd, const char *data, off_t pos, size_t length, int last){
+	if (!length)
+		return 0;
+	if (data) // In memory at the file cache. Big writes go at once with the buffered headers.
+		return onion_response_write(res, data+pos, length)==length ? 0 : -1;
+#ifdef USE_SENDFILE
+	if (onion_use_sendfile && request->connection.listen_point->sendfile && !res->compress && !res->capture){ // Lets have a house party! I can use sendfile!
+		request->output.bulk=1; // The file follows, so the headers may wait to go in the same packets.
+		onion_response_write(res,NULL,0);
+		request->output.bulk=0;
+		if (last && (onion_request_output_pending(request) || onion_shortcut_file_in_slices(request, length)))
+			return onion_shortcut_queue_file(request, res, fd, pos, length)<0 ? -1 : 0;
+		ONION_DEBUG("Using sendfile");
+		while (length && !onion_request_output_pending(request)){
+			ssize_t r=request->connection.listen_point->sendfile(request, fd, &pos, length);
+			if (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK)){
+				if (last)
+					return onion_shortcut_queue_file(request, res, fd, pos, length)<0 ? -1 : 0;
+				break; // The rest through the response, which queues it
+			}
+			if (r<0 && errno==ENOSYS) // Not on this connection, as HTTPS without kernel TLS
+				break;
+			if (r<=0){
+				ONION_ERROR("Could not send all file (%s)", strerror(errno));
+				return -1;
+			}
+			length-=r;
+			res->sent_bytes+=r;
+			res->sent_bytes_total+=r;
+		}
+	}
+#endif
+	if (last && !res->compress && !res->capture && (onion_request_output_pending(request) || onion_shortcut_file_in_slices(request, length))) // Compressed must go through the response
+		return onion_shortcut_queue_file(request, res, fd, pos, length)<0 ? -1 : 0;
+	char *block=malloc(length<ONION_REQUEST_OUTPUT_FILE_BLOCK ? length : ONION_REQUEST_OUTPUT_FILE_BLOCK);
+	if (!block){
+		ONION_ERROR("Could not allocate the file block");
+		return -1;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, pos, length, POSIX_FADV_SEQUENTIAL);
+#endif
+	int ret=0;
+	while (length){
+		size_t l=ONION_REQUEST_OUTPUT_FILE_BLOCK-(pos%ONION_REQUEST_OUTPUT_FILE_BLOCK);
+		if (l>length)
+			l=length;
+		ssize_t r=pread(fd, block, l, pos);
+		if (r<=0){
+			ONION_ERROR("Could not read file to send (%s)", r<0 ? strerror(errno) : "file is shorter");
+			ret=-1;
+			break;
+		}
+		request->output.bulk=(r<length); // More of the file follows, so no partial packet is pushed now
+		ssize_t w=onion_response_write(res, block, r);
+		request->output.bulk=0;
+		if (w!=r){
+			ONION_ERROR("Wrote less than read: write %d, read %d. Quite probably closed connection.",(int)w,(int)r);
+			ret=-1;
+			break;
+		}
+		pos+=r;
+		length-=r;
+	}
+	free(block);
+	return ret;
+}
+
+/// A byte range of a file
+typedef struct{
+	off_t start;
+	size_t length;
+}onion_shortcut_range;
+
+/**
+ * @short Parses a bytes Range header (RFC 7233) for a file of the given size.
+ * 
+ * Ranges can be "a-b", open "a-" or suffix "-n", several separated by commas. The ones that start after
+ * the end of file are skipped, and the ones that end after it, cut.
+ * 
+ * @returns The number of satisfiable ranges, 0 if none is, so it is a 416, or -1 if the header is not valid 
+ *   or has more than ONION_SHORTCUT_MAX_RANGES ranges, and it is ignored.
+ */
+static int onion_shortcut_parse_ranges(const char *range, size_t size, onion_shortcut_range *ranges){
+	if (strncmp(range, "bytes=", 6)!=0)
+		return -1;
+	const char *p=range+6;
+	int n=0, nspecs=0;
+	while (*p){
+		while (*p==' ' || *p=='\t')
+			p++;
+		if (*p==','){
+			p++;
+			continue;
+		}
+		if (!*p)
+			break;
+		char *end;
+		int has_first=(*p>='0' && *p<='9'), has_last;
+		unsigned long long first=0, last=0;
+		if (has_first){
+			first=strtoull(p, &end, 10);
+			p=end;
+		}
+		if (*p!='-')
+			return -1;
+		p++;
+		has_last=(*p>='0' && *p<='9');
+		if (has_last){
+			last=strtoull(p, &end, 10);
+			p=end;
+		}
+		while (*p==' ' || *p=='\t')
+			p++;
+		if ((*p && *p!=',') || (!has_first && !has_last) || (has_first && has_last && last<first))
+			return -1;
+		nspecs++;
+		
+		if (!has_first){ // Suffix, the last bytes
+			if (last==0 || size==0)
+				continue;
+			if (last>size)
+				last=size;
+			first=size-last;
+			last=size-1;
+		}
+		else{
+			if (first>=size)
+				continue;
+			if (!has_last || last>=size)
+				last=size-1;
+		}
+		if (n==ONION_SHORTCUT_MAX_RANGES)
+			return -1;
+		ranges[n].start=first;
+		ranges[n].length=last-first+1;
+		n++;
+	}
+	if (!nspecs)
+		return -1;
+	return n;
+}
+
+/**
+ * @short Whether the Range header applies, as there is no If-Range or it matches the ETag or the Last-Modified.
+ */
+static int onion_shortcut_if_range(onion_request *request, const char *etag, const char *last_modified){
+	const char *if_range=onion_request_get_header_id(request, ONION_H_IF_RANGE);
+	if (!if_range)
+		return 1;
+	if (strcmp(if_range, last_modified)==0)
+		return 1;
+	size_t l=strlen(if_range);
+	if (l>=2 && if_range[0]=='"' && if_range[l-1]=='"')
+		return (l-2==strlen(etag)) && strncmp(if_range+1, etag, l-2)==0;
+	return strcmp(if_range, etag)==0;
+}
+
+/// Writes the part header of a range of a multipart/byteranges response to dest, and returns its length.
+static int onion_shortcut_range_part_header(char *dest, size_t size, const char *boundary, const char *content_type, onion_shortcut_range *range, size_t file_size){
+	return snprintf(dest, size, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %llu-%llu/%llu\r\n\r\n",
+									boundary, content_type, (unsigned long long)range->start, (unsigned long long)(range->start+range->length-1), 
+									(unsigned long long)file_size);
+}
 
 /**
  * @short Shortcut for fast responses, like errors.
@@ -114,22 +323,30 @@ onion_connection_status onion_shortcut_redirect(const char *newurl, onion_reques
 }
 
 
+void onion_request_set_fullpath(onion_request *req, const char *path); // At request.c
+onion_handler *onion_request_root_handler(onion_request *req); // At request.c
+
 /// Shortcut for fast internal redirect. It returns what the server would return with the new address.
 onion_connection_status onion_shortcut_internal_redirect(const char *newurl, onion_request *req, onion_response *res){
-  free(req->fullpath);
-  req->fullpath=req->path=strdup(newurl);
-  return onion_handler_handle(req->connection.listen_point->server->root_handler, req, res);
+  char *old=(req->fullpath!=req->path_buffer.data) ? req->fullpath : NULL;
+  onion_request_set_fullpath(req, newurl);
+  req->path=req->fullpath;
+  free(old);
+  return onion_handler_handle(onion_request_root_handler(req), req, res);
 }
 
-/**
- * @short This shortcut returns the given file contents. 
- * 
- * This is the recomended way to send static files; it even can use sendfile Linux call 
- * if suitable.
- * 
- * It does no security checks, so caller must be security aware.
- */
-onion_connection_status onion_shortcut_response_file(const char *filename, onion_request *request, onion_response *res){
+/// Precompressed siblings of static files, in preference order, and their Content-Encoding.
+static const struct{
+	const char *extension;
+	const char *encoding;
+}onion_shortcut_precompressed_files[]={
+	{ ".br", "br" },
+	{ ".gz", "gzip" },
+	{ NULL, NULL }
+};
+
+/// Checks once whether sendfile is disabled, by ONION_SENDFILE=0.
+static void onion_shortcut_sendfile_init(){
 	if (onion_use_sendfile<0){
 		const char *use_sendfile=getenv("ONION_SENDFILE");
 		if (use_sendfile && strcmp(use_sendfile, "0")==0){
@@ -139,137 +356,339 @@ onion_connection_status onion_shortcut_response_file(const char *filename, onion
 		else
 			onion_use_sendfile=1;
 	}
+}
+
+/// A file to send: opened now, or from the server file cache.
+typedef struct{
+	int fd;
+	struct stat st;
+	onion_file_cache_entry *entry; ///< If from the cache. Then it is released, not closed.
+}onion_shortcut_file;
+
+/// Opens the file, or gets it from the cache. <0 if it does not exist or can not be opened.
+static int onion_shortcut_file_open(onion_file_cache *cache, const char *filename, onion_shortcut_file *f){
+	f->entry=NULL;
+	if (cache){
+		f->entry=onion_file_cache_get(cache, filename);
+		if (!f->entry)
+			return -1;
+		f->fd=onion_file_cache_entry_fd(f->entry);
+		f->st=*onion_file_cache_entry_stat(f->entry);
+		return 0;
+	}
 	
-	int fd=open(filename,O_RDONLY|O_CLOEXEC);
-	
-	if (fd<0)
-		return OCS_NOT_PROCESSED;
+	f->fd=open(filename,O_RDONLY|O_CLOEXEC);
+	if (f->fd<0)
+		return -1;
 
 	if(O_CLOEXEC == 0) { // Good compiler know how to cut this out
-		int flags=fcntl(fd, F_GETFD);
+		int flags=fcntl(f->fd, F_GETFD);
 		if (flags==-1){
 			ONION_ERROR("Retrieving flags from file descriptor");
 		}
 		flags|=FD_CLOEXEC;
-		if (fcntl(fd, F_SETFD, flags)==-1){
+		if (fcntl(f->fd, F_SETFD, flags)==-1){
 			ONION_ERROR("Setting O_CLOEXEC to file descriptor");
 		}
 	}
 	
-	struct stat st;
-	if (stat(filename, &st)!=0){
-		ONION_WARNING("File does not exist: %s",filename);
-		close(fd);
-		return OCS_NOT_PROCESSED;
+	if (fstat(f->fd, &f->st)!=0){
+		ONION_WARNING_RATELIMITED("File does not exist: %s",filename);
+		close(f->fd);
+		return -1;
 	}
-	
-	if (S_ISDIR(st.st_mode)){
-		close(fd);
-		return OCS_NOT_PROCESSED;
+	return 0;
+}
+
+static void onion_shortcut_file_close(onion_shortcut_file *f){
+	if (f->entry)
+		onion_file_cache_release(f->entry);
+	else
+		close(f->fd);
+}
+
+/**
+ * @short If accepted by the client, and there is an up to date precompressed sibling (file.br, file.gz), it is opened.
+ * 
+ * @returns The Content-Encoding, and the sibling at compressed; or NULL if it stays with the original file.
+ */
+static const char *onion_shortcut_precompressed(onion_file_cache *cache, const char *filename, onion_request *request, 
+																								onion_shortcut_file *original, onion_shortcut_file *compressed){
+	const char *accept=onion_request_get_header_id(request, ONION_H_ACCEPT_ENCODING);
+	if (!accept)
+		return NULL;
+	char tmp[4096];
+	int i;
+	for (i=0;onion_shortcut_precompressed_files[i].extension;i++){
+		if (onion_compress_accepts(accept, onion_shortcut_precompressed_files[i].encoding)<=0)
+			continue;
+		if (snprintf(tmp, sizeof(tmp), "%s%s", filename, onion_shortcut_precompressed_files[i].extension)>=sizeof(tmp))
+			continue;
+		if (onion_shortcut_file_open(cache, tmp, compressed)<0)
+			continue;
+		if (compressed->fd<0 || !S_ISREG(compressed->st.st_mode) || compressed->st.st_mtime<original->st.st_mtime){ // Older ones may be stale
+			onion_shortcut_file_close(compressed);
+			continue;
+		}
+		ONION_DEBUG0("Using precompressed %s", tmp);
+		return onion_shortcut_precompressed_files[i].encoding;
 	}
-	
-	size_t length=st.st_size;
-	
+	return NULL;
+}
+
+/// Renders the headers to answer the whole cached file, and keeps them at the entry.
+static const char *onion_shortcut_file_headers(onion_file_cache_entry *entry, const char *etag, const char *last_modified, const char *content_type, const char *encoding){
+	char tmp[1024];
+	if (encoding)
+		snprintf(tmp, sizeof(tmp), "Etag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\nContent-Type: %s\r\nContent-Encoding: %s\r\nVary: Accept-Encoding\r\n", 
+						 etag, last_modified, content_type, encoding);
+	else
+		snprintf(tmp, sizeof(tmp), "Etag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\nContent-Type: %s\r\n", etag, last_modified, content_type);
+	return onion_file_cache_entry_set_headers(entry, encoding!=NULL, strdup(tmp));
+}
+
+/// Answers with the opened file, the whole or the asked ranges.
+static onion_connection_status onion_shortcut_response_opened(onion_shortcut_file *f, const char *content_type, const char *encoding,
+																															onion_request *request, onion_response *res){
 	char etag[64];
-	onion_shortcut_etag(&st, etag);
-		
-	const char *range=onion_request_get_header(request, "Range");
-	if (range){
-		strncat(etag,range,sizeof(etag)-1);
+	if (f->entry)
+		snprintf(etag, sizeof(etag), "%s", onion_file_cache_entry_etag(f->entry));
+	else
+		onion_shortcut_etag(&f->st, etag);
+	if (encoding){ // Not the same ETag as the original, as it is another representation
+		strncat(etag, "-", sizeof(etag)-strlen(etag)-1);
+		strncat(etag, encoding, sizeof(etag)-strlen(etag)-1);
 	}
-	onion_response_set_header(res, "Etag", etag);
+	char last_modified[32];
+	onion_shortcut_date_string(f->st.st_mtime, last_modified);
+	const char *data=f->entry ? onion_file_cache_entry_data(f->entry) : NULL;
 	
-	if (range && strncmp(range,"bytes=",6)==0){
-		onion_response_set_code(res, HTTP_PARTIAL_CONTENT);
-		//ONION_DEBUG("Need just a range: %s",range);
-		char tmp[1024];
-		strncpy(tmp, range+6, 1024);
-		char *start=tmp;
-		char *end=tmp;
-		while (*end!='-' && *end) end++;
-		if (*end=='-'){
-			*end='\0';
-			end++;
-			
-			//ONION_DEBUG("Start %s, end %s",start,end);
-			size_t ends, starts;
-			if (*end)
-				ends=atol(end);
-			else
-				ends=length;
-			starts=atol(start);
-			length=ends-starts+1;
-			lseek(fd, starts, SEEK_SET);
-			snprintf(tmp,sizeof(tmp),"bytes %d-%d/%d",(unsigned int)starts, (unsigned int)ends, (unsigned int)st.st_size);
-			//onion_response_set_header(res, "Accept-Ranges","bytes");
-			onion_response_set_header(res, "Content-Range",tmp);
-		}
+	const char *range=onion_request_get_header_id(request, ONION_H_RANGE);
+	int conditional=onion_request_get_header_id(request, ONION_H_IF_NONE_MATCH) || onion_request_get_header_id(request, ONION_H_IF_MODIFIED_SINCE);
+	if (data && !range && !conditional && !res->compress_level){ // The usual, answered with the prerendered headers.
+		const char *headers=onion_file_cache_entry_headers(f->entry, encoding!=NULL);
+		if (!headers)
+			headers=onion_shortcut_file_headers(f->entry, etag, last_modified, content_type, encoding);
+		onion_dict_remove(res->headers, "Content-Type");
+		onion_response_set_header_block(res, headers, strlen(headers));
+		onion_response_set_length(res, f->st.st_size);
+		onion_response_write_headers(res);
+		if ((onion_request_get_flags(request)&OR_HEAD) != OR_HEAD)
+			onion_response_write(res, data, f->st.st_size);
+		return OCS_PROCESSED;
 	}
 	
-	onion_response_set_length(res, length);
-	onion_response_set_header(res, "Content-Type", onion_mime_get(filename) );
-	ONION_DEBUG("Mime type is %s",onion_mime_get(filename));
+	if (encoding){
+		onion_response_set_header(res, "Content-Encoding", encoding);
+		onion_response_set_header(res, "Vary", "Accept-Encoding");
+	}
+	onion_response_set_header(res, "Etag", etag);
+	onion_response_set_header(res, "Last-Modified", last_modified);
+	onion_response_set_header(res, "Accept-Ranges", "bytes");
+	ONION_DEBUG("Mime type is %s",content_type);
 
   ONION_DEBUG0("Etag %s", etag);
-  const char *prev_etag=onion_request_get_header(request, "If-None-Match");
-  if (prev_etag && (strcmp(prev_etag, etag)==0)){
+  if (conditional && onion_shortcut_not_modified(request, etag, f->st.st_mtime)){
     ONION_DEBUG0("Not modified");
     onion_response_set_length(res, 0);
     onion_response_set_code(res, HTTP_NOT_MODIFIED);
     onion_response_write_headers(res);
-    close(fd);
     return OCS_PROCESSED;
   }
-	onion_response_write_headers(res);
-	if ((onion_request_get_flags(request)&OR_HEAD) == OR_HEAD){ // Just head.
-		length=0;
-	}
 	
-	if (length){
-#ifdef USE_SENDFILE
-		if (onion_use_sendfile && request->connection.listen_point->write==(void*)onion_http_write){ // Lets have a house party! I can use sendfile!
-			onion_response_write(res,NULL,0);
-			ONION_DEBUG("Using sendfile");
-			int r=sendfile(request->connection.fd, fd, NULL, length);
-			ONION_DEBUG("Wrote %d, should be %d (%s)", r, length, r==length ? "ok" : "nok");
-			if (r!=length || r<0){
-				ONION_ERROR("Could not send all file (%s)", strerror(errno));
-				close(fd);
-				return OCS_INTERNAL_ERROR;
+	onion_shortcut_range ranges[ONION_SHORTCUT_MAX_RANGES];
+	int nranges=-1;
+	if (range && onion_shortcut_if_range(request, etag, last_modified))
+		nranges=onion_shortcut_parse_ranges(range, f->st.st_size, ranges);
+	int head=((onion_request_get_flags(request)&OR_HEAD) == OR_HEAD);
+	char tmp[1024];
+	int r=0;
+	
+	if (nranges==0){
+		ONION_DEBUG0("Range not satisfiable: %s", range);
+		snprintf(tmp, sizeof(tmp), "bytes */%llu", (unsigned long long)f->st.st_size);
+		onion_response_set_header(res, "Content-Range", tmp);
+		onion_response_set_length(res, 0);
+		onion_response_set_code(res, HTTP_RANGE_NOT_SATISFIABLE);
+		onion_response_write_headers(res);
+		return OCS_PROCESSED;
+	}
+	if (nranges>1){ // multipart/byteranges, each part with its own headers
+		char boundary[24];
+		snprintf(boundary, sizeof(boundary), "%08x%08x", (unsigned int)rand(), (unsigned int)rand());
+		size_t length=0;
+		int i;
+		for (i=0;i<nranges;i++)
+			length+=onion_shortcut_range_part_header(tmp, sizeof(tmp), boundary, content_type, &ranges[i], f->st.st_size)+ranges[i].length;
+		length+=strlen(boundary)+8; // \r\n--boundary--\r\n
+		
+		onion_response_set_code(res, HTTP_PARTIAL_CONTENT);
+		onion_response_set_length(res, length);
+		snprintf(tmp, sizeof(tmp), "multipart/byteranges; boundary=%s", boundary);
+		onion_response_set_header(res, "Content-Type", tmp);
+		onion_response_write_headers(res);
+		if (!head){
+			for (r=0,i=0;i<nranges && r==0;i++){
+				onion_response_write(res, tmp, onion_shortcut_range_part_header(tmp, sizeof(tmp), boundary, content_type, &ranges[i], f->st.st_size));
+				r=onion_shortcut_send_file(request, res, f->fd, data, ranges[i].start, ranges[i].length, 0);
 			}
-			res->sent_bytes+=length;
-			res->sent_bytes_total+=length;
+			if (r==0)
+				onion_response_printf(res, "\r\n--%s--\r\n", boundary);
 		}
-		else
-#endif
-		{ // Ok, no I cant, do it as always.
-			int r=0,w;
-			size_t tr=0;
-			char tmp[4046];
-			if (length>sizeof(tmp)){
-				size_t max=length-sizeof(tmp);
-				while( tr<max ){
-					r=read(fd,tmp,sizeof(tmp));
-					tr+=r;
-					if (r<0)
-						break;
-					w=onion_response_write(res, tmp, r);
-					if (w!=r){
-						ONION_ERROR("Wrote less than read: write %d, read %d. Quite probably closed connection.",w,r);
-						break;
-					}
-				}
-			}
-			if (sizeof(tmp) >= (length-tr)){
-				r=read(fd, tmp, length-tr);
-				w=onion_response_write(res, tmp, r);
-				if (w!=r){
-					ONION_ERROR("Wrote less than read: write %d, read %d. Quite probably closed connection.",w,r);
-				}
-			}
+		return r<0 ? OCS_CLOSE_CONNECTION : OCS_PROCESSED;
+	}
+	
+	off_t start=0;
+	size_t length=f->st.st_size;
+	if (nranges==1){
+		onion_response_set_code(res, HTTP_PARTIAL_CONTENT);
+		start=ranges[0].start;
+		length=ranges[0].length;
+		snprintf(tmp, sizeof(tmp), "bytes %llu-%llu/%llu", (unsigned long long)start, (unsigned long long)(start+length-1), (unsigned long long)f->st.st_size);
+		onion_response_set_header(res, "Content-Range", tmp);
+	}
+	onion_response_set_length(res, length);
+	onion_response_set_header(res, "Content-Type", content_type);
+	onion_response_write_headers(res);
+	
+	r=head ? 0 : onion_shortcut_send_file(request, res, f->fd, data, start, length, 1);
+	return r<0 ? OCS_CLOSE_CONNECTION : OCS_PROCESSED;
+}
+
+/**
+ * @short This shortcut returns the given file contents. 
+ * 
+ * This is the recomended way to send static files; it even can use sendfile Linux call 
+ * if suitable.
+ * 
+ * If the client accepts brotli or gzip, and there is an up to date precompressed sibling, as file.br 
+ * or file.gz, that one is sent instead, with its Content-Encoding and its own ETag. The Content-Type is 
+ * still the one of the original file.
+ * 
+ * Range requests (RFC 7233) are answered with the satisfiable ranges, several as multipart/byteranges, or 
+ * with 416 if none is. If there is an If-Range and it does not match the ETag, all the file is sent.
+ * 
+ * It sends the ETag and the Last-Modified, and answers 304 without body when the If-None-Match has the 
+ * ETag, or if there is none, when the file was not modified since the If-Modified-Since.
+ * 
+ * If the server has a file cache, the files and their metadata come from there. @see onion_set_file_cache
+ * 
+ * It does no security checks, so caller must be security aware.
+ */
+onion_connection_status onion_shortcut_response_file(const char *filename, onion_request *request, onion_response *res){
+	onion_shortcut_sendfile_init();
+	
+	onion_file_cache *cache=NULL;
+	if (request->connection.listen_point && request->connection.listen_point->server)
+		cache=request->connection.listen_point->server->file_cache;
+	
+	onion_shortcut_file file, compressed;
+	if (onion_shortcut_file_open(cache, filename, &file)<0)
+		return OCS_NOT_PROCESSED;
+	if (file.fd<0 || S_ISDIR(file.st.st_mode)){
+		onion_shortcut_file_close(&file);
+		return OCS_NOT_PROCESSED;
+	}
+	
+	const char *encoding=onion_shortcut_precompressed(cache, filename, request, &file, &compressed);
+	const char *content_type=file.entry ? onion_file_cache_entry_mime(file.entry) : onion_mime_get(filename);
+	
+	onion_connection_status ret=onion_shortcut_response_opened(encoding ? &compressed : &file, content_type, encoding, request, res);
+	
+	if (encoding)
+		onion_shortcut_file_close(&compressed);
+	onion_shortcut_file_close(&file);
+	return ret;
+}
+
+/**
+ * @short Answers an embedded resource, as the handlers opack generates: the representation the client accepts.
+ * 
+ * The variants end with the identity one, with NULL encoding; the others, as gzip or br, go in preference order, 
+ * and the one with the best q at Accept-Encoding is chosen. As at onion_shortcut_response_file, each encoding
+ * has its own ETag, the given one and -encoding, and if there are encodings there is Vary: Accept-Encoding.
+ * 
+ * If the If-None-Match has the ETag, it answers 304 without body.
+ * 
+ * If the variant has its prerendered headers, they are used as they are, with a single copy, and must be
+ * the same this function would set.
+ * 
+ * @param variants The representations, ending with the one with NULL encoding
+ * @param content_type The Content-Type of all of them
+ * @param etag The ETag of the identity representation
+ * @param cache_control The Cache-Control header, or NULL to not set it
+ */
+onion_connection_status onion_shortcut_response_embedded(const onion_shortcut_embedded *variants, const char *content_type, 
+											const char *etag, const char *cache_control, onion_request *req, onion_response *res){
+	return onion_shortcut_response_variants(variants, content_type, etag, cache_control, -1, NULL, req, res);
+}
+
+/**
+ * @short Answers a resource mapped from a file, as the entries of the asset archives: as an embedded one, by sendfile.
+ * 
+ * The data of the variants is at the mapping of fd that starts at base, and it is sent from the fd at 
+ * that offset, or queued to be sent from the poller if big, as onion_shortcut_response_file does. The fd 
+ * is duplicated if queued, so it can be closed and unmapped after this returns.
+ * 
+ * @see onion_shortcut_response_embedded
+ */
+onion_connection_status onion_shortcut_response_mapped(const onion_shortcut_embedded *variants, const char *content_type, 
+											const char *etag, const char *cache_control, int fd, const char *base, onion_request *req, onion_response *res){
+	onion_shortcut_sendfile_init();
+	return onion_shortcut_response_variants(variants, content_type, etag, cache_control, fd, base, req, res);
+}
+
+/// Answers the variant the client accepts; from memory, or from the fd mapped at base, if any.
+static onion_connection_status onion_shortcut_response_variants(const onion_shortcut_embedded *variants, const char *content_type, 
+											const char *etag, const char *cache_control, int fd, const char *base, onion_request *req, onion_response *res){
+	const char *accept=onion_request_get_header_id(req, ONION_H_ACCEPT_ENCODING);
+	const onion_shortcut_embedded *v, *chosen=NULL;
+	float bestq=0;
+	for (v=variants;v->encoding;v++){
+		float q=accept ? onion_compress_accepts(accept, v->encoding) : 0;
+		if (q>bestq){
+			chosen=v;
+			bestq=q;
 		}
 	}
-	close(fd);
+	int vary=(v!=variants);
+	if (!chosen)
+		chosen=v;
+	
+	char tmp[128];
+	if (chosen->encoding){
+		snprintf(tmp, sizeof(tmp), "%s-%s", etag, chosen->encoding);
+		etag=tmp;
+	}
+	if (chosen->headers){
+		onion_dict_remove(res->headers, "Content-Type");
+		onion_response_set_header_block(res, chosen->headers, chosen->headers_length);
+	}
+	else{
+		if (chosen->encoding)
+			onion_response_set_header(res, "Content-Encoding", chosen->encoding);
+		if (vary)
+			onion_response_set_header(res, "Vary", "Accept-Encoding");
+		onion_response_set_header(res, "Etag", etag);
+		onion_response_set_header(res, "Content-Type", content_type);
+		if (cache_control)
+			onion_response_set_header(res, "Cache-Control", cache_control);
+	}
+	
+	if (onion_shortcut_not_modified(req, etag, -1)){
+		onion_response_set_length(res, 0);
+		onion_response_set_code(res, HTTP_NOT_MODIFIED);
+		onion_response_write_headers(res);
+		return OCS_PROCESSED;
+	}
+	
+	onion_response_set_length(res, chosen->length);
+	if (onion_response_write_headers(res)==OR_SKIP_CONTENT)
+		return OCS_PROCESSED;
+	if (fd<0)
+		onion_response_write(res, chosen->data, chosen->length);
+	else if (onion_shortcut_send_file(req, res, fd, NULL, chosen->data-base, chosen->length, 1)<0)
+		return OCS_CLOSE_CONNECTION;
 	return OCS_PROCESSED;
 }
 
@@ -277,32 +696,80 @@ onion_connection_status onion_shortcut_response_file(const char *filename, onion
  * @short Shortcut to answer some json data
  * 
  * It converts to json the passed dict and returns it. The dict is freed before returning.
+ * 
+ * The json is written straight to the response, as onion_dict_write_json, after counting its length.
  */
 onion_connection_status onion_shortcut_response_json(onion_dict *d, onion_request *req, onion_response *res){
 	onion_response_set_header(res, "Content-Type", "application/json");
+	onion_response_set_length(res, onion_dict_json_length(d));
+	onion_response_set_code(res, HTTP_OK);
 	
-	onion_block *bl=onion_dict_to_json(d);
+	if (onion_response_write_headers(res)!=OR_SKIP_CONTENT)
+		onion_dict_write_json(d, res);
 	onion_dict_free(d);
-	char tmp[16];
-	snprintf(tmp,sizeof(tmp),"%ld",(long)onion_block_size(bl));
-	int ret=onion_shortcut_response_extra_headers(onion_block_data(bl), HTTP_OK, req, res, "Content-Length", tmp, NULL);
-	onion_block_free(bl);
-	return ret;
+	return OCS_PROCESSED;
 }
 
+static const char *onion_shortcut_days[]={ "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *onion_shortcut_months[]={ "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
 /**
  * @short Transforms a time_t to a RFC 822 date string
  * 
- * This date format is the standard in HTTP protocol as RFC 2616, section 3.3.1
+ * This date format is the standard in HTTP protocol as RFC 2616, section 3.3.1, the IMF-fixdate of RFC 7231.
+ * Not strftime, as the day and month names must not depend on the locale.
  * 
  * The dest pointer must be at least 32 bytes long as thats the maximum size of the date.
  */
 void onion_shortcut_date_string(time_t t, char *dest){
 	struct tm ts;
 	gmtime_r(&t, &ts);
-	strftime(dest, t, "%a, %d %b %Y %T %Z", &ts);
+	snprintf(dest, 32, "%s, %02d %s %04d %02d:%02d:%02d GMT", onion_shortcut_days[ts.tm_wday], ts.tm_mday, 
+					 onion_shortcut_months[ts.tm_mon], ts.tm_year+1900, ts.tm_hour, ts.tm_min, ts.tm_sec);
 }
 
+/// Month of the 3 letters name, 0 to 11, or -1.
+static int onion_shortcut_month(const char *name){
+	int i;
+	for (i=0;i<12;i++){
+		if (strncmp(name, onion_shortcut_months[i], 3)==0)
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * @short Transforms a HTTP date to time_t.
+ * 
+ * Knows the three formats of RFC 7231, section 7.1.1.1: the IMF-fixdate "Sun, 06 Nov 1994 08:49:37 GMT",
+ * the RFC 850 "Sunday, 06-Nov-94 08:49:37 GMT" and the asctime "Sun Nov  6 08:49:37 1994". All are GMT.
+ * 
+ * @returns The time, or -1 if not a valid date.
+ */
+time_t onion_shortcut_date_time_t(const char *t){
+	char month[4];
+	int day, year, hour, min, sec;
+	const char *comma=strchr(t, ',');
+	if (comma){
+		if (sscanf(comma+1, " %d %3s %d %d:%d:%d GMT", &day, month, &year, &hour, &min, &sec)!=6 &&
+		    sscanf(comma+1, " %d-%3s-%d %d:%d:%d GMT", &day, month, &year, &hour, &min, &sec)!=6)
+			return -1;
+		if (year<100) // RFC 850 two digit years, as the ones that seem in the future are in the past.
+			year+=(year<70) ? 2000 : 1900;
+	}
+	else if (sscanf(t, "%*3s %3s %d %d:%d:%d %d", month, &day, &hour, &min, &sec, &year)!=6)
+		return -1;
+	int mon=onion_shortcut_month(month);
+	if (mon<0 || day<1 || day>31 || hour>23 || min>59 || sec>60 || year<1970)
+		return -1;
+	// Days since the epoch of the civil date, without the time zone of timegm.
+	int y=year-(mon<2);
+	int era=y/400;
+	int yoe=y-era*400;
+	int doy=(153*(mon+(mon<2 ? 10 : -2))+2)/5+day-1;
+	long days=(long)era*146097+yoe*365+yoe/4-yoe/100+doy-719468;
+	return (time_t)days*86400+hour*3600+min*60+sec;
+}
 
 /**
  * @short Transforms a time_t to a ISO date string
@@ -327,12 +794,115 @@ void onion_shortcut_etag(struct stat *st, char etag[32]){
 	ONION_DEBUG0("Etag is %s", etag);
 }
 
+/**
+ * @short Whether the ETag is at the list of an If-None-Match, or it is "*".
+ * 
+ * As the weak comparison of RFC 7232, the W/ prefixes do not count, and neither the quotes, as the ETags
+ * of the files are not quoted and the clients give them back as they got them.
+ */
+static int onion_shortcut_etag_matches(const char *list, const char *etag){
+	if (etag[0]=='W' && etag[1]=='/')
+		etag+=2;
+	size_t l=strlen(etag);
+	if (l>=2 && etag[0]=='"' && etag[l-1]=='"'){
+		etag++;
+		l-=2;
+	}
+	while (*list){
+		while (*list==' ' || *list==',' || *list=='\t')
+			list++;
+		const char *start=list;
+		while (*list && *list!=',')
+			list++;
+		const char *end=list;
+		while (end>start && (end[-1]==' ' || end[-1]=='\t'))
+			end--;
+		if (end-start==1 && *start=='*')
+			return 1;
+		if (end-start>=2 && start[0]=='W' && start[1]=='/')
+			start+=2;
+		if (end-start>=2 && start[0]=='"' && end[-1]=='"'){
+			start++;
+			end--;
+		}
+		if ((size_t)(end-start)==l && memcmp(start, etag, l)==0)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * @short Whether the client already has this version of the resource, so it can be answered with 304.
+ * 
+ * By the If-None-Match if there is one, else by the If-Modified-Since, as RFC 7232. Only for GET and HEAD.
+ * 
+ * @param req The request
+ * @param etag The ETag of the resource, or NULL
+ * @param last_modified When it was modified, or -1 if not known
+ */
+int onion_shortcut_not_modified(onion_request *req, const char *etag, time_t last_modified){
+	int method=onion_request_get_flags(req)&OR_METHODS;
+	if (method!=OR_GET && method!=OR_HEAD)
+		return 0;
+	const char *if_none_match=onion_request_get_header_id(req, ONION_H_IF_NONE_MATCH);
+	if (if_none_match)
+		return etag && onion_shortcut_etag_matches(if_none_match, etag);
+	const char *if_modified_since=onion_request_get_header_id(req, ONION_H_IF_MODIFIED_SINCE);
+	if (!if_modified_since || last_modified<0)
+		return 0;
+	time_t since=onion_shortcut_date_time_t(if_modified_since);
+	return since>=0 && last_modified<=since;
+}
+
+#ifdef O_TMPFILE
+/**
+ * @short Gives the unnamed file a name, dest, replacing any file there at once.
+ * 
+ * It is linked with a hidden temporary name at the directory of dest, and renamed over dest.
+ */
+static int onion_shortcut_link_unnamed(const char *orig, const char *dest){
+	static unsigned int count=0;
+	const char *slash=strrchr(dest, '/');
+	int dirlen=slash ? slash-dest+1 : 0;
+	size_t l=strlen(dest)+48;
+	char *tmp=alloca(l);
+	int i;
+	for (i=0;i<16;i++){
+		snprintf(tmp, l, "%.*s.onion-put-%d-%u", dirlen, dest, (int)getpid(), __sync_add_and_fetch(&count, 1));
+		if (linkat(AT_FDCWD, orig, AT_FDCWD, tmp, AT_SYMLINK_FOLLOW)==0){
+			if (rename(tmp, dest)==0)
+				return 0;
+			int err=errno;
+			unlink(tmp);
+			errno=err;
+			return -1;
+		}
+		if (errno!=EEXIST)
+			return -1;
+	}
+	return -1;
+}
+#endif
+
 /**
  * @short Moves a file to another location
  * 
  * It takes care if it can be a simple rename or must copy and remove old.
+ * 
+ * The PUT bodies at unnamed O_TMPFILE files, named ONION_SPOOL_UNNAMED and their fd, are linked at dest,
+ * if at the same filesystem, so they are written only once. @see onion_set_spool_dir
  */
 int onion_shortcut_rename(const char *orig, const char *dest){
+#ifdef O_TMPFILE
+	if (strncmp(orig, ONION_SPOOL_UNNAMED, sizeof(ONION_SPOOL_UNNAMED)-1)==0){
+		if (onion_shortcut_link_unnamed(orig, dest)==0)
+			return 0;
+		if (errno!=EXDEV){
+			ONION_ERROR("Could not link %s at %s (%s)", orig, dest, strerror(errno));
+			return 1;
+		}
+	}
+#endif
 	int ok=rename(orig, dest);
 	
 	if (ok!=0 && errno==EXDEV){ // Ok, old way, open both, copy
@@ -54,16 +54,34 @@ onion_connection_status onion_shortcut_response_file(const char *filename, onion
 /// Shortcut for response json data. Dict is freed before return.
 onion_connection_status onion_shortcut_response_json(onion_dict *d, onion_request *req, onion_response *res);
 
+/// A representation of an embedded resource, as opack generates them. encoding is NULL at the identity one.
+typedef struct onion_shortcut_embedded_t{
+	const char *encoding;
+	const char *data;
+	unsigned int length;
+	const char *headers;          ///< Prerendered Etag, Content-Type, Content-Encoding, Vary and Cache-Control lines, or NULL
+	unsigned int headers_length;
+}onion_shortcut_embedded;
+
+/// Shortcut to answer an embedded resource, with the encoding the client accepts, ETag, Cache-Control and 304s.
+onion_connection_status onion_shortcut_response_embedded(const onion_shortcut_embedded *variants, const char *content_type, 
+											const char *etag, const char *cache_control, onion_request *req, onion_response *res);
+/// As onion_shortcut_response_embedded, with the data mapped from fd at base, so it is sent by sendfile.
+onion_connection_status onion_shortcut_response_mapped(const onion_shortcut_embedded *variants, const char *content_type, 
+											const char *etag, const char *cache_control, int fd, const char *base, onion_request *req, onion_response *res);
+
 /// Shortcut to return the date in "RFC 822 / section 5, 4 digit years" date format. 
 void onion_shortcut_date_string(time_t t, char *dest);
 /// Shortcut to return the date in ISO format
 void onion_shortcut_date_string_iso(time_t t, char *dest);
 
-/// Shortcut to return the date in time_t from a user given date TODO
-//time_t onion_shortcut_date_time_t(const char *t);
+/// Shortcut to return the date in time_t from a HTTP date, or -1 if not valid.
+time_t onion_shortcut_date_time_t(const char *t);
 
 /// Shortcut to unify the creation of etags.
 void onion_shortcut_etag(struct stat *, char etag[32]);
+/// Shortcut to check whether the client has this version already, by If-None-Match or If-Modified-Since, so it can get a 304.
+int onion_shortcut_not_modified(onion_request *req, const char *etag, time_t last_modified);
 /// Moves a file to another location
 int onion_shortcut_rename(const char *orig, const char *dest);
 
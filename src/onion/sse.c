@@ -0,0 +1,822 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+	
+	a. the GNU Lesser General Public License as published by the 
+	 Free Software Foundation; either version 3.0 of the License, 
+	 or (at your option) any later version.
+	
+	b. the GNU General Public License as published by the 
+	 Free Software Foundation; either version 2.0 of the License, 
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this 
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_PTHREADS
+# include <pthread.h>
+#else  // if no pthreads, ignore locks.
+# define pthread_mutex_init(...)
+# define pthread_mutex_destroy(...)
+# define pthread_mutex_lock(...)
+# define pthread_mutex_unlock(...)
+#endif
+
+#include "log.h"
+#include "sse.h"
+#include "poller.h"
+#include "request.h"
+#include "response.h"
+#include "types_internal.h"
+
+/// An event encoded once, shared by the queues of all the streams it goes to, and by the history of the group.
+typedef struct{
+	int refcount; ///< Atomic
+	char *id;     ///< Its id, after the data, or NULL.
+	size_t size;
+	char data[];
+}onion_sse_event;
+
+typedef struct onion_sse_queued_t{
+	onion_sse_event *event;
+	struct onion_sse_queued_t *next;
+}onion_sse_queued;
+
+/// A subscription, at the array of the group and at the list of the stream.
+typedef struct onion_sse_member_t{
+	onion_sse_group *group;
+	onion_sse *sse;
+	int index;                        ///< At the group
+	struct onion_sse_member_t *next;  ///< Of the stream
+}onion_sse_member;
+
+struct onion_sse_t{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;      ///< For all but the event being written. After the one of the group, if both.
+#endif
+	int refcount;               ///< Atomic. The connection, the keepalive timer, and the onion_sse_ref.
+	onion_request *req;         ///< NULL once the connection is gone.
+	onion_sse_queued *head, *tail;
+	int count;
+	onion_sse_queued *writing;  ///< Out of the queue, being written. Only used at the slot callback.
+	size_t sent;                ///< Bytes of writing already sent, with the chunk framing.
+	char chunked;
+	char armed;                 ///< Its slot is watched, or the handler did not return yet; else nobody writes.
+	char closing;               ///< onion_sse_close was called; it ends after the queue.
+	char closed;                ///< The connection is gone, or must be closed.
+	char nonblock;              ///< O_NONBLOCK was set for the stream, and is cleared as it ends.
+	int keepalive_ms;
+	int64_t last_write;         ///< Monotonic ms of the last event written. Atomic.
+	char *last_event_id;
+	onion_sse_member *members;
+};
+
+struct onion_sse_group_t{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+	int refcount;               ///< Atomic. The owner, and the streams unsubscribing as they end.
+	onion_sse_group_policy policy;
+	int max_queue;
+	onion_sse_member **members;
+	int count;
+	int allocated;
+	onion_sse_event **history;  ///< Ring of the last events with id.
+	int history_size;
+	int history_start;
+	int history_count;
+};
+
+static void onion_sse_group_release(onion_sse_group *group);
+
+/// Monotonic time in ms.
+static int64_t onion_sse_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+/// Releases a reference to the event; the last frees it.
+static void onion_sse_event_release(onion_sse_event *ev){
+	if (__sync_sub_and_fetch(&ev->refcount, 1)==0)
+		free(ev);
+}
+
+/// An event with this text as is, as comments and retry times.
+static onion_sse_event *onion_sse_event_raw(const char *text, size_t len){
+	onion_sse_event *ev=malloc(sizeof(onion_sse_event)+len);
+	if (!ev)
+		return NULL;
+	ev->refcount=1;
+	ev->id=NULL;
+	ev->size=len;
+	memcpy(ev->data, text, len);
+	return ev;
+}
+
+/**
+ * @short Encodes an event: its id, event and data fields, and the empty line that dispatches it.
+ * 
+ * Each line of data, ended by \\n, \\r\\n or \\r, goes at its own data field, so the client gets them 
+ * joined by \\n. The id and the event can not have line ends.
+ */
+static onion_sse_event *onion_sse_event_new(const char *id, const char *event, const char *data, size_t len){
+	if ((id && strpbrk(id, "\r\n")) || (event && strpbrk(event, "\r\n"))){
+		ONION_ERROR("The id and the event name of a server sent event can not have line ends");
+		return NULL;
+	}
+	size_t idlen=id ? strlen(id) : 0;
+	size_t eventlen=event ? strlen(event) : 0;
+	size_t i, lines=1;
+	for (i=0;i<len;i++)
+		if (data[i]=='\n' || (data[i]=='\r' && (i+1==len || data[i+1]!='\n')))
+			lines++;
+	size_t size=(id ? idlen+5 : 0) + (event ? eventlen+8 : 0) + (data ? len+lines*7 : 0) + 1; // At most, line ends may shrink
+	onion_sse_event *ev=malloc(sizeof(onion_sse_event)+size+(id ? idlen+1 : 0));
+	if (!ev){
+		ONION_ERROR("Could not allocate a server sent event of %ld bytes", (long)size);
+		return NULL;
+	}
+	char *p=ev->data;
+	if (id){
+		memcpy(p, "id: ", 4);
+		memcpy(p+4, id, idlen);
+		p+=idlen+4;
+		*p++='\n';
+	}
+	if (event){
+		memcpy(p, "event: ", 7);
+		memcpy(p+7, event, eventlen);
+		p+=eventlen+7;
+		*p++='\n';
+	}
+	if (data){
+		memcpy(p, "data: ", 6);
+		p+=6;
+		for (i=0;i<len;i++){
+			if (data[i]=='\r' || data[i]=='\n'){
+				if (data[i]=='\r' && i+1<len && data[i+1]=='\n')
+					i++;
+				memcpy(p, "\ndata: ", 7);
+				p+=7;
+			}
+			else
+				*p++=data[i];
+		}
+		*p++='\n';
+	}
+	*p++='\n';
+	ev->size=p-ev->data;
+	ev->id=NULL;
+	if (id){
+		ev->id=p;
+		memcpy(p, id, idlen+1);
+	}
+	ev->refcount=1;
+	return ev;
+}
+
+/// Frees the list of queued events, releasing them.
+static void onion_sse_queued_free(onion_sse_queued *n){
+	while (n){
+		onion_sse_queued *next=n->next;
+		onion_sse_event_release(n->event);
+		free(n);
+		n=next;
+	}
+}
+
+/// Removes all the queued events. With the stream locked.
+static void onion_sse_queue_clear(onion_sse *sse){
+	onion_sse_queued_free(sse->head);
+	sse->head=sse->tail=NULL;
+	sse->count=0;
+}
+
+/**
+ * @short Has the poller write the queue, if nobody is at it. With the stream locked.
+ * 
+ * The slot of the connection was not watched since the handler suspended the request, so it is owned 
+ * here: it is watched again until it is writable, and its callback, onion_sse_ready, writes.
+ */
+static void onion_sse_wake(onion_sse *sse){
+	if (sse->armed || !sse->req)
+		return;
+	sse->armed=1;
+	onion_request *req=sse->req;
+	onion *server=req->connection.listen_point->server;
+	onion_poller_slot_set_type(req->connection.slot, O_POLL_WRITE|O_POLL_OTHER);
+	onion_poller_slot_set_timeout(req->connection.slot, server->timeouts.write ? server->timeouts.write : server->timeout);
+	onion_poller_slot_resume(req->connection.slot);
+}
+
+/// Queues the event to the stream. With the stream locked. Returns 0, or -1 if it does not get more events.
+static int onion_sse_enqueue(onion_sse *sse, onion_sse_event *ev){
+	if (sse->closing || sse->closed)
+		return -1;
+	onion_sse_queued *queued=malloc(sizeof(onion_sse_queued));
+	if (!queued)
+		return -1;
+	__sync_fetch_and_add(&ev->refcount, 1);
+	queued->event=ev;
+	queued->next=NULL;
+	if (sse->tail)
+		sse->tail->next=queued;
+	else
+		sse->head=queued;
+	sse->tail=queued;
+	sse->count++;
+	onion_sse_wake(sse);
+	return 0;
+}
+
+/**
+ * @short Starts a Server-Sent Events stream as the answer to this request.
+ * @memberof onion_sse_t
+ * 
+ * Sets the text/event-stream headers and writes them. Then the handler returns OCS_SUSPENDED, and the 
+ * connection is kept for the stream, with no thread waiting on it: the events sent with onion_sse_send 
+ * or published to its groups are queued, and written by the connection poller as the socket is writable, 
+ * until onion_sse_close, or the client goes away.
+ * 
+ * An idle stream is not read, so a client that is gone is known as the next event, or keepalive comment, 
+ * fails to be written.
+ * 
+ * The stream belongs to the connection. To use it after the handler returns, from other threads, keep a 
+ * reference with onion_sse_ref, and release it with onion_sse_free; the sends fail once it ended.
+ * 
+ * Nothing else must be written to the response.
+ * 
+ * @returns The stream, or NULL if it can not be, as on HTTP/2, HEAD requests, connections out of a poller, or
+ *   if something was written already.
+ */
+onion_sse *onion_sse_new(onion_request *req, onion_response *res){
+	if (req->sse)
+		return req->sse;
+	if (!req->connection.slot || (req->flags&OR_HTTP2) || (req->flags&OR_METHODS)==OR_HEAD || (res->flags&OR_HEADER_SENT))
+		return NULL;
+	onion_sse *sse=calloc(1, sizeof(onion_sse));
+	if (!sse)
+		return NULL;
+	pthread_mutex_init(&sse->mutex, NULL);
+	sse->refcount=1;
+	sse->req=req;
+	sse->armed=1; // Until the handler returns
+	sse->keepalive_ms=ONION_SSE_KEEPALIVE;
+	sse->last_write=onion_sse_now();
+	const char *last_event_id=onion_request_get_header(req, "Last-Event-ID");
+	if (last_event_id)
+		sse->last_event_id=strdup(last_event_id);
+	
+	onion_response_set_compression(res, 0, 0);
+	onion_response_set_header(res, "Content-Type", "text/event-stream");
+	onion_response_set_header(res, "Cache-Control", "no-cache");
+	onion_response_set_header(res, "X-Accel-Buffering", "no"); // Not held by proxies
+	onion_response_write_headers(res);
+	onion_response_flush(res);
+	sse->chunked=(res->flags&OR_CHUNKED) ? 1 : 0;
+	req->sse=sse;
+	return sse;
+}
+
+/// Another reference to the stream, to release with onion_sse_free.
+void onion_sse_ref(onion_sse *sse){
+	__sync_fetch_and_add(&sse->refcount, 1);
+}
+
+/**
+ * @short Releases a reference to the stream; the last frees it.
+ * @memberof onion_sse_t
+ * 
+ * It does not end the stream, that goes on while the connection has its reference. @see onion_sse_close
+ */
+void onion_sse_free(onion_sse *sse){
+	if (__sync_sub_and_fetch(&sse->refcount, 1)!=0)
+		return;
+	onion_sse_queue_clear(sse);
+	onion_sse_queued_free(sse->writing);
+	free(sse->last_event_id);
+	pthread_mutex_destroy(&sse->mutex);
+	free(sse);
+}
+
+/**
+ * @short The id of the last event the client got, as it reconnects after losing the stream, or NULL.
+ * @memberof onion_sse_t
+ * 
+ * The events after it may be sent first. Groups with history do it as the stream subscribes. 
+ * @see onion_sse_group_set_history
+ */
+const char *onion_sse_get_last_event_id(onion_sse *sse){
+	return sse->last_event_id;
+}
+
+/**
+ * @short Sends a comment when nothing was sent for interval_ms, so proxies keep the connection, and a gone client is noticed.
+ * @memberof onion_sse_t
+ * 
+ * Default is ONION_SSE_KEEPALIVE; 0 disables it. Set before the handler returns.
+ */
+void onion_sse_set_keepalive(onion_sse *sse, int interval_ms){
+	sse->keepalive_ms=interval_ms;
+}
+
+/// Timer of the keepalive comments. It has its own reference to the stream.
+static void onion_sse_keepalive(onion_sse *sse){
+	onion_poller *poller=NULL;
+	int next=0;
+	pthread_mutex_lock(&sse->mutex);
+	if (sse->req && !sse->closing && !sse->closed && sse->keepalive_ms>0){
+		poller=onion_request_get_poller(sse->req);
+		int64_t idle=onion_sse_now()-__atomic_load_n(&sse->last_write, __ATOMIC_RELAXED);
+		next=sse->keepalive_ms;
+		if (idle<sse->keepalive_ms)
+			next-=idle;
+		else if (!sse->armed){ // Else something is being written already
+			onion_sse_event *ev=onion_sse_event_raw(":\n", 2);
+			if (ev){
+				onion_sse_enqueue(sse, ev);
+				onion_sse_event_release(ev);
+			}
+		}
+	}
+	pthread_mutex_unlock(&sse->mutex);
+	if (next>0 && onion_poller_add_timer(poller, next, (void*)onion_sse_keepalive, sse)==0)
+		return;
+	onion_sse_free(sse);
+}
+
+/**
+ * @short Sets how many ms the client waits before reconnecting, when the stream is lost.
+ * @memberof onion_sse_t
+ * 
+ * @returns 0 if queued, -1 if the stream ended.
+ */
+int onion_sse_set_retry(onion_sse *sse, int retry_ms){
+	char tmp[32];
+	int len=snprintf(tmp, sizeof(tmp), "retry: %d\n", retry_ms);
+	onion_sse_event *ev=onion_sse_event_raw(tmp, len);
+	if (!ev)
+		return -1;
+	pthread_mutex_lock(&sse->mutex);
+	int ret=onion_sse_enqueue(sse, ev);
+	pthread_mutex_unlock(&sse->mutex);
+	onion_sse_event_release(ev);
+	return ret;
+}
+
+/**
+ * @short Sends an event to this stream.
+ * @memberof onion_sse_t
+ * 
+ * It is queued, and written by the connection poller, so it never waits for the client. It can be called 
+ * from any thread, also before the handler returns.
+ * 
+ * @param sse The stream
+ * @param id Its id, that the client sends back as Last-Event-ID when it reconnects, or NULL.
+ * @param event Event name, or NULL for the default "message".
+ * @param data The data, that may have several lines, or NULL.
+ * @param len Its length
+ * @returns 0 if queued, -1 if the stream ended or on error.
+ */
+int onion_sse_send(onion_sse *sse, const char *id, const char *event, const char *data, size_t len){
+	onion_sse_event *ev=onion_sse_event_new(id, event, data, len);
+	if (!ev)
+		return -1;
+	pthread_mutex_lock(&sse->mutex);
+	int ret=onion_sse_enqueue(sse, ev);
+	pthread_mutex_unlock(&sse->mutex);
+	onion_sse_event_release(ev);
+	return ret;
+}
+
+/**
+ * @short Ends the stream, once the queued events are written.
+ * @memberof onion_sse_t
+ * 
+ * The connection goes on to the next request, if kept alive. It can be called from any thread.
+ */
+void onion_sse_close(onion_sse *sse){
+	pthread_mutex_lock(&sse->mutex);
+	if (!sse->closing && !sse->closed){
+		sse->closing=1;
+		onion_sse_wake(sse);
+	}
+	pthread_mutex_unlock(&sse->mutex);
+}
+
+/**
+ * @short The handler returned OCS_SUSPENDED, so the stream is written from now on.
+ * 
+ * Called by the request, as the connection slot is left unwatched. The socket is set non blocking, if the 
+ * server is not, as the events are written by the poller.
+ */
+void onion_sse_suspended(onion_sse *sse){
+	onion_request *req=sse->req;
+	if (!(req->connection.listen_point->server->flags&O_NONBLOCKING)){
+		int flags=fcntl(req->connection.fd, F_GETFL);
+		if (flags!=-1 && fcntl(req->connection.fd, F_SETFL, flags|O_NONBLOCK)!=-1)
+			sse->nonblock=1;
+	}
+	if (sse->keepalive_ms>0){
+		onion_sse_ref(sse);
+		if (onion_poller_add_timer(onion_request_get_poller(req), sse->keepalive_ms, (void*)onion_sse_keepalive, sse)<0)
+			onion_sse_free(sse);
+	}
+	pthread_mutex_lock(&sse->mutex);
+	sse->armed=0;
+	if (sse->head || sse->closing || sse->closed || onion_request_output_pending(req))
+		onion_sse_wake(sse);
+	pthread_mutex_unlock(&sse->mutex);
+}
+
+/**
+ * @short Writes what is left of the event being written.
+ * 
+ * @returns 0 if all was written, 1 if the socket can not take more now, <0 on error.
+ */
+static int onion_sse_write(onion_sse *sse, onion_request *req){
+	onion_sse_event *ev=sse->writing->event;
+	struct iovec iov[3];
+	char chunk[24];
+	int n=0, i=0;
+	if (sse->chunked){
+		snprintf(chunk, sizeof(chunk), "%X\r\n", (unsigned int)ev->size);
+		iov[n].iov_base=chunk;
+		iov[n++].iov_len=strlen(chunk);
+	}
+	iov[n].iov_base=ev->data;
+	iov[n++].iov_len=ev->size;
+	if (sse->chunked){
+		iov[n].iov_base="\r\n";
+		iov[n++].iov_len=2;
+	}
+	size_t skip=sse->sent;
+	while (i<n && skip>=iov[i].iov_len)
+		skip-=iov[i++].iov_len;
+	if (i<n){
+		iov[i].iov_base=(char*)iov[i].iov_base+skip;
+		iov[i].iov_len-=skip;
+	}
+	
+	onion_listen_point *lp=req->connection.listen_point;
+	while (i<n){
+		ssize_t w=lp->writev ? lp->writev(req, &iov[i], n-i) : lp->write(req, iov[i].iov_base, iov[i].iov_len);
+		if (w<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+			return 1;
+		if (w<=0)
+			return OCS_CLOSE_CONNECTION;
+		sse->sent+=w;
+		while (i<n && (size_t)w>=iov[i].iov_len)
+			w-=iov[i++].iov_len;
+		if (i<n){
+			iov[i].iov_base=(char*)iov[i].iov_base+w;
+			iov[i].iov_len-=w;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @short The stream was closed and all written; the request is completed, as resumed.
+ */
+static int onion_sse_end(onion_sse *sse, onion_request *req){
+	if (sse->nonblock){
+		int flags=fcntl(req->connection.fd, F_GETFL);
+		if (flags!=-1)
+			fcntl(req->connection.fd, F_SETFL, flags&~O_NONBLOCK);
+	}
+	onion_poller_slot_set_type(req->connection.slot, O_POLL_READ|O_POLL_OTHER);
+	onion_sse_detach(sse);
+	onion_request_resume(req);
+	return OCS_YIELD;
+}
+
+/**
+ * @short The connection of the stream is writable: writes the queued events.
+ * 
+ * It is the slot callback while the stream has something to write. When all is written the slot is 
+ * left unwatched again, until more events are queued.
+ * 
+ * @returns OCS_PROCESSED to wait until it is writable again, OCS_YIELD when done, or <0 to close the connection.
+ */
+int onion_sse_ready(onion_sse *sse){
+	onion_request *req=sse->req;
+	if (onion_request_output_pending(req)){ // The headers, on O_NONBLOCKING servers
+		int r=onion_request_output_flush(req);
+		if (r!=0)
+			return r<0 ? r : OCS_PROCESSED;
+	}
+	while (1){
+		if (!sse->writing){
+			pthread_mutex_lock(&sse->mutex);
+			if (sse->closed){
+				pthread_mutex_unlock(&sse->mutex);
+				return OCS_CLOSE_CONNECTION;
+			}
+			sse->writing=sse->head;
+			sse->sent=0;
+			if (sse->writing){
+				sse->head=sse->writing->next;
+				if (!sse->head)
+					sse->tail=NULL;
+				sse->count--;
+				sse->writing->next=NULL;
+			}
+			else if (!sse->closing){
+				sse->armed=0;
+				pthread_mutex_unlock(&sse->mutex);
+				return OCS_YIELD;
+			}
+			pthread_mutex_unlock(&sse->mutex);
+			if (!sse->writing)
+				return onion_sse_end(sse, req);
+		}
+		int r=onion_sse_write(sse, req);
+		if (r!=0)
+			return r<0 ? r : OCS_PROCESSED;
+		req->response->sent_bytes+=sse->writing->event->size;
+		__atomic_store_n(&sse->last_write, onion_sse_now(), __ATOMIC_RELAXED);
+		onion_sse_queued_free(sse->writing);
+		sse->writing=NULL;
+	}
+}
+
+/**
+ * @short The stream is done with its connection: it ended, or the connection is being freed.
+ * 
+ * It gets no more events, is out of its groups, and the connection reference is released.
+ */
+void onion_sse_detach(onion_sse *sse){
+	onion_request *req=sse->req;
+	pthread_mutex_lock(&sse->mutex);
+	sse->closed=1;
+	sse->req=NULL;
+	onion_sse_queue_clear(sse);
+	pthread_mutex_unlock(&sse->mutex);
+	req->sse=NULL;
+	onion_sse_queued_free(sse->writing);
+	sse->writing=NULL;
+	
+	while (1){ // Out of its groups. Each is kept meanwhile, as it may be freed at the same time.
+		pthread_mutex_lock(&sse->mutex);
+		onion_sse_group *group=sse->members ? sse->members->group : NULL;
+		if (group)
+			__sync_fetch_and_add(&group->refcount, 1);
+		pthread_mutex_unlock(&sse->mutex);
+		if (!group)
+			break;
+		onion_sse_group_unsubscribe(group, sse);
+		onion_sse_group_release(group);
+	}
+	onion_sse_free(sse);
+}
+
+/**
+ * @short Creates a broadcast group of event streams.
+ * @memberof onion_sse_group_t
+ * 
+ * Each event published to the group is encoded once, at a refcounted buffer, that is queued to each 
+ * subscriber, so the publisher does not write to any connection, nor waits for the slow ones. The connection 
+ * pollers write them as the sockets are writable, so thousands of mostly idle streams need no thread each.
+ * 
+ * When a subscriber has max_queue events still queued, the policy says what to do with a new one: drop 
+ * it, keep only the latest, or disconnect the subscriber.
+ * 
+ * @param policy For the slow subscribers
+ * @param max_queue Max events queued for each subscriber, at least 1.
+ * @returns The group, to free with onion_sse_group_free.
+ */
+onion_sse_group *onion_sse_group_new(onion_sse_group_policy policy, int max_queue){
+	onion_sse_group *group=calloc(1, sizeof(onion_sse_group));
+	if (!group)
+		return NULL;
+	pthread_mutex_init(&group->mutex, NULL);
+	group->refcount=1;
+	group->policy=policy;
+	group->max_queue=max_queue>0 ? max_queue : 1;
+	return group;
+}
+
+/// Releases the events of the history. With the group locked.
+static void onion_sse_group_history_clear(onion_sse_group *group){
+	int i;
+	for (i=0;i<group->history_count;i++)
+		onion_sse_event_release(group->history[(group->history_start+i)%group->history_size]);
+	free(group->history);
+	group->history=NULL;
+	group->history_size=group->history_start=group->history_count=0;
+}
+
+/**
+ * @short Frees the group. Its subscribers get no more events, but the ones queued are still written.
+ * @memberof onion_sse_group_t
+ */
+void onion_sse_group_free(onion_sse_group *group){
+	pthread_mutex_lock(&group->mutex);
+	int i;
+	for (i=0;i<group->count;i++){
+		onion_sse_member *m=group->members[i];
+		onion_sse *sse=m->sse;
+		pthread_mutex_lock(&sse->mutex);
+		onion_sse_member **p=&sse->members;
+		while (*p!=m)
+			p=&(*p)->next;
+		*p=m->next;
+		pthread_mutex_unlock(&sse->mutex);
+		free(m);
+	}
+	free(group->members);
+	group->members=NULL;
+	group->count=group->allocated=0;
+	onion_sse_group_history_clear(group);
+	pthread_mutex_unlock(&group->mutex);
+	onion_sse_group_release(group);
+}
+
+/// Releases a reference; the last frees it.
+static void onion_sse_group_release(onion_sse_group *group){
+	if (__sync_sub_and_fetch(&group->refcount, 1)!=0)
+		return;
+	pthread_mutex_destroy(&group->mutex);
+	free(group);
+}
+
+/**
+ * @short Keeps the last n published events that have an id, to replay them to the streams that reconnect.
+ * @memberof onion_sse_group_t
+ * 
+ * When a stream subscribes with a Last-Event-ID that is at the history, the events after it are queued 
+ * first, so the client gets what it missed while reconnecting. The history kept until now is dropped.
+ */
+void onion_sse_group_set_history(onion_sse_group *group, int n){
+	pthread_mutex_lock(&group->mutex);
+	onion_sse_group_history_clear(group);
+	if (n>0){
+		group->history=calloc(n, sizeof(onion_sse_event*));
+		if (group->history)
+			group->history_size=n;
+	}
+	pthread_mutex_unlock(&group->mutex);
+}
+
+/**
+ * @short Subscribes the stream to the events of the group.
+ * @memberof onion_sse_group_t
+ * 
+ * If the client reconnected with a Last-Event-ID that is at the history of the group, the events after it 
+ * are queued now. It is unsubscribed when the stream ends.
+ * 
+ * @returns How many events of the history were queued, or -1 on error, if already subscribed, or if the stream ended.
+ */
+int onion_sse_group_subscribe(onion_sse_group *group, onion_sse *sse){
+	onion_sse_member *m=calloc(1, sizeof(onion_sse_member));
+	if (!m)
+		return -1;
+	m->group=group;
+	m->sse=sse;
+	
+	int ret=0;
+	pthread_mutex_lock(&group->mutex);
+	pthread_mutex_lock(&sse->mutex);
+	onion_sse_member *o;
+	for (o=sse->members;o && o->group!=group;o=o->next);
+	if (o || sse->closed || sse->closing)
+		ret=-1;
+	else if (group->count==group->allocated){
+		int allocated=group->allocated ? group->allocated*2 : 16;
+		onion_sse_member **members=realloc(group->members, allocated*sizeof(onion_sse_member*));
+		if (members){
+			group->members=members;
+			group->allocated=allocated;
+		}
+		else
+			ret=-1;
+	}
+	if (ret==0){
+		m->index=group->count;
+		group->members[group->count++]=m;
+		m->next=sse->members;
+		sse->members=m;
+		if (sse->last_event_id){ // Replays what it missed, newest match first
+			int i;
+			for (i=group->history_count-1;i>=0;i--)
+				if (strcmp(group->history[(group->history_start+i)%group->history_size]->id, sse->last_event_id)==0)
+					break;
+			if (i>=0)
+				for (i++;i<group->history_count;i++)
+					if (onion_sse_enqueue(sse, group->history[(group->history_start+i)%group->history_size])==0)
+						ret++;
+		}
+	}
+	pthread_mutex_unlock(&sse->mutex);
+	pthread_mutex_unlock(&group->mutex);
+	if (ret<0)
+		free(m);
+	return ret;
+}
+
+/**
+ * @short Unsubscribes the stream from the group. The events already queued are still written.
+ * @memberof onion_sse_group_t
+ * 
+ * @returns 0 if ok, -1 if it was not subscribed.
+ */
+int onion_sse_group_unsubscribe(onion_sse_group *group, onion_sse *sse){
+	pthread_mutex_lock(&group->mutex);
+	pthread_mutex_lock(&sse->mutex);
+	onion_sse_member **p=&sse->members;
+	while (*p && (*p)->group!=group)
+		p=&(*p)->next;
+	onion_sse_member *m=*p;
+	if (m)
+		*p=m->next;
+	pthread_mutex_unlock(&sse->mutex);
+	if (m){ // The last takes its place
+		onion_sse_member *last=group->members[--group->count];
+		group->members[m->index]=last;
+		last->index=m->index;
+	}
+	pthread_mutex_unlock(&group->mutex);
+	free(m);
+	return m ? 0 : -1;
+}
+
+/**
+ * @short Publishes an event to all the subscribers of the group.
+ * @memberof onion_sse_group_t
+ * 
+ * It is encoded once, and queued to each, as the policy of the group says for the slow ones. If it has an 
+ * id, it is also kept at the history, if any. It does not write to the connections, so it never waits for 
+ * them. It can be called from any thread.
+ * 
+ * @returns To how many subscribers it was queued, or -1 on error.
+ */
+int onion_sse_group_publish(onion_sse_group *group, const char *id, const char *event, const char *data, size_t len){
+	onion_sse_event *ev=onion_sse_event_new(id, event, data, len);
+	if (!ev)
+		return -1;
+	
+	int n=0, i;
+	pthread_mutex_lock(&group->mutex);
+	if (id && group->history_size){
+		if (group->history_count==group->history_size){ // The oldest goes
+			onion_sse_event_release(group->history[group->history_start]);
+			group->history_start=(group->history_start+1)%group->history_size;
+			group->history_count--;
+		}
+		__sync_fetch_and_add(&ev->refcount, 1);
+		group->history[(group->history_start+group->history_count++)%group->history_size]=ev;
+	}
+	for (i=0;i<group->count;i++){
+		onion_sse *sse=group->members[i]->sse;
+		pthread_mutex_lock(&sse->mutex);
+		if (!sse->closed && sse->count>=group->max_queue){
+			if (group->policy==OSSE_GROUP_DISCONNECT){
+				ONION_WARNING("Server sent events subscriber is too slow, disconnecting it");
+				sse->closed=1;
+				if (sse->req) // Also out of a blocked write
+					shutdown(sse->req->connection.fd, SHUT_RDWR);
+				onion_sse_wake(sse);
+			}
+			if (group->policy!=OSSE_GROUP_DROP) // The old ones are not needed any more
+				onion_sse_queue_clear(sse);
+		}
+		if (sse->count<group->max_queue && onion_sse_enqueue(sse, ev)==0)
+			n++;
+		pthread_mutex_unlock(&sse->mutex);
+	}
+	pthread_mutex_unlock(&group->mutex);
+	onion_sse_event_release(ev);
+	return n;
+}
+
+/// Subscribers of the group
+int onion_sse_group_count(onion_sse_group *group){
+	pthread_mutex_lock(&group->mutex);
+	int n=group->count;
+	pthread_mutex_unlock(&group->mutex);
+	return n;
+}
@@ -0,0 +1,78 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_SSE_H
+#define ONION_SSE_H
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#include <stddef.h>
+#include "types.h"
+
+/// Default ms between the keepalive comments of an idle stream. @see onion_sse_set_keepalive
+#define ONION_SSE_KEEPALIVE 15000
+
+/// Starts the event stream as the answer of this request. The handler returns OCS_SUSPENDED then.
+onion_sse *onion_sse_new(onion_request *req, onion_response *res);
+/// Another reference, to use the stream from other threads, until onion_sse_free.
+void onion_sse_ref(onion_sse *sse);
+/// Releases a reference; the connection has its own, until it is closed.
+void onion_sse_free(onion_sse *sse);
+
+/// The Last-Event-ID the client reconnected with, or NULL.
+const char *onion_sse_get_last_event_id(onion_sse *sse);
+/// Sends a comment when nothing was sent for interval_ms, or never if 0. Before the handler returns.
+void onion_sse_set_keepalive(onion_sse *sse, int interval_ms);
+/// Tells the client how long to wait before reconnecting.
+int onion_sse_set_retry(onion_sse *sse, int retry_ms);
+/// Queues an event. id and event may be NULL. From any thread.
+int onion_sse_send(onion_sse *sse, const char *id, const char *event, const char *data, size_t len);
+/// Ends the stream after the queued events.
+void onion_sse_close(onion_sse *sse);
+
+onion_sse_group *onion_sse_group_new(onion_sse_group_policy policy, int max_queue);
+void onion_sse_group_free(onion_sse_group *group);
+/// Keeps the last n events with id, to replay them to the streams that subscribe with an older Last-Event-ID.
+void onion_sse_group_set_history(onion_sse_group *group, int n);
+int onion_sse_group_subscribe(onion_sse_group *group, onion_sse *sse);
+int onion_sse_group_unsubscribe(onion_sse_group *group, onion_sse *sse);
+/// Encodes the event once, and queues it to all the subscribers. Returns to how many.
+int onion_sse_group_publish(onion_sse_group *group, const char *id, const char *event, const char *data, size_t len);
+int onion_sse_group_count(onion_sse_group *group);
+
+/// The handler suspended the request; the stream starts to be written. Used by the request.
+void onion_sse_suspended(onion_sse *sse);
+/// The connection of the stream is writable. Used by the listen point.
+int onion_sse_ready(onion_sse *sse);
+/// The request of the stream is done, or being freed. Used by the request.
+void onion_sse_detach(onion_sse *sse);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,254 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+#include "types_internal.h"
+#include "listen_point.h"
+#include "poller.h"
+#include "sessions.h"
+#include "admission.h"
+#include "workers.h"
+#include "log.h"
+
+/// Each server keeps this many copies of its counters, so threads seldom share a cache line.
+#define ONION_STATS_SHARDS 8
+
+/// Counters of a server, updated by some of the threads.
+struct onion_stats_shard_t{
+	unsigned long connections_opened;
+	unsigned long connections_closed;
+	unsigned long bytes_in;
+	unsigned long bytes_out;
+	unsigned long responses[ONION_STATS_CODES];
+	unsigned long phases[ONION_STATS_PHASES][ONION_STATS_PHASE_BUCKETS];
+	unsigned long phases_us[ONION_STATS_PHASES];
+}__attribute__((aligned(64)));
+
+const unsigned long onion_stats_phase_bounds[ONION_STATS_PHASE_BUCKETS-1]={ 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 
+	50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000 };
+
+const char *onion_stats_phase_names[ONION_STATS_PHASES]={ "tls", "headers", "body", "handler", "flush", "total" };
+
+/// The phases from and to which each one of onion_stats_phase is measured.
+static const onion_request_phase onion_stats_phase_limits[ONION_STATS_PHASES][2]={
+	{ OR_PHASE_ACCEPT, OR_PHASE_HANDSHAKE },
+	{ OR_PHASE_START, OR_PHASE_HEADERS },
+	{ OR_PHASE_HEADERS, OR_PHASE_HANDLER },
+	{ OR_PHASE_HANDLER, OR_PHASE_HANDLED },
+	{ OR_PHASE_HANDLED, OR_PHASE_END },
+	{ OR_PHASE_START, OR_PHASE_END },
+};
+
+static struct onion_stats_shard_t *onion_stats_shard(onion *server);
+static void onion_stats_poller(onion_poller *poller, onion_stats *stats);
+
+/// Shard of the counters of this thread, chosen at its first count.
+static __thread int onion_stats_thread_shard=-1;
+static int onion_stats_next_shard=0;
+
+/**
+ * @short Gets the counters of the server.
+ * @memberof onion_t
+ * 
+ * The counters of the connections, responses and bytes are kept at several shards, each updated by some 
+ * of the threads with relaxed atomics, and they are only summed here. The accept and poller counters 
+ * are the ones of the listen points and pollers, also of the private ones of each thread on O_REUSEPORT.
+ * The phase histograms are only counted with onion_set_request_timings.
+ * Rates, as accepts per second, are the difference of two calls.
+ */
+void onion_get_stats(onion *server, onion_stats *stats){
+	memset(stats, 0, sizeof(onion_stats));
+	int i, j;
+	if (server->stats){
+		unsigned long closed=0;
+		for (i=0;i<ONION_STATS_SHARDS;i++){
+			struct onion_stats_shard_t *shard=&server->stats[i];
+			stats->connections_total+=__atomic_load_n(&shard->connections_opened, __ATOMIC_RELAXED);
+			closed+=__atomic_load_n(&shard->connections_closed, __ATOMIC_RELAXED);
+			stats->bytes_in+=__atomic_load_n(&shard->bytes_in, __ATOMIC_RELAXED);
+			stats->bytes_out+=__atomic_load_n(&shard->bytes_out, __ATOMIC_RELAXED);
+			for (j=0;j<ONION_STATS_CODES;j++)
+				stats->responses[j]+=__atomic_load_n(&shard->responses[j], __ATOMIC_RELAXED);
+			int p;
+			for (p=0;p<ONION_STATS_PHASES;p++){
+				for (j=0;j<ONION_STATS_PHASE_BUCKETS;j++)
+					stats->phases[p][j]+=__atomic_load_n(&shard->phases[p][j], __ATOMIC_RELAXED);
+				stats->phases_us[p]+=__atomic_load_n(&shard->phases_us[p], __ATOMIC_RELAXED);
+			}
+		}
+		stats->connections=(stats->connections_total>closed) ? stats->connections_total-closed : 0;
+		for (j=0;j<ONION_STATS_CODES;j++)
+			stats->requests+=stats->responses[j];
+	}
+	
+	onion_listen_point **lp;
+	unsigned long wakeups, accepted;
+	for (lp=server->listen_points;lp && *lp;lp++){
+		onion_listen_point_get_accept_stats(*lp, &wakeups, &accepted, NULL);
+		stats->accept_wakeups+=wakeups;
+		stats->accepted+=accepted;
+	}
+	for (lp=server->spare_listen_points;lp && *lp;lp++){
+		onion_listen_point_get_accept_stats(*lp, &wakeups, &accepted, NULL);
+		stats->accept_wakeups+=wakeups;
+		stats->accepted+=accepted;
+	}
+	onion_stats_poller(server->poller, stats);
+#ifdef HAVE_PTHREADS
+	for (lp=server->thread_listen_points;lp && *lp;lp++){
+		onion_listen_point_get_accept_stats(*lp, &wakeups, &accepted, NULL);
+		stats->accept_wakeups+=wakeups;
+		stats->accepted+=accepted;
+	}
+	onion_poller **poller;
+	for (poller=server->thread_pollers;poller && *poller;poller++)
+		onion_stats_poller(*poller, stats);
+	if (server->workers){
+		onion_workers_stats workers;
+		onion_workers_get_stats(server->workers, &workers);
+		stats->workers=workers.threads;
+		stats->workers_busy=workers.busy;
+		stats->workers_queued=workers.queued;
+		stats->workers_peak=workers.peak;
+		stats->workers_started=workers.started;
+		stats->workers_retired=workers.retired;
+	}
+#endif
+	if (server->sessions)
+		stats->sessions=onion_sessions_count(server->sessions);
+	if (server->process_pids){
+		int i;
+		for (i=0;i<server->nprocesses;i++){
+			if (server->process_pids[i]>0)
+				stats->processes++;
+		}
+	}
+	stats->process_respawns=server->process_respawns;
+	if (server->admission){
+		onion_admission_get_stats(server->admission, &stats->connections_rejected, &stats->requests_rejected, &stats->requests_shed);
+		onion_admission_get_memory_stats(server->admission, &stats->memory_budget, &stats->memory_sheds);
+	}
+	for (i=0;i<ONION_MEMORY_TAGS;i++){
+		stats->memory[i]=onion_memory_get(i);
+		stats->memory_total+=stats->memory[i];
+	}
+}
+
+/// Adds the event counters and profile of the poller.
+static void onion_stats_poller(onion_poller *poller, onion_stats *stats){
+	unsigned long wakeups, events;
+	onion_poller_get_event_stats(poller, &wakeups, &events);
+	stats->poller_wakeups+=wakeups;
+	stats->poller_events+=events;
+	onion_poller_profile profile;
+	onion_poller_get_profile(poller, &profile);
+	stats->poller_wait_us+=profile.wait_us;
+	stats->poller_callbacks_us+=profile.callbacks_us;
+	stats->poller_stalls+=profile.stalls;
+	if (profile.max_callback_us>stats->poller_max_callback_us)
+		stats->poller_max_callback_us=profile.max_callback_us;
+}
+
+/**
+ * @short Allocates the counters of a server, all at 0.
+ * 
+ * They are at shared memory, so the prefork processes count at the same ones. @see onion_set_processes
+ */
+struct onion_stats_shard_t *onion_stats_shards_new(){
+	void *shards=mmap(NULL, sizeof(struct onion_stats_shard_t)*ONION_STATS_SHARDS, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (shards==MAP_FAILED){
+		ONION_ERROR("Could not allocate the server stats");
+		return NULL;
+	}
+	return shards;
+}
+
+void onion_stats_shards_free(struct onion_stats_shard_t *shards){
+	if (shards)
+		munmap(shards, sizeof(struct onion_stats_shard_t)*ONION_STATS_SHARDS);
+}
+
+/// At a new prefork process, its threads start at other shards than the ones of the other processes.
+void onion_stats_set_process(int index){
+	onion_stats_thread_shard=-1;
+	onion_stats_next_shard=index*4;
+}
+
+/// The shard of the calling thread, or NULL if the server has no stats.
+static struct onion_stats_shard_t *onion_stats_shard(onion *server){
+	if (!server || !server->stats)
+		return NULL;
+	if (onion_stats_thread_shard<0)
+		onion_stats_thread_shard=__atomic_fetch_add(&onion_stats_next_shard, 1, __ATOMIC_RELAXED)%ONION_STATS_SHARDS;
+	return &server->stats[onion_stats_thread_shard];
+}
+
+void onion_stats_connection(onion *server, int open){
+	struct onion_stats_shard_t *shard=onion_stats_shard(server);
+	if (shard)
+		__atomic_fetch_add(open ? &shard->connections_opened : &shard->connections_closed, 1, __ATOMIC_RELAXED);
+}
+
+void onion_stats_response(onion *server, int code, size_t bytes){
+	struct onion_stats_shard_t *shard=onion_stats_shard(server);
+	if (!shard)
+		return;
+	__atomic_fetch_add(&shard->responses[(code>0 && code<ONION_STATS_CODES) ? code : 0], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard->bytes_out, bytes, __ATOMIC_RELAXED);
+}
+
+void onion_stats_bytes_in(onion *server, size_t bytes){
+	struct onion_stats_shard_t *shard=onion_stats_shard(server);
+	if (shard)
+		__atomic_fetch_add(&shard->bytes_in, bytes, __ATOMIC_RELAXED);
+}
+
+void onion_stats_timings(onion *server, const int64_t *timings){
+	struct onion_stats_shard_t *shard=onion_stats_shard(server);
+	if (!shard)
+		return;
+	int p;
+	for (p=0;p<ONION_STATS_PHASES;p++){
+		int64_t us=onion_stats_phase_duration(timings, p);
+		if (us<0)
+			continue;
+		int b=0;
+		while (b<ONION_STATS_PHASE_BUCKETS-1 && us>onion_stats_phase_bounds[b])
+			b++;
+		__atomic_fetch_add(&shard->phases[p][b], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&shard->phases_us[p], us, __ATOMIC_RELAXED);
+	}
+}
+
+int64_t onion_stats_phase_duration(const int64_t *timings, onion_stats_phase phase){
+	int64_t from=timings[onion_stats_phase_limits[phase][0]], to=timings[onion_stats_phase_limits[phase][1]];
+	if (!from || !to || to<from)
+		return -1;
+	return to-from;
+}
@@ -0,0 +1,126 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_STATS_H
+#define ONION_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "types.h"
+#include "memory.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/// Status codes counted one by one; the ones out of range are counted at 0.
+#define ONION_STATS_CODES 600
+
+/// Buckets of the phase histograms: one for each of onion_stats_phase_bounds, and one for the higher ones.
+#define ONION_STATS_PHASE_BUCKETS 17
+
+/**
+ * @short Durations of the phases of the requests, from their onion_request_get_timings.
+ * @see onion_set_request_timings
+ */
+enum onion_stats_phase_e{
+	ONION_STATS_PHASE_TLS=0,   ///< From the accept to the end of the TLS handshake.
+	ONION_STATS_PHASE_HEADERS, ///< From the first byte to the end of the headers.
+	ONION_STATS_PHASE_BODY,    ///< From the end of the headers to the handler, reading the body.
+	ONION_STATS_PHASE_HANDLER, ///< At the handler, with the wait for a worker, if any.
+	ONION_STATS_PHASE_FLUSH,   ///< From the end of the handler to the end of the response.
+	ONION_STATS_PHASE_TOTAL,   ///< From the first byte to the end of the response.
+	ONION_STATS_PHASES,        ///< Number of phases, not a phase.
+};
+
+typedef enum onion_stats_phase_e onion_stats_phase;
+
+/// Upper bounds of the buckets of the phase histograms, in microseconds.
+extern const unsigned long onion_stats_phase_bounds[ONION_STATS_PHASE_BUCKETS-1];
+/// Names of the phases, as tls or handler, for the access log and the metrics.
+extern const char *onion_stats_phase_names[ONION_STATS_PHASES];
+
+/// Counters of a server, summed from all its threads. @see onion_get_stats
+typedef struct onion_stats_t{
+	unsigned long connections;        ///< Open now
+	unsigned long connections_total;  ///< Opened since the server was created
+	unsigned long accepted;           ///< Connections accepted by the listen points at the pollers
+	unsigned long accept_wakeups;     ///< Times the listen sockets were ready
+	unsigned long poller_wakeups;     ///< Of all the pollers
+	unsigned long poller_events;      ///< Events handled at those wakeups
+	unsigned long poller_wait_us;     ///< Waiting for events, with onion_set_poller_profiling
+	unsigned long poller_callbacks_us; ///< Running the callbacks of the events, with onion_set_poller_profiling
+	unsigned long poller_max_callback_us; ///< The longest of those callbacks
+	unsigned long poller_stalls;      ///< Callbacks over the stall threshold
+	unsigned long requests;           ///< Responses sent, the sum of responses
+	unsigned long responses[ONION_STATS_CODES]; ///< By status code
+	unsigned long bytes_in;           ///< Request bytes read, with their headers
+	unsigned long bytes_out;          ///< Response body bytes sent
+	int sessions;                     ///< At the session store
+	unsigned long phases[ONION_STATS_PHASES][ONION_STATS_PHASE_BUCKETS]; ///< Requests by the bucket of the duration of each phase, not cumulative
+	unsigned long phases_us[ONION_STATS_PHASES]; ///< Sum of the durations of each phase
+	int processes;                    ///< Prefork processes running, at the supervisor. @see onion_set_processes
+	unsigned long process_respawns;   ///< Prefork processes respawned as they exited
+	unsigned long connections_rejected; ///< Over the connection limits. @see onion_set_connection_limits
+	unsigned long requests_rejected;  ///< Over the in flight limit. @see onion_set_max_inflight
+	unsigned long requests_shed;      ///< Late for too long. @see onion_set_load_shedding
+	int workers;                      ///< Worker threads running now. @see onion_set_workers
+	int workers_busy;                 ///< Of them, running a handler
+	int workers_queued;               ///< Requests waiting for a worker
+	int workers_peak;                 ///< Most worker threads at a time
+	unsigned long workers_started;    ///< Started as all were busy. @see onion_set_workers_autoscale
+	unsigned long workers_retired;    ///< Retired as idle
+	size_t memory[ONION_MEMORY_TAGS]; ///< Bytes allocated by each subsystem, of this process. @see onion_memory_get
+	size_t memory_total;              ///< Of all of them
+	size_t memory_budget;             ///< @see onion_set_memory_budget
+	unsigned long memory_sheds;       ///< Times it was over the budget, and evicted sessions and caches
+}onion_stats;
+
+/// Gets the counters of the server, summed from all the threads.
+void onion_get_stats(onion *server, onion_stats *stats);
+
+/// Counters of each thread of a server. Used by onion_new.
+struct onion_stats_shard_t *onion_stats_shards_new();
+/// Frees them. Used by onion_free.
+void onion_stats_shards_free(struct onion_stats_shard_t *shards);
+/// Spreads the threads of a new prefork process over other shards. Used by onion_listen.
+void onion_stats_set_process(int index);
+/// Counts a connection opened, or closed if open is 0.
+void onion_stats_connection(onion *server, int open);
+/// Counts a response, with the bytes of its body.
+void onion_stats_response(onion *server, int code, size_t bytes);
+/// Counts the request bytes read.
+void onion_stats_bytes_in(onion *server, size_t bytes);
+/// Counts the durations of the phases of a finished request.
+void onion_stats_timings(onion *server, const int64_t *timings);
+/// Duration of the phase, from the timings of a request, in microseconds, or -1 if not known.
+int64_t onion_stats_phase_duration(const int64_t *timings, onion_stats_phase phase);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
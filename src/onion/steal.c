@@ -0,0 +1,235 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "log.h"
+#include "poller.h"
+#include "steal.h"
+
+/// A job at a queue
+typedef struct{
+	void (*f)(void *);
+	void *data;
+}onion_steal_job;
+
+/**
+ * @short The jobs of a poller thread, as a bounded Chase-Lev deque.
+ * 
+ * Only its thread pushes and pops, at the bottom, without locks; the other threads steal from the top, 
+ * with a compare and swap on it.
+ */
+typedef struct{
+	int64_t top;               ///< Next job to steal. Atomic.
+	char pad[64-sizeof(int64_t)]; ///< So the thieves do not bounce the cache line of bottom.
+	int64_t bottom;            ///< Where the next job is pushed. Written only by the thread of the queue.
+	onion_steal_job *jobs;     ///< Circular buffer of mask+1 jobs
+	int64_t mask;
+	onion_poller *poller;
+	struct onion_steal_t *steal;
+	int next_peer;             ///< Where to start looking for an idle peer to wake
+	char idle;                 ///< Not running jobs, nor woken up to steal. Atomic.
+}onion_steal_queue;
+
+struct onion_steal_t{
+	int nqueues;
+	onion_steal_queue *queues;
+};
+
+/// Set while this thread runs a job, so that the jobs it queues, as the next pipelined request, run right away.
+static __thread int onion_steal_running=0;
+
+/// Takes the newest job of the queue. Only at the thread of the queue.
+static int onion_steal_pop(onion_steal_queue *q, onion_steal_job *job){
+	int64_t b=__atomic_load_n(&q->bottom, __ATOMIC_RELAXED)-1;
+	__atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t t=__atomic_load_n(&q->top, __ATOMIC_RELAXED);
+	if (t>b){ // Empty
+		__atomic_store_n(&q->bottom, b+1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	*job=q->jobs[b&q->mask];
+	if (t==b){ // The last one, races with the thieves
+		int won=__atomic_compare_exchange_n(&q->top, &t, t+1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+		__atomic_store_n(&q->bottom, b+1, __ATOMIC_RELAXED);
+		return won;
+	}
+	return 1;
+}
+
+/// Takes the oldest job of the queue. From any thread.
+static int onion_steal_take(onion_steal_queue *q, onion_steal_job *job){
+	for(;;){
+		int64_t t=__atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		int64_t b=__atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+		if (t>=b)
+			return 0;
+		// May be overwritten by a push once top moves, but then the swap fails and it is read again.
+		job->f=__atomic_load_n(&q->jobs[t&q->mask].f, __ATOMIC_RELAXED);
+		job->data=__atomic_load_n(&q->jobs[t&q->mask].data, __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&q->top, &t, t+1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			return 1;
+	}
+}
+
+/// Takes the oldest job of some other queue, starting by the next one.
+static int onion_steal_from_peers(onion_steal_queue *q, onion_steal_job *job){
+	onion_steal *s=q->steal;
+	int i, self=q-s->queues;
+	for (i=1;i<s->nqueues;i++){
+		if (onion_steal_take(&s->queues[(self+i)%s->nqueues], job))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * @short Batch callback of each poller: runs the jobs of its queue, and then steals from the others.
+ * 
+ * Own jobs first, newest first, as their data is still at the caches; the stolen ones are the oldest.
+ */
+static void onion_steal_run(void *_q){
+	onion_steal_queue *q=_q;
+	onion_steal_job job;
+	onion_steal_running=1;
+	for(;;){
+		while (onion_steal_pop(q, &job))
+			job.f(job.data);
+		if (!onion_steal_from_peers(q, &job))
+			break;
+		job.f(job.data);
+	}
+	onion_steal_running=0;
+	__atomic_store_n(&q->idle, 1, __ATOMIC_RELEASE);
+}
+
+/// Wakes up one idle peer of q, if any, to steal from it.
+static void onion_steal_wake_peer(onion_steal_queue *q){
+	onion_steal *s=q->steal;
+	int i;
+	for (i=0;i<s->nqueues;i++){
+		onion_steal_queue *peer=&s->queues[q->next_peer];
+		q->next_peer=(q->next_peer+1)%s->nqueues;
+		if (peer!=q && __atomic_exchange_n(&peer->idle, 0, __ATOMIC_ACQ_REL)){
+			onion_poller_wakeup(peer->poller);
+			return;
+		}
+	}
+}
+
+/**
+ * @short Creates the queues of a group of pollers, and sets their batch callback
+ * @memberof onion_steal_t
+ * 
+ * @param pollers Each polled by only one thread.
+ * @param npollers Number of pollers
+ * @param max_queue Maximum number of jobs at each queue, rounded up to a power of 2.
+ * @returns The queues, or NULL if the pollers do not have batch callbacks.
+ */
+onion_steal *onion_steal_new(onion_poller **pollers, int npollers, int max_queue){
+	int64_t size=1;
+	while (size<max_queue)
+		size<<=1;
+	onion_steal *s=calloc(1, sizeof(onion_steal));
+	s->nqueues=npollers;
+	s->queues=calloc(npollers, sizeof(onion_steal_queue));
+	int i;
+	for (i=0;i<npollers;i++){
+		onion_steal_queue *q=&s->queues[i];
+		q->jobs=malloc(sizeof(onion_steal_job)*size);
+		q->mask=size-1;
+		q->poller=pollers[i];
+		q->steal=s;
+		q->next_peer=(i+1)%npollers;
+		q->idle=1;
+		if (onion_poller_set_batch_callback(pollers[i], onion_steal_run, q)<0){
+			ONION_WARNING("Work stealing not supported by this poller");
+			free(q->jobs);
+			s->nqueues=i;
+			onion_steal_free(s);
+			return NULL;
+		}
+	}
+	ONION_DEBUG("Work stealing among %d pollers, queues of %d", npollers, (int)size);
+	return s;
+}
+
+/**
+ * @short Runs the pending jobs at this thread, and frees the queues
+ * @memberof onion_steal_t
+ * 
+ * The pollers must be stopped, and their batch callbacks are removed.
+ */
+void onion_steal_free(onion_steal *s){
+	onion_steal_job job;
+	int i;
+	onion_steal_running=1;
+	for (i=0;i<s->nqueues;i++){
+		while (onion_steal_take(&s->queues[i], &job))
+			job.f(job.data);
+	}
+	onion_steal_running=0;
+	for (i=0;i<s->nqueues;i++){
+		onion_poller_set_batch_callback(s->queues[i].poller, NULL, NULL);
+		free(s->queues[i].jobs);
+	}
+	free(s->queues);
+	free(s);
+}
+
+/**
+ * @short Adds a job to the queue of that poller
+ * @memberof onion_steal_t
+ * 
+ * Only from the thread of that poller, at its callbacks. The job runs after the current batch of
+ * events, at this thread or at an idle one that steals it. When there are more jobs waiting, an idle
+ * peer is woken up to steal them.
+ * 
+ * @returns 0 if ok, <0 if the queue is full, the poller is not of the group, or this is a job already;
+ * then the job is not run.
+ */
+int onion_steal_push(onion_steal *s, onion_poller *poller, void (*f)(void *), void *data){
+	if (onion_steal_running)
+		return -1;
+	int i;
+	for (i=0;i<s->nqueues && s->queues[i].poller!=poller;i++);
+	if (i==s->nqueues)
+		return -1;
+	onion_steal_queue *q=&s->queues[i];
+	int64_t b=__atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+	int64_t t=__atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+	if (b-t>q->mask)
+		return -1;
+	__atomic_store_n(&q->jobs[b&q->mask].f, f, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->jobs[b&q->mask].data, data, __ATOMIC_RELAXED);
+	__atomic_store_n(&q->bottom, b+1, __ATOMIC_RELEASE);
+	if (b>t) // More than this one waiting
+		onion_steal_wake_peer(q);
+	return 0;
+}
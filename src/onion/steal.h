@@ -0,0 +1,56 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+
+#ifndef ONION_STEAL_H
+#define ONION_STEAL_H
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/**
+ * @struct onion_steal_t
+ * @short Per poller thread queues of jobs, that idle threads steal from the busy ones.
+ *
+ * Internal. Used to balance the handlers among the private pollers of O_REUSEPORT mode.
+ */
+struct onion_steal_t;
+typedef struct onion_steal_t onion_steal;
+
+/// Creates a queue of max_queue jobs for each of the npollers pollers, each polled by its own thread.
+onion_steal *onion_steal_new(onion_poller **pollers, int npollers, int max_queue);
+/// Runs the pending jobs at this thread, and frees the queues. The pollers must be stopped.
+void onion_steal_free(onion_steal *s);
+/// Adds a job to the queue of that poller, from its thread. Returns <0 if it can not be queued.
+int onion_steal_push(onion_steal *s, onion_poller *poller, void (*f)(void *), void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
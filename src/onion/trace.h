@@ -0,0 +1,57 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_TRACE_H
+#define ONION_TRACE_H
+
+/**
+ * @short Static tracepoints (USDT), for SystemTap, bpftrace or perf, at the onion provider.
+ * 
+ * Internal. With sys/sdt.h at build time (HAVE_USDT), each ONION_TRACE is a nop instruction plus a note 
+ * at the ELF, that the tracers patch only while attached, as:
+ * 
+ *   bpftrace -e 'usdt:/usr/lib/libonion.so:onion:handler_exit { printf("%d %s %d\n", arg0, str(arg1), arg2); }'
+ * 
+ * Without it they are not compiled in, and the arguments are not evaluated. The probes, and their arguments:
+ * 
+ * - accept(fd) -- A connection was accepted.
+ * - close(fd) -- A connection socket is closed.
+ * - request_parsed(fd, path, method) -- The headers of a request were parsed; method as at onion_request_methods.
+ * - handler_enter(fd, path) and handler_exit(fd, path, status) -- Around the handler; status as onion_connection_status.
+ * - response_flush(fd, code, bytes, end) -- Response bytes written; end at the last write.
+ * - poller_wakeup(pollfd, events, timeout) -- The poller wait returned, with that many events; timeout in ms.
+ * - slot_timeout(fd) -- A poller slot timed out, and is removed.
+ * - websocket_frame_in(fd, opcode, length) and websocket_frame_out(fd, opcode, length) -- A websocket frame header.
+ * 
+ * Paths are char * into the request, valid while at the probe.
+ */
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+#define ONION_TRACE(name, ...) STAP_PROBEV(onion, name, __VA_ARGS__)
+#else
+#define ONION_TRACE(name, ...) do{}while(0)
+#endif
+
+#endif
@@ -0,0 +1,243 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* fwrite_unlocked */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "traffic_record.h"
+#include "types_internal.h"
+#include "request.h"
+#include "log.h"
+
+/// Buffer of the file; entries are written as they come, and the file is written when full.
+#define ONION_TRAFFIC_RECORD_BUFFER_SIZE (256*1024)
+
+/**
+ * @short Record of the requests read by a server, with their timing, to replay them later.
+ * 
+ * Each entry is its type byte, then the connection number and the microseconds since the previous entry, 
+ * as varints, and then its data: the length and the bytes for OTR_DATA, the status and the no body byte 
+ * for OTR_RESPONSE, nothing for OTR_CLOSE. The threads write them with the file locked, so they are in 
+ * time order.
+ */
+struct onion_traffic_record_t{
+	FILE *file;
+	char *buffer;
+	uint64_t last_us;      ///< Time of the last entry, at the file lock.
+	int64_t start_us;      ///< Monotonic us when the record started.
+	uint64_t connections;  ///< Numbers given. Atomic.
+};
+
+static int64_t onion_traffic_record_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+/**
+ * @short Creates a traffic record at that file.
+ * @memberof onion_traffic_record_t
+ * 
+ * @see onion_set_traffic_record
+ */
+onion_traffic_record *onion_traffic_record_new(const char *path){
+	FILE *file=fopen(path, "we");
+	if (!file){
+		ONION_ERROR("Could not open the traffic record %s", path);
+		return NULL;
+	}
+	onion_traffic_record *record=calloc(1, sizeof(onion_traffic_record));
+	record->file=file;
+	record->buffer=malloc(ONION_TRAFFIC_RECORD_BUFFER_SIZE);
+	setvbuf(file, record->buffer, _IOFBF, ONION_TRAFFIC_RECORD_BUFFER_SIZE);
+	fwrite(ONION_TRAFFIC_RECORD_MAGIC, 1, sizeof(ONION_TRAFFIC_RECORD_MAGIC)-1, file);
+	record->start_us=onion_traffic_record_now();
+	return record;
+}
+
+/**
+ * @short Writes what is pending and frees the record.
+ * @memberof onion_traffic_record_t
+ */
+void onion_traffic_record_free(onion_traffic_record *record){
+	if (fclose(record->file)!=0)
+		ONION_ERROR("Could not write all the traffic record");
+	free(record->buffer);
+	free(record);
+}
+
+static void onion_traffic_record_write_varint(FILE *file, uint64_t v){
+	while (v>=0x80){
+		putc_unlocked((v&0x7F)|0x80, file);
+		v>>=7;
+	}
+	putc_unlocked(v, file);
+}
+
+/// Starts an entry, with the file locked until onion_traffic_record_entry_end.
+static void onion_traffic_record_entry_start(onion_traffic_record *record, onion_traffic_record_type type, uint64_t connection){
+	flockfile(record->file);
+	uint64_t now=onion_traffic_record_now()-record->start_us;
+	if (now<record->last_us) // Read before the lock by another thread
+		now=record->last_us;
+	putc_unlocked(type, record->file);
+	onion_traffic_record_write_varint(record->file, connection);
+	onion_traffic_record_write_varint(record->file, now-record->last_us);
+	record->last_us=now;
+}
+
+static void onion_traffic_record_entry_end(onion_traffic_record *record){
+	funlockfile(record->file);
+}
+
+/**
+ * @short Records the bytes read from the connection of the request. 
+ * @memberof onion_traffic_record_t
+ * 
+ * The connection gets its number at its first bytes.
+ */
+void onion_traffic_record_data(onion_traffic_record *record, onion_request *req, const char *data, size_t length){
+	if (!req->connection.record_id)
+		req->connection.record_id=__sync_add_and_fetch(&record->connections, 1);
+	onion_traffic_record_entry_start(record, OTR_DATA, req->connection.record_id);
+	onion_traffic_record_write_varint(record->file, length);
+	fwrite_unlocked(data, 1, length, record->file);
+	onion_traffic_record_entry_end(record);
+}
+
+/**
+ * @short Records that the response was sent, with its status.
+ * @memberof onion_traffic_record_t
+ * 
+ * Only for connections with recorded data, so not for HTTP/2 streams.
+ */
+void onion_traffic_record_response(onion_traffic_record *record, onion_response *res){
+	onion_request *req=res->request;
+	if (!req->connection.record_id)
+		return;
+	onion_traffic_record_entry_start(record, OTR_RESPONSE, req->connection.record_id);
+	onion_traffic_record_write_varint(record->file, res->code);
+	putc_unlocked((req->flags&OR_METHODS)==OR_HEAD, record->file);
+	onion_traffic_record_entry_end(record);
+}
+
+/**
+ * @short Records that the connection is closed.
+ * @memberof onion_traffic_record_t
+ */
+void onion_traffic_record_close(onion_traffic_record *record, onion_request *req){
+	if (!req->connection.record_id)
+		return;
+	onion_traffic_record_entry_start(record, OTR_CLOSE, req->connection.record_id);
+	onion_traffic_record_entry_end(record);
+}
+
+/**
+ * @short Opens a traffic record to read it.
+ * @memberof onion_traffic_record_t
+ * 
+ * @returns The file, after the header, to read with onion_traffic_record_read, or NULL if it is not a traffic record.
+ */
+FILE *onion_traffic_record_open(const char *path){
+	FILE *file=fopen(path, "re");
+	if (!file){
+		ONION_ERROR("Could not open the traffic record %s", path);
+		return NULL;
+	}
+	char magic[sizeof(ONION_TRAFFIC_RECORD_MAGIC)-1];
+	if (fread(magic, 1, sizeof(magic), file)!=sizeof(magic) || memcmp(magic, ONION_TRAFFIC_RECORD_MAGIC, sizeof(magic))!=0){
+		ONION_ERROR("%s is not a traffic record of this version", path);
+		fclose(file);
+		return NULL;
+	}
+	return file;
+}
+
+static int onion_traffic_record_read_varint(FILE *file, uint64_t *v){
+	int shift=0;
+	*v=0;
+	for(;;){
+		int c=getc(file);
+		if (c==EOF || shift>63)
+			return -1;
+		*v|=((uint64_t)(c&0x7F))<<shift;
+		if (!(c&0x80))
+			return 0;
+		shift+=7;
+	}
+}
+
+/**
+ * @short Reads the next entry of the record.
+ * @memberof onion_traffic_record_t
+ * 
+ * The entry has to be zeroed before the first read, as the times are kept relative to the previous one.
+ * 
+ * @returns 1 if read, 0 at the end of the file, -1 if it is not valid.
+ */
+int onion_traffic_record_read(FILE *file, onion_traffic_record_entry *entry){
+	int type=getc(file);
+	if (type==EOF)
+		return 0;
+	uint64_t delta, v;
+	if (type>OTR_CLOSE || onion_traffic_record_read_varint(file, &entry->connection)<0 || 
+			onion_traffic_record_read_varint(file, &delta)<0)
+		return -1;
+	entry->type=type;
+	entry->time_us+=delta;
+	entry->length=0;
+	entry->status=entry->no_body=0;
+	if (type==OTR_DATA){
+		if (onion_traffic_record_read_varint(file, &v)<0)
+			return -1;
+		if (v>entry->size){
+			char *data=realloc(entry->data, v);
+			if (!data)
+				return -1;
+			entry->data=data;
+			entry->size=v;
+		}
+		entry->length=v;
+		if (fread(entry->data, 1, v, file)!=v)
+			return -1;
+	}
+	else if (type==OTR_RESPONSE){
+		if (onion_traffic_record_read_varint(file, &v)<0)
+			return -1;
+		entry->status=v;
+		int no_body=getc(file);
+		if (no_body==EOF)
+			return -1;
+		entry->no_body=no_body;
+	}
+	return 1;
+}
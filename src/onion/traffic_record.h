@@ -0,0 +1,80 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_TRAFFIC_RECORD_H
+#define ONION_TRAFFIC_RECORD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/// First bytes of a traffic record file; the last one is the format version.
+#define ONION_TRAFFIC_RECORD_MAGIC "ONIONTR\x01"
+
+/// What an entry of a traffic record is.
+typedef enum onion_traffic_record_type_e{
+	OTR_DATA=0,      ///< Bytes read from the client, as they came.
+	OTR_RESPONSE=1,  ///< A response was sent, to the data before it.
+	OTR_CLOSE=2,     ///< The connection was closed.
+}onion_traffic_record_type;
+
+/// An entry read from a traffic record. @see onion_traffic_record_read
+typedef struct onion_traffic_record_entry_t{
+	onion_traffic_record_type type;
+	uint64_t connection;  ///< Number of the connection, from 1, in the order they were recorded first.
+	uint64_t time_us;     ///< Since the record started.
+	int status;           ///< Of OTR_RESPONSE.
+	int no_body;          ///< The OTR_RESPONSE had no body, whatever its headers say, as the answer to a HEAD.
+	char *data;           ///< Of OTR_DATA. Reused by the next reads; the caller frees it at the end.
+	size_t length;        ///< Of OTR_DATA.
+	size_t size;          ///< Allocated at data.
+}onion_traffic_record_entry;
+
+/// Creates a traffic record at that file, truncating it. NULL on error.
+onion_traffic_record *onion_traffic_record_new(const char *path);
+/// Writes what is pending and frees the record. No thread may be recording to it.
+void onion_traffic_record_free(onion_traffic_record *record);
+
+/// Records the bytes read from the connection of the request. Used by the listen point.
+void onion_traffic_record_data(onion_traffic_record *record, onion_request *req, const char *data, size_t length);
+/// Records that the response was sent. Used by the response.
+void onion_traffic_record_response(onion_traffic_record *record, onion_response *res);
+/// Records that the connection of the request is closed. Used by the request.
+void onion_traffic_record_close(onion_traffic_record *record, onion_request *req);
+
+/// Opens a traffic record to read it, checking its format. NULL on error.
+FILE *onion_traffic_record_open(const char *path);
+/// Reads the next entry. 1 if read, 0 at the end, -1 if the file is not valid.
+int onion_traffic_record_read(FILE *file, onion_traffic_record_entry *entry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -44,6 +44,12 @@ typedef struct onion_dict_t onion_dict;
  */
 struct onion_handler_t;
 typedef struct onion_handler_t onion_handler;
+/**
+ * @struct onion_handler_table_t
+ * @short The handlers of a tree, each level contiguous, as onion_listen freezes them. @see onion_handler_freeze
+ */
+struct onion_handler_table_t;
+typedef struct onion_handler_table_t onion_handler_table;
 
 /**
  * @struct onion_url_t
@@ -100,6 +106,10 @@ typedef struct onion_t onion;
 struct onion_sessions_t;
 typedef struct onion_sessions_t onion_sessions;
 
+/// Storage of the sessions. @see onion_sessions_set_backend
+struct onion_sessions_backend_t;
+typedef struct onion_sessions_backend_t onion_sessions_backend;
+
 
 /**
  * @struct onion_block_t
@@ -114,6 +124,40 @@ typedef struct onion_sessions_t onion_sessions;
 struct onion_block_t;
 typedef struct onion_block_t onion_block;
 
+/**
+ * @struct onion_rope_t
+ * @short Raw data as a list of fixed size segments
+ * 
+ * As onion_block, but appending never moves what is already written, so it does not copy on grow,
+ * and it is not contiguous. It is written as is, with writev, with onion_response_write_rope.
+ */
+struct onion_rope_t;
+typedef struct onion_rope_t onion_rope;
+
+/**
+ * @struct onion_shared_buffer_t
+ * @short Data owned elsewhere, with a reference count, that responses write without copying it.
+ * 
+ * It is released when the last reference is dropped, which may be after the response that wrote it ended,
+ * as the socket is writable again. @see onion_response_write_shared
+ */
+struct onion_shared_buffer_t;
+typedef struct onion_shared_buffer_t onion_shared_buffer;
+
+/**
+ * @struct onion_response_prerendered_t
+ * @short A whole response rendered once, written as is but for the Date, as of a health check. @see onion_response_prerender
+ */
+struct onion_response_prerendered_t;
+typedef struct onion_response_prerendered_t onion_response_prerendered;
+
+/**
+ * @struct onion_connection_info_t
+ * @short What a live connection is doing, as listed by onion_get_connections. Defined at request.h.
+ */
+struct onion_connection_info_t;
+typedef struct onion_connection_info_t onion_connection_info;
+
 /**
  * @struct onion_poller_t
  * @short Manages the polling on a set of file descriptors
@@ -147,6 +191,44 @@ typedef struct onion_poller_slot_t onion_poller_slot;
 struct onion_listen_point_t;
 typedef struct onion_listen_point_t onion_listen_point;
 
+/**
+ * @short Tuning of the listen sockets
+ * @struct onion_socket_options_t
+ * 
+ * Set at the server as defaults (onion_set_socket_options), or at each listen point 
+ * (onion_listen_point_set_socket_options). Fields at 0 get the server value, or if also 0, the
+ * system default. Accepted connections inherit TCP_NODELAY and the buffer sizes from the listen socket.
+ */
+struct onion_socket_options_t{
+	int backlog;      ///< Connections waiting to be accepted. Default SOMAXCONN.
+	int defer_accept; ///< TCP_DEFER_ACCEPT: wake up only when the request data arrives, waiting at most these seconds.
+	int fastopen;     ///< TCP_FASTOPEN: length of the queue of pending fast open connections.
+	int nodelay;      ///< TCP_NODELAY: do not delay small writes.
+	int busy_poll;    ///< SO_BUSY_POLL: microseconds to busy poll the device on blocking reads.
+	int sndbuf;       ///< SO_SNDBUF, in bytes.
+	int rcvbuf;       ///< SO_RCVBUF, in bytes.
+};
+typedef struct onion_socket_options_t onion_socket_options;
+
+/**
+ * @short Timeouts of each phase of the connections, in milliseconds
+ * @struct onion_timeouts_t
+ * 
+ * Set with onion_set_timeouts, and kept by the poller, so only on O_POLL/O_POOL modes. Fields at 0 of
+ * the times a connection waits for the client get the server timeout (onion_set_timeout); the others have
+ * no limit. <0 is no limit.
+ */
+struct onion_timeouts_t{
+	int header;         ///< To read all the headers of a request, from its first byte.
+	int body;           ///< Without any byte of the body.
+	int body_min_rate;  ///< Minimum average bytes per second of the body, from body ms after it starts. 0 none.
+	int handler;        ///< For a suspended request to be resumed, or the client connection is shut down. Also the deadline of each request (onion_request_is_cancelled). 0 none.
+	int write;          ///< Without any byte of the pending output written.
+	int keep_alive;     ///< Idle before each request, also the first one.
+	int max_requests;   ///< Requests per connection; the last one is answered with Connection: close. 0 none.
+};
+typedef struct onion_timeouts_t onion_timeouts;
+
 
 /**
  * @short Websocket data type, as returned by onion_websocket_new
@@ -162,13 +244,88 @@ typedef struct onion_listen_point_t onion_listen_point;
 struct onion_websocket_t;
 typedef struct onion_websocket_t onion_websocket;
 
+/**
+ * @struct onion_websocket_group_t
+ * @short Websockets subscribed to the same messages, that are framed once and queued to all. @see onion_websocket_group_publish
+ */
+struct onion_websocket_group_t;
+typedef struct onion_websocket_group_t onion_websocket_group;
+
+/**
+ * @struct onion_sse_t
+ * @short A Server-Sent Events stream, on a suspended request. @see onion_sse_new
+ */
+struct onion_sse_t;
+typedef struct onion_sse_t onion_sse;
+
+/**
+ * @struct onion_sse_group_t
+ * @short Event streams subscribed to the same events, that are encoded once and queued to all. @see onion_sse_group_publish
+ */
+struct onion_sse_group_t;
+typedef struct onion_sse_group_t onion_sse_group;
+
+/**
+ * @struct onion_file_cache_t
+ * @short Cache of open files and their metadata, for static files. @see onion_set_file_cache
+ */
+struct onion_file_cache_t;
+typedef struct onion_file_cache_t onion_file_cache;
+
+/**
+ * @struct onion_access_log_t
+ * @short Log of the requests, buffered per thread and written by a thread of its own. @see onion_set_access_log
+ */
+struct onion_access_log_t;
+typedef struct onion_access_log_t onion_access_log;
+
+/**
+ * @struct onion_traffic_record_t
+ * @short Record of the requests read, with their timing, to replay them. @see onion_set_traffic_record
+ */
+struct onion_traffic_record_t;
+typedef struct onion_traffic_record_t onion_traffic_record;
+
+/**
+ * @struct onion_file_cache_entry_t
+ * @short A path at the file cache: its fd, stat, ETag, MIME type and real path; or that it does not exist.
+ * @memberof onion_file_cache_t
+ */
+struct onion_file_cache_entry_t;
+typedef struct onion_file_cache_entry_t onion_file_cache_entry;
+
+/**
+ * @struct onion_client_t
+ * @short HTTP client with pooled keep alive connections, whose calls go on at a poller. @see onion_client_new
+ */
+struct onion_client_t;
+typedef struct onion_client_t onion_client;
+
+/**
+ * @struct onion_client_call_t
+ * @short A request of an onion_client, and then its response. @see onion_client_call_new
+ *
+ * A handler can fan out several calls and suspend its request; the callback of the last one answers and
+ * resumes it:
+ *
+ * @code
+ *   for (i=0;i<n;i++){
+ *     onion_client_call *call=onion_client_call_new(client, "GET", urls[i]);
+ *     onion_client_call_start(call, onion_request_get_poller(req), part_done, state);
+ *   }
+ *   return OCS_SUSPENDED;
+ * @endcode
+ */
+struct onion_client_call_t;
+typedef struct onion_client_call_t onion_client_call;
+
 /// Flags for the mode of operation of the onion server.
 enum onion_mode_e{
 	O_ONE=1,							///< Perform just one petition
 	O_ONE_LOOP=3,					///< Perform one petition at a time; lineal processing
 	O_THREADED=4,					///< Threaded processing, process many petitions at a time. Needs pthread support.
 	O_DETACH_LISTEN=8,		///< When calling onion_listen, it returns inmediatly and do the listening on another thread. Only if threading is available.
-	O_SYSTEMD=0x010,			///< Allow to start as systemd service. It try to start as if from systemd, but if not, start normally, so its "transparent".
+	O_SYSTEMD=0x010,			///< Allow to start as systemd service. It try to start as if from systemd, but if not, start normally, so its "transparent". Each passed socket goes to the listen point of its FileDescriptorName= (the port, or http or https) or of its port.
 /**
  * @short Use polling for request read, then as other flags say
  * 
@@ -182,6 +339,23 @@ enum onion_mode_e{
  */
 	O_POLL=0x020, ///< Use epoll for request read, then as other flags say.
   O_POOL=0x024, ///< Create some threads, and make them listen for ready file descriptors. It is O_POLL|O_THREADED
+/**
+ * @short On O_POOL mode, each thread has its own poller and its own listen sockets (SO_REUSEPORT).
+ * 
+ * The kernel distributes new connections among the threads, and each connection stays on the thread that 
+ * accepted it for its whole life, so there is no shared poller lock on the hot path. Only socket listen 
+ * points are sharded; custom listen points are only listened at the main thread. With systemd, the threads 
+ * use the extra sockets of the same address, as with ReusePort=, or else share the passed one.
+ */
+	O_REUSEPORT=0x040,
+/**
+ * @short Client sockets are non blocking.
+ *
+ * When the client can not accept more data, the rest of the response is queued and the connection
+ * slot waits for the socket to be writable; meanwhile the thread serves other connections. Only for
+ * O_POLL/O_POOL modes.
+ */
+	O_NONBLOCKING=0x080,
 	/// @{  @name From here on, they are internal. User may check them, but not set.
 	O_SSL_AVAILABLE=0x0100, ///< This is set by the library when creating the onion object, if SSL support is available.
 	O_SSL_ENABLED=0x0200,   ///< This is set by the library when setting the certificates, if SSL is available.
@@ -207,6 +381,8 @@ enum onion_connection_status_e{
 	OCS_CLOSE_CONNECTION=-2,
 	OCS_KEEP_ALIVE=3,
 	OCS_WEBSOCKET=4,
+	OCS_YIELD=5,            ///< The request was handed to another thread, that will resume it (onion_poller_slot_resume). Do not touch it.
+	OCS_SUSPENDED=6,        ///< The handler will answer later, maybe from another thread, and then call onion_request_resume. Only on O_POLL/O_POOL.
 	OCS_INTERNAL_ERROR=-500,
 	OCS_NOT_IMPLEMENTED=-501,
   OCS_FORBIDDEN=-502,
@@ -244,18 +420,90 @@ enum onion_websocket_opcode_e{
 	OWS_TEXT=1,
 	OWS_BINARY=2,
 	OWS_CONNECTION_CLOSE=8,
-	OWS_PING=0x0a,
-	OWS_PONG=0x0b
+	OWS_PING=0x09,
+	OWS_PONG=0x0a
 };
 
 typedef enum onion_websocket_opcode_e onion_websocket_opcode;
 
+/**
+ * @short What a websocket group does when a subscriber has too many frames queued, as it reads slower than they are published.
+ * @memberof onion_websocket_group_t
+ */
+enum onion_websocket_group_policy_e{
+	OWS_GROUP_DROP=0,        ///< The new frame is not queued for it.
+	OWS_GROUP_COALESCE=1,    ///< The queued frames are replaced by the new one, so it gets the latest.
+	OWS_GROUP_DISCONNECT=2,  ///< Its connection is closed.
+};
+
+typedef enum onion_websocket_group_policy_e onion_websocket_group_policy;
+
+/**
+ * @short What an event stream group does when a subscriber has too many events queued, as it reads slower than they are published.
+ * @memberof onion_sse_group_t
+ */
+enum onion_sse_group_policy_e{
+	OSSE_GROUP_DROP=0,        ///< The new event is not queued for it.
+	OSSE_GROUP_COALESCE=1,    ///< The queued events are replaced by the new one, so it gets the latest.
+	OSSE_GROUP_DISCONNECT=2,  ///< Its connection is closed.
+};
+
+typedef enum onion_sse_group_policy_e onion_sse_group_policy;
+
+/**
+ * @short Priority class of a route, that the worker threads run first. @see onion_url_set_priority
+ * 
+ * Each class has its own queue, and may have its own limit of running requests (onion_set_priority_class).
+ */
+enum onion_priority_class_e{
+	OPRIO_HIGH=0,      ///< As health checks, that must answer even under load.
+	OPRIO_NORMAL=1,    ///< The routes without a class.
+	OPRIO_LOW=2,       ///< As bulk exports, that may wait.
+	OPRIO_CLASSES=3,   ///< Number of classes
+};
+
+typedef enum onion_priority_class_e onion_priority_class;
+
 
 /// Signature of request handlers.
 typedef onion_connection_status (*onion_handler_handler)(void *privdata, onion_request *req, onion_response *res);
 /// Signature of free function of private data of request handlers
 typedef void (*onion_handler_private_data_free)(void *privdata);
 
+/// Called for each handler another one calls, with its route if it has one, or NULL. @see onion_handler_set_children
+typedef void (*onion_handler_child_f)(void *data, onion_handler *child, const char *route);
+/// Calls f for each handler that the handler with that private data calls. @see onion_handler_set_children
+typedef void (*onion_handler_children_f)(void *privdata, onion_handler_child_f f, void *data);
+
+/**
+ * @short A handler at an onion_handler_table.
+ *
+ * The handlers of a level follow each other, and the last one has last set.
+ */
+typedef struct onion_handler_entry_t{
+	onion_handler_handler handler;
+	void *priv_data;
+	onion_handler *origin; ///< The handler it was copied from
+	const char *route;     ///< As the parent calls it, or NULL
+	int depth;             ///< 0 at the root levels, 1 at their children...
+	char last;             ///< It is the last of its level
+}onion_handler_entry;
+
+/**
+ * @short Prototype of the request body callbacks
+ * @memberof onion_request_t
+ * 
+ * Called with each chunk of the body as it is read, and once more with NULL, 0 when the body is complete,
+ * just before the handler is called.
+ * 
+ * @returns OCS_NEED_MORE_DATA to keep reading, OCS_SUSPENDED to stop reading until onion_request_body_resume,
+ *          or an error (<0) to close the connection.
+ * @see onion_request_set_body_callback
+ */
+typedef onion_connection_status (*onion_request_body_callback)(void *privdata, onion_request *req, const char *data, size_t length);
+/// Called when the headers of a request with body are read, to set the body callback. @see onion_set_request_body_hook
+typedef void (*onion_request_body_hook)(void *privdata, onion_request *req);
+
 /**
  * @short Prototype for websocket callbacks
  * @memberof onion_websocket_t
@@ -275,6 +523,39 @@ typedef void (*onion_handler_private_data_free)(void *privdata);
  */
 typedef onion_connection_status (*onion_websocket_callback_t)(void *privdata, onion_websocket *ws, size_t data_ready_length);
 
+/**
+ * @short Called when the send queue of a websocket goes down to its low watermark, after it got to the high one.
+ * @memberof onion_websocket_t
+ * 
+ * It is called from the websocket loop, and may write again.
+ * 
+ * @see onion_websocket_set_send_queue
+ * @returns OCS_NEED_MORE_DATA to go on, or OCS_CLOSE_CONNECTION.
+ */
+typedef onion_connection_status (*onion_websocket_writable_callback_t)(void *privdata, onion_websocket *ws);
+
+/**
+ * @short What happened at a graceful stop. @see onion_set_drain
+ * @memberof onion_t
+ */
+struct onion_drain_report_t{
+	unsigned long connections; ///< Open when it stopped accepting
+	unsigned long drained;     ///< Of them, closed before the deadline
+	unsigned long forced;      ///< Still open at the deadline, closed by the server
+	int ms;                    ///< The drain took
+};
+
+typedef struct onion_drain_report_t onion_drain_report;
+
+/**
+ * @short Called when the connections are drained, or the deadline passed, at a graceful stop.
+ * @memberof onion_t
+ * 
+ * It is called at a poller thread, before onion_listen returns.
+ * 
+ * @see onion_set_drain
+ */
+typedef void (*onion_drain_callback)(void *privdata, onion *server, const onion_drain_report *report);
 
 #ifdef __cplusplus
 }
@@ -29,8 +29,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "types.h"
+#include "request.h"
 
 #ifdef HAVE_GNUTLS
 #include <gnutls/gnutls.h>
@@ -45,6 +47,20 @@ extern "C"{
 #endif
 
 #define ONION_REQUEST_BUFFER_SIZE 256
+/// Size of the blocks of the request arena. The first one is kept on keep alive. @see onion_request_alloc
+#define ONION_REQUEST_ARENA_BLOCK_SIZE 4096
+/// Maximum buffers at one onion_request_output_writev call that use the listen point writev.
+#define ONION_REQUEST_OUTPUT_IOV_MAX 8
+/// Max bytes of a queued file sent in one go, so one big download does not keep the poller thread from other connections.
+#define ONION_REQUEST_OUTPUT_FILE_SLICE (256*1024)
+/// Max bytes of the last response of a connection that closes kept to send with the close. @see onion_poller_send_close
+#define ONION_REQUEST_OUTPUT_LAST_MAX (64*1024)
+/// Bytes of a file read at once when it can not go by sendfile, as at HTTPS, so it goes to the listen point at few big writes. Reads are aligned to it.
+#define ONION_REQUEST_OUTPUT_FILE_BLOCK (64*1024)
+/// Name prefix of the PUT bodies kept at unnamed (O_TMPFILE) files, that are reached by their fd.
+#define ONION_SPOOL_UNNAMED "/proc/self/fd/"
+/// Maximum captures of the urls, :name values and regexp groups, a request keeps. @see onion_request_get_url_param
+#define ONION_REQUEST_MAX_URL_PARAMS 16
 #define ONION_RESPONSE_BUFFER_SIZE 1500
 
 
@@ -52,36 +68,148 @@ struct onion_dict_node_t;
 
 struct onion_dict_t{
 	struct onion_dict_node_t *root;
+	struct onion_dict_node_t *free_nodes; ///< Nodes of removed elements, kept to be reused, linked by right.
+	int nfree_nodes;
 #ifdef HAVE_PTHREADS
-	pthread_rwlock_t lock;
-	pthread_mutex_t refmutex;
+	pthread_rwlock_t lock;         ///< Only the writers take it with OD_RCU.
+	pthread_t writer;              ///< With OD_RCU, the thread that has the write lock from onion_dict_lock_write.
+	char writing;
+	struct onion_dict_retired_t *retired; ///< With OD_RCU, old tables and data, freed when no reader can see them.
 #endif
-	int refcount;
+	int refcount;                  ///< Changed atomically.
+	unsigned int generation;       ///< Changes at each add, remove and clear, to know if it was modified. @see onion_dict_generation
   int (*cmp)(const char *a, const char *b);
+	int flags;                     ///< OD_HASH, OD_SORTED, OD_FLAT and OD_RCU, from onion_dict_set_flags, and OD_FROZEN.
+	struct onion_dict_table_t *table; ///< With OD_HASH, the open addressing table used instead of the tree. Replaced as a whole with OD_RCU.
+	struct onion_dict_flat_t *flat; ///< With OD_FLAT, the sorted array of elements, while they are few. Kept at the pool.
+	int nflat;                     ///< Elements at flat.
+	struct onion_dict_frozen_t *frozen; ///< With OD_FROZEN, all the elements and strings at one block.
 };
 
 
+/// A systemd passed socket for the same listen point as another, as with ReusePort=.
+struct onion_spare_fd_t{
+	onion_listen_point *lp;
+	int fd; ///< -1 once used
+};
+
 struct onion_t{
 	int flags;
 	int timeout;   ///< Timeout in milliseconds
+	onion_timeouts timeouts; ///< Of each phase. @see onion_set_timeouts
+	char phase_timeouts;     ///< Some of timeouts is set.
+	int accept_budget; ///< Maximum connections accepted at each listen point per poller wakeup.
+	onion_socket_options socket_options; ///< Defaults for the listen points socket options.
+	int poller_max_events;       ///< Events per wakeup of all the pollers, or 0 for the default. @see onion_set_poller_max_events
+	int poller_max_events_limit; ///< Adaptive limit for poller_max_events
+	char poller_profiling;       ///< The pollers measure their wait and callback times. @see onion_set_poller_profiling
+	int poller_stall_ms;         ///< Stall threshold of the pollers, if profiling
+	char edge_triggered;         ///< Asked for edge triggered connections. @see onion_set_edge_triggered
+	char edge_connections;       ///< They are, as each poller has one thread. Set at onion_listen.
+	int header_slices;           ///< Requests keep the headers as slices of a per connection buffer. @see onion_set_header_slices
+	int idle_compact_ms;         ///< Keep alive connections idle this long free their request buffers, or <0 never. @see onion_set_idle_compact
+	char request_timings;        ///< Requests keep the time of each phase. @see onion_set_request_timings
+	size_t response_buffer_size; ///< Default buffer size of the responses. @see onion_set_response_buffer_size
+	onion_request_body_hook body_hook; ///< Called when the headers are read, and a body follows. @see onion_set_request_body_hook
+	void *body_hook_data;
 	char *username;
 	onion_poller *poller;
 	onion_listen_point **listen_points; ///< List of listen_point. Everytime a new listen point adds, 
 														 ///< it reallocs the full list. Its NULL terminated. 
 														 ///< If NULL at listen, creates a http at 8080.
 	onion_handler *root_handler;	/// Root processing handler for this server.
+	onion_dict *vhosts;           ///< Handler of each Host, or NULL. @see onion_set_vhost_handler
 	onion_handler *internal_error_handler;	/// Root processing handler for this server.
+	onion_handler_table *handler_table; ///< Of the last onion_listen, and the ones it replaced. @see onion_handler_freeze
 	size_t max_post_size;					/// Maximum size of post data. This is the sum of posts, @see onion_request_write_post
 	size_t max_file_size;					/// Maximum size of files. @see onion_request_write_post
+	size_t max_inflate_size;     ///< Bodies with Content-Encoding are decoded up to this size, or 0 to keep them as sent. @see onion_set_request_inflate
+	char *spool_dir;              ///< Where PUT bodies are kept, or NULL for /tmp. @see onion_set_spool_dir
 	onion_sessions *sessions;			/// Storage for sessions.
+	int sessions_timer_fd;        ///< Timer of the sessions expiry at the poller, while listening, or -1.
+	onion_file_cache *file_cache; ///< Open static files, or NULL. @see onion_set_file_cache
+	onion_access_log *access_log; ///< Log of the requests, or NULL to log them as INFO. @see onion_set_access_log
+	onion_traffic_record *traffic_record; ///< Where the requests read are recorded, or NULL. @see onion_set_traffic_record
+	struct onion_stats_shard_t *stats; ///< Counters of the threads. @see onion_get_stats
+	struct onion_admission_t *admission; ///< Limits of connections and requests, or NULL if none. @see onion_set_connection_limits
+	struct{
+		int window_bits;          ///< Of the compressor, 9 to 15, or 0 to not negotiate permessage-deflate.
+		char no_context_takeover; ///< Each message is compressed on its own.
+		size_t max_memory;        ///< Of the zlib streams for each connection, or 0 for no limit.
+	}websocket_deflate; ///< @see onion_set_websocket_deflate
+	int websocket_ping_interval; ///< Default ms of idle before pinging the websockets, or 0. @see onion_set_websocket_keepalive
+	int websocket_pong_timeout;  ///< Default ms to get an answer to the ping
+	int nprocesses;              ///< Prefork processes that listen, or 0 to listen at this one. @see onion_set_processes
+	int *processes_cpus;         ///< CPU of each process, round robin, or NULL
+	int nprocesses_cpus;
+	pid_t *process_pids;         ///< At the supervisor, the pid of each process, or 0 if not running.
+	int process_index;           ///< At a prefork process, its index. -1 at the supervisor, or without prefork.
+	char processes_stopping;     ///< The supervisor is stopping, so the processes that exit are not respawned.
+	unsigned long process_respawns; ///< Processes respawned by the supervisor, as they exited.
+	char *hot_restart_path;      ///< Unix socket where the listen sockets are handed to the next process, or NULL. @see onion_set_hot_restart
+	int hot_restart_fd;          ///< Listening at hot_restart_path, or -1.
+	int drain_ms;                ///< At stop, max ms to wait for the open connections, <0 for all, or 0 to not wait. @see onion_set_drain
+	onion_drain_callback drain_callback;
+	void *drain_data;
+	int64_t drain_started;       ///< Monotonic ms
+	int64_t drain_deadline;      ///< Monotonic ms when the drain ends, or 0 for none.
+	unsigned long drain_connections; ///< Open when it started
+	char draining;               ///< Not accepting anymore, and closes the connections after their current request.
+	char listening;              ///< Its pollers are running at onion_listen.
+	struct onion_spare_fd_t *spare_fds; ///< Systemd passed sockets beyond the first of a listen point, as with ReusePort=.
+	int nspare_fds;
+	onion_listen_point **spare_listen_points; ///< Copies of the listen points that listen at the spare sockets left, at the main poller. NULL terminated.
 #ifdef HAVE_PTHREADS
 	pthread_t listen_thread;
 	pthread_t *threads;
 	int nthreads;
+	onion_poller **thread_pollers; ///< On O_REUSEPORT mode, the private poller of each extra thread. nthreads-1 of them.
+	onion_listen_point **thread_listen_points; ///< On O_REUSEPORT mode, the listen points of the extra threads. NULL terminated.
+	struct onion_workers_t *workers; ///< Threads that run the handlers, if any. Only while listening.
+	int nworkers;                    ///< Number of worker threads. 0 to run the handlers at the poller threads.
+	int workers_max_queue;           ///< Maximum requests waiting for a worker
+	int workers_min;                 ///< If >0, the workers start with this many, and grow up to nworkers. @see onion_set_workers_autoscale
+	int workers_idle_ms;             ///< Workers over workers_min retire after this long idle.
+	int priority_limits[OPRIO_CLASSES]; ///< Requests of each class running at the workers at a time, 0 for no limit.
+	struct onion_steal_t *steal;     ///< Queues of the poller threads for work stealing, if any. Only while listening.
+	int steal_max_queue;             ///< Maximum requests at the queue of each poller thread, or 0 for no work stealing.
+	int *threads_cpus;               ///< CPU of each poller thread, round robin, or NULL. @see onion_set_threads_affinity
+	int nthreads_cpus;
+	char threads_steer;              ///< On O_REUSEPORT mode, new connections go to the thread of the CPU that got them.
+	int *workers_cpus;               ///< CPUs for the worker threads, or NULL
+	int nworkers_cpus;
 #endif
 };
 
 
+/// A header at onion_request_t header_slices, as offsets into its data.
+struct onion_request_header_slice_t{
+	int key;
+	int key_length;
+	int value;
+	int value_length;
+	int id;          ///< onion_header_id, or -1 if not a well known one.
+};
+
+/// A block of the request arena, with the allocations at data. @see onion_request_alloc
+struct onion_request_arena_block_t{
+	struct onion_request_arena_block_t *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+/// Room for the client description: an IPv6, or "unix:" and a unix socket path.
+#define ONION_CLIENT_DESCRIPTION_SIZE 120
+
+/// Output that waits for the connection, at the shared buffer it was written from.
+typedef struct onion_request_output_shared_t{
+	onion_shared_buffer *buffer; ///< A reference, dropped as written
+	const char *data;
+	size_t length;
+	struct onion_request_output_shared_t *next;
+}onion_request_output_shared;
+
 struct onion_request_t{
 	struct{
 		onion_listen_point *listen_point;
@@ -89,23 +217,134 @@ struct onion_request_t{
 		int fd; ///< Original fd, to use at polling.
 		struct sockaddr_storage cli_addr;
 		socklen_t cli_len;
-		char *cli_info;
+		char cli_info[ONION_CLIENT_DESCRIPTION_SIZE]; ///< The client description, formatted at the first use for all the requests of the connection. @see onion_request_get_client_description
+		onion_poller_slot *slot; ///< Poller slot of this connection, if any. Used to wait for write on O_NONBLOCKING, and to resume after a worker.
+		struct onion_http2_session_t *http2; ///< HTTP/2 session, if this connection talks HTTP/2. Its streams are other requests.
+		char handshake;   ///< The TLS handshake is not done yet, and goes on as the poller says the socket is ready.
+		char early_pending; ///< There may be TLS 1.3 early data to read, or the handshake returned early and its end comes with the reads.
+		char early_data;  ///< The data read last was TLS 1.3 early data, that could be a replay. @see onion_https_set_early_data
+		char corked;      ///< TLS data is held, to send it at full records. @see onion_https_write
+		unsigned short small_records; ///< TLS records sent small since the connection start, or since it was idle.
+		int64_t last_write; ///< Monotonic ms of the last TLS write
+		char stats_open;  ///< Counted as an open connection at the server stats. @see onion_get_stats
+		uint64_t record_id; ///< Number of the connection at the traffic record, or 0 if nothing recorded. @see onion_set_traffic_record
+		char state;         ///< The onion_request_state. Read without locks by onion_get_connections, as all these.
+		int64_t state_since; ///< Coarse monotonic ms at which it entered the state
+		int64_t accepted;   ///< Coarse monotonic ms of the accept
+		uint64_t bytes_in;
+		uint64_t bytes_out;
+		char path[ONION_CONNECTION_PATH_SIZE]; ///< Method and path of the current request, set as its headers are parsed.
+		char send_close;    ///< Its poller sends the last response with the close. @see onion_poller_send_close
 	}connection;  /// Connection to the client.
+	struct{
+		onion_block *data;    ///< Data that could not be written yet. Written before the file.
+		size_t data_pos;      ///< Bytes of data already written.
+		struct onion_request_output_shared_t *shared; ///< Queued without copies, written after data. @see onion_response_write_shared
+		struct onion_request_output_shared_t *shared_last;
+		int file_fd;          ///< File to send after data, or -1. Closed when done.
+		off_t file_pos;       ///< Position at file of next byte to send.
+		size_t file_left;     ///< Bytes left to send from file, not yet read to file_block.
+		char *file_block;     ///< Read from the file and not yet written, when it does not go by sendfile.
+		size_t file_block_pos;
+		size_t file_block_len;
+		char file_nonblock;   ///< The socket was set O_NONBLOCK only to send the file; it is blocking again when done.
+		int status;           ///< Connection status to return when all written, for example OCS_CLOSE_CONNECTION.
+		char more;            ///< More pipelined responses follow this one, so the listen point may hold it to send them together.
+		char more_sent;       ///< Some data was written with more set, and may be waiting. @see onion_request_output_push
+		char bulk;            ///< The response buffer is written as it is full, or the headers before a sendfile, and more follows, so the listen point may hold it for bigger writes.
+		char linger;          ///< The last flush of the last response of the connection is being written, so it may be kept for the close.
+		onion_block *last;    ///< That response, kept to send with the close. @see onion_listen_point_request_close_socket
+	}output;  /// Pending output, on O_NONBLOCKING mode. @see onion_request_output_write
+	struct{
+		const char *rest;     ///< While processing, the data after this request at the onion_request_write buffer.
+		size_t rest_length;
+		onion_block *data;    ///< Pipelined data kept while this request is processed at another thread, or suspended.
+	}pipeline;  /// Pipelined requests, sent by the client before the response of the current one.
+
+	struct{
+		char connection;      ///< Counted as an open connection
+		char request;         ///< Counted as a request in flight
+		short client;         ///< Bucket of the client at the per client counters, or -1.
+		int64_t start;        ///< Monotonic us of the first byte, for the load shedding.
+	}admission;  ///< @see onion_set_connection_limits
+
 	int flags;            /// Flags for this response. Ored onion_request_flags_e
+	int64_t timings[OR_PHASES]; ///< Monotonic us of each phase; the start also if there is an access log. @see onion_request_get_timings
 
 	char *fullpath;       /// Original path for the request
+	struct{
+		char *data;
+		size_t size;
+	}path_buffer;         ///< Kept on keep alive for the fullpath of the next requests. @see onion_request_set_fullpath
 	char *path;           /// Path at this level. Its actually a pointer inside fullpath, removing the leading parts already processed by handlers
+	struct{
+		struct onion_request_url_param_t{
+			const char *name;  ///< Of a :name segment, at the url, or NULL for a regexp group.
+			int group;         ///< Of a regexp group, or 0.
+			const char *start; ///< At the fullpath
+			int length;
+			const char *value; ///< At the arena, when first asked.
+		}params[ONION_REQUEST_MAX_URL_PARAMS];
+		int count;
+	}url_params;          ///< Captures of the urls that matched, as :name segments and regexp groups. @see onion_request_get_url_param
 	onion_dict *headers;  /// Headers prepared for this response.
-	onion_dict *GET;      /// When the query (?q=query) is processed, the dict with the values @see onion_request_parse_query
+	onion_dict *GET;      /// When the query (?q=query) is processed, the dict with the values @see onion_request_get_query_dict
+	char *query;          ///< The raw query at the arena, until the GET dict is built from it. @see onion_request_get_query
 	onion_dict *POST;     /// Dictionary with POST values
 	onion_dict *FILES;    /// Dictionary with files. They are automatically saved at /tmp/ and removed at request free. mapped string is full path.
-	onion_dict *session;  /// Pointer to related session
+	onion_dict *session;  /// Pointer to related session. Shared with the storage, read only, until onion_request_get_session_dict copies it.
+	char session_writable;            ///< session is the own copy of this request, to save at its end if changed.
+	unsigned int session_generation;  ///< Generation of the writable session when copied, to know if it changed.
 	onion_block *data;    /// Some extra data from PUT, normally PROPFIND.
+	struct{
+		onion_dict *dict;     ///< The body parsed, borrowing its strings from data.
+		char parsed;          ///< Already parsed, even if not valid, as data was modified.
+	}json;                ///< @see onion_request_get_json
 	onion_dict *cookies;  /// Data about cookies.
 	char *session_id;     /// Session id of the request, if any.
 	void *parser;         /// When recieving data, where to put it. Check at request_parser.c.
 	void *parser_data;    /// Data necesary while parsing, muy be deleted when state changed. At free is simply freed.
 	onion_websocket *websocket; /// Websocket handler. 
+	onion_sse *sse;           ///< Server sent events stream, while it lasts. @see onion_sse_new
+	onion_response *response; ///< Response of a suspended request (OCS_SUSPENDED), until it is resumed.
+	int suspended;            ///< Or'ed 1 when the handler returned OCS_SUSPENDED, 2 when onion_request_resume was called. Atomic.
+	struct{
+		onion_block *data;    ///< Read header bytes as key\0value\0 pairs, or NULL if headers go straight to the headers dict. Kept on keep alive.
+		struct onion_request_header_slice_t *slices;
+		int count;            ///< Headers already read
+		int size;             ///< Allocated slices
+		int start;            ///< Offset at data of the key or value being read
+		int at_dict;          ///< The slices were already added to headers, at onion_request_get_header_dict.
+	}header_slices;  ///< Headers as slices of a per connection buffer. @see onion_set_header_slices
+	struct{
+		const char *values[ONION_H_COUNT]; ///< Value of each well known header, the first one if repeated, or NULL.
+		char ready;           ///< Set when all the headers were parsed. Before, as on requests made by hand, they are looked up by name.
+	}known_headers;  ///< @see onion_request_get_header_id
+	struct{
+		onion_request_body_callback callback; ///< Gets the body as read, instead of buffering it, or NULL.
+		void *data;
+		onion_handler_private_data_free free_data;
+		size_t left;          ///< Body bytes still to read, or of the current chunk on Transfer-Encoding: chunked.
+		size_t read;          ///< Chunked body bytes kept, to check the size limits.
+		int paused;           ///< Or'ed 1 when the callback returned OCS_SUSPENDED, 2 when onion_request_body_resume was called. Atomic.
+		int reject;           ///< HTTP code to answer instead of reading the body, or 0. @see onion_request_reject_body
+		struct onion_request_inflate_t *inflate; ///< Decoder of a body with Content-Encoding, or NULL. At request_parser.c
+	}body;  ///< Streamed request body. @see onion_request_set_body_callback
+	struct{
+		const char *dir;      ///< Where the PUT body is kept, or NULL for the server one. @see onion_request_set_spool_dir
+		int fd;               ///< Of the PUT body when at an unnamed (O_TMPFILE) file, open while the request lasts, or -1.
+	}spool;
+	struct{
+		char state;           ///< 1 reading the headers, 2 the body, 0 else.
+		int64_t start;        ///< Monotonic ms when the headers or the body started.
+		size_t body_read;     ///< Body bytes read, for the minimum rate.
+		unsigned int requests; ///< Requests started at this connection.
+		struct onion_request_watchdog_t *watchdog; ///< Of the handler timeout, while suspended, or NULL.
+		int64_t deadline;     ///< Monotonic ms when the handler should give up, or 0. @see onion_request_is_cancelled
+		int cancelled;        ///< The client went away, or the deadline passed. Atomic.
+		struct onion_request_canceller_t *canceller; ///< Calls the cancel callback, while at the handler, or NULL.
+	}phase;  ///< For the timeouts of each phase. @see onion_set_timeouts
+	struct onion_request_arena_block_t *arena; ///< Newest block first. All but the oldest are freed at clean. @see onion_request_alloc
 };
 
 struct onion_response_t{
@@ -116,8 +355,24 @@ struct onion_response_t{
 	unsigned int length;			/// Length, if known, of the response, to create the Content-Lenght header. 
 	unsigned int sent_bytes; 	/// Sent bytes at content.
 	unsigned int sent_bytes_total; /// Total sent bytes, including headers.
-	char buffer[ONION_RESPONSE_BUFFER_SIZE]; /// buffer of output data. This way its do not send small chunks all the time, but blocks, so better network use. Also helps to keep alive connections with less than block size bytes.
-	off_t buffer_pos;						/// Position in the internal buffer. When sizeof(buffer) its flushed to the onion IO.
+	char *buffer;             /// buffer of output data. This way its do not send small chunks all the time, but blocks, so better network use. Also helps to keep alive connections with less than block size bytes.
+	off_t buffer_pos;						/// Position in the internal buffer. When buffer_size its flushed to the onion IO.
+	size_t buffer_size;       ///< Flushes when this size is reached. Smaller responses get a Content-Length. @see onion_response_set_buffer_size
+	size_t buffer_allocated;  ///< Current size of buffer. Grows as needed up to buffer_size.
+	char small_buffer[ONION_RESPONSE_BUFFER_SIZE]; ///< The buffer until it has to grow.
+	char length_header[24];   ///< Value of the Content-Length header, set at onion_response_set_length.
+	const char *header_block; ///< Preformatted headers, not owned. @see onion_response_set_header_block
+	size_t header_block_length;
+	int compress_level;       ///< Compression level if it may be compressed, 0 if not or already decided. @see onion_response_set_compression
+	size_t compress_min_size; ///< Not compressed if known to be smaller
+	struct onion_compress_t *compress; ///< Compressor, while compressing.
+	int chunk_start;          ///< On chunked responses, the headers are at the buffer until this position, to send them with the first chunk.
+	onion_block *capture;     ///< Copy of the body written, or NULL. @see onion_response_set_capture
+	size_t capture_max;       ///< Over it the copy is dropped. 0 if not capturing.
+	int capture_fragments;    ///< Fragments being captured. @see onion_response_fragment_begin
+	char capture_fragments_own; ///< The capture was started for the fragments, not by onion_response_set_capture.
+	size_t capture_fragments_max; ///< capture_max of the onion_response_set_capture, while there are fragments.
+	char hold;                ///< onion_response_flush waits, as the response may still be made again. @see onion_response_rewind
 };
 
 struct onion_handler_t{
@@ -126,6 +381,27 @@ struct onion_handler_t{
 	void *priv_data;                /// Private data as needed by the handler
 	
 	struct onion_handler_t *next; /// If parser returns null, i try next handler. If no next handler i go up, or return an error. @see onion_handler_handle
+	onion_handler_children_f children; ///< Walks the handlers it calls, to freeze them too. @see onion_handler_set_children
+	const onion_handler_entry *frozen; ///< This level, from this handler, at a table, or NULL to walk the next. @see onion_handler_freeze
+	const onion_response_prerendered *prerendered; ///< What the handler always writes, or NULL. Not owned. @see onion_handler_set_prerendered
+};
+
+/// A level frozen at a table, where its handlers start.
+typedef struct{
+	onion_handler *head;
+	int start;
+	int count;
+}onion_handler_table_head;
+
+/// Where onion_handler_freeze copies the levels, each one contiguous. @see onion_handler_freeze
+struct onion_handler_table_t{
+	onion_handler_entry *entries;
+	int count;
+	int allocated;
+	onion_handler_table_head *heads;
+	int nheads;
+	int aheads;
+	struct onion_handler_table_t *previous; ///< Replaced tables, that the requests being handled may still use.
 };
 
 // onion_url is really a handler. It has its own "fake" type to ensure user dont call the url_* functions
@@ -133,8 +409,41 @@ struct onion_handler_t{
 // struct onion_url_t;
 
 
+/// Independent parts of the sessions storage, by hash of the session id. Power of 2.
+#define ONION_SESSIONS_SHARDS 16
+
+/// A stored session, with its times, at its shard LRU list.
+typedef struct onion_sessions_entry_t{
+	char *id;
+	onion_dict *data;
+	int64_t created;     ///< Monotonic ms
+	int64_t last_access; ///< Monotonic ms
+	struct onion_sessions_entry_t *prev; ///< More recently used
+	struct onion_sessions_entry_t *next; ///< Less recently used
+}onion_sessions_entry;
+
+typedef struct onion_sessions_shard_t{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+	onion_dict *entries;          ///< id -> onion_sessions_entry, not owned by the dict.
+	onion_sessions_entry *first;  ///< Most recently used
+	onion_sessions_entry *last;   ///< Least recently used, the first to expire or be evicted
+	int count;
+}onion_sessions_shard;
+
 struct onion_sessions_t{
-	onion_dict *sessions; 		/// Where all sessions are stored. Each element is another onion_dict.
+	onion_sessions_shard shards[ONION_SESSIONS_SHARDS];
+	int idle_ttl;     ///< Removed if not used in this ms, 0 for never
+	int absolute_ttl; ///< Removed this ms after creation, 0 for never
+	int max_sessions; ///< At most this many, evicting the least recently used, 0 for no limit
+	onion_sessions_backend *backend; ///< Storage instead of the shards, or NULL. @see onion_sessions_set_backend
+	struct{
+		char enabled;
+		char encrypt;
+		unsigned char mac_key[32];
+		unsigned char encrypt_key[32];
+	}cookie; ///< Sessions at the clients cookies, instead of any storage. @see onion_sessions_set_cookie_key
 };
 
 struct onion_block_t{
@@ -143,6 +452,21 @@ struct onion_block_t{
 	int maxsize;
 };
 
+struct onion_shared_buffer_t{
+	const char *data;
+	size_t size;
+	void (*free_cb)(void *free_data); ///< Called with free_data as the last reference is dropped, or NULL
+	void *free_data;
+	int refcount;
+};
+
+struct onion_rope_t{
+	struct iovec *segments; ///< Each ONION_ROPE_SEGMENT_SIZE long, iov_len is the used part. Also the iovec view.
+	int count;              ///< Segments with data, the last one may have room left
+	int allocated;          ///< Allocated segments, the ones after count are empty, kept for reuse.
+	size_t size;
+};
+
 /// Opaque type used at onion_url internally
 struct onion_url_data_t;
 typedef struct onion_url_data_t onion_url_data;
@@ -153,6 +477,17 @@ struct onion_listen_point_t{
 	char *hostname; ///< Stated hostname, as a string. If NULL tries to attach to any hostname, normally 0.0.0.0 (ipv4 and ipv6)
 	char *port;     ///< Stated port, if none then 8080
 	int listenfd;   ///< For socket listening listen points, the listen fd. For others may be -1 as not used, or an fd to watch and when changed calls the request_init with a new request.
+	onion_poller *poller; ///< Poller where the accepted connections are added. If NULL, the server poller.
+	struct{
+		unsigned long wakeups;  ///< Times the listen socket was ready
+		unsigned long accepted; ///< Connections accepted
+		unsigned long full;     ///< Wakeups that used all the accept budget, so maybe there were more waiting.
+		unsigned long poller_wakeup; ///< Poller wakeup of the last connection accepted by the poller, so those of the same wakeup count as one.
+	}accept_stats; ///< Updated atomically, as pollers at several threads may accept.
+	onion_socket_options socket_options; ///< Socket tuning. Fields at 0 get the server value. @see onion_listen_point_set_socket_options
+	int http2;      ///< Talks HTTP/2 to the clients that ask for it. @see onion_listen_point_set_http2
+	char *path;     ///< Unix socket path, of onion_unix_new listen points; then hostname and port are not used. A leading '@' is at the abstract namespace.
+	int mode;       ///< Permissions of the unix socket file. 0 keeps the ones of the umask. @see onion_unix_set_mode
 	
 	/// Internal data used by the listen point, for example in HTTPS is the certificate loaded data.
 	void *user_data; 
@@ -179,6 +514,15 @@ struct onion_listen_point_t{
 	 * It also may be called two succesive times, and should do nothing on second.
 	 */
 	void (*listen_stop)(onion_listen_point *lp);
+	/**
+	 * @short Optional. Writes the state the next process needs to resume the connections of this one, as TLS ticket keys.
+	 * 
+	 * Called at a hot restart, when the listen socket is handed over. Returns the size written, at most size, or 0 if none.
+	 * @see onion_set_hot_restart
+	 */
+	size_t (*get_restart_state)(onion_listen_point *lp, void *data, size_t size);
+	/// Optional. Takes the state written by get_restart_state at the previous process, before listening.
+	void (*set_restart_state)(onion_listen_point *lp, const void *data, size_t size);
 
 	/// @{ @name To be used by requests, but as these methods are shared by protocol, done here.
 	/** 
@@ -191,8 +535,13 @@ struct onion_listen_point_t{
 	 */
 	int (*request_init)(onion_request *req);
 	int (*read_ready)(onion_request *req); ///< When poller detects data is ready to be read. Might be diferent in diferent parts of the processing.
+	/// Optional. Gets the data that the poller read, instead of read_ready, with length 0 if closed by the client. Only for plain sockets, as the poller also sends the last response; who replaces read sets it to NULL. @see onion_poller_slot_set_recv
+	int (*received)(onion_request *req, const char *data, size_t len);
 	ssize_t (*write)(onion_request *req, const char *data, size_t len); ///< Write data to the given request.
+	ssize_t (*writev)(onion_request *req, const struct iovec *iov, int iovcnt); ///< Optional. Writes several buffers at once, as writev. If NULL, write is called for each.
 	ssize_t (*read)(onion_request *req, char *data, size_t len); ///< Read data from the given request and write it in data.
+	ssize_t (*sendfile)(onion_request *req, int fd, off_t *offset, size_t count); ///< Optional. Sends from the file as sendfile, without copies. -1 with ENOSYS if this connection can not, and then it is read and written.
+	ssize_t (*splice)(onion_request *req, int fd, size_t count); ///< Optional. Moves from the pipe to the connection as splice, without copies. -1 with ENOSYS if this connection can not.
 	void (*close)(onion_request *req); ///< Closes the connection and frees listen point user data. Request itself it left. It is called from onion_request_free ONLY.
 	/// @}
 };
@@ -209,7 +558,14 @@ struct onion_websocket_t{
 	char mask[4];
 	int8_t mask_pos;
 	int8_t flags; /// Defined at websocket.c
+	int8_t send_flags; /// Of the message being written by fragments. Defined at websocket.c
+	int ping_interval; /// ms of idle before a ping, or 0. @see onion_websocket_set_keepalive
+	int pong_timeout;  /// ms to read any frame after the ping, or it is closed.
+	int64_t last_read; /// Monotonic ms of the last frame read, when pinging.
+	int64_t ping_sent; /// Monotonic ms of the ping still without answer, or 0.
 	onion_websocket_opcode opcode:4;
+	struct onion_websocket_queue_t *queue; /// Frames of the groups it is subscribed to, or NULL. Defined at websocket.c
+	struct onion_websocket_deflate_t *deflate; /// permessage-deflate state if negotiated, or NULL. Defined at websocket.c
 };
 
 #ifdef __cplusplus
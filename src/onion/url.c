@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <regex.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "log.h"
 #include "handler.h"
@@ -36,15 +37,33 @@
 #include "url.h"
 #include "types_internal.h"
 #include "dict.h"
+#include "pool.h"
 #include <ctype.h>
 
 enum onion_url_data_flags_e{
 	OUD_REGEXP=1,
 	OUD_STRCMP=2,
+	OUD_PREFIX=4,  ///< A regexp that is just ^ and a literal: at the trie, matching the start.
+	OUD_PATTERN=8, ///< A string with :name segments: at the trie, matching the full path.
 };
 
 typedef enum onion_url_data_flags_e onion_url_data_flags;
 
+/// Maximum :name segments at a pattern, as the request keeps them at a fixed array.
+#define ONION_URL_MAX_PARAMS ONION_REQUEST_MAX_URL_PARAMS
+
+#ifdef HAVE_ROUTE_STATS
+/// Each route keeps this many copies of its counters, so threads seldom share a cache line.
+#define ONION_URL_STATS_SHARDS 8
+
+/// Counters of a route, updated by some of the threads. @see onion_url_set_stats
+typedef struct{
+	unsigned long hits;
+	unsigned long errors;
+	unsigned long latency[ONION_URL_STATS_BUCKETS];
+}__attribute__((aligned(64))) onion_url_stats_shard;
+#endif
+
 /**
  * @short Internal onion_url data for each known url
  * @private
@@ -54,67 +73,414 @@ struct onion_url_data_t{
 		regex_t regexp;
 		char *str;
 	};
-#ifdef __DEBUG__
-	char *orig;
-#endif
+	char *orig;        ///< As added, to name it at the stats
 	int flags;
+	int index;         ///< Order it was added, as the first added that matches is used.
+	int nparams;       ///< Of an OUD_PATTERN
+	int priority;      ///< Class of the requests to it, or -1 as the url it is at. @see onion_url_set_priority
+	char **params;     ///< Names of the :name segments of an OUD_PATTERN, in order.
 	onion_handler *inside;
 	struct onion_url_data_t *next;
+	struct onion_url_data_t *next_regexp; ///< Next OUD_REGEXP
+#ifdef HAVE_ROUTE_STATS
+	onion_url_stats_shard *stats; ///< ONION_URL_STATS_SHARDS of them, or NULL
+#endif
 };
 
 //typedef struct onion_url_data_t onion_url_data; // already at types-internal.h
 
 /**
- * @short Performs the real request: checks if its for me, and then calls the inside level.
+ * @short Node of the radix trie of the literal, prefix and pattern urls.
+ * @private
+ * 
+ * Each node is reached by its label, from its parent. The param child is a :name segment,
+ * that matches up to the next / or the end.
+ */
+typedef struct onion_url_node_t{
+	char *label;
+	int length;
+	struct onion_url_node_t **children; ///< Their labels start with different characters.
+	int nchildren;
+	struct onion_url_node_t *param;
+	onion_url_data *exact;  ///< First url that matches if the path ends here
+	onion_url_data *prefix; ///< First url that matches if the path starts up to here
+}onion_url_node;
+
+/**
+ * @short What onion_url_new keeps: the urls in order, the trie of those it can compile, and the regexps.
+ * @private
+ */
+typedef struct{
+	onion_url_data *first;
+	onion_url_data **last;
+	onion_url_data *regexps; ///< Only the OUD_REGEXP, in order, linked by next_regexp.
+	onion_url_data **last_regexp;
+	onion_url_node *trie;
+	int count;
+	int stats; ///< Keeps the stats of the routes. @see onion_url_set_stats
+}onion_url_router;
+
+/// State while looking for the best match at the trie
+typedef struct{
+	const char *path;
+	onion_url_data *best;
+	size_t best_length;    ///< Consumed path by the best
+	int nvalues;           ///< Current :name values
+	size_t values[ONION_URL_MAX_PARAMS][2];
+	size_t best_values[ONION_URL_MAX_PARAMS][2];
+}onion_url_match;
+
+void onion_url_free_data(void *router);
+static void onion_url_node_free(onion_url_node *node);
+static onion_url_node *onion_url_node_new(const char *label, int length);
+static onion_url_node *onion_url_trie_add(onion_url_node *node, const char *str, int length);
+static void onion_url_trie_candidate(onion_url_match *m, onion_url_data *data, size_t length);
+static void onion_url_trie_match(onion_url_match *m, const onion_url_node *node, size_t pos);
+static int onion_url_literal_regexp(const char *regexp, char *literal, int *exact);
+static int onion_url_add_pattern(onion_url_router *router, onion_url_data *data, const char *pattern);
+static onion_url_data *onion_url_find(onion_url_router *router, const char *path, onion_url_match *m, regmatch_t *match, size_t nmatch, size_t *length);
+static int onion_url_call(onion_url_router *router, onion_url_data *data, onion_request *request, onion_response *response);
+static int onion_url_priority(onion_url_router *router, const char *path, int priority);
+static const onion_response_prerendered *onion_url_prerendered(onion_url_router *router, const char *path);
+extern int onion_handler_prerendered_used; // At handler.c
+#ifdef HAVE_ROUTE_STATS
+static int onion_url_call_stats(onion_url_data *data, onion_request *request, onion_response *response);
+static int onion_url_stats_bucket(unsigned long us);
+static void onion_url_stats_new(onion_url_data *data);
+#endif
+static void onion_url_stats_route(onion_url_router *router, const char *prefix, void (*f)(void *data, const onion_url_route_stats *stats), void *data);
+
+static onion_url_node *onion_url_node_new(const char *label, int length){
+	onion_url_node *node=calloc(1, sizeof(onion_url_node));
+	node->label=strndup(label, length);
+	node->length=length;
+	return node;
+}
+
+static void onion_url_node_free(onion_url_node *node){
+	int i;
+	for (i=0;i<node->nchildren;i++)
+		onion_url_node_free(node->children[i]);
+	if (node->param)
+		onion_url_node_free(node->param);
+	free(node->children);
+	free(node->label);
+	free(node);
+}
+
+/// Returns the node for node+str, splitting labels and adding nodes as needed.
+static onion_url_node *onion_url_trie_add(onion_url_node *node, const char *str, int length){
+	while (length>0){
+		onion_url_node *child=NULL;
+		int i;
+		for (i=0;i<node->nchildren;i++){
+			if (node->children[i]->label[0]==str[0]){
+				child=node->children[i];
+				break;
+			}
+		}
+		if (!child){
+			child=onion_url_node_new(str, length);
+			node->children=realloc(node->children, sizeof(onion_url_node*)*(node->nchildren+1));
+			node->children[node->nchildren++]=child;
+			return child;
+		}
+		int common=0;
+		while (common<child->length && common<length && child->label[common]==str[common])
+			common++;
+		if (common<child->length){ // Split: child keeps the end of its label, under a new node with the common part
+			onion_url_node *split=onion_url_node_new(child->label, common);
+			memmove(child->label, child->label+common, child->length-common+1);
+			child->length-=common;
+			split->children=malloc(sizeof(onion_url_node*));
+			split->children[0]=child;
+			split->nchildren=1;
+			node->children[i]=split;
+			child=split;
+		}
+		node=child;
+		str+=common;
+		length-=common;
+	}
+	return node;
+}
+
+/// Keeps the url as the best match if it was added before the current best.
+static void onion_url_trie_candidate(onion_url_match *m, onion_url_data *data, size_t length){
+	if (!data || (m->best && m->best->index<data->index))
+		return;
+	m->best=data;
+	m->best_length=length;
+	memcpy(m->best_values, m->values, sizeof(m->values[0])*m->nvalues);
+}
+
+/**
+ * @short Looks for the first added url that matches, from this node, at pos of the path.
+ * 
+ * Literal and :name children may both match, so both are followed; each character of the path is 
+ * compared once per branch, and there are few branches.
  */
-int onion_url_handler(onion_url_data **dd, onion_request *request, onion_response *response){
-	onion_url_data *next=*dd;
+static void onion_url_trie_match(onion_url_match *m, const onion_url_node *node, size_t pos){
+	const char *path=m->path;
+	onion_url_trie_candidate(m, node->prefix, pos);
+	if (path[pos]=='\0'){
+		onion_url_trie_candidate(m, node->exact, pos);
+		return;
+	}
+	int i;
+	for (i=0;i<node->nchildren;i++){
+		const onion_url_node *child=node->children[i];
+		if (child->label[0]==path[pos]){
+			if (strncmp(child->label, &path[pos], child->length)==0)
+				onion_url_trie_match(m, child, pos+child->length);
+			break;
+		}
+	}
+	if (node->param && m->nvalues<ONION_URL_MAX_PARAMS){
+		size_t end=pos;
+		while (path[end] && path[end]!='/')
+			end++;
+		m->values[m->nvalues][0]=pos;
+		m->values[m->nvalues][1]=end;
+		m->nvalues++;
+		onion_url_trie_match(m, node->param, end);
+		m->nvalues--;
+	}
+}
+
+/**
+ * @short Looks for the first added url that matches the path.
+ * 
+ * The literal, prefix and pattern urls are at the trie, so finding the first of them that matches costs
+ * about the length of the path. Only the regexps added before it are then checked, in order.
+ * 
+ * @returns The url, or NULL. The groups of a regexp are at match, the :name values of a pattern at m, and 
+ *   the matched length of the path at length.
+ */
+static onion_url_data *onion_url_find(onion_url_router *router, const char *path, onion_url_match *m, regmatch_t *match, size_t nmatch, size_t *length){
+	m->path=path;
+	m->best=NULL;
+	m->best_length=0;
+	m->nvalues=0;
+	if (router->trie)
+		onion_url_trie_match(m, router->trie, 0);
+
+	onion_url_data *next;
+	for (next=router->regexps;next && (!m->best || next->index<m->best->index);next=next->next_regexp){
+		ONION_DEBUG0("Check %s against %s", path, next->orig);
+		if (regexec(&next->regexp, path, nmatch, match, 0)==0){
+			*length=match[0].rm_eo;
+			return next;
+		}
+	}
+	*length=m->best_length;
+	return m->best;
+}
+
+/// Performs the real request: checks if its for me, and then calls the inside level.
+int onion_url_handler(onion_url_router *router, onion_request *request, onion_response *response){
 	regmatch_t match[16];
 	int i;
 	
 	const char *path=onion_request_get_path(request);
-	while (next){
-		ONION_DEBUG0("Check %s against %s", onion_request_get_path(request), next->orig);
-		if (next->flags&OUD_STRCMP){
-			if (strcmp(path, next->str)==0){
-				ONION_DEBUG0("Ok, simple match.");
-
-				onion_request_advance_path(request, strlen(next->str));
-				return onion_handler_handle(next->inside, request, response);
+	onion_url_match m;
+	size_t length;
+	onion_url_data *data=onion_url_find(router, path, &m, match, 16, &length);
+	if (!data)
+		return 0;
+	if (data->flags&OUD_REGEXP){
+		ONION_DEBUG0("Ok, regexp match.");
+		for (i=1;i<16;i++){
+			regmatch_t *rm=&match[i];
+			if (rm->rm_so!=-1){
+				onion_request_add_url_param(request, NULL, i, &path[rm->rm_so], rm->rm_eo-rm->rm_so); // Just where, the string when asked
+				ONION_DEBUG0("Add group %d: (%d-%d)", i, rm->rm_so, rm->rm_eo);
 			}
+			else
+				break;
 		}
-		else if (regexec(&next->regexp, onion_request_get_path(request), 16, match, 0)==0){
-			//ONION_DEBUG("Ok,match");
-			onion_dict *reqheader=request->GET;
-			for (i=1;i<16;i++){
-				regmatch_t *rm=&match[i];
-				if (rm->rm_so!=-1){
-					char *tmp=malloc(rm->rm_eo-rm->rm_so+1);
-					memcpy(tmp, &path[rm->rm_so], rm->rm_eo-rm->rm_so);
-					tmp[rm->rm_eo-rm->rm_so]='\0'; // proper finish string
-					char tmpn[4];
-					snprintf(tmpn,sizeof(tmpn),"%d",i);
-					onion_dict_add(reqheader, tmpn, tmp, OD_DUP_KEY|OD_FREE_VALUE);
-					ONION_DEBUG("Add group %d: %s (%d-%d)", i, tmp, rm->rm_so, rm->rm_eo);
-				}
-				else
-					break;
-			}
-			onion_request_advance_path(request, match[0].rm_eo);
-			ONION_DEBUG0("Ok, regexp match.");
+	}
+	else{
+		ONION_DEBUG0("Ok, trie match.");
+		for (i=0;i<data->nparams;i++) // Names at the url, values at the path until asked
+			onion_request_add_url_param(request, data->params[i], 0, &path[m.best_values[i][0]], m.best_values[i][1]-m.best_values[i][0]);
+	}
+	onion_request_advance_path(request, length);
+	return onion_url_call(router, data, request, response);
+}
+
+/// Calls the handler of the route, keeping its stats if asked.
+static int onion_url_call(onion_url_router *router, onion_url_data *data, onion_request *request, onion_response *response){
+#ifdef HAVE_ROUTE_STATS
+	if (router->stats && data->stats)
+		return onion_url_call_stats(data, request, response);
+#endif
+	return onion_handler_handle(data->inside, request, response);
+}
+
+#ifdef HAVE_ROUTE_STATS
+/// Shard of the counters of this thread, chosen at its first request.
+static __thread int onion_url_stats_thread_shard=-1;
+static int onion_url_stats_next_shard=0;
+
+/**
+ * @short Calls the handler of the route, and adds its time to the stats.
+ * 
+ * The counters are at the shard of this thread, with relaxed atomics, so there is no lock, and the 
+ * cache lines are seldom shared. A suspended request counts the time until the handler suspends it.
+ */
+static int onion_url_call_stats(onion_url_data *data, onion_request *request, onion_response *response){
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	int ret=onion_handler_handle(data->inside, request, response);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	long us=(t1.tv_sec-t0.tv_sec)*1000000 + (t1.tv_nsec-t0.tv_nsec)/1000;
+
+	if (onion_url_stats_thread_shard<0)
+		onion_url_stats_thread_shard=__atomic_fetch_add(&onion_url_stats_next_shard, 1, __ATOMIC_RELAXED)%ONION_URL_STATS_SHARDS;
+	onion_url_stats_shard *shard=&data->stats[onion_url_stats_thread_shard];
+	__atomic_fetch_add(&shard->hits, 1, __ATOMIC_RELAXED);
+	if (ret<0 || (ret==OCS_PROCESSED && response->code>=500)) // The response is not ours any more if yielded or suspended
+		__atomic_fetch_add(&shard->errors, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard->latency[onion_url_stats_bucket(us<0 ? 0 : us)], 1, __ATOMIC_RELAXED);
+	return ret;
+}
+
+/**
+ * @short Bucket of a latency, in microseconds.
+ * 
+ * As a HDR histogram: exact up to 15, then 8 buckets for each power of two, so each is at most 12.5% wide.
+ * The last one has all from 2^28 us, about 268 s.
+ */
+static int onion_url_stats_bucket(unsigned long us){
+	if (us<8)
+		return us;
+	if (us>=(1UL<<28))
+		return ONION_URL_STATS_BUCKETS-1;
+	int e=63-__builtin_clzl(us);
+	return (e-2)*8 + ((us>>(e-3))&7);
+}
+
+/// Creates the counters of this route.
+static void onion_url_stats_new(onion_url_data *data){
+	void *stats;
+	if (posix_memalign(&stats, 64, sizeof(onion_url_stats_shard)*ONION_URL_STATS_SHARDS)!=0){
+		ONION_ERROR("Could not allocate the stats of %s", data->orig);
+		return;
+	}
+	memset(stats, 0, sizeof(onion_url_stats_shard)*ONION_URL_STATS_SHARDS);
+	data->stats=stats;
+}
+#endif
+
+/**
+ * @short Keeps, or stops keeping, the hits, errors and latency histogram of each route.
+ * @memberof onion_url_t
+ * 
+ * It applies to the routes already added and to the later ones, and to the urls added at them, with 
+ * onion_url_add_url. The counters are kept when disabled, and are read with onion_url_stats.
+ * 
+ * Its off by default. When off it costs a check per request, and nothing if compiled without 
+ * ONION_USE_ROUTE_STATS.
+ */
+void onion_url_set_stats(onion_url *url, int enabled){
+#ifdef HAVE_ROUTE_STATS
+	onion_url_router *router=onion_handler_get_private_data((onion_handler*)url);
+	onion_url_data *data;
+	for (data=router->first;data;data=data->next){
+		if (enabled && !data->stats)
+			onion_url_stats_new(data);
+		if (data->inside && data->inside->priv_data_free==(void*)onion_url_free_data)
+			onion_url_set_stats((onion_url*)data->inside, enabled);
+	}
+	router->stats=enabled;
+#else
+	ONION_WARNING("Route stats asked, but onion was compiled without them. Set ONION_USE_ROUTE_STATS.");
+#endif
+}
 
-			
-			return onion_handler_handle(next->inside, request, response);
+/**
+ * @short Calls f with the stats of each route, in order, summed from all the threads.
+ * @memberof onion_url_t
+ * 
+ * The routes of the urls added at a route are named after it, as "^api/users/:id". Routes without 
+ * stats are skipped. The stats are valid only during the call.
+ * 
+ * If the handler is not an onion_url, it does nothing, so it can be called with any root handler.
+ */
+void onion_url_stats(onion_url *url, void (*f)(void *data, const onion_url_route_stats *stats), void *data){
+	if (!url || ((onion_handler*)url)->priv_data_free!=(void*)onion_url_free_data)
+		return;
+	onion_url_stats_route(onion_handler_get_private_data((onion_handler*)url), "", f, data);
+}
+
+/// Calls f with the stats of each route of this router, with its name after prefix.
+static void onion_url_stats_route(onion_url_router *router, const char *prefix, void (*f)(void *data, const onion_url_route_stats *stats), void *data){
+#ifdef HAVE_ROUTE_STATS
+	char route[512];
+	onion_url_route_stats stats;
+	onion_url_data *next;
+	for (next=router->first;next;next=next->next){
+		snprintf(route, sizeof(route), "%s%s", prefix, next->orig);
+		if (next->stats){
+			memset(&stats, 0, sizeof(stats));
+			stats.route=route;
+			int i, j;
+			for (i=0;i<ONION_URL_STATS_SHARDS;i++){
+				onion_url_stats_shard *shard=&next->stats[i];
+				stats.hits+=__atomic_load_n(&shard->hits, __ATOMIC_RELAXED);
+				stats.errors+=__atomic_load_n(&shard->errors, __ATOMIC_RELAXED);
+				for (j=0;j<ONION_URL_STATS_BUCKETS;j++)
+					stats.latency[j]+=__atomic_load_n(&shard->latency[j], __ATOMIC_RELAXED);
+			}
+			f(data, &stats);
 		}
-		
-		next=next->next;
+		if (next->inside && next->inside->priv_data_free==(void*)onion_url_free_data)
+			onion_url_stats_route(onion_handler_get_private_data(next->inside), route, f, data);
 	}
-	return 0;
+#endif
+}
+
+/// Calls f for the handler of each url, with the url as added. @see onion_handler_freeze
+static void onion_url_children(onion_url_router *router, onion_handler_child_f f, void *data){
+	onion_url_data *next;
+	for (next=router->first;next;next=next->next)
+		f(data, next->inside, next->orig);
+}
+
+/**
+ * @short Returns the latency, in microseconds, under which that percentage of the hits were.
+ * @memberof onion_url_t
+ * 
+ * As the buckets, it may be up to 12.5% over the real one. 
+ * 
+ * @param stats The stats of a route, from onion_url_stats
+ * @param percentile From 0 to 100, as 99 for the p99
+ * @returns The latency, or 0 if no hits.
+ */
+unsigned long onion_url_stats_percentile(const onion_url_route_stats *stats, double percentile){
+	unsigned long total=0;
+	int i;
+	for (i=0;i<ONION_URL_STATS_BUCKETS;i++)
+		total+=stats->latency[i];
+	if (total==0)
+		return 0;
+	unsigned long target=(unsigned long)(total*percentile/100.0+0.5);
+	if (target<1)
+		target=1;
+	unsigned long count=0;
+	for (i=0;i<ONION_URL_STATS_BUCKETS-1 && count+stats->latency[i]<target;i++)
+		count+=stats->latency[i];
+	if (i<16)
+		return i;
+	int e=i/8+2;
+	return ((unsigned long)(8+i%8+1)<<(e-3))-1; // Upper bound of the bucket
 }
 
 /// Removes internal data for this handler.
-void onion_url_free_data(onion_url_data **d){
-	onion_url_data *next=*d;
+void onion_url_free_data(void *_router){
+	onion_url_router *router=_router;
+	onion_url_data *next=router->first;
 	while (next){
 		onion_url_data *t=next;
 		onion_handler_free(t->inside);
@@ -122,13 +488,20 @@ void onion_url_free_data(onion_url_data **d){
 			regfree(&t->regexp);
 		else
 			free(t->str);
+		int i;
+		for (i=0;i<t->nparams;i++)
+			free(t->params[i]);
+		free(t->params);
 		next=t->next;
-#ifdef __DEBUG__
 		free(t->orig);
+#ifdef HAVE_ROUTE_STATS
+		free(t->stats);
 #endif
-		free(t);
+		onion_slab_free(t, sizeof(onion_url_data));
 	}
-	free(d);
+	if (router->trie)
+		onion_url_node_free(router->trie);
+	free(router);
 }
 
 /**
@@ -157,10 +530,12 @@ void onion_url_free_data(onion_url_data **d){
  *  onion_url_add(url, "^static/", onion_handler_export_local_new(".") ); // Export current directory at static
  *  onion_url_add(url, "^icons/(.*)", directory); // Compiles the regexp, and uses the .* as first argument.
  *  onion_url_add(url, "", redirect_to_index); // Matches an empty path. Not compiled.
+ *  onion_url_add(url, "users/:id/posts", posts); // The id at onion_request_get_url_param(req, "id"). Not compiled.
  * @endcode
  * 
- * Regexp can have groups, and they will be added as request query parameters, with just the number of the 
- * group as key. The groups start at 1, as 0 should be the full match, but its not added for performance
+ * Regexp can have groups, and they can be read as request query parameters, with just the number of the 
+ * group as key, or with onion_request_get_url_group. They are not added to the query dict: only where they 
+ * are at the path is kept, and the string is made when asked, so routing does not allocate. The groups start at 1, as 0 should be the full match, but its not added for performance
  * reasons; its a very strange situation that user will need it, and always can access full path with
  * onion_request_get_fullpath. Also all expression can be a group, and passed as nr 1.:
  * 
@@ -170,6 +545,14 @@ void onion_url_free_data(onion_url_data **d){
  *  onion_request_get_query(req, "1") == ".html"
  * @endcode
  * 
+ * Strings can also have :name segments, as "users/:id/posts", each matching up to the next /, and its value 
+ * is at onion_request_get_url_param(req, "id"), made at the request arena when asked, not at the query.
+ * 
+ * When looking for a match the first added one that matches is used, as if checked in order, but the 
+ * strings, the patterns and the regexps that are just ^ and a literal are at a radix trie, so finding them 
+ * costs about the length of the path, however many they are. Only the other regexps are checked with 
+ * regexec, and only those added before the trie match.
+ * 
  * Be careful as . means every character, and dots in URLs must be with a backslash \ (double because of
  * C escaping), if using regexps.
  * 
@@ -177,11 +560,13 @@ void onion_url_free_data(onion_url_data **d){
  * how to create proper regular expressions. They are compiled as REG_EXTENDED.
  */
 onion_url *onion_url_new(){
-	onion_url_data **priv_data=calloc(1,sizeof(onion_url_data*));
-	*priv_data=NULL;
+	onion_url_router *router=calloc(1,sizeof(onion_url_router));
+	router->last=&router->first;
+	router->last_regexp=&router->regexps;
 	
 	onion_handler *ret=onion_handler_new((onion_handler_handler)onion_url_handler,
-																			 priv_data,(onion_handler_private_data_free) onion_url_free_data);
+																			 router,(onion_handler_private_data_free) onion_url_free_data);
+	onion_handler_set_children(ret, (onion_handler_children_f)onion_url_children);
 	return (onion_url*)ret;
 }
 
@@ -193,7 +578,62 @@ void onion_url_free(onion_url* url){
 	onion_handler_free((onion_handler*)url);
 }
 
+/**
+ * @short If the regexp is ^ and a literal, maybe ending in $, sets it, unescaped, at literal.
+ * 
+ * @returns 1 if so, with exact set if it ended with $, or 0 if it needs regexec.
+ */
+static int onion_url_literal_regexp(const char *regexp, char *literal, int *exact){
+	const char *r=regexp+1;
+	*exact=0;
+	while (*r){
+		if (*r=='\\' && r[1] && !isalnum(r[1])) // \. and so on are just the char
+			r++;
+		else if (*r=='$' && r[1]=='\0'){
+			*exact=1;
+			break;
+		}
+		else if (strchr(".[]()*+?{}|^$\\", *r))
+			return 0;
+		*literal++=*r++;
+	}
+	*literal='\0';
+	return 1;
+}
 
+/**
+ * @short Adds the pattern to the trie, with its :name segments as params.
+ * 
+ * @returns 0 if ok, 1 if too many params.
+ */
+static int onion_url_add_pattern(onion_url_router *router, onion_url_data *data, const char *pattern){
+	onion_url_node *node=router->trie;
+	const char *p=pattern;
+	while (*p){
+		const char *param=p;
+		while (*param && !(*param==':' && (param==pattern || param[-1]=='/')))
+			param++;
+		node=onion_url_trie_add(node, p, param-p);
+		if (!*param)
+			break;
+		if (data->nparams==ONION_URL_MAX_PARAMS){
+			ONION_ERROR("Too many :params at '%s', at most %d", pattern, ONION_URL_MAX_PARAMS);
+			return 1;
+		}
+		const char *end=param+1;
+		while (*end && *end!='/')
+			end++;
+		data->params=realloc(data->params, sizeof(char*)*(data->nparams+1));
+		data->params[data->nparams++]=strndup(param+1, end-param-1);
+		if (!node->param)
+			node->param=onion_url_node_new("", 0);
+		node=node->param;
+		p=end;
+	}
+	if (!node->exact)
+		node->exact=data;
+	return 0;
+}
 
 /**
  * @short Adds a new handler with the given regexp.
@@ -201,18 +641,43 @@ void onion_url_free(onion_url* url){
  * 
  * Adds the given handler.
  * 
+ * Strings, strings with :name segments and regexps that are ^ and a literal, maybe with escaped 
+ * characters and a final $, go to the trie. The other regexps are compiled with regcomp.
+ * 
  * @returns 0 if everything ok. Else there is a regexp error.
  */
 int onion_url_add_handler(onion_url *url, const char *regexp, onion_handler *next){
-	onion_url_data **w=((onion_url_data**)onion_handler_get_private_data((onion_handler*)url));
-	while (*w){
-		w=&(*w)->next;
-	}
+	onion_url_router *router=onion_handler_get_private_data((onion_handler*)url);
 	//ONION_DEBUG("Adding handler at %p",w);
-	*w=malloc(sizeof(onion_url_data));
-	onion_url_data *data=*w;
+	onion_url_data *data=onion_slab_calloc(sizeof(onion_url_data));
+	data->priority=-1;
+	if (!router->trie)
+		router->trie=onion_url_node_new("", 0);
 	
-	data->flags=(regexp[0]=='^') ? OUD_REGEXP : OUD_STRCMP;
+	if (regexp[0]=='^'){
+		char *literal=malloc(strlen(regexp)+1);
+		int exact;
+		if (onion_url_literal_regexp(regexp, literal, &exact)){
+			data->flags=exact ? OUD_STRCMP : OUD_PREFIX;
+			data->str=literal;
+		}
+		else{
+			free(literal);
+			data->flags=OUD_REGEXP;
+		}
+	}
+	else{
+		data->flags=OUD_STRCMP;
+		data->str=strdup(regexp);
+		const char *p=regexp;
+		while ((p=strchr(p, ':'))){
+			if (p==regexp || p[-1]=='/'){
+				data->flags=OUD_PATTERN;
+				break;
+			}
+			p++;
+		}
+	}
 	
 	if (data->flags&OUD_REGEXP){
 		int err=regcomp(&data->regexp, regexp, REG_EXTENDED); // empty regexp, always true. should be fast enough. 
@@ -220,19 +685,41 @@ int onion_url_add_handler(onion_url *url, const char *regexp, onion_handler *nex
 			char buffer[1024];
 			regerror(err, &data->regexp, buffer, sizeof(buffer));
 			ONION_ERROR("Error analyzing regular expression '%s': %s.\n", regexp, buffer);
-			free(data);
-			*w=NULL;
+			onion_slab_free(data, sizeof(onion_url_data));
+			return 1;
+		}
+		*router->last_regexp=data;
+		router->last_regexp=&data->next_regexp;
+	}
+	else if (data->flags&OUD_PATTERN){
+		if (onion_url_add_pattern(router, data, regexp)){
+			int i;
+			for (i=0;i<data->nparams;i++)
+				free(data->params[i]);
+			free(data->params);
+			free(data->str);
+			onion_slab_free(data, sizeof(onion_url_data));
 			return 1;
 		}
 	}
 	else{
-		data->str=strdup(regexp);
+		onion_url_node *node=onion_url_trie_add(router->trie, data->str, strlen(data->str));
+		onion_url_data **at=(data->flags&OUD_PREFIX) ? &node->prefix : &node->exact;
+		if (!*at) // If repeated, the first is used anyway
+			*at=data;
 	}
-	data->next=NULL;
+	data->index=router->count++;
 	data->inside=next;
-#ifdef __DEBUG__
+	*router->last=data;
+	router->last=&data->next;
 	data->orig=strdup(regexp);
-#endif	
+#ifdef HAVE_ROUTE_STATS
+	if (router->stats){
+		onion_url_stats_new(data);
+		if (next && next->priv_data_free==(void*)onion_url_free_data)
+			onion_url_set_stats((onion_url*)next, 1);
+	}
+#endif
 	
 	return 0;
 }
@@ -267,6 +754,103 @@ int onion_url_add_url(onion_url *url, const char *regexp, onion_url *handler){
 	return onion_url_add_handler(url, regexp, (onion_handler*) handler);
 }
 
+/// Whether any route has a priority class, as only then the requests are classified.
+static int onion_url_priorities=0;
+
+/**
+ * @short Sets the priority class of the requests to a route, and to the urls added at it.
+ * @memberof onion_url_t
+ * 
+ * With worker threads (onion_set_workers), the requests of each class wait at their own queue, the ones of 
+ * OPRIO_HIGH run first, and each class may have a limit of requests running at a time 
+ * (onion_set_priority_class), so health checks or critical routes keep answering while bulk ones wait.
+ * 
+ * The class is known before the request goes to a worker, matching the path as the root url would, so 
+ * it works when the root handler of the server, or of the virtual host, is an onion_url. The class of an url added at a route 
+ * is kept over that of the route. Until a class is set, requests are not classified.
+ * 
+ * @param url The url
+ * @param regexp The route, as it was added.
+ * @param priority The class, as OPRIO_HIGH or OPRIO_LOW.
+ * @returns 0 if ok, -1 if there is no such route.
+ */
+int onion_url_set_priority(onion_url *url, const char *regexp, onion_priority_class priority){
+	onion_url_router *router=onion_handler_get_private_data((onion_handler*)url);
+	onion_url_data *data;
+	if (priority<0 || priority>=OPRIO_CLASSES)
+		return -1;
+	for (data=router->first;data;data=data->next){
+		if (strcmp(data->orig, regexp)==0){
+			data->priority=priority;
+			onion_url_priorities=1;
+			return 0;
+		}
+	}
+	ONION_ERROR("No route %s to set its priority", regexp);
+	return -1;
+}
+
+/**
+ * @short Gets the priority class of the request, of the route it would go to.
+ * @memberof onion_url_t
+ * 
+ * Does not change the request. OPRIO_NORMAL if no route has a class, the route has none, or url is not 
+ * an onion_url, so it can be called with any root handler.
+ */
+onion_priority_class onion_url_get_priority(onion_url *url, onion_request *req){
+	if (!onion_url_priorities || !url || ((onion_handler*)url)->priv_data_free!=(void*)onion_url_free_data)
+		return OPRIO_NORMAL;
+	return onion_url_priority(onion_handler_get_private_data((onion_handler*)url), onion_request_get_path(req), OPRIO_NORMAL);
+}
+
+/// Class of the route of the path at this router, and at the urls added at it; priority if none.
+static int onion_url_priority(onion_url_router *router, const char *path, int priority){
+	regmatch_t match[1];
+	onion_url_match m;
+	size_t length;
+	onion_url_data *data=onion_url_find(router, path, &m, match, 1, &length);
+	if (!data)
+		return priority;
+	if (data->priority>=0)
+		priority=data->priority;
+	if (data->inside && data->inside->priv_data_free==(void*)onion_url_free_data)
+		return onion_url_priority(onion_handler_get_private_data(data->inside), path+length, priority);
+	return priority;
+}
+
+/**
+ * @short The prerendered response of the route the request goes to.
+ * @memberof onion_url_t
+ * 
+ * Does not change the request. It is the one of url itself if it is not an onion_url but a handler with one, 
+ * or NULL. As it is looked up before the handlers, the routes with stats do not have it, so they are counted.
+ * 
+ * @see onion_handler_set_prerendered
+ */
+const onion_response_prerendered *onion_url_get_prerendered(onion_url *url, onion_request *req){
+	onion_handler *handler=(onion_handler*)url;
+	if (!onion_handler_prerendered_used || !handler)
+		return NULL;
+	if (handler->priv_data_free!=(void*)onion_url_free_data)
+		return handler->prerendered;
+	return onion_url_prerendered(onion_handler_get_private_data(handler), onion_request_get_path(req));
+}
+
+/// Prerendered response of the route of the path at this router, and at the urls added at it, or NULL.
+static const onion_response_prerendered *onion_url_prerendered(onion_url_router *router, const char *path){
+	if (router->stats)
+		return NULL;
+	regmatch_t match[1];
+	onion_url_match m;
+	size_t length;
+	onion_url_data *data=onion_url_find(router, path, &m, match, 1, &length);
+	if (!data || !data->inside)
+		return NULL;
+	if (data->inside->priv_data_free==(void*)onion_url_free_data)
+		return onion_url_prerendered(onion_handler_get_private_data(data->inside), path+length);
+	return data->inside->prerendered;
+}
+
 /**
  * @short Simple data needed for static data write
  * @private
@@ -274,6 +858,7 @@ int onion_url_add_url(onion_url *url, const char *regexp, onion_url *handler){
 struct onion_url_static_data{
 	char *text;
 	int code;
+	onion_response_prerendered *prerendered; ///< The same, written without calling the handler when possible
 };
 
 /// Handles the write of static data
@@ -287,18 +872,25 @@ static int onion_url_static(struct onion_url_static_data *data, onion_request *r
 /// Frees the static data
 static void onion_url_static_free(struct onion_url_static_data *data){
 	free(data->text);
-	free(data);
+	onion_response_prerendered_free(data->prerendered);
+	onion_slab_free(data, sizeof(struct onion_url_static_data));
 }
 
 /**
  * @short Adds a simple handler, it has static data and a default return code
  * @memberof onion_url_t
+ * 
+ * The whole response is prerendered now, so the requests to it, as the health checks of a load balancer, 
+ * are answered with one write and no response object. @see onion_handler_set_prerendered
  */
 int onion_url_add_static(onion_url *url, const char *regexp, const char *text, int http_code){
-	struct onion_url_static_data *d=malloc(sizeof(struct onion_url_static_data));
+	struct onion_url_static_data *d=onion_slab_alloc(sizeof(struct onion_url_static_data));
 	d->text=strdup(text);
 	d->code=http_code;
-	return onion_url_add_with_data(url, regexp, onion_url_static, d, onion_url_static_free);
+	d->prerendered=onion_response_prerender(http_code, NULL, text, strlen(text));
+	onion_handler *handler=onion_handler_new((onion_handler_handler)onion_url_static, d, (onion_handler_private_data_free)onion_url_static_free);
+	onion_handler_set_prerendered(handler, d->prerendered);
+	return onion_url_add_handler(url, regexp, handler);
 }
 
 /**
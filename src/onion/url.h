@@ -51,6 +51,31 @@ int onion_url_add_static(onion_url *url, const char *regexp, const char *text, i
 /// Returns the related handler for this url
 onion_handler *onion_url_to_handler(onion_url *url);
 
+/// Sets the priority class at the worker threads of the requests to a route, and to the urls at it.
+int onion_url_set_priority(onion_url *url, const char *regexp, onion_priority_class priority);
+/// The priority class of the route the request goes to. OPRIO_NORMAL if url is not an onion_url.
+onion_priority_class onion_url_get_priority(onion_url *url, onion_request *req);
+/// The prerendered response of the route the request goes to, or NULL if it has none. @see onion_handler_set_prerendered
+const onion_response_prerendered *onion_url_get_prerendered(onion_url *url, onion_request *req);
+
+/// Latency buckets of the route stats: exact up to 15 us, then about 12% wide, up to 268 s.
+#define ONION_URL_STATS_BUCKETS 208
+
+/// Stats of a route, summed from all the threads. @see onion_url_stats
+typedef struct onion_url_route_stats_t{
+	const char *route;      ///< As added, after the routes of the parent urls
+	unsigned long hits;
+	unsigned long errors;   ///< The handler returned an error, or answered a 5xx
+	unsigned long latency[ONION_URL_STATS_BUCKETS]; ///< Hits by handler time. @see onion_url_stats_percentile
+}onion_url_route_stats;
+
+/// Keeps, or stops keeping, the hits, errors and latency of each route, and of the urls at them.
+void onion_url_set_stats(onion_url *url, int enabled);
+/// Calls f with the stats of each route. Does nothing if url is not an onion_url.
+void onion_url_stats(onion_url *url, void (*f)(void *data, const onion_url_route_stats *stats), void *data);
+/// Returns the latency in microseconds under which that percentage of the hits were.
+unsigned long onion_url_stats_percentile(const onion_url_route_stats *stats, double percentile);
+
 #ifdef __cplusplus
 }
 #endif
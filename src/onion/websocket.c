@@ -24,25 +24,143 @@
 	*/
 
 #include "log.h"
+#include "trace.h"
 #include "websocket.h"
 #include "response.h"
 #include "types_internal.h"
 #include "request.h"
 #include "codecs.h"
 #include "random.h"
+#include "pool.h"
 
 #include <poll.h>
 #include <errno.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdlib.h>
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 enum onion_websocket_flags_e{
 	WS_FIN=1,
 	WS_MASK=2,
+	WS_DEFLATE=4, ///< Compressed message (RSV1). Once inflated, it is read from the deflate state.
+};
+
+/// Of the message being written by fragments.
+enum onion_websocket_send_flags_e{
+	WS_SENDING=1,      ///< Some fragments were written, but not the final one.
+	WS_SEND_DEFLATE=2, ///< It is compressed.
+};
+
+#ifdef HAVE_ZLIB
+/// Messages smaller than this are not compressed, as it does not pay.
+#define ONION_WEBSOCKET_DEFLATE_MIN_SIZE 64
+
+/// permessage-deflate state, as negotiated. The streams are created as needed; without context takeover, freed after each message.
+typedef struct onion_websocket_deflate_t{
+	z_stream deflate;
+	z_stream inflate;
+	char deflate_ready;
+	char inflate_ready;
+	char server_no_context_takeover;
+	char client_no_context_takeover;
+	int8_t server_window_bits;
+	int8_t client_window_bits;
+	int8_t mem_level;
+	char *message;          ///< The inflated message being read, or NULL.
+	size_t message_size;
+	size_t message_allocated;
+}onion_websocket_deflate;
+#endif
+
+/// A frame encoded once, shared by all the queues it is at.
+typedef struct{
+	int refcount; ///< Atomic
+	size_t size;
+	char data[];
+}onion_websocket_frame;
+
+typedef struct onion_websocket_queued_t{
+	onion_websocket_frame *frame;
+	struct onion_websocket_queued_t *next;
+}onion_websocket_queued;
+
+/// A subscription, at the array of the group and at the list of the websocket.
+typedef struct onion_websocket_member_t{
+	onion_websocket_group *group;
+	onion_websocket *ws;
+	int index;                             ///< At the group
+	struct onion_websocket_member_t *next; ///< Of the websocket
+}onion_websocket_member;
+
+/// The send queue of a websocket, since it is first subscribed to a group.
+typedef struct onion_websocket_queue_t{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;       ///< For the queue and the members. After the one of the group, if both.
+	pthread_mutex_t write_mutex; ///< So the frames are written whole, one after the other.
+#endif
+	int wakefd;                  ///< eventfd, signaled when the queue gets frames, so the websocket loop writes them.
+	onion_websocket_queued *head, *tail;
+	int count;
+	char disconnect;             ///< A group closed it, as a slow consumer.
+	onion_websocket_member *members;
+	onion_websocket_queued *send_head, *send_tail; ///< Written with the send queue set. @see onion_websocket_set_send_queue
+	size_t send_bytes;           ///< Atomic, as writers check it without the mutex.
+	size_t high, low;            ///< Watermarks of send_bytes, or 0 if the writes are not queued.
+	char full;                   ///< Got to high, so writable is called at low.
+	char sending_fragment;       ///< The last data frame written from send was not final, so the group frames wait.
+	onion_websocket_writable_callback_t writable;
+}onion_websocket_queue;
+
+struct onion_websocket_group_t{
+#ifdef HAVE_PTHREADS
+	pthread_mutex_t mutex;
+#endif
+	int refcount;                ///< Atomic. The owner, and the websockets unsubscribing as they are freed.
+	onion_websocket_group_policy policy;
+	int max_queue;
+	onion_websocket_member **members;
+	int count;
+	int allocated;
 };
 
 static int onion_websocket_read_packet_header(onion_websocket *ws);
+static int onion_websocket_read_frame_header(onion_websocket *ws);
+static int onion_websocket_pong(onion_websocket *ws);
+static int onion_websocket_skip_pong(onion_websocket *ws);
+static int onion_websocket_write_control(onion_websocket *ws, onion_websocket_opcode opcode, const char *data, size_t len);
+static int onion_websocket_keepalive_timeout(onion_websocket *ws);
+static int onion_websocket_keepalive(onion_websocket *ws);
+static int64_t onion_websocket_now();
+static int onion_websocket_header(unsigned char *header, onion_websocket_opcode opcode, size_t len, int fin);
+static int onion_websocket_send(onion_websocket *ws, const unsigned char *header, int hlen, const char *payload, size_t plen);
+static int onion_websocket_drain(onion_websocket *ws, int writable_only);
+static void onion_websocket_unmask(char *data, size_t len, const char *mask, int pos);
+static void onion_websocket_frame_release(onion_websocket_frame *frame);
+static onion_websocket_queue *onion_websocket_queue_get(onion_websocket *ws);
+static void onion_websocket_queue_clear(onion_websocket_queue *q);
+static void onion_websocket_queued_free(onion_websocket_queued *n);
+static void onion_websocket_queue_wake(onion_websocket_queue *q);
+static int onion_websocket_queue_pending(onion_websocket_queue *q);
+static void onion_websocket_group_release(onion_websocket_group *group);
+#ifdef HAVE_ZLIB
+static onion_websocket_deflate *onion_websocket_deflate_negotiate(onion *server, const char *offers, char *answer, size_t size);
+static int onion_websocket_deflate_data(onion_websocket *ws, const char *buffer, size_t len, int fin, char *tmp, size_t tmpsize, char **out, size_t *outlen);
+static int onion_websocket_inflate_message(onion_websocket *ws);
+static int onion_websocket_read_inflated(onion_websocket *ws, char *buffer, size_t len);
+#endif
 
 const static char *websocket_magic_13="258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 const static int websocket_magic_13_length=36;
@@ -67,7 +185,7 @@ onion_websocket* onion_websocket_new(onion_request* req, onion_response *res)
 
 	onion_random_init();
 	
-	const char *upgrade=onion_request_get_header(req,"Upgrade");
+	const char *upgrade=onion_request_get_header_id(req, ONION_H_UPGRADE);
 	if (!upgrade || strcasecmp(upgrade,"websocket")!=0)
 		return NULL;
 	
@@ -95,10 +213,9 @@ onion_websocket* onion_websocket_new(onion_request* req, onion_response *res)
 	char ws_sha1[20];
 	onion_sha1(tmp, length+websocket_magic_13_length, ws_sha1);
 	
-	char *key_answer=onion_base64_encode(ws_sha1, 20);
-	char *p;
-	for(p=key_answer;*p!='\n';++p);
-	*p=0;
+	char key_answer[32];
+	size_t key_length=onion_base64_encode_to(ws_sha1, 20, key_answer);
+	key_answer[key_length-1]='\0'; // No new line
 	
 	onion_response_set_code(res, HTTP_SWITCH_PROTOCOL);
 	res->flags|=OR_CONNECTION_UPGRADE;
@@ -106,12 +223,22 @@ onion_websocket* onion_websocket_new(onion_request* req, onion_response *res)
 	if (ws_protocol)
 		onion_response_set_header(res, "Sec-Websocket-Procotol", ws_protocol);
 	onion_response_set_header(res, "Sec-Websocket-Accept", key_answer);
-	free(key_answer);
+	onion *server=req->connection.listen_point ? req->connection.listen_point->server : NULL;
+#ifdef HAVE_ZLIB
+	onion_websocket_deflate *deflate=NULL;
+	const char *ws_extensions=onion_request_get_header(req,"Sec-Websocket-Extensions");
+	if (ws_extensions && server && server->websocket_deflate.window_bits){
+		char answer[256];
+		deflate=onion_websocket_deflate_negotiate(server, ws_extensions, answer, sizeof(answer));
+		if (deflate)
+			onion_response_set_header(res, "Sec-Websocket-Extensions", answer);
+	}
+#endif
 	
 	onion_response_write_headers(res);
 	onion_response_write(res, "",0); // AKA flush
 	
-	onion_websocket *ret=malloc(sizeof(onion_websocket));
+	onion_websocket *ret=onion_slab_alloc(sizeof(onion_websocket));
 	ret->callback=NULL;
 	ret->req=req;
 	ret->data_left=0;
@@ -119,6 +246,19 @@ onion_websocket* onion_websocket_new(onion_request* req, onion_response *res)
 	ret->user_data=req->data;
 	ret->free_user_data=NULL;
 	ret->opcode=OWS_TEXT;
+	ret->send_flags=0;
+	ret->ping_interval=0;
+	ret->pong_timeout=0;
+	ret->last_read=0;
+	ret->ping_sent=0;
+	ret->queue=NULL;
+	if (server)
+		onion_websocket_set_keepalive(ret, server->websocket_ping_interval, server->websocket_pong_timeout);
+#ifdef HAVE_ZLIB
+	ret->deflate=deflate;
+#else
+	ret->deflate=NULL;
+#endif
 	
 	req->websocket=ret;
 	
@@ -135,13 +275,50 @@ onion_websocket* onion_websocket_new(onion_request* req, onion_response *res)
  * @param ws
  */
 void onion_websocket_free(onion_websocket *ws){
+	onion_websocket_queue *q=ws->queue;
+	if (q){ // Out of its groups. Each is kept meanwhile, as it may be freed at the same time.
+		while (1){
+#ifdef HAVE_PTHREADS
+			pthread_mutex_lock(&q->mutex);
+#endif
+			onion_websocket_group *group=q->members ? q->members->group : NULL;
+			if (group)
+				__sync_fetch_and_add(&group->refcount, 1);
+#ifdef HAVE_PTHREADS
+			pthread_mutex_unlock(&q->mutex);
+#endif
+			if (!group)
+				break;
+			onion_websocket_group_unsubscribe(group, ws);
+			onion_websocket_group_release(group);
+		}
+		onion_websocket_queue_clear(q);
+		onion_websocket_queued_free(q->send_head);
+		close(q->wakefd);
+#ifdef HAVE_PTHREADS
+		pthread_mutex_destroy(&q->mutex);
+		pthread_mutex_destroy(&q->write_mutex);
+#endif
+		free(q);
+	}
+#ifdef HAVE_ZLIB
+	onion_websocket_deflate *d=ws->deflate;
+	if (d){
+		if (d->deflate_ready)
+			deflateEnd(&d->deflate);
+		if (d->inflate_ready)
+			inflateEnd(&d->inflate);
+		free(d->message);
+		free(d);
+	}
+#endif
 	if (ws->free_user_data)
 		ws->free_user_data(ws->user_data);
 
 	onion_random_free();
 
 	ws->req->websocket=NULL; // To avoid double free on stupid programs that call this directly.
-	free(ws);
+	onion_slab_free(ws, sizeof(onion_websocket));
 }
 
 
@@ -149,65 +326,166 @@ void onion_websocket_free(onion_websocket *ws){
  * @short Writes a fragment to the websocket
  * @memberof onion_websocket_t
  * 
+ * It is a whole message, as a single final frame. With permessage-deflate, text and binary messages
+ * are compressed, except the small ones. With a send queue it is queued, and it does not wait for the socket.
+ * 
  * @param ws The Websocket
  * @param buffer Data to write
  * @param _len Length of data to write
  * @returns Bytes written or <0 if error writting.
  */
-int onion_websocket_write(onion_websocket* ws, const char* buffer, size_t _len)
+int onion_websocket_write(onion_websocket* ws, const char* buffer, size_t len)
 {
-	int len=_len; // I need it singed here
 	//ONION_DEBUG("Write %d bytes",len);
-	{
-		char header[16];
-		int hlen=2;
-		header[0]=0x80|(ws->opcode&0x0F); // Also final in fragment.
-		header[1]=0x00; // Do not mask on send
-		if (len<126)
-			header[1]|=len;
-		else if (len<0x0FFFF){
-			header[1]|=126;
-			header[2]=(len>>8)&0x0FF;
-			header[3]=(len)&0x0FF;
-			hlen+=2;
-		}
-		else{
-			header[1]|=127;
-			int i;
-			int tlen=len;
-			for(i=0;i<8;i++){
-				header[3+8-i]=tlen&0x0FF;
-				tlen>>=8;
-			}
-			hlen+=8;
-		}
-		
-		/*
-		int i;
-		for(i=0;i<hlen;i++){
-			ONION_DEBUG("%d: %02X", i, header[i]&0x0FF);
-		}
-		*/
-		
-		ws->req->connection.listen_point->write(ws->req, header, hlen);
+	return onion_websocket_write_fragment(ws, buffer, len, 1);
+}
+
+/**
+ * @short Writes a fragment of a message, so big messages are streamed with bounded memory.
+ * @memberof onion_websocket_t
+ * 
+ * The first fragment has the opcode of the websocket, the next ones are continuations, up to the final 
+ * one. Control frames, as pongs, may be written in between. Compressed messages are a single deflate 
+ * stream, flushed at each fragment.
+ * 
+ * With a send queue at its high watermark nothing is written, and it returns -1 with errno EAGAIN, until 
+ * the writable callback is called. Control frames are queued anyway.
+ * 
+ * @param ws The websocket
+ * @param buffer Data to write
+ * @param len Its length
+ * @param fin Whether it is the last fragment of the message
+ * @returns Bytes written, or queued, or <0 on error.
+ */
+int onion_websocket_write_fragment(onion_websocket *ws, const char *buffer, size_t len, int fin){
+	int control=(ws->opcode&0x08);
+	int first=control || !(ws->send_flags&WS_SENDING);
+	onion_websocket_queue *q=ws->queue;
+	if (q && q->high && !control && __atomic_load_n(&q->send_bytes, __ATOMIC_RELAXED)>=q->high){ // Before compressing, as it changes the stream.
+		errno=EAGAIN;
+		return -1;
 	}
-	/// FIXME! powerup using int32_t as basic type.
-	int ret=0;
-	int i,j;
-	char tout[1024];
-	for(i=0;i<len-1024;i+=1024){
-		for (j=0;j<sizeof(tout);j++){
-			//ONION_DEBUG("At %d, %02X ^ %02X = %02X", (i+j)&1023, buffer[i+j]&0x0FF, mask[j&3]&0x0FF, (buffer[i]^mask[j&3])&0x0FF);
-			tout[j]=buffer[i+j];
+	if (control)
+		fin=1;
+	
+	const char *payload=buffer;
+	size_t plen=len;
+	char tmp[4096], *out=NULL;
+	int deflated=0;
+#ifdef HAVE_ZLIB
+	if (!control && ws->deflate && (first ? ((ws->opcode==OWS_TEXT || ws->opcode==OWS_BINARY) && (!fin || len>=ONION_WEBSOCKET_DEFLATE_MIN_SIZE)) 
+	                                      : (ws->send_flags&WS_SEND_DEFLATE))){
+		if (onion_websocket_deflate_data(ws, buffer, len, fin, tmp, sizeof(tmp), &out, &plen)<0)
+			return -1;
+		payload=out;
+		deflated=1;
+	}
+#endif
+	unsigned char header[10];
+	int hlen=onion_websocket_header(header, first ? ws->opcode : 0, plen, fin);
+	if (deflated && first)
+		header[0]|=0x40; // RSV1, compressed
+	int r=onion_websocket_send(ws, header, hlen, payload, plen);
+	if (out && out!=tmp)
+		free(out);
+	if (!control){
+		if (fin)
+			ws->send_flags=0;
+		else
+			ws->send_flags=WS_SENDING|(deflated ? WS_SEND_DEFLATE : 0);
+	}
+	return (r<0) ? -1 : (int)len;
+}
+
+/// Writes the frame now, or appends it to the send queue if it is set.
+static int onion_websocket_send(onion_websocket *ws, const unsigned char *header, int hlen, const char *payload, size_t plen){
+	onion_websocket_queue *q=ws->queue;
+	ONION_TRACE(websocket_frame_out, ws->req->connection.fd, header[0]&0x0F, plen);
+	if (!q || !q->high){ // Header and payload at once, without copies.
+		struct iovec iov[2]={ { (void*)header, hlen }, { (void*)payload, plen } };
+		return onion_request_output_writev(ws->req, iov, plen ? 2 : 1);
+	}
+	onion_websocket_frame *frame=malloc(sizeof(onion_websocket_frame)+hlen+plen);
+	onion_websocket_queued *queued=malloc(sizeof(onion_websocket_queued));
+	if (!frame || !queued){
+		ONION_ERROR("Could not queue a websocket frame of %ld bytes", (long)plen);
+		free(frame);
+		free(queued);
+		return -1;
+	}
+	frame->refcount=1;
+	frame->size=hlen+plen;
+	memcpy(frame->data, header, hlen);
+	memcpy(frame->data+hlen, payload, plen);
+	queued->frame=frame;
+	queued->next=NULL;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&q->mutex);
+#endif
+	if (q->send_tail)
+		q->send_tail->next=queued;
+	else
+		q->send_head=queued;
+	q->send_tail=queued;
+	if (__atomic_add_fetch(&q->send_bytes, frame->size, __ATOMIC_RELAXED)>=q->high)
+		q->full=1;
+	int wake=(q->send_head==queued);
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&q->mutex);
+#endif
+	if (wake)
+		onion_websocket_queue_wake(q);
+	return plen;
+}
+
+/// Writes the header of a fragment of that length, not masked, as the server does. Returns its length, up to 10.
+static int onion_websocket_header(unsigned char *header, onion_websocket_opcode opcode, size_t len, int fin){
+	int hlen=2;
+	header[0]=(fin ? 0x80 : 0x00)|(opcode&0x0F);
+	header[1]=0x00; // Do not mask on send
+	if (len<126)
+		header[1]|=len;
+	else if (len<=0x0FFFF){
+		header[1]|=126;
+		header[2]=(len>>8)&0x0FF;
+		header[3]=(len)&0x0FF;
+		hlen+=2;
+	}
+	else{
+		header[1]|=127;
+		int i;
+		uint64_t tlen=len;
+		for(i=0;i<8;i++){ // Network order
+			header[9-i]=tlen&0x0FF;
+			tlen>>=8;
 		}
-		ret+=ws->req->connection.listen_point->write(ws->req, tout, sizeof(tout));
+		hlen+=8;
 	}
-	for(;i<len;i++){
-		//ONION_DEBUG("At %d, %02X ^ %02X = %02X", i&1023, buffer[i]&0x0FF, mask[i&3]&0x0FF, (buffer[i]^mask[i&3])&0x0FF);
-		tout[i&1023]=buffer[i];
+	return hlen;
+}
+
+/**
+ * @short Unmasks the data in place, 8 bytes at a time.
+ * 
+ * The mask is repeated to 64 bits from the current position, so the XOR of each word is the one of its 
+ * bytes; the compiler also vectorizes the loop.
+ */
+static void onion_websocket_unmask(char *data, size_t len, const char *mask, int pos){
+	unsigned char m[8];
+	int i;
+	for (i=0;i<8;i++)
+		m[i]=mask[(pos+i)&3];
+	uint64_t m64;
+	memcpy(&m64, m, 8);
+	size_t j=0;
+	for (;j+8<=len;j+=8){ // memcpy as the data may be unaligned; it is a plain load and store.
+		uint64_t v;
+		memcpy(&v, data+j, 8);
+		v^=m64;
+		memcpy(data+j, &v, 8);
 	}
-	
-	return ret+ws->req->connection.listen_point->write(ws->req, tout, len&1023);
+	for (;j<len;j++)
+		data[j]^=m[j&7];
 }
 
 /**
@@ -240,14 +518,16 @@ int onion_websocket_read(onion_websocket* ws, char* buffer, size_t len)
 		len=ws->data_left;
 		//ONION_DEBUG("Read %d bytes now, %d bytes later", len, left_len);
 	}
-	int r=ws->req->connection.listen_point->read(ws->req, buffer, len);
-	if (ws->flags&WS_MASK){
-		char *p=buffer;
-		int i;
-		for(i=0;i<r;i++){
-			*p=*p^ws->mask[(ws->mask_pos++)&3];
-			p++;
-		}
+	int r;
+#ifdef HAVE_ZLIB
+	if (ws->flags&WS_DEFLATE)
+		r=onion_websocket_read_inflated(ws, buffer, len);
+	else
+#endif
+	r=ws->req->connection.listen_point->read(ws->req, buffer, len);
+	if (r>0 && ws->flags&WS_MASK){
+		onion_websocket_unmask(buffer, r, ws->mask, ws->mask_pos);
+		ws->mask_pos=(ws->mask_pos+r)&3;
 	}
 	ws->data_left-=r;
 	
@@ -260,6 +540,38 @@ int onion_websocket_read(onion_websocket* ws, char* buffer, size_t len)
 	return r;
 }
 
+/**
+ * @short Reads only from the current fragment, so big messages are streamed with bounded memory.
+ * @memberof onion_websocket_t
+ * 
+ * If the fragment was all read, it waits for the next one, answering the pings meanwhile. Continuations 
+ * keep the opcode of their message. Compressed messages are inflated whole, so they are read as a single 
+ * fragment.
+ * 
+ * @param ws The websocket
+ * @param buffer Where to read
+ * @param len Its size
+ * @param fin Set to 1 when the end of the message is read, else to 0. May be NULL.
+ * @returns Bytes read, up to len, or <0 on error.
+ */
+int onion_websocket_read_fragment(onion_websocket *ws, char *buffer, size_t len, int *fin){
+	while (ws->data_left==0){
+		int opcode=onion_websocket_read_packet_header(ws);
+		if (opcode<0){
+			ONION_ERROR("Error reading websocket header");
+			return -1;
+		}
+		if (opcode!=OWS_PING && opcode!=OWS_PONG)
+			break;
+	}
+	if (len>ws->data_left)
+		len=ws->data_left;
+	int r=len ? onion_websocket_read(ws, buffer, len) : 0;
+	if (fin)
+		*fin=(r>=0 && ws->data_left==0 && (ws->flags&WS_FIN));
+	return r;
+}
+
 /**
  * @short Uses printf-style writing to the websocket
  * @memberof onion_websocket_t
@@ -326,8 +638,35 @@ void onion_websocket_set_userdata(onion_websocket *ws, void *userdata, void (*fr
 
 /**
  * @short Reads a packet header.
+ * 
+ * Pings are answered, and compressed messages are read whole and inflated.
+ * 
+ * @returns The opcode of the frame, or <0 on error.
  */
 static int onion_websocket_read_packet_header(onion_websocket *ws){
+	int opcode=onion_websocket_read_frame_header(ws);
+	if (opcode<0)
+		return -1;
+	if (opcode==OWS_PING) // I do answer ping myself.
+		return (onion_websocket_pong(ws)<0) ? -1 : opcode;
+	if (opcode==OWS_PONG) // And the pongs, to my pings.
+		return (onion_websocket_skip_pong(ws)<0) ? -1 : opcode;
+#ifdef HAVE_ZLIB
+	if (ws->flags&WS_DEFLATE && onion_websocket_inflate_message(ws)<0)
+		return -1;
+#endif
+	return opcode;
+}
+
+/**
+ * @short Reads the header of a frame: flags, opcode, length and mask.
+ * 
+ * Continuations keep the opcode of their message, and pings and pongs the current one, as they are answered
+ * here. Any frame shows the peer is alive, for the keepalive.
+ * 
+ * @returns The opcode of the frame, or <0 on error.
+ */
+static int onion_websocket_read_frame_header(onion_websocket *ws){
 	char tmp[8];
 	unsigned char *utmp=(unsigned char*)tmp;
 	int r=ws->req->connection.listen_point->read(ws->req, tmp, 2);
@@ -338,13 +677,26 @@ static int onion_websocket_read_packet_header(onion_websocket *ws){
 		ws->flags|=WS_FIN;
 	if (tmp[1]&0x80)
 		ws->flags|=WS_MASK;
-	ws->opcode=tmp[0]&0x0F;
+	if (tmp[0]&0x40){ // RSV1, only at the first frame of compressed messages
+		if (!ws->deflate || (tmp[0]&0x0F)==0 || (tmp[0]&0x08)){
+			ONION_ERROR("Websocket frame with RSV1, but it is not the start of a compressed message");
+			return -1;
+		}
+		ws->flags|=WS_DEFLATE;
+	}
+	int opcode=tmp[0]&0x0F;
+	if (opcode!=0 && opcode!=OWS_PING && opcode!=OWS_PONG)
+		ws->opcode=opcode;
+	if (ws->ping_interval){
+		ws->last_read=onion_websocket_now();
+		ws->ping_sent=0;
+	}
 	ws->data_left=tmp[1]&0x7F;
 	if (ws->data_left==126){
 		r=ws->req->connection.listen_point->read(ws->req, tmp, 2);
 		if (r!=2){ ONION_DEBUG("Error reading header"); return -1; }
 		ONION_DEBUG("%d %d", utmp[0], utmp[1]);
-		ws->data_left=utmp[0] + utmp[1]*256;
+		ws->data_left=(utmp[0]<<8) + utmp[1]; // Network order
 	}
 	else if (ws->data_left==127){
 		r=ws->req->connection.listen_point->read(ws->req, tmp, 8);
@@ -353,7 +705,7 @@ static int onion_websocket_read_packet_header(onion_websocket *ws){
 		ws->data_left=0;
 		int i;
 		for(i=0;i<8;i++)
-			ws->data_left+=utmp[i]<<(i*8); // Maybe problematic on 32bits systems
+			ws->data_left=(ws->data_left<<8) + utmp[i]; // Network order
 	}
 	ONION_DEBUG("Data left %d", ws->data_left);
 	if (ws->flags&WS_MASK){
@@ -361,17 +713,41 @@ static int onion_websocket_read_packet_header(onion_websocket *ws){
 		if (r!=4){ ONION_DEBUG("Error reading header"); return -1; }
 		ws->mask_pos=0;
 	}
+	ONION_TRACE(websocket_frame_in, ws->req->connection.fd, opcode, ws->data_left);
+	return opcode;
+	//ONION_DEBUG("Mask %02X %02X %02X %02X", ws->mask[0]&0x0FF, ws->mask[1]&0x0FF, ws->mask[2]&0x0FF, ws->mask[3]&0x0FF);
+}
+
+/// Answers the ping just read with a pong of the same data.
+static int onion_websocket_pong(onion_websocket *ws){
+	char *data=malloc(ws->data_left);
+	ssize_t r=ws->data_left ? onion_websocket_read(ws,data, ws->data_left) : 0;
 	
-	if (ws->opcode==OWS_PING){ // I do answer ping myself.
-		onion_websocket_set_opcode(ws, OWS_PONG);
-		char *data=malloc(ws->data_left);
-		ssize_t r=onion_websocket_read(ws,data, ws->data_left);
-		
-		onion_websocket_write(ws, data, r);
+	if (r>=0)
+		onion_websocket_write_control(ws, OWS_PONG, data, r);
+	free(data);
+	return r<0 ? -1 : 0;
+}
+
+/// Skips the data of the pong just read.
+static int onion_websocket_skip_pong(onion_websocket *ws){
+	char data[128];
+	while (ws->data_left>0){
+		ssize_t r=ws->req->connection.listen_point->read(ws->req, data, (ws->data_left<sizeof(data)) ? ws->data_left : sizeof(data));
+		if (r<=0)
+			return -1;
+		ws->data_left-=r;
 	}
-	
 	return 0;
-	//ONION_DEBUG("Mask %02X %02X %02X %02X", ws->mask[0]&0x0FF, ws->mask[1]&0x0FF, ws->mask[2]&0x0FF, ws->mask[3]&0x0FF);
+}
+
+/// Writes a control frame, keeping the opcode of the messages.
+static int onion_websocket_write_control(onion_websocket *ws, onion_websocket_opcode opcode, const char *data, size_t len){
+	onion_websocket_opcode message_opcode=ws->opcode;
+	ws->opcode=opcode;
+	int r=onion_websocket_write(ws, data, len);
+	ws->opcode=message_opcode;
+	return r;
 }
 
 /**
@@ -382,14 +758,34 @@ onion_connection_status onion_websocket_call(onion_websocket* ws)
 {
 	onion_connection_status ret=OCS_NEED_MORE_DATA;
 	while(ret==OCS_NEED_MORE_DATA){
+		if (ws->queue && onion_websocket_drain(ws, 1)<0)
+			return OCS_CLOSE_CONNECTION;
 		if (ws->req->connection.fd>0){
-			struct pollfd pfd;
-			pfd.events=POLLIN;
-			pfd.fd=ws->req->connection.fd;
+			struct pollfd pfd[2];
+			int n=1;
+			pfd[0].events=POLLIN;
+			pfd[0].fd=ws->req->connection.fd;
+			if (ws->queue){ // Also wakes to write the queued frames, as they come and as the socket is writable.
+				if (onion_websocket_queue_pending(ws->queue))
+					pfd[0].events|=POLLOUT;
+				pfd[1].events=POLLIN;
+				pfd[1].fd=ws->queue->wakefd;
+				n=2;
+			}
 			//ONION_DEBUG("Wait for data");
-			int r=poll(&pfd,1, -1);
-			if (r==0)
-				return OCS_INTERNAL_ERROR;
+			int r=poll(pfd,n, onion_websocket_keepalive_timeout(ws));
+			if (r==0){ // Time to ping, or the pong is late
+				if (onion_websocket_keepalive(ws)<0)
+					return OCS_CLOSE_CONNECTION;
+				continue;
+			}
+			if (n==2 && pfd[1].revents){
+				uint64_t v;
+				if (read(ws->queue->wakefd, &v, sizeof(v))<0 && errno!=EAGAIN)
+					ONION_ERROR("Error reading the websocket queue eventfd");
+			}
+			if (r>0 && !(pfd[0].revents&~POLLOUT)) // Only to write
+				continue;
 			//ONION_DEBUG("waited for data fd %d -- res %d -- events %d", ws->req->fd, r, pfd.events);
 		}
 		else
@@ -417,6 +813,60 @@ onion_connection_status onion_websocket_call(onion_websocket* ws)
 	return OCS_INTERNAL_ERROR;
 }
 
+/**
+ * @short Sets the keepalive of the websocket.
+ * @memberof onion_websocket_t
+ * 
+ * When it reads nothing for interval_ms, it is pinged from the websocket loop, and if it reads nothing 
+ * more, as the pong, in timeout_ms, it is closed. It is the timeout of the poll of the loop, so it costs 
+ * nothing else, as there is no timer for each websocket. The default is the one of the server.
+ * 
+ * @see onion_set_websocket_keepalive
+ * 
+ * @param ws The websocket
+ * @param interval_ms Idle time to ping at, or 0 to not ping.
+ * @param timeout_ms Time to get an answer, or 0 for the same as the interval.
+ */
+void onion_websocket_set_keepalive(onion_websocket *ws, int interval_ms, int timeout_ms){
+	ws->ping_interval=interval_ms>0 ? interval_ms : 0;
+	ws->pong_timeout=timeout_ms>0 ? timeout_ms : ws->ping_interval;
+	ws->last_read=ws->ping_interval ? onion_websocket_now() : 0;
+	ws->ping_sent=0;
+}
+
+/// The timeout for the poll of the loop, up to the next ping, or to the deadline of the pong; or -1.
+static int onion_websocket_keepalive_timeout(onion_websocket *ws){
+	if (!ws->ping_interval)
+		return -1;
+	int64_t at=ws->ping_sent ? ws->ping_sent+ws->pong_timeout : ws->last_read+ws->ping_interval;
+	int64_t left=at-onion_websocket_now();
+	return (left<0) ? 0 : (int)left;
+}
+
+/// Pings the websocket if idle, or returns -1 to close it if the pong is late.
+static int onion_websocket_keepalive(onion_websocket *ws){
+	int64_t now=onion_websocket_now();
+	if (ws->ping_sent){
+		if (now>=ws->ping_sent+ws->pong_timeout){
+			ONION_DEBUG("Websocket did not answer the ping in %d ms, closing it", ws->pong_timeout);
+			return -1;
+		}
+	}
+	else if (now>=ws->last_read+ws->ping_interval){
+		if (onion_websocket_write_control(ws, OWS_PING, NULL, 0)<0)
+			return -1;
+		ws->ping_sent=now;
+	}
+	return 0;
+}
+
+/// Monotonic time, in ms.
+static int64_t onion_websocket_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
 /**
  * @short Sets the opcode for the websocket
  * 
@@ -445,3 +895,759 @@ onion_websocket_opcode onion_websocket_get_opcode(onion_websocket* ws)
 	return ws->opcode;
 }
 
+
+/**
+ * @short Writes the queued frames, of the groups and the send queue, in order.
+ * @memberof onion_websocket_t
+ * 
+ * The websocket loop of the callbacks calls it as frames are queued, so normally there is no need to. 
+ * On the blocking mode without callbacks, call it to send them.
+ * 
+ * @returns The frames written, or <0 if the connection is closed, maybe by OWS_GROUP_DISCONNECT.
+ */
+int onion_websocket_flush_queue(onion_websocket *ws){
+	return onion_websocket_drain(ws, 0);
+}
+
+/**
+ * @short Writes the queued frames. The ones of the groups only between the messages of the send queue.
+ * 
+ * With writable_only it stops when the socket is not writable, so the websocket loop goes on reading.
+ * 
+ * @returns The frames written, or <0 to close the connection.
+ */
+static int onion_websocket_drain(onion_websocket *ws, int writable_only){
+	onion_websocket_queue *q=ws->queue;
+	if (!q)
+		return 0;
+	int n=0, writable=0, group_turn=1;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&q->write_mutex);
+#endif
+	while (1){
+		if (writable_only && ws->req->connection.fd>0){
+			struct pollfd pfd={ ws->req->connection.fd, POLLOUT, 0 };
+			if (poll(&pfd, 1, 0)<=0 || !(pfd.revents&POLLOUT))
+				break;
+		}
+#ifdef HAVE_PTHREADS
+		pthread_mutex_lock(&q->mutex);
+#endif
+		onion_websocket_queued *head=NULL;
+		if (!q->disconnect){
+			// Alternates between both, so none starves; the fragments of a message go all together.
+			if (q->head && !q->sending_fragment && (group_turn || !q->send_head)){
+				head=q->head;
+				q->head=head->next;
+				if (!q->head)
+					q->tail=NULL;
+				q->count--;
+			}
+			else if (q->send_head){
+				head=q->send_head;
+				q->send_head=head->next;
+				if (!q->send_head)
+					q->send_tail=NULL;
+				if (__atomic_sub_fetch(&q->send_bytes, head->frame->size, __ATOMIC_RELAXED)<=q->low && q->full){
+					q->full=0;
+					writable=1;
+				}
+				if (!(head->frame->data[0]&0x08)) // Data frames, not control ones in between
+					q->sending_fragment=!(head->frame->data[0]&0x80);
+			}
+			group_turn=!group_turn;
+		}
+		int disconnect=q->disconnect;
+#ifdef HAVE_PTHREADS
+		pthread_mutex_unlock(&q->mutex);
+#endif
+		if (!head){
+			if (disconnect)
+				n=-1;
+			break;
+		}
+		// The writers do not wait meanwhile, they may queue more.
+		ssize_t w=onion_request_output_write(ws->req, head->frame->data, head->frame->size);
+		onion_websocket_frame_release(head->frame);
+		free(head);
+		if (w<0){
+			n=-1;
+			break;
+		}
+		n++;
+	}
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&q->write_mutex);
+#endif
+	if (n>=0 && writable && q->writable && q->writable(ws->user_data, ws)!=OCS_NEED_MORE_DATA)
+		n=-1;
+	return n;
+}
+
+/**
+ * @short Queues the writes of the websocket, so the writers do not wait for slow clients.
+ * @memberof onion_websocket_t
+ * 
+ * The frames written are copied to the queue, and the websocket loop writes them as the socket is 
+ * writable, between the reads, so it needs a callback (onion_websocket_set_callback), or calls to 
+ * onion_websocket_flush_queue. When the queued bytes get to high, the data writes fail with EAGAIN until 
+ * they go down to low, and then writable is called, from the websocket loop.
+ * 
+ * Set it at the handler, before writing.
+ * 
+ * @param ws The websocket
+ * @param high Queued bytes to stop the writes at
+ * @param low Queued bytes to call writable at, lower than high
+ * @param writable Callback when the writes can go on, or NULL
+ * @returns 0 if ok, -1 on error.
+ */
+int onion_websocket_set_send_queue(onion_websocket *ws, size_t high, size_t low, onion_websocket_writable_callback_t writable){
+	if (low>=high){
+		ONION_ERROR("The high watermark of the websocket send queue must be over the low one");
+		return -1;
+	}
+	onion_websocket_queue *q=onion_websocket_queue_get(ws);
+	if (!q)
+		return -1;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&q->mutex);
+#endif
+	q->high=high;
+	q->low=low;
+	q->writable=writable;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&q->mutex);
+#endif
+	return 0;
+}
+
+/// Bytes at the send queue, still to write.
+size_t onion_websocket_queued_bytes(onion_websocket *ws){
+	return ws->queue ? __atomic_load_n(&ws->queue->send_bytes, __ATOMIC_RELAXED) : 0;
+}
+
+/// The queue of the websocket, created the first time.
+static onion_websocket_queue *onion_websocket_queue_get(onion_websocket *ws){
+	if (ws->queue)
+		return ws->queue;
+	onion_websocket_queue *q=calloc(1, sizeof(onion_websocket_queue));
+	if (!q)
+		return NULL;
+	q->wakefd=eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (q->wakefd<0){
+		ONION_ERROR("Could not create the websocket queue eventfd: %s", strerror(errno));
+		free(q);
+		return NULL;
+	}
+#ifdef HAVE_PTHREADS
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_mutex_init(&q->write_mutex, NULL);
+#endif
+	if (!__sync_bool_compare_and_swap(&ws->queue, NULL, q)){ // Another thread did meanwhile
+		close(q->wakefd);
+#ifdef HAVE_PTHREADS
+		pthread_mutex_destroy(&q->mutex);
+		pthread_mutex_destroy(&q->write_mutex);
+#endif
+		free(q);
+	}
+	return ws->queue;
+}
+
+/// Wakes the websocket loop, to write the queue.
+static void onion_websocket_queue_wake(onion_websocket_queue *q){
+	uint64_t one=1;
+	if (write(q->wakefd, &one, sizeof(one))<0 && errno!=EAGAIN)
+		ONION_ERROR("Could not wake the websocket to write the queue");
+}
+
+/// Whether there are frames that can be written now.
+static int onion_websocket_queue_pending(onion_websocket_queue *q){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&q->mutex);
+#endif
+	int pending=(q->send_head || (q->head && !q->sending_fragment));
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&q->mutex);
+#endif
+	return pending;
+}
+
+/// Releases a reference to the frame; the last frees it.
+static void onion_websocket_frame_release(onion_websocket_frame *frame){
+	if (__sync_sub_and_fetch(&frame->refcount, 1)==0)
+		free(frame);
+}
+
+/// Removes all the frames queued by the groups. With the queue locked.
+static void onion_websocket_queue_clear(onion_websocket_queue *q){
+	onion_websocket_queued_free(q->head);
+	q->head=q->tail=NULL;
+	q->count=0;
+}
+
+/// Frees the list of queued frames, releasing them.
+static void onion_websocket_queued_free(onion_websocket_queued *n){
+	while (n){
+		onion_websocket_queued *next=n->next;
+		onion_websocket_frame_release(n->frame);
+		free(n);
+		n=next;
+	}
+}
+
+/**
+ * @short Creates a broadcast group of websockets.
+ * @memberof onion_websocket_group_t
+ * 
+ * Each message published to the group is framed once, at a refcounted buffer, and that buffer is queued to 
+ * each subscriber, so the publisher does not write to any connection, nor waits for the slow ones. Each 
+ * subscriber writes its queue from its own websocket loop, woken by an eventfd, in order, and the buffer is 
+ * freed when all wrote it.
+ * 
+ * When a subscriber has max_queue frames still queued, the policy says what to do with a new one: drop 
+ * it, keep only the latest, or disconnect the subscriber.
+ * 
+ * @param policy For the slow subscribers
+ * @param max_queue Max frames queued for each subscriber, at least 1.
+ * @returns The group, to free with onion_websocket_group_free.
+ */
+onion_websocket_group *onion_websocket_group_new(onion_websocket_group_policy policy, int max_queue){
+	onion_websocket_group *group=calloc(1, sizeof(onion_websocket_group));
+	if (!group)
+		return NULL;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_init(&group->mutex, NULL);
+#endif
+	group->refcount=1;
+	group->policy=policy;
+	group->max_queue=max_queue>0 ? max_queue : 1;
+	return group;
+}
+
+/**
+ * @short Frees the group. Its subscribers get no more frames, but the ones queued are still written.
+ * @memberof onion_websocket_group_t
+ */
+void onion_websocket_group_free(onion_websocket_group *group){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&group->mutex);
+#endif
+	int i;
+	for (i=0;i<group->count;i++){
+		onion_websocket_member *m=group->members[i];
+		onion_websocket_queue *q=m->ws->queue;
+#ifdef HAVE_PTHREADS
+		pthread_mutex_lock(&q->mutex);
+#endif
+		onion_websocket_member **p=&q->members;
+		while (*p!=m)
+			p=&(*p)->next;
+		*p=m->next;
+#ifdef HAVE_PTHREADS
+		pthread_mutex_unlock(&q->mutex);
+#endif
+		free(m);
+	}
+	free(group->members);
+	group->members=NULL;
+	group->count=group->allocated=0;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&group->mutex);
+#endif
+	onion_websocket_group_release(group);
+}
+
+/// Releases a reference; the last frees it.
+static void onion_websocket_group_release(onion_websocket_group *group){
+	if (__sync_sub_and_fetch(&group->refcount, 1)!=0)
+		return;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_destroy(&group->mutex);
+#endif
+	free(group);
+}
+
+/**
+ * @short Subscribes the websocket to the messages of the group.
+ * @memberof onion_websocket_group_t
+ * 
+ * Do it before returning OCS_WEBSOCKET from the handler, or from a callback, so the websocket loop waits for 
+ * the queued frames too. It is unsubscribed when the websocket is freed, as the connection closes.
+ * 
+ * @returns 0 if ok, -1 on error or if already subscribed.
+ */
+int onion_websocket_group_subscribe(onion_websocket_group *group, onion_websocket *ws){
+	onion_websocket_queue *q=onion_websocket_queue_get(ws);
+	if (!q)
+		return -1;
+	onion_websocket_member *m=calloc(1, sizeof(onion_websocket_member));
+	if (!m)
+		return -1;
+	m->group=group;
+	m->ws=ws;
+	
+	int ret=0;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&group->mutex);
+	pthread_mutex_lock(&q->mutex);
+#endif
+	onion_websocket_member *o;
+	for (o=q->members;o && o->group!=group;o=o->next);
+	if (o)
+		ret=-1;
+	else if (group->count==group->allocated){
+		int allocated=group->allocated ? group->allocated*2 : 16;
+		onion_websocket_member **members=realloc(group->members, allocated*sizeof(onion_websocket_member*));
+		if (members){
+			group->members=members;
+			group->allocated=allocated;
+		}
+		else
+			ret=-1;
+	}
+	if (ret==0){
+		m->index=group->count;
+		group->members[group->count++]=m;
+		m->next=q->members;
+		q->members=m;
+	}
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&q->mutex);
+	pthread_mutex_unlock(&group->mutex);
+#endif
+	if (ret<0)
+		free(m);
+	return ret;
+}
+
+/**
+ * @short Unsubscribes the websocket from the group. The frames already queued are still written.
+ * @memberof onion_websocket_group_t
+ * 
+ * @returns 0 if ok, -1 if it was not subscribed.
+ */
+int onion_websocket_group_unsubscribe(onion_websocket_group *group, onion_websocket *ws){
+	onion_websocket_queue *q=ws->queue;
+	if (!q)
+		return -1;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&group->mutex);
+	pthread_mutex_lock(&q->mutex);
+#endif
+	onion_websocket_member **p=&q->members;
+	while (*p && (*p)->group!=group)
+		p=&(*p)->next;
+	onion_websocket_member *m=*p;
+	if (m)
+		*p=m->next;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&q->mutex);
+#endif
+	if (m){ // The last takes its place
+		onion_websocket_member *last=group->members[--group->count];
+		group->members[m->index]=last;
+		last->index=m->index;
+	}
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&group->mutex);
+#endif
+	free(m);
+	return m ? 0 : -1;
+}
+
+/**
+ * @short Publishes a message to all the subscribers of the group.
+ * @memberof onion_websocket_group_t
+ * 
+ * It is framed once, and queued to each, as the policy of the group says for the slow ones. It does not 
+ * write to the connections, so it never waits for them. It can be called from any thread.
+ * 
+ * @param group The group
+ * @param opcode OWS_TEXT or OWS_BINARY
+ * @param data The message
+ * @param len Its length
+ * @returns To how many subscribers it was queued, or -1 on error.
+ */
+int onion_websocket_group_publish(onion_websocket_group *group, onion_websocket_opcode opcode, const char *data, size_t len){
+	unsigned char header[10];
+	int hlen=onion_websocket_header(header, opcode, len, 1);
+	onion_websocket_frame *frame=malloc(sizeof(onion_websocket_frame)+hlen+len);
+	if (!frame){
+		ONION_ERROR("Could not allocate a websocket frame of %ld bytes", (long)len);
+		return -1;
+	}
+	frame->refcount=1; // Of the publisher, until all are queued.
+	frame->size=hlen+len;
+	memcpy(frame->data, header, hlen);
+	memcpy(frame->data+hlen, data, len);
+	
+	int n=0, i;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&group->mutex);
+#endif
+	for (i=0;i<group->count;i++){
+		onion_websocket *ws=group->members[i]->ws;
+		onion_websocket_queue *q=ws->queue;
+		onion_websocket_queued *queued=malloc(sizeof(onion_websocket_queued));
+		if (!queued)
+			break;
+		queued->frame=frame;
+		queued->next=NULL;
+		int wake=0;
+#ifdef HAVE_PTHREADS
+		pthread_mutex_lock(&q->mutex);
+#endif
+		if (!q->disconnect && q->count>=group->max_queue){
+			if (group->policy==OWS_GROUP_DISCONNECT){
+				ONION_WARNING("Websocket subscriber is too slow, disconnecting it");
+				q->disconnect=1;
+				if (ws->req->connection.fd>0) // Also out of a blocked write
+					shutdown(ws->req->connection.fd, SHUT_RDWR);
+				wake=1;
+			}
+			if (group->policy!=OWS_GROUP_DROP) // The old ones are not needed any more
+				onion_websocket_queue_clear(q);
+		}
+		if (!q->disconnect && q->count<group->max_queue){
+			__sync_fetch_and_add(&frame->refcount, 1);
+			if (q->tail)
+				q->tail->next=queued;
+			else
+				q->head=queued;
+			q->tail=queued;
+			wake=(++q->count==1); // Else it is pending already, or being written, and the writer sees this one too.
+			queued=NULL;
+			n++;
+		}
+#ifdef HAVE_PTHREADS
+		pthread_mutex_unlock(&q->mutex);
+#endif
+		free(queued);
+		if (wake)
+			onion_websocket_queue_wake(q);
+	}
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&group->mutex);
+#endif
+	onion_websocket_frame_release(frame);
+	return n;
+}
+
+/// Subscribers of the group
+int onion_websocket_group_count(onion_websocket_group *group){
+#ifdef HAVE_PTHREADS
+	pthread_mutex_lock(&group->mutex);
+#endif
+	int n=group->count;
+#ifdef HAVE_PTHREADS
+	pthread_mutex_unlock(&group->mutex);
+#endif
+	return n;
+}
+
+#ifdef HAVE_ZLIB
+/// Reads a token, or quoted string, of the extensions header, and the spaces around. Returns where it ends.
+static const char *onion_websocket_extension_token(const char *p, char *token, size_t size){
+	size_t l=0;
+	while (*p==' ' || *p=='\t')
+		p++;
+	int quoted=(*p=='"');
+	if (quoted)
+		p++;
+	while (*p && (quoted ? *p!='"' : !strchr(";,= \t", *p))){
+		if (l+1<size)
+			token[l++]=*p;
+		p++;
+	}
+	if (quoted && *p=='"')
+		p++;
+	token[l]='\0';
+	while (*p==' ' || *p=='\t')
+		p++;
+	return p;
+}
+
+/// Bytes of the zlib streams with those parameters, as zlib.h documents them.
+static size_t onion_websocket_deflate_memory(int server_bits, int client_bits, int mem_level){
+	return (1<<(server_bits+2)) + (1<<(mem_level+9)) + (1<<client_bits) + 7*1024;
+}
+
+/**
+ * @short Chooses the first acceptable offer of permessage-deflate, as RFC 7692.
+ * 
+ * The window bits and the memory level are lowered to fit the memory of the server settings, halving the 
+ * biggest zlib buffer each time. The client window can only be lowered if it offers client_max_window_bits. zlib can not compress with a window 
+ * of 8 bits, so offers that ask for it are declined.
+ * 
+ * @returns The state, and the Sec-Websocket-Extensions answer at answer, or NULL if none is acceptable.
+ */
+static onion_websocket_deflate *onion_websocket_deflate_negotiate(onion *server, const char *offers, char *answer, size_t size){
+	const char *p=offers;
+	while (*p){
+		int server_bits=server->websocket_deflate.window_bits, client_bits=15, mem_level=8;
+		int server_nct=server->websocket_deflate.no_context_takeover, client_nct=server_nct;
+		int client_limit=0, server_limit=0, seen=0, ok=1;
+		char token[64], value[16];
+		
+		p=onion_websocket_extension_token(p, token, sizeof(token));
+		if (strcasecmp(token, "permessage-deflate")!=0)
+			ok=0;
+		while (*p==';'){
+			p=onion_websocket_extension_token(p+1, token, sizeof(token));
+			value[0]='\0';
+			if (*p=='=')
+				p=onion_websocket_extension_token(p+1, value, sizeof(value));
+			int bits=value[0] ? atoi(value) : 0;
+			int param;
+			if (strcasecmp(token, "server_no_context_takeover")==0 && !value[0]){
+				param=1;
+				server_nct=1;
+			}
+			else if (strcasecmp(token, "client_no_context_takeover")==0 && !value[0]){
+				param=2;
+				client_nct=1;
+			}
+			else if (strcasecmp(token, "server_max_window_bits")==0 && bits>=8 && bits<=15){
+				param=4;
+				server_limit=1;
+				if (bits<9)
+					ok=0;
+				else if (bits<server_bits)
+					server_bits=bits;
+			}
+			else if (strcasecmp(token, "client_max_window_bits")==0 && (!value[0] || (bits>=8 && bits<=15))){
+				param=8;
+				client_limit=1;
+				if (bits && bits<client_bits)
+					client_bits=bits;
+			}
+			else
+				param=0;
+			if (!param || (seen&param))
+				ok=0;
+			seen|=param;
+		}
+		
+		size_t max=server->websocket_deflate.max_memory;
+		while (ok && max && onion_websocket_deflate_memory(server_bits, client_bits, mem_level)>max){
+			int window=(server_bits>9) ? server_bits+2 : 0, hash=(mem_level>1) ? mem_level+9 : 0;
+			int client=(client_limit && client_bits>9) ? client_bits : 0;
+			if (hash && hash>=window && hash>=client) // The biggest part is halved
+				mem_level--;
+			else if (window && window>=client)
+				server_bits--;
+			else if (client)
+				client_bits--;
+			else
+				ok=0;
+		}
+		
+		if (ok){
+			int l=snprintf(answer, size, "permessage-deflate");
+			if (server_nct)
+				l+=snprintf(answer+l, size-l, "; server_no_context_takeover");
+			if (client_nct)
+				l+=snprintf(answer+l, size-l, "; client_no_context_takeover");
+			if (server_limit || server_bits<15)
+				l+=snprintf(answer+l, size-l, "; server_max_window_bits=%d", server_bits);
+			if (client_limit && client_bits<15)
+				snprintf(answer+l, size-l, "; client_max_window_bits=%d", client_bits);
+			
+			onion_websocket_deflate *d=calloc(1, sizeof(onion_websocket_deflate));
+			if (!d)
+				return NULL;
+			d->server_no_context_takeover=server_nct;
+			d->client_no_context_takeover=client_nct;
+			d->server_window_bits=server_bits;
+			d->client_window_bits=client_bits<9 ? 9 : client_bits; // A bigger window inflates it too.
+			d->mem_level=mem_level;
+			ONION_DEBUG("Websocket permessage-deflate: %s", answer);
+			return d;
+		}
+		while (*p && *p!=',') // Next offer
+			p++;
+		if (*p==',')
+			p++;
+	}
+	return NULL;
+}
+
+/**
+ * @short Compresses a fragment of the message being written, with a sync flush.
+ * 
+ * The output is at tmp if it fits, else allocated, to free. At the final fragment the 00 00 FF FF of the 
+ * flush is implied, so it is removed.
+ */
+static int onion_websocket_deflate_data(onion_websocket *ws, const char *buffer, size_t len, int fin, char *tmp, size_t tmpsize, char **outp, size_t *outlen){
+	onion_websocket_deflate *d=ws->deflate;
+	if (!d->deflate_ready){
+		memset(&d->deflate, 0, sizeof(z_stream));
+		if (deflateInit2(&d->deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -d->server_window_bits, d->mem_level, Z_DEFAULT_STRATEGY)!=Z_OK){
+			ONION_ERROR("Could not start the websocket compressor");
+			return -1;
+		}
+		d->deflate_ready=1;
+	}
+	
+	size_t size=deflateBound(&d->deflate, len)+16; // And the sync flush
+	char *out=(size<=tmpsize) ? tmp : malloc(size);
+	if (!out)
+		return -1;
+	size_t n=0;
+	int r;
+	d->deflate.next_in=(Bytef*)buffer;
+	d->deflate.avail_in=len;
+	while (1){
+		d->deflate.next_out=(Bytef*)out+n;
+		d->deflate.avail_out=size-n;
+		r=deflate(&d->deflate, Z_SYNC_FLUSH);
+		n=size-d->deflate.avail_out;
+		if (r!=Z_OK || d->deflate.avail_out>0)
+			break;
+		char *bigger=malloc(size*2); // Not expected, after the bound
+		if (bigger)
+			memcpy(bigger, out, n);
+		if (out!=tmp)
+			free(out);
+		out=bigger;
+		size*=2;
+		if (!out)
+			return -1;
+	}
+	
+	if (r!=Z_OK || n<4 || memcmp(out+n-4, "\x00\x00\xff\xff", 4)!=0){
+		ONION_ERROR("Error compressing websocket message");
+		if (out!=tmp)
+			free(out);
+		deflateEnd(&d->deflate);
+		d->deflate_ready=0;
+		return -1;
+	}
+	if (fin){
+		n-=4;
+		if (d->server_no_context_takeover){
+			deflateEnd(&d->deflate);
+			d->deflate_ready=0;
+		}
+	}
+	*outp=out;
+	*outlen=n;
+	return 0;
+}
+
+/// Inflates the data to the end of the message, up to max bytes.
+static int onion_websocket_inflate_data(onion_websocket_deflate *d, const char *data, size_t len, size_t max){
+	z_stream *z=&d->inflate;
+	z->next_in=(Bytef*)data;
+	z->avail_in=len;
+	do{
+		if (d->message_size==d->message_allocated){
+			if (d->message_allocated>=max){
+				ONION_ERROR("Inflated websocket message is too big, more than %ld bytes", (long)max);
+				return -1;
+			}
+			size_t allocated=d->message_allocated ? d->message_allocated*2 : 4096;
+			if (allocated>max)
+				allocated=max;
+			char *message=realloc(d->message, allocated);
+			if (!message)
+				return -1;
+			d->message=message;
+			d->message_allocated=allocated;
+		}
+		z->next_out=(Bytef*)d->message+d->message_size;
+		z->avail_out=d->message_allocated-d->message_size;
+		int r=inflate(z, Z_SYNC_FLUSH);
+		d->message_size=d->message_allocated-z->avail_out;
+		if (r==Z_STREAM_END) // A final block; the next ones start again
+			inflateReset(z);
+		else if (r!=Z_OK && r!=Z_BUF_ERROR){
+			ONION_ERROR("Error inflating websocket message: %s", z->msg ? z->msg : "unknown");
+			return -1;
+		}
+	}while(z->avail_in>0 || z->avail_out==0);
+	return 0;
+}
+
+/**
+ * @short Reads the rest of the compressed message, all its fragments, and inflates it.
+ * 
+ * Then it is read as a single unmasked frame, so the callbacks get the inflated length as ready.
+ */
+static int onion_websocket_inflate_message(onion_websocket *ws){
+	onion_websocket_deflate *d=ws->deflate;
+	onion_websocket_opcode opcode=ws->opcode;
+	size_t max=ws->req->connection.listen_point->server->max_post_size;
+	if (!d->inflate_ready){
+		memset(&d->inflate, 0, sizeof(z_stream));
+		if (inflateInit2(&d->inflate, -d->client_window_bits)!=Z_OK){
+			ONION_ERROR("Could not start the websocket decompressor");
+			return -1;
+		}
+		d->inflate_ready=1;
+	}
+	d->message_size=0;
+	
+	char data[4096];
+	while (1){
+		while (ws->data_left>0){
+			size_t l=(ws->data_left<sizeof(data)) ? ws->data_left : sizeof(data);
+			ssize_t r=ws->req->connection.listen_point->read(ws->req, data, l);
+			if (r<=0)
+				return -1;
+			if (ws->flags&WS_MASK){
+				onion_websocket_unmask(data, r, ws->mask, ws->mask_pos);
+				ws->mask_pos=(ws->mask_pos+r)&3;
+			}
+			ws->data_left-=r;
+			if (onion_websocket_inflate_data(d, data, r, max)<0)
+				return -1;
+		}
+		if (ws->flags&WS_FIN)
+			break;
+		// Next fragment; control frames may come in between.
+		int frame;
+		do{
+			frame=onion_websocket_read_frame_header(ws);
+			if (frame<0)
+				return -1;
+			if (frame==OWS_PING){
+				if (onion_websocket_pong(ws)<0)
+					return -1;
+			}
+			else if (frame==OWS_PONG){
+				if (onion_websocket_skip_pong(ws)<0)
+					return -1;
+			}
+			else if (frame!=0){
+				ONION_ERROR("Expected a continuation of the compressed websocket message");
+				return -1;
+			}
+		}while(frame!=0);
+	}
+	if (onion_websocket_inflate_data(d, "\x00\x00\xff\xff", 4, max)<0)
+		return -1;
+	if (d->client_no_context_takeover){
+		inflateEnd(&d->inflate);
+		d->inflate_ready=0;
+	}
+	
+	ws->opcode=opcode;
+	ws->flags=WS_FIN|WS_DEFLATE;
+	ws->data_left=d->message_size;
+	return 0;
+}
+
+/// Reads from the inflated message, which is freed once read.
+static int onion_websocket_read_inflated(onion_websocket *ws, char *buffer, size_t len){
+	onion_websocket_deflate *d=ws->deflate;
+	memcpy(buffer, d->message+(d->message_size-ws->data_left), len);
+	if (len==ws->data_left){
+		free(d->message);
+		d->message=NULL;
+		d->message_size=d->message_allocated=0;
+	}
+	return len;
+}
+#endif
@@ -42,10 +42,29 @@ void onion_websocket_free(onion_websocket *ws);
 void onion_websocket_set_callback(onion_websocket *ws, onion_websocket_callback_t cb);
 int onion_websocket_read(onion_websocket *ws, char *buffer, size_t len);
 int onion_websocket_write(onion_websocket *ws, const char *buffer, size_t len);
+/// Writes a fragment of a message; the first with the opcode, the rest as continuations, up to fin.
+int onion_websocket_write_fragment(onion_websocket *ws, const char *buffer, size_t len, int fin);
+/// Reads only from the current fragment, and sets fin at the end of the message.
+int onion_websocket_read_fragment(onion_websocket *ws, char *buffer, size_t len, int *fin);
 int onion_websocket_printf(onion_websocket *ws, const char *str, ...);
 onion_connection_status onion_websocket_call(onion_websocket *ws);
 void onion_websocket_set_opcode(onion_websocket *ws, onion_websocket_opcode opcode);
 onion_websocket_opcode onion_websocket_get_opcode(onion_websocket *ws);
+/// Pings the websocket when idle for interval_ms, and closes it if it reads nothing more in timeout_ms.
+void onion_websocket_set_keepalive(onion_websocket *ws, int interval_ms, int timeout_ms);
+/// Writes now the frames queued by the groups. The websocket loop does it as they are queued.
+int onion_websocket_flush_queue(onion_websocket *ws);
+/// Queues the writes, written by the websocket loop as the socket is writable, up to the high watermark.
+int onion_websocket_set_send_queue(onion_websocket *ws, size_t high, size_t low, onion_websocket_writable_callback_t writable);
+size_t onion_websocket_queued_bytes(onion_websocket *ws);
+
+onion_websocket_group *onion_websocket_group_new(onion_websocket_group_policy policy, int max_queue);
+void onion_websocket_group_free(onion_websocket_group *group);
+int onion_websocket_group_subscribe(onion_websocket_group *group, onion_websocket *ws);
+int onion_websocket_group_unsubscribe(onion_websocket_group *group, onion_websocket *ws);
+/// Frames the message once, and queues it to all the subscribers. Returns to how many.
+int onion_websocket_group_publish(onion_websocket_group *group, onion_websocket_opcode opcode, const char *data, size_t len);
+int onion_websocket_group_count(onion_websocket_group *group);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,375 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* pthread_setaffinity_np */
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "log.h"
+#include "workers.h"
+
+/// A job at the queue
+typedef struct{
+	void (*f)(void *);
+	void *data;
+}onion_workers_job;
+
+/// Queue of the jobs of a priority, and how many of them may run at a time.
+typedef struct{
+	onion_workers_job *queue; ///< Circular buffer of max_queue jobs
+	int first;                ///< Position of the first job at the queue
+	int njobs;                ///< Jobs at the queue
+	int running;              ///< Jobs of this lane at the threads now
+	int max_running;          ///< 0 for as many as threads
+}onion_workers_lane;
+
+/// A thread of the pool, or a place for one.
+typedef struct{
+	struct onion_workers_t *workers;
+	pthread_t thread;
+	char state;               ///< 0 never used, 1 running, 2 retired and to be joined.
+}onion_workers_thread_slot;
+
+struct onion_workers_t{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;      ///< Signaled when there are new jobs, or at stop.
+	onion_workers_lane lanes[ONION_WORKERS_LANES]; ///< The first ones run first.
+	int max_queue;
+	int njobs;                ///< Jobs at all the queues
+	char stop;
+	int nthreads;             ///< Running now
+	int min_threads;          ///< Never retired below this
+	int max_threads;          ///< Never started over this
+	int idle_ms;              ///< Threads idle this long retire, while over min_threads.
+	int idle;                 ///< Threads waiting for jobs
+	int starting;             ///< Threads started, that did not look for jobs yet
+	int busy;                 ///< Threads running a job
+	int peak;                 ///< Most threads at a time
+	unsigned long started;    ///< Threads started beyond the first min_threads
+	unsigned long retired;    ///< Threads retired as idle
+	onion_workers_thread_slot *threads; ///< max_threads of them
+	pthread_attr_t attr;      ///< Of the new threads
+};
+
+static void *onion_workers_thread(void *_slot);
+
+/// The first lane with jobs that may run one more, or NULL.
+static onion_workers_lane *onion_workers_next_lane(onion_workers *w){
+	int i;
+	for (i=0;i<ONION_WORKERS_LANES;i++){
+		onion_workers_lane *lane=&w->lanes[i];
+		if (lane->njobs && (!lane->max_running || lane->running<lane->max_running))
+			return lane;
+	}
+	return NULL;
+}
+
+/// Jobs that could run now, as their lane is not at its limit. With the mutex.
+static int onion_workers_runnable(onion_workers *w){
+	int i, n=0;
+	for (i=0;i<ONION_WORKERS_LANES;i++){
+		onion_workers_lane *lane=&w->lanes[i];
+		if (!lane->max_running)
+			n+=lane->njobs;
+		else if (lane->running<lane->max_running)
+			n+=(lane->njobs<lane->max_running-lane->running) ? lane->njobs : lane->max_running-lane->running;
+	}
+	return n;
+}
+
+/**
+ * @short Starts one more thread, if under max_threads. With the mutex.
+ * 
+ * Retired threads are joined here, and their place reused.
+ * 
+ * @returns 0 if started.
+ */
+static int onion_workers_start_thread(onion_workers *w){
+	if (w->nthreads>=w->max_threads)
+		return -1;
+	onion_workers_thread_slot *slot=w->threads;
+	while (slot->state==1)
+		slot++;
+	if (slot->state==2){ // It left the mutex, so it ends soon.
+		pthread_join(slot->thread, NULL);
+		slot->state=0;
+	}
+	int errcode=pthread_create(&slot->thread, &w->attr, onion_workers_thread, slot);
+	if (errcode!=0){
+		ONION_ERROR("Could not create worker thread: %s", strerror(errcode));
+		return -1;
+	}
+	slot->state=1;
+	w->nthreads++;
+	w->starting++;
+	if (w->nthreads>w->peak)
+		w->peak=w->nthreads;
+	return 0;
+}
+
+/**
+ * @short Waits for a job. With the mutex.
+ * 
+ * Over min_threads the wait is up to idle_ms.
+ * 
+ * @returns 0 if woken up, or ETIMEDOUT when it was idle that long.
+ */
+static int onion_workers_wait(onion_workers *w){
+	int ret=0;
+	w->idle++;
+	if (w->nthreads>w->min_threads){
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec+=w->idle_ms/1000;
+		ts.tv_nsec+=(w->idle_ms%1000)*1000000l;
+		if (ts.tv_nsec>=1000000000l){
+			ts.tv_sec++;
+			ts.tv_nsec-=1000000000l;
+		}
+		ret=pthread_cond_timedwait(&w->cond, &w->mutex, &ts);
+	}
+	else
+		pthread_cond_wait(&w->cond, &w->mutex);
+	w->idle--;
+	return ret;
+}
+
+/**
+ * @short Thread main loop: runs jobs until stopped and the queues are empty.
+ * 
+ * The jobs of a lane at its limit wait, even if there are idle threads, and the thread that ends one 
+ * of them looks for the next, so no signal is needed then.
+ * 
+ * When it waits idle_ms for a job while there are more than min_threads, it retires.
+ */
+static void *onion_workers_thread(void *_slot){
+	onion_workers_thread_slot *slot=_slot;
+	onion_workers *w=slot->workers;
+	onion_workers_lane *lane;
+	pthread_mutex_lock(&w->mutex);
+	w->starting--;
+	for(;;){
+		while (!(lane=onion_workers_next_lane(w)) && !(w->stop && !w->njobs)){
+			if (onion_workers_wait(w)==ETIMEDOUT && w->nthreads>w->min_threads && !w->stop &&
+			    !onion_workers_next_lane(w)){
+				w->nthreads--;
+				w->retired++;
+				slot->state=2;
+				ONION_DEBUG("Worker thread retired as idle, %d left", w->nthreads);
+				pthread_mutex_unlock(&w->mutex);
+				return NULL;
+			}
+		}
+		if (!lane) // Stop, and nothing pending
+			break;
+		onion_workers_job job=lane->queue[lane->first];
+		lane->first=(lane->first+1)%w->max_queue;
+		lane->njobs--;
+		lane->running++;
+		w->njobs--;
+		w->busy++;
+		pthread_mutex_unlock(&w->mutex);
+
+		job.f(job.data);
+
+		pthread_mutex_lock(&w->mutex);
+		lane->running--;
+		w->busy--;
+		if (w->stop && !w->njobs) // Others may wait for the limited jobs to end.
+			pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return NULL;
+}
+
+/**
+ * @short Creates a pool of worker threads
+ * @memberof onion_workers_t
+ *
+ * @param nthreads Number of threads
+ * @param max_queue Maximum number of jobs waiting at the queue.
+ * @param cpus If not NULL, the threads only run on these CPUs.
+ * @param ncpus Number of elements on cpus
+ */
+onion_workers *onion_workers_new(int nthreads, int max_queue, const int *cpus, int ncpus){
+	return onion_workers_new_adaptive(nthreads, nthreads, 0, max_queue, cpus, ncpus);
+}
+
+/**
+ * @short Creates a pool of worker threads that grows with the load, and shrinks when idle
+ * @memberof onion_workers_t
+ * 
+ * It starts min_threads. When a job is queued and there are more jobs that could run (their lane is not
+ * at its limit) than idle threads, all of them are busy, so one more thread is started, up to max_threads. So at a burst it grows at most 
+ * as many threads as jobs wait, and not at all while the threads keep up with the queue. Threads 
+ * over min_threads that wait idle_ms without a job retire.
+ *
+ * @param min_threads Threads always running, at least 1
+ * @param max_threads Most threads at a time
+ * @param idle_ms Time without jobs after which the threads over min_threads retire
+ * @param max_queue Maximum number of jobs waiting at the queue.
+ * @param cpus If not NULL, the threads only run on these CPUs.
+ * @param ncpus Number of elements on cpus
+ */
+onion_workers *onion_workers_new_adaptive(int min_threads, int max_threads, int idle_ms, int max_queue, const int *cpus, int ncpus){
+	if (min_threads<=0 || max_threads<min_threads || max_queue<=0){
+		ONION_ERROR("Invalid worker pool: %d to %d threads, %d queue size", min_threads, max_threads, max_queue);
+		return NULL;
+	}
+	onion_workers *w=calloc(1, sizeof(onion_workers));
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_condattr_t condattr;
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&w->cond, &condattr);
+	pthread_condattr_destroy(&condattr);
+	w->max_queue=max_queue;
+	w->min_threads=min_threads;
+	w->max_threads=max_threads;
+	w->idle_ms=idle_ms;
+	int i;
+	for (i=0;i<ONION_WORKERS_LANES;i++)
+		w->lanes[i].queue=malloc(sizeof(onion_workers_job)*max_queue);
+	w->threads=calloc(max_threads, sizeof(onion_workers_thread_slot));
+	for (i=0;i<max_threads;i++)
+		w->threads[i].workers=w;
+
+	pthread_attr_init(&w->attr);
+#ifdef __linux__
+	if (cpus && ncpus>0){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (i=0;i<ncpus;i++)
+			CPU_SET(cpus[i], &set);
+		pthread_attr_setaffinity_np(&w->attr, sizeof(set), &set);
+	}
+#else
+	if (cpus && ncpus>0)
+		ONION_WARNING("Worker CPU affinity not supported on this platform");
+#endif
+	pthread_mutex_lock(&w->mutex);
+	while (w->nthreads<min_threads && onion_workers_start_thread(w)==0);
+	pthread_mutex_unlock(&w->mutex);
+	ONION_DEBUG("Started %d workers, up to %d, queue of %d", w->nthreads, max_threads, max_queue);
+	return w;
+}
+
+/**
+ * @short Runs the pending jobs, stops the threads and frees the pool
+ * @memberof onion_workers_t
+ */
+void onion_workers_free(onion_workers *w){
+	pthread_mutex_lock(&w->mutex);
+	w->stop=1; // No more are started
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+	int i;
+	for (i=0;i<w->max_threads;i++){
+		if (w->threads[i].state)
+			pthread_join(w->threads[i].thread, NULL);
+	}
+
+	pthread_mutex_destroy(&w->mutex);
+	pthread_cond_destroy(&w->cond);
+	pthread_attr_destroy(&w->attr);
+	free(w->threads);
+	for (i=0;i<ONION_WORKERS_LANES;i++)
+		free(w->lanes[i].queue);
+	free(w);
+}
+
+/**
+ * @short Adds a job to the queue of the default lane
+ * @memberof onion_workers_t
+ *
+ * @returns 0 if ok, <0 if the queue is full or the pool stopped; then the job is not run.
+ */
+int onion_workers_push(onion_workers *w, void (*f)(void *), void *data){
+	return onion_workers_push_lane(w, ONION_WORKERS_DEFAULT_LANE, f, data);
+}
+
+/**
+ * @short Adds a job to the queue of a lane
+ * @memberof onion_workers_t
+ * 
+ * The threads take the jobs of the first lanes first, each lane up to its limit. Each lane has a queue
+ * of max_queue jobs.
+ *
+ * @returns 0 if ok, <0 if the queue is full or the pool stopped; then the job is not run.
+ */
+int onion_workers_push_lane(onion_workers *w, int nlane, void (*f)(void *), void *data){
+	onion_workers_lane *lane=&w->lanes[nlane];
+	pthread_mutex_lock(&w->mutex);
+	if (lane->njobs==w->max_queue || w->stop || !w->nthreads){
+		pthread_mutex_unlock(&w->mutex);
+		return -1;
+	}
+	onion_workers_job *job=&lane->queue[(lane->first+lane->njobs)%w->max_queue];
+	job->f=f;
+	job->data=data;
+	lane->njobs++;
+	w->njobs++;
+	if (w->nthreads<w->max_threads && onion_workers_runnable(w)>w->idle+w->starting && onion_workers_start_thread(w)==0) // All busy
+		w->started++;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+	return 0;
+}
+
+/**
+ * @short Gets the thread counts of the pool
+ * @memberof onion_workers_t
+ */
+void onion_workers_get_stats(onion_workers *w, onion_workers_stats *stats){
+	pthread_mutex_lock(&w->mutex);
+	stats->threads=w->nthreads;
+	stats->busy=w->busy;
+	stats->queued=w->njobs;
+	stats->min_threads=w->min_threads;
+	stats->max_threads=w->max_threads;
+	stats->peak=w->peak;
+	stats->started=w->started;
+	stats->retired=w->retired;
+	pthread_mutex_unlock(&w->mutex);
+}
+
+/**
+ * @short Sets how many jobs of the lane may run at a time
+ * @memberof onion_workers_t
+ * 
+ * So the jobs of the other lanes always have some threads. 0, the default, for as many as threads.
+ */
+void onion_workers_set_lane_limit(onion_workers *w, int nlane, int max_running){
+	pthread_mutex_lock(&w->mutex);
+	w->lanes[nlane].max_running=max_running;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+}
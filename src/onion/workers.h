@@ -0,0 +1,81 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This library is free software; you can redistribute it and/or
+	modify it under the terms of, at your choice:
+
+	a. the GNU Lesser General Public License as published by the
+	 Free Software Foundation; either version 3.0 of the License,
+	 or (at your option) any later version.
+
+	b. the GNU General Public License as published by the
+	 Free Software Foundation; either version 2.0 of the License,
+	 or (at your option) any later version.
+
+	This library is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+	Lesser General Public License for more details.
+
+	You should have received a copy of the GNU Lesser General Public
+	License and the GNU General Public License along with this
+	library; if not see <http://www.gnu.org/licenses/>.
+	*/
+
+#ifndef ONION_WORKERS_H
+#define ONION_WORKERS_H
+
+#include "types.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/**
+ * @struct onion_workers_t
+ * @short Pool of threads that run jobs from a bounded queue.
+ *
+ * Internal. Used to run handlers out of the poller threads.
+ */
+struct onion_workers_t;
+typedef struct onion_workers_t onion_workers;
+
+/// Lanes of jobs, one per priority class. @see onion_set_priority_class
+#define ONION_WORKERS_LANES OPRIO_CLASSES
+/// The lane of onion_workers_push
+#define ONION_WORKERS_DEFAULT_LANE OPRIO_NORMAL
+
+/// Creates the pool, and starts the threads. cpus may be NULL to not set the affinity.
+onion_workers *onion_workers_new(int nthreads, int max_queue, const int *cpus, int ncpus);
+/// Creates a pool of min_threads that grows up to max_threads when all are busy, and shrinks after idle_ms without jobs.
+onion_workers *onion_workers_new_adaptive(int min_threads, int max_threads, int idle_ms, int max_queue, const int *cpus, int ncpus);
+/// Runs the pending jobs, stops the threads and frees the pool.
+void onion_workers_free(onion_workers *w);
+/// Adds a job to the queue. Returns <0 if the queue is full.
+int onion_workers_push(onion_workers *w, void (*f)(void *), void *data);
+/// Adds a job to the queue of that lane. The first lanes run first. Returns <0 if its queue is full.
+int onion_workers_push_lane(onion_workers *w, int lane, void (*f)(void *), void *data);
+/// Sets how many jobs of the lane may run at a time, or 0 for as many as threads.
+void onion_workers_set_lane_limit(onion_workers *w, int lane, int max_running);
+
+/// Thread counts of a pool. @see onion_workers_get_stats
+typedef struct onion_workers_stats_t{
+	int threads;            ///< Running now
+	int busy;               ///< Running a job now
+	int queued;             ///< Jobs waiting for a thread
+	int min_threads;
+	int max_threads;
+	int peak;               ///< Most threads at a time
+	unsigned long started;  ///< Threads started as all were busy
+	unsigned long retired;  ///< Threads retired as idle
+}onion_workers_stats;
+
+/// Gets the thread counts of the pool.
+void onion_workers_get_stats(onion_workers *w, onion_workers_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
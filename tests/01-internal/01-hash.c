@@ -733,6 +733,405 @@ void t16_soft_dup_dict_in_dict(){
 }
 
 
+/// The hash backend, with many keys, and the same behaviour as the tree.
+void t17_hash(){
+	INIT_LOCAL();
+	
+	onion_dict *dict=onion_dict_new();
+	onion_dict_set_flags(dict, OD_HASH);
+	char key[16], value[16];
+	int i;
+	for (i=0;i<20000;i++){
+		sprintf(key,"key%d",i);
+		sprintf(value,"%d",i);
+		onion_dict_add(dict, key, value, OD_DUP_ALL);
+	}
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(dict), 20000);
+	int removed=0;
+	for (i=0;i<20000;i+=2){
+		sprintf(key,"key%d",i);
+		removed+=onion_dict_remove(dict, key);
+	}
+	FAIL_IF_NOT_EQUAL_INT(removed, 10000);
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_remove(dict, "key0"), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(dict), 10000);
+	int ok=1;
+	for (i=0;i<20000;i++){ // The removed ones do not break the probe sequences of the others
+		sprintf(key,"key%d",i);
+		sprintf(value,"%d",i);
+		const char *v=onion_dict_get(dict, key);
+		if (i%2 ? (!v || strcmp(v, value)!=0) : v!=NULL)
+			ok=0;
+	}
+	FAIL_IF_NOT(ok);
+	onion_dict_add(dict, "key1", "one", OD_REPLACE);
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "key1"), "one");
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(dict), 10000);
+	onion_dict_clear(dict);
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(dict), 0);
+	FAIL_IF_NOT_EQUAL(onion_dict_get(dict, "key1"), NULL);
+	
+	// Sorted when asked for; a tree with elements is moved, case insensitive after it
+	onion_dict *sub=onion_dict_new();
+	onion_dict_add(sub, "a", "b", 0);
+	onion_dict_add(dict, "S", "T", 0);
+	onion_dict_add(dict, "C", "D", OD_DUP_ALL);
+	onion_dict_add(dict, "A", "B", 0);
+	onion_dict_set_flags(dict, OD_SORTED);
+	char buffer[256]={0};
+	onion_dict_preorder(dict, append_as_headers, buffer);
+	FAIL_IF_NOT_EQUAL_STR(buffer, "A: B\nC: D\nS: T\n");
+	onion_dict_add(dict, "sub", sub, OD_DICT|OD_FREE_VALUE);
+	onion_block *json=onion_dict_to_json(dict);
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(json), "{\"A\":\"B\", \"C\":\"D\", \"S\":\"T\", \"sub\":{\"a\":\"b\"}}");
+	onion_block_free(json);
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_rget(dict, "sub", "a", NULL), "b");
+	onion_dict_free(dict);
+	
+	dict=onion_dict_new();
+	onion_dict_add(dict, "Test", "OK", OD_DUP_ALL);
+	onion_dict_add(dict, "Other", "Value", 0);
+	onion_dict_set_flags(dict, OD_HASH);
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "Test"), "OK");
+	FAIL_IF_NOT_EQUAL(onion_dict_get(dict, "test"), NULL);
+	onion_dict_set_flags(dict, OD_ICASE);
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "test"), "OK");
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "OTHER"), "Value");
+	onion_dict_free(dict);
+	
+	dict=onion_dict_new(); // Reused from the pool, back to a tree
+	onion_dict_add(dict, "b", "1", 0);
+	onion_dict_add(dict, "a", "2", 0);
+	buffer[0]='\0';
+	onion_dict_preorder(dict, append_as_headers, buffer);
+	FAIL_IF_NOT_EQUAL_STR(buffer, "a: 2\nb: 1\n");
+	onion_dict_free(dict);
+	
+	END_LOCAL();
+}
+
+/// The flat backend, with inlined and long strings, until it grows to a tree or a hash table.
+void t18_flat(int flags){
+	INIT_LOCAL();
+	
+	onion_dict *dict=onion_dict_new();
+	onion_dict_set_flags(dict, OD_FLAT|flags);
+	char key[64], value[128];
+	int i;
+	for (i=0;i<40;i++){ // One of each 4 too long to be inlined
+		sprintf(key, i%4 ? "K%02d" : "A-long-key-that-is-not-inlined-%02d", i);
+		sprintf(value, i%4 ? "%d" : "a long value that is not inlined at the flat dict element %d", i);
+		onion_dict_add(dict, key, value, OD_DUP_ALL);
+		if (i==20){
+			onion_dict_add(dict, "K03", "three", OD_DUP_VALUE|OD_REPLACE);
+			FAIL_IF_NOT_EQUAL_INT(onion_dict_remove(dict, "K05"), 1);
+			FAIL_IF_NOT_EQUAL_INT(onion_dict_remove(dict, "K05"), 0);
+			FAIL_IF_NOT_EQUAL_INT(onion_dict_count(dict), 20);
+			char buffer[2048]={0};
+			onion_dict_preorder(dict, append_as_headers, buffer);
+			FAIL_IF_NOT_STRSTR(buffer, "A-long-key-that-is-not-inlined-20: a long value that is not inlined at the flat dict element 20\nK01: 1\nK02: 2\nK03: three\nK06: 6\n");
+		}
+	}
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(dict), 39);
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "K03"), "three");
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "K39"), "39");
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "A-long-key-that-is-not-inlined-36"), "a long value that is not inlined at the flat dict element 36");
+	FAIL_IF_NOT_EQUAL(onion_dict_get(dict, "K05"), NULL);
+	onion_dict_free(dict);
+	
+	dict=onion_dict_new();
+	onion_dict_set_flags(dict, OD_FLAT|flags);
+	onion_dict_add(dict, "Test", "OK", 0);
+	onion_dict_add(dict, "b", "1", OD_DUP_ALL);
+	onion_dict_add(dict, "a", "2", OD_DUP_ALL);
+	FAIL_IF_NOT_EQUAL(onion_dict_get(dict, "test"), NULL);
+	onion_dict_set_flags(dict, OD_ICASE);
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "test"), "OK");
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "A"), "2");
+	onion_block *json=onion_dict_to_json(dict);
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(json), "{\"a\":\"2\", \"b\":\"1\", \"Test\":\"OK\"}");
+	onion_block_free(json);
+	onion_dict_clear(dict);
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(dict), 0);
+	onion_dict_free(dict);
+	
+	END_LOCAL();
+}
+
+#ifdef HAVE_PTHREADS
+#define RCU_READERS 4
+
+int t19_rcu_running;
+
+/// Reads the fixed keys while the writer changes others; values must be the ones set, never freed.
+void *t19_rcu_reader(onion_dict *dict){
+	long errors=0;
+	char key[16], value[16];
+	while (__atomic_load_n(&t19_rcu_running, __ATOMIC_ACQUIRE)){
+		int i;
+		for (i=0;i<100;i++){
+			sprintf(key, "fixed%d", i);
+			sprintf(value, "%d", i*7);
+			onion_dict_lock_read(dict);
+			const char *v=onion_dict_get(dict, key);
+			if (!v || strcmp(v, value)!=0)
+				errors++;
+			v=onion_dict_get(dict, "changing");
+			if (v && strncmp(v, "changing ", 9)!=0)
+				errors++;
+			onion_dict_unlock(dict);
+		}
+	}
+	return (void*)errors;
+}
+
+/// OD_RCU dict: readers without locks while one writer adds, replaces and removes.
+void t19_rcu(){
+	INIT_LOCAL();
+	
+	onion_dict *dict=onion_dict_new();
+	onion_dict_add(dict, "before", "tree", 0);
+	onion_dict_set_flags(dict, OD_RCU);
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "before"), "tree");
+	char key[16], value[32];
+	int i;
+	for (i=0;i<100;i++){
+		sprintf(key, "fixed%d", i);
+		sprintf(value, "%d", i*7);
+		onion_dict_add(dict, key, value, OD_DUP_ALL);
+	}
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(dict), 101);
+	
+	t19_rcu_running=1;
+	pthread_t thread[RCU_READERS];
+	for (i=0;i<RCU_READERS;i++)
+		pthread_create(&thread[i], NULL, (void*)t19_rcu_reader, dict);
+	for (i=0;i<1000;i++){
+		sprintf(value, "changing %d", i);
+		onion_dict_add(dict, "changing", value, OD_DUP_ALL|OD_REPLACE);
+		sprintf(key, "tmp%d", i);
+		onion_dict_add(dict, key, "tmp", 0);
+		if (i%3==0)
+			FAIL_IF_NOT_EQUAL_INT(onion_dict_remove(dict, key), 1);
+		if (i%100==0) // Let the readers in, even with one CPU
+			usleep(1000);
+	}
+	onion_dict_lock_write(dict); // Several changes, as one writer
+	onion_dict_remove(dict, "before");
+	onion_dict_add(dict, "after", "locked", 0);
+	onion_dict_unlock(dict);
+	__atomic_store_n(&t19_rcu_running, 0, __ATOMIC_RELEASE);
+	long errors=0;
+	for (i=0;i<RCU_READERS;i++){
+		void *e;
+		pthread_join(thread[i], &e);
+		errors+=(long)e;
+	}
+	FAIL_IF_NOT_EQUAL_INT(errors, 0);
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "changing"), "changing 999");
+	FAIL_IF_NOT_EQUAL(onion_dict_get(dict, "before"), NULL);
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "after"), "locked");
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(dict), 101+1+1000-334);
+	onion_dict_clear(dict);
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(dict), 0);
+	onion_dict_free(dict);
+	
+	END_LOCAL();
+}
+#endif
+
+/// Json to dicts, copied or in place, with the escapes, nesting, arrays and literals; and invalid json.
+void t20_from_json(){
+	INIT_LOCAL();
+	
+	const char *json=" {\"a\": \"b\", \"esc\\\"aped\":\"new\\nline \\u00f1 \\ud83d\\ude00 \\/\", \"sub\": {\"n\": -1.5e3, \"t\":true, \"x\":null},"
+		"\"list\": [\"zero\", 1, {\"two\":\"2\"}, []], \"a\":\"last\", \"long\":\"0123456789abcdefghijklmnopqrstuvwxyz\"}\n";
+	onion_dict *d=onion_dict_from_json(json);
+	FAIL_IF_EQUAL(d, NULL);
+	char *copy=strdup(json);
+	onion_dict *inplace=onion_dict_from_json_inplace(copy, strlen(copy));
+	FAIL_IF_EQUAL(inplace, NULL);
+	onion_dict *both[2]={ d, inplace };
+	int i;
+	for (i=0;i<2;i++){
+		onion_dict *dict=both[i];
+		if (!dict)
+			continue;
+		FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "a"), "last");
+		FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "esc\"aped"), "new\nline \xc3\xb1 \xf0\x9f\x98\x80 /");
+		FAIL_IF_NOT_EQUAL_STR(onion_dict_rget(dict, "sub", "n", NULL), "-1.5e3");
+		FAIL_IF_NOT_EQUAL_STR(onion_dict_rget(dict, "sub", "t", NULL), "true");
+		FAIL_IF_NOT_EQUAL_STR(onion_dict_rget(dict, "sub", "x", NULL), "null");
+		FAIL_IF_NOT_EQUAL_STR(onion_dict_rget(dict, "list", "0", NULL), "zero");
+		FAIL_IF_NOT_EQUAL_STR(onion_dict_rget(dict, "list", "1", NULL), "1");
+		FAIL_IF_NOT_EQUAL_STR(onion_dict_rget(dict, "list", "2", "two", NULL), "2");
+		FAIL_IF_NOT_EQUAL_INT(onion_dict_count(onion_dict_rget_dict(dict, "list", "3", NULL)), 0);
+		FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "long"), "0123456789abcdefghijklmnopqrstuvwxyz");
+		FAIL_IF_NOT_EQUAL_INT(onion_dict_count(dict), 5);
+	}
+	const char *borrowed=onion_dict_get(inplace, "long");
+	FAIL_IF_NOT(borrowed>copy && borrowed<copy+strlen(json));
+	onion_dict_free(inplace);
+	free(copy);
+	onion_dict_free(d);
+	
+	d=onion_dict_from_json("[]");
+	FAIL_IF_EQUAL(d, NULL);
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(d), 0);
+	onion_dict_free(d);
+	
+	const char *invalid[]={ "", "\"a\"", "{", "{\"a\"}", "{\"a\":}", "{\"a\":\"b\",}", "{\"a\":\"b\"} x", "{\"a\":01}", "{\"a\":tru}",
+		"{\"a\":\"b\\x\"}", "{\"a\":\"\\ud83d\"}", "{\"a\":\"new\nline\"}", "[1 2]", "{\"a\":\"b", NULL };
+	for (i=0;invalid[i];i++){
+		d=onion_dict_from_json(invalid[i]);
+		FAIL_IF_NOT_EQUAL(d, NULL);
+		if (d){
+			ONION_ERROR("Parsed invalid json %s", invalid[i]);
+			onion_dict_free(d);
+		}
+	}
+	char deep[256];
+	memset(deep, '[', sizeof(deep)-1);
+	deep[sizeof(deep)-1]='\0';
+	FAIL_IF_NOT_EQUAL(onion_dict_from_json(deep), NULL);
+	
+	END_LOCAL();
+}
+
+/// Frozen dicts keep the elements in order, with the owned sub dicts, read only until cleared.
+void t21_freeze(int flags){
+	INIT_LOCAL();
+	
+	onion_dict *dict=onion_dict_new();
+	onion_dict_set_flags(dict, flags);
+	char key[16], value[16];
+	int i;
+	for (i=0;i<100;i++){
+		sprintf(key, "key%02d", 99-i);
+		sprintf(value, "%d", 99-i);
+		onion_dict_add(dict, key, value, OD_DUP_ALL);
+	}
+	onion_dict *sub=onion_dict_new();
+	onion_dict_add(sub, "B", "b", 0);
+	onion_dict_add(sub, "a", "a", OD_DUP_VALUE);
+	onion_dict_add(dict, "sub", sub, OD_DICT|OD_FREE_VALUE);
+	onion_dict *other=onion_dict_new(); // Not owned, not frozen
+	onion_dict_add(dict, "other", other, OD_DICT);
+	onion_dict_freeze(dict);
+	onion_dict_freeze(dict);
+	
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(dict), 102);
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "key00"), "0");
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "key57"), "57");
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "key99"), "99");
+	FAIL_IF_NOT_EQUAL(onion_dict_get(dict, "key100"), NULL);
+	FAIL_IF_NOT_EQUAL(onion_dict_get(dict, "a"), NULL);
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_rget(dict, "sub", "a", NULL), "a");
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(sub), 2);
+	FAIL_IF_NOT_EQUAL(onion_dict_get_dict(dict, "other"), other);
+	if (flags&OD_ICASE){
+		FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "KEY12"), "12");
+		FAIL_IF_NOT_EQUAL(onion_dict_get(sub, "b"), NULL); // Its own flags
+	}
+	else
+		FAIL_IF_NOT_EQUAL(onion_dict_get(dict, "KEY12"), NULL);
+	
+	onion_dict_lock_read(dict); // Do nothing, but can be called
+	onion_dict_unlock(dict);
+	onion_dict_add(dict, "new", "value", 0);
+	FAIL_IF_NOT_EQUAL(onion_dict_get(dict, "new"), NULL);
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_remove(dict, "key00"), 0);
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "key00"), "0");
+	
+	char buffer[4096]={0};
+	onion_dict_preorder(sub, append_as_headers, buffer);
+	FAIL_IF_NOT_EQUAL_STR(buffer, "B: b\na: a\n");
+	onion_block *json=onion_dict_to_json(dict);
+	FAIL_IF_NOT_STRSTR(onion_block_data(json), "{\"key00\":\"0\", \"key01\":\"1\", ");
+	FAIL_IF_NOT_STRSTR(onion_block_data(json), "\"key99\":\"99\", \"other\":{}, \"sub\":{");
+	onion_block_free(json);
+	
+	onion_dict_clear(dict); // Normal again
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(dict), 0);
+	onion_dict_add(dict, "new", "value", 0);
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(dict, "new"), "value");
+	onion_dict_free(dict);
+	onion_dict_free(other);
+	
+	dict=onion_dict_new();
+	onion_dict_add(dict, "same", "1", 0);
+	onion_dict_add(dict, "same", "2", 0);
+	onion_dict_freeze(dict);
+	buffer[0]=0;
+	onion_dict_preorder(dict, append_as_headers, buffer);
+	FAIL_IF_NOT_EQUAL_STR(buffer, "same: 1\nsame: 2\n");
+	onion_dict_free(dict);
+	
+	END_LOCAL();
+}
+
+/// Appends the key, to compare the iterator order with onion_dict_preorder
+static void t22_append_key(void *buffer, const char *key, const void *value, int flags){
+	strcat(buffer, key);
+	strcat(buffer, ",");
+}
+
+/// Iterates with the flags, and a dict inside. n elements, or frozen if n is negative.
+void t22_iter(int flags, int n){
+	INIT_LOCAL();
+	
+	onion_dict *dict=onion_dict_new();
+	onion_dict_iter it;
+	FAIL_IF(onion_dict_iter_begin(dict, &it)); // Empty
+	
+	onion_dict_set_flags(dict, flags);
+	int frozen=n<0;
+	if (frozen)
+		n=-n;
+	char key[16], value[16];
+	int i;
+	for (i=0;i<n;i++){
+		sprintf(key, "%03d", (i*7)%n);
+		sprintf(value, "v%d", (i*7)%n);
+		onion_dict_add(dict, key, value, OD_DUP_ALL);
+	}
+	onion_dict *sub=onion_dict_new();
+	onion_dict_add(sub, "a", "b", 0);
+	onion_dict_add(dict, "sub", sub, OD_DICT|OD_FREE_VALUE);
+	if (frozen)
+		onion_dict_freeze(dict);
+	
+	char *order=calloc(1, (n+1)*8);
+	char *preorder=calloc(1, (n+1)*8);
+	int count=0, dicts=0, ok=1;
+	if (onion_dict_iter_begin(dict, &it)) do{
+		count++;
+		if (it.flags&OD_DICT){
+			dicts++;
+			ok=ok && strcmp(it.key, "sub")==0 && onion_dict_get((const onion_dict*)it.value, "a");
+		}
+		else{
+			ok=ok && it.value==onion_dict_get(dict, it.key) && atoi(it.key)==atoi((const char*)it.value+1);
+		}
+		t22_append_key(order, it.key, it.value, it.flags);
+	}while(onion_dict_iter_next(&it));
+	FAIL_IF_NOT(ok);
+	FAIL_IF_NOT_EQUAL_INT(count, n+1);
+	FAIL_IF_NOT_EQUAL_INT(count, onion_dict_count(dict));
+	FAIL_IF_NOT_EQUAL_INT(dicts, 1);
+	FAIL_IF(onion_dict_iter_next(&it)); // Stays at the end
+	
+	onion_dict_preorder(dict, t22_append_key, preorder);
+	if (!(flags&OD_HASH) || frozen)
+		FAIL_IF_NOT_EQUAL_STR(order, preorder);
+	
+	free(order);
+	free(preorder);
+	onion_dict_free(dict);
+	
+	END_LOCAL();
+}
+
 int main(int argc, char **argv){
   START();/*
 	t01_create_add_free();
@@ -754,6 +1153,22 @@ int main(int argc, char **argv){
   t14_dict_case_insensitive();*/
 	t15_hard_dup_dict_in_dict();
 	t16_soft_dup_dict_in_dict();
+	t17_hash();
+	t18_flat(0);
+	t18_flat(OD_HASH);
+#ifdef HAVE_PTHREADS
+	t19_rcu();
+#endif
+	t20_from_json();
+	t21_freeze(0);
+	t21_freeze(OD_HASH|OD_ICASE);
+	t22_iter(0, 1000);
+	t22_iter(OD_FLAT, 5);
+	t22_iter(OD_FLAT, 100); // Grows out of flat
+	t22_iter(OD_HASH, 1000);
+	t22_iter(OD_HASH|OD_SORTED, 100);
+	t22_iter(0, -100);
+	t22_iter(OD_HASH, -100);
 	
 	
 	END();
@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
+#include <arpa/inet.h>
 
 #include <onion/onion.h>
 #include <onion/dict.h>
@@ -131,13 +132,22 @@ void t03_create_add_free_full_flow(){
   onion_request_process(req); // this should set the req->path.
 	FAIL_IF_NOT_EQUAL_STR(req->path,"myurl /is/very/deeply/nested");
 
-	FAIL_IF_EQUAL(req->GET, NULL);
-	FAIL_IF_NOT_EQUAL_STR( onion_dict_get(req->GET,"test"), "test");
-	FAIL_IF_NOT_EQUAL_STR( onion_dict_get(req->GET,"query2"), "query 2");
-	FAIL_IF_NOT_EQUAL_STR( onion_dict_get(req->GET,"more_query"), " more query 10");
+	FAIL_IF_NOT_EQUAL(req->GET, NULL); // Not parsed until asked for
+	FAIL_IF_NOT_EQUAL_STR( onion_request_get_query(req,"more_query"), " more query 10");
 	FAIL_IF_EQUAL(onion_request_get_query(req, "empty"), NULL);
 	FAIL_IF_EQUAL(onion_request_get_query(req, "empty2"), NULL);
 	FAIL_IF_NOT_EQUAL(onion_request_get_query(req, "empty3"), NULL);
+	FAIL_IF_NOT_EQUAL(req->GET, NULL);
+
+	const onion_dict *GET=onion_request_get_query_dict(req);
+	FAIL_IF_EQUAL(GET, NULL);
+	FAIL_IF_NOT_EQUAL_STR( onion_dict_get(GET,"test"), "test");
+	FAIL_IF_NOT_EQUAL_STR( onion_dict_get(GET,"query2"), "query 2");
+	FAIL_IF_NOT_EQUAL_STR( onion_dict_get(GET,"more_query"), " more query 10");
+	FAIL_IF_EQUAL(onion_request_get_query(req, "empty"), NULL);
+	FAIL_IF_EQUAL(onion_request_get_query(req, "empty2"), NULL);
+	FAIL_IF_NOT_EQUAL(onion_request_get_query(req, "empty3"), NULL);
+	FAIL_IF_NOT_STRSTR(onion_request_get_query_string(req), "query2=query%202"); // Still raw after the dict
 	
 	onion_request_free(req);
 	
@@ -174,10 +184,11 @@ void t04_create_add_free_GET(){
 		FAIL_IF_NOT_EQUAL_STR(req->fullpath,"/myurl /is/very/deeply/nested");
 		FAIL_IF_NOT_EQUAL_STR(req->path,"myurl /is/very/deeply/nested");
 
-		FAIL_IF_EQUAL(req->GET,NULL);
-		FAIL_IF_NOT_EQUAL_STR( onion_dict_get(req->GET,"test"), "test");
-		FAIL_IF_NOT_EQUAL_STR( onion_dict_get(req->GET,"query2"), "query 2");
-		FAIL_IF_NOT_EQUAL_STR( onion_dict_get(req->GET,"more_query"), " more query 10");
+		const onion_dict *GET=onion_request_get_query_dict(req);
+		FAIL_IF_EQUAL(GET,NULL);
+		FAIL_IF_NOT_EQUAL_STR( onion_dict_get(GET,"test"), "test");
+		FAIL_IF_NOT_EQUAL_STR( onion_dict_get(GET,"query2"), "query 2");
+		FAIL_IF_NOT_EQUAL_STR( onion_dict_get(GET,"more_query"), " more query 10");
 		
 		onion_request_clean(req);
 		FAIL_IF_NOT_EQUAL(req->GET,NULL);
@@ -217,10 +228,11 @@ void t05_create_add_free_POST(){
 		FAIL_IF_NOT_EQUAL_STR(req->fullpath,"/myurl /is/very/deeply/nested");
 		FAIL_IF_NOT_EQUAL_STR(req->path,"myurl /is/very/deeply/nested");
 
-		FAIL_IF_EQUAL(req->GET,NULL);
-		FAIL_IF_NOT_EQUAL_STR( onion_dict_get(req->GET,"test"), "test");
-		FAIL_IF_NOT_EQUAL_STR( onion_dict_get(req->GET,"query2"), "query 2");
-		FAIL_IF_NOT_EQUAL_STR( onion_dict_get(req->GET,"more_query"), " more query 10");
+		const onion_dict *GET=onion_request_get_query_dict(req);
+		FAIL_IF_EQUAL(GET,NULL);
+		FAIL_IF_NOT_EQUAL_STR( onion_dict_get(GET,"test"), "test");
+		FAIL_IF_NOT_EQUAL_STR( onion_dict_get(GET,"query2"), "query 2");
+		FAIL_IF_NOT_EQUAL_STR( onion_dict_get(GET,"more_query"), " more query 10");
 
 		const onion_dict *post=onion_request_get_post_dict(req);
 		FAIL_IF_EQUAL(post,NULL);
@@ -516,7 +528,240 @@ void t11_cookies(){
 	END_LOCAL();
 }
 
+void t12_header_slices(){
+	INIT_LOCAL();
+	
+	onion_request *req;
+	int ok;
+	
+	onion_set_header_slices(server, 1);
+	req=onion_request_new(custom_io);
+	FAIL_IF_EQUAL(req,NULL);
+	onion_set_header_slices(server, 0);
+	
+	{
+		const char *query="GET / HTTP/1.0\n"
+											"Content-Type: application/x-www-form-urlencoded\n"
+											"Host: 127.0.0.1\n\r"
+											"Other-Header: My header is very long and with several\n \n lines\n"
+											"Cookie: key1=value1; key2=value2;\r\n"
+											"Content-Type: application/x-www-form-urlencoded-bis\n\n";
+		// In two parts, cut at a key and a value
+		ok=onion_request_write(req,query,60);
+		FAIL_IF_NOT_EQUAL_INT(ok,OCS_NEED_MORE_DATA);
+		ok=onion_request_write(req,query+60,strlen(query)-60);
+	}
+	FAIL_IF_EQUAL(ok,OCS_INTERNAL_ERROR);
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(req->headers),0);
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req,"host"),"127.0.0.1");
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req,"Other-Header"),"My header is very long and with several lines");
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req,"Content-Type"),"application/x-www-form-urlencoded");
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_cookie(req,"key2"), "value2");
+	FAIL_IF_NOT_EQUAL(onion_request_get_header(req,"Content-Length"),NULL);
+	
+	const onion_dict *headers=onion_request_get_header_dict(req);
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(headers,"HOST"),"127.0.0.1");
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(headers),5); // Repeated Content-Type too
+	onion_request_clean(req);
+	
+	{ // Keep alive, reuses the buffer
+		const char *query="POST / HTTP/1.0\r\n"
+											"Content-Length: 7\r\n"
+											"Content-Type: application/x-www-form-urlencoded\r\n\r\n"
+											"a=1&b=2";
+		ok=onion_request_write(req,query,strlen(query));
+	}
+	FAIL_IF_EQUAL(ok,OCS_INTERNAL_ERROR);
+	FAIL_IF_NOT_EQUAL(onion_request_get_header(req,"Host"),NULL);
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req,"Content-Length"),"7");
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_post(req,"b"),"2");
+	onion_request_clean(req);
+	
+	{
+		const char *query="GET / HTTP/1.0\n"
+											"Host: 127.0.0.1\n"
+											"No-Colon\n\n";
+		ok=onion_request_write(req,query,strlen(query));
+	}
+	FAIL_IF_NOT_EQUAL(ok,OCS_INTERNAL_ERROR);
+	
+	onion_request_free(req);
+	
+	END_LOCAL();
+}
+void t13_token_grows_and_shrinks(){
+	INIT_LOCAL();
+	
+	onion_request *req;
+	int ok;
+	char query[2048];
+	char path[1024];
+	
+	memset(path, 'a', sizeof(path)-1);
+	path[0]='/';
+	path[sizeof(path)-1]='\0';
+	snprintf(query, sizeof(query), "GET %s HTTP/1.0\nHost: 127.0.0.1\n\n", path);
+	
+	req=onion_request_new(custom_io);
+	ok=onion_request_write(req,query,strlen(query));
+	FAIL_IF_EQUAL(ok,OCS_INTERNAL_ERROR);
+	FAIL_IF_NOT_EQUAL_STR(req->fullpath, path);
+	onion_request_clean(req);
+	
+	REQ_WRITE(req, "GET /small HTTP/1.0\nHost: localhost\n\n");
+	FAIL_IF_NOT_EQUAL_STR(req->fullpath, "/small");
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req,"Host"),"localhost");
+	
+	onion_request_free(req);
+	
+	END_LOCAL();
+}
+void t14_write_split_at_every_byte(){
+	INIT_LOCAL();
+	
+	const char *query="GET /a/long/path/to/cross/several/blocks?q=1 HTTP/1.0\r\n"
+										"Host: 127.0.0.1\r\n"
+										"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko)\r\n"
+										"Accept:text/html,application/xhtml+xml\r\n"
+										"\r\n";
+	int l=strlen(query);
+	int i;
+	for (i=1;i<l;i++){
+		onion_request *req=onion_request_new(custom_io);
+		onion_request_write(req,query,i);
+		onion_request_write(req,query+i,l-i);
+		FAIL_IF_NOT_EQUAL_STR(req->fullpath, "/a/long/path/to/cross/several/blocks");
+		FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req,"User-Agent"),"Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko)");
+		FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req,"Accept"),"text/html,application/xhtml+xml");
+		onion_request_free(req);
+	}
+	
+	END_LOCAL();
+}
 
+void t15_lazy_query(){
+	INIT_LOCAL();
+	
+	onion_request *req=onion_request_new(custom_io);
+	REQ_WRITE(req, "GET /q?utm_source=x&a%20b=1+2&x=first&x=second&flag&test=%41%42&tes HTTP/1.0\nHost: localhost\n\n");
+	FAIL_IF_NOT_EQUAL_STR(req->fullpath, "/q");
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "a b"), "1 2");
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "x"), "first");
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "flag"), "");
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "test"), "AB");
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "tes"), "");
+	FAIL_IF_NOT_EQUAL(onion_request_get_query(req, "te"), NULL);
+	FAIL_IF_NOT_EQUAL(onion_request_get_query(req, "a"), NULL);
+	FAIL_IF_NOT_EQUAL(req->GET, NULL);
+	
+	const onion_dict *GET=onion_request_get_query_dict(req);
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(GET), 7);
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "a b"), "1 2");
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_query(req, "test"), "AB");
+	onion_request_clean(req);
+	
+	REQ_WRITE(req, "GET /noquery HTTP/1.0\nHost: localhost\n\n");
+	FAIL_IF_NOT_EQUAL(onion_request_get_query(req, "x"), NULL);
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(onion_request_get_query_dict(req)), 0);
+	
+	onion_request_free(req);
+	
+	END_LOCAL();
+}
+
+/// The well known headers by id, the first if repeated, on both header modes, and on requests not parsed.
+void t16_header_id(){
+	INIT_LOCAL();
+	
+	int slices;
+	for (slices=0;slices<2;slices++){
+		onion_set_header_slices(server, slices);
+		onion_request *req=onion_request_new(custom_io);
+		onion_set_header_slices(server, 0);
+		int i;
+		for (i=0;i<2;i++){ // And again after a clean, as on keep alive
+			const char *query="GET / HTTP/1.0\n"
+												"content-type: text/plain\n"
+												"HOST: 127.0.0.1\r\n"
+												"X-Content-Type: no\n"
+												"Range: bytes=0-\n"
+												"Content-Type: text/other\n\n";
+			FAIL_IF_EQUAL(onion_request_write(req,query,strlen(query)),OCS_INTERNAL_ERROR);
+			FAIL_IF_NOT_EQUAL_STR(onion_request_get_header_id(req,ONION_H_HOST),"127.0.0.1");
+			FAIL_IF_NOT_EQUAL_STR(onion_request_get_header_id(req,ONION_H_CONTENT_TYPE),"text/plain");
+			FAIL_IF_NOT_EQUAL_STR(onion_request_get_header_id(req,ONION_H_RANGE),"bytes=0-");
+			FAIL_IF_NOT_EQUAL(onion_request_get_header_id(req,ONION_H_CONTENT_LENGTH),NULL);
+			FAIL_IF_NOT_EQUAL_STR(onion_request_get_header(req,onion_request_header_names[ONION_H_CONTENT_TYPE]),"text/plain");
+			onion_request_clean(req);
+			FAIL_IF_NOT_EQUAL(onion_request_get_header_id(req,ONION_H_HOST),NULL);
+		}
+		onion_request_free(req);
+	}
+	
+	onion_request *req=onion_request_new(custom_io); // Made by hand, by name
+	onion_dict_add(req->headers, "Cookie", "a=b", 0);
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_header_id(req,ONION_H_COOKIE),"a=b");
+	onion_request_free(req);
+	
+	END_LOCAL();
+}
+
+/// The client description is as getnameinfo, kept for the next requests, and the IP in binary.
+void t17_client_ip(){
+	INIT_LOCAL();
+	
+	const char *ips[]={ "1.2.3.4", "10.0.100.255", "255.255.255.0", "::1", "2001:db8::8a2e:370:7334", "::ffff:192.168.1.20", "fe80::1:0:0:1", NULL };
+	const char **ip;
+	for (ip=ips;*ip;ip++){
+		struct sockaddr_storage addr;
+		memset(&addr, 0, sizeof(addr));
+		socklen_t len;
+		if (strchr(*ip, ':')){
+			struct sockaddr_in6 *in6=(struct sockaddr_in6*)&addr;
+			in6->sin6_family=AF_INET6;
+			FAIL_IF_NOT_EQUAL_INT(inet_pton(AF_INET6, *ip, &in6->sin6_addr), 1);
+			len=sizeof(*in6);
+		}
+		else{
+			struct sockaddr_in *in=(struct sockaddr_in*)&addr;
+			in->sin_family=AF_INET;
+			FAIL_IF_NOT_EQUAL_INT(inet_pton(AF_INET, *ip, &in->sin_addr), 1);
+			len=sizeof(*in);
+		}
+		char expected[128];
+		getnameinfo((struct sockaddr*)&addr, len, expected, sizeof(expected), NULL, 0, NI_NUMERICHOST);
+		
+		onion_request *req=onion_request_new_from_socket(NULL, 0, &addr, len);
+		FAIL_IF_NOT_EQUAL_STR(onion_request_get_client_description(req), expected);
+		onion_request_clean(req);
+		FAIL_IF_NOT_EQUAL_STR(onion_request_get_client_description(req), expected);
+		
+		size_t length=0;
+		const unsigned char *bin=onion_request_get_client_ip(req, &length);
+		FAIL_IF_EQUAL(bin, NULL);
+		if (strncmp(*ip, "::ffff:", 7)==0){ // Mapped, as IPv4
+			FAIL_IF_NOT_EQUAL_INT(length, 4);
+			FAIL_IF_NOT_EQUAL_INT(memcmp(bin, ((unsigned char*)&((struct sockaddr_in6*)&addr)->sin6_addr)+12, 4), 0);
+		}
+		else if (addr.ss_family==AF_INET6){
+			FAIL_IF_NOT_EQUAL_INT(length, 16);
+			FAIL_IF_NOT_EQUAL_INT(memcmp(bin, &((struct sockaddr_in6*)&addr)->sin6_addr, 16), 0);
+		}
+		else{
+			FAIL_IF_NOT_EQUAL_INT(length, 4);
+			FAIL_IF_NOT_EQUAL_INT(memcmp(bin, &((struct sockaddr_in*)&addr)->sin_addr, 4), 0);
+		}
+		onion_request_free(req);
+	}
+	
+	onion_request *req=onion_request_new(custom_io);
+	size_t length;
+	FAIL_IF_NOT_EQUAL(onion_request_get_client_ip(req, &length), NULL);
+	FAIL_IF_NOT_EQUAL(onion_request_get_client_description(req), NULL);
+	onion_request_free(req);
+	
+	END_LOCAL();
+}
 
 int main(int argc, char **argv){
   START();
@@ -533,6 +778,12 @@ int main(int argc, char **argv){
 	t09_very_long_header();
 	t10_repeated_header();
 	t11_cookies();
+	t12_header_slices();
+	t13_token_grows_and_shrinks();
+	t14_write_split_at_every_byte();
+	t15_lazy_query();
+	t16_header_id();
+	t17_client_ip();
 	
 	teardown();
 	END();
@@ -18,6 +18,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <onion/log.h>
 #include <onion/dict.h>
@@ -26,6 +27,8 @@
 #include <onion/types_internal.h>
 #include <onion/onion.h>
 #include <onion/http.h>
+#include <onion/block.h>
+#include <onion/shortcuts.h>
 
 #include "../ctest.h"
 #include "buffer_listen_point.h"
@@ -180,6 +183,276 @@ void t02_cookies(){
 	END_LOCAL();
 }
 
+int nwritev=0;
+
+/// Appends to the buffer listen point buffer, and counts the calls.
+ssize_t count_writev(onion_request *req, const struct iovec *iov, int iovcnt){
+	ssize_t l=0;
+	int i;
+	for (i=0;i<iovcnt;i++){
+		onion_block_add_data(onion_buffer_listen_point_get_buffer(req), iov[i].iov_base, iov[i].iov_len);
+		l+=iov[i].iov_len;
+	}
+	nwritev++;
+	return l;
+}
+
+/// A small chunked response is written at once: headers, chunk, and chunked end.
+void t04_chunked_writev(){
+	INIT_LOCAL();
+	
+	onion *server=onion_new(0);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	lp->writev=count_writev;
+	onion_add_listen_point(server, NULL,NULL,lp);
+	onion_request *request=onion_request_new(lp);
+	FILL(request,"GET / HTTP/1.1\n");
+	
+	onion_response *response=onion_response_new(request);
+	onion_response_write_headers(response); // No length, so chunked
+	onion_response_write0(response, "hello");
+	FAIL_IF_NOT_EQUAL_INT(nwritev, 0);
+	onion_response_free(response);
+	FAIL_IF_NOT_EQUAL_INT(nwritev, 1);
+	
+	const char *buffer=onion_buffer_listen_point_get_buffer_data(request);
+	FAIL_IF_NOT_STRSTR(buffer, "HTTP/1.1 200 OK\r\n");
+	FAIL_IF_NOT_STRSTR(buffer, "Transfer-Encoding: chunked\r\n");
+	FAIL_IF_NOT_STRSTR(buffer, "\r\n\r\n5\r\nhello\r\n0\r\n\r\n");
+	onion_request_free(request);
+	onion_free(server);
+	
+	END_LOCAL();
+}
+
+/// Responses up to the buffer size get a Content-Length and a single write, bigger are chunked at that size.
+void t05_buffer_size(){
+	INIT_LOCAL();
+	
+	onion *server=onion_new(0);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	lp->writev=count_writev;
+	onion_add_listen_point(server, NULL,NULL,lp);
+	onion_set_response_buffer_size(server, 64*1024);
+	onion_request *request=onion_request_new(lp);
+	FILL(request,"GET / HTTP/1.1\n");
+	
+	char data[10000];
+	memset(data, 'x', sizeof(data));
+	nwritev=0;
+	onion_response *response=onion_response_new(request);
+	int i;
+	for (i=0;i<10;i++)
+		onion_response_write(response, data, 1000);
+	FAIL_IF_NOT_EQUAL_INT(onion_response_free(response), OCS_KEEP_ALIVE);
+	FAIL_IF_NOT_EQUAL_INT(nwritev, 1);
+	const char *buffer=onion_buffer_listen_point_get_buffer_data(request);
+	FAIL_IF_NOT_STRSTR(buffer, "Content-Length: 10000\r\n");
+	FAIL_IF_STRSTR(buffer, "chunked");
+	FAIL_IF_NOT_EQUAL_INT(strlen(strstr(buffer, "\r\n\r\n")+4), 10000);
+	
+	// Smaller than the server default, only for this response
+	onion_block_clear(onion_buffer_listen_point_get_buffer(request));
+	nwritev=0;
+	response=onion_response_new(request);
+	onion_response_set_buffer_size(response, 16);
+	onion_response_write(response, data, 40);
+	onion_response_free(response);
+	FAIL_IF_NOT_EQUAL_INT(nwritev, 3);
+	buffer=onion_buffer_listen_point_get_buffer_data(request);
+	FAIL_IF_NOT_STRSTR(buffer, "Transfer-Encoding: chunked\r\n");
+	FAIL_IF_NOT_STRSTR(buffer, "\r\n\r\n10\r\nxxxxxxxxxxxxxxxx\r\n10\r\nxxxxxxxxxxxxxxxx\r\n8\r\nxxxxxxxx\r\n0\r\n\r\n");
+	
+	onion_request_free(request);
+	onion_free(server);
+	
+	END_LOCAL();
+}
+
+#define HEADER_BLOCK "Cache-Control: no-cache\r\nX-Frame-Options: DENY\r\n"
+
+/// Prerendered status lines and default headers, and a header block.
+void t06_header_block(){
+	INIT_LOCAL();
+	
+	onion *server=onion_new(0);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL,NULL,lp);
+	onion_request *request=onion_request_new(lp);
+	FILL(request,"GET / HTTP/1.1\n");
+	
+	onion_response *response=onion_response_new(request);
+	onion_response_set_code(response, HTTP_NOT_FOUND);
+	onion_response_set_header_block(response, HEADER_BLOCK, sizeof(HEADER_BLOCK)-1);
+	onion_response_set_header(response, "X-Test", "test");
+	onion_response_write0(response, "none");
+	onion_response_free(response);
+	
+	const char *buffer=onion_buffer_listen_point_get_buffer_data(request);
+	FAIL_IF_NOT_EQUAL_INT(strncmp(buffer, "HTTP/1.1 404 NOT FOUND\r\n", 24), 0);
+	FAIL_IF_NOT_STRSTR(buffer, "\r\nServer: libonion");
+	FAIL_IF_NOT_STRSTR(buffer, "\r\nContent-Type: text/html\r\n");
+	FAIL_IF_NOT_STRSTR(buffer, "\r\nX-Test: test\r\n");
+	FAIL_IF_NOT_STRSTR(buffer, "\r\n" HEADER_BLOCK "\r\nnone");
+	
+	// Not at the table, and HTTP/1.0
+	onion_request_free(request);
+	request=onion_request_new(lp);
+	FILL(request,"GET / HTTP/1.0\n");
+	response=onion_response_new(request);
+	onion_response_set_code(response, 418);
+	onion_response_set_header(response, "Content-Type", "text/plain");
+	onion_response_write0(response, "teapot");
+	onion_response_free(response);
+	buffer=onion_buffer_listen_point_get_buffer_data(request);
+	FAIL_IF_NOT_EQUAL_INT(strncmp(buffer, "HTTP/1.0 418 CODE UNKNOWN\r\n", 27), 0);
+	FAIL_IF_NOT_STRSTR(buffer, "\r\nContent-Type: text/plain\r\n");
+	
+	onion_request_free(request);
+	onion_free(server);
+	
+	END_LOCAL();
+}
+
+/// The Date header is GMT, as RFC 7231, and can be overwritten.
+void t07_date(){
+	INIT_LOCAL();
+	
+	onion *server=onion_new(0);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL,NULL,lp);
+	onion_request *request=onion_request_new(lp);
+	FILL(request,"GET / HTTP/1.1\n");
+	
+	onion_response *response=onion_response_new(request);
+	onion_response_write0(response, "date");
+	onion_response_free(response);
+	
+	char expected[64];
+	time_t t=time(NULL);
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	strftime(expected, sizeof(expected), "\r\nDate: %a, %d %b %Y ", &tm); // C locale
+	const char *buffer=onion_buffer_listen_point_get_buffer_data(request);
+	const char *date=strstr(buffer, "\r\nDate: ");
+	FAIL_IF_EQUAL(date, NULL);
+	if (date){
+		FAIL_IF_NOT_EQUAL_INT(strncmp(date, expected, strlen(expected)), 0);
+		FAIL_IF_NOT_EQUAL_INT(strncmp(date+strlen(expected)+8, " GMT\r\n", 6), 0);
+	}
+	
+	onion_request_free(request);
+	request=onion_request_new(lp);
+	FILL(request,"GET / HTTP/1.1\n");
+	response=onion_response_new(request);
+	onion_response_set_header(response, "Date", "Sun, 06 Nov 1994 08:49:37 GMT");
+	onion_response_write0(response, "date");
+	onion_response_free(response);
+	buffer=onion_buffer_listen_point_get_buffer_data(request);
+	date=strstr(buffer, "\r\nDate: ");
+	FAIL_IF_EQUAL(date, NULL);
+	if (date){
+		FAIL_IF_NOT_EQUAL_INT(strncmp(date, "\r\nDate: Sun, 06 Nov 1994 08:49:37 GMT\r\n", 39), 0);
+		FAIL_IF_NOT_EQUAL(strstr(date+1, "\r\nDate: "), NULL);
+	}
+	
+	onion_request_free(request);
+	onion_free(server);
+	
+	END_LOCAL();
+}
+
+/// The json goes straight to the response, escaped, with the length known before.
+void t08_json(){
+	INIT_LOCAL();
+	
+	onion *server=onion_new(0);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL,NULL,lp);
+	onion_request *request=onion_request_new(lp);
+	FILL(request,"GET / HTTP/1.0\n");
+	
+	onion_dict *d=onion_dict_new();
+	onion_dict_add(d, "plain", "value", 0);
+	onion_dict_add(d, "with\"", "new\nline\t\\ \x01 \xc3\xb1", 0);
+	onion_dict *sub=onion_dict_new();
+	onion_dict_add(sub, "a", "1", 0);
+	onion_dict_add(sub, "b", "2", 0);
+	onion_dict_add(d, "sub", sub, OD_DICT|OD_FREE_VALUE);
+	onion_dict_add(d, "empty", onion_dict_new(), OD_DICT|OD_FREE_VALUE);
+	const char *expected="{\"empty\":{}, \"plain\":\"value\", \"sub\":{\"a\":\"1\", \"b\":\"2\"}, \"with\\\"\":\"new\\nline\\t\\\\ \\u0001 \xc3\xb1\"}";
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_json_length(d), strlen(expected));
+	
+	onion_response *response=onion_response_new(request);
+	onion_shortcut_response_json(d, request, response);
+	onion_response_free(response);
+	const char *buffer=onion_buffer_listen_point_get_buffer_data(request);
+	char length[64];
+	snprintf(length, sizeof(length), "Content-Length: %d\r\n", (int)strlen(expected));
+	FAIL_IF_NOT_STRSTR(buffer, length);
+	FAIL_IF_NOT_STRSTR(buffer, "Content-Type: application/json\r\n");
+	const char *body=strstr(buffer, "\r\n\r\n");
+	FAIL_IF_EQUAL(body, NULL);
+	if (body)
+		FAIL_IF_NOT_EQUAL_STR(body+4, expected);
+	
+	onion_request_free(request);
+	onion_free(server);
+	
+	END_LOCAL();
+}
+
+/// Big ropes go as they are, at writev calls, small ones through the buffer.
+void t09_rope(){
+	INIT_LOCAL();
+	
+	onion *server=onion_new(0);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	lp->writev=count_writev;
+	onion_add_listen_point(server, NULL,NULL,lp);
+	onion_request *request=onion_request_new(lp);
+	FILL(request,"GET / HTTP/1.1\n");
+	
+	onion_rope *rope=onion_rope_new();
+	int i;
+	for (i=0;i<20*ONION_ROPE_SEGMENT_SIZE;i++)
+		onion_rope_add_char(rope, 'a'+i%26);
+	nwritev=0;
+	onion_response *response=onion_response_new(request);
+	onion_response_set_length(response, onion_rope_size(rope));
+	FAIL_IF_NOT_EQUAL_INT(onion_response_write_rope(response, rope), onion_rope_size(rope));
+	FAIL_IF_NOT_EQUAL_INT(onion_response_free(response), OCS_KEEP_ALIVE);
+	FAIL_IF_NOT_EQUAL_INT(nwritev, 3); // Headers and 20 segments, 8 at a time
+	const char *buffer=onion_buffer_listen_point_get_buffer_data(request);
+	char length[64];
+	snprintf(length, sizeof(length), "Content-Length: %d\r\n", 20*ONION_ROPE_SEGMENT_SIZE);
+	FAIL_IF_NOT_STRSTR(buffer, length);
+	const char *body=strstr(buffer, "\r\n\r\n")+4;
+	FAIL_IF_NOT_EQUAL_INT(strlen(body), 20*ONION_ROPE_SEGMENT_SIZE);
+	int ok=1;
+	for (i=0;i<20*ONION_ROPE_SEGMENT_SIZE;i++)
+		ok=ok && body[i]=='a'+i%26;
+	FAIL_IF_NOT(ok);
+	
+	onion_block_clear(onion_buffer_listen_point_get_buffer(request));
+	onion_rope_clear(rope);
+	onion_rope_add_str(rope, "small");
+	nwritev=0;
+	response=onion_response_new(request);
+	onion_response_write_rope(response, rope);
+	onion_response_free(response);
+	FAIL_IF_NOT_EQUAL_INT(nwritev, 1);
+	buffer=onion_buffer_listen_point_get_buffer_data(request);
+	FAIL_IF_NOT_STRSTR(buffer, "Content-Length: 5\r\n");
+	FAIL_IF_NOT_STRSTR(buffer, "\r\n\r\nsmall");
+	
+	onion_rope_free(rope);
+	onion_request_free(request);
+	onion_free(server);
+	
+	END_LOCAL();
+}
+
 int main(int argc, char **argv){
 	START();
 	
@@ -187,6 +460,12 @@ int main(int argc, char **argv){
 	t02_full_cycle_http10();
 	t03_full_cycle_http11();
 	t02_cookies();
+	t04_chunked_writev();
+	t05_buffer_size();
+	t06_header_block();
+	t07_date();
+	t08_json();
+	t09_rope();
 	
 	END();
 }
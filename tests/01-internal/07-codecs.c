@@ -21,6 +21,8 @@
 #include <unistd.h>
 
 #include <onion/codecs.h>
+#include <onion/hash.h>
+#include <onion/block.h>
 
 #include "../ctest.h"
 
@@ -183,6 +185,217 @@ void t07_codecs_html(){
 	END_LOCAL();
 }
 
+/// Writer for onion_html_quote_stream, to a block.
+ssize_t html_block_write(void *block, const char *str, size_t length){
+	onion_block_add_data(block, str, length);
+	return length;
+}
+
+void t08_codecs_html_stream(){
+	INIT_LOCAL();
+	
+	// Entities at the ends, and at both sides of the 16 byte scans
+	const char *str="<Lorem ipsum dolor sit amet, \"consectetur\" adipiscing & elit 'sed'>";
+	onion_block *block=onion_block_new();
+	FAIL_IF_NOT_EQUAL_INT(onion_html_quote_stream(str, strlen(str), html_block_write, block), 95);
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(block), "&lt;Lorem ipsum dolor sit amet, &quot;consectetur&quot; adipiscing &amp; elit &#39;sed&#39;&gt;");
+	char *encoded=onion_html_quote(str);
+	FAIL_IF_NOT_EQUAL_STR(encoded, onion_block_data(block));
+	free(encoded);
+	
+	onion_block_clear(block);
+	str="No entities at all, longer than sixteen bytes";
+	FAIL_IF_NOT_EQUAL_INT(onion_html_scan(str, strlen(str)), strlen(str));
+	FAIL_IF_NOT_EQUAL_INT(onion_html_quote_stream(str, strlen(str), html_block_write, block), strlen(str));
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(block), str);
+	FAIL_IF_NOT_EQUAL_INT(onion_html_scan("0123456789abcdef0123&", 21), 20);
+	onion_block_free(block);
+	
+	END_LOCAL();
+}
+
+/// The SIMD kernels give the same as the scalar code, with and without new lines, and in place.
+void t09_codecs_base64_simd(){
+	INIT_LOCAL();
+
+	int i, j;
+	for (i=0;i<200;i++){
+		int length=i<100 ? i : rand()%100000;
+		char *text=malloc(length+1);
+		for (j=0;j<length;j++)
+			text[j]=rand();
+
+		char *enc=malloc(onion_base64_encode_length(length));
+		onion_base64_use_simd(0);
+		size_t elength=onion_base64_encode_to(text, length, enc);
+		FAIL_IF_NOT_EQUAL_INT(elength, strlen(enc));
+		onion_base64_use_simd(1);
+		char *simd=onion_base64_encode(text, length);
+		FAIL_IF_NOT_EQUAL_STR(simd, enc);
+
+		char *dec=malloc(elength*3/4+1);
+		onion_base64_use_simd(0);
+		FAIL_IF_NOT_EQUAL_INT(onion_base64_decode_to(enc, elength, dec), length);
+		FAIL_IF(memcmp(dec, text, length)!=0);
+		onion_base64_use_simd(1);
+		memset(dec, 0, length);
+		FAIL_IF_NOT_EQUAL_INT(onion_base64_decode_to(enc, elength, dec), length);
+		FAIL_IF(memcmp(dec, text, length)!=0);
+
+		// In place, in one line, with a space at an odd place
+		char *inplace=malloc(elength+2), *w=inplace;
+		for (j=0;j<elength;j++){
+			if (j==37)
+				*w++=' ';
+			if (enc[j]!='\n')
+				*w++=enc[j];
+		}
+		FAIL_IF_NOT_EQUAL_INT(onion_base64_decode_to(inplace, w-inplace, inplace), length);
+		FAIL_IF(memcmp(inplace, text, length)!=0);
+		free(inplace);
+
+		free(text);
+		free(enc);
+		free(dec);
+		free(simd);
+	}
+
+	END_LOCAL();
+}
+
+/// URL quoting and unquoting, with clean runs longer than the 16 byte scans, and bad escapes.
+void t10_codecs_url(){
+	INIT_LOCAL();
+
+	char str[128];
+	strcpy(str, "hello+world%21%2fthis+is+a+long+clean+run+of+text%3D%3d%");
+	onion_unquote_inplace(str);
+	FAIL_IF_NOT_EQUAL_STR(str, "hello world!/this is a long clean run of text==%");
+	strcpy(str, "%zz%4%41");
+	onion_unquote_inplace(str);
+	FAIL_IF_NOT_EQUAL_STR(str, "%zz%4A");
+
+	const char *quoted="a%20b%26c";
+	FAIL_IF_NOT_EQUAL_INT(onion_unquote_to(quoted, 5, str), 3); // Only "a%20b"
+	FAIL_IF(memcmp(str, "a b", 3)!=0);
+
+	const char *text="Lorem ipsum dolor sit amet/consectetur?\377";
+	FAIL_IF_NOT_EQUAL_INT(onion_quote_length(text, strlen(text)), 54);
+	FAIL_IF_NOT_EQUAL_INT(onion_quote_to(text, strlen(text), str), 54);
+	FAIL_IF_NOT_EQUAL_STR(str, "Lorem%20ipsum%20dolor%20sit%20amet%2Fconsectetur%3F%FF");
+	char *res=onion_quote_new(text);
+	FAIL_IF_NOT_EQUAL_STR(res, str);
+	onion_unquote_inplace(res);
+	FAIL_IF_NOT_EQUAL_STR(res, text);
+	free(res);
+
+	// Cut at whole escapes
+	FAIL_IF_NOT_EQUAL_INT(onion_quote(text, str, 14), 13);
+	FAIL_IF_NOT_EQUAL_STR(str, "Lorem%20ipsum");
+	FAIL_IF_NOT_EQUAL_INT(onion_quote(text, str, 8), 5);
+	FAIL_IF_NOT_EQUAL_STR(str, "Lorem");
+
+	text="Some \"quoted\" text\nwith\tother \377 chars";
+	FAIL_IF(onion_c_quote_length(text)<strlen("\"Some \\\"quoted\\\" text\\n\"\n\"with\\tother \\377 chars\"")+1);
+	onion_c_quote(text, str, onion_c_quote_length(text));
+	FAIL_IF_NOT_EQUAL_STR(str, "\"Some \\\"quoted\\\" text\\n\"\n\"with\\tother \\377 chars\"");
+
+	END_LOCAL();
+}
+
+/// The query tokenizer gives views into the query, and the in place splitter unquotes as it goes.
+void t11_codecs_query(){
+	INIT_LOCAL();
+
+	const char *query="&a=1&&long+key%21=some+longer+value%3D&empty=&novalue&=x&last=%zz";
+	const char *p=query;
+	onion_query_token token;
+	FAIL_IF_NOT(onion_query_next(&p, &token));
+	FAIL_IF_NOT_EQUAL_INT(token.key_length, 1);
+	FAIL_IF(memcmp(token.key, "a", 1)!=0);
+	FAIL_IF_NOT_EQUAL_INT(token.value_length, 1);
+	FAIL_IF(memcmp(token.value, "1", 1)!=0);
+	FAIL_IF_NOT(onion_query_next(&p, &token));
+	FAIL_IF_NOT_EQUAL_INT(token.key_length, 11);
+	FAIL_IF(token.key!=query+6);
+	FAIL_IF_NOT_EQUAL_INT(token.value_length, 20);
+	FAIL_IF_NOT(onion_query_next(&p, &token));
+	FAIL_IF_NOT_EQUAL_INT(token.value_length, 0);
+	FAIL_IF(token.value==NULL);
+	FAIL_IF_NOT(onion_query_next(&p, &token));
+	FAIL_IF_NOT_EQUAL_INT(token.key_length, 7);
+	FAIL_IF_NOT(token.value==NULL);
+	FAIL_IF_NOT(onion_query_next(&p, &token));
+	FAIL_IF_NOT_EQUAL_INT(token.key_length, 0);
+	FAIL_IF_NOT(onion_query_next(&p, &token));
+	FAIL_IF_NOT_EQUAL_INT(token.value_length, 3);
+	FAIL_IF(onion_query_next(&p, &token));
+
+	char *copy=strdup(query), *q=copy, *key, *value;
+	const char *expected[]={"a","1", "long key!","some longer value=", "empty","", "novalue","", "","x", "last","%zz"};
+	int i=0;
+	while (onion_query_split_inplace(&q, &key, &value)){
+		FAIL_IF(i>=12);
+		if (i>=12)
+			break;
+		FAIL_IF_NOT_EQUAL_STR(key, expected[i]);
+		FAIL_IF_NOT_EQUAL_STR(value, expected[i+1]);
+		i+=2;
+	}
+	FAIL_IF_NOT_EQUAL_INT(i, 12);
+	free(copy);
+
+	END_LOCAL();
+}
+
+/// Hex of length bytes, to compare digests.
+static const char *hex(const char *data, int length){
+	static char ret[129];
+	int i;
+	for (i=0;i<length && i<64;i++)
+		sprintf(&ret[i*2], "%02x", (unsigned char)data[i]);
+	return ret;
+}
+
+/// The built in hashes give the known values, with and without the CPU SHA instructions, and by parts.
+void t12_codecs_hash(){
+	INIT_LOCAL();
+
+	char digest[ONION_SHA256_LENGTH], parts[ONION_SHA256_LENGTH];
+	int hw;
+	for (hw=0;hw<2;hw++){
+		onion_hash_use_hw(hw);
+		onion_sha1("abc", 3, digest);
+		FAIL_IF_NOT_EQUAL_STR(hex(digest, ONION_SHA1_LENGTH), "a9993e364706816aba3e25717850c26c9cd0d89d");
+		onion_sha256("abc", 3, digest);
+		FAIL_IF_NOT_EQUAL_STR(hex(digest, ONION_SHA256_LENGTH), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+		char *million=malloc(1000000);
+		memset(million, 'a', 1000000);
+		onion_sha256(million, 1000000, digest);
+		FAIL_IF_NOT_EQUAL_STR(hex(digest, ONION_SHA256_LENGTH), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+		onion_sha256_state state;
+		onion_sha256_init(&state);
+		int i;
+		for (i=0;i<1000000;i+=777)
+			onion_sha256_update(&state, million+i, i+777<=1000000 ? 777 : 1000000-i);
+		onion_sha256_final(&state, parts);
+		FAIL_IF(memcmp(digest, parts, sizeof(digest))!=0);
+		free(million);
+
+		// RFC 4231, test case 2
+		onion_hmac_sha256("Jefe", 4, "what do ya want for nothing?", 28, digest);
+		FAIL_IF_NOT_EQUAL_STR(hex(digest, ONION_SHA256_LENGTH), "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843");
+	}
+
+	FAIL_IF_NOT(onion_hash64("", 0, 0)==0xef46db3751d8e999ULL);
+	FAIL_IF_NOT(onion_hash64("abc", 3, 0)==0x44bc2cf5ad770999ULL);
+	const char *text="Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod";
+	FAIL_IF_NOT(onion_hash64(text, strlen(text), 1)==0xc581fde67c4801f8ULL);
+
+	END_LOCAL();
+}
+
 int main(int argc, char **argv){
 	START();
 	
@@ -193,6 +406,11 @@ int main(int argc, char **argv){
 	t05_codecs_base64_decode_trash();
 	t06_codecs_c_unicode();
 	t07_codecs_html();
+	t08_codecs_html_stream();
+	t09_codecs_base64_simd();
+	t10_codecs_url();
+	t11_codecs_query();
+	t12_codecs_hash();
 	
 	END();
 }
@@ -28,6 +28,7 @@
 #include <onion/handler.h>
 #include <onion/log.h>
 #include <onion/block.h>
+#include <onion/dict.h>
 
 #include "../ctest.h"
 #include "buffer_listen_point.h"
@@ -323,6 +324,15 @@ onion_connection_status post_json_check(json_response *post, onion_request *req,
 	FAIL_IF_NOT_EQUAL_INT(onion_block_size(data), sizeof(JSON_EXAMPLE));
 	FAIL_IF_NOT_EQUAL_INT(memcmp(onion_block_data(data), JSON_EXAMPLE, sizeof(JSON_EXAMPLE)), 0);
 	
+	const onion_dict *json=onion_request_get_json(req);
+	FAIL_IF_EQUAL(json, NULL);
+	FAIL_IF_NOT_EQUAL(onion_request_get_json(req), json); // Parsed once
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_rget(json, "glossary", "title", NULL), "example glossary");
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_rget(json, "glossary", "GlossDiv", "GlossList", "GlossEntry", "ID", NULL), "SGML");
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_rget(json, "glossary", "GlossDiv", "GlossList", "GlossEntry", "GlossDef", "GlossSeeAlso", "1", NULL), "XML");
+	const char *title=onion_dict_rget(json, "glossary", "title", NULL);
+	FAIL_IF_NOT(title>=onion_block_data(data) && title<onion_block_data(data)+onion_block_size(data)); // Borrowed from the body
+	
 	post->processed=2;
 	
 	return OCS_PROCESSED;
@@ -358,6 +368,160 @@ void t05_post_content_json(){
 }
 
 
+/// Files with pieces of the boundary inside, written split at every byte, and one byte at a time.
+void t06_post_boundary_split_file(){
+	INIT_LOCAL();
+	
+	const char content[]="a\r\n--bound\n--boundar\r\r\n--b\r\nx\n-\r\n--boundarY\r";
+	expected_post post={};
+	post.filename="file.dat";
+	post.size=sizeof(content)-1;
+	
+	onion *server=onion_new(0);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server,NULL,NULL,lp);
+	onion_set_root_handler(server, onion_handler_new((void*)&post_check,&post,NULL));
+	onion_request *req=onion_request_new(lp);
+	
+	char body[512], tmp[1024];
+	int body_length=snprintf(body, sizeof(body), "--boundary\r\nContent-Disposition: text/plain; name=\"file\"; filename=\"file.dat\"\r\n\r\n%s\r\n--boundary--", content);
+	int length=snprintf(tmp, sizeof(tmp), "POST / HTTP/1.1\r\nContent-Type: multipart/form-data; boundary=boundary\r\nContent-Length: %d\r\n\r\n%s", body_length, body);
+	
+	int split;
+	for (split=0;split<=length;split++){
+		post.test_ok=0;
+		if (split==length){ // One byte at a time
+			int i;
+			for (i=0;i<length;i++)
+				onion_request_write(req, tmp+i, 1);
+		}
+		else{
+			onion_request_write(req, tmp, split);
+			onion_request_write(req, tmp+split, length-split);
+		}
+		FAIL_IF_NOT_EQUAL_INT(post.test_ok,1);
+		
+		char readed[sizeof(content)+1];
+		int fd=open(post.tmplink, O_RDONLY);
+		FAIL_IF_EQUAL_INT(fd,-1);
+		int r=read(fd, readed, sizeof(readed));
+		close(fd);
+		unlink(post.tmplink);
+		FAIL_IF_NOT_EQUAL_INT(r, sizeof(content)-1);
+		FAIL_IF_NOT(memcmp(readed, content, sizeof(content)-1)==0);
+		onion_request_clean(req);
+	}
+	
+	onion_request_free(req);
+	onion_free(server);
+	free(post.tmpfilename);
+	free(post.tmplink);
+	
+	END_LOCAL();
+}
+
+
+typedef struct{
+	int checked;
+}fields_post;
+
+onion_connection_status post_fields_check(fields_post *post, onion_request *req, onion_response *res){
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_post(req, "a"), "one");
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_post(req, "text"), "line 1\nline 2\r\n--bound\r\nend");
+	FAIL_IF_NOT_EQUAL_STR(onion_request_get_post(req, "empty"), "");
+	post->checked++;
+	return OCS_PROCESSED;
+}
+
+/// Fields with new lines and pieces of the boundary, split at every byte; the content length is far bigger than the fields.
+void t07_post_fields_split(){
+	INIT_LOCAL();
+	
+	fields_post post={};
+	onion *server=onion_new(0);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server,NULL,NULL,lp);
+	onion_set_root_handler(server, onion_handler_new((void*)&post_fields_check,&post,NULL));
+	onion_request *req=onion_request_new(lp);
+	
+	const char request[]="POST / HTTP/1.1\r\nContent-Type: multipart/form-data; boundary=boundary\r\nContent-Length: 500000\r\n\r\n"
+		"--boundary\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\none\r\n"
+		"--boundary\r\nContent-Disposition: form-data; name=\"text\"\r\n\r\nline 1\nline 2\r\n--bound\r\nend\r\n"
+		"--boundary\r\nContent-Disposition: form-data; name=\"empty\"\r\n\r\n\r\n"
+		"--boundary--\r\n";
+	int length=sizeof(request)-1;
+	int split;
+	for (split=0;split<length;split++){
+		onion_request_write(req, request, split);
+		FAIL_IF(onion_request_write(req, request+split, length-split)<0); // Not the \r\n as a new request
+		FAIL_IF_NOT_EQUAL_INT(post.checked, split+1);
+		onion_request_clean(req);
+	}
+	
+	onion_request_free(req);
+	onion_free(server);
+	
+	END_LOCAL();
+}
+
+
+onion_connection_status post_expect_answer(void *_, onion_request *req, onion_response *res){
+	onion_response_write0(res, onion_request_get_post(req, "a"));
+	return OCS_PROCESSED;
+}
+
+void post_expect_hook(void *_, onion_request *req){
+	if (strcmp(onion_request_get_fullpath(req), "/private")==0)
+		onion_request_reject_body(req, HTTP_UNAUTHORIZED);
+}
+
+/// Expect: 100-continue is answered only when the body is going to be read, and the limits are checked before.
+void t08_post_expect_continue(){
+	INIT_LOCAL();
+	
+	onion *server=onion_new(0);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server,NULL,NULL,lp);
+	onion_set_root_handler(server, onion_handler_new((void*)&post_expect_answer,NULL,NULL));
+	onion_set_request_body_hook(server, post_expect_hook, NULL);
+	onion_set_max_post_size(server, 100);
+	onion_request *req=onion_request_new(lp);
+	onion_block *out=onion_buffer_listen_point_get_buffer(req);
+	
+#define HEADERS(path, length) "POST /" path " HTTP/1.1\r\nContent-Type: application/x-www-form-urlencoded\r\nExpect: 100-continue\r\nContent-Length: " length "\r\n\r\n"
+	onion_request_write(req, HEADERS("", "5"), sizeof(HEADERS("", "5"))-1);
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(out), "HTTP/1.1 100 Continue\r\n\r\n");
+	onion_block_clear(out);
+	onion_request_write(req, "a=yes", 5);
+	FAIL_IF_NOT_EQUAL_INT(strncmp(onion_block_data(out), "HTTP/1.1 200 OK\r\n", 17), 0);
+	FAIL_IF_EQUAL(strstr(onion_block_data(out), "\r\n\r\nyes"), NULL);
+	onion_request_clean(req);
+	onion_block_clear(out);
+	
+	// The body with the headers: no need to tell to send it
+	onion_request_write(req, HEADERS("", "5") "a=yes", sizeof(HEADERS("", "5") "a=yes")-1);
+	FAIL_IF_NOT_EQUAL_INT(strncmp(onion_block_data(out), "HTTP/1.1 200 OK\r\n", 17), 0);
+	onion_request_clean(req);
+	onion_block_clear(out);
+	
+	FAIL_IF_NOT_EQUAL_INT(onion_request_write(req, HEADERS("", "1000"), sizeof(HEADERS("", "1000"))-1), OCS_INTERNAL_ERROR);
+	FAIL_IF_NOT_EQUAL_INT(strncmp(onion_block_data(out), "HTTP/1.1 413 PAYLOAD TOO LARGE\r\n", 32), 0);
+	FAIL_IF_NOT_EQUAL(strstr(onion_block_data(out), "100 Continue"), NULL);
+	onion_request_clean(req);
+	onion_block_clear(out);
+	
+	FAIL_IF_NOT_EQUAL_INT(onion_request_write(req, HEADERS("private", "5"), sizeof(HEADERS("private", "5"))-1), OCS_INTERNAL_ERROR);
+	FAIL_IF_NOT_EQUAL_INT(strncmp(onion_block_data(out), "HTTP/1.1 401 UNAUTHORIZED\r\n", 27), 0);
+	FAIL_IF_NOT_EQUAL(strstr(onion_block_data(out), "100 Continue"), NULL);
+#undef HEADERS
+	
+	onion_request_free(req);
+	onion_free(server);
+	
+	END_LOCAL();
+}
+
+
 int main(int argc, char **argv){
 	START();
 	
@@ -366,6 +530,9 @@ int main(int argc, char **argv){
 	t03_post_carriage_return_new_lines_file();
 	t04_post_largefile();
 	t05_post_content_json();
+	t06_post_boundary_split_file();
+	t07_post_fields_split();
+	t08_post_expect_continue();
 	
 	END();
 }
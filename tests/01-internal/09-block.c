@@ -74,12 +74,65 @@ void t02_several_add_methods(){
 	END_TEST();
 }
 
+void t03_rope(){
+	INIT_TEST();
+	
+	onion_rope *rope=onion_rope_new();
+	int count;
+	onion_rope_iovec(rope, &count);
+	FAIL_IF_NOT_EQUAL_INT(count, 0);
+	
+	int i;
+	for (i=0;i<ONION_ROPE_SEGMENT_SIZE+10;i++)
+		onion_rope_add_char(rope, 'a'+i%26);
+	const struct iovec *iov=onion_rope_iovec(rope, &count);
+	FAIL_IF_NOT_EQUAL_INT(count, 2);
+	FAIL_IF_NOT_EQUAL_INT(iov[0].iov_len, ONION_ROPE_SEGMENT_SIZE);
+	FAIL_IF_NOT_EQUAL_INT(iov[1].iov_len, 10);
+	const char *first=iov[0].iov_base;
+	
+	char big[3*ONION_ROPE_SEGMENT_SIZE];
+	memset(big, 'x', sizeof(big));
+	onion_rope_add_data(rope, big, sizeof(big));
+	onion_rope_add_str(rope, "end");
+	FAIL_IF_NOT_EQUAL_INT(onion_rope_size(rope), 4*ONION_ROPE_SEGMENT_SIZE+13);
+	iov=onion_rope_iovec(rope, &count);
+	FAIL_IF_NOT_EQUAL_INT(count, 5);
+	FAIL_IF_NOT_EQUAL(iov[0].iov_base, first); // Not moved
+	
+	onion_block *block=onion_block_new();
+	onion_block_add_str(block, "block");
+	onion_rope_add_block(rope, block);
+	onion_block_free(block);
+	
+	char *flat=malloc(onion_rope_size(rope)+1);
+	flat[onion_rope_copy(rope, flat, onion_rope_size(rope))]=0;
+	FAIL_IF_NOT_EQUAL_INT(strlen(flat), 4*ONION_ROPE_SEGMENT_SIZE+18);
+	FAIL_IF_NOT_EQUAL_INT(strncmp(flat, "abcdef", 6), 0);
+	FAIL_IF_NOT_EQUAL_STR(flat+4*ONION_ROPE_SEGMENT_SIZE+9, "xendblock");
+	FAIL_IF_NOT_EQUAL_INT(onion_rope_copy(rope, flat, 5), 5);
+	free(flat);
+	
+	// Reuses the segments
+	onion_rope_clear(rope);
+	FAIL_IF_NOT_EQUAL_INT(onion_rope_size(rope), 0);
+	onion_rope_add_str(rope, "again");
+	iov=onion_rope_iovec(rope, &count);
+	FAIL_IF_NOT_EQUAL_INT(count, 1);
+	FAIL_IF_NOT_EQUAL(iov[0].iov_base, first);
+	FAIL_IF_NOT_EQUAL_INT(iov[0].iov_len, 5);
+	
+	onion_rope_free(rope);
+	
+	END_TEST();
+}
 
 int main(int argc, char **argv){
 	START();
 	
 	t01_create_and_free();
 	t02_several_add_methods();
+	t03_rope();
 	
 	END();
 }
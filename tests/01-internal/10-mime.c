@@ -16,7 +16,11 @@
 	along with this program.  If not, see <http://www.gnu.org/licenses/>.
 	*/
 
+#include <stdio.h>
+#include <unistd.h>
+
 #include <onion/mime.h>
+#include <onion/dict.h>
 #include "../ctest.h"
 
 void t01_test_mime(){
@@ -33,11 +37,58 @@ void t01_test_mime(){
 	END_LOCAL();
 }
 
+/// The built in types in any case, a file loaded on top, and updates on top of both.
+void t02_test_mime_layers(){
+	INIT_LOCAL();
+	
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("INDEX.HTML"), "text/html");
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("photo.JpEg"), "image/jpeg");
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("app.webmanifest"), "application/manifest+json");
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("archive.tar.gz"), "application/gzip");
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("noextension"), "text/plain");
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("file.htmlx"), "text/plain");
+	
+	char filename[]="/tmp/onion-mime-XXXXXX";
+	int fd=mkstemp(filename);
+	FAIL_IF(fd<0);
+	FILE *f=fdopen(fd, "w");
+	fprintf(f, "# Comment\napplication/x-onion\tonion oni\ntext/x-html-old html\n\nimage/x-long longextensionnotkept\n");
+	fclose(f);
+	FAIL_IF_NOT_EQUAL_INT(onion_mime_load(filename), 3);
+	unlink(filename);
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("a.ONION"), "application/x-onion");
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("a.oni"), "application/x-onion");
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("a.html"), "text/x-html-old");
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("a.png"), "image/png");
+	FAIL_IF_NOT_EQUAL_INT(onion_mime_load("/non/existant/mime.types"), -1);
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("a.onion"), "application/x-onion");
+	
+	onion_mime_update("png", "image/x-png");
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("a.PNG"), "image/x-png");
+	onion_mime_update("png", NULL);
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("a.png"), "text/plain");
+	onion_mime_update("onion", NULL);
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("a.onion"), "text/plain");
+	
+	// A dict of its own: only that one
+	onion_dict *d=onion_dict_new();
+	onion_dict_add(d, "png", "image/png", 0);
+	onion_mime_set(d);
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("a.png"), "image/png");
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("a.html"), "text/plain");
+	
+	onion_mime_set(NULL);
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("a.html"), "text/html");
+	FAIL_IF_NOT_EQUAL_STR(onion_mime_get("a.onion"), "text/plain");
+	END_LOCAL();
+}
+
 
 int main(int argc, char **argv){
 	START();
 	
 	t01_test_mime();
+	t02_test_mime_layers();
 	
 	END();
 }
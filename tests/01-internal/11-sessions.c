@@ -20,9 +20,14 @@
 #include <onion/log.h>
 #include <onion/sessions.h>
 #include <onion/dict.h>
+#include <onion/block.h>
+#include <onion/codecs.h>
 #include "../ctest.h"
 #include "buffer_listen_point.h"
 #include <onion/types_internal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 void t01_test_session(){
 	INIT_LOCAL();
@@ -211,7 +216,7 @@ void t03_bug_empty_session_is_new_session(){
   strcpy(sessionid, lastsessionid);
   req->fullpath=NULL;
   onion_request_free(req);
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->sessions), 1);
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(onion_get_sessions(o)), 1);
   
   req=onion_request_new(lp);
   req->fullpath="/";
@@ -222,7 +227,7 @@ void t03_bug_empty_session_is_new_session(){
   FAIL_IF_NOT(has_set_cookie);
   req->fullpath=NULL;
   onion_request_free(req);
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->sessions), 2);
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(onion_get_sessions(o)), 2);
   
   req=onion_request_new(lp);
   req->fullpath="/";
@@ -235,7 +240,7 @@ void t03_bug_empty_session_is_new_session(){
   strcpy(sessionid, lastsessionid);
   req->fullpath=NULL;
   onion_request_free(req);
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->sessions), 2);
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(onion_get_sessions(o)), 2);
   
   req=onion_request_new(lp);
   req->fullpath="/";
@@ -247,7 +252,7 @@ void t03_bug_empty_session_is_new_session(){
   FAIL_IF_NOT(has_set_cookie);
   req->fullpath=NULL;
   onion_request_free(req);
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->sessions), 3);
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(onion_get_sessions(o)), 3);
 
   // Ask for new, without session data, but I will not set data on session, so session is not created.
   set_data_on_session=0;
@@ -257,9 +262,9 @@ void t03_bug_empty_session_is_new_session(){
   FAIL_IF_EQUAL_STR(lastsessionid,"");
   strcpy(sessionid, lastsessionid);
   req->fullpath=NULL;
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->sessions), 4); // For a moment it exists, until onion realizes is not necesary.
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(onion_get_sessions(o)), 4); // For a moment it exists, until onion realizes is not necesary.
   onion_request_free(req);
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->sessions), 3);
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(onion_get_sessions(o)), 3);
 
   
   onion_free(o);
@@ -289,7 +294,7 @@ void t04_lot_of_sessionid(){
   req=onion_request_new(lp);
   req->fullpath="/";
   onion_request_process(req);
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->sessions), 1);
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(onion_get_sessions(o)), 1);
   FAIL_IF_EQUAL_STR(lastsessionid,"");
   strcpy(sessionid, lastsessionid);
   req->fullpath=NULL;
@@ -311,7 +316,7 @@ void t04_lot_of_sessionid(){
   //onion_dict_add(req->headers, "Cookie", tmp2, 0);
   
   onion_request_process(req);
-  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(o->sessions->sessions), 1);
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(onion_get_sessions(o)), 1);
   FAIL_IF_EQUAL_STR(lastsessionid,"");
   FAIL_IF_NOT_EQUAL_STR(lastsessionid, sessionid);
   FAIL_IF_NOT(has_set_cookie);
@@ -322,6 +327,440 @@ void t04_lot_of_sessionid(){
   END_LOCAL();
 }
 
+/// Idle and absolute time to live.
+void t05_ttl(){
+  INIT_LOCAL();
+
+  onion_sessions *sessions=onion_sessions_new();
+  onion_sessions_set_ttl(sessions, 100, 0);
+  char *s01=onion_sessions_create(sessions);
+  char *s02=onion_sessions_create(sessions);
+  onion_dict *ses=onion_sessions_get(sessions, s01);
+  onion_dict_add(ses, "foo", "bar", 0);
+  int i;
+  for (i=0;i<4;i++){ // s01 is used, s02 not
+    usleep(40000);
+    onion_dict_free(onion_sessions_get(sessions, s01));
+  }
+  FAIL_IF_NOT_EQUAL(onion_sessions_get(sessions, s02), NULL);
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(sessions), 1);
+  usleep(120000);
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_expire(sessions, 16), 1);
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(sessions), 0);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(ses, "foo"), "bar"); // Still referenced
+  onion_dict_free(ses);
+  free(s01);
+  free(s02);
+
+  // Absolute, even if used.
+  onion_sessions_set_ttl(sessions, 0, 100);
+  s01=onion_sessions_create(sessions);
+  for (i=0;i<2;i++){
+    usleep(40000);
+    ses=onion_sessions_get(sessions, s01);
+    FAIL_IF_EQUAL(ses, NULL);
+    onion_dict_free(ses);
+  }
+  usleep(40000);
+  FAIL_IF_NOT_EQUAL(onion_sessions_get(sessions, s01), NULL);
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(sessions), 0);
+  free(s01);
+
+  onion_sessions_free(sessions);
+
+  END_LOCAL();
+}
+
+/// Over the maximum, the least recently used are evicted.
+void t06_max_sessions(){
+  INIT_LOCAL();
+
+  onion_sessions *sessions=onion_sessions_new();
+  onion_sessions_set_max(sessions, 64);
+  char *first=onion_sessions_create(sessions);
+  char *last=NULL;
+  int i;
+  for (i=0;i<1000;i++){
+    free(last);
+    last=onion_sessions_create(sessions);
+    onion_dict_free(onion_sessions_get(sessions, first)); // Kept as used
+  }
+  FAIL_IF(onion_sessions_count(sessions)>64);
+  FAIL_IF(onion_sessions_count(sessions)<ONION_SESSIONS_SHARDS);
+  onion_dict *ses=onion_sessions_get(sessions, first);
+  FAIL_IF_EQUAL(ses, NULL);
+  onion_dict_free(ses);
+  ses=onion_sessions_get(sessions, last);
+  FAIL_IF_EQUAL(ses, NULL);
+  onion_dict_free(ses);
+  free(first);
+  free(last);
+  onion_sessions_free(sessions);
+
+  END_LOCAL();
+}
+
+onion *timer_server;
+
+void *listen_thread(void *_){
+  onion_listen(timer_server);
+  return NULL;
+}
+
+/// While listening, the poller timer removes the expired sessions.
+void t07_timer_expiry(){
+  INIT_LOCAL();
+
+  timer_server=onion_new(O_POLL);
+  onion_set_port(timer_server, "8094");
+  onion_set_session_ttl(timer_server, 50, 0);
+  int i;
+  for (i=0;i<100;i++)
+    free(onion_sessions_create(onion_get_sessions(timer_server)));
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(onion_get_sessions(timer_server)), 100);
+
+  pthread_t th;
+  pthread_create(&th, NULL, listen_thread, NULL);
+  usleep(300000);
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(onion_get_sessions(timer_server)), 0);
+  onion_listen_stop(timer_server);
+  pthread_join(th, NULL);
+  onion_free(timer_server);
+
+  END_LOCAL();
+}
+
+/// Sessions at shared memory: seen by forked processes, kept at the file, evicted when the bucket is full.
+void t08_shm_backend(){
+  INIT_LOCAL();
+
+  onion_sessions *sessions=onion_sessions_new();
+  onion_sessions_set_backend(sessions, onion_sessions_backend_shm(NULL, 64, 512, 0));
+  char *s01=onion_sessions_create(sessions);
+  onion_dict *ses=onion_sessions_get(sessions, s01);
+  FAIL_IF_EQUAL(ses, NULL);
+  FAIL_IF_NOT_EQUAL_INT(onion_dict_count(ses), 0);
+  onion_dict_add(ses, "foo", "bar", 0);
+  onion_sessions_save(sessions, s01, ses);
+  onion_dict_free(ses);
+
+  pid_t pid=fork();
+  if (pid==0){ // Other worker, changes it
+    ses=onion_sessions_get(sessions, s01);
+    if (!ses || !onion_dict_get(ses, "foo"))
+      _exit(1);
+    onion_dict_add(ses, "child", "yes", 0);
+    onion_sessions_save(sessions, s01, ses);
+    _exit(0);
+  }
+  int status=-1;
+  waitpid(pid, &status, 0);
+  FAIL_IF_NOT_EQUAL_INT(status, 0);
+  ses=onion_sessions_get(sessions, s01);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(ses, "foo"), "bar");
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(ses, "child"), "yes");
+  onion_dict_free(ses);
+
+  onion_sessions_remove(sessions, s01);
+  FAIL_IF_NOT_EQUAL(onion_sessions_get(sessions, s01), NULL);
+  free(s01);
+
+  // Too big for the slot
+  ses=onion_dict_new();
+  char big[1024];
+  memset(big, 'x', sizeof(big)-1);
+  big[sizeof(big)-1]=0;
+  onion_dict_add(ses, "big", big, 0);
+  onion_sessions_save(sessions, "big", ses);
+  FAIL_IF_NOT_EQUAL(onion_sessions_get(sessions, "big"), NULL);
+  onion_dict_free(ses);
+  onion_sessions_free(sessions);
+
+  // At a file, it is kept for the next ones. One bucket of 8, so the 9th evicts the least recently used.
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/onion-sessions-test-%d", getpid());
+  sessions=onion_sessions_new();
+  onion_sessions_set_backend(sessions, onion_sessions_backend_shm(path, 8, 256, 0));
+  char *ids[9];
+  int i;
+  for (i=0;i<9;i++){
+    ids[i]=onion_sessions_create(sessions);
+    if (i==0)
+      usleep(2000);
+    if (i>0) // The first is the oldest
+      onion_sessions_touch(sessions, ids[i]);
+  }
+  onion_sessions_free(sessions);
+
+  sessions=onion_sessions_new();
+  onion_sessions_set_backend(sessions, onion_sessions_backend_shm(path, 1000, 1000, 0)); // Existing sizes are used
+  FAIL_IF_NOT_EQUAL(onion_sessions_get(sessions, ids[0]), NULL);
+  for (i=1;i<9;i++){
+    ses=onion_sessions_get(sessions, ids[i]);
+    FAIL_IF_EQUAL(ses, NULL);
+    onion_dict_free(ses);
+  }
+  for (i=0;i<9;i++)
+    free(ids[i]);
+  onion_sessions_free(sessions);
+  unlink(path);
+
+  // Idle time to live
+  sessions=onion_sessions_new();
+  onion_sessions_set_backend(sessions, onion_sessions_backend_shm(NULL, 64, 256, 50));
+  s01=onion_sessions_create(sessions);
+  ses=onion_sessions_get(sessions, s01);
+  FAIL_IF_EQUAL(ses, NULL);
+  onion_dict_free(ses);
+  usleep(80000);
+  FAIL_IF_NOT_EQUAL(onion_sessions_get(sessions, s01), NULL);
+  free(s01);
+  onion_sessions_free(sessions);
+
+  END_LOCAL();
+}
+
+/// Requests save the session at the backend when they end.
+void t09_backend_requests(){
+  INIT_LOCAL();
+
+  onion *o=onion_new(O_ONE_LOOP);
+  onion_set_session_backend(o, onion_sessions_backend_shm(NULL, 64, 512, 0));
+  onion_listen_point *lp=onion_buffer_listen_point_new();
+  lp->write=empty_write;
+  onion_add_listen_point(o,NULL,NULL,lp);
+  onion_url_add(onion_root_url(o), "^.*", ask_session);
+
+  set_data_on_session=1;
+  onion_request *req=onion_request_new(lp);
+  req->fullpath="/";
+  onion_request_process(req);
+  FAIL_IF_NOT(has_set_cookie);
+  req->fullpath=NULL;
+  onion_request_free(req);
+
+  onion_dict *ses=onion_sessions_get(onion_get_sessions(o), lastsessionid);
+  FAIL_IF_EQUAL(ses, NULL);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(ses, "Test"), "New data to create the session");
+  onion_dict_free(ses);
+
+  char tmp[256];
+  set_data_on_session=0;
+  req=onion_request_new(lp);
+  req->fullpath="/";
+  snprintf(tmp,sizeof(tmp),"sessionid=%s",lastsessionid);
+  onion_dict_add(req->headers, "Cookie", tmp, OD_DUP_VALUE);
+  onion_dict *session=onion_request_get_session_dict(req);
+  FAIL_IF_NOT_EQUAL_STR(req->session_id, lastsessionid);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(session, "Test"), "New data to create the session");
+  req->fullpath=NULL;
+  onion_request_free(req);
+
+  onion_free(o);
+
+  END_LOCAL();
+}
+
+/// Adds the cookie of that session to a new request.
+static onion_request *session_request(onion_listen_point *lp, const char *sessionid){
+  char tmp[256];
+  onion_request *req=onion_request_new(lp);
+  snprintf(tmp,sizeof(tmp),"sessionid=%s",sessionid);
+  onion_dict_add(req->headers, "Cookie", tmp, OD_DUP_VALUE);
+  return req;
+}
+
+/// Requests read the stored session as is, and only write a changed copy back, at their end.
+void t10_copy_on_write(){
+  INIT_LOCAL();
+
+  onion *o=onion_new(O_ONE_LOOP);
+  onion_listen_point *lp=onion_buffer_listen_point_new();
+  onion_add_listen_point(o,NULL,NULL,lp);
+
+  // Reading without a session does not create one
+  onion_request *req=onion_request_new(lp);
+  FAIL_IF_NOT_EQUAL(onion_request_get_session(req, "a"), NULL);
+  FAIL_IF_NOT_EQUAL(onion_request_get_session_snapshot(req), NULL);
+  onion_request_free(req);
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(onion_get_sessions(o)), 0);
+
+  req=onion_request_new(lp);
+  onion_dict_add(onion_request_get_session_dict(req), "a", "1", 0);
+  char *sessionid=strdup(req->session_id);
+  onion_request_free(req);
+  onion_dict *stored=onion_sessions_get(onion_get_sessions(o), sessionid);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(stored, "a"), "1");
+  unsigned int generation=onion_dict_generation(stored);
+
+  // Read only: the stored dict itself, not saved
+  req=session_request(lp, sessionid);
+  FAIL_IF_NOT_EQUAL_STR(onion_request_get_session(req, "a"), "1");
+  FAIL_IF_NOT_EQUAL(onion_request_get_session_snapshot(req), stored);
+  onion_request_free(req);
+  onion_dict *ses=onion_sessions_get(onion_get_sessions(o), sessionid);
+  FAIL_IF_NOT_EQUAL(ses, stored);
+  FAIL_IF_NOT_EQUAL_INT(onion_dict_generation(ses), generation);
+  onion_dict_free(ses);
+
+  // Asked to write, but not changed: not saved either
+  req=session_request(lp, sessionid);
+  FAIL_IF_EQUAL(onion_request_get_session_dict(req), stored);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(onion_request_get_session_dict(req), "a"), "1");
+  onion_request_free(req);
+  ses=onion_sessions_get(onion_get_sessions(o), sessionid);
+  FAIL_IF_NOT_EQUAL(ses, stored);
+  onion_dict_free(ses);
+
+  // Changed: the copy replaces it at the end, and who had the old one keeps it as it was
+  req=session_request(lp, sessionid);
+  onion_dict *session=onion_request_get_session_dict(req);
+  onion_dict_add(session, "a", "2", OD_REPLACE);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(stored, "a"), "1");
+  onion_request_free(req);
+  ses=onion_sessions_get(onion_get_sessions(o), sessionid);
+  FAIL_IF_EQUAL(ses, stored);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(ses, "a"), "2");
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_get(stored, "a"), "1");
+  onion_dict_free(stored);
+
+  // Changes inside a dict of the session are marked explicitly
+  onion_dict *sub=onion_dict_new();
+  onion_dict_add(ses, "sub", sub, OD_DICT|OD_FREE_VALUE);
+  onion_dict_free(ses);
+  req=session_request(lp, sessionid);
+  onion_dict_add(onion_dict_get_dict(onion_request_get_session_dict(req), "sub"), "b", "3", 0);
+  onion_request_session_changed(req);
+  onion_request_free(req);
+  ses=onion_sessions_get(onion_get_sessions(o), sessionid);
+  FAIL_IF_NOT_EQUAL_STR(onion_dict_rget(ses, "sub", "b", NULL), "3");
+  onion_dict_free(ses);
+
+  free(sessionid);
+  onion_free(o);
+
+  END_LOCAL();
+}
+
+static int cookie_set_user=0;
+
+/// Answers the user at the session, setting it first if so asked.
+static onion_connection_status cookie_session(void *_, onion_request *req, onion_response *res){
+  if (cookie_set_user)
+    onion_dict_add(onion_request_get_session_dict(req), "user", "coralbits", 0);
+  const char *user=onion_request_get_session(req, "user");
+  onion_response_write0(res, user ? user : "nobody");
+  return OCS_PROCESSED;
+}
+
+/// Processes a request with that session cookie, if any, and returns the response.
+static const char *cookie_request(onion_listen_point *lp, const char *cookie){
+  static char response[8192];
+  onion_request *req=cookie ? session_request(lp, cookie) : onion_request_new(lp);
+  req->fullpath="/";
+  onion_request_process(req);
+  snprintf(response, sizeof(response), "%s", onion_block_data(onion_buffer_listen_point_get_buffer(req)));
+  req->fullpath=NULL;
+  onion_request_free(req);
+  return response;
+}
+
+/// Returns the new value of the sessionid cookie at the response, or NULL.
+static char *set_cookie_value(const char *response){
+  const char *p=strstr(response, "Set-Cookie: sessionid=");
+  if (!p)
+    return NULL;
+  p+=strlen("Set-Cookie: sessionid=");
+  return strndup(p, strchr(p, ';')-p);
+}
+
+/// Sessions at signed cookies: nothing is stored, and changes only are sent back.
+void t11_cookie_sessions(){
+  INIT_LOCAL();
+
+  onion *o=onion_new(O_ONE_LOOP);
+  FAIL_IF_NOT_EQUAL_INT(onion_set_session_cookie_key(o, "0123456789abcdef0123456789abcdef", 32, 0), 0);
+  onion_listen_point *lp=onion_buffer_listen_point_new();
+  onion_add_listen_point(o,NULL,NULL,lp);
+  onion_url_add(onion_root_url(o), "^.*", cookie_session);
+
+  cookie_set_user=1;
+  const char *response=cookie_request(lp, NULL);
+  char *cookie=set_cookie_value(response);
+  FAIL_IF_EQUAL(cookie, NULL);
+  FAIL_IF_NOT(strstr(response, "coralbits"));
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(onion_get_sessions(o)), 0);
+
+  // Read back, and not sent again as it did not change
+  cookie_set_user=0;
+  response=cookie_request(lp, cookie);
+  FAIL_IF_NOT(strstr(response, "coralbits"));
+  FAIL_IF(strstr(response, "Set-Cookie"));
+
+  // Changed by the client: not valid
+  char *forged=strdup(cookie);
+  forged[2]=forged[2]=='A' ? 'B' : 'A';
+  response=cookie_request(lp, forged);
+  FAIL_IF_NOT(strstr(response, "nobody"));
+  free(forged);
+
+#ifdef HAVE_GNUTLS
+  // Encrypted: not readable, nor valid with another key
+  onion_sessions_set_cookie_key(onion_get_sessions(o), "0123456789abcdef0123456789abcdef", 32, 1);
+  FAIL_IF_NOT_EQUAL(onion_sessions_cookie_decode(onion_get_sessions(o), cookie), NULL);
+  free(cookie);
+  cookie_set_user=1;
+  cookie=set_cookie_value(cookie_request(lp, NULL));
+  FAIL_IF_EQUAL(cookie, NULL);
+  char *clear=onion_base64_decode(cookie, NULL);
+  FAIL_IF(strstr(clear, "coralbits"));
+  free(clear);
+  cookie_set_user=0;
+  FAIL_IF_NOT(strstr(cookie_request(lp, cookie), "coralbits"));
+  onion_sessions_set_cookie_key(onion_get_sessions(o), "another key, as long as the other", 32, 1);
+  FAIL_IF_NOT(strstr(cookie_request(lp, cookie), "nobody"));
+#else
+  FAIL_IF_NOT_EQUAL_INT(onion_sessions_set_cookie_key(onion_get_sessions(o), "0123456789abcdef0123456789abcdef", 32, 1), -1);
+#endif
+  free(cookie);
+
+  onion_free(o);
+
+  END_LOCAL();
+}
+
+/// Values with UTF-8, line ends and quotes come back as they were, also inside a dict of the session.
+void t12_cookie_sessions_round_trip(){
+  INIT_LOCAL();
+
+  onion_sessions *sessions=onion_sessions_new();
+  onion_sessions_set_cookie_key(sessions, "0123456789abcdef0123456789abcdef", 32, 0);
+  onion_dict *session=onion_dict_new();
+  onion_dict_add(session, "name", "Jos\xc3\xa9", 0);
+  onion_dict_add(session, "note", "a\r\nb\nc", 0);
+  onion_dict_add(session, "quote", "say \"hi\" \\ bye", 0);
+  onion_dict *sub=onion_dict_new();
+  onion_dict_add(sub, "city", "M\xc3\xa1laga\n", 0);
+  onion_dict_add(session, "sub", sub, OD_DICT|OD_FREE_VALUE);
+
+  char *cookie=onion_sessions_cookie_encode(sessions, session);
+  FAIL_IF_EQUAL(cookie, NULL);
+  onion_dict *back=onion_sessions_cookie_decode(sessions, cookie);
+  FAIL_IF_EQUAL(back, NULL);
+  if (back){
+    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(back, "name"), "Jos\xc3\xa9");
+    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(back, "note"), "a\r\nb\nc");
+    FAIL_IF_NOT_EQUAL_STR(onion_dict_get(back, "quote"), "say \"hi\" \\ bye");
+    FAIL_IF_NOT_EQUAL_STR(onion_dict_rget(back, "sub", "city", NULL), "M\xc3\xa1laga\n");
+    onion_dict_free(back);
+  }
+  free(cookie);
+  onion_dict_free(session);
+  onion_sessions_free(sessions);
+
+  END_LOCAL();
+}
+
 int main(int argc, char **argv){
   START();
   
@@ -329,6 +768,14 @@ int main(int argc, char **argv){
   t02_cookies();
   t03_bug_empty_session_is_new_session();
   t04_lot_of_sessionid();
+  t05_ttl();
+  t06_max_sessions();
+  t07_timer_expiry();
+  t08_shm_backend();
+  t09_backend_requests();
+  t10_copy_on_write();
+  t11_cookie_sessions();
+  t12_cookie_sessions_round_trip();
 	
 	END();
 }
@@ -23,9 +23,12 @@
 #include <onion/dict.h>
 #include <onion/types_internal.h>
 #include <onion/block.h>
+#include <onion/fragment_cache.h>
 
 onion_connection_status _13_otemplate_html_handler_page(onion_dict *context, onion_request *req, onion_response *res);
 onion_connection_status AGPL_txt_handler_page(onion_dict *context, onion_request *req, onion_response *res);
+void _13_otemplate_html_render(onion_dict *context, onion_response_sink write, void *data);
+void AGPL_txt_render(onion_dict *context, onion_response_sink write, void *data);
 
 struct tests_call_otemplate{
   char ok_title;
@@ -160,11 +163,113 @@ void t02_long_template(){
 }
 
 
+/// The loop variable is looked up at each element, the rest once, before the loop.
+void t03_loop_variables(){
+	INIT_LOCAL();
+	
+	onion *s=onion_new(0);
+	onion_dict *d=onion_dict_new();
+	onion_dict *items=onion_dict_new();
+	onion_dict *item=onion_dict_new();
+	onion_dict_add(item, "name", "Apple", 0);
+	onion_dict_add(item, "price", "1", 0);
+	onion_dict_add(items, "0", item, OD_DICT|OD_FREE_VALUE);
+	item=onion_dict_new();
+	onion_dict_add(item, "name", "Pear", 0);
+	onion_dict_add(item, "price", "2", 0);
+	onion_dict_add(items, "1", item, OD_DICT|OD_FREE_VALUE);
+	onion_dict_add(d, "items", items, OD_DICT|OD_FREE_VALUE);
+	onion_dict *shop=onion_dict_new();
+	onion_dict_add(shop, "currency", "EUR", 0);
+	onion_dict_add(d, "shop", shop, OD_DICT|OD_FREE_VALUE);
+	
+	onion_set_root_handler(s, onion_handler_new((void*)_13_otemplate_html_handler_page, d, (void*)onion_dict_free));
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(s,NULL,NULL,lp);
+	
+	onion_request *req=onion_request_new(lp);
+	FAIL_IF_NOT_EQUAL_INT(onion_request_write0(req, "GET /\n\n"), OCS_CLOSE_CONNECTION);
+	const char *data=onion_buffer_listen_point_get_buffer_data(req);
+	FAIL_IF_EQUAL(strstr(data, "<li>Apple 1 EUR</li>"), NULL);
+	FAIL_IF_EQUAL(strstr(data, "<li>Pear 2 EUR</li>"), NULL);
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(d), 2); // The loop did not change the context
+	
+	onion_request_free(req);
+	onion_free(s);
+	
+	END_LOCAL();
+}
+
+/// Renders the template with that menu, and returns if the output has that nav.
+int render_menu(const char *menu, const char *nav){
+	onion *s=onion_new(0);
+	onion_dict *d=onion_dict_new();
+	onion_dict_add(d, "menu", menu, 0);
+	onion_set_root_handler(s, onion_handler_new((void*)_13_otemplate_html_handler_page, d, (void*)onion_dict_free));
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(s,NULL,NULL,lp);
+	
+	onion_request *req=onion_request_new(lp);
+	onion_request_write0(req, "GET /\n\n");
+	int ret=strstr(onion_buffer_listen_point_get_buffer_data(req), nav)!=NULL;
+	
+	onion_request_free(req);
+	onion_free(s);
+	return ret;
+}
+
+/// The cached fragment is the same until it expires or the cache is cleared.
+void t04_cache_fragment(){
+	INIT_LOCAL();
+	
+	onion_fragment_cache_clear();
+	FAIL_IF_NOT(render_menu("A", "<nav>A</nav>"));
+	FAIL_IF_NOT(render_menu("B", "<nav>A</nav>"));
+	onion_fragment_cache_clear();
+	FAIL_IF_NOT(render_menu("B", "<nav>B</nav>"));
+	onion_fragment_cache_set_max_size(0); // Does not fit, so not kept
+	FAIL_IF_NOT(render_menu("C", "<nav>C</nav>"));
+	FAIL_IF_NOT(render_menu("D", "<nav>D</nav>"));
+	onion_fragment_cache_set_max_size(16*1024*1024);
+	
+	END_LOCAL();
+}
+
+/// Rendered with no request, to a block, the body only.
+void t05_render_sink(){
+	INIT_LOCAL();
+	
+	onion_dict *d=onion_dict_new();
+	onion_dict_add(d, "title", "TITLE", 0);
+	onion_dict *list=onion_dict_new();
+	onion_dict_add(list, "0", "LIST 1", 0);
+	onion_dict_add(d, "list", list, OD_DICT|OD_FREE_VALUE);
+	
+	onion_block *block=onion_block_new();
+	_13_otemplate_html_render(d, onion_response_sink_block, block);
+	const char *data=onion_block_data(block);
+	FAIL_IF_NOT_EQUAL_INT(strncmp(data, "\n<html>", 7), 0); // No headers
+	FAIL_IF_EQUAL(strstr(data, "<li>LIST 1</li>"), NULL);
+	FAIL_IF_EQUAL(strstr(data, "TITLE TITLE"), NULL);
+	onion_dict_free(d);
+	
+	onion_block_clear(block); // Bigger than the response buffer
+	AGPL_txt_render(NULL, onion_response_sink_block, block);
+	FAIL_IF(onion_block_size(block)<30000);
+	FAIL_IF_NOT_EQUAL_INT(strlen(onion_block_data(block)), onion_block_size(block));
+	onion_block_free(block);
+	
+	END_LOCAL();
+}
+
 int main(int argc, char **argv){
   START();
   
   t01_call_otemplate();
   t02_long_template();
+  t03_loop_variables();
+  t04_cache_fragment();
+  t05_render_sink();
 	
   END();
 }
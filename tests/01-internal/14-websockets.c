@@ -16,17 +16,30 @@
 	along with this program.  If not, see <http://www.gnu.org/licenses/>.
 	*/
 
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+
 #include <onion/onion.h>
 #include <onion/http.h>
 #include <onion/websocket.h>
+#include <onion/block.h>
 #include "../ctest.h"
 #include "buffer_listen_point.h"
+#include "../../src/onion/types_internal.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 struct ws_status_t{
 	int connected;
 	int is_connected;
 };
 struct ws_status_t ws_status;
+onion_websocket *last_ws;
 
 onion_connection_status ws_callback(void *privadata, onion_websocket *ws, size_t nbytes_ready){
 	return OCS_NEED_MORE_DATA;
@@ -36,6 +49,7 @@ onion_connection_status ws_handler(void *priv, onion_request *req, onion_respons
 	onion_websocket *ws=onion_websocket_new(req, res);
 	ws_status.connected++;
 	ws_status.is_connected=(ws!=NULL);
+	last_ws=ws;
 	
 	if (ws_status.is_connected){
 		onion_websocket_set_callback(ws, ws_callback);
@@ -92,11 +106,538 @@ void t02_websocket_server_w_ws(){
 }
 
 
+/// What the client sends, read by the websocket
+const char *client_data;
+size_t client_left;
+
+ssize_t client_read(onion_request *req, char *data, size_t len){
+	if (len>client_left)
+		len=client_left;
+	memcpy(data, client_data, len);
+	client_data+=len;
+	client_left-=len;
+	return len;
+}
+
+/// Appends a masked client frame, returns its length.
+size_t client_frame(char *out, int first, const char *data, size_t len){
+	const char mask[4]={ 0x11, 0x22, 0x33, 0x44 };
+	size_t h=2, i;
+	out[0]=first;
+	if (len<126)
+		out[1]=0x80|len;
+	else{
+		out[1]=0x80|126;
+		out[2]=len>>8;
+		out[3]=len&0xFF;
+		h=4;
+	}
+	memcpy(out+h, mask, 4);
+	for (i=0;i<len;i++)
+		out[h+4+i]=data[i]^mask[i&3];
+	return h+4+len;
+}
+
+/// Frames with the 16 and 64 bit lengths, unmasked data at odd positions.
+void t03_websocket_framing(){
+	INIT_LOCAL();
+	
+	onion *o=websocket_server_new();
+	onion_listen_point *lp=onion_get_listen_point(o, 0);
+	lp->read=client_read;
+	onion_request *req=onion_request_new(lp);
+	onion_request_write0(req,"GET /\nUpgrade: websocket\nSec-Websocket-Version: 13\nSec-Websocket-Key: My-key\n\n");
+	FAIL_IF_EQUAL(last_ws, NULL);
+	onion_block *out=onion_buffer_listen_point_get_buffer(req);
+	
+	static char data[70000];
+	int i;
+	for (i=0;i<sizeof(data);i++)
+		data[i]=i*7;
+	onion_block_clear(out);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_write(last_ws, data, 300), 300);
+	const unsigned char *b=(const unsigned char*)onion_block_data(out);
+	FAIL_IF_NOT_EQUAL_INT(onion_block_size(out), 4+300);
+	FAIL_IF_NOT_EQUAL_INT(b[1], 126);
+	FAIL_IF_NOT_EQUAL_INT((b[2]<<8)+b[3], 300);
+	FAIL_IF_NOT(memcmp(b+4, data, 300)==0);
+	
+	onion_block_clear(out);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_write(last_ws, data, sizeof(data)), sizeof(data));
+	b=(const unsigned char*)onion_block_data(out);
+	FAIL_IF_NOT_EQUAL_INT(onion_block_size(out), 10+sizeof(data));
+	FAIL_IF_NOT_EQUAL_INT(b[1], 127);
+	FAIL_IF_NOT_EQUAL_INT((b[7]<<16)+(b[8]<<8)+b[9], sizeof(data));
+	FAIL_IF_NOT(memcmp(b+10, data, sizeof(data))==0);
+	
+	// A masked client frame, of 1000 bytes
+	static char frame[8+1000];
+	const char mask[4]={ 0x12, 0x34, 0x56, 0x78 };
+	frame[0]=0x82;
+	frame[1]=0x80|126;
+	frame[2]=1000>>8;
+	frame[3]=1000&0xFF;
+	memcpy(frame+4, mask, 4);
+	for (i=0;i<1000;i++)
+		frame[8+i]=data[i]^mask[i&3];
+	client_data=frame;
+	client_left=sizeof(frame);
+	char read[1000];
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_read(last_ws, read, 3), 3);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_read(last_ws, read+3, 997), 997);
+	FAIL_IF_NOT(memcmp(read, data, 1000)==0);
+	
+	onion_request_free(req);
+	onion_free(o);
+	
+	END_LOCAL();
+}
+
+/// Opens a websocket at a new request, returns it.
+onion_websocket *group_ws(onion *o, onion_request **req){
+	*req=onion_request_new(onion_get_listen_point(o, 0));
+	last_ws=NULL;
+	onion_request_write0(*req,"GET /\nUpgrade: websocket\nSec-Websocket-Version: 13\nSec-Websocket-Key: My-key\n\n");
+	onion_block_clear(onion_buffer_listen_point_get_buffer(*req));
+	return last_ws;
+}
+
+/// Published once, queued to each subscriber, as the policy says when they are slow.
+void t04_websocket_group(){
+	INIT_LOCAL();
+	
+	onion *o=websocket_server_new();
+	onion_request *req_a, *req_b, *req_c;
+	onion_websocket *ws_a=group_ws(o, &req_a), *ws_b=group_ws(o, &req_b), *ws_c=group_ws(o, &req_c);
+	FAIL_IF_EQUAL(ws_c, NULL);
+	onion_block *out_a=onion_buffer_listen_point_get_buffer(req_a);
+	onion_block *out_b=onion_buffer_listen_point_get_buffer(req_b);
+	
+	onion_websocket_group *drop=onion_websocket_group_new(OWS_GROUP_DROP, 2);
+	onion_websocket_group *coalesce=onion_websocket_group_new(OWS_GROUP_COALESCE, 1);
+	onion_websocket_group *disconnect=onion_websocket_group_new(OWS_GROUP_DISCONNECT, 1);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_subscribe(drop, ws_a), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_subscribe(drop, ws_a), -1);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_subscribe(drop, ws_b), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_subscribe(coalesce, ws_b), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_count(drop), 2);
+	
+	// Drop: the third waits for the two queued.
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_publish(drop, OWS_TEXT, "one", 3), 2);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_publish(drop, OWS_TEXT, "two", 3), 2);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_publish(drop, OWS_TEXT, "three", 5), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_block_size(out_a), 0); // Not written by the publisher
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_flush_queue(ws_a), 2);
+	FAIL_IF_NOT_EQUAL_INT(onion_block_size(out_a), 10);
+	FAIL_IF_NOT(memcmp(onion_block_data(out_a), "\x81\x03one\x81\x03two", 10)==0);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_flush_queue(ws_a), 0);
+	
+	// Coalesce: only the latest, after the drop ones of b.
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_publish(coalesce, OWS_TEXT, "old", 3), 1);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_publish(coalesce, OWS_TEXT, "new", 3), 1);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_flush_queue(ws_b), 1);
+	FAIL_IF_NOT_EQUAL_INT(onion_block_size(out_b), 5);
+	FAIL_IF_NOT(memcmp(onion_block_data(out_b), "\x81\x03new", 5)==0);
+	
+	// Unsubscribed, gets no more.
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_unsubscribe(drop, ws_a), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_unsubscribe(drop, ws_a), -1);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_publish(drop, OWS_BINARY, "x", 1), 1);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_flush_queue(ws_a), 0);
+	
+	// Disconnect: the slow one is closed.
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_subscribe(disconnect, ws_c), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_publish(disconnect, OWS_TEXT, "1", 1), 1);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_publish(disconnect, OWS_TEXT, "2", 1), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_flush_queue(ws_c), -1);
+	
+	// Freed while subscribed, both ways; b still has the "x" queued.
+	onion_request_free(req_b);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_count(drop), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_count(coalesce), 0);
+	onion_websocket_group_free(disconnect);
+	onion_request_free(req_c);
+	onion_websocket_group_free(drop);
+	onion_websocket_group_free(coalesce);
+	onion_request_free(req_a);
+	onion_free(o);
+	
+	END_LOCAL();
+}
+
+int writable_calls;
+
+onion_connection_status ws_writable(void *_, onion_websocket *ws){
+	writable_calls++;
+	return OCS_NEED_MORE_DATA;
+}
+
+/// Fragmented messages both ways, and the send queue with its watermarks.
+void t06_websocket_fragments_and_queue(){
+	INIT_LOCAL();
+	
+	onion *o=websocket_server_new();
+	onion_listen_point *lp=onion_get_listen_point(o, 0);
+	lp->read=client_read;
+	client_left=0;
+	onion_request *req;
+	onion_websocket *ws=group_ws(o, &req);
+	FAIL_IF_EQUAL(ws, NULL);
+	onion_block *out=onion_buffer_listen_point_get_buffer(req);
+	
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_write_fragment(ws, "Hello ", 6, 0), 6);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_write_fragment(ws, "world", 5, 1), 5);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_write(ws, "!", 1), 1);
+	FAIL_IF_NOT_EQUAL_INT(onion_block_size(out), 8+7+3);
+	FAIL_IF_NOT(memcmp(onion_block_data(out), "\x01\x06Hello \x80\x05world\x81\x01!", 18)==0);
+	onion_block_clear(out);
+	
+	// Reads by fragment, of a binary message with a ping in between.
+	static char frames[64];
+	size_t flen=client_frame(frames, 0x02, "abc", 3);
+	flen+=client_frame(frames+flen, 0x89, "p", 1);
+	flen+=client_frame(frames+flen, 0x80, "defg", 4);
+	client_data=frames;
+	client_left=flen;
+	char read[16];
+	int fin=-1;
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_read_fragment(ws, read, sizeof(read), &fin), 3);
+	FAIL_IF_NOT_EQUAL_INT(fin, 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_get_opcode(ws), OWS_BINARY);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_read_fragment(ws, read+3, 2, &fin), 2);
+	FAIL_IF_NOT_EQUAL_INT(fin, 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_read_fragment(ws, read+5, sizeof(read), &fin), 2);
+	FAIL_IF_NOT_EQUAL_INT(fin, 1);
+	FAIL_IF_NOT(memcmp(read, "abcdefg", 7)==0);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_get_opcode(ws), OWS_BINARY); // Kept after the continuation and the ping
+	FAIL_IF_NOT(memcmp(onion_block_data(out), "\x8A\x01p", 3)==0); // The pong
+	onion_block_clear(out);
+	
+	// The send queue: written by the flush, and it stops at high until low.
+	onion_websocket_set_opcode(ws, OWS_TEXT);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_set_send_queue(ws, 100, 100, ws_writable), -1);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_set_send_queue(ws, 100, 20, ws_writable), 0);
+	char data[60];
+	memset(data, 'x', sizeof(data));
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_write(ws, data, 60), 60);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_write(ws, data, 60), 60);
+	errno=0;
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_write(ws, data, 60), -1);
+	FAIL_IF_NOT_EQUAL_INT(errno, EAGAIN);
+	FAIL_IF_NOT_EQUAL_INT(onion_block_size(out), 0); // Not written by the writer
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_queued_bytes(ws), 2*62);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_flush_queue(ws), 2);
+	FAIL_IF_NOT_EQUAL_INT(onion_block_size(out), 2*62);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_queued_bytes(ws), 0);
+	FAIL_IF_NOT_EQUAL_INT(writable_calls, 1);
+	onion_block_clear(out);
+	
+	// The group frames wait for the end of the message being written.
+	onion_websocket_group *group=onion_websocket_group_new(OWS_GROUP_DROP, 4);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_subscribe(group, ws), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_write_fragment(ws, "a", 1, 0), 1);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_flush_queue(ws), 1);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_group_publish(group, OWS_TEXT, "g", 1), 1);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_flush_queue(ws), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_write_fragment(ws, "b", 1, 1), 1);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_flush_queue(ws), 2);
+	FAIL_IF_NOT_EQUAL_INT(onion_block_size(out), 9);
+	FAIL_IF_NOT(memcmp(onion_block_data(out), "\x01\x01" "a\x80\x01" "b\x81\x01g", 9)==0);
+	FAIL_IF_NOT_EQUAL_INT(writable_calls, 1);
+	
+	onion_websocket_group_free(group);
+	onion_request_free(req);
+	onion_free(o);
+	
+	END_LOCAL();
+}
+
+#ifdef HAVE_ZLIB
+/// Opens a websocket offering those extensions, and keeps the answered ones, or "".
+onion_websocket *deflate_ws(onion *o, onion_request **req, const char *extensions, char *answer, size_t size){
+	char request[512];
+	snprintf(request, sizeof(request), "GET /\nUpgrade: websocket\nSec-Websocket-Version: 13\nSec-Websocket-Key: My-key\n%s%s%s\n",
+					 extensions ? "Sec-Websocket-Extensions: " : "", extensions ? extensions : "", extensions ? "\n" : "");
+	*req=onion_request_new(onion_get_listen_point(o, 0));
+	last_ws=NULL;
+	onion_request_write0(*req, request);
+	onion_block *out=onion_buffer_listen_point_get_buffer(*req);
+	const char *h=strstr(onion_block_data(out), "Sec-Websocket-Extensions: ");
+	answer[0]='\0';
+	if (h){
+		h+=strlen("Sec-Websocket-Extensions: ");
+		snprintf(answer, size, "%.*s", (int)strcspn(h, "\r\n"), h);
+	}
+	onion_block_clear(out);
+	return last_ws;
+}
+
+/// Length of the payload of the server frame, and where it starts.
+size_t frame_payload(const unsigned char *b, const unsigned char **payload){
+	size_t l=b[1]&0x7F;
+	*payload=b+2;
+	if (l==126){
+		l=(b[2]<<8)+b[3];
+		*payload=b+4;
+	}
+	return l;
+}
+
+/// Inflates a compressed payload as the client does, with the implied 00 00 FF FF. Returns the inflated length.
+size_t client_inflate(z_stream *z, const unsigned char *data, size_t len, char *out, size_t size){
+	unsigned char *tmp=malloc(len+4);
+	memcpy(tmp, data, len);
+	memcpy(tmp+len, "\x00\x00\xff\xff", 4);
+	z->next_in=tmp;
+	z->avail_in=len+4;
+	z->next_out=(Bytef*)out;
+	z->avail_out=size;
+	inflate(z, Z_SYNC_FLUSH);
+	free(tmp);
+	return size-z->avail_out;
+}
+
+/// permessage-deflate negotiation, compressed messages both ways, and the memory budget.
+void t05_websocket_deflate(){
+	INIT_LOCAL();
+	
+	onion *o=websocket_server_new();
+	onion_listen_point *lp=onion_get_listen_point(o, 0);
+	lp->read=client_read;
+	client_left=0;
+	char answer[256];
+	onion_request *req;
+	
+	FAIL_IF_EQUAL(deflate_ws(o, &req, "permessage-deflate", answer, sizeof(answer)), NULL);
+	FAIL_IF_NOT_EQUAL_STR(answer, ""); // Not enabled
+	onion_request_free(req);
+	
+	onion_set_websocket_deflate(o, 15, 1, 0);
+	FAIL_IF_EQUAL(deflate_ws(o, &req, NULL, answer, sizeof(answer)), NULL);
+	FAIL_IF_NOT_EQUAL_STR(answer, ""); // Not offered
+	FAIL_IF_NOT_EQUAL(last_ws->deflate, NULL);
+	onion_request_free(req);
+	
+	// zlib can not do 8 bits, the second offer is taken.
+	onion_websocket *ws=deflate_ws(o, &req, "permessage-deflate; server_max_window_bits=8, permessage-deflate; client_max_window_bits", answer, sizeof(answer));
+	FAIL_IF_EQUAL(ws, NULL);
+	FAIL_IF_NOT_EQUAL_STR(answer, "permessage-deflate");
+	onion_block *out=onion_buffer_listen_point_get_buffer(req);
+	
+	static char json[4000];
+	int i, json_len=0;
+	for (i=0;i<60;i++)
+		json_len+=snprintf(json+json_len, sizeof(json)-json_len, "{\"id\":%d,\"name\":\"item\",\"tags\":[\"a\",\"b\"]},", i);
+	
+	// Compressed, and with context takeover the second one is even smaller.
+	z_stream client;
+	memset(&client, 0, sizeof(client));
+	inflateInit2(&client, -15);
+	char inflated[4000];
+	const unsigned char *payload;
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_write(ws, json, json_len), json_len);
+	const unsigned char *b=(const unsigned char*)onion_block_data(out);
+	FAIL_IF_NOT_EQUAL_INT(b[0], 0xC1); // FIN, RSV1, text
+	size_t l1=frame_payload(b, &payload);
+	FAIL_IF(l1*5>json_len);
+	FAIL_IF_NOT_EQUAL_INT(client_inflate(&client, payload, l1, inflated, sizeof(inflated)), json_len);
+	FAIL_IF_NOT(memcmp(inflated, json, json_len)==0);
+	onion_block_clear(out);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_write(ws, json, json_len), json_len);
+	b=(const unsigned char*)onion_block_data(out);
+	size_t l2=frame_payload(b, &payload);
+	FAIL_IF(l2>=l1);
+	FAIL_IF_NOT_EQUAL_INT(client_inflate(&client, payload, l2, inflated, sizeof(inflated)), json_len);
+	FAIL_IF_NOT(memcmp(inflated, json, json_len)==0);
+	inflateEnd(&client);
+	onion_block_clear(out);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_write(ws, "small", 5), 5);
+	FAIL_IF_NOT_EQUAL_INT(((const unsigned char*)onion_block_data(out))[0], 0x81); // Not worth it
+	onion_block_clear(out);
+	
+	// From the client: compressed, in two fragments with a ping in between.
+	z_stream zc;
+	memset(&zc, 0, sizeof(zc));
+	deflateInit2(&zc, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	char compressed[4000];
+	zc.next_in=(Bytef*)json;
+	zc.avail_in=json_len;
+	zc.next_out=(Bytef*)compressed;
+	zc.avail_out=sizeof(compressed);
+	deflate(&zc, Z_SYNC_FLUSH);
+	size_t clen=sizeof(compressed)-zc.avail_out-4;
+	deflateEnd(&zc);
+	static char frames[5000];
+	size_t flen=client_frame(frames, 0x41, compressed, clen/2);
+	flen+=client_frame(frames+flen, 0x89, "pp", 2);
+	flen+=client_frame(frames+flen, 0x80, compressed+clen/2, clen-clen/2);
+	client_data=frames;
+	client_left=flen;
+	char read[4000];
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_read(ws, read, 10), 10);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_get_opcode(ws), OWS_TEXT);
+	FAIL_IF_NOT_EQUAL_INT(onion_websocket_read(ws, read+10, json_len-10), json_len-10);
+	FAIL_IF_NOT(memcmp(read, json, json_len)==0);
+	FAIL_IF_NOT(memcmp(onion_block_data(out), "\x8A\x02pp", 4)==0); // The pong
+	onion_request_free(req);
+	
+	// Without context takeover, and lowered to the memory.
+	onion_set_websocket_deflate(o, 15, 0, 64*1024);
+	ws=deflate_ws(o, &req, "permessage-deflate; client_max_window_bits", answer, sizeof(answer));
+	FAIL_IF_EQUAL(ws, NULL);
+	FAIL_IF_NOT_EQUAL_STR(answer, "permessage-deflate; server_no_context_takeover; client_no_context_takeover; server_max_window_bits=12; client_max_window_bits=14");
+	out=onion_buffer_listen_point_get_buffer(req);
+	for (i=0;i<2;i++){ // Each one alone
+		memset(&client, 0, sizeof(client));
+		inflateInit2(&client, -15);
+		onion_block_clear(out);
+		FAIL_IF_NOT_EQUAL_INT(onion_websocket_write(ws, json, json_len), json_len);
+		b=(const unsigned char*)onion_block_data(out);
+		l1=frame_payload(b, &payload);
+		FAIL_IF_NOT_EQUAL_INT(client_inflate(&client, payload, l1, inflated, sizeof(inflated)), json_len);
+		FAIL_IF_NOT(memcmp(inflated, json, json_len)==0);
+		inflateEnd(&client);
+	}
+	onion_request_free(req);
+	
+	onion_set_websocket_deflate(o, 15, 0, 1000);
+	FAIL_IF_EQUAL(deflate_ws(o, &req, "permessage-deflate; client_max_window_bits", answer, sizeof(answer)), NULL);
+	FAIL_IF_NOT_EQUAL_STR(answer, ""); // Does not fit
+	onion_request_free(req);
+	
+	onion_free(o);
+	
+	END_LOCAL();
+}
+#endif
+
+/// Echoes the messages, to know the pongs are not delivered as data.
+onion_connection_status echo_callback(void *privdata, onion_websocket *ws, size_t nbytes_ready){
+	char tmp[256];
+	if (nbytes_ready>sizeof(tmp))
+		nbytes_ready=sizeof(tmp);
+	if (nbytes_ready==0)
+		return OCS_NEED_MORE_DATA;
+	ssize_t r=onion_websocket_read(ws, tmp, nbytes_ready);
+	if (r<=0)
+		return OCS_CLOSE_CONNECTION;
+	onion_websocket_write(ws, tmp, r);
+	return OCS_NEED_MORE_DATA;
+}
+
+onion_connection_status echo_handler(void *priv, onion_request *req, onion_response *res){
+	onion_websocket *ws=onion_websocket_new(req, res);
+	if (!ws)
+		return OCS_NOT_IMPLEMENTED;
+	onion_websocket_set_callback(ws, echo_callback);
+	return OCS_WEBSOCKET;
+}
+
+void *keepalive_listen(void *o){
+	onion_listen((onion*)o);
+	return NULL;
+}
+
+static long keepalive_now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/// Reads exactly len bytes in timeout_ms; returns what was read, 0 if closed.
+ssize_t keepalive_read(int fd, char *buffer, size_t len, int timeout_ms){
+	long end=keepalive_now_ms()+timeout_ms;
+	size_t done=0;
+	while (done<len){
+		struct pollfd pfd={ fd, POLLIN, 0 };
+		long left=end-keepalive_now_ms();
+		if (left<=0 || poll(&pfd, 1, left)<=0)
+			return -1;
+		ssize_t r=read(fd, buffer+done, len-done);
+		if (r<=0)
+			return done;
+		done+=r;
+	}
+	return done;
+}
+
+/// Idle websockets are pinged, the pongs are consumed, and one not answering is closed.
+void t07_websocket_keepalive(){
+	INIT_LOCAL();
+	
+	onion *o=onion_new(O_THREADED);
+	onion_set_port(o, "8105");
+	onion_set_root_handler(o, onion_handler_new(echo_handler, NULL, NULL));
+	onion_set_websocket_keepalive(o, 200, 200);
+	pthread_t th;
+	pthread_create(&th, NULL, keepalive_listen, o);
+	usleep(200000);
+	
+	struct addrinfo hints, *server;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_flags=AI_NUMERICSERV;
+	FAIL_IF_NOT_EQUAL_INT(getaddrinfo("localhost", "8105", &hints, &server), 0);
+	int fd=socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+	FAIL_IF_NOT_EQUAL_INT(connect(fd, server->ai_addr, server->ai_addrlen), 0);
+	freeaddrinfo(server);
+	
+	const char *handshake="GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-Websocket-Version: 13\r\nSec-Websocket-Key: My-key\r\n\r\n";
+	FAIL_IF_NOT_EQUAL_INT(write(fd, handshake, strlen(handshake)), strlen(handshake));
+	char buffer[1024]={0};
+	size_t l=0;
+	while (!strstr(buffer, "\r\n\r\n") && l<sizeof(buffer)-1){
+		ssize_t r=keepalive_read(fd, buffer+l, 1, 1000);
+		if (r!=1)
+			break;
+		l++;
+	}
+	FAIL_IF_NOT(strstr(buffer, "101"));
+	
+	// An unsolicited pong is skipped, the message after it is echoed.
+	char frames[64];
+	size_t n=client_frame(frames, 0x8A, "", 0);
+	n+=client_frame(frames+n, 0x81, "hi", 2);
+	FAIL_IF_NOT_EQUAL_INT(write(fd, frames, n), n);
+	FAIL_IF_NOT_EQUAL_INT(keepalive_read(fd, buffer, 4, 1000), 4);
+	FAIL_IF_NOT_EQUAL_INT(memcmp(buffer, "\x81\x02hi", 4), 0);
+	
+	// Idle, pinged; answered, pinged again later.
+	long t0=keepalive_now_ms();
+	FAIL_IF_NOT_EQUAL_INT(keepalive_read(fd, buffer, 2, 1000), 2);
+	FAIL_IF_NOT_EQUAL_INT(memcmp(buffer, "\x89\x00", 2), 0);
+	FAIL_IF(keepalive_now_ms()-t0 < 150);
+	n=client_frame(frames, 0x8A, "", 0);
+	FAIL_IF_NOT_EQUAL_INT(write(fd, frames, n), n);
+	FAIL_IF_NOT_EQUAL_INT(keepalive_read(fd, buffer, 2, 1000), 2);
+	FAIL_IF_NOT_EQUAL_INT(memcmp(buffer, "\x89\x00", 2), 0);
+	
+	// Not answered, closed after the pong timeout.
+	t0=keepalive_now_ms();
+	FAIL_IF_NOT_EQUAL_INT(keepalive_read(fd, buffer, 2, 1000), 0);
+	FAIL_IF(keepalive_now_ms()-t0 < 150);
+	close(fd);
+	
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+	
+	END_LOCAL();
+}
+
 int main(int argc, char **argv){
 	START();
 	
 	t01_websocket_server_no_ws();
 	t02_websocket_server_w_ws();
+	t03_websocket_framing();
+	t04_websocket_group();
+#ifdef HAVE_ZLIB
+	t05_websocket_deflate();
+#endif
+	t06_websocket_fragments_and_queue();
+	t07_websocket_keepalive();
 	
 	END();
 }
@@ -17,7 +17,10 @@
 	*/
 
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <onion/onion.h>
 #include <onion/url.h>
@@ -101,6 +104,278 @@ void t01_url(){
 	END_LOCAL();
 }
 
+const char *called_name;
+char params[256];
+
+/// Keeps its name, the path left, and the id and x url params.
+int named_handler(void *name, onion_request *r, onion_response *res){
+	called_name=name;
+	free(urltxt);
+	urltxt=strdup(onion_request_get_path(r));
+	const char *id=onion_request_get_url_param(r, "id"), *x=onion_request_get_url_param(r, "x"), *g=onion_request_get_url_group(r, 1);
+	snprintf(params, sizeof(params), "%s,%s,%s", id ? id : "-", x ? x : "-", g ? g : "-");
+	return OCS_PROCESSED;
+}
+
+void add_named(onion_url *url, const char *regexp, const char *name){
+	onion_url_add_handler(url, regexp, onion_handler_new((onion_handler_handler)named_handler, (void*)name, NULL));
+}
+
+/// Returns the name of the handler for that path, or NULL.
+const char *route(onion_request *req, const char *path){
+	char tmp[256];
+	called_name=NULL;
+	params[0]='\0';
+	onion_request_clean(req);
+	snprintf(tmp, sizeof(tmp), "GET /%s HTTP/1.1\n\n", path);
+	onion_request_write(req, tmp, strlen(tmp));
+	return called_name;
+}
+
+/// The trie gives the same handler as checking in order, with the :name params.
+void t02_trie(){
+	INIT_LOCAL();
+
+	onion_url *url=onion_url_new();
+	add_named(url, "^api/v1/", "api");
+	add_named(url, "^ol(d)$", "regexp");
+	add_named(url, "users/:id/posts", "posts");
+	add_named(url, "users/me/posts", "me"); // Never, the pattern was first
+	add_named(url, "users/:id", "user");
+	add_named(url, "^index\\.html$", "index");
+	add_named(url, "old", "old"); // Never, the regexp was first
+	add_named(url, "olden", "olden");
+	add_named(url, "^a(b+)c", "abc");
+	onion_url *sub=onion_url_new();
+	add_named(sub, ":x", "sub");
+	onion_url_add_url(url, "^sub/:id/", sub); // Not a pattern, as a regexp
+	onion_url *sub2=onion_url_new();
+	add_named(sub2, "item/:x", "sub2");
+	onion_url_add_url(url, "^in/", sub2);
+	int i;
+	char tmp[64];
+	static char names[300][16];
+	for (i=0;i<300;i++){
+		snprintf(tmp, sizeof(tmp), "r%d/:x", i);
+		snprintf(names[i], sizeof(names[i]), "r%d", i);
+		add_named(url, tmp, names[i]);
+	}
+	add_named(url, "^", "default");
+
+	onion_set_root_handler(server, onion_url_to_handler(url));
+	onion_request *req=onion_request_new(onion_get_listen_point(server, 0));
+
+	FAIL_IF_NOT_EQUAL_STR(route(req, "api/v1/list"), "api");
+	FAIL_IF_NOT_EQUAL_STR(urltxt, "list");
+	FAIL_IF_NOT_EQUAL_STR(route(req, "old"), "regexp");
+	FAIL_IF_NOT_EQUAL_STR(params, "-,-,d");
+	FAIL_IF_NOT_EQUAL_STR(route(req, "olden"), "olden");
+	FAIL_IF_NOT_EQUAL_STR(route(req, "users/42/posts"), "posts");
+	FAIL_IF_NOT_EQUAL_STR(params, "42,-,-");
+	FAIL_IF_NOT_EQUAL_STR(urltxt, "");
+	FAIL_IF_NOT_EQUAL_STR(route(req, "users/me/posts"), "posts");
+	FAIL_IF_NOT_EQUAL_STR(params, "me,-,-");
+	FAIL_IF_NOT_EQUAL_STR(route(req, "users/42"), "user");
+	FAIL_IF_NOT_EQUAL_STR(route(req, "users/42/"), "default");
+	FAIL_IF_NOT_EQUAL_STR(route(req, "users/"), "default"); // :id is not empty
+	FAIL_IF_NOT_EQUAL_STR(route(req, "index.html"), "index");
+	FAIL_IF_NOT_EQUAL_STR(route(req, "indexxhtml"), "default");
+	FAIL_IF_NOT_EQUAL_STR(route(req, "abbbcd"), "abc");
+	FAIL_IF_NOT_EQUAL_STR(params, "-,-,bbb");
+	FAIL_IF_NOT_EQUAL_STR(urltxt, "d");
+	FAIL_IF_NOT_EQUAL_STR(route(req, "r299/last"), "r299");
+	FAIL_IF_NOT_EQUAL_STR(params, "-,last,-");
+	FAIL_IF_NOT_EQUAL_STR(route(req, "r29/x"), "r29");
+	FAIL_IF_NOT_EQUAL_STR(route(req, "in/item/7"), "sub2");
+	FAIL_IF_NOT_EQUAL_STR(params, "-,7,-");
+	FAIL_IF_NOT_EQUAL_STR(route(req, "sub/:id/y"), "sub");
+	FAIL_IF_NOT_EQUAL_STR(route(req, "nothing"), "default");
+	FAIL_IF_NOT_EQUAL_STR(urltxt, "nothing");
+
+	onion_request_free(req);
+	onion_url_free(url);
+	onion_set_root_handler(server, NULL);
+	free(urltxt);
+	urltxt=NULL;
+
+	END_LOCAL();
+}
+
+/// Returns the name of the handler for that path at that host, or NULL.
+const char *route_host(onion_request *req, const char *host, const char *path){
+	char tmp[256];
+	called_name=NULL;
+	onion_request_clean(req);
+	snprintf(tmp, sizeof(tmp), "GET /%s HTTP/1.1\nHost: %s\n\n", path, host);
+	onion_request_write(req, tmp, strlen(tmp));
+	return called_name;
+}
+
+/// Each host has its url tree, the most specific wildcard wins, and the rest go to the root handler.
+void t03_vhosts(){
+	INIT_LOCAL();
+
+	onion_url *root=onion_root_url(server);
+	add_named(root, "^", "root");
+	add_named(onion_vhost_url(server, "www.example.com"), "^", "www");
+	add_named(onion_vhost_url(server, "*.example.com"), "^", "any");
+	add_named(onion_vhost_url(server, "*.b.example.com"), "^", "b");
+	onion_url *api=onion_vhost_url(server, "api.example.com");
+	add_named(api, "v1/:id", "api");
+	FAIL_IF_NOT_EQUAL(onion_vhost_url(server, "API.example.com"), api);
+	onion_set_vhost_handler(server, "old.example.com", onion_handler_new((onion_handler_handler)named_handler, "old", NULL));
+	FAIL_IF_NOT_EQUAL(onion_vhost_url(server, "old.example.com"), NULL); // Not an url
+
+	onion_request *req=onion_request_new(onion_get_listen_point(server, 0));
+	FAIL_IF_NOT_EQUAL_STR(route_host(req, "www.example.com", "x"), "www");
+	FAIL_IF_NOT_EQUAL_STR(route_host(req, "WWW.Example.com:8080", "x"), "www");
+	FAIL_IF_NOT_EQUAL_STR(route_host(req, "www.example.com.", "x"), "www");
+	FAIL_IF_NOT_EQUAL_STR(route_host(req, "api.example.com", "v1/7"), "api");
+	FAIL_IF_NOT_EQUAL_STR(params, "7,-,-");
+	FAIL_IF_NOT_EQUAL(route_host(req, "api.example.com", "v2"), NULL); // No fallback to the root, as the host is known
+	FAIL_IF_NOT_EQUAL_STR(route_host(req, "old.example.com", "x"), "old");
+	FAIL_IF_NOT_EQUAL_STR(route_host(req, "c.example.com", "x"), "any");
+	FAIL_IF_NOT_EQUAL_STR(route_host(req, "a.c.example.com", "x"), "any");
+	FAIL_IF_NOT_EQUAL_STR(route_host(req, "a.b.example.com:80", "x"), "b");
+	FAIL_IF_NOT_EQUAL_STR(route_host(req, "example.com", "x"), "root");
+	FAIL_IF_NOT_EQUAL_STR(route_host(req, "[::1]:8080", "x"), "root");
+	FAIL_IF_NOT_EQUAL_STR(route(req, "x"), "root"); // No Host
+
+	onion_set_vhost_handler(server, "www.example.com", NULL);
+	FAIL_IF_NOT_EQUAL_STR(route_host(req, "www.example.com", "x"), "any");
+
+	onion_request_free(req);
+	onion_set_root_handler(server, NULL);
+	onion_url_free(root);
+
+	END_LOCAL();
+}
+
+#ifdef HAVE_ROUTE_STATS
+/// Waits 2 ms, and fails on ?fail.
+int slow_handler(void *p, onion_request *r, onion_response *res){
+	usleep(2000);
+	if (onion_request_get_query(r, "fail"))
+		return OCS_INTERNAL_ERROR;
+	return OCS_PROCESSED;
+}
+
+onion_url_route_stats found[8];
+char found_routes[8][64];
+int nfound;
+
+void keep_stats(void *_, const onion_url_route_stats *stats){
+	found[nfound]=*stats;
+	snprintf(found_routes[nfound], sizeof(found_routes[nfound]), "%s", stats->route);
+	nfound++;
+}
+
+/// Hits, errors and latency of each route, also of the urls inside.
+void t04_stats(){
+	INIT_LOCAL();
+
+	onion_url *url=onion_url_new();
+	add_named(url, "fast", "fast");
+	onion_url *api=onion_url_new();
+	onion_url_add(api, "slow", slow_handler);
+	onion_url_add_url(url, "^api/", api);
+	onion_url_set_stats(url, 1);
+	add_named(api, "later", "later"); // Added after, also kept
+	onion_set_root_handler(server, onion_url_to_handler(url));
+
+	onion_request *req=onion_request_new(onion_get_listen_point(server, 0));
+	int i;
+	for (i=0;i<10;i++)
+		route(req, "fast");
+	route(req, "api/slow");
+	route(req, "api/slow?fail=1");
+	route(req, "api/later");
+
+	nfound=0;
+	onion_url_stats(url, keep_stats, NULL);
+	FAIL_IF_NOT_EQUAL_INT(nfound, 4);
+	FAIL_IF_NOT_EQUAL_STR(found_routes[0], "fast");
+	FAIL_IF_NOT_EQUAL_INT(found[0].hits, 10);
+	FAIL_IF_NOT_EQUAL_INT(found[0].errors, 0);
+	FAIL_IF(onion_url_stats_percentile(&found[0], 50)>=1000);
+	FAIL_IF_NOT_EQUAL_STR(found_routes[1], "^api/");
+	FAIL_IF_NOT_EQUAL_INT(found[1].hits, 3);
+	FAIL_IF_NOT_EQUAL_STR(found_routes[2], "^api/slow");
+	FAIL_IF_NOT_EQUAL_INT(found[2].hits, 2);
+	FAIL_IF_NOT_EQUAL_INT(found[2].errors, 1);
+	FAIL_IF(onion_url_stats_percentile(&found[2], 50)<2000);
+	FAIL_IF(onion_url_stats_percentile(&found[2], 100)<onion_url_stats_percentile(&found[2], 50));
+	FAIL_IF_NOT_EQUAL_STR(found_routes[3], "^api/later");
+	FAIL_IF_NOT_EQUAL_INT(found[3].hits, 1);
+
+	// Disabled, the counters stay
+	onion_url_set_stats(url, 0);
+	route(req, "fast");
+	nfound=0;
+	onion_url_stats(url, keep_stats, NULL);
+	FAIL_IF_NOT_EQUAL_INT(found[0].hits, 10);
+
+	onion_request_free(req);
+	onion_set_root_handler(server, NULL);
+	onion_url_free(url);
+
+	END_LOCAL();
+}
+#endif
+
+onion_url *classified;
+onion_priority_class priority;
+
+/// Keeps the class of the route the request would go to, at classified.
+int classify_handler(void *p, onion_request *r, onion_response *res){
+	priority=onion_url_get_priority(classified, r);
+	return OCS_PROCESSED;
+}
+
+/// Priority classes of the routes, and of the urls at them, without calling them.
+void t05_priority(){
+	INIT_LOCAL();
+
+	classified=onion_url_new();
+	onion_url_add(classified, "healthz", handler1);
+	onion_url_add(classified, "^export/", handler2);
+	onion_url *api=onion_url_new();
+	onion_url_add(api, "checkout", handler1);
+	onion_url_add(api, "^report", handler2);
+	onion_url_add_url(classified, "^api/", api);
+	onion_set_root_handler(server, onion_handler_new(classify_handler, NULL, NULL));
+	onion_request *req=onion_request_new(onion_get_listen_point(server, 0));
+
+	route(req, "export/all");
+	FAIL_IF_NOT_EQUAL_INT(priority, OPRIO_NORMAL);
+
+	FAIL_IF_NOT_EQUAL_INT(onion_url_set_priority(classified, "healthz", OPRIO_HIGH), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_url_set_priority(classified, "^export/", OPRIO_LOW), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_url_set_priority(classified, "^api/", OPRIO_LOW), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_url_set_priority(api, "checkout", OPRIO_HIGH), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_url_set_priority(classified, "missing", OPRIO_HIGH), -1);
+
+	route(req, "healthz");
+	FAIL_IF_NOT_EQUAL_INT(priority, OPRIO_HIGH);
+	route(req, "export/all");
+	FAIL_IF_NOT_EQUAL_INT(priority, OPRIO_LOW);
+	route(req, "api/checkout");
+	FAIL_IF_NOT_EQUAL_INT(priority, OPRIO_HIGH);
+	route(req, "api/report");
+	FAIL_IF_NOT_EQUAL_INT(priority, OPRIO_LOW);
+	route(req, "other");
+	FAIL_IF_NOT_EQUAL_INT(priority, OPRIO_NORMAL);
+	onion_handler *other=onion_handler_new(classify_handler, NULL, NULL);
+	FAIL_IF_NOT_EQUAL_INT(onion_url_get_priority((onion_url*)other, req), OPRIO_NORMAL);
+	onion_handler_free(other);
+
+	onion_request_free(req);
+	onion_set_root_handler(server, NULL);
+	onion_url_free(classified);
+
+	END_LOCAL();
+}
+
 void init(){
 	server=onion_new(0);
 	onion_add_listen_point(server, NULL, NULL, onion_buffer_listen_point_new());
@@ -115,6 +390,12 @@ int main(int argc, char **argv){
 	
 	init();
 	t01_url();
+	t02_trie();
+	t03_vhosts();
+#ifdef HAVE_ROUTE_STATS
+	t04_stats();
+#endif
+	t05_priority();
 	
 	end();
 	END();
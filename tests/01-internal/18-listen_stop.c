@@ -16,13 +16,22 @@
 	along with this program.  If not, see <http://www.gnu.org/licenses/>.
 	*/
 
+#define _GNU_SOURCE
 #include <signal.h>
+#include <sched.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <netinet/in.h>
+
+#include <string.h>
 
 #include <onion/onion.h>
 #include <onion/log.h>
+#include <onion/handlers/static.h>
+#include <onion/response.h>
+#include <onion/listen_point.h>
+#include <onion/types_internal.h>
 
 #include "../ctest.h"
 
@@ -55,6 +64,18 @@ int connect_to(const char *addr, const char *port){
   return fd;
 }
 
+char port[16];
+
+/// Port of the first listen point of a server listening at port 0, so tests can run in parallel. Once listening.
+void listen_port(onion *o, char *port, size_t size){
+	struct sockaddr_storage addr;
+	socklen_t len=sizeof(addr);
+	int p=0;
+	if (getsockname(onion_get_listen_point(o, 0)->listenfd, (struct sockaddr*)&addr, &len)==0)
+		p=ntohs(addr.ss_family==AF_INET6 ? ((struct sockaddr_in6*)&addr)->sin6_port : ((struct sockaddr_in*)&addr)->sin_port);
+	snprintf(port, size, "%d", p);
+}
+
 static void shutdown_server(int _){
 	if (o) 
 		onion_listen_stop(o);
@@ -78,6 +99,7 @@ void t01_stop_listening(){
 	signal(SIGTERM, shutdown_server);
 	
 	o=onion_new(O_POOL);
+	onion_set_port(o, "0");
 	
 	pthread_t th;
 	
@@ -101,14 +123,16 @@ void t02_stop_listening_some_petitions(){
 	signal(SIGTERM, shutdown_server);
 	
 	o=onion_new(O_POOL);
+	onion_set_port(o, "0");
 	
 	pthread_t th;
 	
 	pthread_create(&th, NULL, listen_thread_f, NULL);
 
 	sleep(2);
+	listen_port(o, port, sizeof(port));
 	ONION_INFO("Connecting to server");
-	int connfd=connect_to("localhost","8080");
+	int connfd=connect_to("localhost",port);
 	FAIL_IF( connfd < 0 );
 	FAIL_IF_NOT(ok_listening);
 	kill(getpid(), SIGTERM);
@@ -121,11 +145,99 @@ void t02_stop_listening_some_petitions(){
 	END_LOCAL();
 }
 
+void t03_stop_listening_reuseport(){
+	INIT_LOCAL();
+	
+	signal(SIGTERM, shutdown_server);
+	
+	o=onion_new(O_POOL|O_REUSEPORT);
+	onion_set_port(o, "0");
+	onion_set_max_threads(o, 4);
+	onion_set_root_handler(o, onion_handler_static("Hello", 200));
+	
+	pthread_t th;
+	
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+
+	sleep(2);
+	listen_port(o, port, sizeof(port));
+	int i;
+	for (i=0;i<8;i++){ // Several connections, to hit several threads.
+		int connfd=connect_to("localhost",port);
+		FAIL_IF( connfd < 0 );
+		const char *get="GET / HTTP/1.0\r\n\r\n";
+		FAIL_IF( write(connfd, get, strlen(get)) != strlen(get) );
+		char buffer[1024];
+		memset(buffer, 0, sizeof(buffer));
+		ssize_t r, pos=0;
+		while ( (r=read(connfd, buffer+pos, sizeof(buffer)-pos-1)) > 0 )
+			pos+=r;
+		FAIL_IF_NOT_STRSTR(buffer, "Hello");
+		close(connfd);
+	}
+	FAIL_IF_NOT(ok_listening);
+	kill(getpid(), SIGTERM);
+	sleep(2);
+	FAIL_IF(ok_listening);
+
+	pthread_join(th, NULL);
+	onion_free(o);
+	
+	END_LOCAL();
+}
+
+int handler_cpu=-1;
+
+onion_connection_status cpu_handler(void *_, onion_request *req, onion_response *res){
+	handler_cpu=sched_getcpu();
+	onion_response_write0(res, "Hello");
+	return OCS_PROCESSED;
+}
+
+/// With the threads pinned, the handlers run on their CPU, and connections may be steered to them.
+void t04_reuseport_affinity(){
+	INIT_LOCAL();
+	
+	o=onion_new(O_POOL|O_REUSEPORT);
+	onion_set_port(o, "0");
+	onion_set_max_threads(o, 4);
+	int cpus[]={ 0 };
+	onion_set_threads_affinity(o, cpus, 1, 1);
+	onion_set_root_handler(o, onion_handler_new(cpu_handler, NULL, NULL));
+	
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	sleep(2);
+	listen_port(o, port, sizeof(port));
+	int i;
+	for (i=0;i<8;i++){
+		int connfd=connect_to("localhost",port);
+		FAIL_IF( connfd < 0 );
+		const char *get="GET / HTTP/1.0\r\n\r\n";
+		FAIL_IF( write(connfd, get, strlen(get)) != strlen(get) );
+		char buffer[1024];
+		memset(buffer, 0, sizeof(buffer));
+		ssize_t r, pos=0;
+		while ( (r=read(connfd, buffer+pos, sizeof(buffer)-pos-1)) > 0 )
+			pos+=r;
+		FAIL_IF_NOT_STRSTR(buffer, "Hello");
+		FAIL_IF_NOT_EQUAL_INT(handler_cpu, 0);
+		close(connfd);
+	}
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+	
+	END_LOCAL();
+}
+
 int main(int argc, char **argv){
 	START();
 	
 	t01_stop_listening();
 	t02_stop_listening_some_petitions();
+	t03_stop_listening_reuseport();
+	t04_reuseport_affinity();
 	
 	END();
 }
\ No newline at end of file
@@ -20,6 +20,10 @@
 #include <onion/log.h>
 #include <onion/random.h>
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
 #include "../ctest.h"
 
 // this is a simple test to check the implementation, not the algorithm
@@ -51,10 +55,82 @@ void t01_test_random(){
 	END_LOCAL();
 }
 
+/// All the characters of the alphabet, about the same times.
+void t02_alphabet(){
+	INIT_LOCAL();
+
+	onion_random_init();
+	static char data[62*1000+1];
+	const char *alphabet="abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	onion_random_alphabet(data, sizeof(data)-1, alphabet);
+	FAIL_IF_NOT_EQUAL_INT(strlen(data), sizeof(data)-1);
+	int count[256]={0};
+	unsigned i;
+	for (i=0;i<sizeof(data)-1;i++)
+		count[(unsigned char)data[i]]++;
+	for (i=0;i<256;i++){
+		if (strchr(alphabet, i) && i){
+			FAIL_IF( count[i]<800 || count[i]>1200 ); // 1000 expected, the modulo took 1034 for the first ones.
+		}
+		else{
+			FAIL_IF_NOT_EQUAL_INT(count[i], 0);
+		}
+	}
+	onion_random_free();
+
+	END_LOCAL();
+}
+
+/// Compares the next bytes of a thread and a forked child.
+void *random_thread(void *data){
+	onion_random_generate(data, 64);
+	return NULL;
+}
+
+/// Each thread and each forked child has its own stream.
+void t03_threads_and_fork(){
+	INIT_LOCAL();
+
+	onion_random_init();
+	unsigned char a[64], b[64];
+	onion_random_generate(a, 1); // Keyed
+	pthread_t th;
+	pthread_create(&th, NULL, random_thread, b);
+	pthread_join(th, NULL);
+	onion_random_generate(a, sizeof(a));
+	FAIL_IF( memcmp(a, b, sizeof(a))==0 );
+
+	int pipefd[2];
+	FAIL_IF( pipe(pipefd)<0 );
+	pid_t pid=fork();
+	if (pid==0){
+		onion_random_generate(b, sizeof(b));
+		if (write(pipefd[1], b, sizeof(b))!=sizeof(b))
+			exit(1);
+		exit(0);
+	}
+	onion_random_generate(a, sizeof(a));
+	FAIL_IF_NOT( read(pipefd[0], b, sizeof(b))==sizeof(b) );
+	waitpid(pid, NULL, 0);
+	FAIL_IF( memcmp(a, b, sizeof(a))==0 );
+	close(pipefd[0]);
+	close(pipefd[1]);
+
+	// Many, over the reseed, all different
+	static unsigned char big[3*1024*1024];
+	onion_random_generate(big, sizeof(big));
+	FAIL_IF( memcmp(big, big+1024*1024, 1024*1024)==0 );
+	onion_random_free();
+
+	END_LOCAL();
+}
+
 int main(int argc, char **argv){
   START();
   
 	t01_test_random();
+	t02_alphabet();
+	t03_threads_and_fork();
 	
 	END();
 }
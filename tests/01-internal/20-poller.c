@@ -0,0 +1,332 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <onion/poller.h>
+#include <onion/log.h>
+
+#include "../ctest.h"
+
+static int64_t now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+static int never_called(void *_){
+	ONION_ERROR("Should not be called, no data written to the pipe.");
+	return -1;
+}
+
+static int64_t shutdown_at[4];
+
+static void set_shutdown_time(void *n){
+	shutdown_at[(intptr_t)n]=now_ms();
+}
+
+void t01_ms_timeout(){
+	INIT_LOCAL();
+	
+	onion_poller *p=onion_poller_new(8);
+	int fds[2];
+	FAIL_IF(pipe(fds)<0);
+	
+	onion_poller_slot *slot=onion_poller_slot_new(fds[0], never_called, NULL);
+	onion_poller_slot_set_timeout(slot, 200);
+	onion_poller_slot_set_shutdown(slot, set_shutdown_time, (void*)0);
+	onion_poller_add(p, slot);
+	
+	int64_t start=now_ms();
+	onion_poller_poll(p); // Exits when only the internal eventfd is left.
+	int64_t elapsed=shutdown_at[0]-start;
+	ONION_INFO("Timeout after %d ms", (int)elapsed);
+	FAIL_IF(elapsed<190);
+	FAIL_IF(elapsed>600);
+	
+	close(fds[0]);
+	close(fds[1]);
+	onion_poller_free(p);
+	
+	END_LOCAL();
+}
+
+void t02_timeouts_in_order(){
+	INIT_LOCAL();
+	
+	onion_poller *p=onion_poller_new(8);
+	int fds[3][2];
+	int timeouts[3]={300, 100, 200};
+	int i;
+	for (i=0;i<3;i++){
+		FAIL_IF(pipe(fds[i])<0);
+		onion_poller_slot *slot=onion_poller_slot_new(fds[i][0], never_called, NULL);
+		onion_poller_slot_set_timeout(slot, timeouts[i]);
+		onion_poller_slot_set_shutdown(slot, set_shutdown_time, (void*)(intptr_t)i);
+		onion_poller_add(p, slot);
+	}
+	
+	onion_poller_poll(p);
+	FAIL_IF_NOT(shutdown_at[1]<=shutdown_at[2]);
+	FAIL_IF_NOT(shutdown_at[2]<=shutdown_at[0]);
+	FAIL_IF(shutdown_at[0]-shutdown_at[1]<150);
+	
+	for (i=0;i<3;i++){
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+	onion_poller_free(p);
+	
+	END_LOCAL();
+}
+
+static int read_and_close(void *fd){
+	char c;
+	if (read((intptr_t)fd, &c, 1)!=1)
+		ONION_ERROR("Could not read from pipe");
+	return -1;
+}
+
+void t03_adaptive_batches(){
+	INIT_LOCAL();
+	
+	onion_poller *p=onion_poller_new(8);
+	onion_poller_set_max_events(p, 2, 64);
+	int fds[32][2];
+	int i;
+	for (i=0;i<32;i++){
+		FAIL_IF(pipe(fds[i])<0);
+		FAIL_IF(write(fds[i][1], "x", 1)!=1);
+		onion_poller_add(p, onion_poller_slot_new(fds[i][0], read_and_close, (void*)(intptr_t)fds[i][0]));
+	}
+	
+	onion_poller_poll(p); // Batches of 2, 4, 8, 16, and the rest.
+	unsigned long wakeups, events;
+	onion_poller_get_event_stats(p, &wakeups, &events);
+	ONION_INFO("%lu events in %lu wakeups", events, wakeups);
+	FAIL_IF_NOT_EQUAL_INT(events, 32);
+	FAIL_IF(wakeups<1);
+	FAIL_IF(wakeups>6);
+	
+	for (i=0;i<32;i++){
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+	onion_poller_free(p);
+	
+	END_LOCAL();
+}
+
+char stall_message[256];
+
+/// Keeps the warnings, as the stalls.
+static void keep_warnings(onion_log_level level, const char *filename, int lineno, const char *fmt, ...){
+	if (level!=O_WARNING)
+		return;
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(stall_message, sizeof(stall_message), fmt, ap);
+	va_end(ap);
+}
+
+/// Holds the poller thread, as a blocking handler would.
+static int slow_read(void *fd){
+	onion_poller_note_handler((void*)slow_read, NULL);
+	usleep(60000);
+	return read_and_close(fd);
+}
+
+/// The wait and callback times, and the callbacks over the threshold are logged with the handler.
+void t04_profiling(){
+	INIT_LOCAL();
+	
+	onion_poller *p=onion_poller_new(8);
+	onion_poller_profile profile;
+	onion_poller_get_profile(p, &profile);
+	FAIL_IF_NOT_EQUAL_INT(profile.callbacks_us, 0);
+	onion_poller_set_profiling(p, 30);
+	int fds[3][2];
+	int i;
+	for (i=0;i<3;i++){
+		FAIL_IF(pipe(fds[i])<0);
+		FAIL_IF(write(fds[i][1], "x", 1)!=1);
+		onion_poller_add(p, onion_poller_slot_new(fds[i][0], i==1 ? slow_read : read_and_close, (void*)(intptr_t)fds[i][0]));
+	}
+	
+	stall_message[0]='\0';
+	onion_log=keep_warnings;
+	onion_poller_poll(p);
+	onion_log=onion_log_stderr;
+	
+	onion_poller_get_profile(p, &profile);
+	FAIL_IF_NOT_EQUAL_INT(profile.stalls, 1);
+	FAIL_IF(profile.max_callback_us<60000);
+	FAIL_IF(profile.callbacks_us<profile.max_callback_us);
+	char expected[64];
+	snprintf(expected, sizeof(expected), "fd %d,", fds[1][0]);
+	FAIL_IF_NOT(strstr(stall_message, expected));
+	snprintf(expected, sizeof(expected), "handler %p", (void*)slow_read);
+	FAIL_IF_NOT(strstr(stall_message, expected));
+	
+	for (i=0;i<3;i++){
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+	onion_poller_free(p);
+	
+	END_LOCAL();
+}
+
+static int64_t idle_at;
+
+static void set_idle_time(void *_){
+	idle_at=now_ms();
+}
+
+/// The idle function goes once before the timeout, that stays where it was.
+void t05_idle(){
+	INIT_LOCAL();
+	
+	onion_poller *p=onion_poller_new(8);
+	int fds[2];
+	FAIL_IF(pipe(fds)<0);
+	
+	onion_poller_slot *slot=onion_poller_slot_new(fds[0], never_called, NULL);
+	onion_poller_slot_set_timeout(slot, 300);
+	onion_poller_slot_set_idle(slot, 100, set_idle_time, NULL);
+	onion_poller_slot_set_shutdown(slot, set_shutdown_time, (void*)0);
+	onion_poller_add(p, slot);
+	
+	int64_t start=now_ms();
+	onion_poller_poll(p);
+	ONION_INFO("Idle after %d ms, timeout after %d ms", (int)(idle_at-start), (int)(shutdown_at[0]-start));
+	FAIL_IF(idle_at-start<90);
+	FAIL_IF(idle_at-start>250);
+	FAIL_IF(shutdown_at[0]-start<290);
+	FAIL_IF(shutdown_at[0]-start>700);
+	
+	close(fds[0]);
+	close(fds[1]);
+	onion_poller_free(p);
+	
+	END_LOCAL();
+}
+
+static char received[64];
+
+/// Polled slot, as the poller can not receive: reads itself.
+static int read_data(void *fd){
+	ssize_t r=read((intptr_t)fd, received, sizeof(received)-1);
+	received[r>0 ? r : 0]='\0';
+	return -1;
+}
+
+static int receive_data(void *_, const char *data, size_t len){
+	memcpy(received, data, len);
+	received[len]='\0';
+	return -1;
+}
+
+static int accepted_fd;
+
+/// Polled listen slot, as the poller can not accept: accepts itself.
+static int accept_connection(void *fd){
+	accepted_fd=accept((intptr_t)fd, NULL, NULL);
+	return -1;
+}
+
+static int connection_accepted(void *_, int fd){
+	accepted_fd=fd;
+	return -1;
+}
+
+/// Received and accepted by the poller if it can, and the last data sent with the close.
+void t06_recv_accept_send_close(){
+	INIT_LOCAL();
+	
+	onion_poller *p=onion_poller_new(8);
+	int fds[2];
+	FAIL_IF(socketpair(AF_UNIX, SOCK_STREAM, 0, fds)<0);
+	onion_poller_slot *slot=onion_poller_slot_new(fds[0], read_data, (void*)(intptr_t)fds[0]);
+	int can_recv=(onion_poller_slot_set_recv(slot, receive_data)==0);
+	onion_poller_add(p, slot);
+	FAIL_IF_NOT_EQUAL_INT(write(fds[1], "Hello", 5), 5);
+	onion_poller_poll(p);
+	ONION_INFO("Received at the poller: %d", can_recv);
+	FAIL_IF_NOT_EQUAL_STR(received, "Hello");
+	
+	int listenfd=socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	socklen_t len=sizeof(addr);
+	FAIL_IF(bind(listenfd, (struct sockaddr*)&addr, sizeof(addr))<0);
+	FAIL_IF(listen(listenfd, 8)<0);
+	FAIL_IF(getsockname(listenfd, (struct sockaddr*)&addr, &len)<0);
+	slot=onion_poller_slot_new(listenfd, accept_connection, (void*)(intptr_t)listenfd);
+	int can_accept=(onion_poller_slot_set_accept(slot, connection_accepted)==0);
+	onion_poller_add(p, slot);
+	int clientfd=socket(AF_INET, SOCK_STREAM, 0);
+	FAIL_IF(connect(clientfd, (struct sockaddr*)&addr, sizeof(addr))<0);
+	accepted_fd=-1;
+	onion_poller_poll(p);
+	ONION_INFO("Accepted at the poller: %d", can_accept);
+	FAIL_IF(accepted_fd<0);
+	
+	if (onion_poller_can_send_close(p)){
+		FAIL_IF_NOT_EQUAL_INT(onion_poller_send_close(p, accepted_fd, "Bye", 3), 0);
+		char data[8];
+		ssize_t r, pos=0;
+		while ( (r=read(clientfd, data+pos, sizeof(data)-pos-1)) > 0 )
+			pos+=r;
+		data[pos]='\0';
+		FAIL_IF_NOT_EQUAL_STR(data, "Bye"); // And then closed
+	}
+	else{
+		FAIL_IF_EQUAL_INT(onion_poller_send_close(p, accepted_fd, "Bye", 3), 0);
+		close(accepted_fd);
+	}
+	
+	close(clientfd);
+	close(fds[1]);
+	onion_poller_free(p);
+	
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	
+	t01_ms_timeout();
+	t02_timeouts_in_order();
+	t03_adaptive_batches();
+	t04_profiling();
+	t05_idle();
+	t06_recv_accept_send_close();
+	
+	END();
+}
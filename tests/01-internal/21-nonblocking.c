@@ -0,0 +1,242 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/response.h>
+#include <onion/shortcuts.h>
+
+#include "../ctest.h"
+
+#define BIG_SIZE (16*1024*1024)
+
+onion *o;
+const char *port;
+char bigfile[]="/tmp/onion-nonblocking-XXXXXX";
+
+int connect_to(const char *addr, const char *port){
+  struct addrinfo hints;
+  struct addrinfo *server;
+
+  memset(&hints,0, sizeof(struct addrinfo));
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+  if (getaddrinfo(addr,port,&hints,&server)<0){
+    ONION_ERROR("Error getting server info");
+    return -1;
+  }
+  int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+  if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+    close(fd);
+    fd=-1;
+    ONION_ERROR("Error connecting to server %s:%s",addr,port);
+  }
+
+  freeaddrinfo(server);
+
+  return fd;
+}
+
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	const char *path=onion_request_get_path(req);
+	if (strcmp(path, "big")==0){
+		char data[4096];
+		memset(data, 'a', sizeof(data));
+		int i;
+		onion_response_set_length(res, BIG_SIZE);
+		for (i=0;i<BIG_SIZE/sizeof(data);i++)
+			onion_response_write(res, data, sizeof(data));
+		return OCS_PROCESSED;
+	}
+	if (strcmp(path, "file")==0)
+		return onion_shortcut_response_file(bigfile, req, res);
+	onion_response_write0(res, "Hello");
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+/// Current monotonic time, in milliseconds.
+static long now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/// Asks for the path, and returns the fd without reading anything
+int request(const char *path){
+	int fd=connect_to("localhost",port);
+	if (fd<0)
+		return fd;
+	char get[256];
+	snprintf(get, sizeof(get), "GET /%s HTTP/1.0\r\n\r\n", path);
+	if (write(fd, get, strlen(get)) != strlen(get)){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/// Reads all response, and returns the body size. On the way, counts 'a's at body.
+ssize_t read_body(int fd, ssize_t *as){
+	static char buffer[64*1024];
+	ssize_t r, total=0, body=-1;
+	*as=0;
+	while ( (r=read(fd, buffer, sizeof(buffer)-1)) > 0 ){
+		buffer[r]=0;
+		int start=0;
+		if (body<0){
+			char *p=strstr(buffer, "\r\n\r\n");
+			if (p){
+				start=(p-buffer)+4;
+				body=0;
+			}
+		}
+		if (body>=0){
+			int i;
+			for (i=start;i<r;i++)
+				if (buffer[i]=='a')
+					(*as)++;
+			body+=r-start;
+		}
+		total+=r;
+	}
+	close(fd);
+	return body;
+}
+
+/// A client that does not read must not block the only thread from serving others.
+void t01_slow_reader(const char *path){
+	INIT_LOCAL();
+
+	int slowfd=request(path);
+	FAIL_IF( slowfd < 0 );
+	usleep(500000);
+
+	long t0=now_ms();
+	int fastfd=request("");
+	FAIL_IF( fastfd < 0 );
+	char buffer[1024];
+	memset(buffer, 0, sizeof(buffer));
+	ssize_t r, pos=0;
+	while ( (r=read(fastfd, buffer+pos, sizeof(buffer)-pos-1)) > 0 )
+		pos+=r;
+	close(fastfd);
+	long t=now_ms()-t0;
+	ONION_INFO("Fast client served in %ld ms while slow one waits", t);
+	FAIL_IF_NOT_STRSTR(buffer, "Hello");
+	FAIL_IF( t > 1000 );
+
+	ssize_t as;
+	ssize_t size=read_body(slowfd, &as);
+	FAIL_IF_NOT_EQUAL_INT(size, BIG_SIZE);
+	FAIL_IF_NOT_EQUAL_INT(as, BIG_SIZE);
+
+	END_LOCAL();
+}
+
+/// A request pipelined after a file is answered after all the file.
+void t02_pipelined_after_file(){
+	INIT_LOCAL();
+
+	int fd=connect_to("localhost",port);
+	FAIL_IF( fd < 0 );
+	const char *get="GET /file HTTP/1.1\r\n\r\nGET /hello HTTP/1.0\r\n\r\n";
+	FAIL_IF_NOT_EQUAL_INT(write(fd, get, strlen(get)), strlen(get));
+	
+	size_t size=BIG_SIZE+4096, pos=0;
+	char *buffer=malloc(size+1);
+	ssize_t r;
+	while ( pos<size && (r=read(fd, buffer+pos, size-pos)) > 0 )
+		pos+=r;
+	close(fd);
+	buffer[pos]=0;
+	
+	char *body=strstr(buffer, "\r\n\r\n");
+	FAIL_IF_EQUAL(body, NULL);
+	if (body){
+		body+=4;
+		FAIL_IF( buffer+pos-body < BIG_SIZE );
+		size_t i, as=0;
+		for (i=0;i<BIG_SIZE && body+i<buffer+pos;i++)
+			if (body[i]=='a')
+				as++;
+		FAIL_IF_NOT_EQUAL_INT(as, BIG_SIZE);
+		if (buffer+pos-body >= BIG_SIZE){
+			FAIL_IF_NOT_STRSTR(body+BIG_SIZE, " 200 OK");
+			FAIL_IF_NOT_EQUAL_STR(buffer+pos-5, "Hello");
+		}
+	}
+	free(buffer);
+
+	END_LOCAL();
+}
+
+void run_server(int flags, const char *_port){
+	port=_port;
+	o=onion_new(flags);
+	onion_set_max_threads(o, 1);
+	onion_set_port(o, port);
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	sleep(1);
+
+	if (flags&O_NONBLOCKING)
+		t01_slow_reader("big");
+	t01_slow_reader("file"); // Without O_NONBLOCKING, big files are sent in slices too.
+	t02_pipelined_after_file();
+
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+}
+
+int main(int argc, char **argv){
+	START();
+
+	int fd=mkstemp(bigfile);
+	char data[4096];
+	memset(data, 'a', sizeof(data));
+	int i;
+	for (i=0;i<BIG_SIZE/sizeof(data);i++)
+		if (write(fd, data, sizeof(data))!=sizeof(data))
+			ONION_ERROR("Could not write test file");
+	close(fd);
+
+	run_server(O_POOL|O_NONBLOCKING, "8082");
+	run_server(O_POLL, "8093");
+	unlink(bigfile);
+
+	END();
+}
@@ -0,0 +1,218 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/response.h>
+#include <onion/stats.h>
+
+#include "../ctest.h"
+
+onion *o;
+
+int connect_to(const char *addr, const char *port){
+  struct addrinfo hints;
+  struct addrinfo *server;
+
+  memset(&hints,0, sizeof(struct addrinfo));
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+  if (getaddrinfo(addr,port,&hints,&server)<0){
+    ONION_ERROR("Error getting server info");
+    return -1;
+  }
+  int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+  if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+    close(fd);
+    fd=-1;
+    ONION_ERROR("Error connecting to server %s:%s",addr,port);
+  }
+
+  freeaddrinfo(server);
+
+  return fd;
+}
+
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	if (strcmp(onion_request_get_path(req), "slow")==0)
+		usleep(500000);
+	onion_response_set_length(res, 5);
+	onion_response_write0(res, "Hello");
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+/// Current monotonic time, in milliseconds.
+static long now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/// Sends the request.
+int request(int fd, const char *path){
+	char get[256];
+	snprintf(get, sizeof(get), "GET /%s HTTP/1.1\r\n\r\n", path);
+	return write(fd, get, strlen(get)) == strlen(get);
+}
+
+/// Reads one response, that ends in Hello
+int read_hello(int fd){
+	char buffer[1024];
+	memset(buffer, 0, sizeof(buffer));
+	ssize_t r, pos=0;
+	while ( (r=read(fd, buffer+pos, sizeof(buffer)-pos-1)) > 0 ){
+		pos+=r;
+		if (strstr(buffer, "Hello"))
+			return 1;
+	}
+	return 0;
+}
+
+/// Slow handlers run at the workers, so the only poller thread keeps serving.
+void t01_slow_handlers(){
+	INIT_LOCAL();
+
+	int slowfd[3];
+	int i;
+	for (i=0;i<3;i++){
+		slowfd[i]=connect_to("localhost","8083");
+		FAIL_IF( slowfd[i] < 0 );
+		FAIL_IF_NOT( request(slowfd[i], "slow") );
+	}
+	usleep(100000);
+
+	long t0=now_ms();
+	int fastfd=connect_to("localhost","8083");
+	FAIL_IF( fastfd < 0 );
+	FAIL_IF_NOT( request(fastfd, "") );
+	FAIL_IF_NOT( read_hello(fastfd) );
+	long t=now_ms()-t0;
+	ONION_INFO("Fast request served in %ld ms", t);
+	FAIL_IF( t > 300 );
+
+	// Connection is back at the poller, keep alive works.
+	FAIL_IF_NOT( request(fastfd, "") );
+	FAIL_IF_NOT( read_hello(fastfd) );
+	close(fastfd);
+
+	for (i=0;i<3;i++){
+		FAIL_IF_NOT( read_hello(slowfd[i]) );
+		FAIL_IF_NOT( request(slowfd[i], "slow") );
+		FAIL_IF_NOT( read_hello(slowfd[i]) );
+		close(slowfd[i]);
+	}
+
+	END_LOCAL();
+}
+
+/// Starts with one worker, grows one per busy request, and goes back to one when idle.
+void t02_autoscale(){
+	INIT_LOCAL();
+
+	onion *server=onion_new(O_POOL|O_DETACH_LISTEN);
+	onion_set_max_threads(server, 1);
+	onion_set_workers(server, 6, 16);
+	onion_set_workers_autoscale(server, 1, 200);
+	onion_set_port(server, "8149");
+	onion_set_root_handler(server, onion_handler_new(handler, NULL, NULL));
+	FAIL_IF(onion_listen(server));
+	usleep(100000);
+
+	onion_stats stats;
+	onion_get_stats(server, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.workers, 1);
+	FAIL_IF_NOT_EQUAL_INT(stats.workers_started, 0);
+
+	int slowfd[4];
+	int i;
+	for (i=0;i<4;i++){
+		slowfd[i]=connect_to("localhost","8149");
+		FAIL_IF( slowfd[i] < 0 );
+		FAIL_IF_NOT( request(slowfd[i], "slow") );
+	}
+	usleep(200000);
+	onion_get_stats(server, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.workers, 4);
+	FAIL_IF_NOT_EQUAL_INT(stats.workers_busy, 4);
+	FAIL_IF_NOT_EQUAL_INT(stats.workers_queued, 0);
+	FAIL_IF_NOT_EQUAL_INT(stats.workers_started, 3);
+	for (i=0;i<4;i++){
+		FAIL_IF_NOT( read_hello(slowfd[i]) );
+		close(slowfd[i]);
+	}
+
+	for (i=0;i<100;i++){ // The three over the minimum retire after 200 ms idle
+		onion_get_stats(server, &stats);
+		if (stats.workers==1)
+			break;
+		usleep(10000);
+	}
+	FAIL_IF_NOT_EQUAL_INT(stats.workers, 1);
+	FAIL_IF_NOT_EQUAL_INT(stats.workers_retired, 3);
+	FAIL_IF_NOT_EQUAL_INT(stats.workers_peak, 4);
+
+	int fastfd=connect_to("localhost","8149"); // And the one left keeps serving
+	FAIL_IF_NOT( request(fastfd, "") );
+	FAIL_IF_NOT( read_hello(fastfd) );
+	close(fastfd);
+	onion_get_stats(server, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.workers_started, 3);
+
+	onion_free(server);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	o=onion_new(O_POOL);
+	onion_set_max_threads(o, 1);
+	onion_set_workers(o, 4, 16);
+	onion_set_port(o, "8083");
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	sleep(1);
+
+	t01_slow_handlers();
+
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+
+	t02_autoscale();
+
+	END();
+}
@@ -0,0 +1,168 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/response.h>
+#include <onion/request.h>
+
+#include "../ctest.h"
+
+onion *o;
+
+int connect_to(const char *addr, const char *port){
+  struct addrinfo hints;
+  struct addrinfo *server;
+
+  memset(&hints,0, sizeof(struct addrinfo));
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+  if (getaddrinfo(addr,port,&hints,&server)<0){
+    ONION_ERROR("Error getting server info");
+    return -1;
+  }
+  int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+  if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+    close(fd);
+    fd=-1;
+    ONION_ERROR("Error connecting to server %s:%s",addr,port);
+  }
+
+  freeaddrinfo(server);
+
+  return fd;
+}
+
+onion_request *suspended_req=NULL;
+onion_response *suspended_res=NULL;
+
+/// /suspend keeps the request, to be answered by another thread. Else answers now.
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	if (strcmp(onion_request_get_path(req), "suspend")==0){
+		suspended_res=res;
+		__sync_synchronize();
+		suspended_req=req;
+		return OCS_SUSPENDED;
+	}
+	onion_response_set_length(res, 5);
+	onion_response_write0(res, "Hello");
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+/// Sends the request.
+int request(int fd, const char *path){
+	char get[256];
+	snprintf(get, sizeof(get), "GET /%s HTTP/1.1\r\n\r\n", path);
+	return write(fd, get, strlen(get)) == strlen(get);
+}
+
+/// Reads one response, that ends in Hello
+int read_hello(int fd){
+	char buffer[1024];
+	memset(buffer, 0, sizeof(buffer));
+	ssize_t r, pos=0;
+	while ( (r=read(fd, buffer+pos, sizeof(buffer)-pos-1)) > 0 ){
+		pos+=r;
+		if (strstr(buffer, "Hello"))
+			return 1;
+	}
+	return 0;
+}
+
+/// Waits for the suspended request, and answers it from this thread.
+void *resume_thread_f(void *_){
+	while (!suspended_req)
+		usleep(10000);
+	usleep(200000);
+	__sync_synchronize();
+	onion_request *req=suspended_req;
+	onion_response *res=suspended_res;
+	suspended_req=NULL;
+	onion_response_set_length(res, 5);
+	onion_response_write0(res, "Hello");
+	onion_request_resume(req);
+	return NULL;
+}
+
+/// A suspended request does not block the only poller thread, and is answered from another thread.
+void t01_suspend(){
+	INIT_LOCAL();
+
+	pthread_t th;
+	pthread_create(&th, NULL, resume_thread_f, NULL);
+
+	int susfd=connect_to("localhost","8084");
+	FAIL_IF( susfd < 0 );
+	FAIL_IF_NOT( request(susfd, "suspend") );
+
+	// Served while the other is suspended
+	int fastfd=connect_to("localhost","8084");
+	FAIL_IF( fastfd < 0 );
+	FAIL_IF_NOT( request(fastfd, "") );
+	FAIL_IF_NOT( read_hello(fastfd) );
+	close(fastfd);
+
+	FAIL_IF_NOT( read_hello(susfd) );
+	pthread_join(th, NULL);
+
+	// Keep alive, and suspend again.
+	pthread_create(&th, NULL, resume_thread_f, NULL);
+	FAIL_IF_NOT( request(susfd, "suspend") );
+	FAIL_IF_NOT( read_hello(susfd) );
+	pthread_join(th, NULL);
+	FAIL_IF_NOT( request(susfd, "") );
+	FAIL_IF_NOT( read_hello(susfd) );
+	close(susfd);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	o=onion_new(O_POOL);
+	onion_set_max_threads(o, 1);
+	onion_set_port(o, "8084");
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	sleep(1);
+
+	t01_suspend();
+
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+
+	END();
+}
@@ -0,0 +1,145 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/response.h>
+#include <onion/listen_point.h>
+
+#include "../ctest.h"
+
+onion *o;
+
+int connect_to(const char *addr, const char *port){
+  struct addrinfo hints;
+  struct addrinfo *server;
+
+  memset(&hints,0, sizeof(struct addrinfo));
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+  if (getaddrinfo(addr,port,&hints,&server)<0){
+    ONION_ERROR("Error getting server info");
+    return -1;
+  }
+  int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+  if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+    close(fd);
+    fd=-1;
+    ONION_ERROR("Error connecting to server %s:%s",addr,port);
+  }
+
+  freeaddrinfo(server);
+
+  return fd;
+}
+
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	if (strcmp(onion_request_get_path(req), "slow")==0)
+		usleep(300000);
+	onion_response_set_length(res, 5);
+	onion_response_write0(res, "Hello");
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+/// Sends the request.
+int request(int fd, const char *path){
+	char get[256];
+	snprintf(get, sizeof(get), "GET /%s HTTP/1.1\r\n\r\n", path);
+	return write(fd, get, strlen(get)) == strlen(get);
+}
+
+/// Reads one response, that ends in Hello
+int read_hello(int fd){
+	char buffer[1024];
+	memset(buffer, 0, sizeof(buffer));
+	ssize_t r, pos=0;
+	while ( (r=read(fd, buffer+pos, sizeof(buffer)-pos-1)) > 0 ){
+		pos+=r;
+		if (strstr(buffer, "Hello"))
+			return 1;
+	}
+	return 0;
+}
+
+/// While the only thread is busy, several connections wait, and are accepted at the same wakeup.
+void t01_batch_accept(){
+	INIT_LOCAL();
+
+	int slowfd=connect_to("localhost","8085");
+	FAIL_IF( slowfd < 0 );
+	FAIL_IF_NOT( request(slowfd, "slow") );
+	usleep(100000);
+
+	int fd[4];
+	int i;
+	for (i=0;i<4;i++){
+		fd[i]=connect_to("localhost","8085");
+		FAIL_IF( fd[i] < 0 );
+		FAIL_IF_NOT( request(fd[i], "") );
+	}
+	FAIL_IF_NOT( read_hello(slowfd) );
+	for (i=0;i<4;i++){
+		FAIL_IF_NOT( read_hello(fd[i]) );
+		close(fd[i]);
+	}
+	close(slowfd);
+
+	unsigned long wakeups, accepted, full;
+	onion_listen_point_get_accept_stats(onion_get_listen_point(o, 0), &wakeups, &accepted, &full);
+	ONION_INFO("%lu connections accepted in %lu wakeups, %lu full", accepted, wakeups, full);
+	FAIL_IF_NOT_EQUAL_INT( accepted, 5 );
+	FAIL_IF( wakeups >= 5 );
+	FAIL_IF_NOT_EQUAL_INT( full, 0 );
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	o=onion_new(O_POLL);
+	onion_set_accept_budget(o, 8);
+	onion_set_port(o, "8085");
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	sleep(1);
+
+	t01_batch_accept();
+
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+
+	END();
+}
@@ -0,0 +1,132 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/response.h>
+#include <onion/listen_point.h>
+#include <onion/types_internal.h>
+
+#include "../ctest.h"
+
+onion *o;
+
+int connect_to(const char *addr, const char *port){
+  struct addrinfo hints;
+  struct addrinfo *server;
+
+  memset(&hints,0, sizeof(struct addrinfo));
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+  if (getaddrinfo(addr,port,&hints,&server)<0){
+    ONION_ERROR("Error getting server info");
+    return -1;
+  }
+  int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+  if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+    close(fd);
+    fd=-1;
+    ONION_ERROR("Error connecting to server %s:%s",addr,port);
+  }
+
+  freeaddrinfo(server);
+
+  return fd;
+}
+
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	onion_response_set_length(res, 5);
+	onion_response_write0(res, "Hello");
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+/// Gets an int socket option
+int getopt_int(int fd, int level, int name){
+	int value=0;
+	socklen_t len=sizeof(value);
+	if (getsockopt(fd, level, name, &value, &len)<0)
+		return -1;
+	return value;
+}
+
+/// Server defaults and listen point options are both applied, and connections still work.
+void t01_socket_options(){
+	INIT_LOCAL();
+
+	int listenfd=onion_get_listen_point(o, 0)->listenfd;
+	FAIL_IF( listenfd < 0 );
+	FAIL_IF_NOT_EQUAL_INT( getopt_int(listenfd, IPPROTO_TCP, TCP_NODELAY)!=0, 1 );
+	FAIL_IF( getopt_int(listenfd, SOL_SOCKET, SO_RCVBUF) < 65536 );
+#ifdef TCP_DEFER_ACCEPT
+	FAIL_IF( getopt_int(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT) <= 0 );
+#endif
+
+	int fd=connect_to("localhost","8086");
+	FAIL_IF( fd < 0 );
+	const char *get="GET / HTTP/1.1\r\n\r\n";
+	FAIL_IF_NOT_EQUAL_INT( write(fd, get, strlen(get)), strlen(get) );
+	char buffer[1024];
+	memset(buffer, 0, sizeof(buffer));
+	ssize_t r, pos=0;
+	while ( !strstr(buffer, "Hello") && (r=read(fd, buffer+pos, sizeof(buffer)-pos-1)) > 0 )
+		pos+=r;
+	FAIL_IF_NOT_STRSTR( buffer, "Hello" );
+	close(fd);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	o=onion_new(O_POLL);
+	onion_socket_options defaults={ .backlog=128, .nodelay=1, .rcvbuf=65536 };
+	onion_set_socket_options(o, &defaults);
+	onion_set_port(o, "8086");
+	onion_socket_options opts={ .defer_accept=1 };
+	onion_listen_point_set_socket_options(onion_get_listen_point(o, 0), &opts);
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	sleep(1);
+
+	t01_socket_options();
+
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+
+	END();
+}
@@ -0,0 +1,159 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/response.h>
+
+#include "../ctest.h"
+
+onion *o;
+
+int connect_to(const char *addr, const char *port){
+  struct addrinfo hints;
+  struct addrinfo *server;
+
+  memset(&hints,0, sizeof(struct addrinfo));
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+  if (getaddrinfo(addr,port,&hints,&server)<0){
+    ONION_ERROR("Error getting server info");
+    return -1;
+  }
+  int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+  if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+    close(fd);
+    fd=-1;
+    ONION_ERROR("Error connecting to server %s:%s",addr,port);
+  }
+
+  freeaddrinfo(server);
+
+  return fd;
+}
+
+/// Answers <path>
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	char tmp[64];
+	snprintf(tmp, sizeof(tmp), "<%s>", onion_request_get_path(req));
+	onion_response_set_length(res, strlen(tmp));
+	onion_response_write0(res, tmp);
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+/// Current monotonic time, in milliseconds.
+static long now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+int send_str(int fd, const char *str){
+	return write(fd, str, strlen(str)) == strlen(str);
+}
+
+/// Reads until the expected text is in the buffer, or timeout. The expected text is removed from the buffer.
+int read_until(int fd, char *buffer, size_t size, const char *expected, int timeout_ms){
+	long end=now_ms()+timeout_ms;
+	while (1){
+		char *p=strstr(buffer, expected);
+		if (p){
+			memmove(buffer, p+strlen(expected), strlen(p+strlen(expected))+1);
+			return 1;
+		}
+		long left=end-now_ms();
+		struct pollfd pfd={ fd, POLLIN, 0 };
+		if (left<=0 || poll(&pfd, 1, left)<=0)
+			return 0;
+		size_t l=strlen(buffer);
+		ssize_t r=read(fd, buffer+l, size-l-1);
+		if (r<=0)
+			return 0;
+		buffer[l+r]='\0';
+	}
+}
+
+/// Several requests in one write, all answered in order.
+void t01_pipelined(const char *port){
+	INIT_LOCAL();
+
+	char buffer[4096]={0};
+	int fd=connect_to("localhost", port);
+	FAIL_IF( fd < 0 );
+	FAIL_IF_NOT( send_str(fd, "GET /a HTTP/1.1\r\n\r\nGET /b HTTP/1.1\r\n\r\nGET /c HTTP/1.1\r\nHost: localhost\r\n\r\n") );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<a>", 2000) );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<b>", 2000) );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<c>", 2000) );
+
+	// The last one is not complete, the previous answer is sent anyway, not held.
+	FAIL_IF_NOT( send_str(fd, "GET /d HTTP/1.1\r\n\r\nGET /e HT") );
+	long t0=now_ms();
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<d>", 2000) );
+	FAIL_IF( now_ms()-t0 > 150 );
+	FAIL_IF_NOT( send_str(fd, "TP/1.1\r\n\r\nGET /f HTTP/1.0\r\n\r\n") );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<e>", 2000) );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<f>", 2000) );
+	close(fd);
+
+	END_LOCAL();
+}
+
+void run_server(int flags, int nworkers, const char *port){
+	o=onion_new(flags);
+	onion_set_max_threads(o, 1);
+	if (nworkers)
+		onion_set_workers(o, nworkers, 16);
+	onion_set_port(o, port);
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	usleep(200000);
+
+	t01_pipelined(port);
+
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+}
+
+int main(int argc, char **argv){
+	START();
+
+	run_server(O_POLL, 0, "8087");
+	run_server(O_POOL, 2, "8088"); // Pipelined requests wait while the previous is at a worker.
+	run_server(O_THREADED, 0, "8089");
+
+	END();
+}
@@ -0,0 +1,432 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/response.h>
+#include <onion/block.h>
+
+#include "../ctest.h"
+
+onion *o;
+
+/// What the body callback got, for the handler to answer it.
+typedef struct{
+	size_t total;
+	unsigned int sum;
+	int chunks;
+	int pause;
+	int end;
+}body_state;
+
+body_state last;
+
+int connect_to(const char *addr, const char *port){
+  struct addrinfo hints;
+  struct addrinfo *server;
+
+  memset(&hints,0, sizeof(struct addrinfo));
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+  if (getaddrinfo(addr,port,&hints,&server)<0){
+    ONION_ERROR("Error getting server info");
+    return -1;
+  }
+  int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+  if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+    close(fd);
+    fd=-1;
+    ONION_ERROR("Error connecting to server %s:%s",addr,port);
+  }
+
+  freeaddrinfo(server);
+
+  return fd;
+}
+
+void *resume_later(void *req){
+	usleep(5000);
+	onion_request_body_resume(req);
+	return NULL;
+}
+
+onion_connection_status body_callback(void *_state, onion_request *req, const char *data, size_t length){
+	body_state *state=_state;
+	if (!data){
+		state->end=1;
+		last=*state;
+		return OCS_NEED_MORE_DATA;
+	}
+	size_t i;
+	for (i=0;i<length;i++)
+		state->sum+=(unsigned char)data[i];
+	state->total+=length;
+	state->chunks++;
+	if (state->pause){
+		pthread_t th;
+		pthread_create(&th, NULL, resume_later, req);
+		pthread_detach(th);
+		return OCS_SUSPENDED;
+	}
+	return OCS_NEED_MORE_DATA;
+}
+
+/// Streams the bodies of /stream*, /stream-pause pausing at every chunk.
+void body_hook(void *_, onion_request *req){
+	const char *path=onion_request_get_fullpath(req);
+	if (strncmp(path, "/stream", 7)!=0)
+		return;
+	body_state *state=calloc(1, sizeof(body_state));
+	state->pause=(strcmp(path, "/stream-pause")==0);
+	onion_request_set_body_callback(req, body_callback, state, free);
+}
+
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	char tmp[128];
+	if (strncmp(onion_request_get_fullpath(req), "/stream", 7)==0)
+		snprintf(tmp, sizeof(tmp), "<%ld %u %d %s>", (long)last.total, last.sum, last.end, onion_request_get_post_dict(req) ? "post" : "nopost");
+	else if (onion_request_get_file(req, "filename")){
+		struct stat st;
+		stat(onion_request_get_file(req, "filename"), &st);
+		snprintf(tmp, sizeof(tmp), "<%s file %ld>", onion_request_get_path(req), (long)st.st_size);
+	}
+	else if (onion_request_get_data(req))
+		snprintf(tmp, sizeof(tmp), "<%s data %s>", onion_request_get_path(req), onion_block_data(onion_request_get_data(req)));
+	else
+		snprintf(tmp, sizeof(tmp), "<%s %s>", onion_request_get_path(req), onion_request_get_post(req, "a") ? onion_request_get_post(req, "a") : "-");
+	memset(&last, 0, sizeof(last));
+	onion_response_set_length(res, strlen(tmp));
+	onion_response_write0(res, tmp);
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+/// Current monotonic time, in milliseconds.
+static long now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+int send_all(int fd, const char *data, size_t length){
+	while (length){
+		ssize_t w=write(fd, data, length);
+		if (w<=0)
+			return 0;
+		data+=w;
+		length-=w;
+	}
+	return 1;
+}
+
+int send_str(int fd, const char *str){
+	return send_all(fd, str, strlen(str));
+}
+
+/// Reads until the expected text is in the buffer, or timeout. The expected text is removed from the buffer.
+int read_until(int fd, char *buffer, size_t size, const char *expected, int timeout_ms){
+	long end=now_ms()+timeout_ms;
+	while (1){
+		char *p=strstr(buffer, expected);
+		if (p){
+			memmove(buffer, p+strlen(expected), strlen(p+strlen(expected))+1);
+			return 1;
+		}
+		long left=end-now_ms();
+		struct pollfd pfd={ fd, POLLIN, 0 };
+		if (left<=0 || poll(&pfd, 1, left)<=0)
+			return 0;
+		size_t l=strlen(buffer);
+		ssize_t r=read(fd, buffer+l, size-l-1);
+		if (r<=0)
+			return 0;
+		buffer[l+r]='\0';
+	}
+}
+
+/// Sends a POST with a body of length bytes, and the next request right after, in one write.
+int send_post(int fd, const char *path, size_t length, unsigned int *sum){
+	onion_block *req=onion_block_new();
+	char tmp[128];
+	snprintf(tmp, sizeof(tmp), "POST %s HTTP/1.1\r\nContent-Type: application/octet-stream\r\nContent-Length: %ld\r\n\r\n", path, (long)length);
+	onion_block_add_str(req, tmp);
+	size_t i;
+	*sum=0;
+	for (i=0;i<length;i++){
+		char c='a'+i%26;
+		*sum+=(unsigned char)c;
+		onion_block_add_char(req, c);
+	}
+	onion_block_add_str(req, "GET /next HTTP/1.1\r\n\r\n");
+	int ok=send_all(fd, onion_block_data(req), onion_block_size(req));
+	onion_block_free(req);
+	return ok;
+}
+
+/// The body goes to the callback, not kept, and the next requests are parsed.
+void t01_stream(const char *port){
+	INIT_LOCAL();
+
+	char buffer[4096]={0};
+	char expected[128];
+	unsigned int sum;
+	int fd=connect_to("localhost", port);
+	FAIL_IF( fd < 0 );
+	FAIL_IF_NOT( send_post(fd, "/stream", 200000, &sum) );
+	snprintf(expected, sizeof(expected), "<200000 %u 1 nopost>", sum);
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), expected, 5000) );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<next ->", 2000) );
+
+	// Not streamed by the hook, as usual.
+	FAIL_IF_NOT( send_str(fd, "POST /form HTTP/1.1\r\nContent-Type: application/x-www-form-urlencoded\r\nContent-Length: 3\r\n\r\na=b") );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<form b>", 2000) );
+
+	// Body in pieces, separated in time
+	FAIL_IF_NOT( send_str(fd, "PUT /stream HTTP/1.1\r\nContent-Length: 6\r\n\r\nab") );
+	usleep(20000);
+	FAIL_IF_NOT( send_str(fd, "cd") );
+	usleep(20000);
+	FAIL_IF_NOT( send_str(fd, "ef") );
+	snprintf(expected, sizeof(expected), "<6 %u 1 nopost>", 'a'+'b'+'c'+'d'+'e'+'f');
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), expected, 2000) );
+	close(fd);
+
+	END_LOCAL();
+}
+
+/// The callback pauses at every chunk, and it is resumed from another thread.
+void t02_stream_pause(const char *port){
+	INIT_LOCAL();
+
+	char buffer[4096]={0};
+	char expected[128];
+	unsigned int sum;
+	int fd=connect_to("localhost", port);
+	FAIL_IF( fd < 0 );
+	FAIL_IF_NOT( send_post(fd, "/stream-pause", 300000, &sum) );
+	snprintf(expected, sizeof(expected), "<300000 %u 1 nopost>", sum);
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), expected, 10000) );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<next ->", 2000) );
+
+	FAIL_IF_NOT( send_post(fd, "/stream-pause", 1, &sum) );
+	snprintf(expected, sizeof(expected), "<1 %u 1 nopost>", sum);
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), expected, 2000) );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<next ->", 2000) );
+	close(fd);
+
+	END_LOCAL();
+}
+
+/// Transfer-Encoding: chunked bodies, streamed and kept.
+void t03_chunked(const char *port){
+	INIT_LOCAL();
+
+	char buffer[4096]={0};
+	char expected[128];
+	int fd=connect_to("localhost", port);
+	FAIL_IF( fd < 0 );
+	unsigned int sum='a'*3+'b'*2+'c'*10;
+	FAIL_IF_NOT( send_str(fd, "POST /stream-pause HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 1000\r\n\r\n3\r\naaa\r\n2;ext=1\r\nbb\r\n") );
+	usleep(20000);
+	FAIL_IF_NOT( send_str(fd, "A\r\ncccc") );
+	usleep(20000);
+	FAIL_IF_NOT( send_str(fd, "cccccc\r\n0\r\nTrailer: ignored\r\n\r\nGET /next HTTP/1.1\r\n\r\n") );
+	snprintf(expected, sizeof(expected), "<15 %u 1 nopost>", sum);
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), expected, 2000) );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<next ->", 2000) );
+
+	// No body callback
+	FAIL_IF_NOT( send_str(fd, "POST /form HTTP/1.1\r\nContent-Type: application/x-www-form-urlencoded\r\nTransfer-Encoding: chunked\r\n\r\n2\r\na=\r\n3\r\nxyz\r\n0\r\n\r\n") );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<form xyz>", 2000) );
+	FAIL_IF_NOT( send_str(fd, "PUT /put HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\n12345\r\n1\r\n6\r\n0\r\n\r\n") );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<put file 6>", 2000) );
+	FAIL_IF_NOT( send_str(fd, "PROPFIND /data HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n4\r\n<a/>\r\n0\r\n\r\n") );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<data data <a/>>", 2000) );
+
+	// Bad chunk size closes the connection
+	FAIL_IF_NOT( send_str(fd, "PUT /stream HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n") );
+	FAIL_IF( read_until(fd, buffer, sizeof(buffer), ">", 1000) );
+	close(fd);
+
+	// Over the limit, as with Content-Length
+	onion_set_max_post_size(o, 16);
+	fd=connect_to("localhost", port);
+	FAIL_IF( fd < 0 );
+	FAIL_IF_NOT( send_str(fd, "POST /form HTTP/1.1\r\nContent-Type: application/x-www-form-urlencoded\r\nTransfer-Encoding: chunked\r\n\r\n"
+	                          "a\r\na=01234567\r\na\r\n0123456789\r\n0\r\n\r\n") );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), " 413 ", 2000) );
+	close(fd);
+	onion_set_max_post_size(o, 1024*1024);
+
+	END_LOCAL();
+}
+
+#ifdef HAVE_ZLIB
+/// Compresses the data, gzip or zlib as deflate, to a new block.
+onion_block *compress_block(const char *data, size_t length, int gzip){
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, gzip ? 15+16 : 15, 8, Z_DEFAULT_STRATEGY);
+	onion_block *ret=onion_block_new();
+	char out[4096];
+	z.next_in=(Bytef*)data;
+	z.avail_in=length;
+	int r;
+	do{
+		z.next_out=(Bytef*)out;
+		z.avail_out=sizeof(out);
+		r=deflate(&z, Z_FINISH);
+		onion_block_add_data(ret, out, sizeof(out)-z.avail_out);
+	}while (r==Z_OK);
+	deflateEnd(&z);
+	return ret;
+}
+
+/// Sends a request with the body compressed, with Content-Length, or in two chunks.
+int send_compressed(int fd, const char *head, const char *data, size_t length, int gzip, int chunked){
+	onion_block *body=compress_block(data, length, gzip);
+	size_t size=onion_block_size(body);
+	char tmp[512];
+	int ok;
+	if (chunked){
+		snprintf(tmp, sizeof(tmp), "%sContent-Encoding: %s\r\nTransfer-Encoding: chunked\r\n\r\n%lx\r\n", head, gzip ? "gzip" : "deflate", (long)size/2);
+		ok=send_str(fd, tmp) && send_all(fd, onion_block_data(body), size/2);
+		snprintf(tmp, sizeof(tmp), "\r\n%lx\r\n", (long)(size-size/2));
+		ok=ok && send_str(fd, tmp) && send_all(fd, onion_block_data(body)+size/2, size-size/2) && send_str(fd, "\r\n0\r\n\r\n");
+	}
+	else{
+		snprintf(tmp, sizeof(tmp), "%sContent-Encoding: %s\r\nContent-Length: %ld\r\n\r\n", head, gzip ? "gzip" : "deflate", (long)size);
+		ok=send_str(fd, tmp) && send_all(fd, onion_block_data(body), size);
+	}
+	onion_block_free(body);
+	return ok;
+}
+
+/// Bodies with Content-Encoding are decoded as read, to each consumer, up to the inflate limit.
+void t04_inflate(const char *port){
+	INIT_LOCAL();
+
+	char buffer[4096]={0};
+	char expected[128];
+	int fd=connect_to("localhost", port);
+	FAIL_IF( fd < 0 );
+
+	// Streamed, pausing at each decoded piece, with a body that decodes into many.
+	size_t length=300000, i;
+	char *data=malloc(length);
+	unsigned int sum=0;
+	for (i=0;i<length;i++){
+		data[i]='a'+i%26;
+		sum+=(unsigned char)data[i];
+	}
+	FAIL_IF_NOT( send_compressed(fd, "POST /stream-pause HTTP/1.1\r\n", data, length, 1, 0) );
+	snprintf(expected, sizeof(expected), "<300000 %u 1 nopost>", sum);
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), expected, 10000) );
+	FAIL_IF_NOT( send_compressed(fd, "POST /stream HTTP/1.1\r\n", data, length, 0, 1) );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), expected, 10000) );
+
+	// Kept
+	FAIL_IF_NOT( send_compressed(fd, "POST /form HTTP/1.1\r\nContent-Type: application/x-www-form-urlencoded\r\n", "a=hello", 7, 1, 0) );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<form hello>", 2000) );
+	FAIL_IF_NOT( send_compressed(fd, "POST /form HTTP/1.1\r\n", "a=chunks", 8, 1, 1) );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<form chunks>", 2000) );
+	FAIL_IF_NOT( send_compressed(fd, "POST /data HTTP/1.1\r\nContent-Type: application/json\r\n", "{\"a\":1}", 7, 0, 0) );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<data data {\"a\":1}>", 2000) );
+	FAIL_IF_NOT( send_compressed(fd, "PUT /put HTTP/1.1\r\n", data, length, 1, 0) );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<put file 300000>", 2000) );
+	const char *multipart="--B\r\nContent-Disposition: form-data; name=\"filename\"; filename=\"f.txt\"\r\n\r\n12345\r\n--B--\r\n";
+	FAIL_IF_NOT( send_compressed(fd, "POST /mp HTTP/1.1\r\nContent-Type: multipart/form-data; boundary=B\r\n", multipart, strlen(multipart), 1, 0) );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<mp file 5>", 2000) );
+	multipart="--B\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\nfield\r\n--B--\r\n";
+	FAIL_IF_NOT( send_compressed(fd, "POST /mp HTTP/1.1\r\nContent-Type: multipart/form-data; boundary=B\r\n", multipart, strlen(multipart), 1, 0) );
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), "<mp field>", 2000) );
+
+	// A small body that decodes into more than the limit is rejected.
+	char *zeros=calloc(1, 4*1024*1024);
+	FAIL_IF_NOT( send_compressed(fd, "POST /stream HTTP/1.1\r\n", zeros, 4*1024*1024, 1, 0) );
+	free(zeros);
+	FAIL_IF_NOT( read_until(fd, buffer, sizeof(buffer), " 413 ", 2000) );
+	close(fd);
+
+	// As a broken one.
+	fd=connect_to("localhost", port);
+	FAIL_IF( fd < 0 );
+	FAIL_IF_NOT( send_str(fd, "POST /stream HTTP/1.1\r\nContent-Encoding: gzip\r\nContent-Length: 10\r\n\r\n0123456789") );
+	FAIL_IF( read_until(fd, buffer, sizeof(buffer), ">", 1000) );
+	close(fd);
+	free(data);
+
+	END_LOCAL();
+}
+#endif
+
+void run_server(int flags, int nworkers, const char *port){
+	o=onion_new(flags);
+	onion_set_max_threads(o, 1);
+	if (nworkers)
+		onion_set_workers(o, nworkers, 16);
+	onion_set_port(o, port);
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+	onion_set_request_body_hook(o, body_hook, NULL);
+	onion_set_request_inflate(o, 1024*1024);
+
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	usleep(200000);
+
+	t01_stream(port);
+	t02_stream_pause(port);
+	t03_chunked(port);
+#ifdef HAVE_ZLIB
+	t04_inflate(port);
+#endif
+
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+}
+
+int main(int argc, char **argv){
+	START();
+	signal(SIGPIPE, SIG_IGN); // Rejected bodies may be still being sent.
+
+	run_server(O_POLL, 0, "8090");
+	run_server(O_POOL, 2, "8091");
+
+	END();
+}
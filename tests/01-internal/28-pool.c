@@ -0,0 +1,340 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <onion/onion.h>
+#include <onion/dict.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/block.h>
+#include <onion/log.h>
+#include <onion/url.h>
+#include <stdint.h>
+
+#include "../../src/onion/pool.h"
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+#ifndef __SANITIZE_ADDRESS__
+/// Counts the allocations of the library, when counting is set. glibc allows to replace malloc this way.
+#define COUNT_MALLOCS 1
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+int counting=0;
+long nallocs=0;
+
+void *malloc(size_t size){
+	if (counting)
+		nallocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size){
+	if (counting)
+		nallocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size){
+	if (counting)
+		nallocs++;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+onion *server;
+onion_listen_point *custom_io;
+
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	const char *q=onion_request_get_query(req, "q");
+	onion_response_set_length(res, 2);
+	onion_response_write(res, q ? q : "--", 2);
+	return OCS_PROCESSED;
+}
+
+/// Uses the cookies and scratch memory, both at the request arena.
+onion_connection_status arena_handler(void *_, onion_request *req, onion_response *res){
+	const char *cookie=onion_request_get_cookie(req, "c");
+	char *scratch=onion_request_alloc(req, 128);
+	snprintf(scratch, 128, "%s", onion_request_get_query(req, "q"));
+	if (!cookie || strcmp(cookie, "d")!=0)
+		return OCS_INTERNAL_ERROR;
+	onion_response_set_length(res, 2);
+	onion_response_write(res, scratch, 2);
+	return OCS_PROCESSED;
+}
+
+#define GET_REQUEST "GET /path?q=ok HTTP/1.1\r\nHost: localhost\r\nUser-Agent: test\r\nAccept: */*\r\nCookie: a=b; c=d\r\n\r\n"
+
+/// Writes requests on keep alive, returns the allocations of the last ones.
+long keep_alive_mallocs(onion_request *req){
+	onion_block *buffer=onion_buffer_listen_point_get_buffer(req);
+	int i;
+	long n=0;
+	for (i=0;i<100;i++){
+#ifdef COUNT_MALLOCS
+		if (i==50){ // Warmed up
+			nallocs=0;
+			counting=1;
+		}
+#endif
+		onion_connection_status r=onion_request_write(req, GET_REQUEST, strlen(GET_REQUEST));
+		if (r!=OCS_KEEP_ALIVE){
+			ONION_ERROR("Expected keep alive, got %d", r);
+			return -1;
+		}
+		if (!strstr(onion_block_data(buffer), "\r\n\r\nok")){
+			ONION_ERROR("Bad response: %s", onion_block_data(buffer));
+			return -1;
+		}
+		onion_block_clear(buffer);
+	}
+#ifdef COUNT_MALLOCS
+	counting=0;
+	n=nallocs;
+#endif
+	return n;
+}
+
+/// Zero mallocs on the keep alive GET path, with the headers as slices.
+void t01_keep_alive_no_mallocs(){
+	INIT_LOCAL();
+
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	onion_set_root_handler(server, onion_handler_new(handler, NULL, NULL));
+	onion_set_header_slices(server, 1);
+
+	onion_request *req=onion_request_new(custom_io);
+	FAIL_IF_NOT_EQUAL_INT(keep_alive_mallocs(req), 0);
+	onion_request_free(req);
+
+	onion_free(server);
+
+	END_LOCAL();
+}
+
+/// Freed requests, responses and dicts are reused, reset.
+void t02_reuse(){
+	INIT_LOCAL();
+
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	onion_set_root_handler(server, onion_handler_new(handler, NULL, NULL));
+
+	onion_request *req=onion_request_new(custom_io);
+	FAIL_IF_NOT_EQUAL_INT(keep_alive_mallocs(req), keep_alive_mallocs(req)); // Not growing
+	onion_request_free(req);
+	onion_request *req2=onion_request_new(custom_io);
+	FAIL_IF_NOT_EQUAL(req, req2);
+	FAIL_IF_NOT_EQUAL(onion_request_get_fullpath(req2), NULL);
+	FAIL_IF_NOT_EQUAL(onion_request_get_query_dict(req2), NULL);
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(onion_request_get_header_dict(req2)), 0);
+	FAIL_IF_NOT_EQUAL_INT(keep_alive_mallocs(req2), keep_alive_mallocs(req2));
+	onion_request_free(req2);
+
+	onion_dict *d=onion_dict_new();
+	onion_dict_add(d, "a", "b", OD_DUP_ALL);
+	onion_dict_add(d, "c", "d", 0);
+	onion_dict_free(d);
+	onion_dict *d2=onion_dict_new();
+	FAIL_IF_NOT_EQUAL(d, d2);
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(d2), 0);
+	FAIL_IF_NOT_EQUAL(onion_dict_get(d2, "a"), NULL);
+	onion_dict_add(d2, "A", "B", 0);
+	FAIL_IF_NOT_EQUAL(onion_dict_get(d2, "a"), NULL); // Not case insensitive as the request headers were
+	FAIL_IF_NOT_EQUAL_STR(onion_dict_get(d2, "A"), "B");
+	onion_dict_clear(d2);
+	FAIL_IF_NOT_EQUAL_INT(onion_dict_count(d2), 0);
+	onion_dict_free(d2);
+
+	onion_free(server);
+
+	END_LOCAL();
+}
+
+/// The headers and cookies go to the arena: no mallocs with the headers at the dict either.
+void t03_arena(){
+	INIT_LOCAL();
+
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	onion_set_root_handler(server, onion_handler_new(arena_handler, NULL, NULL));
+
+	onion_request *req=onion_request_new(custom_io);
+	FAIL_IF_NOT_EQUAL_INT(keep_alive_mallocs(req), 0);
+
+	// Aligned, and big allocations get their own block.
+	char *first=onion_request_alloc(req, 1); // Not a nor b, that the ctest.h macros declare
+	char *second=onion_request_alloc(req, 1);
+	FAIL_IF_NOT_EQUAL_INT(((uintptr_t)first)%16, 0);
+	FAIL_IF_NOT_EQUAL_INT(((uintptr_t)second)%16, 0);
+	FAIL_IF_EQUAL(first, second);
+	char *big=onion_request_alloc(req, 64*1024);
+	FAIL_IF_EQUAL(big, NULL);
+	memset(big, 'x', 64*1024);
+	FAIL_IF_NOT_EQUAL_STR(onion_request_strdup(req, "hello"), "hello");
+	onion_request_clean(req);
+	FAIL_IF_NOT_EQUAL(onion_request_alloc(req, 1), first); // Back at the start of the first block
+	onion_request_free(req);
+
+	onion_free(server);
+
+	END_LOCAL();
+}
+
+/// Answers the :q param, or the group of the regexp.
+onion_connection_status url_handler(void *_, onion_request *req, onion_response *res){
+	const char *q=onion_request_get_url_param(req, "q");
+	if (!q)
+		q=onion_request_get_query(req, "1");
+	onion_response_set_length(res, 2);
+	onion_response_write(res, q ? q : "--", 2);
+	return OCS_PROCESSED;
+}
+
+#define URL_REQUEST "GET /a/ok HTTP/1.1\r\nHost: localhost\r\n\r\n"
+#define REGEXP_REQUEST "GET /b/ok HTTP/1.1\r\nHost: localhost\r\n\r\n"
+
+/// Writes that request on keep alive, returns the allocations of the last ones.
+long url_mallocs(onion_request *req, const char *request){
+	onion_block *buffer=onion_buffer_listen_point_get_buffer(req);
+	int i;
+	long n=0;
+	for (i=0;i<100;i++){
+#ifdef COUNT_MALLOCS
+		if (i==50){
+			nallocs=0;
+			counting=1;
+		}
+#endif
+		onion_request_write(req, request, strlen(request));
+		if (!strstr(onion_block_data(buffer), "\r\n\r\nok")){
+			ONION_ERROR("Bad response: %s", onion_block_data(buffer));
+			return -1;
+		}
+		onion_block_clear(buffer);
+	}
+#ifdef COUNT_MALLOCS
+	counting=0;
+	n=nallocs;
+#endif
+	return n;
+}
+
+/// Routing by the url trie, with its captures, does not allocate.
+void t05_url_captures(){
+	INIT_LOCAL();
+
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	onion_url *url=onion_root_url(server);
+	onion_url_add(url, "x/:q", url_handler);
+	onion_url_add(url, "a/:q", url_handler);
+	onion_url_add(url, "^b/(.*)$", url_handler);
+	onion_set_header_slices(server, 1);
+
+	onion_request *req=onion_request_new(custom_io);
+	FAIL_IF_NOT_EQUAL_INT(url_mallocs(req, URL_REQUEST), 0);
+	FAIL_IF(url_mallocs(req, REGEXP_REQUEST)<0); // The group, at the query as before. regexec itself may allocate.
+	onion_request_free(req);
+
+	onion_free(server);
+
+	END_LOCAL();
+}
+
+long slab_mallocs=0, slab_frees=0;
+
+void *slab_malloc(size_t size){
+	__sync_fetch_and_add(&slab_mallocs, 1);
+	return malloc(size);
+}
+
+void slab_free(void *ptr){
+	__sync_fetch_and_add(&slab_frees, 1);
+	free(ptr);
+}
+
+/// Allocates and frees, from the depot, at another thread.
+void *slab_thread(void *_){
+	void *p[64];
+	int i;
+	for (i=0;i<64;i++)
+		p[i]=onion_slab_alloc(24);
+	for (i=0;i<64;i++)
+		onion_slab_free(p[i], 24);
+	return NULL;
+}
+
+/// Small objects are reused by size class, shared through the depot, and the excess after a spike is freed.
+void t04_slab(){
+	INIT_LOCAL();
+
+	onion_set_allocator(slab_malloc, slab_free);
+	void *a=onion_slab_alloc(40);
+	onion_slab_free(a, 40);
+	FAIL_IF_NOT_EQUAL(onion_slab_alloc(33), a); // Same class
+	onion_slab_free(a, 33);
+
+	// A spike
+	static void *p[4096];
+	int i;
+	for (i=0;i<4096;i++)
+		p[i]=onion_slab_alloc(24);
+	long mallocs=slab_mallocs;
+	for (i=0;i<4096;i++)
+		onion_slab_free(p[i], 24);
+	FAIL_IF(slab_frees<4096-128-32*32); // Returned, except what the caches keep
+	FAIL_IF(slab_frees>4096-32*32);
+
+	// Other threads reuse them
+	pthread_t th;
+	pthread_create(&th, NULL, slab_thread, NULL);
+	pthread_join(th, NULL);
+	FAIL_IF_NOT_EQUAL_INT(slab_mallocs, mallocs);
+
+	onion_pool_clear();
+	onion_set_allocator(NULL, NULL);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	onion_log_flags=OF_INIT|OF_NOINFO;
+	t01_keep_alive_no_mallocs();
+	t02_reuse();
+	t03_arena();
+	t04_slab();
+	t05_url_captures();
+
+	END();
+}
@@ -0,0 +1,412 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <onion/onion.h>
+#include <onion/http2.h>
+#include <onion/hpack.h>
+#include <onion/block.h>
+#include <onion/log.h>
+#include <onion/request.h>
+#include <onion/response.h>
+
+#include "../ctest.h"
+
+#define PORT "8092"
+/// Streams the test client keeps track of
+#define MAX_STREAM_ID 16
+
+onion *o;
+
+/// Decoded headers, as "name: value\n"
+static int add_header(void *data, const char *name, size_t name_length, const char *value, size_t value_length){
+	onion_block *b=data;
+	onion_block_add_data(b, name, name_length);
+	onion_block_add_str(b, ": ");
+	onion_block_add_data(b, value, value_length);
+	onion_block_add_char(b, '\n');
+	return 0;
+}
+
+/// Decodes the hex string, and checks the headers are the expected.
+static int decode_hex(onion_hpack *hpack, const char *hex, const char *expected){
+	unsigned char data[256];
+	size_t l=0;
+	while (hex[0] && hex[1]){
+		if (hex[0]==' '){
+			hex++;
+			continue;
+		}
+		char tmp[3]={ hex[0], hex[1], 0 };
+		data[l++]=strtol(tmp, NULL, 16);
+		hex+=2;
+	}
+	onion_block *b=onion_block_new();
+	int r=onion_hpack_decode(hpack, data, l, add_header, b);
+	int ok=r==0 && strcmp(onion_block_data(b), expected)==0;
+	if (!ok)
+		ONION_ERROR("Decoded %d: %s", r, onion_block_data(b));
+	onion_block_free(b);
+	return ok;
+}
+
+/// RFC 7541 C.3 and C.4 examples, and encode of what is decoded.
+void t01_hpack(){
+	INIT_LOCAL();
+	
+	onion_hpack *d=onion_hpack_new(4096);
+	FAIL_IF_NOT(decode_hex(d, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", 
+		":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"));
+	FAIL_IF_NOT(decode_hex(d, "8286 84be 5808 6e6f 2d63 6163 6865", 
+		":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n"));
+	FAIL_IF_NOT(decode_hex(d, "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65", 
+		":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n"));
+	onion_hpack_free(d);
+	
+	d=onion_hpack_new(4096); // Huffman
+	FAIL_IF_NOT(decode_hex(d, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", 
+		":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"));
+	FAIL_IF_NOT(decode_hex(d, "8286 84be 5886 a8eb 1064 9cbf", 
+		":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n"));
+	FAIL_IF_NOT(decode_hex(d, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf", 
+		":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n"));
+	FAIL_IF(decode_hex(d, "c6", "")); // Out of the table
+	FAIL_IF(decode_hex(d, "4081 0000", "")); // Bad padding, not the EOS ones
+	onion_hpack_free(d);
+	
+	onion_hpack *e=onion_hpack_new(4096);
+	d=onion_hpack_new(4096);
+	int i;
+	size_t sizes[2];
+	for (i=0;i<2;i++){
+		onion_block *b=onion_block_new();
+		onion_hpack_encode(e, b, ":status", "200");
+		onion_hpack_encode(e, b, "content-type", "text/html");
+		onion_hpack_encode(e, b, "x-custom", "Some value, with \"rare\" chars\x7f");
+		onion_hpack_encode(e, b, "content-length", "1234");
+		sizes[i]=onion_block_size(b);
+		onion_block *out=onion_block_new();
+		FAIL_IF_NOT_EQUAL_INT(onion_hpack_decode(d, (const unsigned char*)onion_block_data(b), onion_block_size(b), add_header, out), 0);
+		FAIL_IF_NOT_EQUAL_STR(onion_block_data(out), ":status: 200\ncontent-type: text/html\nx-custom: Some value, with \"rare\" chars\x7f\ncontent-length: 1234\n");
+		onion_block_free(out);
+		onion_block_free(b);
+	}
+	FAIL_IF_NOT(sizes[1]<sizes[0]); // From the dynamic table
+	onion_hpack_free(e);
+	onion_hpack_free(d);
+	
+	END_LOCAL();
+}
+
+/// Answers <path>, and the a POST field; /big writes 100 bytes. 
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	if (strcmp(onion_request_get_path(req), "big")==0){
+		char tmp[100];
+		memset(tmp, 'x', sizeof(tmp));
+		onion_response_write(res, tmp, sizeof(tmp));
+		return OCS_PROCESSED;
+	}
+	const char *post=onion_request_get_post(req, "a");
+	onion_response_printf(res, "<%s>%s", onion_request_get_path(req), post ? post : "");
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+int connect_to(const char *addr, const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+	if (getaddrinfo(addr,port,&hints,&server)<0){
+		ONION_ERROR("Error getting server info");
+		return -1;
+	}
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+		ONION_ERROR("Error connecting to server %s:%s",addr,port);
+	}
+
+	freeaddrinfo(server);
+
+	return fd;
+}
+
+/// A client connection
+typedef struct{
+	int fd;
+	onion_hpack *encoder;
+	onion_hpack *decoder;
+	unsigned char in[65536];
+	size_t in_size;
+	size_t consumed;                 ///< Bytes of the last frame read, at the start of in
+	int code[MAX_STREAM_ID];         ///< :status of each stream
+	int status[MAX_STREAM_ID];       ///< :status when ended, or -RST_STREAM code
+	onion_block *body[MAX_STREAM_ID];
+}client;
+
+static void frame(onion_block *out, int type, int flags, uint32_t id, const void *payload, size_t length){
+	unsigned char header[9]={ length>>16, length>>8, length, type, flags, id>>24, id>>16, id>>8, id };
+	onion_block_add_data(out, (const char*)header, 9);
+	onion_block_add_data(out, payload, length);
+}
+
+static void send_block(client *c, onion_block *b){
+	if (write(c->fd, onion_block_data(b), onion_block_size(b))!=onion_block_size(b))
+		ONION_ERROR("Could not write");
+	onion_block_free(b);
+}
+
+/// Connects, and sends the preface with the given settings.
+static client *client_new(const void *settings, size_t settings_length){
+	client *c=calloc(1, sizeof(client));
+	c->fd=connect_to("localhost", PORT);
+	c->encoder=onion_hpack_new(4096);
+	c->decoder=onion_hpack_new(4096);
+	onion_block *b=onion_block_new();
+	onion_block_add_str(b, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+	frame(b, 4, 0, 0, settings, settings_length);
+	send_block(c, b);
+	return c;
+}
+
+static void client_free(client *c){
+	close(c->fd);
+	onion_hpack_free(c->encoder);
+	onion_hpack_free(c->decoder);
+	int i;
+	for (i=0;i<MAX_STREAM_ID;i++)
+		if (c->body[i])
+			onion_block_free(c->body[i]);
+	free(c);
+}
+
+/// Adds a request HEADERS frame.
+static void request(client *c, onion_block *out, uint32_t id, const char *method, const char *path, const char *extra_name, const char *extra_value, int flags){
+	onion_block *h=onion_block_new();
+	onion_hpack_encode(c->encoder, h, ":method", method);
+	onion_hpack_encode(c->encoder, h, ":scheme", "http");
+	onion_hpack_encode(c->encoder, h, ":path", path);
+	onion_hpack_encode(c->encoder, h, ":authority", "localhost");
+	if (extra_name)
+		onion_hpack_encode(c->encoder, h, extra_name, extra_value);
+	frame(out, 1, flags|4, id, onion_block_data(h), onion_block_size(h));
+	onion_block_free(h);
+}
+
+/// Reads the next frame, with at most timeout_ms wait. Returns its type, or -1. The payload is at c->in+9 until next call.
+static int read_frame(client *c, int *flags, uint32_t *id, size_t *length, int timeout_ms){
+	memmove(c->in, c->in+c->consumed, c->in_size-c->consumed);
+	c->in_size-=c->consumed;
+	c->consumed=0;
+	while (1){
+		if (c->in_size>=9){
+			size_t l=(c->in[0]<<16) | (c->in[1]<<8) | c->in[2];
+			if (c->in_size>=9+l){
+				*length=l;
+				*flags=c->in[4];
+				*id=((c->in[5]&0x7f)<<24) | (c->in[6]<<16) | (c->in[7]<<8) | c->in[8];
+				c->consumed=9+l;
+				return c->in[3];
+			}
+		}
+		struct pollfd pfd={ c->fd, POLLIN, 0 };
+		if (poll(&pfd, 1, timeout_ms)<=0)
+			return -1;
+		ssize_t r=read(c->fd, c->in+c->in_size, sizeof(c->in)-c->in_size);
+		if (r<=0)
+			return -1;
+		c->in_size+=r;
+	}
+}
+
+/// Reads frames until the stream ends, or is reset. Returns the :status and the body at body, or -RST_STREAM code.
+static int read_response(client *c, uint32_t stream_id, onion_block *body, int timeout_ms){
+	int type, flags;
+	uint32_t id;
+	size_t length;
+	while (!c->status[stream_id] && (type=read_frame(c, &flags, &id, &length, timeout_ms))>=0 ){
+		unsigned char *payload=c->in+9;
+		if (id>=MAX_STREAM_ID)
+			continue;
+		if (!c->body[id])
+			c->body[id]=onion_block_new();
+		if (type==1){ // HEADERS, always at one frame here.
+			onion_block *h=onion_block_new();
+			onion_hpack_decode(c->decoder, payload, length, add_header, h);
+			c->code[id]=atoi(onion_block_data(h)+strlen(":status: "));
+			onion_block_free(h);
+		}
+		if (type==0)
+			onion_block_add_data(c->body[id], (const char*)payload, length);
+		if (type==3)
+			c->status[id]=-((payload[0]<<24) | (payload[1]<<16) | (payload[2]<<8) | payload[3]);
+		if ((type==0 || type==1) && (flags&1))
+			c->status[id]=c->code[id];
+	}
+	if (c->body[stream_id]){
+		onion_block_add_block(body, c->body[stream_id]);
+		onion_block_clear(c->body[stream_id]);
+	}
+	return c->status[stream_id];
+}
+
+/// Several streams at one write, a POST, a PING, and a malformed request.
+void t02_streams(){
+	INIT_LOCAL();
+	
+	client *c=client_new(NULL, 0);
+	FAIL_IF( c->fd<0 );
+	onion_block *b=onion_block_new();
+	request(c, b, 1, "GET", "/a", NULL, NULL, 1);
+	request(c, b, 3, "GET", "/b", NULL, NULL, 1);
+	request(c, b, 5, "POST", "/c", "content-type", "application/x-www-form-urlencoded", 0); // No length, goes chunked
+	frame(b, 0, 0, 5, "a=he", 4);
+	frame(b, 0, 1, 5, "llo", 3);
+	send_block(c, b);
+	
+	onion_block *body=onion_block_new();
+	FAIL_IF_NOT_EQUAL_INT(read_response(c, 1, body, 2000), 200);
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(body), "<a>");
+	onion_block_clear(body);
+	FAIL_IF_NOT_EQUAL_INT(read_response(c, 3, body, 2000), 200);
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(body), "<b>");
+	onion_block_clear(body);
+	FAIL_IF_NOT_EQUAL_INT(read_response(c, 5, body, 2000), 200);
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(body), "<c>hello");
+	
+	b=onion_block_new();
+	frame(b, 6, 0, 0, "12345678", 8);
+	send_block(c, b);
+	int type, flags;
+	uint32_t id;
+	size_t length;
+	do{
+		type=read_frame(c, &flags, &id, &length, 2000);
+	}while (type>=0 && type!=6);
+	FAIL_IF_NOT_EQUAL_INT(type, 6);
+	FAIL_IF_NOT_EQUAL_INT(flags, 1);
+	FAIL_IF_NOT_EQUAL_INT(memcmp(c->in+9, "12345678", 8), 0);
+	
+	b=onion_block_new();
+	request(c, b, 7, "GET", "/d", "X-Upper", "no", 1); // Names must be lowercase
+	request(c, b, 9, "GET", "/e", NULL, NULL, 1);
+	send_block(c, b);
+	onion_block_clear(body);
+	FAIL_IF_NOT_EQUAL_INT(read_response(c, 7, body, 2000), -1); // PROTOCOL_ERROR
+	FAIL_IF_NOT_EQUAL_INT(read_response(c, 9, body, 2000), 200); // The connection is still alive
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(body), "<e>");
+	
+	onion_block_free(body);
+	client_free(c);
+	
+	END_LOCAL();
+}
+
+/// The response waits for the client flow control window.
+void t03_flow_control(){
+	INIT_LOCAL();
+	
+	unsigned char settings[6]={ 0, 4, 0, 0, 0, 10 }; // INITIAL_WINDOW_SIZE 10
+	client *c=client_new(settings, sizeof(settings));
+	FAIL_IF( c->fd<0 );
+	onion_block *b=onion_block_new();
+	request(c, b, 1, "GET", "/big", NULL, NULL, 1);
+	send_block(c, b);
+	
+	onion_block *body=onion_block_new();
+	FAIL_IF_NOT_EQUAL_INT(read_response(c, 1, body, 200), 0); // Timeout, no END_STREAM
+	FAIL_IF_NOT_EQUAL_INT(onion_block_size(body), 10);
+	
+	b=onion_block_new();
+	unsigned char increment[4]={ 0, 0, 0, 90 };
+	frame(b, 8, 0, 1, increment, 4);
+	send_block(c, b);
+	FAIL_IF_NOT_EQUAL_INT(read_response(c, 1, body, 2000), 200);
+	FAIL_IF_NOT_EQUAL_INT(onion_block_size(body), 100);
+	
+	onion_block_free(body);
+	client_free(c);
+	
+	END_LOCAL();
+}
+
+/// HTTP/1 keeps working at the same listen point.
+void t04_http1(){
+	INIT_LOCAL();
+	
+	int fd=connect_to("localhost", PORT);
+	FAIL_IF( fd<0 );
+	const char *req="GET /h1 HTTP/1.1\r\n\r\n";
+	FAIL_IF_NOT_EQUAL_INT(write(fd, req, strlen(req)), strlen(req));
+	char buffer[1024]={0};
+	size_t l=0;
+	struct pollfd pfd={ fd, POLLIN, 0 };
+	while (!strstr(buffer, "<h1>") && poll(&pfd, 1, 2000)>0){
+		ssize_t r=read(fd, buffer+l, sizeof(buffer)-l-1);
+		if (r<=0)
+			break;
+		l+=r;
+	}
+	FAIL_IF_NOT(strstr(buffer, "HTTP/1.1 200"));
+	FAIL_IF_NOT(strstr(buffer, "<h1>"));
+	close(fd);
+	
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	
+	t01_hpack();
+	
+	o=onion_new(O_POLL);
+	onion_add_listen_point(o, NULL, PORT, onion_http2_new());
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	usleep(200000);
+	
+	t02_streams();
+	t03_flow_control();
+	t04_http1();
+	
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+	
+	END();
+}
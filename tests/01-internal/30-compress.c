@@ -0,0 +1,388 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
+
+#include <onion/onion.h>
+#include <onion/dict.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/block.h>
+#include <onion/log.h>
+#include <onion/handlers/compress.h>
+#include <onion/shortcuts.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+#define TEXT "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore. "
+
+onion *server;
+onion_listen_point *custom_io;
+int repeat=100;
+const char *content_type=NULL;
+/// More headers for do_request, ending in \r\n
+const char *extra_headers="";
+
+/// Writes TEXT repeat times
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	if (content_type)
+		onion_response_set_header(res, "Content-Type", content_type);
+	int i;
+	for (i=0;i<repeat;i++)
+		onion_response_write0(res, TEXT);
+	return OCS_PROCESSED;
+}
+
+/// Answer of a request, split at headers and body, dechunked.
+struct answer{
+	char headers[4096];
+	onion_block *body;
+};
+
+/// Does the request, and leaves the answer at ans.
+void do_request(const char *accept, struct answer *ans){
+	onion_request *req=onion_request_new(custom_io);
+	char tmp[512];
+	if (accept)
+		snprintf(tmp, sizeof(tmp), "GET / HTTP/1.1\r\nAccept-Encoding: %s\r\n%s\r\n", accept, extra_headers);
+	else
+		snprintf(tmp, sizeof(tmp), "GET / HTTP/1.1\r\n%s\r\n", extra_headers);
+	onion_request_write(req, tmp, strlen(tmp));
+	
+	onion_block *buffer=onion_buffer_listen_point_get_buffer(req);
+	const char *data=onion_block_data(buffer);
+	const char *end=strstr(data, "\r\n\r\n");
+	ans->headers[0]='\0';
+	ans->body=onion_block_new();
+	if (end){
+		snprintf(ans->headers, sizeof(ans->headers), "%.*s", (int)(end-data+2), data);
+		const char *body=end+4;
+		size_t size=onion_block_size(buffer)-(body-data);
+		if (!strstr(ans->headers, "Transfer-Encoding: chunked"))
+			onion_block_add_data(ans->body, body, size);
+		else{
+			while (1){
+				char *next;
+				long l=strtol(body, &next, 16);
+				if (l<=0)
+					break;
+				onion_block_add_data(ans->body, next+2, l);
+				body=next+2+l+2;
+			}
+		}
+	}
+	onion_request_free(req);
+}
+
+/// Inflates gzip or deflate data, returns its size or -1.
+long inflate_data(onion_block *data, char *out, size_t size){
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	inflateInit2(&z, 15+32); // gzip or zlib, by its header
+	z.next_in=(Bytef*)onion_block_data(data);
+	z.avail_in=onion_block_size(data);
+	z.next_out=(Bytef*)out;
+	z.avail_out=size;
+	int r=inflate(&z, Z_FINISH);
+	long l=z.total_out;
+	inflateEnd(&z);
+	return r==Z_STREAM_END ? l : -1;
+}
+
+void setup(){
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	onion_set_root_handler(server, onion_handler_compress(onion_handler_new(handler, NULL, NULL), 6, 1000));
+}
+
+/// Whole response at the buffer: compressed length. Bigger: compressed and chunked.
+void t01_gzip(){
+	INIT_LOCAL();
+	setup();
+	
+	struct answer ans;
+	char *out=malloc(1024*1024);
+	onion_set_response_buffer_size(server, 64*1024);
+	do_request("gzip, deflate", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Encoding: gzip\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Vary: Accept-Encoding\r\n");
+	FAIL_IF_STRSTR(ans.headers, "chunked");
+	char length[64];
+	snprintf(length, sizeof(length), "Content-Length: %d\r\n", (int)onion_block_size(ans.body));
+	FAIL_IF_NOT_STRSTR(ans.headers, length);
+	FAIL_IF_NOT(onion_block_size(ans.body) < 100*strlen(TEXT)/4);
+	FAIL_IF_NOT_EQUAL_INT(inflate_data(ans.body, out, 1024*1024), 100*strlen(TEXT));
+	FAIL_IF_NOT_EQUAL_INT(strncmp(out, TEXT TEXT, 2*strlen(TEXT)), 0);
+	onion_block_free(ans.body);
+	
+	repeat=5000; // 500KB
+	do_request("deflate", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Encoding: deflate\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Transfer-Encoding: chunked\r\n");
+	FAIL_IF_STRSTR(ans.headers, "Content-Length");
+	FAIL_IF_NOT_EQUAL_INT(inflate_data(ans.body, out, 1024*1024), 5000*strlen(TEXT));
+	FAIL_IF_NOT_EQUAL_INT(strncmp(out+4999*strlen(TEXT), TEXT, strlen(TEXT)), 0);
+	onion_block_free(ans.body);
+	repeat=100;
+	
+	free(out);
+	onion_free(server);
+	END_LOCAL();
+}
+
+/// Not compressed when not accepted, small, or already compressed.
+void t02_not_compressed(){
+	INIT_LOCAL();
+	setup();
+	
+	struct answer ans;
+	do_request(NULL, &ans);
+	FAIL_IF_STRSTR(ans.headers, "Content-Encoding");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Vary: Accept-Encoding\r\n");
+	FAIL_IF_NOT_EQUAL_INT(onion_block_size(ans.body), 100*strlen(TEXT));
+	onion_block_free(ans.body);
+	
+	do_request("gzip;q=0, identity", &ans);
+	FAIL_IF_STRSTR(ans.headers, "Content-Encoding");
+	onion_block_free(ans.body);
+	
+	repeat=5;
+	do_request("gzip", &ans);
+	FAIL_IF_STRSTR(ans.headers, "Content-Encoding");
+	FAIL_IF_NOT_EQUAL_INT(onion_block_size(ans.body), 5*strlen(TEXT));
+	onion_block_free(ans.body);
+	repeat=100;
+	
+	content_type="image/png";
+	do_request("gzip", &ans);
+	FAIL_IF_STRSTR(ans.headers, "Content-Encoding");
+	FAIL_IF_STRSTR(ans.headers, "Vary");
+	onion_block_free(ans.body);
+	content_type="application/json; charset=utf-8";
+	do_request("*", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Encoding: ");
+	onion_block_free(ans.body);
+	content_type=NULL;
+	
+	onion_free(server);
+	END_LOCAL();
+}
+
+#ifdef HAVE_BROTLI
+/// Brotli is preferred when accepted.
+void t03_brotli(){
+	INIT_LOCAL();
+	setup();
+	
+	struct answer ans;
+	char *out=malloc(1024*1024);
+	repeat=3000;
+	do_request("gzip, deflate, br", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Encoding: br\r\n");
+	size_t size=1024*1024;
+	FAIL_IF_NOT_EQUAL_INT(BrotliDecoderDecompress(onion_block_size(ans.body), (const uint8_t*)onion_block_data(ans.body), &size, (uint8_t*)out), BROTLI_DECODER_RESULT_SUCCESS);
+	FAIL_IF_NOT_EQUAL_INT(size, 3000*strlen(TEXT));
+	FAIL_IF_NOT_EQUAL_INT(strncmp(out+2999*strlen(TEXT), TEXT, strlen(TEXT)), 0);
+	onion_block_free(ans.body);
+	repeat=100;
+	
+	do_request("gzip;q=1.0, br;q=0.5", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Encoding: gzip\r\n");
+	onion_block_free(ans.body);
+	
+	free(out);
+	onion_free(server);
+	END_LOCAL();
+}
+#endif
+
+char filename[]="/tmp/onion-compress-XXXXXX";
+
+onion_connection_status file_handler(void *_, onion_request *req, onion_response *res){
+	return onion_shortcut_response_file(filename, req, res);
+}
+
+/// Writes the data to the file, and sets its modification time.
+void write_file(const char *name, const char *data, time_t mtime){
+	FILE *f=fopen(name, "w");
+	fputs(data, f);
+	fclose(f);
+	struct utimbuf t={ mtime, mtime };
+	utime(name, &t);
+}
+
+/// Static files with precompressed siblings, as file.br and file.gz.
+void t04_precompressed(){
+	INIT_LOCAL();
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	onion_set_root_handler(server, onion_handler_new(file_handler, NULL, NULL));
+	
+	close(mkstemp(filename));
+	char br[64], gz[64];
+	snprintf(br, sizeof(br), "%s.br", filename);
+	snprintf(gz, sizeof(gz), "%s.gz", filename);
+	time_t now=time(NULL);
+	write_file(filename, "original", now-10);
+	write_file(br, "BR", now);
+	write_file(gz, "GZIP", now);
+	
+	struct answer ans;
+	do_request(NULL, &ans);
+	FAIL_IF_STRSTR(ans.headers, "Content-Encoding");
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(ans.body), "original");
+	char etag[256];
+	const char *e=strstr(ans.headers, "Etag: ");
+	snprintf(etag, sizeof(etag), "%s", e ? e : "");
+	onion_block_free(ans.body);
+	
+	do_request("gzip, deflate, br", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Encoding: br\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Vary: Accept-Encoding\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Length: 2\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "-br\r\n"); // At the ETag
+	FAIL_IF_STRSTR(ans.headers, etag);
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(ans.body), "BR");
+	onion_block_free(ans.body);
+	
+	do_request("gzip", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Encoding: gzip\r\n");
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(ans.body), "GZIP");
+	onion_block_free(ans.body);
+	
+	write_file(gz, "GZIP", now-20); // Older than the original, not used
+	do_request("gzip", &ans);
+	FAIL_IF_STRSTR(ans.headers, "Content-Encoding");
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(ans.body), "original");
+	onion_block_free(ans.body);
+	
+	unlink(br);
+	unlink(gz);
+	unlink(filename);
+	onion_free(server);
+	END_LOCAL();
+}
+
+onion_connection_status embedded_handler(void *_, onion_request *req, onion_response *res){
+	static const onion_shortcut_embedded variants[]={
+		{ "br", "BR", 2 },
+		{ "gzip", "GZIP", 4 },
+		{ NULL, "original", 8 }
+	};
+	return onion_shortcut_response_embedded(variants, "text/plain", "abc", "no-cache", req, res);
+}
+
+/// With the prerendered headers, as opack writes them.
+onion_connection_status embedded_headers_handler(void *_, onion_request *req, onion_response *res){
+	static const char headers_gzip[]="Etag: abc-gzip\r\nContent-Type: text/plain\r\nContent-Encoding: gzip\r\nVary: Accept-Encoding\r\n";
+	static const char headers[]="Etag: abc\r\nContent-Type: text/plain\r\nVary: Accept-Encoding\r\n";
+	static const onion_shortcut_embedded variants[]={
+		{ "gzip", "GZIP", 4, headers_gzip, sizeof(headers_gzip)-1 },
+		{ NULL, "original", 8, headers, sizeof(headers)-1 }
+	};
+	return onion_shortcut_response_embedded(variants, "text/plain", "abc", NULL, req, res);
+}
+
+/// Embedded resources, as opack generates: the accepted variant, its ETag, and 304s.
+void t05_embedded(){
+	INIT_LOCAL();
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	onion_set_root_handler(server, onion_handler_new(embedded_handler, NULL, NULL));
+	
+	struct answer ans;
+	do_request(NULL, &ans);
+	FAIL_IF_STRSTR(ans.headers, "Content-Encoding");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Vary: Accept-Encoding\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Etag: abc\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Cache-Control: no-cache\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Type: text/plain\r\n");
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(ans.body), "original");
+	onion_block_free(ans.body);
+	
+	do_request("gzip, br;q=0.5", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Encoding: gzip\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Etag: abc-gzip\r\n");
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(ans.body), "GZIP");
+	onion_block_free(ans.body);
+	
+	do_request("gzip, deflate, br", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Encoding: br\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Length: 2\r\n");
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(ans.body), "BR");
+	onion_block_free(ans.body);
+	
+	extra_headers="If-None-Match: abc-br\r\n";
+	do_request("br", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, " 304 ");
+	FAIL_IF_NOT_EQUAL_INT(onion_block_size(ans.body), 0);
+	onion_block_free(ans.body);
+	
+	do_request(NULL, &ans); // Other representation
+	FAIL_IF_NOT_STRSTR(ans.headers, " 200 ");
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(ans.body), "original");
+	onion_block_free(ans.body);
+	extra_headers="";
+	
+	onion_set_root_handler(server, onion_handler_new(embedded_headers_handler, NULL, NULL));
+	do_request("gzip", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Encoding: gzip\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Etag: abc-gzip\r\n");
+	const char *type=strstr(ans.headers, "Content-Type:");
+	FAIL_IF_EQUAL(type, NULL);
+	FAIL_IF_NOT_EQUAL(strstr(type+1, "Content-Type:"), NULL); // Only the prerendered one
+	FAIL_IF_NOT_EQUAL_STR(onion_block_data(ans.body), "GZIP");
+	onion_block_free(ans.body);
+	extra_headers="If-None-Match: abc\r\n";
+	do_request(NULL, &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, " 304 ");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Etag: abc\r\n");
+	onion_block_free(ans.body);
+	extra_headers="";
+	
+	onion_free(server);
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	
+	onion_log_flags=OF_INIT|OF_NOINFO;
+	t01_gzip();
+	t02_not_compressed();
+#ifdef HAVE_BROTLI
+	t03_brotli();
+#endif
+	t04_precompressed();
+	t05_embedded();
+	
+	END();
+}
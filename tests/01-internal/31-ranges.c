@@ -0,0 +1,262 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <onion/onion.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/block.h>
+#include <onion/log.h>
+#include <onion/mime.h>
+#include <onion/shortcuts.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+#define CONTENT "0123456789abcdefghijklmnopqrstuvwxyz"
+/// Some blocks and a bit, so it is read at several, not aligned at the end
+#define BIG_SIZE (3*65536+1001)
+
+onion *server;
+onion_listen_point *custom_io;
+char filename[]="/tmp/onion-ranges-XXXXXX";
+char big_filename[]="/tmp/onion-ranges-big-XXXXXX";
+char etag[64];
+
+onion_connection_status file_handler(void *_, onion_request *req, onion_response *res){
+	if (strcmp(onion_request_get_path(req), "big")==0)
+		return onion_shortcut_response_file(big_filename, req, res);
+	return onion_shortcut_response_file(filename, req, res);
+}
+
+/// The byte at that position of the big file
+static char big_byte(size_t pos){
+	return 'a'+(pos%23);
+}
+
+/// Answer of a request, split at headers and body
+struct answer{
+	char headers[4096];
+	char body[4096];
+};
+
+/// Does a GET with the given extra headers, and leaves the answer at ans.
+void do_request(const char *headers, struct answer *ans){
+	onion_request *req=onion_request_new(custom_io);
+	char tmp[1024];
+	snprintf(tmp, sizeof(tmp), "GET / HTTP/1.1\r\n%s\r\n", headers);
+	onion_request_write(req, tmp, strlen(tmp));
+	
+	onion_block *buffer=onion_buffer_listen_point_get_buffer(req);
+	const char *data=onion_block_data(buffer);
+	const char *end=strstr(data, "\r\n\r\n");
+	ans->headers[0]='\0';
+	ans->body[0]='\0';
+	if (end){
+		snprintf(ans->headers, sizeof(ans->headers), "%.*s", (int)(end-data+2), data);
+		snprintf(ans->body, sizeof(ans->body), "%.*s", (int)(onion_block_size(buffer)-(end+4-data)), end+4);
+	}
+	onion_request_free(req);
+}
+
+/// Single ranges: closed, open and suffix, cut at the end of file.
+void t01_single(){
+	INIT_LOCAL();
+	struct answer ans;
+	
+	do_request("", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "HTTP/1.1 200 OK\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Accept-Ranges: bytes\r\n");
+	FAIL_IF_NOT_EQUAL_STR(ans.body, CONTENT);
+	const char *e=strstr(ans.headers, "Etag: ");
+	if (e)
+		sscanf(e+6, "%63[^\r]", etag);
+	
+	do_request("Range: bytes=2-4\r\n", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "HTTP/1.1 206 PARTIAL CONTENT\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Range: bytes 2-4/36\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Length: 3\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, etag); // Same ETag as the full file
+	FAIL_IF_NOT_EQUAL_STR(ans.body, "234");
+	
+	do_request("Range: bytes=30-\r\n", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Range: bytes 30-35/36\r\n");
+	FAIL_IF_NOT_EQUAL_STR(ans.body, "uvwxyz");
+	
+	do_request("Range: bytes=-3\r\n", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Range: bytes 33-35/36\r\n");
+	FAIL_IF_NOT_EQUAL_STR(ans.body, "xyz");
+	
+	do_request("Range: bytes=-100\r\n", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Range: bytes 0-35/36\r\n");
+	FAIL_IF_NOT_EQUAL_STR(ans.body, CONTENT);
+	
+	do_request("Range: bytes=34-1000\r\n", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Range: bytes 34-35/36\r\n");
+	FAIL_IF_NOT_EQUAL_STR(ans.body, "yz");
+	
+	END_LOCAL();
+}
+
+/// Not satisfiable ranges are 416, not valid ones are ignored.
+void t02_invalid(){
+	INIT_LOCAL();
+	struct answer ans;
+	
+	do_request("Range: bytes=100-200\r\n", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "HTTP/1.1 416 RANGE NOT SATISFIABLE\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Range: bytes */36\r\n");
+	FAIL_IF_NOT_EQUAL_STR(ans.body, "");
+	
+	do_request("Range: bytes=-0\r\n", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "HTTP/1.1 416 ");
+	
+	const char *invalid[]={ "Range: bytes=5-2\r\n", "Range: bytes=a-b\r\n", "Range: lines=1-2\r\n", "Range: bytes=\r\n", "Range: bytes=-\r\n", NULL };
+	int i;
+	for (i=0;invalid[i];i++){
+		do_request(invalid[i], &ans);
+		FAIL_IF_NOT_STRSTR(ans.headers, "HTTP/1.1 200 OK\r\n");
+		FAIL_IF_NOT_EQUAL_STR(ans.body, CONTENT);
+	}
+	
+	END_LOCAL();
+}
+
+/// Several ranges as multipart/byteranges.
+void t03_multipart(){
+	INIT_LOCAL();
+	struct answer ans;
+	
+	do_request("Range: bytes=0-1, 100-200, -2\r\n", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "HTTP/1.1 206 PARTIAL CONTENT\r\n");
+	FAIL_IF_NOT_STRSTR(ans.headers, "Content-Type: multipart/byteranges; boundary=");
+	FAIL_IF_STRSTR(ans.headers, "Content-Range");
+	char boundary[64]={0};
+	const char *b=strstr(ans.headers, "boundary=");
+	if (b)
+		sscanf(b+9, "%63[^\r]", boundary);
+	char expected[1024];
+	snprintf(expected, sizeof(expected), 
+		"\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes 0-1/36\r\n\r\n01"
+		"\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes 34-35/36\r\n\r\nyz"
+		"\r\n--%s--\r\n", boundary, onion_mime_get(filename), boundary, onion_mime_get(filename), boundary);
+	FAIL_IF_NOT_EQUAL_STR(ans.body, expected);
+	char length[64];
+	snprintf(length, sizeof(length), "Content-Length: %d\r\n", (int)strlen(expected));
+	FAIL_IF_NOT_STRSTR(ans.headers, length);
+	
+	END_LOCAL();
+}
+
+/// If-Range: ranges only if it matches the ETag.
+void t04_if_range(){
+	INIT_LOCAL();
+	struct answer ans;
+	char headers[256];
+	
+	snprintf(headers, sizeof(headers), "Range: bytes=2-4\r\nIf-Range: %s\r\n", etag);
+	do_request(headers, &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "HTTP/1.1 206 ");
+	FAIL_IF_NOT_EQUAL_STR(ans.body, "234");
+	
+	snprintf(headers, sizeof(headers), "Range: bytes=2-4\r\nIf-Range: \"%s\"\r\n", etag);
+	do_request(headers, &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "HTTP/1.1 206 ");
+	
+	do_request("Range: bytes=2-4\r\nIf-Range: \"other\"\r\n", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "HTTP/1.1 200 OK\r\n");
+	FAIL_IF_NOT_EQUAL_STR(ans.body, CONTENT);
+	
+	do_request("Range: bytes=2-4\r\nIf-Range: Wed, 21 Oct 2015 07:28:00 GMT\r\n", &ans);
+	FAIL_IF_NOT_STRSTR(ans.headers, "HTTP/1.1 200 OK\r\n");
+	
+	END_LOCAL();
+}
+
+/// A file of several read blocks, as this listen point has no sendfile: all, and a range across blocks.
+void t05_big_file(){
+	INIT_LOCAL();
+	size_t starts[]={ 0, 65000 };
+	size_t lengths[]={ BIG_SIZE, 70000 };
+	int i;
+	for (i=0;i<2;i++){
+		onion_request *req=onion_request_new(custom_io);
+		char tmp[256];
+		if (i==0)
+			snprintf(tmp, sizeof(tmp), "GET /big HTTP/1.1\r\n\r\n");
+		else
+			snprintf(tmp, sizeof(tmp), "GET /big HTTP/1.1\r\nRange: bytes=%d-%d\r\n\r\n", (int)starts[i], (int)(starts[i]+lengths[i]-1));
+		onion_request_write(req, tmp, strlen(tmp));
+		
+		onion_block *buffer=onion_buffer_listen_point_get_buffer(req);
+		const char *data=onion_block_data(buffer);
+		const char *end=strstr(data, "\r\n\r\n");
+		FAIL_IF_NOT(end);
+		if (end){
+			FAIL_IF_NOT_STRSTR(data, i==0 ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.1 206 ");
+			end+=4;
+			FAIL_IF_NOT_EQUAL_INT(onion_block_size(buffer)-(end-data), lengths[i]);
+			size_t j, wrong=0;
+			for (j=0;j<lengths[i] && end+j<data+onion_block_size(buffer);j++)
+				if (end[j]!=big_byte(starts[i]+j))
+					wrong++;
+			FAIL_IF_NOT_EQUAL_INT(wrong, 0);
+		}
+		onion_request_free(req);
+	}
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	
+	onion_log_flags=OF_INIT|OF_NOINFO;
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	onion_set_root_handler(server, onion_handler_new(file_handler, NULL, NULL));
+	
+	int fd=mkstemp(filename);
+	if (write(fd, CONTENT, strlen(CONTENT))!=strlen(CONTENT))
+		ONION_ERROR("Could not write test file");
+	close(fd);
+	fd=mkstemp(big_filename);
+	char *big=malloc(BIG_SIZE);
+	size_t i;
+	for (i=0;i<BIG_SIZE;i++)
+		big[i]=big_byte(i);
+	if (write(fd, big, BIG_SIZE)!=BIG_SIZE)
+		ONION_ERROR("Could not write big test file");
+	free(big);
+	close(fd);
+	
+	t01_single();
+	t02_invalid();
+	t03_multipart();
+	t04_if_range();
+	t05_big_file();
+	
+	unlink(filename);
+	unlink(big_filename);
+	onion_free(server);
+	END();
+}
@@ -0,0 +1,292 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <onion/onion.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/block.h>
+#include <onion/log.h>
+#include <onion/shortcuts.h>
+#include <onion/file_cache.h>
+#include <onion/handlers/exportlocal.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+onion *server;
+onion_listen_point *custom_io;
+char dirpath[]="/tmp/onion-file-cache-XXXXXX";
+char filename[256];
+
+onion_connection_status file_handler(void *_, onion_request *req, onion_response *res){
+	return onion_shortcut_response_file(filename, req, res);
+}
+
+/// Writes the file as a new one, so the open fds still see the old one.
+void write_file(const char *name, const char *data){
+	char tmp[256];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+	FILE *f=fopen(tmp, "w");
+	fputs(data, f);
+	fclose(f);
+	rename(tmp, name);
+}
+
+/// Writes the request, and returns all the response.
+const char *raw_request(const char *request){
+	static char response[8192];
+	onion_request *req=onion_request_new(custom_io);
+	onion_request_write(req, request, strlen(request));
+	onion_block *buffer=onion_buffer_listen_point_get_buffer(req);
+	snprintf(response, sizeof(response), "%s", onion_block_data(buffer));
+	onion_request_free(req);
+	return response;
+}
+
+/// GETs the path and returns the body, or "" if not found.
+const char *do_request(const char *path){
+	static char body[4096];
+	char tmp[512];
+	snprintf(tmp, sizeof(tmp), "GET %s HTTP/1.1\r\n\r\n", path);
+	const char *data=raw_request(tmp);
+	const char *end=strstr(data, "\r\n\r\n");
+	body[0]='\0';
+	if (end && strncmp(data, "HTTP/1.1 200", 12)==0)
+		snprintf(body, sizeof(body), "%s", end+4);
+	return body;
+}
+
+void init_server(onion_handler *root){
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	onion_set_root_handler(server, root);
+}
+
+/// The cache keeps the file opened for the ttl, also if it does not exist.
+void t01_cache(){
+	INIT_LOCAL();
+	init_server(onion_handler_new(file_handler, NULL, NULL));
+	
+	unlink(filename);
+	onion_set_file_cache(server, 16, 60000);
+	FAIL_IF_NOT_EQUAL_STR(do_request("/"), "");
+	write_file(filename, "one");
+	FAIL_IF_NOT_EQUAL_STR(do_request("/"), ""); // Still cached as not existing
+	
+	onion_set_file_cache(server, 16, 60000); // A new cache
+	FAIL_IF_NOT_EQUAL_STR(do_request("/"), "one");
+	write_file(filename, "two");
+	FAIL_IF_NOT_EQUAL_STR(do_request("/"), "one"); // The cached fd, until it expires
+	
+	onion_set_file_cache(server, 16, 0); // Expires at once
+	FAIL_IF_NOT_EQUAL_STR(do_request("/"), "two");
+	usleep(20000);
+	write_file(filename, "three");
+	FAIL_IF_NOT_EQUAL_STR(do_request("/"), "three");
+	
+	onion_set_file_cache(server, 0, 0);
+	write_file(filename, "four");
+	FAIL_IF_NOT_EQUAL_STR(do_request("/"), "four");
+	
+	onion_free(server);
+	END_LOCAL();
+}
+
+/// export_local with the cache, with less entries than paths.
+void t02_export_local(){
+	INIT_LOCAL();
+	init_server(onion_handler_export_local_new(dirpath));
+	onion_set_file_cache(server, 1, 60000);
+	
+	char other[256];
+	snprintf(other, sizeof(other), "%s/other", dirpath);
+	write_file(filename, "file");
+	write_file(other, "other");
+	int i;
+	for (i=0;i<4;i++){ // Each one takes the only slot from the other
+		FAIL_IF_NOT_EQUAL_STR(do_request("/file"), "file");
+		FAIL_IF_NOT_EQUAL_STR(do_request("/other"), "other");
+	}
+	FAIL_IF_NOT_EQUAL_STR(do_request("/none"), "");
+	FAIL_IF_NOT_EQUAL_STR(do_request("/../etc/passwd"), "");
+	
+	onion_free(server);
+	unlink(other);
+	END_LOCAL();
+}
+
+/// Small files answered from memory, with the same headers, and the least recently used out.
+void t03_in_memory(){
+	INIT_LOCAL();
+	init_server(onion_handler_export_local_new(dirpath));
+	onion_set_file_cache(server, 65536, 60000); // Big, so no path takes the slot of other
+	onion_file_cache *cache=onion_get_file_cache(server);
+	onion_file_cache_set_memory(cache, 2048, 4096);
+	
+	char big[3000], name[256];
+	memset(big, 'b', sizeof(big)-1);
+	big[sizeof(big)-1]='\0';
+	snprintf(name, sizeof(name), "%s/big", dirpath);
+	write_file(name, big);
+	write_file(filename, "file");
+	FAIL_IF_NOT_EQUAL_STR(do_request("/file"), "file");
+	write_file(filename, "changed");
+	FAIL_IF_NOT_EQUAL_STR(do_request("/file"), "file"); // From memory
+	FAIL_IF_NOT_EQUAL_STR(do_request("/big"), big); // Too big for memory
+	
+	onion_file_cache_stats stats;
+	onion_file_cache_get_stats(cache, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.hits, 4); // Each request gets it at export_local, and at the shortcut
+	FAIL_IF_NOT_EQUAL_INT(stats.misses, 2);
+	FAIL_IF_NOT_EQUAL_INT(stats.in_memory, 1);
+	FAIL_IF_NOT_EQUAL_INT(stats.memory, 4);
+	
+	const char *res=raw_request("GET /file HTTP/1.1\r\n\r\n");
+	FAIL_IF_EQUAL(strstr(res, "Content-Length: 4\r\n"), NULL);
+	FAIL_IF_EQUAL(strstr(res, "Content-Type: "), NULL);
+	FAIL_IF_EQUAL(strstr(res, "Accept-Ranges: bytes\r\n"), NULL);
+	const char *etag=strstr(res, "Etag: ");
+	FAIL_IF_EQUAL(etag, NULL);
+	char req304[256];
+	snprintf(req304, sizeof(req304), "GET /file HTTP/1.1\r\nIf-None-Match: %.*s\r\n\r\n", (int)(strchr(etag, '\r')-etag-6), etag+6);
+	FAIL_IF_EQUAL(strstr(raw_request(req304), " 304 "), NULL);
+	res=raw_request("HEAD /file HTTP/1.1\r\n\r\n");
+	FAIL_IF_EQUAL(strstr(res, "Content-Length: 4\r\n"), NULL);
+	FAIL_IF_NOT_EQUAL_STR(strstr(res, "\r\n\r\n"), "\r\n\r\n");
+	res=raw_request("GET /file HTTP/1.1\r\nRange: bytes=1-2\r\n\r\n");
+	FAIL_IF_EQUAL(strstr(res, " 206 "), NULL);
+	FAIL_IF_NOT_EQUAL_STR(strstr(res, "\r\n\r\n"), "\r\n\r\nil");
+	
+	// Three of 1500 bytes do not fit at 4096, the least recently used goes out.
+	char medium[1501], names[3][256];
+	int i;
+	memset(medium, 'm', sizeof(medium)-1);
+	medium[sizeof(medium)-1]='\0';
+	for (i=0;i<3;i++){
+		snprintf(names[i], sizeof(names[i]), "%s/m%d", dirpath, i);
+		write_file(names[i], medium);
+		snprintf(name, sizeof(name), "/m%d", i);
+		FAIL_IF_NOT_EQUAL_STR(do_request(name), medium);
+	}
+	onion_file_cache_get_stats(cache, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.evictions, 2); // /file went first, then /m0
+	FAIL_IF_NOT_EQUAL_INT(stats.in_memory, 2);
+	FAIL_IF_NOT_EQUAL_INT(stats.memory, 3000);
+	FAIL_IF_NOT_EQUAL_STR(do_request("/file"), "changed"); // Read again
+	
+	onion_free(server);
+	for (i=0;i<3;i++)
+		unlink(names[i]);
+	snprintf(name, sizeof(name), "%s/big", dirpath);
+	unlink(name);
+	END_LOCAL();
+}
+
+/// GETs the listing as json, and sets etag from the answer. Returns the body, or the status line if not 200.
+const char *json_listing(const char *path, const char *if_none_match, char *etag){
+	char tmp[512];
+	snprintf(tmp, sizeof(tmp), "GET %s HTTP/1.1\r\nAccept: application/json\r\n%s%s%s\r\n", path,
+					 if_none_match ? "If-None-Match: " : "", if_none_match ? if_none_match : "", if_none_match ? "\r\n" : "");
+	const char *data=raw_request(tmp);
+	const char *e=strstr(data, "ETag: ");
+	if (e)
+		sscanf(e+6, "%63s", etag);
+	if (strncmp(data, "HTTP/1.1 200", 12)!=0)
+		return strncmp(data, "HTTP/1.1 304", 12)==0 ? "304" : data;
+	return strstr(data, "\r\n\r\n")+4;
+}
+
+/// Listings from the cache, updated as files come and go, with ETags.
+void t04_listing_cache(){
+	INIT_LOCAL();
+	onion_handler *export_local=onion_handler_export_local_new(dirpath);
+	onion_handler_export_local_set_listing_cache(export_local, 1024*1024);
+	init_server(export_local);
+
+	char list[200], a[256], b[256], c[256];
+	snprintf(list, sizeof(list), "%s/list", dirpath);
+	snprintf(a, sizeof(a), "%s/a", list);
+	snprintf(b, sizeof(b), "%s/b", list);
+	snprintf(c, sizeof(c), "%s/c", list);
+	mkdir(list, 0700);
+	write_file(a, "aa");
+	write_file(b, "bbb");
+
+	char etag[64]="", etag2[64]="";
+	const char *body=json_listing("/list/", NULL, etag);
+	FAIL_IF_NOT(strstr(body, "[{\"name\":\"a\",\"size\":2,\"owner\":"));
+	FAIL_IF_NOT(strstr(body, "{\"name\":\"b\",\"size\":3,"));
+	FAIL_IF_NOT(strstr(body, "\"dir\":false}]"));
+	FAIL_IF_EQUAL_STR(etag, "");
+	FAIL_IF_NOT_EQUAL_STR(json_listing("/list/", etag, etag2), "304");
+
+	write_file(c, "ccc");
+	unlink(a);
+	body=json_listing("/list/", etag, etag2);
+	FAIL_IF_NOT(strstr(body, "[{\"name\":\"b\",\"size\":3,"));
+	FAIL_IF_NOT(strstr(body, "{\"name\":\"c\",\"size\":3,"));
+	FAIL_IF(strstr(body, "\"a\""));
+	FAIL_IF(strstr(body, ".tmp"));
+	FAIL_IF_EQUAL_STR(etag, etag2);
+
+	write_file(b, "bigger");
+	body=json_listing("/list/", NULL, etag);
+	FAIL_IF_NOT(strstr(body, "{\"name\":\"b\",\"size\":6,"));
+
+	char quoted[256];
+	snprintf(quoted, sizeof(quoted), "%s/q\"<b>", list);
+	write_file(quoted, "");
+	const char *data=raw_request("GET /list/ HTTP/1.1\r\n\r\n"); // The html page, names escaped inside the script
+	FAIL_IF_NOT(strstr(data, "Content-Type: text/html; charset=utf-8\r\n"));
+	FAIL_IF_NOT(strstr(data, "  [\"b\",6,"));
+	FAIL_IF_NOT(strstr(data, "  [\"c\",3,"));
+	FAIL_IF_NOT(strstr(data, "  [\"q\\\"\\u003cb>\",0,"));
+	FAIL_IF_NOT(strstr(data, "  [] ]\n</script>"));
+
+	onion_free(server);
+	unlink(b);
+	unlink(c);
+	unlink(quoted);
+	rmdir(list);
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	
+	onion_log_flags=OF_INIT|OF_NOINFO;
+	if (!mkdtemp(dirpath))
+		ONION_ERROR("Could not create temporal dir");
+	snprintf(filename, sizeof(filename), "%s/file", dirpath);
+	
+	t01_cache();
+	t02_export_local();
+	t03_in_memory();
+	t04_listing_cache();
+	
+	unlink(filename);
+	rmdir(dirpath);
+	END();
+}
@@ -0,0 +1,212 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <onion/onion.h>
+#include <onion/dict.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/block.h>
+#include <onion/log.h>
+#include <onion/handlers/cache.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+onion *server;
+onion_listen_point *custom_io;
+int calls=0;
+int delay_ms=0;
+
+/// Answers with the number of call, the query and the language, after delay_ms.
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	int n=__sync_add_and_fetch(&calls, 1);
+	if (delay_ms)
+		usleep(delay_ms*1000);
+	const char *path=onion_request_get_path(req);
+	if (strcmp(path, "cookie")==0)
+		onion_response_add_cookie(res, "a", "b", -1, NULL, NULL, 0);
+	if (strcmp(path, "private")==0)
+		onion_response_set_header(res, "Cache-Control", "private");
+	if (strcmp(path, "error")==0)
+		return OCS_INTERNAL_ERROR;
+	if (strcmp(path, "missing")==0)
+		onion_response_set_code(res, HTTP_NOT_FOUND);
+	onion_response_set_header(res, "Content-Type", "text/plain");
+	onion_response_set_header(res, "X-Custom", "yes");
+	const char *lang=onion_request_get_header(req, "Accept-Language");
+	onion_response_printf(res, "call %d %s %s", n, onion_request_get_queryd(req, "q", "-"), lang ? lang : "-");
+	return OCS_PROCESSED;
+}
+
+/// Does the request, and returns the body, or NULL. The headers at headers, if not NULL.
+char *do_request(const char *method, const char *path, const char *extra, char *headers, size_t size){
+	onion_request *req=onion_request_new(custom_io);
+	char tmp[512];
+	snprintf(tmp, sizeof(tmp), "%s /%s HTTP/1.1\r\n%s\r\n", method, path, extra ? extra : "");
+	onion_request_write(req, tmp, strlen(tmp));
+	const char *data=onion_buffer_listen_point_get_buffer_data(req);
+	const char *end=strstr(data, "\r\n\r\n");
+	char *ret=end ? strdup(end+4) : NULL;
+	if (headers && end)
+		snprintf(headers, size, "%.*s", (int)(end-data), data);
+	onion_request_free(req);
+	return ret;
+}
+
+#define CHECK_BODY(method, path, extra, expected) { \
+	char *body=do_request(method, path, extra, NULL, 0); \
+	FAIL_IF_NOT_EQUAL_STR(body, expected); \
+	free(body); \
+}
+
+void init(int ttl, int stale, size_t max_size, size_t max_entry_size){
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	onion_handler *cache=onion_handler_cache(onion_handler_new(handler, NULL, NULL), ttl, stale, max_size, max_entry_size);
+	onion_handler_cache_vary(cache, "Accept-Language");
+	onion_set_root_handler(server, cache);
+	calls=0;
+	delay_ms=0;
+}
+
+/// Hits replay the code, headers and body, by path, query and vary headers.
+void t01_hits(){
+	INIT_LOCAL();
+	init(10000, 0, 1024*1024, 64*1024);
+
+	char headers[1024];
+	char *body=do_request("GET", "a?q=1", NULL, headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL_STR(body, "call 1 1 -");
+	free(body);
+	body=do_request("GET", "a?q=1", NULL, headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL_STR(body, "call 1 1 -");
+	free(body);
+	FAIL_IF_EQUAL(strstr(headers, "X-Custom: yes"), NULL);
+	FAIL_IF_EQUAL(strstr(headers, "Content-Type: text/plain\r\n"), NULL);
+	FAIL_IF_NOT_EQUAL(strstr(headers, "text/html"), NULL); // The default is replaced
+	FAIL_IF_EQUAL(strstr(headers, "Content-Length: 10\r\n"), NULL);
+
+	CHECK_BODY("GET", "a?q=2", NULL, "call 2 2 -");
+	CHECK_BODY("GET", "b?q=1", NULL, "call 3 1 -");
+	CHECK_BODY("GET", "a?q=1", "Accept-Language: es\r\n", "call 4 1 es");
+	CHECK_BODY("GET", "a?q=1", "Accept-Language: es\r\n", "call 4 1 es");
+	CHECK_BODY("HEAD", "a?q=1", NULL, "");
+	CHECK_BODY("GET", "missing", NULL, "call 5 - -");
+	CHECK_BODY("GET", "missing", NULL, "call 5 - -");
+	FAIL_IF_NOT_EQUAL_INT(calls, 5);
+
+	// Not cached
+	CHECK_BODY("DELETE", "a?q=1", NULL, "call 6 1 -");
+	CHECK_BODY("GET", "a?q=1", "Authorization: Basic eDp5\r\n", "call 7 1 -");
+	CHECK_BODY("GET", "cookie", NULL, "call 8 - -");
+	CHECK_BODY("GET", "cookie", NULL, "call 9 - -");
+	CHECK_BODY("GET", "private", NULL, "call 10 - -");
+	CHECK_BODY("GET", "private", NULL, "call 11 - -");
+	free(do_request("GET", "error", NULL, NULL, 0));
+	free(do_request("GET", "error", NULL, NULL, 0));
+	FAIL_IF_NOT_EQUAL_INT(calls, 13);
+	CHECK_BODY("HEAD", "c", NULL, ""); // Does not fill
+	CHECK_BODY("GET", "c", NULL, "call 15 - -");
+
+	onion_free(server);
+	END_LOCAL();
+}
+
+/// Fresh for the ttl, then stale while refreshing, then gone.
+void t02_ttl(){
+	INIT_LOCAL();
+	init(100, 200, 1024*1024, 64*1024);
+
+	CHECK_BODY("GET", "a", NULL, "call 1 - -");
+	CHECK_BODY("GET", "a", NULL, "call 1 - -");
+	usleep(150000);
+	CHECK_BODY("GET", "a", NULL, "call 2 - -"); // Stale, this one refreshes it
+	CHECK_BODY("GET", "a", NULL, "call 2 - -");
+	usleep(400000);
+	CHECK_BODY("GET", "a", NULL, "call 3 - -"); // Too old
+	FAIL_IF_NOT_EQUAL_INT(calls, 3);
+
+	onion_free(server);
+	END_LOCAL();
+}
+
+/// Big bodies are not kept, and the least recently used go when full.
+void t03_sizes(){
+	INIT_LOCAL();
+	init(10000, 0, 150, 20); // Each is about 55 bytes, with its key and headers
+
+	CHECK_BODY("GET", "a?q=0123456789012", NULL, "call 1 0123456789012 -"); // Body over 20
+	CHECK_BODY("GET", "a?q=0123456789012", NULL, "call 2 0123456789012 -");
+	CHECK_BODY("GET", "a", NULL, "call 3 - -");
+	CHECK_BODY("GET", "b", NULL, "call 4 - -");
+	CHECK_BODY("GET", "a", NULL, "call 3 - -");
+	CHECK_BODY("GET", "c", NULL, "call 5 - -"); // Over 150: b, the least recently used, goes
+	CHECK_BODY("GET", "a", NULL, "call 3 - -");
+	CHECK_BODY("GET", "b", NULL, "call 6 - -");
+
+	onion_free(server);
+	END_LOCAL();
+}
+
+char *thread_bodies[8];
+
+void *request_thread(void *n){
+	thread_bodies[(long)n]=do_request("GET", "slow", NULL, NULL, 0);
+	return NULL;
+}
+
+/// Concurrent misses of a key run the handler once, and all get its response.
+void t04_coalescing(){
+	INIT_LOCAL();
+	init(10000, 0, 1024*1024, 64*1024);
+	delay_ms=200;
+
+	pthread_t th[8];
+	long i;
+	for (i=0;i<8;i++)
+		pthread_create(&th[i], NULL, request_thread, (void*)i);
+	for (i=0;i<8;i++)
+		pthread_join(th[i], NULL);
+	FAIL_IF_NOT_EQUAL_INT(calls, 1);
+	for (i=0;i<8;i++){
+		FAIL_IF_NOT_EQUAL_STR(thread_bodies[i], "call 1 - -");
+		free(thread_bodies[i]);
+	}
+
+	onion_free(server);
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	onion_log_flags=OF_INIT|OF_NOINFO;
+	t01_hits();
+	t02_ttl();
+	t03_sizes();
+	t04_coalescing();
+
+	END();
+}
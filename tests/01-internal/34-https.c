@@ -0,0 +1,929 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#include <gnutls/ocsp.h>
+#include <gnutls/abstract.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/response.h>
+#include <onion/https.h>
+#include <onion/shortcuts.h>
+
+#include "../ctest.h"
+
+#define CERTFILE "34-https.pem"
+#define CERTFILE2 "34-https-2.pem"
+#define CERTFILE3 "34-https-ocsp.pem"
+#define OCSP_URL "http://localhost:8101/ocsp"
+#define BIGFILE "34-https.data"
+#define BIGFILE_SIZE (300*1024)
+
+onion *o;
+onion_listen_point *https;
+
+int connect_to(const char *addr, const char *port){
+  struct addrinfo hints;
+  struct addrinfo *server;
+
+  memset(&hints,0, sizeof(struct addrinfo));
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+  if (getaddrinfo(addr,port,&hints,&server)<0){
+    ONION_ERROR("Error getting server info");
+    return -1;
+  }
+  int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+  if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+    close(fd);
+    fd=-1;
+    ONION_ERROR("Error connecting to server %s:%s",addr,port);
+  }
+
+  freeaddrinfo(server);
+
+  return fd;
+}
+
+/// A self signed certificate for that name and its key, at the same file, as certtool may not be there. With that OCSP responder, if any.
+int write_certificate(const char *filename, const char *name, const char *ocsp_url){
+	gnutls_x509_privkey_t key;
+	gnutls_x509_crt_t crt;
+	gnutls_x509_privkey_init(&key);
+	gnutls_x509_privkey_generate(key, GNUTLS_PK_RSA, 2048, 0);
+	gnutls_x509_crt_init(&crt);
+	gnutls_x509_crt_set_version(crt, 3);
+	gnutls_x509_crt_set_serial(crt, "\x01", 1);
+	gnutls_x509_crt_set_activation_time(crt, time(NULL)-3600);
+	gnutls_x509_crt_set_expiration_time(crt, time(NULL)+3600);
+	gnutls_x509_crt_set_dn_by_oid(crt, GNUTLS_OID_X520_COMMON_NAME, 0, name, strlen(name));
+	gnutls_x509_crt_set_key(crt, key);
+	if (ocsp_url){
+		gnutls_datum_t url={ (unsigned char*)ocsp_url, strlen(ocsp_url) };
+		gnutls_x509_crt_set_authority_info_access(crt, GNUTLS_IA_OCSP_URI, &url);
+	}
+	int r=gnutls_x509_crt_sign2(crt, crt, key, GNUTLS_DIG_SHA256, 0);
+
+	static char pem[16*1024];
+	size_t l1=sizeof(pem), l2;
+	if (r>=0)
+		r=gnutls_x509_crt_export(crt, GNUTLS_X509_FMT_PEM, pem, &l1);
+	l2=sizeof(pem)-l1;
+	if (r>=0)
+		r=gnutls_x509_privkey_export(key, GNUTLS_X509_FMT_PEM, pem+l1, &l2);
+	gnutls_x509_crt_deinit(crt);
+	gnutls_x509_privkey_deinit(key);
+	if (r<0)
+		return -1;
+	char tmp[256];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+	FILE *f=fopen(tmp, "w");
+	fwrite(pem, 1, l1+l2, f);
+	fclose(f);
+	return rename(tmp, filename); // As certbot, the new one appears at once
+}
+
+/// Whether the server stapled an OCSP response at the last client_connect
+int client_stapled=0;
+
+/// Handshakes, and returns the session, or NULL. At name, the common name of the server certificate.
+gnutls_session_t client_connect(const char *port, char *name, size_t size){
+	static gnutls_certificate_credentials_t cred=NULL;
+	gnutls_session_t session;
+	if (!cred)
+		gnutls_certificate_allocate_credentials(&cred);
+	gnutls_init(&session, GNUTLS_CLIENT);
+	gnutls_priority_set_direct(session, "NORMAL:+VERS-TLS1.0", NULL);
+	gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, cred);
+	gnutls_ocsp_status_request_enable_client(session, NULL, 0, NULL);
+	int fd=connect_to("localhost", port);
+	gnutls_transport_set_int(session, fd); // A macro, that uses fd twice
+	int ret;
+	do{
+		ret=gnutls_handshake(session);
+	}while (ret<0 && !gnutls_error_is_fatal(ret));
+	gnutls_datum_t stapled;
+	client_stapled=(ret>=0 && gnutls_ocsp_status_request_get(session, &stapled)==0);
+	unsigned int n=0;
+	const gnutls_datum_t *peers=ret<0 ? NULL : gnutls_certificate_get_peers(session, &n);
+	name[0]=0;
+	if (peers && n){
+		gnutls_x509_crt_t crt;
+		gnutls_x509_crt_init(&crt);
+		gnutls_x509_crt_import(crt, &peers[0], GNUTLS_X509_FMT_DER);
+		gnutls_x509_crt_get_dn_by_oid(crt, GNUTLS_OID_X520_COMMON_NAME, 0, 0, name, &size);
+		gnutls_x509_crt_deinit(crt);
+	}
+	if (ret<0){
+		ONION_ERROR("Client handshake failed: %s", gnutls_strerror(ret));
+		close(gnutls_transport_get_int(session));
+		gnutls_deinit(session);
+		return NULL;
+	}
+	return session;
+}
+
+/// A keep alive request at the session, returns 1 if answered.
+int client_request(gnutls_session_t session){
+	const char *request="GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	char buffer[1024];
+	gnutls_record_send(session, request, strlen(request));
+	ssize_t l=0, r;
+	buffer[0]=0;
+	while (!strstr(buffer, "\r\n\r\nok") && (r=gnutls_record_recv(session, buffer+l, sizeof(buffer)-l-1))>0){
+		l+=r;
+		buffer[l]=0;
+	}
+	return strstr(buffer, "\r\n\r\nok")!=NULL;
+}
+
+void client_close(gnutls_session_t session){
+	gnutls_bye(session, GNUTLS_SHUT_RDWR);
+	close(gnutls_transport_get_int(session));
+	gnutls_deinit(session);
+}
+
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	onion_response_set_length(res, 2);
+	onion_response_write(res, "ok", 2);
+	return OCS_PROCESSED;
+}
+
+onion_connection_status file_handler(void *_, onion_request *req, onion_response *res){
+	return onion_shortcut_response_file(BIGFILE, req, res);
+}
+
+/// Gets the file with TLS 1.3, and checks it. Returns its length, or -1.
+ssize_t client_get_file(const char *port){
+	gnutls_certificate_credentials_t cred;
+	gnutls_session_t session;
+	gnutls_certificate_allocate_credentials(&cred);
+	gnutls_init(&session, GNUTLS_CLIENT);
+	gnutls_priority_set_direct(session, "NORMAL", NULL);
+	gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, cred);
+	int fd=connect_to("localhost", port);
+	gnutls_transport_set_int(session, fd);
+	int ret;
+	do{
+		ret=gnutls_handshake(session);
+	}while (ret<0 && !gnutls_error_is_fatal(ret));
+	ssize_t length=-1;
+	if (ret<0 || gnutls_protocol_get_version(session)!=GNUTLS_TLS1_3)
+		ONION_ERROR("TLS 1.3 handshake failed: %s", ret<0 ? gnutls_strerror(ret) : gnutls_protocol_get_name(gnutls_protocol_get_version(session)));
+	if (ret>=0 && gnutls_protocol_get_version(session)==GNUTLS_TLS1_3){
+		char *buffer=malloc(BIGFILE_SIZE+4096);
+		const char *request="GET / HTTP/1.0\r\n\r\n";
+		gnutls_record_send(session, request, strlen(request));
+		ssize_t l=0, r;
+		while ((r=gnutls_record_recv(session, buffer+l, BIGFILE_SIZE+4096-l))>0 || r==GNUTLS_E_AGAIN || r==GNUTLS_E_INTERRUPTED) // AGAIN after the tickets of TLS 1.3
+			l+=r>0 ? r : 0;
+		char *body=NULL;
+		ssize_t i;
+		for (i=0;i+4<=l && !body;i++){
+			if (memcmp(buffer+i, "\r\n\r\n", 4)==0)
+				body=buffer+i+4;
+		}
+		if (body){
+			length=l-(body-buffer);
+			for (i=0;i<length;i++){
+				if (body[i]!=(char)(i%251)){
+					length=-1;
+					break;
+				}
+			}
+		}
+		free(buffer);
+	}
+	close(fd);
+	gnutls_deinit(session);
+	gnutls_certificate_free_credentials(cred);
+	return length;
+}
+
+/**
+ * Connects, resuming *data if any, and does a request. *data gets the session data for the next.
+ * 
+ * @returns 1 if resumed, 0 if a full handshake, -1 on error.
+ */
+int client(const char *port, int flags, gnutls_datum_t *data){
+	gnutls_certificate_credentials_t cred;
+	gnutls_session_t session;
+	gnutls_certificate_allocate_credentials(&cred);
+	gnutls_init(&session, GNUTLS_CLIENT | flags);
+	gnutls_priority_set_direct(session, "NORMAL:+VERS-TLS1.0", NULL);
+	gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, cred);
+	if (data->data)
+		gnutls_session_set_data(session, data->data, data->size);
+	int fd=connect_to("localhost", port);
+	gnutls_transport_set_int(session, fd);
+	int ret;
+	do{
+		ret=gnutls_handshake(session);
+	}while (ret<0 && !gnutls_error_is_fatal(ret));
+	if (ret>=0){
+		ret=gnutls_session_is_resumed(session) ? 1 : 0;
+		char buffer[1024];
+		const char *request="GET / HTTP/1.0\r\n\r\n";
+		gnutls_record_send(session, request, strlen(request));
+		ssize_t l=0, r;
+		while ((r=gnutls_record_recv(session, buffer+l, sizeof(buffer)-l-1))>0)
+			l+=r;
+		buffer[l]=0;
+		if (!strstr(buffer, "\r\n\r\nok"))
+			ret=-1;
+		gnutls_free(data->data);
+		gnutls_session_get_data2(session, data);
+		gnutls_bye(session, GNUTLS_SHUT_RDWR);
+	}
+	else
+		ONION_ERROR("Client handshake failed: %s", gnutls_strerror(ret));
+	close(fd);
+	gnutls_deinit(session);
+	gnutls_certificate_free_credentials(cred);
+	return ret;
+}
+
+void start_server(const char *port){
+	o=onion_new(O_THREADED | O_DETACH_LISTEN);
+	https=onion_https_new();
+	onion_add_listen_point(o, "localhost", port, https);
+	onion_https_set_certificate(https, O_SSL_CERTIFICATE_KEY, CERTFILE, CERTFILE);
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+}
+
+/// Resumes by session ticket, without cache.
+void t01_tickets(){
+	INIT_LOCAL();
+
+	start_server("8095");
+	onion_listen(o);
+	usleep(100000);
+
+	gnutls_datum_t data={ NULL, 0 };
+	FAIL_IF_NOT_EQUAL_INT(client("8095", 0, &data), 0);
+	FAIL_IF_NOT_EQUAL_INT(client("8095", 0, &data), 1);
+	FAIL_IF_NOT_EQUAL_INT(client("8095", 0, &data), 1);
+
+	onion_https_stats stats;
+	FAIL_IF_NOT_EQUAL_INT(onion_https_get_stats(https, &stats), 0);
+	FAIL_IF_NOT_EQUAL_INT(stats.handshakes, 3);
+	FAIL_IF_NOT_EQUAL_INT(stats.resumed, 2);
+	FAIL_IF_NOT_EQUAL_INT(stats.cache_hits+stats.cache_misses, 0);
+
+	gnutls_free(data.data);
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+/// Without tickets, resumes by the session id at the cache.
+void t02_cache(){
+	INIT_LOCAL();
+
+	start_server("8096");
+	onion_https_set_ticket_rotation(https, -1);
+	FAIL_IF_NOT_EQUAL_INT(onion_https_set_session_cache(https, 64, 60, 1), 0);
+	onion_listen(o);
+	usleep(100000);
+
+	gnutls_datum_t data={ NULL, 0 };
+	FAIL_IF_NOT_EQUAL_INT(client("8096", GNUTLS_NO_TICKETS, &data), 0);
+	FAIL_IF_NOT_EQUAL_INT(client("8096", GNUTLS_NO_TICKETS, &data), 1);
+
+	onion_https_stats stats;
+	onion_https_get_stats(https, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.handshakes, 2);
+	FAIL_IF_NOT_EQUAL_INT(stats.resumed, 1);
+	FAIL_IF_NOT_EQUAL_INT(stats.cache_hits, 1);
+	FAIL_IF_NOT_EQUAL_INT(stats.cache_stores, 1);
+
+	gnutls_free(data.data);
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+/// Tickets of a rotated key are not valid anymore.
+void t03_rotation(){
+	INIT_LOCAL();
+
+	start_server("8097");
+	onion_https_set_ticket_rotation(https, 1);
+	onion_listen(o);
+	usleep(100000);
+
+	gnutls_datum_t data={ NULL, 0 };
+	FAIL_IF_NOT_EQUAL_INT(client("8097", 0, &data), 0);
+	FAIL_IF_NOT_EQUAL_INT(client("8097", 0, &data), 1);
+	sleep(1);
+	usleep(100000);
+	FAIL_IF_NOT_EQUAL_INT(client("8097", 0, &data), 0);
+	FAIL_IF_NOT_EQUAL_INT(client("8097", 0, &data), 1);
+
+	gnutls_free(data.data);
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+/// Clients that do not end their handshakes do not stop the others, at a single poller thread.
+void t04_slow_handshakes(){
+	INIT_LOCAL();
+
+	o=onion_new(O_POLL | O_DETACH_LISTEN);
+	onion_set_max_threads(o, 1);
+	onion_set_timeout(o, 5000);
+	https=onion_https_new();
+	onion_add_listen_point(o, "localhost", "8098", https);
+	onion_https_set_certificate(https, O_SSL_CERTIFICATE_KEY, CERTFILE, CERTFILE);
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+	onion_listen(o);
+	usleep(100000);
+
+	int silent=connect_to("localhost", "8098");
+	int half=connect_to("localhost", "8098");
+	FAIL_IF_NOT_EQUAL_INT(write(half, "\x16\x03\x01\x02\x00\x01", 6), 6); // Start of a client hello
+	usleep(100000);
+
+	time_t t0=time(NULL);
+	gnutls_datum_t data={ NULL, 0 };
+	int i;
+	for (i=0;i<4;i++)
+		FAIL_IF_NOT_EQUAL_INT(client("8098", 0, &data), i ? 1 : 0);
+	FAIL_IF(time(NULL)-t0>2);
+
+	onion_https_stats stats;
+	onion_https_get_stats(https, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.handshakes, 4);
+
+	close(silent);
+	close(half);
+	gnutls_free(data.data);
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+/// Files over TLS 1.3: by sendfile if the kernel TLS is there, else read and written.
+void t05_file(){
+	INIT_LOCAL();
+
+	FILE *f=fopen(BIGFILE, "w");
+	int i;
+	for (i=0;i<BIGFILE_SIZE;i++)
+		fputc(i%251, f);
+	fclose(f);
+
+	o=onion_new(O_POLL | O_DETACH_LISTEN);
+	https=onion_https_new();
+	onion_add_listen_point(o, "localhost", "8099", https);
+	onion_https_set_certificate(https, O_SSL_CERTIFICATE_KEY, CERTFILE, CERTFILE);
+	FAIL_IF_EQUAL_INT(onion_https_set_priority(https, "NORMAL:+NO_SUCH_THING"), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_https_set_priority(https, "NORMAL"), 0);
+	onion_set_root_handler(o, onion_handler_new(file_handler, NULL, NULL));
+	onion_listen(o);
+	usleep(100000);
+
+	FAIL_IF_NOT_EQUAL_INT(client_get_file("8099"), BIGFILE_SIZE);
+	FAIL_IF_NOT_EQUAL_INT(client_get_file("8099"), BIGFILE_SIZE);
+
+	onion_https_stats stats;
+	onion_https_get_stats(https, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.handshakes, 2);
+	ONION_INFO("%ld connections by kernel TLS", stats.ktls);
+
+	onion_free(o);
+	unlink(BIGFILE);
+
+	END_LOCAL();
+}
+
+/// New handshakes get the reloaded certificate, the open connections keep theirs.
+void t06_reload(){
+	INIT_LOCAL();
+
+	start_server("8100");
+	onion_listen(o);
+	usleep(100000);
+
+	char name[64];
+	gnutls_session_t old=client_connect("8100", name, sizeof(name));
+	FAIL_IF_EQUAL(old, NULL);
+	FAIL_IF_NOT_EQUAL_STR(name, "localhost");
+
+	FAIL_IF_NOT_EQUAL_INT(write_certificate(CERTFILE2, "second", NULL), 0);
+	FAIL_IF_EQUAL_INT(onion_https_reload_certificate(https, NULL, O_SSL_CERTIFICATE_KEY, "no-such-file.pem", "no-such-file.pem", O_SSL_NONE), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_https_reload_certificate(https, NULL, O_SSL_CERTIFICATE_KEY, CERTFILE2, CERTFILE2, O_SSL_NONE), 0);
+	gnutls_session_t session=client_connect("8100", name, sizeof(name));
+	FAIL_IF_NOT_EQUAL_STR(name, "second");
+	FAIL_IF_NOT(client_request(session));
+	client_close(session);
+	FAIL_IF_NOT(client_request(old)); // Still there
+	client_close(old);
+
+	// The watch sees the file replaced
+	FAIL_IF_NOT_EQUAL_INT(onion_https_watch_certificates(https, 1), 0);
+	session=client_connect("8100", name, sizeof(name));
+	FAIL_IF_NOT_EQUAL_STR(name, "second");
+	client_close(session);
+	FAIL_IF_NOT_EQUAL_INT(write_certificate(CERTFILE2, "third", NULL), 0);
+	usleep(1100000);
+	session=client_connect("8100", name, sizeof(name));
+	FAIL_IF_NOT_EQUAL_STR(name, "third");
+	client_close(session);
+
+	onion_https_stats stats;
+	onion_https_get_stats(https, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.certificate_reloads, 2);
+
+	onion_free(o);
+	unlink(CERTFILE2);
+
+	END_LOCAL();
+}
+
+/// A DER encoding being built
+typedef struct{
+	unsigned char data[8192];
+	int size;
+}der;
+
+/// Adds the element with that tag and content.
+void der_add(der *d, unsigned char tag, const void *content, int length){
+	d->data[d->size++]=tag;
+	if (length>=256){
+		d->data[d->size++]=0x82;
+		d->data[d->size++]=length>>8;
+	}
+	else if (length>=128)
+		d->data[d->size++]=0x81;
+	d->data[d->size++]=length&0xFF;
+	memcpy(d->data+d->size, content, length);
+	d->size+=length;
+}
+
+void der_time(der *d, time_t t){
+	char tmp[32];
+	strftime(tmp, sizeof(tmp), "%Y%m%d%H%M%SZ", gmtime(&t));
+	der_add(d, 0x18, tmp, strlen(tmp));
+}
+
+int responder_fd=-1;
+int responder_requests=0;
+int responder_garbage=0; ///< Answers something that is not an OCSP response
+
+/**
+ * @short A good OCSP response for the certificate of the request, signed with the key of that certificate file.
+ * 
+ * GnuTLS can not make OCSP responses, so it is encoded here.
+ */
+int ocsp_response(const char *certfile, const gnutls_datum_t *request, der *response){
+	gnutls_ocsp_req_t req;
+	gnutls_datum_t name_hash, key_hash, serial, file, dn, signature;
+	gnutls_digest_algorithm_t digest;
+	gnutls_ocsp_req_init(&req);
+	if (gnutls_ocsp_req_import(req, request)<0 || gnutls_ocsp_req_get_cert_id(req, 0, &digest, &name_hash, &key_hash, &serial)<0 || digest!=GNUTLS_DIG_SHA1){
+		gnutls_ocsp_req_deinit(req);
+		return -1;
+	}
+	gnutls_ocsp_req_deinit(req);
+	gnutls_x509_crt_t crt;
+	gnutls_x509_privkey_t key;
+	gnutls_privkey_t privkey;
+	gnutls_load_file(certfile, &file);
+	gnutls_x509_crt_init(&crt);
+	gnutls_x509_crt_import(crt, &file, GNUTLS_X509_FMT_PEM);
+	gnutls_x509_privkey_init(&key);
+	gnutls_x509_privkey_import(key, &file, GNUTLS_X509_FMT_PEM);
+	gnutls_privkey_init(&privkey);
+	gnutls_privkey_import_x509(privkey, key, 0);
+	gnutls_x509_crt_get_raw_dn(crt, &dn);
+
+	time_t now=time(NULL);
+	der certid={{0},0}, single={{0},0}, responses={{0},0}, tbs={{0},0}, tbs_seq={{0},0}, basic={{0},0}, basic_seq={{0},0}, bytes={{0},0}, tmp={{0},0};
+	const unsigned char sha1[]={ 0x06, 0x05, 0x2B, 0x0E, 0x03, 0x02, 0x1A, 0x05, 0x00 };
+	der_add(&certid, 0x30, sha1, sizeof(sha1));
+	der_add(&certid, 0x04, name_hash.data, name_hash.size);
+	der_add(&certid, 0x04, key_hash.data, key_hash.size);
+	der_add(&certid, 0x02, serial.data, serial.size);
+	der_add(&single, 0x30, certid.data, certid.size);
+	der_add(&single, 0x80, "", 0); // good
+	der_time(&single, now-60);
+	der_time(&tmp, now+3600);
+	der_add(&single, 0xA0, tmp.data, tmp.size);
+	der_add(&responses, 0x30, single.data, single.size);
+	der_add(&tbs, 0xA1, dn.data, dn.size); // responder by name
+	der_time(&tbs, now);
+	der_add(&tbs, 0x30, responses.data, responses.size);
+	der_add(&tbs_seq, 0x30, tbs.data, tbs.size);
+
+	gnutls_datum_t to_sign={ tbs_seq.data, tbs_seq.size };
+	int r=gnutls_privkey_sign_data(privkey, GNUTLS_DIG_SHA256, 0, &to_sign, &signature);
+	if (r>=0){
+		const unsigned char sha256_rsa[]={ 0x06, 0x09, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x01, 0x0B, 0x05, 0x00 };
+		memcpy(basic.data, tbs_seq.data, tbs_seq.size);
+		basic.size=tbs_seq.size;
+		der_add(&basic, 0x30, sha256_rsa, sizeof(sha256_rsa));
+		tmp.size=0;
+		tmp.data[tmp.size++]=0; // No unused bits
+		memcpy(tmp.data+1, signature.data, signature.size);
+		tmp.size+=signature.size;
+		der_add(&basic, 0x03, tmp.data, tmp.size);
+		der_add(&basic_seq, 0x30, basic.data, basic.size);
+		const unsigned char ocsp_basic[]={ 0x06, 0x09, 0x2B, 0x06, 0x01, 0x05, 0x05, 0x07, 0x30, 0x01, 0x01 };
+		tmp.size=0;
+		memcpy(tmp.data, ocsp_basic, sizeof(ocsp_basic));
+		tmp.size=sizeof(ocsp_basic);
+		der_add(&tmp, 0x04, basic_seq.data, basic_seq.size);
+		der_add(&bytes, 0x30, tmp.data, tmp.size);
+		tmp.size=0;
+		der_add(&tmp, 0x0A, "", 1); // successful
+		der_add(&tmp, 0xA0, bytes.data, bytes.size);
+		response->size=0;
+		der_add(response, 0x30, tmp.data, tmp.size);
+		gnutls_free(signature.data);
+	}
+	gnutls_free(dn.data);
+	gnutls_privkey_deinit(privkey);
+	gnutls_x509_privkey_deinit(key);
+	gnutls_x509_crt_deinit(crt);
+	gnutls_free(file.data);
+	gnutls_free(name_hash.data);
+	gnutls_free(key_hash.data);
+	gnutls_free(serial.data);
+	return r<0 ? -1 : 0;
+}
+
+/// Answers the OCSP requests, from the certificate at CERTFILE3, until responder_fd is closed.
+void *responder_thread(void *_){
+	int fd;
+	while ((fd=accept(responder_fd, NULL, NULL))>=0){
+		static char buffer[8192];
+		size_t l=0;
+		ssize_t r;
+		char *body=NULL;
+		while (!body && (r=read(fd, buffer+l, sizeof(buffer)-l-1))>0){
+			l+=r;
+			buffer[l]=0;
+			body=strstr(buffer, "\r\n\r\n");
+		}
+		char *length=strstr(buffer, "Content-Length: ");
+		if (body && length && strstr(buffer, "POST /ocsp HTTP/1.0\r\n") && strstr(buffer, "Content-Type: application/ocsp-request\r\n")){
+			body+=4;
+			size_t size=atoi(length+16);
+			while (buffer+l<body+size && (r=read(fd, buffer+l, sizeof(buffer)-l-1))>0)
+				l+=r;
+			gnutls_datum_t request={ (unsigned char*)body, size };
+			static der response;
+			if (responder_garbage){
+				strcpy((char*)response.data, "garbage");
+				response.size=7;
+			}
+			else if (ocsp_response(CERTFILE3, &request, &response)<0)
+				response.size=0;
+			char head[256];
+			snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: application/ocsp-response\r\nContent-Length: %d\r\n\r\n", response.size);
+			if (write(fd, head, strlen(head))>0 && write(fd, response.data, response.size)>0)
+				__sync_fetch_and_add(&responder_requests, 1);
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+/// Waits up to 3 s for that many OCSP fetches, or errors.
+void wait_ocsp(long fetches, long errors){
+	onion_https_stats stats;
+	int i;
+	for (i=0;i<300;i++){
+		onion_https_get_stats(https, &stats);
+		if (stats.ocsp_fetches>=fetches && stats.ocsp_errors>=errors)
+			return;
+		usleep(10000);
+	}
+}
+
+/// The OCSP response is fetched in the background and stapled; reloaded certificates get theirs.
+void t07_ocsp(){
+	INIT_LOCAL();
+
+	FAIL_IF_NOT_EQUAL_INT(write_certificate(CERTFILE3, "localhost", OCSP_URL), 0);
+	responder_fd=socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int one=1;
+	setsockopt(responder_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(8101);
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	FAIL_IF_NOT_EQUAL_INT(bind(responder_fd, (struct sockaddr*)&addr, sizeof(addr)), 0);
+	listen(responder_fd, 4);
+	pthread_t responder;
+	pthread_create(&responder, NULL, responder_thread, NULL);
+
+	o=onion_new(O_THREADED | O_DETACH_LISTEN);
+	https=onion_https_new();
+	onion_add_listen_point(o, "localhost", "8102", https);
+	onion_https_set_certificate(https, O_SSL_CERTIFICATE_KEY, CERTFILE3, CERTFILE3);
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+	FAIL_IF_NOT_EQUAL_INT(onion_https_set_ocsp_stapling(https, 1), 0);
+	onion_listen(o);
+	wait_ocsp(1, 0);
+
+	char name[64];
+	onion_https_stats stats;
+	gnutls_session_t session=client_connect("8102", name, sizeof(name));
+	FAIL_IF_EQUAL(session, NULL);
+	FAIL_IF_NOT(client_stapled);
+	FAIL_IF_NOT(client_request(session));
+	client_close(session);
+	onion_https_get_stats(https, &stats);
+	FAIL_IF_NOT_EQUAL_INT(responder_requests, 1);
+	FAIL_IF_NOT_EQUAL_INT(stats.ocsp_fetches, 1);
+	FAIL_IF_NOT_EQUAL_INT(stats.ocsp_stapled, 1);
+
+	// A new certificate is asked for at once, and a bad answer is not stapled.
+	responder_garbage=1;
+	FAIL_IF_NOT_EQUAL_INT(write_certificate(CERTFILE3, "localhost", OCSP_URL), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_https_reload_certificate(https, NULL, O_SSL_CERTIFICATE_KEY, CERTFILE3, CERTFILE3, O_SSL_NONE), 0);
+	wait_ocsp(1, 1);
+	session=client_connect("8102", name, sizeof(name));
+	FAIL_IF_EQUAL(session, NULL);
+	FAIL_IF(client_stapled);
+	client_close(session);
+	onion_https_get_stats(https, &stats);
+	FAIL_IF_NOT_EQUAL_INT(responder_requests, 2);
+	FAIL_IF_NOT_EQUAL_INT(stats.ocsp_errors, 1);
+
+	responder_garbage=0;
+	FAIL_IF_NOT_EQUAL_INT(onion_https_reload_certificate(https, NULL, O_SSL_CERTIFICATE_KEY, CERTFILE3, CERTFILE3, O_SSL_NONE), 0);
+	wait_ocsp(2, 1);
+	session=client_connect("8102", name, sizeof(name));
+	FAIL_IF_NOT(client_stapled);
+	client_close(session);
+
+	onion_free(o);
+	shutdown(responder_fd, SHUT_RDWR);
+	close(responder_fd);
+	pthread_join(responder, NULL);
+	unlink(CERTFILE3);
+
+	END_LOCAL();
+}
+
+#define RECORDS_SIZE 200000
+
+/// A big response, written in small parts, through the response buffer.
+onion_connection_status records_handler(void *_, onion_request *req, onion_response *res){
+	char tmp[100];
+	memset(tmp, 'x', sizeof(tmp));
+	onion_response_set_length(res, RECORDS_SIZE);
+	int i;
+	for (i=0;i<RECORDS_SIZE/sizeof(tmp);i++)
+		onion_response_write(res, tmp, sizeof(tmp));
+	return OCS_PROCESSED;
+}
+
+/// A request at the session, and the size of each record of the response, up to max. Returns how many records.
+int client_records(gnutls_session_t session, ssize_t *sizes, int max){
+	const char *request="GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	gnutls_record_send(session, request, strlen(request));
+	static char buffer[32*1024];
+	ssize_t total=0, expected=-1, r;
+	int n=0;
+	while (expected<0 || total<expected){
+		r=gnutls_record_recv(session, buffer, sizeof(buffer)); // One record at a time
+		if (r==GNUTLS_E_AGAIN || r==GNUTLS_E_INTERRUPTED)
+			continue;
+		if (r<=0)
+			return -1;
+		if (expected<0){
+			int i;
+			for (i=0;i+4<=r;i++){
+				if (memcmp(buffer+i, "\r\n\r\n", 4)==0){
+					expected=RECORDS_SIZE+i+4;
+					break;
+				}
+			}
+		}
+		if (n<max)
+			sizes[n++]=r;
+		total+=r;
+	}
+	return n;
+}
+
+/// The first records are small, then full, as the response buffer writes are coalesced; small again after idle.
+void t08_records(){
+	INIT_LOCAL();
+
+	o=onion_new(O_THREADED | O_DETACH_LISTEN);
+	https=onion_https_new();
+	onion_add_listen_point(o, "localhost", "8103", https);
+	onion_https_set_certificate(https, O_SSL_CERTIFICATE_KEY, CERTFILE, CERTFILE);
+	onion_set_root_handler(o, onion_handler_new(records_handler, NULL, NULL));
+	onion_listen(o);
+	usleep(100000);
+
+	char name[64];
+	static ssize_t sizes[1024];
+	gnutls_session_t session=client_connect("8103", name, sizeof(name));
+	FAIL_IF_EQUAL(session, NULL);
+	int n=client_records(session, sizes, 1024);
+	FAIL_IF(n<40);
+	int i, small=0, full=0;
+	for (i=0;i<n;i++){
+		if (i<40 && sizes[i]<=1369)
+			small++;
+		if (sizes[i]>=8*1024)
+			full++;
+	}
+	FAIL_IF_NOT_EQUAL_INT(small, 40);
+	FAIL_IF(full<(RECORDS_SIZE-40*1369)/16384-1); // Not 1500 bytes each, as the response buffer
+	FAIL_IF(n>40+(RECORDS_SIZE-40*1369)/1500/4);
+
+	// At once, stays full.
+	n=client_records(session, sizes, 1024);
+	FAIL_IF(n<1);
+	FAIL_IF(sizes[0]<8*1024);
+
+	usleep(1100000); // Idle, small again
+	n=client_records(session, sizes, 1024);
+	FAIL_IF(n<40);
+	FAIL_IF(sizes[0]>1369);
+	FAIL_IF(sizes[39]>1369);
+	client_close(session);
+
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+int early_handled=0;
+
+onion_connection_status early_handler(void *_, onion_request *req, onion_response *res){
+	__sync_fetch_and_add(&early_handled, 1);
+	onion_response_set_length(res, 2);
+	onion_response_write(res, "ok", 2);
+	return OCS_PROCESSED;
+}
+
+/// The first flight of the client, the hello and its early data, to replay it.
+char early_flight[16*1024];
+size_t early_flight_size=0;
+int early_flight_done=0;
+
+static ssize_t record_push(gnutls_transport_ptr_t fd, const void *data, size_t size){
+	if (!early_flight_done && early_flight_size+size<=sizeof(early_flight)){
+		memcpy(early_flight+early_flight_size, data, size);
+		early_flight_size+=size;
+	}
+	return send((int)(long)fd, data, size, MSG_NOSIGNAL);
+}
+
+static ssize_t record_pull(gnutls_transport_ptr_t fd, void *data, size_t size){
+	early_flight_done=1;
+	return recv((int)(long)fd, data, size, 0);
+}
+
+/**
+ * Connects resuming *data, if any, with the request as early data, and reads the answer to buffer.
+ * 
+ * @returns 1 if the early data was accepted, 0 if not, and then the request is sent after the handshake, -1 on error.
+ */
+int client_early(const char *port, gnutls_datum_t *data, const char *request, char *buffer, size_t size){
+	gnutls_certificate_credentials_t cred;
+	gnutls_session_t session;
+	gnutls_certificate_allocate_credentials(&cred);
+	gnutls_init(&session, GNUTLS_CLIENT | GNUTLS_ENABLE_EARLY_DATA);
+	gnutls_priority_set_direct(session, "NORMAL", NULL);
+	gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, cred);
+	int fd=connect_to("localhost", port);
+	gnutls_transport_set_int(session, fd);
+	early_flight_size=0;
+	early_flight_done=0;
+	gnutls_transport_set_push_function(session, record_push);
+	gnutls_transport_set_pull_function(session, record_pull);
+	if (data->data){
+		gnutls_session_set_data(session, data->data, data->size);
+		gnutls_record_send_early_data(session, request, strlen(request));
+	}
+	int ret;
+	do{
+		ret=gnutls_handshake(session);
+	}while (ret<0 && !gnutls_error_is_fatal(ret));
+	buffer[0]=0;
+	if (ret>=0){
+		ret=(gnutls_session_get_flags(session)&GNUTLS_SFLAGS_EARLY_DATA) ? 1 : 0;
+		if (!ret)
+			gnutls_record_send(session, request, strlen(request));
+		ssize_t l=0, r;
+		while ((r=gnutls_record_recv(session, buffer+l, size-l-1))>0 || r==GNUTLS_E_AGAIN || r==GNUTLS_E_INTERRUPTED)
+			l+=r>0 ? r : 0;
+		buffer[l]=0;
+		gnutls_free(data->data);
+		gnutls_session_get_data2(session, data);
+		gnutls_bye(session, GNUTLS_SHUT_RDWR);
+	}
+	else
+		ONION_ERROR("Client handshake failed: %s", gnutls_strerror(ret));
+	close(fd);
+	gnutls_deinit(session);
+	gnutls_certificate_free_credentials(cred);
+	return ret;
+}
+
+/// Resumed clients send the request as early data, once; the replays and the unsafe methods are not handled early.
+void t09_early_data(){
+	INIT_LOCAL();
+
+	o=onion_new(O_POLL | O_DETACH_LISTEN);
+	https=onion_https_new();
+	onion_add_listen_point(o, "localhost", "8141", https);
+	onion_https_set_certificate(https, O_SSL_CERTIFICATE_KEY, CERTFILE, CERTFILE);
+	onion_https_set_priority(https, "NORMAL");
+	FAIL_IF_NOT_EQUAL_INT(onion_https_set_early_data(https, 16*1024, 0), 0);
+	onion_set_root_handler(o, onion_handler_new(early_handler, NULL, NULL));
+	onion_listen(o);
+	usleep(100000);
+
+	const char *get="GET / HTTP/1.0\r\n\r\n";
+	char buffer[1024];
+	gnutls_datum_t data={ NULL, 0 };
+	FAIL_IF_NOT_EQUAL_INT(client_early("8141", &data, get, buffer, sizeof(buffer)), 0);
+	FAIL_IF_NOT_STRSTR(buffer, "\r\n\r\nok");
+	FAIL_IF_NOT_EQUAL_INT(client_early("8141", &data, get, buffer, sizeof(buffer)), 1);
+	FAIL_IF_NOT_STRSTR(buffer, "\r\n\r\nok");
+	FAIL_IF_NOT_EQUAL_INT(early_handled, 2);
+
+	// The same hello and early data again, as an attacker would: the server does not take it.
+	int fd=connect_to("localhost", "8141");
+	FAIL_IF(fd<0);
+	FAIL_IF_NOT_EQUAL_INT(send(fd, early_flight, early_flight_size, MSG_NOSIGNAL), early_flight_size);
+	usleep(300000);
+	close(fd);
+	usleep(100000);
+	FAIL_IF_NOT_EQUAL_INT(early_handled, 2);
+
+	FAIL_IF_NOT_EQUAL_INT(client_early("8141", &data, "DELETE / HTTP/1.0\r\n\r\n", buffer, sizeof(buffer)), 1);
+	FAIL_IF_NOT_STRSTR(buffer, "HTTP/1.0 425");
+	FAIL_IF_NOT_EQUAL_INT(early_handled, 2);
+
+	onion_https_stats stats;
+	FAIL_IF_NOT_EQUAL_INT(onion_https_get_stats(https, &stats), 0);
+	FAIL_IF_NOT_EQUAL_INT(stats.early_data, 2);
+
+	gnutls_free(data.data);
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	onion_log_flags=OF_INIT|OF_NOINFO;
+	if (write_certificate(CERTFILE, "localhost", NULL)<0){
+		ONION_ERROR("Could not create the test certificate");
+		return 1;
+	}
+	t01_tickets();
+	t02_cache();
+	t03_rotation();
+	t04_slow_handshakes();
+	t05_file();
+	t06_reload();
+	t07_ocsp();
+	t08_records();
+	t09_early_data();
+	unlink(CERTFILE);
+
+	END();
+}
@@ -0,0 +1,173 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <onion/onion.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/block.h>
+#include <onion/log.h>
+#include <onion/access_log.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+onion *server;
+onion_listen_point *custom_io;
+char logpath[]="/tmp/onion-access-log-XXXXXX";
+
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	onion_response_set_length(res, 2);
+	onion_response_write(res, "ok", 2);
+	return OCS_PROCESSED;
+}
+
+void init_server(){
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	onion_set_root_handler(server, onion_handler_new(handler, NULL, NULL));
+	close(mkstemp(logpath));
+}
+
+/// Reads all the log file.
+const char *read_log(){
+	static char data[1024*1024];
+	FILE *f=fopen(logpath, "r");
+	size_t l=f ? fread(data, 1, sizeof(data)-1, f) : 0;
+	data[l]='\0';
+	if (f)
+		fclose(f);
+	return data;
+}
+
+void do_request(const char *request){
+	onion_request *req=onion_request_new(custom_io);
+	onion_request_write(req, request, strlen(request));
+	onion_request_free(req);
+}
+
+/// The fields of the format, and the texts from the client escaped, so each request is one line.
+void t01_format(){
+	INIT_LOCAL();
+	
+	init_server();
+	FAIL_IF_NOT_EQUAL_INT(onion_set_access_log(server, logpath, "%x"), -1);
+	FAIL_IF_NOT_EQUAL_INT(onion_set_access_log(server, logpath, "%{User-Agent}"), -1);
+	FAIL_IF_NOT_EQUAL_INT(onion_set_access_log(server, logpath, "\"%m %U %H\" %s %b %D %{User-Agent}i %%"), 0);
+	FAIL_IF_EQUAL(onion_get_access_log(server), NULL);
+	
+	do_request("GET /a?q=1 HTTP/1.1\r\nUser-Agent: test\r\n\r\n");
+	do_request("GET /b%0A%22c HTTP/1.0\r\n\r\n");
+	onion_access_log_stats stats;
+	onion_access_log_get_stats(onion_get_access_log(server), &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.logged, 2);
+	FAIL_IF_NOT_EQUAL_INT(stats.dropped, 0);
+	onion_free(server); // Writes the pending lines
+	
+	const char *data=read_log();
+	FAIL_IF_NOT_EQUAL_INT(strncmp(data, "\"GET /a HTTP/1.1\" 200 2 ", 24), 0);
+	const char *line2=strchr(data, '\n');
+	FAIL_IF_EQUAL(line2, NULL);
+	FAIL_IF_NOT(strstr(data, " test %\n"));
+	line2++;
+	FAIL_IF_NOT_EQUAL_INT(strncmp(line2, "\"GET /b\\x0a\\x22c HTTP/1.0\" 200 2 ", 33), 0);
+	FAIL_IF_NOT(strstr(line2, " - %\n")); // No User-Agent
+	FAIL_IF_NOT_EQUAL(strchr(line2, '\n')[1], '\0');
+	
+	long duration=atol(strstr(data, "200 2 ")+6);
+	FAIL_IF(duration<0 || duration>1000000);
+	unlink(logpath);
+	
+	END_LOCAL();
+}
+
+/// With the buffer full, lines are dropped and counted, but never waited for; the logged ones are all written.
+void t02_dropped(){
+	INIT_LOCAL();
+	
+	init_server();
+	FAIL_IF_NOT_EQUAL_INT(onion_set_access_log(server, logpath, "%U %{X}i"), 0);
+	onion_access_log *log=onion_get_access_log(server);
+	onion_access_log_set_buffer_size(log, 1);
+	
+	char padding[800];
+	memset(padding, 'x', sizeof(padding)-1);
+	padding[sizeof(padding)-1]='\0';
+	char request[1024];
+	snprintf(request, sizeof(request), "GET /p HTTP/1.1\r\nX: %s\r\n\r\n", padding);
+	int i;
+	for (i=0;i<1000;i++)
+		do_request(request);
+	
+	onion_access_log_stats stats;
+	onion_access_log_get_stats(log, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.logged+stats.dropped, 1000);
+	FAIL_IF(stats.logged<2);
+	FAIL_IF(stats.dropped==0);
+	onion_free(server);
+	
+	const char *data=read_log();
+	long lines=0;
+	for (;*data;data++)
+		if (*data=='\n')
+			lines++;
+	FAIL_IF_NOT_EQUAL_INT(lines, stats.logged);
+	unlink(logpath);
+	
+	END_LOCAL();
+}
+
+/// The durations of the phases, with the request timings; - for the ones not reached, as the TLS one without TLS.
+void t03_phases(){
+	INIT_LOCAL();
+	
+	init_server();
+	FAIL_IF_NOT_EQUAL_INT(onion_set_access_log(server, logpath, "%{nope}P"), -1);
+	FAIL_IF_NOT_EQUAL_INT(onion_set_access_log(server, logpath, "%{handler}i"), 0); // A header named handler
+	FAIL_IF_NOT_EQUAL_INT(onion_set_access_log(server, logpath, "%{headers}P %{handler}P %{total}P %{tls}P"), 0);
+	do_request("GET / HTTP/1.0\r\n\r\n");
+	onion_set_request_timings(server, 1);
+	do_request("GET / HTTP/1.0\r\n\r\n");
+	onion_free(server);
+	
+	const char *data=read_log();
+	FAIL_IF_NOT_EQUAL_INT(strncmp(data, "- - - -\n", 8), 0); // Not kept yet
+	long headers=-1, handler=-1, total=-1;
+	char tls[8]={0};
+	FAIL_IF_NOT_EQUAL_INT(sscanf(data+8, "%ld %ld %ld %7s", &headers, &handler, &total, tls), 4);
+	FAIL_IF(headers<0 || handler<0 || total<headers+handler);
+	FAIL_IF_NOT_EQUAL_STR(tls, "-");
+	unlink(logpath);
+	
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	
+	t01_format();
+	t02_dropped();
+	t03_phases();
+	
+	END();
+}
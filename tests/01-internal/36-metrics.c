@@ -0,0 +1,214 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <onion/onion.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/block.h>
+#include <onion/log.h>
+#include <onion/url.h>
+#include <onion/stats.h>
+#include <onion/handlers/metrics.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+onion *server;
+onion_listen_point *custom_io;
+
+onion_connection_status hello(void *_, onion_request *req, onion_response *res){
+	onion_response_set_length(res, 5);
+	onion_response_write(res, "hello", 5);
+	return OCS_PROCESSED;
+}
+
+onion_connection_status fail(void *_, onion_request *req, onion_response *res){
+	return OCS_INTERNAL_ERROR;
+}
+
+int64_t handler_timings[OR_PHASES];
+
+/// Keeps the timings as seen by the handler, and takes some time.
+onion_connection_status timed(void *_, onion_request *req, onion_response *res){
+	const int64_t *timings=onion_request_get_timings(req);
+	if (timings)
+		memcpy(handler_timings, timings, sizeof(handler_timings));
+	usleep(3000);
+	return hello(_, req, res);
+}
+
+/// Writes the request, and returns all the response.
+const char *raw_request(const char *request){
+	static char response[64*1024];
+	onion_request *req=onion_request_new(custom_io);
+	onion_request_write(req, request, strlen(request));
+	onion_block *buffer=onion_buffer_listen_point_get_buffer(req);
+	snprintf(response, sizeof(response), "%s", onion_block_data(buffer));
+	onion_request_free(req);
+	return response;
+}
+
+/// Responses by code, bytes, and the routes, at the stats and at the metrics handler.
+void t01_metrics(){
+	INIT_LOCAL();
+	
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	onion_url *urls=onion_root_url(server);
+	onion_url_set_stats(urls, 1);
+	onion_url_add(urls, "hello", hello);
+	onion_url_add(urls, "fail", fail);
+	onion_url_add_handler(urls, "metrics", onion_handler_metrics());
+	
+	raw_request("GET /hello HTTP/1.1\r\n\r\n");
+	raw_request("GET /hello HTTP/1.1\r\n\r\n");
+	raw_request("GET /fail HTTP/1.1\r\n\r\n");
+	raw_request("GET /nope HTTP/1.1\r\n\r\n");
+	
+	onion_stats stats;
+	onion_get_stats(server, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.responses[200], 2);
+	FAIL_IF_NOT_EQUAL_INT(stats.responses[500], 1);
+	FAIL_IF_NOT_EQUAL_INT(stats.responses[404], 1);
+	FAIL_IF_NOT_EQUAL_INT(stats.requests, 4);
+	FAIL_IF_NOT_EQUAL_INT(stats.bytes_in, 2*strlen("GET /hello HTTP/1.1\r\n\r\n")+2*strlen("GET /fail HTTP/1.1\r\n\r\n"));
+	FAIL_IF(stats.bytes_out<10);
+	FAIL_IF_NOT_EQUAL_INT(stats.connections, 0); // No sockets
+	
+	const char *data=raw_request("GET /metrics HTTP/1.1\r\n\r\n");
+	FAIL_IF_NOT(strstr(data, "Content-Type: text/plain; version=0.0.4"));
+	FAIL_IF_NOT(strstr(data, "# TYPE onion_http_responses_total counter\n"));
+	FAIL_IF_NOT(strstr(data, "\nonion_http_responses_total{code=\"200\"} 2\n"));
+	FAIL_IF_NOT(strstr(data, "\nonion_http_responses_total{code=\"500\"} 1\n"));
+	FAIL_IF_NOT(strstr(data, "\nonion_connections 0\n"));
+	FAIL_IF_NOT(strstr(data, "\nonion_sessions 0\n"));
+	FAIL_IF_NOT(strstr(data, "# TYPE onion_route_latency_seconds histogram\n"));
+	FAIL_IF_NOT(strstr(data, "\nonion_route_latency_seconds_bucket{route=\"hello\",le=\"+Inf\"} 2\n"));
+	FAIL_IF_NOT(strstr(data, "\nonion_route_latency_seconds_bucket{route=\"hello\",le=\"10\"} 2\n"));
+	FAIL_IF_NOT(strstr(data, "\nonion_route_latency_seconds_count{route=\"fail\"} 1\n"));
+	FAIL_IF_NOT(strstr(data, "\nonion_route_errors_total{route=\"fail\"} 1\n"));
+	FAIL_IF_NOT(strstr(data, "\nonion_route_errors_total{route=\"hello\"} 0\n"));
+	
+	onion_free(server);
+	
+	END_LOCAL();
+}
+
+/// Connections are counted while they have a socket.
+void t02_connections(){
+	INIT_LOCAL();
+	
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	
+	int fds[2];
+	FAIL_IF_NOT_EQUAL_INT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	struct sockaddr_storage addr;
+	memset(&addr, 0, sizeof(addr));
+	onion_request *req=onion_request_new_from_socket(custom_io, fds[0], &addr, sizeof(addr));
+	onion_stats stats;
+	onion_get_stats(server, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.connections, 1);
+	FAIL_IF_NOT_EQUAL_INT(stats.connections_total, 1);
+	onion_request_free(req);
+	onion_get_stats(server, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.connections, 0);
+	FAIL_IF_NOT_EQUAL_INT(stats.connections_total, 1);
+	close(fds[0]);
+	close(fds[1]);
+	
+	onion_free(server);
+	
+	END_LOCAL();
+}
+
+/// The timings of the phases, at the request, the stats and the metrics.
+void t03_timings(){
+	INIT_LOCAL();
+	
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	onion_url *urls=onion_root_url(server);
+	onion_url_add(urls, "timed", timed);
+	onion_url_add_handler(urls, "metrics", onion_handler_metrics());
+	
+	memset(handler_timings, 0, sizeof(handler_timings));
+	raw_request("GET /timed HTTP/1.1\r\n\r\n");
+	FAIL_IF(handler_timings[OR_PHASE_START]!=0); // Not kept
+	onion_stats stats;
+	onion_get_stats(server, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.phases[ONION_STATS_PHASE_TOTAL][ONION_STATS_PHASE_BUCKETS-1], 0);
+	FAIL_IF(strstr(raw_request("GET /metrics HTTP/1.1\r\n\r\n"), "onion_request_phase_seconds"));
+	
+	onion_set_request_timings(server, 1);
+	raw_request("GET /timed HTTP/1.1\r\n\r\n");
+	FAIL_IF(handler_timings[OR_PHASE_START]==0);
+	FAIL_IF(handler_timings[OR_PHASE_HEADERS]<handler_timings[OR_PHASE_START]);
+	FAIL_IF(handler_timings[OR_PHASE_HANDLER]<handler_timings[OR_PHASE_HEADERS]);
+	FAIL_IF(handler_timings[OR_PHASE_ACCEPT]!=0); // No accept, nor handshake, at this listen point
+	FAIL_IF(handler_timings[OR_PHASE_HANDSHAKE]!=0);
+	FAIL_IF(handler_timings[OR_PHASE_HANDLED]!=0); // Still at the handler
+	FAIL_IF(handler_timings[OR_PHASE_END]!=0);
+	
+	onion_get_stats(server, &stats);
+	unsigned long count[ONION_STATS_PHASES];
+	int p, i;
+	for (p=0;p<ONION_STATS_PHASES;p++){
+		count[p]=0;
+		for (i=0;i<ONION_STATS_PHASE_BUCKETS;i++)
+			count[p]+=stats.phases[p][i];
+	}
+	FAIL_IF_NOT_EQUAL_INT(count[ONION_STATS_PHASE_TLS], 0);
+	FAIL_IF_NOT_EQUAL_INT(count[ONION_STATS_PHASE_HEADERS], 1);
+	FAIL_IF_NOT_EQUAL_INT(count[ONION_STATS_PHASE_HANDLER], 1);
+	FAIL_IF_NOT_EQUAL_INT(count[ONION_STATS_PHASE_TOTAL], 1);
+	FAIL_IF(stats.phases_us[ONION_STATS_PHASE_HANDLER]<3000);
+	FAIL_IF(stats.phases_us[ONION_STATS_PHASE_TOTAL]<stats.phases_us[ONION_STATS_PHASE_HANDLER]);
+	FAIL_IF_NOT_EQUAL_INT(stats.phases[ONION_STATS_PHASE_HANDLER][0], 0); // More than 100 us
+	
+	const char *data=raw_request("GET /metrics HTTP/1.1\r\n\r\n");
+	FAIL_IF_NOT(strstr(data, "# TYPE onion_request_phase_seconds histogram\n"));
+	FAIL_IF_NOT(strstr(data, "\nonion_request_phase_seconds_count{phase=\"handler\"} 1\n"));
+	FAIL_IF_NOT(strstr(data, "\nonion_request_phase_seconds_bucket{phase=\"total\",le=\"+Inf\"} 1\n"));
+	FAIL_IF_NOT(strstr(data, "\nonion_request_phase_seconds_bucket{phase=\"handler\",le=\"0.0001\"} 0\n"));
+	FAIL_IF_NOT(strstr(data, "\nonion_request_phase_seconds_count{phase=\"tls\"} 0\n"));
+	
+	onion_free(server);
+	
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	
+	onion_log_flags=OF_INIT|OF_NOINFO;
+	t01_metrics();
+	t02_connections();
+	t03_timings();
+	
+	END();
+}
@@ -0,0 +1,104 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#define ONION_LOG_MIN_LEVEL O_WARNING // Only at this file
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <onion/log.h>
+
+#include "../ctest.h"
+
+int logged=0;
+char last[256];
+
+/// Counts the messages, instead of writing them.
+void counting_log(onion_log_level level, const char *filename, int lineno, const char *fmt, ...){
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(last, sizeof(last), fmt, ap);
+	va_end(ap);
+	logged++;
+}
+
+/// Logs from one call site only.
+void noisy(int i){
+	ONION_WARNING_RATELIMITED("Noisy %d", i);
+}
+
+/// Below the compile time level, the calls are not done, nor their arguments evaluated.
+void t01_min_level(){
+	INIT_LOCAL();
+	
+	int evaluated=0;
+	logged=0;
+	ONION_INFO("Not compiled %d", evaluated++);
+	FAIL_IF_NOT_EQUAL_INT(evaluated, 0);
+	FAIL_IF_NOT_EQUAL_INT(logged, 0);
+	ONION_WARNING("Compiled %d", evaluated++);
+	FAIL_IF_NOT_EQUAL_INT(evaluated, 1);
+	FAIL_IF_NOT_EQUAL_INT(logged, 1);
+	
+	END_LOCAL();
+}
+
+/// Each call site logs its burst, then at the rate; the next logged says how many were dropped.
+void t02_ratelimit(){
+	INIT_LOCAL();
+	
+	onion_log_set_ratelimit(10, 5);
+	logged=0;
+	int i;
+	for (i=0;i<100;i++)
+		noisy(i);
+	FAIL_IF_NOT_EQUAL_INT(logged, 5);
+	FAIL_IF_NOT_EQUAL_STR(last, "Noisy 4");
+	ONION_WARNING_RATELIMITED("Other site"); // Own bucket
+	FAIL_IF_NOT_EQUAL_INT(logged, 6);
+	
+	usleep(150000); // One token more
+	logged=0;
+	noisy(100);
+	noisy(101);
+	FAIL_IF_NOT_EQUAL_INT(logged, 2); // The dropped count, and the message
+	FAIL_IF_NOT_EQUAL_STR(last, "Noisy 100");
+	
+	onion_log_set_ratelimit(0, 0); // Not limited
+	logged=0;
+	for (i=0;i<100;i++)
+		noisy(i);
+	FAIL_IF_NOT_EQUAL_INT(logged, 100);
+	onion_log_set_ratelimit(10, 20);
+	
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	
+	onion_log=counting_log;
+	t01_min_level();
+	t02_ratelimit();
+	onion_log=onion_log_stderr;
+	
+	END();
+}
@@ -0,0 +1,141 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/response.h>
+#include <onion/request.h>
+#include <onion/stats.h>
+
+#include "../ctest.h"
+
+onion *o;
+
+int connect_to(const char *addr, const char *port){
+  struct addrinfo hints;
+  struct addrinfo *server;
+
+  memset(&hints,0, sizeof(struct addrinfo));
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+  if (getaddrinfo(addr,port,&hints,&server)<0){
+    ONION_ERROR("Error getting server info");
+    return -1;
+  }
+  int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+  if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+    close(fd);
+    fd=-1;
+    ONION_ERROR("Error connecting to server %s:%s",addr,port);
+  }
+
+  freeaddrinfo(server);
+
+  return fd;
+}
+
+/// Answers the pid of the process, or /crash kills it.
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	if (strcmp(onion_request_get_path(req), "crash")==0)
+		abort();
+	onion_response_printf(res, "%d %d", (int)getpid(), onion_get_process_index(o));
+	return OCS_PROCESSED;
+}
+
+/// GETs the path with HTTP/1.0, and returns the pid at the answer, or 0.
+int get_pid(const char *path, int *index){
+	int fd=connect_to("localhost","8121");
+	if (fd<0)
+		return 0;
+	char buffer[1024];
+	snprintf(buffer, sizeof(buffer), "GET /%s HTTP/1.0\r\n\r\n", path);
+	if (write(fd, buffer, strlen(buffer))!=strlen(buffer)){
+		close(fd);
+		return 0;
+	}
+	memset(buffer, 0, sizeof(buffer));
+	ssize_t r, pos=0;
+	while ( (r=read(fd, buffer+pos, sizeof(buffer)-pos-1)) > 0 )
+		pos+=r;
+	close(fd);
+	char *body=strstr(buffer, "\r\n\r\n");
+	int pid=0;
+	if (!body || sscanf(body+4, "%d %d", &pid, index)!=2)
+		return 0;
+	return pid;
+}
+
+/// Requests are served by the forked processes, that are respawned when they crash.
+void t01_prefork(){
+	INIT_LOCAL();
+
+	o=onion_new(O_POLL|O_DETACH_LISTEN);
+	onion_set_port(o, "8121");
+	int cpus[]={ 0 };
+	onion_set_processes(o, 2, cpus, 1);
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+	FAIL_IF_NOT_EQUAL_INT(onion_get_process_index(o), -1);
+	onion_listen(o);
+	sleep(1);
+
+	int i, index=-1, pid;
+	for (i=0;i<20;i++){
+		pid=get_pid("", &index);
+		FAIL_IF(pid==0 || pid==getpid());
+		FAIL_IF(index<0 || index>1);
+	}
+
+	onion_stats stats;
+	onion_get_stats(o, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.processes, 2);
+	FAIL_IF_NOT_EQUAL_INT((int)stats.requests, 20); // Of both processes, at shared memory
+
+	FAIL_IF_NOT_EQUAL_INT(get_pid("crash", &index), 0);
+	sleep(2);
+	for (i=0;i<10;i++)
+		FAIL_IF(get_pid("", &index)==0);
+	onion_get_stats(o, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.processes, 2);
+	FAIL_IF_NOT_EQUAL_INT((int)stats.process_respawns, 1);
+
+	onion_listen_stop(o);
+	onion_get_stats(o, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.processes, 0);
+	FAIL_IF_NOT_EQUAL_INT(get_pid("", &index), 0);
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	t01_prefork();
+
+	END();
+}
@@ -0,0 +1,168 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/response.h>
+#include <onion/request.h>
+
+#include "../ctest.h"
+
+#define HOT_RESTART_PATH "/tmp/onion-39-hot_restart.sock"
+
+int connect_to(const char *addr, const char *port){
+  struct addrinfo hints;
+  struct addrinfo *server;
+
+  memset(&hints,0, sizeof(struct addrinfo));
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+  if (getaddrinfo(addr,port,&hints,&server)<0){
+    ONION_ERROR("Error getting server info");
+    return -1;
+  }
+  int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+  if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+    close(fd);
+    fd=-1;
+    ONION_ERROR("Error connecting to server %s:%s",addr,port);
+  }
+
+  freeaddrinfo(server);
+
+  return fd;
+}
+
+/// Answers its name, the data of the handler; /slow after a while.
+onion_connection_status handler(void *name, onion_request *req, onion_response *res){
+	if (strcmp(onion_request_get_path(req), "slow")==0)
+		usleep(300000);
+	onion_response_write0(res, (const char*)name);
+	return OCS_PROCESSED;
+}
+
+/// Reads once, and returns the body at buffer.
+const char *read_body(int fd, char *buffer, size_t size){
+	memset(buffer, 0, size);
+	ssize_t r=read(fd, buffer, size-1);
+	if (r<=0)
+		return "";
+	char *body=strstr(buffer, "\r\n\r\n");
+	return body ? body+4 : "";
+}
+
+/// Sends the request, and returns the body of the answer.
+const char *request(int fd, const char *req, char *buffer, size_t size){
+	if (fd<0 || write(fd, req, strlen(req))!=strlen(req))
+		return "";
+	return read_body(fd, buffer, size);
+}
+
+/// A HTTP/1.0 GET at a new connection.
+const char *get(const char *path, char *buffer, size_t size){
+	char req[256];
+	snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\n\r\n", path);
+	int fd=connect_to("localhost", "8122");
+	const char *ret=request(fd, req, buffer, size);
+	if (fd>=0)
+		close(fd);
+	return ret;
+}
+
+void *listen_thread_f(void *o){
+	onion_listen((onion*)o);
+	return NULL;
+}
+
+onion *server_new(const char *name){
+	onion *o=onion_new(O_THREADED);
+	onion_set_max_threads(o, 4);
+	onion_set_port(o, "8122");
+	onion_set_hot_restart(o, HOT_RESTART_PATH);
+	onion_set_drain(o, 5000, NULL, NULL);
+	onion_set_root_handler(o, onion_handler_new(handler, (void*)name, NULL));
+	return o;
+}
+
+/// The next server takes the listen socket, and the previous one finishes its requests and returns.
+void t01_hot_restart(){
+	INIT_LOCAL();
+	char buffer[1024];
+	unlink(HOT_RESTART_PATH);
+
+	onion *a=server_new("a");
+	pthread_t ath;
+	pthread_create(&ath, NULL, listen_thread_f, a);
+	sleep(1);
+	FAIL_IF_NOT_EQUAL_STR(get("/", buffer, sizeof(buffer)), "a");
+
+	int idle=connect_to("localhost", "8122");
+	FAIL_IF_NOT_EQUAL_STR(request(idle, "GET / HTTP/1.1\r\n\r\n", buffer, sizeof(buffer)), "a");
+	int slow=connect_to("localhost", "8122");
+	FAIL_IF(slow<0 || write(slow, "GET /slow HTTP/1.1\r\n\r\n", 22)!=22);
+	usleep(100000);
+
+	// Takes the socket; binding a new one would fail, as a still has it.
+	onion *b=server_new("b");
+	pthread_t bth;
+	pthread_create(&bth, NULL, listen_thread_f, b);
+	usleep(100000);
+	FAIL_IF_NOT_EQUAL_STR(get("/", buffer, sizeof(buffer)), "b");
+	FAIL_IF_NOT_EQUAL_STR(get("/", buffer, sizeof(buffer)), "b");
+
+	// The request in progress finishes at a, and then it closes the connection.
+	FAIL_IF_NOT_EQUAL_STR(read_body(slow, buffer, sizeof(buffer)), "a");
+	FAIL_IF(strstr(buffer, "Keep-Alive"));
+	FAIL_IF_NOT_EQUAL_INT((int)read(slow, buffer, sizeof(buffer)), 0);
+	close(slow);
+
+	// Returns when the idle keep alive connection closes, before the deadline.
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	close(idle);
+	pthread_join(ath, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	FAIL_IF(end.tv_sec-start.tv_sec>2);
+	onion_free(a);
+
+	FAIL_IF_NOT_EQUAL_STR(get("/", buffer, sizeof(buffer)), "b");
+	onion_listen_stop(b);
+	pthread_join(bth, NULL);
+	onion_free(b);
+	unlink(HOT_RESTART_PATH);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	t01_hot_restart();
+
+	END();
+}
@@ -0,0 +1,169 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <unistd.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/http.h>
+#include <onion/response.h>
+#include <onion/stats.h>
+
+#include "../ctest.h"
+
+int connect_to(const char *addr, const char *port){
+  struct addrinfo hints;
+  struct addrinfo *server;
+
+  memset(&hints,0, sizeof(struct addrinfo));
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+  if (getaddrinfo(addr,port,&hints,&server)<0){
+    ONION_ERROR("Error getting server info");
+    return -1;
+  }
+  int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+  if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+    close(fd);
+    fd=-1;
+    ONION_ERROR("Error connecting to server %s:%s",addr,port);
+  }
+
+  freeaddrinfo(server);
+
+  return fd;
+}
+
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	onion_response_write0(res, "ok");
+	return OCS_PROCESSED;
+}
+
+/// GETs / and returns if answered ok, failing after a second instead of waiting forever.
+int get_ok(const char *port){
+	int fd=connect_to("127.0.0.1", port);
+	if (fd<0)
+		return 0;
+	struct timeval tv={ 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	const char *get="GET / HTTP/1.0\r\n\r\n";
+	char buffer[1024];
+	memset(buffer, 0, sizeof(buffer));
+	ssize_t r=0, pos=0;
+	if (write(fd, get, strlen(get))==strlen(get)){
+		while ( (r=read(fd, buffer+pos, sizeof(buffer)-pos-1)) > 0 )
+			pos+=r;
+	}
+	close(fd);
+	char *body=strstr(buffer, "\r\n\r\n");
+	return body && strcmp(body+4, "ok")==0;
+}
+
+/// A listening socket at that port, as systemd would create it, at a high fd.
+int listen_socket(int port, int reuseport){
+	int fd=socket(AF_INET, SOCK_STREAM, 0);
+	int one=1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (reuseport)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(port);
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))<0 || listen(fd, 16)<0){
+		close(fd);
+		return -1;
+	}
+	int high=fcntl(fd, F_DUPFD, 20);
+	close(fd);
+	return high;
+}
+
+/// Passes the sockets as systemd does, from fd 3, with their names.
+void pass_sockets(int *fds, int n, const char *names){
+	int i;
+	for (i=0;i<n;i++){
+		dup2(fds[i], 3+i);
+		close(fds[i]);
+	}
+	char tmp[32];
+	snprintf(tmp, sizeof(tmp), "%d", (int)getpid());
+	setenv("LISTEN_PID", tmp, 1);
+	snprintf(tmp, sizeof(tmp), "%d", n);
+	setenv("LISTEN_FDS", tmp, 1);
+	setenv("LISTEN_FDNAMES", names, 1);
+}
+
+/// Each socket goes to its listen point by name or by port, and the extra one of a port is accepted from too.
+void t01_systemd_sockets(){
+	INIT_LOCAL();
+
+	int fds[3];
+	fds[0]=listen_socket(8124, 0);
+	fds[1]=listen_socket(8123, 1);
+	fds[2]=listen_socket(8123, 1);
+	FAIL_IF(fds[0]<0 || fds[1]<0 || fds[2]<0);
+	pass_sockets(fds, 3, "alt:main:main");
+
+	onion *o=onion_new(O_POOL|O_SYSTEMD|O_DETACH_LISTEN);
+	onion_set_max_threads(o, 2);
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+	// Binding any of them would fail, as the sockets are there. The order does not matter.
+	onion_add_listen_point(o, "127.0.0.1", "8123", onion_http_new());
+	onion_add_listen_point(o, NULL, "alt", onion_http_new());
+	FAIL_IF_NOT_EQUAL_INT(onion_listen(o), 0);
+	usleep(200000);
+
+	FAIL_IF_NOT(get_ok("8124"));
+	int i, ok=0;
+	for (i=0;i<32;i++) // The kernel balances them among both sockets of the port
+		ok+=get_ok("8123");
+	FAIL_IF_NOT_EQUAL_INT(ok, 32);
+
+	onion_stats stats;
+	onion_get_stats(o, &stats);
+	FAIL_IF_NOT_EQUAL_INT((int)stats.accepted, 33);
+
+	onion_listen_stop(o);
+	onion_free(o);
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	t01_systemd_sockets();
+
+	END();
+}
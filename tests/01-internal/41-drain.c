@@ -0,0 +1,181 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/response.h>
+#include <onion/request.h>
+
+#include "../ctest.h"
+
+int connect_to(const char *addr, const char *port){
+  struct addrinfo hints;
+  struct addrinfo *server;
+
+  memset(&hints,0, sizeof(struct addrinfo));
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+  if (getaddrinfo(addr,port,&hints,&server)<0){
+    ONION_ERROR("Error getting server info");
+    return -1;
+  }
+  int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+  if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+    close(fd);
+    fd=-1;
+    ONION_ERROR("Error connecting to server %s:%s",addr,port);
+  }
+
+  freeaddrinfo(server);
+
+  return fd;
+}
+
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	if (strcmp(onion_request_get_path(req), "slow")==0)
+		usleep(300000);
+	onion_response_write0(res, "ok");
+	return OCS_PROCESSED;
+}
+
+/// Reads all until closed, at buffer.
+void read_all(int fd, char *buffer, size_t size){
+	memset(buffer, 0, size);
+	ssize_t r, pos=0;
+	while ( (r=read(fd, buffer+pos, size-pos-1)) > 0 )
+		pos+=r;
+}
+
+int slow_fd;
+char slow_answer[1024];
+
+void *slow_reader(void *_){
+	read_all(slow_fd, slow_answer, sizeof(slow_answer));
+	return NULL;
+}
+
+onion_drain_report report;
+int drained_calls=0;
+
+void drained(void *data, onion *o, const onion_drain_report *r){
+	FAIL_IF_NOT_EQUAL_INT(*(int*)data, 42);
+	report=*r;
+	drained_calls++;
+}
+
+/// Stopping waits for the request in progress, that closes its connection, and closes the idle one at the deadline.
+void t01_drain(){
+	INIT_LOCAL();
+	char buffer[1024];
+
+	onion *o=onion_new(O_POOL|O_DETACH_LISTEN);
+	onion_set_max_threads(o, 2);
+	onion_set_port(o, "8126");
+	int data=42;
+	onion_set_drain(o, 1000, drained, &data);
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+	onion_listen(o);
+	usleep(200000);
+
+	int idle=connect_to("localhost", "8126");
+	const char *get="GET / HTTP/1.1\r\n\r\n";
+	FAIL_IF(write(idle, get, strlen(get))!=strlen(get));
+	memset(buffer, 0, sizeof(buffer));
+	FAIL_IF(read(idle, buffer, sizeof(buffer)-1)<=0);
+	FAIL_IF(strstr(buffer, "Connection: Close")); // Kept alive
+
+	slow_fd=connect_to("localhost", "8126");
+	const char *slow="GET /slow HTTP/1.1\r\n\r\n";
+	FAIL_IF(write(slow_fd, slow, strlen(slow))!=strlen(slow));
+	pthread_t th;
+	pthread_create(&th, NULL, slow_reader, NULL);
+	usleep(100000);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	onion_listen_stop(o); // Waits for the drain, as detached
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	int ms=(end.tv_sec-start.tv_sec)*1000+(end.tv_nsec-start.tv_nsec)/1000000;
+	FAIL_IF(ms<900 || ms>2000);
+
+	pthread_join(th, NULL);
+	FAIL_IF_NOT(strstr(slow_answer, "\r\n\r\nok"));
+	FAIL_IF_NOT(strstr(slow_answer, "Connection: Close"));
+	close(slow_fd);
+	FAIL_IF_NOT_EQUAL_INT(connect_to("localhost", "8126"), -1);
+
+	// The idle one was closed at the deadline
+	FAIL_IF_NOT_EQUAL_INT((int)read(idle, buffer, sizeof(buffer)), 0);
+	close(idle);
+
+	FAIL_IF_NOT_EQUAL_INT(drained_calls, 1);
+	FAIL_IF_NOT_EQUAL_INT((int)report.connections, 2);
+	FAIL_IF_NOT_EQUAL_INT((int)report.drained, 1);
+	FAIL_IF_NOT_EQUAL_INT((int)report.forced, 1);
+	FAIL_IF(report.ms<900);
+
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+/// Without connections, it stops at once.
+void t02_drain_empty(){
+	INIT_LOCAL();
+
+	onion *o=onion_new(O_POOL|O_DETACH_LISTEN);
+	onion_set_port(o, "8126");
+	int data=42;
+	drained_calls=0;
+	onion_set_drain(o, 5000, drained, &data);
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+	onion_listen(o);
+	usleep(200000);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	onion_listen_stop(o);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	FAIL_IF(end.tv_sec-start.tv_sec>1);
+	FAIL_IF_NOT_EQUAL_INT(drained_calls, 1);
+	FAIL_IF_NOT_EQUAL_INT((int)report.connections, 0);
+	FAIL_IF_NOT_EQUAL_INT((int)report.forced, 0);
+
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	t01_drain();
+	t02_drain_empty();
+
+	END();
+}
@@ -0,0 +1,209 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <unistd.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/block.h>
+#include <onion/response.h>
+#include <onion/request.h>
+#include <onion/stats.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+int connect_to(const char *addr, const char *port){
+  struct addrinfo hints;
+  struct addrinfo *server;
+
+  memset(&hints,0, sizeof(struct addrinfo));
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+  if (getaddrinfo(addr,port,&hints,&server)<0){
+    ONION_ERROR("Error getting server info");
+    return -1;
+  }
+  int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+  if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+    close(fd);
+    fd=-1;
+    ONION_ERROR("Error connecting to server %s:%s",addr,port);
+  }
+
+  freeaddrinfo(server);
+
+  return fd;
+}
+
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	onion_response_write0(res, "ok");
+	return OCS_PROCESSED;
+}
+
+/// Reads all until closed, at buffer.
+void read_all(int fd, char *buffer, size_t size){
+	memset(buffer, 0, size);
+	ssize_t r, pos=0;
+	while ( (r=read(fd, buffer+pos, size-pos-1)) > 0 )
+		pos+=r;
+	close(fd);
+}
+
+/// Over the limits, new connections get a 503 and are closed, and when some closes there is room again.
+void t01_connection_limits(){
+	INIT_LOCAL();
+	char buffer[1024];
+	int per_client;
+
+	for (per_client=0;per_client<2;per_client++){
+		onion *o=onion_new(O_POOL|O_DETACH_LISTEN);
+		onion_set_max_threads(o, 2);
+		onion_set_port(o, "8127");
+		if (per_client)
+			onion_set_connection_limits(o, 0, 1);
+		else
+			onion_set_connection_limits(o, 2, 0);
+		onion_set_max_inflight(o, 0, 7);
+		onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+		onion_listen(o);
+		usleep(200000);
+
+		int open=per_client ? 1 : 2, i;
+		int fds[2];
+		for (i=0;i<open;i++)
+			fds[i]=connect_to("localhost", "8127");
+		usleep(100000);
+
+		read_all(connect_to("localhost", "8127"), buffer, sizeof(buffer));
+		FAIL_IF_NOT(strstr(buffer, "HTTP/1.1 503 Service Unavailable\r\n"));
+		FAIL_IF_NOT(strstr(buffer, "Retry-After: 7\r\n"));
+
+		close(fds[0]);
+		usleep(100000);
+		int fd=connect_to("localhost", "8127");
+		const char *get="GET / HTTP/1.0\r\n\r\n";
+		FAIL_IF(write(fd, get, strlen(get))!=strlen(get));
+		read_all(fd, buffer, sizeof(buffer));
+		FAIL_IF_NOT(strstr(buffer, "HTTP/1.0 200 OK\r\n"));
+
+		onion_stats stats;
+		onion_get_stats(o, &stats);
+		FAIL_IF_NOT_EQUAL_INT((int)stats.connections_rejected, 1);
+
+		for (i=1;i<open;i++)
+			close(fds[i]);
+		onion_listen_stop(o);
+		onion_free(o);
+	}
+
+	END_LOCAL();
+}
+
+/// Writes the request at a new buffer request, and returns it.
+onion_request *raw_request(onion_listen_point *lp, const char *request){
+	onion_request *req=onion_request_new(lp);
+	onion_request_write(req, request, strlen(request));
+	return req;
+}
+
+/// Over the in flight limit, requests get a 503 before being parsed.
+void t02_inflight(){
+	INIT_LOCAL();
+
+	onion *o=onion_new(O_ONE);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(o, NULL, NULL, lp);
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+	onion_set_max_inflight(o, 1, 3);
+
+	onion_request *waiting=raw_request(lp, "GET / HTTP/1.0\r\n"); // Not complete yet
+	onion_request *req=raw_request(lp, "GET / HTTP/1.0\r\n\r\n");
+	const char *data=onion_buffer_listen_point_get_buffer_data(req);
+	FAIL_IF_NOT(strstr(data, "HTTP/1.1 503 Service Unavailable\r\n"));
+	FAIL_IF_NOT(strstr(data, "Retry-After: 3\r\n"));
+	onion_request_free(req);
+
+	onion_request_write(waiting, "\r\n", 2);
+	FAIL_IF_NOT(strstr(onion_buffer_listen_point_get_buffer_data(waiting), "HTTP/1.0 200 OK\r\n"));
+	onion_request_free(waiting);
+
+	req=raw_request(lp, "GET / HTTP/1.0\r\n\r\n");
+	FAIL_IF_NOT(strstr(onion_buffer_listen_point_get_buffer_data(req), "HTTP/1.0 200 OK\r\n"));
+	onion_request_free(req);
+
+	onion_stats stats;
+	onion_get_stats(o, &stats);
+	FAIL_IF_NOT_EQUAL_INT((int)stats.requests_rejected, 1);
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+/// Writes the request in two parts, with a pause, and returns the status code.
+int late_request(onion_listen_point *lp, int pause_ms){
+	onion_request *req=onion_request_new(lp);
+	onion_request_write(req, "GET / HTTP/1.0\r\n", 16);
+	usleep(pause_ms*1000);
+	onion_request_write(req, "\r\n", 2);
+	int code=atoi(onion_buffer_listen_point_get_buffer_data(req)+9); // After HTTP/1.0
+	onion_request_free(req);
+	return code;
+}
+
+/// Late requests are shed only after being late for a whole interval, and until one is on time.
+void t03_load_shedding(){
+	INIT_LOCAL();
+
+	onion *o=onion_new(O_ONE);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(o, NULL, NULL, lp);
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+	onion_set_load_shedding(o, 10, 50);
+
+	FAIL_IF_NOT_EQUAL_INT(late_request(lp, 20), 200); // First late
+	FAIL_IF_NOT_EQUAL_INT(late_request(lp, 20), 200); // Still in the interval
+	usleep(50000);
+	FAIL_IF_NOT_EQUAL_INT(late_request(lp, 20), 503);
+	FAIL_IF_NOT_EQUAL_INT(late_request(lp, 0), 200); // On time, not late anymore
+	FAIL_IF_NOT_EQUAL_INT(late_request(lp, 20), 200);
+
+	onion_stats stats;
+	onion_get_stats(o, &stats);
+	FAIL_IF_NOT_EQUAL_INT((int)stats.requests_shed, 1);
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	t01_connection_limits();
+	t02_inflight();
+	t03_load_shedding();
+
+	END();
+}
@@ -0,0 +1,141 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <onion/onion.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/log.h>
+#include <onion/handlers/ratelimit.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+onion *server;
+onion_listen_point *custom_io;
+int calls=0;
+
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	calls++;
+	onion_response_write0(res, "ok");
+	return OCS_PROCESSED;
+}
+
+/// Does the request, with the extra headers, and returns the response headers.
+const char *do_request(const char *path, const char *extra){
+	static char headers[2048];
+	onion_request *req=onion_request_new(custom_io);
+	char tmp[512];
+	snprintf(tmp, sizeof(tmp), "GET /%s HTTP/1.1\r\n%s\r\n", path, extra ? extra : "");
+	onion_request_write(req, tmp, strlen(tmp));
+	const char *data=onion_buffer_listen_point_get_buffer_data(req);
+	const char *end=strstr(data, "\r\n\r\n");
+	snprintf(headers, sizeof(headers), "%.*s", end ? (int)(end-data+2) : 0, data);
+	onion_request_free(req);
+	return headers;
+}
+
+void init(onion_handler *ratelimit){
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	onion_set_root_handler(server, ratelimit);
+	calls=0;
+}
+
+/// A burst of limit requests, then 429 until a token is back.
+void t01_ratelimit(){
+	INIT_LOCAL();
+
+	init(onion_handler_ratelimit(onion_handler_new(handler, NULL, NULL), 3, 600));
+	const char *h=do_request("", NULL);
+	FAIL_IF_NOT(strstr(h, " 200 "));
+	FAIL_IF_NOT(strstr(h, "RateLimit-Limit: 3\r\n"));
+	FAIL_IF_NOT(strstr(h, "RateLimit-Remaining: 2\r\n"));
+	FAIL_IF_NOT(strstr(h, "RateLimit-Policy: 3;w=1\r\n"));
+	FAIL_IF_NOT(strstr(do_request("", NULL), "RateLimit-Remaining: 1\r\n"));
+	FAIL_IF_NOT(strstr(do_request("", NULL), "RateLimit-Remaining: 0\r\n"));
+	h=do_request("", NULL);
+	FAIL_IF_NOT(strstr(h, " 429 TOO MANY REQUESTS\r\n"));
+	FAIL_IF_NOT(strstr(h, "Retry-After: 1\r\n"));
+	FAIL_IF_NOT(strstr(h, "RateLimit-Remaining: 0\r\n"));
+	FAIL_IF_NOT_EQUAL_INT(calls, 3);
+
+	usleep(250000); // One token back each 200 ms
+	FAIL_IF_NOT(strstr(do_request("", NULL), " 200 "));
+	FAIL_IF_NOT(strstr(do_request("", NULL), " 429 "));
+	FAIL_IF_NOT_EQUAL_INT(calls, 4);
+
+	onion_free(server);
+
+	END_LOCAL();
+}
+
+/// Each API key has its own limit, and the requests without one the limit of their address.
+void t02_by_header(){
+	INIT_LOCAL();
+
+	onion_handler *ratelimit=onion_handler_ratelimit(onion_handler_new(handler, NULL, NULL), 1, 10000);
+	onion_handler_ratelimit_by_header(ratelimit, "X-Api-Key");
+	init(ratelimit);
+	FAIL_IF_NOT(strstr(do_request("", "X-Api-Key: a\r\n"), " 200 "));
+	FAIL_IF_NOT(strstr(do_request("", "X-Api-Key: a\r\n"), " 429 "));
+	FAIL_IF_NOT(strstr(do_request("", "X-Api-Key: b\r\n"), " 200 "));
+	FAIL_IF_NOT(strstr(do_request("", NULL), " 200 "));
+	FAIL_IF_NOT(strstr(do_request("", NULL), " 429 "));
+	FAIL_IF_NOT_EQUAL_INT(calls, 3);
+	onion_free(server);
+
+	END_LOCAL();
+}
+
+/// The path as key
+const char *path_key(void *data, onion_request *req){
+	FAIL_IF_NOT_EQUAL_STR((const char*)data, "data");
+	return onion_request_get_fullpath(req);
+}
+
+void t03_by_key(){
+	INIT_LOCAL();
+
+	onion_handler *ratelimit=onion_handler_ratelimit(onion_handler_new(handler, NULL, NULL), 2, 10000);
+	onion_handler_ratelimit_by_key(ratelimit, path_key, "data");
+	init(ratelimit);
+	FAIL_IF_NOT(strstr(do_request("a", NULL), " 200 "));
+	FAIL_IF_NOT(strstr(do_request("a", NULL), " 200 "));
+	FAIL_IF_NOT(strstr(do_request("a", NULL), " 429 "));
+	FAIL_IF_NOT(strstr(do_request("b", NULL), " 200 "));
+	FAIL_IF_NOT_EQUAL_INT(calls, 3);
+	onion_free(server);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	t01_ratelimit();
+	t02_by_header();
+	t03_by_key();
+
+	END();
+}
@@ -0,0 +1,342 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/url.h>
+#include <onion/block.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/handlers/proxy.h>
+
+#include "../ctest.h"
+
+#define BIG_SIZE 200000
+
+int connect_to(const char *addr, const char *port){
+  struct addrinfo hints;
+  struct addrinfo *server;
+
+  memset(&hints,0, sizeof(struct addrinfo));
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+  if (getaddrinfo(addr,port,&hints,&server)<0){
+    ONION_ERROR("Error getting server info");
+    return -1;
+  }
+  int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+  if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+    close(fd);
+    fd=-1;
+    ONION_ERROR("Error connecting to server %s:%s",addr,port);
+  }
+
+  freeaddrinfo(server);
+
+  return fd;
+}
+
+/// Client ports of the connections that got /who, at each upstream.
+int who_ports[2][64];
+int who_count[2];
+
+/// Distinct connections at who_ports
+int connections(int upstream){
+	int i, j, n=0;
+	for (i=0;i<who_count[upstream];i++){
+		for (j=0;j<i;j++)
+			if (who_ports[upstream][j]==who_ports[upstream][i])
+				break;
+		if (j==i)
+			n++;
+	}
+	return n;
+}
+
+onion_connection_status who(void *upstream, onion_request *req, onion_response *res){
+	int n=(int)(long)upstream;
+	socklen_t l;
+	struct sockaddr_storage *addr=onion_request_get_sockadd_storage(req, &l);
+	if (who_count[n]<64)
+		who_ports[n][who_count[n]++]=ntohs(((struct sockaddr_in*)addr)->sin_port);
+	if (strcmp(onion_request_get_fullpath(req), "/slow")==0)
+		usleep(300000);
+	onion_response_write0(res, n ? "B" : "A");
+	return OCS_PROCESSED;
+}
+
+onion_connection_status hello(void *_, onion_request *req, onion_response *res){
+	onion_response_set_header(res, "X-Upstream", "yes");
+	onion_response_printf(res, "Hello %s, from %s", onion_request_get_queryd(req, "name", "nobody"), 
+												onion_request_get_header(req, "X-Forwarded-For") ? "proxy" : "client");
+	return OCS_PROCESSED;
+}
+
+onion_connection_status big(void *_, onion_request *req, onion_response *res){
+	char data[1000];
+	int i;
+	onion_response_set_length(res, BIG_SIZE);
+	for (i=0;i<BIG_SIZE;i++){
+		data[i%sizeof(data)]='a'+i%26;
+		if (i%sizeof(data)==sizeof(data)-1)
+			onion_response_write(res, data, sizeof(data));
+	}
+	return OCS_PROCESSED;
+}
+
+/// No length, so chunked to the proxy.
+onion_connection_status chunked(void *_, onion_request *req, onion_response *res){
+	int i;
+	for (i=0;i<1000;i++)
+		onion_response_printf(res, "%d,", i);
+	return OCS_PROCESSED;
+}
+
+onion_connection_status echo(void *_, onion_request *req, onion_response *res){
+	const onion_block *data=onion_request_get_data(req);
+	if (data)
+		onion_response_write(res, onion_block_data(data), onion_block_size(data));
+	else
+		onion_response_printf(res, "a=%s b=%s", onion_request_get_post(req, "a"), onion_request_get_post(req, "b"));
+	return OCS_PROCESSED;
+}
+
+onion_connection_status health(void *upstream, onion_request *req, onion_response *res){
+	if (upstream) // B is down
+		return OCS_INTERNAL_ERROR;
+	onion_response_write0(res, "ok");
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *o){
+	onion_listen((onion*)o);
+	return NULL;
+}
+
+onion *upstream_new(const char *port, long n, pthread_t *th){
+	onion *o=onion_new(O_POOL);
+	onion_set_max_threads(o, 4);
+	onion_set_port(o, port);
+	onion_url *url=onion_root_url(o);
+	onion_url_add_with_data(url, "^who$", who, (void*)n, NULL);
+	onion_url_add_with_data(url, "^slow$", who, (void*)n, NULL);
+	onion_url_add(url, "^hello$", hello);
+	onion_url_add(url, "^big$", big);
+	onion_url_add(url, "^chunked$", chunked);
+	onion_url_add(url, "^echo$", echo);
+	onion_url_add_with_data(url, "^health$", health, (void*)n, NULL);
+	pthread_create(th, NULL, listen_thread_f, o);
+	return o;
+}
+
+void server_free(onion *o, pthread_t th){
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+}
+
+/// Does the request, and reads all the answer, headers and body, into buffer.
+const char *do_request_into(const char *request, char *buffer, size_t size){
+	memset(buffer, 0, size);
+	int fd=connect_to("localhost", "8129");
+	if (fd<0)
+		return buffer;
+	if (write(fd, request, strlen(request))<0){
+		close(fd);
+		return buffer;
+	}
+	ssize_t r, pos=0;
+	while ( (r=read(fd, buffer+pos, size-pos-1)) > 0 )
+		pos+=r;
+	close(fd);
+	return buffer;
+}
+
+/// Does the request, and returns all the answer. Valid until the next call.
+const char *do_request(const char *request){
+	static char buffer[BIG_SIZE+4096];
+	return do_request_into(request, buffer, sizeof(buffer));
+}
+
+const char *body(const char *answer){
+	const char *b=strstr(answer, "\r\n\r\n");
+	return b ? b+4 : "";
+}
+
+/// Requests and responses of all kinds go through.
+void check_relay(){
+	const char *ans=do_request("GET /hello?name=John%20Doe HTTP/1.0\r\n\r\n");
+	FAIL_IF_NOT_EQUAL_INT(atoi(ans+9), 200);
+	FAIL_IF_NOT(strstr(ans, "X-Upstream: yes\r\n"));
+	FAIL_IF_NOT_EQUAL_STR(body(ans), "Hello John Doe, from proxy");
+	
+	ans=do_request("GET /big HTTP/1.0\r\n\r\n");
+	FAIL_IF_NOT(strstr(ans, "Content-Length: 200000\r\n"));
+	const char *b=body(ans);
+	FAIL_IF_NOT_EQUAL_INT((int)strlen(b), BIG_SIZE);
+	int i;
+	for (i=0;i<BIG_SIZE;i++){
+		if (b[i]!='a'+i%26){
+			FAIL_IF_NOT_EQUAL_INT(i, -1);
+			break;
+		}
+	}
+	
+	ans=do_request("GET /chunked HTTP/1.0\r\n\r\n");
+	b=body(ans);
+	FAIL_IF_NOT_EQUAL_INT((int)strlen(b), 3890);
+	FAIL_IF_NOT(strncmp(b, "0,1,2,", 6)==0);
+	FAIL_IF_NOT(strstr(b, ",998,999,"));
+	
+	ans=do_request("POST /echo HTTP/1.0\r\nContent-Type: application/json\r\nContent-Length: 11\r\n\r\n{\"a\": true}");
+	FAIL_IF_NOT_EQUAL_STR(body(ans), "{\"a\": true}");
+	ans=do_request("POST /echo HTTP/1.0\r\nContent-Type: application/x-www-form-urlencoded\r\nContent-Length: 13\r\n\r\na=1&b=x+y%26z");
+	FAIL_IF_NOT_EQUAL_STR(body(ans), "a=1 b=x y&z");
+	
+	ans=do_request("HEAD /big HTTP/1.0\r\n\r\n");
+	FAIL_IF_NOT(strstr(ans, "Content-Length: 200000\r\n"));
+	FAIL_IF_NOT_EQUAL_STR(body(ans), "");
+	
+	ans=do_request("GET /nothere HTTP/1.0\r\n\r\n");
+	FAIL_IF_NOT_EQUAL_INT(atoi(ans+9), 404);
+}
+
+onion *proxy_new(int flags, onion_handler *proxy, pthread_t *th){
+	onion *o=onion_new(flags);
+	onion_set_max_threads(o, 2);
+	onion_set_port(o, "8129");
+	onion_set_root_handler(o, proxy);
+	pthread_create(th, NULL, listen_thread_f, o);
+	return o;
+}
+
+void t01_relay(){
+	INIT_LOCAL();
+	pthread_t tha, thp;
+	onion *a=upstream_new("8128", 0, &tha);
+	onion *p=proxy_new(O_POOL, onion_handler_proxy("localhost", "8128"), &thp);
+	sleep(1);
+	
+	check_relay();
+	
+	// Same upstream connection for all
+	memset(who_count, 0, sizeof(who_count));
+	int i;
+	for (i=0;i<5;i++)
+		FAIL_IF_NOT_EQUAL_STR(body(do_request("GET /who HTTP/1.0\r\n\r\n")), "A");
+	FAIL_IF_NOT_EQUAL_INT(who_count[0], 5);
+	FAIL_IF_NOT_EQUAL_INT(connections(0), 1);
+	
+	server_free(p, thp);
+	server_free(a, tha);
+	END_LOCAL();
+}
+
+/// Out of a poller the handler thread waits, with the same results.
+void t02_relay_threaded(){
+	INIT_LOCAL();
+	pthread_t tha, thp;
+	onion *a=upstream_new("8128", 0, &tha);
+	onion *p=proxy_new(O_THREADED, onion_handler_proxy("localhost", "8128"), &thp);
+	sleep(1);
+	
+	check_relay();
+	
+	server_free(p, thp);
+	server_free(a, tha);
+	END_LOCAL();
+}
+
+typedef struct{
+	const char *request;
+	const char *answer;
+}slow_request;
+
+void *slow_request_f(void *_){
+	slow_request *s=_;
+	char buffer[1024];
+	s->answer=strdup(body(do_request_into(s->request, buffer, sizeof(buffer))));
+	return NULL;
+}
+
+/// Least connections, failover and health checks.
+void t03_upstreams(){
+	INIT_LOCAL();
+	pthread_t tha, thb, thp;
+	onion *a=upstream_new("8128", 0, &tha);
+	onion *b=upstream_new("8131", 1, &thb);
+	onion_handler *proxy=onion_handler_proxy("localhost", "8133"); // Nobody there
+	FAIL_IF_NOT_EQUAL_INT(onion_handler_proxy_add_upstream(proxy, "localhost", "8128"), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_handler_proxy_add_upstream(proxy, "localhost", "8131"), 0);
+	onion *p=proxy_new(O_POOL, proxy, &thp);
+	sleep(1);
+	
+	// While one is busy, the other gets the requests. The failing one is skipped.
+	int i;
+	for (i=0;i<4;i++){
+		slow_request s={ "GET /slow HTTP/1.0\r\n\r\n", NULL };
+		pthread_t th;
+		pthread_create(&th, NULL, slow_request_f, &s);
+		usleep(100000);
+		const char *other=body(do_request("GET /who HTTP/1.0\r\n\r\n"));
+		pthread_join(th, NULL);
+		FAIL_IF(strlen(s.answer)!=1 || strlen(other)!=1);
+		FAIL_IF_EQUAL_STR(s.answer, other);
+		free((char*)s.answer);
+	}
+	
+	// B fails its health check, so it gets none.
+	onion_handler_proxy_set_health_check(proxy, "/health", 100);
+	do_request("GET /who HTTP/1.0\r\n\r\n"); // Starts the checks
+	usleep(300000);
+	for (i=0;i<6;i++)
+		FAIL_IF_NOT_EQUAL_STR(body(do_request("GET /who HTTP/1.0\r\n\r\n")), "A");
+	
+	server_free(p, thp);
+	server_free(b, thb);
+	
+	// No upstream left
+	p=proxy_new(O_POOL, onion_handler_proxy("localhost", "8131"), &thp);
+	sleep(1);
+	FAIL_IF_NOT_EQUAL_INT(atoi(do_request("GET /who HTTP/1.0\r\n\r\n")+9), 502);
+	
+	server_free(p, thp);
+	server_free(a, tha);
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	
+	t01_relay();
+	t02_relay_threaded();
+	t03_upstreams();
+	
+	END();
+}
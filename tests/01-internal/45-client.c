@@ -0,0 +1,476 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/url.h>
+#include <onion/block.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/poller.h>
+#include <onion/client.h>
+#include <onion/listen_point.h>
+#include <onion/types_internal.h>
+#ifdef HAVE_GNUTLS
+#include <onion/https.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#endif
+
+#include "../ctest.h"
+
+#define BIG_SIZE 100000
+#define FANOUT 10
+
+/// Client ports of the connections that got /who
+int who_ports[64];
+int who_count;
+
+/// Distinct connections at who_ports
+int connections(){
+	int i, j, n=0;
+	for (i=0;i<who_count;i++){
+		for (j=0;j<i;j++)
+			if (who_ports[j]==who_ports[i])
+				break;
+		if (j==i)
+			n++;
+	}
+	return n;
+}
+
+onion_connection_status who(void *_, onion_request *req, onion_response *res){
+	socklen_t l;
+	struct sockaddr_storage *addr=onion_request_get_sockadd_storage(req, &l);
+	if (who_count<64)
+		who_ports[who_count++]=ntohs(((struct sockaddr_in*)addr)->sin_port);
+	onion_response_write0(res, "who");
+	return OCS_PROCESSED;
+}
+
+onion_connection_status hello(void *_, onion_request *req, onion_response *res){
+	onion_response_set_header(res, "X-Test", onion_request_get_header(req, "X-Test") ? "yes" : "no");
+	onion_response_printf(res, "Hello %s", onion_request_get_queryd(req, "name", "nobody"));
+	return OCS_PROCESSED;
+}
+
+onion_connection_status slow(void *_, onion_request *req, onion_response *res){
+	usleep(200000);
+	onion_response_write0(res, "slow");
+	return OCS_PROCESSED;
+}
+
+onion_connection_status big(void *_, onion_request *req, onion_response *res){
+	char data[1000];
+	int i;
+	onion_response_set_length(res, BIG_SIZE);
+	for (i=0;i<BIG_SIZE;i++){
+		data[i%sizeof(data)]='a'+i%26;
+		if (i%sizeof(data)==sizeof(data)-1)
+			onion_response_write(res, data, sizeof(data));
+	}
+	return OCS_PROCESSED;
+}
+
+/// No length, so chunked.
+onion_connection_status chunked(void *_, onion_request *req, onion_response *res){
+	int i;
+	for (i=0;i<1000;i++)
+		onion_response_printf(res, "%d,", i);
+	return OCS_PROCESSED;
+}
+
+onion_connection_status echo(void *_, onion_request *req, onion_response *res){
+	const onion_block *data=onion_request_get_data(req);
+	if (data)
+		onion_response_write(res, onion_block_data(data), onion_block_size(data));
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *o){
+	onion_listen((onion*)o);
+	return NULL;
+}
+
+/// The port the kernel gave to a socket bound to port 0, so tests can run in parallel.
+void socket_port(int fd, char *port, size_t size){
+	struct sockaddr_storage addr;
+	socklen_t len=sizeof(addr);
+	int p=0;
+	if (getsockname(fd, (struct sockaddr*)&addr, &len)==0)
+		p=ntohs(addr.ss_family==AF_INET6 ? ((struct sockaddr_in6*)&addr)->sin6_port : ((struct sockaddr_in*)&addr)->sin_port);
+	snprintf(port, size, "%d", p);
+}
+
+/// Port of the first listen point of a server listening at port 0. Once listening.
+void listen_port(onion *o, char *port, size_t size){
+	socket_port(onion_get_listen_point(o, 0)->listenfd, port, size);
+}
+
+/// A port where nobody listens: it was just given to a socket, now closed.
+void free_port(char *port, size_t size){
+	int fd=socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+	socket_port(fd, port, size);
+	close(fd);
+}
+
+/// That scheme, port and path URL, at a buffer of this thread.
+const char *url(const char *scheme, const char *port, const char *path){
+	static __thread char ret[256];
+	snprintf(ret, sizeof(ret), "%s://localhost:%s%s", scheme, port, path);
+	return ret;
+}
+
+/// Port of the backend_new server
+char backend_port[16];
+
+void add_handlers(onion *o){
+	onion_url *url=onion_root_url(o);
+	onion_url_add(url, "^who$", who);
+	onion_url_add(url, "^hello$", hello);
+	onion_url_add(url, "^slow$", slow);
+	onion_url_add(url, "^big$", big);
+	onion_url_add(url, "^chunked$", chunked);
+	onion_url_add(url, "^echo$", echo);
+}
+
+onion *backend_new(pthread_t *th){
+	onion *o=onion_new(O_POOL);
+	onion_set_max_threads(o, FANOUT+2);
+	onion_poller_set_max_events(onion_get_poller(o), 1, 1); // The slow ones at once, also on kept alive connections
+	onion_set_port(o, "0");
+	add_handlers(o);
+	pthread_create(th, NULL, listen_thread_f, o);
+	sleep(1);
+	listen_port(o, backend_port, sizeof(backend_port));
+	return o;
+}
+
+void server_free(onion *o, pthread_t th){
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+}
+
+/// What a call got.
+typedef struct{
+	int code;
+	char *error;
+	char *body;
+	size_t size;
+	char *header;
+}result;
+
+void store_result(void *_, onion_client_call *call){
+	result *r=_;
+	r->code=onion_client_call_get_code(call);
+	r->error=onion_client_call_get_error(call) ? strdup(onion_client_call_get_error(call)) : NULL;
+	r->body=strdup(onion_client_call_get_body(call));
+	r->size=onion_client_call_get_body_size(call);
+	const char *h=onion_client_call_get_header(call, "X-Test");
+	r->header=h ? strdup(h) : NULL;
+}
+
+void result_free(result *r){
+	free(r->error);
+	free(r->body);
+	free(r->header);
+	memset(r, 0, sizeof(*r));
+}
+
+/// Does the call at this thread
+result call(onion_client *client, const char *method, const char *url, const char *body){
+	result r;
+	memset(&r, 0, sizeof(r));
+	onion_client_call *c=onion_client_call_new(client, method, url);
+	if (!c)
+		return r;
+	if (body){
+		onion_client_call_set_header(c, "Content-Type", "application/json");
+		onion_client_call_set_body(c, body, strlen(body));
+	}
+	onion_client_call_set_header(c, "X-Test", "1");
+	onion_client_call_start(c, NULL, store_result, &r);
+	return r;
+}
+
+/// Responses of all kinds, waiting at this thread.
+void t01_blocking(){
+	INIT_LOCAL();
+	pthread_t th;
+	onion *o=backend_new(&th);
+	onion_client *client=onion_client_new();
+
+	result r=call(client, "GET", url("http", backend_port, "/hello?name=John%20Doe"), NULL);
+	FAIL_IF_NOT_EQUAL_INT(r.code, 200);
+	FAIL_IF_NOT_EQUAL_STR(r.body, "Hello John Doe");
+	FAIL_IF_NOT_EQUAL_STR(r.header, "yes");
+	FAIL_IF(r.error!=NULL);
+	result_free(&r);
+
+	r=call(client, "POST", url("http", backend_port, "/echo"), "{\"a\": true}");
+	FAIL_IF_NOT_EQUAL_INT(r.code, 200);
+	FAIL_IF_NOT_EQUAL_STR(r.body, "{\"a\": true}");
+	result_free(&r);
+
+	r=call(client, "GET", url("http", backend_port, "/chunked"), NULL);
+	FAIL_IF_NOT_EQUAL_INT(r.code, 200);
+	FAIL_IF_NOT_EQUAL_INT(r.size, 3890);
+	FAIL_IF_NOT_EQUAL_STR(r.body+r.size-4, "999,");
+	result_free(&r);
+
+	r=call(client, "GET", url("http", backend_port, "/big"), NULL);
+	FAIL_IF_NOT_EQUAL_INT(r.code, 200);
+	FAIL_IF_NOT_EQUAL_INT(r.size, BIG_SIZE);
+	FAIL_IF_NOT_EQUAL_INT(r.body[BIG_SIZE-1], 'a'+(BIG_SIZE-1)%26);
+	result_free(&r);
+
+	r=call(client, "HEAD", url("http", backend_port, "/big"), NULL);
+	FAIL_IF_NOT_EQUAL_INT(r.code, 200);
+	FAIL_IF_NOT_EQUAL_INT(r.size, 0);
+	result_free(&r);
+
+	r=call(client, "GET", url("http", backend_port, "/nothere"), NULL);
+	FAIL_IF_NOT_EQUAL_INT(r.code, 404);
+	result_free(&r);
+
+	// All on the same connection
+	who_count=0;
+	int i;
+	for (i=0;i<5;i++){
+		r=call(client, "GET", url("http", backend_port, "/who"), NULL);
+		FAIL_IF_NOT_EQUAL_STR(r.body, "who");
+		result_free(&r);
+	}
+	FAIL_IF_NOT_EQUAL_INT(who_count, 5);
+	FAIL_IF_NOT_EQUAL_INT(connections(), 1);
+
+	// Errors
+	char nobody[16];
+	free_port(nobody, sizeof(nobody));
+	r=call(client, "GET", url("http", nobody, "/"), NULL);
+	FAIL_IF_NOT_EQUAL_INT(r.code, 0);
+	FAIL_IF(r.error==NULL);
+	result_free(&r);
+	FAIL_IF_NOT_EQUAL(onion_client_call_new(client, "GET", "ftp://localhost/"), NULL);
+	FAIL_IF_NOT_EQUAL(onion_client_call_new(client, "GET", "http:///path"), NULL);
+
+	onion_client_set_timeout(client, 50);
+	r=call(client, "GET", url("http", backend_port, "/slow"), NULL);
+	FAIL_IF_NOT_EQUAL_INT(r.code, 0);
+	FAIL_IF_NOT_EQUAL_STR(r.error, "Timed out");
+	result_free(&r);
+
+	onion_client_free(client);
+	server_free(o, th);
+	END_LOCAL();
+}
+
+onion_client *fanout_client;
+
+/// A fan out in flight: the last call to end answers and resumes the request.
+typedef struct{
+	onion_request *req;
+	onion_response *res;
+	int pending;
+	int ok;
+}fanout_state;
+
+void fanout_part_done(void *_, onion_client_call *call){
+	fanout_state *s=_;
+	if (onion_client_call_get_code(call)==200 && strcmp(onion_client_call_get_body(call), "slow")==0)
+		__sync_fetch_and_add(&s->ok, 1);
+	if (__sync_sub_and_fetch(&s->pending, 1)==0){
+		onion_request *req=s->req;
+		onion_response_printf(s->res, "%d ok", s->ok);
+		free(s);
+		onion_request_resume(req);
+	}
+}
+
+/// Calls /slow FANOUT times at once, and suspends the request meanwhile.
+onion_connection_status fanout(void *_, onion_request *req, onion_response *res){
+	fanout_state *s=calloc(1, sizeof(fanout_state));
+	s->req=req;
+	s->res=res;
+	s->pending=FANOUT;
+	int i;
+	for (i=0;i<FANOUT;i++){
+		onion_client_call *call=onion_client_call_new(fanout_client, "GET", url("http", backend_port, "/slow"));
+		onion_client_call_start(call, onion_request_get_poller(req), fanout_part_done, s);
+	}
+	return OCS_SUSPENDED;
+}
+
+/// Reads all the answer to a GET of that path at that port, and returns its body.
+char *get(const char *port, const char *path){
+	onion_client *client=onion_client_new();
+	char url[256];
+	snprintf(url, sizeof(url), "http://localhost:%s%s", port, path);
+	result r=call(client, "GET", url, NULL);
+	onion_client_free(client);
+	char *ret=r.body;
+	r.body=NULL;
+	result_free(&r);
+	return ret;
+}
+
+int64_t now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+/// All the calls go on at once at the poller of a single thread server.
+void t02_fanout_at_poller(){
+	INIT_LOCAL();
+	pthread_t th, thf;
+	onion *o=backend_new(&th);
+	onion *front=onion_new(O_POOL);
+	onion_set_max_threads(front, 1);
+	onion_set_port(front, "0");
+	onion_url_add(onion_root_url(front), "^fanout$", fanout);
+	fanout_client=onion_client_new();
+	pthread_create(&thf, NULL, listen_thread_f, front);
+	sleep(1);
+	char front_port[16];
+	listen_port(front, front_port, sizeof(front_port));
+
+	int i;
+	for (i=0;i<2;i++){ // The second, on kept alive connections
+		int64_t start=now_ms();
+		char *b=get(front_port, "/fanout");
+		FAIL_IF_NOT_EQUAL_STR(b, "10 ok");
+		free(b);
+		FAIL_IF(now_ms()-start>=FANOUT*200/2);
+	}
+
+	server_free(front, thf);
+	onion_client_free(fanout_client);
+	server_free(o, th);
+	END_LOCAL();
+}
+
+#ifdef HAVE_GNUTLS
+#define CERTFILE "45-client.pem"
+
+/// A self signed certificate for that name and its key, at the same file.
+int write_certificate(const char *filename, const char *name){
+	gnutls_x509_privkey_t key;
+	gnutls_x509_crt_t crt;
+	gnutls_x509_privkey_init(&key);
+	gnutls_x509_privkey_generate(key, GNUTLS_PK_RSA, 2048, 0);
+	gnutls_x509_crt_init(&crt);
+	gnutls_x509_crt_set_version(crt, 3);
+	gnutls_x509_crt_set_serial(crt, "\x01", 1);
+	gnutls_x509_crt_set_activation_time(crt, time(NULL)-3600);
+	gnutls_x509_crt_set_expiration_time(crt, time(NULL)+3600);
+	gnutls_x509_crt_set_dn_by_oid(crt, GNUTLS_OID_X520_COMMON_NAME, 0, name, strlen(name));
+	gnutls_x509_crt_set_key(crt, key);
+	int r=gnutls_x509_crt_sign2(crt, crt, key, GNUTLS_DIG_SHA256, 0);
+
+	static char pem[16*1024];
+	size_t l1=sizeof(pem), l2;
+	if (r>=0)
+		r=gnutls_x509_crt_export(crt, GNUTLS_X509_FMT_PEM, pem, &l1);
+	l2=sizeof(pem)-l1;
+	if (r>=0)
+		r=gnutls_x509_privkey_export(key, GNUTLS_X509_FMT_PEM, pem+l1, &l2);
+	gnutls_x509_crt_deinit(crt);
+	gnutls_x509_privkey_deinit(key);
+	if (r<0)
+		return -1;
+	FILE *f=fopen(filename, "w");
+	fwrite(pem, 1, l1+l2, f);
+	fclose(f);
+	return 0;
+}
+
+/// Verified TLS, and kept alive TLS connections.
+void t03_https(){
+	INIT_LOCAL();
+	FAIL_IF_NOT_EQUAL_INT(write_certificate(CERTFILE, "localhost"), 0);
+	pthread_t th;
+	onion *o=onion_new(O_POOL);
+	onion_set_max_threads(o, 2);
+	onion_listen_point *https=onion_https_new();
+	onion_add_listen_point(o, "localhost", "0", https);
+	onion_https_set_certificate(https, O_SSL_CERTIFICATE_KEY, CERTFILE, CERTFILE);
+	add_handlers(o);
+	pthread_create(&th, NULL, listen_thread_f, o);
+	sleep(1);
+	char port[16];
+	listen_port(o, port, sizeof(port));
+
+	onion_client *client=onion_client_new();
+	result r=call(client, "GET", url("https", port, "/hello"), NULL); // Not trusted yet
+	FAIL_IF_NOT_EQUAL_INT(r.code, 0);
+	FAIL_IF(r.error==NULL);
+	result_free(&r);
+
+	FAIL_IF_NOT_EQUAL_INT(onion_client_set_ca_file(client, CERTFILE), 0);
+	r=call(client, "GET", url("https", port, "/hello?name=TLS"), NULL);
+	FAIL_IF_NOT_EQUAL_INT(r.code, 200);
+	FAIL_IF_NOT_EQUAL_STR(r.body, "Hello TLS");
+	result_free(&r);
+
+	r=call(client, "GET", url("https", port, "/big"), NULL);
+	FAIL_IF_NOT_EQUAL_INT(r.size, BIG_SIZE);
+	result_free(&r);
+
+	who_count=0;
+	int i;
+	for (i=0;i<3;i++){
+		r=call(client, "GET", url("https", port, "/who"), NULL);
+		FAIL_IF_NOT_EQUAL_STR(r.body, "who");
+		result_free(&r);
+	}
+	FAIL_IF_NOT_EQUAL_INT(connections(), 1);
+
+	onion_client_free(client);
+	server_free(o, th);
+	unlink(CERTFILE);
+	END_LOCAL();
+}
+#endif
+
+int main(int argc, char **argv){
+	START();
+
+	t01_blocking();
+	t02_fanout_at_poller();
+#ifdef HAVE_GNUTLS
+	t03_https();
+#endif
+
+	END();
+}
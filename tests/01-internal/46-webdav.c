@@ -0,0 +1,318 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include <onion/onion.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/log.h>
+#include <onion/handlers/webdav.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+onion *server;
+onion_listen_point *custom_io;
+onion_handler *webdav;
+char dir[64];
+char etag[64];
+
+/// The body of a chunked response, dechunked.
+void dechunk(const char *data, char *body, size_t size){
+	size_t l=0;
+	const char *p=data;
+	for(;;){
+		int n=strtol(p, (char**)&p, 16);
+		if (n<=0 || l+n>=size)
+			break;
+		p+=2;
+		memcpy(body+l, p, n);
+		l+=n;
+		p+=n+2;
+	}
+	body[l]='\0';
+}
+
+/// Does the request, and returns the status line, and the body. The ETag, if any, at etag.
+const char *do_request(const char *method, const char *path, const char *headers, const char *xml, char **body){
+	static char status[256];
+	static char data[512*1024];
+	onion_request *req=onion_request_new(custom_io);
+	char tmp[1024];
+	snprintf(tmp, sizeof(tmp), "%s %s HTTP/1.1\r\n%sContent-Length: %d\r\n\r\n%s", method, path, headers, xml ? (int)strlen(xml) : 0, xml ? xml : "");
+	onion_request_write(req, tmp, strlen(tmp));
+	const char *answer=onion_buffer_listen_point_get_buffer_data(req);
+	const char *end=strstr(answer, "\r\n");
+	snprintf(status, sizeof(status), "%.*s", end ? (int)(end-answer) : 0, answer);
+	const char *headers_end=strstr(answer, "\r\n\r\n");
+	if (headers_end && strstr(answer, "Transfer-Encoding: chunked") && strstr(answer, "Transfer-Encoding: chunked")<headers_end)
+		dechunk(headers_end+4, data, sizeof(data));
+	else
+		snprintf(data, sizeof(data), "%s", headers_end ? headers_end+4 : "");
+	const char *e=strstr(answer, "ETag: ");
+	if (e && e<headers_end)
+		snprintf(etag, sizeof(etag), "%.*s", (int)(strstr(e, "\r\n")-e-6), e+6);
+	else
+		etag[0]='\0';
+	*body=data;
+	onion_request_free(req);
+	return status;
+}
+
+/// Does the PROPFIND, and returns the status line, and the body.
+const char *propfind(const char *path, const char *depth, const char *xml, char **body){
+	char depth_header[64]="";
+	if (depth)
+		snprintf(depth_header, sizeof(depth_header), "Depth: %s\r\n", depth);
+	return do_request("PROPFIND", path, depth_header, xml, body);
+}
+
+void write_file(const char *name, const char *content){
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	FILE *f=fopen(path, "w");
+	fputs(content, f);
+	fclose(f);
+}
+
+void make_tree(){
+	strcpy(dir, "/tmp/onion-webdav-XXXXXX");
+	mkdtemp(dir);
+	char path[256];
+	write_file("a.txt", "hello");
+	snprintf(path, sizeof(path), "%s/sub", dir);
+	mkdir(path, 0700);
+	write_file("sub/b.txt", "b");
+	snprintf(path, sizeof(path), "%s/sub/deep", dir);
+	mkdir(path, 0700);
+	write_file("sub/deep/c.txt", "c");
+	snprintf(path, sizeof(path), "%s/sub/loop", dir);
+	symlink("..", path); // Not followed down
+}
+
+void remove_tree(){
+	char cmd[256];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	FAIL_IF_NOT_EQUAL_INT(system(cmd), 0);
+}
+
+/// Each depth, streamed as chunks.
+void t01_propfind_depth(){
+	INIT_LOCAL();
+	char *body;
+
+	const char *status=propfind("/", "0", NULL, &body);
+	FAIL_IF_NOT_EQUAL_STR(status, "HTTP/1.1 207 MULTI STATUS");
+	FAIL_IF_NOT(strstr(body, "<D:href>/</D:href>"));
+	FAIL_IF(strstr(body, "a.txt"));
+	FAIL_IF_NOT(strstr(body, "</D:multistatus>"));
+
+	propfind("/", "1", NULL, &body);
+	FAIL_IF_NOT(strstr(body, "<D:href>/a.txt</D:href>"));
+	FAIL_IF_NOT(strstr(body, "<D:href>/sub/</D:href>"));
+	FAIL_IF(strstr(body, "b.txt"));
+
+	propfind("/sub", "1", NULL, &body);
+	FAIL_IF_NOT(strstr(body, "<D:href>/sub/</D:href>"));
+	FAIL_IF_NOT(strstr(body, "<D:href>/sub/b.txt</D:href>"));
+	FAIL_IF_NOT(strstr(body, "<D:href>/sub/deep/</D:href>"));
+	FAIL_IF(strstr(body, "c.txt"));
+
+	propfind("/", "infinity", NULL, &body);
+	FAIL_IF_NOT(strstr(body, "<D:href>/a.txt</D:href>"));
+	FAIL_IF_NOT(strstr(body, "<D:href>/sub/b.txt</D:href>"));
+	FAIL_IF_NOT(strstr(body, "<D:href>/sub/deep/c.txt</D:href>"));
+	FAIL_IF_NOT(strstr(body, "<D:href>/sub/loop/</D:href>"));
+	FAIL_IF(strstr(body, "/sub/loop/a.txt"));
+	FAIL_IF_NOT(strstr(body, "</D:multistatus>"));
+
+	propfind("/", NULL, NULL, &body); // No Depth is infinity
+	FAIL_IF_NOT(strstr(body, "<D:href>/sub/deep/c.txt</D:href>"));
+
+	status=propfind("/nothere", "1", NULL, &body);
+	FAIL_IF_NOT_EQUAL_STR(status, "HTTP/1.1 404 NOT FOUND");
+
+	END_LOCAL();
+}
+
+/// Only the asked props, with a stat only when they need it.
+void t02_propfind_props(){
+	INIT_LOCAL();
+	char *body;
+
+	propfind("/", "1", "<?xml version=\"1.0\"?><propfind xmlns=\"DAV:\"><prop><getcontentlength/></prop></propfind>", &body);
+	FAIL_IF_NOT(strstr(body, "<lp1:getcontentlength>5</lp1:getcontentlength>"));
+	FAIL_IF(strstr(body, "resourcetype"));
+
+	propfind("/", "1", "<?xml version=\"1.0\"?><propfind xmlns=\"DAV:\"><prop><resourcetype/></prop></propfind>", &body);
+	FAIL_IF_NOT(strstr(body, "<D:href>/sub/</D:href>"));
+	FAIL_IF_NOT(strstr(body, "<D:collection/>"));
+	FAIL_IF(strstr(body, "getcontentlength>5"));
+
+	END_LOCAL();
+}
+
+/// Many entries go out as several chunks.
+void t03_propfind_big(){
+	INIT_LOCAL();
+	char name[64];
+	int i;
+	for (i=0;i<200;i++){
+		snprintf(name, sizeof(name), "sub/deep/file-%03d.txt", i);
+		write_file(name, "x");
+	}
+	char *body;
+	propfind("/sub/deep", "1", NULL, &body);
+	FAIL_IF_NOT(strstr(body, "<D:href>/sub/deep/file-000.txt</D:href>"));
+	FAIL_IF_NOT(strstr(body, "<D:href>/sub/deep/file-199.txt</D:href>"));
+	FAIL_IF_NOT(strstr(body, "</D:multistatus>"));
+
+	END_LOCAL();
+}
+
+/// Answers kept until something changes there, by inotify or through the handler.
+void t04_propfind_cache(){
+	INIT_LOCAL();
+	char *body;
+	char first[64];
+	FAIL_IF_NOT_EQUAL_INT(onion_handler_webdav_set_cache(webdav, 1024*1024), 0);
+
+	const char *status=propfind("/", "1", NULL, &body);
+	FAIL_IF_NOT_EQUAL_STR(status, "HTTP/1.1 207 MULTI STATUS");
+	FAIL_IF_EQUAL_STR(etag, "");
+	strcpy(first, etag);
+	propfind("/", "1", NULL, &body); // Kept
+	FAIL_IF_NOT_EQUAL_STR(etag, first);
+	FAIL_IF_NOT(strstr(body, "<D:href>/a.txt</D:href>"));
+	FAIL_IF_NOT(strstr(body, "</D:multistatus>"));
+
+	char headers[128];
+	snprintf(headers, sizeof(headers), "Depth: 1\r\nIf-None-Match: %s\r\n", first);
+	status=do_request("PROPFIND", "/", headers, NULL, &body);
+	FAIL_IF_NOT_EQUAL_STR(status, "HTTP/1.1 304 NOT MODIFIED");
+	FAIL_IF_NOT_EQUAL_STR(body, "");
+
+	write_file("new.txt", "new"); // Not through the handler
+	status=do_request("PROPFIND", "/", headers, NULL, &body);
+	FAIL_IF_NOT_EQUAL_STR(status, "HTTP/1.1 207 MULTI STATUS");
+	FAIL_IF_EQUAL_STR(etag, first);
+	FAIL_IF_NOT(strstr(body, "<D:href>/new.txt</D:href>"));
+
+	// Deep changes, for Depth: infinity
+	propfind("/", "infinity", NULL, &body);
+	strcpy(first, etag);
+	propfind("/", "infinity", NULL, &body);
+	FAIL_IF_NOT_EQUAL_STR(etag, first);
+	write_file("sub/deep/z.txt", "z");
+	propfind("/", "infinity", NULL, &body);
+	FAIL_IF_EQUAL_STR(etag, first);
+	FAIL_IF_NOT(strstr(body, "<D:href>/sub/deep/z.txt</D:href>"));
+
+	// Only what is touched goes out
+	propfind("/sub", "1", NULL, &body);
+	strcpy(first, etag);
+	write_file("other.txt", "other");
+	propfind("/sub", "1", NULL, &body);
+	FAIL_IF_NOT_EQUAL_STR(etag, first);
+
+	// Through the handler
+	status=do_request("MKCOL", "/made", "", NULL, &body);
+	FAIL_IF_NOT_EQUAL_STR(status, "HTTP/1.1 201 CREATED");
+	propfind("/", "1", NULL, &body);
+	FAIL_IF_NOT(strstr(body, "<D:href>/made/</D:href>"));
+	status=do_request("DELETE", "/made", "", NULL, &body);
+	propfind("/", "1", NULL, &body);
+	FAIL_IF(strstr(body, "<D:href>/made/</D:href>"));
+
+	END_LOCAL();
+}
+
+/// PUT bodies kept at the export, so they are just linked in place.
+void put_spool_hook(void *_, onion_request *req){
+	if ((onion_request_get_flags(req)&OR_METHODS)==OR_PUT)
+		onion_request_set_spool_dir(req, dir);
+}
+
+void t05_put(){
+	INIT_LOCAL();
+	char *body;
+	onion_set_request_body_hook(server, put_spool_hook, NULL);
+
+	const char *status=do_request("PUT", "/put.txt", "", "written once", &body);
+	FAIL_IF_NOT_EQUAL_STR(status, "HTTP/1.1 201 CREATED");
+	status=do_request("PUT", "/a.txt", "", "replaced", &body);
+	FAIL_IF_NOT_EQUAL_STR(status, "HTTP/1.1 201 CREATED");
+
+	char path[256], content[64];
+	snprintf(path, sizeof(path), "%s/put.txt", dir);
+	FILE *f=fopen(path, "r");
+	FAIL_IF(f==NULL);
+	if (f){
+		content[fread(content, 1, sizeof(content)-1, f)]='\0';
+		fclose(f);
+		FAIL_IF_NOT_EQUAL_STR(content, "written once");
+	}
+	snprintf(path, sizeof(path), "%s/a.txt", dir);
+	f=fopen(path, "r");
+	FAIL_IF(f==NULL);
+	if (f){
+		content[fread(content, 1, sizeof(content)-1, f)]='\0';
+		fclose(f);
+		FAIL_IF_NOT_EQUAL_STR(content, "replaced");
+	}
+
+	// Nothing left at the spool dir
+	DIR *d=opendir(dir);
+	struct dirent *de;
+	while ( (de=readdir(d)) ){
+		FAIL_IF(strstr(de->d_name, "onion-"));
+	}
+	closedir(d);
+
+	propfind("/", "1", NULL, &body); // The cache knows
+	FAIL_IF_NOT(strstr(body, "<D:href>/put.txt</D:href>"));
+
+	onion_set_request_body_hook(server, NULL, NULL);
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	make_tree();
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	webdav=onion_handler_webdav(dir, NULL);
+	onion_set_root_handler(server, webdav);
+
+	t01_propfind_depth();
+	t02_propfind_props();
+	t03_propfind_big();
+	t04_propfind_cache();
+	t05_put();
+
+	onion_free(server);
+	remove_tree();
+	END();
+}
@@ -0,0 +1,174 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <png.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/block.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/extras/png.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+#define WIDTH 700
+#define HEIGHT 500
+
+struct{
+	int Bpp;
+	int level;
+	onion_png_filter filter;
+	int threads;
+	int rows_per_write;
+}encoding;
+
+unsigned char image[WIDTH*HEIGHT*4];
+
+/// Some noise over gradients, so all the filters get used.
+void fill_image(){
+	int i;
+	srand(1);
+	for (i=0;i<sizeof(image);i++){
+		int x=(i/4)%WIDTH, y=(i/4)/WIDTH;
+		image[i]=((x*(i%4+1) + y*2) & 0xff) ^ (rand()%8==0 ? rand()&0xff : 0);
+	}
+}
+
+onion_connection_status png_handler(void *_, onion_request *req, onion_response *res){
+	int Bpp=encoding.Bpp<0 ? -encoding.Bpp : encoding.Bpp;
+	onion_png *png=onion_png_begin(res, encoding.Bpp, WIDTH, HEIGHT);
+	onion_png_set_compression(png, encoding.level, encoding.filter);
+	onion_png_set_threads(png, encoding.threads);
+	int y;
+	for (y=0;y<HEIGHT;y+=encoding.rows_per_write){
+		int n=HEIGHT-y<encoding.rows_per_write ? HEIGHT-y : encoding.rows_per_write;
+		if (onion_png_write_rows(png, image+y*WIDTH*Bpp, n)<0)
+			break;
+	}
+	return onion_png_end(png);
+}
+
+/// Encodes the image with the current settings, decodes it with libpng, and checks it is the same.
+void check_roundtrip(onion_listen_point *lp){
+	int Bpp=encoding.Bpp<0 ? -encoding.Bpp : encoding.Bpp;
+	onion_request *req=onion_request_new(lp);
+	onion_request_write(req, "GET / HTTP/1.0\r\n\r\n", 18);
+	onion_block *block=onion_buffer_listen_point_get_buffer(req);
+	const char *data=onion_block_data(block);
+	FAIL_IF_NOT(strstr(data, "HTTP/1.0 200 OK\r\n"));
+	FAIL_IF_NOT(strstr(data, "Content-Type: image/png\r\n"));
+	const char *body=strstr(data, "\r\n\r\n");
+	FAIL_IF_EQUAL(body, NULL);
+	if (!body){
+		onion_request_free(req);
+		return;
+	}
+	body+=4;
+
+	png_image decoded;
+	memset(&decoded, 0, sizeof(decoded));
+	decoded.version=PNG_IMAGE_VERSION;
+	FAIL_IF_NOT(png_image_begin_read_from_memory(&decoded, body, onion_block_size(block)-(body-data)));
+	FAIL_IF_NOT_EQUAL_INT(decoded.width, WIDTH);
+	FAIL_IF_NOT_EQUAL_INT(decoded.height, HEIGHT);
+	static const int formats[]={PNG_FORMAT_GRAY, PNG_FORMAT_GA, PNG_FORMAT_RGB, PNG_FORMAT_RGBA};
+	decoded.format=formats[Bpp-1];
+	if (encoding.Bpp<0)
+		decoded.format|=PNG_FORMAT_FLAG_BGR;
+	unsigned char *pixels=malloc(WIDTH*HEIGHT*Bpp);
+	FAIL_IF_NOT(png_image_finish_read(&decoded, NULL, pixels, 0, NULL));
+	FAIL_IF_NOT(memcmp(pixels, image, WIDTH*HEIGHT*Bpp)==0);
+	png_image_free(&decoded);
+	free(pixels);
+	onion_request_free(req);
+}
+
+void t01_serial(){
+	INIT_LOCAL();
+	onion *o=onion_new(O_ONE);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(o, NULL, NULL, lp);
+	onion_set_root_handler(o, onion_handler_new(png_handler, NULL, NULL));
+
+	encoding.Bpp=3;
+	encoding.level=-1;
+	encoding.filter=ONION_PNG_FILTER_DEFAULT;
+	encoding.threads=1;
+	encoding.rows_per_write=HEIGHT;
+	check_roundtrip(lp);
+
+	encoding.Bpp=1;
+	encoding.level=0;
+	encoding.filter=ONION_PNG_FILTER_NONE;
+	encoding.rows_per_write=1;
+	check_roundtrip(lp);
+
+	onion_free(o);
+	END_LOCAL();
+}
+
+/// Bands of rows deflated at several threads must give the same image, with any filter and row grouping.
+void t02_parallel(){
+	INIT_LOCAL();
+	onion *o=onion_new(O_ONE);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(o, NULL, NULL, lp);
+	onion_set_root_handler(o, onion_handler_new(png_handler, NULL, NULL));
+
+	encoding.threads=4;
+	encoding.Bpp=3;
+	encoding.level=6;
+	encoding.filter=ONION_PNG_FILTER_DEFAULT;
+	encoding.rows_per_write=7;
+	check_roundtrip(lp);
+
+	encoding.Bpp=-4;
+	encoding.level=1;
+	encoding.filter=ONION_PNG_FILTER_PAETH;
+	encoding.rows_per_write=1;
+	check_roundtrip(lp);
+
+	encoding.Bpp=2;
+	encoding.level=9;
+	encoding.filter=ONION_PNG_FILTER_AVG;
+	encoding.rows_per_write=HEIGHT;
+	check_roundtrip(lp);
+
+	encoding.Bpp=4;
+	encoding.level=0;
+	encoding.filter=ONION_PNG_FILTER_SUB;
+	encoding.rows_per_write=33;
+	check_roundtrip(lp);
+
+	onion_free(o);
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	fill_image();
+
+	t01_serial();
+	t02_parallel();
+
+	END();
+}
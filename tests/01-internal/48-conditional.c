@@ -0,0 +1,245 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <onion/onion.h>
+#include <onion/dict.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/shortcuts.h>
+#include <onion/block.h>
+#include <onion/log.h>
+#include <onion/handlers/conditional.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+#define TMPFILE "/tmp/onion-48-conditional.txt"
+
+onion *server;
+onion_listen_point *custom_io;
+int calls=0;
+int version=1;
+
+/// Answers with the version, in several ways by path.
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	calls++;
+	const char *path=onion_request_get_fullpath(req);
+	if (strcmp(path, "/file")==0)
+		return onion_shortcut_response_file(TMPFILE, req, res);
+	if (strcmp(path, "/own")==0)
+		onion_response_set_header(res, "ETag", "\"own\"");
+	if (strcmp(path, "/dated")==0)
+		onion_response_set_header(res, "Last-Modified", "Sun, 06 Nov 1994 08:49:37 GMT");
+	if (strcmp(path, "/missing")==0)
+		onion_response_set_code(res, HTTP_NOT_FOUND);
+	if (strcmp(path, "/explicit")==0){
+		onion_response_set_length(res, 9);
+		onion_response_write_headers(res);
+	}
+	if (strcmp(path, "/big")==0){
+		int i;
+		for (i=0;i<1000;i++)
+			onion_response_write0(res, "0123456789");
+	}
+	onion_response_printf(res, "version %d", version);
+	return OCS_PROCESSED;
+}
+
+/// Does the request, and returns the body, or NULL. The headers at headers, if not NULL.
+char *do_request(const char *method, const char *path, const char *extra, char *headers, size_t size){
+	onion_request *req=onion_request_new(custom_io);
+	char tmp[512];
+	snprintf(tmp, sizeof(tmp), "%s /%s HTTP/1.1\r\n%s\r\n", method, path, extra ? extra : "");
+	onion_request_write(req, tmp, strlen(tmp));
+	const char *data=onion_buffer_listen_point_get_buffer_data(req);
+	const char *end=strstr(data, "\r\n\r\n");
+	char *ret=end ? strdup(end+4) : NULL;
+	if (headers && end)
+		snprintf(headers, size, "%.*s\r\n", (int)(end-data), data);
+	onion_request_free(req);
+	return ret;
+}
+
+/// Copies the value of the header at the response headers to dest.
+void get_header(const char *headers, const char *name, char *dest, size_t size){
+	dest[0]=0;
+	const char *p=strstr(headers, name);
+	if (!p)
+		return;
+	p+=strlen(name)+2;
+	const char *end=strstr(p, "\r\n");
+	snprintf(dest, size, "%.*s", (int)(end-p), p);
+}
+
+void init(){
+	server=onion_new(O_ONE);
+	custom_io=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, custom_io);
+	onion_set_root_handler(server, onion_handler_conditional(onion_handler_new(handler, NULL, NULL), 4096));
+	calls=0;
+	version=1;
+}
+
+/// The dynamic responses get an ETag of their body, and a 304 when the client has it.
+void t01_dynamic(){
+	INIT_LOCAL();
+	init();
+
+	char headers[1024], etag[64], extra[128];
+	char *body=do_request("GET", "a", NULL, headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL_STR(body, "version 1");
+	free(body);
+	FAIL_IF_EQUAL(strstr(headers, "HTTP/1.1 200 OK\r\n"), NULL);
+	FAIL_IF_EQUAL(strstr(headers, "Content-Length: 9\r\n"), NULL);
+	get_header(headers, "ETag", etag, sizeof(etag));
+	FAIL_IF_NOT_EQUAL_INT((int)strlen(etag), 20);
+	FAIL_IF_NOT_EQUAL_INT(strncmp(etag, "W/\"", 3), 0);
+
+	snprintf(extra, sizeof(extra), "If-None-Match: \"other\", %s\r\n", etag);
+	body=do_request("GET", "a", extra, headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL_STR(body, "");
+	free(body);
+	FAIL_IF_EQUAL(strstr(headers, "HTTP/1.1 304 NOT MODIFIED\r\n"), NULL);
+	FAIL_IF_EQUAL(strstr(headers, etag), NULL);
+	FAIL_IF_NOT_EQUAL_INT(calls, 2); // It still runs
+
+	body=do_request("GET", "explicit", extra, headers, sizeof(headers)); // Same body, with the headers written already
+	FAIL_IF_NOT_EQUAL_STR(body, "");
+	free(body);
+	FAIL_IF_EQUAL(strstr(headers, "HTTP/1.1 304"), NULL);
+
+	version=2;
+	body=do_request("GET", "a", extra, headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL_STR(body, "version 2");
+	free(body);
+	FAIL_IF_EQUAL(strstr(headers, "HTTP/1.1 200 OK\r\n"), NULL);
+	FAIL_IF_NOT_EQUAL(strstr(headers, etag), NULL);
+
+	body=do_request("GET", "own", "If-None-Match: \"own\"\r\n", headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL_STR(body, "");
+	free(body);
+	FAIL_IF_EQUAL(strstr(headers, "HTTP/1.1 304"), NULL);
+
+	body=do_request("GET", "dated", "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n", headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL_STR(body, "");
+	free(body);
+	FAIL_IF_EQUAL(strstr(headers, "HTTP/1.1 304"), NULL);
+	body=do_request("GET", "dated", "If-Modified-Since: Sat, 05 Nov 1994 08:49:37 GMT\r\n", headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL_STR(body, "version 2");
+	free(body);
+
+	// As they are
+	body=do_request("GET", "missing", NULL, headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL_STR(body, "version 2");
+	free(body);
+	FAIL_IF_NOT_EQUAL(strstr(headers, "ETag"), NULL);
+	body=do_request("GET", "big", NULL, headers, sizeof(headers));
+	FAIL_IF_EQUAL(strstr(body, "version 2"), NULL);
+	free(body);
+	FAIL_IF_NOT_EQUAL(strstr(headers, "ETag"), NULL);
+	body=do_request("POST", "a", "Content-Length: 0\r\n", headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL(strstr(headers, "ETag"), NULL);
+	free(body);
+
+	onion_free(server);
+	END_LOCAL();
+}
+
+/// The files have Last-Modified, and If-Modified-Since is used when there is no If-None-Match.
+void t02_files(){
+	INIT_LOCAL();
+	init();
+	FILE *f=fopen(TMPFILE, "w");
+	fprintf(f, "file contents");
+	fclose(f);
+	struct stat st;
+	stat(TMPFILE, &st);
+
+	char headers[1024], last_modified[64], etag[64], extra[256];
+	char *body=do_request("GET", "file", NULL, headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL_STR(body, "file contents");
+	free(body);
+	get_header(headers, "Last-Modified", last_modified, sizeof(last_modified));
+	get_header(headers, "Etag", etag, sizeof(etag));
+	FAIL_IF_NOT_EQUAL_INT((int)onion_shortcut_date_time_t(last_modified), (int)st.st_mtime);
+
+	snprintf(extra, sizeof(extra), "If-Modified-Since: %s\r\n", last_modified);
+	body=do_request("GET", "file", extra, headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL_STR(body, "");
+	free(body);
+	FAIL_IF_EQUAL(strstr(headers, "HTTP/1.1 304"), NULL);
+
+	char older[32];
+	onion_shortcut_date_string(st.st_mtime-10, older);
+	snprintf(extra, sizeof(extra), "If-Modified-Since: %s\r\n", older);
+	body=do_request("GET", "file", extra, headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL_STR(body, "file contents");
+	free(body);
+
+	snprintf(extra, sizeof(extra), "If-None-Match: \"x\"\r\nIf-Modified-Since: %s\r\n", last_modified); // The ETag decides
+	body=do_request("GET", "file", extra, headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL_STR(body, "file contents");
+	free(body);
+
+	snprintf(extra, sizeof(extra), "If-None-Match: W/\"%s\"\r\n", etag);
+	body=do_request("GET", "file", extra, headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL_STR(body, "");
+	free(body);
+
+	snprintf(extra, sizeof(extra), "Range: bytes=0-3\r\nIf-Range: %s\r\n", last_modified);
+	body=do_request("GET", "file", extra, headers, sizeof(headers));
+	FAIL_IF_NOT_EQUAL_STR(body, "file");
+	free(body);
+
+	unlink(TMPFILE);
+	onion_free(server);
+	END_LOCAL();
+}
+
+/// The three date formats of HTTP
+void t03_dates(){
+	INIT_LOCAL();
+	FAIL_IF_NOT_EQUAL_INT((int)onion_shortcut_date_time_t("Sun, 06 Nov 1994 08:49:37 GMT"), 784111777);
+	FAIL_IF_NOT_EQUAL_INT((int)onion_shortcut_date_time_t("Sunday, 06-Nov-94 08:49:37 GMT"), 784111777);
+	FAIL_IF_NOT_EQUAL_INT((int)onion_shortcut_date_time_t("Sun Nov  6 08:49:37 1994"), 784111777);
+	FAIL_IF_NOT_EQUAL_INT((int)onion_shortcut_date_time_t("Tue, 29 Feb 2000 23:59:59 GMT"), 951868799);
+	FAIL_IF_NOT_EQUAL_INT((int)onion_shortcut_date_time_t("yesterday"), -1);
+	FAIL_IF_NOT_EQUAL_INT((int)onion_shortcut_date_time_t("Sun, 06 Nox 1994 08:49:37 GMT"), -1);
+	char tmp[32];
+	onion_shortcut_date_string(784111777, tmp);
+	FAIL_IF_NOT_EQUAL_STR(tmp, "Sun, 06 Nov 1994 08:49:37 GMT");
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	onion_log_flags=OF_INIT|OF_NOINFO;
+	t01_dynamic();
+	t02_files();
+	t03_dates();
+
+	END();
+}
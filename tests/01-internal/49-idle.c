@@ -0,0 +1,149 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/response.h>
+
+#include "../ctest.h"
+
+#define NCONNECTIONS 200
+
+onion *o;
+
+int connect_to(const char *addr, const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+	if (getaddrinfo(addr,port,&hints,&server)<0){
+		ONION_ERROR("Error getting server info");
+		return -1;
+	}
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+		ONION_ERROR("Error connecting to server %s:%s",addr,port);
+	}
+	freeaddrinfo(server);
+
+	return fd;
+}
+
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	onion_response_write0(res, "Hello ");
+	onion_response_write0(res, onion_request_get_path(req));
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+/// Bytes allocated now, by the whole process.
+static size_t allocated(){
+	return mallinfo2().uordblks;
+}
+
+/// Asks for a path on a keep alive connection, and checks the answer.
+static int get(int fd, int n){
+	char buffer[1024];
+	snprintf(buffer, sizeof(buffer), "GET /path/to/%d HTTP/1.1\r\nHost: localhost\r\nUser-Agent: onion-test\r\n"
+	         "Accept: text/html,application/xhtml+xml\r\nAccept-Language: en\r\nCookie: a=b; c=d\r\n\r\n", n);
+	size_t l=strlen(buffer);
+	if (write(fd, buffer, l)!=l)
+		return -1;
+	char expected[64];
+	snprintf(expected, sizeof(expected), "Hello path/to/%d", n);
+	ssize_t r, pos=0;
+	buffer[0]=0;
+	while (!strstr(buffer, expected) && (r=read(fd, buffer+pos, sizeof(buffer)-pos-1)) > 0){
+		pos+=r;
+		buffer[pos]=0;
+	}
+	return strstr(buffer, expected) ? 0 : -1;
+}
+
+/// Idle keep alive connections free their request buffers, and still answer the next request.
+void t01_idle_compact(){
+	INIT_LOCAL();
+
+	int fds[NCONNECTIONS];
+	int i, errors=0;
+	size_t start=allocated();
+	for (i=0;i<NCONNECTIONS;i++){
+		fds[i]=connect_to("localhost", "8137");
+		FAIL_IF(fds[i]<0);
+		if (get(fds[i], i)<0)
+			errors++;
+	}
+	FAIL_IF_NOT_EQUAL_INT(errors, 0);
+	size_t busy=allocated();
+	usleep(1000000);
+	size_t idle=allocated();
+
+	long busy_per=((long)busy-(long)start)/NCONNECTIONS;
+	long idle_per=((long)idle-(long)start)/NCONNECTIONS;
+	ONION_INFO("Bytes per keep alive connection: %ld after a request, %ld when idle", busy_per, idle_per);
+	FAIL_IF_NOT(idle_per < busy_per/2);
+
+	for (i=0;i<NCONNECTIONS;i++){
+		if (get(fds[i], NCONNECTIONS+i)<0)
+			errors++;
+		close(fds[i]);
+	}
+	FAIL_IF_NOT_EQUAL_INT(errors, 0);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	o=onion_new(O_POLL);
+	onion_set_port(o, "8137");
+	onion_set_timeout(o, 10000);
+	onion_set_idle_compact(o, 300);
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	sleep(1);
+
+	t01_idle_compact();
+
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+
+	END();
+}
@@ -0,0 +1,270 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/response.h>
+#include <onion/request.h>
+
+#include "../ctest.h"
+
+onion *o;
+
+int connect_to(const char *addr, const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+	if (getaddrinfo(addr,port,&hints,&server)<0){
+		ONION_ERROR("Error getting server info");
+		return -1;
+	}
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+		ONION_ERROR("Error connecting to server %s:%s",addr,port);
+	}
+	freeaddrinfo(server);
+
+	return fd;
+}
+
+onion_request *suspended_req=NULL;
+onion_response *suspended_res=NULL;
+
+/// /suspend keeps the request, and is never answered in time. Else answers now.
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	if (strcmp(onion_request_get_path(req), "suspend")==0){
+		suspended_res=res;
+		__sync_synchronize();
+		suspended_req=req;
+		return OCS_SUSPENDED;
+	}
+	onion_response_write0(res, "Hello");
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+static long now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static int send_str(int fd, const char *str){
+	return send(fd, str, strlen(str), MSG_NOSIGNAL)==strlen(str) ? 0 : -1;
+}
+
+/// Whether the server closed the connection, reading what comes, for up to ms.
+static int closed_in(int fd, int ms, char *buffer, size_t size){
+	long end=now_ms()+ms;
+	size_t pos=0;
+	buffer[0]=0;
+	while (now_ms()<end){
+		struct pollfd pfd={ fd, POLLIN, 0 };
+		if (poll(&pfd, 1, end-now_ms())<=0)
+			return 0;
+		ssize_t r=read(fd, buffer+pos, size-pos-1);
+		if (r<=0)
+			return 1;
+		pos+=r;
+		buffer[pos]=0;
+	}
+	return 0;
+}
+
+/// A client that sends the headers a byte at a time is closed at the header timeout, not kept alive by them.
+void t01_slow_headers(){
+	INIT_LOCAL();
+
+	int fd=connect_to("localhost", "8138");
+	FAIL_IF(fd<0);
+	const char *get="GET / HTTP/1.1\r\nHost: localhost\r\nX-Some-Long-Header: aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\r\n\r\n";
+	long start=now_ms();
+	int i, sent=0;
+	for (i=0;get[i];i++){
+		char c[2]={ get[i], 0 };
+		if (send_str(fd, c)<0)
+			break;
+		sent++;
+		usleep(20000);
+		char buffer[256];
+		if (closed_in(fd, 0, buffer, sizeof(buffer)))
+			break;
+	}
+	long elapsed=now_ms()-start;
+	ONION_INFO("Closed after %d bytes of headers, in %ld ms", sent, elapsed);
+	FAIL_IF(get[i]==0);
+	FAIL_IF(elapsed<450);
+	FAIL_IF(elapsed>1500);
+	close(fd);
+
+	END_LOCAL();
+}
+
+/// Idle keep alive connections are closed at the keep alive timeout.
+void t02_keep_alive(){
+	INIT_LOCAL();
+
+	int fd=connect_to("localhost", "8138");
+	FAIL_IF(fd<0);
+	FAIL_IF(send_str(fd, "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n")<0);
+	char buffer[1024];
+	long start=now_ms();
+	FAIL_IF_NOT(closed_in(fd, 2000, buffer, sizeof(buffer)));
+	long elapsed=now_ms()-start;
+	ONION_INFO("Keep alive closed after %ld ms", elapsed);
+	FAIL_IF_NOT_STRSTR(buffer, "Hello");
+	FAIL_IF(elapsed<250);
+	FAIL_IF(elapsed>1000);
+	close(fd);
+
+	END_LOCAL();
+}
+
+/// A body under the minimum rate is closed, while a fast one is read.
+void t03_body_rate(){
+	INIT_LOCAL();
+
+	int fd=connect_to("localhost", "8138");
+	FAIL_IF(fd<0);
+	FAIL_IF(send_str(fd, "POST / HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/octet-stream\r\nContent-Length: 10000\r\n\r\n")<0);
+	long start=now_ms();
+	int i;
+	char buffer[1024];
+	for (i=0;i<50;i++){
+		if (send_str(fd, "0123456789")<0 || closed_in(fd, 100, buffer, sizeof(buffer)))
+			break;
+	}
+	long elapsed=now_ms()-start;
+	ONION_INFO("Slow body closed after %ld ms", elapsed);
+	FAIL_IF(i==50);
+	FAIL_IF(elapsed<250);
+	close(fd);
+
+	fd=connect_to("localhost", "8138");
+	FAIL_IF(fd<0);
+	FAIL_IF(send_str(fd, "POST / HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/octet-stream\r\nContent-Length: 10000\r\n\r\n")<0);
+	char body[10000];
+	memset(body, 'a', sizeof(body));
+	FAIL_IF(send(fd, body, sizeof(body), MSG_NOSIGNAL)!=sizeof(body));
+	closed_in(fd, 200, buffer, sizeof(buffer));
+	FAIL_IF_NOT_STRSTR(buffer, "Hello");
+	close(fd);
+
+	END_LOCAL();
+}
+
+/// After max_requests, the connection is closed.
+void t04_max_requests(){
+	INIT_LOCAL();
+
+	int fd=connect_to("localhost", "8138");
+	FAIL_IF(fd<0);
+	char buffer[1024];
+	FAIL_IF(send_str(fd, "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n")<0);
+	FAIL_IF(closed_in(fd, 100, buffer, sizeof(buffer)));
+	FAIL_IF_NOT_STRSTR(buffer, "Hello");
+	FAIL_IF(send_str(fd, "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n")<0);
+	FAIL_IF_NOT(closed_in(fd, 100, buffer, sizeof(buffer)));
+	FAIL_IF_NOT_STRSTR(buffer, "Connection: Close");
+	FAIL_IF_NOT_STRSTR(buffer, "Hello");
+	close(fd);
+
+	END_LOCAL();
+}
+
+/// A suspended request not resumed in time gets its connection shut down, and it can still be resumed later.
+void t05_handler(){
+	INIT_LOCAL();
+
+	int fd=connect_to("localhost", "8138");
+	FAIL_IF(fd<0);
+	char buffer[1024];
+	FAIL_IF(send_str(fd, "GET /suspend HTTP/1.1\r\nHost: localhost\r\n\r\n")<0);
+	long start=now_ms();
+	FAIL_IF_NOT(closed_in(fd, 2000, buffer, sizeof(buffer)));
+	long elapsed=now_ms()-start;
+	ONION_INFO("Suspended request closed after %ld ms", elapsed);
+	FAIL_IF(elapsed<150);
+	FAIL_IF(elapsed>1000);
+	FAIL_IF_NOT_EQUAL_STR(buffer, "");
+	close(fd);
+
+	FAIL_IF(suspended_req==NULL);
+	if (suspended_req){
+		onion_response_write0(suspended_res, "Late");
+		onion_request_resume(suspended_req);
+	}
+	usleep(100000);
+
+	fd=connect_to("localhost", "8138");
+	FAIL_IF(fd<0);
+	FAIL_IF(send_str(fd, "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n")<0);
+	closed_in(fd, 100, buffer, sizeof(buffer));
+	FAIL_IF_NOT_STRSTR(buffer, "Hello");
+	close(fd);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	signal(SIGPIPE, SIG_IGN); // The late response is written to the shut down connection.
+
+	o=onion_new(O_POLL);
+	onion_set_port(o, "8138");
+	onion_timeouts timeouts={ .header=500, .body=300, .body_min_rate=1000, .handler=200, .keep_alive=400, .max_requests=2 };
+	onion_set_timeouts(o, &timeouts);
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	sleep(1);
+
+	t01_slow_headers();
+	t02_keep_alive();
+	t03_body_rate();
+	t04_max_requests();
+	t05_handler();
+
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+
+	END();
+}
@@ -0,0 +1,174 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/response.h>
+#include <onion/request.h>
+
+#include "../ctest.h"
+
+#define NSLOW 4
+
+onion *o;
+
+int connect_to(const char *addr, const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+	if (getaddrinfo(addr,port,&hints,&server)<0){
+		ONION_ERROR("Error getting server info");
+		return -1;
+	}
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+		ONION_ERROR("Error connecting to server %s:%s",addr,port);
+	}
+	freeaddrinfo(server);
+
+	return fd;
+}
+
+pthread_mutex_t threads_mutex=PTHREAD_MUTEX_INITIALIZER;
+pthread_t threads[NSLOW+1];
+int nthreads=0;
+
+/// /slow takes a while, and notes the thread that ran it.
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	if (strcmp(onion_request_get_path(req), "slow")==0){
+		usleep(300000);
+		pthread_mutex_lock(&threads_mutex);
+		int i;
+		for (i=0;i<nthreads && !pthread_equal(threads[i], pthread_self());i++);
+		if (i==nthreads && nthreads<NSLOW+1)
+			threads[nthreads++]=pthread_self();
+		pthread_mutex_unlock(&threads_mutex);
+	}
+	onion_response_set_length(res, 5);
+	onion_response_write0(res, "Hello");
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+static long now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/// Sends the request.
+static int request(int fd, const char *path){
+	char get[256];
+	snprintf(get, sizeof(get), "GET /%s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+	return write(fd, get, strlen(get)) == strlen(get);
+}
+
+/// Reads one response, that ends in Hello
+static int read_hello(int fd){
+	char buffer[1024];
+	memset(buffer, 0, sizeof(buffer));
+	ssize_t r, pos=0;
+	while ( (r=read(fd, buffer+pos, sizeof(buffer)-pos-1)) > 0 ){
+		pos+=r;
+		if (strstr(buffer, "Hello"))
+			return 1;
+	}
+	return 0;
+}
+
+/// The requests that arrive while a thread is busy are stolen by the idle ones, and the connections keep alive.
+void t01_steal(){
+	INIT_LOCAL();
+
+	int busyfd=connect_to("localhost", "8139");
+	FAIL_IF(busyfd<0);
+	int fds[NSLOW];
+	int i;
+	for (i=0;i<NSLOW;i++){ // Keep alive connections, all at the same thread.
+		fds[i]=connect_to("localhost", "8139");
+		FAIL_IF(fds[i]<0);
+		FAIL_IF_NOT(request(fds[i], ""));
+		FAIL_IF_NOT(read_hello(fds[i]));
+	}
+
+	FAIL_IF_NOT(request(busyfd, "slow"));
+	usleep(50000);
+	long start=now_ms();
+	for (i=0;i<NSLOW;i++)
+		FAIL_IF_NOT(request(fds[i], "slow"));
+	FAIL_IF_NOT(read_hello(busyfd));
+	for (i=0;i<NSLOW;i++)
+		FAIL_IF_NOT(read_hello(fds[i]));
+	long elapsed=now_ms()-start;
+	ONION_INFO("%d slow requests served in %ld ms, by %d threads", NSLOW, elapsed, nthreads);
+	FAIL_IF(elapsed>(NSLOW-1)*300);
+	FAIL_IF(nthreads<2);
+
+	for (i=0;i<NSLOW;i++){ // Back at their poller
+		FAIL_IF_NOT(request(fds[i], ""));
+		FAIL_IF_NOT(read_hello(fds[i]));
+		close(fds[i]);
+	}
+	close(busyfd);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	o=onion_new(O_POOL|O_REUSEPORT);
+	onion_set_max_threads(o, 4);
+	int cpus[]={ 0 };
+	onion_set_threads_affinity(o, cpus, 1, 1); // So all the connections go to the first thread, if the kernel can.
+	onion_set_work_stealing(o, 16);
+	onion_set_port(o, "8139");
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	sleep(1);
+
+	t01_steal();
+
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+
+	END();
+}
@@ -0,0 +1,183 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <onion/onion.h>
+#include <onion/http.h>
+#include <onion/log.h>
+#include <onion/request.h>
+#include <onion/response.h>
+
+#include "../ctest.h"
+
+#define SOCKET_PATH "/tmp/onion-test-52.sock"
+#define CLIENT_PATH "/tmp/onion-test-52-client.sock"
+#define ABSTRACT_NAME "@onion-test-52"
+
+onion *o;
+
+/// Connects to the unix socket at that path, or '@' abstract name. If client is set, binds to it first.
+int connect_unix(const char *path, const char *client){
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	strcpy(addr.sun_path, path);
+	socklen_t len=offsetof(struct sockaddr_un, sun_path)+strlen(path)+1;
+	if (path[0]=='@'){
+		addr.sun_path[0]='\0';
+		len--;
+	}
+	int fd=socket(AF_UNIX, SOCK_STREAM, 0);
+	if (client){
+		struct sockaddr_un caddr;
+		memset(&caddr, 0, sizeof(caddr));
+		caddr.sun_family=AF_UNIX;
+		strcpy(caddr.sun_path, client);
+		unlink(client);
+		if (bind(fd, (struct sockaddr*)&caddr, sizeof(caddr))<0)
+			ONION_ERROR("Could not bind the client to %s", client);
+	}
+	if (connect(fd, (struct sockaddr*)&addr, len)<0){
+		ONION_ERROR("Error connecting to %s", path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/// Answers the client description.
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	const char *client=onion_request_get_client_description(req);
+	onion_response_write0(res, client ? client : "(null)");
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+/// Asks for / at that unix socket, and returns the body of the answer.
+const char *get(const char *path, const char *client, char *buffer, size_t size){
+	memset(buffer, 0, size);
+	int fd=connect_unix(path, client);
+	if (fd<0)
+		return "";
+	const char *req="GET / HTTP/1.0\r\n\r\n";
+	ssize_t r=-1, pos=0;
+	if (write(fd, req, strlen(req))==strlen(req)){
+		while ((r=read(fd, buffer+pos, size-pos-1))>0)
+			pos+=r;
+	}
+	close(fd);
+	char *body=strstr(buffer, "\r\n\r\n");
+	return body ? body+4 : "";
+}
+
+/// The socket file gets the permissions, and replaced the stale one.
+void t01_socket_file(){
+	INIT_LOCAL();
+	char buffer[1024];
+
+	struct stat st;
+	FAIL_IF(stat(SOCKET_PATH, &st)<0);
+	FAIL_IF_NOT(S_ISSOCK(st.st_mode));
+	FAIL_IF_NOT_EQUAL_INT(st.st_mode&0777, 0600);
+	FAIL_IF_NOT_EQUAL_STR(get(SOCKET_PATH, NULL, buffer, sizeof(buffer)), "unix");
+
+	END_LOCAL();
+}
+
+/// The abstract namespace has no file.
+void t02_abstract(){
+	INIT_LOCAL();
+	char buffer[1024];
+
+	FAIL_IF_NOT_EQUAL_STR(get(ABSTRACT_NAME, NULL, buffer, sizeof(buffer)), "unix");
+
+	END_LOCAL();
+}
+
+/// A client with a bound socket is described by its path.
+void t03_client_path(){
+	INIT_LOCAL();
+	char buffer[1024];
+
+	FAIL_IF_NOT_EQUAL_STR(get(SOCKET_PATH, CLIENT_PATH, buffer, sizeof(buffer)), "unix:" CLIENT_PATH);
+	unlink(CLIENT_PATH);
+
+	END_LOCAL();
+}
+
+/// When it stops listening, the socket file is removed.
+void t04_removed(){
+	INIT_LOCAL();
+
+	struct stat st;
+	FAIL_IF_NOT(stat(SOCKET_PATH, &st)<0);
+
+	END_LOCAL();
+}
+
+/// A stale socket file, as left by a killed process.
+void make_stale_socket(){
+	unlink(SOCKET_PATH);
+	int fd=socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	strcpy(addr.sun_path, SOCKET_PATH);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))<0)
+		ONION_ERROR("Could not create the stale socket");
+	close(fd);
+}
+
+int main(int argc, char **argv){
+	START();
+	make_stale_socket();
+
+	o=onion_new(O_POLL);
+	onion_listen_point *lp=onion_unix_new(SOCKET_PATH);
+	onion_unix_set_mode(lp, 0600);
+	onion_add_listen_point(o, NULL, NULL, lp);
+	onion_add_listen_point(o, NULL, NULL, onion_unix_new(ABSTRACT_NAME));
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	sleep(1);
+
+	t01_socket_file();
+	t02_abstract();
+	t03_client_path();
+
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+	t04_removed();
+
+	END();
+}
@@ -0,0 +1,245 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/response.h>
+#include <onion/request.h>
+#include <onion/sse.h>
+
+#include "../ctest.h"
+
+#define NCLIENTS 50
+
+onion *o;
+onion_sse_group *group;
+onion_sse *stream=NULL;
+
+int connect_to(const char *addr, const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+	if (getaddrinfo(addr,port,&hints,&server)<0){
+		ONION_ERROR("Error getting server info");
+		return -1;
+	}
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+		ONION_ERROR("Error connecting to server %s:%s",addr,port);
+	}
+	freeaddrinfo(server);
+
+	return fd;
+}
+
+/// /stream is kept for the test to send, /group subscribes to the group, and the rest are answered now.
+onion_connection_status handler(void *_, onion_request *req, onion_response *res){
+	const char *path=onion_request_get_path(req);
+	if (strcmp(path, "stream")==0){
+		onion_sse *sse=onion_sse_new(req, res);
+		if (!sse)
+			return OCS_INTERNAL_ERROR;
+		onion_sse_set_keepalive(sse, 200);
+		onion_sse_send(sse, "1", NULL, "first", 5);
+		onion_sse_ref(sse);
+		__sync_synchronize();
+		stream=sse;
+		return OCS_SUSPENDED;
+	}
+	if (strcmp(path, "group")==0){
+		onion_sse *sse=onion_sse_new(req, res);
+		if (!sse)
+			return OCS_INTERNAL_ERROR;
+		onion_sse_set_keepalive(sse, 0);
+		onion_sse_group_subscribe(group, sse);
+		return OCS_SUSPENDED;
+	}
+	onion_response_write0(res, "Hello");
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+static long now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static int send_str(int fd, const char *str){
+	return send(fd, str, strlen(str), MSG_NOSIGNAL)==strlen(str) ? 0 : -1;
+}
+
+/// Reads until expected is at buffer, for up to ms. Returns 1 if it is.
+static int read_until(int fd, const char *expected, int ms, char *buffer, size_t size){
+	long end=now_ms()+ms;
+	size_t pos=strlen(buffer);
+	while (!strstr(buffer, expected) && now_ms()<end && pos<size-1){
+		struct pollfd pfd={ fd, POLLIN, 0 };
+		if (poll(&pfd, 1, end-now_ms())<=0)
+			break;
+		ssize_t r=read(fd, buffer+pos, size-pos-1);
+		if (r<=0)
+			break;
+		pos+=r;
+		buffer[pos]=0;
+	}
+	return strstr(buffer, expected)!=NULL;
+}
+
+/// Events sent from the handler and from another thread, the keepalive comments, and the end of the stream.
+void t01_stream(){
+	INIT_LOCAL();
+
+	int fd=connect_to("localhost", "8140");
+	FAIL_IF(fd<0);
+	FAIL_IF(send_str(fd, "GET /stream HTTP/1.1\r\nHost: localhost\r\n\r\n")<0);
+	char buffer[4096]={0};
+	FAIL_IF_NOT(read_until(fd, "first\n\n", 1000, buffer, sizeof(buffer)));
+	FAIL_IF_NOT_STRSTR(buffer, "Content-Type: text/event-stream");
+	FAIL_IF_NOT_STRSTR(buffer, "Transfer-Encoding: chunked");
+	FAIL_IF_NOT_STRSTR(buffer, "id: 1\ndata: first\n\n");
+	FAIL_IF(stream==NULL);
+
+	buffer[0]=0;
+	FAIL_IF(onion_sse_send(stream, "2", "update", "a\r\nb\rc", 6)<0);
+	FAIL_IF_NOT(read_until(fd, "c\n\n", 1000, buffer, sizeof(buffer)));
+	FAIL_IF_NOT_STRSTR(buffer, "id: 2\nevent: update\ndata: a\ndata: b\ndata: c\n\n");
+	FAIL_IF(onion_sse_send(stream, "3\n", NULL, "x", 1)==0);
+
+	buffer[0]=0;
+	FAIL_IF_NOT(read_until(fd, ":\n", 1000, buffer, sizeof(buffer)));
+	ONION_INFO("Keepalive comment got");
+
+	buffer[0]=0;
+	onion_sse_close(stream);
+	FAIL_IF_NOT(read_until(fd, "0\r\n\r\n", 1000, buffer, sizeof(buffer)));
+	FAIL_IF(onion_sse_send(stream, NULL, NULL, "late", 4)==0);
+	onion_sse_free(stream);
+	stream=NULL;
+
+	buffer[0]=0;
+	FAIL_IF(send_str(fd, "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n")<0);
+	FAIL_IF_NOT(read_until(fd, "Hello", 1000, buffer, sizeof(buffer)));
+	close(fd);
+
+	END_LOCAL();
+}
+
+/// Events published once get to all the subscribers, and the gone ones leave the group.
+void t02_group(){
+	INIT_LOCAL();
+
+	int fds[NCLIENTS];
+	int i, ok=0;
+	char buffer[4096];
+	for (i=0;i<NCLIENTS;i++){
+		fds[i]=connect_to("localhost", "8140");
+		FAIL_IF(fds[i]<0);
+		FAIL_IF(send_str(fds[i], "GET /group HTTP/1.1\r\nHost: localhost\r\n\r\n")<0);
+	}
+	long end=now_ms()+2000;
+	while (onion_sse_group_count(group)<NCLIENTS && now_ms()<end)
+		usleep(10000);
+	FAIL_IF_NOT_EQUAL_INT(onion_sse_group_count(group), NCLIENTS);
+
+	FAIL_IF_NOT_EQUAL_INT(onion_sse_group_publish(group, "1", NULL, "one", 3), NCLIENTS);
+	FAIL_IF_NOT_EQUAL_INT(onion_sse_group_publish(group, "2", NULL, "two", 3), NCLIENTS);
+	for (i=0;i<NCLIENTS;i++){
+		buffer[0]=0;
+		if (read_until(fds[i], "data: two\n\n", 1000, buffer, sizeof(buffer)) && strstr(buffer, "data: one\n\n"))
+			ok++;
+	}
+	FAIL_IF_NOT_EQUAL_INT(ok, NCLIENTS);
+
+	for (i=0;i<NCLIENTS;i++)
+		close(fds[i]);
+	end=now_ms()+2000;
+	while (onion_sse_group_count(group)>0 && now_ms()<end){ // Each write finds they are gone
+		onion_sse_group_publish(group, NULL, NULL, "ping", 4);
+		usleep(50000);
+	}
+	FAIL_IF_NOT_EQUAL_INT(onion_sse_group_count(group), 0);
+
+	END_LOCAL();
+}
+
+/// A client that reconnects with Last-Event-ID gets the events it missed, from the history.
+void t03_last_event_id(){
+	INIT_LOCAL();
+
+	onion_sse_group_publish(group, "3", NULL, "three", 5);
+	int fd=connect_to("localhost", "8140");
+	FAIL_IF(fd<0);
+	FAIL_IF(send_str(fd, "GET /group HTTP/1.1\r\nHost: localhost\r\nLast-Event-ID: 1\r\n\r\n")<0);
+	char buffer[4096]={0};
+	FAIL_IF_NOT(read_until(fd, "data: three\n\n", 1000, buffer, sizeof(buffer)));
+	FAIL_IF_NOT_STRSTR(buffer, "id: 2\ndata: two\n\n");
+	FAIL_IF(strstr(buffer, "data: one"));
+	FAIL_IF(strstr(buffer, "data: ping"));
+	close(fd);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	signal(SIGPIPE, SIG_IGN);
+
+	group=onion_sse_group_new(OSSE_GROUP_DISCONNECT, 64);
+	onion_sse_group_set_history(group, 8);
+
+	o=onion_new(O_POLL);
+	onion_set_port(o, "8140");
+	onion_set_root_handler(o, onion_handler_new(handler, NULL, NULL));
+
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	sleep(1);
+
+	t01_stream();
+	t02_group();
+	t03_last_event_id();
+
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+	onion_sse_group_free(group);
+
+	END();
+}
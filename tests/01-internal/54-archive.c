@@ -0,0 +1,220 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/handlers/archive.h>
+
+#include "../ctest.h"
+
+#define BIG_SIZE (256*1024)
+
+onion *o;
+onion_handler *archive;
+char tmpdir[]="/tmp/onion-archive-XXXXXX";
+char archivename[1024];
+
+int connect_to(const char *addr, const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+	if (getaddrinfo(addr,port,&hints,&server)<0){
+		ONION_ERROR("Error getting server info");
+		return -1;
+	}
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+		ONION_ERROR("Error connecting to server %s:%s",addr,port);
+	}
+	freeaddrinfo(server);
+
+	return fd;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+/// Asks for the path with the extra headers, and reads all the answer. Returns its length, and the body at body.
+static ssize_t get(const char *path, const char *headers, char *buffer, size_t size, char **body){
+	int fd=connect_to("localhost", "8142");
+	if (fd<0)
+		return -1;
+	char request[1024];
+	snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n%s\r\n", path, headers);
+	if (write(fd, request, strlen(request))!=strlen(request)){
+		close(fd);
+		return -1;
+	}
+	ssize_t r, pos=0;
+	while ( pos<size-1 && (r=read(fd, buffer+pos, size-pos-1)) > 0 )
+		pos+=r;
+	buffer[pos]=0;
+	close(fd);
+	char *end=strstr(buffer, "\r\n\r\n");
+	*body=end ? end+4 : buffer+pos;
+	return pos;
+}
+
+static void write_file(const char *name, const char *data, size_t length){
+	char filename[1024];
+	snprintf(filename, sizeof(filename), "%s/%s", tmpdir, name);
+	FILE *fd=fopen(filename, "w");
+	fwrite(data, 1, length, fd);
+	fclose(fd);
+}
+
+/// Packs the directory into the archive, with opack.
+static int pack(){
+	char command[2048];
+	snprintf(command, sizeof(command), "%s -r %s %s/www", OPACK, archivename, tmpdir);
+	return system(command);
+}
+
+static char *big;
+
+void t01_serve(){
+	INIT_LOCAL();
+	
+	char buffer[BIG_SIZE+4096], *body;
+	FAIL_IF(get("index.html", "", buffer, sizeof(buffer), &body)<0);
+	FAIL_IF_NOT_STRSTR(buffer, "HTTP/1.1 200 OK");
+	FAIL_IF_NOT_STRSTR(buffer, "Content-Type: text/html");
+	FAIL_IF_NOT_STRSTR(buffer, "Etag: ");
+	FAIL_IF_NOT_EQUAL_STR(body, "<h1>Version 1</h1>");
+	
+	char etag[64];
+	sscanf(strstr(buffer, "Etag: "), "Etag: %63s", etag);
+	char headers[128];
+	snprintf(headers, sizeof(headers), "If-None-Match: %s\r\n", etag);
+	FAIL_IF(get("index.html", headers, buffer, sizeof(buffer), &body)<0);
+	FAIL_IF_NOT_STRSTR(buffer, "HTTP/1.1 304");
+	
+	FAIL_IF(get("js/app.js", "Accept-Encoding: gzip\r\n", buffer, sizeof(buffer), &body)<0);
+	FAIL_IF_NOT_STRSTR(buffer, "HTTP/1.1 200 OK");
+	FAIL_IF_NOT_STRSTR(buffer, "Content-Encoding: gzip");
+	FAIL_IF_NOT_STRSTR(buffer, "Vary: Accept-Encoding");
+	
+	FAIL_IF(get("js/app.js", "", buffer, sizeof(buffer), &body)<0);
+	FAIL_IF(strstr(buffer, "Content-Encoding"));
+	FAIL_IF_NOT_STRSTR(body, "function app(){");
+	
+	ssize_t l=get("big.bin", "", buffer, sizeof(buffer), &body);
+	FAIL_IF_NOT_STRSTR(buffer, "HTTP/1.1 200 OK");
+	FAIL_IF_NOT_EQUAL_INT(l-(body-buffer), BIG_SIZE);
+	FAIL_IF(memcmp(body, big, BIG_SIZE)!=0);
+	
+	FAIL_IF(get("missing.html", "", buffer, sizeof(buffer), &body)<0);
+	FAIL_IF_NOT_STRSTR(buffer, "HTTP/1.1 404");
+	
+	END_LOCAL();
+}
+
+/// A new archive replaces the old one while serving; a bad one is refused and the old one stays.
+void t02_reload(){
+	INIT_LOCAL();
+	
+	char buffer[4096], *body, etag[64];
+	FAIL_IF(get("index.html", "", buffer, sizeof(buffer), &body)<0);
+	sscanf(strstr(buffer, "Etag: "), "Etag: %63s", etag);
+	
+	write_file("www/index.html", "<h1>Version 2</h1>", 18);
+	FAIL_IF_NOT_EQUAL_INT(pack(), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_handler_archive_reload(archive, archivename), 0);
+	
+	FAIL_IF(get("index.html", "", buffer, sizeof(buffer), &body)<0);
+	FAIL_IF_NOT_EQUAL_STR(body, "<h1>Version 2</h1>");
+	FAIL_IF(strstr(buffer, etag));
+	
+	char bad[1024];
+	snprintf(bad, sizeof(bad), "%s/bad.oar", tmpdir);
+	write_file("bad.oar", "ONIONAR1 but not an archive", 27);
+	FAIL_IF_EQUAL_INT(onion_handler_archive_reload(archive, bad), 0);
+	FAIL_IF(get("index.html", "", buffer, sizeof(buffer), &body)<0);
+	FAIL_IF_NOT_EQUAL_STR(body, "<h1>Version 2</h1>");
+	
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	signal(SIGPIPE, SIG_IGN);
+	
+	FAIL_IF(mkdtemp(tmpdir)==NULL);
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/www", tmpdir);
+	mkdir(path, 0700);
+	snprintf(path, sizeof(path), "%s/www/js", tmpdir);
+	mkdir(path, 0700);
+	write_file("www/index.html", "<h1>Version 1</h1>", 18);
+	char js[4096];
+	int i, l=0;
+	for (i=0;i<100;i++)
+		l+=snprintf(js+l, sizeof(js)-l, "function app(){ return %d; }\n", i);
+	write_file("www/js/app.js", js, l);
+	big=malloc(BIG_SIZE);
+	srand(1);
+	for (i=0;i<BIG_SIZE;i++)
+		big[i]=rand();
+	write_file("www/big.bin", big, BIG_SIZE);
+	snprintf(archivename, sizeof(archivename), "%s/assets.oar", tmpdir);
+	FAIL_IF_NOT_EQUAL_INT(pack(), 0);
+	
+	archive=onion_handler_archive(archivename);
+	FAIL_IF(archive==NULL);
+	
+	o=onion_new(O_POLL);
+	onion_set_port(o, "8142");
+	onion_set_root_handler(o, archive);
+	
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	sleep(1);
+	
+	t01_serve();
+	t02_reload();
+	
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+	free(big);
+	
+	char command[1100];
+	snprintf(command, sizeof(command), "rm -rf %s", tmpdir);
+	FAIL_IF_NOT_EQUAL_INT(system(command), 0);
+	
+	END();
+}
@@ -0,0 +1,169 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/url.h>
+#include <onion/response.h>
+
+#include "../ctest.h"
+
+#define NEXPORTS 4
+
+onion *o;
+int running_exports=0, max_running_exports=0;
+
+int connect_to(const char *addr, const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+	if (getaddrinfo(addr,port,&hints,&server)<0){
+		ONION_ERROR("Error getting server info");
+		return -1;
+	}
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+		ONION_ERROR("Error connecting to server %s:%s",addr,port);
+	}
+	freeaddrinfo(server);
+
+	return fd;
+}
+
+/// A bulk request, that keeps its worker busy.
+onion_connection_status export_handler(void *_, onion_request *req, onion_response *res){
+	int running=__sync_add_and_fetch(&running_exports, 1);
+	if (running>max_running_exports)
+		max_running_exports=running;
+	usleep(300000);
+	__sync_sub_and_fetch(&running_exports, 1);
+	onion_response_write0(res, "Exported");
+	return OCS_PROCESSED;
+}
+
+onion_connection_status healthz_handler(void *_, onion_request *req, onion_response *res){
+	onion_response_write0(res, "OK");
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+static long now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/// Sends the request for the path, to be answered later.
+static int send_get(const char *path){
+	int fd=connect_to("localhost", "8143");
+	if (fd<0)
+		return -1;
+	char request[256];
+	snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n", path);
+	if (write(fd, request, strlen(request))!=strlen(request)){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/// Reads all the answer, and whether it has the text.
+static int read_answer(int fd, const char *text){
+	char buffer[1024];
+	ssize_t r, pos=0;
+	while ( (r=read(fd, buffer+pos, sizeof(buffer)-pos-1)) > 0 )
+		pos+=r;
+	buffer[pos]=0;
+	close(fd);
+	return strstr(buffer, text)!=NULL;
+}
+
+/// With the bulk requests at all the threads they may have, health checks still answer at once.
+void t01_priority(){
+	INIT_LOCAL();
+	
+	int fds[NEXPORTS], i;
+	long start=now_ms();
+	for (i=0;i<NEXPORTS;i++){
+		fds[i]=send_get("export/all");
+		FAIL_IF(fds[i]<0);
+	}
+	usleep(50000);
+	
+	long healthz_start=now_ms();
+	int fd=send_get("healthz");
+	FAIL_IF(fd<0);
+	FAIL_IF_NOT(read_answer(fd, "OK"));
+	long healthz_ms=now_ms()-healthz_start;
+	
+	for (i=0;i<NEXPORTS;i++)
+		FAIL_IF_NOT(read_answer(fds[i], "Exported"));
+	long exports_ms=now_ms()-start;
+	
+	ONION_INFO("Health check answered in %ld ms, exports in %ld ms, %d at a time", healthz_ms, exports_ms, max_running_exports);
+	FAIL_IF(healthz_ms>150);
+	FAIL_IF_NOT_EQUAL_INT(max_running_exports, 1);
+	FAIL_IF(exports_ms<NEXPORTS*300-50);
+	
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	
+	o=onion_new(O_POLL);
+	onion_set_port(o, "8143");
+	onion_set_workers(o, 2, 16);
+	onion_set_priority_class(o, OPRIO_LOW, 1);
+	onion_url *urls=onion_root_url(o);
+	onion_url_add(urls, "healthz", healthz_handler);
+	onion_url_add(urls, "^export/", export_handler);
+	onion_url_set_priority(urls, "healthz", OPRIO_HIGH);
+	onion_url_set_priority(urls, "^export/", OPRIO_LOW);
+	
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	sleep(1);
+	
+	t01_priority();
+	
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+	
+	END();
+}
@@ -0,0 +1,221 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <time.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/url.h>
+#include <onion/request.h>
+#include <onion/response.h>
+
+#include "../ctest.h"
+
+onion *o;
+int busy_calls=0;
+long cancelled_at=0;
+
+int connect_to(const char *addr, const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+	if (getaddrinfo(addr,port,&hints,&server)<0){
+		ONION_ERROR("Error getting server info");
+		return -1;
+	}
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+		ONION_ERROR("Error connecting to server %s:%s",addr,port);
+	}
+	freeaddrinfo(server);
+
+	return fd;
+}
+
+static long now_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/// Works until cancelled, for up to 3 s, and tells the time it had.
+onion_connection_status work_handler(void *_, onion_request *req, onion_response *res){
+	int remaining=onion_request_get_remaining_ms(req);
+	long start=now_ms();
+	while (!onion_request_is_cancelled(req) && now_ms()-start<3000)
+		usleep(10000);
+	onion_response_printf(res, "Had %d ms, worked %ld ms", remaining, now_ms()-start);
+	return OCS_PROCESSED;
+}
+
+static void set_cancelled(void *done){
+	cancelled_at=now_ms();
+	*(int*)done=1;
+}
+
+/// Waits for something that never comes, until the cancel callback says nobody waits for it.
+onion_connection_status wait_handler(void *_, onion_request *req, onion_response *res){
+	int done=0;
+	onion_request_set_cancel_callback(req, set_cancelled, &done);
+	long start=now_ms();
+	while (!__atomic_load_n(&done, __ATOMIC_SEQ_CST) && now_ms()-start<3000)
+		usleep(10000);
+	onion_response_write0(res, "Done");
+	return OCS_PROCESSED;
+}
+
+onion_connection_status busy_handler(void *_, onion_request *req, onion_response *res){
+	__sync_add_and_fetch(&busy_calls, 1);
+	usleep(300000);
+	onion_response_write0(res, "Busy");
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+static int send_get(const char *path, const char *headers){
+	int fd=connect_to("localhost", "8144");
+	if (fd<0)
+		return -1;
+	char request[256];
+	snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n%s\r\n", path, headers);
+	if (write(fd, request, strlen(request))!=strlen(request)){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void read_answer(int fd, char *buffer, size_t size){
+	ssize_t r, pos=0;
+	while ( (r=read(fd, buffer+pos, size-pos-1)) > 0 )
+		pos+=r;
+	buffer[pos]=0;
+	close(fd);
+}
+
+/// The client asks for a shorter deadline than the server one, and the handler stops then.
+void t01_deadline(){
+	INIT_LOCAL();
+	
+	char buffer[1024];
+	long start=now_ms();
+	int fd=send_get("work", "X-Request-Timeout: 200\r\n");
+	FAIL_IF(fd<0);
+	read_answer(fd, buffer, sizeof(buffer));
+	long elapsed=now_ms()-start;
+	ONION_INFO("Answered in %ld ms: %s", elapsed, strstr(buffer, "Had"));
+	FAIL_IF_NOT_STRSTR(buffer, "HTTP/1.1 200");
+	int had=-1, worked=-1;
+	sscanf(strstr(buffer, "Had"), "Had %d ms, worked %d ms", &had, &worked);
+	FAIL_IF(had>200 || had<150);
+	FAIL_IF(worked<150 || worked>400);
+	
+	fd=send_get("work", ""); // The server deadline
+	FAIL_IF(fd<0);
+	read_answer(fd, buffer, sizeof(buffer));
+	sscanf(strstr(buffer, "Had"), "Had %d ms, worked %d ms", &had, &worked);
+	FAIL_IF(had>1000 || had<900);
+	FAIL_IF(worked<900 || worked>1300);
+	
+	END_LOCAL();
+}
+
+/// The client goes away, and the handler knows at once.
+void t02_client_gone(){
+	INIT_LOCAL();
+	
+	cancelled_at=0;
+	int fd=send_get("wait", "");
+	FAIL_IF(fd<0);
+	usleep(100000);
+	long closed=now_ms();
+	close(fd);
+	usleep(500000);
+	ONION_INFO("Cancel callback %ld ms after the client left", cancelled_at-closed);
+	FAIL_IF(cancelled_at==0);
+	FAIL_IF(cancelled_at-closed>300);
+	
+	END_LOCAL();
+}
+
+/// A request whose deadline passes while waiting for a worker is not handled.
+void t03_queued(){
+	INIT_LOCAL();
+	
+	char buffer[1024];
+	busy_calls=0;
+	int busy=send_get("busy", "");
+	FAIL_IF(busy<0);
+	usleep(50000);
+	int late=send_get("busy", "X-Request-Timeout: 100\r\n");
+	FAIL_IF(late<0);
+	read_answer(late, buffer, sizeof(buffer));
+	FAIL_IF_NOT_STRSTR(buffer, "HTTP/1.1 503");
+	read_answer(busy, buffer, sizeof(buffer));
+	FAIL_IF_NOT_STRSTR(buffer, "Busy");
+	FAIL_IF_NOT_EQUAL_INT(busy_calls, 1);
+	
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	signal(SIGPIPE, SIG_IGN);
+	
+	o=onion_new(O_POLL);
+	onion_set_port(o, "8144");
+	onion_set_workers(o, 1, 16);
+	onion_timeouts timeouts={ .handler=1000 };
+	onion_set_timeouts(o, &timeouts);
+	onion_url *urls=onion_root_url(o);
+	onion_url_add(urls, "work", work_handler);
+	onion_url_add(urls, "wait", wait_handler);
+	onion_url_add(urls, "busy", busy_handler);
+	
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	sleep(1);
+	
+	t01_deadline();
+	t02_client_gone();
+	t03_queued();
+	
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+	
+	END();
+}
@@ -0,0 +1,236 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/url.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/traffic_record.h>
+
+#include "../ctest.h"
+
+onion *o;
+char record_path[64];
+
+const char *get_hello="GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n";
+const char *post_head="POST /hello HTTP/1.1\r\nHost: localhost\r\nContent-Length: 8\r\n\r\nfirst";
+const char *post_tail="end";
+const char *head_hello="HEAD /hello HTTP/1.1\r\nHost: localhost\r\n\r\n";
+const char *get_missing="GET /missing HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+
+int connect_to(const char *addr, const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+	if (getaddrinfo(addr,port,&hints,&server)<0){
+		ONION_ERROR("Error getting server info");
+		return -1;
+	}
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+		ONION_ERROR("Error connecting to server %s:%s",addr,port);
+	}
+	freeaddrinfo(server);
+
+	return fd;
+}
+
+onion_connection_status hello_handler(void *_, onion_request *req, onion_response *res){
+	onion_response_write0(res, "Hello");
+	return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *_){
+	onion_listen(o);
+	return NULL;
+}
+
+/// Reads from the keep alive connection until the response ends with end.
+static void read_until(int fd, const char *end, char *buffer, size_t size){
+	ssize_t r, pos=0;
+	buffer[0]=0;
+	while (!strstr(buffer, end) && (r=read(fd, buffer+pos, size-pos-1)) > 0 ){
+		pos+=r;
+		buffer[pos]=0;
+	}
+}
+
+/// Requests of two connections, one keep alive with a body sent in two parts, one closed by the server.
+void t01_traffic(){
+	INIT_LOCAL();
+
+	char buffer[1024];
+	int fd=connect_to("localhost", "8145");
+	FAIL_IF(fd<0);
+	FAIL_IF_NOT_EQUAL_INT(write(fd, get_hello, strlen(get_hello)), strlen(get_hello));
+	read_until(fd, "Hello", buffer, sizeof(buffer));
+	FAIL_IF_NOT_STRSTR(buffer, "HTTP/1.1 200");
+
+	FAIL_IF_NOT_EQUAL_INT(write(fd, post_head, strlen(post_head)), strlen(post_head));
+	usleep(100000);
+	FAIL_IF_NOT_EQUAL_INT(write(fd, post_tail, strlen(post_tail)), strlen(post_tail));
+	read_until(fd, "Hello", buffer, sizeof(buffer));
+	FAIL_IF_NOT_STRSTR(buffer, "HTTP/1.1 200");
+
+	FAIL_IF_NOT_EQUAL_INT(write(fd, head_hello, strlen(head_hello)), strlen(head_hello));
+	read_until(fd, "\r\n\r\n", buffer, sizeof(buffer));
+	FAIL_IF_NOT_STRSTR(buffer, "HTTP/1.1 200");
+	close(fd);
+
+	fd=connect_to("localhost", "8145");
+	FAIL_IF(fd<0);
+	FAIL_IF_NOT_EQUAL_INT(write(fd, get_missing, strlen(get_missing)), strlen(get_missing));
+	ssize_t r, pos=0;
+	while ( (r=read(fd, buffer+pos, sizeof(buffer)-pos-1)) > 0 ) // Until closed
+		pos+=r;
+	buffer[pos]=0;
+	FAIL_IF_NOT_STRSTR(buffer, "HTTP/1.1 404");
+	close(fd);
+	usleep(200000);
+
+	END_LOCAL();
+}
+
+/// The record has the bytes as they came, the responses and the closes, of each connection.
+void t02_read_record(){
+	INIT_LOCAL();
+
+	FILE *file=onion_traffic_record_open(record_path);
+	FAIL_IF(file==NULL);
+	if (!file){
+		END_LOCAL();
+		return;
+	}
+	onion_traffic_record_entry entry;
+	memset(&entry, 0, sizeof(entry));
+	char data[2][1024]={ "", "" };
+	int data_entries[2]={ 0, 0 };
+	int statuses[2][4];
+	int no_body[2][4];
+	int responses[2]={ 0, 0 };
+	int closed[2]={ 0, 0 };
+	uint64_t last_time=0, post_tail_time=0, post_head_time=0;
+	int r;
+	while ( (r=onion_traffic_record_read(file, &entry))==1 ){
+		FAIL_IF(entry.time_us<last_time);
+		last_time=entry.time_us;
+		FAIL_IF(entry.connection<1 || entry.connection>2);
+		if (entry.connection<1 || entry.connection>2)
+			continue;
+		int c=entry.connection-1;
+		FAIL_IF(closed[c]);
+		if (entry.type==OTR_DATA){
+			strncat(data[c], entry.data, entry.length);
+			data_entries[c]++;
+			if (entry.length==strlen(post_head) && memcmp(entry.data, post_head, entry.length)==0)
+				post_head_time=entry.time_us;
+			if (entry.length==strlen(post_tail) && memcmp(entry.data, post_tail, entry.length)==0)
+				post_tail_time=entry.time_us;
+		}
+		else if (entry.type==OTR_RESPONSE){
+			FAIL_IF(responses[c]>=4);
+			if (responses[c]<4){
+				statuses[c][responses[c]]=entry.status;
+				no_body[c][responses[c]]=entry.no_body;
+				responses[c]++;
+			}
+		}
+		else if (entry.type==OTR_CLOSE)
+			closed[c]=1;
+	}
+	FAIL_IF_NOT_EQUAL_INT(r, 0);
+	free(entry.data);
+	fclose(file);
+
+	char sent[1024];
+	snprintf(sent, sizeof(sent), "%s%s%s%s", get_hello, post_head, post_tail, head_hello);
+	FAIL_IF_NOT_EQUAL_STR(data[0], sent);
+	FAIL_IF_NOT_EQUAL_STR(data[1], get_missing);
+	FAIL_IF_NOT_EQUAL_INT(data_entries[0], 4);
+	FAIL_IF(post_tail_time-post_head_time<80000);
+
+	FAIL_IF_NOT_EQUAL_INT(responses[0], 3);
+	FAIL_IF_NOT_EQUAL_INT(statuses[0][0], 200);
+	FAIL_IF_NOT_EQUAL_INT(statuses[0][1], 200);
+	FAIL_IF_NOT_EQUAL_INT(statuses[0][2], 200);
+	FAIL_IF_NOT_EQUAL_INT(no_body[0][1], 0);
+	FAIL_IF_NOT_EQUAL_INT(no_body[0][2], 1);
+	FAIL_IF_NOT_EQUAL_INT(responses[1], 1);
+	FAIL_IF_NOT_EQUAL_INT(statuses[1][0], 404);
+	FAIL_IF_NOT(closed[0]);
+	FAIL_IF_NOT(closed[1]);
+
+	END_LOCAL();
+}
+
+/// Not a record: a wrong magic is an error, not an empty record.
+void t03_not_a_record(){
+	INIT_LOCAL();
+
+	FILE *f=fopen(record_path, "w");
+	fputs("GET / HTTP/1.1\r\n\r\n", f);
+	fclose(f);
+	FAIL_IF_NOT(onion_traffic_record_open(record_path)==NULL);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	signal(SIGPIPE, SIG_IGN);
+	snprintf(record_path, sizeof(record_path), "/tmp/onion-traffic-%d.otr", getpid());
+
+	o=onion_new(O_POLL);
+	onion_set_port(o, "8145");
+	onion_url *urls=onion_root_url(o);
+	onion_url_add(urls, "hello", hello_handler);
+	FAIL_IF_NOT_EQUAL_INT(onion_set_traffic_record(o, record_path), 0);
+
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, NULL);
+	sleep(1);
+
+	t01_traffic();
+
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+
+	t02_read_record();
+	t03_not_a_record();
+	unlink(record_path);
+
+	END();
+}
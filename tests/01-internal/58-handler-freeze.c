@@ -0,0 +1,160 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <onion/onion.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/handler.h>
+#include <onion/log.h>
+#include <onion/url.h>
+
+#include <onion/handlers/static.h>
+#include <onion/handlers/path.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+#define FILL(a,b) onion_request_write(a,b,strlen(b))
+
+/// Processes the request to that path at the server, and returns whether the response has the text.
+static int request_has(onion *server, onion_listen_point *lp, const char *path, const char *text){
+	onion_request *request=onion_request_new(lp);
+	char line[256];
+	snprintf(line, sizeof(line), "GET %s HTTP/1.1\n\n", path);
+	FILL(request, line);
+	const char *buffer=onion_buffer_listen_point_get_buffer_data(request);
+	int ret=strstr(buffer, text)!=NULL;
+	if (!ret)
+		ONION_DEBUG("%s: %s", path, buffer);
+	onion_request_free(request);
+	return ret;
+}
+
+/// url [ ^$, ^api/ url [ ^x$, ^y$ ] ], then a path, then a fallback
+static onion_handler *tree(){
+	onion_url *api=onion_url_new();
+	onion_url_add_static(api, "^x$", "is x", 200);
+	onion_url_add_static(api, "^y$", "is y", 200);
+	onion_url *url=onion_url_new();
+	onion_url_add_static(url, "^$", "is root", 200);
+	onion_url_add_url(url, "^api/", api);
+	onion_handler *root=onion_url_to_handler(url);
+	onion_handler_add(root, onion_handler_path("^p/", onion_handler_static("is p", 200)));
+	onion_handler_add(root, onion_handler_static("is fallback", 404));
+	return root;
+}
+
+void t01_table(){
+	INIT_LOCAL();
+
+	onion_handler *root=tree();
+	onion_handler_table *table=onion_handler_table_new();
+	FAIL_IF_NOT_EQUAL_INT(onion_handler_table_count(table), 0);
+	FAIL_IF_NOT_EQUAL_INT(onion_handler_freeze(table, root), 8);
+	FAIL_IF_NOT_EQUAL_INT(onion_handler_freeze(table, root), 0); // Already there
+	FAIL_IF_NOT_EQUAL_INT(onion_handler_table_count(table), 8);
+
+	int depths[]={ 0,0,0, 1, 1, 2,2, 1 };
+	const char *routes[]={ NULL,NULL,NULL, "^$", "^api/", "^x$","^y$", NULL };
+	char lasts[]={ 0,0,1, 1, 1, 1,1, 1 }; // Each route is a level
+	int i;
+	for (i=0;i<8;i++){
+		const onion_handler_entry *e=onion_handler_table_get(table, i);
+		FAIL_IF_NOT(e);
+		FAIL_IF_NOT_EQUAL_INT(e->depth, depths[i]);
+		FAIL_IF_NOT_EQUAL_INT(e->last, lasts[i]);
+		FAIL_IF_NOT_EQUAL_STR(e->route, routes[i]);
+	}
+	FAIL_IF_NOT_EQUAL(onion_handler_table_get(table, 0)->origin, root);
+	FAIL_IF_NOT_EQUAL(onion_handler_table_get(table, 8), NULL);
+	FAIL_IF_NOT_EQUAL(onion_handler_table_get(table, -1), NULL);
+
+	onion_handler_free(root);
+	onion_handler_table_free(table);
+
+	END_LOCAL();
+}
+
+void t02_dispatch(){
+	INIT_LOCAL();
+
+	onion *server=onion_new(0);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, lp);
+	onion_handler *root=tree();
+	onion_set_root_handler(server, root);
+	onion_handler_table *table=onion_handler_table_new();
+	onion_handler_freeze(table, root);
+
+	FAIL_IF_NOT(request_has(server, lp, "/", "is root"));
+	FAIL_IF_NOT(request_has(server, lp, "/api/x", "is x"));
+	FAIL_IF_NOT(request_has(server, lp, "/api/y", "is y"));
+	FAIL_IF_NOT(request_has(server, lp, "/api/z", "is fallback"));
+	FAIL_IF_NOT(request_has(server, lp, "/p/", "is p"));
+	FAIL_IF_NOT(request_has(server, lp, "/other", "404"));
+
+	onion_free(server);
+	onion_handler_table_free(table);
+
+	END_LOCAL();
+}
+
+void t03_add_after_freeze(){
+	INIT_LOCAL();
+
+	onion *server=onion_new(0);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, lp);
+	onion_url *url=onion_url_new();
+	onion_url_add_static(url, "^$", "is root", 200);
+	onion_handler *root=onion_url_to_handler(url);
+	onion_set_root_handler(server, root);
+	onion_handler_table *table=onion_handler_table_new();
+	FAIL_IF_NOT_EQUAL_INT(onion_handler_freeze(table, root), 2);
+
+	FAIL_IF_NOT(request_has(server, lp, "/other", "404"));
+	onion_handler_add(root, onion_handler_static("is late", 200));
+	FAIL_IF_NOT(request_has(server, lp, "/other", "is late"));
+	onion_url_add_static(url, "^new$", "is new", 200);
+	FAIL_IF_NOT(request_has(server, lp, "/new", "is new"));
+	FAIL_IF_NOT(request_has(server, lp, "/", "is root"));
+
+	onion_handler_table_free(table);
+	table=onion_handler_table_new();
+	FAIL_IF_NOT_EQUAL_INT(onion_handler_freeze(table, root), 4);
+	FAIL_IF_NOT(request_has(server, lp, "/other", "is late"));
+	FAIL_IF_NOT(request_has(server, lp, "/new", "is new"));
+
+	onion_free(server);
+	onion_handler_table_free(table);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+
+	t01_table();
+	t02_dispatch();
+	t03_add_after_freeze();
+
+	END();
+}
@@ -0,0 +1,272 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/block.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/handler.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+#define FILL(a,b) onion_request_write(a,b,strlen(b))
+/// Bigger than the socket buffers, so it waits for the client
+#define BIG_SIZE (8*1024*1024)
+
+static int freed=0;
+
+static void count_free(void *data){
+	__atomic_add_fetch(&freed, 1, __ATOMIC_RELAXED);
+	free(data);
+}
+
+/// size bytes of a pattern, so a misplaced byte shows
+static char *pattern(size_t size){
+	char *data=malloc(size);
+	size_t i;
+	for (i=0;i<size;i++)
+		data[i]='a'+(i%23);
+	return data;
+}
+
+static int is_pattern(const char *data, size_t size){
+	size_t i;
+	for (i=0;i<size;i++)
+		if (data[i]!='a'+(i%23))
+			return 0;
+	return 1;
+}
+
+void t01_refcount(){
+	INIT_LOCAL();
+
+	freed=0;
+	onion_shared_buffer *b=onion_shared_buffer_new(pattern(100), 100, count_free);
+	FAIL_IF_NOT_EQUAL_INT(onion_shared_buffer_size(b), 100);
+	FAIL_IF_NOT(is_pattern(onion_shared_buffer_data(b), 100));
+	FAIL_IF_NOT_EQUAL(onion_shared_buffer_ref(b), b);
+	onion_shared_buffer_unref(b);
+	FAIL_IF_NOT_EQUAL_INT(freed, 0);
+	onion_shared_buffer_unref(b);
+	FAIL_IF_NOT_EQUAL_INT(freed, 1);
+
+	char text[]="some text";
+	b=onion_shared_buffer_copy(text, sizeof(text));
+	text[0]='S';
+	FAIL_IF_NOT_EQUAL_STR(onion_shared_buffer_data(b), "some text");
+	onion_shared_buffer_unref(b);
+
+	onion_block *block=onion_block_new();
+	onion_block_add_str(block, "of a block");
+	b=onion_shared_buffer_new_block(block);
+	FAIL_IF_NOT_EQUAL_INT(onion_shared_buffer_size(b), 10);
+	FAIL_IF_NOT_EQUAL(onion_shared_buffer_data(b), onion_block_data(block));
+	onion_shared_buffer_unref(b); // And the block
+
+	END_LOCAL();
+}
+
+static size_t body_size;
+static int chunked;
+
+onion_connection_status external_handler(void *_, onion_request *req, onion_response *res){
+	if (!chunked)
+		onion_response_set_length(res, body_size+5);
+	onion_response_write0(res, "start");
+	onion_response_write_external(res, pattern(body_size), body_size, count_free);
+	if (chunked)
+		onion_response_write0(res, "end");
+	return OCS_PROCESSED;
+}
+
+/// Removes the chunked encoding, in place. Returns the body size, or -1 if it is wrong.
+static ssize_t dechunk(char *body){
+	char *in=body, *out=body;
+	for(;;){
+		char *end;
+		long size=strtol(in, &end, 16);
+		if (end==in || strncmp(end, "\r\n", 2)!=0)
+			return -1;
+		in=end+2;
+		if (size==0)
+			return out-body;
+		memmove(out, in, size);
+		out+=size;
+		in+=size;
+		if (strncmp(in, "\r\n", 2)!=0)
+			return -1;
+		in+=2;
+	}
+}
+
+void t02_write_external(){
+	INIT_LOCAL();
+
+	onion *server=onion_new(0);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, lp);
+	onion_set_root_handler(server, onion_handler_new(external_handler, NULL, NULL));
+
+	size_t sizes[]={ 10, 64*1024 };
+	int i;
+	for (chunked=0;chunked<2;chunked++){
+		for (i=0;i<2;i++){
+			freed=0;
+			body_size=sizes[i];
+			onion_request *request=onion_request_new(lp);
+			FILL(request, "GET / HTTP/1.1\n\n");
+			const char *buffer=onion_buffer_listen_point_get_buffer_data(request);
+			FAIL_IF_NOT_EQUAL_INT(freed, 1);
+			char *body=strstr(buffer, "\r\n\r\n");
+			FAIL_IF_NOT(body);
+			if (body){
+				body=strdup(body+4);
+				ssize_t size=strlen(body);
+				if (chunked && body_size>1500){ // Else all is buffered, and the length known at the end
+					FAIL_IF_NOT_STRSTR(buffer, "Transfer-Encoding: chunked");
+					size=dechunk(body);
+					FAIL_IF_NOT_EQUAL_INT(size, body_size+8);
+					FAIL_IF_NOT_EQUAL_INT(strncmp(&body[size-3], "end", 3), 0);
+				}
+				else
+					FAIL_IF_NOT_EQUAL_INT(size, body_size+(chunked ? 8 : 5));
+				FAIL_IF_NOT_EQUAL_INT(strncmp(body, "start", 5), 0);
+				FAIL_IF_NOT(is_pattern(body+5, body_size));
+				free(body);
+			}
+			onion_request_free(request);
+		}
+	}
+
+	onion_free(server);
+
+	END_LOCAL();
+}
+
+static onion_shared_buffer *big=NULL;
+
+onion_connection_status big_handler(void *_, onion_request *req, onion_response *res){
+	onion_response_set_length(res, BIG_SIZE);
+	onion_response_write_shared(res, big);
+	return OCS_PROCESSED;
+}
+
+int connect_to(const char *addr, const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+	if (getaddrinfo(addr,port,&hints,&server)<0){
+		ONION_ERROR("Error getting server info");
+		return -1;
+	}
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+		ONION_ERROR("Error connecting to server %s:%s",addr,port);
+	}
+	freeaddrinfo(server);
+
+	return fd;
+}
+
+/// Reads the response to the end, and returns the body, or NULL.
+static char *read_body(int fd, size_t *size){
+	size_t allocated=BIG_SIZE+4096, total=0;
+	char *data=malloc(allocated);
+	ssize_t r;
+	while (total<allocated && (r=read(fd, data+total, allocated-total))>0)
+		total+=r;
+	close(fd);
+	char *body=memmem(data, total, "\r\n\r\n", 4);
+	if (!body){
+		free(data);
+		return NULL;
+	}
+	body+=4;
+	*size=total-(body-data);
+	memmove(data, body, *size);
+	return data;
+}
+
+/// The clients do not read for a while, so the same buffer is queued at both, without copies.
+void t03_nonblocking(){
+	INIT_LOCAL();
+
+	freed=0;
+	big=onion_shared_buffer_new(pattern(BIG_SIZE), BIG_SIZE, count_free);
+	onion *o=onion_new(O_POOL|O_NONBLOCKING|O_DETACH_LISTEN);
+	onion_set_hostname(o, "localhost");
+	onion_set_port(o, "8146");
+	onion_set_root_handler(o, onion_handler_new(big_handler, NULL, NULL));
+	FAIL_IF(onion_listen(o));
+	usleep(100000);
+
+	const char *get="GET / HTTP/1.0\r\n\r\n";
+	int fds[2], i;
+	for (i=0;i<2;i++){
+		fds[i]=connect_to("localhost", "8146");
+		FAIL_IF(fds[i]<0);
+		FAIL_IF_NOT_EQUAL_INT(write(fds[i], get, strlen(get)), strlen(get));
+	}
+	usleep(200000);
+	onion_shared_buffer_unref(big); // Now only the queues have it
+	FAIL_IF_NOT_EQUAL_INT(freed, 0);
+	for (i=0;i<2;i++){
+		size_t size=0;
+		char *body=read_body(fds[i], &size);
+		FAIL_IF_NOT(body);
+		FAIL_IF_NOT_EQUAL_INT(size, BIG_SIZE);
+		FAIL_IF_NOT(body && is_pattern(body, size));
+		free(body);
+	}
+	for (i=0;i<100 && !freed;i++)
+		usleep(10000);
+	FAIL_IF_NOT_EQUAL_INT(freed, 1);
+
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	signal(SIGPIPE, SIG_IGN);
+
+	t01_refcount();
+	t02_write_external();
+	t03_nonblocking();
+
+	END();
+}
@@ -0,0 +1,218 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/url.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/poller.h>
+#include <onion/handlers/connections.h>
+
+#include "../ctest.h"
+
+#define PORT "8147"
+
+static volatile int release_slow=0;
+
+onion_connection_status slow(void *_, onion_request *req, onion_response *res){
+	int i;
+	for (i=0;i<500 && !release_slow;i++)
+		usleep(10000);
+	onion_response_write0(res, "slow");
+	return OCS_PROCESSED;
+}
+
+onion_connection_status hello(void *_, onion_request *req, onion_response *res){
+	onion_response_write0(res, "hello");
+	return OCS_PROCESSED;
+}
+
+int connect_to(const char *addr, const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+	if (getaddrinfo(addr,port,&hints,&server)<0){
+		ONION_ERROR("Error getting server info");
+		return -1;
+	}
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+		ONION_ERROR("Error connecting to server %s:%s",addr,port);
+	}
+	freeaddrinfo(server);
+
+	return fd;
+}
+
+/// The local port of the client socket, as the server sees it as the peer.
+static int local_port(int fd){
+	struct sockaddr_storage addr;
+	socklen_t len=sizeof(addr);
+	if (getsockname(fd, (struct sockaddr*)&addr, &len)<0)
+		return -1;
+	if (addr.ss_family==AF_INET6)
+		return ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
+	return ntohs(((struct sockaddr_in*)&addr)->sin_port);
+}
+
+/// The connection of that client at the list, or NULL.
+static onion_connection_info *find(onion_connection_info *infos, int count, int fd){
+	char port[16];
+	snprintf(port, sizeof(port), ":%d", local_port(fd));
+	int i;
+	for (i=0;i<count;i++){
+		const char *p=strrchr(infos[i].peer, ':');
+		if (p && strcmp(p, port)==0)
+			return &infos[i];
+	}
+	return NULL;
+}
+
+static int send_str(int fd, const char *str){
+	return write(fd, str, strlen(str))==strlen(str);
+}
+
+/// Reads until the connection is closed.
+static char *read_all(int fd){
+	size_t size=0, allocated=4096;
+	char *data=malloc(allocated);
+	ssize_t r;
+	while ((r=read(fd, data+size, allocated-size-1))>0){
+		size+=r;
+		if (size+1==allocated)
+			data=realloc(data, allocated*=2);
+	}
+	data[size]='\0';
+	return data;
+}
+
+/// Connections at each state, as listed directly and by the handler.
+void t01_states(){
+	INIT_LOCAL();
+
+	onion *o=onion_new(O_POOL|O_DETACH_LISTEN);
+	onion_set_max_threads(o, 4);
+	onion_set_hostname(o, "localhost");
+	onion_set_port(o, PORT);
+	onion_url *urls=onion_root_url(o);
+	onion_url_add(urls, "slow", slow);
+	onion_url_add(urls, "hello", hello);
+	onion_url_add_handler(urls, "connections", onion_handler_connections());
+	// One event per wakeup, so the thread at the slow handler does not keep others' events.
+	onion_poller_set_max_events(onion_get_poller(o), 1, 1);
+	FAIL_IF(onion_listen(o));
+	usleep(100000);
+
+	int idle=connect_to("localhost", PORT);
+	FAIL_IF(idle<0);
+	FAIL_IF_NOT(send_str(idle, "GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n"));
+	char tmp[1024];
+	ssize_t r=read(idle, tmp, sizeof(tmp)-1);
+	FAIL_IF(r<=0);
+	int in_handler=connect_to("localhost", PORT);
+	FAIL_IF_NOT(send_str(in_handler, "GET /slow?x=1 HTTP/1.1\r\nHost: localhost\r\n\r\n"));
+	int in_headers=connect_to("localhost", PORT);
+	FAIL_IF_NOT(send_str(in_headers, "GET /par"));
+	usleep(300000);
+
+	int count=0;
+	onion_connection_info *infos=onion_get_connections(o, &count);
+	FAIL_IF_NOT(infos);
+	FAIL_IF_NOT_EQUAL_INT(count, 3);
+	onion_connection_info *c=find(infos, count, idle);
+	FAIL_IF_NOT(c);
+	if (c){
+		FAIL_IF_NOT_EQUAL_STR(onion_request_state_names[c->state], "idle");
+		FAIL_IF_NOT_EQUAL_STR(c->path, "GET /hello");
+		FAIL_IF_NOT(c->bytes_in>30);
+		FAIL_IF_NOT_EQUAL_INT(c->bytes_out, 5); // The body
+		FAIL_IF(c->age_ms<c->state_ms);
+		FAIL_IF(c->state_ms<200);
+		FAIL_IF_NOT_STRSTR(c->listen_point, ":" PORT);
+	}
+	c=find(infos, count, in_handler);
+	FAIL_IF_NOT(c);
+	if (c){
+		FAIL_IF_NOT_EQUAL_INT(c->state, OR_STATE_HANDLER);
+		FAIL_IF_NOT_EQUAL_STR(c->path, "GET /slow");
+		FAIL_IF_NOT_EQUAL_INT(c->bytes_out, 0);
+		FAIL_IF(c->state_ms<200);
+	}
+	c=find(infos, count, in_headers);
+	FAIL_IF_NOT(c);
+	if (c)
+		FAIL_IF_NOT_EQUAL_INT(c->state, OR_STATE_HEADERS);
+	free(infos);
+
+	int list=connect_to("localhost", PORT);
+	FAIL_IF_NOT(send_str(list, "GET /connections?format=json HTTP/1.0\r\n\r\n"));
+	char *json=read_all(list);
+	close(list);
+	FAIL_IF_NOT_STRSTR(json, "Content-Type: application/json");
+	FAIL_IF_NOT_STRSTR(json, "\"state\":\"handler\",");
+	FAIL_IF_NOT_STRSTR(json, "\"path\":\"GET /slow\"");
+	FAIL_IF_NOT_STRSTR(json, "\"path\":\"GET /connections\"");
+	const char *slow_at=strstr(json, "GET /slow"), *self_at=strstr(json, "GET /connections");
+	FAIL_IF_NOT(slow_at && self_at && slow_at<self_at); // Longest at its state first
+	free(json);
+
+	list=connect_to("localhost", PORT);
+	FAIL_IF_NOT(send_str(list, "GET /connections HTTP/1.0\r\n\r\n"));
+	char *text=read_all(list);
+	close(list);
+	FAIL_IF_NOT_STRSTR(text, "state_ms");
+	FAIL_IF_NOT_STRSTR(text, " headers ");
+	FAIL_IF_NOT_STRSTR(text, " idle ");
+	free(text);
+
+	release_slow=1;
+	close(idle);
+	close(in_handler);
+	close(in_headers);
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	signal(SIGPIPE, SIG_IGN);
+	onion_log_flags=OF_NOINFO;
+
+	t01_states();
+
+	END();
+}
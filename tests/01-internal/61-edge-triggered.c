@@ -0,0 +1,278 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/url.h>
+#include <onion/block.h>
+#include <onion/request.h>
+#include <onion/response.h>
+
+#include "../ctest.h"
+
+#define PORT "8148"
+/// Bigger than the socket buffers, so the output waits for the socket to be writable
+#define BIG_SIZE (4*1024*1024)
+/// Bigger than the read budget of a wakeup, so the connection is not drained at once
+#define POST_SIZE (600*1024)
+
+onion_connection_status hello(void *_, onion_request *req, onion_response *res){
+	onion_response_write0(res, "hello");
+	return OCS_PROCESSED;
+}
+
+onion_connection_status big(void *_, onion_request *req, onion_response *res){
+	static char block[64*1024];
+	memset(block, 'b', sizeof(block));
+	onion_response_set_length(res, BIG_SIZE);
+	int i;
+	for (i=0;i<BIG_SIZE/sizeof(block);i++)
+		onion_response_write(res, block, sizeof(block));
+	return OCS_PROCESSED;
+}
+
+onion_connection_status post(void *_, onion_request *req, onion_response *res){
+	const onion_block *data=onion_request_get_data(req);
+	onion_response_printf(res, "%ld", data ? (long)onion_block_size(data) : -1l);
+	return OCS_PROCESSED;
+}
+
+int connect_to(const char *addr, const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+	if (getaddrinfo(addr,port,&hints,&server)<0){
+		ONION_ERROR("Error getting server info");
+		return -1;
+	}
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+		ONION_ERROR("Error connecting to server %s:%s",addr,port);
+	}
+	freeaddrinfo(server);
+
+	return fd;
+}
+
+/// A client connection, with what was read after the last response.
+typedef struct{
+	int fd;
+	char *buffer;
+	size_t size;
+	size_t allocated;
+}client;
+
+static void client_init(client *c){
+	c->fd=connect_to("localhost", PORT);
+	c->allocated=BIG_SIZE+4096;
+	c->buffer=malloc(c->allocated);
+	c->size=0;
+}
+
+static void client_free(client *c){
+	close(c->fd);
+	free(c->buffer);
+}
+
+static int send_all(int fd, const char *data, size_t size){
+	while (size){
+		ssize_t w=write(fd, data, size);
+		if (w<=0)
+			return 0;
+		data+=w;
+		size-=w;
+	}
+	return 1;
+}
+
+/// Reads a response with Content-Length. Returns its body size, or -1. The body is at c->buffer, and body_start.
+static ssize_t client_response(client *c, char **body){
+	char *end=NULL;
+	size_t length=0;
+	for(;;){
+		if (!end && (end=memmem(c->buffer, c->size, "\r\n\r\n", 4))){
+			*end='\0';
+			char *cl=strcasestr(c->buffer, "Content-Length: ");
+			if (!cl)
+				return -1;
+			length=atol(cl+16);
+			end+=4;
+		}
+		if (end && c->size>=(end-c->buffer)+length)
+			break;
+		ssize_t r=read(c->fd, c->buffer+c->size, c->allocated-c->size);
+		if (r<=0)
+			return -1;
+		c->size+=r;
+	}
+	*body=end;
+	return length;
+}
+
+/// Drops the last response read.
+static void client_next(client *c, char *body, size_t length){
+	size_t used=(body-c->buffer)+length;
+	memmove(c->buffer, c->buffer+used, c->size-used);
+	c->size-=used;
+}
+
+/// Checks that the next response is that body.
+static int expect(client *c, const char *expected){
+	char *body;
+	ssize_t length=client_response(c, &body);
+	int ok=(length==strlen(expected) && memcmp(body, expected, length)==0);
+	if (!ok)
+		ONION_ERROR("Expected '%s', got %ld bytes", expected, (long)length);
+	if (length>=0)
+		client_next(c, body, length);
+	return ok;
+}
+
+static const char *get_hello="GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+/// Keep alive, pipelined, big bodies and big responses that wait for the socket.
+static void check_server(){
+	client c;
+	client_init(&c);
+	FAIL_IF(c.fd<0);
+	int i;
+	for (i=0;i<50;i++){
+		FAIL_IF_NOT(send_all(c.fd, get_hello, strlen(get_hello)));
+		FAIL_IF_NOT(expect(&c, "hello"));
+	}
+
+	char pipelined[512];
+	snprintf(pipelined, sizeof(pipelined), "%s%s%s", get_hello, get_hello, get_hello);
+	FAIL_IF_NOT(send_all(c.fd, pipelined, strlen(pipelined)));
+	for (i=0;i<3;i++)
+		FAIL_IF_NOT(expect(&c, "hello"));
+
+	char headers[256];
+	snprintf(headers, sizeof(headers), "POST /post HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/octet-stream\r\n"
+	         "Content-Length: %d\r\n\r\n", POST_SIZE);
+	char *data=malloc(POST_SIZE+sizeof(headers)+strlen(get_hello));
+	size_t size=strlen(headers);
+	memcpy(data, headers, size);
+	memset(data+size, 'p', POST_SIZE);
+	size+=POST_SIZE;
+	memcpy(data+size, get_hello, strlen(get_hello)); // And one more right after the body
+	size+=strlen(get_hello);
+	FAIL_IF_NOT(send_all(c.fd, data, size));
+	free(data);
+	char post_size[32];
+	snprintf(post_size, sizeof(post_size), "%d", POST_SIZE);
+	FAIL_IF_NOT(expect(&c, post_size));
+	FAIL_IF_NOT(expect(&c, "hello"));
+
+	const char *get_big="GET /big HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	FAIL_IF_NOT(send_all(c.fd, get_big, strlen(get_big)));
+	usleep(100000); // The server fills the socket and waits
+	char *body;
+	ssize_t length=client_response(&c, &body);
+	FAIL_IF_NOT_EQUAL_INT(length, BIG_SIZE);
+	if (length==BIG_SIZE){
+		FAIL_IF_NOT(body[0]=='b' && body[BIG_SIZE-1]=='b');
+		client_next(&c, body, length);
+	}
+	FAIL_IF_NOT(send_all(c.fd, get_hello, strlen(get_hello)));
+	FAIL_IF_NOT(expect(&c, "hello"));
+
+	client_free(&c);
+}
+
+static onion *server_new(int flags){
+	onion *o=onion_new(flags|O_DETACH_LISTEN);
+	onion_set_hostname(o, "localhost");
+	onion_set_port(o, PORT);
+	onion_set_edge_triggered(o, 1);
+	onion_url *urls=onion_root_url(o);
+	onion_url_add(urls, "hello", hello);
+	onion_url_add(urls, "big", big);
+	onion_url_add(urls, "post", post);
+	return o;
+}
+
+void t01_poll(){
+	INIT_LOCAL();
+
+	onion *o=server_new(O_POLL|O_NONBLOCKING);
+	FAIL_IF(onion_listen(o));
+	usleep(100000);
+	check_server();
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+/// The handlers run at the workers, so the connections yield and are resumed from other threads.
+void t02_reuseport_workers(){
+	INIT_LOCAL();
+
+	onion *o=server_new(O_POOL|O_REUSEPORT|O_NONBLOCKING);
+	onion_set_max_threads(o, 3);
+	onion_set_workers(o, 2, 16);
+	FAIL_IF(onion_listen(o));
+	usleep(100000);
+	int i;
+	for (i=0;i<4;i++)
+		check_server();
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+/// A poller of several threads can not have them, so they are as always.
+void t03_shared_poller(){
+	INIT_LOCAL();
+
+	onion *o=server_new(O_POOL|O_NONBLOCKING);
+	onion_set_max_threads(o, 3);
+	FAIL_IF(onion_listen(o));
+	usleep(100000);
+	check_server();
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	signal(SIGPIPE, SIG_IGN);
+
+	t01_poll();
+	t02_reuseport_workers();
+	t03_shared_poller();
+
+	END();
+}
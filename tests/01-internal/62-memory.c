@@ -0,0 +1,228 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/dict.h>
+#include <onion/block.h>
+#include <onion/sessions.h>
+#include <onion/fragment_cache.h>
+#include <onion/memory.h>
+#include <onion/stats.h>
+
+#include "../ctest.h"
+
+#define PORT "8150"
+/// Of each fragment at the cache
+#define FRAGMENT_SIZE (4*1024*1024)
+
+void onion_pool_clear(); // At pool.c
+
+void t01_dicts(){
+	INIT_LOCAL();
+
+	onion_pool_clear();
+	size_t before=onion_memory_get(ONION_MEMORY_DICT);
+	onion_dict *dicts[100];
+	int i, j;
+	for (i=0;i<100;i++){
+		dicts[i]=onion_dict_new();
+		for (j=0;j<20;j++){
+			char key[16];
+			snprintf(key, sizeof(key), "key%d", j);
+			onion_dict_add(dicts[i], key, "value", OD_DUP_KEY);
+		}
+	}
+	size_t used=onion_memory_get(ONION_MEMORY_DICT);
+	FAIL_IF_NOT(used>=before+100*(sizeof(void*)*20));
+	FAIL_IF_NOT(onion_memory_total()>=used);
+	for (i=0;i<100;i++)
+		onion_dict_free(dicts[i]);
+	onion_pool_clear(); // The pooled ones are still memory in use
+	FAIL_IF_NOT_EQUAL_INT(onion_memory_get(ONION_MEMORY_DICT), before);
+
+	END_LOCAL();
+}
+
+static void *new_dicts(void *dicts){
+	int i;
+	for (i=0;i<100;i++){
+		((onion_dict**)dicts)[i]=onion_dict_new();
+		onion_dict_set_flags(((onion_dict**)dicts)[i], OD_HASH);
+	}
+	return NULL;
+}
+
+/// Allocated at a thread that ends, and freed at other: the sum is the same.
+void t02_threads(){
+	INIT_LOCAL();
+
+	onion_pool_clear();
+	size_t before=onion_memory_get(ONION_MEMORY_DICT);
+	onion_dict *dicts[100];
+	pthread_t thread;
+	pthread_create(&thread, NULL, new_dicts, dicts);
+	pthread_join(thread, NULL);
+	FAIL_IF_NOT(onion_memory_get(ONION_MEMORY_DICT)>before);
+	int i;
+	for (i=0;i<100;i++)
+		onion_dict_free(dicts[i]);
+	onion_pool_clear();
+	FAIL_IF_NOT_EQUAL_INT(onion_memory_get(ONION_MEMORY_DICT), before);
+
+	END_LOCAL();
+}
+
+void t03_sessions(){
+	INIT_LOCAL();
+
+	onion_sessions *sessions=onion_sessions_new();
+	size_t before=onion_memory_get(ONION_MEMORY_SESSION);
+	int i;
+	for (i=0;i<160;i++)
+		free(onion_sessions_create(sessions));
+	FAIL_IF_NOT(onion_memory_get(ONION_MEMORY_SESSION)>=before+160*32);
+	FAIL_IF_NOT_EQUAL_INT(onion_sessions_evict(sessions, 2), 32);
+	FAIL_IF_NOT_EQUAL_INT(onion_sessions_count(sessions), 128);
+	onion_sessions_free(sessions);
+	FAIL_IF_NOT_EQUAL_INT(onion_memory_get(ONION_MEMORY_SESSION), before);
+
+	END_LOCAL();
+}
+
+onion_connection_status hello(void *_, onion_request *req, onion_response *res){
+	onion_response_write0(res, "hello");
+	return OCS_PROCESSED;
+}
+
+int connect_to(const char *addr, const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+	if (getaddrinfo(addr,port,&hints,&server)<0){
+		ONION_ERROR("Error getting server info");
+		return -1;
+	}
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+		ONION_ERROR("Error connecting to server %s:%s",addr,port);
+	}
+	freeaddrinfo(server);
+
+	return fd;
+}
+
+/// Asks for /, and returns the status code of the response, or -1.
+static int get_code(){
+	int fd=connect_to("localhost", PORT);
+	if (fd<0)
+		return -1;
+	const char *get="GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+	char buffer[1024];
+	size_t size=0;
+	ssize_t r;
+	if (write(fd, get, strlen(get))!=strlen(get)){
+		close(fd);
+		return -1;
+	}
+	while (size<sizeof(buffer)-1 && (r=read(fd, buffer+size, sizeof(buffer)-1-size))>0)
+		size+=r;
+	close(fd);
+	buffer[size]='\0';
+	if (strncmp(buffer, "HTTP/1.1 ", 9)!=0)
+		return -1;
+	return atoi(buffer+9);
+}
+
+static void store_fragment(const char *key){
+	onion_block *block=onion_block_new();
+	char *data=malloc(FRAGMENT_SIZE);
+	memset(data, 'f', FRAGMENT_SIZE);
+	onion_block_add_data(block, data, FRAGMENT_SIZE);
+	free(data);
+	onion_fragment_cache_store("memory", key, 60, block);
+}
+
+/// Over the budget the cache is evicted, and if that is not enough, new connections are rejected.
+void t04_budget(){
+	INIT_LOCAL();
+
+	onion *o=onion_new(O_POLL|O_DETACH_LISTEN);
+	onion_set_hostname(o, "localhost");
+	onion_set_port(o, PORT);
+	onion_set_root_handler(o, onion_handler_new(hello, NULL, NULL));
+	onion_set_memory_budget(o, onion_memory_total()+64*1024*1024);
+	FAIL_IF(onion_listen(o));
+	usleep(100000);
+	FAIL_IF_NOT_EQUAL_INT(get_code(), 200);
+
+	onion_fragment_cache_set_max_size(3*FRAGMENT_SIZE);
+	store_fragment("a");
+	store_fragment("b");
+	FAIL_IF_NOT(onion_memory_get(ONION_MEMORY_CACHE)>=2*FRAGMENT_SIZE);
+	onion_set_memory_budget(o, onion_memory_total()-FRAGMENT_SIZE);
+	FAIL_IF_NOT_EQUAL_INT(get_code(), 200); // After evicting the fragments
+	FAIL_IF_NOT(onion_memory_get(ONION_MEMORY_CACHE)<FRAGMENT_SIZE);
+	onion_stats stats;
+	onion_get_stats(o, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.memory_sheds, 1);
+	FAIL_IF_NOT_EQUAL_INT(stats.connections_rejected, 0);
+
+	onion_set_memory_budget(o, 1);
+	FAIL_IF_NOT_EQUAL_INT(get_code(), 503);
+	onion_get_stats(o, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.connections_rejected, 1);
+	FAIL_IF_NOT(stats.memory_total>0);
+	FAIL_IF_NOT(stats.memory[ONION_MEMORY_POLLER]>0);
+
+	onion_set_memory_budget(o, 0);
+	FAIL_IF_NOT_EQUAL_INT(get_code(), 200);
+
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	signal(SIGPIPE, SIG_IGN);
+
+	t01_dicts();
+	t02_threads();
+	t03_sessions();
+	t04_budget();
+
+	END();
+}
@@ -0,0 +1,249 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/url.h>
+#include <onion/block.h>
+#include <onion/stats.h>
+#include <onion/handler.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/handlers/static.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+#define FILL(a,b) onion_request_write(a,b,strlen(b))
+#define PORT "8151"
+
+static int called=0;
+
+onion_connection_status pong(void *_, onion_request *req, onion_response *res){
+	called++;
+	onion_response_set_header(res, "Content-Type", "text/plain");
+	onion_response_set_length(res, 4);
+	onion_response_write0(res, "pong");
+	return OCS_PROCESSED;
+}
+
+onion_connection_status hello(void *_, onion_request *req, onion_response *res){
+	onion_response_write0(res, "hello");
+	return OCS_PROCESSED;
+}
+
+/// Answers that request, and returns what was written, without the Date line, to be freed.
+static char *answer(onion_listen_point *lp, const char *request, int *status){
+	onion_request *req=onion_request_new(lp);
+	*status=FILL(req, request);
+	char *ret=strdup(onion_buffer_listen_point_get_buffer_data(req));
+	onion_request_free(req);
+	char *date=strstr(ret, "Date: ");
+	if (date){
+		char *end=strstr(date, "\r\n");
+		memmove(date, end+2, strlen(end+2)+1);
+	}
+	return ret;
+}
+
+/// Both the prerendered and the normal response, so they must be the same but the Date.
+void t01_same_response(){
+	INIT_LOCAL();
+
+	onion *server=onion_new(0);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, lp);
+	onion_url *urls=onion_root_url(server);
+	onion_url_add_static(urls, "healthz", "OK", 200);
+	onion_url_add_static(urls, "^gone", "Not here anymore", 410);
+	onion_handler *h=onion_handler_new(pong, NULL, NULL);
+	onion_response_prerendered *p=onion_response_prerender(200, "text/plain", "pong", 4);
+	onion_handler_set_prerendered(h, p);
+	onion_url_add_handler(urls, "ping", h);
+
+	const char *requests[]={
+		"GET /healthz HTTP/1.1\n\n",
+		"HEAD /healthz HTTP/1.1\n\n",
+		"GET /healthz HTTP/1.1\nConnection: close\n\n",
+		"GET /healthz HTTP/1.0\n\n",
+		"GET /healthz HTTP/1.0\nConnection: Keep-Alive\n\n",
+		"POST /healthz HTTP/1.1\nContent-Length: 4\n\ndata",
+		"GET /gone/and/more HTTP/1.1\n\n",
+		"GET /ping HTTP/1.1\n\n",
+	};
+	int keep_alive[]={ 1, 1, 0, 0, 1, 1, 1, 1 };
+	char *fast[8];
+	int i, status;
+	called=0;
+	for (i=0;i<8;i++){
+		fast[i]=answer(lp, requests[i], &status);
+		FAIL_IF_NOT_EQUAL_INT(status, keep_alive[i] ? OCS_KEEP_ALIVE : OCS_CLOSE_CONNECTION);
+	}
+	FAIL_IF_NOT_EQUAL_INT(called, 0);
+	FAIL_IF_NOT_STRSTR(fast[0], "HTTP/1.1 200 OK\r\n");
+	FAIL_IF_NOT_STRSTR(fast[0], "Content-Length: 2\r\n");
+	FAIL_IF_NOT_STRSTR(fast[0], "\r\n\r\nOK");
+	FAIL_IF_STRSTR(fast[1], "\r\n\r\nOK");
+	FAIL_IF_NOT_STRSTR(fast[2], "Connection: Close\r\n");
+	FAIL_IF_NOT_STRSTR(fast[3], "HTTP/1.0 200 OK\r\n");
+	FAIL_IF_NOT_STRSTR(fast[6], "HTTP/1.1 410 ");
+	FAIL_IF_NOT_STRSTR(fast[7], "Content-Type: text/plain\r\n");
+
+	onion_url_set_stats(urls, 1); // The handlers are called, to count them
+	for (i=0;i<8;i++){
+		char *normal=answer(lp, requests[i], &status);
+		FAIL_IF_NOT_EQUAL_INT(status, keep_alive[i] ? OCS_KEEP_ALIVE : OCS_CLOSE_CONNECTION);
+		FAIL_IF_NOT_EQUAL_STR(fast[i], normal);
+		free(normal);
+		free(fast[i]);
+	}
+	FAIL_IF_NOT_EQUAL_INT(called, 1);
+
+	onion_free(server);
+	onion_response_prerendered_free(p);
+
+	END_LOCAL();
+}
+
+/// The root handler itself, and the stats as for any response.
+void t02_root_and_stats(){
+	INIT_LOCAL();
+
+	onion *server=onion_new(0);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, lp);
+	onion_set_root_handler(server, onion_handler_static("I am fine", 200));
+
+	int i, status;
+	for (i=0;i<3;i++){
+		char *data=answer(lp, "GET /anything HTTP/1.1\n\n", &status);
+		FAIL_IF_NOT_EQUAL_INT(status, OCS_KEEP_ALIVE);
+		FAIL_IF_NOT_STRSTR(data, "\r\n\r\nI am fine");
+		free(data);
+	}
+	onion_stats stats;
+	onion_get_stats(server, &stats);
+	FAIL_IF_NOT_EQUAL_INT(stats.requests, 3);
+	FAIL_IF_NOT_EQUAL_INT(stats.responses[200], 3);
+	FAIL_IF_NOT_EQUAL_INT(stats.bytes_out, 3*9);
+
+	onion_free(server);
+
+	END_LOCAL();
+}
+
+int connect_to(const char *addr, const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+	if (getaddrinfo(addr,port,&hints,&server)<0){
+		ONION_ERROR("Error getting server info");
+		return -1;
+	}
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+		ONION_ERROR("Error connecting to server %s:%s",addr,port);
+	}
+	freeaddrinfo(server);
+
+	return fd;
+}
+
+/// Pipelined health checks and normal requests at a server with workers, answered in order.
+void t03_pipelined(){
+	INIT_LOCAL();
+
+	onion *o=onion_new(O_POOL|O_NONBLOCKING|O_DETACH_LISTEN);
+	onion_set_hostname(o, "localhost");
+	onion_set_port(o, PORT);
+	onion_set_max_threads(o, 2);
+	onion_set_workers(o, 2, 16);
+	onion_url *urls=onion_root_url(o);
+	onion_url_add_static(urls, "healthz", "OK", 200);
+	onion_url_add(urls, "hello", hello);
+	FAIL_IF(onion_listen(o));
+	usleep(100000);
+
+	int fd=connect_to("localhost", PORT);
+	FAIL_IF(fd<0);
+	char request[4096]="";
+	int i;
+	for (i=0;i<20;i++)
+		strcat(request, (i%3==1) ? "GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n" : "GET /healthz HTTP/1.1\r\nHost: localhost\r\n\r\n");
+	FAIL_IF_NOT_EQUAL_INT(write(fd, request, strlen(request)), strlen(request));
+
+	char buffer[16*1024];
+	size_t size=0;
+	int responses=0;
+	while (responses<20 && size<sizeof(buffer)-1){
+		ssize_t r=read(fd, buffer+size, sizeof(buffer)-1-size);
+		if (r<=0)
+			break;
+		size+=r;
+		buffer[size]='\0';
+		responses=0;
+		char *p=buffer;
+		while ((p=strstr(p, "HTTP/1.1 200 OK"))){
+			responses++;
+			p++;
+		}
+	}
+	FAIL_IF_NOT_EQUAL_INT(responses, 20);
+	char *p=buffer;
+	for (i=0;i<20;i++){ // In order
+		p=strstr(p, "\r\n\r\n");
+		FAIL_IF_NOT(p);
+		if (!p)
+			break;
+		p+=4;
+		const char *body=(i%3==1) ? "hello" : "OK";
+		FAIL_IF_NOT_EQUAL_INT(strncmp(p, body, strlen(body)), 0);
+	}
+	close(fd);
+
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	signal(SIGPIPE, SIG_IGN);
+
+	t01_same_response();
+	t02_root_and_stats();
+	t03_pipelined();
+
+	END();
+}
@@ -0,0 +1,245 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <security/pam_appl.h>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <onion/codecs.h>
+#include <onion/handler.h>
+#include <onion/request.h>
+#include <onion/client.h>
+#include <onion/listen_point.h>
+#include <onion/types_internal.h>
+#include <onion/handlers/static.h>
+#include <onion/handlers/auth_pam.h>
+
+#include "../ctest.h"
+#include "buffer_listen_point.h"
+
+#define FILL(a,b) onion_request_write(a,b,strlen(b))
+
+/// PAM stub: "user" and "locked" have password "secret", but "locked" can not log in.
+struct pam_handle{
+	const struct pam_conv *conv;
+	char user[64];
+};
+
+int pam_calls=0;      ///< pam_authenticate calls. Atomic.
+int pam_inside=0;     ///< pam_authenticate calls running now. Atomic.
+int pam_max_inside=0; ///< Most at once
+int pam_delay_ms=0;   ///< Each takes this long, as a slow PAM module.
+
+int pam_start(const char *service_name, const char *user, const struct pam_conv *pam_conversation, pam_handle_t **pamh){
+	*pamh=calloc(1, sizeof(pam_handle_t));
+	(*pamh)->conv=pam_conversation;
+	snprintf((*pamh)->user, sizeof((*pamh)->user), "%s", user);
+	return PAM_SUCCESS;
+}
+
+int pam_authenticate(pam_handle_t *pamh, int flags){
+	__sync_fetch_and_add(&pam_calls, 1);
+	int inside=__sync_add_and_fetch(&pam_inside, 1);
+	int max;
+	while ((max=pam_max_inside)<inside && !__sync_bool_compare_and_swap(&pam_max_inside, max, inside))
+		;
+	usleep(pam_delay_ms*1000);
+	__sync_fetch_and_sub(&pam_inside, 1);
+
+	struct pam_message message={ 1, "Password: " };
+	const struct pam_message *messages=&message;
+	struct pam_response *response=NULL;
+	int ret=pamh->conv->conv(1, &messages, &response, pamh->conv->appdata_ptr);
+	if (ret!=PAM_SUCCESS)
+		return ret;
+	if (strcmp(response->resp, "secret")!=0 || (strcmp(pamh->user, "user")!=0 && strcmp(pamh->user, "locked")!=0))
+		ret=PAM_AUTH_ERR;
+	free(response->resp);
+	free(response);
+	return ret;
+}
+
+int pam_acct_mgmt(pam_handle_t *pamh, int flags){
+	return strcmp(pamh->user, "locked")==0 ? PAM_AUTH_ERR : PAM_SUCCESS;
+}
+
+int pam_end(pam_handle_t *pamh, int pam_status){
+	free(pamh);
+	return PAM_SUCCESS;
+}
+
+/// The Authorization header value for those credentials, to be freed.
+char *basic(const char *credentials){
+	char *b64=onion_base64_encode(credentials, strlen(credentials));
+	char *end=b64+strlen(b64);
+	while (end>b64 && (end[-1]=='\n' || end[-1]=='\r'))
+		*--end='\0';
+	char *ret=malloc(strlen(b64)+8);
+	sprintf(ret, "Basic %s", b64);
+	free(b64);
+	return ret;
+}
+
+/// Status code of a GET with those credentials, or none if NULL.
+int get(onion_listen_point *lp, const char *credentials){
+	char request[512];
+	if (credentials){
+		char *auth=basic(credentials);
+		snprintf(request, sizeof(request), "GET / HTTP/1.1\nAuthorization: %s\n\n", auth);
+		free(auth);
+	}
+	else
+		snprintf(request, sizeof(request), "GET / HTTP/1.1\n\n");
+	onion_request *req=onion_request_new(lp);
+	FILL(req, request);
+	const char *data=onion_buffer_listen_point_get_buffer_data(req);
+	int code=(strncmp(data, "HTTP/1.1 ", 9)==0) ? atoi(data+9) : 0;
+	onion_request_free(req);
+	return code;
+}
+
+/// Good and failed verifications kept until they expire, or are the least recently used.
+void t01_cache(){
+	INIT_LOCAL();
+	onion *server=onion_new(0);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, lp);
+	onion_handler *auth=onion_handler_auth_pam("test", "onion-test", onion_handler_static("ok", 200));
+	onion_set_root_handler(server, auth);
+	pam_calls=0;
+	pam_delay_ms=0;
+
+	FAIL_IF_NOT_EQUAL_INT(get(lp, NULL), 401);
+	FAIL_IF_NOT_EQUAL_INT(pam_calls, 0);
+
+	// No cache, PAM each time
+	FAIL_IF_NOT_EQUAL_INT(get(lp, "user:secret"), 200);
+	FAIL_IF_NOT_EQUAL_INT(get(lp, "user:secret"), 200);
+	FAIL_IF_NOT_EQUAL_INT(pam_calls, 2);
+
+	onion_handler_auth_pam_set_cache(auth, 2, 300, 300);
+	FAIL_IF_NOT_EQUAL_INT(get(lp, "user:secret"), 200);
+	FAIL_IF_NOT_EQUAL_INT(get(lp, "user:secret"), 200);
+	FAIL_IF_NOT_EQUAL_INT(pam_calls, 3);
+	FAIL_IF_NOT_EQUAL_INT(get(lp, "user:wrong"), 401);
+	FAIL_IF_NOT_EQUAL_INT(get(lp, "user:wrong"), 401);
+	FAIL_IF_NOT_EQUAL_INT(pam_calls, 4);
+	FAIL_IF_NOT_EQUAL_INT(get(lp, "locked:secret"), 401);
+	FAIL_IF_NOT_EQUAL_INT(pam_calls, 5);
+	// Only 2 kept, so the good one is out.
+	FAIL_IF_NOT_EQUAL_INT(get(lp, "user:secret"), 200);
+	FAIL_IF_NOT_EQUAL_INT(pam_calls, 6);
+	FAIL_IF_NOT_EQUAL_INT(get(lp, "locked:secret"), 401);
+	FAIL_IF_NOT_EQUAL_INT(pam_calls, 6);
+
+	usleep(350000); // All expired
+	FAIL_IF_NOT_EQUAL_INT(get(lp, "user:secret"), 200);
+	FAIL_IF_NOT_EQUAL_INT(get(lp, "user:wrong"), 401);
+	FAIL_IF_NOT_EQUAL_INT(pam_calls, 8);
+
+	onion_free(server);
+	END_LOCAL();
+}
+
+/// Port of the first listen point of a server listening at port 0. Once listening.
+void listen_port(onion *o, char *port, size_t size){
+	struct sockaddr_storage addr;
+	socklen_t len=sizeof(addr);
+	int p=0;
+	if (getsockname(onion_get_listen_point(o, 0)->listenfd, (struct sockaddr*)&addr, &len)==0)
+		p=ntohs(addr.ss_family==AF_INET6 ? ((struct sockaddr_in6*)&addr)->sin6_port : ((struct sockaddr_in*)&addr)->sin_port);
+	snprintf(port, size, "%d", p);
+}
+
+void *listen_thread_f(void *o){
+	onion_listen((onion*)o);
+	return NULL;
+}
+
+char port[16];
+
+void store_code(void *code, onion_client_call *call){
+	*(int*)code=onion_client_call_get_code(call);
+}
+
+/// A client thread, that GETs with good credentials and stores the code.
+void *client_thread_f(void *code){
+	onion_client *client=onion_client_new();
+	char url[64];
+	snprintf(url, sizeof(url), "http://localhost:%s/", port);
+	onion_client_call *call=onion_client_call_new(client, "GET", url);
+	char *auth=basic("user:secret");
+	onion_client_call_set_header(call, "Authorization", auth);
+	free(auth);
+	onion_client_call_start(call, NULL, store_code, code);
+	onion_client_free(client);
+	return NULL;
+}
+
+/// Slow PAM calls at the workers, while the single poller thread goes on with other requests.
+void t02_workers(){
+	INIT_LOCAL();
+	onion *o=onion_new(O_POOL);
+	onion_set_max_threads(o, 1);
+	onion_set_port(o, "0");
+	onion_handler *auth=onion_handler_auth_pam("test", "onion-test", onion_handler_static("ok", 200));
+	onion_handler_auth_pam_set_workers(auth, 3);
+	onion_set_root_handler(o, auth);
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, o);
+	sleep(1);
+	listen_port(o, port, sizeof(port));
+	pam_calls=0;
+	pam_max_inside=0;
+	pam_delay_ms=300;
+
+	pthread_t clients[3];
+	int codes[3]={0,0,0};
+	int i;
+	for (i=0;i<3;i++)
+		pthread_create(&clients[i], NULL, client_thread_f, &codes[i]);
+	for (i=0;i<3;i++){
+		pthread_join(clients[i], NULL);
+		FAIL_IF_NOT_EQUAL_INT(codes[i], 200);
+	}
+	FAIL_IF_NOT_EQUAL_INT(pam_calls, 3);
+	FAIL_IF(pam_max_inside<2); // At the poller thread they would be one after the other
+
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	signal(SIGPIPE, SIG_IGN);
+
+	t01_cache();
+	t02_workers();
+
+	END();
+}
@@ -0,0 +1,49 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+#ifndef __PAM_STUB_APPL_H__
+#define __PAM_STUB_APPL_H__
+
+/// Just what auth_pam.c uses of PAM, so it can be tested with 64-auth-pam.c stubs, without libpam.
+
+#define PAM_SUCCESS 0
+#define PAM_BUF_ERR 5
+#define PAM_AUTH_ERR 7
+
+typedef struct pam_handle pam_handle_t;
+
+struct pam_message{
+	int msg_style;
+	const char *msg;
+};
+
+struct pam_response{
+	char *resp;
+	int resp_retcode;
+};
+
+struct pam_conv{
+	int (*conv)(int num_msg, const struct pam_message **msg, struct pam_response **resp, void *appdata_ptr);
+	void *appdata_ptr;
+};
+
+int pam_start(const char *service_name, const char *user, const struct pam_conv *pam_conversation, pam_handle_t **pamh);
+int pam_authenticate(pam_handle_t *pamh, int flags);
+int pam_acct_mgmt(pam_handle_t *pamh, int flags);
+int pam_end(pam_handle_t *pamh, int pam_status);
+
+#endif
@@ -66,12 +66,51 @@ void t02_dup(){
 	END_LOCAL();
 }
 
+void t03_move(){
+	INIT_LOCAL();
+	
+	Onion::Dict normal;
+	normal.add("Hello", "World");
+	onion_dict *d=normal.c_handler();
+	
+	Onion::Dict moved(std::move(normal));
+	FAIL_IF_NOT_EQUAL(moved.c_handler(), d);
+	FAIL_IF_NOT_EQUAL_STRING(moved.get("Hello"), "World");
+	
+	Onion::Dict other;
+	other=std::move(moved);
+	FAIL_IF_NOT_EQUAL(other.c_handler(), d);
+	FAIL_IF_NOT_EQUAL_STRING(other["Hello"], "World");
+	
+	END_LOCAL();
+}
+
+void t04_views(){
+	INIT_LOCAL();
+	
+	Onion::Dict dict;
+	dict.add("Hello", "World");
+	
+	std::optional<std::string_view> v=dict.find("Hello");
+	FAIL_IF_NOT(v.has_value());
+	FAIL_IF_NOT(*v=="World");
+	FAIL_IF_NOT_EQUAL(v->data(), dict.get_c_str("Hello")); // The string at the dict, no copies
+	FAIL_IF(dict.find("World").has_value());
+	std::string key("Hello, World");
+	FAIL_IF_NOT(dict.find(std::string_view(key).substr(0,5)).has_value()); // Not \0 ended
+	FAIL_IF_NOT(dict.view("Bye", "none")=="none");
+	FAIL_IF_NOT(dict.has("Hello"));
+	
+	END_LOCAL();
+}
 
 int main(int argc, char **argv){
   START();
 	INFO("Remember to check with valgrind");
 	t01_basic();
 	t02_dup();
+	t03_move();
+	t04_views();
 
 	
 	END();
@@ -0,0 +1,170 @@
+#include "../ctest.h"
+
+#include <bindings/cpp/onion.hpp>
+#include <bindings/cpp/response.hpp>
+#include <bindings/cpp/url.hpp>
+#include <bindings/cpp/request.hpp>
+#include <onion/block.h>
+#include <string.h>
+
+extern "C"{
+#include "../01-internal/buffer_listen_point.h"
+}
+
+onion_connection_status hello(Onion::Request &req, Onion::Response &res){
+	res.write("hello");
+	return OCS_PROCESSED;
+}
+
+onion_connection_status bye(Onion::Request &req, Onion::Response &res){
+	res.write("bye");
+	return OCS_PROCESSED;
+}
+
+static constexpr Onion::Route routes[]={
+	{"^hello$", hello},
+	{"^bye$", bye},
+};
+
+/// Writes a GET of that path, returns the response body.
+std::string get(onion_listen_point *lp, const char *path){
+	onion_request *req=onion_request_new(lp);
+	std::string request=std::string("GET ")+path+" HTTP/1.0\r\n\r\n";
+	onion_request_write(req, request.c_str(), request.size());
+	const char *data=onion_buffer_listen_point_get_buffer_data(req);
+	const char *body=strstr(data, "\r\n\r\n");
+	std::string ret=body ? body+4 : "";
+	onion_request_free(req);
+	return ret;
+}
+
+/// Lambdas, small and big, functions and route tables.
+void t01_callables(){
+	INIT_LOCAL();
+
+	onion *server=onion_new(O_ONE);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, lp);
+	Onion::Url url(onion_root_url(server));
+
+	int calls=0;
+	auto small=[&calls](Onion::Request &req, Onion::Response &res){
+		calls++;
+		res.write("small");
+		return OCS_PROCESSED;
+	};
+	FAIL_IF_NOT(Onion::HandlerCallable<decltype(small)>::inlined); // At the handler data, no allocation
+	FAIL_IF(url.add("^small$", small));
+
+	std::string big(64, 'x');
+	FAIL_IF(url.add("^big$", [big, &calls](Onion::Request &req, Onion::Response &res){
+		calls++;
+		res.write(big);
+		return OCS_PROCESSED;
+	}));
+	FAIL_IF(url.add("^error$", [](Onion::Request &req, Onion::Response &res) -> onion_connection_status {
+		throw Onion::HttpInternalError("Oops");
+	}));
+	FAIL_IF(url.add("^fn$", hello));
+	FAIL_IF(url.add(routes));
+
+	FAIL_IF_NOT_EQUAL_STRING(get(lp, "/small").c_str(), "small");
+	FAIL_IF_NOT_EQUAL_STRING(get(lp, "/big").c_str(), big.c_str());
+	FAIL_IF_NOT_EQUAL_INT(calls, 2);
+	FAIL_IF_NOT_EQUAL_STRING(get(lp, "/error").c_str(), "Oops");
+	FAIL_IF_NOT_EQUAL_STRING(get(lp, "/fn").c_str(), "hello");
+	FAIL_IF_NOT_EQUAL_STRING(get(lp, "/hello").c_str(), "hello");
+	FAIL_IF_NOT_EQUAL_STRING(get(lp, "/bye").c_str(), "bye");
+
+	onion_free(server);
+
+	END_LOCAL();
+}
+
+/// Stream output is kept at the put area, and keeps its order with direct and C writes.
+void t02_stream(){
+	INIT_LOCAL();
+
+	onion *server=onion_new(O_ONE);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, lp);
+	Onion::Url url(onion_root_url(server));
+
+	std::string big(3000, 'b');
+	FAIL_IF(url.add("^stream$", [&big](Onion::Request &req, Onion::Response &res){
+		res<<'a'<<1<<' ';
+		res.write("direct ");
+		res<<"stream ";
+		onion_response_write0(res.c_handler(), "c ");
+		res.printf("%d-%s ", 42, "printf");
+		res<<big;
+		res<<std::string(2000, 'c')<<std::endl;
+		return OCS_PROCESSED;
+	}));
+	std::string expected="a1 direct stream c 42-printf "+big+std::string(2000, 'c')+"\n";
+	FAIL_IF_NOT_EQUAL_STRING(get(lp, "/stream").c_str(), expected.c_str());
+
+	onion_free(server);
+
+	END_LOCAL();
+}
+
+struct Page{
+	int64_t limit=20;
+	int64_t offset=0;
+	double x=0;
+	bool desc=false;
+	std::optional<std::string_view> q;
+};
+
+static constexpr auto page_params=Onion::params(
+	Onion::param("limit", &Page::limit),
+	Onion::param("offset", &Page::offset),
+	Onion::param("x", &Page::x),
+	Onion::param("desc", &Page::desc),
+	Onion::param("q", &Page::q));
+
+/// Typed parameters and schemas: missing ones keep the default, malformed ones are reported.
+void t03_params(){
+	INIT_LOCAL();
+
+	onion *server=onion_new(O_ONE);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, lp);
+	Onion::Url url(onion_root_url(server));
+
+	FAIL_IF(url.add("^typed$", [](Onion::Request &req, Onion::Response &res){
+		res<<req.query<int64_t>("limit", 20)<<' '<<req.query<double>("x", -1.0)<<' ';
+		res<<(req.query<int>("bad") ? "some" : "none")<<' '<<req.query<bool>("desc").value_or(false);
+		return OCS_PROCESSED;
+	}));
+	FAIL_IF(url.add("^schema$", [](Onion::Request &req, Onion::Response &res){
+		Page page;
+		const char *bad=req.parseQuery(page_params, page);
+		if (bad)
+			res<<"bad "<<bad;
+		else
+			res<<page.limit<<' '<<page.offset<<' '<<page.x<<' '<<page.desc<<' '<<page.q.value_or("-");
+		return OCS_PROCESSED;
+	}));
+
+	FAIL_IF_NOT_EQUAL_STRING(get(lp, "/typed?limit=5&x=1.5&bad=1x&desc=on").c_str(), "5 1.5 none 1");
+	FAIL_IF_NOT_EQUAL_STRING(get(lp, "/typed?limit=-").c_str(), "20 -1 none 0");
+	FAIL_IF_NOT_EQUAL_STRING(get(lp, "/schema?offset=40&q=onion&desc=yes").c_str(), "20 40 0 1 onion");
+	FAIL_IF_NOT_EQUAL_STRING(get(lp, "/schema?limit=10&x=2.25").c_str(), "10 0 2.25 0 -");
+	FAIL_IF_NOT_EQUAL_STRING(get(lp, "/schema?limit=10&offset=ten").c_str(), "bad offset");
+
+	onion_free(server);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	INFO("Remember to check with valgrind");
+	t01_callables();
+	t02_stream();
+	t03_params();
+
+	END();
+}
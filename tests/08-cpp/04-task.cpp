@@ -0,0 +1,193 @@
+#include "../ctest.h"
+
+#include <bindings/cpp/onion.hpp>
+#include <bindings/cpp/response.hpp>
+#include <bindings/cpp/url.hpp>
+#include <bindings/cpp/request.hpp>
+#include <bindings/cpp/task.hpp>
+#include <onion/block.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <thread>
+
+extern "C"{
+#include "../01-internal/buffer_listen_point.h"
+}
+
+using namespace std::chrono_literals;
+
+int connect_to(const char *addr, const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+
+	if (getaddrinfo(addr,port,&hints,&server)<0){
+		ONION_ERROR("Error getting server info");
+		return -1;
+	}
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+		ONION_ERROR("Error connecting to server %s:%s",addr,port);
+	}
+
+	freeaddrinfo(server);
+
+	return fd;
+}
+
+/// Sends a HTTP/1.0 GET of that path.
+int request(int fd, const char *path){
+	std::string get=std::string("GET ")+path+" HTTP/1.0\r\n\r\n";
+	return write(fd, get.c_str(), get.size())==(ssize_t)get.size();
+}
+
+/// Reads until the connection is closed, and returns the body.
+std::string read_body(int fd){
+	std::string data;
+	char buffer[1024];
+	ssize_t r;
+	while ( (r=read(fd, buffer, sizeof(buffer))) > 0 )
+		data.append(buffer, r);
+	close(fd);
+	size_t body=data.find("\r\n\r\n");
+	return body==std::string::npos ? "" : data.substr(body+4);
+}
+
+std::string get(const char *path){
+	int fd=connect_to("localhost", "8120");
+	if (fd<0 || !request(fd, path))
+		return "";
+	return read_body(fd);
+}
+
+Onion::Task hello(Onion::Request &req, Onion::Response &res){
+	res.write("hello");
+	co_return OCS_PROCESSED;
+}
+
+Onion::Task sleepy(Onion::Request &req, Onion::Response &res){
+	co_await Onion::Sleep(300ms);
+	res.write("awake");
+	co_return OCS_PROCESSED;
+}
+
+Onion::Task failing(Onion::Request &req, Onion::Response &res){
+	co_await Onion::Sleep(10ms);
+	throw Onion::HttpInternalError("Oops");
+}
+
+/// Values completed at another thread, as a database client would.
+Onion::Task completed(Onion::Request &req, Onion::Response &res){
+	Onion::Completion<std::string> value;
+	std::thread th([&value]{
+		std::this_thread::sleep_for(50ms);
+		value.complete("completed");
+	});
+	th.detach();
+	std::string v=co_await value;
+	res.write(v);
+	co_return OCS_PROCESSED;
+}
+
+void *listen_thread_f(void *o){
+	onion_listen((onion*)o);
+	return NULL;
+}
+
+/// Awaiting frees the only thread, and tasks are resumed at the poller.
+void t01_tasks_at_poller(){
+	INIT_LOCAL();
+
+	onion *o=onion_new(O_POOL);
+	onion_set_max_threads(o, 1);
+	onion_set_port(o, "8120");
+	Onion::Url url(onion_root_url(o));
+	FAIL_IF(url.add("^hello$", hello));
+	FAIL_IF(url.add("^sleep$", sleepy));
+	FAIL_IF(url.add("^error$", failing));
+	FAIL_IF(url.add("^completed$", completed));
+	int n=0;
+	FAIL_IF(url.add("^lambda$", [&n](Onion::Request &req, Onion::Response &res) -> Onion::Task {
+		co_await Onion::Sleep(0ms);
+		n++;
+		res.write("lambda");
+		co_return OCS_PROCESSED;
+	}));
+
+	pthread_t th;
+	pthread_create(&th, NULL, listen_thread_f, o);
+	sleep(1);
+
+	FAIL_IF_NOT_EQUAL_STRING(get("/hello").c_str(), "hello");
+	FAIL_IF_NOT_EQUAL_STRING(get("/completed").c_str(), "completed");
+	FAIL_IF_NOT_EQUAL_STRING(get("/error").c_str(), "Oops");
+	FAIL_IF_NOT_EQUAL_STRING(get("/lambda").c_str(), "lambda");
+	FAIL_IF_NOT_EQUAL_INT(n, 1);
+
+	// Served while the other sleeps
+	int sleepfd=connect_to("localhost", "8120");
+	FAIL_IF_NOT(request(sleepfd, "/sleep"));
+	usleep(50000);
+	auto start=std::chrono::steady_clock::now();
+	FAIL_IF_NOT_EQUAL_STRING(get("/hello").c_str(), "hello");
+	FAIL_IF(std::chrono::steady_clock::now()-start>200ms);
+	FAIL_IF_NOT_EQUAL_STRING(read_body(sleepfd).c_str(), "awake");
+
+	onion_listen_stop(o);
+	pthread_join(th, NULL);
+	onion_free(o);
+
+	END_LOCAL();
+}
+
+/// Writes a GET of that path, returns the response body.
+std::string get(onion_listen_point *lp, const char *path){
+	onion_request *req=onion_request_new(lp);
+	std::string request=std::string("GET ")+path+" HTTP/1.0\r\n\r\n";
+	onion_request_write(req, request.c_str(), request.size());
+	const char *data=onion_buffer_listen_point_get_buffer_data(req);
+	const char *body=strstr(data, "\r\n\r\n");
+	std::string ret=body ? body+4 : "";
+	onion_request_free(req);
+	return ret;
+}
+
+/// Out of a poller, the handler thread waits for the task.
+void t02_tasks_blocking(){
+	INIT_LOCAL();
+
+	onion *server=onion_new(O_ONE);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, lp);
+	Onion::Url url(onion_root_url(server));
+	FAIL_IF(url.add("^hello$", hello));
+	FAIL_IF(url.add("^sleep$", sleepy));
+	FAIL_IF(url.add("^completed$", completed));
+
+	FAIL_IF_NOT_EQUAL_STRING(get(lp, "/hello").c_str(), "hello");
+	FAIL_IF_NOT_EQUAL_STRING(get(lp, "/sleep").c_str(), "awake");
+	FAIL_IF_NOT_EQUAL_STRING(get(lp, "/completed").c_str(), "completed");
+
+	onion_free(server);
+
+	END_LOCAL();
+}
+
+int main(int argc, char **argv){
+	START();
+	INFO("Remember to check with valgrind");
+	t01_tasks_at_poller();
+	t02_tasks_blocking();
+
+	END();
+}
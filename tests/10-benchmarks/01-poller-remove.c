@@ -0,0 +1,106 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+/**
+ * @short Measures the cost of removing slots from the poller, with a growing number of slots.
+ * 
+ * Each slot is an eventfd. They are removed in random order, as when connections close. 
+ * The cost per remove should stay flat as the number of slots grows.
+ * 
+ * The number of slots is limited by RLIMIT_NOFILE, which is raised to the hard limit if possible.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+#include <onion/poller.h>
+#include <onion/log.h>
+
+static int64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+static int never_called(void *_){
+	return -1;
+}
+
+static void close_fd(void *fd){
+	close((intptr_t)fd);
+}
+
+/// Adds n eventfd slots, and returns ns per remove, or -1 on error.
+static double bench_remove(int n){
+	onion_poller *p=onion_poller_new(n);
+	int *fds=malloc(sizeof(int)*n);
+	int i;
+	for (i=0;i<n;i++){
+		fds[i]=eventfd(0, EFD_CLOEXEC);
+		if (fds[i]<0){
+			ONION_ERROR("Could not create eventfd number %d", i);
+			n=i;
+			break;
+		}
+		onion_poller_slot *slot=onion_poller_slot_new(fds[i], never_called, NULL);
+		onion_poller_slot_set_shutdown(slot, close_fd, (void*)(intptr_t)fds[i]);
+		onion_poller_add(p, slot);
+	}
+	for (i=n-1;i>0;i--){ // Shuffle, so close order is not add order
+		int j=rand()%(i+1);
+		int t=fds[i]; fds[i]=fds[j]; fds[j]=t;
+	}
+	
+	int64_t start=now_ns();
+	for (i=0;i<n;i++)
+		onion_poller_remove(p, fds[i]);
+	int64_t end=now_ns();
+	
+	free(fds);
+	onion_poller_free(p);
+	return n ? ((double)(end-start))/n : -1;
+}
+
+int main(int argc, char **argv){
+	struct rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur=rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	int max_slots=rl.rlim_cur-64;
+	
+	onion_log_flags=OF_INIT|OF_NOINFO;
+	
+	int sizes[]={1000, 10000, 100000};
+	int i;
+	printf("%10s %16s\n", "slots", "ns/remove");
+	for (i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++){
+		int n=sizes[i];
+		if (n>max_slots){
+			printf("%10d %16s (RLIMIT_NOFILE is %d)\n", n, "skipped", (int)rl.rlim_cur);
+			continue;
+		}
+		printf("%10d %16.1f\n", n, bench_remove(n));
+	}
+	
+	return 0;
+}
@@ -0,0 +1,93 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+/**
+ * @short Measures inserts and lookups of the dict backends, on dicts the size of the headers and bigger.
+ *
+ *   ./03-dict
+ *
+ * Each round creates a dict, adds n header like keys with OD_DUP_ALL, as onion_response_set_header,
+ * gets each of them and frees the dict, back to the pool.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <onion/dict.h>
+#include <onion/log.h>
+
+/// Lookups, and keys added, per round
+#define BENCH_OPS 1000000
+
+static int64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+/// Returns ns per key, insert and lookup
+static double bench_dict(int flags, int n, char **keys){
+	int rounds=BENCH_OPS/n;
+	int r, i;
+	long found=0;
+	int64_t start=now_ns();
+	for (r=0;r<rounds;r++){
+		onion_dict *d=onion_dict_new();
+		onion_dict_set_flags(d, flags);
+		for (i=0;i<n;i++)
+			onion_dict_add(d, keys[i], "text/html; charset=utf-8", OD_DUP_ALL|OD_REPLACE);
+		for (i=0;i<n;i++)
+			found+=onion_dict_get(d, keys[(i*7)%n])!=NULL;
+		onion_dict_free(d);
+	}
+	int64_t t=now_ns()-start;
+	if (found!=(long)rounds*n)
+		ONION_ERROR("Not all found");
+	return ((double)t)/((double)rounds*n);
+}
+
+int main(int argc, char **argv){
+	onion_log_flags=OF_INIT|OF_NOINFO;
+	static const char *names[]={ "Content-Type", "Content-Length", "Server", "Date", "Etag", "Cache-Control", 
+		"Connection", "Vary", "Accept-Ranges", "Last-Modified", "Set-Cookie", "Location" };
+	char *keys[64];
+	int i;
+	for (i=0;i<64;i++){
+		char tmp[64];
+		if (i<12)
+			snprintf(tmp, sizeof(tmp), "%s", names[i]);
+		else
+			snprintf(tmp, sizeof(tmp), "X-Header-%d", i);
+		keys[i]=strdup(tmp);
+	}
+
+	int sizes[]={ 4, 8, 16, 32, 64 };
+	printf("%8s %12s %12s %12s %12s\n", "keys", "tree ns", "flat ns", "hash ns", "icase flat");
+	for (i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++){
+		int n=sizes[i];
+		printf("%8d %12.1f %12.1f %12.1f %12.1f\n", n, bench_dict(0, n, keys), bench_dict(OD_FLAT, n, keys), 
+					 bench_dict(OD_HASH, n, keys), bench_dict(OD_FLAT|OD_ICASE, n, keys));
+	}
+
+	for (i=0;i<64;i++)
+		free(keys[i]);
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+/**
+ * @short Measures the json parser, copying and in place, on some usual payload shapes.
+ *
+ *   ./04-json
+ *
+ * Each round parses the payload to a dict and frees it. In place parses a fresh copy of the payload
+ * each round, as it modifies it; the copy is measured too, and is part of the time, as a body would not need it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <onion/dict.h>
+#include <onion/block.h>
+#include <onion/log.h>
+
+/// Bytes parsed at each measure
+#define BENCH_BYTES (64*1024*1024)
+
+static int64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+/// Returns MB/s
+static double bench_json(const char *json, int inplace){
+	size_t l=strlen(json);
+	int rounds=BENCH_BYTES/l+1;
+	char *copy=malloc(l+1);
+	int r, errors=0;
+	int64_t start=now_ns();
+	for (r=0;r<rounds;r++){
+		onion_dict *d;
+		if (inplace){
+			memcpy(copy, json, l+1);
+			d=onion_dict_from_json_inplace(copy, l);
+		}
+		else
+			d=onion_dict_from_json(json);
+		if (d)
+			onion_dict_free(d);
+		else
+			errors++;
+	}
+	int64_t t=now_ns()-start;
+	free(copy);
+	if (errors)
+		ONION_ERROR("Could not parse");
+	return ((double)l*rounds)/(t/1e9)/(1024*1024);
+}
+
+/// A login or form like object
+static char *small_object(){
+	return strdup("{\"username\":\"someone@example.com\",\"password\":\"secret\",\"remember\":true,\"retries\":3}");
+}
+
+/// An API listing: an array of objects with numbers, strings and nested objects
+static char *listing(){
+	onion_block *b=onion_block_new();
+	onion_block_add_str(b, "{\"total\":500,\"items\":[");
+	int i;
+	for (i=0;i<500;i++){
+		char tmp[256];
+		snprintf(tmp, sizeof(tmp), "%s{\"id\":%d,\"name\":\"Item number %d\",\"price\":%d.%02d,\"tags\":[\"a\",\"b\"],"
+			"\"owner\":{\"id\":%d,\"login\":\"user%d\"}}", i ? "," : "", i, i, i*3, i%100, i%17, i%17);
+		onion_block_add_str(b, tmp);
+	}
+	onion_block_add_str(b, "]}");
+	char *ret=strdup(onion_block_data(b));
+	onion_block_free(b);
+	return ret;
+}
+
+/// Few keys with long text values, some escapes
+static char *long_strings(){
+	onion_block *b=onion_block_new();
+	onion_block_add_str(b, "{");
+	int i, j;
+	for (i=0;i<8;i++){
+		char tmp[64];
+		snprintf(tmp, sizeof(tmp), "%s\"text%d\":\"", i ? "," : "", i);
+		onion_block_add_str(b, tmp);
+		for (j=0;j<64;j++)
+			onion_block_add_str(b, j%16 ? "Lorem ipsum dolor sit amet, consectetur adipiscing elit. " : "Quoted \\\"text\\\"\\n");
+		onion_block_add_str(b, "\"");
+	}
+	onion_block_add_str(b, "}");
+	char *ret=strdup(onion_block_data(b));
+	onion_block_free(b);
+	return ret;
+}
+
+int main(int argc, char **argv){
+	onion_log_flags=OF_INIT|OF_NOINFO;
+	struct{
+		const char *name;
+		char *json;
+	}payloads[]={ { "small object", small_object() }, { "listing", listing() }, { "long strings", long_strings() } };
+	int i;
+	printf("%14s %10s %12s %12s\n", "payload", "bytes", "copy MB/s", "inplace MB/s");
+	for (i=0;i<sizeof(payloads)/sizeof(payloads[0]);i++){
+		printf("%14s %10d %12.1f %12.1f\n", payloads[i].name, (int)strlen(payloads[i].json), 
+					 bench_json(payloads[i].json, 0), bench_json(payloads[i].json, 1));
+		free(payloads[i].json);
+	}
+	return 0;
+}
@@ -0,0 +1,606 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+/**
+ * @short Measures the whole server over the loopback: requests per second, latency percentiles and bytes per second.
+ *
+ * It starts the server at each mode, O_ONE_LOOP, O_POLL and O_POOL, on HTTP and on HTTPS, with keep alive
+ * and with a new connection per request, and drives it with an epoll load generator of many non blocking
+ * connections at some threads. The results are one JSON object, at stdout or at the -o file:
+ *
+ *   ./05-http-load -t 5 -c 128 -g 4 -o http-load.json
+ *
+ * -m selects the modes, for example -m poll,pool, and -T skips HTTPS. poll_nonblocking and poll_edge, not run by
+ * default, are O_POLL with O_NONBLOCKING, with one shot and with edge triggered connections (onion_set_edge_triggered). The latency is from the start of the
+ * request until the whole response is read; without keep alive it includes the connect and the handshake.
+ *
+ * O_ONE_LOOP answers one connection at a time and without keep alive, so it is measured with one connection,
+ * reconnecting after each response, as it counts at "reconnects". The client resets the connections it closes,
+ * so the runs do not exhaust the ephemeral ports at TIME_WAIT.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef HAVE_GNUTLS
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#endif
+
+#include <onion/onion.h>
+#include <onion/http.h>
+#include <onion/response.h>
+#include <onion/log.h>
+#ifdef HAVE_GNUTLS
+#include <onion/https.h>
+#endif
+
+/// Default seconds to run each mode
+#define BENCH_SECONDS 2
+/// Default connections of the load generator
+#define BENCH_CONNECTIONS 64
+/// Default threads of the load generator
+#define BENCH_THREADS 2
+/// Size of the body of each response
+#define BODY_SIZE 128
+#define CERTFILE "05-http-load.pem"
+
+#define KEEP_ALIVE_REQUEST "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"
+#define CLOSE_REQUEST "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n"
+
+/// A client connection, and the request on course.
+typedef struct{
+	int fd;
+	int connecting;
+	int reused;       ///< Whether it already had a response, on keep alive
+#ifdef HAVE_GNUTLS
+	gnutls_session_t session;
+	int handshaking;
+#endif
+	size_t sent;      ///< Bytes of the request already written
+	size_t received;  ///< Bytes of the response at buffer
+	int64_t start_ns; ///< When the request was started
+	char buffer[4096];
+}connection;
+
+/// A load generator thread, with its connections and its results.
+typedef struct{
+	pthread_t thread;
+	int epfd;
+	int tls;
+	int keep_alive;
+	uint16_t port;
+	int64_t end_ns;
+	int nconnections;
+	connection *connections;
+	uint32_t *latencies_us;
+	size_t nlatencies;
+	size_t latencies_size;
+	long errors;
+	long reconnects;
+	int64_t bytes;
+}generator;
+
+static int64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+static char body[BODY_SIZE];
+
+/// While the server stops, the connections that the clients reset on course are not logged.
+static int stopping=0;
+
+static void bench_log(onion_log_level level, const char *filename, int lineno, const char *fmt, ...){
+	if (stopping)
+		return;
+	char tmp[512];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+	onion_log_stderr(level, filename, lineno, "%s", tmp);
+}
+
+static onion_connection_status body_handler(void *_, onion_request *req, onion_response *res){
+	onion_response_set_length(res, BODY_SIZE);
+	onion_response_write(res, body, BODY_SIZE);
+	return OCS_PROCESSED;
+}
+
+#ifdef HAVE_GNUTLS
+static gnutls_certificate_credentials_t client_cred=NULL;
+
+/// A self signed certificate and its key, at the same file, as certtool may not be there.
+static int write_certificate(const char *filename){
+	gnutls_x509_privkey_t key;
+	gnutls_x509_crt_t crt;
+	gnutls_x509_privkey_init(&key);
+	gnutls_x509_privkey_generate(key, GNUTLS_PK_RSA, 2048, 0);
+	gnutls_x509_crt_init(&crt);
+	gnutls_x509_crt_set_version(crt, 3);
+	gnutls_x509_crt_set_serial(crt, "\x01", 1);
+	gnutls_x509_crt_set_activation_time(crt, time(NULL)-3600);
+	gnutls_x509_crt_set_expiration_time(crt, time(NULL)+24*3600);
+	gnutls_x509_crt_set_dn_by_oid(crt, GNUTLS_OID_X520_COMMON_NAME, 0, "localhost", strlen("localhost"));
+	gnutls_x509_crt_set_key(crt, key);
+	int r=gnutls_x509_crt_sign2(crt, crt, key, GNUTLS_DIG_SHA256, 0);
+
+	static char pem[16*1024];
+	size_t l1=sizeof(pem), l2;
+	if (r>=0)
+		r=gnutls_x509_crt_export(crt, GNUTLS_X509_FMT_PEM, pem, &l1);
+	l2=sizeof(pem)-l1;
+	if (r>=0)
+		r=gnutls_x509_privkey_export(key, GNUTLS_X509_FMT_PEM, pem+l1, &l2);
+	gnutls_x509_crt_deinit(crt);
+	gnutls_x509_privkey_deinit(key);
+	if (r<0)
+		return -1;
+	FILE *f=fopen(filename, "w");
+	if (!f)
+		return -1;
+	fwrite(pem, 1, l1+l2, f);
+	fclose(f);
+	return 0;
+}
+#endif
+
+/// Sets the epoll interest of the connection.
+static void conn_want(generator *g, connection *c, uint32_t events){
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events=events;
+	ev.data.ptr=c;
+	epoll_ctl(g->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/// Resets the connection, so there is no TIME_WAIT, and frees it.
+static void conn_close(connection *c){
+	if (c->fd<0)
+		return;
+#ifdef HAVE_GNUTLS
+	if (c->session){
+		gnutls_deinit(c->session);
+		c->session=NULL;
+	}
+#endif
+	struct linger l={ 1, 0 };
+	setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+	close(c->fd); // Also out of the epoll
+	c->fd=-1;
+}
+
+/// Connects, non blocking; the request starts now.
+static int conn_open(generator *g, connection *c){
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(g->port);
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+
+	c->start_ns=now_ns();
+	c->sent=c->received=0;
+	c->reused=0;
+	c->fd=socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->fd<0)
+		return -1;
+	int one=1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(c->fd, (struct sockaddr*)&addr, sizeof(addr))<0 && errno!=EINPROGRESS){
+		conn_close(c);
+		return -1;
+	}
+	c->connecting=1;
+#ifdef HAVE_GNUTLS
+	c->session=NULL;
+	c->handshaking=0;
+	if (g->tls){
+		gnutls_init(&c->session, GNUTLS_CLIENT | GNUTLS_NONBLOCK);
+		gnutls_set_default_priority(c->session);
+		gnutls_credentials_set(c->session, GNUTLS_CRD_CERTIFICATE, client_cred);
+		gnutls_transport_set_int(c->session, c->fd);
+		c->handshaking=1;
+	}
+#endif
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events=EPOLLOUT;
+	ev.data.ptr=c;
+	epoll_ctl(g->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+	return 0;
+}
+
+/// Writes some, as send: <0 and errno EAGAIN when it would block.
+static ssize_t conn_write(connection *c, const char *data, size_t len){
+#ifdef HAVE_GNUTLS
+	if (c->session){
+		ssize_t r=gnutls_record_send(c->session, data, len);
+		if (r==GNUTLS_E_AGAIN || r==GNUTLS_E_INTERRUPTED){
+			errno=EAGAIN;
+			return -1;
+		}
+		if (r<0){
+			errno=EIO;
+			return -1;
+		}
+		return r;
+	}
+#endif
+	return send(c->fd, data, len, MSG_NOSIGNAL);
+}
+
+/// Reads some, as recv: 0 at the end, <0 and errno EAGAIN when it would block.
+static ssize_t conn_read(connection *c, char *data, size_t len){
+#ifdef HAVE_GNUTLS
+	if (c->session){
+		ssize_t r=gnutls_record_recv(c->session, data, len);
+		if (r==GNUTLS_E_AGAIN || r==GNUTLS_E_INTERRUPTED){
+			errno=EAGAIN;
+			return -1;
+		}
+		if (r<0){
+			errno=EIO;
+			return -1;
+		}
+		return r;
+	}
+#endif
+	return recv(c->fd, data, len, 0);
+}
+
+/// Whether the buffer has a whole response: the headers and the Content-Length of body. At closes, whether the server closes after it.
+static int conn_response_complete(connection *c, int *closes){
+	char *end=strstr(c->buffer, "\r\n\r\n");
+	if (!end)
+		return 0;
+	*end=0;
+	char *length=strstr(c->buffer, "Content-Length: ");
+	*closes=strstr(c->buffer, "Connection: close")!=NULL;
+	*end='\r';
+	size_t size=(end+4-c->buffer) + (length ? strtoul(length+16, NULL, 10) : 0);
+	return c->received>=size;
+}
+
+static void add_latency(generator *g, int64_t ns){
+	if (g->nlatencies==g->latencies_size){
+		g->latencies_size=g->latencies_size ? g->latencies_size*2 : 64*1024;
+		g->latencies_us=realloc(g->latencies_us, g->latencies_size*sizeof(uint32_t));
+	}
+	g->latencies_us[g->nlatencies++]=ns/1000;
+}
+
+/// All went wrong: a new connection, while there is time. A kept alive connection that the server closed is
+/// not an error, the request goes on at the new one.
+static void conn_error(generator *g, connection *c){
+	int64_t start_ns=c->start_ns;
+	int reconnect=c->reused && c->received==0;
+	if (reconnect)
+		g->reconnects++;
+	else
+		g->errors++;
+	conn_close(c);
+	if (now_ns()<g->end_ns && conn_open(g, c)==0 && reconnect)
+		c->start_ns=start_ns;
+}
+
+/// Advances the connection as far as it can without blocking.
+static void conn_event(generator *g, connection *c){
+	if (c->connecting){
+		int err=0;
+		socklen_t len=sizeof(err);
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len)<0 || err){
+			conn_error(g, c);
+			return;
+		}
+		c->connecting=0;
+	}
+#ifdef HAVE_GNUTLS
+	if (c->handshaking){
+		int r=gnutls_handshake(c->session);
+		if (r==GNUTLS_E_AGAIN || r==GNUTLS_E_INTERRUPTED){
+			conn_want(g, c, gnutls_record_get_direction(c->session) ? EPOLLOUT : EPOLLIN);
+			return;
+		}
+		if (r<0){
+			conn_error(g, c);
+			return;
+		}
+		c->handshaking=0;
+	}
+#endif
+	const char *request=g->keep_alive ? KEEP_ALIVE_REQUEST : CLOSE_REQUEST;
+	size_t request_len=strlen(request);
+	while (c->sent<request_len){
+		ssize_t w=conn_write(c, request+c->sent, request_len-c->sent);
+		if (w<0 && errno==EAGAIN){
+			conn_want(g, c, EPOLLOUT);
+			return;
+		}
+		if (w<=0){
+			conn_error(g, c);
+			return;
+		}
+		if ((c->sent+=w)==request_len)
+			conn_want(g, c, EPOLLIN);
+	}
+	int closes=0;
+	for(;;){
+		ssize_t r=conn_read(c, c->buffer+c->received, sizeof(c->buffer)-1-c->received);
+		if (r<0 && errno==EAGAIN)
+			return;
+		if (r<=0){
+			conn_error(g, c);
+			return;
+		}
+		c->received+=r;
+		c->buffer[c->received]=0;
+		if (conn_response_complete(c, &closes))
+			break;
+		if (c->received==sizeof(c->buffer)-1){
+			conn_error(g, c);
+			return;
+		}
+	}
+
+	int64_t now=now_ns();
+	add_latency(g, now-c->start_ns);
+	g->bytes+=c->received;
+	if (now>=g->end_ns){
+		conn_close(c);
+		return;
+	}
+	if (g->keep_alive && !closes){
+		c->start_ns=now;
+		c->sent=c->received=0;
+		c->reused=1;
+		conn_want(g, c, EPOLLOUT);
+	}
+	else{
+		conn_close(c);
+		conn_open(g, c);
+	}
+}
+
+static void *generator_run(void *data){
+	generator *g=data;
+	struct epoll_event ev[64];
+	int i;
+	for (i=0;i<g->nconnections;i++){
+		g->connections[i].fd=-1;
+		if (conn_open(g, &g->connections[i])<0)
+			g->errors++;
+	}
+	while (now_ns()<g->end_ns){
+		int n=epoll_wait(g->epfd, ev, sizeof(ev)/sizeof(ev[0]), 100);
+		for (i=0;i<n;i++)
+			conn_event(g, ev[i].data.ptr);
+	}
+	stopping=1;
+	for (i=0;i<g->nconnections;i++)
+		conn_close(&g->connections[i]);
+	return NULL;
+}
+
+/// Waits until the server accepts connections.
+static int wait_for_server(uint16_t port){
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(port);
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	int i;
+	for (i=0;i<200;i++){
+		int fd=socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int r=connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+		close(fd);
+		if (r==0)
+			return 0;
+		usleep(10000);
+	}
+	return -1;
+}
+
+static int compare_u32(const void *a, const void *b){
+	uint32_t x=*(const uint32_t*)a, y=*(const uint32_t*)b;
+	return x<y ? -1 : x>y;
+}
+
+static int bench_seconds=BENCH_SECONDS;
+static int bench_connections=BENCH_CONNECTIONS;
+static int bench_threads=BENCH_THREADS;
+static int bench_port=8180;
+
+/// Runs the server at that mode, with the load, and writes its JSON object.
+static void bench_http(FILE *out, const char *name, int flags, int edge, int tls, int keep_alive, int first){
+	char port[16];
+	snprintf(port, sizeof(port), "%d", bench_port);
+	onion *o=onion_new(flags | O_DETACH_LISTEN);
+	onion_set_edge_triggered(o, edge);
+	onion_listen_point *lp=NULL;
+#ifdef HAVE_GNUTLS
+	if (tls){
+		lp=onion_https_new();
+		onion_https_set_certificate(lp, O_SSL_CERTIFICATE_KEY, CERTFILE, CERTFILE);
+	}
+#endif
+	if (!lp)
+		lp=onion_http_new();
+	onion_add_listen_point(o, "127.0.0.1", port, lp);
+	onion_set_root_handler(o, onion_handler_new(body_handler, NULL, NULL));
+	onion_listen(o);
+
+	int nconnections=(flags&O_POLL) ? bench_connections : 1;
+	int nthreads=nconnections<bench_threads ? nconnections : bench_threads;
+	generator *g=calloc(nthreads, sizeof(generator));
+	int i;
+	long errors=0, reconnects=0;
+	int64_t bytes=0;
+	size_t nlatencies=0;
+	int64_t start=0, end=0;
+	if (wait_for_server(bench_port)<0){
+		ONION_ERROR("Server at %s did not start", port);
+		errors=-1;
+	}
+	else{
+		start=now_ns();
+		end=start+((int64_t)bench_seconds)*1000000000;
+		for (i=0;i<nthreads;i++){
+			g[i].epfd=epoll_create1(EPOLL_CLOEXEC);
+			g[i].tls=tls;
+			g[i].keep_alive=keep_alive;
+			g[i].port=bench_port;
+			g[i].end_ns=end;
+			g[i].nconnections=nconnections/nthreads + (i<nconnections%nthreads);
+			g[i].connections=calloc(g[i].nconnections, sizeof(connection));
+			pthread_create(&g[i].thread, NULL, generator_run, &g[i]);
+		}
+		for (i=0;i<nthreads;i++){
+			pthread_join(g[i].thread, NULL);
+			close(g[i].epfd);
+			free(g[i].connections);
+			errors+=g[i].errors;
+			reconnects+=g[i].reconnects;
+			bytes+=g[i].bytes;
+			nlatencies+=g[i].nlatencies;
+		}
+		end=now_ns();
+	}
+	stopping=1;
+	onion_listen_stop(o);
+	onion_free(o);
+	stopping=0;
+	bench_port++; // The next run does not wait for this one's sockets
+
+	uint32_t *latencies=malloc((nlatencies+1)*sizeof(uint32_t));
+	size_t n=0;
+	for (i=0;i<nthreads;i++){
+		if (g[i].nlatencies)
+			memcpy(latencies+n, g[i].latencies_us, g[i].nlatencies*sizeof(uint32_t));
+		n+=g[i].nlatencies;
+		free(g[i].latencies_us);
+	}
+	free(g);
+	qsort(latencies, n, sizeof(uint32_t), compare_u32);
+	double seconds=end>start ? (end-start)/1e9 : 1;
+#define PERCENTILE(q) (n ? latencies[(size_t)((q)*(n-1))] : 0)
+	fprintf(out, "%s\n    {\"mode\":\"%s\",\"tls\":%s,\"keep_alive\":%s,\"connections\":%d,"
+		"\"requests\":%ld,\"errors\":%ld,\"reconnects\":%ld,\"requests_per_second\":%.1f,\"bytes_per_second\":%.1f,"
+		"\"latency_us\":{\"p50\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}}",
+		first ? "" : ",", name, tls ? "true" : "false", keep_alive ? "true" : "false", nconnections,
+		(long)n, errors, reconnects, n/seconds, bytes/seconds,
+		PERCENTILE(0.5), PERCENTILE(0.99), PERCENTILE(0.999), n ? latencies[n-1] : 0);
+#undef PERCENTILE
+	free(latencies);
+	fprintf(stderr, "%10s %5s %10s %12.0f req/s\n", name, tls ? "https" : "http",
+					keep_alive ? "keep-alive" : "close", n/seconds);
+}
+
+static void usage(const char *name){
+	fprintf(stderr, "Usage: %s [-t seconds] [-c connections] [-g generator threads] [-p first port] "
+					"[-m one_loop,poll,pool,poll_nonblocking,poll_edge] [-T] [-o results.json]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv){
+	const char *modes="one_loop,poll,pool";
+	const char *output=NULL;
+	int use_tls=1;
+	int opt;
+	while ( (opt=getopt(argc, argv, "t:c:g:p:m:To:")) != -1 ){
+		switch(opt){
+			case 't': bench_seconds=atoi(optarg); break;
+			case 'c': bench_connections=atoi(optarg); break;
+			case 'g': bench_threads=atoi(optarg); break;
+			case 'p': bench_port=atoi(optarg); break;
+			case 'm': modes=optarg; break;
+			case 'T': use_tls=0; break;
+			case 'o': output=optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (bench_seconds<=0 || bench_connections<=0 || bench_threads<=0)
+		usage(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+	onion_log_flags=OF_NOINFO;
+	onion_log=bench_log;
+	memset(body, 'x', sizeof(body));
+#ifdef HAVE_GNUTLS
+	if (use_tls){
+		if (write_certificate(CERTFILE)<0){
+			ONION_ERROR("Could not write the certificate, HTTPS is skipped");
+			use_tls=0;
+		}
+		gnutls_certificate_allocate_credentials(&client_cred);
+	}
+#else
+	use_tls=0;
+#endif
+
+	FILE *out=output ? fopen(output, "w") : stdout;
+	if (!out){
+		ONION_ERROR("Could not open %s", output);
+		return 1;
+	}
+	struct{
+		const char *name;
+		int flags;
+		int edge;
+	} all_modes[]={ { "one_loop", O_ONE_LOOP }, { "poll", O_POLL }, { "pool", O_POOL },
+	                { "poll_nonblocking", O_POLL|O_NONBLOCKING }, { "poll_edge", O_POLL|O_NONBLOCKING, 1 } };
+	fprintf(out, "{\"seconds\":%d,\"generator_threads\":%d,\"body_size\":%d,\"results\":[",
+					bench_seconds, bench_threads, BODY_SIZE);
+	int first=1;
+	int i, tls, keep_alive;
+	for (i=0;i<sizeof(all_modes)/sizeof(all_modes[0]);i++){
+		if (!strstr(modes, all_modes[i].name))
+			continue;
+		for (tls=0;tls<=use_tls;tls++){
+			for (keep_alive=1;keep_alive>=0;keep_alive--){
+				bench_http(out, all_modes[i].name, all_modes[i].flags, all_modes[i].edge, tls, keep_alive, first);
+				first=0;
+			}
+		}
+	}
+	fprintf(out, "\n]}\n");
+	if (output)
+		fclose(out);
+
+#ifdef HAVE_GNUTLS
+	if (client_cred){
+		gnutls_certificate_free_credentials(client_cred);
+		unlink(CERTFILE);
+	}
+#endif
+	return 0;
+}
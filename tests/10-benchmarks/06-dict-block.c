@@ -0,0 +1,350 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+/**
+ * @short Measures the dict operations and the block and rope growth: ops/s, bytes allocated and cache misses.
+ *
+ *   ./06-dict-block
+ *
+ * The dicts have keys as the headers, as session ids, and as the 10000 fields of a big POST form. Each
+ * backend, the tree, OD_FLAT and OD_HASH, is measured case sensitive and with OD_ICASE, where the lookups
+ * use other case. Each of onion_dict_add, get, remove and preorder is measured apart.
+ *
+ * The blocks and ropes grow by chars, by small strings and by 4 KB chunks, up to 1 MB.
+ *
+ * The bytes are what is asked to malloc, calloc and realloc, that are replaced for it, so they are not
+ * counted under the address sanitizer. The cache misses are from perf_event_open, as "-" when the kernel
+ * does not allow it, for example with a high perf_event_paranoid or at a container.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <onion/dict.h>
+#include <onion/block.h>
+#include <onion/log.h>
+
+/// Operations of each measure, at least
+#define BENCH_OPS 1000000
+
+#ifndef __SANITIZE_ADDRESS__
+/// Counts the allocated bytes while measuring; glibc allows to replace malloc this way.
+#define COUNT_MALLOCS 1
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+static int counting=0;
+static long long nbytes=0;
+
+void *malloc(size_t size){
+	if (counting)
+		nbytes+=size;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size){
+	if (counting)
+		nbytes+=nmemb*size;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size){
+	if (counting)
+		nbytes+=size;
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+static int64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+/// The cache misses counter of this thread, at user space, or -1.
+static int misses_fd=-1;
+
+static void misses_open(){
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size=sizeof(attr);
+	attr.type=PERF_TYPE_HARDWARE;
+	attr.config=PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled=1;
+	attr.exclude_kernel=1;
+	attr.exclude_hv=1;
+	misses_fd=syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long misses_read(){
+	long long count=0;
+	if (misses_fd<0 || read(misses_fd, &count, sizeof(count))!=sizeof(count))
+		return -1;
+	return count;
+}
+
+/// What one measure takes, summed over the parts that are measured.
+typedef struct{
+	int64_t ns;
+	long long bytes;
+	long long misses;
+	long ops;
+}measure;
+
+static void measure_start(){
+#ifdef COUNT_MALLOCS
+	nbytes=0;
+	counting=1;
+#endif
+	if (misses_fd>=0){
+		ioctl(misses_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+static void measure_stop(measure *m, int64_t start, long ops){
+	m->ns+=now_ns()-start;
+	if (misses_fd>=0){
+		ioctl(misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+		m->misses+=misses_read();
+	}
+#ifdef COUNT_MALLOCS
+	counting=0;
+	m->bytes+=nbytes;
+#endif
+	m->ops+=ops;
+}
+
+static void measure_print(const char *set, const char *kind, const char *op, measure *m){
+	char misses[32];
+	if (misses_fd>=0)
+		snprintf(misses, sizeof(misses), "%.2f", ((double)m->misses)/m->ops);
+	else
+		snprintf(misses, sizeof(misses), "-");
+#ifdef COUNT_MALLOCS
+	double bytes=((double)m->bytes)/m->ops;
+#else
+	double bytes=-1;
+#endif
+	printf("%10s %12s %10s %14.0f %12.1f %12s\n", set, kind, op, ((double)m->ops)*1000000000/m->ns, bytes, misses);
+}
+
+static onion_dict *dict_fill(int flags, char **keys, int n){
+	onion_dict *d=onion_dict_new();
+	onion_dict_set_flags(d, flags);
+	int i;
+	for (i=0;i<n;i++)
+		onion_dict_add(d, keys[i], "text/html; charset=utf-8", OD_DUP_ALL|OD_REPLACE);
+	return d;
+}
+
+static void count_element(long *count, const char *key, const char *value, int flags){
+	(*count)++;
+}
+
+/// Measures onion_dict_add, get, remove and preorder of n keys. Lookups and removals are with the lookup keys.
+static void bench_dict(const char *set, const char *kind, int flags, char **keys, char **lookup, int n){
+	int rounds=(BENCH_OPS+n-1)/n;
+	int r, i;
+	long found=0;
+	measure add, get, remove, preorder;
+	memset(&add, 0, sizeof(add));
+	memset(&get, 0, sizeof(get));
+	memset(&remove, 0, sizeof(remove));
+	memset(&preorder, 0, sizeof(preorder));
+
+	for (r=0;r<rounds;r++){
+		measure_start();
+		int64_t start=now_ns();
+		onion_dict *d=dict_fill(flags, keys, n);
+		measure_stop(&add, start, n);
+
+		measure_start();
+		start=now_ns();
+		for (i=0;i<n;i++)
+			found+=onion_dict_get(d, lookup[(i*7919)%n])!=NULL;
+		measure_stop(&get, start, n);
+
+		long count=0;
+		measure_start();
+		start=now_ns();
+		onion_dict_preorder(d, count_element, &count);
+		measure_stop(&preorder, start, count);
+
+		measure_start();
+		start=now_ns();
+		for (i=0;i<n;i++)
+			onion_dict_remove(d, lookup[(i*7919)%n]);
+		measure_stop(&remove, start, n);
+		onion_dict_free(d);
+	}
+	if (found!=(long)rounds*n)
+		ONION_ERROR("Not all found at %s %s: %ld of %ld", set, kind, found, (long)rounds*n);
+
+	measure_print(set, kind, "add", &add);
+	measure_print(set, kind, "get", &get);
+	measure_print(set, kind, "remove", &remove);
+	measure_print(set, kind, "preorder", &preorder);
+}
+
+/// Each backend, case sensitive and OD_ICASE.
+static void bench_dict_set(const char *set, char **keys, int n){
+	char **other_case=malloc(sizeof(char*)*n);
+	int i;
+	for (i=0;i<n;i++){
+		char *k=strdup(keys[i]), *p;
+		for (p=k;*p;p++)
+			*p=isupper(*p) ? tolower(*p) : toupper(*p);
+		other_case[i]=k;
+	}
+	struct{
+		const char *name;
+		int flags;
+	} kinds[]={ { "tree", 0 }, { "flat", OD_FLAT }, { "hash", OD_HASH } };
+	for (i=0;i<sizeof(kinds)/sizeof(kinds[0]);i++){
+		char name[32];
+		bench_dict(set, kinds[i].name, kinds[i].flags, keys, keys, n);
+		snprintf(name, sizeof(name), "%s icase", kinds[i].name);
+		bench_dict(set, name, kinds[i].flags|OD_ICASE, keys, other_case, n);
+	}
+	for (i=0;i<n;i++)
+		free(other_case[i]);
+	free(other_case);
+}
+
+/// Block growth, up to this size
+#define BLOCK_SIZE (1024*1024)
+
+static const char small_string[]="<tr><td>name</td><td>value</td></tr>\n";
+static char chunk[4096];
+
+/// Grows a block or a rope to BLOCK_SIZE, by chars, by small strings or by chunks. The ops are bytes.
+static void bench_block(const char *kind, const char *op, int rope){
+	measure m;
+	memset(&m, 0, sizeof(m));
+	int rounds=(BENCH_OPS*16+BLOCK_SIZE-1)/BLOCK_SIZE;
+	int r;
+	for (r=0;r<rounds;r++){
+		onion_block *b=NULL;
+		onion_rope *rp=NULL;
+		long size=0;
+		measure_start();
+		int64_t start=now_ns();
+		if (rope)
+			rp=onion_rope_new();
+		else
+			b=onion_block_new();
+		if (strcmp(op, "char")==0){
+			for (size=0;size<BLOCK_SIZE;size++){
+				if (rope)
+					onion_rope_add_char(rp, 'x');
+				else
+					onion_block_add_char(b, 'x');
+			}
+		}
+		else if (strcmp(op, "str")==0){
+			for (size=0;size<BLOCK_SIZE;size+=sizeof(small_string)-1){
+				if (rope)
+					onion_rope_add_str(rp, small_string);
+				else
+					onion_block_add_str(b, small_string);
+			}
+		}
+		else{
+			for (size=0;size<BLOCK_SIZE;size+=sizeof(chunk)){
+				if (rope)
+					onion_rope_add_data(rp, chunk, sizeof(chunk));
+				else
+					onion_block_add_data(b, chunk, sizeof(chunk));
+			}
+		}
+		if (rope)
+			onion_rope_free(rp);
+		else
+			onion_block_free(b);
+		measure_stop(&m, start, size);
+	}
+	measure_print(kind, op, "bytes", &m);
+}
+
+int main(int argc, char **argv){
+	onion_log_flags=OF_INIT|OF_NOINFO;
+	misses_open();
+	memset(chunk, 'x', sizeof(chunk));
+
+	static const char *names[]={ "Host", "Connection", "Cache-Control", "Accept", "User-Agent", "Accept-Encoding",
+		"Accept-Language", "Referer", "Origin", "Cookie", "Content-Type", "Content-Length", "If-None-Match",
+		"If-Modified-Since", "Authorization", "X-Forwarded-For", "X-Forwarded-Proto", "X-Request-Id",
+		"Sec-Fetch-Dest", "Sec-Fetch-Mode" };
+	int nheaders=sizeof(names)/sizeof(names[0]);
+	int nsessions=1000;
+	int nfields=10000;
+	char **keys=malloc(sizeof(char*)*nfields);
+	int i;
+
+	printf("%10s %12s %10s %14s %12s %12s\n", "set", "kind", "op", "ops/s", "bytes/op", "misses/op");
+	for (i=0;i<nheaders;i++)
+		keys[i]=strdup(names[i]);
+	bench_dict_set("headers", keys, nheaders);
+	for (i=0;i<nheaders;i++)
+		free(keys[i]);
+
+	srand(1);
+	for (i=0;i<nsessions;i++){
+		char tmp[33];
+		int j;
+		for (j=0;j<32;j++)
+			tmp[j]="0123456789abcdef"[rand()%16];
+		tmp[32]=0;
+		keys[i]=strdup(tmp);
+	}
+	bench_dict_set("sessions", keys, nsessions);
+	for (i=0;i<nsessions;i++)
+		free(keys[i]);
+
+	for (i=0;i<nfields;i++){
+		char tmp[64];
+		snprintf(tmp, sizeof(tmp), "items[%d][Name]", i);
+		keys[i]=strdup(tmp);
+	}
+	bench_dict_set("form", keys, nfields);
+	for (i=0;i<nfields;i++)
+		free(keys[i]);
+	free(keys);
+
+	bench_block("block", "char", 0);
+	bench_block("block", "str", 0);
+	bench_block("block", "chunk", 0);
+	bench_block("rope", "char", 1);
+	bench_block("rope", "str", 1);
+	bench_block("rope", "chunk", 1);
+
+	if (misses_fd>=0)
+		close(misses_fd);
+	return 0;
+}
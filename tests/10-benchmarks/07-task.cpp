@@ -0,0 +1,149 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+/**
+ * @short Handlers that wait for upstream I/O: blocking the thread against co_await at an Onion::Task.
+ *
+ * Each request waits the given upstream latency. The blocking handler sleeps its thread, so at most
+ * one request per server thread waits at a time; the task handler awaits a poller timer, so all the
+ * connections wait at once. It prints requests per second and mean latency of each.
+ *
+ * Usage: 07-task [-t seconds] [-c connections] [-w server threads] [-l upstream latency ms]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <onion/onion.h>
+#include <onion/log.h>
+#include <bindings/cpp/onion.hpp>
+#include <bindings/cpp/url.hpp>
+#include <bindings/cpp/task.hpp>
+
+static int seconds=3;
+static int connections=64;
+static int threads=4;
+static int latency_ms=10;
+
+static std::atomic<bool> running;
+static std::atomic<long> requests;
+static std::atomic<long> latency_us;
+
+onion_connection_status blocking(Onion::Request &req, Onion::Response &res){
+	std::this_thread::sleep_for(std::chrono::milliseconds(latency_ms));
+	res.write("ok");
+	return OCS_PROCESSED;
+}
+
+Onion::Task task(Onion::Request &req, Onion::Response &res){
+	co_await Onion::Sleep(std::chrono::milliseconds(latency_ms));
+	res.write("ok");
+	co_return OCS_PROCESSED;
+}
+
+static int connect_to(const char *port){
+	struct addrinfo hints;
+	struct addrinfo *server;
+	memset(&hints,0, sizeof(struct addrinfo));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_family=AF_UNSPEC;
+	hints.ai_flags=AI_NUMERICSERV;
+	if (getaddrinfo("localhost",port,&hints,&server)!=0)
+		return -1;
+	int fd=socket(server->ai_family, server->ai_socktype | SOCK_CLOEXEC, server->ai_protocol);
+	if (connect(fd, server->ai_addr, server->ai_addrlen)==-1){
+		close(fd);
+		fd=-1;
+	}
+	freeaddrinfo(server);
+	return fd;
+}
+
+/// One connection per request, until stopped.
+static void client(const char *port, const char *path){
+	std::string get=std::string("GET ")+path+" HTTP/1.0\r\n\r\n";
+	char buffer[1024];
+	while (running){
+		auto start=std::chrono::steady_clock::now();
+		int fd=connect_to(port);
+		if (fd<0)
+			continue;
+		if (write(fd, get.c_str(), get.size())==(ssize_t)get.size()){
+			while (read(fd, buffer, sizeof(buffer))>0);
+			requests++;
+			latency_us+=std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-start).count();
+		}
+		close(fd);
+	}
+}
+
+static void bench(const char *name, const char *path){
+	requests=0;
+	latency_us=0;
+	running=true;
+	std::vector<std::thread> clients;
+	for (int i=0;i<connections;i++)
+		clients.emplace_back(client, "8130", path);
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	running=false;
+	for (auto &c: clients)
+		c.join();
+	long n=requests;
+	printf("%10s %10.0f req/s %10.2f ms mean latency\n", name, (double)n/seconds, n ? latency_us/1000.0/n : 0.0);
+}
+
+int main(int argc, char **argv){
+	int opt;
+	while ((opt=getopt(argc, argv, "t:c:w:l:"))!=-1){
+		switch(opt){
+			case 't': seconds=atoi(optarg); break;
+			case 'c': connections=atoi(optarg); break;
+			case 'w': threads=atoi(optarg); break;
+			case 'l': latency_ms=atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-t seconds] [-c connections] [-w server threads] [-l upstream latency ms]\n", argv[0]);
+				return 1;
+		}
+	}
+	onion_log_flags=OF_NOINFO;
+	onion *o=onion_new(O_POOL|O_DETACH_LISTEN);
+	onion_set_max_threads(o, threads);
+	onion_set_port(o, "8130");
+	Onion::Url url(onion_root_url(o));
+	url.add("^blocking$", blocking);
+	url.add("^task$", task);
+	onion_listen(o);
+	sleep(1);
+
+	printf("%d connections, %d server threads, %d ms upstream latency\n", connections, threads, latency_ms);
+	bench("blocking", "/blocking");
+	bench("task", "/task");
+
+	onion_listen_stop(o);
+	onion_free(o);
+	return 0;
+}
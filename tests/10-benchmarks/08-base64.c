@@ -0,0 +1,110 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+/**
+ * @short Measures base64 encode and decode, scalar and with the SIMD kernels of this CPU.
+ *
+ *   ./08-base64
+ *
+ * Sizes go from a Basic auth header to a payload of some MB. Encode writes to a caller buffer, and
+ * decode goes in place, so no time goes to malloc; the allocating versions are measured too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <onion/codecs.h>
+#include <onion/log.h>
+
+/// Bytes encoded or decoded at each measure
+#define BENCH_BYTES (256*1024*1024)
+
+static int64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+/// Returns MB/s of the original data
+static double bench_encode(const char *data, size_t l, int alloc){
+	int rounds=BENCH_BYTES/l+1;
+	char *out=malloc(onion_base64_encode_length(l));
+	int r;
+	int64_t start=now_ns();
+	for (r=0;r<rounds;r++){
+		if (alloc)
+			free(onion_base64_encode(data, l));
+		else
+			onion_base64_encode_to(data, l, out);
+	}
+	int64_t t=now_ns()-start;
+	free(out);
+	return ((double)l*rounds)/(t/1e9)/(1024*1024);
+}
+
+/// Returns MB/s of the decoded data. In place decodes a fresh copy each round; the copy is part of the time.
+static double bench_decode(const char *enc, size_t l, size_t decoded, int alloc){
+	int rounds=BENCH_BYTES/l+1;
+	char *copy=malloc(l+1);
+	int r, errors=0;
+	int64_t start=now_ns();
+	for (r=0;r<rounds;r++){
+		int length;
+		if (alloc){
+			free(onion_base64_decode(enc, &length));
+		}
+		else{
+			memcpy(copy, enc, l);
+			length=onion_base64_decode_to(copy, l, copy);
+		}
+		if (length!=decoded)
+			errors++;
+	}
+	int64_t t=now_ns()-start;
+	free(copy);
+	if (errors)
+		ONION_ERROR("Wrong decoded length");
+	return ((double)decoded*rounds)/(t/1e9)/(1024*1024);
+}
+
+int main(int argc, char **argv){
+	onion_log_flags=OF_INIT|OF_NOINFO;
+	size_t sizes[]={ 20, 48, 1024, 64*1024, 4*1024*1024 };
+	int i, simd;
+	printf("%5s %10s %12s %12s %12s %12s\n", "simd", "bytes", "enc MB/s", "enc alloc", "dec MB/s", "dec alloc");
+	for (i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++){
+		size_t l=sizes[i], j;
+		char *data=malloc(l);
+		for (j=0;j<l;j++)
+			data[j]=rand();
+		char *enc=onion_base64_encode(data, l);
+		size_t elength=strlen(enc);
+		for (simd=0;simd<2;simd++){
+			onion_base64_use_simd(simd);
+			printf("%5s %10d %12.1f %12.1f %12.1f %12.1f\n", simd ? "yes" : "no", (int)l, 
+						 bench_encode(data, l, 0), bench_encode(data, l, 1),
+						 bench_decode(enc, elength, l, 0), bench_decode(enc, elength, l, 1));
+		}
+		free(enc);
+		free(data);
+	}
+	return 0;
+}
@@ -0,0 +1,116 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+/**
+ * @short Measures multipart file uploads: the boundary search and the writes to the temporal file.
+ *
+ *   ./09-upload [MB]
+ *
+ * A file of MB megabytes (64 by default), binary or text, is posted as multipart/form-data to the
+ * buffer listen point, in writes of several sizes as reads of a socket would be. The temporal files
+ * go to /tmp, so a tmpfs there measures the parser, and a disk the writes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <onion/onion.h>
+#include <onion/request.h>
+#include <onion/log.h>
+
+#include "../01-internal/buffer_listen_point.h"
+
+#define BOUNDARY "----WebKitFormBoundary7MA4YWxkTrZu0gW"
+
+static int64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+/// Checks the size of the uploaded file
+static onion_connection_status check_upload(size_t *size, onion_request *req, onion_response *res){
+	const char *filename=onion_request_get_file(req, "file");
+	struct stat st;
+	if (!filename || stat(filename, &st)!=0 || st.st_size!=*size){
+		ONION_ERROR("Uploaded file is wrong");
+		exit(1);
+	}
+	*size=0; // Marks as checked
+	return OCS_PROCESSED;
+}
+
+/// Returns MB/s of the file data
+static double bench_upload(onion *server, onion_listen_point *lp, size_t *checked, const char *file, size_t size, size_t chunk){
+	char head[512];
+	const char *tail="\r\n--" BOUNDARY "--";
+	int body=snprintf(head, sizeof(head), "--" BOUNDARY "\r\nContent-Disposition: form-data; name=\"file\"; filename=\"file.dat\"\r\n"
+										"Content-Type: application/octet-stream\r\n\r\n");
+	size_t content_length=body+size+strlen(tail);
+	char headers[1024];
+	snprintf(headers, sizeof(headers), "POST /upload HTTP/1.1\r\nHost: localhost\r\nContent-Type: multipart/form-data; boundary=" BOUNDARY "\r\n"
+					 "Content-Length: %d\r\n\r\n%s", (int)content_length, head);
+	
+	onion_request *req=onion_request_new(lp);
+	*checked=size;
+	int64_t start=now_ns();
+	onion_request_write(req, headers, strlen(headers));
+	size_t pos;
+	for (pos=0;pos<size;pos+=chunk)
+		onion_request_write(req, file+pos, pos+chunk<size ? chunk : size-pos);
+	onion_request_write(req, tail, strlen(tail));
+	int64_t t=now_ns()-start;
+	onion_request_free(req);
+	if (*checked!=0)
+		ONION_ERROR("The handler did not get the upload");
+	return ((double)size)/(t/1e9)/(1024*1024);
+}
+
+int main(int argc, char **argv){
+	onion_log_flags=OF_INIT|OF_NOINFO;
+	size_t size=(argc>1 ? atoi(argv[1]) : 64)*1024*1024, i;
+	size_t chunks[]={ 1500, 4096, 16*1024, 64*1024, 256*1024 };
+	size_t checked=0;
+	
+	onion *server=onion_new(0);
+	onion_set_max_post_size(server, 4096);
+	onion_listen_point *lp=onion_buffer_listen_point_new();
+	onion_add_listen_point(server, NULL, NULL, lp);
+	onion_set_root_handler(server, onion_handler_new((void*)check_upload, &checked, NULL));
+	
+	char *binary=malloc(size), *text=malloc(size);
+	for (i=0;i<size;i++){
+		binary[i]=rand();
+		text[i]=(i%72==71) ? '\n' : 'a'+(rand()%26);
+	}
+	
+	printf("%10s %12s %12s\n", "write", "binary MB/s", "text MB/s");
+	for (i=0;i<sizeof(chunks)/sizeof(chunks[0]);i++)
+		printf("%10d %12.1f %12.1f\n", (int)chunks[i],
+					 bench_upload(server, lp, &checked, binary, size, chunks[i]),
+					 bench_upload(server, lp, &checked, text, size, chunks[i]));
+	
+	free(binary);
+	free(text);
+	onion_free(server);
+	return 0;
+}
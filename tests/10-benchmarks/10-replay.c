@@ -0,0 +1,755 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+/**
+ * @short Replays a traffic record against a live server, and measures its latencies.
+ *
+ * The record is made by a server with onion_set_traffic_record: the bytes each connection sent, when, and
+ * the status of each response. Each recorded connection is opened again at its time, and sends the same bytes
+ * at the same pace, scaled by -s; the bytes sent after a response wait for it too, as the client did. The
+ * latency of each response is from the end of its request until the whole response is read. The results are
+ * one JSON object, at stdout or at the -o file:
+ *
+ *   ./10-replay -s 2 -x 4 -o new.json traffic.otr 127.0.0.1:8080
+ *
+ * -s 0 sends as fast as the responses come. -x replays each connection that many times at once, for more load
+ * than was recorded, and -g sets the threads. To compare two builds, replay the same record against each, and:
+ *
+ *   ./10-replay -d old.json new.json
+ *
+ * Responses with another status than recorded are counted at "status_mismatches", and the ones with no request
+ * recorded before them, as the errors answered before any handler, at "unexpected".
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <onion/dict.h>
+#include <onion/log.h>
+#include <onion/traffic_record.h>
+
+/// Default threads of the replay
+#define REPLAY_THREADS 2
+/// Room for the headers of a response; the bodies are read through it.
+#define REPLAY_BUFFER_SIZE (16*1024)
+/// Seconds to wait for the responses after the last recorded event.
+#define REPLAY_GRACE 10
+
+/// A recorded event of a connection.
+typedef struct{
+	onion_traffic_record_type type;
+	int64_t time_us;
+	int status;
+	int no_body;
+	size_t offset;   ///< Of OTR_DATA, at the recorded bytes
+	size_t length;
+}event;
+
+/// A recorded connection.
+typedef struct{
+	event *events;
+	int nevents;
+	int size;
+}recorded_connection;
+
+static recorded_connection *recorded=NULL;
+static size_t nrecorded=0;
+static char *recorded_data=NULL;
+static size_t recorded_data_size=0;
+static int64_t recorded_us=0;
+
+/// A response that is expected, as its request was sent.
+typedef struct{
+	int64_t start_ns;
+	int status;
+	int no_body;
+}expected;
+
+enum response_state{
+	RS_HEAD=0,
+	RS_BODY,
+	RS_CHUNK_SIZE,
+	RS_CHUNK_DATA,
+	RS_TRAILER,
+	RS_UNTIL_CLOSE,
+};
+
+/// A connection being replayed.
+typedef struct{
+	recorded_connection *rec;
+	int next;           ///< Next event to replay
+	int fd;
+	int connecting;
+	const char *out;    ///< Bytes of an OTR_DATA left to write
+	size_t out_left;
+	int64_t sent_ns;    ///< When the last bytes of the last OTR_DATA were written
+	expected *pending;  ///< Ring of the responses expected
+	int npending;
+	int first_pending;
+	int pending_size;
+	enum response_state state;
+	int status;         ///< Of the response being read
+	size_t body_left;
+	size_t received;    ///< Bytes at buffer
+	char buffer[REPLAY_BUFFER_SIZE+1];
+}replay_connection;
+
+/// A replay thread, with its connections and its results.
+typedef struct{
+	pthread_t thread;
+	int epfd;
+	int nconnections;
+	replay_connection *connections;
+	int64_t start_ns;
+	int64_t end_ns;
+	uint32_t *latencies_us;
+	size_t nlatencies;
+	size_t latencies_size;
+	long errors;
+	long mismatches;
+	long unexpected;
+	int64_t bytes;
+}replayer;
+
+static struct addrinfo *target=NULL;
+static double speed=1;
+
+static int64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+/// Reads the record, grouping the events by connection, and all the bytes at one block.
+static int load_record(const char *path){
+	FILE *file=onion_traffic_record_open(path);
+	if (!file)
+		return -1;
+	onion_traffic_record_entry entry;
+	memset(&entry, 0, sizeof(entry));
+	int r;
+	size_t data_size=0;
+	int64_t first_us=-1; // The record starts with the server, the replay at its first event
+	while ( (r=onion_traffic_record_read(file, &entry))==1 ){
+		if (entry.connection==0 || entry.connection>(1<<24)){
+			r=-1;
+			break;
+		}
+		if (entry.connection>nrecorded){
+			recorded=realloc(recorded, entry.connection*sizeof(recorded_connection));
+			memset(recorded+nrecorded, 0, (entry.connection-nrecorded)*sizeof(recorded_connection));
+			nrecorded=entry.connection;
+		}
+		recorded_connection *rc=&recorded[entry.connection-1];
+		if (rc->nevents==rc->size){
+			rc->size=rc->size ? rc->size*2 : 16;
+			rc->events=realloc(rc->events, rc->size*sizeof(event));
+		}
+		if (first_us<0)
+			first_us=entry.time_us;
+		event *e=&rc->events[rc->nevents++];
+		e->type=entry.type;
+		e->time_us=entry.time_us-first_us;
+		e->status=entry.status;
+		e->no_body=entry.no_body;
+		e->offset=recorded_data_size;
+		e->length=entry.length;
+		if (entry.length){
+			if (recorded_data_size+entry.length>data_size){
+				data_size=(recorded_data_size+entry.length)*2;
+				recorded_data=realloc(recorded_data, data_size);
+			}
+			memcpy(recorded_data+recorded_data_size, entry.data, entry.length);
+			recorded_data_size+=entry.length;
+		}
+		recorded_us=e->time_us;
+	}
+	free(entry.data);
+	fclose(file);
+	if (r<0){
+		ONION_ERROR("The traffic record %s is not valid", path);
+		return -1;
+	}
+	return 0;
+}
+
+/// When the event is due, as the speed says.
+static int64_t event_due_ns(replayer *g, event *e){
+	if (speed<=0)
+		return g->start_ns;
+	return g->start_ns + (int64_t)(e->time_us*1000/speed);
+}
+
+static void conn_want(replayer *g, replay_connection *c, uint32_t events){
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events=events;
+	ev.data.ptr=c;
+	epoll_ctl(g->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/// Resets the connection, so there is no TIME_WAIT.
+static void conn_close(replay_connection *c){
+	if (c->fd<0)
+		return;
+	struct linger l={ 1, 0 };
+	setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+	close(c->fd);
+	c->fd=-1;
+	c->received=0;
+	c->state=RS_HEAD;
+}
+
+static int conn_open(replayer *g, replay_connection *c){
+	c->fd=socket(target->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->fd<0)
+		return -1;
+	int one=1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(c->fd, target->ai_addr, target->ai_addrlen)<0 && errno!=EINPROGRESS){
+		conn_close(c);
+		return -1;
+	}
+	c->connecting=1;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events=EPOLLOUT;
+	ev.data.ptr=c;
+	epoll_ctl(g->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+	return 0;
+}
+
+static void add_latency(replayer *g, int64_t ns){
+	if (g->nlatencies==g->latencies_size){
+		g->latencies_size=g->latencies_size ? g->latencies_size*2 : 64*1024;
+		g->latencies_us=realloc(g->latencies_us, g->latencies_size*sizeof(uint32_t));
+	}
+	g->latencies_us[g->nlatencies++]=ns/1000;
+}
+
+static void push_expected(replay_connection *c, int64_t start_ns, int status, int no_body){
+	if (c->npending==c->pending_size){
+		int size=c->pending_size ? c->pending_size*2 : 8;
+		expected *pending=malloc(size*sizeof(expected));
+		int i;
+		for (i=0;i<c->npending;i++)
+			pending[i]=c->pending[(c->first_pending+i)%c->pending_size];
+		free(c->pending);
+		c->pending=pending;
+		c->pending_size=size;
+		c->first_pending=0;
+	}
+	expected *e=&c->pending[(c->first_pending+c->npending)%c->pending_size];
+	e->start_ns=start_ns;
+	e->status=status;
+	e->no_body=no_body;
+	c->npending++;
+}
+
+/// A whole response was read: its latency, and whether it is as recorded.
+static void response_done(replayer *g, replay_connection *c){
+	c->state=RS_HEAD;
+	if (!c->npending){
+		g->unexpected++;
+		return;
+	}
+	expected *e=&c->pending[c->first_pending];
+	add_latency(g, now_ns()-e->start_ns);
+	if (e->status!=c->status)
+		g->mismatches++;
+	c->first_pending=(c->first_pending+1)%c->pending_size;
+	c->npending--;
+}
+
+/// The headers of a response are at buffer, up to end: how its body comes.
+static void response_head(replay_connection *c, char *end){
+	char save=*end;
+	*end='\0';
+	c->status=strncmp(c->buffer, "HTTP/1.", 7)==0 ? atoi(c->buffer+9) : 0;
+	const char *length=strcasestr(c->buffer, "\ncontent-length:");
+	const char *encoding=strcasestr(c->buffer, "\ntransfer-encoding:");
+	int chunked=encoding && strncasecmp(encoding+19+strspn(encoding+19, " "), "chunked", 7)==0;
+	*end=save;
+	int no_body=(c->npending && c->pending[c->first_pending].no_body) || c->status==204 || c->status==304;
+	if (no_body)
+		c->body_left=0;
+	else if (chunked)
+		c->state=RS_CHUNK_SIZE;
+	else if (length){
+		c->body_left=strtoul(length+16, NULL, 10);
+		c->state=RS_BODY;
+	}
+	else
+		c->state=RS_UNTIL_CLOSE;
+}
+
+/// Parses the responses read, as far as there is data. -1 if they are not valid.
+static int parse_responses(replayer *g, replay_connection *c){
+	size_t pos=0;
+	for(;;){
+		char *p=c->buffer+pos;
+		size_t left=c->received-pos;
+		if (c->state==RS_HEAD){
+			c->buffer[c->received]='\0';
+			char *end=strstr(p, "\r\n\r\n");
+			if (!end){
+				if (pos==0 && c->received==REPLAY_BUFFER_SIZE)
+					return -1;
+				break;
+			}
+			if (pos)
+				memmove(c->buffer, p, left);
+			c->received=left;
+			pos=0;
+			end=c->buffer+(end-p);
+			response_head(c, end);
+			pos=end+4-c->buffer;
+			if (c->status>=100 && c->status<200) // 100 Continue, the response comes later.
+				continue;
+			if (c->state==RS_HEAD)
+				response_done(g, c);
+		}
+		else if (c->state==RS_BODY || c->state==RS_CHUNK_DATA){
+			size_t n=left<c->body_left ? left : c->body_left;
+			pos+=n;
+			c->body_left-=n;
+			if (c->body_left)
+				break;
+			if (c->state==RS_BODY)
+				response_done(g, c);
+			else
+				c->state=RS_CHUNK_SIZE;
+		}
+		else if (c->state==RS_CHUNK_SIZE || c->state==RS_TRAILER){
+			char *nl=memchr(p, '\n', left);
+			if (!nl){
+				if (pos==0 && c->received==REPLAY_BUFFER_SIZE)
+					return -1;
+				break;
+			}
+			pos+=nl+1-p;
+			if (c->state==RS_TRAILER){
+				if (nl==p || (nl==p+1 && *p=='\r'))
+					response_done(g, c);
+				continue;
+			}
+			char *endp;
+			size_t size=strtoul(p, &endp, 16);
+			if (endp==p)
+				return -1;
+			if (size==0)
+				c->state=RS_TRAILER;
+			else{
+				c->body_left=size+2; // and its \r\n
+				c->state=RS_CHUNK_DATA;
+			}
+		}
+		else{ // RS_UNTIL_CLOSE
+			pos=c->received;
+			break;
+		}
+		if (pos==c->received)
+			break;
+	}
+	memmove(c->buffer, c->buffer+pos, c->received-pos);
+	c->received-=pos;
+	return 0;
+}
+
+/// The connection was closed by the server, or failed: what was expected is lost, but the rest is replayed.
+static void conn_lost(replayer *g, replay_connection *c){
+	if (c->state==RS_UNTIL_CLOSE)
+		response_done(g, c);
+	g->errors+=c->npending;
+	c->npending=0;
+	c->out_left=0;
+	conn_close(c);
+}
+
+/// Writes what it can of the current OTR_DATA.
+static int conn_write(replayer *g, replay_connection *c){
+	while (c->out_left){
+		// Over the loopback the server may answer before send returns, so the latency counts from before it.
+		c->sent_ns=now_ns();
+		ssize_t w=send(c->fd, c->out, c->out_left, MSG_NOSIGNAL);
+		if (w<0 && errno==EAGAIN){
+			conn_want(g, c, EPOLLIN | EPOLLOUT);
+			return 0;
+		}
+		if (w<=0){
+			conn_lost(g, c);
+			return -1;
+		}
+		c->out+=w;
+		c->out_left-=w;
+	}
+	conn_want(g, c, EPOLLIN);
+	return 0;
+}
+
+/**
+ * @short Replays the events of the connection that can go now. Returns when the next one is due, or 0 if it waits for the server.
+ */
+static int64_t conn_advance(replayer *g, replay_connection *c){
+	while (c->next<c->rec->nevents){
+		if (c->connecting || c->out_left)
+			return 0;
+		event *e=&c->rec->events[c->next];
+		if (e->type==OTR_RESPONSE){
+			if (c->fd<0) // Its request was lost with the connection
+				g->errors++;
+			else
+				push_expected(c, c->sent_ns, e->status, e->no_body);
+			c->next++;
+			continue;
+		}
+		if (c->npending) // Sent after the response, by the recorded client
+			return 0;
+		if (e->type==OTR_CLOSE){
+			conn_close(c);
+			c->next++;
+			continue;
+		}
+		int64_t due=event_due_ns(g, e);
+		if (due>now_ns())
+			return due;
+		if (c->fd<0){
+			if (conn_open(g, c)<0){ // Its responses are counted as errors
+				c->next++;
+				continue;
+			}
+			c->out=recorded_data+e->offset;
+			c->out_left=e->length;
+			c->next++;
+			return 0; // Written when connected
+		}
+		c->out=recorded_data+e->offset;
+		c->out_left=e->length;
+		c->next++;
+		if (conn_write(g, c)<0)
+			continue;
+	}
+	if (c->fd>=0 && !c->npending && !c->out_left)
+		conn_close(c);
+	return 0;
+}
+
+/// The socket is ready: connects, writes, and reads the responses.
+static void conn_event(replayer *g, replay_connection *c, uint32_t events){
+	if (c->connecting){
+		int err=0;
+		socklen_t len=sizeof(err);
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len)<0 || err){
+			c->connecting=0;
+			conn_lost(g, c);
+			return;
+		}
+		c->connecting=0;
+	}
+	if (c->out_left){
+		if (conn_write(g, c)<0)
+			return;
+		if (!c->out_left) // Expects its responses before reading them
+			conn_advance(g, c);
+	}
+	if (!(events&(EPOLLIN|EPOLLHUP|EPOLLERR)) || c->fd<0)
+		return;
+	for(;;){
+		ssize_t r=recv(c->fd, c->buffer+c->received, REPLAY_BUFFER_SIZE-c->received, 0);
+		if (r<0 && errno==EAGAIN)
+			return;
+		if (r<=0){
+			conn_lost(g, c);
+			return;
+		}
+		g->bytes+=r;
+		c->received+=r;
+		if (parse_responses(g, c)<0){
+			ONION_ERROR("Invalid response from the server");
+			conn_lost(g, c);
+			return;
+		}
+	}
+}
+
+static void *replayer_run(void *data){
+	replayer *g=data;
+	struct epoll_event ev[64];
+	int i;
+	for(;;){
+		int64_t now=now_ns(), next=0;
+		int running=0;
+		for (i=0;i<g->nconnections;i++){
+			replay_connection *c=&g->connections[i];
+			if (c->next>=c->rec->nevents && c->fd<0)
+				continue;
+			running++;
+			int64_t due=conn_advance(g, c);
+			if (due && (!next || due<next))
+				next=due;
+		}
+		if (!running || now>=g->end_ns)
+			break;
+		int timeout=100;
+		if (next){
+			int64_t wait=(next-now_ns()+999999)/1000000;
+			timeout=wait<0 ? 0 : wait<timeout ? wait : timeout;
+		}
+		int n=epoll_wait(g->epfd, ev, sizeof(ev)/sizeof(ev[0]), timeout);
+		for (i=0;i<n;i++)
+			conn_event(g, ev[i].data.ptr, ev[i].events);
+	}
+	for (i=0;i<g->nconnections;i++){
+		replay_connection *c=&g->connections[i];
+		g->errors+=c->npending;
+		conn_close(c);
+		free(c->pending);
+	}
+	return NULL;
+}
+
+static int compare_u32(const void *a, const void *b){
+	uint32_t x=*(const uint32_t*)a, y=*(const uint32_t*)b;
+	return x<y ? -1 : x>y;
+}
+
+/// Replays the record, with that many copies of each connection at threads, and writes the JSON results.
+static int replay(FILE *out, const char *path, int copies, int nthreads){
+	size_t total=nrecorded*copies;
+	if (nthreads>total)
+		nthreads=total ? total : 1;
+	replayer *g=calloc(nthreads, sizeof(replayer));
+	int64_t start=now_ns()+100000000; // All the threads start at once
+	int64_t end=start+(speed>0 ? (int64_t)(recorded_us*1000/speed) : 0)+((int64_t)REPLAY_GRACE)*1000000000;
+	int i;
+	size_t j;
+	for (i=0;i<nthreads;i++){
+		g[i].epfd=epoll_create1(EPOLL_CLOEXEC);
+		g[i].start_ns=start;
+		g[i].end_ns=end;
+		g[i].connections=calloc(total/nthreads+1, sizeof(replay_connection));
+	}
+	for (j=0;j<total;j++){
+		replayer *t=&g[j%nthreads];
+		replay_connection *c=&t->connections[t->nconnections++];
+		c->rec=&recorded[j%nrecorded];
+		c->fd=-1;
+	}
+	for (i=0;i<nthreads;i++)
+		pthread_create(&g[i].thread, NULL, replayer_run, &g[i]);
+
+	long errors=0, mismatches=0, unexpected=0;
+	int64_t bytes=0;
+	size_t n=0;
+	for (i=0;i<nthreads;i++){
+		pthread_join(g[i].thread, NULL);
+		close(g[i].epfd);
+		free(g[i].connections);
+		errors+=g[i].errors;
+		mismatches+=g[i].mismatches;
+		unexpected+=g[i].unexpected;
+		bytes+=g[i].bytes;
+		n+=g[i].nlatencies;
+	}
+	int64_t finish=now_ns();
+	uint32_t *latencies=malloc((n+1)*sizeof(uint32_t));
+	n=0;
+	for (i=0;i<nthreads;i++){
+		if (g[i].nlatencies)
+			memcpy(latencies+n, g[i].latencies_us, g[i].nlatencies*sizeof(uint32_t));
+		n+=g[i].nlatencies;
+		free(g[i].latencies_us);
+	}
+	free(g);
+	qsort(latencies, n, sizeof(uint32_t), compare_u32);
+	double seconds=finish>start ? (finish-start)/1e9 : 1;
+	double mean=0;
+	for (j=0;j<n;j++)
+		mean+=latencies[j];
+	mean=n ? mean/n : 0;
+
+#define PERCENTILE(q) (n ? latencies[(size_t)((q)*(n-1))] : 0)
+	fprintf(out, "{\"record\":\"%s\",\"recorded_seconds\":%.3f,\"speed\":%g,\"copies\":%d,\"connections\":%ld,"
+		"\"requests\":%ld,\"errors\":%ld,\"status_mismatches\":%ld,\"unexpected\":%ld,\"seconds\":%.3f,"
+		"\"requests_per_second\":%.1f,\"bytes_per_second\":%.1f,"
+		"\"latency_us\":{\"mean\":%.0f,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u},\"histogram_us\":{",
+		path, recorded_us/1e6, speed, copies, (long)total, (long)n, errors, mismatches, unexpected, seconds,
+		n/seconds, bytes/seconds, mean, PERCENTILE(0.5), PERCENTILE(0.9), PERCENTILE(0.99), PERCENTILE(0.999),
+		n ? latencies[n-1] : 0);
+#undef PERCENTILE
+	// Responses up to each power of 2 us, from the previous one.
+	uint32_t le=1;
+	size_t count=0;
+	int first=1;
+	for (j=0;j<n;j++){
+		while (latencies[j]>le){
+			if (count)
+				fprintf(out, "%s\"%u\":%ld", first ? "" : ",", le, (long)count);
+			first=first && !count;
+			count=0;
+			le*=2;
+		}
+		count++;
+	}
+	if (count)
+		fprintf(out, "%s\"%u\":%ld", first ? "" : ",", le, (long)count);
+	fprintf(out, "}}\n");
+	free(latencies);
+	fprintf(stderr, "%ld requests, %.1f req/s, %ld errors, %ld status mismatches\n", (long)n, n/seconds, errors, mismatches);
+	return errors ? 2 : 0;
+}
+
+static onion_dict *read_results(const char *path){
+	FILE *f=fopen(path, "r");
+	if (!f){
+		ONION_ERROR("Could not open %s", path);
+		return NULL;
+	}
+	char data[64*1024];
+	size_t l=fread(data, 1, sizeof(data)-1, f);
+	fclose(f);
+	data[l]='\0';
+	onion_dict *d=onion_dict_from_json(data);
+	if (!d)
+		ONION_ERROR("%s is not the JSON of a replay", path);
+	return d;
+}
+
+/// Prints the results of two replays side by side, with the change from the first to the second.
+static int compare(const char *old_path, const char *new_path){
+	onion_dict *a=read_results(old_path), *b=read_results(new_path);
+	if (!a || !b){
+		if (a)
+			onion_dict_free(a);
+		if (b)
+			onion_dict_free(b);
+		return 1;
+	}
+	const char *fields[][3]={
+		{ "requests/s", "requests_per_second", NULL },
+		{ "mean us", "latency_us", "mean" },
+		{ "p50 us", "latency_us", "p50" },
+		{ "p90 us", "latency_us", "p90" },
+		{ "p99 us", "latency_us", "p99" },
+		{ "p999 us", "latency_us", "p999" },
+		{ "max us", "latency_us", "max" },
+		{ "errors", "errors", NULL },
+		{ "mismatches", "status_mismatches", NULL },
+	};
+	printf("%-12s %14s %14s %9s\n", "", old_path, new_path, "change");
+	int i;
+	for (i=0;i<sizeof(fields)/sizeof(fields[0]);i++){
+		const char *va=onion_dict_rget(a, fields[i][1], fields[i][2], NULL);
+		const char *vb=onion_dict_rget(b, fields[i][1], fields[i][2], NULL);
+		double x=va ? atof(va) : 0, y=vb ? atof(vb) : 0;
+		if (x!=0)
+			printf("%-12s %14.1f %14.1f %+8.1f%%\n", fields[i][0], x, y, (y-x)*100/x);
+		else
+			printf("%-12s %14.1f %14.1f %9s\n", fields[i][0], x, y, "-");
+	}
+	onion_dict_free(a);
+	onion_dict_free(b);
+	return 0;
+}
+
+static void usage(const char *name){
+	fprintf(stderr, "Usage: %s [-s speed] [-x copies] [-g threads] [-o results.json] record [host:port]\n"
+					"       %s -d old.json new.json\n", name, name);
+	exit(1);
+}
+
+int main(int argc, char **argv){
+	const char *output=NULL;
+	int copies=1, nthreads=REPLAY_THREADS, diff=0;
+	int opt;
+	while ( (opt=getopt(argc, argv, "s:x:g:o:d")) != -1 ){
+		switch(opt){
+			case 's': speed=atof(optarg); break;
+			case 'x': copies=atoi(optarg); break;
+			case 'g': nthreads=atoi(optarg); break;
+			case 'o': output=optarg; break;
+			case 'd': diff=1; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (diff){
+		if (argc-optind!=2)
+			usage(argv[0]);
+		return compare(argv[optind], argv[optind+1]);
+	}
+	if (argc-optind<1 || argc-optind>2 || copies<=0 || nthreads<=0 || speed<0)
+		usage(argv[0]);
+
+	char host[256]="127.0.0.1";
+	const char *port="8080";
+	if (argc-optind==2){
+		snprintf(host, sizeof(host), "%s", argv[optind+1]);
+		char *colon=strrchr(host, ':');
+		if (colon){
+			*colon='\0';
+			port=argv[optind+1]+(colon-host)+1;
+		}
+	}
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype=SOCK_STREAM;
+	hints.ai_flags=AI_NUMERICSERV;
+	if (getaddrinfo(host, port, &hints, &target)!=0){
+		ONION_ERROR("Could not resolve %s:%s", host, port);
+		return 1;
+	}
+	if (load_record(argv[optind])<0)
+		return 1;
+	if (!nrecorded){
+		ONION_ERROR("Nothing recorded at %s", argv[optind]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	FILE *out=output ? fopen(output, "w") : stdout;
+	if (!out){
+		ONION_ERROR("Could not open %s", output);
+		return 1;
+	}
+	int r=replay(out, argv[optind], copies, nthreads);
+	if (output)
+		fclose(out);
+
+	size_t i;
+	for (i=0;i<nrecorded;i++)
+		free(recorded[i].events);
+	free(recorded);
+	free(recorded_data);
+	freeaddrinfo(target);
+	return r;
+}
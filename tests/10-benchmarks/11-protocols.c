@@ -0,0 +1,993 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+/**
+ * @short Measures the protocols over the loopback: TLS handshakes, bulk HTTPS, websocket messages and broadcasts.
+ *
+ * Each benchmark starts its own server, as the examples do: the basic one, O_POOL over HTTPS, for the
+ * handshakes and the bulk transfers, and the websockets one, O_THREADED, for the messages and the broadcasts.
+ * The clients are blocking, one connection per thread. The results are one JSON object, at stdout or at the
+ * -o file:
+ *
+ *   ./11-protocols -t 5 -g 4 -n 256 -o protocols.json
+ *
+ * -b selects the benchmarks, for example -b handshake,websocket. They are:
+ *
+ *  - handshake: new connections with a full handshake each, and with the session resumed from the last
+ *    one. The rate per core divides by the CPU time of the server, which is that of the process but the
+ *    client threads.
+ *  - bulk: responses of 1 MB on keep alive connections, over HTTP and over HTTPS, in bytes per second.
+ *  - websocket: messages of 64 bytes and of 64 KB, from the clients, masked as they must be, and to the
+ *    clients, in messages and bytes per second.
+ *  - broadcast: -n clients subscribed to a group, where a message is published once all got the previous.
+ *    Its latency is from the publish until each subscriber, and until the last of them, the fan-out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef HAVE_GNUTLS
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#endif
+
+#include <onion/onion.h>
+#include <onion/http.h>
+#include <onion/url.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/websocket.h>
+#include <onion/log.h>
+#ifdef HAVE_GNUTLS
+#include <onion/https.h>
+#endif
+
+/// Default seconds to run each benchmark
+#define BENCH_SECONDS 2
+/// Default client threads, each with its connection
+#define BENCH_THREADS 2
+/// Default subscribers of the broadcast
+#define BENCH_SUBSCRIBERS 64
+/// Size of the bulk responses
+#define BULK_SIZE (1024*1024)
+/// Size of the small and the large websocket messages
+#define SMALL_MESSAGE 64
+#define LARGE_MESSAGE (64*1024)
+/// Messages of a websocket burst, before the client waits for the server
+#define BURST 256
+#define CERTFILE "11-protocols.pem"
+
+#define SMALL_REQUEST "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n"
+#define BULK_REQUEST "GET /bulk HTTP/1.1\r\nHost: localhost\r\n\r\n"
+#define UPGRADE_REQUEST "GET /%s HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n" \
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n"
+
+/// A blocking client connection, with its read buffer.
+typedef struct{
+	int fd;
+#ifdef HAVE_GNUTLS
+	gnutls_session_t session;
+#endif
+	size_t pos;       ///< Of the first byte not consumed at buffer
+	size_t received;  ///< Bytes at buffer
+	char buffer[16*1024];
+}connection;
+
+/// A client thread, and its results.
+typedef struct{
+	pthread_t thread;
+	int tls;
+	int resume;
+	size_t message_size;
+	int upstream;
+	int64_t end_ns;
+#ifdef HAVE_GNUTLS
+	gnutls_datum_t session_data; ///< To resume the next connection
+#endif
+	uint32_t *latencies_us;
+	size_t nlatencies;
+	size_t latencies_size;
+	long count;       ///< Handshakes, responses or messages
+	long resumed;
+	long errors;
+	int64_t bytes;
+	int64_t cpu_ns;   ///< Used by the thread, so not by the server
+}client;
+
+static int64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+static int64_t cpu_ns(clockid_t clock){
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ((int64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+static char *bulk=NULL;
+/// Large enough for any message, masked with the zero mask, so as is.
+static char *payload=NULL;
+
+static int bench_seconds=BENCH_SECONDS;
+static int bench_threads=BENCH_THREADS;
+static int bench_subscribers=BENCH_SUBSCRIBERS;
+static int bench_port=8190;
+
+/// While a server stops, the connections that the clients reset on course are not logged.
+static int stopping=0;
+
+static void bench_log(onion_log_level level, const char *filename, int lineno, const char *fmt, ...){
+	if (stopping)
+		return;
+	char tmp[512];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+	onion_log_stderr(level, filename, lineno, "%s", tmp);
+}
+
+static onion_connection_status small_handler(void *_, onion_request *req, onion_response *res){
+	onion_response_set_length(res, 2);
+	onion_response_write(res, "OK", 2);
+	return OCS_PROCESSED;
+}
+
+static onion_connection_status bulk_handler(void *_, onion_request *req, onion_response *res){
+	onion_response_set_length(res, BULK_SIZE);
+	onion_response_write(res, bulk, BULK_SIZE);
+	return OCS_PROCESSED;
+}
+
+/**
+ * @short The messages of the websocket benchmark.
+ *
+ * The binary ones are read and dropped. The text ones are commands: "down n size" writes n binary messages of
+ * that size, and "sync" answers "sync", so the client knows all before it was read.
+ */
+static onion_connection_status ws_bench_data(void *_, onion_websocket *ws, size_t data_ready_len){
+	char tmp[16*1024];
+	if (onion_websocket_get_opcode(ws)!=OWS_TEXT){
+		while (data_ready_len){
+			int r=onion_websocket_read(ws, tmp, data_ready_len<sizeof(tmp) ? data_ready_len : sizeof(tmp));
+			if (r<=0)
+				return OCS_CLOSE_CONNECTION;
+			data_ready_len-=r;
+		}
+		return OCS_NEED_MORE_DATA;
+	}
+	if (data_ready_len>=sizeof(tmp))
+		return OCS_CLOSE_CONNECTION;
+	int r=onion_websocket_read(ws, tmp, data_ready_len);
+	if (r<0)
+		return OCS_CLOSE_CONNECTION;
+	tmp[r]='\0';
+	int n, size;
+	if (sscanf(tmp, "down %d %d", &n, &size)==2 && size<=LARGE_MESSAGE){
+		onion_websocket_set_opcode(ws, OWS_BINARY);
+		while (n--)
+			if (onion_websocket_write(ws, payload, size)<0)
+				return OCS_CLOSE_CONNECTION;
+		onion_websocket_set_opcode(ws, OWS_TEXT);
+	}
+	else if (strcmp(tmp, "sync")==0)
+		onion_websocket_write(ws, "sync", 4);
+	return OCS_NEED_MORE_DATA;
+}
+
+static onion_connection_status ws_bench_handler(void *_, onion_request *req, onion_response *res){
+	onion_websocket *ws=onion_websocket_new(req, res);
+	if (!ws)
+		return OCS_NOT_PROCESSED;
+	onion_websocket_set_callback(ws, ws_bench_data);
+	return OCS_WEBSOCKET;
+}
+
+/// The subscribers only read; the messages come from the group.
+static onion_connection_status ws_sub_data(void *_, onion_websocket *ws, size_t data_ready_len){
+	char tmp[256];
+	while (data_ready_len){
+		int r=onion_websocket_read(ws, tmp, data_ready_len<sizeof(tmp) ? data_ready_len : sizeof(tmp));
+		if (r<=0)
+			return OCS_CLOSE_CONNECTION;
+		data_ready_len-=r;
+	}
+	return OCS_NEED_MORE_DATA;
+}
+
+static onion_websocket_group *broadcast_group=NULL;
+
+static onion_connection_status ws_sub_handler(void *_, onion_request *req, onion_response *res){
+	onion_websocket *ws=onion_websocket_new(req, res);
+	if (!ws)
+		return OCS_NOT_PROCESSED;
+	onion_websocket_set_callback(ws, ws_sub_data);
+	onion_websocket_group_subscribe(broadcast_group, ws);
+	return OCS_WEBSOCKET;
+}
+
+#ifdef HAVE_GNUTLS
+static gnutls_certificate_credentials_t client_cred=NULL;
+
+/// A self signed certificate and its key, at the same file, as certtool may not be there.
+static int write_certificate(const char *filename){
+	gnutls_x509_privkey_t key;
+	gnutls_x509_crt_t crt;
+	gnutls_x509_privkey_init(&key);
+	gnutls_x509_privkey_generate(key, GNUTLS_PK_RSA, 2048, 0);
+	gnutls_x509_crt_init(&crt);
+	gnutls_x509_crt_set_version(crt, 3);
+	gnutls_x509_crt_set_serial(crt, "\x01", 1);
+	gnutls_x509_crt_set_activation_time(crt, time(NULL)-3600);
+	gnutls_x509_crt_set_expiration_time(crt, time(NULL)+24*3600);
+	gnutls_x509_crt_set_dn_by_oid(crt, GNUTLS_OID_X520_COMMON_NAME, 0, "localhost", strlen("localhost"));
+	gnutls_x509_crt_set_key(crt, key);
+	int r=gnutls_x509_crt_sign2(crt, crt, key, GNUTLS_DIG_SHA256, 0);
+
+	static char pem[16*1024];
+	size_t l1=sizeof(pem), l2;
+	if (r>=0)
+		r=gnutls_x509_crt_export(crt, GNUTLS_X509_FMT_PEM, pem, &l1);
+	l2=sizeof(pem)-l1;
+	if (r>=0)
+		r=gnutls_x509_privkey_export(key, GNUTLS_X509_FMT_PEM, pem+l1, &l2);
+	gnutls_x509_crt_deinit(crt);
+	gnutls_x509_privkey_deinit(key);
+	if (r<0)
+		return -1;
+	FILE *f=fopen(filename, "w");
+	if (!f)
+		return -1;
+	fwrite(pem, 1, l1+l2, f);
+	fclose(f);
+	return 0;
+}
+#endif
+
+/// Resets the connection, so there is no TIME_WAIT.
+static void conn_close(connection *c){
+	if (c->fd<0)
+		return;
+#ifdef HAVE_GNUTLS
+	if (c->session){
+		gnutls_deinit(c->session);
+		c->session=NULL;
+	}
+#endif
+	struct linger l={ 1, 0 };
+	setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+	close(c->fd);
+	c->fd=-1;
+}
+
+/// Connects, and with tls, does the handshake, resuming the session of session_data if any.
+static int conn_open(connection *c, int tls, void *session_data){
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(bench_port);
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+
+	c->pos=c->received=0;
+	c->buffer[0]='\0';
+	c->fd=socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (c->fd<0)
+		return -1;
+	int one=1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(c->fd, (struct sockaddr*)&addr, sizeof(addr))<0){
+		close(c->fd);
+		c->fd=-1;
+		return -1;
+	}
+#ifdef HAVE_GNUTLS
+	c->session=NULL;
+	if (tls){
+		gnutls_init(&c->session, GNUTLS_CLIENT);
+		gnutls_set_default_priority(c->session);
+		gnutls_credentials_set(c->session, GNUTLS_CRD_CERTIFICATE, client_cred);
+		gnutls_transport_set_int(c->session, c->fd);
+		gnutls_datum_t *data=session_data;
+		if (data && data->data)
+			gnutls_session_set_data(c->session, data->data, data->size);
+		int r;
+		do{
+			r=gnutls_handshake(c->session);
+		}while (r<0 && !gnutls_error_is_fatal(r));
+		if (r<0){
+			conn_close(c);
+			return -1;
+		}
+	}
+#endif
+	return 0;
+}
+
+static int conn_write(connection *c, const char *data, size_t len){
+	while (len){
+		ssize_t w;
+#ifdef HAVE_GNUTLS
+		if (c->session)
+			w=gnutls_record_send(c->session, data, len);
+		else
+#endif
+		w=send(c->fd, data, len, MSG_NOSIGNAL);
+		if (w<=0)
+			return -1;
+		data+=w;
+		len-=w;
+	}
+	return 0;
+}
+
+/// Refills the buffer, keeping what was not consumed. <=0 when closed or on error.
+static ssize_t conn_fill(connection *c){
+	if (c->pos){
+		memmove(c->buffer, c->buffer+c->pos, c->received-c->pos);
+		c->received-=c->pos;
+		c->pos=0;
+		c->buffer[c->received]='\0';
+	}
+	ssize_t r;
+#ifdef HAVE_GNUTLS
+	if (c->session){
+		do{
+			r=gnutls_record_recv(c->session, c->buffer+c->received, sizeof(c->buffer)-1-c->received);
+		}while (r==GNUTLS_E_AGAIN || r==GNUTLS_E_INTERRUPTED);
+	}
+	else
+#endif
+	r=recv(c->fd, c->buffer+c->received, sizeof(c->buffer)-1-c->received, 0);
+	if (r>0){
+		c->received+=r;
+		c->buffer[c->received]='\0';
+	}
+	return r;
+}
+
+/// Reads len bytes to data, or skips them if data is NULL.
+static int conn_read(connection *c, char *data, size_t len){
+	while (len){
+		if (c->pos==c->received && conn_fill(c)<=0)
+			return -1;
+		size_t n=c->received-c->pos;
+		if (n>len)
+			n=len;
+		if (data){
+			memcpy(data, c->buffer+c->pos, n);
+			data+=n;
+		}
+		c->pos+=n;
+		len-=n;
+	}
+	return 0;
+}
+
+/// Reads the headers of a response, up to the empty line. Returns its Content-Length, or -1 on error.
+static ssize_t conn_read_head(connection *c, int *status){
+	char *end;
+	while ( !(end=strstr(c->buffer+c->pos, "\r\n\r\n")) ){
+		if (c->received-c->pos==sizeof(c->buffer)-1 || conn_fill(c)<=0)
+			return -1;
+	}
+	*end='\0';
+	*status=atoi(c->buffer+c->pos+9);
+	const char *length=strstr(c->buffer+c->pos, "Content-Length: ");
+	c->pos=end+4-c->buffer;
+	return length ? strtoul(length+16, NULL, 10) : 0;
+}
+
+/// Requests, and reads the whole response. Its size, or -1 on error.
+static ssize_t conn_request(connection *c, const char *request){
+	if (conn_write(c, request, strlen(request))<0)
+		return -1;
+	int status;
+	ssize_t length=conn_read_head(c, &status);
+	if (length<0 || status!=200 || conn_read(c, NULL, length)<0)
+		return -1;
+	return length;
+}
+
+static void add_latency(client *cl, int64_t ns){
+	if (cl->nlatencies==cl->latencies_size){
+		cl->latencies_size=cl->latencies_size ? cl->latencies_size*2 : 64*1024;
+		cl->latencies_us=realloc(cl->latencies_us, cl->latencies_size*sizeof(uint32_t));
+	}
+	cl->latencies_us[cl->nlatencies++]=ns/1000;
+}
+
+#ifdef HAVE_GNUTLS
+/// A new connection each time, with a small request, so the handshake is most of it.
+static void *handshake_run(void *data){
+	client *cl=data;
+	connection c;
+	while (now_ns()<cl->end_ns){
+		int64_t start=now_ns();
+		if (conn_open(&c, 1, cl->resume ? &cl->session_data : NULL)<0){
+			cl->errors++;
+			continue;
+		}
+		if (conn_request(&c, SMALL_REQUEST)<0)
+			cl->errors++;
+		else{
+			add_latency(cl, now_ns()-start);
+			cl->count++;
+			if (gnutls_session_is_resumed(c.session))
+				cl->resumed++;
+			if (cl->resume){ // The ticket comes after the handshake, with the response.
+				gnutls_free(cl->session_data.data);
+				cl->session_data.data=NULL;
+				gnutls_session_get_data2(c.session, &cl->session_data);
+			}
+		}
+		conn_close(&c);
+	}
+	stopping=1;
+	gnutls_free(cl->session_data.data);
+	cl->cpu_ns=cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+	return NULL;
+}
+#endif
+
+/// Large responses, one after the other on the same connection.
+static void *bulk_run(void *data){
+	client *cl=data;
+	connection c;
+	if (conn_open(&c, cl->tls, NULL)<0){
+		cl->errors++;
+		return NULL;
+	}
+	while (now_ns()<cl->end_ns){
+		int64_t start=now_ns();
+		ssize_t r=conn_request(&c, BULK_REQUEST);
+		if (r<0){
+			cl->errors++;
+			break;
+		}
+		add_latency(cl, now_ns()-start);
+		cl->count++;
+		cl->bytes+=r;
+	}
+	stopping=1;
+	conn_close(&c);
+	return NULL;
+}
+
+/// Connects, and upgrades to websocket.
+static int ws_open(connection *c, const char *path){
+	if (conn_open(c, 0, NULL)<0)
+		return -1;
+	char request[512];
+	snprintf(request, sizeof(request), UPGRADE_REQUEST, path);
+	int status;
+	if (conn_write(c, request, strlen(request))<0 || conn_read_head(c, &status)<0 || status!=101){
+		conn_close(c);
+		return -1;
+	}
+	return 0;
+}
+
+/// Writes a message, masked with the zero mask, so the payload is sent as is but the server still unmasks it.
+static int ws_write(connection *c, int opcode, const char *data, size_t len){
+	unsigned char header[14];
+	int hlen=2;
+	header[0]=0x80 | opcode;
+	if (len<126)
+		header[1]=0x80 | len;
+	else if (len<65536){
+		header[1]=0x80 | 126;
+		header[2]=len>>8;
+		header[3]=len;
+		hlen=4;
+	}
+	else{
+		header[1]=0x80 | 127;
+		int i;
+		for (i=0;i<8;i++)
+			header[2+i]=((uint64_t)len)>>(56-8*i);
+		hlen=10;
+	}
+	memset(header+hlen, 0, 4);
+	hlen+=4;
+	struct iovec iov[2]={ { header, hlen }, { (void*)data, len } };
+	ssize_t w=writev(c->fd, iov, 2);
+	if (w<0)
+		return -1;
+	if (w<hlen+len){ // Rest of it, blocking
+		if (w<hlen && conn_write(c, (char*)header+w, hlen-w)<0)
+			return -1;
+		size_t done=w<hlen ? 0 : w-hlen;
+		return conn_write(c, data+done, len-done);
+	}
+	return 0;
+}
+
+/// Reads a message; its payload to data, up to size, and the rest is skipped. Returns its length, or -1.
+static ssize_t ws_read(connection *c, int *opcode, char *data, size_t size){
+	unsigned char header[8];
+	if (conn_read(c, (char*)header, 2)<0)
+		return -1;
+	*opcode=header[0]&0x0F;
+	uint64_t len=header[1]&0x7F;
+	if (len==126){
+		if (conn_read(c, (char*)header, 2)<0)
+			return -1;
+		len=(header[0]<<8) | header[1];
+	}
+	else if (len==127){
+		if (conn_read(c, (char*)header, 8)<0)
+			return -1;
+		int i;
+		len=0;
+		for (i=0;i<8;i++)
+			len=(len<<8) | header[i];
+	}
+	size_t n=len<size ? len : size;
+	if (conn_read(c, data, n)<0 || conn_read(c, NULL, len-n)<0)
+		return -1;
+	return len;
+}
+
+/// Waits for the answer to "sync", so all the messages before it were read by the server.
+static int ws_sync(connection *c){
+	if (ws_write(c, OWS_TEXT, "sync", 4)<0)
+		return -1;
+	char tmp[8];
+	int opcode;
+	return ws_read(c, &opcode, tmp, sizeof(tmp))==4 && opcode==OWS_TEXT ? 0 : -1;
+}
+
+/// Bursts of messages to the server, or from it, each burst synced, so the queues do not grow.
+static void *websocket_run(void *data){
+	client *cl=data;
+	connection c;
+	if (ws_open(&c, "ws")<0){
+		cl->errors++;
+		return NULL;
+	}
+	char command[64];
+	snprintf(command, sizeof(command), "down %d %d", BURST, (int)cl->message_size);
+	while (now_ns()<cl->end_ns){
+		int i;
+		if (cl->upstream){
+			for (i=0;i<BURST;i++)
+				if (ws_write(&c, OWS_BINARY, payload, cl->message_size)<0)
+					break;
+			if (i<BURST || ws_sync(&c)<0){
+				cl->errors++;
+				break;
+			}
+		}
+		else{
+			if (ws_write(&c, OWS_TEXT, command, strlen(command))<0){
+				cl->errors++;
+				break;
+			}
+			int opcode;
+			for (i=0;i<BURST;i++)
+				if (ws_read(&c, &opcode, NULL, 0)!=cl->message_size)
+					break;
+			if (i<BURST){
+				cl->errors++;
+				break;
+			}
+		}
+		cl->count+=BURST;
+		cl->bytes+=BURST*cl->message_size;
+	}
+	stopping=1;
+	conn_close(&c);
+	return NULL;
+}
+
+static int compare_u32(const void *a, const void *b){
+	uint32_t x=*(const uint32_t*)a, y=*(const uint32_t*)b;
+	return x<y ? -1 : x>y;
+}
+
+/// Waits until the server accepts connections.
+static int wait_for_server(uint16_t port){
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(port);
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	int i;
+	for (i=0;i<200;i++){
+		int fd=socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int r=connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+		close(fd);
+		if (r==0)
+			return 0;
+		usleep(10000);
+	}
+	return -1;
+}
+
+/// Starts a server like the examples: basic over HTTPS with tls, else websockets.
+static onion *server_start(int tls){
+	char port[16];
+	snprintf(port, sizeof(port), "%d", bench_port);
+	onion *o=onion_new((tls ? O_POOL : O_THREADED) | O_DETACH_LISTEN);
+	if (!tls) // A thread for each websocket
+		onion_set_max_threads(o, bench_subscribers+bench_threads+16);
+	onion_listen_point *lp=NULL;
+#ifdef HAVE_GNUTLS
+	if (tls){
+		lp=onion_https_new();
+		onion_https_set_certificate(lp, O_SSL_CERTIFICATE_KEY, CERTFILE, CERTFILE);
+	}
+#endif
+	if (!lp)
+		lp=onion_http_new();
+	onion_add_listen_point(o, "127.0.0.1", port, lp);
+	onion_url *urls=onion_root_url(o);
+	onion_url_add(urls, "", small_handler);
+	onion_url_add(urls, "bulk", bulk_handler);
+	onion_url_add(urls, "ws", ws_bench_handler);
+	onion_url_add(urls, "sub", ws_sub_handler);
+	onion_listen(o);
+	if (wait_for_server(bench_port)<0){
+		ONION_ERROR("Server at %s did not start", port);
+		onion_free(o);
+		return NULL;
+	}
+	return o;
+}
+
+static void server_stop(onion *o){
+	stopping=1;
+	onion_listen_stop(o);
+	onion_free(o);
+	stopping=0;
+	bench_port++; // The next run does not wait for this one's sockets
+}
+
+/// Results of the client threads of a run.
+typedef struct{
+	long count;
+	long resumed;
+	long errors;
+	int64_t bytes;
+	int64_t client_cpu_ns;
+	double seconds;
+	size_t n;
+	uint32_t *latencies;
+}results;
+
+/// Runs the clients until the time is up, and adds their results.
+static void run_clients(client *cl, void *(*run)(void *), results *r){
+	int64_t start=now_ns(), end=start+((int64_t)bench_seconds)*1000000000;
+	int i;
+	for (i=0;i<bench_threads;i++){
+		cl[i].end_ns=end;
+		pthread_create(&cl[i].thread, NULL, run, &cl[i]);
+	}
+	memset(r, 0, sizeof(*r));
+	for (i=0;i<bench_threads;i++){
+		pthread_join(cl[i].thread, NULL);
+		r->count+=cl[i].count;
+		r->resumed+=cl[i].resumed;
+		r->errors+=cl[i].errors;
+		r->bytes+=cl[i].bytes;
+		r->client_cpu_ns+=cl[i].cpu_ns;
+		r->n+=cl[i].nlatencies;
+	}
+	r->seconds=(now_ns()-start)/1e9;
+	r->latencies=malloc((r->n+1)*sizeof(uint32_t));
+	size_t n=0;
+	for (i=0;i<bench_threads;i++){
+		if (cl[i].nlatencies)
+			memcpy(r->latencies+n, cl[i].latencies_us, cl[i].nlatencies*sizeof(uint32_t));
+		n+=cl[i].nlatencies;
+		free(cl[i].latencies_us);
+	}
+	qsort(r->latencies, r->n, sizeof(uint32_t), compare_u32);
+}
+
+#define PERCENTILE(l, n, q) ((n) ? (l)[(size_t)((q)*((n)-1))] : 0)
+
+static void print_latencies(FILE *out, const char *name, uint32_t *l, size_t n){
+	fprintf(out, "\"%s\":{\"p50\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}", name,
+		PERCENTILE(l, n, 0.5), PERCENTILE(l, n, 0.99), PERCENTILE(l, n, 0.999), n ? l[n-1] : 0);
+}
+
+#ifdef HAVE_GNUTLS
+/// Full and resumed handshakes per second, and per second of server CPU.
+static void bench_handshake(FILE *out){
+	fprintf(out, "\"handshake\":[");
+	int resume;
+	for (resume=0;resume<=1;resume++){
+		onion *o=server_start(1);
+		if (!o)
+			break;
+		client *cl=calloc(bench_threads, sizeof(client));
+		int i;
+		for (i=0;i<bench_threads;i++)
+			cl[i].resume=resume;
+		results r;
+		int64_t cpu_start=cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+		run_clients(cl, handshake_run, &r);
+		double server_cpu=(cpu_ns(CLOCK_PROCESS_CPUTIME_ID)-cpu_start-r.client_cpu_ns)/1e9;
+		server_stop(o);
+		fprintf(out, "%s\n    {\"resumed_sessions\":%s,\"handshakes\":%ld,\"resumed\":%ld,\"errors\":%ld,"
+			"\"handshakes_per_second\":%.1f,\"handshakes_per_core_second\":%.1f,",
+			resume ? "," : "", resume ? "true" : "false", r.count, r.resumed, r.errors,
+			r.count/r.seconds, server_cpu>0 ? r.count/server_cpu : 0);
+		print_latencies(out, "latency_us", r.latencies, r.n);
+		fprintf(out, "}");
+		fprintf(stderr, "%10s %8s %12.0f handshakes/s %10.0f per core\n", "handshake", resume ? "resumed" : "full",
+			r.count/r.seconds, server_cpu>0 ? r.count/server_cpu : 0);
+		free(r.latencies);
+		free(cl);
+	}
+	fprintf(out, "\n  ]");
+}
+#endif
+
+/// Bytes per second of large responses, over HTTP and over HTTPS.
+static void bench_bulk(FILE *out, int use_tls){
+	fprintf(out, "\"bulk\":[");
+	int tls;
+	for (tls=0;tls<=use_tls;tls++){
+		onion *o=server_start(tls);
+		if (!o)
+			break;
+		client *cl=calloc(bench_threads, sizeof(client));
+		int i;
+		for (i=0;i<bench_threads;i++)
+			cl[i].tls=tls;
+		results r;
+		run_clients(cl, bulk_run, &r);
+		server_stop(o);
+		fprintf(out, "%s\n    {\"tls\":%s,\"body_size\":%d,\"responses\":%ld,\"errors\":%ld,\"bytes_per_second\":%.1f,",
+			tls ? "," : "", tls ? "true" : "false", BULK_SIZE, r.count, r.errors, r.bytes/r.seconds);
+		print_latencies(out, "latency_us", r.latencies, r.n);
+		fprintf(out, "}");
+		fprintf(stderr, "%10s %8s %12.1f MB/s\n", "bulk", tls ? "https" : "http", r.bytes/r.seconds/(1024*1024));
+		free(r.latencies);
+		free(cl);
+	}
+	fprintf(out, "\n  ]");
+}
+
+/// Messages per second, small and large, from the clients and to them.
+static void bench_websocket(FILE *out){
+	fprintf(out, "\"websocket\":[");
+	size_t sizes[]={ SMALL_MESSAGE, LARGE_MESSAGE };
+	int s, upstream, first=1;
+	for (s=0;s<2;s++){
+		for (upstream=1;upstream>=0;upstream--){
+			onion *o=server_start(0);
+			if (!o)
+				break;
+			client *cl=calloc(bench_threads, sizeof(client));
+			int i;
+			for (i=0;i<bench_threads;i++){
+				cl[i].message_size=sizes[s];
+				cl[i].upstream=upstream;
+			}
+			results r;
+			run_clients(cl, websocket_run, &r);
+			server_stop(o);
+			fprintf(out, "%s\n    {\"direction\":\"%s\",\"message_size\":%ld,\"messages\":%ld,\"errors\":%ld,"
+				"\"messages_per_second\":%.1f,\"bytes_per_second\":%.1f}",
+				first ? "" : ",", upstream ? "to_server" : "to_client", (long)sizes[s], r.count, r.errors,
+				r.count/r.seconds, r.bytes/r.seconds);
+			fprintf(stderr, "%10s %9s %6ld B %10.0f msg/s %10.1f MB/s\n", "websocket", upstream ? "to server" : "to client",
+				(long)sizes[s], r.count/r.seconds, r.bytes/r.seconds/(1024*1024));
+			first=0;
+			free(r.latencies);
+			free(cl);
+		}
+	}
+	fprintf(out, "\n  ]");
+}
+
+/// Publishes messages with their time to the subscribers, one after the other, and reads them at one epoll.
+static void bench_broadcast(FILE *out){
+	broadcast_group=onion_websocket_group_new(OWS_GROUP_DROP, 1024);
+	onion *o=server_start(0);
+	connection *subs=calloc(bench_subscribers, sizeof(connection));
+	int epfd=epoll_create1(EPOLL_CLOEXEC);
+	int i, nsubs=0;
+	long errors=0;
+	for (i=0;i<bench_subscribers;i++)
+		subs[i].fd=-1;
+	for (i=0;o && i<bench_subscribers;i++){
+		if (ws_open(&subs[i], "sub")<0){
+			errors++;
+			continue;
+		}
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events=EPOLLIN;
+		ev.data.ptr=&subs[i];
+		epoll_ctl(epfd, EPOLL_CTL_ADD, subs[i].fd, &ev);
+		nsubs++;
+	}
+	int64_t deadline=now_ns()+1000000000;
+	while (o && onion_websocket_group_count(broadcast_group)<nsubs && now_ns()<deadline)
+		usleep(1000);
+
+	size_t size=1024*1024, n=0, nmessages=0;
+	uint32_t *delivery=malloc(size*sizeof(uint32_t));
+	uint32_t *fanout=malloc(size*sizeof(uint32_t));
+	int64_t start=now_ns(), end=start+((int64_t)bench_seconds)*1000000000;
+	while (o && nsubs && now_ns()<end && n+nsubs<=size){
+		int64_t sent=now_ns();
+		char message[32];
+		int len=snprintf(message, sizeof(message), "%ld", (long)sent);
+		if (onion_websocket_group_publish(broadcast_group, OWS_TEXT, message, len)<nsubs)
+			errors++;
+		int got=0;
+		int64_t last=sent;
+		while (got<nsubs){
+			struct epoll_event ev[64];
+			int r=epoll_wait(epfd, ev, sizeof(ev)/sizeof(ev[0]), 1000);
+			if (r<=0){
+				errors+=nsubs-got;
+				break;
+			}
+			int64_t now=now_ns();
+			for (i=0;i<r;i++){
+				connection *c=ev[i].data.ptr;
+				do{ // All the messages at its buffer; a fill only when some are at the socket
+					char tmp[32];
+					int opcode;
+					ssize_t l=ws_read(c, &opcode, tmp, sizeof(tmp)-1);
+					if (l<0){
+						epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+						errors++;
+						break;
+					}
+					tmp[l<sizeof(tmp)-1 ? l : sizeof(tmp)-1]='\0';
+					if (atol(tmp)==sent){
+						delivery[n++]=(now-sent)/1000;
+						got++;
+						last=now;
+					}
+				}while (c->pos<c->received);
+			}
+		}
+		if (got<nsubs)
+			break;
+		fanout[nmessages++]=(last-sent)/1000;
+	}
+	double seconds=(now_ns()-start)/1e9;
+	stopping=1;
+	for (i=0;i<bench_subscribers;i++)
+		conn_close(&subs[i]);
+	close(epfd);
+	free(subs);
+	if (o)
+		server_stop(o);
+	onion_websocket_group_free(broadcast_group);
+	broadcast_group=NULL;
+
+	qsort(delivery, n, sizeof(uint32_t), compare_u32);
+	qsort(fanout, nmessages, sizeof(uint32_t), compare_u32);
+	fprintf(out, "\"broadcast\":{\"subscribers\":%d,\"messages\":%ld,\"deliveries\":%ld,\"errors\":%ld,"
+		"\"messages_per_second\":%.1f,", nsubs, (long)nmessages, (long)n, errors, nmessages/seconds);
+	print_latencies(out, "delivery_latency_us", delivery, n);
+	fprintf(out, ",");
+	print_latencies(out, "fanout_latency_us", fanout, nmessages);
+	fprintf(out, "}");
+	fprintf(stderr, "%10s %5d subs %10.0f msg/s, fan-out p50 %u us p99 %u us\n", "broadcast", nsubs,
+		nmessages/seconds, PERCENTILE(fanout, nmessages, 0.5), PERCENTILE(fanout, nmessages, 0.99));
+	free(delivery);
+	free(fanout);
+}
+
+static void usage(const char *name){
+	fprintf(stderr, "Usage: %s [-t seconds] [-g client threads] [-n subscribers] [-p first port] "
+					"[-b handshake,bulk,websocket,broadcast] [-o results.json]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv){
+	const char *benchmarks="handshake,bulk,websocket,broadcast";
+	const char *output=NULL;
+	int opt;
+	while ( (opt=getopt(argc, argv, "t:g:n:p:b:o:")) != -1 ){
+		switch(opt){
+			case 't': bench_seconds=atoi(optarg); break;
+			case 'g': bench_threads=atoi(optarg); break;
+			case 'n': bench_subscribers=atoi(optarg); break;
+			case 'p': bench_port=atoi(optarg); break;
+			case 'b': benchmarks=optarg; break;
+			case 'o': output=optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (bench_seconds<=0 || bench_threads<=0 || bench_subscribers<=0)
+		usage(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+	onion_log_flags=OF_NOINFO;
+	onion_log=bench_log;
+	bulk=malloc(BULK_SIZE);
+	memset(bulk, 'x', BULK_SIZE);
+	payload=calloc(1, LARGE_MESSAGE);
+	int use_tls=0;
+#ifdef HAVE_GNUTLS
+	if (write_certificate(CERTFILE)<0)
+		ONION_ERROR("Could not write the certificate, HTTPS is skipped");
+	else{
+		use_tls=1;
+		gnutls_certificate_allocate_credentials(&client_cred);
+	}
+#endif
+
+	FILE *out=output ? fopen(output, "w") : stdout;
+	if (!out){
+		ONION_ERROR("Could not open %s", output);
+		return 1;
+	}
+	fprintf(out, "{\"seconds\":%d,\"client_threads\":%d,\"results\":{", bench_seconds, bench_threads);
+	const char *sep="\n  ";
+#ifdef HAVE_GNUTLS
+	if (use_tls && strstr(benchmarks, "handshake")){
+		fprintf(out, "%s", sep);
+		bench_handshake(out);
+		sep=",\n  ";
+	}
+#endif
+	if (strstr(benchmarks, "bulk")){
+		fprintf(out, "%s", sep);
+		bench_bulk(out, use_tls);
+		sep=",\n  ";
+	}
+	if (strstr(benchmarks, "websocket")){
+		fprintf(out, "%s", sep);
+		bench_websocket(out);
+		sep=",\n  ";
+	}
+	if (strstr(benchmarks, "broadcast")){
+		fprintf(out, "%s", sep);
+		bench_broadcast(out);
+	}
+	fprintf(out, "\n}}\n");
+	if (output)
+		fclose(out);
+
+#ifdef HAVE_GNUTLS
+	if (client_cred){
+		gnutls_certificate_free_credentials(client_cred);
+		unlink(CERTFILE);
+	}
+#endif
+	free(bulk);
+	free(payload);
+	return 0;
+}
@@ -0,0 +1,327 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+/**
+ * @short Measures how the shared structures scale with the threads that use them at once.
+ *
+ * Each workload runs with 1, 2, 4... threads up to -n, by default the CPUs, hammering the same structure for -t
+ * seconds. The throughput at each count, and the speedup over one thread, are one JSON object, at stdout or at
+ * the -o file, and are plotted at stderr:
+ *
+ *   ./12-contention -t 1 -n 16 -o contention.json
+ *
+ * -w selects the workloads, for example -w sessions,dict. They are:
+ *
+ *  - sessions: 80% gets of existing sessions, 10% creates and 10% removes of the thread's own ones.
+ *  - dict: a dup of a shared dict of headers, as each request does, a get from it, and its free.
+ *  - log: warnings through onion_log to /dev/null.
+ *  - poller: add and remove of an eventfd to a poller that polls at its own thread, as connections come and go.
+ *
+ * A flat line is a lock that all the threads wait for; it should grow with the threads, up to the CPUs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <onion/dict.h>
+#include <onion/sessions.h>
+#include <onion/poller.h>
+#include <onion/log.h>
+
+/// Default seconds of each run
+#define BENCH_SECONDS 1
+/// Operations between the checks of the end
+#define BATCH 64
+/// Sessions that the gets find
+#define SESSIONS 10000
+/// Sessions each thread created and did not remove yet
+#define OWN_SESSIONS 64
+
+/// A thread of a run, and its count.
+typedef struct{
+	pthread_t thread;
+	uint64_t random;
+	long ops;
+	char *own[OWN_SESSIONS];
+	int nown;
+}worker;
+
+static volatile int running=0;
+static pthread_barrier_t barrier;
+
+static onion_sessions *sessions=NULL;
+static char *session_ids[SESSIONS];
+static onion_dict *headers=NULL;
+static onion_poller *poller=NULL;
+
+static uint64_t next_random(worker *w){ // xorshift64
+	w->random^=w->random<<13;
+	w->random^=w->random>>7;
+	w->random^=w->random<<17;
+	return w->random;
+}
+
+static int64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+static void sessions_op(worker *w){
+	int r=next_random(w)%10;
+	if (r==0 && w->nown<OWN_SESSIONS)
+		w->own[w->nown++]=onion_sessions_create(sessions);
+	else if (r==1 && w->nown>0){
+		char *id=w->own[--w->nown];
+		onion_sessions_remove(sessions, id);
+		free(id);
+	}
+	else{
+		onion_dict *session=onion_sessions_get(sessions, session_ids[next_random(w)%SESSIONS]);
+		if (session)
+			onion_dict_free(session);
+	}
+}
+
+static void dict_op(worker *w){
+	onion_dict *d=onion_dict_dup(headers);
+	if (!onion_dict_get(d, "Host"))
+		ONION_ERROR("Host header not found");
+	onion_dict_free(d);
+}
+
+static void log_op(worker *w){
+	ONION_WARNING("Contention benchmark %ld", w->ops);
+}
+
+static int never_called(void *_){
+	return -1;
+}
+
+static void close_fd(void *fd){
+	close((intptr_t)fd);
+}
+
+static void poller_op(worker *w){
+	int fd=eventfd(0, EFD_CLOEXEC);
+	if (fd<0)
+		return;
+	onion_poller_slot *slot=onion_poller_slot_new(fd, never_called, NULL);
+	onion_poller_slot_set_shutdown(slot, close_fd, (void*)(intptr_t)fd);
+	onion_poller_add(poller, slot);
+	onion_poller_remove(poller, fd);
+}
+
+/// A workload: a shared structure, its setup and teardown, and the operation the threads repeat on it.
+typedef struct{
+	const char *name;
+	void (*setup)();
+	void (*op)(worker *w);
+	void (*teardown)();
+}workload;
+
+static void sessions_setup(){
+	sessions=onion_sessions_new();
+	int i;
+	for (i=0;i<SESSIONS;i++)
+		session_ids[i]=onion_sessions_create(sessions);
+}
+
+static void sessions_teardown(){
+	int i;
+	for (i=0;i<SESSIONS;i++)
+		free(session_ids[i]);
+	onion_sessions_free(sessions);
+	sessions=NULL;
+}
+
+static void dict_setup(){
+	const char *names[]={ "Host", "User-Agent", "Accept", "Accept-Language", "Accept-Encoding", "Connection",
+		"Cookie", "Referer", "Cache-Control", "Upgrade-Insecure-Requests", "Pragma", "DNT" };
+	headers=onion_dict_new();
+	int i;
+	for (i=0;i<sizeof(names)/sizeof(names[0]);i++)
+		onion_dict_add(headers, names[i], "some value of the header", 0);
+}
+
+static void dict_teardown(){
+	onion_dict_free(headers);
+	headers=NULL;
+}
+
+static pthread_t poller_thread;
+static int saved_stderr=-1;
+
+static void *poller_run(void *_){
+	onion_poller_poll(poller);
+	return NULL;
+}
+
+static void poller_setup(){
+	poller=onion_poller_new(1024);
+	pthread_create(&poller_thread, NULL, poller_run, NULL);
+}
+
+static void poller_teardown(){
+	onion_poller_stop(poller);
+	pthread_join(poller_thread, NULL);
+	onion_poller_free(poller);
+	poller=NULL;
+}
+
+static void log_setup(){
+	fflush(stderr);
+	saved_stderr=dup(2);
+	int null=open("/dev/null", O_WRONLY | O_CLOEXEC);
+	dup2(null, 2);
+	close(null);
+}
+
+static void log_teardown(){
+	fflush(stderr);
+	dup2(saved_stderr, 2);
+	close(saved_stderr);
+}
+
+static void (*current_op)(worker *w);
+
+static void *worker_run(void *data){
+	worker *w=data;
+	pthread_barrier_wait(&barrier);
+	while (running){
+		int i;
+		for (i=0;i<BATCH;i++)
+			current_op(w);
+		w->ops+=BATCH;
+	}
+	return NULL;
+}
+
+/// Runs the workload at that many threads. Returns operations per second.
+static double run(const workload *wl, int nthreads, int seconds){
+	worker *w=calloc(nthreads, sizeof(worker));
+	current_op=wl->op;
+	running=1;
+	pthread_barrier_init(&barrier, NULL, nthreads+1);
+	int i;
+	for (i=0;i<nthreads;i++){
+		w[i].random=0x9E3779B97F4A7C15ull*(i+1);
+		pthread_create(&w[i].thread, NULL, worker_run, &w[i]);
+	}
+	pthread_barrier_wait(&barrier);
+	int64_t start=now_ns();
+	usleep(seconds*1000000);
+	running=0;
+	long ops=0;
+	for (i=0;i<nthreads;i++){
+		pthread_join(w[i].thread, NULL);
+		ops+=w[i].ops;
+		while (w[i].nown>0){
+			char *id=w[i].own[--w[i].nown];
+			onion_sessions_remove(sessions, id);
+			free(id);
+		}
+	}
+	double elapsed=(now_ns()-start)/1e9;
+	pthread_barrier_destroy(&barrier);
+	free(w);
+	return ops/elapsed;
+}
+
+static void usage(const char *name){
+	fprintf(stderr, "Usage: %s [-t seconds] [-n max threads] [-w sessions,dict,log,poller] [-o results.json]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv){
+	const char *workloads="sessions,dict,log,poller";
+	const char *output=NULL;
+	int seconds=BENCH_SECONDS;
+	int max_threads=sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while ( (opt=getopt(argc, argv, "t:n:w:o:")) != -1 ){
+		switch(opt){
+			case 't': seconds=atoi(optarg); break;
+			case 'n': max_threads=atoi(optarg); break;
+			case 'w': workloads=optarg; break;
+			case 'o': output=optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (seconds<=0 || max_threads<=0)
+		usage(argv[0]);
+	if (max_threads<2)
+		max_threads=2;
+
+	onion_log_flags=OF_NOINFO;
+	FILE *out=output ? fopen(output, "w") : stdout;
+	if (!out){
+		ONION_ERROR("Could not open %s", output);
+		return 1;
+	}
+	int counts[32], ncounts=0, n;
+	for (n=1;n<max_threads && ncounts<31;n*=2)
+		counts[ncounts++]=n;
+	counts[ncounts++]=max_threads;
+
+	const workload all[]={
+		{ "sessions", sessions_setup, sessions_op, sessions_teardown },
+		{ "dict", dict_setup, dict_op, dict_teardown },
+		{ "log", log_setup, log_op, log_teardown },
+		{ "poller", poller_setup, poller_op, poller_teardown },
+	};
+	fprintf(out, "{\"seconds\":%d,\"cpus\":%ld,\"results\":{", seconds, sysconf(_SC_NPROCESSORS_ONLN));
+	int i, j, first=1;
+	for (i=0;i<sizeof(all)/sizeof(all[0]);i++){
+		if (!strstr(workloads, all[i].name))
+			continue;
+		double rates[32], max_rate=0;
+		for (j=0;j<ncounts;j++){
+			all[i].setup();
+			rates[j]=run(&all[i], counts[j], seconds);
+			all[i].teardown();
+			if (rates[j]>max_rate)
+				max_rate=rates[j];
+		}
+		fprintf(out, "%s\n  \"%s\":[", first ? "" : ",", all[i].name);
+		fprintf(stderr, "%s\n", all[i].name);
+		for (j=0;j<ncounts;j++){
+			double speedup=rates[0]>0 ? rates[j]/rates[0] : 0;
+			fprintf(out, "%s{\"threads\":%d,\"ops_per_second\":%.1f,\"speedup\":%.2f}", j ? "," : "",
+				counts[j], rates[j], speedup);
+			char bar[41];
+			int len=max_rate>0 ? (int)(40*rates[j]/max_rate) : 0;
+			memset(bar, '#', len);
+			bar[len]='\0';
+			fprintf(stderr, "  %3d %-40s %12.0f ops/s x%.2f\n", counts[j], bar, rates[j], speedup);
+		}
+		fprintf(out, "]");
+		first=0;
+	}
+	fprintf(out, "\n}}\n");
+	if (output)
+		fclose(out);
+	return 0;
+}
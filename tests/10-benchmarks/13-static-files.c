@@ -0,0 +1,641 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+/**
+ * @short Measures the static files: onion_handler_export_local_new and onion_shortcut_response_file.
+ *
+ * Each combination of file size, handler, HTTP or HTTPS, sendfile or not, the whole file or a range of it,
+ * keep alive or not, and cold or warm page cache, is run for -t seconds by -c blocking clients, against an
+ * O_POOL server at the same process. The results are one JSON object, at stdout or at the -o file:
+ *
+ *   ./13-static-files -t 2 -s 100,1m,1g -o static-files.json
+ *
+ * The files are created at -d, by default the current directory; it should not be a tmpfs, as there the
+ * cold page cache is as warm. Cold is that the clients drop the pages of the file before each request,
+ * with posix_fadvise. -T skips HTTPS, -C the cold cache, and -F enables the server file cache.
+ *
+ * ONION_SENDFILE is read once per process, so each sendfile setting runs at a child process. The CPU per GB
+ * and the syscalls per request are of the server: those of the process but the ones of the client threads.
+ * The syscalls are the read and write ones, as counted at /proc/self/io, so sendfile counts, but not epoll.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef HAVE_GNUTLS
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#endif
+
+#include <onion/onion.h>
+#include <onion/http.h>
+#include <onion/url.h>
+#include <onion/shortcuts.h>
+#include <onion/handlers/exportlocal.h>
+#include <onion/log.h>
+#ifdef HAVE_GNUTLS
+#include <onion/https.h>
+#endif
+
+/// Default seconds of each combination
+#define BENCH_SECONDS 1
+/// Default client threads, each with its connection
+#define BENCH_THREADS 2
+/// Default file sizes
+#define BENCH_SIZES "100,10k,1m,100m,1g"
+/// Most bytes of a range request, from a quarter of the file
+#define RANGE_SIZE (1024*1024)
+#define CERTFILE "13-static-files.pem"
+
+/// A combination of the matrix.
+typedef struct{
+	const char *handler;  ///< "export_local" or "response_file"
+	size_t size;
+	int tls;
+	int range;
+	int keep_alive;
+	int cold;
+}combination;
+
+/// A blocking client connection.
+typedef struct{
+	int fd;
+#ifdef HAVE_GNUTLS
+	gnutls_session_t session;
+#endif
+}connection;
+
+/// A client thread, and its results.
+typedef struct{
+	pthread_t thread;
+	const combination *comb;
+	int64_t end_ns;
+	long requests;
+	long errors;
+	int64_t bytes;
+	int64_t cpu_ns;
+	long syscalls;
+}client;
+
+static int bench_seconds=BENCH_SECONDS;
+static int bench_threads=BENCH_THREADS;
+static int bench_port=8200;
+static int file_cache=0;
+static char directory[512]=".";
+
+/// While a server stops, the connections that the clients reset on course are not logged.
+static int stopping=0;
+
+static void bench_log(onion_log_level level, const char *filename, int lineno, const char *fmt, ...){
+	if (stopping)
+		return;
+	char tmp[512];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+	onion_log_stderr(level, filename, lineno, "%s", tmp);
+}
+
+static int64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+static int64_t cpu_ns(clockid_t clock){
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ((int64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+/// Read and write syscalls so far, of the process or of the calling thread.
+static long io_syscalls(const char *path){
+	FILE *f=fopen(path, "r");
+	if (!f)
+		return 0;
+	char line[128];
+	long total=0, n;
+	while (fgets(line, sizeof(line), f)){
+		if (sscanf(line, "syscr: %ld", &n)==1 || sscanf(line, "syscw: %ld", &n)==1)
+			total+=n;
+	}
+	fclose(f);
+	return total;
+}
+
+static void file_path(char *path, size_t size, size_t file_size){
+	snprintf(path, size, "%s/static-%zu", directory, file_size);
+}
+
+/// Creates the file of that size, if not there already.
+static int file_create(size_t size){
+	char path[600];
+	file_path(path, sizeof(path), size);
+	struct stat st;
+	if (stat(path, &st)==0 && st.st_size==size)
+		return 0;
+	int fd=open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd<0)
+		return -1;
+	static char block[1024*1024];
+	memset(block, 'x', sizeof(block));
+	size_t left=size;
+	while (left){
+		ssize_t w=write(fd, block, left<sizeof(block) ? left : sizeof(block));
+		if (w<=0){
+			close(fd);
+			unlink(path);
+			return -1;
+		}
+		left-=w;
+	}
+	close(fd);
+	return 0;
+}
+
+/// Drops the pages of the file, or reads them all, for the cold or the warm page cache.
+static void file_cache_state(size_t size, int cold){
+	char path[600];
+	file_path(path, sizeof(path), size);
+	int fd=open(path, O_RDONLY | O_CLOEXEC);
+	if (fd<0)
+		return;
+	if (cold){
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	else{
+		static __thread char tmp[64*1024];
+		while (read(fd, tmp, sizeof(tmp))>0);
+	}
+	close(fd);
+}
+
+static onion_connection_status response_file_handler(void *_, onion_request *req, onion_response *res){
+	char path[600];
+	snprintf(path, sizeof(path), "%s/%s", directory, onion_request_get_path(req));
+	return onion_shortcut_response_file(path, req, res);
+}
+
+#ifdef HAVE_GNUTLS
+static gnutls_certificate_credentials_t client_cred=NULL;
+
+/// A self signed certificate and its key, at the same file, as certtool may not be there.
+static int write_certificate(const char *filename){
+	gnutls_x509_privkey_t key;
+	gnutls_x509_crt_t crt;
+	gnutls_x509_privkey_init(&key);
+	gnutls_x509_privkey_generate(key, GNUTLS_PK_RSA, 2048, 0);
+	gnutls_x509_crt_init(&crt);
+	gnutls_x509_crt_set_version(crt, 3);
+	gnutls_x509_crt_set_serial(crt, "\x01", 1);
+	gnutls_x509_crt_set_activation_time(crt, time(NULL)-3600);
+	gnutls_x509_crt_set_expiration_time(crt, time(NULL)+24*3600);
+	gnutls_x509_crt_set_dn_by_oid(crt, GNUTLS_OID_X520_COMMON_NAME, 0, "localhost", strlen("localhost"));
+	gnutls_x509_crt_set_key(crt, key);
+	int r=gnutls_x509_crt_sign2(crt, crt, key, GNUTLS_DIG_SHA256, 0);
+
+	static char pem[16*1024];
+	size_t l1=sizeof(pem), l2;
+	if (r>=0)
+		r=gnutls_x509_crt_export(crt, GNUTLS_X509_FMT_PEM, pem, &l1);
+	l2=sizeof(pem)-l1;
+	if (r>=0)
+		r=gnutls_x509_privkey_export(key, GNUTLS_X509_FMT_PEM, pem+l1, &l2);
+	gnutls_x509_crt_deinit(crt);
+	gnutls_x509_privkey_deinit(key);
+	if (r<0)
+		return -1;
+	FILE *f=fopen(filename, "w");
+	if (!f)
+		return -1;
+	fwrite(pem, 1, l1+l2, f);
+	fclose(f);
+	return 0;
+}
+#endif
+
+/// Resets the connection, so there is no TIME_WAIT.
+static void conn_close(connection *c){
+	if (c->fd<0)
+		return;
+#ifdef HAVE_GNUTLS
+	if (c->session){
+		gnutls_deinit(c->session);
+		c->session=NULL;
+	}
+#endif
+	struct linger l={ 1, 0 };
+	setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+	close(c->fd);
+	c->fd=-1;
+}
+
+static int conn_open(connection *c, int tls){
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(bench_port);
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	c->fd=socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (c->fd<0)
+		return -1;
+	int one=1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(c->fd, (struct sockaddr*)&addr, sizeof(addr))<0){
+		close(c->fd);
+		c->fd=-1;
+		return -1;
+	}
+#ifdef HAVE_GNUTLS
+	c->session=NULL;
+	if (tls){
+		gnutls_init(&c->session, GNUTLS_CLIENT);
+		gnutls_set_default_priority(c->session);
+		gnutls_credentials_set(c->session, GNUTLS_CRD_CERTIFICATE, client_cred);
+		gnutls_transport_set_int(c->session, c->fd);
+		int r;
+		do{
+			r=gnutls_handshake(c->session);
+		}while (r<0 && !gnutls_error_is_fatal(r));
+		if (r<0){
+			conn_close(c);
+			return -1;
+		}
+	}
+#endif
+	return 0;
+}
+
+static int conn_write(connection *c, const char *data, size_t len){
+	while (len){
+		ssize_t w;
+#ifdef HAVE_GNUTLS
+		if (c->session)
+			w=gnutls_record_send(c->session, data, len);
+		else
+#endif
+		w=send(c->fd, data, len, MSG_NOSIGNAL);
+		if (w<=0)
+			return -1;
+		data+=w;
+		len-=w;
+	}
+	return 0;
+}
+
+static ssize_t conn_read(connection *c, char *data, size_t len){
+#ifdef HAVE_GNUTLS
+	if (c->session){
+		ssize_t r;
+		do{
+			r=gnutls_record_recv(c->session, data, len);
+		}while (r==GNUTLS_E_AGAIN || r==GNUTLS_E_INTERRUPTED);
+		return r;
+	}
+#endif
+	return recv(c->fd, data, len, 0);
+}
+
+/**
+ * @short Requests the file, and reads all the response. Returns the bytes of the body, or -1 on error.
+ *
+ * Reads the headers first, and then the body to a buffer that is dropped.
+ */
+static ssize_t conn_request(connection *c, const combination *comb){
+	char request[512];
+	char range[64]="";
+	size_t expected=comb->size;
+	if (comb->range){
+		size_t from=comb->size/4, len=comb->size/2<RANGE_SIZE ? comb->size/2 : RANGE_SIZE;
+		snprintf(range, sizeof(range), "Range: bytes=%zu-%zu\r\n", from, from+len-1);
+		expected=len;
+	}
+	snprintf(request, sizeof(request), "GET /%s/static-%zu HTTP/1.1\r\nHost: localhost\r\n%s%s\r\n",
+		strcmp(comb->handler, "export_local")==0 ? "export" : "file", comb->size, range,
+		comb->keep_alive ? "" : "Connection: close\r\n");
+	if (conn_write(c, request, strlen(request))<0)
+		return -1;
+
+	static __thread char buffer[64*1024+1];
+	size_t received=0;
+	char *end=NULL;
+	while (!end){
+		ssize_t r=conn_read(c, buffer+received, 8*1024-received);
+		if (r<=0)
+			return -1;
+		received+=r;
+		buffer[received]='\0';
+		end=strstr(buffer, "\r\n\r\n");
+		if (!end && received==8*1024)
+			return -1;
+	}
+	int status=atoi(buffer+9);
+	const char *length=strstr(buffer, "Content-Length: ");
+	if (status!=(comb->range ? 206 : 200) || !length || strtoul(length+16, NULL, 10)!=expected)
+		return -1;
+	size_t body=received-(end+4-buffer);
+	while (body<expected){
+		ssize_t r=conn_read(c, buffer, expected-body<sizeof(buffer)-1 ? expected-body : sizeof(buffer)-1);
+		if (r<=0)
+			return -1;
+		body+=r;
+	}
+	return body;
+}
+
+static void *client_run(void *data){
+	client *cl=data;
+	const combination *comb=cl->comb;
+	connection c={ -1 };
+	while (now_ns()<cl->end_ns){
+		if (comb->cold)
+			file_cache_state(comb->size, 1);
+		if (c.fd<0 && conn_open(&c, comb->tls)<0){
+			cl->errors++;
+			continue;
+		}
+		ssize_t r=conn_request(&c, comb);
+		if (r<0){
+			cl->errors++;
+			conn_close(&c);
+			continue;
+		}
+		cl->requests++;
+		cl->bytes+=r;
+		if (!comb->keep_alive)
+			conn_close(&c);
+	}
+	stopping=1;
+	conn_close(&c);
+	cl->cpu_ns=cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+	cl->syscalls=io_syscalls("/proc/thread-self/io");
+	return NULL;
+}
+
+/// Waits until the server accepts connections.
+static int wait_for_server(uint16_t port){
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(port);
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	int i;
+	for (i=0;i<200;i++){
+		int fd=socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int r=connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+		close(fd);
+		if (r==0)
+			return 0;
+		usleep(10000);
+	}
+	return -1;
+}
+
+/// Runs the combination, and writes its JSON object as a line.
+static void bench_static(FILE *out, const combination *comb, int sendfile){
+	char port[16];
+	snprintf(port, sizeof(port), "%d", bench_port);
+	onion *o=onion_new(O_POOL | O_DETACH_LISTEN);
+	if (file_cache)
+		onion_set_file_cache(o, 1024, 1000);
+	onion_listen_point *lp=NULL;
+#ifdef HAVE_GNUTLS
+	if (comb->tls){
+		lp=onion_https_new();
+		onion_https_set_certificate(lp, O_SSL_CERTIFICATE_KEY, CERTFILE, CERTFILE);
+	}
+#endif
+	if (!lp)
+		lp=onion_http_new();
+	onion_add_listen_point(o, "127.0.0.1", port, lp);
+	onion_url *urls=onion_root_url(o);
+	onion_url_add_handler(urls, "^export/", onion_handler_export_local_new(directory));
+	onion_url_add(urls, "^file/", response_file_handler);
+	onion_listen(o);
+
+	file_cache_state(comb->size, comb->cold);
+	client *cl=calloc(bench_threads, sizeof(client));
+	long requests=0, errors=0, client_syscalls=0;
+	int64_t bytes=0, client_cpu=0, start=now_ns();
+	int64_t cpu_start=cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+	long syscalls_start=io_syscalls("/proc/self/io");
+	int i;
+	stopping=1; // The probes close without a request, or without a TLS handshake
+	int ready=wait_for_server(bench_port);
+	usleep(10000);
+	stopping=0;
+	if (ready<0){
+		ONION_ERROR("Server at %s did not start", port);
+		errors=-1;
+	}
+	else{
+		start=now_ns();
+		cpu_start=cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+		syscalls_start=io_syscalls("/proc/self/io");
+		for (i=0;i<bench_threads;i++){
+			cl[i].comb=comb;
+			cl[i].end_ns=start+((int64_t)bench_seconds)*1000000000;
+			pthread_create(&cl[i].thread, NULL, client_run, &cl[i]);
+		}
+		for (i=0;i<bench_threads;i++){
+			pthread_join(cl[i].thread, NULL);
+			requests+=cl[i].requests;
+			errors+=cl[i].errors;
+			bytes+=cl[i].bytes;
+			client_cpu+=cl[i].cpu_ns;
+			client_syscalls+=cl[i].syscalls;
+		}
+	}
+	double seconds=(now_ns()-start)/1e9;
+	double server_cpu=(cpu_ns(CLOCK_PROCESS_CPUTIME_ID)-cpu_start-client_cpu)/1e9;
+	long server_syscalls=io_syscalls("/proc/self/io")-syscalls_start-client_syscalls;
+	stopping=1;
+	onion_listen_stop(o);
+	onion_free(o);
+	stopping=0;
+	bench_port++; // The next run does not wait for this one's sockets
+	free(cl);
+
+	fprintf(out, "{\"handler\":\"%s\",\"size\":%zu,\"tls\":%s,\"sendfile\":%s,\"range\":%s,\"keep_alive\":%s,"
+		"\"cache\":\"%s\",\"requests\":%ld,\"errors\":%ld,\"requests_per_second\":%.1f,\"bytes_per_second\":%.1f,"
+		"\"cpu_seconds_per_gb\":%.3f,\"syscalls_per_request\":%.1f}\n",
+		comb->handler, comb->size, comb->tls ? "true" : "false", sendfile ? "true" : "false",
+		comb->range ? "true" : "false", comb->keep_alive ? "true" : "false", comb->cold ? "cold" : "warm",
+		requests, errors, requests/seconds, bytes/seconds, bytes ? server_cpu/(bytes/1e9) : 0,
+		requests ? (double)server_syscalls/requests : 0);
+	fflush(out);
+	fprintf(stderr, "%13s %10zu %5s %8s %5s %10s %4s %10.0f req/s %10.1f MB/s\n", comb->handler, comb->size,
+		comb->tls ? "https" : "http", sendfile ? "sendfile" : "write", comb->range ? "range" : "full",
+		comb->keep_alive ? "keep-alive" : "close", comb->cold ? "cold" : "warm", requests/seconds,
+		bytes/seconds/(1024*1024));
+}
+
+/// Parses a size as 100, 10k, 1m or 1g.
+static size_t parse_size(const char *s){
+	char *end;
+	size_t n=strtoul(s, &end, 10);
+	switch(*end){
+		case 'k': case 'K': return n*1024;
+		case 'm': case 'M': return n*1024*1024;
+		case 'g': case 'G': return n*1024*1024*1024;
+	}
+	return n;
+}
+
+static void usage(const char *name){
+	fprintf(stderr, "Usage: %s [-t seconds] [-c client threads] [-s sizes] [-d directory] [-p first port] "
+					"[-T] [-C] [-F] [-o results.json]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv){
+	const char *sizes_arg=BENCH_SIZES;
+	const char *output=NULL;
+	int use_tls=1, use_cold=1;
+	int opt;
+	while ( (opt=getopt(argc, argv, "t:c:s:d:p:TCFo:")) != -1 ){
+		switch(opt){
+			case 't': bench_seconds=atoi(optarg); break;
+			case 'c': bench_threads=atoi(optarg); break;
+			case 's': sizes_arg=optarg; break;
+			case 'd': snprintf(directory, sizeof(directory), "%s", optarg); break;
+			case 'p': bench_port=atoi(optarg); break;
+			case 'T': use_tls=0; break;
+			case 'C': use_cold=0; break;
+			case 'F': file_cache=1; break;
+			case 'o': output=optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (bench_seconds<=0 || bench_threads<=0)
+		usage(argv[0]);
+
+	size_t sizes[16];
+	int nsizes=0;
+	char *tmp=strdup(sizes_arg), *save=NULL, *tok;
+	for (tok=strtok_r(tmp, ",", &save); tok && nsizes<16; tok=strtok_r(NULL, ",", &save))
+		if ( (sizes[nsizes]=parse_size(tok)) > 0 )
+			nsizes++;
+	free(tmp);
+	if (!nsizes)
+		usage(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+	onion_log_flags=OF_NOINFO;
+	onion_log=bench_log;
+	int i;
+	for (i=0;i<nsizes;i++){
+		if (file_create(sizes[i])<0){
+			ONION_ERROR("Could not create the file of %zu bytes at %s", sizes[i], directory);
+			return 1;
+		}
+	}
+#ifdef HAVE_GNUTLS
+	if (use_tls && write_certificate(CERTFILE)<0){
+		ONION_ERROR("Could not write the certificate, HTTPS is skipped");
+		use_tls=0;
+	}
+#else
+	use_tls=0;
+#endif
+
+	FILE *out=output ? fopen(output, "w") : stdout;
+	if (!out){
+		ONION_ERROR("Could not open %s", output);
+		return 1;
+	}
+	fprintf(out, "{\"seconds\":%d,\"client_threads\":%d,\"file_cache\":%s,\"results\":[",
+					bench_seconds, bench_threads, file_cache ? "true" : "false");
+	fflush(out);
+	const char *handlers[]={ "export_local", "response_file" };
+	int first=1, sendfile;
+	for (sendfile=1;sendfile>=0;sendfile--){
+		int fds[2];
+		if (pipe(fds)<0)
+			break;
+		pid_t pid=fork();
+		if (pid==0){ // ONION_SENDFILE is read at the first file sent, so once per process.
+			close(fds[0]);
+			setenv("ONION_SENDFILE", sendfile ? "1" : "0", 1);
+			FILE *results=fdopen(fds[1], "w");
+#ifdef HAVE_GNUTLS
+			if (use_tls)
+				gnutls_certificate_allocate_credentials(&client_cred);
+#endif
+			bench_port+=sendfile ? 0 : 1000;
+			int s, h, tls, range, keep_alive, cold;
+			for (s=0;s<nsizes;s++)
+				for (h=0;h<2;h++)
+					for (tls=0;tls<=use_tls;tls++)
+						for (range=0;range<=1;range++)
+							for (keep_alive=1;keep_alive>=0;keep_alive--)
+								for (cold=0;cold<=use_cold;cold++){
+									combination comb={ handlers[h], sizes[s], tls, range, keep_alive, cold };
+									bench_static(results, &comb, sendfile);
+								}
+			fclose(results);
+#ifdef HAVE_GNUTLS
+			if (client_cred)
+				gnutls_certificate_free_credentials(client_cred);
+#endif
+			_exit(0);
+		}
+		close(fds[1]);
+		FILE *results=fdopen(fds[0], "r");
+		char line[1024];
+		while (results && fgets(line, sizeof(line), results)){
+			line[strcspn(line, "\n")]='\0';
+			fprintf(out, "%s\n  %s", first ? "" : ",", line);
+			first=0;
+		}
+		if (results)
+			fclose(results);
+		waitpid(pid, NULL, 0);
+	}
+	fprintf(out, "\n]}\n");
+	if (output)
+		fclose(out);
+
+#ifdef HAVE_GNUTLS
+	if (use_tls)
+		unlink(CERTFILE);
+#endif
+	char path[600];
+	for (i=0;i<nsizes;i++){
+		file_path(path, sizeof(path), sizes[i]);
+		unlink(path);
+	}
+	return 0;
+}
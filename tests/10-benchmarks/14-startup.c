@@ -0,0 +1,292 @@
+/*
+	Onion HTTP server library
+	Copyright (C) 2010-2013 David Moreno Montero
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU Affero General Public License as
+	published by the Free Software Foundation, either version 3 of the
+	License, or (at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU Affero General Public License for more details.
+
+	You should have received a copy of the GNU Affero General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+	*/
+
+/**
+ * @short Measures the cold start: from the exec of a new server process to the first byte it serves.
+ *
+ * Each run execs this program again as a server, that creates the onion with onion_new, sets a handler and
+ * listens, while this process connects as soon as it can and asks for /. The server tells its own times
+ * through a pipe, so the total is split in phases:
+ *
+ *  - exec: from the fork to main, the exec and the dynamic linking.
+ *  - new: onion_new.
+ *  - listen: from onion_new to the first accepted connection, as the listen points open and the threads start.
+ *  - first: from the connection to the first byte of the response, the first request.
+ *
+ * Each mode (-m pool,threaded,poll) runs -n times; the minimum, median and 90th percentile of each phase,
+ * in microseconds, are one JSON object, at stdout or at the -o file:
+ *
+ *   ./14-startup -n 50 -o startup.json
+ *
+ * -s also creates a session at the first request, and -f serves a file, so they are at the first byte too.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <onion/onion.h>
+#include <onion/request.h>
+#include <onion/response.h>
+#include <onion/shortcuts.h>
+#include <onion/dict.h>
+#include <onion/log.h>
+
+/// Default runs of each mode
+#define BENCH_RUNS 20
+/// Port of the servers
+#define BENCH_PORT 8210
+/// Longest wait for a server, in milliseconds
+#define BENCH_TIMEOUT_MS 5000
+
+/// The times a server sends through the pipe, as CLOCK_MONOTONIC nanoseconds, that all processes share.
+typedef struct{
+	int64_t main;
+	int64_t created;
+}server_times;
+
+/// The phases of a run, in nanoseconds.
+typedef struct{
+	int64_t exec;
+	int64_t create;
+	int64_t listen;
+	int64_t first;
+	int64_t total;
+}run_times;
+
+static int64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+static const char *served_file=NULL;
+static int use_session=0;
+
+static onion_connection_status first_handler(void *_, onion_request *req, onion_response *res){
+	if (use_session)
+		onion_dict_add(onion_request_get_session_dict(req), "started", "yes", 0);
+	if (served_file)
+		return onion_shortcut_response_file(served_file, req, res);
+	onion_response_write0(res, "started");
+	return OCS_PROCESSED;
+}
+
+/// The server process: tells its times, and serves until killed.
+static int server_main(int64_t main_ns, const char *mode, const char *port, int pipe_fd){
+	int flags=O_POOL;
+	if (strcmp(mode, "threaded")==0)
+		flags=O_THREADED;
+	else if (strcmp(mode, "poll")==0)
+		flags=O_POLL;
+	server_times times;
+	times.main=main_ns;
+	onion *o=onion_new(flags);
+	times.created=now_ns();
+	onion_set_root_handler(o, onion_handler_new(first_handler, NULL, NULL));
+	onion_set_hostname(o, "127.0.0.1");
+	onion_set_port(o, port);
+	if (write(pipe_fd, &times, sizeof(times))!=sizeof(times))
+		return 1;
+	close(pipe_fd);
+	onion_listen(o);
+	onion_free(o);
+	return 0;
+}
+
+/// Connects, retrying until the server listens. Returns the socket, or -1.
+static int connect_server(int port, int64_t deadline){
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(port);
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	while (now_ns()<deadline){
+		int fd=socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd<0)
+			return -1;
+		if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))==0){
+			int one=1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			return fd;
+		}
+		close(fd);
+		usleep(50);
+	}
+	return -1;
+}
+
+/// Starts a server at that mode and measures it. Returns 0 if it served.
+static int run(const char *self, const char *mode, int port, run_times *t){
+	int pipe_fds[2];
+	if (pipe2(pipe_fds, O_CLOEXEC)<0)
+		return -1;
+	char port_str[16], fd_str[16];
+	snprintf(port_str, sizeof(port_str), "%d", port);
+	snprintf(fd_str, sizeof(fd_str), "%d", pipe_fds[1]);
+	char *args[16]={ (char*)self, "-S", (char*)mode, "-p", port_str, "-P", fd_str };
+	int nargs=7;
+	if (served_file){
+		args[nargs++]="-f";
+		args[nargs++]=(char*)served_file;
+	}
+	if (use_session)
+		args[nargs++]="-s";
+	args[nargs]=NULL;
+
+	int64_t start=now_ns();
+	pid_t pid=fork();
+	if (pid==0){
+		fcntl(pipe_fds[1], F_SETFD, 0); // The server keeps its end
+		execv("/proc/self/exe", args);
+		_exit(127);
+	}
+	close(pipe_fds[1]);
+	int ret=-1;
+	int fd=connect_server(port, start+BENCH_TIMEOUT_MS*1000000ll);
+	if (fd>=0){
+		int64_t connected=now_ns();
+		const char *request="GET / HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n\r\n";
+		char c;
+		if (write(fd, request, strlen(request))==strlen(request) && read(fd, &c, 1)==1){
+			int64_t first=now_ns();
+			server_times times;
+			if (read(pipe_fds[0], &times, sizeof(times))==sizeof(times)){
+				t->exec=times.main-start;
+				t->create=times.created-times.main;
+				t->listen=connected-times.created;
+				t->first=first-connected;
+				t->total=first-start;
+				ret=0;
+			}
+		}
+		close(fd);
+	}
+	close(pipe_fds[0]);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return ret;
+}
+
+static int compare_int64(const void *a, const void *b){
+	int64_t x=*(const int64_t*)a, y=*(const int64_t*)b;
+	return x<y ? -1 : x>y;
+}
+
+/// Writes the min, median and 90th percentile of that phase of the runs, in microseconds.
+static void phase_stats(FILE *out, const char *name, run_times *runs, int n, size_t offset, int first){
+	int64_t *values=malloc(sizeof(int64_t)*n);
+	int i;
+	for (i=0;i<n;i++)
+		values[i]=*(int64_t*)(((char*)&runs[i])+offset);
+	qsort(values, n, sizeof(int64_t), compare_int64);
+	fprintf(out, "%s\"%s\":{\"min\":%.1f,\"median\":%.1f,\"p90\":%.1f}", first ? "" : ",", name,
+		values[0]/1e3, values[n/2]/1e3, values[(n*9)/10]/1e3);
+	fprintf(stderr, "  %-8s min %9.1f  median %9.1f  p90 %9.1f us\n", name, values[0]/1e3, values[n/2]/1e3,
+		values[(n*9)/10]/1e3);
+	free(values);
+}
+
+static void usage(const char *name){
+	fprintf(stderr, "Usage: %s [-n runs] [-m pool,threaded,poll] [-p port] [-s] [-f file] [-o results.json]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv){
+	int64_t main_ns=now_ns();
+	const char *modes="pool,threaded,poll";
+	const char *output=NULL;
+	const char *server_mode=NULL;
+	int runs=BENCH_RUNS;
+	int port=BENCH_PORT;
+	int pipe_fd=-1;
+	int opt;
+	while ( (opt=getopt(argc, argv, "n:m:p:sf:o:S:P:")) != -1 ){
+		switch(opt){
+			case 'n': runs=atoi(optarg); break;
+			case 'm': modes=optarg; break;
+			case 'p': port=atoi(optarg); break;
+			case 's': use_session=1; break;
+			case 'f': served_file=optarg; break;
+			case 'o': output=optarg; break;
+			case 'S': server_mode=optarg; break;
+			case 'P': pipe_fd=atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (server_mode){
+		char port_str[16];
+		snprintf(port_str, sizeof(port_str), "%d", port);
+		onion_log_flags=OF_NOINFO;
+		return server_main(main_ns, server_mode, port_str, pipe_fd);
+	}
+	if (runs<=0)
+		usage(argv[0]);
+
+	signal(SIGPIPE, SIG_IGN);
+	FILE *out=output ? fopen(output, "w") : stdout;
+	if (!out){
+		ONION_ERROR("Could not open %s", output);
+		return 1;
+	}
+	const char *all[]={ "pool", "threaded", "poll" };
+	run_times *times=malloc(sizeof(run_times)*runs);
+	fprintf(out, "{\"runs\":%d,\"session\":%s,\"file\":%s,\"results\":{", runs, use_session ? "true" : "false",
+		served_file ? "true" : "false");
+	int i, j, first=1;
+	for (i=0;i<sizeof(all)/sizeof(all[0]);i++){
+		if (!strstr(modes, all[i]))
+			continue;
+		int n=0;
+		for (j=0;j<runs;j++){
+			if (run(argv[0], all[i], port+(j%16), &times[n])==0) // Several ports, so the previous run is surely closed
+				n++;
+			else
+				ONION_ERROR("Run %d of %s did not serve", j, all[i]);
+		}
+		if (!n)
+			continue;
+		fprintf(out, "%s\n  \"%s\":{", first ? "" : ",", all[i]);
+		fprintf(stderr, "%s, %d runs\n", all[i], n);
+		phase_stats(out, "exec", times, n, offsetof(run_times, exec), 1);
+		phase_stats(out, "new", times, n, offsetof(run_times, create), 0);
+		phase_stats(out, "listen", times, n, offsetof(run_times, listen), 0);
+		phase_stats(out, "first", times, n, offsetof(run_times, first), 0);
+		phase_stats(out, "total", times, n, offsetof(run_times, total), 0);
+		fprintf(out, "}");
+		first=0;
+	}
+	fprintf(out, "\n}}\n");
+	free(times);
+	if (output)
+		fclose(out);
+	return 0;
+}
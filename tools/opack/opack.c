@@ -23,20 +23,35 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <stdint.h>
+#include <string.h>
 #include <onion/mime.h>
+#include <onion/handlers/archive.h>
+#include <onion/codecs.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
 
 #include "../common/updateassets.h"
 
+/// Cache-Control of the generated handlers. By default they are revalidated, which is a 304 while they do not change.
+const char *cache_control="no-cache";
+
 void print_help();
 char *funcname(const char *prefix, const char *filename);
 void parse_file(const char *prefix, const char *filename, FILE *outfd, onion_assets_file *assets);
 void parse_directory(const char *prefix, const char *dirname, FILE *outfd, onion_assets_file *assets);
+int write_archive(const char *archive, char **files, int nfiles);
 
 int main(int argc, char **argv){
 	if (argc==1)
 		print_help(argv[0]);
 	int i;
 	char *outfile=NULL;
+	char *archive=NULL;
 	char *assetfile="assets.h";
 	// First pass cancel out the options, let only the files
 	for (i=1;i<argc;i++){
@@ -62,8 +77,31 @@ int main(int argc, char **argv){
 			argv[i+1]=NULL; 
 			i++;
 		}
+		else if (strcmp(argv[i],"-r")==0){
+			if (i>=argc-1){
+				fprintf(stderr,"ERROR: Need an argument for -r");
+				exit(2);
+			}
+			archive=argv[i+1];
+			argv[i]=NULL; // cancel them out.
+			argv[i+1]=NULL; 
+			i++;
+		}
+		else if (strcmp(argv[i],"-c")==0){
+			if (i>=argc-1){
+				fprintf(stderr,"ERROR: Need an argument for -c");
+				exit(2);
+			}
+			cache_control=argv[i+1][0] ? argv[i+1] : NULL;
+			argv[i]=NULL; // cancel them out.
+			argv[i+1]=NULL; 
+			i++;
+		}
 	}
 	
+	if (archive)
+		return write_archive(archive, argv+1, argc-1);
+	
 	FILE *outfd=stdout;
 	if (outfile){
 		outfd=fopen(outfile,"w");
@@ -78,6 +116,7 @@ int main(int argc, char **argv){
 	fprintf(outfd,"/** File autogenerated by opack **/\n\n");
   fprintf(outfd,"#include <onion/request.h>\n\n");
 	fprintf(outfd,"#include <onion/response.h>\n\n");
+	fprintf(outfd,"#include <onion/shortcuts.h>\n\n");
   fprintf(outfd,"#include <string.h>\n\n");
 	
 	for (i=1;i<argc;i++){
@@ -126,8 +165,99 @@ char *funcname(const char *prefix, const char *filename){
 	return ret;
 }
 
+/// Writes the data as a static array with that name
+void print_data(FILE *outfd, const char *name, const unsigned char *data, size_t l){
+	fprintf(outfd,"  static const char %s[]={\n", name);
+	size_t i;
+	for (i=0;i<l;i++){
+		fprintf(outfd,"0x%02X, ", data[i]);
+		if ((i%16) == 15){
+			fprintf(outfd,"\n");
+		}
+	}
+	fprintf(outfd,"};\n");
+}
+
+/// Writes the prerendered headers of a variant, the same onion_shortcut_response_embedded would set.
+void print_headers(FILE *outfd, const char *name, const char *etag, const char *mime_type, const char *encoding, int vary){
+	fprintf(outfd,"  static const char %s[]=\"Etag: %s%s%s\\r\\nContent-Type: %s\\r\\n", name, etag, 
+					encoding ? "-" : "", encoding ? encoding : "", mime_type);
+	if (encoding)
+		fprintf(outfd,"Content-Encoding: %s\\r\\n", encoding);
+	if (vary)
+		fprintf(outfd,"Vary: Accept-Encoding\\r\\n");
+	if (cache_control)
+		fprintf(outfd,"Cache-Control: %s\\r\\n", cache_control);
+	fprintf(outfd,"\";\n");
+}
+
+/// Hex of a hash of the contents, for the ETag: SHA1 if there is gnutls, 64 bits FNV-1a if not.
+void content_hash(const unsigned char *data, size_t l, char hex[41]){
+#ifdef HAVE_GNUTLS
+	unsigned char sha1[20];
+	int i;
+	onion_sha1((const char*)data, l, (char*)sha1);
+	for (i=0;i<20;i++)
+		sprintf(hex+i*2, "%02x", sha1[i]);
+#else
+	uint64_t h=14695981039346656037ULL;
+	size_t i;
+	for (i=0;i<l;i++){
+		h^=data[i];
+		h*=1099511628211ULL;
+	}
+	sprintf(hex, "%016llx", (unsigned long long)h);
+#endif
+}
+
+/// A compressed variant is only kept if it saves at least a 10%.
+#define WORTH_COMPRESSED(l, compressed_l) ((compressed_l)*10 < (l)*9)
+
+/// Gzip of data, or NULL if not available or not worth it.
+unsigned char *gzip_data(const unsigned char *data, size_t l, size_t *out_l){
+#ifdef HAVE_ZLIB
+	if (!l)
+		return NULL;
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15+16, 9, Z_DEFAULT_STRATEGY)!=Z_OK)
+		return NULL;
+	size_t size=deflateBound(&z, l)+32;
+	unsigned char *out=malloc(size);
+	z.next_in=(unsigned char*)data;
+	z.avail_in=l;
+	z.next_out=out;
+	z.avail_out=size;
+	int r=deflate(&z, Z_FINISH);
+	*out_l=size-z.avail_out;
+	deflateEnd(&z);
+	if (r==Z_STREAM_END && WORTH_COMPRESSED(l, *out_l))
+		return out;
+	free(out);
+#endif
+	return NULL;
+}
+
+/// Brotli of data, or NULL if not available or not worth it.
+unsigned char *brotli_data(const unsigned char *data, size_t l, size_t *out_l){
+#ifdef HAVE_BROTLI
+	if (!l)
+		return NULL;
+	*out_l=BrotliEncoderMaxCompressedSize(l);
+	unsigned char *out=malloc(*out_l);
+	if (BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, l, data, out_l, out) && 
+			WORTH_COMPRESSED(l, *out_l))
+		return out;
+	free(out);
+#endif
+	return NULL;
+}
+
 /**
  * @short Generates the necesary data to the output stream.
+ * 
+ * The handler answers with onion_shortcut_response_embedded: the brotli or gzip variants, compressed now, if 
+ * the client accepts them, the ETag of the contents hash, and 304 if the client has it already.
  */
 void parse_file(const char *prefix, const char *filename, FILE *outfd, onion_assets_file *assets){
 	FILE *fd=fopen(filename, "r");
@@ -147,32 +277,99 @@ void parse_file(const char *prefix, const char *filename, FILE *outfd, onion_ass
 	onion_assets_file_update(assets,buffer);
 
 	fprintf(stderr, "Parsing: %s to '%s'.\n",filename, buffer);
-	fprintf(outfd,"onion_connection_status %s(void *_, onion_request *req, onion_response *res){\n  static const char data[]={\n",fname);
-	int r, i, l=0;
+	unsigned char *data=NULL;
+	size_t r, l=0;
 	while ( (r=fread(buffer,1,sizeof(buffer)-1,fd)) !=0 ){
-		for (i=0;i<r;i++){
-			fprintf(outfd,"0x%02X, ", buffer[i]&0x0FF);
-			if ((i%16) == 15){
-				fprintf(outfd,"\n");
-			}
-		}
+		data=realloc(data, l+r);
+		memcpy(data+l, buffer, r);
 		l+=r;
 	}
-	fprintf(outfd,"};\n");
+	fclose(fd);
+
+	size_t gzip_l=0, brotli_l=0;
+	unsigned char *gzip=gzip_data(data, l, &gzip_l);
+	unsigned char *brotli=brotli_data(data, l, &brotli_l);
+	char etag[41];
+	content_hash(data, l, etag);
 
+	fprintf(outfd,"onion_connection_status %s(void *_, onion_request *req, onion_response *res){\n",fname);
+	print_data(outfd, "data", data, l);
+	if (brotli)
+		print_data(outfd, "data_br", brotli, brotli_l);
+	if (gzip)
+		print_data(outfd, "data_gzip", gzip, gzip_l);
 	const char *mime_type=onion_mime_get(filename);
-  fprintf(outfd,"  onion_response_set_length(res, %d);\n", l);
-  fprintf(outfd,"  onion_response_set_header(res, \"Content-Type\", \"%s\");\n", mime_type);
-	fprintf(outfd,"  return onion_response_write(res, data, sizeof(data));\n}\n\n");
+	int vary=(brotli || gzip);
+	if (brotli)
+		print_headers(outfd, "headers_br", etag, mime_type, "br", vary);
+	if (gzip)
+		print_headers(outfd, "headers_gzip", etag, mime_type, "gzip", vary);
+	print_headers(outfd, "headers", etag, mime_type, NULL, vary);
+	fprintf(outfd,"  static const onion_shortcut_embedded variants[]={\n");
+	if (brotli)
+		fprintf(outfd,"    { \"br\", data_br, sizeof(data_br), headers_br, sizeof(headers_br)-1 },\n");
+	if (gzip)
+		fprintf(outfd,"    { \"gzip\", data_gzip, sizeof(data_gzip), headers_gzip, sizeof(headers_gzip)-1 },\n");
+	fprintf(outfd,"    { NULL, data, sizeof(data), headers, sizeof(headers)-1 }\n  };\n");
+
+	if (cache_control)
+		fprintf(outfd,"  return onion_shortcut_response_embedded(variants, \"%s\", \"%s\", \"%s\", req, res);\n}\n\n", 
+						mime_type, etag, cache_control);
+	else
+		fprintf(outfd,"  return onion_shortcut_response_embedded(variants, \"%s\", \"%s\", NULL, req, res);\n}\n\n", 
+						mime_type, etag);
 
-	fprintf(outfd,"const unsigned int %s_length = %d;\n\n",fname,l);
+	fprintf(outfd,"const unsigned int %s_length = %d;\n\n",fname,(int)l);
 	
-	fclose(fd);
+	free(gzip);
+	free(brotli);
+	free(data);
 	free(fname);
 }
 
+/// A file under a directory, by its path from there, and its handler function name.
+typedef struct{
+	char *path;
+	char *fname;
+}opack_path;
+
+static int opack_path_cmp(const void *a, const void *b){
+	return strcmp(((const opack_path*)a)->path, ((const opack_path*)b)->path);
+}
+
+/// Adds to paths all the files under dirname, recursively, with the same names and skips as parse_directory.
+void collect_paths(const char *prefix, const char *dirname, const char *relpath, opack_path **paths, int *npaths){
+	DIR *dir=opendir(dirname);
+	if (!dir)
+		return;
+	struct dirent *de;
+	char fullname[1024], path[1024];
+	while ( (de=readdir(dir)) ){
+		if (de->d_name[0]=='.' || de->d_name[strlen(de->d_name)-1]=='~')
+			continue;
+		snprintf(fullname, sizeof(fullname), "%s/%s", dirname, de->d_name);
+		snprintf(path, sizeof(path), "%s%s", relpath, de->d_name);
+		if (de->d_type==DT_DIR){
+			char prefix2[256];
+			snprintf(prefix2, sizeof(prefix2), "%s/%s", prefix, de->d_name);
+			strncat(path, "/", sizeof(path)-strlen(path)-1);
+			collect_paths(prefix2, fullname, path, paths, npaths);
+		}
+		else{
+			*paths=realloc(*paths, sizeof(opack_path)*((*npaths)+1));
+			(*paths)[*npaths].path=strdup(path);
+			(*paths)[*npaths].fname=funcname(prefix, de->d_name);
+			(*npaths)++;
+		}
+	}
+	closedir(dir);
+}
+
 /**
  * @short Bulk converts all files at dirname, excepting *~, and the creates a handler for such directory.
+ * 
+ * The handler looks up the path at a table of all the files under it, sorted, so it is a binary search and
+ * not a compare per file.
  */
 void parse_directory(const char *prefix, const char *dirname, FILE *outfd, onion_assets_file *assets){
   DIR *dir=opendir(dirname);
@@ -201,34 +398,260 @@ void parse_directory(const char *prefix, const char *dirname, FILE *outfd, onion
 	snprintf(fullname, sizeof(fullname), "onion_connection_status %s(void *_, onion_request *req, onion_response *res);", fname);
 	onion_assets_file_update(assets, fullname);
   fprintf(stderr, "Parsing directory: %s to '%s'.\n",dirname, fullname);
-  fprintf(outfd,"onion_connection_status %s(void *_, onion_request *req, onion_response *res){\n", fname);
-  fprintf(outfd,"  const char *path=onion_request_get_path(req);\n\n");
 
-  dir=opendir(dirname);
-  while ( (de=readdir(dir)) ){
-    if (de->d_name[0]=='.' || de->d_name[strlen(de->d_name)-1]=='~')
-      continue;
-    char *fname=funcname(prefix, de->d_name);
-    if (de->d_type==DT_DIR){
-      int l=strlen(de->d_name);
-      fprintf(outfd, "  if (strncmp(\"%s/\", path, %d)==0){\n", de->d_name, l+1);
-      fprintf(outfd, "    onion_request_advance_path(req, %d);\n", l+1);
-    }
-    else
-      fprintf(outfd, "  if (strcmp(\"%s\", path)==0){\n", de->d_name);
-    fprintf(outfd, "    return %s(_, req, res);\n", fname);
-    fprintf(outfd, "  }\n");
-    free(fname);
+  opack_path *paths=NULL;
+  int npaths=0, i;
+  collect_paths(prefix, dirname, "", &paths, &npaths);
+  if (npaths)
+    qsort(paths, npaths, sizeof(opack_path), opack_path_cmp);
+
+  fprintf(outfd,"onion_connection_status %s(void *_, onion_request *req, onion_response *res){\n", fname);
+  fprintf(outfd,"  static const struct{\n    const char *path;\n    onion_handler_handler handler;\n  } paths[]={\n");
+  for (i=0;i<npaths;i++){
+    fprintf(outfd, "    { \"%s\", %s },\n", paths[i].path, paths[i].fname);
+    free(paths[i].path);
+    free(paths[i].fname);
   }
-  closedir(dir);
-  
-  
-  
+  free(paths);
+  fprintf(outfd,"    { NULL, NULL }\n  };\n");
+  fprintf(outfd,"  const char *path=onion_request_get_path(req);\n");
+  fprintf(outfd,"  int lo=0, hi=%d;\n", npaths-1);
+  fprintf(outfd,"  while (lo<=hi){\n");
+  fprintf(outfd,"    int mid=(lo+hi)/2;\n");
+  fprintf(outfd,"    int c=strcmp(path, paths[mid].path);\n");
+  fprintf(outfd,"    if (c==0)\n      return paths[mid].handler(_, req, res);\n");
+  fprintf(outfd,"    if (c<0)\n      hi=mid-1;\n    else\n      lo=mid+1;\n");
+  fprintf(outfd,"  }\n");
   fprintf(outfd,"  return OCS_NOT_PROCESSED;\n");
   fprintf(outfd,"}\n\n");
   free(fname);
 }
 
+/// A file to write to the archive, its variants, and the strings they use.
+typedef struct{
+	char *path;
+	char *filename;
+	unsigned char *data[ONION_ARCHIVE_VARIANTS];
+	onion_archive_entry entry;
+}archive_file;
+
+/// The strings of the archive, and where they start at it.
+typedef struct{
+	char *data;
+	size_t length;
+	size_t base;
+}archive_strings;
+
+/// Adds the string, and returns its offset at the archive.
+static uint32_t archive_string(archive_strings *strings, const char *str){
+	size_t l=strlen(str)+1;
+	strings->data=realloc(strings->data, strings->length+l);
+	memcpy(strings->data+strings->length, str, l);
+	strings->length+=l;
+	return strings->base+strings->length-l;
+}
+
+/// Adds the prerendered headers of a variant, the same print_headers writes, and returns their offset.
+static uint32_t archive_headers(archive_strings *strings, onion_archive_variant *v, const char *etag, const char *mime_type, const char *encoding, int vary){
+	char headers[1024];
+	snprintf(headers, sizeof(headers), "Etag: %s%s%s\r\nContent-Type: %s\r\n%s%s%s%s%s%s%s", etag, encoding ? "-" : "", encoding ? encoding : "", mime_type,
+					 encoding ? "Content-Encoding: " : "", encoding ? encoding : "", encoding ? "\r\n" : "", 
+					 vary ? "Vary: Accept-Encoding\r\n" : "",
+					 cache_control ? "Cache-Control: " : "", cache_control ? cache_control : "", cache_control ? "\r\n" : "");
+	v->headers_length=strlen(headers);
+	return archive_string(strings, headers);
+}
+
+/// Adds the files under dirname, recursively, with paths from there, skipping as parse_directory.
+static void archive_collect(const char *dirname, const char *relpath, archive_file **files, int *nfiles){
+	DIR *dir=opendir(dirname);
+	if (!dir){
+		fprintf(stderr, "ERROR: Could not open directory %s, check permissions.", dirname);
+		exit(4);
+	}
+	struct dirent *de;
+	char fullname[1024], path[1024];
+	while ( (de=readdir(dir)) ){
+		if (de->d_name[0]=='.' || de->d_name[strlen(de->d_name)-1]=='~')
+			continue;
+		snprintf(fullname, sizeof(fullname), "%s/%s", dirname, de->d_name);
+		snprintf(path, sizeof(path), "%s%s", relpath, de->d_name);
+		if (de->d_type==DT_DIR){
+			strncat(path, "/", sizeof(path)-strlen(path)-1);
+			archive_collect(fullname, path, files, nfiles);
+		}
+		else{
+			*files=realloc(*files, sizeof(archive_file)*((*nfiles)+1));
+			memset(&(*files)[*nfiles], 0, sizeof(archive_file));
+			(*files)[*nfiles].path=strdup(path);
+			(*files)[*nfiles].filename=strdup(fullname);
+			(*nfiles)++;
+		}
+	}
+	closedir(dir);
+}
+
+/// Reads all the file, or exits.
+static unsigned char *archive_read(const char *filename, size_t *l){
+	FILE *fd=fopen(filename, "r");
+	if (!fd){
+		fprintf(stderr,"ERROR: Cant open file %s: ",filename);
+		perror("");
+		exit(3);
+	}
+	unsigned char *data=NULL;
+	char buffer[4096];
+	size_t r;
+	*l=0;
+	while ( (r=fread(buffer,1,sizeof(buffer),fd)) !=0 ){
+		data=realloc(data, *l+r);
+		memcpy(data+*l, buffer, r);
+		*l+=r;
+	}
+	fclose(fd);
+	return data;
+}
+
+/// Writes zeros up to the offset.
+static void archive_pad(FILE *outfd, size_t *pos, size_t offset){
+	static const char zeros[ONION_ARCHIVE_ALIGN];
+	while (*pos<offset){
+		size_t l=offset-*pos<sizeof(zeros) ? offset-*pos : sizeof(zeros);
+		fwrite(zeros, 1, l, outfd);
+		*pos+=l;
+	}
+}
+
+/**
+ * @short Writes the files, and the files under the directories, to an asset archive for onion_handler_archive.
+ * 
+ * Each file has the same variants and headers as the handlers of parse_file, at its path as in directory mode. 
+ * It is written to archive.tmp and renamed, so a server that maps the old one can reload it at any time.
+ */
+int write_archive(const char *archive, char **argv, int argc){
+	archive_file *files=NULL;
+	int nfiles=0, i, j;
+	for (i=0;i<argc;i++){
+		if (!argv[i])
+			continue;
+		struct stat st;
+		if (stat(argv[i], &st)==0 && S_ISDIR(st.st_mode))
+			archive_collect(argv[i], "", &files, &nfiles);
+		else{
+			files=realloc(files, sizeof(archive_file)*(nfiles+1));
+			memset(&files[nfiles], 0, sizeof(archive_file));
+			files[nfiles].path=strdup(basename(argv[i]));
+			files[nfiles].filename=strdup(argv[i]);
+			nfiles++;
+		}
+	}
+	
+	onion_archive_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, ONION_ARCHIVE_MAGIC, sizeof(header.magic));
+	header.nentries=nfiles;
+	header.nbuckets=2;
+	while (header.nbuckets<nfiles*2)
+		header.nbuckets*=2;
+	header.entries=(sizeof(header)+7)&~7;
+	header.buckets=header.entries+nfiles*sizeof(onion_archive_entry);
+	uint32_t *buckets=calloc(header.nbuckets, sizeof(uint32_t));
+	archive_strings strings={ NULL, 0, header.buckets+header.nbuckets*sizeof(uint32_t) };
+	
+	for (i=0;i<nfiles;i++){
+		archive_file *f=&files[i];
+		onion_archive_entry *e=&f->entry;
+		fprintf(stderr, "Archiving: %s as '%s'.\n", f->filename, f->path);
+		size_t l, gzip_l=0, brotli_l=0;
+		unsigned char *data=archive_read(f->filename, &l);
+		unsigned char *gzip=gzip_data(data, l, &gzip_l);
+		unsigned char *brotli=brotli_data(data, l, &brotli_l);
+		char etag[41];
+		content_hash(data, l, etag);
+		const char *mime_type=onion_mime_get(f->filename);
+		int vary=(brotli || gzip);
+		
+		e->path=archive_string(&strings, f->path);
+		e->hash=onion_archive_hash(f->path);
+		e->content_type=archive_string(&strings, mime_type);
+		e->etag=archive_string(&strings, etag);
+		if (brotli){
+			onion_archive_variant *v=&e->variants[e->nvariants];
+			v->encoding=archive_string(&strings, "br");
+			v->headers=archive_headers(&strings, v, etag, mime_type, "br", vary);
+			v->length=brotli_l;
+			f->data[e->nvariants++]=brotli;
+		}
+		if (gzip){
+			onion_archive_variant *v=&e->variants[e->nvariants];
+			v->encoding=archive_string(&strings, "gzip");
+			v->headers=archive_headers(&strings, v, etag, mime_type, "gzip", vary);
+			v->length=gzip_l;
+			f->data[e->nvariants++]=gzip;
+		}
+		onion_archive_variant *v=&e->variants[e->nvariants];
+		v->headers=archive_headers(&strings, v, etag, mime_type, NULL, vary);
+		v->length=l;
+		f->data[e->nvariants++]=data;
+		
+		uint32_t b=e->hash&(header.nbuckets-1);
+		while (buckets[b])
+			b=(b+1)&(header.nbuckets-1);
+		buckets[b]=i+1;
+	}
+	
+	size_t offset=strings.base+strings.length; // The data, the big ones aligned, so they are sent from whole pages.
+	for (i=0;i<nfiles;i++){
+		for (j=0;j<files[i].entry.nvariants;j++){
+			onion_archive_variant *v=&files[i].entry.variants[j];
+			if (v->length>=ONION_ARCHIVE_ALIGN)
+				offset=(offset+ONION_ARCHIVE_ALIGN-1)&~((size_t)ONION_ARCHIVE_ALIGN-1);
+			v->offset=offset;
+			offset+=v->length;
+		}
+	}
+	header.size=offset;
+	
+	char tmpname[1024];
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", archive);
+	FILE *outfd=fopen(tmpname, "w");
+	if (!outfd){
+		perror("ERROR: Could not open the archive");
+		exit(2);
+	}
+	size_t pos=0;
+	fwrite(&header, 1, sizeof(header), outfd);
+	pos+=sizeof(header);
+	archive_pad(outfd, &pos, header.entries);
+	for (i=0;i<nfiles;i++)
+		fwrite(&files[i].entry, 1, sizeof(onion_archive_entry), outfd);
+	fwrite(buckets, sizeof(uint32_t), header.nbuckets, outfd);
+	fwrite(strings.data, 1, strings.length, outfd);
+	pos=strings.base+strings.length;
+	for (i=0;i<nfiles;i++){
+		for (j=0;j<files[i].entry.nvariants;j++){
+			onion_archive_variant *v=&files[i].entry.variants[j];
+			archive_pad(outfd, &pos, v->offset);
+			fwrite(files[i].data[j], 1, v->length, outfd);
+			pos+=v->length;
+			free(files[i].data[j]);
+		}
+		free(files[i].path);
+		free(files[i].filename);
+	}
+	int error=ferror(outfd);
+	if (fclose(outfd)!=0 || error || rename(tmpname, archive)!=0){
+		perror("ERROR: Could not write the archive");
+		unlink(tmpname);
+		exit(2);
+	}
+	fprintf(stderr, "Archive %s written: %d files, %lu bytes.\n", archive, nfiles, (unsigned long)header.size);
+	free(strings.data);
+	free(buckets);
+	free(files);
+	return 0;
+}
+
 /// Shows the help
 void print_help(const char *name){
 	fprintf(stderr,"%s -- Packs a given file or files into a C function that will print it out\n\n", name);
@@ -237,13 +660,17 @@ void print_help(const char *name){
 	fprintf(stderr,"Options:\n");
 	fprintf(stderr,"       --help            Shows this help\n");
 	fprintf(stderr,"       -o <filename.c>   Output filename\n");
-	fprintf(stderr,"       -a <filename.h>   Asset header file. By default assets.h\n\n");
+	fprintf(stderr,"       -a <filename.h>   Asset header file. By default assets.h\n");
+	fprintf(stderr,"       -c <value>        Cache-Control of the files. By default no-cache, so they are revalidated by ETag; \"\" for none.\n");
+	fprintf(stderr,"       -r <archive>      Writes an asset archive for onion_handler_archive instead of C code.\n\n");
 	fprintf(stderr,"It later creates a series of functions, with the name of the file or directory, and with the following signature.\n");
 	fprintf(stderr,"   int opack_[file_name_and_extension](void *_, onion_request *request, onion_response *response);\n\n");
 	fprintf(stderr,"An asset header file is created/updated with the opack needed handlers.");
 	fprintf(stderr,"With this signature handlers are very easily used from onion.\n\n");
   fprintf(stderr,"If its a directory, access is as expected using the path, but only last element: static/jquery.min.js, for example if you pack static with jquery.min.js at src/static/. It is recursive.\n");
   fprintf(stderr,"In directory mode, files ending with ~ and starting with . are ignored.\n");
+  fprintf(stderr,"The files are also kept compressed with brotli and gzip, if it is worth it, and sent so to the clients that accept it.\n");
+  fprintf(stderr,"An archive is a single file that the server maps at runtime, so the assets can change without compiling; the paths are as in directory mode.\n");
 	exit(1);
 }
 
@@ -23,6 +23,7 @@
 
 #include <onion/log.h>
 #include <onion/block.h>
+#include <onion/codecs.h>
 
 #include "list.h"
 #include "parser.h"
@@ -69,8 +70,16 @@ static void function_write(parser_status *st, function_data *d){
 "void %s(%s){\n", d->id, d->signature ? d->signature : "onion_dict *context, onion_response *res"
 					);
 		
-		const char *data=onion_block_data(d->code);
-		int ldata=onion_block_size(d->code);
+		onion_block *code=d->code;
+		if (onion_block_size(d->locals)){ // Cached dicts, once the context is set
+			code=onion_block_new();
+			onion_block_add_data(code, onion_block_data(d->code), d->locals_at);
+			onion_block_add_block(code, d->locals);
+			onion_block_add_data(code, onion_block_data(d->code)+d->locals_at, onion_block_size(d->code)-d->locals_at);
+		}
+		
+		const char *data=onion_block_data(code);
+		int ldata=onion_block_size(code);
 		if (use_orig_line_numbers){
 			fprintf(st->out, "#line 1\n");
 		
@@ -105,6 +114,8 @@ static void function_write(parser_status *st, function_data *d){
 					abort();
 			}
 		}
+		if (code!=d->code)
+			onion_block_free(code);
 
 		fprintf(st->out,"}\n");
 	}
@@ -115,17 +126,31 @@ void functions_write_code(parser_status *st){
 	list_loop(st->functions, function_write, st);
 }
 
-/// Writes the main function code.
+/// Writes the static table with all the text of the template.
+void functions_write_static_data(parser_status *st){
+	if (!onion_block_size(st->static_data))
+		return;
+	char *safe=onion_c_quote_new(onion_block_data(st->static_data));
+	fprintf(st->out, "static const char %s[]=\n%s;\n\n", st->static_name, safe);
+	free(safe);
+}
+
+/// Writes the main function code. If all the template is text, the handlers set its length, so it is not chunked.
 void functions_write_main_code(parser_status *st){
 	const char *f=((function_data*)list_get_n(st->function_stack,1))->id;
+	char set_length[128];
+	set_length[0]='\0';
+	if (!st->dynamic)
+		snprintf(set_length, sizeof(set_length), "  onion_response_set_length(res, %d);\n", (int)onion_block_size(st->static_data));
 
-		fprintf(st->out,"\n\n"
+	fprintf(st->out,"\n\n"
 "onion_connection_status %s_handler_page(onion_dict *context, onion_request *req, onion_response *res){\n"
 "\n"
+"%s"
 "  %s(context, res);\n"
 "\n"
 "  return OCS_PROCESSED;\n"
-"}\n\n", f, f);
+"}\n\n", f, set_length, f);
 
 	fprintf(st->out,
 "\n"
@@ -140,11 +165,20 @@ void functions_write_main_code(parser_status *st){
 "\n"
 "  if (context) onion_dict_add(context, \"LANG\", onion_request_get_language_code(req), OD_FREE_VALUE);\n"
 "\n"
+"%s"
 "  %s(context, res);\n"
 "\n"
 "  if (context) onion_dict_free(context);\n"
 "\n"
 "  return OCS_PROCESSED;\n"
+"}\n\n", f, set_length, f);
+
+	fprintf(st->out,
+"\n"
+"void %s_render(onion_dict *context, onion_response_sink write, void *data){\n"
+"  onion_response *res=onion_response_new_sink(write, data);\n"
+"  %s(context, res);\n"
+"  onion_response_free(res);\n"
 "}\n\n", f, f);
 }
 
@@ -157,6 +191,14 @@ function_data *function_new(parser_status *st, const char *fmt, ...){
 	function_data *d=malloc(sizeof(function_data));
 	d->flags=0;
 	d->code=onion_block_new();
+	d->locals=onion_block_new();
+	d->locals_at=0;
+	d->cached=list_new(free);
+	d->loop_var=NULL;
+	d->loop_dict=NULL;
+	d->hoisted=list_new(free);
+	if (st && st->static_text)
+		write_static_text(st); // To the function it belongs
 	if (st){
 		st->current_code=d->code;
 		list_add(st->function_stack, d);
@@ -205,6 +247,11 @@ function_data *function_new(parser_status *st, const char *fmt, ...){
 void function_free(function_data *d){
 	if (d->code)
 		onion_block_free(d->code);
+	onion_block_free(d->locals);
+	list_free(d->cached);
+	list_free(d->hoisted);
+	free(d->loop_var);
+	free(d->loop_dict);
 	free(d->id);
 	free(d);
 }
@@ -214,6 +261,7 @@ void function_free(function_data *d){
  * @short Pops the function from the stack. Its still at the function list.
  */
 function_data *function_pop(parser_status *st){
+	write_static_text(st);
 	function_data *p=(function_data*)st->function_stack->tail->data;
 	list_pop(st->function_stack);
 	//ONION_DEBUG("pop function stack, length is %d", list_count(st->function_stack));
@@ -229,6 +277,10 @@ void function_add_code(parser_status *st, const char *fmt, ...){
 	function_data *p=(function_data*)st->function_stack->tail->data;
 	if (p->flags&F_NO_MORE_WRITE)
 		return;
+	if (!st->in_static_write){
+		write_static_text(st); // Before this code
+		st->dynamic=1;
+	}
 	
 	char tmp[4096];
 	
@@ -21,6 +21,7 @@
 
 #include <onion/types.h>
 #include "../common/updateassets.h"
+#include "list.h"
 
 enum function_data_flags_e{
 	F_NO_MORE_WRITE=1,
@@ -34,6 +35,13 @@ struct function_data_t{
 	int is_static:1;
 	const char *signature; /// The function signature. If NULL its the standard
 	int flags;
+	
+	onion_block *locals; /// Declarations of the dicts cached at this function, written at locals_at.
+	int locals_at; /// Position at code where the locals are written, after the code that sets the context.
+	list *cached; /// Paths of the cached dicts, the position is the name of the local.
+	char *loop_var; /// If its the body of a for, the name of the loop variable.
+	char *loop_dict; /// And the dict it loops over.
+	list *hoisted; /// Paths not depending on the loop variable, solved once by the caller before the loop.
 };
 
 typedef struct function_data_t function_data;
@@ -44,6 +52,7 @@ void functions_write_declarations_assets(struct parser_status_t *st, onion_asset
 void functions_write_declarations(struct parser_status_t *st);
 void functions_write_code(struct parser_status_t *st);
 void functions_write_main_code(struct parser_status_t *st);
+void functions_write_static_data(struct parser_status_t *st);
 
 
 function_data *function_new(struct parser_status_t *st, const char *fmt, ...);
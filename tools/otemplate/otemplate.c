@@ -172,6 +172,8 @@ int work(const char *infilename, const char *outfilename, onion_assets_file *ass
 	status.status=0;
 	status.line=1;
 	status.rawblock=onion_block_new();
+	status.static_text=onion_block_new();
+	status.static_data=onion_block_new();
 	status.infilename=infilename;
 	char tmp2[256];
 	strncpy(tmp2, infilename, sizeof(tmp2)-1);
@@ -191,7 +193,10 @@ int work(const char *infilename, const char *outfilename, onion_assets_file *ass
 	}
 
 	ONION_DEBUG("Create main function on top, tname %s",tname);
-	function_new(&status, tname);
+	function_data *main_function=function_new(&status, tname);
+	char static_name[600];
+	snprintf(static_name, sizeof(static_name), "%s_static_data", main_function->id);
+	status.static_name=static_name;
 	
 	function_add_code(&status, 
 "  int has_context=(context!=NULL);\n"
@@ -199,15 +204,20 @@ int work(const char *infilename, const char *outfilename, onion_assets_file *ass
 "    context=onion_dict_new();\n"
 "  \n"
 "  %s(context);\n",  status.blocks_init->id);
+	status.dynamic=0; // The code until now is always there
+	main_function->locals_at=onion_block_size(main_function->code); // Cached dicts, once there is a context
 	
 	parse_template(&status);
 	
+	write_static_text(&status);
 	((function_data*)status.function_stack->tail->data)->flags=0;
+	int dynamic=status.dynamic;
 	
 	function_add_code(&status,
 "  if (!has_context)\n"
 "    onion_dict_free(context);\n"
 	);
+	status.dynamic=dynamic;
 	
 	if (status.status){
 		ONION_ERROR("Parsing error");
@@ -230,11 +240,7 @@ int work(const char *infilename, const char *outfilename, onion_assets_file *ass
 "#include <string.h>\n\n"
 "#include <onion/onion.h>\n"
 "#include <onion/dict.h>\n"
-"\n"
-"typedef struct dict_res_t{\n"
-"	onion_dict *dict;\n"
-"	onion_response *res;\n"
-"}dict_res;\n"
+"#include <onion/fragment_cache.h>\n"
 "\n"
 "\n");
 
@@ -242,6 +248,8 @@ int work(const char *infilename, const char *outfilename, onion_assets_file *ass
 	
 	functions_write_declarations(&status);
 
+	functions_write_static_data(&status);
+
 	functions_write_main_code(&status);
 
 	if (use_orig_line_numbers)
@@ -258,6 +266,8 @@ work_end:
 	list_free(status.function_stack);
 	//list_free(status.blocks);
 	onion_block_free(status.rawblock);
+	onion_block_free(status.static_text);
+	onion_block_free(status.static_data);
 	
 	tag_free();
 	return status.status;
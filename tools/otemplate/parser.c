@@ -108,38 +108,9 @@ void write_block(parser_status *st, onion_block *b){
 	switch(mode){
 		case TEXT:
 		{
-			int oldl;
-			if ( (oldl=onion_block_size(b)) ){
-				if (oldl>0){ // Not Just \0
-					int use_orig_line_numbers_bak=use_orig_line_numbers;
-					use_orig_line_numbers=0;
-					char *safe=onion_c_quote_new(onion_block_data(b));
-					function_add_code(st, "  onion_response_write(res, ");
-					int pos=0;
-					int size=strlen(safe);
-					char *s=safe;
-					//ONION_DEBUG("------- pos %d, size %d",pos,size);
-					while (pos<size){
-						//ONION_DEBUG("pos %d, size %d",pos,size);
-						char *e=strstr(s, "\n");
-						if (!e)
-							break;
-						*e='\0';
-						if (pos==0)
-							function_add_code(st, "%s\n", s);
-						else
-							function_add_code(st, "      %s\n", s);
-						pos+=(e-s)+1;
-						s=e+1;
-					}
-					if (pos==0)
-						function_add_code(st, "%s, %d);\n", s, oldl);
-					else
-						function_add_code(st, "      %s, %d);\n", s, oldl);
-					use_orig_line_numbers=use_orig_line_numbers_bak;
-					free(safe);
-				}
-			}
+			function_data *f=(function_data*)st->function_stack->tail->data;
+			if (onion_block_size(b) && !(f->flags&F_NO_MORE_WRITE)) // Written with the next code, merged with the following text
+				onion_block_add_data(st->static_text, onion_block_data(b), onion_block_size(b));
 		}
 			break;
 		case VARIABLE:
@@ -154,6 +125,28 @@ void write_block(parser_status *st, onion_block *b){
 	onion_block_clear(st->rawblock);
 }
 
+/**
+ * @short Writes the pending text, if any, as one onion_response_write from the static table of the template.
+ * 
+ * It is called before any other code is added, and when the current function changes, so the text between
+ * tags that add no code is written at once.
+ */
+void write_static_text(parser_status *st){
+	int l=onion_block_size(st->static_text);
+	if (!l)
+		return;
+	int offset=onion_block_size(st->static_data);
+	onion_block_add_data(st->static_data, onion_block_data(st->static_text), l);
+	onion_block_clear(st->static_text);
+	
+	int use_orig_line_numbers_bak=use_orig_line_numbers;
+	use_orig_line_numbers=0;
+	st->in_static_write=1;
+	function_add_code(st, "  onion_response_write(res, %s+%d, %d);\n", st->static_name, offset, l);
+	st->in_static_write=0;
+	use_orig_line_numbers=use_orig_line_numbers_bak;
+}
+
 /// Read a char from the st->in-
 void add_char(parser_status *st, char c){
 	onion_block_add_char(st->rawblock, c);
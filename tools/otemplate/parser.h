@@ -58,6 +58,12 @@ struct parser_status_t{
 	int status; /// Exit status.
 	int function_count;
 	int line;
+	
+	onion_block *static_text; /// Text to write, not yet written, so the next text is merged with it.
+	onion_block *static_data; /// All the text of the template, as one static table.
+	char *static_name; /// Name of that table at the generated code.
+	int in_static_write; /// Set while writing the text, so it does not count as code.
+	int dynamic; /// If there is code besides the text, so the length is not known.
 };
 typedef struct parser_status_t parser_status;
 
@@ -65,6 +71,7 @@ void parse_template(parser_status *status);
 
 void add_char(parser_status *st, char c);
 void write_block(parser_status *st, onion_block *b);
+void write_static_text(parser_status *st);
 
 
 #endif
@@ -44,6 +44,8 @@ void tag_include(parser_status *st, list *l);
 void tag_extends(parser_status *st, list *l);
 void tag_block(parser_status *st, list *l);
 void tag_endblock(parser_status *st, list *l);
+void tag_cache(parser_status *st, list *l);
+void tag_endcache(parser_status *st, list *l);
 
 /**
  * @short Initializes all builtins
@@ -59,6 +61,8 @@ void tag_init_builtins(){
 	tag_add("extends", tag_extends);
 	tag_add("block", tag_block);
 	tag_add("endblock", tag_endblock);
+	tag_add("cache", tag_cache);
+	tag_add("endcache", tag_endcache);
 }
 
 
@@ -79,37 +83,55 @@ void tag_load(parser_status *st, list *l){
 	}
 }
 
-/// Do the first for part.
+/**
+ * @short Do the first for part. The body is a function called at each element, the loop itself is written at endfor.
+ * 
+ * So the caller knows which variables of the body do not depend on the loop variable, and can solve them once.
+ */
 void tag_for(parser_status *st, list *l){
-	function_add_code(st, 
-"  {\n"
-"    onion_dict *loopdict=onion_dict_get_dict(context, \"%s\");\n", tag_value_arg (l,3));
-	function_add_code(st, 
-"    onion_dict *tmpcontext=onion_dict_hard_dup(context);\n"
-"    if (loopdict){\n"
-"      dict_res dr={ .dict = tmpcontext, .res=res };\n"
-"      onion_dict_preorder(loopdict, ");
 	function_data *d=function_new(st, NULL);
-	d->signature="dict_res *dr, const char *key, const void *value, int flags";
-
-	function_add_code(st, 
-"  onion_dict_add(dr->dict, \"%s\", value, OD_DUP_VALUE|OD_REPLACE|(flags&OD_TYPE_MASK));\n", tag_value_arg(l,1));
-	
-	function_new(st, NULL);
+	d->loop_var=strdup(tag_value_arg(l,1));
+	d->loop_dict=strdup(tag_value_arg(l,3));
 }
 
-/// Ends a for
+/**
+ * @short Ends a for. The loop is an onion_dict_iter over the dict, adding each element to a copy of the context.
+ * 
+ * The copy is shallow: the values are the ones at the context, so no element is duplicated.
+ */
 void tag_endfor(parser_status *st, list *l){
-	// First the preorder function
 	function_data *d=function_pop(st);
-	function_add_code(st, "  %s(dr->dict, dr->res);\n", d->id);
+	function_data *f=(function_data*)st->function_stack->tail->data;
 	
-	// Now the normal code
-	d=function_pop(st);
-	function_add_code(st, "%s, &dr);\n"
-"    }\n"
+	function_add_code(st, 
+"  {\n"
+"    onion_dict *loopdict=onion_dict_get_dict(context, \"%s\");\n", d->loop_dict);
+	int n=list_count(d->hoisted);
+	if (n){
+		d->signature="onion_dict *context, onion_response *res, const char **hoisted";
+		function_add_code(st, 
+"    const char *invariants[%d]={\n", n);
+		list_item *it=d->hoisted->head;
+		while (it){
+			char *e=variable_expression(f, it->data);
+			function_add_code(st, "      %s,\n", e);
+			free(e);
+			it=it->next;
+		}
+		function_add_code(st, "    };\n");
+	}
+	function_add_code(st, 
+"    onion_dict *tmpcontext=onion_dict_new();\n"
+"    onion_dict_iter it;\n"
+"    if (onion_dict_iter_begin(context, &it)) do{\n"
+"      onion_dict_add(tmpcontext, it.key, it.value, it.flags&OD_TYPE_MASK);\n"
+"    }while(onion_dict_iter_next(&it));\n"
+"    if (loopdict && onion_dict_iter_begin(loopdict, &it)) do{\n"
+"      onion_dict_add(tmpcontext, \"%s\", it.value, OD_REPLACE|(it.flags&OD_TYPE_MASK));\n"
+"      %s(tmpcontext, res%s);\n"
+"    }while(onion_dict_iter_next(&it));\n"
 "    onion_dict_free(tmpcontext);\n"
-"  }\n", d->id);
+"  }\n", d->loop_var, d->id, n ? ", invariants" : "");
 }
 
 /// Starts an if
@@ -174,6 +196,44 @@ void tag_endif(parser_status *st, list *l){
 	function_add_code(st, "      %s(context, res);\n  }\n", d->id);
 }
 
+/**
+ * @short Starts a cached fragment: {% cache "key" seconds %}
+ * 
+ * The body is a function, rendered only if the fragment cache has not that key of this template. Then what
+ * it writes is kept for the next renders, for those seconds.
+ */
+void tag_cache(parser_status *st, list *l){
+	const char *ttl=tag_value_arg(l, 2);
+	if (list_count(l)!=3 || strspn(ttl, "0123456789")!=strlen(ttl)){
+		ONION_ERROR("%s:%d Cache needs the key and the seconds, as a number.", st->infilename, st->line);
+		st->status=1;
+		function_new(st, NULL); // So endcache finds it
+		return;
+	}
+	const char *name=((function_data*)list_get_n(st->function_stack,1))->id;
+	function_add_code(st, 
+"  {\n"
+"    const char *key;\n");
+	variable_solve(st, tag_value_arg(l, 1), "key", tag_type_arg(l,1));
+	function_add_code(st, 
+"    if (!onion_fragment_cache_write(\"%s\", key, res)){\n"
+"      size_t fragment=onion_response_fragment_begin(res);\n"
+"      int ttl=%s;\n", name, ttl);
+	
+	function_new(st, NULL);
+}
+
+/// Ends a cached fragment, keeping it.
+void tag_endcache(parser_status *st, list *l){
+	function_data *d=function_pop(st);
+	const char *name=((function_data*)list_get_n(st->function_stack,1))->id;
+	function_add_code(st, 
+"      %s(context, res);\n"
+"      onion_fragment_cache_store(\"%s\", key, ttl, onion_response_fragment_end(res, fragment));\n"
+"    }\n"
+"  }\n", d->id, name);
+}
+
 /// Include an external html. This is only the call, the programmer must compile such html too.
 void tag_include(parser_status* st, list* l){
 	function_data *d=function_new(st, "%s", tag_value_arg(l, 1));
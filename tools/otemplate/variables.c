@@ -40,6 +40,86 @@ void variable_write(parser_status *st, onion_block *b){
 "  }\n");
 }
 
+/// Returns the position of that path at the list, adding it if not there.
+static int variable_list_index(list *l, const char *path){
+	int n=0;
+	list_item *it=l->head;
+	while (it){
+		if (strcmp(it->data, path)==0)
+			return n;
+		n++;
+		it=it->next;
+	}
+	list_add(l, strdup(path));
+	return n;
+}
+
+/**
+ * @short Returns the name of the local with the dict at that path, at the function f.
+ * 
+ * The dict is looked up once per call of f, at its start, and shared by all the variables under it.
+ */
+static char *variable_dict(function_data *f, const char *path){
+	int n=list_count(f->cached);
+	int i=variable_list_index(f->cached, path);
+	if (i==n){ // New, write how its solved
+		char tmp[512];
+		char *s;
+		const char *last=strrchr(path, '.');
+		if (!last){
+			s=onion_c_quote_new(path);
+			snprintf(tmp, sizeof(tmp), "  const onion_dict *odict_%d=onion_dict_get_dict(context, %s);\n", i, s);
+		}
+		else{
+			char *parent=strdup(path);
+			parent[last-path]='\0';
+			char *pname=variable_dict(f, parent);
+			s=onion_c_quote_new(last+1);
+			snprintf(tmp, sizeof(tmp), "  const onion_dict *odict_%d=%s ? onion_dict_get_dict(%s, %s) : NULL;\n", i, pname, pname, s);
+			free(pname);
+			free(parent);
+		}
+		onion_block_add_str(f->locals, tmp);
+		free(s);
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "odict_%d", i);
+	return strdup(name);
+}
+
+/**
+ * @short Returns the C expression that gets the value at that path, at the function f.
+ * 
+ * At a for body, the paths that do not start with the loop variable are the same at all the iterations,
+ * so they are solved by the caller, once, and passed at the hoisted array.
+ */
+char *variable_expression(function_data *f, const char *path){
+	char tmp[512];
+	const char *last=strrchr(path, '.');
+	if (f->loop_var){
+		int l=strlen(f->loop_var);
+		if (!(strncmp(path, f->loop_var, l)==0 && (path[l]=='\0' || path[l]=='.'))){
+			snprintf(tmp, sizeof(tmp), "hoisted[%d]", variable_list_index(f->hoisted, path));
+			return strdup(tmp);
+		}
+	}
+	if (!last){
+		char *s=onion_c_quote_new(path);
+		snprintf(tmp, sizeof(tmp), "onion_dict_get(context, %s)", s);
+		free(s);
+		return strdup(tmp);
+	}
+	char *parent=strdup(path);
+	parent[last-path]='\0';
+	char *pname=variable_dict(f, parent);
+	char *s=onion_c_quote_new(last+1);
+	snprintf(tmp, sizeof(tmp), "(%s ? onion_dict_get(%s, %s) : NULL)", pname, pname, s);
+	free(s);
+	free(pname);
+	free(parent);
+	return strdup(tmp);
+}
+
 /**
  * @short Solves a variable into code.
  * 
@@ -53,42 +133,19 @@ void variable_solve(parser_status *st, const char *data, const char *tmpname, in
 		free(s);
 		return;
 	}
+	function_data *f=(function_data*)st->function_stack->tail->data;
+	if (f->flags&F_NO_MORE_WRITE)
+		return;
 	
-	list *parts=list_new(onion_block_free);
-	onion_block *lastblock;
-	list_add(parts, lastblock=onion_block_new());
-	
-	
-	int i=0;
-	int l=strlen(data);
-	const char *d=data;
-	for (i=0;i<l;i++){
-		if (d[i]=='.')
-			list_add(parts, lastblock=onion_block_new());
-		else if (d[i]==' ')
-			continue;
-		else
-			onion_block_add_char(lastblock, d[i]);
+	onion_block *path=onion_block_new();
+	const char *d;
+	for (d=data;*d;d++){
+		if (*d!=' ')
+			onion_block_add_char(path, *d);
 	}
-
-	if (list_count(parts)==1){
-		char *s=onion_c_quote_new(onion_block_data(lastblock));
-		function_add_code(st, 
-"    %s=onion_dict_get(context, %s);\n", tmpname, s);
-		free(s);
-	}
-	else{
-		function_add_code(st,"    %s=onion_dict_rget(context", tmpname);
-		list_item *it=parts->head;
-		while (it){
-			lastblock=it->data;
-			char *s=onion_c_quote_new(onion_block_data(lastblock));
-			function_add_code(st,", %s", s);
-			free(s);
-			it=it->next;
-		}
-		function_add_code(st,", NULL);\n");
-	}
-	list_free(parts);
+	
+	char *e=variable_expression(f, onion_block_data(path));
+	function_add_code(st, "    %s=%s;\n", tmpname, e);
+	free(e);
+	onion_block_free(path);
 }
-
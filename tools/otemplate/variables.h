@@ -23,6 +23,7 @@
 #include <onion/types.h>
 
 void variable_write(struct parser_status_t *st, onion_block *b);
+char *variable_expression(struct function_data_t *f, const char *path);
 void variable_solve(struct parser_status_t *st, const char *b, const char *tmpname, int type);
 
 #endif